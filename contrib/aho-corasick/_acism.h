@@ -57,6 +57,7 @@ struct acism {
     STRASH* hashv;
     unsigned flags;
 #   define IS_MMAP 1
+#   define IS_SSSE3 2
 
 #if ACISM_SIZE < 8
     TRAN sym_mask;
@@ -67,9 +68,18 @@ struct acism {
     unsigned tran_size; // #(tranv)
     unsigned nsyms, nchars, nstrs, maxlen;
     SYMBOL symv[256];
+    // Bitmaps of bytes that have a transition from the root state:
+    //  [0] is for exact and [1] is for caseless lookups.
+    uint8_t rootv[2][32];
+    // Nibble masks of rootv for vectorized skipping of the text:
+    //  a byte (b) may start a pattern iff
+    //  root_lo[][b & 15] & root_hi[b >> 4] is not zero.
+    uint8_t root_lo[2][16];
+    uint8_t root_hi[16];
 };
 
 #include "acism.h"
+#include "platform_config.h"
 
 // p_size: size of tranv + hashv
 static inline unsigned p_size(ac_trie_t const *psp)
@@ -102,4 +112,7 @@ static inline int t_strno(ac_trie_t const *psp, TRAN t)
 static inline _SYMBOL t_valid(ac_trie_t const *psp, TRAN t)
     { return !t_sym(psp, t); }
 
+static inline int p_isroot(ac_trie_t const *psp, int caseless, uint8_t b)
+    { return psp->rootv[caseless][b >> 3] & (1 << (b & 7)); }
+
 #endif//_ACISM_H
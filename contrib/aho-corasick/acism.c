@@ -22,6 +22,54 @@
 #define BACK ((SYMBOL)0)
 #define ROOT ((STATE) 0)
 
+// Return the first byte in [cp, endp) that starts some pattern,
+//  all bytes before it leave the automaton in the root state.
+static const char *
+skip_root(ac_trie_t const *psp, const char *cp, const char *endp,
+        int caseless)
+{
+    while (cp < endp && !p_isroot(psp, caseless, (uint8_t)*cp))
+        ++cp;
+
+    return cp;
+}
+
+#if defined(HAVE_SSSE3) && defined(HAVE_TARGET_ATTRIBUTE)
+#include <tmmintrin.h>
+
+__attribute__((target("ssse3"))) static const char *
+skip_root_ssse3(ac_trie_t const *psp, const char *cp, const char *endp,
+        int caseless)
+{
+    const __m128i lo = _mm_loadu_si128((const __m128i *)psp->root_lo[caseless]);
+    const __m128i hi = _mm_loadu_si128((const __m128i *)psp->root_hi);
+    const __m128i nib = _mm_set1_epi8(0x0f), zero = _mm_setzero_si128();
+
+    while (endp - cp >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)cp);
+        __m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(v, nib));
+        __m128i h = _mm_shuffle_epi8(hi,
+                _mm_and_si128(_mm_srli_epi16(v, 4), nib));
+        unsigned mask = ~_mm_movemask_epi8(
+                _mm_cmpeq_epi8(_mm_and_si128(l, h), zero)) & 0xffff;
+
+        // Candidates are checked against the exact bitmap
+        while (mask) {
+            unsigned i = __builtin_ctz(mask);
+
+            if (p_isroot(psp, caseless, (uint8_t)cp[i]))
+                return cp + i;
+
+            mask &= mask - 1;
+        }
+
+        cp += 16;
+    }
+
+    return skip_root(psp, cp, endp, caseless);
+}
+#endif
+
 int
 acism_lookup(ac_trie_t const *psp, const char *text, size_t len,
            ACISM_ACTION *cb, void *context, int *statep, bool caseless)
@@ -33,6 +81,18 @@ acism_lookup(ac_trie_t const *psp, const char *text, size_t len,
     int ret = 0;
 
     while (cp < endp) {
+        if (state == ROOT) {
+#if defined(HAVE_SSSE3) && defined(HAVE_TARGET_ATTRIBUTE)
+            if (ps.flags & IS_SSSE3)
+                cp = skip_root_ssse3(psp, cp, endp, caseless);
+            else
+#endif
+                cp = skip_root(psp, cp, endp, caseless);
+
+            if (cp == endp)
+                break;
+        }
+
     	s = caseless ? g_ascii_tolower (*cp++) : *cp++;
         _SYMBOL sym = ps.symv[s];
         if (!sym) {
@@ -38,6 +38,7 @@ static inline int bitwid(unsigned u)
     return ret;
 }
 static void   fill_symv(ac_trie_t*, ac_trie_pat_t const*, int ns);
+static void   fill_rootv(ac_trie_t*);
 static int    create_tree(TNODE*, SYMBOL const*symv, ac_trie_pat_t const*strv, int nstrs);
 static void   add_backlinks(TNODE*, TNODE**, TNODE**);
 static void   prune_backlinks(TNODE*);
@@ -119,6 +120,8 @@ acism_create(ac_trie_pat_t const* strv, int nstrs)
         set_tranv(psp, realloc(psp->tranv, p_size(psp)));
     }
 
+    fill_rootv(psp);
+
         // Diagnostics/statistics only:
     psp->nstrs = nstrs;
     for (i = psp->maxlen = 0; i < nstrs; ++i)
@@ -130,6 +133,43 @@ DONE: free(troot), free(v1), free(v2);
     return psp;
 }
 
+// Collect bytes starting some pattern, lookup skips all other bytes
+//  while it is in the root state.
+static void
+fill_rootv(ac_trie_t *psp)
+{
+    int b, h;
+
+    for (b = 0; b < 256; ++b) {
+        _SYMBOL sym = psp->symv[b];
+
+        if (sym && t_valid(psp, p_tran(psp, 0, sym)))
+            psp->rootv[0][b >> 3] |= 1 << (b & 7);
+    }
+
+    for (b = 0; b < 256; ++b) {
+        if (p_isroot(psp, 0, g_ascii_tolower(b)))
+            psp->rootv[1][b >> 3] |= 1 << (b & 7);
+    }
+
+    // High nibbles share 8 buckets, so the masks may give false
+    //  positives for (b) and (b ^ 0x80), but never false negatives.
+    for (h = 0; h < 16; ++h)
+        psp->root_hi[h] = 1 << (h & 7);
+
+    for (b = 0; b < 256; ++b) {
+        if (p_isroot(psp, 0, b))
+            psp->root_lo[0][b & 15] |= psp->root_hi[b >> 4];
+        if (p_isroot(psp, 1, b))
+            psp->root_lo[1][b & 15] |= psp->root_hi[b >> 4];
+    }
+
+#if defined(HAVE_SSSE3) && defined(HAVE_TARGET_ATTRIBUTE)
+    if (__builtin_cpu_supports("ssse3"))
+        psp->flags |= IS_SSSE3;
+#endif
+}
+
 typedef struct { int freq, rank; } FRANK;
 static int frcmp(FRANK*a, FRANK*b) { return a->freq - b->freq; }
 
@@ -60,6 +60,9 @@ struct rdns_server {
 
 	struct rdns_io_channel **io_channels;
 	upstream_entry_t up;
+
+	double latency; /**< moving average of replies latency                       */
+	unsigned int latency_samples;
 };
 
 struct rdns_request {
@@ -91,6 +94,10 @@ struct rdns_request {
 	void *arg;
 
 	void *async_event;
+	double sent; /**< time of the first sending                                 */
+	bool outstanding; /**< request is counted as being in flight               */
+	bool queued; /**< request waits in the pending queue                          */
+	struct rdns_request *prev, *next;
 
 #ifdef TWEETNACL
 	void *curve_plugin_data;
@@ -130,6 +137,12 @@ struct rdns_resolver {
 	uint64_t max_ioc_uses;
 	void *refresh_ioc_periodic;
 
+	unsigned int max_outstanding; /**< 0 means no limit                          */
+	unsigned int outstanding;
+	struct rdns_request *pending; /**< requests waiting to be sent               */
+	bool processing_pending;
+	double slow_factor;
+
 	bool async_binded;
 	bool initialized;
 	ref_entry_t ref;
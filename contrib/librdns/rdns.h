@@ -269,6 +269,24 @@ void rdns_resolver_set_log_level (struct rdns_resolver *resolver,
 void rdns_resolver_set_max_io_uses (struct rdns_resolver *resolver,
 		uint64_t max_ioc_uses, double check_time);
 
+/**
+ * Set maximum number of requests being resolved at the same time, requests
+ * made over this limit are queued and sent when other requests are finished
+ * @param resolver resolver object
+ * @param max_outstanding limit of requests in flight, 0 means no limit
+ */
+void rdns_resolver_set_max_outstanding (struct rdns_resolver *resolver,
+		unsigned int max_outstanding);
+
+/**
+ * Set ratio of an average latency of a server to the best average latency
+ * of other alive servers to treat this server as failed
+ * @param resolver resolver object
+ * @param slow_factor ratio of latencies, 0 disables latency checks
+ */
+void rdns_resolver_set_slow_factor (struct rdns_resolver *resolver,
+		double slow_factor);
+
 /**
  * Register new plugin for rdns resolver
  * @param resolver
@@ -334,6 +352,19 @@ struct rdns_request* rdns_request_retain (struct rdns_request *req);
  */
 void rdns_request_release (struct rdns_request *req);
 
+/**
+ * Make a reply that is not received from a server, e.g. a recorded one. The
+ * reply is owned by its request that should be released by a caller, entries
+ * should be allocated by malloc and appended to the `entries` list
+ * @param resolver resolver object
+ * @param name requested name
+ * @param type requested type
+ * @param rcode code of the reply
+ * @return reply or NULL
+ */
+struct rdns_reply* rdns_make_fake_reply (struct rdns_resolver *resolver,
+		const char *name, enum rdns_request_type type, enum dns_rcode rcode);
+
 /**
  * Check whether a request contains `type` request
  * @param req request object
@@ -31,6 +31,8 @@
 #include <string.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <time.h>
+#include <sys/time.h>
 
 #include "rdns.h"
 #include "dns_private.h"
@@ -124,6 +126,162 @@ rdns_make_reply (struct rdns_request *req, enum dns_rcode rcode)
 	return rep;
 }
 
+#define RDNS_LATENCY_ALPHA 0.2
+#define RDNS_LATENCY_MIN_SAMPLES 8
+#define RDNS_LATENCY_MIN_SLOW 0.01
+
+static double
+rdns_get_ticks (void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1000000000.;
+#else
+	struct timeval tv;
+
+	gettimeofday (&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.;
+#endif
+}
+
+/*
+ * Updates average latency of a server, a server that is much slower than the
+ * best alive one is marked as dead as if it has failed
+ */
+static void
+rdns_server_latency (struct rdns_resolver *resolver, struct rdns_server *serv,
+		double latency)
+{
+	struct rdns_server *cur;
+	double best = -1;
+
+	if (serv->latency_samples == 0) {
+		serv->latency = latency;
+	}
+	else {
+		serv->latency += RDNS_LATENCY_ALPHA * (latency - serv->latency);
+	}
+
+	serv->latency_samples ++;
+
+	if (resolver->slow_factor <= 0 || serv->up.dead ||
+			serv->up.common->alive < 2 ||
+			serv->latency_samples < RDNS_LATENCY_MIN_SAMPLES ||
+			serv->latency < RDNS_LATENCY_MIN_SLOW) {
+		return;
+	}
+
+	UPSTREAM_FOREACH (resolver->servers, cur) {
+		if (cur != serv && !cur->up.dead &&
+				cur->latency_samples >= RDNS_LATENCY_MIN_SAMPLES &&
+				(best < 0 || cur->latency < best)) {
+			best = cur->latency;
+		}
+	}
+
+	if (best >= 0 && serv->latency > best * resolver->slow_factor) {
+		rdns_info ("server %s is too slow: %.3f seconds average latency, "
+				"%.3f is the best one", serv->name, serv->latency, best);
+		serv->up.dead = 1;
+		serv->up.time = time (NULL);
+		serv->up.common->alive --;
+		/* Start from scratch when the server is revived */
+		serv->latency_samples = 0;
+	}
+}
+
+/*
+ * Selects server and io channel and sends a new request
+ */
+static bool
+rdns_request_send_new (struct rdns_request *req)
+{
+	struct rdns_resolver *resolver = req->resolver;
+	struct rdns_server *serv;
+
+	UPSTREAM_SELECT_ROUND_ROBIN (resolver->servers, serv);
+
+	if (serv == NULL) {
+		rdns_warn ("cannot find suitable server for request");
+		return false;
+	}
+
+	/* Select random IO channel */
+	req->io = serv->io_channels[ottery_rand_uint32 () % serv->io_cnt];
+	req->io->uses ++;
+
+	/* Now send request to server */
+	if (rdns_send_request (req, req->io->sock, true) == -1) {
+		req->io = NULL;
+		return false;
+	}
+
+	REF_RETAIN (req->io);
+	REF_RETAIN (req->resolver);
+	req->sent = rdns_get_ticks ();
+	req->outstanding = true;
+	resolver->outstanding ++;
+
+	return true;
+}
+
+static void
+rdns_process_pending (struct rdns_resolver *resolver)
+{
+	struct rdns_request *req;
+	struct rdns_reply *rep;
+
+	/* Failed requests call callbacks that can finish other requests */
+	if (resolver->processing_pending) {
+		return;
+	}
+
+	resolver->processing_pending = true;
+
+	while (resolver->pending != NULL && (resolver->max_outstanding == 0 ||
+			resolver->outstanding < resolver->max_outstanding)) {
+		req = resolver->pending;
+		DL_DELETE (resolver->pending, req);
+		req->queued = false;
+
+		if (!rdns_request_send_new (req)) {
+			rep = rdns_make_reply (req, RDNS_RC_NETERR);
+			req->state = RDNS_REQUEST_REPLIED;
+			req->func (rep, req->arg);
+			REF_RELEASE (req);
+		}
+
+		/* Reference of the queue */
+		REF_RELEASE (resolver);
+	}
+
+	resolver->processing_pending = false;
+}
+
+void
+rdns_request_finished (struct rdns_request *req)
+{
+	struct rdns_resolver *resolver = req->resolver;
+
+	if (req->queued) {
+		DL_DELETE (resolver->pending, req);
+		req->queued = false;
+		REF_RELEASE (resolver);
+	}
+	else if (req->outstanding) {
+		req->outstanding = false;
+		resolver->outstanding --;
+
+		if (resolver->pending != NULL) {
+			rdns_process_pending (resolver);
+		}
+	}
+}
+
 static struct rdns_request *
 rdns_find_dns_request (uint8_t *in, struct rdns_io_channel *ioc)
 {
@@ -271,8 +429,11 @@ rdns_process_read (int fd, void *arg)
 	if (req != NULL) {
 		if (rdns_parse_reply (in, r, req, &rep)) {
 			UPSTREAM_OK (req->io->srv);
+			rdns_server_latency (resolver, req->io->srv,
+					rdns_get_ticks () - req->sent);
 			req->state = RDNS_REQUEST_REPLIED;
 			rdns_request_unschedule (req);
+			rdns_request_finished (req);
 			req->func (rep, req->arg);
 			REF_RELEASE (req);
 		}
@@ -298,9 +459,13 @@ rdns_process_timer (void *arg)
 
 	if (req->retransmits == 0) {
 		UPSTREAM_FAIL (req->io->srv, time (NULL));
+		/* Timeout is the lower bound of the latency of a server */
+		rdns_server_latency (resolver, req->io->srv,
+				rdns_get_ticks () - req->sent);
 		rep = rdns_make_reply (req, RDNS_RC_TIMEOUT);
 		req->state = RDNS_REQUEST_REPLIED;
 		rdns_request_unschedule (req);
+		rdns_request_finished (req);
 		req->func (rep, req->arg);
 		REF_RELEASE (req);
 
@@ -319,8 +484,14 @@ rdns_process_timer (void *arg)
 			rdns_warn ("cannot find suitable server for request");
 			rep = rdns_make_reply (req, RDNS_RC_SERVFAIL);
 			req->state = RDNS_REQUEST_REPLIED;
+			/* IO channel has been released already */
+			req->io = NULL;
+			rdns_request_finished (req);
 			req->func (rep, req->arg);
 			REF_RELEASE (req);
+			REF_RELEASE (resolver);
+
+			return;
 		}
 
 		/* Select random IO channel */
@@ -344,6 +515,7 @@ rdns_process_timer (void *arg)
 		rep = rdns_make_reply (req, RDNS_RC_NETERR);
 		req->state = RDNS_REQUEST_REPLIED;
 		rdns_request_unschedule (req);
+		rdns_request_finished (req);
 		req->func (rep, req->arg);
 		REF_RELEASE (req);
 	}
@@ -429,6 +601,7 @@ rdns_process_retransmit (int fd, void *arg)
 		UPSTREAM_FAIL (req->io->srv, time (NULL));
 		rep = rdns_make_reply (req, RDNS_RC_NETERR);
 		req->state = RDNS_REQUEST_REPLIED;
+		rdns_request_finished (req);
 		req->func (rep, req->arg);
 		REF_RELEASE (req);
 	}
@@ -452,8 +625,7 @@ rdns_make_request_full (
 {
 	va_list args;
 	struct rdns_request *req;
-	struct rdns_server *serv;
-	int r, type;
+	int type;
 	unsigned int i, tlen = 0, clen = 0, cur;
 	size_t olen;
 	const char *cur_name, *last_name = NULL;
@@ -475,6 +647,11 @@ rdns_make_request_full (
 	req->qcount = queries;
 	req->io = NULL;
 	req->state = RDNS_REQUEST_NEW;
+	req->sent = 0;
+	req->outstanding = false;
+	req->queued = false;
+	req->prev = NULL;
+	req->next = NULL;
 	req->packet = NULL;
 	req->requested_names = calloc (queries, sizeof (struct rdns_request_name));
 	if (req->requested_names == NULL) {
@@ -554,29 +731,21 @@ rdns_make_request_full (
 	req->state = RDNS_REQUEST_NEW;
 	req->async = resolver->async;
 
-	UPSTREAM_SELECT_ROUND_ROBIN (resolver->servers, serv);
+	if (resolver->max_outstanding > 0 &&
+			resolver->outstanding >= resolver->max_outstanding) {
+		/* Request is sent when another one is finished */
+		req->queued = true;
+		REF_RETAIN (resolver);
+		DL_APPEND (resolver->pending, req);
 
-	if (serv == NULL) {
-		rdns_warn ("cannot find suitable server for request");
-		REF_RELEASE (req);
-		return NULL;
+		return req;
 	}
-	
-	/* Select random IO channel */
-	req->io = serv->io_channels[ottery_rand_uint32 () % serv->io_cnt];
-	req->io->uses ++;
-	
-	/* Now send request to server */
-	r = rdns_send_request (req, req->io->sock, true);
 
-	if (r == -1) {
+	if (!rdns_request_send_new (req)) {
 		REF_RELEASE (req);
 		return NULL;
 	}
 
-	REF_RETAIN (req->io);
-	REF_RETAIN (req->resolver);
-
 	return req;
 }
 
@@ -720,6 +889,21 @@ rdns_resolver_set_max_io_uses (struct rdns_resolver *resolver,
 	}
 }
 
+void
+rdns_resolver_set_max_outstanding (struct rdns_resolver *resolver,
+		unsigned int max_outstanding)
+{
+	resolver->max_outstanding = max_outstanding;
+	rdns_process_pending (resolver);
+}
+
+void
+rdns_resolver_set_slow_factor (struct rdns_resolver *resolver,
+		double slow_factor)
+{
+	resolver->slow_factor = slow_factor;
+}
+
 static void
 rdns_resolver_free (struct rdns_resolver *resolver)
 {
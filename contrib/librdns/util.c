@@ -300,6 +300,7 @@ rdns_request_free (struct rdns_request *req)
 	unsigned int i;
 
 	if (req != NULL) {
+		rdns_request_finished (req);
 		if (req->packet != NULL) {
 			free (req->packet);
 		}
@@ -373,6 +374,48 @@ rdns_request_release (struct rdns_request *req)
 	REF_RELEASE (req);
 }
 
+struct rdns_reply *
+rdns_make_fake_reply (struct rdns_resolver *resolver, const char *name,
+		enum rdns_request_type type, enum dns_rcode rcode)
+{
+	struct rdns_request *req;
+	struct rdns_reply *rep;
+
+	req = calloc (1, sizeof (struct rdns_request));
+	if (req == NULL) {
+		return NULL;
+	}
+
+	req->resolver = resolver;
+	req->type = type;
+	req->requested_names = calloc (1, sizeof (struct rdns_request_name));
+	rep = calloc (1, sizeof (struct rdns_reply));
+
+	if (req->requested_names == NULL || rep == NULL) {
+		free (req->requested_names);
+		free (rep);
+		free (req);
+		return NULL;
+	}
+
+	req->requested_names[0].name = strdup (name);
+	req->requested_names[0].type = type;
+	req->requested_names[0].len = strlen (name);
+	req->qcount = 1;
+	/* Request is never sent, so it has neither IO channel nor timer */
+	req->state = RDNS_REQUEST_REPLIED;
+	REF_INIT_RETAIN (req, rdns_request_free);
+
+	rep->request = req;
+	rep->resolver = resolver;
+	rep->entries = NULL;
+	rep->requested_name = req->requested_names[0].name;
+	rep->code = rcode;
+	req->reply = rep;
+
+	return rep;
+}
+
 static bool
 rdns_resolver_conf_process_line (struct rdns_resolver *resolver, char *line)
 {
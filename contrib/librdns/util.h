@@ -53,6 +53,13 @@ void rdns_ioc_free (struct rdns_io_channel *ioc);
  */
 void rdns_request_free (struct rdns_request *req);
 
+/**
+ * Remove request from the pending queue or stop counting it as outstanding and
+ * send pending requests instead
+ * @param req
+ */
+void rdns_request_finished (struct rdns_request *req);
+
 /**
  * Free reply
  * @param rep
@@ -832,6 +832,27 @@ UCL_EXTERN void ucl_parser_register_variable (struct ucl_parser *parser, const c
 UCL_EXTERN void ucl_parser_set_variables_handler (struct ucl_parser *parser,
 		ucl_variable_handler handler, void *ud);
 
+/**
+ * Handler called for each include of a file or URL
+ * @param path included path (glob pattern if glob is allowed) or URL
+ * @param len length of path
+ * @param allow_glob true if path can be a glob pattern
+ * @param is_url true if path is an URL
+ * @param ud opaque userdata
+ */
+typedef void (*ucl_include_trace_func_t) (const unsigned char *path,
+		size_t len, bool allow_glob, bool is_url, void *ud);
+
+/**
+ * Set handler that is called for each include, e.g. to track all sources of
+ * a configuration
+ * @param parser parser structure
+ * @param func desired handler
+ * @param ud opaque data for the handler
+ */
+UCL_EXTERN void ucl_parser_set_include_tracer (struct ucl_parser *parser,
+		ucl_include_trace_func_t func, void *ud);
+
 /**
  * Load new chunk to a parser
  * @param parser parser structure
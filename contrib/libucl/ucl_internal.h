@@ -202,6 +202,8 @@ struct ucl_parser {
 	struct ucl_variable *variables;
 	ucl_variable_handler var_handler;
 	void *var_data;
+	ucl_include_trace_func_t include_trace;
+	void *include_trace_data;
 	UT_string *err;
 };
 
@@ -2188,6 +2188,14 @@ ucl_parser_set_variables_handler (struct ucl_parser *parser,
 	parser->var_data = ud;
 }
 
+void
+ucl_parser_set_include_tracer (struct ucl_parser *parser,
+		ucl_include_trace_func_t func, void *ud)
+{
+	parser->include_trace = func;
+	parser->include_trace_data = ud;
+}
+
 bool
 ucl_parser_add_chunk_priority (struct ucl_parser *parser, const unsigned char *data,
 		size_t len, unsigned priority)
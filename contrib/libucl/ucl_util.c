@@ -1084,11 +1084,19 @@ ucl_include_common (const unsigned char *data, size_t len,
 	}
 
 	if (*data == '/' || *data == '.') {
+		if (parser->include_trace) {
+			parser->include_trace (data, len, allow_glob, false,
+					parser->include_trace_data);
+		}
 		/* Try to load a file */
 		return ucl_include_file (data, len, parser, need_sign, !try_load,
 				allow_glob, priority);
 	}
 	else if (allow_url) {
+		if (parser->include_trace) {
+			parser->include_trace (data, len, false, true,
+					parser->include_trace_data);
+		}
 		/* Globbing is not used for URL's */
 		return ucl_include_url (data, len, parser, need_sign, !try_load,
 				priority);
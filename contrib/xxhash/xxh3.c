@@ -0,0 +1,400 @@
+/*
+XXH3 - 64 bit variant of the fast hash for short inputs
+Based on the XXH3 algorithm by Yann Collet.
+BSD 2-Clause License (http://www.opensource.org/licenses/bsd-license.php)
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+
+    * Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above
+copyright notice, this list of conditions and the following disclaimer
+in the documentation and/or other materials provided with the
+distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+//**************************************
+// Includes
+//**************************************
+#include <string.h>
+#include <stdint.h>
+#include "xxh3.h"
+
+
+//**************************************
+// Basic Types
+//**************************************
+typedef uint8_t  BYTE;
+typedef uint32_t U32;
+typedef uint64_t U64;
+
+
+//**************************************
+// Constants
+//**************************************
+#define PRIME32_1   2654435761U
+#define PRIME32_2   2246822519U
+#define PRIME32_3   3266489917U
+
+#define PRIME64_1 11400714785074694791ULL
+#define PRIME64_2 14029467366897019727ULL
+#define PRIME64_3  1609587929392839161ULL
+#define PRIME64_4  9650029242287828579ULL
+#define PRIME64_5  2870177450012600261ULL
+
+#define PRIME_MX1 0x165667919E3779F9ULL
+#define PRIME_MX2 0x9FB21C651E98DF25ULL
+
+#define XXH3_SECRET_SIZE 192
+#define XXH3_SECRET_SIZE_MIN 136
+#define XXH3_STRIPE_LEN 64
+#define XXH3_SECRET_CONSUME_RATE 8
+#define XXH3_ACC_NB 8
+#define XXH3_MIDSIZE_MAX 240
+#define XXH3_MIDSIZE_STARTOFFSET 3
+#define XXH3_MIDSIZE_LASTOFFSET 17
+#define XXH3_SECRET_LASTACC_START 7
+#define XXH3_SECRET_MERGEACCS_START 11
+
+static const BYTE kSecret[XXH3_SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+
+//**************************************
+// Reading and writing
+//**************************************
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#  define XXH3_BIG_ENDIAN 1
+#endif
+
+static inline U32 XXH3_readLE32 (const void* ptr)
+{
+    U32 v;
+    memcpy (&v, ptr, sizeof (v));
+#ifdef XXH3_BIG_ENDIAN
+    v = __builtin_bswap32 (v);
+#endif
+    return v;
+}
+
+static inline U64 XXH3_readLE64 (const void* ptr)
+{
+    U64 v;
+    memcpy (&v, ptr, sizeof (v));
+#ifdef XXH3_BIG_ENDIAN
+    v = __builtin_bswap64 (v);
+#endif
+    return v;
+}
+
+static inline void XXH3_writeLE64 (void* dst, U64 v)
+{
+#ifdef XXH3_BIG_ENDIAN
+    v = __builtin_bswap64 (v);
+#endif
+    memcpy (dst, &v, sizeof (v));
+}
+
+static inline U32 XXH3_swap32 (U32 x)
+{
+    return ((x << 24) & 0xff000000) | ((x <<  8) & 0x00ff0000) |
+           ((x >>  8) & 0x0000ff00) | ((x >> 24) & 0x000000ff);
+}
+
+static inline U64 XXH3_swap64 (U64 x)
+{
+    return ((U64)XXH3_swap32 ((U32)x) << 32) | XXH3_swap32 ((U32)(x >> 32));
+}
+
+#define XXH3_rotl64(x,r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+
+//**************************************
+// Mixers
+//**************************************
+static inline U64 XXH3_mul128_fold64 (U64 lhs, U64 rhs)
+{
+#if defined(__SIZEOF_INT128__)
+    __uint128_t product = (__uint128_t)lhs * (__uint128_t)rhs;
+    return (U64)product ^ (U64)(product >> 64);
+#else
+    /* Portable schoolbook multiplication */
+    U64 lo_lo = (lhs & 0xFFFFFFFF) * (rhs & 0xFFFFFFFF);
+    U64 hi_lo = (lhs >> 32) * (rhs & 0xFFFFFFFF);
+    U64 lo_hi = (lhs & 0xFFFFFFFF) * (rhs >> 32);
+    U64 hi_hi = (lhs >> 32) * (rhs >> 32);
+    U64 cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+    U64 upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    U64 lower = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+    return lower ^ upper;
+#endif
+}
+
+static inline U64 XXH64_avalanche (U64 h)
+{
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline U64 XXH3_avalanche (U64 h)
+{
+    h ^= h >> 37;
+    h *= PRIME_MX1;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline U64 XXH3_rrmxmx (U64 h, U64 len)
+{
+    h ^= XXH3_rotl64 (h, 49) ^ XXH3_rotl64 (h, 24);
+    h *= PRIME_MX2;
+    h ^= (h >> 35) + len;
+    h *= PRIME_MX2;
+    return h ^ (h >> 28);
+}
+
+static inline U64 XXH3_mix16B (const BYTE* input, const BYTE* secret, U64 seed)
+{
+    U64 input_lo = XXH3_readLE64 (input);
+    U64 input_hi = XXH3_readLE64 (input + 8);
+    return XXH3_mul128_fold64 (
+            input_lo ^ (XXH3_readLE64 (secret) + seed),
+            input_hi ^ (XXH3_readLE64 (secret + 8) - seed));
+}
+
+
+//**************************************
+// Short inputs
+//**************************************
+static inline U64 XXH3_len_1to3 (const BYTE* input, size_t len,
+        const BYTE* secret, U64 seed)
+{
+    BYTE c1 = input[0];
+    BYTE c2 = input[len >> 1];
+    BYTE c3 = input[len - 1];
+    U32 combined = ((U32)c1 << 16) | ((U32)c2 << 24) | ((U32)c3 << 0) |
+            ((U32)len << 8);
+    U64 bitflip = (XXH3_readLE32 (secret) ^ XXH3_readLE32 (secret + 4)) + seed;
+    return XXH64_avalanche ((U64)combined ^ bitflip);
+}
+
+static inline U64 XXH3_len_4to8 (const BYTE* input, size_t len,
+        const BYTE* secret, U64 seed)
+{
+    U32 input1, input2;
+    U64 bitflip, input64;
+
+    seed ^= (U64)XXH3_swap32 ((U32)seed) << 32;
+    input1 = XXH3_readLE32 (input);
+    input2 = XXH3_readLE32 (input + len - 4);
+    bitflip = (XXH3_readLE64 (secret + 8) ^ XXH3_readLE64 (secret + 16)) - seed;
+    input64 = input2 + ((U64)input1 << 32);
+    return XXH3_rrmxmx (input64 ^ bitflip, len);
+}
+
+static inline U64 XXH3_len_9to16 (const BYTE* input, size_t len,
+        const BYTE* secret, U64 seed)
+{
+    U64 bitflip1 = (XXH3_readLE64 (secret + 24) ^ XXH3_readLE64 (secret + 32)) + seed;
+    U64 bitflip2 = (XXH3_readLE64 (secret + 40) ^ XXH3_readLE64 (secret + 48)) - seed;
+    U64 input_lo = XXH3_readLE64 (input) ^ bitflip1;
+    U64 input_hi = XXH3_readLE64 (input + len - 8) ^ bitflip2;
+    U64 acc = len + XXH3_swap64 (input_lo) + input_hi +
+            XXH3_mul128_fold64 (input_lo, input_hi);
+    return XXH3_avalanche (acc);
+}
+
+static inline U64 XXH3_len_0to16 (const BYTE* input, size_t len,
+        const BYTE* secret, U64 seed)
+{
+    if (len > 8) return XXH3_len_9to16 (input, len, secret, seed);
+    if (len >= 4) return XXH3_len_4to8 (input, len, secret, seed);
+    if (len) return XXH3_len_1to3 (input, len, secret, seed);
+    return XXH64_avalanche (seed ^ (XXH3_readLE64 (secret + 56) ^
+            XXH3_readLE64 (secret + 64)));
+}
+
+static inline U64 XXH3_len_17to128 (const BYTE* input, size_t len,
+        const BYTE* secret, U64 seed)
+{
+    U64 acc = len * PRIME64_1;
+
+    if (len > 32) {
+        if (len > 64) {
+            if (len > 96) {
+                acc += XXH3_mix16B (input + 48, secret + 96, seed);
+                acc += XXH3_mix16B (input + len - 64, secret + 112, seed);
+            }
+            acc += XXH3_mix16B (input + 32, secret + 64, seed);
+            acc += XXH3_mix16B (input + len - 48, secret + 80, seed);
+        }
+        acc += XXH3_mix16B (input + 16, secret + 32, seed);
+        acc += XXH3_mix16B (input + len - 32, secret + 48, seed);
+    }
+    acc += XXH3_mix16B (input, secret, seed);
+    acc += XXH3_mix16B (input + len - 16, secret + 16, seed);
+
+    return XXH3_avalanche (acc);
+}
+
+static U64 XXH3_len_129to240 (const BYTE* input, size_t len,
+        const BYTE* secret, U64 seed)
+{
+    U64 acc = len * PRIME64_1;
+    int nbRounds = (int)len / 16;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        acc += XXH3_mix16B (input + 16 * i, secret + 16 * i, seed);
+    }
+    acc = XXH3_avalanche (acc);
+
+    for (i = 8; i < nbRounds; i++) {
+        acc += XXH3_mix16B (input + 16 * i,
+                secret + 16 * (i - 8) + XXH3_MIDSIZE_STARTOFFSET, seed);
+    }
+    /* last bytes */
+    acc += XXH3_mix16B (input + len - 16,
+            secret + XXH3_SECRET_SIZE_MIN - XXH3_MIDSIZE_LASTOFFSET, seed);
+
+    return XXH3_avalanche (acc);
+}
+
+
+//**************************************
+// Long inputs
+//**************************************
+static inline void XXH3_accumulate_512 (U64* acc, const BYTE* input,
+        const BYTE* secret)
+{
+    int i;
+
+    for (i = 0; i < XXH3_ACC_NB; i++) {
+        U64 data_val = XXH3_readLE64 (input + 8 * i);
+        U64 data_key = data_val ^ XXH3_readLE64 (secret + 8 * i);
+        acc[i ^ 1] += data_val;
+        acc[i] += (U32)data_key * (data_key >> 32);
+    }
+}
+
+static inline void XXH3_scrambleAcc (U64* acc, const BYTE* secret)
+{
+    int i;
+
+    for (i = 0; i < XXH3_ACC_NB; i++) {
+        U64 acc64 = acc[i];
+        acc64 ^= acc64 >> 47;
+        acc64 ^= XXH3_readLE64 (secret + 8 * i);
+        acc64 *= PRIME32_1;
+        acc[i] = acc64;
+    }
+}
+
+static inline void XXH3_accumulate (U64* acc, const BYTE* input,
+        const BYTE* secret, size_t nbStripes)
+{
+    size_t n;
+
+    for (n = 0; n < nbStripes; n++) {
+        XXH3_accumulate_512 (acc, input + n * XXH3_STRIPE_LEN,
+                secret + n * XXH3_SECRET_CONSUME_RATE);
+    }
+}
+
+static U64 XXH3_hashLong (const BYTE* input, size_t len, const BYTE* secret)
+{
+    U64 acc[XXH3_ACC_NB] = {
+        PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+        PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1
+    };
+    size_t nbStripesPerBlock = (XXH3_SECRET_SIZE - XXH3_STRIPE_LEN) /
+            XXH3_SECRET_CONSUME_RATE;
+    size_t block_len = XXH3_STRIPE_LEN * nbStripesPerBlock;
+    size_t nb_blocks = (len - 1) / block_len;
+    size_t nbStripes, n;
+    U64 result;
+
+    for (n = 0; n < nb_blocks; n++) {
+        XXH3_accumulate (acc, input + n * block_len, secret, nbStripesPerBlock);
+        XXH3_scrambleAcc (acc, secret + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN);
+    }
+
+    /* last partial block */
+    nbStripes = ((len - 1) - (block_len * nb_blocks)) / XXH3_STRIPE_LEN;
+    XXH3_accumulate (acc, input + nb_blocks * block_len, secret, nbStripes);
+
+    /* last stripe */
+    XXH3_accumulate_512 (acc, input + len - XXH3_STRIPE_LEN,
+            secret + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN - XXH3_SECRET_LASTACC_START);
+
+    /* merge accumulators */
+    result = len * PRIME64_1;
+    secret += XXH3_SECRET_MERGEACCS_START;
+    for (n = 0; n < 4; n++) {
+        result += XXH3_mul128_fold64 (acc[2 * n] ^ XXH3_readLE64 (secret + 16 * n),
+                acc[2 * n + 1] ^ XXH3_readLE64 (secret + 16 * n + 8));
+    }
+
+    return XXH3_avalanche (result);
+}
+
+
+//****************************
+// Simple Hash Functions
+//****************************
+unsigned long long XXH3_64bits_withSeed (const void* input, size_t len,
+        unsigned long long seed)
+{
+    const BYTE* p = (const BYTE*)input;
+    BYTE secret[XXH3_SECRET_SIZE];
+    size_t i;
+
+    if (len <= 16) return XXH3_len_0to16 (p, len, kSecret, seed);
+    if (len <= 128) return XXH3_len_17to128 (p, len, kSecret, seed);
+    if (len <= XXH3_MIDSIZE_MAX) return XXH3_len_129to240 (p, len, kSecret, seed);
+    if (seed == 0) return XXH3_hashLong (p, len, kSecret);
+
+    /* Derive secret from seed */
+    for (i = 0; i < XXH3_SECRET_SIZE / 16; i++) {
+        XXH3_writeLE64 (secret + 16 * i, XXH3_readLE64 (kSecret + 16 * i) + seed);
+        XXH3_writeLE64 (secret + 16 * i + 8,
+                XXH3_readLE64 (kSecret + 16 * i + 8) - seed);
+    }
+
+    return XXH3_hashLong (p, len, secret);
+}
+
+unsigned long long XXH3_64bits (const void* input, size_t len)
+{
+    return XXH3_64bits_withSeed (input, len, 0);
+}
@@ -29,6 +29,7 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include "rspamdclient.h"
+#include "histogram.h"
 #include "utlist.h"
 
 #define DEFAULT_PORT 11333
@@ -57,6 +58,13 @@ static gboolean json = FALSE;
 static gboolean headers = FALSE;
 static gboolean raw = FALSE;
 static gboolean extended_urls = FALSE;
+static gboolean batch = FALSE;
+static gboolean compact = FALSE;
+static gboolean mbox = FALSE;
+static gboolean summary = FALSE;
+static gboolean quiet = FALSE;
+/* Connections kept alive by rspamd, indexed by is_controller */
+static GQueue idle_conns[2] = {G_QUEUE_INIT, G_QUEUE_INIT};
 static gchar *key = NULL;
 
 static GOptionEntry entries[] =
@@ -109,6 +117,16 @@ static GOptionEntry entries[] =
 	   "Output urls in extended format", NULL },
 	{ "key", 0, 0, G_OPTION_ARG_STRING, &key,
 	   "Use specified pubkey to encrypt request", NULL },
+	{ "batch", 0, 0, G_OPTION_ARG_NONE, &batch,
+	   "Scan all files in a single batch request", NULL },
+	{ "compact", 0, 0, G_OPTION_ARG_NONE, &compact,
+	   "Use compact binary protocol for scan requests", NULL },
+	{ "mbox", 0, 0, G_OPTION_ARG_NONE, &mbox,
+	   "Treat files as mailboxes in mbox format", NULL },
+	{ "summary", 0, 0, G_OPTION_ARG_NONE, &summary,
+	   "Print throughput and latency of requests at the end", NULL },
+	{ "quiet", 'q', 0, G_OPTION_ARG_NONE, &quiet,
+	   "Do not print replies of rspamd", NULL },
 	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
 };
 
@@ -259,8 +277,43 @@ struct rspamc_command {
 struct rspamc_callback_data {
 	struct rspamc_command *cmd;
 	gchar *filename;
+	GPtrArray *files;
+	gdouble start;
 };
 
+/*
+ * Messages of files, directories, maildirs and mailboxes from the command
+ * line are read one by one, so up to max_requests requests are kept in flight
+ * without loading the whole corpus to memory
+ */
+struct rspamc_stream {
+	struct event_base *ev_base;
+	struct rspamc_command *cmd;
+	GHashTable *attrs;
+	gchar **names;
+	gint nnames;
+	gint cur_name;
+	GQueue dirs;                /* directories that are not read yet */
+	DIR *d;
+	gchar *dir_name;
+	FILE *mbox;
+	gchar *mbox_name;
+	guint mbox_nmsg;
+	gchar *line;
+	gsize linelen;
+	guint in_flight;
+	gboolean refill_pending;
+};
+
+static struct rspamc_stream *stream = NULL;
+
+/* Statistics of requests for --summary */
+static struct rspamd_histogram latencies;
+static guint64 requests_failed = 0;
+static guint64 bytes_sent = 0;
+
+static void rspamc_stream_refill_cb (gint fd, short what, gpointer ud);
+
 /*
  * Parse command line
  */
@@ -724,11 +777,19 @@ rspamc_stat_output (ucl_object_t *obj)
 		ucl_object_toint (ucl_object_find_key (obj, "chunks_freed")));
 	rspamd_printf_gstring (out, "Oversized chunks: %L\n",
 		ucl_object_toint (ucl_object_find_key (obj, "chunks_oversized")));
+	rspamd_printf_gstring (out, "Chunks reused: %L\n",
+		ucl_object_toint (ucl_object_find_key (obj, "chunks_reused")));
+	rspamd_printf_gstring (out, "Chunks cached: %L\n",
+		ucl_object_toint (ucl_object_find_key (obj, "chunks_cached")));
 	/* Fuzzy */
 	rspamd_printf_gstring (out, "Fuzzy hashes stored: %L\n",
 		ucl_object_toint (ucl_object_find_key (obj, "fuzzy_stored")));
 	rspamd_printf_gstring (out, "Fuzzy hashes expired: %L\n",
 		ucl_object_toint (ucl_object_find_key (obj, "fuzzy_expired")));
+	rspamd_printf_gstring (out, "Fuzzy updates pending: %L\n",
+		ucl_object_toint (ucl_object_find_key (obj, "fuzzy_pending")));
+	rspamd_printf_gstring (out, "Fuzzy hashes waiting for expiration: %L\n",
+		ucl_object_toint (ucl_object_find_key (obj, "fuzzy_expire_backlog")));
 
 	st = ucl_object_find_key (obj, "fuzzy_checked");
 	if (st != NULL && ucl_object_type (st) == UCL_ARRAY) {
@@ -754,6 +815,22 @@ rspamc_stat_output (ucl_object_t *obj)
 		rspamd_printf_gstring (out, "\n");
 	}
 
+	/* Encryption */
+	rspamd_printf_gstring (out, "Shared keys cache hits: %L\n",
+		ucl_object_toint (ucl_object_find_key (obj, "keys_cache_hits")));
+	rspamd_printf_gstring (out, "Shared keys cache misses: %L\n",
+		ucl_object_toint (ucl_object_find_key (obj, "keys_cache_misses")));
+	/* DNS */
+	rspamd_printf_gstring (out, "DNS cache hits: %L\n",
+		ucl_object_toint (ucl_object_find_key (obj, "dns_cache_hits")));
+	rspamd_printf_gstring (out, "DNS cache misses: %L\n",
+		ucl_object_toint (ucl_object_find_key (obj, "dns_cache_misses")));
+	/* Stemming */
+	rspamd_printf_gstring (out, "Stems cache hits: %L\n",
+		ucl_object_toint (ucl_object_find_key (obj, "stem_cache_hits")));
+	rspamd_printf_gstring (out, "Stems cache misses: %L\n",
+		ucl_object_toint (ucl_object_find_key (obj, "stem_cache_misses")));
+
 	st = ucl_object_find_key (obj, "statfiles");
 	if (st != NULL && ucl_object_type (st) == UCL_ARRAY) {
 		iter = NULL;
@@ -781,13 +858,53 @@ rspamc_output_headers (struct rspamd_http_message *msg)
 }
 
 static void
-rspamc_client_cb (struct rspamd_client_connection *conn,
-	struct rspamd_http_message *msg,
-	const gchar *name, ucl_object_t *result,
-	gpointer ud, GError *err)
+rspamc_client_release (struct rspamc_command *cmd,
+	struct rspamd_client_connection *conn)
+{
+	if (rspamd_client_is_persistent (conn)) {
+		g_queue_push_tail (&idle_conns[cmd->is_controller ? 1 : 0], conn);
+	}
+	else {
+		rspamd_client_destroy (conn);
+	}
+}
+
+static void
+rspamc_request_done (struct rspamc_callback_data *cbdata, gboolean success)
+{
+	struct timeval tv;
+
+	if (summary) {
+		rspamd_histogram_add (&latencies,
+				(rspamd_get_ticks () - cbdata->start) * 1e6);
+	}
+
+	if (!success) {
+		requests_failed ++;
+	}
+
+	if (stream != NULL) {
+		stream->in_flight --;
+
+		/*
+		 * The connection cannot be reused from its own callback, so the next
+		 * requests are started from the event loop
+		 */
+		if (!stream->refill_pending) {
+			stream->refill_pending = TRUE;
+			tv.tv_sec = 0;
+			tv.tv_usec = 0;
+			event_base_once (stream->ev_base, -1, EV_TIMEOUT,
+					rspamc_stream_refill_cb, stream, &tv);
+		}
+	}
+}
+
+static void
+rspamc_client_output (struct rspamc_callback_data *cbdata,
+	struct rspamd_http_message *msg, ucl_object_t *result, GError *err)
 {
 	gchar *out;
-	struct rspamc_callback_data *cbdata = (struct rspamc_callback_data *)ud;
 	struct rspamc_command *cmd;
 
 	cmd = cbdata->cmd;
@@ -814,7 +931,6 @@ rspamc_client_cb (struct rspamd_client_connection *conn,
 		else {
 			cmd->command_output_func (result);
 		}
-		ucl_object_unref (result);
 	}
 	else if (err != NULL) {
 		rspamd_fprintf (stdout, "%s\n", err->message);
@@ -822,21 +938,113 @@ rspamc_client_cb (struct rspamd_client_connection *conn,
 
 	rspamd_fprintf (stdout, "\n");
 	fflush (stdout);
+}
+
+static void
+rspamc_client_cb (struct rspamd_client_connection *conn,
+	struct rspamd_http_message *msg,
+	const gchar *name, ucl_object_t *result,
+	gpointer ud, GError *err)
+{
+	struct rspamc_callback_data *cbdata = (struct rspamc_callback_data *)ud;
+
+	rspamc_request_done (cbdata, result != NULL);
+
+	if (!quiet) {
+		rspamc_client_output (cbdata, msg, result, err);
+	}
+
+	if (result != NULL) {
+		ucl_object_unref (result);
+	}
 
-	rspamd_client_destroy (conn);
+	rspamc_client_release (cbdata->cmd, conn);
 	g_free (cbdata->filename);
 	g_slice_free1 (sizeof (struct rspamc_callback_data), cbdata);
 }
 
 static void
-rspamc_process_input (struct event_base *ev_base, struct rspamc_command *cmd,
-	FILE *in, const gchar *name, GHashTable *attrs)
+rspamc_batch_cb (struct rspamd_client_connection *conn,
+	struct rspamd_http_message *msg,
+	const gchar *name, ucl_object_t *result,
+	gpointer ud, GError *err)
+{
+	gchar *out;
+	struct rspamc_callback_data *cbdata = (struct rspamc_callback_data *)ud;
+	const ucl_object_t *cur, *elt;
+	ucl_object_iter_t it = NULL;
+	guint idx;
+
+	rspamc_request_done (cbdata, result != NULL && result->type == UCL_ARRAY);
+
+	if (result != NULL && result->type == UCL_ARRAY) {
+		if (headers && msg != NULL) {
+			rspamc_output_headers (msg);
+		}
+
+		/* Results are in order of completion */
+		while ((cur = ucl_iterate_object (result, &it, true)) != NULL) {
+			elt = ucl_object_find_key (cur, "index");
+			idx = elt != NULL ? ucl_object_toint (elt) : cbdata->files->len;
+
+			rspamd_fprintf (stdout, "Results for file: %s\n",
+				idx < cbdata->files->len ?
+				(gchar *)g_ptr_array_index (cbdata->files, idx) : "unknown");
+
+			if (raw) {
+				if (json) {
+					out = ucl_object_emit (cur, UCL_EMIT_JSON);
+				}
+				else {
+					out = ucl_object_emit (cur, UCL_EMIT_CONFIG);
+				}
+				printf ("%s", out);
+				free (out);
+			}
+			else {
+				rspamc_symbols_output ((ucl_object_t *)cur);
+			}
+
+			rspamd_fprintf (stdout, "\n");
+		}
+	}
+	else {
+		rspamd_fprintf (stdout, "Results for batch of %ud files\n",
+			cbdata->files->len);
+
+		if (err != NULL) {
+			rspamd_fprintf (stdout, "%s\n", err->message);
+		}
+		else {
+			rspamd_fprintf (stdout, "Bad output\n");
+		}
+
+		rspamd_fprintf (stdout, "\n");
+	}
+
+	if (result != NULL) {
+		ucl_object_unref (result);
+	}
+
+	fflush (stdout);
+
+	rspamc_client_release (cbdata->cmd, conn);
+	g_ptr_array_free (cbdata->files, TRUE);
+	g_slice_free1 (sizeof (struct rspamc_callback_data), cbdata);
+}
+
+static struct rspamd_client_connection *
+rspamc_client_connect (struct event_base *ev_base, struct rspamc_command *cmd)
 {
 	struct rspamd_client_connection *conn;
 	gchar **connectv;
 	guint16 port;
-	GError *err = NULL;
-	struct rspamc_callback_data *cbdata;
+
+	conn = g_queue_pop_head (&idle_conns[cmd->is_controller ? 1 : 0]);
+
+	if (conn != NULL) {
+		return conn;
+	}
 
 	connectv = g_strsplit_set (connect_str, ":", -1);
 
@@ -859,10 +1067,29 @@ rspamc_process_input (struct event_base *ev_base, struct rspamc_command *cmd,
 	conn = rspamd_client_init (ev_base, connectv[0], port, timeout, key);
 	g_strfreev (connectv);
 
+	return conn;
+}
+
+static void
+rspamc_process_input (struct event_base *ev_base, struct rspamc_command *cmd,
+	FILE *in, const gchar *name, GHashTable *attrs)
+{
+	struct rspamd_client_connection *conn;
+	GError *err = NULL;
+	struct rspamc_callback_data *cbdata;
+
+	conn = rspamc_client_connect (ev_base, cmd);
+
 	if (conn != NULL) {
 		cbdata = g_slice_alloc (sizeof (struct rspamc_callback_data));
 		cbdata->cmd = cmd;
 		cbdata->filename = g_strdup (name);
+		cbdata->files = NULL;
+		cbdata->start = rspamd_get_ticks ();
+		/* Raw output is expected to be the same textual reply */
+		rspamd_client_set_compact (conn,
+				compact && !raw && !cmd->is_controller);
+
 		if (cmd->need_input) {
 			rspamd_client_command (conn, cmd->path, attrs, in, rspamc_client_cb,
 				cbdata, &err);
@@ -880,66 +1107,390 @@ rspamc_process_input (struct event_base *ev_base, struct rspamc_command *cmd,
 }
 
 static void
-rspamc_process_dir (struct event_base *ev_base, struct rspamc_command *cmd,
-	const gchar *name, GHashTable *attrs)
+rspamc_stream_add_dir (struct rspamc_stream *st, const gchar *name)
+{
+	struct stat st_cur, st_new;
+	gchar cur[PATH_MAX], new[PATH_MAX];
+
+	rspamd_snprintf (cur, sizeof (cur), "%s%ccur", name, G_DIR_SEPARATOR);
+	rspamd_snprintf (new, sizeof (new), "%s%cnew", name, G_DIR_SEPARATOR);
+
+	if (stat (cur, &st_cur) != -1 && S_ISDIR (st_cur.st_mode) &&
+			stat (new, &st_new) != -1 && S_ISDIR (st_new.st_mode)) {
+		/* Maildir, `tmp` contains incomplete messages */
+		g_queue_push_tail (&st->dirs, g_strdup (cur));
+		g_queue_push_tail (&st->dirs, g_strdup (new));
+	}
+	else {
+		g_queue_push_tail (&st->dirs, g_strdup (name));
+	}
+}
+
+/*
+ * Read the next message of mbox, separators are removed and `>From ` lines
+ * are unescaped as in mboxrd format
+ */
+static gchar *
+rspamc_mbox_next (struct rspamc_stream *st, gsize *len)
+{
+	GString *msg = NULL;
+	gssize r;
+	gchar *p;
+
+	while ((r = getline (&st->line, &st->linelen, st->mbox)) > 0) {
+		if (r >= 5 && memcmp (st->line, "From ", 5) == 0) {
+			if (msg != NULL) {
+				break;
+			}
+
+			continue;
+		}
+
+		if (msg == NULL) {
+			msg = g_string_sized_new (BUFSIZ);
+		}
+
+		p = st->line;
+
+		if (*p == '>') {
+			while (p < st->line + r && *p == '>') {
+				p ++;
+			}
+
+			if (st->line + r - p >= 5 && memcmp (p, "From ", 5) == 0) {
+				g_string_append_len (msg, st->line + 1, r - 1);
+				continue;
+			}
+		}
+
+		g_string_append_len (msg, st->line, r);
+	}
+
+	if (msg == NULL) {
+		return NULL;
+	}
+
+	*len = msg->len;
+
+	return g_string_free (msg, FALSE);
+}
+
+static gboolean
+rspamc_stream_read_file (struct rspamc_stream *st, const gchar *fname,
+	gchar **name, gchar **data, gsize *len)
+{
+	GError *err = NULL;
+
+	if (mbox) {
+		st->mbox = fopen (fname, "r");
+
+		if (st->mbox == NULL) {
+			fprintf (stderr, "cannot open file %s\n", fname);
+			exit (EXIT_FAILURE);
+		}
+
+		st->mbox_name = g_strdup (fname);
+		st->mbox_nmsg = 0;
+
+		return FALSE;
+	}
+
+	if (!g_file_get_contents (fname, data, len, &err)) {
+		fprintf (stderr, "cannot read file %s: %s\n", fname, err->message);
+		exit (EXIT_FAILURE);
+	}
+
+	*name = g_strdup (fname);
+
+	return TRUE;
+}
+
+/*
+ * Get the next message of the stream
+ * @return FALSE if there are no more messages
+ */
+static gboolean
+rspamc_stream_next (struct rspamc_stream *st, gchar **name, gchar **data,
+	gsize *len)
 {
-	DIR *d;
-	gint cur_req = 0;
 	struct dirent *ent;
-#if defined(__sun)
 	struct stat sb;
-#endif
-	FILE *in;
-	char filebuf[PATH_MAX];
+	const gchar *fname;
+	gchar filebuf[PATH_MAX];
+
+	for (;;) {
+		if (st->mbox != NULL) {
+			if ((*data = rspamc_mbox_next (st, len)) != NULL) {
+				*name = g_strdup_printf ("%s:%ud", st->mbox_name,
+						++st->mbox_nmsg);
+				return TRUE;
+			}
 
-	d = opendir (name);
+			fclose (st->mbox);
+			st->mbox = NULL;
+			g_free (st->mbox_name);
+			st->mbox_name = NULL;
+		}
+		else if (st->d != NULL) {
+			if ((ent = readdir (st->d)) == NULL) {
+				closedir (st->d);
+				st->d = NULL;
+				g_free (st->dir_name);
+				st->dir_name = NULL;
+				continue;
+			}
 
-	if (d != NULL) {
-		while ((ent = readdir (d))) {
 			rspamd_snprintf (filebuf, sizeof (filebuf), "%s%c%s",
-					name, G_DIR_SEPARATOR, ent->d_name);
-#if defined(__sun)
-			if (stat (filebuf, &sb)) continue;
-			if (S_ISREG (sb.st_mode)) {
-#else
-			if (ent->d_type == DT_REG || ent->d_type == DT_UNKNOWN) {
-#endif
-				if (access (filebuf, R_OK) != -1) {
-					in = fopen (filebuf, "r");
-					if (in == NULL) {
-						fprintf (stderr, "cannot open file %s\n", filebuf);
-						exit (EXIT_FAILURE);
-					}
-					rspamc_process_input (ev_base, cmd, in, filebuf, attrs);
-					cur_req++;
-					fclose (in);
-					if (cur_req >= max_requests) {
-						cur_req = 0;
-						/* Wait for completion */
-						event_base_loop (ev_base, 0);
-					}
+					st->dir_name, G_DIR_SEPARATOR, ent->d_name);
+
+			if (stat (filebuf, &sb) != -1 && S_ISREG (sb.st_mode) &&
+					access (filebuf, R_OK) != -1) {
+				if (rspamc_stream_read_file (st, filebuf, name, data, len)) {
+					return TRUE;
 				}
 			}
 		}
+		else if (!g_queue_is_empty (&st->dirs)) {
+			st->dir_name = g_queue_pop_head (&st->dirs);
+			st->d = opendir (st->dir_name);
+
+			if (st->d == NULL) {
+				fprintf (stderr, "cannot open directory %s\n", st->dir_name);
+				exit (EXIT_FAILURE);
+			}
+		}
+		else if (st->cur_name < st->nnames) {
+			fname = st->names[st->cur_name ++];
+
+			if (stat (fname, &sb) == -1) {
+				fprintf (stderr, "cannot stat file %s\n", fname);
+				exit (EXIT_FAILURE);
+			}
+
+			if (S_ISDIR (sb.st_mode)) {
+				rspamc_stream_add_dir (st, fname);
+			}
+			else if (rspamc_stream_read_file (st, fname, name, data, len)) {
+				return TRUE;
+			}
+		}
+		else {
+			return FALSE;
+		}
 	}
-	else {
-		fprintf (stderr, "cannot open directory %s\n", name);
-		exit (EXIT_FAILURE);
+}
+
+static void
+rspamc_stream_refill (struct rspamc_stream *st)
+{
+	struct rspamd_client_connection *conn;
+	struct rspamc_callback_data *cbdata;
+	GError *err = NULL;
+	gchar *name, *data;
+	gsize len;
+
+	while (st->in_flight < (guint)MAX (max_requests, 1) &&
+			rspamc_stream_next (st, &name, &data, &len)) {
+		conn = rspamc_client_connect (st->ev_base, st->cmd);
+
+		if (conn == NULL) {
+			fprintf (stderr, "cannot connect to %s\n", connect_str);
+			requests_failed ++;
+			g_free (name);
+			g_free (data);
+			continue;
+		}
+
+		cbdata = g_slice_alloc (sizeof (struct rspamc_callback_data));
+		cbdata->cmd = st->cmd;
+		cbdata->filename = name;
+		cbdata->files = NULL;
+		cbdata->start = rspamd_get_ticks ();
+		rspamd_client_set_compact (conn,
+				compact && !raw && !st->cmd->is_controller);
+
+		if (rspamd_client_command_data (conn, st->cmd->path, st->attrs,
+				data, len, rspamc_client_cb, cbdata, &err)) {
+			st->in_flight ++;
+			bytes_sent += len;
+		}
+		else {
+			fprintf (stderr, "cannot send %s: %s\n", name, err->message);
+			g_error_free (err);
+			err = NULL;
+			requests_failed ++;
+			rspamd_client_destroy (conn);
+			g_free (cbdata->filename);
+			g_slice_free1 (sizeof (struct rspamc_callback_data), cbdata);
+		}
+
+		g_free (data);
 	}
+}
 
-	closedir (d);
+static void
+rspamc_stream_refill_cb (gint fd, short what, gpointer ud)
+{
+	struct rspamc_stream *st = ud;
+
+	st->refill_pending = FALSE;
+	rspamc_stream_refill (st);
+}
+
+static void
+rspamc_process_stream (struct event_base *ev_base, struct rspamc_command *cmd,
+	gchar **names, gint nnames, GHashTable *attrs)
+{
+	stream = g_slice_alloc0 (sizeof (struct rspamc_stream));
+	stream->ev_base = ev_base;
+	stream->cmd = cmd;
+	stream->attrs = attrs;
+	stream->names = names;
+	stream->nnames = nnames;
+	g_queue_init (&stream->dirs);
+
+	rspamc_stream_refill (stream);
 	event_base_loop (ev_base, 0);
+
+	free (stream->line);
+	g_slice_free1 (sizeof (struct rspamc_stream), stream);
+	stream = NULL;
+}
+
+static void
+rspamc_print_summary (gdouble elapsed)
+{
+	if (elapsed <= 0) {
+		elapsed = 1e-9;
+	}
+
+	rspamd_fprintf (stdout, "Requests: %uL, failed: %uL, elapsed: %.3f seconds\n",
+			latencies.count, requests_failed, elapsed);
+	rspamd_fprintf (stdout, "Throughput: %.2f requests/sec, %.2f Mb/sec\n",
+			latencies.count / elapsed,
+			bytes_sent / elapsed / (1024.0 * 1024.0));
+
+	if (latencies.count > 0) {
+		rspamd_fprintf (stdout, "Latency (ms): avg %.2f, p50 %.2f, p90 %.2f, "
+				"p99 %.2f, p99.9 %.2f, max %.2f\n",
+				latencies.sum / (gdouble)latencies.count / 1000.0,
+				rspamd_histogram_percentile (&latencies, 50) / 1000.0,
+				rspamd_histogram_percentile (&latencies, 90) / 1000.0,
+				rspamd_histogram_percentile (&latencies, 99) / 1000.0,
+				rspamd_histogram_percentile (&latencies, 99.9) / 1000.0,
+				latencies.max / 1000.0);
+	}
+}
+
+static void
+rspamc_batch_add_file (FILE *out, GPtrArray *files, const gchar *name)
+{
+	gchar *data;
+	gsize len;
+	GError *err = NULL;
+
+	if (!g_file_get_contents (name, &data, &len, &err)) {
+		fprintf (stderr, "cannot read file %s: %s\n", name, err->message);
+		exit (EXIT_FAILURE);
+	}
+
+	if (len > 0) {
+		/* Each message is preceded by its length */
+		rspamd_fprintf (out, "%z\n", len);
+		if (fwrite (data, 1, len, out) != len) {
+			fprintf (stderr, "cannot write batch: %s\n", strerror (errno));
+			exit (EXIT_FAILURE);
+		}
+		g_ptr_array_add (files, g_strdup (name));
+	}
+
+	g_free (data);
+}
+
+static void
+rspamc_process_batch (struct event_base *ev_base, struct rspamc_command *cmd,
+	gchar **names, gint nnames, GHashTable *attrs)
+{
+	struct rspamd_client_connection *conn;
+	struct rspamc_callback_data *cbdata;
+	struct dirent *ent;
+	struct stat st;
+	GPtrArray *files;
+	GError *err = NULL;
+	FILE *out;
+	DIR *d;
+	gchar filebuf[PATH_MAX];
+	gint i;
+
+	out = tmpfile ();
+
+	if (out == NULL) {
+		fprintf (stderr, "cannot create temporary file: %s\n", strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+
+	files = g_ptr_array_new_with_free_func (g_free);
+
+	for (i = 0; i < nnames; i++) {
+		if (stat (names[i], &st) == -1) {
+			fprintf (stderr, "cannot stat file %s\n", names[i]);
+			exit (EXIT_FAILURE);
+		}
+
+		if (S_ISDIR (st.st_mode)) {
+			d = opendir (names[i]);
+
+			if (d == NULL) {
+				fprintf (stderr, "cannot open directory %s\n", names[i]);
+				exit (EXIT_FAILURE);
+			}
+
+			while ((ent = readdir (d))) {
+				rspamd_snprintf (filebuf, sizeof (filebuf), "%s%c%s",
+						names[i], G_DIR_SEPARATOR, ent->d_name);
+
+				if (stat (filebuf, &st) != -1 && S_ISREG (st.st_mode) &&
+						access (filebuf, R_OK) != -1) {
+					rspamc_batch_add_file (out, files, filebuf);
+				}
+			}
+
+			closedir (d);
+		}
+		else {
+			rspamc_batch_add_file (out, files, names[i]);
+		}
+	}
+
+	conn = rspamc_client_connect (ev_base, cmd);
+
+	if (conn != NULL) {
+		rewind (out);
+		cbdata = g_slice_alloc (sizeof (struct rspamc_callback_data));
+		cbdata->cmd = cmd;
+		cbdata->filename = NULL;
+		cbdata->files = files;
+		cbdata->start = rspamd_get_ticks ();
+		rspamd_client_set_compact (conn, FALSE);
+		rspamd_client_command (conn, "batch", attrs, out, rspamc_batch_cb,
+			cbdata, &err);
+	}
+	else {
+		g_ptr_array_free (files, TRUE);
+	}
+
+	fclose (out);
 }
 
 gint
 main (gint argc, gchar **argv, gchar **env)
 {
-	gint i, start_argc, cur_req = 0;
+	gint i, start_argc;
 	GHashTable *kwattrs;
 	struct rspamc_command *cmd;
 	FILE *in = NULL;
 	struct event_base *ev_base;
-	struct stat st;
+	gdouble start;
 
 	kwattrs = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
 
@@ -1002,42 +1553,33 @@ main (gint argc, gchar **argv, gchar **env)
 	}
 
 	add_options (kwattrs);
+	start = rspamd_get_ticks ();
 
 	if (start_argc == argc) {
 		/* Do command without input or with stdin */
 		rspamc_process_input (ev_base, cmd, in, "stdin", kwattrs);
 	}
+	else if (batch && cmd->cmd == RSPAMC_COMMAND_SYMBOLS) {
+		rspamc_process_batch (ev_base, cmd, &argv[start_argc],
+			argc - start_argc, kwattrs);
+	}
 	else {
-		for (i = start_argc; i < argc; i++) {
-			if (stat (argv[i], &st) == -1) {
-				fprintf (stderr, "cannot stat file %s\n", argv[i]);
-				exit (EXIT_FAILURE);
-			}
-			if (S_ISDIR (st.st_mode)) {
-				/* Directories are processed with a separate limit */
-				rspamc_process_dir (ev_base, cmd, argv[i], kwattrs);
-				cur_req = 0;
-			}
-			else {
-				in = fopen (argv[i], "r");
-				if (in == NULL) {
-					fprintf (stderr, "cannot open file %s\n", argv[i]);
-					exit (EXIT_FAILURE);
-				}
-				rspamc_process_input (ev_base, cmd, in, argv[i], kwattrs);
-				cur_req++;
-				fclose (in);
-			}
-			if (cur_req >= max_requests) {
-				cur_req = 0;
-				/* Wait for completion */
-				event_base_loop (ev_base, 0);
-			}
-		}
+		rspamc_process_stream (ev_base, cmd, &argv[start_argc],
+			argc - start_argc, kwattrs);
 	}
 
 	event_base_loop (ev_base, 0);
 
+	if (summary) {
+		rspamc_print_summary (rspamd_get_ticks () - start);
+	}
+
+	for (i = 0; i < (gint)G_N_ELEMENTS (idle_conns); i++) {
+		while (!g_queue_is_empty (&idle_conns[i])) {
+			rspamd_client_destroy (g_queue_pop_head (&idle_conns[i]));
+		}
+	}
+
 	g_hash_table_destroy (kwattrs);
 
 	return 0;
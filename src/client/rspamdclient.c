@@ -25,6 +25,7 @@
 #include "util.h"
 #include "http.h"
 #include "keypairs_cache.h"
+#include "protocol.h"
 
 #ifdef HAVE_FETCH_H
 #include <fetch.h>
@@ -35,7 +36,8 @@
 struct rspamd_client_request;
 
 /*
- * Since rspamd uses untagged HTTP we can pass a single message per socket
+ * Since rspamd uses untagged HTTP we can pass a single message at a time,
+ * however, the socket could be reused if rspamd keeps it alive
  */
 struct rspamd_client_connection {
 	gint fd;
@@ -46,6 +48,8 @@ struct rspamd_client_connection {
 	struct timeval timeout;
 	struct rspamd_http_connection *http_conn;
 	gboolean req_sent;
+	gboolean persistent;
+	gboolean compact;
 	struct rspamd_client_request *req;
 	struct rspamd_keypair_cache *keys_cache;
 };
@@ -57,6 +61,32 @@ struct rspamd_client_request {
 	gpointer ud;
 };
 
+/*
+ * Local keypair and keys cache are shared by all connections of a process, so
+ * the server sees the same public key and can reuse the cached shared key
+ * instead of computing it for each new connection
+ */
+static gpointer client_keypair = NULL;
+static struct rspamd_keypair_cache *client_keys_cache = NULL;
+
+/* Request attributes that are sent as fields of the binary control chunk */
+static const struct {
+	const gchar *name;
+	guint id;
+} rspamd_client_bin_fields[] = {
+	{"Ip", RSPAMD_PROTOCOL_BIN_IP},
+	{"Helo", RSPAMD_PROTOCOL_BIN_HELO},
+	{"From", RSPAMD_PROTOCOL_BIN_FROM},
+	{"Rcpt", RSPAMD_PROTOCOL_BIN_RCPT},
+	{"User", RSPAMD_PROTOCOL_BIN_USER},
+	{"Settings-ID", RSPAMD_PROTOCOL_BIN_SETTINGS_ID},
+	{"Queue-ID", RSPAMD_PROTOCOL_BIN_QUEUE_ID},
+	{"Hostname", RSPAMD_PROTOCOL_BIN_HOSTNAME},
+	{"Deliver-To", RSPAMD_PROTOCOL_BIN_DELIVER_TO},
+};
+
+#define RCLIENT_MSGPACK_MAX_DEPTH 32
+
 #define RCLIENT_ERROR rspamd_client_error_quark ()
 GQuark
 rspamd_client_error_quark (void)
@@ -84,6 +114,190 @@ rspamd_client_error_handler (struct rspamd_http_connection *conn, GError *err)
 	req->cb (c, NULL, c->server_name->str, NULL, req->ud, err);
 }
 
+static guint64
+rspamd_client_msgpack_uint (const guchar *p, guint len)
+{
+	guint64 res = 0;
+	guint i;
+
+	for (i = 0; i < len; i ++) {
+		res = (res << 8) | p[i];
+	}
+
+	return res;
+}
+
+/*
+ * Convert msgpack reply to an ucl object, returns NULL on malformed input
+ */
+static ucl_object_t *
+rspamd_client_msgpack_to_ucl (const guchar **pp, const guchar *end,
+	guint depth)
+{
+	const guchar *p = *pp;
+	ucl_object_t *obj = NULL, *elt, *key;
+	guchar t;
+	guint64 len = 0, i;
+	guint hlen = 0;
+	gboolean is_map = FALSE;
+	union {
+		guint32 u32;
+		gfloat f;
+	} f32;
+	union {
+		guint64 u64;
+		gdouble d;
+	} f64;
+
+	if (p >= end || depth > RCLIENT_MSGPACK_MAX_DEPTH) {
+		return NULL;
+	}
+
+	t = *p++;
+
+	if (t <= 0x7f) {
+		obj = ucl_object_fromint (t);
+	}
+	else if (t >= 0xe0) {
+		obj = ucl_object_fromint ((gint8)t);
+	}
+	else if ((t & 0xe0) == 0xa0 || (t >= 0xc4 && t <= 0xc6) ||
+			(t >= 0xd9 && t <= 0xdb)) {
+		/* Strings and binary data */
+		if ((t & 0xe0) == 0xa0) {
+			len = t & 0x1f;
+		}
+		else {
+			hlen = (t >= 0xd9) ? 1 << (t - 0xd9) : 1 << (t - 0xc4);
+
+			if ((gsize)(end - p) < hlen) {
+				return NULL;
+			}
+
+			len = rspamd_client_msgpack_uint (p, hlen);
+			p += hlen;
+		}
+
+		if ((guint64)(end - p) < len) {
+			return NULL;
+		}
+
+		/* Zero length means NUL terminated string for ucl */
+		obj = ucl_object_fromstring_common (len > 0 ? (const gchar *)p : "",
+				len, 0);
+		p += len;
+	}
+	else if ((t & 0xe0) == 0x80 || (t >= 0xdc && t <= 0xdf)) {
+		/* Arrays and maps */
+		if ((t & 0xf0) == 0x80 || (t & 0xf0) == 0x90) {
+			is_map = (t & 0xf0) == 0x80;
+			len = t & 0x0f;
+		}
+		else {
+			is_map = t >= 0xde;
+			hlen = (t == 0xdc || t == 0xde) ? 2 : 4;
+
+			if ((gsize)(end - p) < hlen) {
+				return NULL;
+			}
+
+			len = rspamd_client_msgpack_uint (p, hlen);
+			p += hlen;
+		}
+
+		obj = ucl_object_typed_new (is_map ? UCL_OBJECT : UCL_ARRAY);
+
+		for (i = 0; i < len; i ++) {
+			if (is_map) {
+				key = rspamd_client_msgpack_to_ucl (&p, end, depth + 1);
+
+				if (key == NULL || ucl_object_type (key) != UCL_STRING) {
+					ucl_object_unref (key);
+					ucl_object_unref (obj);
+					return NULL;
+				}
+			}
+			else {
+				key = NULL;
+			}
+
+			elt = rspamd_client_msgpack_to_ucl (&p, end, depth + 1);
+
+			if (elt == NULL) {
+				ucl_object_unref (key);
+				ucl_object_unref (obj);
+				return NULL;
+			}
+
+			if (is_map) {
+				ucl_object_insert_key (obj, elt, ucl_object_tostring (key),
+						key->len, true);
+				ucl_object_unref (key);
+			}
+			else {
+				ucl_array_append (obj, elt);
+			}
+		}
+	}
+	else {
+		switch (t) {
+		case 0xc0:
+			obj = ucl_object_typed_new (UCL_NULL);
+			break;
+		case 0xc2:
+		case 0xc3:
+			obj = ucl_object_frombool (t == 0xc3);
+			break;
+		case 0xca:
+			if (end - p < 4) {
+				return NULL;
+			}
+			f32.u32 = rspamd_client_msgpack_uint (p, 4);
+			obj = ucl_object_fromdouble (f32.f);
+			p += 4;
+			break;
+		case 0xcb:
+			if (end - p < 8) {
+				return NULL;
+			}
+			f64.u64 = rspamd_client_msgpack_uint (p, 8);
+			obj = ucl_object_fromdouble (f64.d);
+			p += 8;
+			break;
+		case 0xcc:
+		case 0xcd:
+		case 0xce:
+		case 0xcf:
+		case 0xd0:
+		case 0xd1:
+		case 0xd2:
+		case 0xd3:
+			hlen = 1 << ((t - 0xcc) & 0x3);
+
+			if ((gsize)(end - p) < hlen) {
+				return NULL;
+			}
+
+			len = rspamd_client_msgpack_uint (p, hlen);
+
+			if (t >= 0xd0 && hlen < 8 && (len & (1ULL << (hlen * 8 - 1)))) {
+				/* Sign extend */
+				len |= G_MAXUINT64 << (hlen * 8);
+			}
+
+			obj = ucl_object_fromint ((gint64)len);
+			p += hlen;
+			break;
+		default:
+			return NULL;
+		}
+	}
+
+	*pp = p;
+
+	return obj;
+}
+
 static gint
 rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
@@ -92,6 +306,9 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 		(struct rspamd_client_request *)conn->ud;
 	struct rspamd_client_connection *c;
 	struct ucl_parser *parser;
+	const GString *ctype;
+	const guchar *p;
+	ucl_object_t *obj;
 	GError *err;
 
 	c = req->conn;
@@ -107,6 +324,8 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 		return 0;
 	}
 	else {
+		c->persistent = (msg->flags & RSPAMD_HTTP_FLAG_KEEP_ALIVE) != 0;
+
 		if (msg->body == NULL || msg->body->len == 0 || msg->code != 200) {
 			err = g_error_new (RCLIENT_ERROR, msg->code, "HTTP error: %d, %s",
 					msg->code,
@@ -116,6 +335,29 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 			return 0;
 		}
 
+		ctype = rspamd_http_message_find_header (msg, "Content-Type");
+
+		if (ctype != NULL &&
+				ctype->len >= sizeof ("application/msgpack") - 1 &&
+				g_ascii_strncasecmp (ctype->str, "application/msgpack",
+						sizeof ("application/msgpack") - 1) == 0) {
+			p = (const guchar *)msg->body->str;
+			obj = rspamd_client_msgpack_to_ucl (&p,
+					p + msg->body->len, 0);
+
+			if (obj == NULL) {
+				err = g_error_new (RCLIENT_ERROR, msg->code,
+						"Cannot parse msgpack reply");
+				req->cb (c, msg, c->server_name->str, NULL, req->ud, err);
+				g_error_free (err);
+				return 0;
+			}
+
+			req->cb (c, msg, c->server_name->str, obj, req->ud, NULL);
+
+			return 0;
+		}
+
 		parser = ucl_parser_new (0);
 		if (!ucl_parser_add_chunk (parser, msg->body->str, msg->body->len)) {
 			err = g_error_new (RCLIENT_ERROR, msg->code, "Cannot parse UCL: %s",
@@ -150,11 +392,16 @@ rspamd_client_init (struct event_base *ev_base, const gchar *name,
 	conn->ev_base = ev_base;
 	conn->fd = fd;
 	conn->req_sent = FALSE;
-	conn->keys_cache = rspamd_keypair_cache_new (32);
+
+	if (client_keys_cache == NULL) {
+		client_keys_cache = rspamd_keypair_cache_new (32);
+	}
+
+	conn->keys_cache = client_keys_cache;
 	conn->http_conn = rspamd_http_connection_new (rspamd_client_body_handler,
 			rspamd_client_error_handler,
 			rspamd_client_finish_handler,
-			0,
+			RSPAMD_HTTP_KEEP_ALIVE,
 			RSPAMD_HTTP_CLIENT,
 			conn->keys_cache);
 
@@ -168,7 +415,11 @@ rspamd_client_init (struct event_base *ev_base, const gchar *name,
 	if (key) {
 		conn->key = rspamd_http_connection_make_peer_key (key);
 		if (conn->key) {
-			conn->keypair = rspamd_http_connection_gen_key ();
+			if (client_keypair == NULL) {
+				client_keypair = rspamd_http_connection_gen_key ();
+			}
+
+			conn->keypair = rspamd_http_connection_key_ref (client_keypair);
 			rspamd_http_connection_set_key (conn->http_conn, conn->keypair);
 		}
 		else {
@@ -180,16 +431,123 @@ rspamd_client_init (struct event_base *ev_base, const gchar *name,
 	return conn;
 }
 
-gboolean
-rspamd_client_command (struct rspamd_client_connection *conn,
-	const gchar *command, GHashTable *attrs,
-	FILE *in, rspamd_client_callback cb,
-	gpointer ud, GError **err)
+static void
+rspamd_client_bin_field (GString *out, guint id, const gchar *val, gsize len)
+{
+	len = MIN (len, G_MAXUINT16);
+	g_string_append_c (out, id);
+	g_string_append_c (out, (len >> 8) & 0xff);
+	g_string_append_c (out, len & 0xff);
+	g_string_append_len (out, val, len);
+}
+
+/*
+ * Move request attributes to the binary control chunk, attributes that have
+ * no binary representation are left as HTTP headers
+ */
+static GString *
+rspamd_client_make_bin_control (GHashTable *attrs, GHashTable *left)
+{
+	GString *out;
+	GHashTableIter it;
+	gchar *hn, *hv;
+	guint32 flags = RSPAMD_PROTOCOL_BIN_FLAG_MSGPACK;
+	guchar flbuf[4];
+	guint i;
+	gboolean found;
+
+	out = g_string_sized_new (128);
+	g_string_append (out, RSPAMD_PROTOCOL_BIN_MAGIC);
+
+	g_hash_table_iter_init (&it, attrs);
+	while (g_hash_table_iter_next (&it, (gpointer *)&hn, (gpointer *)&hv)) {
+		found = FALSE;
+
+		for (i = 0; i < G_N_ELEMENTS (rspamd_client_bin_fields); i ++) {
+			if (g_ascii_strcasecmp (hn, rspamd_client_bin_fields[i].name) == 0) {
+				rspamd_client_bin_field (out, rspamd_client_bin_fields[i].id,
+						hv, strlen (hv));
+				found = TRUE;
+				break;
+			}
+		}
+
+		if (!found) {
+			if (g_ascii_strcasecmp (hn, "Pass") == 0 &&
+					g_ascii_strcasecmp (hv, "all") == 0) {
+				flags |= RSPAMD_PROTOCOL_BIN_FLAG_PASS_ALL;
+			}
+			else if (g_ascii_strcasecmp (hn, "URL-Format") == 0 &&
+					g_ascii_strcasecmp (hv, "extended") == 0) {
+				flags |= RSPAMD_PROTOCOL_BIN_FLAG_EXT_URLS;
+			}
+			else if (g_ascii_strcasecmp (hn, "Log") == 0 &&
+					g_ascii_strcasecmp (hv, "no") == 0) {
+				flags |= RSPAMD_PROTOCOL_BIN_FLAG_NO_LOG;
+			}
+			else {
+				g_hash_table_insert (left, hn, hv);
+			}
+		}
+	}
+
+	flbuf[0] = (flags >> 24) & 0xff;
+	flbuf[1] = (flags >> 16) & 0xff;
+	flbuf[2] = (flags >> 8) & 0xff;
+	flbuf[3] = flags & 0xff;
+	rspamd_client_bin_field (out, RSPAMD_PROTOCOL_BIN_FLAGS,
+			(const gchar *)flbuf, sizeof (flbuf));
+
+	return out;
+}
+
+/*
+ * Start body of a request, in compact mode the body starts with the control
+ * chunk and headers that have no binary representation are returned in
+ * a new table
+ */
+static GString *
+rspamd_client_body_start (struct rspamd_client_connection *conn,
+	GHashTable *attrs, GHashTable **headers, gsize hint)
+{
+	GString *body;
+
+	if (conn->compact) {
+		/* Control chunk is followed by the message itself */
+		*headers = g_hash_table_new (rspamd_strcase_hash,
+				rspamd_strcase_equal);
+		body = rspamd_client_make_bin_control (attrs, *headers);
+		g_string_set_size (body, body->len + hint);
+		body->len -= hint;
+		body->str[body->len] = '\0';
+	}
+	else {
+		*headers = attrs;
+		body = g_string_sized_new (hint);
+	}
+
+	return body;
+}
+
+static gboolean
+rspamd_client_send (struct rspamd_client_connection *conn,
+	const gchar *command, GHashTable *attrs, GHashTable *headers,
+	GString *body, gsize control_len,
+	rspamd_client_callback cb, gpointer ud)
 {
 	struct rspamd_client_request *req;
-	gchar *p, *hn, *hv;
-	gsize remain, old_len;
+	gchar *hn, *hv;
 	GHashTableIter it;
+	gchar lenbuf[32];
+
+	if (conn->req != NULL) {
+		/* Reuse persistent connection */
+		g_slice_free1 (sizeof (struct rspamd_client_request), conn->req);
+		conn->req = NULL;
+		conn->req_sent = FALSE;
+		conn->persistent = FALSE;
+		rspamd_http_connection_reset (conn->http_conn);
+	}
 
 	req = g_slice_alloc (sizeof (struct rspamd_client_request));
 	req->conn = conn;
@@ -197,54 +555,118 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 	req->ud = ud;
 
 	req->msg = rspamd_http_new_message (HTTP_REQUEST);
+	req->msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
 	if (conn->key) {
 		req->msg->peer_key = rspamd_http_connection_key_ref (conn->key);
 	}
 
+	req->msg->body = body;
+
+	if (body != NULL && conn->compact) {
+		rspamd_snprintf (lenbuf, sizeof (lenbuf), "%z",
+				body->len - control_len);
+		rspamd_http_message_add_header (req->msg, "Message-Length",
+				lenbuf);
+	}
+
+	/* Convert headers */
+	g_hash_table_iter_init (&it, headers);
+	while (g_hash_table_iter_next (&it, (gpointer *)&hn, (gpointer *)&hv)) {
+		rspamd_http_message_add_header (req->msg, hn, hv);
+	}
+
+	if (headers != attrs) {
+		g_hash_table_unref (headers);
+	}
+
+	g_string_append_c (req->msg->url, '/');
+	g_string_append (req->msg->url, command);
+
+	conn->req = req;
+
+	rspamd_http_connection_write_message (conn->http_conn, req->msg, NULL,
+		"text/plain", req, conn->fd, &conn->timeout, conn->ev_base);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_client_command (struct rspamd_client_connection *conn,
+	const gchar *command, GHashTable *attrs,
+	FILE *in, rspamd_client_callback cb,
+	gpointer ud, GError **err)
+{
+	GString *body = NULL;
+	GHashTable *headers = attrs;
+	gchar *p;
+	gsize remain, old_len, control_len = 0;
+
 	if (in != NULL) {
+		body = rspamd_client_body_start (conn, attrs, &headers, BUFSIZ);
+		control_len = body->len;
+
 		/* Read input stream */
-		req->msg->body = g_string_sized_new (BUFSIZ);
 		while (!feof (in)) {
-			p = req->msg->body->str + req->msg->body->len;
-			remain = req->msg->body->allocated_len - req->msg->body->len - 1;
+			p = body->str + body->len;
+			remain = body->allocated_len - body->len - 1;
 			if (remain == 0) {
-				old_len = req->msg->body->len;
-				g_string_set_size (req->msg->body, old_len * 2);
-				req->msg->body->len = old_len;
+				old_len = body->len;
+				g_string_set_size (body, old_len * 2);
+				body->len = old_len;
 				continue;
 			}
 			remain = fread (p, 1, remain, in);
 			if (remain > 0) {
-				req->msg->body->len += remain;
-				req->msg->body->str[req->msg->body->len] = '\0';
+				body->len += remain;
+				body->str[body->len] = '\0';
 			}
 		}
 		if (ferror (in) != 0) {
 			g_set_error (err, RCLIENT_ERROR, ferror (
 					in), "input IO error: %s", strerror (ferror (in)));
-			g_slice_free1 (sizeof (struct rspamd_client_request), req);
+			g_string_free (body, TRUE);
+
+			if (headers != attrs) {
+				g_hash_table_unref (headers);
+			}
+
 			return FALSE;
 		}
 	}
-	else {
-		req->msg->body = NULL;
-	}
 
-	/* Convert headers */
-	g_hash_table_iter_init (&it, attrs);
-	while (g_hash_table_iter_next (&it, (gpointer *)&hn, (gpointer *)&hv)) {
-		rspamd_http_message_add_header (req->msg, hn, hv);
-	}
+	return rspamd_client_send (conn, command, attrs, headers, body,
+			control_len, cb, ud);
+}
 
-	g_string_append_c (req->msg->url, '/');
-	g_string_append (req->msg->url, command);
+gboolean
+rspamd_client_command_data (struct rspamd_client_connection *conn,
+	const gchar *command, GHashTable *attrs,
+	const gchar *data, gsize len, rspamd_client_callback cb,
+	gpointer ud, GError **err)
+{
+	GString *body;
+	GHashTable *headers;
+	gsize control_len;
 
-	conn->req = req;
+	body = rspamd_client_body_start (conn, attrs, &headers, len + 1);
+	control_len = body->len;
+	g_string_append_len (body, data, len);
 
-	rspamd_http_connection_write_message (conn->http_conn, req->msg, NULL,
-		"text/plain", req, conn->fd, &conn->timeout, conn->ev_base);
+	return rspamd_client_send (conn, command, attrs, headers, body,
+			control_len, cb, ud);
+}
 
-	return TRUE;
+void
+rspamd_client_set_compact (struct rspamd_client_connection *conn,
+	gboolean compact)
+{
+	conn->compact = compact;
+}
+
+gboolean
+rspamd_client_is_persistent (struct rspamd_client_connection *conn)
+{
+	return conn->persistent;
 }
 
 void
@@ -80,6 +80,44 @@ gboolean rspamd_client_command (
 	gpointer ud,
 	GError **err);
 
+/**
+ * Start rspamd command with a message in memory
+ * @param conn connection object
+ * @param command command name
+ * @param attrs additional attributes
+ * @param data message data, it is copied to the request
+ * @param len length of message
+ * @param cb callback to be called on command completion
+ * @param ud opaque user data
+ * @return
+ */
+gboolean rspamd_client_command_data (
+	struct rspamd_client_connection *conn,
+	const gchar *command,
+	GHashTable *attrs,
+	const gchar *data,
+	gsize len,
+	rspamd_client_callback cb,
+	gpointer ud,
+	GError **err);
+
+/**
+ * Use compact protocol for the following commands: request attributes are
+ * passed in a binary control chunk and the reply is requested in msgpack
+ * @param conn connection object
+ * @param compact TRUE to enable compact protocol
+ */
+void rspamd_client_set_compact (struct rspamd_client_connection *conn,
+	gboolean compact);
+
+/**
+ * Check whether rspamd has kept connection alive after the last command, so
+ * it could be used for the next command
+ * @param conn connection object
+ * @return TRUE if connection can be reused
+ */
+gboolean rspamd_client_is_persistent (struct rspamd_client_connection *conn);
+
 /**
  * Destroy a connection to rspamd
  * @param conn
@@ -26,16 +26,25 @@
 #include "libserver/dynamic_cfg.h"
 #include "libutil/rrd.h"
 #include "libutil/map.h"
+#include "libserver/protocol.h"
 #include "libstat/stat_api.h"
+#include "lua/lua_common.h"
 #include "main.h"
 #include "utlist.h"
 
 #include "blake2.h" 
 #include "cryptobox.h"
 #include "ottery.h"
+#include "xxhash.h"
 
 /* 60 seconds for worker's IO */
 #define DEFAULT_WORKER_IO_TIMEOUT 60000
+#define DEFAULT_LEARN_CONCURRENCY 16
+/* Interval of stat snapshots updates in seconds */
+#define DEFAULT_STATS_INTERVAL 1.0
+#define STATSD_DEFAULT_PORT 8125
+/* Metrics are batched to datagrams that are not fragmented */
+#define STATSD_PACKET_SIZE 1432
 
 /* HTTP paths */
 #define PATH_AUTH "/auth"
@@ -48,6 +57,7 @@
 #define PATH_HISTORY "/history"
 #define PATH_LEARN_SPAM "/learnspam"
 #define PATH_LEARN_HAM "/learnham"
+#define PATH_LEARN_BATCH "/learnbatch"
 #define PATH_SAVE_ACTIONS "/saveactions"
 #define PATH_SAVE_SYMBOLS "/savesymbols"
 #define PATH_SAVE_MAP "/savemap"
@@ -55,7 +65,11 @@
 #define PATH_CHECK "/check"
 #define PATH_STAT "/stat"
 #define PATH_STAT_RESET "/statreset"
+#define PATH_STAT_RESIZE "/statresize"
 #define PATH_COUNTERS "/counters"
+#define PATH_METRICS "/metrics"
+#define PATH_TIMESERIES "/timeseries"
+#define PATH_LUA_PROFILE "/luaprofile"
 
 /* Graph colors */
 #define COLOR_CLEAN "#58A458"
@@ -79,6 +93,14 @@ worker_t controller_worker = {
 	TRUE,                   /* Killable */
 	SOCK_STREAM             /* TCP socket */
 };
+/*
+ * JSON reply that is updated periodically and sent as is
+ */
+struct rspamd_controller_snapshot {
+	GString *body;
+	gchar etag[24];
+};
+
 /*
  * Worker's context
  */
@@ -114,6 +136,10 @@ struct rspamd_controller_worker_ctx {
 	/* Static files dir */
 	gchar *static_files_dir;
 
+	/* Normal workers that process /scan and /check requests */
+	gchar *scan_servers;
+	struct upstream_list *scan_upstreams;
+
 	/* Custom commands registered by plugins */
 	GHashTable *custom_commands;
 
@@ -122,17 +148,81 @@ struct rspamd_controller_worker_ctx {
 
 	/* Local keypair */
 	gpointer key;
+
+	/* Limit of messages processed simultaneously in a learn batch */
+	guint32 learn_concurrency;
+
+	/* Precomputed replies for stat and counters commands */
+	gdouble stats_interval;
+	struct event stats_ev;
+	struct rspamd_controller_snapshot stat_snap;
+	struct rspamd_controller_snapshot counters_snap;
+
+	/* Push of metrics to statsd */
+	gint statsd_fd;
+	struct event statsd_ev;
+	struct rspamd_histogram *statsd_stages;
 };
 
+struct rspamd_controller_learn_batch;
+
 struct rspamd_controller_session {
 	struct rspamd_controller_worker_ctx *ctx;
 	rspamd_mempool_t *pool;
 	struct rspamd_task *task;
+	struct rspamd_controller_learn_batch *learn_batch;
+	struct rspamd_controller_history_wait *history_wait;
+	struct rspamd_controller_scan_forward *scan_forward;
 	struct rspamd_classifier_config *cl;
 	rspamd_inet_addr_t *from_addr;
 	gboolean is_spam;
 };
 
+/*
+ * History request waiting for rows newer than `since`, rows are written by
+ * other processes, so the shared history is checked periodically
+ */
+struct rspamd_controller_history_wait {
+	struct rspamd_http_connection_entry *conn_ent;
+	struct roll_history *history;
+	struct event ev;
+	guint since;
+	gdouble deadline;
+};
+
+/*
+ * Scan request forwarded to a normal worker, code, status and body of its
+ * reply are relayed to the client
+ */
+struct rspamd_controller_scan_forward {
+	struct rspamd_http_connection_entry *conn_ent;
+	struct rspamd_http_connection *conn;
+	struct upstream *up;
+	gdouble start;
+	gint fd;
+};
+
+/* Interval of checks for new history rows */
+#define HISTORY_WAIT_INTERVAL 0.5
+/* Maximum time that a history request waits for new rows */
+#define HISTORY_WAIT_MAX 60.0
+
+/*
+ * Messages of a batch are processed simultaneously and their tokens are
+ * learned at once when all messages are processed
+ */
+struct rspamd_controller_learn_batch {
+	struct rspamd_http_connection_entry *conn_ent;
+	struct rspamd_stat_learn_batch *learn;
+	GArray *frames;
+	GPtrArray *tasks;
+	guint next;
+	guint pending;
+	guint skipped;
+	guint failed;
+	gboolean scheduling;
+};
+
 
 const struct rspamd_controller_pbkdf pbkdf_list[] = {
 	{
@@ -821,56 +911,33 @@ rspamd_controller_handle_pie_chart (
 	return 0;
 }
 
-/*
- * History command handler:
- * request: /history
- * headers: Password
- * reply: json [
- *      { label: "Foo", data: 11 },
- *      { label: "Bar", data: 20 },
- *      {...}
- * ]
- */
-static int
-rspamd_controller_handle_history (struct rspamd_http_connection_entry *conn_ent,
-	struct rspamd_http_message *msg)
+/* Send history rows with ids greater than `since` from the oldest one */
+static void
+rspamd_controller_send_history (struct rspamd_http_connection_entry *conn_ent,
+	struct roll_history *history, guint since)
 {
-	struct rspamd_controller_session *session = conn_ent->ud;
-	struct rspamd_controller_worker_ctx *ctx;
-	struct roll_history_row *row;
-	struct roll_history copied_history;
-	gint i, rows_proc, row_num;
+	struct roll_history_row copied_row, *row = &copied_row;
+	guint i, row_num;
 	struct tm *tm;
 	gchar timebuf[32];
 	ucl_object_t *top, *obj;
 
-	ctx = session->ctx;
-
-	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
-		return 0;
-	}
-
 	top = ucl_object_typed_new (UCL_ARRAY);
 
-	/* Set lock on history */
-	rspamd_mempool_lock_mutex (ctx->srv->history->mtx);
-	ctx->srv->history->need_lock = TRUE;
-	/* Copy locked */
-	memcpy (&copied_history, ctx->srv->history, sizeof (copied_history));
-	rspamd_mempool_unlock_mutex (ctx->srv->history->mtx);
-
-	/* Go through all rows */
-	row_num = copied_history.cur_row;
-	for (i = 0, rows_proc = 0; i < HISTORY_MAX_ROWS; i++, row_num++) {
-		if (row_num == HISTORY_MAX_ROWS) {
+	/* Go through all rows starting from the oldest one */
+	row_num = g_atomic_int_get ((gint *)&history->cur_row) % history->nrows;
+	for (i = 0; i < history->nrows; i++, row_num++) {
+		if (row_num == history->nrows) {
 			row_num = 0;
 		}
-		row = &copied_history.rows[row_num];
 		/* Get only completed rows */
-		if (row->completed) {
+		if (rspamd_roll_history_get_row (history, row_num, row) &&
+				ROLL_HISTORY_ROW_ID (row) > since) {
 			tm = localtime (&row->tv.tv_sec);
 			strftime (timebuf, sizeof (timebuf) - 1, "%Y-%m-%d %H:%M:%S", tm);
 			obj = ucl_object_typed_new (UCL_OBJECT);
+			ucl_object_insert_key (obj, ucl_object_fromint (
+					ROLL_HISTORY_ROW_ID (row)), "row", 0, false);
 			ucl_object_insert_key (obj, ucl_object_fromstring (
 					timebuf),		  "time", 0, false);
 			ucl_object_insert_key (obj, ucl_object_fromstring (
@@ -896,12 +963,102 @@ rspamd_controller_handle_history (struct rspamd_http_connection_entry *conn_ent,
 						row->user), "user", 0, false);
 			}
 			ucl_array_append (top, obj);
-			rows_proc++;
 		}
 	}
 
 	rspamd_controller_send_ucl (conn_ent, top);
 	ucl_object_unref (top);
+}
+
+static void
+rspamd_controller_history_wait_free (struct rspamd_controller_history_wait *w)
+{
+	event_del (&w->ev);
+	g_slice_free1 (sizeof (*w), w);
+}
+
+static void
+rspamd_controller_history_wait_cb (gint fd, short what, gpointer ud)
+{
+	struct rspamd_controller_history_wait *w = ud;
+	struct rspamd_controller_session *session = w->conn_ent->ud;
+	struct timeval tv;
+
+	if ((guint)g_atomic_int_get ((gint *)&w->history->cur_row) > w->since ||
+			rspamd_get_ticks () >= w->deadline) {
+		session->history_wait = NULL;
+		rspamd_controller_send_history (w->conn_ent, w->history, w->since);
+		rspamd_controller_history_wait_free (w);
+	}
+	else {
+		double_to_tv (HISTORY_WAIT_INTERVAL, &tv);
+		evtimer_add (&w->ev, &tv);
+	}
+}
+
+/*
+ * History command handler:
+ * request: /history
+ * headers: Password, Since (optional), Wait (optional)
+ * reply: json [
+ *      { row: 12, time: "...", id: "...", action: "...", ... },
+ *      {...}
+ * ]
+ * If `Since` is set, only rows with `row` greater than its value are returned;
+ * if `Wait` is set as well, then the reply is delayed for up to `Wait` seconds
+ * until some newer rows appear
+ */
+static int
+rspamd_controller_handle_history (struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_controller_worker_ctx *ctx;
+	struct rspamd_controller_history_wait *w;
+	struct roll_history *history;
+	const GString *hdr;
+	gulong since = 0, wait = 0;
+	struct timeval tv;
+
+	ctx = session->ctx;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	history = ctx->srv->history;
+	hdr = rspamd_http_message_find_header (msg, "Since");
+
+	if (hdr != NULL && !rspamd_strtoul (hdr->str, hdr->len, &since)) {
+		rspamd_controller_send_error (conn_ent, 400, "Invalid since");
+		return 0;
+	}
+
+	hdr = rspamd_http_message_find_header (msg, "Wait");
+
+	if (hdr != NULL && !rspamd_strtoul (hdr->str, hdr->len, &wait)) {
+		rspamd_controller_send_error (conn_ent, 400, "Invalid wait");
+		return 0;
+	}
+
+	if (wait > 0 && session->history_wait == NULL &&
+			(guint)g_atomic_int_get ((gint *)&history->cur_row) <= since) {
+		/* Long poll for new rows */
+		w = g_slice_alloc0 (sizeof (*w));
+		w->conn_ent = conn_ent;
+		w->history = history;
+		w->since = since;
+		w->deadline = rspamd_get_ticks () + MIN (wait, HISTORY_WAIT_MAX);
+		evtimer_set (&w->ev, rspamd_controller_history_wait_cb, w);
+		event_base_set (ctx->ev_base, &w->ev);
+		double_to_tv (HISTORY_WAIT_INTERVAL, &tv);
+		evtimer_add (&w->ev, &tv);
+		session->history_wait = w;
+
+		return 0;
+	}
+
+	rspamd_controller_send_history (conn_ent, history, since);
 
 	return 0;
 }
@@ -1048,95 +1205,181 @@ rspamd_controller_handle_learnham (
 	return rspamd_controller_handle_learn_common (conn_ent, msg, FALSE);
 }
 
-/*
- * Scan command handler:
- * request: /scan
- * headers: Password
- * input: plaintext data
- * reply: json {scan data} or {"error":"error message"}
- */
-static int
-rspamd_controller_handle_scan (struct rspamd_http_connection_entry *conn_ent,
-	struct rspamd_http_message *msg)
+static void rspamd_controller_learn_batch_schedule (
+	struct rspamd_controller_learn_batch *batch);
+
+static gboolean
+rspamd_controller_learn_batch_fin_task (void *ud)
 {
-	struct rspamd_controller_session *session = conn_ent->ud;
-	struct rspamd_controller_worker_ctx *ctx;
-	struct rspamd_task *task;
+	struct rspamd_task *task = ud;
+	struct rspamd_controller_learn_batch *batch = task->fin_arg;
+	GError *err = NULL;
 
-	ctx = session->ctx;
+	if (rspamd_stat_learn_batch_add (batch->learn, task, task->cfg->lua_state,
+			&err) != RSPAMD_STAT_PROCESS_OK) {
+		if (err != NULL && err->code == 404) {
+			/* Already learned */
+			batch->skipped ++;
+		}
+		else {
+			batch->failed ++;
+		}
 
-	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
-		return 0;
+		if (err != NULL) {
+			msg_info ("cannot learn <%s>: %s", task->message_id, err->message);
+			g_error_free (err);
+		}
 	}
 
-	if (msg->body == NULL || msg->body->len == 0) {
-		msg_err ("got zero length body, cannot continue");
-		rspamd_controller_send_error (conn_ent,
-			400,
-			"Empty body is not permitted");
-		return 0;
-	}
+	batch->pending --;
+	rspamd_controller_learn_batch_schedule (batch);
 
-	task = rspamd_task_new (session->ctx->worker);
-	task->ev_base = session->ctx->ev_base;
+	return TRUE;
+}
+
+static void
+rspamd_controller_learn_batch_process_frame (
+	struct rspamd_controller_learn_batch *batch,
+	guint idx)
+{
+	struct rspamd_controller_session *session = batch->conn_ent->ud;
+	struct rspamd_controller_worker_ctx *ctx = session->ctx;
+	struct rspamd_protocol_batch_frame *frame;
+	struct rspamd_task *task;
 
+	frame = &g_array_index (batch->frames, struct rspamd_protocol_batch_frame,
+			idx);
+	task = rspamd_task_new (ctx->worker);
 	task->resolver = ctx->resolver;
 	task->ev_base = ctx->ev_base;
-
 	task->s = new_async_session (session->pool,
-			rspamd_controller_check_fin_task,
+			rspamd_controller_learn_batch_fin_task,
 			NULL,
 			rspamd_task_free_hard,
 			task);
 	task->s->wanna_die = TRUE;
-	task->fin_arg = conn_ent;
-	task->http_conn = rspamd_http_connection_ref (conn_ent->conn);
-	task->sock = conn_ent->conn->fd;
-
-	/* XXX: handle encrypted messages */
-	if (!rspamd_task_process (task, msg, msg->body->str, msg->body->len, NULL, FALSE)) {
-		msg_warn ("filters cannot be processed for %s", task->message_id);
-		rspamd_controller_send_error (conn_ent, 500, task->last_error);
-		destroy_session (task->s);
-		return 0;
+	task->fin_arg = batch;
+	/* Tasks own backends runtime, so they are kept until the batch is done */
+	g_ptr_array_add (batch->tasks, task);
+	batch->pending ++;
+
+	if (!rspamd_task_process (task, NULL, frame->start, frame->len, NULL,
+			FALSE)) {
+		msg_warn ("filters cannot be processed for message %ud of batch", idx);
+		batch->failed ++;
+		batch->pending --;
+		return;
 	}
 
-	session->task = task;
 	check_session_pending (task->s);
+}
 
-	return 0;
+static void
+rspamd_controller_learn_batch_reply (
+	struct rspamd_controller_learn_batch *batch)
+{
+	struct rspamd_controller_session *session = batch->conn_ent->ud;
+	ucl_object_t *obj;
+	guint learned;
+
+	learned = rspamd_stat_learn_batch_commit (batch->learn);
+	msg_info ("<%s> learned %ud messages as %s, %ud skipped, %ud failed",
+		rspamd_inet_address_to_string (session->from_addr),
+		learned, session->is_spam ? "spam" : "ham",
+		batch->skipped, batch->failed);
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_frombool (true), "success", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (learned), "learned", 0,
+		false);
+	ucl_object_insert_key (obj, ucl_object_fromint (batch->skipped), "skipped",
+		0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (batch->failed), "failed",
+		0, false);
+	rspamd_controller_send_ucl (batch->conn_ent, obj);
+	ucl_object_unref (obj);
+}
+
+static void
+rspamd_controller_learn_batch_schedule (
+	struct rspamd_controller_learn_batch *batch)
+{
+	struct rspamd_controller_session *session = batch->conn_ent->ud;
+	guint limit = MAX (session->ctx->learn_concurrency, 1);
+
+	/* Messages could be finished synchronously */
+	if (batch->scheduling) {
+		return;
+	}
+
+	batch->scheduling = TRUE;
+
+	while (batch->pending < limit && batch->next < batch->frames->len) {
+		rspamd_controller_learn_batch_process_frame (batch, batch->next ++);
+	}
+
+	batch->scheduling = FALSE;
+
+	if (batch->pending == 0 && batch->next == batch->frames->len) {
+		rspamd_controller_learn_batch_reply (batch);
+	}
+}
+
+static void
+rspamd_controller_learn_batch_destroy (
+	struct rspamd_controller_learn_batch *batch)
+{
+	struct rspamd_task *task;
+	guint i;
+
+	for (i = 0; i < batch->tasks->len; i ++) {
+		task = g_ptr_array_index (batch->tasks, i);
+		destroy_session (task->s);
+	}
+
+	g_ptr_array_free (batch->tasks, TRUE);
+	g_array_free (batch->frames, TRUE);
+	rspamd_stat_learn_batch_destroy (batch->learn);
+	g_slice_free1 (sizeof (*batch), batch);
 }
 
 /*
- * Save actions command handler:
- * request: /saveactions
- * headers: Password
- * input: json array [<spam>,<probable spam>,<greylist>]
- * reply: json {"success":true} or {"error":"error message"}
+ * Learn batch command handler:
+ * request: /learnbatch
+ * headers: Password, Class
+ * input: messages each preceded by its length and a newline
+ * reply: json {"success":true,"learned":<n>,"skipped":<n>,"failed":<n>} or
+ * {"error":"error message"}
  */
 static int
-rspamd_controller_handle_saveactions (
+rspamd_controller_handle_learnbatch (
 	struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg)
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
-	struct ucl_parser *parser;
-	struct metric *metric;
-	ucl_object_t *obj;
-	const ucl_object_t *cur;
-	struct rspamd_controller_worker_ctx *ctx;
-	const gchar *error;
-	gdouble score;
-	gint i, added = 0;
-	enum rspamd_metric_action act;
-	ucl_object_iter_t it = NULL;
-
-	ctx = session->ctx;
+	struct rspamd_controller_learn_batch *batch;
+	const GString *cls;
+	gboolean is_spam;
 
 	if (!rspamd_controller_check_password (conn_ent, session, msg, TRUE)) {
 		return 0;
 	}
 
+	cls = rspamd_http_message_find_header (msg, "Class");
+
+	if (cls != NULL && g_ascii_strcasecmp (cls->str, "spam") == 0) {
+		is_spam = TRUE;
+	}
+	else if (cls != NULL && g_ascii_strcasecmp (cls->str, "ham") == 0) {
+		is_spam = FALSE;
+	}
+	else {
+		msg_info ("absent or invalid class of messages");
+		rspamd_controller_send_error (conn_ent, 400,
+			"400 class header missing or invalid");
+		return 0;
+	}
+
 	if (msg->body == NULL || msg->body->len == 0) {
 		msg_err ("got zero length body, cannot continue");
 		rspamd_controller_send_error (conn_ent,
@@ -1145,48 +1388,331 @@ rspamd_controller_handle_saveactions (
 		return 0;
 	}
 
-	metric = g_hash_table_lookup (ctx->cfg->metrics, DEFAULT_METRIC);
-	if (metric == NULL) {
-		msg_err ("cannot find default metric");
-		rspamd_controller_send_error (conn_ent, 500,
-			"Default metric is absent");
+	/* XXX: now work with only bayes */
+	if (rspamd_config_find_classifier (session->ctx->cfg, "bayes") == NULL) {
+		rspamd_controller_send_error (conn_ent, 400, "Classifier not found");
 		return 0;
 	}
 
-	/* Now check for dynamic config */
-	if (!ctx->cfg->dynamic_conf) {
-		msg_err ("dynamic conf has not been defined");
-		rspamd_controller_send_error (conn_ent,
-			500,
-			"No dynamic_rules setting defined");
+	batch = g_slice_alloc0 (sizeof (*batch));
+	batch->conn_ent = conn_ent;
+	batch->frames = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_protocol_batch_frame));
+
+	if (!rspamd_protocol_parse_batch (msg->body->str, msg->body->len,
+			batch->frames)) {
+		msg_err ("got invalid batch of %z bytes", msg->body->len);
+		g_array_free (batch->frames, TRUE);
+		g_slice_free1 (sizeof (*batch), batch);
+		rspamd_controller_send_error (conn_ent, 400, "Invalid batch");
 		return 0;
 	}
 
-	parser = ucl_parser_new (0);
-	ucl_parser_add_chunk (parser, msg->body->str, msg->body->len);
+	batch->tasks = g_ptr_array_sized_new (batch->frames->len);
+	batch->learn = rspamd_stat_learn_batch_new (is_spam);
+	session->learn_batch = batch;
+	session->is_spam = is_spam;
 
-	if ((error = ucl_parser_get_error (parser)) != NULL) {
-		msg_err ("cannot parse input: %s", error);
-		rspamd_controller_send_error (conn_ent, 400, "Cannot parse input");
-		ucl_parser_free (parser);
-		return 0;
-	}
+	msg_info ("<%s> got batch of %ud messages to learn as %s",
+		rspamd_inet_address_to_string (session->from_addr),
+		batch->frames->len, is_spam ? "spam" : "ham");
+	rspamd_controller_learn_batch_schedule (batch);
 
-	obj = ucl_parser_get_object (parser);
-	ucl_parser_free (parser);
+	return 0;
+}
 
-	if (obj->type != UCL_ARRAY || obj->len != 3) {
-		msg_err ("input is not an array of 3 elements");
-		rspamd_controller_send_error (conn_ent, 400, "Cannot parse input");
-		ucl_object_unref (obj);
-		return 0;
-	}
+/*
+ * Scan command handler:
+ * request: /scan
+ * headers: Password
+ * input: plaintext data
+ * reply: json {scan data} or {"error":"error message"}
+ */
+static void
+rspamd_controller_scan_forward_free (struct rspamd_controller_scan_forward *fwd)
+{
+	rspamd_http_connection_unref (fwd->conn);
+	close (fwd->fd);
+	g_slice_free1 (sizeof (*fwd), fwd);
+}
 
-	for (i = 0; i < 3; i++) {
-		cur = ucl_iterate_object (obj, &it, TRUE);
-		if (cur == NULL) {
-			break;
-		}
+static void
+rspamd_controller_scan_forward_error (struct rspamd_http_connection *conn,
+	GError *err)
+{
+	struct rspamd_controller_scan_forward *fwd = conn->ud;
+	struct rspamd_controller_session *session = fwd->conn_ent->ud;
+
+	msg_info ("cannot scan message by %s: %s", rspamd_upstream_name (fwd->up),
+			err->message);
+	rspamd_upstream_fail (fwd->up);
+	session->scan_forward = NULL;
+	rspamd_controller_send_error (fwd->conn_ent, 502, "%s", err->message);
+	rspamd_controller_scan_forward_free (fwd);
+}
+
+static int
+rspamd_controller_scan_forward_finish (struct rspamd_http_connection *conn,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_scan_forward *fwd = conn->ud;
+	struct rspamd_controller_session *session = fwd->conn_ent->ud;
+	struct rspamd_http_connection_entry *conn_ent = fwd->conn_ent;
+	struct rspamd_http_message *reply;
+
+	rspamd_upstream_ok (fwd->up);
+	rspamd_upstream_latency (fwd->up, rspamd_get_ticks () - fwd->start);
+
+	reply = rspamd_http_new_message (HTTP_RESPONSE);
+	reply->date = time (NULL);
+	reply->code = msg->code;
+
+	if (msg->status != NULL) {
+		reply->status = g_string_new_len (msg->status->str, msg->status->len);
+	}
+
+	if (msg->body != NULL && msg->body->len > 0) {
+		reply->body = g_string_new_len (msg->body->str, msg->body->len);
+	}
+
+	session->scan_forward = NULL;
+	rspamd_controller_scan_forward_free (fwd);
+
+	rspamd_http_connection_reset (conn_ent->conn);
+	rspamd_http_connection_write_message (conn_ent->conn, reply, NULL,
+		"application/json", conn_ent, conn_ent->conn->fd, conn_ent->rt->ptv,
+		conn_ent->rt->ev_base);
+
+	return 0;
+}
+
+/* Names of http headers are not zero terminated */
+static gboolean
+rspamd_controller_header_is (const GString *name, const gchar *hdr)
+{
+	gsize len = strlen (hdr);
+
+	return name->len == len && g_ascii_strncasecmp (name->str, hdr, len) == 0;
+}
+
+/* Send a scan request to one of normal workers */
+static void
+rspamd_controller_scan_forward (struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_controller_worker_ctx *ctx = session->ctx;
+	struct rspamd_controller_scan_forward *fwd;
+	struct rspamd_http_message *req;
+	struct rspamd_http_header *h;
+	struct upstream *up;
+	gchar *hn, *hv;
+	gint fd;
+
+	up = rspamd_upstream_get (ctx->scan_upstreams, RSPAMD_UPSTREAM_ROUND_ROBIN);
+
+	if (up == NULL) {
+		rspamd_controller_send_error (conn_ent, 502, "No scan servers alive");
+		return;
+	}
+
+	fd = rspamd_inet_address_connect (rspamd_upstream_addr (up), SOCK_STREAM,
+			TRUE);
+
+	if (fd == -1) {
+		rspamd_upstream_fail (up);
+		rspamd_controller_send_error (conn_ent, 502,
+				"Cannot connect to %s", rspamd_upstream_name (up));
+		return;
+	}
+
+	req = rspamd_http_new_message (HTTP_REQUEST);
+	req->method = HTTP_POST;
+	g_string_assign (req->url, "/check");
+	req->body = g_string_new_len (msg->body->str, msg->body->len);
+
+	/*
+	 * Scan options of the client are passed as is. The reply is compressed
+	 * for the client by the controller's connection, so the worker should not
+	 * compress it
+	 */
+	LL_FOREACH (msg->headers, h) {
+		if (rspamd_controller_header_is (h->name, "Password") ||
+				rspamd_controller_header_is (h->name, "Content-Length") ||
+				rspamd_controller_header_is (h->name, "Connection") ||
+				rspamd_controller_header_is (h->name, "Host") ||
+				rspamd_controller_header_is (h->name, "Accept-Encoding")) {
+			continue;
+		}
+
+		hn = g_strndup (h->name->str, h->name->len);
+		hv = g_strndup (h->value->str, h->value->len);
+		rspamd_http_message_add_header (req, hn, hv);
+		g_free (hn);
+		g_free (hv);
+	}
+
+	if (rspamd_http_message_find_header (msg, "IP") == NULL &&
+			session->from_addr != NULL) {
+		/* Scan as if the message came from the client of controller */
+		rspamd_http_message_add_header (req, "IP",
+				rspamd_inet_address_to_string (session->from_addr));
+	}
+
+	fwd = g_slice_alloc0 (sizeof (*fwd));
+	fwd->conn_ent = conn_ent;
+	fwd->up = up;
+	fwd->fd = fd;
+	fwd->start = rspamd_get_ticks ();
+	fwd->conn = rspamd_http_connection_new (NULL,
+			rspamd_controller_scan_forward_error,
+			rspamd_controller_scan_forward_finish,
+			RSPAMD_HTTP_CLIENT_SIMPLE,
+			RSPAMD_HTTP_CLIENT, NULL);
+	session->scan_forward = fwd;
+
+	rspamd_http_connection_write_message (fwd->conn, req, NULL,
+			"application/octet-stream", fwd, fd, &ctx->io_tv, ctx->ev_base);
+}
+
+static int
+rspamd_controller_handle_scan (struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_controller_worker_ctx *ctx;
+	struct rspamd_task *task;
+
+	ctx = session->ctx;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	if (msg->body == NULL || msg->body->len == 0) {
+		msg_err ("got zero length body, cannot continue");
+		rspamd_controller_send_error (conn_ent,
+			400,
+			"Empty body is not permitted");
+		return 0;
+	}
+
+	if (ctx->scan_upstreams != NULL) {
+		/* Controller's loop is not blocked by scanning */
+		rspamd_controller_scan_forward (conn_ent, msg);
+		return 0;
+	}
+
+	task = rspamd_task_new (session->ctx->worker);
+	task->ev_base = session->ctx->ev_base;
+
+	task->resolver = ctx->resolver;
+	task->ev_base = ctx->ev_base;
+
+	task->s = new_async_session (session->pool,
+			rspamd_controller_check_fin_task,
+			NULL,
+			rspamd_task_free_hard,
+			task);
+	task->s->wanna_die = TRUE;
+	task->fin_arg = conn_ent;
+	task->http_conn = rspamd_http_connection_ref (conn_ent->conn);
+	task->sock = conn_ent->conn->fd;
+
+	/* XXX: handle encrypted messages */
+	if (!rspamd_task_process (task, msg, msg->body->str, msg->body->len, NULL, FALSE)) {
+		msg_warn ("filters cannot be processed for %s", task->message_id);
+		rspamd_controller_send_error (conn_ent, 500, task->last_error);
+		destroy_session (task->s);
+		return 0;
+	}
+
+	session->task = task;
+	check_session_pending (task->s);
+
+	return 0;
+}
+
+/*
+ * Save actions command handler:
+ * request: /saveactions
+ * headers: Password
+ * input: json array [<spam>,<probable spam>,<greylist>]
+ * reply: json {"success":true} or {"error":"error message"}
+ */
+static int
+rspamd_controller_handle_saveactions (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct ucl_parser *parser;
+	struct metric *metric;
+	ucl_object_t *obj;
+	const ucl_object_t *cur;
+	struct rspamd_controller_worker_ctx *ctx;
+	const gchar *error;
+	gdouble score;
+	gint i, added = 0;
+	enum rspamd_metric_action act;
+	ucl_object_iter_t it = NULL;
+
+	ctx = session->ctx;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, TRUE)) {
+		return 0;
+	}
+
+	if (msg->body == NULL || msg->body->len == 0) {
+		msg_err ("got zero length body, cannot continue");
+		rspamd_controller_send_error (conn_ent,
+			400,
+			"Empty body is not permitted");
+		return 0;
+	}
+
+	metric = g_hash_table_lookup (ctx->cfg->metrics, DEFAULT_METRIC);
+	if (metric == NULL) {
+		msg_err ("cannot find default metric");
+		rspamd_controller_send_error (conn_ent, 500,
+			"Default metric is absent");
+		return 0;
+	}
+
+	/* Now check for dynamic config */
+	if (!ctx->cfg->dynamic_conf) {
+		msg_err ("dynamic conf has not been defined");
+		rspamd_controller_send_error (conn_ent,
+			500,
+			"No dynamic_rules setting defined");
+		return 0;
+	}
+
+	parser = ucl_parser_new (0);
+	ucl_parser_add_chunk (parser, msg->body->str, msg->body->len);
+
+	if ((error = ucl_parser_get_error (parser)) != NULL) {
+		msg_err ("cannot parse input: %s", error);
+		rspamd_controller_send_error (conn_ent, 400, "Cannot parse input");
+		ucl_parser_free (parser);
+		return 0;
+	}
+
+	obj = ucl_parser_get_object (parser);
+	ucl_parser_free (parser);
+
+	if (obj->type != UCL_ARRAY || obj->len != 3) {
+		msg_err ("input is not an array of 3 elements");
+		rspamd_controller_send_error (conn_ent, 400, "Cannot parse input");
+		ucl_object_unref (obj);
+		return 0;
+	}
+
+	for (i = 0; i < 3; i++) {
+		cur = ucl_iterate_object (obj, &it, TRUE);
+		if (cur == NULL) {
+			break;
+		}
 		switch (i) {
 		case 0:
 			act = METRIC_ACTION_REJECT;
@@ -1205,7 +1731,7 @@ rspamd_controller_handle_saveactions (
 		}
 	}
 
-	dump_dynamic_config (ctx->cfg);
+	dump_dynamic_config (ctx->cfg, ctx->ev_base);
 	msg_info ("<%s> modified %d actions",
 		rspamd_inet_address_to_string (session->from_addr),
 		added);
@@ -1316,7 +1842,7 @@ rspamd_controller_handle_savesymbols (
 		}
 	}
 
-	dump_dynamic_config (ctx->cfg);
+	dump_dynamic_config (ctx->cfg, ctx->ev_base);
 	msg_info ("<%s> modified %d symbols",
 			rspamd_inet_address_to_string (session->from_addr),
 			added);
@@ -1435,13 +1961,102 @@ rspamd_controller_handle_savemap (struct rspamd_http_connection_entry *conn_ent,
  * headers: Password
  * reply: json data
  */
-static int
-rspamd_controller_handle_stat_common (
-	struct rspamd_http_connection_entry *conn_ent,
-	struct rspamd_http_message *msg,
+static ucl_object_t *
+rspamd_controller_histogram_to_ucl (const struct rspamd_histogram *h)
+{
+	ucl_object_t *obj;
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromint (h->count), "count", 0,
+			false);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (h->count > 0 ?
+			h->sum / (gdouble)h->count / 1000.0 : 0.0), "avg", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (
+			rspamd_histogram_percentile (h, 50) / 1000.0), "p50", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (
+			rspamd_histogram_percentile (h, 90) / 1000.0), "p90", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (
+			rspamd_histogram_percentile (h, 99) / 1000.0), "p99", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (h->max / 1000.0),
+			"max", 0, false);
+
+	return obj;
+}
+
+static ucl_object_t *
+rspamd_controller_process_memory_to_ucl (pid_t pid, const gchar *type)
+{
+	ucl_object_t *obj;
+	gsize shared, private;
+
+	if (!rspamd_get_process_memory (pid, &shared, &private)) {
+		return NULL;
+	}
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromint (pid), "pid", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromstring (type), "type", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (shared), "shared", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (private), "private", 0,
+		false);
+
+	return obj;
+}
+
+/*
+ * Memory of the main process and all workers split to pages shared after fork
+ * and private pages of each process
+ */
+static ucl_object_t *
+rspamd_controller_workers_memory_to_ucl (struct rspamd_controller_worker_ctx *ctx,
+	struct rspamd_stat *stat)
+{
+	ucl_object_t *top, *obj;
+	guint i;
+
+	top = ucl_object_typed_new (UCL_ARRAY);
+	/* Main process might be not accessible after privileges are dropped */
+	obj = rspamd_controller_process_memory_to_ucl (ctx->srv->pid, "main");
+
+	if (obj != NULL) {
+		ucl_array_append (top, obj);
+	}
+
+	for (i = 0; i < RSPAMD_MAX_WORKERS_STAT; i ++) {
+		if (stat->workers[i].pid == 0) {
+			continue;
+		}
+
+		stat->workers[i].type[sizeof (stat->workers[i].type) - 1] = '\0';
+		obj = rspamd_controller_process_memory_to_ucl (stat->workers[i].pid,
+				stat->workers[i].type);
+
+		if (obj != NULL) {
+			ucl_object_insert_key (obj,
+					ucl_object_fromint (stat->workers[i].lua_gc_time),
+					"lua_gc_time", 0, false);
+			ucl_object_insert_key (obj,
+					ucl_object_fromint (stat->workers[i].lua_gc_steps),
+					"lua_gc_steps", 0, false);
+			ucl_object_insert_key (obj,
+					ucl_object_fromint (stat->workers[i].lua_gc_full),
+					"lua_gc_full", 0, false);
+			ucl_array_append (top, obj);
+		}
+	}
+
+	if (top->len == 0) {
+		ucl_object_unref (top);
+		return NULL;
+	}
+
+	return top;
+}
+
+static ucl_object_t *
+rspamd_controller_stat_to_ucl (struct rspamd_controller_worker_ctx *ctx,
 	gboolean do_reset)
 {
-	struct rspamd_controller_session *session = conn_ent->ud;
 	ucl_object_t *top, *sub;
 	gint i;
 	guint64 learned  = 0, spam = 0, ham = 0;
@@ -1449,7 +2064,9 @@ rspamd_controller_handle_stat_common (
 	struct rspamd_stat *stat, stat_copy;
 
 	rspamd_mempool_stat (&mem_st);
-	memcpy (&stat_copy, session->ctx->worker->srv->stat, sizeof (stat_copy));
+	rspamd_mempool_lock_mutex (ctx->worker->srv->stat_mtx);
+	memcpy (&stat_copy, ctx->worker->srv->stat, sizeof (stat_copy));
+	rspamd_mempool_unlock_mutex (ctx->worker->srv->stat_mtx);
 	stat = &stat_copy;
 	top = ucl_object_typed_new (UCL_OBJECT);
 
@@ -1468,7 +2085,7 @@ rspamd_controller_handle_stat_common (
 				ham += stat->actions_stat[i];
 			}
 			if (do_reset) {
-				session->ctx->worker->srv->stat->actions_stat[i] = 0;
+				ctx->worker->srv->stat->actions_stat[i] = 0;
 			}
 		}
 		ucl_object_insert_key (top, sub, "actions", 0, false);
@@ -1503,45 +2120,531 @@ rspamd_controller_handle_stat_common (
 	ucl_object_insert_key (top,
 		ucl_object_fromint (
 			mem_st.oversized_chunks), "chunks_oversized", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (mem_st.chunks_reused), "chunks_reused", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (mem_st.chunks_cached), "chunks_cached", 0, false);
 	ucl_object_insert_key (top,
 		ucl_object_fromint (stat->fuzzy_hashes), "fuzzy_stored", 0, false);
 	ucl_object_insert_key (top,
 		ucl_object_fromint (
 			stat->fuzzy_hashes_expired), "fuzzy_expired", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (
+			stat->fuzzy_updates_pending), "fuzzy_pending", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (
+			stat->fuzzy_expire_backlog), "fuzzy_expire_backlog", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (
+			stat->fuzzy_ratelimited), "fuzzy_ratelimited", 0, false);
+
+	/* Fuzzy epoch statistics */
+	sub = ucl_object_typed_new (UCL_ARRAY);
+
+	for (i = RSPAMD_FUZZY_EPOCH6; i < RSPAMD_FUZZY_EPOCH_MAX; i ++) {
+		ucl_array_append (sub, ucl_object_fromint (stat->fuzzy_hashes_checked[i]));
+	}
+
+	ucl_object_insert_key (top, sub, "fuzzy_checked", 0, false);
+	sub = ucl_object_typed_new (UCL_ARRAY);
+
+	for (i = RSPAMD_FUZZY_EPOCH6; i < RSPAMD_FUZZY_EPOCH_MAX; i ++) {
+		ucl_array_append (sub, ucl_object_fromint (stat->fuzzy_hashes_found[i]));
+	}
+
+	ucl_object_insert_key (top, sub, "fuzzy_found", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->keys_cache_hits), "keys_cache_hits", 0,
+		false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->keys_cache_misses), "keys_cache_misses", 0,
+		false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->dns_cache_hits), "dns_cache_hits", 0,
+		false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->dns_cache_misses), "dns_cache_misses", 0,
+		false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->stem_cache_hits), "stem_cache_hits", 0,
+		false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->stem_cache_misses), "stem_cache_misses", 0,
+		false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->fuzzy_cache_hits), "fuzzy_cache_hits", 0,
+		false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->fuzzy_cache_misses), "fuzzy_cache_misses", 0,
+		false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->classify_tasks), "classify_tasks", 0,
+		false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->classify_overflows), "classify_overflows", 0,
+		false);
+	ucl_object_insert_key (top,
+		ucl_object_fromdouble (stat->classify_tasks > 0 ?
+		stat->classify_queue_time / (gdouble)stat->classify_tasks / 1000.0 :
+		0.0), "classify_queue_avg", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->admission_rejected), "admission_rejected", 0,
+		false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->admission_skipped), "admission_skipped", 0,
+		false);
+
+	/* Latency of stages in milliseconds */
+	sub = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = 0; i < RSPAMD_TASK_STAGE_MAX; i ++) {
+		ucl_object_insert_key (sub,
+				rspamd_controller_histogram_to_ucl (&stat->stages[i]),
+				rspamd_task_stage_name (i), 0, false);
+
+		if (do_reset) {
+			rspamd_mempool_lock_mutex (ctx->worker->srv->stat_mtx);
+			rspamd_histogram_reset (&ctx->worker->srv->stat->stages[i]);
+			rspamd_mempool_unlock_mutex (ctx->worker->srv->stat_mtx);
+		}
+	}
+
+	ucl_object_insert_key (top, sub, "latency", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromdouble (stat->classify_queue_max / 1000.0),
+		"classify_queue_max", 0, false);
+
+	sub = rspamd_controller_workers_memory_to_ucl (ctx, stat);
+
+	if (sub != NULL) {
+		ucl_object_insert_key (top, sub, "workers_memory", 0, false);
+	}
+
+	/* Now write statistics for each statfile */
+
+	sub = rspamd_stat_statistics (ctx->cfg, &learned);
+	ucl_object_insert_key (top, sub, "statfiles", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (learned), "total_learns", 0, false);
+
+	if (do_reset) {
+		ctx->srv->stat->messages_scanned = 0;
+		ctx->srv->stat->messages_learned = 0;
+		ctx->srv->stat->connections_count = 0;
+		ctx->srv->stat->control_connections_count = 0;
+		memset (stat->fuzzy_hashes_checked, 0,
+				sizeof (stat->fuzzy_hashes_checked));
+		memset (stat->fuzzy_hashes_found, 0,
+				sizeof (stat->fuzzy_hashes_found));
+		stat->fuzzy_ratelimited = 0;
+		stat->keys_cache_hits = 0;
+		stat->keys_cache_misses = 0;
+		stat->dns_cache_hits = 0;
+		stat->dns_cache_misses = 0;
+		stat->stem_cache_hits = 0;
+		stat->stem_cache_misses = 0;
+		stat->fuzzy_cache_hits = 0;
+		stat->fuzzy_cache_misses = 0;
+		stat->classify_tasks = 0;
+		stat->classify_overflows = 0;
+		stat->classify_queue_time = 0;
+		stat->classify_queue_max = 0;
+		stat->admission_rejected = 0;
+		stat->admission_skipped = 0;
+		rspamd_mempool_stat_reset ();
+	}
+
+	return top;
+}
+
+static void
+rspamd_controller_snapshot_update (struct rspamd_controller_snapshot *snap,
+	ucl_object_t *obj)
+{
+	if (snap->body == NULL) {
+		snap->body = g_string_sized_new (BUFSIZ);
+	}
+	else {
+		g_string_truncate (snap->body, 0);
+	}
+
+	rspamd_ucl_emit_gstring (obj, UCL_EMIT_JSON_COMPACT, snap->body);
+	ucl_object_unref (obj);
+	rspamd_snprintf (snap->etag, sizeof (snap->etag), "\"%xL\"",
+			XXH64 (snap->body->str, snap->body->len, 0));
+}
+
+/*
+ * Send a snapshot or `304 Not Modified` if a client has the same version
+ */
+static gboolean
+rspamd_controller_send_snapshot (struct rspamd_http_connection_entry *entry,
+	struct rspamd_http_message *msg,
+	struct rspamd_controller_snapshot *snap)
+{
+	struct rspamd_http_message *reply;
+	const GString *etag;
+
+	if (snap->body == NULL) {
+		return FALSE;
+	}
+
+	reply = rspamd_http_new_message (HTTP_RESPONSE);
+	reply->date = time (NULL);
+	etag = rspamd_http_message_find_header (msg, "If-None-Match");
+
+	if (etag != NULL && etag->len == strlen (snap->etag) &&
+			memcmp (etag->str, snap->etag, etag->len) == 0) {
+		reply->code = 304;
+	}
+	else {
+		reply->code = 200;
+		reply->body = g_string_new_len (snap->body->str, snap->body->len);
+	}
+
+	rspamd_http_message_add_header (reply, "ETag", snap->etag);
+	rspamd_http_connection_reset (entry->conn);
+	rspamd_http_connection_write_message (entry->conn,
+		reply,
+		NULL,
+		"application/json",
+		entry,
+		entry->conn->fd,
+		entry->rt->ptv,
+		entry->rt->ev_base);
+	entry->is_reply = TRUE;
+
+	return TRUE;
+}
+
+static int
+rspamd_controller_handle_stat_common (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg,
+	gboolean do_reset)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	ucl_object_t *top;
+
+	if (!do_reset && rspamd_controller_send_snapshot (conn_ent, msg,
+			&session->ctx->stat_snap)) {
+		return 0;
+	}
+
+	top = rspamd_controller_stat_to_ucl (session->ctx, do_reset);
+	rspamd_controller_send_ucl (conn_ent, top);
+	ucl_object_unref (top);
+
+	return 0;
+}
+
+static int
+rspamd_controller_handle_stat (struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	return rspamd_controller_handle_stat_common (conn_ent, msg, FALSE);
+}
+
+static int
+rspamd_controller_handle_statreset (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, TRUE)) {
+		return 0;
+	}
+
+	msg_info ("<%s> reset stat",
+			rspamd_inet_address_to_string (session->from_addr));
+	return rspamd_controller_handle_stat_common (conn_ent, msg, TRUE);
+}
+
+/*
+ * Statresize command handler:
+ * request: /statresize
+ * headers: Password, Symbol, Size (optional, bytes)
+ * reply: json {"success":true} or {"error":"error message"}
+ */
+static int
+rspamd_controller_handle_statresize (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	const GString *symbol, *sizestr;
+	gchar *errstr;
+	gsize size = 0;
+	GError *err = NULL;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, TRUE)) {
+		return 0;
+	}
+
+	symbol = rspamd_http_message_find_header (msg, "Symbol");
+
+	if (symbol == NULL) {
+		msg_info ("absent statfile symbol");
+		rspamd_controller_send_error (conn_ent, 400,
+				"400 symbol header missing");
+		return 0;
+	}
+
+	sizestr = rspamd_http_message_find_header (msg, "Size");
+
+	if (sizestr != NULL) {
+		size = strtoul (sizestr->str, &errstr, 10);
+		if (*errstr != '\0' && *errstr != '\n') {
+			msg_info ("invalid statfile size");
+			rspamd_controller_send_error (conn_ent, 400, "400 invalid size");
+			return 0;
+		}
+	}
+
+	if (!rspamd_stat_resize (session->ctx->cfg, symbol->str, size,
+			session->ctx->ev_base, &err)) {
+		msg_info ("cannot resize statfile %s: %s", symbol->str, err->message);
+		rspamd_controller_send_error (conn_ent, err->code, err->message);
+		g_error_free (err);
+		return 0;
+	}
+
+	msg_info ("<%s> resize statfile %s",
+			rspamd_inet_address_to_string (session->from_addr), symbol->str);
+	rspamd_controller_send_string (conn_ent, "{\"success\":true}");
+
+	return 0;
+}
+
+static ucl_object_t *
+rspamd_controller_cache_item_to_ucl (struct cache_item *item)
+{
+	ucl_object_t *obj;
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromstring (item->s->symbol),
+		"symbol", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (item->s->weight),
+		"weight", 0, false);
+	ucl_object_insert_key (obj,	   ucl_object_fromint (item->s->frequency),
+		"frequency", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (item->s->avg_time),
+		"time", 0, false);
+
+	return obj;
+}
+
+static ucl_object_t *
+rspamd_controller_counters_to_ucl (struct rspamd_controller_worker_ctx *ctx)
+{
+	ucl_object_t *top;
+	struct cache_item *item;
+	struct symbols_cache *cache;
+	guint i;
+
+	cache = ctx->cfg->cache;
+	top = ucl_object_typed_new (UCL_ARRAY);
+	if (cache != NULL) {
+		for (i = 0; i < cache->items_by_order->len; i ++) {
+			item = g_ptr_array_index (cache->items_by_order, i);
+			if (!(item->flags & RSPAMD_SYMBOL_FLAG_CALLBACK)) {
+				ucl_array_append (top, rspamd_controller_cache_item_to_ucl (
+						item));
+			}
+		}
+	}
+
+	return top;
+}
+
+/*
+ * Counters command handler:
+ * request: /counters
+ * headers: Password
+ * reply: json array of all counters
+ */
+static int
+rspamd_controller_handle_counters (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	ucl_object_t *top;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	if (rspamd_controller_send_snapshot (conn_ent, msg,
+			&session->ctx->counters_snap)) {
+		return 0;
+	}
+
+	top = rspamd_controller_counters_to_ucl (session->ctx);
+	rspamd_controller_send_ucl (conn_ent, top);
+	ucl_object_unref (top);
+
+	return 0;
+}
+
+static void
+rspamd_controller_stats_timer (gint fd, short what, void *arg)
+{
+	struct rspamd_controller_worker_ctx *ctx = arg;
+	struct timeval tv;
+
+	/* Changes of symbols and actions made by other controllers */
+	rspamd_dynamic_config_sync (ctx->cfg);
+
+	rspamd_controller_snapshot_update (&ctx->stat_snap,
+			rspamd_controller_stat_to_ucl (ctx, FALSE));
+	rspamd_controller_snapshot_update (&ctx->counters_snap,
+			rspamd_controller_counters_to_ucl (ctx));
+
+	double_to_tv (ctx->stats_interval, &tv);
+	event_add (&ctx->stats_ev, &tv);
+}
+
+static ucl_object_t *
+rspamd_controller_ts_percentile_to_ucl (struct rspamd_ts_store *store,
+	gint id, enum rspamd_ts_resolution res, time_t now, guint count,
+	gdouble pct, gdouble *buf)
+{
+	ucl_object_t *arr;
+	guint i;
+
+	arr = ucl_object_typed_new (UCL_ARRAY);
+	rspamd_ts_store_read_percentile (store, id, res, now, count, pct, buf);
+
+	for (i = 0; i < count; i ++) {
+		ucl_array_append (arr, ucl_object_fromdouble (buf[i]));
+	}
+
+	return arr;
+}
+
+/*
+ * Timeseries command handler:
+ * request: /timeseries
+ * headers: Password, Series (optional), Resolution (second or minute),
+ * Count (optional, number of the last values)
+ * reply: json array of series names if Series is not specified, otherwise
+ * {"series":"name","type":"counter","step":1,"start":ts,"values":[...]},
+ * latency series have "p50", "p95" and "p99" arrays in seconds
+ */
+static int
+rspamd_controller_handle_timeseries (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_ts_store *store;
+	enum rspamd_ts_resolution res = RSPAMD_TS_SECOND;
+	enum rspamd_ts_type type;
+	const GString *hdr;
+	ucl_object_t *top, *arr;
+	guint32 *values;
+	gdouble *pcts;
+	guint count, i;
+	gchar *errstr, name[RSPAMD_TS_NAME_LEN];
+	time_t now;
+	gint id;
 
-	/* Fuzzy epoch statistics */
-	sub = ucl_object_typed_new (UCL_ARRAY);
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
 
-	for (i = RSPAMD_FUZZY_EPOCH6; i < RSPAMD_FUZZY_EPOCH_MAX; i ++) {
-		ucl_array_append (sub, ucl_object_fromint (stat->fuzzy_hashes_checked[i]));
+	if (session->ctx->srv->ts == NULL) {
+		rspamd_controller_send_error (conn_ent, 404,
+				"404 time series are disabled");
+		return 0;
 	}
 
-	ucl_object_insert_key (top, sub, "fuzzy_checked", 0, false);
-	sub = ucl_object_typed_new (UCL_ARRAY);
+	store = session->ctx->srv->ts->store;
+	hdr = rspamd_http_message_find_header (msg, "Series");
 
-	for (i = RSPAMD_FUZZY_EPOCH6; i < RSPAMD_FUZZY_EPOCH_MAX; i ++) {
-		ucl_array_append (sub, ucl_object_fromint (stat->fuzzy_hashes_found[i]));
+	if (hdr == NULL) {
+		top = ucl_object_typed_new (UCL_ARRAY);
+
+		for (i = 0; i < rspamd_ts_store_count (store); i ++) {
+			ucl_array_append (top, ucl_object_fromstring (
+					rspamd_ts_store_name (store, i, NULL)));
+		}
+
+		rspamd_controller_send_ucl (conn_ent, top);
+		ucl_object_unref (top);
+
+		return 0;
 	}
 
-	ucl_object_insert_key (top, sub, "fuzzy_found", 0, false);
+	rspamd_strlcpy (name, hdr->str, MIN (hdr->len + 1, sizeof (name)));
+	id = rspamd_ts_store_find (store, name);
 
-	/* Now write statistics for each statfile */
+	if (id == -1) {
+		rspamd_controller_send_error (conn_ent, 404, "404 series not found");
+		return 0;
+	}
 
-	sub = rspamd_stat_statistics (session->ctx->cfg, &learned);
-	ucl_object_insert_key (top, sub, "statfiles", 0, false);
-	ucl_object_insert_key (top,
-			ucl_object_fromint (learned), "total_learns", 0, false);
+	rspamd_ts_store_name (store, id, &type);
+	hdr = rspamd_http_message_find_header (msg, "Resolution");
 
-	if (do_reset) {
-		session->ctx->srv->stat->messages_scanned = 0;
-		session->ctx->srv->stat->messages_learned = 0;
-		session->ctx->srv->stat->connections_count = 0;
-		session->ctx->srv->stat->control_connections_count = 0;
-		memset (stat->fuzzy_hashes_checked, 0,
-				sizeof (stat->fuzzy_hashes_checked));
-		memset (stat->fuzzy_hashes_found, 0,
-				sizeof (stat->fuzzy_hashes_found));
-		rspamd_mempool_stat_reset ();
+	if (hdr != NULL && g_ascii_strncasecmp (hdr->str, "minute", hdr->len) == 0) {
+		res = RSPAMD_TS_MINUTE;
+	}
+
+	count = rspamd_ts_store_slots (res);
+	hdr = rspamd_http_message_find_header (msg, "Count");
+
+	if (hdr != NULL) {
+		count = strtoul (hdr->str, &errstr, 10);
+
+		if ((*errstr != '\0' && *errstr != '\n') || count == 0 ||
+				count > rspamd_ts_store_slots (res)) {
+			rspamd_controller_send_error (conn_ent, 400, "400 invalid count");
+			return 0;
+		}
+	}
+
+	now = time (NULL);
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top, ucl_object_fromstring (
+			rspamd_ts_store_name (store, id, NULL)), "series", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromstring (
+			type == RSPAMD_TS_LATENCY ? "latency" : "counter"), "type", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (rspamd_ts_store_step (res)),
+			"step", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (
+			(now / rspamd_ts_store_step (res) - count + 1) *
+			rspamd_ts_store_step (res)), "start", 0, false);
+
+	values = g_malloc (count * sizeof (*values));
+	rspamd_ts_store_read (store, id, res, now, count, values);
+	arr = ucl_object_typed_new (UCL_ARRAY);
+
+	for (i = 0; i < count; i ++) {
+		ucl_array_append (arr, ucl_object_fromint (values[i]));
+	}
+
+	ucl_object_insert_key (top, arr, "values", 0, false);
+	g_free (values);
+
+	if (type == RSPAMD_TS_LATENCY) {
+		pcts = g_malloc (count * sizeof (*pcts));
+		ucl_object_insert_key (top, rspamd_controller_ts_percentile_to_ucl (
+				store, id, res, now, count, 50, pcts), "p50", 0, false);
+		ucl_object_insert_key (top, rspamd_controller_ts_percentile_to_ucl (
+				store, id, res, now, count, 95, pcts), "p95", 0, false);
+		ucl_object_insert_key (top, rspamd_controller_ts_percentile_to_ucl (
+				store, id, res, now, count, 99, pcts), "p99", 0, false);
+		g_free (pcts);
 	}
 
 	rspamd_controller_send_ucl (conn_ent, top);
@@ -1550,102 +2653,492 @@ rspamd_controller_handle_stat_common (
 	return 0;
 }
 
+/*
+ * Lua profile command handler:
+ * request: /luaprofile
+ * headers: Password
+ * reply: json array of workers with lua lines sorted by time spent
+ */
 static int
-rspamd_controller_handle_stat (struct rspamd_http_connection_entry *conn_ent,
+rspamd_controller_handle_lua_profile (
+	struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg)
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_main *srv = session->ctx->srv;
+	ucl_object_t *top;
 
 	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
 		return 0;
 	}
 
-	return rspamd_controller_handle_stat_common (conn_ent, msg, FALSE);
+	if (srv->lua_profile == NULL) {
+		rspamd_controller_send_error (conn_ent, 404,
+				"404 lua profiler is disabled");
+		return 0;
+	}
+
+	top = rspamd_lua_profile_to_ucl (srv->lua_profile, srv->stat);
+	rspamd_controller_send_ucl (conn_ent, top);
+	ucl_object_unref (top);
+
+	return 0;
 }
 
-static int
-rspamd_controller_handle_statreset (
-	struct rspamd_http_connection_entry *conn_ent,
-	struct rspamd_http_message *msg)
+/*
+ * Callback for each value of exported metrics, label_name and label are NULL
+ * for metrics without labels
+ */
+typedef void (*rspamd_controller_metric_cb) (const gchar *name,
+		const gchar *help, gboolean counter, const gchar *label_name,
+		const gchar *label, gdouble value, gpointer ud);
+
+/*
+ * Call `cb` for counters and gauges of all workers, values of the same metric
+ * are passed one after another
+ */
+static void
+rspamd_controller_metrics_foreach (struct rspamd_controller_worker_ctx *ctx,
+	rspamd_controller_metric_cb cb, gpointer ud)
 {
-	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_stat stat;
+	struct symbols_cache *cache;
+	struct cache_item *item;
+	const gchar *caches[] = {"keys", "dns", "stem", "fuzzy"};
+	guint64 hits[4], misses[4];
+	guint i;
+
+	rspamd_mempool_lock_mutex (ctx->srv->stat_mtx);
+	memcpy (&stat, ctx->srv->stat, sizeof (stat));
+	rspamd_mempool_unlock_mutex (ctx->srv->stat_mtx);
+
+	cb ("scanned_total", "Messages scanned", TRUE, NULL, NULL,
+			stat.messages_scanned, ud);
+
+	for (i = METRIC_ACTION_REJECT; i <= METRIC_ACTION_NOACTION; i ++) {
+		cb ("actions_total", "Messages scanned with each action", TRUE,
+				"action", rspamd_action_to_str (i), stat.actions_stat[i], ud);
+	}
+
+	cb ("learned_total", "Messages learned", TRUE, NULL, NULL,
+			stat.messages_learned, ud);
+	cb ("connections_total", "Connections to scanning workers", TRUE,
+			NULL, NULL, stat.connections_count, ud);
+	cb ("control_connections_total", "Connections to controllers", TRUE,
+			NULL, NULL, stat.control_connections_count, ud);
+
+	hits[0] = stat.keys_cache_hits;
+	misses[0] = stat.keys_cache_misses;
+	hits[1] = stat.dns_cache_hits;
+	misses[1] = stat.dns_cache_misses;
+	hits[2] = stat.stem_cache_hits;
+	misses[2] = stat.stem_cache_misses;
+	hits[3] = stat.fuzzy_cache_hits;
+	misses[3] = stat.fuzzy_cache_misses;
+
+	for (i = 0; i < G_N_ELEMENTS (caches); i ++) {
+		cb ("cache_hits_total", "Lookups served by caches", TRUE,
+				"cache", caches[i], hits[i], ud);
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (caches); i ++) {
+		cb ("cache_misses_total", "Lookups not found in caches", TRUE,
+				"cache", caches[i], misses[i], ud);
+	}
+
+	cb ("classify_tasks_total", "Tasks classified by classifier threads",
+			TRUE, NULL, NULL, stat.classify_tasks, ud);
+	cb ("classify_overflows_total",
+			"Tasks classified inline as the queue was full",
+			TRUE, NULL, NULL, stat.classify_overflows, ud);
+	cb ("classify_queue_seconds_total",
+			"Time tasks waited in the classifier queue",
+			TRUE, NULL, NULL, stat.classify_queue_time / 1000000.0, ud);
+	cb ("admission_rejected_total", "Tasks rejected by admission control",
+			TRUE, NULL, NULL, stat.admission_rejected, ud);
+	cb ("admission_skipped_total", "Tasks scanned without expensive checks",
+			TRUE, NULL, NULL, stat.admission_skipped, ud);
+	cb ("fuzzy_ratelimited_total", "Fuzzy requests dropped by rate limit",
+			TRUE, NULL, NULL, stat.fuzzy_ratelimited, ud);
+	cb ("fuzzy_hashes", "Fuzzy hashes stored", FALSE, NULL, NULL,
+			stat.fuzzy_hashes, ud);
+	cb ("fuzzy_updates_pending", "Fuzzy updates waiting to be written",
+			FALSE, NULL, NULL, stat.fuzzy_updates_pending, ud);
+	cb ("fuzzy_expire_backlog", "Expired fuzzy hashes not removed yet",
+			FALSE, NULL, NULL, stat.fuzzy_expire_backlog, ud);
+
+	cache = ctx->cfg->cache;
 
-	if (!rspamd_controller_check_password (conn_ent, session, msg, TRUE)) {
-		return 0;
+	if (cache != NULL) {
+		for (i = 0; i < cache->items_by_order->len; i ++) {
+			item = g_ptr_array_index (cache->items_by_order, i);
+
+			if (item->s->frequency == 0) {
+				continue;
+			}
+
+			cb ("symbol_hits_total", "Symbols inserted to results", TRUE,
+					"symbol", item->s->symbol, item->s->frequency, ud);
+		}
 	}
+}
 
-	msg_info ("<%s> reset stat",
-			rspamd_inet_address_to_string (session->from_addr));
-	return rspamd_controller_handle_stat_common (conn_ent, msg, TRUE);
+struct rspamd_controller_prometheus_cbdata {
+	GString *out;
+	const gchar *last_name;
+};
+
+static void
+rspamd_controller_prometheus_escape (GString *out, const gchar *value)
+{
+	const gchar *p;
+
+	for (p = value; *p != '\0'; p ++) {
+		if (*p == '"' || *p == '\\') {
+			g_string_append_c (out, '\\');
+		}
+
+		g_string_append_c (out, *p);
+	}
 }
 
-static ucl_object_t *
-rspamd_controller_cache_item_to_ucl (struct cache_item *item)
+static void
+rspamd_controller_prometheus_metric (const gchar *name,
+	const gchar *help, gboolean counter, const gchar *label_name,
+	const gchar *label, gdouble value, gpointer ud)
 {
-	ucl_object_t *obj;
+	struct rspamd_controller_prometheus_cbdata *cbd = ud;
 
-	obj = ucl_object_typed_new (UCL_OBJECT);
-	ucl_object_insert_key (obj, ucl_object_fromstring (item->s->symbol),
-		"symbol", 0, false);
-	ucl_object_insert_key (obj, ucl_object_fromdouble (item->s->weight),
-		"weight", 0, false);
-	ucl_object_insert_key (obj,	   ucl_object_fromint (item->s->frequency),
-		"frequency", 0, false);
-	ucl_object_insert_key (obj, ucl_object_fromdouble (item->s->avg_time),
-		"time", 0, false);
+	if (cbd->last_name == NULL || strcmp (cbd->last_name, name) != 0) {
+		rspamd_printf_gstring (cbd->out, "# HELP rspamd_%s %s\n"
+				"# TYPE rspamd_%s %s\n", name, help, name,
+				counter ? "counter" : "gauge");
+		cbd->last_name = name;
+	}
 
-	return obj;
+	if (label != NULL) {
+		rspamd_printf_gstring (cbd->out, "rspamd_%s{%s=\"", name, label_name);
+		rspamd_controller_prometheus_escape (cbd->out, label);
+		rspamd_printf_gstring (cbd->out, "\"} %.6f\n", value);
+	}
+	else {
+		rspamd_printf_gstring (cbd->out, "rspamd_%s %.6f\n", name, value);
+	}
 }
 
 /*
- * Counters command handler:
- * request: /counters
+ * Metrics command handler:
+ * request: /metrics
  * headers: Password
- * reply: json array of all counters
+ * reply: counters, gauges and latency histograms of stages and symbols in
+ * Prometheus text format
  */
 static int
-rspamd_controller_handle_counters (
+rspamd_controller_handle_metrics (
 	struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg)
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
-	ucl_object_t *top;
-	GList *cur;
+	struct rspamd_main *srv = session->ctx->worker->srv;
+	struct rspamd_http_message *reply;
+	struct rspamd_controller_prometheus_cbdata cbd;
+	struct rspamd_histogram *h;
 	struct cache_item *item;
 	struct symbols_cache *cache;
+	GString *labels;
+	guint i;
 
 	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
 		return 0;
 	}
 
+	reply = rspamd_http_new_message (HTTP_RESPONSE);
+	reply->date = time (NULL);
+	reply->code = 200;
+	reply->body = g_string_sized_new (BUFSIZ);
+	labels = g_string_sized_new (MAX_SYMBOL + 16);
+	h = g_slice_alloc (sizeof (*h));
+
+	cbd.out = reply->body;
+	cbd.last_name = NULL;
+	rspamd_controller_metrics_foreach (session->ctx,
+			rspamd_controller_prometheus_metric, &cbd);
+
+	rspamd_printf_gstring (reply->body,
+			"# HELP rspamd_stage_latency_seconds Latency of task processing stages\n"
+			"# TYPE rspamd_stage_latency_seconds histogram\n");
+
+	for (i = 0; i < RSPAMD_TASK_STAGE_MAX; i ++) {
+		rspamd_mempool_lock_mutex (srv->stat_mtx);
+		memcpy (h, &srv->stat->stages[i], sizeof (*h));
+		rspamd_mempool_unlock_mutex (srv->stat_mtx);
+
+		g_string_truncate (labels, 0);
+		rspamd_printf_gstring (labels, "stage=\"%s\"",
+				rspamd_task_stage_name (i));
+		rspamd_histogram_write_prometheus (reply->body,
+				"rspamd_stage_latency_seconds", labels->str, h);
+	}
+
 	cache = session->ctx->cfg->cache;
-	top = ucl_object_typed_new (UCL_ARRAY);
+
 	if (cache != NULL) {
-		cur = cache->negative_items;
-		while (cur) {
-			item = cur->data;
-			if (!item->is_callback) {
-				ucl_array_append (top, rspamd_controller_cache_item_to_ucl (
-						item));
+		rspamd_printf_gstring (reply->body,
+				"# HELP rspamd_symbol_latency_seconds Latency of symbols checks\n"
+				"# TYPE rspamd_symbol_latency_seconds histogram\n");
+
+		for (i = 0; i < cache->items_by_order->len; i ++) {
+			item = g_ptr_array_index (cache->items_by_order, i);
+
+			if (item->hist == NULL) {
+				continue;
 			}
-			cur = g_list_next (cur);
-		}
-		cur = cache->static_items;
-		while (cur) {
-			item = cur->data;
-			if (!item->is_callback) {
-				ucl_array_append (top, rspamd_controller_cache_item_to_ucl (
-						item));
+
+			rspamd_mempool_lock_mutex (item->mtx);
+			memcpy (h, item->hist, sizeof (*h));
+			rspamd_mempool_unlock_mutex (item->mtx);
+
+			if (h->count == 0) {
+				continue;
 			}
-			cur = g_list_next (cur);
+
+			g_string_assign (labels, "symbol=\"");
+			rspamd_controller_prometheus_escape (labels, item->s->symbol);
+			g_string_append_c (labels, '"');
+			rspamd_histogram_write_prometheus (reply->body,
+					"rspamd_symbol_latency_seconds", labels->str, h);
 		}
 	}
-	rspamd_controller_send_ucl (conn_ent, top);
-	ucl_object_unref (top);
+
+	g_slice_free1 (sizeof (*h), h);
+	g_string_free (labels, TRUE);
+
+	rspamd_http_connection_reset (conn_ent->conn);
+	rspamd_http_connection_write_message (conn_ent->conn,
+		reply,
+		NULL,
+		"text/plain; version=0.0.4",
+		conn_ent,
+		conn_ent->conn->fd,
+		conn_ent->rt->ptv,
+		conn_ent->rt->ev_base);
+	conn_ent->is_reply = TRUE;
 
 	return 0;
 }
 
+struct rspamd_controller_statsd_cbdata {
+	gint fd;
+	const gchar *prefix;
+	GString *packet;
+	GString *line;
+};
+
+static void
+rspamd_controller_statsd_flush (struct rspamd_controller_statsd_cbdata *cbd)
+{
+	if (cbd->packet->len > 0) {
+		if (write (cbd->fd, cbd->packet->str, cbd->packet->len) == -1) {
+			msg_debug ("cannot send metrics to statsd: %s", strerror (errno));
+		}
+
+		g_string_truncate (cbd->packet, 0);
+	}
+}
+
+/*
+ * Append a line to the current datagram, statsd accepts several metrics
+ * separated by newlines in a single packet
+ */
+static void
+rspamd_controller_statsd_append (struct rspamd_controller_statsd_cbdata *cbd)
+{
+	if (cbd->packet->len + cbd->line->len + 1 > STATSD_PACKET_SIZE) {
+		rspamd_controller_statsd_flush (cbd);
+	}
+
+	if (cbd->packet->len > 0) {
+		g_string_append_c (cbd->packet, '\n');
+	}
+
+	g_string_append_len (cbd->packet, cbd->line->str, cbd->line->len);
+}
+
+static void
+rspamd_controller_statsd_name (GString *out, const gchar *name)
+{
+	const gchar *p;
+
+	/* Dots split names to levels and colons separate values */
+	for (p = name; *p != '\0'; p ++) {
+		if (g_ascii_isalnum (*p) || *p == '_' || *p == '-') {
+			g_string_append_c (out, *p);
+		}
+		else {
+			g_string_append_c (out, '_');
+		}
+	}
+}
+
+static void
+rspamd_controller_statsd_metric (const gchar *name,
+	const gchar *help, gboolean counter, const gchar *label_name,
+	const gchar *label, gdouble value, gpointer ud)
+{
+	struct rspamd_controller_statsd_cbdata *cbd = ud;
+
+	g_string_truncate (cbd->line, 0);
+	rspamd_printf_gstring (cbd->line, "%s.%s", cbd->prefix, name);
+
+	if (label != NULL) {
+		g_string_append_c (cbd->line, '.');
+		rspamd_controller_statsd_name (cbd->line, label);
+	}
+
+	/* Totals are sent as gauges, so a lost datagram loses no hits */
+	rspamd_printf_gstring (cbd->line, ":%.3f|g", value);
+	rspamd_controller_statsd_append (cbd);
+}
+
+/*
+ * Send latency of stages since the previous push: number of tasks as a
+ * counter and mean, median and 99th percentile in milliseconds as gauges
+ */
+static void
+rspamd_controller_statsd_stages (struct rspamd_controller_worker_ctx *ctx,
+	struct rspamd_controller_statsd_cbdata *cbd)
+{
+	struct rspamd_histogram *h, *prev, *delta;
+	guint i, j;
+
+	h = g_slice_alloc (sizeof (*h));
+	delta = g_slice_alloc (sizeof (*delta));
+
+	for (i = 0; i < RSPAMD_TASK_STAGE_MAX; i ++) {
+		rspamd_mempool_lock_mutex (ctx->srv->stat_mtx);
+		memcpy (h, &ctx->srv->stat->stages[i], sizeof (*h));
+		rspamd_mempool_unlock_mutex (ctx->srv->stat_mtx);
+		prev = &ctx->statsd_stages[i];
+
+		if (h->count < prev->count) {
+			/* Statistics has been reset */
+			memcpy (delta, h, sizeof (*delta));
+		}
+		else {
+			delta->count = h->count - prev->count;
+			delta->sum = h->sum - prev->sum;
+			delta->max = h->max;
+
+			for (j = 0; j < RSPAMD_HISTOGRAM_BUCKETS; j ++) {
+				delta->buckets[j] = h->buckets[j] >= prev->buckets[j] ?
+						h->buckets[j] - prev->buckets[j] : 0;
+			}
+		}
+
+		memcpy (prev, h, sizeof (*prev));
+
+		if (delta->count == 0) {
+			continue;
+		}
+
+		g_string_truncate (cbd->line, 0);
+		rspamd_printf_gstring (cbd->line, "%s.stage.%s.count:%uL|c",
+				cbd->prefix, rspamd_task_stage_name (i), delta->count);
+		rspamd_controller_statsd_append (cbd);
+		g_string_truncate (cbd->line, 0);
+		rspamd_printf_gstring (cbd->line, "%s.stage.%s.mean:%.3f|g",
+				cbd->prefix, rspamd_task_stage_name (i),
+				delta->sum / (gdouble)delta->count / 1000.0);
+		rspamd_controller_statsd_append (cbd);
+		g_string_truncate (cbd->line, 0);
+		rspamd_printf_gstring (cbd->line, "%s.stage.%s.p50:%.3f|g",
+				cbd->prefix, rspamd_task_stage_name (i),
+				rspamd_histogram_percentile (delta, 50) / 1000.0);
+		rspamd_controller_statsd_append (cbd);
+		g_string_truncate (cbd->line, 0);
+		rspamd_printf_gstring (cbd->line, "%s.stage.%s.p99:%.3f|g",
+				cbd->prefix, rspamd_task_stage_name (i),
+				rspamd_histogram_percentile (delta, 99) / 1000.0);
+		rspamd_controller_statsd_append (cbd);
+	}
+
+	g_slice_free1 (sizeof (*h), h);
+	g_slice_free1 (sizeof (*delta), delta);
+}
+
+static void
+rspamd_controller_statsd_timer (gint fd, short what, void *arg)
+{
+	struct rspamd_controller_worker_ctx *ctx = arg;
+	struct rspamd_controller_statsd_cbdata cbd;
+	struct timeval tv;
+	gdouble now;
+	gboolean push = FALSE;
+
+	/*
+	 * Each controller has this timer, the first one that fires in an
+	 * interval pushes metrics of all workers and others skip it
+	 */
+	now = rspamd_get_ticks ();
+	rspamd_mempool_lock_mutex (ctx->srv->stat_mtx);
+
+	if (now - ctx->srv->stat->statsd_pushed >= ctx->cfg->statsd_interval / 2.0) {
+		ctx->srv->stat->statsd_pushed = now;
+		push = TRUE;
+	}
+
+	rspamd_mempool_unlock_mutex (ctx->srv->stat_mtx);
+
+	if (push) {
+		cbd.fd = ctx->statsd_fd;
+		cbd.prefix = ctx->cfg->statsd_prefix ? ctx->cfg->statsd_prefix :
+				"rspamd";
+		cbd.packet = g_string_sized_new (STATSD_PACKET_SIZE);
+		cbd.line = g_string_sized_new (MAX_SYMBOL + 64);
+
+		rspamd_controller_metrics_foreach (ctx,
+				rspamd_controller_statsd_metric, &cbd);
+		rspamd_controller_statsd_stages (ctx, &cbd);
+		rspamd_controller_statsd_flush (&cbd);
+
+		g_string_free (cbd.packet, TRUE);
+		g_string_free (cbd.line, TRUE);
+	}
+
+	double_to_tv (ctx->cfg->statsd_interval, &tv);
+	event_add (&ctx->statsd_ev, &tv);
+}
+
+static void
+rspamd_controller_statsd_init (struct rspamd_controller_worker_ctx *ctx)
+{
+	GPtrArray *addrs = NULL;
+	struct timeval tv;
+
+	if (!rspamd_parse_host_port (ctx->cfg->statsd_server, &addrs, NULL,
+			STATSD_DEFAULT_PORT, NULL)) {
+		msg_err ("cannot parse statsd address: %s", ctx->cfg->statsd_server);
+		return;
+	}
+
+	ctx->statsd_fd = rspamd_inet_address_connect (
+			g_ptr_array_index (addrs, 0), SOCK_DGRAM, TRUE);
+	g_ptr_array_free (addrs, TRUE);
+
+	if (ctx->statsd_fd == -1) {
+		msg_err ("cannot create socket for statsd %s: %s",
+				ctx->cfg->statsd_server, strerror (errno));
+		return;
+	}
+
+	ctx->statsd_stages = g_malloc0 (sizeof (*ctx->statsd_stages) *
+			RSPAMD_TASK_STAGE_MAX);
+	evtimer_set (&ctx->statsd_ev, rspamd_controller_statsd_timer, ctx);
+	event_base_set (ctx->ev_base, &ctx->statsd_ev);
+	double_to_tv (ctx->cfg->statsd_interval, &tv);
+	event_add (&ctx->statsd_ev, &tv);
+}
+
 static int
 rspamd_controller_handle_custom (struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg)
@@ -1691,6 +3184,15 @@ rspamd_controller_finish_handler (struct rspamd_http_connection_entry *conn_ent)
 	if (session->task != NULL) {
 		destroy_session (session->task->s);
 	}
+	if (session->learn_batch != NULL) {
+		rspamd_controller_learn_batch_destroy (session->learn_batch);
+	}
+	if (session->history_wait != NULL) {
+		rspamd_controller_history_wait_free (session->history_wait);
+	}
+	if (session->scan_forward != NULL) {
+		rspamd_controller_scan_forward_free (session->scan_forward);
+	}
 	if (session->pool) {
 		rspamd_mempool_delete (session->pool);
 	}
@@ -1783,6 +3285,9 @@ init_controller_worker (struct rspamd_config *cfg)
 	ctx = g_malloc0 (sizeof (struct rspamd_controller_worker_ctx));
 
 	ctx->timeout = DEFAULT_WORKER_IO_TIMEOUT;
+	ctx->learn_concurrency = DEFAULT_LEARN_CONCURRENCY;
+	ctx->stats_interval = DEFAULT_STATS_INTERVAL;
+	ctx->statsd_fd = -1;
 
 	rspamd_rcl_register_worker_option (cfg, type, "password",
 		rspamd_rcl_parse_struct_string, ctx,
@@ -1822,6 +3327,21 @@ init_controller_worker (struct rspamd_config *cfg)
 		G_STRUCT_OFFSET (struct rspamd_controller_worker_ctx,
 		key), 0);
 
+	rspamd_rcl_register_worker_option (cfg, type, "stats_interval",
+		rspamd_rcl_parse_struct_time, ctx,
+		G_STRUCT_OFFSET (struct rspamd_controller_worker_ctx,
+		stats_interval), RSPAMD_CL_FLAG_TIME_FLOAT);
+
+	rspamd_rcl_register_worker_option (cfg, type, "learn_concurrency",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_controller_worker_ctx,
+		learn_concurrency), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "scan_servers",
+		rspamd_rcl_parse_struct_string, ctx,
+		G_STRUCT_OFFSET (struct rspamd_controller_worker_ctx,
+		scan_servers), 0);
+
 	return ctx;
 }
 
@@ -1876,6 +3396,8 @@ start_controller_worker (struct rspamd_worker *worker)
 
 	/* Accept event */
 	cache = rspamd_keypair_cache_new (256);
+	rspamd_keypair_cache_set_counters (cache, &worker->srv->stat->keys_cache_hits,
+			&worker->srv->stat->keys_cache_misses);
 	ctx->http = rspamd_http_router_new (rspamd_controller_error_handler,
 			rspamd_controller_finish_handler, &ctx->io_tv, ctx->ev_base,
 			ctx->static_files_dir, cache);
@@ -1908,6 +3430,9 @@ start_controller_worker (struct rspamd_worker *worker)
 	rspamd_http_router_add_path (ctx->http,
 		   PATH_LEARN_HAM,
 		rspamd_controller_handle_learnham);
+	rspamd_http_router_add_path (ctx->http,
+		 PATH_LEARN_BATCH,
+		rspamd_controller_handle_learnbatch);
 	rspamd_http_router_add_path (ctx->http,
 		PATH_SAVE_ACTIONS,
 		rspamd_controller_handle_saveactions);
@@ -1929,9 +3454,21 @@ start_controller_worker (struct rspamd_worker *worker)
 	rspamd_http_router_add_path (ctx->http,
 		  PATH_STAT_RESET,
 		rspamd_controller_handle_statreset);
+	rspamd_http_router_add_path (ctx->http,
+		  PATH_STAT_RESIZE,
+		rspamd_controller_handle_statresize);
 	rspamd_http_router_add_path (ctx->http,
 			PATH_COUNTERS,
 		rspamd_controller_handle_counters);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_METRICS,
+		rspamd_controller_handle_metrics);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_TIMESERIES,
+		rspamd_controller_handle_timeseries);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_LUA_PROFILE,
+		rspamd_controller_handle_lua_profile);
 
 	if (ctx->key) {
 		rspamd_http_router_set_key (ctx->http, ctx->key);
@@ -1960,9 +3497,31 @@ start_controller_worker (struct rspamd_worker *worker)
 
 	rspamd_upstreams_library_init (ctx->resolver->r, ctx->ev_base);
 	rspamd_upstreams_library_config (worker->srv->cfg);
+
+	if (ctx->scan_servers != NULL) {
+		ctx->scan_upstreams = rspamd_upstreams_create ();
+
+		if (!rspamd_upstreams_parse_line (ctx->scan_upstreams,
+				ctx->scan_servers, DEFAULT_BIND_PORT, NULL)) {
+			msg_err ("cannot parse scan servers: %s", ctx->scan_servers);
+			rspamd_upstreams_destroy (ctx->scan_upstreams);
+			ctx->scan_upstreams = NULL;
+		}
+	}
 	/* Maps events */
 	rspamd_map_watch (worker->srv->cfg, ctx->ev_base);
 
+	if (ctx->stats_interval > 0) {
+		/* Build snapshots before serving requests */
+		evtimer_set (&ctx->stats_ev, rspamd_controller_stats_timer, ctx);
+		event_base_set (ctx->ev_base, &ctx->stats_ev);
+		rspamd_controller_stats_timer (-1, EV_TIMEOUT, ctx);
+	}
+
+	if (ctx->cfg->statsd_server != NULL && ctx->cfg->statsd_interval > 0) {
+		rspamd_controller_statsd_init (ctx);
+	}
+
 	event_base_loop (ctx->ev_base, 0);
 
 	g_mime_shutdown ();
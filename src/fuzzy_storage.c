@@ -39,12 +39,48 @@
 #include "map.h"
 #include "fuzzy_storage.h"
 #include "fuzzy_backend.h"
+#include "http.h"
+#include "keypairs_cache.h"
 #include "ottery.h"
+#include "xxhash.h"
 
 /* This number is used as expire time in seconds for cache items  (2 days) */
 #define DEFAULT_EXPIRE 172800L
 /* Resync value in seconds */
 #define DEFAULT_SYNC_TIMEOUT 60.0
+/* Interval between expire runs */
+#define DEFAULT_EXPIRE_INTERVAL 1.0
+/* Maximum number of hashes removed by a single expire run */
+#define DEFAULT_EXPIRE_CHUNK 1000
+/* Number of pending updates that causes flush */
+#define DEFAULT_UPDATES_BATCH 100
+/* Maximum time in seconds for updates to stay in the queue */
+#define DEFAULT_UPDATES_TIMEOUT 1.0
+/* Maximum number of datagrams processed per socket wakeup */
+#define DEFAULT_IO_BATCH 32
+/* Size of a single datagram buffer */
+#define FUZZY_IO_BUF_SIZE RSPAMD_FUZZY_MAX_DATAGRAM
+/* Default port for the replication stream */
+#define DEFAULT_REPLICATION_PORT 11336
+/* Number of updates kept in memory for replicas */
+#define DEFAULT_REPLICATION_LOG 100000
+/* Maximum number of updates sent in a single replication request */
+#define DEFAULT_REPLICATION_BATCH 1000
+/* Interval between replication attempts */
+#define DEFAULT_REPLICATION_INTERVAL 1.0
+/* IO timeout for replication connections */
+#define DEFAULT_REPLICATION_TIMEOUT 5.0
+/* Default port for the filter of digests */
+#define DEFAULT_FILTER_PORT 11337
+/* Interval between publishing of the updated filter */
+#define DEFAULT_FILTER_INTERVAL 60.0
+/* Filter is rebuilt from storage to forget removed digests */
+#define FILTER_REBUILD_CYCLES 60
+/* Number of rate limit buckets, rounded up to power of 2 */
+#define DEFAULT_RATELIMIT_BUCKETS 65536
+/* Sources are rate limited by the networks of these sizes */
+#define RATELIMIT_MASK_V4 24
+#define RATELIMIT_MASK_V6 64
 
 
 #define INVALID_NODE_TIME (guint64) - 1
@@ -73,11 +109,112 @@ struct rspamd_fuzzy_storage_ctx {
 	char *hashfile;
 	gdouble expire;
 	gdouble sync_timeout;
+	gdouble expire_interval;
+	guint32 expire_chunk;
 	radix_compressed_t *update_ips;
 	gchar *update_map;
+	gboolean memory_index;
+	gchar *compact_index;
+	guint32 updates_batch;
+	gdouble updates_timeout;
+	guint32 io_batch;
 	struct event_base *ev_base;
+	struct fuzzy_io_batch *io;
+
+	/* Replication options */
+	GList *replicas_list;
+	gchar *replica_key_str;
+	gchar *replication_bind;
+	gchar *replication_allow_map;
+	gpointer keypair;
+	guint32 replication_log_size;
+	guint32 replication_batch;
+	gdouble replication_interval;
+	gdouble replication_timeout;
+	/* Master side: replicas and the log of updates with sequence numbers */
+	GPtrArray *replicas;
+	GPtrArray *repl_log;
+	gpointer replica_key;
+	gpointer local_key;
+	guint64 repl_epoch;
+	guint64 repl_seq;
+	struct event repl_ev;
+	/* Replica side: the last update applied from master */
+	radix_compressed_t *replication_allow;
+	GList *repl_listen_events;
+	guint64 repl_master_epoch;
+	guint64 repl_applied_seq;
+	struct rspamd_keypair_cache *keys_cache;
+	struct timeval repl_io_tv;
+
+	/* Filter of digests published for clients */
+	gchar *filter_bind;
+	gdouble filter_interval;
+	GByteArray *filter;
+	guint64 filter_gen;
+	guint filter_cycles;
+	gboolean filter_dirty;
+	GList *filter_listen_events;
+	struct event filter_ev;
+	struct timeval filter_io_tv;
+
+	/* Token buckets of source networks */
+	gdouble ratelimit_rate;
+	gdouble ratelimit_burst;
+	guint32 ratelimit_buckets;
+	struct fuzzy_ratelimit_bucket *ratelimit;
 
 	struct rspamd_fuzzy_backend *backend;
+	/* Write commands waiting to be applied to the backend */
+	GQueue *updates_pending;
+	/* Digest -> struct fuzzy_pending_digest for the pending updates */
+	GHashTable *pending_digests;
+	struct event updates_ev;
+	struct event expire_ev;
+};
+
+/* Bucket is shared by all sources of a network */
+struct fuzzy_ratelimit_bucket {
+	guint64 net;
+	gdouble tokens;
+	gdouble last;               /* time of the last refill */
+	guint32 dropped;            /* requests dropped since the last release */
+	gint32 af;                  /* 0 for empty buckets */
+};
+
+/* Cumulative effect of pending updates for a single digest */
+struct fuzzy_pending_digest {
+	gchar digest[64];
+	gint32 value;
+	guint32 flag;
+	gboolean added;
+	gboolean deleted;
+};
+
+/* Update with its sequence number in the replication log */
+struct fuzzy_repl_entry {
+	guint64 seq;
+	gsize len;
+	struct rspamd_fuzzy_cmd *cmd;
+};
+
+/* Replica as seen by master */
+struct fuzzy_replica {
+	gchar *name;
+	rspamd_inet_addr_t *addr;
+	guint64 acked;
+	gboolean in_flight;
+	gint fd;
+	struct rspamd_http_connection *conn;
+};
+
+/* Incoming replication connection on replica */
+struct fuzzy_repl_session {
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	struct rspamd_http_connection *conn;
+	rspamd_inet_addr_t *addr;
+	gint fd;
+	gboolean replied;
 };
 
 struct rspamd_legacy_fuzzy_node {
@@ -95,208 +232,1446 @@ struct fuzzy_session {
 	gboolean legacy;
 	rspamd_inet_addr_t *addr;
 	struct rspamd_fuzzy_storage_ctx *ctx;
+	/* Replies are appended here and sent by the caller */
+	guint8 reply[FUZZY_IO_BUF_SIZE];
+	gsize reply_len;
 };
 
-static gboolean
-rspamd_fuzzy_check_client (struct fuzzy_session *session)
+/* Buffers used to receive and reply to a batch of datagrams at once */
+struct fuzzy_io_batch {
+	guint size;
+	guint8 *bufs;
+	struct sockaddr_storage *addrs;
+	struct fuzzy_session *sessions;
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+	struct iovec *in_iov;
+	struct mmsghdr *in_msgs;
+	struct iovec *out_iov;
+	struct mmsghdr *out_msgs;
+#endif
+};
+
+static gboolean
+rspamd_fuzzy_check_client (struct fuzzy_session *session)
+{
+	if (session->ctx->update_ips != NULL) {
+		if (radix_find_compressed_addr (session->ctx->update_ips,
+				session->addr) == RADIX_NO_VALUE) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static void
+rspamd_fuzzy_ratelimit_release (struct fuzzy_ratelimit_bucket *b)
+{
+	if (b->dropped > 0) {
+		msg_info ("rate limit of %s network %xL is released, %ud requests "
+				"have been dropped",
+				b->af == AF_INET ? "IPv4" : "IPv6", b->net, b->dropped);
+		b->dropped = 0;
+	}
+}
+
+/*
+ * Checks token bucket of the source network, this is done prior to parsing
+ * of a datagram, so a narrow table is used: each network may occupy one of
+ * two buckets, and the least recently used one is replaced if none matches
+ */
+static gboolean
+rspamd_fuzzy_ratelimit_allow (struct fuzzy_session *session)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = session->ctx;
+	struct fuzzy_ratelimit_bucket *b, *alt;
+	const guchar *key;
+	guint64 net = 0, h;
+	guint klen, i;
+	gint af;
+	gdouble now;
+
+	if (ctx->ratelimit == NULL) {
+		return TRUE;
+	}
+
+	af = rspamd_inet_address_get_af (session->addr);
+
+	if (af != AF_INET && af != AF_INET6) {
+		return TRUE;
+	}
+
+	key = rspamd_inet_address_get_radix_key (session->addr, &klen);
+	klen = (af == AF_INET ? RATELIMIT_MASK_V4 : RATELIMIT_MASK_V6) / NBBY;
+
+	for (i = 0; i < klen; i ++) {
+		net = (net << NBBY) | key[i];
+	}
+
+	h = XXH64 (&net, sizeof (net), af);
+	b = &ctx->ratelimit[h & (ctx->ratelimit_buckets - 1)];
+	alt = &ctx->ratelimit[(h >> 32) & (ctx->ratelimit_buckets - 1)];
+	now = rspamd_get_ticks ();
+
+	if (b->af != af || b->net != net) {
+		if (alt->af == af && alt->net == net) {
+			b = alt;
+		}
+		else {
+			if (alt->last < b->last) {
+				b = alt;
+			}
+
+			rspamd_fuzzy_ratelimit_release (b);
+			b->af = af;
+			b->net = net;
+			b->tokens = ctx->ratelimit_burst;
+			b->last = now;
+		}
+	}
+
+	b->tokens = MIN (ctx->ratelimit_burst,
+			b->tokens + (now - b->last) * ctx->ratelimit_rate);
+	b->last = now;
+
+	if (b->tokens >= 1.0) {
+		b->tokens -= 1.0;
+
+		/* Network is released when it does not exceed rate any longer */
+		if (b->dropped > 0 && b->tokens >= ctx->ratelimit_burst - 1.0) {
+			rspamd_fuzzy_ratelimit_release (b);
+		}
+
+		return TRUE;
+	}
+
+	if (b->dropped ++ == 0) {
+		msg_info ("rate limit requests from %s (/%d)",
+				rspamd_inet_address_to_string (session->addr),
+				af == AF_INET ? RATELIMIT_MASK_V4 : RATELIMIT_MASK_V6);
+	}
+
+	server_stat->fuzzy_ratelimited ++;
+
+	return FALSE;
+}
+
+static void
+rspamd_fuzzy_write_reply (struct fuzzy_session *session,
+		struct rspamd_fuzzy_reply *rep)
+{
+	if (session->legacy) {
+		if (rep->prob > 0.5) {
+			if (session->cmd->cmd == FUZZY_CHECK) {
+				session->reply_len = rspamd_snprintf (session->reply,
+						sizeof (session->reply), "OK %d %d" CRLF,
+						rep->value, rep->flag);
+			}
+			else {
+				session->reply_len = rspamd_snprintf (session->reply,
+						sizeof (session->reply), "OK" CRLF);
+			}
+
+		}
+		else {
+			session->reply_len = rspamd_snprintf (session->reply,
+					sizeof (session->reply), "ERR" CRLF);
+		}
+	}
+	else {
+		/* Packed commands get their replies in a single datagram */
+		if (session->reply_len + sizeof (*rep) > sizeof (session->reply)) {
+			msg_warn ("too many replies for a single datagram, drop reply");
+			return;
+		}
+
+		memcpy (session->reply + session->reply_len, rep, sizeof (*rep));
+		session->reply_len += sizeof (*rep);
+	}
+}
+
+static void
+rspamd_fuzzy_send_reply (struct fuzzy_session *session)
+{
+	gint r;
+
+	while ((r = rspamd_inet_address_sendto (session->fd, session->reply,
+			session->reply_len, 0, session->addr)) == -1) {
+		if (errno == EINTR) {
+			continue;
+		}
+		msg_err ("error while writing reply: %s", strerror (errno));
+		break;
+	}
+}
+
+static guint
+rspamd_fuzzy_digest_hash (gconstpointer key)
+{
+	guint ret;
+
+	/* Digests are already hashes, so we can use just their prefix */
+	memcpy (&ret, key, sizeof (ret));
+
+	return ret;
+}
+
+static gboolean
+rspamd_fuzzy_digest_equal (gconstpointer v, gconstpointer v2)
+{
+	return memcmp (v, v2, 64) == 0;
+}
+
+static void
+rspamd_fuzzy_pending_digest_free (gpointer p)
+{
+	g_slice_free1 (sizeof (struct fuzzy_pending_digest), p);
+}
+
+static void
+rspamd_fuzzy_flush_updates (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	struct rspamd_fuzzy_cmd *cmd;
+	guint nupdates = 0, nfailed = 0;
+
+	if (evtimer_pending (&ctx->updates_ev, NULL)) {
+		event_del (&ctx->updates_ev);
+	}
+
+	if (g_queue_is_empty (ctx->updates_pending)) {
+		return;
+	}
+
+	while ((cmd = g_queue_pop_head (ctx->updates_pending)) != NULL) {
+		if (cmd->cmd == FUZZY_WRITE) {
+			if (!rspamd_fuzzy_backend_add (ctx->backend, cmd)) {
+				nfailed ++;
+			}
+		}
+		else {
+			if (!rspamd_fuzzy_backend_del (ctx->backend, cmd)) {
+				nfailed ++;
+			}
+		}
+
+		nupdates ++;
+		g_slice_free1 (cmd->shingles_count > 0 ?
+				sizeof (struct rspamd_fuzzy_shingle_cmd) : sizeof (*cmd), cmd);
+	}
+
+	g_hash_table_remove_all (ctx->pending_digests);
+
+	/* Commit all updates in a single transaction */
+	rspamd_fuzzy_backend_sync (ctx->backend, 0);
+
+	if (nfailed > 0) {
+		msg_err ("cannot apply %ud of %ud fuzzy updates", nfailed, nupdates);
+	}
+	else {
+		msg_debug ("applied %ud fuzzy updates", nupdates);
+	}
+
+	server_stat->fuzzy_hashes = rspamd_fuzzy_backend_count (ctx->backend);
+	server_stat->fuzzy_updates_pending = 0;
+}
+
+static void
+rspamd_fuzzy_updates_timer (gint fd, short what, void *arg)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = arg;
+
+	rspamd_fuzzy_flush_updates (ctx);
+}
+
+static void
+rspamd_fuzzy_queue_update (struct rspamd_fuzzy_storage_ctx *ctx,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	struct rspamd_fuzzy_cmd *copy;
+	struct fuzzy_pending_digest *pd;
+	struct timeval tv;
+	gsize len;
+
+	len = cmd->shingles_count > 0 ?
+			sizeof (struct rspamd_fuzzy_shingle_cmd) : sizeof (*cmd);
+	copy = g_slice_alloc (len);
+	memcpy (copy, cmd, len);
+	g_queue_push_tail (ctx->updates_pending, copy);
+
+	pd = g_hash_table_lookup (ctx->pending_digests, cmd->digest);
+
+	if (pd == NULL) {
+		pd = g_slice_alloc0 (sizeof (*pd));
+		memcpy (pd->digest, cmd->digest, sizeof (pd->digest));
+		g_hash_table_insert (ctx->pending_digests, pd->digest, pd);
+	}
+
+	if (cmd->cmd == FUZZY_WRITE) {
+		if (!pd->added) {
+			pd->flag = cmd->flag;
+			pd->added = TRUE;
+		}
+
+		pd->value += cmd->value;
+	}
+	else {
+		pd->deleted = TRUE;
+		pd->added = FALSE;
+		pd->value = 0;
+	}
+
+	server_stat->fuzzy_updates_pending = g_queue_get_length (
+			ctx->updates_pending);
+
+	if (g_queue_get_length (ctx->updates_pending) >= ctx->updates_batch) {
+		rspamd_fuzzy_flush_updates (ctx);
+	}
+	else if (!evtimer_pending (&ctx->updates_ev, NULL)) {
+		double_to_tv (ctx->updates_timeout, &tv);
+		evtimer_add (&ctx->updates_ev, &tv);
+	}
+}
+
+/*
+ * Apply pending updates of the digest to the reply from the backend
+ */
+static void
+rspamd_fuzzy_check_pending (struct rspamd_fuzzy_storage_ctx *ctx,
+		const struct rspamd_fuzzy_cmd *cmd, struct rspamd_fuzzy_reply *rep)
+{
+	struct fuzzy_pending_digest *pd;
+
+	pd = g_hash_table_lookup (ctx->pending_digests, cmd->digest);
+
+	if (pd == NULL) {
+		return;
+	}
+
+	if (pd->deleted || rep->prob < 1.0) {
+		/* Existing digest is either removed or not matched directly */
+		rep->value = 0;
+		rep->flag = pd->flag;
+		rep->prob = 0.0;
+	}
+
+	if (pd->added) {
+		rep->value += pd->value;
+		rep->prob = 1.0;
+	}
+}
+
+static gboolean
+rspamd_fuzzy_apply_update (struct rspamd_fuzzy_storage_ctx *ctx,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	gboolean res;
+
+	if (ctx->filter != NULL && cmd->cmd == FUZZY_WRITE) {
+		/* Removed digests stay in filter until it is rebuilt */
+		rspamd_fuzzy_filter_add (ctx->filter, cmd->digest);
+		ctx->filter_dirty = TRUE;
+	}
+
+	if (ctx->updates_pending != NULL) {
+		/* Updates are applied later, so we cannot check result */
+		rspamd_fuzzy_queue_update (ctx, cmd);
+		res = TRUE;
+	}
+	else if (cmd->cmd == FUZZY_WRITE) {
+		res = rspamd_fuzzy_backend_add (ctx->backend, cmd);
+	}
+	else {
+		res = rspamd_fuzzy_backend_del (ctx->backend, cmd);
+	}
+
+	return res;
+}
+
+static void
+rspamd_fuzzy_repl_entry_free (gpointer p)
+{
+	struct fuzzy_repl_entry *entry = p;
+
+	g_slice_free1 (entry->len, entry->cmd);
+	g_slice_free1 (sizeof (*entry), entry);
+}
+
+/*
+ * Append an update to the replication log
+ */
+static void
+rspamd_fuzzy_replicate (struct rspamd_fuzzy_storage_ctx *ctx,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	struct fuzzy_repl_entry *entry;
+	guint max = ctx->replication_log_size;
+
+	if (ctx->repl_log == NULL) {
+		return;
+	}
+
+	entry = g_slice_alloc (sizeof (*entry));
+	entry->seq = ++ctx->repl_seq;
+	entry->len = cmd->shingles_count > 0 ?
+			sizeof (struct rspamd_fuzzy_shingle_cmd) : sizeof (*cmd);
+	entry->cmd = g_slice_alloc (entry->len);
+	memcpy (entry->cmd, cmd, entry->len);
+	g_ptr_array_add (ctx->repl_log, entry);
+
+	/* Trim the log by chunks to avoid moving it on each update */
+	if (ctx->repl_log->len > max + MAX (max / 8, 1)) {
+		g_ptr_array_remove_range (ctx->repl_log, 0,
+				ctx->repl_log->len - max);
+	}
+}
+
+/*
+ * Expire record holds expire time in `value` and the number of removed
+ * hashes in `tag`, so replicas remove the same oldest hashes
+ */
+static void
+rspamd_fuzzy_replicate_expire (struct rspamd_fuzzy_storage_ctx *ctx,
+		gsize removed)
+{
+	struct rspamd_fuzzy_cmd cmd;
+
+	memset (&cmd, 0, sizeof (cmd));
+	cmd.cmd = FUZZY_EXPIRE;
+	cmd.value = ctx->expire;
+	cmd.tag = removed;
+	rspamd_fuzzy_replicate (ctx, &cmd);
+}
+
+static void
+rspamd_fuzzy_process_command (struct fuzzy_session *session,
+		enum rspamd_fuzzy_epoch epoch)
+{
+	struct rspamd_fuzzy_reply rep = {0, 0, 0, 0.0};
+	gboolean res = FALSE;
+
+	if (session->cmd->cmd == FUZZY_CHECK) {
+		rep = rspamd_fuzzy_backend_check (session->ctx->backend, session->cmd,
+				session->ctx->expire);
+
+		if (session->ctx->updates_pending != NULL) {
+			rspamd_fuzzy_check_pending (session->ctx, session->cmd, &rep);
+		}
+
+		/* XXX: actually, these updates are not atomic, but we don't care */
+		server_stat->fuzzy_hashes_checked[epoch] ++;
+
+		if (rep.prob > 0.5) {
+			server_stat->fuzzy_hashes_found[epoch] ++;
+		}
+	}
+	else if (session->cmd->cmd != FUZZY_WRITE &&
+			session->cmd->cmd != FUZZY_DEL) {
+		/* Other commands are not accepted from clients */
+		rep.flag = session->cmd->flag;
+		rep.value = 400;
+		rep.prob = 0.0;
+	}
+	else {
+		rep.flag = session->cmd->flag;
+		if (rspamd_fuzzy_check_client (session)) {
+			res = rspamd_fuzzy_apply_update (session->ctx, session->cmd);
+
+			if (res) {
+				rspamd_fuzzy_replicate (session->ctx, session->cmd);
+			}
+
+			if (!res) {
+				rep.value = 404;
+				rep.prob = 0.0;
+			}
+			else {
+				rep.value = 0;
+				rep.prob = 1.0;
+			}
+		}
+		else {
+			rep.value = 403;
+			rep.prob = 0.0;
+		}
+		server_stat->fuzzy_hashes = rspamd_fuzzy_backend_count (session->ctx->backend);
+	}
+
+	rep.tag = session->cmd->tag;
+	rspamd_fuzzy_write_reply (session, &rep);
+}
+
+
+static enum rspamd_fuzzy_epoch
+rspamd_fuzzy_command_valid (struct rspamd_fuzzy_cmd *cmd, gint r)
+{
+	enum rspamd_fuzzy_epoch ret = RSPAMD_FUZZY_EPOCH_MAX;
+
+	if (cmd->version == RSPAMD_FUZZY_VERSION) {
+		if (cmd->shingles_count > 0) {
+			if (r == sizeof (struct rspamd_fuzzy_shingle_cmd)) {
+				ret = RSPAMD_FUZZY_EPOCH9;
+			}
+		}
+		else {
+			if (r == sizeof (*cmd)) {
+				ret = RSPAMD_FUZZY_EPOCH9;
+			}
+		}
+	}
+	else if (cmd->version == 2) {
+		/*
+		 * rspamd 0.8 has slightly different tokenizer then it might be not
+		 * 100% compatible
+		 */
+		if (cmd->shingles_count > 0) {
+			if (r == sizeof (struct rspamd_fuzzy_shingle_cmd)) {
+				ret = RSPAMD_FUZZY_EPOCH8;
+			}
+		}
+		else {
+			ret = RSPAMD_FUZZY_EPOCH8;
+		}
+	}
+
+	return ret;
+}
+/*
+ * Process all commands packed in a single datagram
+ */
+static void
+rspamd_fuzzy_handle_multi (struct fuzzy_session *session, guint8 *buf, gint r)
+{
+	struct rspamd_fuzzy_multi_cmd *mc = (struct rspamd_fuzzy_multi_cmd *)buf;
+	struct rspamd_fuzzy_cmd *cmd;
+	enum rspamd_fuzzy_epoch epoch;
+	guint8 *p = buf + sizeof (*mc);
+	gsize remain = r - sizeof (*mc), len;
+	guint i;
+
+	session->legacy = FALSE;
+
+	for (i = 0; i < mc->count; i ++) {
+		if (remain < sizeof (*cmd)) {
+			msg_debug ("truncated packed fuzzy command received");
+			break;
+		}
+
+		cmd = (struct rspamd_fuzzy_cmd *)p;
+		len = cmd->shingles_count > 0 ?
+				sizeof (struct rspamd_fuzzy_shingle_cmd) : sizeof (*cmd);
+
+		if (remain < len || cmd->cmd == FUZZY_MULTI) {
+			msg_debug ("invalid packed fuzzy command received");
+			break;
+		}
+
+		epoch = rspamd_fuzzy_command_valid (cmd, len);
+
+		if (epoch == RSPAMD_FUZZY_EPOCH_MAX) {
+			msg_debug ("invalid packed fuzzy command received");
+			break;
+		}
+
+		session->cmd = cmd;
+		rspamd_fuzzy_process_command (session, epoch);
+		p += len;
+		remain -= len;
+	}
+}
+
+/*
+ * Parse a single datagram and fill the session reply if needed
+ */
+static void
+rspamd_fuzzy_handle_packet (struct fuzzy_session *session, guint8 *buf, gint r)
+{
+	struct rspamd_fuzzy_cmd *cmd = NULL, lcmd;
+	struct legacy_fuzzy_cmd *l;
+	enum rspamd_fuzzy_epoch epoch = RSPAMD_FUZZY_EPOCH_MAX;
+
+	session->reply_len = 0;
+
+	if (!rspamd_fuzzy_ratelimit_allow (session)) {
+		return;
+	}
+
+	if ((guint)r >= sizeof (struct rspamd_fuzzy_multi_cmd) &&
+			buf[0] == RSPAMD_FUZZY_VERSION && buf[1] == FUZZY_MULTI) {
+		rspamd_fuzzy_handle_multi (session, buf, r);
+	}
+	else if ((guint)r == sizeof (struct legacy_fuzzy_cmd)) {
+		session->legacy = TRUE;
+		l = (struct legacy_fuzzy_cmd *)buf;
+		lcmd.version = 2;
+		memcpy (lcmd.digest, l->hash, sizeof (lcmd.digest));
+		lcmd.cmd = l->cmd;
+		lcmd.flag = l->flag;
+		lcmd.shingles_count = 0;
+		lcmd.value = l->value;
+		lcmd.tag = 0;
+		cmd = &lcmd;
+		epoch = RSPAMD_FUZZY_EPOCH6;
+	}
+	else if ((guint)r >= sizeof (struct rspamd_fuzzy_cmd)) {
+		/* Check shingles count sanity */
+		session->legacy = FALSE;
+		cmd = (struct rspamd_fuzzy_cmd *)buf;
+		epoch = rspamd_fuzzy_command_valid (cmd, r);
+		if (epoch == RSPAMD_FUZZY_EPOCH_MAX) {
+			/* Bad input */
+			msg_debug ("invalid fuzzy command of size %d received", r);
+			cmd = NULL;
+		}
+	}
+	else {
+		/* Discard input */
+		msg_debug ("invalid fuzzy command of size %d received", r);
+	}
+	if (cmd != NULL) {
+		session->cmd = cmd;
+		rspamd_fuzzy_process_command (session, epoch);
+	}
+}
+
+static struct fuzzy_io_batch *
+rspamd_fuzzy_io_batch_new (guint size)
+{
+	struct fuzzy_io_batch *io;
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+	guint i;
+#endif
+
+	if (size == 0) {
+		size = 1;
+	}
+
+	io = g_malloc0 (sizeof (*io));
+	io->size = size;
+	io->bufs = g_malloc (size * FUZZY_IO_BUF_SIZE);
+	io->addrs = g_malloc0 (size * sizeof (*io->addrs));
+	io->sessions = g_malloc0 (size * sizeof (*io->sessions));
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+	io->in_iov = g_malloc0 (size * sizeof (*io->in_iov));
+	io->in_msgs = g_malloc0 (size * sizeof (*io->in_msgs));
+	io->out_iov = g_malloc0 (size * sizeof (*io->out_iov));
+	io->out_msgs = g_malloc0 (size * sizeof (*io->out_msgs));
+
+	for (i = 0; i < size; i ++) {
+		io->in_iov[i].iov_base = io->bufs + i * FUZZY_IO_BUF_SIZE;
+		io->in_iov[i].iov_len = FUZZY_IO_BUF_SIZE;
+	}
+#endif
+
+	return io;
+}
+
+static void
+rspamd_fuzzy_io_batch_free (struct fuzzy_io_batch *io)
+{
+	if (io) {
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+		g_free (io->in_iov);
+		g_free (io->in_msgs);
+		g_free (io->out_iov);
+		g_free (io->out_msgs);
+#endif
+		g_free (io->bufs);
+		g_free (io->addrs);
+		g_free (io->sessions);
+		g_free (io);
+	}
+}
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+/*
+ * Read all datagrams available (up to the batch size) with a single syscall,
+ * process them and send all replies with another one
+ */
+static void
+rspamd_fuzzy_process_batch (struct rspamd_worker *worker, gint fd)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
+	struct fuzzy_io_batch *io = ctx->io;
+	struct fuzzy_session *session;
+	struct mmsghdr *msg;
+	guint64 now;
+	gint r, i, nin, nout = 0, sent;
+
+	for (i = 0; i < (gint)io->size; i ++) {
+		msg = &io->in_msgs[i];
+		memset (&msg->msg_hdr, 0, sizeof (msg->msg_hdr));
+		msg->msg_hdr.msg_name = &io->addrs[i];
+		msg->msg_hdr.msg_namelen = sizeof (io->addrs[i]);
+		msg->msg_hdr.msg_iov = &io->in_iov[i];
+		msg->msg_hdr.msg_iovlen = 1;
+	}
+
+	while ((r = recvmmsg (fd, io->in_msgs, io->size, MSG_DONTWAIT,
+			NULL)) == -1) {
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			msg_err ("got error while reading from socket: %d, %s",
+					errno,
+					strerror (errno));
+		}
+		return;
+	}
+
+	now = (guint64)time (NULL);
+	nin = r;
+
+	for (i = 0; i < nin; i ++) {
+		msg = &io->in_msgs[i];
+		session = &io->sessions[i];
+		session->worker = worker;
+		session->fd = fd;
+		session->ctx = ctx;
+		session->time = now;
+		session->addr = rspamd_inet_address_from_sa (msg->msg_hdr.msg_name,
+				msg->msg_hdr.msg_namelen);
+
+		if (session->addr == NULL) {
+			session->reply_len = 0;
+			continue;
+		}
+
+		rspamd_fuzzy_handle_packet (session, io->bufs + i * FUZZY_IO_BUF_SIZE,
+				msg->msg_len);
+
+		if (session->reply_len > 0) {
+			io->out_iov[nout].iov_base = session->reply;
+			io->out_iov[nout].iov_len = session->reply_len;
+			memset (&io->out_msgs[nout], 0, sizeof (io->out_msgs[nout]));
+			io->out_msgs[nout].msg_hdr.msg_name = msg->msg_hdr.msg_name;
+			io->out_msgs[nout].msg_hdr.msg_namelen = msg->msg_hdr.msg_namelen;
+			io->out_msgs[nout].msg_hdr.msg_iov = &io->out_iov[nout];
+			io->out_msgs[nout].msg_hdr.msg_iovlen = 1;
+			nout ++;
+		}
+	}
+
+	sent = 0;
+
+	while (sent < nout) {
+		r = sendmmsg (fd, io->out_msgs + sent, nout - sent, 0);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			msg_err ("error while writing reply: %s", strerror (errno));
+			/* Skip the failed datagram and try the rest */
+			sent ++;
+		}
+		else {
+			sent += r;
+		}
+	}
+
+	for (i = 0; i < nin; i ++) {
+		if (io->sessions[i].addr) {
+			rspamd_inet_address_destroy (io->sessions[i].addr);
+			io->sessions[i].addr = NULL;
+		}
+	}
+}
+#endif
+
+/*
+ * Accept new connection and construct task
+ */
+static void
+accept_fuzzy_socket (gint fd, short what, void *arg)
+{
+	struct rspamd_worker *worker = (struct rspamd_worker *)arg;
+#if !defined(HAVE_RECVMMSG) || !defined(HAVE_SENDMMSG)
+	struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
+	struct fuzzy_session *session;
+	gint r;
+	guint i;
+#endif
+
+	/* Got some data */
+	if (what == EV_READ) {
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+		rspamd_fuzzy_process_batch (worker, fd);
+#else
+		session = &ctx->io->sessions[0];
+		session->worker = worker;
+		session->fd = fd;
+		session->ctx = ctx;
+
+		/* Drain up to batch size datagrams per wakeup */
+		for (i = 0; i < ctx->io->size; i ++) {
+			while ((r = rspamd_inet_address_recvfrom (fd, ctx->io->bufs,
+					FUZZY_IO_BUF_SIZE, i > 0 ? MSG_DONTWAIT : 0,
+					&session->addr)) == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno != EAGAIN && errno != EWOULDBLOCK) {
+					msg_err ("got error while reading from socket: %d, %s",
+							errno,
+							strerror (errno));
+				}
+				return;
+			}
+
+			session->time = (guint64)time (NULL);
+			rspamd_fuzzy_handle_packet (session, ctx->io->bufs, r);
+
+			if (session->reply_len > 0) {
+				rspamd_fuzzy_send_reply (session);
+			}
+
+			rspamd_inet_address_destroy (session->addr);
+		}
+#endif
+	}
+}
+
+static void
+rspamd_fuzzy_replica_reset (struct fuzzy_replica *replica)
+{
+	if (replica->conn) {
+		rspamd_http_connection_unref (replica->conn);
+		replica->conn = NULL;
+	}
+
+	if (replica->fd != -1) {
+		close (replica->fd);
+		replica->fd = -1;
+	}
+
+	replica->in_flight = FALSE;
+}
+
+static void
+rspamd_fuzzy_replica_error_handler (struct rspamd_http_connection *conn,
+		GError *err)
+{
+	struct fuzzy_replica *replica = conn->ud;
+
+	msg_warn ("cannot send updates to replica %s: %e", replica->name, err);
+	rspamd_fuzzy_replica_reset (replica);
+}
+
+static gint
+rspamd_fuzzy_replica_finish_handler (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg)
+{
+	struct fuzzy_replica *replica = conn->ud;
+	const GString *hdr;
+
+	if (msg->code != 200) {
+		msg_warn ("replica %s refused updates: %d", replica->name, msg->code);
+	}
+	else if ((hdr = rspamd_http_message_find_header (msg, "Seq")) == NULL) {
+		msg_warn ("replica %s has not returned the applied sequence",
+				replica->name);
+	}
+	else {
+		replica->acked = strtoull (hdr->str, NULL, 10);
+		msg_debug ("replica %s has applied updates up to %L", replica->name,
+				replica->acked);
+	}
+
+	rspamd_fuzzy_replica_reset (replica);
+
+	return 0;
+}
+
+/*
+ * Send the next batch of updates to the replica
+ */
+static void
+rspamd_fuzzy_replica_push (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct fuzzy_replica *replica)
+{
+	struct rspamd_fuzzy_repl_header hdr;
+	struct rspamd_http_message *msg;
+	struct fuzzy_repl_entry *entry;
+	GString *body;
+	guint64 first;
+	guint start, count, i;
+
+	if (ctx->repl_log->len == 0 || replica->acked >= ctx->repl_seq) {
+		return;
+	}
+
+	entry = g_ptr_array_index (ctx->repl_log, 0);
+	first = entry->seq;
+
+	if (replica->acked + 1 < first) {
+		msg_warn ("replica %s is too far behind, %L updates are lost for it",
+				replica->name, first - replica->acked - 1);
+		start = 0;
+	}
+	else {
+		start = replica->acked + 1 - first;
+	}
+
+	count = MIN (ctx->repl_log->len - start, ctx->replication_batch);
+
+	replica->fd = rspamd_inet_address_connect (replica->addr, SOCK_STREAM, TRUE);
+
+	if (replica->fd == -1) {
+		msg_warn ("cannot connect to replica %s: %s", replica->name,
+				strerror (errno));
+		return;
+	}
+
+	hdr.version = RSPAMD_FUZZY_REPL_VERSION;
+	hdr.count = count;
+	hdr.epoch = ctx->repl_epoch;
+	body = g_string_sized_new (sizeof (hdr) +
+			count * sizeof (struct rspamd_fuzzy_repl_record));
+	g_string_append_len (body, (const gchar *)&hdr, sizeof (hdr));
+
+	for (i = start; i < start + count; i ++) {
+		entry = g_ptr_array_index (ctx->repl_log, i);
+		g_string_append_len (body, (const gchar *)&entry->seq,
+				sizeof (entry->seq));
+		g_string_append_len (body, (const gchar *)entry->cmd, entry->len);
+	}
+
+	replica->conn = rspamd_http_connection_new (NULL,
+			rspamd_fuzzy_replica_error_handler,
+			rspamd_fuzzy_replica_finish_handler,
+			RSPAMD_HTTP_CLIENT_SIMPLE,
+			RSPAMD_HTTP_CLIENT,
+			ctx->keys_cache);
+	rspamd_http_connection_set_key (replica->conn, ctx->local_key);
+
+	msg = rspamd_http_new_message (HTTP_REQUEST);
+	g_string_append (msg->url, "/replicate");
+	msg->method = HTTP_POST;
+	msg->body = body;
+	msg->peer_key = rspamd_http_connection_key_ref (ctx->replica_key);
+	replica->in_flight = TRUE;
+
+	rspamd_http_connection_write_message (replica->conn, msg, NULL,
+			"application/octet-stream", replica, replica->fd,
+			&ctx->repl_io_tv, ctx->ev_base);
+}
+
+static void
+rspamd_fuzzy_replication_timer (gint fd, short what, void *arg)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = arg;
+	struct fuzzy_replica *replica;
+	struct timeval tv;
+	guint i;
+
+	for (i = 0; i < ctx->replicas->len; i ++) {
+		replica = g_ptr_array_index (ctx->replicas, i);
+
+		if (!replica->in_flight) {
+			rspamd_fuzzy_replica_push (ctx, replica);
+		}
+	}
+
+	double_to_tv (ctx->replication_interval, &tv);
+	evtimer_add (&ctx->repl_ev, &tv);
+}
+
+/*
+ * Apply replication batch received from master
+ */
+static gboolean
+rspamd_fuzzy_apply_replication (struct rspamd_fuzzy_storage_ctx *ctx,
+		const GString *body)
+{
+	const struct rspamd_fuzzy_repl_header *hdr;
+	const struct rspamd_fuzzy_repl_record *rec;
+	const guchar *p, *end;
+	guint64 seq;
+	gsize len;
+	guint i, napplied = 0;
+
+	if (body == NULL || body->len < sizeof (*hdr)) {
+		msg_warn ("got too short replication batch");
+		return FALSE;
+	}
+
+	p = (const guchar *)body->str;
+	end = p + body->len;
+	hdr = (const struct rspamd_fuzzy_repl_header *)p;
+	p += sizeof (*hdr);
+
+	if (hdr->version != RSPAMD_FUZZY_REPL_VERSION) {
+		msg_warn ("got replication batch of unknown version %ud", hdr->version);
+		return FALSE;
+	}
+
+	if (hdr->epoch != ctx->repl_master_epoch) {
+		/* Master has been restarted and begins a new log */
+		msg_info ("starting replication from new master log %XL", hdr->epoch);
+		ctx->repl_master_epoch = hdr->epoch;
+		ctx->repl_applied_seq = 0;
+	}
+
+	for (i = 0; i < hdr->count; i ++) {
+		if (p + sizeof (*rec) > end) {
+			msg_warn ("got truncated replication batch");
+			return FALSE;
+		}
+
+		rec = (const struct rspamd_fuzzy_repl_record *)p;
+		len = rec->cmd.shingles_count > 0 ?
+				sizeof (struct rspamd_fuzzy_shingle_cmd) : sizeof (rec->cmd);
+
+		if (p + sizeof (rec->seq) + len > end) {
+			msg_warn ("got truncated replication batch");
+			return FALSE;
+		}
+
+		p += sizeof (rec->seq) + len;
+		memcpy (&seq, &rec->seq, sizeof (seq));
+
+		if (seq <= ctx->repl_applied_seq) {
+			/* Already applied */
+			continue;
+		}
+
+		if (seq != ctx->repl_applied_seq + 1) {
+			msg_warn ("missed %L updates from master",
+					seq - ctx->repl_applied_seq - 1);
+		}
+
+		if (rec->cmd.cmd == FUZZY_EXPIRE) {
+			if (ctx->updates_pending != NULL) {
+				rspamd_fuzzy_flush_updates (ctx);
+			}
+
+			rspamd_fuzzy_backend_expire (ctx->backend, rec->cmd.value,
+					rec->cmd.tag);
+			server_stat->fuzzy_hashes_expired =
+					rspamd_fuzzy_backend_expired (ctx->backend);
+		}
+		else if (rec->cmd.cmd == FUZZY_WRITE || rec->cmd.cmd == FUZZY_DEL) {
+			if (!rspamd_fuzzy_apply_update (ctx, &rec->cmd)) {
+				msg_warn ("cannot apply replicated update %L", seq);
+			}
+		}
+
+		ctx->repl_applied_seq = seq;
+		napplied ++;
+	}
+
+	/* Acknowledge only updates that have reached the database */
+	if (ctx->updates_pending != NULL) {
+		rspamd_fuzzy_flush_updates (ctx);
+	}
+	else {
+		rspamd_fuzzy_backend_sync (ctx->backend, 0);
+	}
+
+	server_stat->fuzzy_hashes = rspamd_fuzzy_backend_count (ctx->backend);
+	msg_debug ("applied %ud replicated updates, last sequence: %L", napplied,
+			ctx->repl_applied_seq);
+
+	return TRUE;
+}
+
+static void
+rspamd_fuzzy_repl_session_free (struct fuzzy_repl_session *session)
+{
+	rspamd_http_connection_unref (session->conn);
+	rspamd_inet_address_destroy (session->addr);
+	close (session->fd);
+	g_slice_free1 (sizeof (*session), session);
+}
+
+static void
+rspamd_fuzzy_repl_error_handler (struct rspamd_http_connection *conn,
+		GError *err)
+{
+	struct fuzzy_repl_session *session = conn->ud;
+
+	msg_warn ("abnormally closing replication connection from %s: %e",
+			rspamd_inet_address_to_string (session->addr), err);
+	rspamd_fuzzy_repl_session_free (session);
+}
+
+static gint
+rspamd_fuzzy_repl_finish_handler (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg)
+{
+	struct fuzzy_repl_session *session = conn->ud;
+	struct rspamd_http_message *reply;
+	gchar seqbuf[32];
+	gint code = 200;
+
+	if (session->replied) {
+		rspamd_fuzzy_repl_session_free (session);
+		return 0;
+	}
+
+	session->replied = TRUE;
+
+	if (!rspamd_http_connection_is_encrypted (conn)) {
+		msg_warn ("refuse unencrypted replication from %s",
+				rspamd_inet_address_to_string (session->addr));
+		code = 403;
+	}
+	else if (!rspamd_fuzzy_apply_replication (session->ctx, msg->body)) {
+		code = 400;
+	}
+
+	rspamd_http_connection_reset (conn);
+	reply = rspamd_http_new_message (HTTP_RESPONSE);
+	reply->code = code;
+	rspamd_snprintf (seqbuf, sizeof (seqbuf), "%uL",
+			session->ctx->repl_applied_seq);
+	rspamd_http_message_add_header (reply, "Seq", seqbuf);
+	rspamd_http_connection_write_message (conn, reply, NULL, "text/plain",
+			session, session->fd, &session->ctx->repl_io_tv,
+			session->ctx->ev_base);
+
+	return 0;
+}
+
+static void
+rspamd_fuzzy_replication_accept (gint fd, short what, void *arg)
 {
-	if (session->ctx->update_ips != NULL) {
-		if (radix_find_compressed_addr (session->ctx->update_ips,
-				session->addr) == RADIX_NO_VALUE) {
-			return FALSE;
-		}
+	struct rspamd_fuzzy_storage_ctx *ctx = arg;
+	struct fuzzy_repl_session *session;
+	rspamd_inet_addr_t *addr;
+	gint nfd;
+
+	if ((nfd = rspamd_accept_from_socket (fd, &addr)) == -1) {
+		msg_warn ("accept failed: %s", strerror (errno));
+		return;
 	}
-	return TRUE;
+	/* Check for EAGAIN */
+	if (nfd == 0) {
+		return;
+	}
+
+	if (ctx->replication_allow != NULL &&
+			radix_find_compressed_addr (ctx->replication_allow, addr) ==
+			RADIX_NO_VALUE) {
+		msg_warn ("refuse replication connection from %s",
+				rspamd_inet_address_to_string (addr));
+		rspamd_inet_address_destroy (addr);
+		close (nfd);
+		return;
+	}
+
+	session = g_slice_alloc0 (sizeof (*session));
+	session->ctx = ctx;
+	session->addr = addr;
+	session->fd = nfd;
+	session->conn = rspamd_http_connection_new (NULL,
+			rspamd_fuzzy_repl_error_handler,
+			rspamd_fuzzy_repl_finish_handler,
+			0,
+			RSPAMD_HTTP_SERVER,
+			ctx->keys_cache);
+	rspamd_http_connection_set_key (session->conn, ctx->keypair);
+	rspamd_http_connection_read_message (session->conn, session, nfd,
+			&ctx->repl_io_tv, ctx->ev_base);
 }
 
 static void
-rspamd_fuzzy_write_reply (struct fuzzy_session *session,
-		struct rspamd_fuzzy_reply *rep)
+rspamd_fuzzy_replication_init (struct rspamd_worker *worker,
+		struct rspamd_fuzzy_storage_ctx *ctx)
 {
-	gint r;
-	gchar buf[64];
+	struct fuzzy_replica *replica;
+	struct event *ev;
+	struct timeval tv;
+	GPtrArray *addrs = NULL;
+	GList *cur;
+	gchar *name;
+	guint i;
+	gint fd;
 
-	if (session->legacy) {
-		if (rep->prob > 0.5) {
-			if (session->cmd->cmd == FUZZY_CHECK) {
-				r = rspamd_snprintf (buf, sizeof (buf), "OK %d %d" CRLF,
-						rep->value, rep->flag);
-			}
-			else {
-				r = rspamd_snprintf (buf, sizeof (buf), "OK" CRLF);
-			}
+	if (ctx->replicas_list == NULL && ctx->replication_bind == NULL) {
+		return;
+	}
 
+	ctx->keys_cache = rspamd_keypair_cache_new (256);
+	rspamd_keypair_cache_set_counters (ctx->keys_cache,
+			&worker->srv->stat->keys_cache_hits,
+			&worker->srv->stat->keys_cache_misses);
+	double_to_tv (ctx->replication_timeout, &ctx->repl_io_tv);
+
+	if (ctx->replicas_list != NULL) {
+		if (ctx->replica_key_str == NULL || (ctx->replica_key =
+				rspamd_http_connection_make_peer_key (ctx->replica_key_str)) ==
+				NULL) {
+			msg_err ("replication requires a valid `replica_key`, "
+					"updates are not replicated");
 		}
 		else {
-			r = rspamd_snprintf (buf, sizeof (buf), "ERR" CRLF);
+			ctx->local_key = ctx->keypair ? ctx->keypair :
+					rspamd_http_connection_gen_key ();
+			ctx->replicas = g_ptr_array_new ();
+			ctx->repl_log = g_ptr_array_new_with_free_func (
+					rspamd_fuzzy_repl_entry_free);
+			ctx->repl_epoch = ottery_rand_uint64 ();
+
+			for (cur = ctx->replicas_list; cur != NULL; cur = g_list_next (cur)) {
+				if (!rspamd_parse_host_port (cur->data, &addrs, &name,
+						DEFAULT_REPLICATION_PORT, worker->srv->cfg->cfg_pool)) {
+					msg_err ("cannot parse replica address: %s",
+							(const gchar *)cur->data);
+					continue;
+				}
+
+				for (i = 0; i < addrs->len; i ++) {
+					replica = g_slice_alloc0 (sizeof (*replica));
+					replica->name = name;
+					replica->addr = g_ptr_array_index (addrs, i);
+					replica->fd = -1;
+					g_ptr_array_add (ctx->replicas, replica);
+				}
+			}
+
+			evtimer_set (&ctx->repl_ev, rspamd_fuzzy_replication_timer, ctx);
+			event_base_set (ctx->ev_base, &ctx->repl_ev);
+			double_to_tv (ctx->replication_interval, &tv);
+			evtimer_add (&ctx->repl_ev, &tv);
 		}
-		r = rspamd_inet_address_sendto (session->fd, buf, r, 0, session->addr);
-	}
-	else {
-		r = rspamd_inet_address_sendto (session->fd, rep, sizeof (*rep), 0,
-				session->addr);
 	}
 
-	if (r == -1) {
-		if (errno == EINTR) {
-			rspamd_fuzzy_write_reply (session, rep);
+	if (ctx->replication_bind != NULL) {
+		if (ctx->keypair == NULL) {
+			msg_err ("replica requires `keypair`, replication is disabled");
+			return;
 		}
-		else {
-			msg_err ("error while writing reply: %s", strerror (errno));
+
+		if (ctx->replication_allow_map != NULL) {
+			if (!rspamd_map_add (worker->srv->cfg, ctx->replication_allow_map,
+					"Allow replication from specified addresses",
+					rspamd_radix_read, rspamd_radix_fin,
+					(void **)&ctx->replication_allow)) {
+				if (!radix_add_generic_iplist (ctx->replication_allow_map,
+						&ctx->replication_allow)) {
+					msg_warn ("cannot load or parse ip list from '%s'",
+							ctx->replication_allow_map);
+				}
+			}
+		}
+
+		addrs = NULL;
+
+		if (!rspamd_parse_host_port (ctx->replication_bind, &addrs, &name,
+				DEFAULT_REPLICATION_PORT, worker->srv->cfg->cfg_pool)) {
+			msg_err ("cannot parse replication address: %s",
+					ctx->replication_bind);
+			return;
+		}
+
+		for (i = 0; i < addrs->len; i ++) {
+			fd = rspamd_inet_address_listen (g_ptr_array_index (addrs, i),
+					SOCK_STREAM, TRUE, FALSE);
+
+			if (fd == -1) {
+				msg_err ("cannot listen for replication on %s: %s",
+						ctx->replication_bind, strerror (errno));
+				continue;
+			}
+
+			ev = g_slice_alloc0 (sizeof (*ev));
+			event_set (ev, fd, EV_READ | EV_PERSIST,
+					rspamd_fuzzy_replication_accept, ctx);
+			event_base_set (ctx->ev_base, ev);
+			event_add (ev, NULL);
+			ctx->repl_listen_events = g_list_prepend (ctx->repl_listen_events,
+					ev);
 		}
 	}
 }
 
-static void
-rspamd_fuzzy_process_command (struct fuzzy_session *session,
-		enum rspamd_fuzzy_epoch epoch)
+static gint
+rspamd_fuzzy_filter_finish_handler (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg)
 {
-	struct rspamd_fuzzy_reply rep = {0, 0, 0, 0.0};
-	gboolean res = FALSE;
+	struct fuzzy_repl_session *session = conn->ud;
+	struct rspamd_fuzzy_storage_ctx *ctx = session->ctx;
+	struct rspamd_http_message *reply;
+	const GString *inm;
+	gchar etag[32];
+	gsize etag_len;
 
-	if (session->cmd->cmd == FUZZY_CHECK) {
-		rep = rspamd_fuzzy_backend_check (session->ctx->backend, session->cmd,
-				session->ctx->expire);
-		/* XXX: actually, these updates are not atomic, but we don't care */
-		server_stat->fuzzy_hashes_checked[epoch] ++;
+	if (session->replied) {
+		rspamd_fuzzy_repl_session_free (session);
+		return 0;
+	}
 
-		if (rep.prob > 0.5) {
-			server_stat->fuzzy_hashes_found[epoch] ++;
-		}
+	session->replied = TRUE;
+	etag_len = rspamd_snprintf (etag, sizeof (etag), "\"%uL\"",
+			ctx->filter_gen);
+	inm = rspamd_http_message_find_header (msg, "If-None-Match");
+
+	rspamd_http_connection_reset (conn);
+	reply = rspamd_http_new_message (HTTP_RESPONSE);
+	reply->date = time (NULL);
+
+	if (ctx->filter == NULL) {
+		reply->code = 503;
+	}
+	else if (inm != NULL && inm->len == etag_len &&
+			memcmp (inm->str, etag, etag_len) == 0) {
+		reply->code = 304;
 	}
 	else {
-		rep.flag = session->cmd->flag;
-		if (rspamd_fuzzy_check_client (session)) {
-			if (session->cmd->cmd == FUZZY_WRITE) {
-				res = rspamd_fuzzy_backend_add (session->ctx->backend,
-						session->cmd);
-			}
-			else {
-				res = rspamd_fuzzy_backend_del (session->ctx->backend,
-						session->cmd);
-			}
-			if (!res) {
-				rep.value = 404;
-				rep.prob = 0.0;
-			}
-			else {
-				rep.value = 0;
-				rep.prob = 1.0;
-			}
-		}
-		else {
-			rep.value = 403;
-			rep.prob = 0.0;
-		}
-		server_stat->fuzzy_hashes = rspamd_fuzzy_backend_count (session->ctx->backend);
+		reply->code = 200;
+		reply->body = g_string_new_len ((const gchar *)ctx->filter->data,
+				ctx->filter->len);
 	}
 
-	rep.tag = session->cmd->tag;
-	rspamd_fuzzy_write_reply (session, &rep);
+	rspamd_http_message_add_header (reply, "ETag", etag);
+	rspamd_http_connection_write_message (conn, reply, NULL,
+			"application/octet-stream", session, session->fd,
+			&ctx->filter_io_tv, ctx->ev_base);
+
+	return 0;
 }
 
+static void
+rspamd_fuzzy_filter_error_handler (struct rspamd_http_connection *conn,
+		GError *err)
+{
+	struct fuzzy_repl_session *session = conn->ud;
+
+	msg_info ("abnormally closing filter connection from %s: %e",
+			rspamd_inet_address_to_string (session->addr), err);
+	rspamd_fuzzy_repl_session_free (session);
+}
 
-static enum rspamd_fuzzy_epoch
-rspamd_fuzzy_command_valid (struct rspamd_fuzzy_cmd *cmd, gint r)
+static void
+rspamd_fuzzy_filter_accept (gint fd, short what, void *arg)
 {
-	enum rspamd_fuzzy_epoch ret = RSPAMD_FUZZY_EPOCH_MAX;
+	struct rspamd_fuzzy_storage_ctx *ctx = arg;
+	struct fuzzy_repl_session *session;
+	rspamd_inet_addr_t *addr;
+	gint nfd;
 
-	if (cmd->version == RSPAMD_FUZZY_VERSION) {
-		if (cmd->shingles_count > 0) {
-			if (r == sizeof (struct rspamd_fuzzy_shingle_cmd)) {
-				ret = RSPAMD_FUZZY_EPOCH9;
-			}
-		}
-		else {
-			if (r == sizeof (*cmd)) {
-				ret = RSPAMD_FUZZY_EPOCH9;
-			}
-		}
+	if ((nfd = rspamd_accept_from_socket (fd, &addr)) == -1) {
+		msg_warn ("accept failed: %s", strerror (errno));
+		return;
 	}
-	else if (cmd->version == 2) {
-		/*
-		 * rspamd 0.8 has slightly different tokenizer then it might be not
-		 * 100% compatible
-		 */
-		if (cmd->shingles_count > 0) {
-			if (r == sizeof (struct rspamd_fuzzy_shingle_cmd)) {
-				ret = RSPAMD_FUZZY_EPOCH8;
-			}
-		}
-		else {
-			ret = RSPAMD_FUZZY_EPOCH8;
-		}
+	/* Check for EAGAIN */
+	if (nfd == 0) {
+		return;
 	}
 
-	return ret;
+	session = g_slice_alloc0 (sizeof (*session));
+	session->ctx = ctx;
+	session->addr = addr;
+	session->fd = nfd;
+	session->conn = rspamd_http_connection_new (NULL,
+			rspamd_fuzzy_filter_error_handler,
+			rspamd_fuzzy_filter_finish_handler,
+			0,
+			RSPAMD_HTTP_SERVER,
+			NULL);
+	rspamd_http_connection_read_message (session->conn, session, nfd,
+			&ctx->filter_io_tv, ctx->ev_base);
 }
+
+static void
+rspamd_fuzzy_filter_rebuild (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	GByteArray *filter;
+	GError *err = NULL;
+
+	if (ctx->updates_pending != NULL) {
+		/* Filter is built from storage, so it must have all updates */
+		rspamd_fuzzy_flush_updates (ctx);
+	}
+
+	if ((filter = rspamd_fuzzy_backend_build_filter (ctx->backend, &err)) ==
+			NULL) {
+		msg_err ("cannot build fuzzy filter: %e", err);
+		g_error_free (err);
+		return;
+	}
+
+	if (ctx->filter != NULL) {
+		g_byte_array_free (ctx->filter, TRUE);
+	}
+
+	ctx->filter = filter;
+	ctx->filter_gen ++;
+	ctx->filter_dirty = FALSE;
+	ctx->filter_cycles = 0;
+	msg_info ("built fuzzy filter of %ud bytes", filter->len);
+}
+
 /*
- * Accept new connection and construct task
+ * Clients reload filter when its generation is changed, so new digests are
+ * published once per interval
  */
 static void
-accept_fuzzy_socket (gint fd, short what, void *arg)
+rspamd_fuzzy_filter_timer (gint fd, short what, void *arg)
 {
-	struct rspamd_worker *worker = (struct rspamd_worker *)arg;
-	struct fuzzy_session session;
-	gint r;
-	guint8 buf[2048];
-	struct rspamd_fuzzy_cmd *cmd = NULL, lcmd;
-	struct legacy_fuzzy_cmd *l;
-	enum rspamd_fuzzy_epoch epoch = RSPAMD_FUZZY_EPOCH_MAX;
+	struct rspamd_fuzzy_storage_ctx *ctx = arg;
+	struct timeval tv;
 
-	session.worker = worker;
-	session.fd = fd;
-	session.ctx = worker->ctx;
-	session.time = (guint64)time (NULL);
+	if (++ctx->filter_cycles >= FILTER_REBUILD_CYCLES) {
+		rspamd_fuzzy_filter_rebuild (ctx);
+	}
+	else if (ctx->filter_dirty) {
+		ctx->filter_gen ++;
+		ctx->filter_dirty = FALSE;
+	}
 
-	/* Got some data */
-	if (what == EV_READ) {
-		while ((r = rspamd_inet_address_recvfrom (fd, buf, sizeof (buf), 0,
-			&session.addr)) == -1) {
-			if (errno == EINTR) {
-				continue;
-			}
-			msg_err ("got error while reading from socket: %d, %s",
-				errno,
-				strerror (errno));
-			return;
-		}
+	double_to_tv (ctx->filter_interval, &tv);
+	evtimer_add (&ctx->filter_ev, &tv);
+}
 
-		if ((guint)r == sizeof (struct legacy_fuzzy_cmd)) {
-			session.legacy = TRUE;
-			l = (struct legacy_fuzzy_cmd *)buf;
-			lcmd.version = 2;
-			memcpy (lcmd.digest, l->hash, sizeof (lcmd.digest));
-			lcmd.cmd = l->cmd;
-			lcmd.flag = l->flag;
-			lcmd.shingles_count = 0;
-			lcmd.value = l->value;
-			lcmd.tag = 0;
-			cmd = &lcmd;
-			epoch = RSPAMD_FUZZY_EPOCH6;
-		}
-		else if ((guint)r >= sizeof (struct rspamd_fuzzy_cmd)) {
-			/* Check shingles count sanity */
-			session.legacy = FALSE;
-			cmd = (struct rspamd_fuzzy_cmd *)buf;
-			epoch = rspamd_fuzzy_command_valid (cmd, r);
-			if (epoch == RSPAMD_FUZZY_EPOCH_MAX) {
-				/* Bad input */
-				msg_debug ("invalid fuzzy command of size %d received", r);
-				cmd = NULL;
-			}
-		}
-		else {
-			/* Discard input */
-			msg_debug ("invalid fuzzy command of size %d received", r);
-		}
-		if (cmd != NULL) {
-			session.cmd = cmd;
-			rspamd_fuzzy_process_command (&session, epoch);
+static void
+rspamd_fuzzy_filter_init (struct rspamd_worker *worker,
+		struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	struct event *ev;
+	struct timeval tv;
+	GPtrArray *addrs = NULL;
+	gchar *name;
+	guint i;
+	gint fd;
+
+	if (ctx->filter_bind == NULL) {
+		return;
+	}
+
+	if (!rspamd_parse_host_port (ctx->filter_bind, &addrs, &name,
+			DEFAULT_FILTER_PORT, worker->srv->cfg->cfg_pool)) {
+		msg_err ("cannot parse filter address: %s", ctx->filter_bind);
+		return;
+	}
+
+	rspamd_fuzzy_filter_rebuild (ctx);
+	double_to_tv (ctx->replication_timeout, &ctx->filter_io_tv);
+
+	for (i = 0; i < addrs->len; i ++) {
+		fd = rspamd_inet_address_listen (g_ptr_array_index (addrs, i),
+				SOCK_STREAM, TRUE, FALSE);
+
+		if (fd == -1) {
+			msg_err ("cannot listen for filter requests on %s: %s",
+					ctx->filter_bind, strerror (errno));
+			continue;
 		}
 
-		rspamd_inet_address_destroy (session.addr);
+		ev = g_slice_alloc0 (sizeof (*ev));
+		event_set (ev, fd, EV_READ | EV_PERSIST,
+				rspamd_fuzzy_filter_accept, ctx);
+		event_base_set (ctx->ev_base, ev);
+		event_add (ev, NULL);
+		ctx->filter_listen_events = g_list_prepend (ctx->filter_listen_events,
+				ev);
 	}
+
+	evtimer_set (&ctx->filter_ev, rspamd_fuzzy_filter_timer, ctx);
+	event_base_set (ctx->ev_base, &ctx->filter_ev);
+	double_to_tv (ctx->filter_interval, &tv);
+	evtimer_add (&ctx->filter_ev, &tv);
 }
 
 static void
@@ -317,9 +1692,39 @@ sync_callback (gint fd, short what, void *arg)
 	evtimer_add (&tev, &tmv);
 
 	/* Call backend sync */
-	rspamd_fuzzy_backend_sync (ctx->backend, ctx->expire);
+	if (ctx->updates_pending != NULL) {
+		rspamd_fuzzy_flush_updates (ctx);
+	}
+
+	/* Expiration is performed incrementally by the expire timer */
+	rspamd_fuzzy_backend_sync (ctx->backend, 0);
+}
+
+/*
+ * Remove a bounded chunk of expired hashes, so the event loop is never
+ * blocked by a large expiration
+ */
+static void
+rspamd_fuzzy_expire_timer (gint fd, short what, void *arg)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = arg;
+	struct timeval tv;
+	gsize removed;
+
+	removed = rspamd_fuzzy_backend_expire (ctx->backend, ctx->expire,
+			MAX (ctx->expire_chunk, 1));
+
+	if (removed > 0) {
+		rspamd_fuzzy_replicate_expire (ctx, removed);
+		server_stat->fuzzy_hashes = rspamd_fuzzy_backend_count (ctx->backend);
+	}
 
 	server_stat->fuzzy_hashes_expired = rspamd_fuzzy_backend_expired (ctx->backend);
+	server_stat->fuzzy_expire_backlog =
+			rspamd_fuzzy_backend_expire_backlog (ctx->backend);
+
+	double_to_tv (ctx->expire_interval, &tv);
+	evtimer_add (&ctx->expire_ev, &tv);
 }
 
 gpointer
@@ -333,6 +1738,17 @@ init_fuzzy (struct rspamd_config *cfg)
 	ctx = g_malloc0 (sizeof (struct rspamd_fuzzy_storage_ctx));
 
 	ctx->sync_timeout = DEFAULT_SYNC_TIMEOUT;
+	ctx->expire_interval = DEFAULT_EXPIRE_INTERVAL;
+	ctx->expire_chunk = DEFAULT_EXPIRE_CHUNK;
+	ctx->updates_batch = DEFAULT_UPDATES_BATCH;
+	ctx->updates_timeout = DEFAULT_UPDATES_TIMEOUT;
+	ctx->io_batch = DEFAULT_IO_BATCH;
+	ctx->replication_log_size = DEFAULT_REPLICATION_LOG;
+	ctx->replication_batch = DEFAULT_REPLICATION_BATCH;
+	ctx->replication_interval = DEFAULT_REPLICATION_INTERVAL;
+	ctx->replication_timeout = DEFAULT_REPLICATION_TIMEOUT;
+	ctx->filter_interval = DEFAULT_FILTER_INTERVAL;
+	ctx->ratelimit_buckets = DEFAULT_RATELIMIT_BUCKETS;
 
 	rspamd_rcl_register_worker_option (cfg, type, "hashfile",
 		rspamd_rcl_parse_struct_string, ctx,
@@ -360,10 +1776,105 @@ init_fuzzy (struct rspamd_config *cfg)
 		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
 		expire), RSPAMD_CL_FLAG_TIME_FLOAT);
 
+	rspamd_rcl_register_worker_option (cfg, type, "expire_interval",
+		rspamd_rcl_parse_struct_time, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+		expire_interval), RSPAMD_CL_FLAG_TIME_FLOAT);
+
+	rspamd_rcl_register_worker_option (cfg, type, "expire_chunk",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+		expire_chunk), RSPAMD_CL_FLAG_INT_32);
+
 	rspamd_rcl_register_worker_option (cfg, type, "allow_update",
 		rspamd_rcl_parse_struct_string, ctx,
 		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, update_map), 0);
 
+	rspamd_rcl_register_worker_option (cfg, type, "memory_index",
+		rspamd_rcl_parse_struct_boolean, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, memory_index), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "ratelimit_rate",
+		rspamd_rcl_parse_struct_double, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, ratelimit_rate), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "ratelimit_burst",
+		rspamd_rcl_parse_struct_double, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, ratelimit_burst), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "ratelimit_buckets",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+		ratelimit_buckets), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "compact_index",
+		rspamd_rcl_parse_struct_string, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, compact_index), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "updates_batch",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+		updates_batch), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "updates_timeout",
+		rspamd_rcl_parse_struct_time, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+		updates_timeout), RSPAMD_CL_FLAG_TIME_FLOAT);
+
+	rspamd_rcl_register_worker_option (cfg, type, "io_batch",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+		io_batch), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "replicas",
+		rspamd_rcl_parse_struct_string_list, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, replicas_list), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "replica_key",
+		rspamd_rcl_parse_struct_string, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, replica_key_str), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "keypair",
+		rspamd_rcl_parse_struct_keypair, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, keypair), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "replication_bind",
+		rspamd_rcl_parse_struct_string, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, replication_bind), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "replication_allow",
+		rspamd_rcl_parse_struct_string, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+		replication_allow_map), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "replication_log",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+		replication_log_size), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "replication_batch",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+		replication_batch), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "replication_interval",
+		rspamd_rcl_parse_struct_time, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+		replication_interval), RSPAMD_CL_FLAG_TIME_FLOAT);
+
+	rspamd_rcl_register_worker_option (cfg, type, "replication_timeout",
+		rspamd_rcl_parse_struct_time, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+		replication_timeout), RSPAMD_CL_FLAG_TIME_FLOAT);
+
+	rspamd_rcl_register_worker_option (cfg, type, "filter_bind",
+		rspamd_rcl_parse_struct_string, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, filter_bind), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "filter_interval",
+		rspamd_rcl_parse_struct_time, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+		filter_interval), RSPAMD_CL_FLAG_TIME_FLOAT);
 
 	return ctx;
 }
@@ -377,7 +1888,10 @@ start_fuzzy (struct rspamd_worker *worker)
 	struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
 	GError *err = NULL;
 	gdouble next_check;
+	struct timeval tv;
+	guint32 nbuckets;
 
+	ctx->io = rspamd_fuzzy_io_batch_new (ctx->io_batch);
 	ctx->ev_base = rspamd_prepare_worker (worker,
 			"fuzzy",
 			accept_fuzzy_socket);
@@ -390,8 +1904,37 @@ start_fuzzy (struct rspamd_worker *worker)
 		exit (EXIT_FAILURE);
 	}
 
+	if (ctx->compact_index != NULL) {
+		if (ctx->memory_index) {
+			msg_warn ("memory index is not used with compact index");
+		}
+
+		if (!rspamd_fuzzy_backend_build_compact (ctx->backend,
+				ctx->compact_index, &err)) {
+			msg_err ("cannot build compact index: %e", err);
+			g_error_free (err);
+			exit (EXIT_FAILURE);
+		}
+	}
+	else if (ctx->memory_index &&
+			!rspamd_fuzzy_backend_build_index (ctx->backend, &err)) {
+		msg_err ("cannot build memory index: %e", err);
+		g_error_free (err);
+		exit (EXIT_FAILURE);
+	}
+
 	server_stat->fuzzy_hashes = rspamd_fuzzy_backend_count (ctx->backend);
 
+	/* Zero batch size means that updates are applied immediately */
+	if (ctx->updates_batch > 0) {
+		ctx->updates_pending = g_queue_new ();
+		ctx->pending_digests = g_hash_table_new_full (rspamd_fuzzy_digest_hash,
+				rspamd_fuzzy_digest_equal, NULL,
+				rspamd_fuzzy_pending_digest_free);
+		evtimer_set (&ctx->updates_ev, rspamd_fuzzy_updates_timer, ctx);
+		event_base_set (ctx->ev_base, &ctx->updates_ev);
+	}
+
 	/* Timer event */
 	evtimer_set (&tev, sync_callback, worker);
 	event_base_set (ctx->ev_base, &tev);
@@ -414,13 +1957,55 @@ start_fuzzy (struct rspamd_worker *worker)
 		}
 	}
 
+	if (ctx->ratelimit_rate > 0) {
+		nbuckets = 1;
+
+		while (nbuckets < ctx->ratelimit_buckets) {
+			nbuckets <<= 1;
+		}
+
+		ctx->ratelimit_buckets = nbuckets;
+		if (ctx->ratelimit_burst < 1.0) {
+			/* Allow one second of requests by default */
+			ctx->ratelimit_burst = MAX (ctx->ratelimit_rate, 1.0);
+		}
+
+		ctx->ratelimit = g_malloc0 (nbuckets * sizeof (*ctx->ratelimit));
+	}
+
+	rspamd_fuzzy_replication_init (worker, ctx);
+	rspamd_fuzzy_filter_init (worker, ctx);
+
+	/* Replicas expire hashes when master says so */
+	if (ctx->expire > 0 && ctx->repl_listen_events == NULL) {
+		evtimer_set (&ctx->expire_ev, rspamd_fuzzy_expire_timer, ctx);
+		event_base_set (ctx->ev_base, &ctx->expire_ev);
+		double_to_tv (ctx->expire_interval, &tv);
+		evtimer_add (&ctx->expire_ev, &tv);
+	}
+
 	/* Maps events */
 	rspamd_map_watch (worker->srv->cfg, ctx->ev_base);
 
 	event_base_loop (ctx->ev_base, 0);
 
-	rspamd_fuzzy_backend_sync (ctx->backend, ctx->expire);
+	if (ctx->updates_pending != NULL) {
+		rspamd_fuzzy_flush_updates (ctx);
+		g_queue_free (ctx->updates_pending);
+		g_hash_table_unref (ctx->pending_digests);
+	}
+
+	rspamd_fuzzy_backend_sync (ctx->backend, 0);
 	rspamd_fuzzy_backend_close (ctx->backend);
+	rspamd_fuzzy_io_batch_free (ctx->io);
+	g_free (ctx->ratelimit);
+
+	if (ctx->repl_log != NULL) {
+		g_ptr_array_free (ctx->repl_log, TRUE);
+	}
+	if (ctx->keys_cache != NULL) {
+		rspamd_keypair_cache_destroy (ctx->keys_cache);
+	}
 	rspamd_log_close (rspamd_main->logger);
 	exit (EXIT_SUCCESS);
 }
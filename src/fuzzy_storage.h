@@ -12,6 +12,25 @@
 #define FUZZY_CHECK 0
 #define FUZZY_WRITE 1
 #define FUZZY_DEL 2
+/* Used in the replication stream only */
+#define FUZZY_EXPIRE 3
+/* Several commands packed in a single datagram */
+#define FUZZY_MULTI 4
+
+/*
+ * Flag in `shingles_count` of commands with shingles generated by
+ * rspamd_shingles_generate_fast, such shingles are stored with different
+ * numbers, so they are never compared with shingles of the default algorithm
+ */
+#define RSPAMD_FUZZY_SHINGLES_FAST 0x80
+#define RSPAMD_FUZZY_SHINGLE_NUMBER(cmd, i) \
+	(((cmd)->shingles_count & RSPAMD_FUZZY_SHINGLES_FAST) ? \
+	(i) + RSPAMD_SHINGLE_SIZE : (i))
+
+/* Maximum size of a datagram with packed commands */
+#define RSPAMD_FUZZY_MAX_DATAGRAM 4096
+
+#define RSPAMD_FUZZY_REPL_VERSION 1
 
 struct legacy_fuzzy_cmd {
 	u_char cmd;
@@ -36,6 +55,17 @@ RSPAMD_PACKED(rspamd_fuzzy_shingle_cmd) {
 	struct rspamd_shingle sgl;
 };
 
+/*
+ * Header of a datagram with `count` packed commands, each command is followed
+ * by its shingles if `shingles_count` > 0. Storage replies with a single datagram
+ * containing replies for all commands that are matched by tags
+ */
+RSPAMD_PACKED(rspamd_fuzzy_multi_cmd) {
+	guint8 version;
+	guint8 cmd;
+	guint16 count;
+};
+
 RSPAMD_PACKED(rspamd_fuzzy_reply) {
 	gint32 value;
 	guint32 flag;
@@ -43,4 +73,19 @@ RSPAMD_PACKED(rspamd_fuzzy_reply) {
 	float prob;
 };
 
+/*
+ * Replication batch sent from master to replicas: header followed by `count`
+ * records, each record is followed by shingles if `cmd.shingles_count` > 0
+ */
+RSPAMD_PACKED(rspamd_fuzzy_repl_header) {
+	guint32 version;
+	guint32 count;
+	guint64 epoch;
+};
+
+RSPAMD_PACKED(rspamd_fuzzy_repl_record) {
+	guint64 seq;
+	struct rspamd_fuzzy_cmd cmd;
+};
+
 #endif
@@ -33,10 +33,17 @@
 #include "libmime/message.h"
 #include "main.h"
 #include "keypairs_cache.h"
+#include "keypairs_pool.h"
 #include "ottery.h"
 
 /* Rotate keys each minute by default */
 #define DEFAULT_ROTATION_TIME 60.0
+/* Idle connections kept for each backend host */
+#define DEFAULT_BACKEND_POOL_SIZE 16
+/* Should be less than keepalive timeout of backends */
+#define DEFAULT_BACKEND_IDLE_TIMEOUT 5.0
+/* Keypairs generated in advance for rotation */
+#define HTTP_PROXY_KEYS_POOL_SIZE 4
 
 gpointer init_http_proxy (struct rspamd_config *cfg);
 void start_http_proxy (struct rspamd_worker *worker);
@@ -75,8 +82,24 @@ struct http_proxy_ctx {
 	struct rspamd_http_upstream *default_upstream;
 	/* Local rotating keypair for upstreams */
 	gpointer local_key;
+	/* Pregenerated keypairs for rotation */
+	struct rspamd_keypair_pool *keys_pool;
 	struct event rotate_ev;
 	gdouble rotate_tm;
+	/* Idle keep-alive connections to backends indexed by upstream */
+	GHashTable *backend_pools;
+	guint32 backend_pool_size;
+	gdouble backend_idle_timeout;
+	struct timeval idle_tv;
+};
+
+struct http_proxy_backend_conn {
+	struct rspamd_http_connection *conn;
+	gpointer local_key;
+	GQueue *pool;
+	GList *link;
+	struct event ev;
+	gint sock;
 };
 
 struct http_proxy_session {
@@ -198,6 +221,9 @@ init_http_proxy (struct rspamd_config *cfg)
 	ctx->timeout = 5.0;
 	ctx->upstreams = g_hash_table_new (rspamd_strcase_hash, rspamd_strcase_equal);
 	ctx->rotate_tm = DEFAULT_ROTATION_TIME;
+	ctx->backend_pools = g_hash_table_new (g_direct_hash, g_direct_equal);
+	ctx->backend_pool_size = DEFAULT_BACKEND_POOL_SIZE;
+	ctx->backend_idle_timeout = DEFAULT_BACKEND_IDLE_TIMEOUT;
 
 	rspamd_rcl_register_worker_option (cfg, type, "timeout",
 		rspamd_rcl_parse_struct_time, ctx,
@@ -213,10 +239,113 @@ init_http_proxy (struct rspamd_config *cfg)
 		key), 0);
 	rspamd_rcl_register_worker_option (cfg, type, "upstream",
 		http_proxy_parse_upstream, ctx, 0, 0);
+	rspamd_rcl_register_worker_option (cfg, type, "backend_pool_size",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct http_proxy_ctx,
+		backend_pool_size), RSPAMD_CL_FLAG_INT_32);
+	rspamd_rcl_register_worker_option (cfg, type, "backend_idle_timeout",
+		rspamd_rcl_parse_struct_time, ctx,
+		G_STRUCT_OFFSET (struct http_proxy_ctx,
+		backend_idle_timeout), RSPAMD_CL_FLAG_TIME_FLOAT);
 
 	return ctx;
 }
 
+static void
+proxy_backend_conn_free (struct http_proxy_backend_conn *bc)
+{
+	event_del (&bc->ev);
+	g_queue_delete_link (bc->pool, bc->link);
+	rspamd_http_connection_unref (bc->conn);
+	close (bc->sock);
+	g_slice_free1 (sizeof (*bc), bc);
+}
+
+static void
+proxy_backend_idle_handler (gint fd, short what, void *arg)
+{
+	struct http_proxy_backend_conn *bc = arg;
+
+	/* Idle backend should not send anything, so it is either closed or broken */
+	if (what == EV_READ) {
+		msg_debug ("backend has closed idle connection");
+	}
+
+	proxy_backend_conn_free (bc);
+}
+
+/*
+ * Returns an idle connection to the specified backend host or NULL
+ */
+static struct rspamd_http_connection *
+proxy_backend_pool_get (struct http_proxy_ctx *ctx, struct upstream *up,
+	gint *sock, gpointer *local_key)
+{
+	struct http_proxy_backend_conn *bc;
+	struct rspamd_http_connection *conn;
+	GQueue *pool;
+
+	pool = g_hash_table_lookup (ctx->backend_pools, up);
+
+	if (pool == NULL || g_queue_is_empty (pool)) {
+		return NULL;
+	}
+
+	/* The most recently used connection is the least likely to be closed */
+	bc = g_queue_pop_head (pool);
+	event_del (&bc->ev);
+	conn = bc->conn;
+	*sock = bc->sock;
+	*local_key = bc->local_key;
+	g_slice_free1 (sizeof (*bc), bc);
+
+	return conn;
+}
+
+/*
+ * Moves backend connection of a session to the pool, connections established
+ * with rotated keys are not reused anymore
+ */
+static gboolean
+proxy_backend_pool_put (struct http_proxy_session *session)
+{
+	struct http_proxy_ctx *ctx = session->ctx;
+	struct http_proxy_backend_conn *bc;
+	GQueue *pool;
+
+	if (session->local_key != ctx->local_key) {
+		return FALSE;
+	}
+
+	pool = g_hash_table_lookup (ctx->backend_pools, session->up);
+
+	if (pool == NULL) {
+		pool = g_queue_new ();
+		g_hash_table_insert (ctx->backend_pools, session->up, pool);
+	}
+
+	if (g_queue_get_length (pool) >= ctx->backend_pool_size) {
+		return FALSE;
+	}
+
+	bc = g_slice_alloc0 (sizeof (*bc));
+	bc->conn = session->backend_conn;
+	bc->sock = session->backend_sock;
+	bc->local_key = session->local_key;
+	bc->pool = pool;
+	g_queue_push_head (pool, bc);
+	bc->link = pool->head;
+
+	event_set (&bc->ev, bc->sock, EV_READ, proxy_backend_idle_handler, bc);
+	event_base_set (ctx->ev_base, &bc->ev);
+	event_add (&bc->ev, &ctx->idle_tv);
+
+	session->backend_conn = NULL;
+	session->backend_sock = -1;
+
+	return TRUE;
+}
+
 static void
 proxy_session_cleanup (struct http_proxy_session *session)
 {
@@ -229,7 +358,10 @@ proxy_session_cleanup (struct http_proxy_session *session)
 		rspamd_http_connection_unref (session->client_conn);
 	}
 
-	close (session->backend_sock);
+	if (session->backend_sock != -1) {
+		close (session->backend_sock);
+	}
+
 	close (session->client_sock);
 
 	g_slice_free1 (sizeof (*session), session);
@@ -265,11 +397,21 @@ proxy_backend_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
 {
 	struct http_proxy_session *session = conn->ud;
+	gboolean keepalive;
 
 	rspamd_http_connection_steal_msg (session->backend_conn);
+	keepalive = msg->flags & RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+	/* Client connections are not persistent */
+	msg->flags &= ~RSPAMD_HTTP_FLAG_KEEP_ALIVE;
 	rspamd_http_message_remove_header (msg, "Content-Length");
 	rspamd_http_message_remove_header (msg, "Key");
 	rspamd_http_connection_reset (session->backend_conn);
+	rspamd_upstream_ok (session->up);
+
+	if (keepalive && session->ctx->backend_pool_size > 0) {
+		proxy_backend_pool_put (session);
+	}
+
 	rspamd_http_connection_write_message (session->client_conn,
 		msg, NULL, NULL, session, session->client_sock,
 		&session->ctx->io_tv, session->ev_base);
@@ -325,30 +467,49 @@ proxy_client_finish_handler (struct rspamd_http_connection *conn,
 				goto err;
 			}
 
-			session->backend_sock = rspamd_inet_address_connect (
-					rspamd_upstream_addr (session->up), SOCK_STREAM, TRUE);
-
-			if (session->backend_sock == -1) {
-				msg_err ("cannot connect upstream for %s", host ? hostbuf : "default");
-				rspamd_upstream_fail (session->up);
-				goto err;
+			/* Pooled connections keep their peer key from the previous request */
+			session->backend_conn = proxy_backend_pool_get (session->ctx,
+					session->up, &session->backend_sock, &session->local_key);
+
+			if (session->backend_conn == NULL) {
+				session->backend_sock = rspamd_inet_address_connect (
+						rspamd_upstream_addr (session->up), SOCK_STREAM, TRUE);
+
+				if (session->backend_sock == -1) {
+					msg_err ("cannot connect upstream for %s",
+							host ? hostbuf : "default");
+					rspamd_upstream_fail (session->up);
+					goto err;
+				}
+
+				session->backend_conn = rspamd_http_connection_new (
+						NULL,
+						proxy_backend_error_handler,
+						proxy_backend_finish_handler,
+						RSPAMD_HTTP_CLIENT_SIMPLE |
+						(session->ctx->backend_pool_size > 0 ?
+								RSPAMD_HTTP_KEEP_ALIVE : 0),
+						RSPAMD_HTTP_CLIENT,
+						session->ctx->keys_cache);
+
+				session->local_key = session->ctx->local_key;
+				rspamd_http_connection_set_key (session->backend_conn,
+						session->local_key);
+
+				if (backend->key) {
+					msg->peer_key = rspamd_http_connection_key_ref (backend->key);
+				}
 			}
 
 			rspamd_http_connection_steal_msg (session->client_conn);
 			rspamd_http_message_remove_header (msg, "Content-Length");
 			rspamd_http_message_remove_header (msg, "Key");
 			rspamd_http_connection_reset (session->client_conn);
-			session->backend_conn = rspamd_http_connection_new (
-					NULL,
-					proxy_backend_error_handler,
-					proxy_backend_finish_handler,
-					RSPAMD_HTTP_CLIENT_SIMPLE,
-					RSPAMD_HTTP_CLIENT,
-					session->ctx->keys_cache);
-
-			rspamd_http_connection_set_key (session->backend_conn,
-					session->ctx->local_key);
-			msg->peer_key = rspamd_http_connection_key_ref (backend->key);
+
+			if (session->ctx->backend_pool_size > 0) {
+				msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+			}
+
 			session->replied = TRUE;
 
 			rspamd_http_connection_write_message (session->backend_conn,
@@ -396,6 +557,7 @@ proxy_accept_socket (gint fd, short what, void *arg)
 
 	session = g_slice_alloc0 (sizeof (*session));
 	session->client_sock = nfd;
+	session->backend_sock = -1;
 	session->client_addr = addr;
 
 	session->resolver = ctx->resolver;
@@ -433,8 +595,12 @@ proxy_rotate_key (gint fd, short what, void *arg)
 	event_del (&ctx->rotate_ev);
 	event_add (&ctx->rotate_ev, &rot_tv);
 
+	/*
+	 * Pooled connections hold their own reference to the old key, so they are
+	 * used until they are returned to the pool next time
+	 */
 	kp = ctx->local_key;
-	ctx->local_key = rspamd_http_connection_gen_key ();
+	ctx->local_key = rspamd_keypair_pool_get (ctx->keys_pool);
 	rspamd_http_connection_key_unref (kp);
 }
 
@@ -454,13 +620,18 @@ start_http_proxy (struct rspamd_worker *worker)
 			ctx->ev_base,
 			worker->srv->cfg);
 	double_to_tv (ctx->timeout, &ctx->io_tv);
+	double_to_tv (ctx->backend_idle_timeout, &ctx->idle_tv);
 
 	rspamd_upstreams_library_init (ctx->resolver->r, ctx->ev_base);
 	rspamd_upstreams_library_config (worker->srv->cfg);
 
 	/* XXX: stupid default */
 	ctx->keys_cache = rspamd_keypair_cache_new (256);
-	ctx->local_key = rspamd_http_connection_gen_key ();
+	rspamd_keypair_cache_set_counters (ctx->keys_cache,
+			&worker->srv->stat->keys_cache_hits,
+			&worker->srv->stat->keys_cache_misses);
+	ctx->keys_pool = rspamd_keypair_pool_new (HTTP_PROXY_KEYS_POOL_SIZE);
+	ctx->local_key = rspamd_keypair_pool_get (ctx->keys_pool);
 
 	double_to_tv (ctx->rotate_tm, &rot_tv);
 	rot_tv.tv_sec += ottery_rand_range (rot_tv.tv_sec);
@@ -478,6 +649,7 @@ start_http_proxy (struct rspamd_worker *worker)
 	}
 
 	rspamd_keypair_cache_destroy (ctx->keys_cache);
+	rspamd_keypair_pool_destroy (ctx->keys_pool);
 
 	exit (EXIT_SUCCESS);
 }
@@ -25,35 +25,39 @@
 #include "kvstorage.h"
 #include "main.h"
 #include "radix.h"
+#include "xxhash.h"
 #ifdef WITH_JUDY
 #include <Judy.h>
 #endif
 
 #define MAX_EXPIRE_STEPS 10
 
+#define BACKEND_LOCK(s) do { if ((s)->backend) rspamd_mutex_lock ((s)->backend_mtx); } while (0)
+#define BACKEND_UNLOCK(s) do { if ((s)->backend) rspamd_mutex_unlock ((s)->backend_mtx); } while (0)
+
 /** Create new kv storage */
 struct rspamd_kv_storage *
 rspamd_kv_storage_new (gint id,
 	const gchar *name,
-	struct rspamd_kv_cache *cache,
+	struct rspamd_kv_cache **caches,
 	struct rspamd_kv_backend *backend,
-	struct rspamd_kv_expire *expire,
+	struct rspamd_kv_expire **expires,
+	guint nshards,
 	gsize max_elts,
 	gsize max_memory,
 	gboolean no_overwrite)
 {
 	struct rspamd_kv_storage *new;
+	struct rspamd_kv_shard *shard;
+	guint i;
 
-	new = g_slice_alloc (sizeof (struct rspamd_kv_storage));
-	new->elts = 0;
-	new->memory = 0;
+	g_assert (nshards > 0);
 
-	new->cache = cache;
+	new = g_slice_alloc (sizeof (struct rspamd_kv_storage));
 	new->backend = backend;
-	new->expire = expire;
-
-	new->max_elts = max_elts;
-	new->max_memory = max_memory;
+	new->backend_mtx = rspamd_mutex_new ();
+	new->nshards = nshards;
+	new->shards = g_malloc0 (sizeof (struct rspamd_kv_shard) * nshards);
 
 	new->id = id;
 
@@ -67,27 +71,90 @@ rspamd_kv_storage_new (gint id,
 		new->name = g_malloc (sizeof ("18446744073709551616"));
 		rspamd_snprintf (new->name, sizeof ("18446744073709551616"), "%d", id);
 	}
+
+	for (i = 0; i < nshards; i ++) {
+		shard = &new->shards[i];
+		shard->storage = new;
+		shard->cache = caches[i];
+		shard->expire = expires != NULL ? expires[i] : NULL;
+		/* Limits are divided between shards */
+		shard->max_elts = max_elts > 0 ? (max_elts + nshards - 1) / nshards : 0;
+		shard->max_memory = max_memory > 0 ?
+				(max_memory + nshards - 1) / nshards : 0;
 #if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
-	g_rw_lock_init (&new->rwlock);
+		g_rw_lock_init (&shard->rwlock);
 #else
-	g_static_rw_lock_init (&new->rwlock);
+		g_static_rw_lock_init (&shard->rwlock);
 #endif
 
-
-	/* Init structures */
-	if (new->cache->init_func) {
-		new->cache->init_func (new->cache);
+		/* Init structures */
+		if (shard->cache->init_func) {
+			shard->cache->init_func (shard->cache);
+		}
+		if (shard->expire && shard->expire->init_func) {
+			shard->expire->init_func (shard->expire);
+		}
 	}
+
 	if (new->backend && new->backend->init_func) {
 		new->backend->init_func (new->backend);
 	}
-	if (new->expire && new->expire->init_func) {
-		new->expire->init_func (new->expire);
-	}
 
 	return new;
 }
 
+struct rspamd_kv_shard *
+rspamd_kv_storage_get_shard (struct rspamd_kv_storage *storage,
+	gconstpointer key,
+	guint keylen)
+{
+	if (storage->nshards == 1) {
+		return &storage->shards[0];
+	}
+
+	return &storage->shards[XXH64 (key, keylen, 0) % storage->nshards];
+}
+
+void
+rspamd_kv_storage_unlock (struct rspamd_kv_storage *storage,
+	gconstpointer key,
+	guint keylen)
+{
+	struct rspamd_kv_shard *shard;
+
+	shard = rspamd_kv_storage_get_shard (storage, key, keylen);
+	RW_R_UNLOCK (&shard->rwlock);
+}
+
+/*
+ * Expire elements of a shard until there is space for a new element,
+ * shard must be write locked
+ */
+static gboolean
+rspamd_kv_shard_make_space (struct rspamd_kv_shard *shard, gsize len)
+{
+	gint steps = 0;
+
+	while ((shard->max_memory > 0 && shard->memory + len > shard->max_memory) ||
+			(shard->max_elts > 0 && shard->elts >= shard->max_elts)) {
+		if (shard->expire) {
+			shard->expire->step_func (shard->expire, shard, time (NULL), steps);
+		}
+		else {
+			msg_warn (
+				"<%s>: storage is full and no expire function is defined",
+				shard->storage->name);
+		}
+		if (++steps > MAX_EXPIRE_STEPS) {
+			msg_warn ("<%s>: cannot expire enough keys in storage",
+				shard->storage->name);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
 /** Internal insertion to the kv storage from backend */
 gboolean
 rspamd_kv_storage_insert_cache (struct rspamd_kv_storage *storage,
@@ -99,45 +166,31 @@ rspamd_kv_storage_insert_cache (struct rspamd_kv_storage *storage,
 	guint expire,
 	struct rspamd_kv_element **pelt)
 {
-	gint steps = 0;
+	struct rspamd_kv_shard *shard;
 	struct rspamd_kv_element *elt;
 
-	RW_W_LOCK (&storage->rwlock);
+	shard = rspamd_kv_storage_get_shard (storage, key, keylen);
+	RW_W_LOCK (&shard->rwlock);
 	/* Hard limit */
-	if (storage->max_memory > 0) {
-		if (len > storage->max_memory) {
-			msg_info (
-				"<%s>: trying to insert value of length %z while limit is %z",
-				storage->name,
-				len,
-				storage->max_memory);
-			RW_W_UNLOCK (&storage->rwlock);
-			return FALSE;
-		}
+	if (shard->max_memory > 0 && len > shard->max_memory) {
+		msg_info (
+			"<%s>: trying to insert value of length %z while limit is %z",
+			storage->name,
+			len,
+			shard->max_memory);
+		RW_W_UNLOCK (&shard->rwlock);
+		return FALSE;
+	}
 
-		/* Now check limits */
-		while (storage->memory + len > storage->max_memory) {
-			if (storage->expire) {
-				storage->expire->step_func (storage->expire, storage, time (
-						NULL), steps);
-			}
-			else {
-				msg_warn (
-					"<%s>: storage is full and no expire function is defined",
-					storage->name);
-			}
-			if (++steps > MAX_EXPIRE_STEPS) {
-				RW_W_UNLOCK (&storage->rwlock);
-				msg_warn ("<%s>: cannot expire enough keys in storage",
-					storage->name);
-				return FALSE;
-			}
-		}
+	/* Now check limits */
+	if (!rspamd_kv_shard_make_space (shard, len)) {
+		RW_W_UNLOCK (&shard->rwlock);
+		return FALSE;
 	}
 
 	/* Insert elt to the cache */
 
-	elt = storage->cache->insert_func (storage->cache, key, keylen, data, len);
+	elt = shard->cache->insert_func (shard->cache, key, keylen, data, len);
 
 
 	/* Copy data */
@@ -149,13 +202,13 @@ rspamd_kv_storage_insert_cache (struct rspamd_kv_storage *storage,
 	}
 
 	/* Insert to the expire */
-	if (storage->expire) {
-		storage->expire->insert_func (storage->expire, elt);
+	if (shard->expire) {
+		shard->expire->insert_func (shard->expire, elt);
 	}
 
-	storage->elts++;
-	storage->memory += ELT_SIZE (elt);
-	RW_W_UNLOCK (&storage->rwlock);
+	shard->elts++;
+	shard->memory += ELT_REAL_SIZE (elt);
+	RW_W_UNLOCK (&shard->rwlock);
 
 	return TRUE;
 }
@@ -170,97 +223,62 @@ rspamd_kv_storage_insert (struct rspamd_kv_storage *storage,
 	gint flags,
 	guint expire)
 {
-	gint steps = 0;
+	struct rspamd_kv_shard *shard;
 	struct rspamd_kv_element *elt;
 	gboolean res = TRUE;
 	glong longval;
 
-	/* Hard limit */
-	RW_W_LOCK (&storage->rwlock);
-	if (storage->max_memory > 0) {
-		if (len + sizeof (struct rspamd_kv_element) + keylen >=
-			storage->max_memory) {
-			msg_warn (
-				"<%s>: trying to insert value of length %z while limit is %z",
-				storage->name,
-				len,
-				storage->max_memory);
-			RW_W_UNLOCK (&storage->rwlock);
-			return FALSE;
-		}
+	shard = rspamd_kv_storage_get_shard (storage, key, keylen);
 
-		/* Now check limits */
-		while (storage->memory + len + keylen > storage->max_memory) {
-			if (storage->expire) {
-				storage->expire->step_func (storage->expire, storage, time (
-						NULL), steps);
-			}
-			else {
-				msg_warn (
-					"<%s>: storage is full and no expire function is defined",
-					storage->name);
-			}
-			if (++steps > MAX_EXPIRE_STEPS) {
-				RW_W_UNLOCK (&storage->rwlock);
-				msg_warn ("<%s>: cannot expire enough keys in storage",
-					storage->name);
-				return FALSE;
-			}
-		}
+	/* Hard limit */
+	RW_W_LOCK (&shard->rwlock);
+	if (shard->max_memory > 0 &&
+		len + sizeof (struct rspamd_kv_element) + keylen >= shard->max_memory) {
+		msg_warn (
+			"<%s>: trying to insert value of length %z while limit is %z",
+			storage->name,
+			len,
+			shard->max_memory);
+		RW_W_UNLOCK (&shard->rwlock);
+		return FALSE;
 	}
-	if (storage->max_elts > 0 && storage->elts > storage->max_elts) {
-		/* More expire */
-		steps = 0;
-		while (storage->elts > storage->max_elts) {
-			if (storage->expire) {
-				storage->expire->step_func (storage->expire, storage, time (
-						NULL), steps);
-			}
-			else {
-				msg_warn (
-					"<%s>: storage is full and no expire function is defined",
-					storage->name);
-			}
-			if (++steps > MAX_EXPIRE_STEPS) {
-				RW_W_UNLOCK (&storage->rwlock);
-				msg_warn ("<%s>: cannot expire enough keys in storage",
-					storage->name);
-				return FALSE;
-			}
-		}
+
+	/* Now check limits */
+	if (!rspamd_kv_shard_make_space (shard, len + keylen)) {
+		RW_W_UNLOCK (&shard->rwlock);
+		return FALSE;
 	}
 
 	/* First try to search it in cache */
 
-	elt = storage->cache->lookup_func (storage->cache, key, keylen);
+	elt = shard->cache->lookup_func (shard->cache, key, keylen);
 	if (elt) {
 		if (!storage->no_overwrite) {
 			/* Remove old elt */
-			if (storage->expire) {
-				storage->expire->delete_func (storage->expire, elt);
+			if (shard->expire) {
+				shard->expire->delete_func (shard->expire, elt);
 			}
-			storage->memory -= ELT_SIZE (elt);
-			storage->cache->steal_func (storage->cache, elt);
+			shard->memory -= ELT_REAL_SIZE (elt);
+			shard->elts--;
+			shard->cache->steal_func (shard->cache, elt);
 			if (elt->flags & KV_ELT_DIRTY) {
 				/* Element is in backend storage queue */
 				elt->flags |= KV_ELT_NEED_FREE;
 			}
 			else {
-				g_slice_free1 (ELT_SIZE (elt), elt);
+				ELT_FREE (elt);
 			}
 		}
 		else {
 			/* Just do incref and nothing more */
 			if (storage->backend && storage->backend->incref_func) {
-				if (storage->backend->incref_func (storage->backend, key,
-					keylen)) {
-					RW_W_UNLOCK (&storage->rwlock);
-					return TRUE;
-				}
-				else {
-					RW_W_UNLOCK (&storage->rwlock);
-					return FALSE;
-				}
+				BACKEND_LOCK (storage);
+				res = storage->backend->incref_func (storage->backend, key,
+						keylen);
+				BACKEND_UNLOCK (storage);
+				RW_W_UNLOCK (&shard->rwlock);
+
+				return res;
 			}
 		}
 	}
@@ -269,12 +287,13 @@ rspamd_kv_storage_insert (struct rspamd_kv_storage *storage,
 
 	/* First of all check element for integer */
 	if (rspamd_strtol (data, len, &longval)) {
-		elt = storage->cache->insert_func (storage->cache,
+		elt = shard->cache->insert_func (shard->cache,
 				key,
 				keylen,
 				&longval,
 				sizeof (glong));
 		if (elt == NULL) {
+			RW_W_UNLOCK (&shard->rwlock);
 			return FALSE;
 		}
 		else {
@@ -282,13 +301,13 @@ rspamd_kv_storage_insert (struct rspamd_kv_storage *storage,
 		}
 	}
 	else {
-		elt = storage->cache->insert_func (storage->cache,
+		elt = shard->cache->insert_func (shard->cache,
 				key,
 				keylen,
 				data,
 				len);
 		if (elt == NULL) {
-			RW_W_UNLOCK (&storage->rwlock);
+			RW_W_UNLOCK (&shard->rwlock);
 			return FALSE;
 		}
 	}
@@ -301,18 +320,20 @@ rspamd_kv_storage_insert (struct rspamd_kv_storage *storage,
 
 	/* Place to the backend */
 	if (storage->backend) {
+		BACKEND_LOCK (storage);
 		res =
 			storage->backend->insert_func (storage->backend, key, keylen, elt);
+		BACKEND_UNLOCK (storage);
 	}
 
 	/* Insert to the expire */
-	if (storage->expire) {
-		storage->expire->insert_func (storage->expire, elt);
+	if (shard->expire) {
+		shard->expire->insert_func (shard->expire, elt);
 	}
 
-	storage->elts++;
-	storage->memory += ELT_SIZE (elt);
-	RW_W_UNLOCK (&storage->rwlock);
+	shard->elts++;
+	shard->memory += ELT_REAL_SIZE (elt);
+	RW_W_UNLOCK (&shard->rwlock);
 
 	return res;
 }
@@ -324,51 +345,52 @@ rspamd_kv_storage_replace (struct rspamd_kv_storage *storage,
 	guint keylen,
 	struct rspamd_kv_element *elt)
 {
+	struct rspamd_kv_shard *shard;
+	struct rspamd_kv_element *oldelt;
 	gboolean res = TRUE;
-	gint steps = 0;
+
+	shard = rspamd_kv_storage_get_shard (storage, key, keylen);
 
 	/* Hard limit */
-	if (storage->max_memory > 0) {
-		if (elt->size > storage->max_memory) {
-			msg_info (
-				"<%s>: trying to replace value of length %z while limit is %z",
-				storage->name,
-				elt->size,
-				storage->max_memory);
-			return FALSE;
-		}
+	if (shard->max_memory > 0 && elt->size > shard->max_memory) {
+		msg_info (
+			"<%s>: trying to replace value of length %z while limit is %z",
+			storage->name,
+			elt->size,
+			shard->max_memory);
+		return FALSE;
+	}
 
-		/* Now check limits */
-		while (storage->memory + ELT_SIZE (elt) > storage->max_memory) {
-			if (storage->expire) {
-				RW_W_LOCK (&storage->rwlock);
-				storage->expire->step_func (storage->expire, storage, time (
-						NULL), steps);
-				RW_W_UNLOCK (&storage->rwlock);
-			}
-			else {
-				msg_warn (
-					"<%s>: storage is full and no expire function is defined",
-					storage->name);
-			}
-			if (++steps > MAX_EXPIRE_STEPS) {
-				msg_warn ("<%s>: cannot expire enough keys in storage",
-					storage->name);
-				return FALSE;
-			}
-		}
+	RW_W_LOCK (&shard->rwlock);
+
+	/* Now check limits */
+	if (shard->max_memory > 0 &&
+			!rspamd_kv_shard_make_space (shard, ELT_REAL_SIZE (elt))) {
+		RW_W_UNLOCK (&shard->rwlock);
+		return FALSE;
+	}
+
+	/* Unlink the old element from expire as the cache may free it */
+	oldelt = shard->cache->lookup_func (shard->cache, key, keylen);
+	if (oldelt != NULL && oldelt != elt && shard->expire) {
+		shard->expire->delete_func (shard->expire, oldelt);
 	}
 
-	RW_W_LOCK (&storage->rwlock);
 	/* Insert elt to the cache */
-	res = storage->cache->replace_func (storage->cache, key, keylen, elt);
+	res = shard->cache->replace_func (shard->cache, key, keylen, elt);
+
+	if (oldelt != NULL && oldelt != elt && shard->expire) {
+		shard->expire->insert_func (shard->expire, res ? elt : oldelt);
+	}
 
 	/* Place to the backend */
 	if (res && storage->backend) {
+		BACKEND_LOCK (storage);
 		res =
 			storage->backend->replace_func (storage->backend, key, keylen, elt);
+		BACKEND_UNLOCK (storage);
 	}
-	RW_W_UNLOCK (&storage->rwlock);
+	RW_W_UNLOCK (&shard->rwlock);
 
 	return res;
 }
@@ -380,24 +402,30 @@ rspamd_kv_storage_increment (struct rspamd_kv_storage *storage,
 	guint keylen,
 	glong *value)
 {
+	struct rspamd_kv_shard *shard;
 	struct rspamd_kv_element *elt = NULL, *belt;
+	gboolean res = TRUE;
 	glong *lp;
 
+	shard = rspamd_kv_storage_get_shard (storage, key, keylen);
+
 	/* First try to look at cache */
-	RW_W_LOCK (&storage->rwlock);
-	elt = storage->cache->lookup_func (storage->cache, key, keylen);
+	RW_W_LOCK (&shard->rwlock);
+	elt = shard->cache->lookup_func (shard->cache, key, keylen);
 
 	if (elt == NULL && storage->backend) {
+		BACKEND_LOCK (storage);
 		belt = storage->backend->lookup_func (storage->backend, key, keylen);
+		BACKEND_UNLOCK (storage);
 		if (belt) {
 			/* Put this element into cache */
 			if ((belt->flags & KV_ELT_INTEGER) != 0) {
-				RW_W_UNLOCK (&storage->rwlock);
+				RW_W_UNLOCK (&shard->rwlock);
 				rspamd_kv_storage_insert_cache (storage, ELT_KEY (
 						belt), keylen, ELT_DATA (belt),
 					belt->size, belt->flags,
 					belt->expire, &elt);
-				RW_W_LOCK (&storage->rwlock);
+				RW_W_LOCK (&shard->rwlock);
 			}
 			if ((belt->flags & KV_ELT_DIRTY) == 0) {
 				g_free (belt);
@@ -416,23 +444,18 @@ rspamd_kv_storage_increment (struct rspamd_kv_storage *storage,
 		}
 		elt->age = time (NULL);
 		if (storage->backend) {
-			if (storage->backend->replace_func (storage->backend, key, keylen,
-				elt)) {
-				RW_W_UNLOCK (&storage->rwlock);
-				return TRUE;
-			}
-			else {
-				RW_W_UNLOCK (&storage->rwlock);
-				return FALSE;
-			}
-		}
-		else {
-			RW_W_UNLOCK (&storage->rwlock);
-			return TRUE;
+			BACKEND_LOCK (storage);
+			res = storage->backend->replace_func (storage->backend, key, keylen,
+					elt);
+			BACKEND_UNLOCK (storage);
 		}
+
+		RW_W_UNLOCK (&shard->rwlock);
+
+		return res;
 	}
 
-	RW_W_UNLOCK (&storage->rwlock);
+	RW_W_UNLOCK (&shard->rwlock);
 
 	return FALSE;
 }
@@ -444,15 +467,20 @@ rspamd_kv_storage_lookup (struct rspamd_kv_storage *storage,
 	guint keylen,
 	time_t now)
 {
+	struct rspamd_kv_shard *shard;
 	struct rspamd_kv_element *elt = NULL, *belt;
 
+	shard = rspamd_kv_storage_get_shard (storage, key, keylen);
+
 	/* First try to look at cache */
-	RW_R_LOCK (&storage->rwlock);
-	elt = storage->cache->lookup_func (storage->cache, key, keylen);
+	RW_R_LOCK (&shard->rwlock);
+	elt = shard->cache->lookup_func (shard->cache, key, keylen);
 
 	/* Next look at the backend */
 	if (elt == NULL && storage->backend) {
+		BACKEND_LOCK (storage);
 		belt = storage->backend->lookup_func (storage->backend, key, keylen);
+		BACKEND_UNLOCK (storage);
 
 		if (belt) {
 			/* Put this element into cache */
@@ -470,11 +498,16 @@ rspamd_kv_storage_lookup (struct rspamd_kv_storage *storage,
 		/* Check expiration */
 		if (now - elt->age > (gint)elt->expire) {
 			/* Set need expire as we have no write lock here */
-			elt->flags |= KV_ELT_NEED_EXPIRE;
+			__sync_fetch_and_or (&elt->flags, KV_ELT_NEED_EXPIRE);
 			elt = NULL;
 		}
 	}
 
+	if (elt && (elt->flags & KV_ELT_REFERENCED) == 0) {
+		/* Give this element the second chance on expire */
+		__sync_fetch_and_or (&elt->flags, KV_ELT_REFERENCED);
+	}
+
 	/* RWlock is still locked */
 	return elt;
 }
@@ -485,54 +518,98 @@ rspamd_kv_storage_delete (struct rspamd_kv_storage *storage,
 	gpointer key,
 	guint keylen)
 {
+	struct rspamd_kv_shard *shard;
 	struct rspamd_kv_element *elt;
 
+	shard = rspamd_kv_storage_get_shard (storage, key, keylen);
+
 	/* First delete key from cache */
-	RW_W_LOCK (&storage->rwlock);
-	elt = storage->cache->delete_func (storage->cache, key, keylen);
+	RW_W_LOCK (&shard->rwlock);
+	elt = shard->cache->delete_func (shard->cache, key, keylen);
 
 	/* Now delete from backend */
 	if (storage->backend) {
+		BACKEND_LOCK (storage);
 		storage->backend->delete_func (storage->backend, key, keylen);
+		BACKEND_UNLOCK (storage);
 	}
 	/* Notify expire */
 	if (elt) {
-		if (storage->expire) {
-			storage->expire->delete_func (storage->expire, elt);
+		if (shard->expire) {
+			shard->expire->delete_func (shard->expire, elt);
 		}
-		storage->elts--;
-		storage->memory -= elt->size;
+		shard->elts--;
+		shard->memory -= ELT_REAL_SIZE (elt);
 		if ((elt->flags & KV_ELT_DIRTY) != 0) {
 			elt->flags |= KV_ELT_NEED_FREE;
 		}
 		else {
-			g_slice_free1 (ELT_SIZE (elt), elt);
+			ELT_FREE (elt);
 		}
 	}
 
-	RW_W_UNLOCK (&storage->rwlock);
+	RW_W_UNLOCK (&shard->rwlock);
 
 	return elt;
 }
 
+/** Remove expired elements of all shards */
+gsize
+rspamd_kv_storage_expire_tick (struct rspamd_kv_storage *storage,
+	time_t now,
+	gsize max_checks)
+{
+	struct rspamd_kv_shard *shard;
+	gsize removed = 0, shard_checks;
+	guint i;
+
+	shard_checks = MAX (max_checks / storage->nshards, 1);
+
+	for (i = 0; i < storage->nshards; i ++) {
+		shard = &storage->shards[i];
+		if (shard->expire == NULL || shard->expire->tick_func == NULL) {
+			continue;
+		}
+		RW_W_LOCK (&shard->rwlock);
+		removed += shard->expire->tick_func (shard->expire, shard, now,
+				shard_checks);
+		RW_W_UNLOCK (&shard->rwlock);
+	}
+
+	return removed;
+}
+
 /** Destroy kv storage */
 void
 rspamd_kv_storage_destroy (struct rspamd_kv_storage *storage)
 {
-	RW_W_LOCK (&storage->rwlock);
+	struct rspamd_kv_shard *shard;
+	guint i;
+
 	if (storage->backend && storage->backend->destroy_func) {
 		storage->backend->destroy_func (storage->backend);
 	}
-	if (storage->expire && storage->expire->destroy_func) {
-		storage->expire->destroy_func (storage->expire);
-	}
-	if (storage->cache && storage->cache->destroy_func) {
-		storage->cache->destroy_func (storage->cache);
+
+	for (i = 0; i < storage->nshards; i ++) {
+		shard = &storage->shards[i];
+		RW_W_LOCK (&shard->rwlock);
+		if (shard->expire && shard->expire->destroy_func) {
+			shard->expire->destroy_func (shard->expire);
+		}
+		if (shard->cache && shard->cache->destroy_func) {
+			shard->cache->destroy_func (shard->cache);
+		}
+		RW_W_UNLOCK (&shard->rwlock);
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
+		g_rw_lock_clear (&shard->rwlock);
+#else
+		g_static_rw_lock_free (&shard->rwlock);
+#endif
 	}
 
 	g_free (storage->name);
-
-	RW_W_UNLOCK (&storage->rwlock);
+	g_free (storage->shards);
+	rspamd_mutex_free (storage->backend_mtx);
 	g_slice_free1 (sizeof (struct rspamd_kv_storage), storage);
 }
 
@@ -550,6 +627,7 @@ rspamd_kv_storage_insert_array (struct rspamd_kv_storage *storage,
 	struct rspamd_kv_element *elt;
 	guint *es;
 	gpointer arr_data;
+	gboolean res = TRUE;
 
 	/* Make temporary copy */
 	arr_data = g_slice_alloc (len + sizeof (guint));
@@ -568,11 +646,13 @@ rspamd_kv_storage_insert_array (struct rspamd_kv_storage *storage,
 	/* Place to the backend */
 
 	if (storage->backend) {
-		return storage->backend->insert_func (storage->backend, key, keylen,
+		BACKEND_LOCK (storage);
+		res = storage->backend->insert_func (storage->backend, key, keylen,
 				   elt);
+		BACKEND_UNLOCK (storage);
 	}
 
-	return TRUE;
+	return res;
 }
 
 /** Set element inside array */
@@ -588,39 +668,40 @@ rspamd_kv_storage_set_array (struct rspamd_kv_storage *storage,
 	struct rspamd_kv_element *elt;
 	guint *es;
 	gpointer target;
+	gboolean res = FALSE;
 
 	elt = rspamd_kv_storage_lookup (storage, key, keylen, now);
-	if (elt == NULL) {
+	if (elt == NULL || (elt->flags & KV_ELT_ARRAY) == 0) {
+		rspamd_kv_storage_unlock (storage, key, keylen);
 		return FALSE;
 	}
 
-	if ((elt->flags & KV_ELT_ARRAY) == 0) {
-		return FALSE;
-	}
 	/* Get element size */
 	es = (guint *)ELT_DATA (elt);
-	if (elt_num > (elt->size - sizeof (guint)) / (*es)) {
-		/* Invalid index */
+	if (elt_num > (elt->size - sizeof (guint)) / (*es) || len != *es) {
+		/* Invalid index or size */
+		rspamd_kv_storage_unlock (storage, key, keylen);
 		return FALSE;
 	}
 	target = (gchar *)ELT_DATA (elt) + sizeof (guint) + (*es) * elt_num;
-	if (len != *es) {
-		/* Invalid size */
-		return FALSE;
-	}
 	memcpy (target, data, len);
+	res = TRUE;
 	/* Place to the backend */
 	if (storage->backend) {
-		return storage->backend->replace_func (storage->backend,
+		BACKEND_LOCK (storage);
+		res = storage->backend->replace_func (storage->backend,
 				   key,
 				   keylen,
 				   elt);
+		BACKEND_UNLOCK (storage);
 	}
 
-	return TRUE;
+	rspamd_kv_storage_unlock (storage, key, keylen);
+
+	return res;
 }
 
-/** Get element inside array */
+/** Get element inside array, the shard is left read locked as for lookup */
 gboolean
 rspamd_kv_storage_get_array (struct rspamd_kv_storage *storage,
 	gpointer key,
@@ -660,16 +741,54 @@ rspamd_kv_storage_get_array (struct rspamd_kv_storage *storage,
  * LRU expire functions
  */
 
+/* Number of one second slots of timing wheel */
+#define RSPAMD_KV_WHEEL_SLOTS 512
+
 struct rspamd_kv_lru_expire {
 	expire_init init_func;                      /*< this callback is called on kv storage initialization */
 	expire_insert insert_func;                  /*< this callback is called when element is inserted */
 	expire_step step_func;                      /*< this callback is used when cache is full */
 	expire_delete delete_func;                  /*< this callback is called when an element is deleted */
 	expire_destroy destroy_func;                /*< this callback is used for destroying all elements inside expire */
+	expire_tick tick_func;                      /*< this callback is called periodically to remove expired elements */
 
 	TAILQ_HEAD (eltq, rspamd_kv_element) head;
+	/* Timing wheel of elements with ttl, a slot holds elements whose deadline
+	 * is equal to the slot number modulo RSPAMD_KV_WHEEL_SLOTS */
+	struct eltq wheel[RSPAMD_KV_WHEEL_SLOTS];
+	time_t wheel_time;                          /*< the first second not checked yet */
+	struct rspamd_kv_element *wheel_cursor;     /*< position in the current slot */
 };
 
+#define RSPAMD_KV_ELT_DEADLINE(elt) ((elt)->age + (time_t)(elt)->expire + 1)
+
+static void
+rspamd_lru_wheel_link (struct rspamd_kv_lru_expire *expire,
+	struct rspamd_kv_element *elt,
+	time_t deadline)
+{
+	if (deadline < expire->wheel_time) {
+		deadline = expire->wheel_time;
+	}
+	elt->ttl_slot = deadline % RSPAMD_KV_WHEEL_SLOTS;
+	elt->flags |= KV_ELT_TTL;
+	TAILQ_INSERT_TAIL (&expire->wheel[elt->ttl_slot], elt, ttl_entry);
+}
+
+static void
+rspamd_lru_wheel_unlink (struct rspamd_kv_lru_expire *expire,
+	struct rspamd_kv_element *elt)
+{
+	if ((elt->flags & KV_ELT_TTL) == 0) {
+		return;
+	}
+	if (expire->wheel_cursor == elt) {
+		expire->wheel_cursor = TAILQ_NEXT (elt, ttl_entry);
+	}
+	TAILQ_REMOVE (&expire->wheel[elt->ttl_slot], elt, ttl_entry);
+	elt->flags &= ~KV_ELT_TTL;
+}
+
 /**
  * Insert an element into expire queue
  */
@@ -680,6 +799,11 @@ rspamd_lru_insert (struct rspamd_kv_expire *e, struct rspamd_kv_element *elt)
 
 	/* Get a proper queue */
 	TAILQ_INSERT_TAIL (&expire->head, elt, entry);
+
+	elt->flags &= ~KV_ELT_TTL;
+	if (elt->expire > 0 && (elt->flags & KV_ELT_PERSISTENT) == 0) {
+		rspamd_lru_wheel_link (expire, elt, RSPAMD_KV_ELT_DEADLINE (elt));
+	}
 }
 /**
  * Delete an element from expire queue
@@ -691,14 +815,35 @@ rspamd_lru_delete (struct rspamd_kv_expire *e, struct rspamd_kv_element *elt)
 
 	/* Unlink element */
 	TAILQ_REMOVE (&expire->head, elt, entry);
+	rspamd_lru_wheel_unlink (expire, elt);
+}
+
+static void
+rspamd_lru_free (struct rspamd_kv_lru_expire *expire,
+	struct rspamd_kv_shard *shard,
+	struct rspamd_kv_element *elt)
+{
+	shard->memory -= ELT_REAL_SIZE (elt);
+	shard->elts--;
+	shard->cache->steal_func (shard->cache, elt);
+	TAILQ_REMOVE (&expire->head, elt, entry);
+	rspamd_lru_wheel_unlink (expire, elt);
+	/* Free memory */
+	if ((elt->flags & (KV_ELT_DIRTY | KV_ELT_NEED_INSERT)) != 0) {
+		elt->flags |= KV_ELT_NEED_FREE;
+	}
+	else {
+		ELT_FREE (elt);
+	}
 }
 
 /**
- * Expire elements
+ * Expire elements, it works as CLOCK algorithm: elements that have been
+ * looked up since the previous pass are moved to the tail of queue once
  */
 static gboolean
 rspamd_lru_expire_step (struct rspamd_kv_expire *e,
-	struct rspamd_kv_storage *storage,
+	struct rspamd_kv_shard *shard,
 	time_t now,
 	gboolean forced)
 {
@@ -706,8 +851,21 @@ rspamd_lru_expire_step (struct rspamd_kv_expire *e,
 	struct rspamd_kv_element *elt, *oldest_elt = NULL, *temp;
 	time_t diff;
 	gboolean res = FALSE;
+	guint rotated = 0;
 
 	elt = TAILQ_FIRST (&expire->head);
+
+	/* Skip referenced elements that are not expired yet */
+	while (elt != NULL && !forced && (elt->flags & KV_ELT_REFERENCED) &&
+			(elt->expire == 0 || (gint)elt->expire >= (now - elt->age)) &&
+			rotated < shard->elts) {
+		elt->flags &= ~KV_ELT_REFERENCED;
+		TAILQ_REMOVE (&expire->head, elt, entry);
+		TAILQ_INSERT_TAIL (&expire->head, elt, entry);
+		elt = TAILQ_FIRST (&expire->head);
+		rotated ++;
+	}
+
 	if (elt &&
 		(forced || (elt->flags & (KV_ELT_PERSISTENT | KV_ELT_DIRTY)) == 0)) {
 		diff = elt->expire - (now - elt->age);
@@ -716,17 +874,7 @@ rspamd_lru_expire_step (struct rspamd_kv_expire *e,
 		}
 		else {
 			/* This element is already expired */
-			storage->cache->steal_func (storage->cache, elt);
-			storage->memory -= ELT_SIZE (elt);
-			storage->elts--;
-			TAILQ_REMOVE (&expire->head, elt, entry);
-			/* Free memory */
-			if ((elt->flags & (KV_ELT_DIRTY | KV_ELT_NEED_INSERT)) != 0) {
-				elt->flags |= KV_ELT_NEED_FREE;
-			}
-			else {
-				g_slice_free1 (ELT_SIZE (elt), elt);
-			}
+			rspamd_lru_free (expire, shard, elt);
 			res = TRUE;
 			/* Check other elements in this queue */
 			TAILQ_FOREACH_SAFE (elt, &expire->head, entry, temp)
@@ -736,37 +884,81 @@ rspamd_lru_expire_step (struct rspamd_kv_expire *e,
 					(gint)elt->expire < (now - elt->age)) {
 					break;
 				}
-				storage->memory -= ELT_SIZE (elt);
-				storage->elts--;
-				storage->cache->steal_func (storage->cache, elt);
-				TAILQ_REMOVE (&expire->head, elt, entry);
-				/* Free memory */
-				if ((elt->flags & (KV_ELT_DIRTY | KV_ELT_NEED_INSERT)) != 0) {
-					elt->flags |= KV_ELT_NEED_FREE;
-				}
-				else {
-					g_slice_free1 (ELT_SIZE (elt), elt);
-				}
-
+				rspamd_lru_free (expire, shard, elt);
 			}
 		}
 	}
 
 	if (!res && oldest_elt != NULL) {
-		storage->memory -= ELT_SIZE (oldest_elt);
-		storage->elts--;
-		storage->cache->steal_func (storage->cache, oldest_elt);
-		TAILQ_REMOVE (&expire->head, oldest_elt, entry);
-		/* Free memory */
-		if ((oldest_elt->flags & (KV_ELT_DIRTY | KV_ELT_NEED_INSERT)) != 0) {
-			oldest_elt->flags |= KV_ELT_NEED_FREE;
+		rspamd_lru_free (expire, shard, oldest_elt);
+	}
+
+	return TRUE;
+}
+
+/**
+ * Remove expired elements from the slots of timing wheel passed since the
+ * previous call, at most max_checks elements are checked per call
+ */
+static gsize
+rspamd_lru_expire_tick (struct rspamd_kv_expire *e,
+	struct rspamd_kv_shard *shard,
+	time_t now,
+	gsize max_checks)
+{
+	struct rspamd_kv_lru_expire *expire = (struct rspamd_kv_lru_expire *)e;
+	struct rspamd_kv_element *elt, *next;
+	struct eltq *slot;
+	time_t deadline;
+	gsize checks = 0, removed = 0;
+
+	if (expire->wheel_time + RSPAMD_KV_WHEEL_SLOTS < now) {
+		/* All slots are passed, so check each of them once */
+		expire->wheel_time = now - RSPAMD_KV_WHEEL_SLOTS;
+		expire->wheel_cursor = NULL;
+	}
+
+	while (expire->wheel_time <= now) {
+		slot = &expire->wheel[expire->wheel_time % RSPAMD_KV_WHEEL_SLOTS];
+		elt = expire->wheel_cursor ? expire->wheel_cursor : TAILQ_FIRST (slot);
+
+		while (elt != NULL) {
+			if (checks >= max_checks) {
+				expire->wheel_cursor = elt;
+				return removed;
+			}
+			checks ++;
+			next = TAILQ_NEXT (elt, ttl_entry);
+			/* Increment changes age, so deadline is checked again */
+			deadline = RSPAMD_KV_ELT_DEADLINE (elt);
+
+			if (deadline <= now) {
+				if ((elt->flags & KV_ELT_DIRTY) != 0) {
+					/* Retry when it is written to the backend */
+					TAILQ_REMOVE (slot, elt, ttl_entry);
+					rspamd_lru_wheel_link (expire, elt, now + 1);
+				}
+				else {
+					rspamd_lru_free (expire, shard, elt);
+					removed ++;
+				}
+			}
+			else if (deadline % RSPAMD_KV_WHEEL_SLOTS != elt->ttl_slot) {
+				TAILQ_REMOVE (slot, elt, ttl_entry);
+				rspamd_lru_wheel_link (expire, elt, deadline);
+			}
+			elt = next;
 		}
-		else {
-			g_slice_free1 (ELT_SIZE (oldest_elt), oldest_elt);
+
+		expire->wheel_cursor = NULL;
+		if (expire->wheel_time == now) {
+			/* Elements of this second can be added later */
+			break;
 		}
+		expire->wheel_time ++;
 	}
 
-	return TRUE;
+	return removed;
 }
 
 /**
@@ -787,9 +979,15 @@ struct rspamd_kv_expire *
 rspamd_lru_expire_new (void)
 {
 	struct rspamd_kv_lru_expire *new;
+	guint i;
 
 	new = g_slice_alloc (sizeof (struct rspamd_kv_lru_expire));
 	TAILQ_INIT (&new->head);
+	for (i = 0; i < RSPAMD_KV_WHEEL_SLOTS; i ++) {
+		TAILQ_INIT (&new->wheel[i]);
+	}
+	new->wheel_time = time (NULL);
+	new->wheel_cursor = NULL;
 
 	/* Set callbacks */
 	new->init_func = NULL;
@@ -797,6 +995,7 @@ rspamd_lru_expire_new (void)
 	new->delete_func = rspamd_lru_delete;
 	new->step_func = rspamd_lru_expire_step;
 	new->destroy_func = rspamd_lru_destroy;
+	new->tick_func = rspamd_lru_expire_tick;
 
 	return (struct rspamd_kv_expire *)new;
 }
@@ -833,8 +1032,9 @@ rspamd_kv_hash_insert (struct rspamd_kv_cache *c,
 	search_elt.p = key;
 
 	if ((elt = g_hash_table_lookup (cache->hash, &search_elt)) == NULL) {
-		elt = g_slice_alloc (
-			sizeof (struct rspamd_kv_element) + len + keylen + 1);
+		elt = rspamd_kv_slab_alloc (
+			sizeof (struct rspamd_kv_element) + len + keylen + 1,
+			FALSE);
 		elt->age = time (NULL);
 		elt->keylen = keylen;
 		elt->size = len;
@@ -851,10 +1051,11 @@ rspamd_kv_hash_insert (struct rspamd_kv_cache *c,
 		}
 		else {
 			/* Free it by self */
-			g_slice_free1 (ELT_SIZE (elt), elt);
+			ELT_FREE (elt);
 		}
-		elt = g_slice_alloc (
-			sizeof (struct rspamd_kv_element) + len + keylen + 1);
+		elt = rspamd_kv_slab_alloc (
+			sizeof (struct rspamd_kv_element) + len + keylen + 1,
+			FALSE);
 		elt->age = time (NULL);
 		elt->keylen = keylen;
 		elt->size = len;
@@ -906,7 +1107,7 @@ rspamd_kv_hash_replace (struct rspamd_kv_cache *c,
 		}
 		else {
 			/* Free it by self */
-			g_slice_free1 (ELT_SIZE (oldelt), oldelt);
+			ELT_FREE (oldelt);
 		}
 		g_hash_table_insert (cache->hash, elt, elt);
 		return TRUE;
@@ -955,7 +1156,7 @@ rspamd_kv_hash_destroy_cb (gpointer key, gpointer value, gpointer unused)
 {
 	struct rspamd_kv_element *elt = value;
 
-	g_slice_free1 (ELT_SIZE (elt), elt);
+	ELT_FREE (elt);
 }
 
 static void
@@ -1231,8 +1432,9 @@ rspamd_kv_radix_insert (struct rspamd_kv_cache *c,
 
 	elt = (struct rspamd_kv_element *)radix32tree_find (cache->tree, rkey);
 	if ((uintptr_t)elt == RADIX_NO_VALUE) {
-		elt = g_slice_alloc (
-			sizeof (struct rspamd_kv_element) + len + keylen + 1);
+		elt = rspamd_kv_slab_alloc (
+			sizeof (struct rspamd_kv_element) + len + keylen + 1,
+			FALSE);
 		elt->age = time (NULL);
 		elt->keylen = keylen;
 		elt->size = len;
@@ -1249,10 +1451,11 @@ rspamd_kv_radix_insert (struct rspamd_kv_cache *c,
 		}
 		else {
 			/* Free it by self */
-			g_slice_free1 (ELT_SIZE (elt), elt);
+			ELT_FREE (elt);
 		}
-		elt = g_slice_alloc (
-			sizeof (struct rspamd_kv_element) + len + keylen + 1);
+		elt = rspamd_kv_slab_alloc (
+			sizeof (struct rspamd_kv_element) + len + keylen + 1,
+			FALSE);
 		elt->age = time (NULL);
 		elt->keylen = keylen;
 		elt->size = len;
@@ -1306,7 +1509,7 @@ rspamd_kv_radix_replace (struct rspamd_kv_cache *c,
 		}
 		else {
 			/* Free it by self */
-			g_slice_free1 (ELT_SIZE (oldelt), oldelt);
+			ELT_FREE (oldelt);
 		}
 		radix32tree_insert (cache->tree, rkey, 0xffffffff, (uintptr_t)elt);
 		return TRUE;
@@ -1381,6 +1584,450 @@ rspamd_kv_radix_new (void)
 	return (struct rspamd_kv_cache *)new;
 }
 
+/*
+ * Cuckoo cache
+ */
+
+/* Number of slots in a bucket, tags of a bucket fit in a single word */
+#define RSPAMD_KV_CUCKOO_SLOTS 8
+/* Keys that are not longer than this are stored inside buckets */
+#define RSPAMD_KV_CUCKOO_KEYLEN 16
+/* Maximum number of displacements before the table is grown */
+#define RSPAMD_KV_CUCKOO_MAX_KICKS 512
+/* Initial number of buckets, must be a power of two */
+#define RSPAMD_KV_CUCKOO_MIN_BUCKETS 64
+/* Maximum load factor in percents */
+#define RSPAMD_KV_CUCKOO_MAX_LOAD 95
+
+#define RSPAMD_KV_CUCKOO_ONES G_GUINT64_CONSTANT (0x0101010101010101)
+#define RSPAMD_KV_CUCKOO_LOWS G_GUINT64_CONSTANT (0x7f7f7f7f7f7f7f7f)
+
+struct rspamd_kv_cuckoo_bucket {
+	guint64 tags;                               /*< tag byte per slot, zero means empty slot */
+	guint8 keylens[RSPAMD_KV_CUCKOO_SLOTS];     /*< lengths of keys, G_MAXUINT8 for long keys */
+	guint8 keys[RSPAMD_KV_CUCKOO_SLOTS][RSPAMD_KV_CUCKOO_KEYLEN];
+	struct rspamd_kv_element *elts[RSPAMD_KV_CUCKOO_SLOTS];
+};
+
+struct rspamd_kv_cuckoo_cache {
+	cache_init init_func;                       /*< this callback is called on kv storage initialization */
+	cache_insert insert_func;                   /*< this callback is called when element is inserted */
+	cache_replace replace_func;                 /*< this callback is called when element is replace */
+	cache_lookup lookup_func;                   /*< this callback is used for lookup of element */
+	cache_delete delete_func;                   /*< this callback is called when an element is deleted */
+	cache_steal steal_func;                     /*< this callback is used to replace duplicates in cache */
+	cache_destroy destroy_func;                 /*< this callback is used for destroying all elements inside cache */
+	struct rspamd_kv_cuckoo_bucket *buckets;
+	gsize nbuckets;                             /*< number of buckets, a power of two */
+	gsize nelts;
+	guint victim;                               /*< slot to displace on the next kick */
+};
+
+static inline guint64
+rspamd_kv_cuckoo_hash (gconstpointer key, guint keylen)
+{
+	return XXH64 (key, keylen, 0xdeadbabe);
+}
+
+static inline guint8
+rspamd_kv_cuckoo_tag (guint64 h)
+{
+	guint8 tag = h >> 56;
+
+	return tag != 0 ? tag : 1;
+}
+
+/* The alternate bucket depends on the tag only, so elements can be moved
+ * without looking at their keys */
+static inline gsize
+rspamd_kv_cuckoo_alt (struct rspamd_kv_cuckoo_cache *cache,
+	gsize idx,
+	guint8 tag)
+{
+	return (idx ^ ((guint64)tag * G_GUINT64_CONSTANT (0xc6a4a7935bd1e995))) &
+		   (cache->nbuckets - 1);
+}
+
+/* Get a bit mask of slots whose tags are equal to the specified one, the mask
+ * has the high bit of each matched byte set, all tags are compared at once */
+static inline guint64
+rspamd_kv_cuckoo_match (const struct rspamd_kv_cuckoo_bucket *b, guint8 tag)
+{
+	guint64 x = b->tags ^ (RSPAMD_KV_CUCKOO_ONES * tag);
+
+	return ~(((x & RSPAMD_KV_CUCKOO_LOWS) + RSPAMD_KV_CUCKOO_LOWS) | x |
+		   RSPAMD_KV_CUCKOO_LOWS);
+}
+
+static inline guint8
+rspamd_kv_cuckoo_slot_tag (const struct rspamd_kv_cuckoo_bucket *b, guint i)
+{
+	return (b->tags >> (i * 8)) & 0xff;
+}
+
+static inline void
+rspamd_kv_cuckoo_set_slot (struct rspamd_kv_cuckoo_bucket *b,
+	guint i,
+	guint8 tag,
+	struct rspamd_kv_element *elt)
+{
+	b->tags &= ~(G_GUINT64_CONSTANT (0xff) << (i * 8));
+	b->tags |= (guint64)tag << (i * 8);
+	b->elts[i] = elt;
+
+	if (elt != NULL) {
+		if (elt->keylen <= RSPAMD_KV_CUCKOO_KEYLEN) {
+			b->keylens[i] = elt->keylen;
+			memcpy (b->keys[i], ELT_KEY (elt), elt->keylen);
+		}
+		else {
+			b->keylens[i] = G_MAXUINT8;
+		}
+	}
+}
+
+static gint
+rspamd_kv_cuckoo_find_slot (const struct rspamd_kv_cuckoo_bucket *b,
+	guint8 tag,
+	gconstpointer key,
+	guint keylen)
+{
+	guint64 m;
+	guint i;
+
+	m = rspamd_kv_cuckoo_match (b, tag);
+
+	while (m != 0) {
+		i = (__builtin_ctzll (m)) / 8;
+		m &= m - 1;
+
+		if (keylen <= RSPAMD_KV_CUCKOO_KEYLEN) {
+			if (b->keylens[i] == keylen && memcmp (b->keys[i], key, keylen) == 0) {
+				return i;
+			}
+		}
+		else if (b->keylens[i] == G_MAXUINT8 && b->elts[i]->keylen == keylen &&
+			memcmp (ELT_KEY (b->elts[i]), key, keylen) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static struct rspamd_kv_cuckoo_bucket *
+rspamd_kv_cuckoo_find (struct rspamd_kv_cuckoo_cache *cache,
+	gconstpointer key,
+	guint keylen,
+	gint *slot)
+{
+	struct rspamd_kv_cuckoo_bucket *b;
+	guint64 h;
+	gsize idx;
+	guint8 tag;
+
+	h = rspamd_kv_cuckoo_hash (key, keylen);
+	tag = rspamd_kv_cuckoo_tag (h);
+	idx = h & (cache->nbuckets - 1);
+
+	b = &cache->buckets[idx];
+	if ((*slot = rspamd_kv_cuckoo_find_slot (b, tag, key, keylen)) != -1) {
+		return b;
+	}
+
+	b = &cache->buckets[rspamd_kv_cuckoo_alt (cache, idx, tag)];
+	if ((*slot = rspamd_kv_cuckoo_find_slot (b, tag, key, keylen)) != -1) {
+		return b;
+	}
+
+	return NULL;
+}
+
+/* Place an element to the table, returns an element that cannot be placed */
+static struct rspamd_kv_element *
+rspamd_kv_cuckoo_place (struct rspamd_kv_cuckoo_cache *cache,
+	struct rspamd_kv_element *elt)
+{
+	struct rspamd_kv_cuckoo_bucket *b;
+	struct rspamd_kv_element *victim;
+	guint64 h, m;
+	gsize idx, alt;
+	guint8 tag, vtag;
+	guint i, kicks;
+
+	h = rspamd_kv_cuckoo_hash (ELT_KEY (elt), elt->keylen);
+	tag = rspamd_kv_cuckoo_tag (h);
+	idx = h & (cache->nbuckets - 1);
+	alt = rspamd_kv_cuckoo_alt (cache, idx, tag);
+
+	/* Use a less loaded bucket of two */
+	m = rspamd_kv_cuckoo_match (&cache->buckets[alt], 0);
+	if (__builtin_popcountll (rspamd_kv_cuckoo_match (&cache->buckets[idx], 0)) <
+		__builtin_popcountll (m)) {
+		idx = alt;
+	}
+
+	for (kicks = 0; kicks < RSPAMD_KV_CUCKOO_MAX_KICKS; kicks ++) {
+		b = &cache->buckets[idx];
+
+		for (i = 0; i < RSPAMD_KV_CUCKOO_SLOTS; i ++) {
+			if (rspamd_kv_cuckoo_slot_tag (b, i) == 0) {
+				rspamd_kv_cuckoo_set_slot (b, i, tag, elt);
+				return NULL;
+			}
+		}
+
+		/* Displace an element to its alternate bucket */
+		i = cache->victim ++ % RSPAMD_KV_CUCKOO_SLOTS;
+		victim = b->elts[i];
+		vtag = rspamd_kv_cuckoo_slot_tag (b, i);
+		rspamd_kv_cuckoo_set_slot (b, i, tag, elt);
+		elt = victim;
+		tag = vtag;
+		idx = rspamd_kv_cuckoo_alt (cache, idx, tag);
+	}
+
+	return elt;
+}
+
+/* Rebuild the table with a larger number of buckets */
+static void
+rspamd_kv_cuckoo_grow (struct rspamd_kv_cuckoo_cache *cache,
+	struct rspamd_kv_element *pending)
+{
+	struct rspamd_kv_cuckoo_bucket *old;
+	gsize oldn, i;
+	guint j;
+	gboolean placed;
+
+	old = cache->buckets;
+	oldn = cache->nbuckets;
+
+	do {
+		cache->nbuckets *= 2;
+		cache->buckets = g_malloc0 (
+			sizeof (struct rspamd_kv_cuckoo_bucket) * cache->nbuckets);
+		placed = TRUE;
+
+		for (i = 0; i < oldn && placed; i ++) {
+			for (j = 0; j < RSPAMD_KV_CUCKOO_SLOTS && placed; j ++) {
+				if (rspamd_kv_cuckoo_slot_tag (&old[i], j) != 0) {
+					placed = rspamd_kv_cuckoo_place (cache,
+							old[i].elts[j]) == NULL;
+				}
+			}
+		}
+		if (placed && pending != NULL) {
+			placed = rspamd_kv_cuckoo_place (cache, pending) == NULL;
+		}
+		if (!placed) {
+			/* Very unlikely, the old table is still intact */
+			g_free (cache->buckets);
+		}
+	} while (!placed);
+
+	g_free (old);
+}
+
+static void
+rspamd_kv_cuckoo_add (struct rspamd_kv_cuckoo_cache *cache,
+	struct rspamd_kv_element *elt)
+{
+	if ((cache->nelts + 1) * 100 >
+		cache->nbuckets * RSPAMD_KV_CUCKOO_SLOTS * RSPAMD_KV_CUCKOO_MAX_LOAD) {
+		rspamd_kv_cuckoo_grow (cache, elt);
+	}
+	else if ((elt = rspamd_kv_cuckoo_place (cache, elt)) != NULL) {
+		rspamd_kv_cuckoo_grow (cache, elt);
+	}
+
+	cache->nelts ++;
+}
+
+static void
+rspamd_kv_cuckoo_remove (struct rspamd_kv_cuckoo_cache *cache,
+	struct rspamd_kv_cuckoo_bucket *b,
+	gint slot)
+{
+	rspamd_kv_cuckoo_set_slot (b, slot, 0, NULL);
+	cache->nelts --;
+}
+
+/* Release an element removed from the cache */
+static void
+rspamd_kv_cuckoo_release (struct rspamd_kv_element *elt)
+{
+	if ((elt->flags & KV_ELT_DIRTY) != 0) {
+		elt->flags |= KV_ELT_NEED_FREE;
+	}
+	else {
+		/* Free it by self */
+		ELT_FREE (elt);
+	}
+}
+
+/**
+ * Insert an element inside cache
+ */
+static struct rspamd_kv_element *
+rspamd_kv_cuckoo_insert (struct rspamd_kv_cache *c,
+	gpointer key,
+	guint keylen,
+	gpointer value,
+	gsize len)
+{
+	struct rspamd_kv_cuckoo_cache *cache = (struct rspamd_kv_cuckoo_cache *)c;
+	struct rspamd_kv_cuckoo_bucket *b;
+	struct rspamd_kv_element *elt;
+	gint slot;
+
+	if ((b = rspamd_kv_cuckoo_find (cache, key, keylen, &slot)) != NULL) {
+		elt = b->elts[slot];
+		rspamd_kv_cuckoo_remove (cache, b, slot);
+		rspamd_kv_cuckoo_release (elt);
+	}
+
+	elt = rspamd_kv_slab_alloc (
+		sizeof (struct rspamd_kv_element) + len + keylen + 1,
+		FALSE);
+	elt->age = time (NULL);
+	elt->keylen = keylen;
+	elt->size = len;
+	elt->flags = 0;
+	memcpy (ELT_KEY (elt),	key,   keylen + 1);
+	memcpy (ELT_DATA (elt), value, len);
+	elt->p = &elt->data;
+	rspamd_kv_cuckoo_add (cache, elt);
+
+	return elt;
+}
+
+/**
+ * Lookup an item inside cuckoo table
+ */
+static struct rspamd_kv_element *
+rspamd_kv_cuckoo_lookup (struct rspamd_kv_cache *c, gpointer key, guint keylen)
+{
+	struct rspamd_kv_cuckoo_cache *cache = (struct rspamd_kv_cuckoo_cache *)c;
+	struct rspamd_kv_cuckoo_bucket *b;
+	gint slot;
+
+	if ((b = rspamd_kv_cuckoo_find (cache, key, keylen, &slot)) != NULL) {
+		return b->elts[slot];
+	}
+
+	return NULL;
+}
+
+/**
+ * Replace an element inside cache
+ */
+static gboolean
+rspamd_kv_cuckoo_replace (struct rspamd_kv_cache *c,
+	gpointer key,
+	guint keylen,
+	struct rspamd_kv_element *elt)
+{
+	struct rspamd_kv_cuckoo_cache *cache = (struct rspamd_kv_cuckoo_cache *)c;
+	struct rspamd_kv_cuckoo_bucket *b;
+	struct rspamd_kv_element *oldelt;
+	gint slot;
+
+	if ((b = rspamd_kv_cuckoo_find (cache, key, keylen, &slot)) != NULL) {
+		oldelt = b->elts[slot];
+		/* The key is the same, so the slot can be reused */
+		rspamd_kv_cuckoo_set_slot (b, slot,
+			rspamd_kv_cuckoo_slot_tag (b, slot), elt);
+		rspamd_kv_cuckoo_release (oldelt);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Delete an element from cache
+ */
+static struct rspamd_kv_element *
+rspamd_kv_cuckoo_delete (struct rspamd_kv_cache *c, gpointer key, guint keylen)
+{
+	struct rspamd_kv_cuckoo_cache *cache = (struct rspamd_kv_cuckoo_cache *)c;
+	struct rspamd_kv_cuckoo_bucket *b;
+	struct rspamd_kv_element *elt;
+	gint slot;
+
+	if ((b = rspamd_kv_cuckoo_find (cache, key, keylen, &slot)) != NULL) {
+		elt = b->elts[slot];
+		rspamd_kv_cuckoo_remove (cache, b, slot);
+		return elt;
+	}
+
+	return NULL;
+}
+
+/**
+ * Steal an element from cache
+ */
+static void
+rspamd_kv_cuckoo_steal (struct rspamd_kv_cache *c, struct rspamd_kv_element *elt)
+{
+	struct rspamd_kv_cuckoo_cache *cache = (struct rspamd_kv_cuckoo_cache *)c;
+	struct rspamd_kv_cuckoo_bucket *b;
+	gint slot;
+
+	b = rspamd_kv_cuckoo_find (cache, ELT_KEY (elt), elt->keylen, &slot);
+	if (b != NULL && b->elts[slot] == elt) {
+		rspamd_kv_cuckoo_remove (cache, b, slot);
+	}
+}
+
+/**
+ * Destroy the whole cache
+ */
+static void
+rspamd_kv_cuckoo_destroy (struct rspamd_kv_cache *c)
+{
+	struct rspamd_kv_cuckoo_cache *cache = (struct rspamd_kv_cuckoo_cache *)c;
+	gsize i;
+	guint j;
+
+	for (i = 0; i < cache->nbuckets; i ++) {
+		for (j = 0; j < RSPAMD_KV_CUCKOO_SLOTS; j ++) {
+			if (rspamd_kv_cuckoo_slot_tag (&cache->buckets[i], j) != 0) {
+				ELT_FREE (cache->buckets[i].elts[j]);
+			}
+		}
+	}
+
+	g_free (cache->buckets);
+	g_slice_free1 (sizeof (struct rspamd_kv_cuckoo_cache), cache);
+}
+
+/**
+ * Create new cuckoo kv cache
+ */
+struct rspamd_kv_cache *
+rspamd_kv_cuckoo_new (void)
+{
+	struct rspamd_kv_cuckoo_cache *new;
+
+	new = g_slice_alloc (sizeof (struct rspamd_kv_cuckoo_cache));
+	new->nbuckets = RSPAMD_KV_CUCKOO_MIN_BUCKETS;
+	new->buckets = g_malloc0 (
+		sizeof (struct rspamd_kv_cuckoo_bucket) * new->nbuckets);
+	new->nelts = 0;
+	new->victim = 0;
+	new->init_func = NULL;
+	new->insert_func = rspamd_kv_cuckoo_insert;
+	new->lookup_func = rspamd_kv_cuckoo_lookup;
+	new->replace_func = rspamd_kv_cuckoo_replace;
+	new->delete_func = rspamd_kv_cuckoo_delete;
+	new->steal_func = rspamd_kv_cuckoo_steal;
+	new->destroy_func = rspamd_kv_cuckoo_destroy;
+
+	return (struct rspamd_kv_cache *)new;
+}
+
 
 #ifdef WITH_JUDY
 /*
@@ -1457,8 +2104,9 @@ rspamd_kv_judy_insert (struct rspamd_kv_cache *c,
 	struct rspamd_kv_judy_cache *cache = (struct rspamd_kv_judy_cache *)c;
 
 	if ((elt = rspamd_kv_judy_lookup (c, key, keylen)) == NULL) {
-		elt = g_slice_alloc (
-			sizeof (struct rspamd_kv_element) + len + keylen + 1);
+		elt = rspamd_kv_slab_alloc (
+			sizeof (struct rspamd_kv_element) + len + keylen + 1,
+			FALSE);
 		elt->age = time (NULL);
 		elt->keylen = keylen;
 		elt->size = len;
@@ -1476,10 +2124,11 @@ rspamd_kv_judy_insert (struct rspamd_kv_cache *c,
 		}
 		else {
 			/* Free it by self */
-			g_slice_free1 (ELT_SIZE (elt), elt);
+			ELT_FREE (elt);
 		}
-		elt = g_slice_alloc0 (
-			sizeof (struct rspamd_kv_element) + len + keylen + 1);
+		elt = rspamd_kv_slab_alloc (
+			sizeof (struct rspamd_kv_element) + len + keylen + 1,
+			TRUE);
 		elt->age = time (NULL);
 		elt->keylen = keylen;
 		elt->size = len;
@@ -1514,7 +2163,7 @@ rspamd_kv_judy_replace (struct rspamd_kv_cache *c,
 		}
 		else {
 			/* Free it by self */
-			g_slice_free1 (ELT_SIZE (oldelt), oldelt);
+			ELT_FREE (oldelt);
 		}
 		JHSI (pelt, cache->judy, ELT_KEY (elt), elt->keylen);
 		*pelt = elt;
@@ -25,10 +25,13 @@
 #define KVSTORAGE_H_
 
 #include "config.h"
+#include "util.h"
+#include "kvstorage_slab.h"
 
 struct rspamd_kv_cache;
 struct rspamd_kv_backend;
 struct rspamd_kv_storage;
+struct rspamd_kv_shard;
 struct rspamd_kv_expire;
 struct rspamd_kv_element;
 
@@ -85,9 +88,12 @@ typedef void (*expire_insert)(struct rspamd_kv_expire *expire,
 typedef void (*expire_delete)(struct rspamd_kv_expire *expire,
 	struct rspamd_kv_element *elt);
 typedef gboolean (*expire_step)(struct rspamd_kv_expire *expire,
-	struct rspamd_kv_storage *storage,
+	struct rspamd_kv_shard *shard,
 	time_t now, gboolean forced);
 typedef void (*expire_destroy)(struct rspamd_kv_expire *expire);
+typedef gsize (*expire_tick)(struct rspamd_kv_expire *expire,
+	struct rspamd_kv_shard *shard,
+	time_t now, gsize max_checks);
 
 
 /* Flags of element */
@@ -99,7 +105,9 @@ enum rspamd_kv_flags {
 	KV_ELT_NEED_FREE = 1 << 4,
 	KV_ELT_INTEGER = 1 << 5,
 	KV_ELT_NEED_INSERT = 1 << 6,
-	KV_ELT_NEED_EXPIRE = 1 << 7
+	KV_ELT_NEED_EXPIRE = 1 << 7,
+	KV_ELT_REFERENCED = 1 << 8,
+	KV_ELT_TTL = 1 << 9
 };
 
 #define ELT_DATA(elt) (gchar *)(elt)->data + (elt)->keylen + 1
@@ -107,6 +115,9 @@ enum rspamd_kv_flags {
 #define ELT_KEY(elt) (gchar *)(elt)->data
 #define ELT_SIZE(elt) elt->size + sizeof(struct rspamd_kv_element) + \
 	elt->keylen + 1
+/* Memory actually used by an element inside slab */
+#define ELT_REAL_SIZE(elt) rspamd_kv_slab_chunk_size (ELT_SIZE (elt))
+#define ELT_FREE(elt) rspamd_kv_slab_free ((elt), ELT_SIZE (elt))
 
 /* Common structures description */
 
@@ -117,6 +128,8 @@ struct rspamd_kv_element {
 	gsize size;                                 /*< size of element */
 	TAILQ_ENTRY (rspamd_kv_element) entry;      /*< list entry */
 	guint keylen;                               /*< length of key */
+	guint32 ttl_slot;                           /*< slot of timing wheel */
+	TAILQ_ENTRY (rspamd_kv_element) ttl_entry;  /*< timing wheel entry */
 
 	gpointer p;                                 /*< pointer to data */
 	gchar data[1];                              /*< expandable data */
@@ -147,25 +160,23 @@ struct rspamd_kv_expire {
 	expire_step step_func;                      /*< this callback is used when cache is full */
 	expire_delete delete_func;                  /*< this callback is called when an element is deleted */
 	expire_destroy destroy_func;                /*< this callback is used for destroying all elements inside expire */
+	expire_tick tick_func;                      /*< this callback is called periodically to remove expired elements */
 };
 
-/* Main kv storage structure */
+/* Default number of independently locked partitions of a storage */
+#define RSPAMD_KV_DEFAULT_SHARDS 16
 
-struct rspamd_kv_storage {
+/* Partition of kv storage, a key always belongs to the same shard */
+struct rspamd_kv_shard {
 	struct rspamd_kv_cache *cache;
-	struct rspamd_kv_backend *backend;
 	struct rspamd_kv_expire *expire;
+	struct rspamd_kv_storage *storage;
 
-	gsize elts;                                 /*< current elements count in a storage */
-	gsize max_elts;                             /*< maximum number of elements in a storage */
+	gsize elts;                                 /*< current elements count in a shard */
+	gsize max_elts;                             /*< maximum number of elements in a shard */
 
 	gsize memory;                               /*< memory eaten */
 	gsize max_memory;                           /*< memory limit */
-
-	gint id;                                    /* char ID */
-	gchar *name;                                /* numeric ID */
-
-	gboolean no_overwrite;                      /* do not overwrite data with the same keys */
 #if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
 	GRWLock rwlock;                             /* rwlock in new glib */
 #else
@@ -173,12 +184,42 @@ struct rspamd_kv_storage {
 #endif
 };
 
-/** Create new kv storage */
+/* Main kv storage structure */
+
+struct rspamd_kv_storage {
+	struct rspamd_kv_shard *shards;
+	guint nshards;
+	struct rspamd_kv_backend *backend;
+	rspamd_mutex_t *backend_mtx;                /*< serializes access to backend */
+
+	gint id;                                    /* char ID */
+	gchar *name;                                /* numeric ID */
+
+	gboolean no_overwrite;                      /* do not overwrite data with the same keys */
+};
+
+/**
+ * Create new kv storage
+ * @param caches array of nshards caches
+ * @param expires array of nshards expires or NULL
+ * @param nshards number of partitions, limits are divided between them
+ */
 struct rspamd_kv_storage * rspamd_kv_storage_new (gint id, const gchar *name,
-	struct rspamd_kv_cache *cache, struct rspamd_kv_backend *backend,
-	struct rspamd_kv_expire *expire,
+	struct rspamd_kv_cache **caches, struct rspamd_kv_backend *backend,
+	struct rspamd_kv_expire **expires, guint nshards,
 	gsize max_elts, gsize max_memory, gboolean no_overwrite);
 
+/** Get shard of a key */
+struct rspamd_kv_shard * rspamd_kv_storage_get_shard (
+	struct rspamd_kv_storage *storage,
+	gconstpointer key,
+	guint keylen);
+
+/** Release read lock taken by rspamd_kv_storage_lookup */
+void rspamd_kv_storage_unlock (struct rspamd_kv_storage *storage,
+	gconstpointer key,
+	guint keylen);
+
 /** Insert new element to the kv storage */
 gboolean rspamd_kv_storage_insert (struct rspamd_kv_storage *storage,
 	gpointer key,
@@ -210,7 +251,10 @@ gboolean rspamd_kv_storage_increment (struct rspamd_kv_storage *storage,
 	guint keylen,
 	glong *value);
 
-/** Lookup an element inside kv storage */
+/**
+ * Lookup an element inside kv storage, the shard of key is left read locked
+ * and it must be released by rspamd_kv_storage_unlock
+ */
 struct rspamd_kv_element * rspamd_kv_storage_lookup (
 	struct rspamd_kv_storage *storage,
 	gpointer key,
@@ -223,6 +267,15 @@ struct rspamd_kv_element * rspamd_kv_storage_delete (
 	gpointer key,
 	guint keylen);
 
+/**
+ * Remove expired elements in small steps, it should be called periodically
+ * @param max_checks maximum number of elements checked in all shards
+ * @return number of elements removed
+ */
+gsize rspamd_kv_storage_expire_tick (struct rspamd_kv_storage *storage,
+	time_t now,
+	gsize max_checks);
+
 /** Destroy kv storage */
 void rspamd_kv_storage_destroy (struct rspamd_kv_storage *storage);
 
@@ -273,6 +326,11 @@ struct rspamd_kv_cache * rspamd_kv_hash_new (void);
  */
 struct rspamd_kv_cache * rspamd_kv_radix_new (void);
 
+/**
+ * Bucketized cuckoo hash, short keys are stored inside the table
+ */
+struct rspamd_kv_cache * rspamd_kv_cuckoo_new (void);
+
 #ifdef WITH_JUDY
 /**
  * Judy tree
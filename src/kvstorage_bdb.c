@@ -119,7 +119,7 @@ bdb_process_queue (struct rspamd_kv_backend *backend)
 		if (op->op == BDB_OP_DELETE || (op->elt->flags & KV_ELT_NEED_FREE) !=
 			0) {
 			/* Also clean memory */
-			g_slice_free1 (ELT_SIZE (op->elt), op->elt);
+			ELT_FREE (op->elt);
 		}
 		g_slice_free1 (sizeof (struct bdb_op), op);
 		cur = g_list_next (cur);
@@ -31,6 +31,7 @@
 #include "kvstorage_sqlite.h"
 #endif
 #include "kvstorage_file.h"
+#include "kvstorage_log.h"
 
 #define FILE_STORAGE_LEVELS 3
 
@@ -51,6 +52,7 @@ struct kvstorage_config_parser {
 		KVSTORAGE_STATE_CACHE_TYPE,
 		KVSTORAGE_STATE_CACHE_MAX_ELTS,
 		KVSTORAGE_STATE_CACHE_MAX_MEM,
+		KVSTORAGE_STATE_CACHE_SHARDS,
 		KVSTORAGE_STATE_CACHE_NO_OVERWRITE,
 		KVSTORAGE_STATE_BACKEND_TYPE,
 		KVSTORAGE_STATE_BACKEND_FILENAME,
@@ -88,25 +90,36 @@ kvstorage_init_callback (const gpointer key,
 	gpointer unused)
 {
 	struct kvstorage_config *kconf = value;
-	struct rspamd_kv_cache *cache;
+	struct rspamd_kv_cache **caches;
 	struct rspamd_kv_backend *backend = NULL;
-	struct rspamd_kv_expire *expire = NULL;
-
-	switch (kconf->cache.type) {
-	case KVSTORAGE_TYPE_CACHE_HASH:
-		cache = rspamd_kv_hash_new ();
-		break;
-	case KVSTORAGE_TYPE_CACHE_RADIX:
-		cache = rspamd_kv_radix_new ();
-		break;
+	struct rspamd_kv_expire **expires = NULL;
+	guint i, nshards;
+
+	nshards = kconf->cache.shards > 0 ? kconf->cache.shards :
+		RSPAMD_KV_DEFAULT_SHARDS;
+	caches = g_malloc0 (sizeof (struct rspamd_kv_cache *) * nshards);
+
+	for (i = 0; i < nshards; i ++) {
+		switch (kconf->cache.type) {
+		case KVSTORAGE_TYPE_CACHE_HASH:
+			caches[i] = rspamd_kv_hash_new ();
+			break;
+		case KVSTORAGE_TYPE_CACHE_RADIX:
+			caches[i] = rspamd_kv_radix_new ();
+			break;
+		case KVSTORAGE_TYPE_CACHE_CUCKOO:
+			caches[i] = rspamd_kv_cuckoo_new ();
+			break;
 #ifdef WITH_JUDY
-	case KVSTORAGE_TYPE_CACHE_JUDY:
-		cache = rspamd_kv_judy_new ();
-		break;
+		case KVSTORAGE_TYPE_CACHE_JUDY:
+			caches[i] = rspamd_kv_judy_new ();
+			break;
 #endif
-	default:
-		msg_err ("unknown cache type, internal error");
-		return;
+		default:
+			msg_err ("unknown cache type, internal error");
+			g_free (caches);
+			return;
+		}
 	}
 
 	switch (kconf->backend.type) {
@@ -121,6 +134,11 @@ kvstorage_init_callback (const gpointer key,
 				kconf->backend.do_fsync,
 				kconf->backend.do_ref);
 		break;
+	case KVSTORAGE_TYPE_BACKEND_LOG:
+		backend = rspamd_kv_log_new (kconf->backend.filename,
+				kconf->backend.sync_ops,
+				kconf->backend.do_fsync);
+		break;
 #ifdef WITH_DB
 	case KVSTORAGE_TYPE_BACKEND_BDB:
 		backend = rspamd_kv_bdb_new (kconf->backend.filename,
@@ -137,18 +155,25 @@ kvstorage_init_callback (const gpointer key,
 
 	switch (kconf->expire.type) {
 	case KVSTORAGE_TYPE_EXPIRE_LRU:
-		expire = rspamd_lru_expire_new ();
+		expires = g_malloc0 (sizeof (struct rspamd_kv_expire *) * nshards);
+		for (i = 0; i < nshards; i ++) {
+			expires[i] = rspamd_lru_expire_new ();
+		}
 		break;
 	}
 
 	kconf->storage = rspamd_kv_storage_new (kconf->id,
 			kconf->name,
-			cache,
+			caches,
 			backend,
-			expire,
+			expires,
+			nshards,
 			kconf->cache.max_elements,
 			kconf->cache.max_memory,
 			kconf->cache.no_overwrite);
+
+	g_free (caches);
+	g_free (expires);
 }
 
 /* XML parse callbacks */
@@ -193,6 +218,10 @@ kvstorage_xml_start_element (GMarkupParseContext *context,
 			kv_parser->state = KVSTORAGE_STATE_CACHE_MAX_MEM;
 			kv_parser->cur_elt = "max_memory";
 		}
+		else if (g_ascii_strcasecmp (element_name, "shards") == 0) {
+			kv_parser->state = KVSTORAGE_STATE_CACHE_SHARDS;
+			kv_parser->cur_elt = "shards";
+		}
 		else if (g_ascii_strcasecmp (element_name, "no_overwrite") == 0) {
 			kv_parser->state = KVSTORAGE_STATE_CACHE_NO_OVERWRITE;
 			kv_parser->cur_elt = "no_overwrite";
@@ -314,6 +343,7 @@ kvstorage_xml_end_element (GMarkupParseContext *context,
 	case KVSTORAGE_STATE_CACHE_TYPE:
 	case KVSTORAGE_STATE_CACHE_MAX_ELTS:
 	case KVSTORAGE_STATE_CACHE_MAX_MEM:
+	case KVSTORAGE_STATE_CACHE_SHARDS:
 	case KVSTORAGE_STATE_CACHE_NO_OVERWRITE:
 		CHECK_TAG (KVSTORAGE_STATE_PARAM);
 		break;
@@ -417,6 +447,10 @@ kvstorage_xml_text (GMarkupParseContext *context,
 		kv_parser->current_storage->cache.max_memory =
 			rspamd_config_parse_limit (text, text_len);
 		break;
+	case KVSTORAGE_STATE_CACHE_SHARDS:
+		kv_parser->current_storage->cache.shards =
+			rspamd_config_parse_limit (text, text_len);
+		break;
 	case KVSTORAGE_STATE_CACHE_NO_OVERWRITE:
 		kv_parser->current_storage->cache.no_overwrite =
 			rspamd_config_parse_flag (text);
@@ -430,6 +464,10 @@ kvstorage_xml_text (GMarkupParseContext *context,
 			MIN (text_len, sizeof ("radix") - 1)) == 0) {
 			kv_parser->current_storage->cache.type = KVSTORAGE_TYPE_CACHE_RADIX;
 		}
+		else if (g_ascii_strncasecmp (text, "cuckoo",
+			MIN (text_len, sizeof ("cuckoo") - 1)) == 0) {
+			kv_parser->current_storage->cache.type = KVSTORAGE_TYPE_CACHE_CUCKOO;
+		}
 #ifdef WITH_JUDY
 		else if (g_ascii_strncasecmp (text, "judy",
 			MIN (text_len, sizeof ("judy") - 1)) == 0) {
@@ -456,6 +494,11 @@ kvstorage_xml_text (GMarkupParseContext *context,
 			kv_parser->current_storage->backend.type =
 				KVSTORAGE_TYPE_BACKEND_FILE;
 		}
+		else if (g_ascii_strncasecmp (text, "log",
+			MIN (text_len, sizeof ("log") - 1)) == 0) {
+			kv_parser->current_storage->backend.type =
+				KVSTORAGE_TYPE_BACKEND_LOG;
+		}
 #ifdef WITH_DB
 		else if (g_ascii_strncasecmp (text, "bdb",
 			MIN (text_len, sizeof ("bdb") - 1)) == 0) {
@@ -593,6 +636,31 @@ get_kvstorage_config (gint id)
 	return g_hash_table_lookup (storages, &id);
 }
 
+/* Remove expired elements of all storages */
+gsize
+kvstorage_expire_tick (time_t now, gsize max_checks)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct kvstorage_config *kconf;
+	gsize removed = 0;
+
+	if (storages == NULL) {
+		return 0;
+	}
+
+	g_hash_table_iter_init (&it, storages);
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		kconf = v;
+		if (kconf->storage != NULL) {
+			removed += rspamd_kv_storage_expire_tick (kconf->storage, now,
+					max_checks);
+		}
+	}
+
+	return removed;
+}
+
 void
 destroy_kvstorage_config (void)
 {
@@ -32,6 +32,7 @@
 enum kvstorage_cache_type {
 	KVSTORAGE_TYPE_CACHE_HASH,
 	KVSTORAGE_TYPE_CACHE_RADIX,
+	KVSTORAGE_TYPE_CACHE_CUCKOO,
 #ifdef WITH_JUDY
 	KVSTORAGE_TYPE_CACHE_JUDY,
 #endif
@@ -42,6 +43,7 @@ enum kvstorage_cache_type {
 enum kvstorage_backend_type {
 	KVSTORAGE_TYPE_BACKEND_NULL = 0,
 	KVSTORAGE_TYPE_BACKEND_FILE,
+	KVSTORAGE_TYPE_BACKEND_LOG,
 #ifdef WITH_DB
 	KVSTORAGE_TYPE_BACKEND_BDB,
 #endif
@@ -60,6 +62,7 @@ enum kvstorage_expire_type {
 struct kvstorage_cache_config {
 	gsize max_elements;
 	gsize max_memory;
+	guint shards;
 	gboolean no_overwrite;
 	enum kvstorage_cache_type type;
 };
@@ -97,4 +100,7 @@ struct kvstorage_config * get_kvstorage_config (gint id);
 
 void destroy_kvstorage_config (void);
 
+/* Remove expired elements of all storages, returns number of removed elements */
+gsize kvstorage_expire_tick (time_t now, gsize max_checks);
+
 #endif /* KVSTORAGE_CONFIG_H_ */
@@ -316,7 +316,7 @@ file_process_queue (struct rspamd_kv_backend *backend)
 			((op->elt->flags & KV_ELT_NEED_FREE) != 0 &&
 			(op->elt->flags & KV_ELT_NEED_INSERT) == 0)) {
 			/* Also clean memory */
-			g_slice_free1 (ELT_SIZE (op->elt), op->elt);
+			ELT_FREE (op->elt);
 		}
 		else {
 			/* Unset dirty flag */
@@ -431,7 +431,7 @@ rspamd_file_insert (struct rspamd_kv_backend *backend,
 			0) {
 			/* Also clean memory */
 			g_hash_table_steal (db->ops_hash, &search_elt);
-			g_slice_free1 (ELT_SIZE (op->elt), op->elt);
+			ELT_FREE (op->elt);
 		}
 		op->op = FILE_OP_INSERT;
 		op->ref++;
@@ -480,7 +480,7 @@ rspamd_file_replace (struct rspamd_kv_backend *backend,
 			0) {
 			/* Also clean memory */
 			g_hash_table_steal (db->ops_hash, &search_elt);
-			g_slice_free1 (ELT_SIZE (op->elt), op->elt);
+			ELT_FREE (op->elt);
 		}
 		op->op = FILE_OP_REPLACE;
 		op->elt = elt;
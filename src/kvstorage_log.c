@@ -0,0 +1,827 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Log structured backend for kv storage.
+ *
+ * All modifications are appended as records to the active segment: records
+ * are accumulated in a write buffer and written by a single write followed by
+ * fdatasync for a whole batch (group commit). Positions of the latest records
+ * for all keys are kept in memory and the index is rebuilt by replaying
+ * segments on startup. A segment that mostly consists of outdated records is
+ * compacted: its live records are appended to the active segment by small
+ * steps after each commit and then the segment is removed.
+ */
+
+#include "config.h"
+#include "kvstorage.h"
+#include "kvstorage_log.h"
+#include "util.h"
+#include "main.h"
+#include "xxhash.h"
+
+#define LOG_RECORD_MAGIC 0x4c564b52
+/* Maximum size of write buffer before it is flushed */
+#define LOG_WRITE_BUFFER_MAX (1024 * 1024)
+/* Segments with less live data are compacted */
+#define LOG_COMPACT_RATIO 0.5
+/* Amount of data processed by a single compaction step */
+#define LOG_COMPACT_STEP (1024 * 1024)
+
+enum log_op {
+	LOG_OP_PUT = 0,
+	LOG_OP_DELETE
+};
+
+struct log_record_hdr {
+	guint32 magic;
+	guint32 op;
+	guint32 keylen;
+	guint32 len;                                /*< length of payload */
+	guint64 checksum;                           /*< XXH64 of payload */
+};
+
+struct log_index_entry {
+	gchar *key;
+	guint keylen;
+	guint32 segment;
+	off_t offset;                             /*< offset of record */
+	guint32 len;                                /*< length of payload */
+};
+
+struct log_segment {
+	guint32 id;
+	gint fd;
+	off_t size;                               /*< bytes written to file */
+	off_t live;                               /*< bytes of actual records */
+};
+
+/* Main log structure */
+struct rspamd_log_backend {
+	backend_init init_func;                     /*< this callback is called on kv storage initialization */
+	backend_insert insert_func;                 /*< this callback is called when element is inserted */
+	backend_replace replace_func;               /*< this callback is called when element is replaced */
+	backend_lookup lookup_func;                 /*< this callback is used for lookup of element */
+	backend_delete delete_func;                 /*< this callback is called when an element is deleted */
+	backend_sync sync_func;                     /*< this callback is called when backend need to be synced */
+	backend_incref incref_func;                 /*< this callback is called when element must be ref'd */
+	backend_destroy destroy_func;               /*< this callback is used for destroying all elements inside backend */
+	gchar *filename;
+	gchar *dirname;
+	gchar *basename;
+	guint sync_ops;
+	guint pending;                              /*< records in write buffer */
+	gboolean do_fsync;
+	gboolean initialized;
+	gboolean compacting;
+	GHashTable *index;
+	GHashTable *segments;
+	struct log_segment *active;
+	GByteArray *wbuf;
+	gsize segment_size;
+	struct log_segment *compact_seg;            /*< segment being compacted */
+	off_t compact_offset;
+};
+
+#define LOG_RECORD_SIZE(len) ((off_t)sizeof (struct log_record_hdr) + (len))
+
+static guint
+log_index_hash (gconstpointer p)
+{
+	const struct log_index_entry *entry = p;
+
+	return XXH64 (entry->key, entry->keylen, 0);
+}
+
+static gboolean
+log_index_equal (gconstpointer p1, gconstpointer p2)
+{
+	const struct log_index_entry *e1 = p1, *e2 = p2;
+
+	if (e1->keylen == e2->keylen) {
+		return memcmp (e1->key, e2->key, e1->keylen) == 0;
+	}
+
+	return FALSE;
+}
+
+static void
+log_index_free (gpointer p)
+{
+	struct log_index_entry *entry = p;
+
+	g_free (entry->key);
+	g_slice_free1 (sizeof (struct log_index_entry), entry);
+}
+
+static void
+log_segment_free (gpointer p)
+{
+	struct log_segment *seg = p;
+
+	if (seg->fd != -1) {
+		close (seg->fd);
+	}
+
+	g_slice_free1 (sizeof (struct log_segment), seg);
+}
+
+static void
+log_segment_path (struct rspamd_log_backend *db, guint32 id, gchar *buf,
+	gsize buflen)
+{
+	rspamd_snprintf (buf, buflen, "%s%c%s.%08ud", db->dirname,
+		G_DIR_SEPARATOR, db->basename, id);
+}
+
+static struct log_segment *
+log_segment_open (struct rspamd_log_backend *db, guint32 id, gboolean create)
+{
+	struct log_segment *seg;
+	gchar pathbuf[PATH_MAX];
+	struct stat st;
+	gint fd, flags = O_RDWR | O_APPEND;
+
+	if (create) {
+		flags |= O_CREAT | O_EXCL;
+	}
+
+	log_segment_path (db, id, pathbuf, sizeof (pathbuf));
+
+	if ((fd = open (pathbuf, flags, S_IRUSR | S_IWUSR | S_IRGRP)) == -1) {
+		msg_err ("cannot open log segment %s: %s", pathbuf, strerror (errno));
+		return NULL;
+	}
+
+	if (fstat (fd, &st) == -1) {
+		msg_err ("cannot stat log segment %s: %s", pathbuf, strerror (errno));
+		close (fd);
+		return NULL;
+	}
+
+	seg = g_slice_alloc0 (sizeof (struct log_segment));
+	seg->id = id;
+	seg->fd = fd;
+	seg->size = st.st_size;
+	g_hash_table_insert (db->segments, GUINT_TO_POINTER (id), seg);
+
+	return seg;
+}
+
+static void
+log_segment_unlink (struct rspamd_log_backend *db, struct log_segment *seg)
+{
+	gchar pathbuf[PATH_MAX];
+
+	log_segment_path (db, seg->id, pathbuf, sizeof (pathbuf));
+
+	if (unlink (pathbuf) == -1) {
+		msg_warn ("cannot unlink log segment %s: %s", pathbuf,
+			strerror (errno));
+	}
+
+	g_hash_table_remove (db->segments, GUINT_TO_POINTER (seg->id));
+}
+
+/* Account the previous record of a key as outdated */
+static void
+log_index_forget (struct rspamd_log_backend *db, struct log_index_entry *entry)
+{
+	struct log_segment *seg;
+
+	seg = g_hash_table_lookup (db->segments, GUINT_TO_POINTER (entry->segment));
+
+	if (seg != NULL) {
+		seg->live -= LOG_RECORD_SIZE (entry->len);
+	}
+}
+
+/* Update index for a record placed at the specified position */
+static void
+log_index_update (struct rspamd_log_backend *db,
+	struct log_segment *seg,
+	enum log_op op,
+	const gchar *key,
+	guint keylen,
+	off_t offset,
+	guint32 len)
+{
+	struct log_index_entry search, *entry;
+
+	search.key = (gchar *)key;
+	search.keylen = keylen;
+	entry = g_hash_table_lookup (db->index, &search);
+
+	if (entry != NULL) {
+		log_index_forget (db, entry);
+	}
+
+	if (op == LOG_OP_DELETE) {
+		if (entry != NULL) {
+			g_hash_table_remove (db->index, entry);
+		}
+
+		return;
+	}
+
+	if (entry == NULL) {
+		entry = g_slice_alloc (sizeof (struct log_index_entry));
+		entry->key = g_malloc (keylen);
+		memcpy (entry->key, key, keylen);
+		entry->keylen = keylen;
+		g_hash_table_insert (db->index, entry, entry);
+	}
+
+	entry->segment = seg->id;
+	entry->offset = offset;
+	entry->len = len;
+	seg->live += LOG_RECORD_SIZE (len);
+}
+
+/* Open a new active segment */
+static gboolean
+log_rotate (struct rspamd_log_backend *db)
+{
+	struct log_segment *seg;
+	guint32 id = 1;
+
+	if (db->active != NULL) {
+		id = db->active->id + 1;
+	}
+
+	seg = log_segment_open (db, id, TRUE);
+
+	if (seg == NULL) {
+		return FALSE;
+	}
+
+	db->active = seg;
+
+	return TRUE;
+}
+
+/* Write buffered records to the active segment */
+static gboolean
+log_flush (struct rspamd_log_backend *db, gboolean do_fsync)
+{
+	gssize r;
+	gsize written = 0;
+
+	while (written < db->wbuf->len) {
+		r = write (db->active->fd, db->wbuf->data + written,
+				db->wbuf->len - written);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			msg_err ("cannot write log segment %ud: %s", db->active->id,
+				strerror (errno));
+			/* Remove partial data, records will be written by the next commit */
+			if (written > 0 &&
+					ftruncate (db->active->fd, db->active->size) == -1) {
+				msg_err ("cannot truncate log segment %ud: %s",
+					db->active->id, strerror (errno));
+			}
+
+			return FALSE;
+		}
+
+		written += r;
+	}
+
+	db->active->size += written;
+	g_byte_array_set_size (db->wbuf, 0);
+	db->pending = 0;
+
+	if (do_fsync && written > 0) {
+#ifdef HAVE_FDATASYNC
+		fdatasync (db->active->fd);
+#else
+		fsync (db->active->fd);
+#endif
+	}
+
+	if (db->active->size >= (off_t)db->segment_size) {
+		return log_rotate (db);
+	}
+
+	return TRUE;
+}
+
+static gboolean log_commit (struct rspamd_log_backend *db);
+
+/* Append a record to the write buffer */
+static gboolean
+log_append (struct rspamd_log_backend *db,
+	enum log_op op,
+	const gchar *key,
+	guint keylen,
+	gconstpointer payload,
+	guint32 len)
+{
+	struct log_record_hdr hdr;
+	off_t offset;
+
+	hdr.magic = LOG_RECORD_MAGIC;
+	hdr.op = op;
+	hdr.keylen = keylen;
+	hdr.len = len;
+	hdr.checksum = XXH64 (payload, len, 0);
+
+	offset = db->active->size + db->wbuf->len;
+	g_byte_array_append (db->wbuf, (const guint8 *)&hdr, sizeof (hdr));
+	g_byte_array_append (db->wbuf, (const guint8 *)payload, len);
+	log_index_update (db, db->active, op, key, keylen, offset, len);
+	db->pending ++;
+
+	if ((db->sync_ops > 0 && db->pending >= db->sync_ops) ||
+			db->wbuf->len >= LOG_WRITE_BUFFER_MAX) {
+		if (db->compacting) {
+			return log_flush (db, db->do_fsync);
+		}
+
+		return log_commit (db);
+	}
+
+	return TRUE;
+}
+
+/* Read payload of a record */
+static gboolean
+log_read_payload (struct rspamd_log_backend *db,
+	guint32 segment,
+	off_t offset,
+	gpointer buf,
+	guint32 len)
+{
+	struct log_segment *seg;
+
+	if (segment == db->active->id && offset >= db->active->size) {
+		/* Record is still in write buffer */
+		memcpy (buf, db->wbuf->data + (offset - db->active->size) +
+			sizeof (struct log_record_hdr), len);
+
+		return TRUE;
+	}
+
+	seg = g_hash_table_lookup (db->segments, GUINT_TO_POINTER (segment));
+
+	if (seg == NULL) {
+		return FALSE;
+	}
+
+	if (pread (seg->fd, buf, len, offset + sizeof (struct log_record_hdr)) !=
+			(gssize)len) {
+		msg_err ("cannot read log segment %ud: %s", segment, strerror (errno));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Choose a segment with the most outdated data */
+static struct log_segment *
+log_compact_candidate (struct rspamd_log_backend *db)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct log_segment *seg, *selected = NULL;
+	gdouble ratio, best = LOG_COMPACT_RATIO;
+
+	g_hash_table_iter_init (&it, db->segments);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		seg = v;
+
+		if (seg == db->active || seg->size == 0) {
+			continue;
+		}
+
+		ratio = (gdouble)seg->live / (gdouble)seg->size;
+
+		if (ratio < best) {
+			best = ratio;
+			selected = seg;
+		}
+	}
+
+	return selected;
+}
+
+static gboolean
+log_is_oldest (struct rspamd_log_backend *db, struct log_segment *seg)
+{
+	GHashTableIter it;
+	gpointer k, v;
+
+	g_hash_table_iter_init (&it, db->segments);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		if (((struct log_segment *)v)->id < seg->id) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/* Move a portion of live records from the segment being compacted */
+static gboolean
+log_compact_step (struct rspamd_log_backend *db)
+{
+	struct log_segment *seg;
+	struct log_record_hdr hdr;
+	struct log_index_entry search, *entry;
+	off_t processed = 0;
+	gchar *payload;
+	gboolean oldest, res = TRUE;
+
+	if (db->compact_seg == NULL) {
+		db->compact_seg = log_compact_candidate (db);
+		db->compact_offset = 0;
+
+		if (db->compact_seg == NULL) {
+			return TRUE;
+		}
+	}
+
+	seg = db->compact_seg;
+	oldest = log_is_oldest (db, seg);
+	db->compacting = TRUE;
+
+	while (db->compact_offset < seg->size && processed < LOG_COMPACT_STEP) {
+		if (pread (seg->fd, &hdr, sizeof (hdr), db->compact_offset) !=
+				sizeof (hdr) || hdr.magic != LOG_RECORD_MAGIC) {
+			msg_err ("invalid record in log segment %ud at %O",
+				seg->id, db->compact_offset);
+			db->compact_seg = NULL;
+			db->compacting = FALSE;
+
+			return FALSE;
+		}
+
+		payload = g_malloc (hdr.len);
+
+		if (!log_read_payload (db, seg->id, db->compact_offset, payload,
+				hdr.len)) {
+			g_free (payload);
+			db->compact_seg = NULL;
+			db->compacting = FALSE;
+
+			return FALSE;
+		}
+
+		if (hdr.op == LOG_OP_PUT) {
+			search.key = ELT_KEY ((struct rspamd_kv_element *)payload);
+			search.keylen = hdr.keylen;
+			entry = g_hash_table_lookup (db->index, &search);
+
+			if (entry != NULL && entry->segment == seg->id &&
+					entry->offset == db->compact_offset) {
+				res = log_append (db, LOG_OP_PUT, search.key, search.keylen,
+						payload, hdr.len);
+			}
+		}
+		else if (!oldest) {
+			/* Tombstone may hide a record in older segments */
+			search.key = payload;
+			search.keylen = hdr.keylen;
+
+			if (g_hash_table_lookup (db->index, &search) == NULL) {
+				res = log_append (db, LOG_OP_DELETE, search.key, search.keylen,
+						payload, hdr.len);
+			}
+		}
+
+		g_free (payload);
+
+		if (!res) {
+			break;
+		}
+
+		processed += LOG_RECORD_SIZE (hdr.len);
+		db->compact_offset += LOG_RECORD_SIZE (hdr.len);
+	}
+
+	if (res && db->compact_offset >= seg->size) {
+		/* All live records must be durable before segment is removed */
+		res = log_flush (db, TRUE);
+
+		if (res) {
+			msg_info ("compacted log segment %ud", seg->id);
+			log_segment_unlink (db, seg);
+			db->compact_seg = NULL;
+		}
+	}
+
+	db->compacting = FALSE;
+
+	return res;
+}
+
+/* Group commit: write all buffered records and do compaction work */
+static gboolean
+log_commit (struct rspamd_log_backend *db)
+{
+	if (!log_flush (db, db->do_fsync)) {
+		return FALSE;
+	}
+
+	return log_compact_step (db);
+}
+
+/* Replay records of a segment to rebuild index */
+static void
+log_replay_segment (struct rspamd_log_backend *db, struct log_segment *seg)
+{
+	struct log_record_hdr hdr;
+	off_t offset = 0;
+	gchar *payload;
+	const gchar *key;
+
+	while (offset < seg->size) {
+		if (pread (seg->fd, &hdr, sizeof (hdr), offset) != sizeof (hdr) ||
+				hdr.magic != LOG_RECORD_MAGIC ||
+				offset + LOG_RECORD_SIZE (hdr.len) > seg->size) {
+			break;
+		}
+
+		payload = g_malloc (hdr.len);
+
+		if (pread (seg->fd, payload, hdr.len, offset + sizeof (hdr)) !=
+				(gssize)hdr.len ||
+				XXH64 (payload, hdr.len, 0) != hdr.checksum) {
+			g_free (payload);
+			break;
+		}
+
+		if (hdr.op == LOG_OP_PUT) {
+			key = ELT_KEY ((struct rspamd_kv_element *)payload);
+		}
+		else {
+			key = payload;
+		}
+
+		log_index_update (db, seg, hdr.op, key, hdr.keylen, offset, hdr.len);
+		g_free (payload);
+		offset += LOG_RECORD_SIZE (hdr.len);
+	}
+
+	if (offset < seg->size) {
+		/* Most likely a batch was not completely written on crash */
+		msg_warn ("truncate log segment %ud at %O, %O bytes are corrupted",
+			seg->id, offset, seg->size - offset);
+
+		if (ftruncate (seg->fd, offset) == -1) {
+			msg_err ("cannot truncate log segment %ud: %s", seg->id,
+				strerror (errno));
+		}
+
+		seg->size = offset;
+	}
+}
+
+static gint
+log_id_cmp (gconstpointer a, gconstpointer b)
+{
+	guint32 id1 = *(const guint32 *)a, id2 = *(const guint32 *)b;
+
+	return id1 < id2 ? -1 : (id1 > id2 ? 1 : 0);
+}
+
+/* Backend callbacks */
+static void
+rspamd_log_init (struct rspamd_kv_backend *backend)
+{
+	struct rspamd_log_backend *db = (struct rspamd_log_backend *)backend;
+	GDir *dir;
+	GError *err = NULL;
+	GArray *ids;
+	const gchar *name;
+	gchar *end;
+	struct log_segment *seg;
+	gsize baselen;
+	guint32 id;
+	guint i;
+
+	if ((dir = g_dir_open (db->dirname, 0, &err)) == NULL) {
+		msg_err ("cannot open directory %s: %s", db->dirname, err->message);
+		g_error_free (err);
+		return;
+	}
+
+	ids = g_array_new (FALSE, FALSE, sizeof (guint32));
+	baselen = strlen (db->basename);
+
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		if (strncmp (name, db->basename, baselen) == 0 &&
+				name[baselen] == '.' && g_ascii_isdigit (name[baselen + 1])) {
+			id = strtoul (name + baselen + 1, &end, 10);
+
+			if (*end == '\0' && id > 0) {
+				g_array_append_val (ids, id);
+			}
+		}
+	}
+
+	g_dir_close (dir);
+	g_array_sort (ids, log_id_cmp);
+
+	for (i = 0; i < ids->len; i ++) {
+		seg = log_segment_open (db, g_array_index (ids, guint32, i), FALSE);
+
+		if (seg == NULL) {
+			g_array_free (ids, TRUE);
+			return;
+		}
+
+		log_replay_segment (db, seg);
+		db->active = seg;
+	}
+
+	g_array_free (ids, TRUE);
+
+	if (db->active == NULL || db->active->size >= (off_t)db->segment_size) {
+		if (!log_rotate (db)) {
+			return;
+		}
+	}
+
+	msg_info ("loaded %ud keys from %ud log segments",
+		g_hash_table_size (db->index), g_hash_table_size (db->segments));
+	db->initialized = TRUE;
+}
+
+static gboolean
+rspamd_log_insert (struct rspamd_kv_backend *backend,
+	gpointer key,
+	guint keylen,
+	struct rspamd_kv_element *elt)
+{
+	struct rspamd_log_backend *db = (struct rspamd_log_backend *)backend;
+
+	if (!db->initialized) {
+		return FALSE;
+	}
+
+	return log_append (db, LOG_OP_PUT, key, keylen, elt, ELT_SIZE (elt));
+}
+
+static struct rspamd_kv_element *
+rspamd_log_lookup (struct rspamd_kv_backend *backend,
+	gpointer key,
+	guint keylen)
+{
+	struct rspamd_log_backend *db = (struct rspamd_log_backend *)backend;
+	struct log_index_entry search, *entry;
+	struct rspamd_kv_element *elt;
+
+	if (!db->initialized) {
+		return NULL;
+	}
+
+	search.key = key;
+	search.keylen = keylen;
+
+	if ((entry = g_hash_table_lookup (db->index, &search)) == NULL) {
+		return NULL;
+	}
+
+	elt = g_malloc (entry->len);
+
+	if (!log_read_payload (db, entry->segment, entry->offset, elt,
+			entry->len)) {
+		g_free (elt);
+		return NULL;
+	}
+
+	elt->flags &= ~(KV_ELT_DIRTY | KV_ELT_NEED_FREE | KV_ELT_REFERENCED);
+
+	return elt;
+}
+
+static void
+rspamd_log_delete (struct rspamd_kv_backend *backend,
+	gpointer key,
+	guint keylen)
+{
+	struct rspamd_log_backend *db = (struct rspamd_log_backend *)backend;
+	struct log_index_entry search;
+
+	if (!db->initialized) {
+		return;
+	}
+
+	search.key = key;
+	search.keylen = keylen;
+
+	if (g_hash_table_lookup (db->index, &search) != NULL) {
+		log_append (db, LOG_OP_DELETE, key, keylen, key, keylen);
+	}
+}
+
+static gboolean
+rspamd_log_sync (struct rspamd_kv_backend *backend)
+{
+	struct rspamd_log_backend *db = (struct rspamd_log_backend *)backend;
+
+	if (!db->initialized) {
+		return FALSE;
+	}
+
+	if (!log_flush (db, TRUE)) {
+		return FALSE;
+	}
+
+	return log_compact_step (db);
+}
+
+static void
+rspamd_log_destroy (struct rspamd_kv_backend *backend)
+{
+	struct rspamd_log_backend *db = (struct rspamd_log_backend *)backend;
+
+	if (db->initialized) {
+		log_flush (db, TRUE);
+	}
+
+	g_hash_table_unref (db->index);
+	g_hash_table_unref (db->segments);
+	g_byte_array_free (db->wbuf, TRUE);
+	g_free (db->filename);
+	g_free (db->dirname);
+	g_free (db->basename);
+	g_slice_free1 (sizeof (struct rspamd_log_backend), db);
+}
+
+/* Create new log backend */
+struct rspamd_kv_backend *
+rspamd_kv_log_new (const gchar *filename,
+	guint sync_ops,
+	gboolean do_fsync)
+{
+	struct rspamd_log_backend *new;
+	struct stat st;
+	gchar *dirname;
+
+	if (filename == NULL) {
+		return NULL;
+	}
+
+	dirname = g_path_get_dirname (filename);
+	if (dirname == NULL || stat (dirname, &st) == -1 || !S_ISDIR (st.st_mode)) {
+		/* Inaccessible path */
+		if (dirname != NULL) {
+			g_free (dirname);
+		}
+		msg_err ("invalid file: %s", filename);
+		return NULL;
+	}
+
+	new = g_slice_alloc0 (sizeof (struct rspamd_log_backend));
+	new->dirname = dirname;
+	new->basename = g_path_get_basename (filename);
+	new->filename = g_strdup (filename);
+	new->sync_ops = sync_ops;
+	new->do_fsync = do_fsync;
+	new->segment_size = RSPAMD_KV_LOG_SEGMENT_SIZE;
+	new->wbuf = g_byte_array_sized_new (LOG_WRITE_BUFFER_MAX);
+	new->index = g_hash_table_new_full (log_index_hash, log_index_equal,
+			NULL, log_index_free);
+	new->segments = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+			NULL, log_segment_free);
+
+	/* Set callbacks */
+	new->init_func = rspamd_log_init;
+	new->insert_func = rspamd_log_insert;
+	new->replace_func = rspamd_log_insert;
+	new->lookup_func = rspamd_log_lookup;
+	new->delete_func = rspamd_log_delete;
+	new->sync_func = rspamd_log_sync;
+	new->incref_func = NULL;
+	new->destroy_func = rspamd_log_destroy;
+
+	return (struct rspamd_kv_backend *)new;
+}
@@ -0,0 +1,45 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef KVSTORAGE_LOG_H_
+#define KVSTORAGE_LOG_H_
+
+#include "config.h"
+#include "kvstorage.h"
+
+/* Default size of a log segment */
+#define RSPAMD_KV_LOG_SEGMENT_SIZE (64 * 1024 * 1024)
+
+/**
+ * Create new log structured backend: all modifications are appended to
+ * segment files named as <filename>.<number>, the index of keys is kept in
+ * memory and rebuilt from segments on startup
+ * @param filename base name of segments
+ * @param sync_ops number of records written and synced in a single batch
+ * @param do_fsync call fdatasync for each batch
+ */
+struct rspamd_kv_backend * rspamd_kv_log_new (const gchar *filename,
+	guint sync_ops,
+	gboolean do_fsync);
+
+#endif /* KVSTORAGE_LOG_H_ */
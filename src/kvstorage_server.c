@@ -153,6 +153,239 @@ free_kvstorage_session (struct kvstorage_session *session)
 	g_slice_free1 (sizeof (struct kvstorage_session), session);
 }
 
+/*
+ * Queue reply to a client: replies are not written immediately but sent by a
+ * single writev when all complete commands in the input buffer are processed
+ */
+static gboolean
+kvstorage_reply (struct kvstorage_session *session,
+	const void *data,
+	gsize len,
+	gboolean allocated)
+{
+	return rspamd_dispatcher_write (session->dispather, data, len, TRUE,
+			   allocated);
+}
+
+/*
+ * Lookup a key and queue its value, the value is copied to the reply, so the
+ * shard is unlocked before this function returns
+ */
+static gboolean
+kvstorage_send_value (struct kvstorage_session *session,
+	gchar *key,
+	guint keylen,
+	gboolean is_redis)
+{
+	struct rspamd_kv_element *elt;
+	gchar intbuf[sizeof ("9223372036854775807")];
+	GString *reply;
+	guint eltlen;
+
+	elt = rspamd_kv_storage_lookup (session->cf->storage,
+			key,
+			keylen,
+			session->now);
+	if (elt == NULL) {
+		rspamd_kv_storage_unlock (session->cf->storage, key, keylen);
+		if (!is_redis) {
+			return kvstorage_reply (session, ERROR_NOT_FOUND,
+					   sizeof (ERROR_NOT_FOUND) - 1, TRUE);
+		}
+		else {
+			return kvstorage_reply (session, "$-1" CRLF,
+					   sizeof ("$-1" CRLF) - 1, TRUE);
+		}
+	}
+
+	if (elt->flags & KV_ELT_INTEGER) {
+		eltlen = rspamd_snprintf (intbuf,
+				sizeof (intbuf),
+				"%l",
+				ELT_LONG (elt));
+	}
+	else {
+		eltlen = elt->size;
+	}
+
+	reply = g_string_sized_new (eltlen + keylen + sizeof ("VALUE  ") +
+			sizeof (CRLF "END" CRLF) + 32);
+
+	if (!is_redis) {
+		rspamd_printf_gstring (reply, "VALUE %s %ud %ud" CRLF,
+			ELT_KEY (elt),
+			elt->flags,
+			eltlen);
+	}
+	else {
+		rspamd_printf_gstring (reply, "$%ud" CRLF, eltlen);
+	}
+
+	g_string_append_len (reply,
+		(elt->flags & KV_ELT_INTEGER) ? intbuf : ELT_DATA (elt),
+		eltlen);
+	g_string_append (reply, is_redis ? CRLF : CRLF "END" CRLF);
+
+	rspamd_kv_storage_unlock (session->cf->storage, key, keylen);
+
+	if ((elt->flags & KV_ELT_NEED_INSERT) != 0) {
+		/* Element is loaded from backend, insert it to cache and free */
+		elt->flags &= ~KV_ELT_NEED_INSERT;
+		rspamd_kv_storage_insert_cache (session->cf->storage,
+			ELT_KEY (elt),
+			elt->keylen, ELT_DATA (elt),
+			elt->size, elt->flags,
+			elt->expire, NULL);
+		g_free (elt);
+	}
+
+	return rspamd_dispatcher_write_string (session->dispather, reply, TRUE,
+			   TRUE);
+}
+
+/*
+ * Process redis multi-key commands: MGET, MSET and MINCRBY
+ */
+static gboolean
+kvstorage_process_multi (struct kvstorage_session *session)
+{
+	struct kvstorage_config *cf = session->cf;
+	rspamd_fstring_t *argv = session->argv;
+	guint i, nargs = session->argc - 1;
+	gchar outbuf[64];
+	glong longval;
+	gint r;
+	gboolean res = TRUE;
+
+	switch (session->command) {
+	case KVSTORAGE_CMD_MGET:
+		r = rspamd_snprintf (outbuf, sizeof (outbuf), "*%ud" CRLF, nargs);
+		if (!kvstorage_reply (session, outbuf, r, FALSE)) {
+			return FALSE;
+		}
+		for (i = 0; i < nargs && res; i ++) {
+			res = kvstorage_send_value (session, argv[i].begin, argv[i].len,
+					TRUE);
+		}
+		break;
+	case KVSTORAGE_CMD_MSET:
+		for (i = 0; i < nargs; i += 2) {
+			if (!rspamd_kv_storage_insert (cf->storage,
+				argv[i].begin, argv[i].len,
+				argv[i + 1].begin, argv[i + 1].len,
+				0, 0)) {
+				return kvstorage_reply (session, "-ERR not stored" CRLF,
+						   sizeof ("-ERR not stored" CRLF) - 1, TRUE);
+			}
+		}
+		res = kvstorage_reply (session, "+OK" CRLF, sizeof ("+OK" CRLF) - 1,
+				TRUE);
+		break;
+	case KVSTORAGE_CMD_MINCRBY:
+		r = rspamd_snprintf (outbuf, sizeof (outbuf), "*%ud" CRLF, nargs / 2);
+		if (!kvstorage_reply (session, outbuf, r, FALSE)) {
+			return FALSE;
+		}
+		for (i = 0; i < nargs && res; i += 2) {
+			if (!rspamd_strtol (argv[i + 1].begin, argv[i + 1].len,
+				&longval)) {
+				res = kvstorage_reply (session, "$-1" CRLF,
+						sizeof ("$-1" CRLF) - 1, TRUE);
+				continue;
+			}
+			if (!rspamd_kv_storage_increment (cf->storage, argv[i].begin,
+				argv[i].len, &longval)) {
+				/* Missing keys are created like in INCRBY of redis */
+				r = rspamd_snprintf (outbuf, sizeof (outbuf), "%l", longval);
+				if (!rspamd_kv_storage_insert (cf->storage, argv[i].begin,
+					argv[i].len, outbuf, r, 0, 0)) {
+					res = kvstorage_reply (session, "$-1" CRLF,
+							sizeof ("$-1" CRLF) - 1, TRUE);
+					continue;
+				}
+			}
+			r = rspamd_snprintf (outbuf, sizeof (outbuf), ":%l" CRLF, longval);
+			res = kvstorage_reply (session, outbuf, r, FALSE);
+		}
+		break;
+	default:
+		g_assert_not_reached ();
+	}
+
+	return res;
+}
+
+#define KVSTORAGE_INFO_CLASSES 64
+
+/*
+ * Write storage and slab allocator statistics
+ */
+static gboolean
+kvstorage_write_info (struct kvstorage_session *session, gboolean is_redis)
+{
+	struct rspamd_kv_storage *storage = session->cf->storage;
+	struct rspamd_kv_shard *shard;
+	struct rspamd_kv_slab_stat st[KVSTORAGE_INFO_CLASSES];
+	gsize elts = 0, memory = 0, max_elts = 0, max_memory = 0;
+	guint i, nclasses;
+	GString *buf;
+	gchar outbuf[64];
+	gboolean res;
+	gint r;
+	const gchar *fmt;
+
+	for (i = 0; i < storage->nshards; i ++) {
+		shard = &storage->shards[i];
+		RW_R_LOCK (&shard->rwlock);
+		elts += shard->elts;
+		memory += shard->memory;
+		max_elts += shard->max_elts;
+		max_memory += shard->max_memory;
+		RW_R_UNLOCK (&shard->rwlock);
+	}
+
+	buf = g_string_sized_new (BUFSIZ);
+	fmt = is_redis ? "%s:%z" CRLF : "STAT %s %z" CRLF;
+
+	rspamd_printf_gstring (buf, fmt, "shards", (gsize)storage->nshards);
+	rspamd_printf_gstring (buf, fmt, "elts", elts);
+	rspamd_printf_gstring (buf, fmt, "max_elts", max_elts);
+	rspamd_printf_gstring (buf, fmt, "memory", memory);
+	rspamd_printf_gstring (buf, fmt, "max_memory", max_memory);
+
+	nclasses = rspamd_kv_slab_get_stat (st, G_N_ELEMENTS (st));
+	fmt = is_redis ? "slab_%z_%s:%z" CRLF : "STAT slab_%z_%s %z" CRLF;
+
+	for (i = 0; i < nclasses; i ++) {
+		/* Zero chunk size stands for large allocations */
+		rspamd_printf_gstring (buf, fmt, st[i].chunk_size, "slabs",
+			st[i].slabs);
+		rspamd_printf_gstring (buf, fmt, st[i].chunk_size, "used_chunks",
+			st[i].used_chunks);
+		rspamd_printf_gstring (buf, fmt, st[i].chunk_size, "total_chunks",
+			st[i].total_chunks);
+		rspamd_printf_gstring (buf, fmt, st[i].chunk_size, "requested",
+			st[i].requested);
+	}
+
+	if (!is_redis) {
+		g_string_append (buf, "END" CRLF);
+	}
+	else {
+		r = rspamd_snprintf (outbuf, sizeof (outbuf), "$%z" CRLF, buf->len);
+		g_string_append (buf, CRLF);
+		if (!kvstorage_reply (session, outbuf, r, FALSE)) {
+			g_string_free (buf, TRUE);
+			return FALSE;
+		}
+	}
+
+	/* Buffer is freed by dispatcher */
+	res = rspamd_dispatcher_write_string (session->dispather, buf, TRUE, TRUE);
+
+	return res;
+}
+
 /*
  * Parse kvstorage command
  */
@@ -203,6 +436,15 @@ parse_kvstorage_command (struct kvstorage_session *session, gchar *c, guint len)
 			4) == 0 || g_ascii_strncasecmp (c, "save", 4) == 0) {
 			session->command = KVSTORAGE_CMD_SYNC;
 		}
+		else if (g_ascii_strncasecmp (c, "info", 4) == 0) {
+			session->command = KVSTORAGE_CMD_INFO;
+		}
+		else if (g_ascii_strncasecmp (c, "mget", 4) == 0) {
+			session->command = KVSTORAGE_CMD_MGET;
+		}
+		else if (g_ascii_strncasecmp (c, "mset", 4) == 0) {
+			session->command = KVSTORAGE_CMD_MSET;
+		}
 	}
 	else if (len == 6) {
 		if ((c[0] == 'i' || c[0] == 'I')     &&
@@ -238,6 +480,14 @@ parse_kvstorage_command (struct kvstorage_session *session, gchar *c, guint len)
 			return FALSE;
 		}
 	}
+	else if (len == 7) {
+		if (g_ascii_strncasecmp (c, "mincrby", 7) == 0) {
+			session->command = KVSTORAGE_CMD_MINCRBY;
+		}
+		else {
+			return FALSE;
+		}
+	}
 
 	return TRUE;
 }
@@ -302,6 +552,7 @@ parse_kvstorage_line (struct kvstorage_session *session, rspamd_fstring_t *in)
 
 					case KVSTORAGE_CMD_QUIT:
 					case KVSTORAGE_CMD_SYNC:
+					case KVSTORAGE_CMD_INFO:
 						/* Single argument command */
 						state = 100;
 						break;
@@ -310,6 +561,11 @@ parse_kvstorage_line (struct kvstorage_session *session, rspamd_fstring_t *in)
 						state = 99;
 						next_state = 6;
 						break;
+					case KVSTORAGE_CMD_MGET:
+					case KVSTORAGE_CMD_MSET:
+					case KVSTORAGE_CMD_MINCRBY:
+						/* Multi-key commands are supported for redis only */
+						return FALSE;
 					default:
 						/* Normal command, read key */
 						state = 99;
@@ -491,10 +747,9 @@ static gboolean
 kvstorage_process_command (struct kvstorage_session *session, gboolean is_redis)
 {
 	gint r;
-	gchar outbuf[BUFSIZ], intbuf[sizeof ("9223372036854775807")];
+	gchar outbuf[BUFSIZ];
 	gboolean res;
 	struct rspamd_kv_element *elt;
-	guint eltlen;
 	glong longval;
 
 	if (session->command == KVSTORAGE_CMD_SET) {
@@ -504,118 +759,32 @@ kvstorage_process_command (struct kvstorage_session *session, gboolean is_redis)
 			session->arg_data.length);
 	}
 	else if (session->command == KVSTORAGE_CMD_GET) {
-		elt = rspamd_kv_storage_lookup (session->cf->storage,
-				session->key,
-				session->keylen,
-				session->now);
-		if (elt == NULL) {
-			RW_R_UNLOCK (&session->cf->storage->rwlock);
-			if (!is_redis) {
-				return rspamd_dispatcher_write (session->dispather,
-						   ERROR_NOT_FOUND,
-						   sizeof (ERROR_NOT_FOUND) - 1,
-						   FALSE,
-						   TRUE);
-			}
-			else {
-				return rspamd_dispatcher_write (session->dispather, "$-1" CRLF,
-						   sizeof ("$-1" CRLF) - 1, FALSE, TRUE);
-			}
-		}
-		else {
-			if (elt->flags & KV_ELT_INTEGER) {
-				eltlen = rspamd_snprintf (intbuf,
-						sizeof (intbuf),
-						"%l",
-						ELT_LONG (elt));
-
-			}
-			else {
-				eltlen = elt->size;
-			}
-
-			if (!is_redis) {
-				r = rspamd_snprintf (outbuf,
-						sizeof (outbuf),
-						"VALUE %s %ud %ud" CRLF,
-						ELT_KEY (elt),
-						elt->flags,
-						eltlen);
-			}
-			else {
-				r = rspamd_snprintf (outbuf, sizeof (outbuf), "$%ud" CRLF,
-						eltlen);
-			}
-			if (!rspamd_dispatcher_write (session->dispather, outbuf,
-				r, TRUE, FALSE)) {
-				RW_R_UNLOCK (&session->cf->storage->rwlock);
-				return FALSE;
-			}
-			if (elt->flags & KV_ELT_INTEGER) {
-				if (!rspamd_dispatcher_write (session->dispather, intbuf,
-					eltlen, TRUE, TRUE)) {
-					RW_R_UNLOCK (&session->cf->storage->rwlock);
-					return FALSE;
-				}
-			}
-			else {
-				if (!rspamd_dispatcher_write (session->dispather,
-					ELT_DATA (elt), eltlen, TRUE, TRUE)) {
-					RW_R_UNLOCK (&session->cf->storage->rwlock);
-					return FALSE;
-				}
-			}
-			session->elt = elt;
-			if (!is_redis) {
-				res = rspamd_dispatcher_write (session->dispather,
-						CRLF "END" CRLF,
-						sizeof (CRLF "END" CRLF) - 1,
-						FALSE,
-						TRUE);
-			}
-			else {
-				res = rspamd_dispatcher_write (session->dispather, CRLF,
-						sizeof (CRLF) - 1, FALSE, TRUE);
-			}
-			if (!res) {
-				RW_R_UNLOCK (&session->cf->storage->rwlock);
-			}
-
-			return res;
-		}
+		return kvstorage_send_value (session, session->key, session->keylen,
+				   is_redis);
 	}
 	else if (session->command == KVSTORAGE_CMD_DELETE) {
 		elt = rspamd_kv_storage_delete (session->cf->storage,
 				session->key,
 				session->keylen);
 		if (elt != NULL) {
-			if ((elt->flags & KV_ELT_DIRTY) == 0) {
-				/* Free memory if backend has deleted this element */
-				g_slice_free1 (ELT_SIZE (elt), elt);
-			}
+			/* Element memory is already released by storage */
 			if (!is_redis) {
-				return rspamd_dispatcher_write (session->dispather,
-						   "DELETED" CRLF,
-						   sizeof ("DELETED" CRLF) - 1,
-						   FALSE,
-						   TRUE);
+				return kvstorage_reply (session, "DELETED" CRLF,
+						sizeof ("DELETED" CRLF) - 1, TRUE);
 			}
 			else {
-				return rspamd_dispatcher_write (session->dispather, ":1" CRLF,
-						   sizeof (":1" CRLF) - 1, FALSE, TRUE);
+				return kvstorage_reply (session, ":1" CRLF,
+						sizeof (":1" CRLF) - 1, TRUE);
 			}
 		}
 		else {
 			if (!is_redis) {
-				return rspamd_dispatcher_write (session->dispather,
-						   ERROR_NOT_FOUND,
-						   sizeof (ERROR_NOT_FOUND) - 1,
-						   FALSE,
-						   TRUE);
+				return kvstorage_reply (session, ERROR_NOT_FOUND,
+						sizeof (ERROR_NOT_FOUND) - 1, TRUE);
 			}
 			else {
-				return rspamd_dispatcher_write (session->dispather, ":0" CRLF,
-						   sizeof (":0" CRLF) - 1, FALSE, TRUE);
+				return kvstorage_reply (session, ":0" CRLF,
+						sizeof (":0" CRLF) - 1, TRUE);
 			}
 		}
 	}
@@ -625,18 +794,12 @@ kvstorage_process_command (struct kvstorage_session *session, gboolean is_redis)
 		if (!rspamd_kv_storage_increment (session->cf->storage, session->key,
 			session->keylen, &longval)) {
 			if (!is_redis) {
-				return rspamd_dispatcher_write (session->dispather,
-						   ERROR_NOT_FOUND,
-						   sizeof (ERROR_NOT_FOUND) - 1,
-						   FALSE,
-						   TRUE);
+				return kvstorage_reply (session, ERROR_NOT_FOUND,
+						sizeof (ERROR_NOT_FOUND) - 1, TRUE);
 			}
 			else {
-				return rspamd_dispatcher_write (session->dispather,
-						   "-ERR not found" CRLF,
-						   sizeof ("-ERR not found" CRLF) - 1,
-						   FALSE,
-						   TRUE);
+				return kvstorage_reply (session, "-ERR not found" CRLF,
+						sizeof ("-ERR not found" CRLF) - 1, TRUE);
 			}
 		}
 		else {
@@ -648,8 +811,7 @@ kvstorage_process_command (struct kvstorage_session *session, gboolean is_redis)
 				r = rspamd_snprintf (outbuf, sizeof (outbuf), ":%l" CRLF,
 						longval);
 			}
-			if (!rspamd_dispatcher_write (session->dispather, outbuf,
-				r, FALSE, FALSE)) {
+			if (!kvstorage_reply (session, outbuf, r, FALSE)) {
 				return FALSE;
 			}
 		}
@@ -658,66 +820,55 @@ kvstorage_process_command (struct kvstorage_session *session, gboolean is_redis)
 		if (session->cf->storage->backend == NULL ||
 			session->cf->storage->backend->sync_func == NULL) {
 			if (!is_redis) {
-				return rspamd_dispatcher_write (session->dispather,
-						   ERROR_COMMON,
-						   sizeof (ERROR_COMMON) - 1,
-						   FALSE,
-						   TRUE);
+				return kvstorage_reply (session, ERROR_COMMON,
+						sizeof (ERROR_COMMON) - 1, TRUE);
 			}
 			else {
-				return rspamd_dispatcher_write (session->dispather,
-						   "-ERR unsupported" CRLF,
-						   sizeof ("-ERR unsupported" CRLF) - 1,
-						   FALSE,
-						   TRUE);
+				return kvstorage_reply (session, "-ERR unsupported" CRLF,
+						sizeof ("-ERR unsupported" CRLF) - 1, TRUE);
 			}
 		}
 		else {
-			if (session->cf->storage->backend->sync_func (session->cf->storage->
-				backend)) {
+			rspamd_mutex_lock (session->cf->storage->backend_mtx);
+			res = session->cf->storage->backend->sync_func (
+				session->cf->storage->backend);
+			rspamd_mutex_unlock (session->cf->storage->backend_mtx);
+
+			if (res) {
 				if (!is_redis) {
-					return rspamd_dispatcher_write (session->dispather,
-							   "SYNCED" CRLF,
-							   sizeof ("SYNCED" CRLF) - 1,
-							   FALSE,
-							   TRUE);
+					return kvstorage_reply (session, "SYNCED" CRLF,
+							sizeof ("SYNCED" CRLF) - 1, TRUE);
 				}
 				else {
-					return rspamd_dispatcher_write (session->dispather,
-							   "+OK" CRLF,
-							   sizeof ("+OK" CRLF) - 1,
-							   FALSE,
-							   TRUE);
+					return kvstorage_reply (session, "+OK" CRLF,
+							sizeof ("+OK" CRLF) - 1, TRUE);
 				}
 			}
 			else {
 				if (!is_redis) {
-					return rspamd_dispatcher_write (session->dispather,
-							   "NOT_SYNCED" CRLF,
-							   sizeof ("NOT_SYNCED" CRLF) - 1,
-							   FALSE,
-							   TRUE);
+					return kvstorage_reply (session, "NOT_SYNCED" CRLF,
+							sizeof ("NOT_SYNCED" CRLF) - 1, TRUE);
 				}
 				else {
-					return rspamd_dispatcher_write (session->dispather,
-							   "-ERR not synced" CRLF,
-							   sizeof ("-ERR not synced" CRLF) - 1,
-							   FALSE,
-							   TRUE);
+					return kvstorage_reply (session, "-ERR not synced" CRLF,
+							sizeof ("-ERR not synced" CRLF) - 1, TRUE);
 				}
 			}
 		}
 	}
 	else if (session->command == KVSTORAGE_CMD_SELECT) {
 		if (!is_redis) {
-			return rspamd_dispatcher_write (session->dispather, "SELECTED" CRLF,
-					   sizeof ("SELECTED" CRLF) - 1, FALSE, TRUE);
+			return kvstorage_reply (session, "SELECTED" CRLF,
+					sizeof ("SELECTED" CRLF) - 1, TRUE);
 		}
 		else {
-			return rspamd_dispatcher_write (session->dispather, "+OK" CRLF,
-					   sizeof ("+OK" CRLF) - 1, FALSE, TRUE);
+			return kvstorage_reply (session, "+OK" CRLF,
+					sizeof ("+OK" CRLF) - 1, TRUE);
 		}
 	}
+	else if (session->command == KVSTORAGE_CMD_INFO) {
+		return kvstorage_write_info (session, is_redis);
+	}
 	else if (session->command == KVSTORAGE_CMD_QUIT) {
 		/* Quit session */
 		free_kvstorage_session (session);
@@ -775,12 +926,19 @@ kvstorage_check_argnum (struct kvstorage_session *session)
 	switch (session->command) {
 	case KVSTORAGE_CMD_QUIT:
 	case KVSTORAGE_CMD_SYNC:
+	case KVSTORAGE_CMD_INFO:
 		return session->argc == 1;
 	case KVSTORAGE_CMD_SET:
 		return session->argc == 3 || session->argc == 4;
 	case KVSTORAGE_CMD_INCR:
 	case KVSTORAGE_CMD_DECR:
 		return session->argc == 2 || session->argc == 3;
+	case KVSTORAGE_CMD_MGET:
+		return session->argc >= 2;
+	case KVSTORAGE_CMD_MSET:
+	case KVSTORAGE_CMD_MINCRBY:
+		/* Pairs of keys and values */
+		return session->argc >= 3 && session->argc % 2 == 1;
 	default:
 		return session->argc == 2;
 	}
@@ -820,19 +978,15 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 		if (!parse_kvstorage_line (session, in)) {
 			thr_info ("%ud: unknown command: %V", thr->id, in);
 			if (!is_redis) {
-				return rspamd_dispatcher_write (session->dispather,
-						   ERROR_UNKNOWN_COMMAND,
-						   sizeof (ERROR_UNKNOWN_COMMAND) - 1,
-						   FALSE,
-						   TRUE);
+				return kvstorage_reply (session, ERROR_UNKNOWN_COMMAND,
+						sizeof (ERROR_UNKNOWN_COMMAND) - 1, TRUE);
 			}
 			else {
 				r = rspamd_snprintf (outbuf,
 						sizeof (outbuf),
 						"-ERR unknown command '%V'" CRLF,
 						in);
-				return rspamd_dispatcher_write (session->dispather, outbuf,
-						   r, FALSE, TRUE);
+				return kvstorage_reply (session, outbuf, r, FALSE);
 			}
 		}
 		else {
@@ -840,18 +994,12 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 			if (session->cf == NULL) {
 				thr_info ("%ud: bad keystorage: %ud", thr->id, session->id);
 				if (!is_redis) {
-					return rspamd_dispatcher_write (session->dispather,
-							   ERROR_INVALID_KEYSTORAGE,
-							   sizeof (ERROR_INVALID_KEYSTORAGE) - 1,
-							   FALSE,
-							   TRUE);
+					return kvstorage_reply (session, ERROR_INVALID_KEYSTORAGE,
+							sizeof (ERROR_INVALID_KEYSTORAGE) - 1, TRUE);
 				}
 				else {
-					return rspamd_dispatcher_write (session->dispather,
-							   "-ERR unknown keystorage" CRLF,
-							   sizeof ("-ERR unknown keystorage" CRLF) - 1,
-							   FALSE,
-							   TRUE);
+					return kvstorage_reply (session, "-ERR unknown keystorage" CRLF,
+							sizeof ("-ERR unknown keystorage" CRLF) - 1, TRUE);
 				}
 			}
 			if (session->state != KVSTORAGE_STATE_READ_ARGLEN) {
@@ -866,8 +1014,7 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 					sizeof (outbuf),
 					"-ERR unknown arglen '%V'" CRLF,
 					in);
-			return rspamd_dispatcher_write (session->dispather, outbuf,
-					   r, FALSE, TRUE);
+			return kvstorage_reply (session, outbuf, r, FALSE);
 		}
 		else {
 			session->state = KVSTORAGE_STATE_READ_ARG;
@@ -885,8 +1032,7 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 						sizeof (outbuf),
 						"-ERR unknown command '%V'" CRLF,
 						in);
-				return rspamd_dispatcher_write (session->dispather, outbuf,
-						   r, FALSE, TRUE);
+				return kvstorage_reply (session, outbuf, r, FALSE);
 			}
 			else {
 				if (!kvstorage_check_argnum (session)) {
@@ -896,10 +1042,18 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 							"-ERR invalid argnum for command '%V': %ud" CRLF,
 							in,
 							session->argc);
-					return rspamd_dispatcher_write (session->dispather, outbuf,
-							   r, FALSE, TRUE);
+					return kvstorage_reply (session, outbuf, r, FALSE);
 				}
 				else {
+					if (session->command == KVSTORAGE_CMD_MGET ||
+						session->command == KVSTORAGE_CMD_MSET ||
+						session->command == KVSTORAGE_CMD_MINCRBY) {
+						session->argv = rspamd_mempool_alloc (session->pool,
+								sizeof (rspamd_fstring_t) * (session->argc - 1));
+					}
+					else {
+						session->argv = NULL;
+					}
 					if (session->argnum == session->argc - 1) {
 						session->state = KVSTORAGE_STATE_READ_CMD;
 						rspamd_set_dispatcher_policy (session->dispather,
@@ -917,6 +1071,23 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 				}
 			}
 		}
+		else if (session->argv != NULL) {
+			/* Argument of multi-key command */
+			session->argv[session->argnum - 1].begin =
+				rspamd_mempool_fstrdup (session->pool, in);
+			session->argv[session->argnum - 1].len = in->len;
+			rspamd_set_dispatcher_policy (session->dispather,
+				BUFFER_LINE,
+				-1);
+			if (session->argnum == session->argc - 1) {
+				session->state = KVSTORAGE_STATE_READ_CMD;
+				return kvstorage_process_multi (session);
+			}
+			else {
+				session->argnum++;
+				session->state = KVSTORAGE_STATE_READ_ARGLEN;
+			}
+		}
 		else if (session->argnum == 1) {
 			if (session->command != KVSTORAGE_CMD_SELECT) {
 				/* This argument is a key for normal command */
@@ -960,18 +1131,12 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 					session->key, session->keylen,
 					in->begin, in->len,
 					session->flags, session->expire)) {
-					return rspamd_dispatcher_write (session->dispather,
-							   "+OK" CRLF,
-							   sizeof ("+OK" CRLF) - 1,
-							   FALSE,
-							   TRUE);
+					return kvstorage_reply (session, "+OK" CRLF,
+							sizeof ("+OK" CRLF) - 1, TRUE);
 				}
 				else {
-					return rspamd_dispatcher_write (session->dispather,
-							   "-ERR not stored" CRLF,
-							   sizeof ("-ERR not stored" CRLF) - 1,
-							   FALSE,
-							   TRUE);
+					return kvstorage_reply (session, "-ERR not stored" CRLF,
+							sizeof ("-ERR not stored" CRLF) - 1, TRUE);
 				}
 			}
 			else if (session->command == KVSTORAGE_CMD_SET && session->argc ==
@@ -1008,18 +1173,12 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 					session->key, session->keylen,
 					in->begin, in->len,
 					session->flags, session->expire)) {
-					return rspamd_dispatcher_write (session->dispather,
-							   "+OK" CRLF,
-							   sizeof ("+OK" CRLF) - 1,
-							   FALSE,
-							   TRUE);
+					return kvstorage_reply (session, "+OK" CRLF,
+							sizeof ("+OK" CRLF) - 1, TRUE);
 				}
 				else {
-					return rspamd_dispatcher_write (session->dispather,
-							   "-ERR not stored" CRLF,
-							   sizeof ("-ERR not stored" CRLF) - 1,
-							   FALSE,
-							   TRUE);
+					return kvstorage_reply (session, "-ERR not stored" CRLF,
+							sizeof ("-ERR not stored" CRLF) - 1, TRUE);
 				}
 			}
 		}
@@ -1032,31 +1191,22 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 			in->begin, in->len,
 			session->flags, session->expire)) {
 			if (!is_redis) {
-				return rspamd_dispatcher_write (session->dispather,
-						   "STORED" CRLF,
-						   sizeof ("STORED" CRLF) - 1,
-						   FALSE,
-						   TRUE);
+				return kvstorage_reply (session, "STORED" CRLF,
+						sizeof ("STORED" CRLF) - 1, TRUE);
 			}
 			else {
-				return rspamd_dispatcher_write (session->dispather, "+OK" CRLF,
-						   sizeof ("+OK" CRLF) - 1, FALSE, TRUE);
+				return kvstorage_reply (session, "+OK" CRLF,
+						sizeof ("+OK" CRLF) - 1, TRUE);
 			}
 		}
 		else {
 			if (!is_redis) {
-				return rspamd_dispatcher_write (session->dispather,
-						   ERROR_NOT_STORED,
-						   sizeof (ERROR_NOT_STORED) - 1,
-						   FALSE,
-						   TRUE);
+				return kvstorage_reply (session, ERROR_NOT_STORED,
+						sizeof (ERROR_NOT_STORED) - 1, TRUE);
 			}
 			else {
-				return rspamd_dispatcher_write (session->dispather,
-						   "-ERR not stored" CRLF,
-						   sizeof ("-ERR not stored" CRLF) - 1,
-						   FALSE,
-						   TRUE);
+				return kvstorage_reply (session, "-ERR not stored" CRLF,
+						sizeof ("-ERR not stored" CRLF) - 1, TRUE);
 			}
 		}
 
@@ -1072,27 +1222,7 @@ kvstorage_read_socket (rspamd_fstring_t * in, void *arg)
 static gboolean
 kvstorage_write_socket (void *arg)
 {
-	struct kvstorage_session *session = (struct kvstorage_session *) arg;
-
-	if (session->elt) {
-		if ((session->elt->flags & KV_ELT_NEED_INSERT) != 0) {
-			/* Insert to cache and free element */
-			session->elt->flags &= ~KV_ELT_NEED_INSERT;
-			RW_R_UNLOCK (&session->cf->storage->rwlock);
-			rspamd_kv_storage_insert_cache (session->cf->storage,
-				ELT_KEY (session->elt),
-				session->elt->keylen, ELT_DATA (session->elt),
-				session->elt->size, session->elt->flags,
-				session->elt->expire, NULL);
-			g_free (session->elt);
-			session->elt = NULL;
-			return TRUE;
-		}
-		RW_R_UNLOCK (&session->cf->storage->rwlock);
-		session->elt = NULL;
-
-	}
-
+	/* Replies are copied to output buffers, so there is nothing to release */
 	return TRUE;
 }
 
@@ -1111,11 +1241,6 @@ kvstorage_err_socket (GError * err, void *arg)
 			thr->id, inet_ntoa (session->client_addr), err->message);
 	}
 
-	if (session->elt) {
-		RW_R_UNLOCK (&session->cf->storage->rwlock);
-		session->elt = NULL;
-	}
-
 	g_error_free (err);
 	free_kvstorage_session (session);
 }
@@ -1161,7 +1286,7 @@ thr_accept_socket (gint fd, short what, void *arg)
 			session);
 
 	g_mutex_unlock (thr->accept_mtx);
-	session->elt = NULL;
+	session->argv = NULL;
 
 	if (su.ss.ss_family == AF_UNIX) {
 		session->client_addr.s_addr = INADDR_NONE;
@@ -1189,6 +1314,29 @@ thr_term_socket (gint fd, short what, void *arg)
 
 	event_base_loopexit (thr->ev_base, &tv);
 	event_del (&thr->bind_ev);
+	if (thr->id == 0) {
+		event_del (&thr->expire_ev);
+	}
+}
+
+/* Interval of expire timer in milliseconds */
+#define KVSTORAGE_EXPIRE_INTERVAL 100
+/* Maximum number of elements checked per a storage on each timer event */
+#define KVSTORAGE_EXPIRE_CHECKS 1024
+
+/**
+ * Remove expired elements in small steps
+ */
+static void
+thr_expire_timer (gint fd, short what, void *arg)
+{
+	struct kvstorage_worker_thread *thr = (struct kvstorage_worker_thread *)arg;
+	struct timeval tv;
+
+	kvstorage_expire_tick (time (NULL), KVSTORAGE_EXPIRE_CHECKS);
+
+	msec_to_tv (KVSTORAGE_EXPIRE_INTERVAL, &tv);
+	evtimer_add (&thr->expire_ev, &tv);
 }
 
 /**
@@ -1198,6 +1346,7 @@ static gpointer
 kvstorage_thread (gpointer ud)
 {
 	struct kvstorage_worker_thread *thr = ud;
+	struct timeval tv;
 
 	/* Block signals as it is dispatcher deity */
 	sigprocmask (SIG_BLOCK, thr->signals, NULL);
@@ -1220,6 +1369,14 @@ kvstorage_thread (gpointer ud)
 	event_base_set (thr->ev_base, &thr->term_ev);
 	event_add (&thr->term_ev, NULL);
 
+	/* Storages are shared, so only the first thread expires elements */
+	if (thr->id == 0) {
+		evtimer_set (&thr->expire_ev, thr_expire_timer, (void *)thr);
+		event_base_set (thr->ev_base, &thr->expire_ev);
+		msec_to_tv (KVSTORAGE_EXPIRE_INTERVAL, &tv);
+		evtimer_add (&thr->expire_ev, &tv);
+	}
+
 	event_base_loop (thr->ev_base, 0);
 
 	return NULL;
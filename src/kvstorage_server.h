@@ -45,6 +45,7 @@ struct kvstorage_worker_ctx {
 struct kvstorage_worker_thread {
 	struct event bind_ev;
 	struct event term_ev;
+	struct event expire_ev;
 	struct timeval *tv;
 	struct kvstorage_worker_ctx *ctx;
 	struct rspamd_worker *worker;
@@ -73,6 +74,10 @@ struct kvstorage_session {
 		KVSTORAGE_CMD_SELECT,
 		KVSTORAGE_CMD_INCR,
 		KVSTORAGE_CMD_DECR,
+		KVSTORAGE_CMD_INFO,
+		KVSTORAGE_CMD_MGET,
+		KVSTORAGE_CMD_MSET,
+		KVSTORAGE_CMD_MINCRBY,
 		KVSTORAGE_CMD_QUIT
 	} command;
 	guint id;
@@ -83,7 +88,7 @@ struct kvstorage_session {
 	guint keylen;
 	struct kvstorage_config *cf;
 	struct kvstorage_worker_thread *thr;
-	struct rspamd_kv_element *elt;
+	rspamd_fstring_t *argv;                     /*< arguments of multi-key commands */
 	struct in_addr client_addr;
 	gint sock;
 	guint flags;
@@ -0,0 +1,296 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "kvstorage_slab.h"
+#include "util.h"
+#include "main.h"
+
+#define SLAB_MIN_CHUNK 64
+#define SLAB_GROWTH_FACTOR 1.25
+#define SLAB_ALIGN 8
+#define SLAB_MAX_CLASSES 64
+
+struct rspamd_kv_slab_class;
+
+struct rspamd_kv_slab {
+	struct rspamd_kv_slab_class *cls;
+	gpointer free_chunks;                       /*< list of freed chunks */
+	guint used;                                 /*< chunks in use */
+	guint carved;                               /*< chunks ever taken from this slab */
+	TAILQ_ENTRY (rspamd_kv_slab) entry;
+};
+
+struct rspamd_kv_slab_class {
+	gsize chunk_size;
+	guint nchunks;                              /*< chunks per slab */
+	gsize slabs;
+	gsize used;
+	gsize requested;
+	TAILQ_HEAD (, rspamd_kv_slab) partial;     /*< slabs with free chunks */
+	TAILQ_HEAD (, rspamd_kv_slab) full;
+	rspamd_mutex_t *mtx;
+};
+
+#define SLAB_HDR_SIZE ((sizeof (struct rspamd_kv_slab) + SLAB_ALIGN - 1) & \
+	~(SLAB_ALIGN - 1))
+#define SLAB_OF(p) ((struct rspamd_kv_slab *)((uintptr_t)(p) & \
+	~((uintptr_t)RSPAMD_KV_SLAB_SIZE - 1)))
+#define SLAB_CHUNK(slab, n) ((guchar *)(slab) + SLAB_HDR_SIZE + \
+	(gsize)(n) * (slab)->cls->chunk_size)
+
+static struct rspamd_kv_slab_class slab_classes[SLAB_MAX_CLASSES];
+static guint slab_nclasses = 0;
+static gsize slab_large_count = 0, slab_large_bytes = 0;
+static volatile gsize slab_initialized = 0;
+
+static void
+rspamd_kv_slab_init (void)
+{
+	struct rspamd_kv_slab_class *cls;
+	gsize sz = SLAB_MIN_CHUNK;
+
+	if (g_once_init_enter (&slab_initialized)) {
+		while (slab_nclasses < SLAB_MAX_CLASSES) {
+			cls = &slab_classes[slab_nclasses++];
+			cls->chunk_size = sz;
+			cls->nchunks = (RSPAMD_KV_SLAB_SIZE - SLAB_HDR_SIZE) / sz;
+			TAILQ_INIT (&cls->partial);
+			TAILQ_INIT (&cls->full);
+			cls->mtx = rspamd_mutex_new ();
+
+			if (sz >= RSPAMD_KV_SLAB_MAX_CHUNK) {
+				break;
+			}
+
+			sz = sz * SLAB_GROWTH_FACTOR;
+			sz = (sz + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+
+			if (sz > RSPAMD_KV_SLAB_MAX_CHUNK) {
+				sz = RSPAMD_KV_SLAB_MAX_CHUNK;
+			}
+		}
+
+		g_once_init_leave (&slab_initialized, 1);
+	}
+}
+
+static struct rspamd_kv_slab_class *
+rspamd_kv_slab_find_class (gsize size)
+{
+	guint lo = 0, hi, mid;
+
+	rspamd_kv_slab_init ();
+
+	if (size > RSPAMD_KV_SLAB_MAX_CHUNK) {
+		return NULL;
+	}
+
+	hi = slab_nclasses - 1;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+
+		if (slab_classes[mid].chunk_size < size) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	return &slab_classes[lo];
+}
+
+static struct rspamd_kv_slab *
+rspamd_kv_slab_new (struct rspamd_kv_slab_class *cls)
+{
+	struct rspamd_kv_slab *slab;
+	gpointer map;
+
+	if (posix_memalign (&map, RSPAMD_KV_SLAB_SIZE, RSPAMD_KV_SLAB_SIZE) != 0) {
+		msg_err ("cannot allocate slab of %z bytes: %s",
+			(gsize)RSPAMD_KV_SLAB_SIZE, strerror (errno));
+		return NULL;
+	}
+
+	slab = map;
+	slab->cls = cls;
+	slab->free_chunks = NULL;
+	slab->used = 0;
+	slab->carved = 0;
+	cls->slabs ++;
+
+	return slab;
+}
+
+gpointer
+rspamd_kv_slab_alloc (gsize size, gboolean zero)
+{
+	struct rspamd_kv_slab_class *cls;
+	struct rspamd_kv_slab *slab;
+	gpointer p;
+
+	cls = rspamd_kv_slab_find_class (size);
+
+	if (cls == NULL) {
+		__sync_fetch_and_add (&slab_large_count, 1);
+		__sync_fetch_and_add (&slab_large_bytes, size);
+
+		return zero ? g_malloc0 (size) : g_malloc (size);
+	}
+
+	rspamd_mutex_lock (cls->mtx);
+	slab = TAILQ_FIRST (&cls->partial);
+
+	if (slab == NULL) {
+		slab = rspamd_kv_slab_new (cls);
+
+		if (slab == NULL) {
+			rspamd_mutex_unlock (cls->mtx);
+			return NULL;
+		}
+
+		TAILQ_INSERT_HEAD (&cls->partial, slab, entry);
+	}
+
+	if (slab->free_chunks != NULL) {
+		p = slab->free_chunks;
+		slab->free_chunks = *(gpointer *)p;
+	}
+	else {
+		p = SLAB_CHUNK (slab, slab->carved);
+		slab->carved ++;
+	}
+
+	slab->used ++;
+	cls->used ++;
+	cls->requested += size;
+
+	if (slab->used == cls->nchunks) {
+		TAILQ_REMOVE (&cls->partial, slab, entry);
+		TAILQ_INSERT_TAIL (&cls->full, slab, entry);
+	}
+
+	rspamd_mutex_unlock (cls->mtx);
+
+	if (zero) {
+		memset (p, 0, size);
+	}
+
+	return p;
+}
+
+void
+rspamd_kv_slab_free (gpointer p, gsize size)
+{
+	struct rspamd_kv_slab_class *cls;
+	struct rspamd_kv_slab *slab;
+
+	if (p == NULL) {
+		return;
+	}
+
+	cls = rspamd_kv_slab_find_class (size);
+
+	if (cls == NULL) {
+		__sync_fetch_and_sub (&slab_large_count, 1);
+		__sync_fetch_and_sub (&slab_large_bytes, size);
+		g_free (p);
+
+		return;
+	}
+
+	slab = SLAB_OF (p);
+	g_assert (slab->cls == cls);
+
+	rspamd_mutex_lock (cls->mtx);
+
+	if (slab->used == cls->nchunks) {
+		TAILQ_REMOVE (&cls->full, slab, entry);
+		TAILQ_INSERT_TAIL (&cls->partial, slab, entry);
+	}
+
+	*(gpointer *)p = slab->free_chunks;
+	slab->free_chunks = p;
+	slab->used --;
+	cls->used --;
+	cls->requested -= size;
+
+	if (slab->used == 0 &&
+			(TAILQ_FIRST (&cls->partial) != slab ||
+			TAILQ_NEXT (slab, entry) != NULL)) {
+		/* Reclaim the whole slab, but keep the last one to avoid thrashing */
+		TAILQ_REMOVE (&cls->partial, slab, entry);
+		cls->slabs --;
+		free (slab);
+	}
+
+	rspamd_mutex_unlock (cls->mtx);
+}
+
+gsize
+rspamd_kv_slab_chunk_size (gsize size)
+{
+	struct rspamd_kv_slab_class *cls;
+
+	cls = rspamd_kv_slab_find_class (size);
+
+	return cls != NULL ? cls->chunk_size : size;
+}
+
+guint
+rspamd_kv_slab_get_stat (struct rspamd_kv_slab_stat *st, guint max)
+{
+	struct rspamd_kv_slab_class *cls;
+	guint i, n = 0;
+
+	rspamd_kv_slab_init ();
+
+	for (i = 0; i < slab_nclasses && n < max; i ++) {
+		cls = &slab_classes[i];
+
+		rspamd_mutex_lock (cls->mtx);
+		if (cls->slabs > 0) {
+			st[n].chunk_size = cls->chunk_size;
+			st[n].slabs = cls->slabs;
+			st[n].used_chunks = cls->used;
+			st[n].total_chunks = cls->slabs * cls->nchunks;
+			st[n].requested = cls->requested;
+			n ++;
+		}
+		rspamd_mutex_unlock (cls->mtx);
+	}
+
+	if (n < max) {
+		/* Large allocations */
+		st[n].chunk_size = 0;
+		st[n].slabs = 0;
+		st[n].used_chunks = slab_large_count;
+		st[n].total_chunks = slab_large_count;
+		st[n].requested = slab_large_bytes;
+		n ++;
+	}
+
+	return n;
+}
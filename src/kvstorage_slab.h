@@ -0,0 +1,78 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef KVSTORAGE_SLAB_H_
+#define KVSTORAGE_SLAB_H_
+
+#include "config.h"
+
+/*
+ * Slab allocator for kv storage elements: elements are placed into chunks of
+ * fixed size classes carved from large aligned slabs, so the memory used by a
+ * storage is predictable and a slab is returned to the system as soon as all
+ * its chunks are freed
+ */
+
+/* Size of a single slab */
+#define RSPAMD_KV_SLAB_SIZE (1024 * 1024)
+/* Allocations larger than this are served by malloc directly */
+#define RSPAMD_KV_SLAB_MAX_CHUNK (RSPAMD_KV_SLAB_SIZE / 4)
+
+struct rspamd_kv_slab_stat {
+	gsize chunk_size;                           /*< size of chunks in a class */
+	gsize slabs;                                /*< number of slabs allocated */
+	gsize used_chunks;                          /*< chunks in use */
+	gsize total_chunks;                         /*< chunks available in all slabs */
+	gsize requested;                            /*< bytes requested by users */
+};
+
+/**
+ * Allocate memory for an element
+ * @param size size of element
+ * @param zero zero allocated chunk
+ * @return new chunk
+ */
+gpointer rspamd_kv_slab_alloc (gsize size, gboolean zero);
+
+/**
+ * Free memory allocated by rspamd_kv_slab_alloc
+ * @param p pointer to chunk
+ * @param size the same size as passed to rspamd_kv_slab_alloc
+ */
+void rspamd_kv_slab_free (gpointer p, gsize size);
+
+/**
+ * Returns the real amount of memory used to store an element of the specified
+ * size
+ */
+gsize rspamd_kv_slab_chunk_size (gsize size);
+
+/**
+ * Get statistics of size classes
+ * @param st array of stat structures
+ * @param max size of array
+ * @return number of classes filled, the last one describes large allocations
+ */
+guint rspamd_kv_slab_get_stat (struct rspamd_kv_slab_stat *st, guint max);
+
+#endif /* KVSTORAGE_SLAB_H_ */
@@ -129,7 +129,7 @@ sqlite_process_queue (struct rspamd_kv_backend *backend)
 		if (op->op == SQLITE_OP_DELETE || (op->elt->flags & KV_ELT_NEED_FREE) !=
 			0) {
 			/* Also clean memory */
-			g_slice_free1 (ELT_SIZE (op->elt), op->elt);
+			ELT_FREE (op->elt);
 		}
 		g_slice_free1 (sizeof (struct sqlite_op), op);
 		cur = g_list_next (cur);
@@ -292,7 +292,7 @@ rspamd_sqlite_insert (struct rspamd_kv_backend *backend,
 		if (op->op == SQLITE_OP_DELETE || (op->elt->flags & KV_ELT_NEED_FREE) !=
 			0) {
 			/* Also clean memory */
-			g_slice_free1 (ELT_SIZE (op->elt), op->elt);
+			ELT_FREE (op->elt);
 		}
 		op->op = SQLITE_OP_INSERT;
 		op->elt = elt;
@@ -332,7 +332,7 @@ rspamd_sqlite_replace (struct rspamd_kv_backend *backend,
 		if (op->op == SQLITE_OP_DELETE || (op->elt->flags & KV_ELT_NEED_FREE) !=
 			0) {
 			/* Also clean memory */
-			g_slice_free1 (ELT_SIZE (op->elt), op->elt);
+			ELT_FREE (op->elt);
 		}
 		op->op = SQLITE_OP_REPLACE;
 		op->elt = elt;
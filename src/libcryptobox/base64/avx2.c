@@ -0,0 +1,101 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Base64 decoding of 32 characters per iteration using AVX2, characters are
+ * validated and translated by nibble lookups as described by Wojciech Mula
+ */
+
+#include "config.h"
+#include "base64.h"
+#include "platform_config.h"
+
+#if defined(HAVE_AVX2) && defined(HAVE_TARGET_ATTRIBUTE)
+#include <immintrin.h>
+
+gsize base64_decode_ref (const guchar *in, gsize inlen, guchar *out,
+		gsize outlen);
+
+__attribute__((target("avx2"))) gsize
+base64_decode_avx2 (const guchar *in, gsize inlen, guchar *out, gsize outlen)
+{
+	const guchar *p = in;
+	__m256i str, hi_nibbles, lo_nibbles, hi, lo, roll;
+	const __m256i lut_lo = _mm256_setr_epi8 (
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m256i lut_hi = _mm256_setr_epi8 (
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8 (
+			0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0,
+			0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i pack_shuf = _mm256_setr_epi8 (
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i pack_perm = _mm256_setr_epi32 (0, 1, 2, 4, 5, 6, -1, -1);
+	const __m256i mask_2f = _mm256_set1_epi8 (0x2f);
+
+	while (inlen >= 32 && outlen >= 24) {
+		str = _mm256_loadu_si256 ((const __m256i *)p);
+		hi_nibbles = _mm256_and_si256 (_mm256_srli_epi32 (str, 4), mask_2f);
+		lo_nibbles = _mm256_and_si256 (str, mask_2f);
+		hi = _mm256_shuffle_epi8 (lut_hi, hi_nibbles);
+		lo = _mm256_shuffle_epi8 (lut_lo, lo_nibbles);
+
+		if (!_mm256_testz_si256 (lo, hi)) {
+			/* Invalid character in the block */
+			break;
+		}
+
+		roll = _mm256_shuffle_epi8 (lut_roll,
+				_mm256_add_epi8 (_mm256_cmpeq_epi8 (str, mask_2f), hi_nibbles));
+		str = _mm256_add_epi8 (str, roll);
+
+		/* Pack 6 bit values to 24 bytes */
+		str = _mm256_maddubs_epi16 (str, _mm256_set1_epi32 (0x01400140));
+		str = _mm256_madd_epi16 (str, _mm256_set1_epi32 (0x00011000));
+		str = _mm256_shuffle_epi8 (str, pack_shuf);
+		str = _mm256_permutevar8x32_epi32 (str, pack_perm);
+
+		_mm_storeu_si128 ((__m128i *)out, _mm256_castsi256_si128 (str));
+		_mm_storel_epi64 ((__m128i *)(out + 16),
+				_mm256_extracti128_si256 (str, 1));
+
+		p += 32;
+		out += 24;
+		inlen -= 32;
+		outlen -= 24;
+	}
+
+	/* Decode the rest of the run by quads */
+	return (p - in) + base64_decode_ref (p, inlen, out, outlen);
+}
+
+#endif
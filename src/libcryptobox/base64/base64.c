@@ -0,0 +1,155 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "base64.h"
+#include "platform_config.h"
+
+extern unsigned long cpu_config;
+
+typedef struct base64_impl_t
+{
+	unsigned long cpu_flags;
+	const char *desc;
+
+	gsize (*decode) (const guchar *in, gsize inlen, guchar *out, gsize outlen);
+} base64_impl_t;
+
+#define BASE64_DECLARE(ext) \
+	gsize base64_decode_##ext(const guchar *in, gsize inlen, guchar *out, gsize outlen);
+
+#define BASE64_IMPL(cpuflags, desc, ext) \
+	{(cpuflags), desc, base64_decode_##ext}
+
+
+BASE64_DECLARE(ref)
+#define BASE64_GENERIC BASE64_IMPL(0, "generic", ref)
+#if defined(HAVE_AVX2) && defined(HAVE_TARGET_ATTRIBUTE)
+BASE64_DECLARE(avx2)
+#define BASE64_AVX2 BASE64_IMPL(CPUID_AVX2, "avx2", avx2)
+#endif
+
+/* list implemenations from most optimized to least, with generic as the last entry */
+static const base64_impl_t base64_list[] = {
+		BASE64_GENERIC,
+#if defined(BASE64_AVX2)
+		BASE64_AVX2,
+#endif
+};
+
+static const base64_impl_t *base64_opt = &base64_list[0];
+
+void
+base64_load (void)
+{
+	guint i;
+
+	if (cpu_config != 0) {
+		for (i = 0; i < G_N_ELEMENTS(base64_list); i++) {
+			if (base64_list[i].cpu_flags & cpu_config) {
+				base64_opt = &base64_list[i];
+				break;
+			}
+		}
+	}
+}
+
+/* Writes bytes of an incomplete quad */
+static guchar *
+base64_flush (guint32 acc, guint n, guchar *o, guchar *end)
+{
+	if (n == 2 && o < end) {
+		*o++ = acc >> 4;
+	}
+	else if (n == 3 && end - o >= 2) {
+		*o++ = acc >> 10;
+		*o++ = acc >> 2;
+	}
+
+	return o;
+}
+
+gboolean
+rspamd_cryptobox_base64_decode (const gchar *in, gsize inlen,
+		guchar *out, gsize *outlen)
+{
+	const guchar *p = (const guchar *)in, *end = p + inlen;
+	guchar *o = out, *oend = out + *outlen;
+	guint32 acc = 0;
+	guint n = 0;
+	guchar c;
+	gsize consumed;
+	gboolean ret = TRUE;
+
+	while (p < end) {
+		if (n == 0) {
+			/* Runs of valid characters between line breaks */
+			consumed = base64_opt->decode (p, end - p, o, oend - o);
+			p += consumed;
+			o += consumed / 4 * 3;
+
+			if (p == end) {
+				break;
+			}
+		}
+
+		c = base64_dec_table[*p];
+
+		if (c == 0xff) {
+			if (*p == '=') {
+				/* Padding finishes a quad, data can follow in broken mail */
+				o = base64_flush (acc, n, o, oend);
+				acc = 0;
+				n = 0;
+			}
+
+			p ++;
+			continue;
+		}
+
+		acc = (acc << 6) | c;
+		p ++;
+
+		if (++n == 4) {
+			if (oend - o < 3) {
+				ret = FALSE;
+				break;
+			}
+
+			*o++ = acc >> 16;
+			*o++ = acc >> 8;
+			*o++ = acc;
+			acc = 0;
+			n = 0;
+		}
+	}
+
+	if (ret) {
+		o = base64_flush (acc, n, o, oend);
+	}
+
+	*outlen = o - out;
+
+	return ret;
+}
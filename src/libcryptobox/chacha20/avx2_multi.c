@@ -0,0 +1,157 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Multi-buffer chacha: computes keystream for eight independent chacha
+ * states at once placing each state into its own lane of AVX2 registers.
+ */
+
+#include "config.h"
+#include "chacha.h"
+#include "platform_config.h"
+
+#if defined(HAVE_AVX2) && defined(HAVE_TARGET_ATTRIBUTE)
+#include <immintrin.h>
+
+#define ROTL_AVX2(x, n) _mm256_or_si256 (_mm256_slli_epi32 ((x), (n)), \
+		_mm256_srli_epi32 ((x), 32 - (n)))
+#define QR_AVX2(a, b, c, d) do { \
+	(a) = _mm256_add_epi32 ((a), (b)); (d) = _mm256_xor_si256 ((d), (a)); \
+	(d) = ROTL_AVX2 ((d), 16); \
+	(c) = _mm256_add_epi32 ((c), (d)); (b) = _mm256_xor_si256 ((b), (c)); \
+	(b) = ROTL_AVX2 ((b), 12); \
+	(a) = _mm256_add_epi32 ((a), (b)); (d) = _mm256_xor_si256 ((d), (a)); \
+	(d) = ROTL_AVX2 ((d), 8); \
+	(c) = _mm256_add_epi32 ((c), (d)); (b) = _mm256_xor_si256 ((b), (c)); \
+	(b) = ROTL_AVX2 ((b), 7); \
+} while (0)
+
+static inline guint32
+chacha_multi_load32 (const unsigned char *p)
+{
+	return ((guint32)p[0]) | ((guint32)p[1] << 8) | ((guint32)p[2] << 16) |
+			((guint32)p[3] << 24);
+}
+
+#define LANES_AVX2(st, off) _mm256_set_epi32 ( \
+		chacha_multi_load32 ((st)[7]->s + (off)), \
+		chacha_multi_load32 ((st)[6]->s + (off)), \
+		chacha_multi_load32 ((st)[5]->s + (off)), \
+		chacha_multi_load32 ((st)[4]->s + (off)), \
+		chacha_multi_load32 ((st)[3]->s + (off)), \
+		chacha_multi_load32 ((st)[2]->s + (off)), \
+		chacha_multi_load32 ((st)[1]->s + (off)), \
+		chacha_multi_load32 ((st)[0]->s + (off)))
+
+__attribute__((target("avx2"))) void
+chacha_blocks_multi_avx2 (chacha_state_internal **st, unsigned char **out,
+		size_t blocks)
+{
+	__m256i x[16], j[16], t0, t1, t2, t3, v;
+	guint64 ctr[8];
+	guint32 lo[8], hi[8];
+	size_t i, r, b, l;
+
+	j[0] = _mm256_set1_epi32 (0x61707865);
+	j[1] = _mm256_set1_epi32 (0x3320646e);
+	j[2] = _mm256_set1_epi32 (0x79622d32);
+	j[3] = _mm256_set1_epi32 (0x6b206574);
+
+	for (i = 0; i < 8; i ++) {
+		j[4 + i] = LANES_AVX2 (st, i * 4);
+	}
+
+	j[14] = LANES_AVX2 (st, 40);
+	j[15] = LANES_AVX2 (st, 44);
+
+	for (l = 0; l < 8; l ++) {
+		ctr[l] = (guint64)chacha_multi_load32 (st[l]->s + 32) |
+				((guint64)chacha_multi_load32 (st[l]->s + 36) << 32);
+	}
+
+	for (b = 0; b < blocks; b ++) {
+		for (l = 0; l < 8; l ++) {
+			lo[l] = (guint32)ctr[l];
+			hi[l] = (guint32)(ctr[l] >> 32);
+		}
+
+		j[12] = _mm256_loadu_si256 ((const __m256i *)lo);
+		j[13] = _mm256_loadu_si256 ((const __m256i *)hi);
+
+		for (i = 0; i < 16; i ++) {
+			x[i] = j[i];
+		}
+
+		for (r = st[0]->rounds; r > 0; r -= 2) {
+			QR_AVX2 (x[0], x[4], x[8], x[12]);
+			QR_AVX2 (x[1], x[5], x[9], x[13]);
+			QR_AVX2 (x[2], x[6], x[10], x[14]);
+			QR_AVX2 (x[3], x[7], x[11], x[15]);
+			QR_AVX2 (x[0], x[5], x[10], x[15]);
+			QR_AVX2 (x[1], x[6], x[11], x[12]);
+			QR_AVX2 (x[2], x[7], x[8], x[13]);
+			QR_AVX2 (x[3], x[4], x[9], x[14]);
+		}
+
+		for (i = 0; i < 16; i ++) {
+			x[i] = _mm256_add_epi32 (x[i], j[i]);
+		}
+
+		/*
+		 * Unpack instructions work within 128 bit halves, so the low half
+		 * of each result belongs to lanes 0-3 and the high half to lanes 4-7
+		 */
+		for (i = 0; i < 16; i += 4) {
+			t0 = _mm256_unpacklo_epi32 (x[i], x[i + 1]);
+			t1 = _mm256_unpacklo_epi32 (x[i + 2], x[i + 3]);
+			t2 = _mm256_unpackhi_epi32 (x[i], x[i + 1]);
+			t3 = _mm256_unpackhi_epi32 (x[i + 2], x[i + 3]);
+
+#define STORE_AVX2(vec, lane) do { \
+	v = (vec); \
+	_mm_storeu_si128 ((__m128i *)(out[(lane)] + b * 64 + i * 4), \
+			_mm256_castsi256_si128 (v)); \
+	_mm_storeu_si128 ((__m128i *)(out[(lane) + 4] + b * 64 + i * 4), \
+			_mm256_extracti128_si256 (v, 1)); \
+} while (0)
+
+			STORE_AVX2 (_mm256_unpacklo_epi64 (t0, t1), 0);
+			STORE_AVX2 (_mm256_unpackhi_epi64 (t0, t1), 1);
+			STORE_AVX2 (_mm256_unpacklo_epi64 (t2, t3), 2);
+			STORE_AVX2 (_mm256_unpackhi_epi64 (t2, t3), 3);
+#undef STORE_AVX2
+		}
+
+		for (l = 0; l < 8; l ++) {
+			ctr[l] ++;
+		}
+	}
+
+	for (l = 0; l < 8; l ++) {
+		for (i = 0; i < 8; i ++) {
+			st[l]->s[32 + i] = (ctr[l] >> (i * 8)) & 0xff;
+		}
+	}
+}
+
+#endif
@@ -83,6 +83,44 @@ static const chacha_impl_t chacha_list[] = {
 
 static const chacha_impl_t *chacha_impl = &chacha_list[0];
 
+typedef struct chacha_multi_impl_t {
+	unsigned long cpu_flags;
+	const char *desc;
+	size_t lanes;
+	void (*chacha_blocks_multi) (chacha_state_internal **states,
+			unsigned char **out, size_t blocks);
+} chacha_multi_impl_t;
+
+#define CHACHA_MULTI_DECLARE(ext) \
+		void chacha_blocks_multi_##ext(chacha_state_internal **states, unsigned char **out, size_t blocks);
+#define CHACHA_MULTI_IMPL(cpuflags, desc, lanes, ext) \
+		{(cpuflags), desc, lanes, chacha_blocks_multi_##ext}
+
+#if defined(HAVE_AVX2) && defined(HAVE_TARGET_ATTRIBUTE)
+	CHACHA_MULTI_DECLARE(avx2)
+	#define CHACHA_MULTI_AVX2 CHACHA_MULTI_IMPL(CPUID_AVX2, "avx2", 8, avx2)
+#endif
+#if defined(HAVE_SSE2) && defined(HAVE_TARGET_ATTRIBUTE)
+	CHACHA_MULTI_DECLARE(sse2)
+	#define CHACHA_MULTI_SSE2 CHACHA_MULTI_IMPL(CPUID_SSE2, "sse2", 4, sse2)
+#endif
+
+static void chacha_blocks_multi_generic (chacha_state_internal **states,
+		unsigned char **out, size_t blocks);
+#define CHACHA_MULTI_GENERIC CHACHA_MULTI_IMPL(0, "generic", 1, generic)
+
+static const chacha_multi_impl_t chacha_multi_list[] = {
+	CHACHA_MULTI_GENERIC,
+#if defined(CHACHA_MULTI_AVX2)
+	CHACHA_MULTI_AVX2,
+#endif
+#if defined(CHACHA_MULTI_SSE2)
+	CHACHA_MULTI_SSE2
+#endif
+};
+
+static const chacha_multi_impl_t *chacha_multi_impl = &chacha_multi_list[0];
+
 static int
 chacha_is_aligned (const void *p)
 {
@@ -101,6 +139,13 @@ chacha_load (void)
 				break;
 			}
 		}
+
+		for (i = 0; i < G_N_ELEMENTS (chacha_multi_list); i ++) {
+			if (chacha_multi_list[i].cpu_flags & cpu_config) {
+				chacha_multi_impl = &chacha_multi_list[i];
+				break;
+			}
+		}
 	}
 }
 
@@ -259,3 +304,70 @@ xchacha (const chacha_key *key, const chacha_iv24 *iv,
 {
 	chacha_impl->xchacha (key, iv, in, out, inlen, rounds);
 }
+
+/*
+ * Multi-buffer keystream
+ */
+
+/* Single stream fallback, uses the best available blocks implementation */
+static void
+chacha_blocks_multi_generic (chacha_state_internal **states,
+		unsigned char **out, size_t blocks)
+{
+	chacha_impl->chacha_blocks (states[0], NULL, out[0],
+			blocks * CHACHA_BLOCKBYTES);
+}
+
+size_t
+chacha_multi_lanes (void)
+{
+	return chacha_multi_impl->lanes;
+}
+
+void
+chacha_multi_keystream (chacha_state **states, unsigned char **out,
+		size_t nstates, size_t blocks)
+{
+	chacha_state_internal *lanes[CHACHA_MULTI_MAXLANES], dummy;
+	unsigned char *lanes_out[CHACHA_MULTI_MAXLANES],
+		scratch[CHACHA_BLOCKBYTES * 4];
+	size_t i, cur, nlanes = chacha_multi_impl->lanes;
+
+	g_assert (nstates <= nlanes);
+
+	if (nstates == 0 || blocks == 0) {
+		return;
+	}
+
+	for (i = 0; i < nstates; i ++) {
+		lanes[i] = (chacha_state_internal *)states[i];
+		lanes_out[i] = out[i];
+	}
+
+	if (nstates == nlanes) {
+		chacha_multi_impl->chacha_blocks_multi (lanes, lanes_out, blocks);
+		return;
+	}
+
+	/* Fill the unused lanes with a state whose output is thrown away */
+	memcpy (&dummy, lanes[0], sizeof (dummy));
+
+	for (i = nstates; i < nlanes; i ++) {
+		lanes[i] = &dummy;
+		lanes_out[i] = scratch;
+	}
+
+	while (blocks > 0) {
+		cur = MIN (blocks, sizeof (scratch) / CHACHA_BLOCKBYTES);
+		chacha_multi_impl->chacha_blocks_multi (lanes, lanes_out, cur);
+
+		for (i = 0; i < nstates; i ++) {
+			lanes_out[i] += cur * CHACHA_BLOCKBYTES;
+		}
+
+		blocks -= cur;
+	}
+
+	rspamd_explicit_memzero (&dummy, sizeof (dummy));
+	rspamd_explicit_memzero (scratch, sizeof (scratch));
+}
@@ -28,6 +28,7 @@
 
 enum chacha_constants {
 	CHACHA_BLOCKBYTES = 64,
+	CHACHA_MULTI_MAXLANES = 8,
 };
 
 typedef struct chacha_state_internal_t {
@@ -74,6 +75,17 @@ void xchacha (const chacha_key *key, const chacha_iv24 *iv,
 		const unsigned char *in, unsigned char *out, size_t inlen,
 		size_t rounds);
 
+/* Number of states processed by a single multi-buffer call */
+size_t chacha_multi_lanes (void);
+
+/*
+ * Write `blocks` full blocks of keystream for each of `nstates` independent
+ * states to out[i] advancing their counters, nstates must not exceed
+ * chacha_multi_lanes (), states must have no leftover data
+ */
+void chacha_multi_keystream (chacha_state **states, unsigned char **out,
+		size_t nstates, size_t blocks);
+
 void chacha_load (void);
 
 #endif /* CHACHA_H_ */
@@ -0,0 +1,143 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Multi-buffer chacha: computes keystream for four independent chacha
+ * states at once placing each state into its own lane of SSE2 registers.
+ * It is useful for short messages where a single stream implementation
+ * cannot process several blocks in parallel.
+ */
+
+#include "config.h"
+#include "chacha.h"
+#include "platform_config.h"
+
+#if defined(HAVE_SSE2) && defined(HAVE_TARGET_ATTRIBUTE)
+#include <emmintrin.h>
+
+#define ROTL_SSE2(x, n) _mm_or_si128 (_mm_slli_epi32 ((x), (n)), \
+		_mm_srli_epi32 ((x), 32 - (n)))
+#define QR_SSE2(a, b, c, d) do { \
+	(a) = _mm_add_epi32 ((a), (b)); (d) = _mm_xor_si128 ((d), (a)); \
+	(d) = ROTL_SSE2 ((d), 16); \
+	(c) = _mm_add_epi32 ((c), (d)); (b) = _mm_xor_si128 ((b), (c)); \
+	(b) = ROTL_SSE2 ((b), 12); \
+	(a) = _mm_add_epi32 ((a), (b)); (d) = _mm_xor_si128 ((d), (a)); \
+	(d) = ROTL_SSE2 ((d), 8); \
+	(c) = _mm_add_epi32 ((c), (d)); (b) = _mm_xor_si128 ((b), (c)); \
+	(b) = ROTL_SSE2 ((b), 7); \
+} while (0)
+
+static inline guint32
+chacha_multi_load32 (const unsigned char *p)
+{
+	return ((guint32)p[0]) | ((guint32)p[1] << 8) | ((guint32)p[2] << 16) |
+			((guint32)p[3] << 24);
+}
+
+#define LANES_SSE2(st, off) _mm_set_epi32 ( \
+		chacha_multi_load32 ((st)[3]->s + (off)), \
+		chacha_multi_load32 ((st)[2]->s + (off)), \
+		chacha_multi_load32 ((st)[1]->s + (off)), \
+		chacha_multi_load32 ((st)[0]->s + (off)))
+
+__attribute__((target("sse2"))) void
+chacha_blocks_multi_sse2 (chacha_state_internal **st, unsigned char **out,
+		size_t blocks)
+{
+	__m128i x[16], j[16], t0, t1, t2, t3;
+	guint64 ctr[4];
+	size_t i, r, b, l;
+
+	j[0] = _mm_set1_epi32 (0x61707865);
+	j[1] = _mm_set1_epi32 (0x3320646e);
+	j[2] = _mm_set1_epi32 (0x79622d32);
+	j[3] = _mm_set1_epi32 (0x6b206574);
+
+	for (i = 0; i < 8; i ++) {
+		j[4 + i] = LANES_SSE2 (st, i * 4);
+	}
+
+	j[14] = LANES_SSE2 (st, 40);
+	j[15] = LANES_SSE2 (st, 44);
+
+	for (l = 0; l < 4; l ++) {
+		ctr[l] = (guint64)chacha_multi_load32 (st[l]->s + 32) |
+				((guint64)chacha_multi_load32 (st[l]->s + 36) << 32);
+	}
+
+	for (b = 0; b < blocks; b ++) {
+		j[12] = _mm_set_epi32 ((guint32)ctr[3], (guint32)ctr[2],
+				(guint32)ctr[1], (guint32)ctr[0]);
+		j[13] = _mm_set_epi32 ((guint32)(ctr[3] >> 32), (guint32)(ctr[2] >> 32),
+				(guint32)(ctr[1] >> 32), (guint32)(ctr[0] >> 32));
+
+		for (i = 0; i < 16; i ++) {
+			x[i] = j[i];
+		}
+
+		for (r = st[0]->rounds; r > 0; r -= 2) {
+			QR_SSE2 (x[0], x[4], x[8], x[12]);
+			QR_SSE2 (x[1], x[5], x[9], x[13]);
+			QR_SSE2 (x[2], x[6], x[10], x[14]);
+			QR_SSE2 (x[3], x[7], x[11], x[15]);
+			QR_SSE2 (x[0], x[5], x[10], x[15]);
+			QR_SSE2 (x[1], x[6], x[11], x[12]);
+			QR_SSE2 (x[2], x[7], x[8], x[13]);
+			QR_SSE2 (x[3], x[4], x[9], x[14]);
+		}
+
+		for (i = 0; i < 16; i ++) {
+			x[i] = _mm_add_epi32 (x[i], j[i]);
+		}
+
+		/* Transpose words back to lanes, 16 bytes per lane at a time */
+		for (i = 0; i < 16; i += 4) {
+			t0 = _mm_unpacklo_epi32 (x[i], x[i + 1]);
+			t1 = _mm_unpacklo_epi32 (x[i + 2], x[i + 3]);
+			t2 = _mm_unpackhi_epi32 (x[i], x[i + 1]);
+			t3 = _mm_unpackhi_epi32 (x[i + 2], x[i + 3]);
+
+			_mm_storeu_si128 ((__m128i *)(out[0] + b * 64 + i * 4),
+					_mm_unpacklo_epi64 (t0, t1));
+			_mm_storeu_si128 ((__m128i *)(out[1] + b * 64 + i * 4),
+					_mm_unpackhi_epi64 (t0, t1));
+			_mm_storeu_si128 ((__m128i *)(out[2] + b * 64 + i * 4),
+					_mm_unpacklo_epi64 (t2, t3));
+			_mm_storeu_si128 ((__m128i *)(out[3] + b * 64 + i * 4),
+					_mm_unpackhi_epi64 (t2, t3));
+		}
+
+		for (l = 0; l < 4; l ++) {
+			ctr[l] ++;
+		}
+	}
+
+	for (l = 0; l < 4; l ++) {
+		for (i = 0; i < 8; i ++) {
+			st[l]->s[32 + i] = (ctr[l] >> (i * 8)) & 0xff;
+		}
+	}
+}
+
+#endif
@@ -33,6 +33,8 @@
 #include "poly1305/poly1305.h"
 #include "curve25519/curve25519.h"
 #include "siphash/siphash.h"
+#include "sha/sha.h"
+#include "base64/base64.h"
 #include "ottery.h"
 #include "blake2.h"
 #ifdef HAVE_CPUID_H
@@ -136,6 +138,9 @@ rspamd_cryptobox_init (void)
 				if ((cpu[1] & ((gint)1 <<  5))) {
 					cpu_config |= CPUID_AVX2;
 				}
+				if ((cpu[1] & ((gint)1 << 29))) {
+					cpu_config |= CPUID_SHA;
+				}
 			}
 		}
 	}
@@ -144,6 +149,8 @@ rspamd_cryptobox_init (void)
 	chacha_load ();
 	poly1305_load ();
 	siphash_load ();
+	sha_load ();
+	base64_load ();
 }
 
 void
@@ -342,6 +349,152 @@ rspamd_cryptobox_decrypt_nm_inplace (guchar *data, gsize len,
 	return ret;
 }
 
+/* Keystream blocks generated for each lane in a single multi-buffer pass */
+#define CRYPTOBOX_MULTI_BLOCKS 4
+
+static gboolean
+rspamd_cryptobox_process_multi_group (struct rspamd_cryptobox_message *m,
+		gsize n, gboolean encrypt)
+{
+	chacha_state states[CHACHA_MULTI_MAXLANES], *cur[CHACHA_MULTI_MAXLANES];
+	guchar ALIGNED(32) ks[CHACHA_MULTI_MAXLANES][CHACHA_BLOCKBYTES *
+			CRYPTOBOX_MULTI_BLOCKS];
+	guchar ALIGNED(32) mac_keys[CHACHA_MULTI_MAXLANES][sizeof (poly1305_key)];
+	guchar *outs[CHACHA_MULTI_MAXLANES];
+	gsize active[CHACHA_MULTI_MAXLANES], offsets[CHACHA_MULTI_MAXLANES];
+	gsize i, j, k, na = 0, len, r;
+	rspamd_sig_t mac;
+	gboolean ret = TRUE;
+
+	for (i = 0; i < n; i ++) {
+		xchacha_init (&states[i], (const chacha_key *)m[i].nm,
+				(const chacha_iv24 *)m[i].nonce, 20);
+		cur[i] = &states[i];
+		outs[i] = ks[i];
+	}
+
+	/* The first block of each stream is used as poly1305 key */
+	chacha_multi_keystream (cur, outs, n, 1);
+
+	for (i = 0; i < n; i ++) {
+		memcpy (mac_keys[i], ks[i], sizeof (mac_keys[i]));
+		offsets[i] = 0;
+
+		if (!encrypt) {
+			poly1305_auth (mac, m[i].data, m[i].len,
+					(const poly1305_key *)mac_keys[i]);
+			m[i].verified = poly1305_verify (mac, m[i].sig);
+
+			if (!m[i].verified) {
+				ret = FALSE;
+				continue;
+			}
+		}
+
+		if (m[i].len > 0) {
+			active[na ++] = i;
+		}
+	}
+
+	while (na > 1) {
+		for (j = 0; j < na; j ++) {
+			cur[j] = &states[active[j]];
+			outs[j] = ks[j];
+		}
+
+		chacha_multi_keystream (cur, outs, na, CRYPTOBOX_MULTI_BLOCKS);
+
+		for (j = 0, k = 0; j < na; j ++) {
+			i = active[j];
+			len = MIN (m[i].len - offsets[i], sizeof (ks[j]));
+
+			for (r = 0; r < len; r ++) {
+				m[i].data[offsets[i] + r] ^= ks[j][r];
+			}
+
+			offsets[i] += len;
+
+			if (offsets[i] < m[i].len) {
+				active[k ++] = i;
+			}
+		}
+
+		na = k;
+	}
+
+	if (na == 1) {
+		/* Single stream implementation is faster for the last message */
+		i = active[0];
+		r = chacha_update (&states[i], m[i].data + offsets[i],
+				m[i].data + offsets[i], m[i].len - offsets[i]);
+		chacha_final (&states[i], m[i].data + offsets[i] + r);
+	}
+
+	if (encrypt) {
+		for (i = 0; i < n; i ++) {
+			poly1305_auth (m[i].sig, m[i].data, m[i].len,
+					(const poly1305_key *)mac_keys[i]);
+		}
+	}
+
+	rspamd_explicit_memzero (states, sizeof (states));
+	rspamd_explicit_memzero (ks, sizeof (ks));
+	rspamd_explicit_memzero (mac_keys, sizeof (mac_keys));
+
+	return ret;
+}
+
+static gboolean
+rspamd_cryptobox_process_multi (struct rspamd_cryptobox_message *messages,
+		gsize cnt, gboolean encrypt)
+{
+	gsize i, n, lanes;
+	gboolean ret = TRUE;
+
+	lanes = chacha_multi_lanes ();
+
+	for (i = 0; i < cnt; i += n) {
+		n = MIN (lanes, cnt - i);
+
+		if (n == 1) {
+			if (encrypt) {
+				rspamd_cryptobox_encrypt_nm_inplace (messages[i].data,
+						messages[i].len, messages[i].nonce, messages[i].nm,
+						messages[i].sig);
+			}
+			else {
+				messages[i].verified = rspamd_cryptobox_decrypt_nm_inplace (
+						messages[i].data, messages[i].len, messages[i].nonce,
+						messages[i].nm, messages[i].sig);
+
+				if (!messages[i].verified) {
+					ret = FALSE;
+				}
+			}
+		}
+		else if (!rspamd_cryptobox_process_multi_group (&messages[i], n,
+				encrypt)) {
+			ret = FALSE;
+		}
+	}
+
+	return ret;
+}
+
+void
+rspamd_cryptobox_encrypt_nm_inplace_multi (
+		struct rspamd_cryptobox_message *messages, gsize cnt)
+{
+	rspamd_cryptobox_process_multi (messages, cnt, TRUE);
+}
+
+gboolean
+rspamd_cryptobox_decrypt_nm_inplace_multi (
+		struct rspamd_cryptobox_message *messages, gsize cnt)
+{
+	return rspamd_cryptobox_process_multi (messages, cnt, FALSE);
+}
+
 gboolean
 rspamd_cryptobox_decrypt_inplace (guchar *data, gsize len,
 		const rspamd_nonce_t nonce,
@@ -392,6 +545,14 @@ rspamd_cryptobox_siphash (unsigned char *out, const unsigned char *in,
 	siphash24 (out, in, inlen, k);
 }
 
+void
+rspamd_cryptobox_siphash_multi (guint64 *out,
+		const struct rspamd_cryptobox_segment *segments, gsize cnt,
+		const rspamd_sipkey_t k)
+{
+	siphash24_multi (out, segments, cnt, k);
+}
+
 /*
  * Password-Based Key Derivation Function 2 (PKCS #5 v2.0).
  * Code based on IEEE Std 802.11-2007, Annex H.4.2.
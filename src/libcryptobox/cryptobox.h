@@ -30,12 +30,26 @@ struct rspamd_cryptobox_segment {
 	gsize len;
 };
 
+/*
+ * Independent message for multi-buffer encryption and decryption
+ */
+struct rspamd_cryptobox_message {
+	guchar *data;           /**< data to process inplace */
+	gsize len;              /**< length of data */
+	const guchar *nonce;    /**< nonce of rspamd_cryptobox_NONCEBYTES */
+	const guchar *nm;       /**< shared secret of rspamd_cryptobox_NMBYTES */
+	guchar *sig;            /**< signature of rspamd_cryptobox_MACBYTES */
+	gboolean verified;      /**< set by decryption if signature is valid */
+};
+
 #define rspamd_cryptobox_NONCEBYTES 24
 #define rspamd_cryptobox_PKBYTES 32
 #define rspamd_cryptobox_SKBYTES 32
 #define rspamd_cryptobox_MACBYTES 16
 #define rspamd_cryptobox_NMBYTES 32
 #define rspamd_cryptobox_SIPKEYBYTES 16
+#define rspamd_cryptobox_SHA1BYTES 20
+#define rspamd_cryptobox_SHA256BYTES 32
 
 typedef guchar rspamd_pk_t[rspamd_cryptobox_PKBYTES];
 typedef guchar rspamd_sk_t[rspamd_cryptobox_SKBYTES];
@@ -44,6 +58,23 @@ typedef guchar rspamd_nm_t[rspamd_cryptobox_NMBYTES];
 typedef guchar rspamd_nonce_t[rspamd_cryptobox_NONCEBYTES];
 typedef guchar rspamd_sipkey_t[rspamd_cryptobox_SIPKEYBYTES];
 
+enum rspamd_cryptobox_sha_type {
+	RSPAMD_CRYPTOBOX_SHA1 = 0,
+	RSPAMD_CRYPTOBOX_SHA256
+};
+
+/*
+ * Streaming SHA-1/SHA-256 state, compression uses CPU SHA extensions
+ * if they are available
+ */
+typedef struct rspamd_cryptobox_sha_state_s {
+	guint32 h[8];
+	guint64 total;
+	guchar buf[64];
+	gsize buflen;
+	enum rspamd_cryptobox_sha_type type;
+} rspamd_cryptobox_sha_state_t;
+
 /**
  * Init cryptobox library
  */
@@ -133,6 +164,26 @@ gboolean rspamd_cryptobox_decrypt_nm_inplace (guchar *data, gsize len,
 		 const rspamd_nonce_t nonce,
 		 const rspamd_nm_t nm, const rspamd_sig_t sig);
 
+/**
+ * Encrypt several independent messages inplace writing signature of each
+ * message to its sig field. Messages are processed by groups in parallel
+ * lanes of SIMD registers if CPU supports that.
+ * @param messages array of messages
+ * @param cnt count of messages
+ */
+void rspamd_cryptobox_encrypt_nm_inplace_multi (
+		struct rspamd_cryptobox_message *messages, gsize cnt);
+
+/**
+ * Verify and decrypt several independent messages inplace. Messages that
+ * failed verification are left untouched with verified field set to FALSE.
+ * @param messages array of messages
+ * @param cnt count of messages
+ * @return TRUE if all messages have been verified successfully
+ */
+gboolean rspamd_cryptobox_decrypt_nm_inplace_multi (
+		struct rspamd_cryptobox_message *messages, gsize cnt);
+
 /**
  * Generate shared secret from local sk and remote pk
  * @param nm shared secret
@@ -159,6 +210,19 @@ void rspamd_cryptobox_siphash (unsigned char *out, const unsigned char *in,
 		unsigned long long inlen,
 		const rspamd_sipkey_t k);
 
+/**
+ * Calculates siphash-2-4 for several independent messages with the same key.
+ * Messages are processed by groups in parallel lanes of SIMD registers if CPU
+ * supports that, so it is faster than hashing short messages one by one
+ * @param out output hashes (cnt values)
+ * @param segments messages to hash
+ * @param cnt count of messages
+ * @param k key (must be 16 bytes)
+ */
+void rspamd_cryptobox_siphash_multi (guint64 *out,
+		const struct rspamd_cryptobox_segment *segments, gsize cnt,
+		const rspamd_sipkey_t k);
+
 /**
  * Derive key from password using PKCS#5 and HMAC-blake2
  * @param pass input password
@@ -174,4 +238,43 @@ gboolean rspamd_cryptobox_pbkdf(const char *pass, gsize pass_len,
 		const guint8 *salt, gsize salt_len, guint8 *key, gsize key_len,
 		unsigned int rounds);
 
+/**
+ * Init SHA state
+ * @param st state to init
+ * @param type hash algorithm
+ */
+void rspamd_cryptobox_sha_init (rspamd_cryptobox_sha_state_t *st,
+		enum rspamd_cryptobox_sha_type type);
+
+/**
+ * Update SHA state with data
+ * @param st state
+ * @param data input
+ * @param len length of input
+ */
+void rspamd_cryptobox_sha_update (rspamd_cryptobox_sha_state_t *st,
+		const guchar *data, gsize len);
+
+/**
+ * Finish SHA calculation and clear state
+ * @param st state
+ * @param out output buffer (rspamd_cryptobox_SHA256BYTES at least)
+ * @return length of digest written
+ */
+gsize rspamd_cryptobox_sha_final (rspamd_cryptobox_sha_state_t *st,
+		guchar *out);
+
+/**
+ * Decode base64 skipping line breaks and other characters that are not in the
+ * alphabet, padding finishes the current quad
+ * @param in input
+ * @param inlen length of input
+ * @param out output buffer
+ * @param outlen size of output buffer (inlen / 4 * 3 + 3 is always enough),
+ * set to the length of decoded data
+ * @return FALSE if output buffer is too small
+ */
+gboolean rspamd_cryptobox_base64_decode (const gchar *in, gsize inlen,
+		guchar *out, gsize *outlen);
+
 #endif /* CRYPTOBOX_H_ */
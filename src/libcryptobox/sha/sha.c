@@ -0,0 +1,187 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "sha.h"
+#include "platform_config.h"
+
+extern unsigned long cpu_config;
+
+typedef struct sha_impl_t
+{
+	unsigned long cpu_flags;
+	const char *desc;
+
+	void (*sha1_blocks) (guint32 *state, const guchar *in, gsize nblocks);
+	void (*sha256_blocks) (guint32 *state, const guchar *in, gsize nblocks);
+} sha_impl_t;
+
+#define SHA_DECLARE(ext) \
+	void sha1_blocks_##ext(guint32 *state, const guchar *in, gsize nblocks); \
+	void sha256_blocks_##ext(guint32 *state, const guchar *in, gsize nblocks);
+
+#define SHA_IMPL(cpuflags, desc, ext) \
+	{(cpuflags), desc, sha1_blocks_##ext, sha256_blocks_##ext}
+
+
+SHA_DECLARE(ref)
+#define SHA_GENERIC SHA_IMPL(0, "generic", ref)
+#if defined(HAVE_SHANI) && defined(HAVE_TARGET_ATTRIBUTE)
+SHA_DECLARE(shani)
+#define SHA_SHANI SHA_IMPL(CPUID_SHA, "shani", shani)
+#endif
+
+/* list implemenations from most optimized to least, with generic as the last entry */
+static const sha_impl_t sha_list[] = {
+		SHA_GENERIC,
+#if defined(SHA_SHANI)
+		SHA_SHANI,
+#endif
+};
+
+static const sha_impl_t *sha_opt = &sha_list[0];
+
+void
+sha_load (void)
+{
+	guint i;
+
+	if (cpu_config != 0) {
+		for (i = 0; i < G_N_ELEMENTS(sha_list); i++) {
+			if (sha_list[i].cpu_flags & cpu_config) {
+				sha_opt = &sha_list[i];
+				break;
+			}
+		}
+	}
+}
+
+static void
+rspamd_cryptobox_sha_blocks (rspamd_cryptobox_sha_state_t *st,
+		const guchar *in, gsize nblocks)
+{
+	if (st->type == RSPAMD_CRYPTOBOX_SHA1) {
+		sha_opt->sha1_blocks (st->h, in, nblocks);
+	}
+	else {
+		sha_opt->sha256_blocks (st->h, in, nblocks);
+	}
+}
+
+void
+rspamd_cryptobox_sha_init (rspamd_cryptobox_sha_state_t *st,
+		enum rspamd_cryptobox_sha_type type)
+{
+	static const guint32 sha1_iv[5] = {
+		0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+	};
+	static const guint32 sha256_iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memset (st, 0, sizeof (*st));
+	st->type = type;
+
+	if (type == RSPAMD_CRYPTOBOX_SHA1) {
+		memcpy (st->h, sha1_iv, sizeof (sha1_iv));
+	}
+	else {
+		memcpy (st->h, sha256_iv, sizeof (sha256_iv));
+	}
+}
+
+void
+rspamd_cryptobox_sha_update (rspamd_cryptobox_sha_state_t *st,
+		const guchar *data, gsize len)
+{
+	gsize n;
+
+	st->total += len;
+
+	if (st->buflen > 0) {
+		n = MIN (len, SHA_BLOCKBYTES - st->buflen);
+		memcpy (st->buf + st->buflen, data, n);
+		st->buflen += n;
+		data += n;
+		len -= n;
+
+		if (st->buflen < SHA_BLOCKBYTES) {
+			return;
+		}
+
+		rspamd_cryptobox_sha_blocks (st, st->buf, 1);
+		st->buflen = 0;
+	}
+
+	/* Full blocks are hashed directly from the input */
+	n = len / SHA_BLOCKBYTES;
+
+	if (n > 0) {
+		rspamd_cryptobox_sha_blocks (st, data, n);
+		data += n * SHA_BLOCKBYTES;
+		len -= n * SHA_BLOCKBYTES;
+	}
+
+	if (len > 0) {
+		memcpy (st->buf, data, len);
+		st->buflen = len;
+	}
+}
+
+gsize
+rspamd_cryptobox_sha_final (rspamd_cryptobox_sha_state_t *st, guchar *out)
+{
+	guint64 bits = st->total * 8;
+	guint i, nwords;
+
+	st->buf[st->buflen ++] = 0x80;
+
+	if (st->buflen > SHA_BLOCKBYTES - 8) {
+		memset (st->buf + st->buflen, 0, SHA_BLOCKBYTES - st->buflen);
+		rspamd_cryptobox_sha_blocks (st, st->buf, 1);
+		st->buflen = 0;
+	}
+
+	memset (st->buf + st->buflen, 0, SHA_BLOCKBYTES - 8 - st->buflen);
+
+	for (i = 0; i < 8; i ++) {
+		st->buf[SHA_BLOCKBYTES - 1 - i] = (guchar)(bits >> (i * 8));
+	}
+
+	rspamd_cryptobox_sha_blocks (st, st->buf, 1);
+
+	nwords = st->type == RSPAMD_CRYPTOBOX_SHA1 ? 5 : 8;
+
+	for (i = 0; i < nwords; i ++) {
+		out[i * 4] = (guchar)(st->h[i] >> 24);
+		out[i * 4 + 1] = (guchar)(st->h[i] >> 16);
+		out[i * 4 + 2] = (guchar)(st->h[i] >> 8);
+		out[i * 4 + 3] = (guchar)(st->h[i]);
+	}
+
+	rspamd_explicit_memzero (st, sizeof (*st));
+
+	return nwords * 4;
+}
@@ -0,0 +1,175 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * SHA-1 and SHA-256 compression functions using Intel SHA extensions
+ */
+
+#include "config.h"
+#include "sha.h"
+#include "platform_config.h"
+
+#if defined(HAVE_SHANI) && defined(HAVE_TARGET_ATTRIBUTE)
+#include <immintrin.h>
+
+static const guint32 sha256_k_ni[64] __attribute__((aligned(16))) = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+__attribute__((target("sha,sse4.1"))) void
+sha1_blocks_shani (guint32 *state, const guchar *in, gsize nblocks)
+{
+	__m128i abcd, abcd_save, e0, e0_save, e, eprev, w[4];
+	const __m128i mask = _mm_set_epi64x (0x0001020304050607ULL,
+			0x08090a0b0c0d0e0fULL);
+	guint g;
+
+	abcd = _mm_loadu_si128 ((const __m128i *)state);
+	abcd = _mm_shuffle_epi32 (abcd, 0x1b);
+	e0 = _mm_set_epi32 (state[4], 0, 0, 0);
+
+	while (nblocks --) {
+		abcd_save = abcd;
+		e0_save = e0;
+		eprev = e0;
+
+		for (g = 0; g < 20; g ++) {
+			if (g < 4) {
+				w[g] = _mm_shuffle_epi8 (
+						_mm_loadu_si128 ((const __m128i *)(in + g * 16)), mask);
+			}
+			else {
+				/* w[g - 4] is replaced by the new message words */
+				w[g & 3] = _mm_sha1msg2_epu32 (
+						_mm_xor_si128 (
+								_mm_sha1msg1_epu32 (w[g & 3], w[(g - 3) & 3]),
+								w[(g - 2) & 3]),
+						w[(g - 1) & 3]);
+			}
+
+			if (g == 0) {
+				e = _mm_add_epi32 (e0, w[0]);
+			}
+			else {
+				e = _mm_sha1nexte_epu32 (eprev, w[g & 3]);
+			}
+
+			eprev = abcd;
+
+			/* Round function must be an immediate value */
+			switch (g / 5) {
+			case 0:
+				abcd = _mm_sha1rnds4_epu32 (abcd, e, 0);
+				break;
+			case 1:
+				abcd = _mm_sha1rnds4_epu32 (abcd, e, 1);
+				break;
+			case 2:
+				abcd = _mm_sha1rnds4_epu32 (abcd, e, 2);
+				break;
+			default:
+				abcd = _mm_sha1rnds4_epu32 (abcd, e, 3);
+				break;
+			}
+		}
+
+		e0 = _mm_sha1nexte_epu32 (eprev, e0_save);
+		abcd = _mm_add_epi32 (abcd, abcd_save);
+
+		in += SHA_BLOCKBYTES;
+	}
+
+	abcd = _mm_shuffle_epi32 (abcd, 0x1b);
+	_mm_storeu_si128 ((__m128i *)state, abcd);
+	state[4] = _mm_extract_epi32 (e0, 3);
+}
+
+__attribute__((target("sha,sse4.1"))) void
+sha256_blocks_shani (guint32 *state, const guchar *in, gsize nblocks)
+{
+	__m128i st0, st1, tmp, msg, abef_save, cdgh_save, w[4];
+	const __m128i mask = _mm_set_epi64x (0x0c0d0e0f08090a0bULL,
+			0x0405060700010203ULL);
+	guint g;
+
+	/* Rearrange state to ABEF and CDGH words as the instructions expect */
+	tmp = _mm_loadu_si128 ((const __m128i *)&state[0]);
+	st1 = _mm_loadu_si128 ((const __m128i *)&state[4]);
+	tmp = _mm_shuffle_epi32 (tmp, 0xb1);
+	st1 = _mm_shuffle_epi32 (st1, 0x1b);
+	st0 = _mm_alignr_epi8 (tmp, st1, 8);
+	st1 = _mm_blend_epi16 (st1, tmp, 0xf0);
+
+	while (nblocks --) {
+		abef_save = st0;
+		cdgh_save = st1;
+
+		for (g = 0; g < 16; g ++) {
+			if (g < 4) {
+				w[g] = _mm_shuffle_epi8 (
+						_mm_loadu_si128 ((const __m128i *)(in + g * 16)), mask);
+			}
+			else {
+				tmp = _mm_sha256msg1_epu32 (w[g & 3], w[(g - 3) & 3]);
+				tmp = _mm_add_epi32 (tmp,
+						_mm_alignr_epi8 (w[(g - 1) & 3], w[(g - 2) & 3], 4));
+				w[g & 3] = _mm_sha256msg2_epu32 (tmp, w[(g - 1) & 3]);
+			}
+
+			msg = _mm_add_epi32 (w[g & 3],
+					_mm_load_si128 ((const __m128i *)&sha256_k_ni[g * 4]));
+			st1 = _mm_sha256rnds2_epu32 (st1, st0, msg);
+			msg = _mm_shuffle_epi32 (msg, 0x0e);
+			st0 = _mm_sha256rnds2_epu32 (st0, st1, msg);
+		}
+
+		st0 = _mm_add_epi32 (st0, abef_save);
+		st1 = _mm_add_epi32 (st1, cdgh_save);
+
+		in += SHA_BLOCKBYTES;
+	}
+
+	tmp = _mm_shuffle_epi32 (st0, 0x1b);
+	st1 = _mm_shuffle_epi32 (st1, 0xb1);
+	st0 = _mm_blend_epi16 (tmp, st1, 0xf0);
+	st1 = _mm_alignr_epi8 (st1, tmp, 8);
+
+	_mm_storeu_si128 ((__m128i *)&state[0], st0);
+	_mm_storeu_si128 ((__m128i *)&state[4], st1);
+}
+#endif
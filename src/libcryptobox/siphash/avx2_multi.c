@@ -0,0 +1,179 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Multi-buffer siphash: computes siphash-2-4 of four independent messages
+ * with the same key placing each message into its own 64 bit lane of
+ * AVX2 registers. Lanes of shorter messages are masked once their last
+ * block is processed, so finalization is common for all lanes.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "siphash.h"
+#include "platform_config.h"
+
+#if defined(HAVE_AVX2) && defined(HAVE_TARGET_ATTRIBUTE)
+#include <immintrin.h>
+
+#define ROTL_AVX2(x, b) _mm256_or_si256 (_mm256_slli_epi64 ((x), (b)), \
+		_mm256_srli_epi64 ((x), 64 - (b)))
+/* Rotations by 32 and 16 bits are done by shuffles */
+#define ROTL32_AVX2(x) _mm256_shuffle_epi32 ((x), _MM_SHUFFLE (2, 3, 0, 1))
+#define ROTL16_AVX2(x) _mm256_shuffle_epi8 ((x), r16)
+#define SIPROUND_AVX2 do { \
+	v0 = _mm256_add_epi64 (v0, v1); v1 = ROTL_AVX2 (v1, 13); \
+	v1 = _mm256_xor_si256 (v1, v0); v0 = ROTL32_AVX2 (v0); \
+	v2 = _mm256_add_epi64 (v2, v3); v3 = ROTL16_AVX2 (v3); \
+	v3 = _mm256_xor_si256 (v3, v2); \
+	v0 = _mm256_add_epi64 (v0, v3); v3 = ROTL_AVX2 (v3, 21); \
+	v3 = _mm256_xor_si256 (v3, v0); \
+	v2 = _mm256_add_epi64 (v2, v1); v1 = ROTL_AVX2 (v1, 17); \
+	v1 = _mm256_xor_si256 (v1, v2); v2 = ROTL32_AVX2 (v2); \
+} while (0)
+
+/* The last block of a message includes length of message */
+static inline uint64_t
+siphash_multi_tail (const unsigned char *in, uint64_t inlen)
+{
+	uint64_t b = inlen << 56;
+
+	switch (inlen & 7) {
+	case 7:
+		b |= ((uint64_t) in[6]) << 48;
+	case 6:
+		b |= ((uint64_t) in[5]) << 40;
+	case 5:
+		b |= ((uint64_t) in[4]) << 32;
+	case 4:
+		b |= ((uint64_t) in[3]) << 24;
+	case 3:
+		b |= ((uint64_t) in[2]) << 16;
+	case 2:
+		b |= ((uint64_t) in[1]) << 8;
+	case 1:
+		b |= ((uint64_t) in[0]);
+		break;
+	case 0:
+		break;
+	}
+
+	return b;
+}
+
+static inline uint64_t
+siphash_multi_load (const unsigned char *in)
+{
+	uint64_t m;
+
+	memcpy (&m, in, sizeof (m));
+
+	return m;
+}
+
+__attribute__((target("avx2"))) void
+siphash_multi_avx2 (const unsigned char k[16],
+		const struct rspamd_cryptobox_segment *segs, uint64_t *out)
+{
+	__m256i v0, v1, v2, v3, o0, o1, o2, o3, m, mask, r16;
+	const unsigned char *in[4];
+	uint64_t k0, k1, inlen[4], w[4], active[4], blocks[4], b;
+	uint64_t nblocks = 0, minblocks = UINT64_MAX;
+	unsigned int i;
+
+	r16 = _mm256_setr_epi8 (6, 7, 0, 1, 2, 3, 4, 5, 14, 15, 8, 9, 10, 11, 12, 13,
+			6, 7, 0, 1, 2, 3, 4, 5, 14, 15, 8, 9, 10, 11, 12, 13);
+	memcpy (&k0, k, sizeof (k0));
+	memcpy (&k1, k + 8, sizeof (k1));
+	v0 = _mm256_set1_epi64x (0x736f6d6570736575ULL ^ k0);
+	v1 = _mm256_set1_epi64x (0x646f72616e646f6dULL ^ k1);
+	v2 = _mm256_set1_epi64x (0x6c7967656e657261ULL ^ k0);
+	v3 = _mm256_set1_epi64x (0x7465646279746573ULL ^ k1);
+
+	for (i = 0; i < 4; i ++) {
+		in[i] = segs[i].data;
+		inlen[i] = segs[i].len;
+		blocks[i] = inlen[i] / 8 + 1;
+		nblocks = MAX (nblocks, blocks[i]);
+		minblocks = MIN (minblocks, blocks[i]);
+	}
+
+	/* Full blocks that are present in all lanes */
+	for (b = 0; b + 1 < minblocks; b ++) {
+		m = _mm256_set_epi64x (siphash_multi_load (in[3] + b * 8),
+				siphash_multi_load (in[2] + b * 8),
+				siphash_multi_load (in[1] + b * 8),
+				siphash_multi_load (in[0] + b * 8));
+		v3 = _mm256_xor_si256 (v3, m);
+		SIPROUND_AVX2;
+		SIPROUND_AVX2;
+		v0 = _mm256_xor_si256 (v0, m);
+	}
+
+	/* Lanes are masked once their last block is processed */
+	for (; b < nblocks; b ++) {
+		for (i = 0; i < 4; i ++) {
+			if (b + 1 < blocks[i]) {
+				w[i] = siphash_multi_load (in[i] + b * 8);
+				active[i] = UINT64_MAX;
+			}
+			else if (b + 1 == blocks[i]) {
+				w[i] = siphash_multi_tail (in[i] + b * 8, inlen[i]);
+				active[i] = UINT64_MAX;
+			}
+			else {
+				w[i] = 0;
+				active[i] = 0;
+			}
+		}
+
+		m = _mm256_set_epi64x (w[3], w[2], w[1], w[0]);
+		mask = _mm256_set_epi64x (active[3], active[2], active[1], active[0]);
+		o0 = v0;
+		o1 = v1;
+		o2 = v2;
+		o3 = v3;
+
+		v3 = _mm256_xor_si256 (v3, m);
+		SIPROUND_AVX2;
+		SIPROUND_AVX2;
+		v0 = _mm256_xor_si256 (v0, m);
+
+		v0 = _mm256_blendv_epi8 (o0, v0, mask);
+		v1 = _mm256_blendv_epi8 (o1, v1, mask);
+		v2 = _mm256_blendv_epi8 (o2, v2, mask);
+		v3 = _mm256_blendv_epi8 (o3, v3, mask);
+	}
+
+	v2 = _mm256_xor_si256 (v2, _mm256_set1_epi64x (0xff));
+	SIPROUND_AVX2;
+	SIPROUND_AVX2;
+	SIPROUND_AVX2;
+	SIPROUND_AVX2;
+
+	v0 = _mm256_xor_si256 (_mm256_xor_si256 (v0, v1),
+			_mm256_xor_si256 (v2, v3));
+	_mm256_storeu_si256 ((__m256i *)out, v0);
+}
+
+#endif
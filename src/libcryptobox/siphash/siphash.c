@@ -61,6 +61,42 @@ static const siphash_impl_t siphash_list[] = {
 
 static const siphash_impl_t *siphash_opt = &siphash_list[0];
 
+/* Maximum number of messages processed by a single multi-buffer call */
+#define SIPHASH_MULTI_MAXLANES 4
+
+typedef struct siphash_multi_impl_t
+{
+	unsigned long cpu_flags;
+	const char *desc;
+	size_t lanes;
+
+	void (*siphash_multi) (const unsigned char k[16],
+			const struct rspamd_cryptobox_segment *segments, uint64_t *out);
+} siphash_multi_impl_t;
+
+#define SIPHASH_MULTI_DECLARE(ext) \
+	void siphash_multi_##ext(const unsigned char k[16], const struct rspamd_cryptobox_segment *segments, uint64_t *out);
+#define SIPHASH_MULTI_IMPL(cpuflags, desc, lanes, ext) \
+	{(cpuflags), desc, lanes, siphash_multi_##ext}
+
+#if defined(HAVE_AVX2) && defined(HAVE_TARGET_ATTRIBUTE)
+SIPHASH_MULTI_DECLARE(avx2)
+#define SIPHASH_MULTI_AVX2 SIPHASH_MULTI_IMPL(CPUID_AVX2, "avx2", 4, avx2)
+#endif
+
+static void siphash_multi_generic (const unsigned char k[16],
+		const struct rspamd_cryptobox_segment *segments, uint64_t *out);
+#define SIPHASH_MULTI_GENERIC SIPHASH_MULTI_IMPL(0, "generic", 1, generic)
+
+static const siphash_multi_impl_t siphash_multi_list[] = {
+		SIPHASH_MULTI_GENERIC,
+#if defined(SIPHASH_MULTI_AVX2)
+		SIPHASH_MULTI_AVX2,
+#endif
+};
+
+static const siphash_multi_impl_t *siphash_multi_opt = &siphash_multi_list[0];
+
 void
 siphash_load(void)
 {
@@ -73,6 +109,13 @@ siphash_load(void)
 				break;
 			}
 		}
+
+		for (i = 0; i < G_N_ELEMENTS(siphash_multi_list); i++) {
+			if (siphash_multi_list[i].cpu_flags & cpu_config) {
+				siphash_multi_opt = &siphash_multi_list[i];
+				break;
+			}
+		}
 	}
 }
 
@@ -85,6 +128,45 @@ void siphash24 (unsigned char *out, const unsigned char *in,
 	memcpy (out, &r, sizeof (r));
 }
 
+/* Single message fallback, uses the best available implementation */
+static void
+siphash_multi_generic (const unsigned char k[16],
+		const struct rspamd_cryptobox_segment *segments, uint64_t *out)
+{
+	out[0] = siphash_opt->siphash (k, segments[0].data, segments[0].len);
+}
+
+void
+siphash24_multi (uint64_t *out, const struct rspamd_cryptobox_segment *segments,
+		size_t cnt, const unsigned char *k)
+{
+	struct rspamd_cryptobox_segment lanes[SIPHASH_MULTI_MAXLANES];
+	uint64_t res[SIPHASH_MULTI_MAXLANES];
+	size_t i, nlanes = siphash_multi_opt->lanes;
+
+	while (cnt >= nlanes) {
+		siphash_multi_opt->siphash_multi (k, segments, out);
+		segments += nlanes;
+		out += nlanes;
+		cnt -= nlanes;
+	}
+
+	if (cnt > 0) {
+		/* Unused lanes hash an empty message that is thrown away */
+		for (i = 0; i < nlanes; i ++) {
+			if (i < cnt) {
+				lanes[i] = segments[i];
+			}
+			else {
+				lanes[i].data = segments[0].data;
+				lanes[i].len = 0;
+			}
+		}
+
+		siphash_multi_opt->siphash_multi (k, lanes, res);
+		memcpy (out, res, cnt * sizeof (*out));
+	}
+}
 
 size_t
 siphash24_test (bool generic)
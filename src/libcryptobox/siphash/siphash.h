@@ -24,16 +24,27 @@
 #define SIPHASH_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
 #if defined(__cplusplus)
 extern "C"
 {
 #endif
+struct rspamd_cryptobox_segment;
+
 void siphash_load (void);
 void siphash24 (unsigned char *out,
 		const unsigned char *in,
 		unsigned long long inlen,
 		const unsigned char *k);
+/*
+ * Hash cnt independent messages with the same key, out must have space for
+ * cnt hashes
+ */
+void siphash24_multi (uint64_t *out,
+		const struct rspamd_cryptobox_segment *segments,
+		size_t cnt,
+		const unsigned char *k);
 #if defined(__cplusplus)
 }
 #endif
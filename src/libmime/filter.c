@@ -99,6 +99,11 @@ rspamd_create_metric_result (struct rspamd_task *task, const gchar *name)
 	rspamd_mempool_add_destructor (task->task_pool,
 			(rspamd_mempool_destruct_t) g_hash_table_unref,
 			metric_res->symbols);
+	/* Symbols known by cache are found without hashing their names */
+	metric_res->nsymbols_by_id = task->cfg->cache ?
+			task->cfg->cache->items_by_id->len : 0;
+	metric_res->symbols_by_id = rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (struct symbol *) * metric_res->nsymbols_by_id);
 	metric_res->sym_groups = g_hash_table_new (g_direct_hash, g_direct_equal);
 	rspamd_mempool_add_destructor (task->task_pool,
 			(rspamd_mempool_destruct_t) g_hash_table_unref,
@@ -114,10 +119,190 @@ rspamd_create_metric_result (struct rspamd_task *task, const gchar *name)
 	return metric_res;
 }
 
+static void
+rspamd_settings_dtor (struct rspamd_settings *settings)
+{
+	g_hash_table_unref (settings->metrics);
+	ucl_object_unref (settings->obj);
+	g_slice_free1 (sizeof (*settings), settings);
+}
+
+static void
+rspamd_metric_settings_free (gpointer p)
+{
+	struct rspamd_metric_settings *ms = p;
+
+	g_free (ms->weights);
+	g_free (ms->redefined);
+	g_hash_table_unref (ms->symbols);
+	g_slice_free1 (sizeof (*ms), ms);
+}
+
+static struct rspamd_metric_settings *
+rspamd_metric_settings_new (struct rspamd_config *cfg, struct metric *metric,
+		const ucl_object_t *mobj)
+{
+	struct rspamd_metric_settings *ms;
+	const ucl_object_t *act, *sact, *cur;
+	ucl_object_iter_t it = NULL;
+	struct cache_item *item;
+	gdouble val, *pval;
+	gint i;
+
+	ms = g_slice_alloc0 (sizeof (*ms));
+	ms->metric = metric;
+	ms->symbols = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			NULL, g_free);
+	ms->nweights = cfg->cache ? cfg->cache->items_by_id->len : 0;
+	ms->weights = g_malloc0 (sizeof (gdouble) * ms->nweights);
+	ms->redefined = g_malloc0 (NBYTES (ms->nweights));
+
+	act = ucl_object_find_key (mobj, "actions");
+
+	for (i = METRIC_ACTION_REJECT; i < METRIC_ACTION_MAX; i ++) {
+		ms->actions[i] = metric->actions[i].score;
+
+		if (act != NULL) {
+			sact = ucl_object_find_key (act,
+					rspamd_action_to_str (metric->actions[i].action));
+
+			if (sact != NULL && ucl_object_todouble_safe (sact, &val)) {
+				ms->actions[i] = val;
+			}
+		}
+	}
+
+	while ((cur = ucl_iterate_object (mobj, &it, true)) != NULL) {
+		if (cur == act || !ucl_object_todouble_safe (cur, &val)) {
+			continue;
+		}
+
+		item = rspamd_symbols_cache_find_symbol (cfg->cache,
+				ucl_object_key (cur));
+
+		if (item != NULL && item->id >= 0 && (guint)item->id < ms->nweights) {
+			ms->weights[item->id] = val;
+			setbit (ms->redefined, item->id);
+		}
+		else {
+			pval = g_malloc (sizeof (*pval));
+			*pval = val;
+			g_hash_table_insert (ms->symbols, (gpointer)ucl_object_key (cur),
+					pval);
+		}
+	}
+
+	return ms;
+}
+
+struct rspamd_settings *
+rspamd_settings_new (struct rspamd_config *cfg, ucl_object_t *obj)
+{
+	struct rspamd_settings *settings;
+	struct metric *metric;
+	const ucl_object_t *mobj;
+	GList *cur;
+
+	settings = g_slice_alloc0 (sizeof (*settings));
+	settings->obj = ucl_object_ref (obj);
+	settings->whitelist = ucl_object_find_key (obj, "whitelist") != NULL;
+	settings->metrics = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+			NULL, rspamd_metric_settings_free);
+	REF_INIT_RETAIN (settings, rspamd_settings_dtor);
+
+	cur = cfg->metrics_list;
+
+	while (cur) {
+		metric = cur->data;
+		mobj = ucl_object_find_key (obj, metric->name);
+
+		if (mobj != NULL) {
+			g_hash_table_insert (settings->metrics, metric,
+					rspamd_metric_settings_new (cfg, metric, mobj));
+		}
+
+		cur = g_list_next (cur);
+	}
+
+	return settings;
+}
+
+struct rspamd_settings *
+rspamd_settings_ref (struct rspamd_settings *settings)
+{
+	REF_RETAIN (settings);
+
+	return settings;
+}
+
+void
+rspamd_settings_unref (struct rspamd_settings *settings)
+{
+	REF_RELEASE (settings);
+}
+
+static inline struct rspamd_metric_settings *
+rspamd_task_metric_settings (struct rspamd_task *task, struct metric *metric)
+{
+	if (task->compiled_settings == NULL) {
+		return NULL;
+	}
+
+	return g_hash_table_lookup (task->compiled_settings->metrics, metric);
+}
+
+static gboolean
+rspamd_metric_settings_weight (struct rspamd_metric_settings *ms,
+		const gchar *symbol, gint id, gdouble *weight)
+{
+	gdouble *pval;
+
+	if (id >= 0 && (guint)id < ms->nweights) {
+		if (isset (ms->redefined, id)) {
+			*weight = ms->weights[id];
+			return TRUE;
+		}
+
+		return FALSE;
+	}
+
+	pval = g_hash_table_lookup (ms->symbols, symbol);
+
+	if (pval != NULL) {
+		*weight = *pval;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static inline struct symbol *
+metric_result_find_symbol (struct metric_result *metric_res,
+	const gchar *symbol, gint id)
+{
+	if (id >= 0 && (guint)id < metric_res->nsymbols_by_id) {
+		return metric_res->symbols_by_id[id];
+	}
+
+	return g_hash_table_lookup (metric_res->symbols, symbol);
+}
+
+static void
+metric_result_remove_symbol (struct metric_result *metric_res,
+	struct symbol *s)
+{
+	if (s->id >= 0 && (guint)s->id < metric_res->nsymbols_by_id) {
+		metric_res->symbols_by_id[s->id] = NULL;
+	}
+
+	g_hash_table_remove (metric_res->symbols, s->name);
+}
+
 static void
 insert_metric_result (struct rspamd_task *task,
 	struct metric *metric,
 	const gchar *symbol,
+	gint id,
 	double flag,
 	GList * opts,
 	gboolean single)
@@ -127,7 +312,8 @@ insert_metric_result (struct rspamd_task *task,
 	gdouble w, *gr_score = NULL;
 	struct rspamd_symbol_def *sdef;
 	struct rspamd_symbols_group *gr = NULL;
-	const ucl_object_t *mobj, *sobj;
+	struct rspamd_metric_settings *ms;
+	gdouble corr;
 
 	metric_res = rspamd_create_metric_result (task, metric->name);
 
@@ -150,18 +336,12 @@ insert_metric_result (struct rspamd_task *task,
 		}
 	}
 
-	if (task->settings) {
-		mobj = ucl_object_find_key (task->settings, metric->name);
-		if (mobj) {
-			gdouble corr;
+	ms = rspamd_task_metric_settings (task, metric);
 
-			sobj = ucl_object_find_key (mobj, symbol);
-			if (sobj != NULL && ucl_object_todouble_safe (sobj, &corr)) {
-				msg_debug ("settings: changed weight of symbol %s from %.2f to %.2f",
-						symbol, w, corr);
-				w = corr * flag;
-			}
-		}
+	if (ms != NULL && rspamd_metric_settings_weight (ms, symbol, id, &corr)) {
+		msg_debug ("settings: changed weight of symbol %s from %.2f to %.2f",
+				symbol, w, corr);
+		w = corr * flag;
 	}
 
 	/* XXX: does not take grow factor into account */
@@ -180,7 +360,7 @@ insert_metric_result (struct rspamd_task *task,
 	}
 
 	/* Add metric score */
-	if ((s = g_hash_table_lookup (metric_res->symbols, symbol)) != NULL) {
+	if ((s = metric_result_find_symbol (metric_res, symbol, id)) != NULL) {
 		if (sdef && sdef->one_shot) {
 			/*
 			 * For one shot symbols we do not need to add them again, so
@@ -233,6 +413,7 @@ insert_metric_result (struct rspamd_task *task,
 		s->score = w;
 		s->name = symbol;
 		s->def = sdef;
+		s->id = id;
 		metric_res->score += w;
 
 		if (opts) {
@@ -245,6 +426,10 @@ insert_metric_result (struct rspamd_task *task,
 		}
 
 		g_hash_table_insert (metric_res->symbols, (gpointer) symbol, s);
+
+		if (id >= 0 && (guint)id < metric_res->nsymbols_by_id) {
+			metric_res->symbols_by_id[id] = s;
+		}
 	}
 	debug_task ("symbol %s, score %.2f, metric %s, factor: %f",
 		symbol,
@@ -269,6 +454,7 @@ insert_result_common (struct rspamd_task *task,
 	struct metric *metric;
 	struct cache_item *item;
 	GList *cur, *metric_list;
+	gint id;
 
 	/* Avoid concurrenting inserting of results */
 #if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
@@ -276,13 +462,16 @@ insert_result_common (struct rspamd_task *task,
 #else
 	G_LOCK (result_mtx);
 #endif
+	item = rspamd_symbols_cache_find_symbol (task->cfg->cache, symbol);
+	id = item != NULL ? item->id : -1;
+
 	metric_list = g_hash_table_lookup (task->cfg->metrics_symbols, symbol);
 	if (metric_list) {
 		cur = metric_list;
 
 		while (cur) {
 			metric = cur->data;
-			insert_metric_result (task, metric, symbol, flag, opts, single);
+			insert_metric_result (task, metric, symbol, id, flag, opts, single);
 			cur = g_list_next (cur);
 		}
 	}
@@ -291,16 +480,19 @@ insert_result_common (struct rspamd_task *task,
 		insert_metric_result (task,
 			task->cfg->default_metric,
 			symbol,
+			id,
 			flag,
 			opts,
 			single);
 	}
 
 	/* Process cache item */
-	if (task->cfg->cache) {
-		item = g_hash_table_lookup (task->cfg->cache->items_by_symbol, symbol);
-		if (item != NULL) {
-			item->s->frequency++;
+	if (item != NULL) {
+		rspamd_symbols_cache_inc_frequency (item);
+
+		if (task->worker && task->worker->srv->ts) {
+			rspamd_ts_store_add (task->worker->srv->ts->store,
+					item->ts_id, 1);
 		}
 	}
 
@@ -339,24 +531,13 @@ static gboolean
 check_metric_settings (struct rspamd_task *task, struct metric *metric,
 	double *score)
 {
-	const ucl_object_t *mobj, *reject, *act;
-	double val;
+	struct rspamd_metric_settings *ms;
 
-	if (task->settings == NULL) {
-		return FALSE;
-	}
+	ms = rspamd_task_metric_settings (task, metric);
 
-	mobj = ucl_object_find_key (task->settings, metric->name);
-	if (mobj != NULL) {
-		act = ucl_object_find_key (mobj, "actions");
-		if (act != NULL) {
-			reject = ucl_object_find_key (act,
-					rspamd_action_to_str (METRIC_ACTION_REJECT));
-			if (reject != NULL && ucl_object_todouble_safe (reject, &val)) {
-				*score = val;
-				return TRUE;
-			}
-		}
+	if (ms != NULL) {
+		*score = ms->actions[METRIC_ACTION_REJECT];
+		return TRUE;
 	}
 
 	return FALSE;
@@ -397,34 +578,70 @@ check_metric_is_spam (struct rspamd_task *task, struct metric *metric)
 	return FALSE;
 }
 
+/*
+ * Return true if the action of metric cannot be changed by the checks that
+ * are not finished yet
+ */
+static gboolean
+check_metric_is_final (struct rspamd_task *task, struct metric *metric)
+{
+	struct metric_result *res;
+	gdouble score = 0, pos, neg;
+
+	if (metric->grow_factor > 1.0) {
+		/* Positive weights are not bounded in this case */
+		return FALSE;
+	}
+
+	if (rspamd_task_metric_settings (task, metric) != NULL) {
+		/* Weights could be redefined by settings */
+		return FALSE;
+	}
+
+	if (!rspamd_symbols_cache_remaining_weight (task, task->cfg->cache,
+			metric, &pos, &neg)) {
+		return FALSE;
+	}
+
+	res = g_hash_table_lookup (task->results, metric->name);
+
+	if (res != NULL) {
+		score = res->score;
+	}
+
+	return rspamd_check_action_metric (task, score + neg, NULL, metric) ==
+			rspamd_check_action_metric (task, score + pos, NULL, metric);
+}
+
 gint
 rspamd_process_filters (struct rspamd_task *task)
 {
 	GList *cur;
 	struct metric *metric;
-	gpointer item = NULL;
 
 	/* Insert default metric to be sure that it exists all the time */
 	rspamd_create_metric_result (task, DEFAULT_METRIC);
-	if (task->settings) {
-		const ucl_object_t *wl;
+	if (task->compiled_settings && task->compiled_settings->whitelist) {
+		msg_info ("<%s> is whitelisted", task->message_id);
+		task->flags |= RSPAMD_TASK_FLAG_SKIP;
+		return 0;
+	}
 
-		wl = ucl_object_find_key (task->settings, "whitelist");
-		if (wl != NULL) {
-			msg_info ("<%s> is whitelisted", task->message_id);
-			task->flags |= RSPAMD_TASK_FLAG_SKIP;
+	/* Process metrics symbols */
+	while (call_symbol_callback (task, task->cfg->cache, &task->checkpoint)) {
+		if (rspamd_task_check_memory (task)) {
 			return 0;
 		}
-	}
 
-	/* Process metrics symbols */
-	while (call_symbol_callback (task, task->cfg->cache, &item)) {
+		if (task->flags & RSPAMD_TASK_FLAG_PASS_ALL) {
+			continue;
+		}
+
 		/* Check reject actions */
 		cur = task->cfg->metrics_list;
 		while (cur) {
 			metric = cur->data;
-			if (!(task->flags & RSPAMD_TASK_FLAG_PASS_ALL) &&
-				metric->actions[METRIC_ACTION_REJECT].score > 0 &&
+			if (metric->actions[METRIC_ACTION_REJECT].score > 0 &&
 				check_metric_is_spam (task, metric)) {
 				msg_info ("<%s> has already scored more than %.2f, so do not "
 						"plan any more checks", task->message_id,
@@ -433,6 +650,25 @@ rspamd_process_filters (struct rspamd_task *task)
 			}
 			cur = g_list_next (cur);
 		}
+
+		if (task->cfg->shortcut_checks ||
+				(task->flags & RSPAMD_TASK_FLAG_OVERLOAD)) {
+			cur = task->cfg->metrics_list;
+			while (cur) {
+				metric = cur->data;
+				if (!check_metric_is_final (task, metric)) {
+					break;
+				}
+				cur = g_list_next (cur);
+			}
+
+			if (cur == NULL) {
+				msg_info ("<%s> cannot change its action by the remaining "
+						"checks, so do not plan any more checks",
+						task->message_id);
+				return 1;
+			}
+		}
 	}
 
 	task->state = WAIT_FILTER;
@@ -456,6 +692,40 @@ struct symbol_remove_data {
 	GList *comp;
 };
 
+/*
+ * Parsed composite atom, composites and groups referred by atoms are found on
+ * the first evaluation, as they might be defined after the composite itself
+ */
+struct composite_atom {
+	const gchar *sym;
+	gint id;
+	gchar op;
+	gboolean is_group;
+	gboolean resolved;
+	struct rspamd_composite *ncomp;
+	struct rspamd_symbols_group *gr;
+};
+
+struct composite_index_elt {
+	const gchar *name;
+	struct rspamd_composite *comp;
+	guint pos;
+	gboolean unconditional;
+};
+
+/*
+ * Inverted index of composites: a composite can be true only if some of its
+ * symbols are found or if it is true when none of them is found, so others
+ * are not evaluated at all
+ */
+struct rspamd_composites_index {
+	GHashTable *symbols;
+	GArray *composites;
+	GPtrArray *unconditional;
+};
+
+G_LOCK_DEFINE_STATIC (composites_index_lock);
+
 
 /*
  * Composites are just sequences of symbols
@@ -466,6 +736,8 @@ rspamd_composite_expr_parse (const gchar *line, gsize len,
 {
 	gsize clen;
 	rspamd_expression_atom_t *res;
+	struct composite_atom *catom;
+	gchar *sym;
 
 	clen = strcspn (line, ", \t()><+!|&\n");
 	if (clen == 0) {
@@ -478,24 +750,60 @@ rspamd_composite_expr_parse (const gchar *line, gsize len,
 	res = rspamd_mempool_alloc0 (pool, sizeof (*res));
 	res->len = clen;
 	res->str = line;
-	res->data = rspamd_mempool_alloc (pool, clen + 1);
-	rspamd_strlcpy (res->data, line, clen + 1);
+	sym = rspamd_mempool_alloc (pool, clen + 1);
+	rspamd_strlcpy (sym, line, clen + 1);
+
+	catom = rspamd_mempool_alloc0 (pool, sizeof (*catom));
+	catom->sym = sym;
+	catom->id = -1;
+
+	if (*catom->sym == '~' || *catom->sym == '-') {
+		catom->op = *catom->sym ++;
+	}
+
+	if (strncmp (catom->sym, "g:", 2) == 0) {
+		catom->is_group = TRUE;
+		catom->sym += 2;
+	}
+
+	res->data = catom;
 
 	return res;
 }
 
+static void
+rspamd_composite_atom_resolve (struct rspamd_config *cfg,
+		struct composite_atom *catom)
+{
+	struct cache_item *item;
+
+	/* Configuration is not changed after loading, so it is enough once */
+	if (catom->is_group) {
+		catom->gr = g_hash_table_lookup (cfg->symbols_groups, catom->sym);
+	}
+	else {
+		catom->ncomp = g_hash_table_lookup (cfg->composite_symbols,
+				catom->sym);
+		item = rspamd_symbols_cache_find_symbol (cfg->cache, catom->sym);
+
+		if (item != NULL) {
+			catom->id = item->id;
+		}
+	}
+
+	catom->resolved = TRUE;
+}
+
 static gint
 rspamd_composite_process_single_symbol (struct composites_data *cd,
-		const gchar *sym, struct symbol **pms)
+		const gchar *sym, gint id, struct rspamd_composite *ncomp,
+		struct symbol **pms)
 {
 	struct symbol *ms = NULL;
 	gint rc = 0;
-	struct rspamd_composite *ncomp;
 
-	if ((ms = g_hash_table_lookup (cd->metric_res->symbols, sym)) == NULL) {
-		if ((ncomp =
-				g_hash_table_lookup (cd->task->cfg->composite_symbols,
-						sym)) != NULL) {
+	if ((ms = metric_result_find_symbol (cd->metric_res, sym, id)) == NULL) {
+		if (ncomp != NULL) {
 			/* Set checked for this symbol to avoid cyclic references */
 			if (isclr (cd->checked, ncomp->id * 2)) {
 				setbit (cd->checked, cd->composite->id * 2);
@@ -508,7 +816,7 @@ rspamd_composite_process_single_symbol (struct composites_data *cd,
 				}
 				setbit (cd->checked, ncomp->id * 2);
 
-				ms = g_hash_table_lookup (cd->metric_res->symbols, sym);
+				ms = metric_result_find_symbol (cd->metric_res, sym, id);
 			}
 			else {
 				/*
@@ -530,13 +838,12 @@ static gint
 rspamd_composite_expr_process (gpointer input, rspamd_expression_atom_t *atom)
 {
 	struct composites_data *cd = (struct composites_data *)input;
-	const gchar *sym = atom->data;
+	struct composite_atom *catom = atom->data;
 	struct symbol_remove_data *rd;
-	struct symbol *ms;
-	struct rspamd_symbols_group *gr;
+	struct symbol *ms = NULL;
 	struct rspamd_symbol_def *sdef;
 	gint rc = 0;
-	gchar t = '\0';
+	gchar t;
 
 	if (isset (cd->checked, cd->composite->id * 2)) {
 		/* We have already checked this composite, so just return its value */
@@ -544,16 +851,24 @@ rspamd_composite_expr_process (gpointer input, rspamd_expression_atom_t *atom)
 		return rc;
 	}
 
-	if (*sym == '~' || *sym == '-') {
-		t = *sym ++;
+	if (cd->task == NULL) {
+		/* Composite is evaluated for no symbols when the index is built */
+		return 0;
 	}
 
-	if (strncmp (sym, "g:", 2) == 0) {
-		gr = g_hash_table_lookup (cd->task->cfg->symbols_groups, sym + 2);
+	if (G_UNLIKELY (!catom->resolved)) {
+		rspamd_composite_atom_resolve (cd->task->cfg, catom);
+	}
 
-		if (gr != NULL) {
-			LL_FOREACH (gr->symbols, sdef) {
-				rc = rspamd_composite_process_single_symbol (cd, sdef->name, &ms);
+	t = catom->op;
+
+	if (catom->is_group) {
+		if (catom->gr != NULL) {
+			LL_FOREACH (catom->gr->symbols, sdef) {
+				rc = rspamd_composite_process_single_symbol (cd, sdef->name, -1,
+						g_hash_table_lookup (cd->task->cfg->composite_symbols,
+								sdef->name),
+						&ms);
 				if (rc) {
 					break;
 				}
@@ -561,7 +876,8 @@ rspamd_composite_expr_process (gpointer input, rspamd_expression_atom_t *atom)
 		}
 	}
 	else {
-		rc = rspamd_composite_process_single_symbol (cd, sym, &ms);
+		rc = rspamd_composite_process_single_symbol (cd, catom->sym,
+				catom->id, catom->ncomp, &ms);
 	}
 
 	if (rc && ms) {
@@ -684,7 +1000,7 @@ composites_remove_symbols (gpointer key, gpointer value, gpointer data)
 
 	if (matched) {
 		if (rd->remove_symbol) {
-			g_hash_table_remove (cd->metric_res->symbols, key);
+			metric_result_remove_symbol (cd->metric_res, rd->ms);
 		}
 		if (rd->remove_weight) {
 			cd->metric_res->score -= rd->ms->score;
@@ -694,6 +1010,154 @@ composites_remove_symbols (gpointer key, gpointer value, gpointer data)
 	return FALSE;
 }
 
+struct composites_index_data {
+	struct rspamd_config *cfg;
+	struct rspamd_composites_index *idx;
+	struct composite_index_elt *elt;
+};
+
+static void
+composites_index_symbol (struct composites_index_data *id, const gchar *sym)
+{
+	GPtrArray *elts;
+
+	if (g_hash_table_lookup (id->cfg->composite_symbols, sym) != NULL) {
+		/* Results of nested composites are not known in advance */
+		id->elt->unconditional = TRUE;
+		return;
+	}
+
+	elts = g_hash_table_lookup (id->idx->symbols, sym);
+
+	if (elts == NULL) {
+		elts = g_ptr_array_new ();
+		g_hash_table_insert (id->idx->symbols, (gpointer)sym, elts);
+	}
+	else if (elts->len > 0 &&
+			g_ptr_array_index (elts, elts->len - 1) == id->elt) {
+		return;
+	}
+
+	g_ptr_array_add (elts, id->elt);
+}
+
+static void
+composites_index_atom (rspamd_expression_atom_t *atom, gpointer ud)
+{
+	struct composites_index_data *id = ud;
+	struct composite_atom *catom = atom->data;
+	struct rspamd_symbol_def *sdef;
+
+	rspamd_composite_atom_resolve (id->cfg, catom);
+
+	if (catom->is_group) {
+		if (catom->gr != NULL) {
+			LL_FOREACH (catom->gr->symbols, sdef) {
+				composites_index_symbol (id, sdef->name);
+			}
+		}
+	}
+	else {
+		composites_index_symbol (id, catom->sym);
+	}
+}
+
+static void
+composites_index_destroy (gpointer ud)
+{
+	struct rspamd_composites_index *idx = ud;
+
+	g_hash_table_unref (idx->symbols);
+	g_array_free (idx->composites, TRUE);
+	g_ptr_array_free (idx->unconditional, TRUE);
+	g_slice_free1 (sizeof (*idx), idx);
+}
+
+static struct rspamd_composites_index *
+composites_index_build (struct rspamd_config *cfg)
+{
+	struct rspamd_composites_index *idx;
+	struct composites_index_data id;
+	struct composites_data cd;
+	struct composite_index_elt elt, *pelt;
+	GHashTableIter it;
+	gpointer k, v;
+	guint i;
+
+	idx = g_slice_alloc (sizeof (*idx));
+	idx->symbols = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			NULL, rspamd_ptr_array_free_hard);
+	idx->composites = g_array_sized_new (FALSE, TRUE, sizeof (elt),
+			g_hash_table_size (cfg->composite_symbols));
+	idx->unconditional = g_ptr_array_new ();
+
+	memset (&elt, 0, sizeof (elt));
+	g_hash_table_iter_init (&it, cfg->composite_symbols);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		elt.name = k;
+		elt.comp = v;
+		elt.pos = idx->composites->len;
+		g_array_append_val (idx->composites, elt);
+	}
+
+	memset (&cd, 0, sizeof (cd));
+	cd.checked = g_malloc0 (NBYTES (g_hash_table_size (
+			cfg->composite_symbols) * 2));
+	id.cfg = cfg;
+	id.idx = idx;
+
+	for (i = 0; i < idx->composites->len; i ++) {
+		pelt = &g_array_index (idx->composites, struct composite_index_elt, i);
+		id.elt = pelt;
+		rspamd_expression_atom_foreach (pelt->comp->expr,
+				composites_index_atom, &id);
+
+		if (!pelt->unconditional) {
+			cd.composite = pelt->comp;
+			pelt->unconditional = rspamd_process_expression (pelt->comp->expr,
+					RSPAMD_EXPRESSION_FLAG_NOOPT, &cd);
+		}
+
+		if (pelt->unconditional) {
+			g_ptr_array_add (idx->unconditional, pelt);
+		}
+	}
+
+	g_free (cd.checked);
+	msg_debug ("indexed %ud composites by %ud symbols, %ud composites are "
+			"always checked", idx->composites->len,
+			g_hash_table_size (idx->symbols), idx->unconditional->len);
+
+	return idx;
+}
+
+static struct rspamd_composites_index *
+composites_get_index (struct rspamd_config *cfg)
+{
+	struct rspamd_composites_index *idx;
+
+	idx = g_atomic_pointer_get (&cfg->composites_index);
+
+	if (G_UNLIKELY (idx == NULL)) {
+		G_LOCK (composites_index_lock);
+
+		if (cfg->composites_index == NULL) {
+			idx = composites_index_build (cfg);
+			rspamd_mempool_add_destructor (cfg->cfg_pool,
+					composites_index_destroy, idx);
+			g_atomic_pointer_set (&cfg->composites_index, idx);
+		}
+		else {
+			idx = cfg->composites_index;
+		}
+
+		G_UNLOCK (composites_index_lock);
+	}
+
+	return idx;
+}
+
 static void
 composites_metric_callback (gpointer key, gpointer value, gpointer data)
 {
@@ -701,6 +1165,13 @@ composites_metric_callback (gpointer key, gpointer value, gpointer data)
 	struct composites_data *cd =
 		rspamd_mempool_alloc (task->task_pool, sizeof (struct composites_data));
 	struct metric_result *metric_res = (struct metric_result *)value;
+	struct rspamd_composites_index *idx;
+	struct composite_index_elt *elt;
+	GHashTableIter it;
+	GPtrArray *elts;
+	gpointer k, v;
+	guint8 *candidates;
+	guint i;
 
 	cd->task = task;
 	cd->metric_res = (struct metric_result *)metric_res;
@@ -709,10 +1180,35 @@ composites_metric_callback (gpointer key, gpointer value, gpointer data)
 		rspamd_mempool_alloc0 (task->task_pool,
 			NBYTES (g_hash_table_size (task->cfg->composite_symbols) * 2));
 
-	/* Process hash table */
-	g_hash_table_foreach (task->cfg->composite_symbols,
-		composites_foreach_callback,
-		cd);
+	idx = composites_get_index (task->cfg);
+	candidates = rspamd_mempool_alloc0 (task->task_pool,
+			NBYTES (idx->composites->len));
+
+	for (i = 0; i < idx->unconditional->len; i ++) {
+		elt = g_ptr_array_index (idx->unconditional, i);
+		setbit (candidates, elt->pos);
+	}
+
+	/* Select composites that refer to the found symbols */
+	g_hash_table_iter_init (&it, metric_res->symbols);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		elts = g_hash_table_lookup (idx->symbols, k);
+
+		if (elts != NULL) {
+			for (i = 0; i < elts->len; i ++) {
+				elt = g_ptr_array_index (elts, i);
+				setbit (candidates, elt->pos);
+			}
+		}
+	}
+
+	for (i = 0; i < idx->composites->len; i ++) {
+		if (isset (candidates, i)) {
+			elt = &g_array_index (idx->composites, struct composite_index_elt, i);
+			composites_foreach_callback ((gpointer)elt->name, elt->comp, cd);
+		}
+	}
 
 	/* Remove symbols that are in composites */
 	g_tree_foreach (cd->symbols_to_remove, composites_remove_symbols, cd);
@@ -726,42 +1222,119 @@ rspamd_make_composites (struct rspamd_task *task)
 	g_hash_table_foreach (task->results, composites_metric_callback, task);
 }
 
-struct classifiers_cbdata {
-	struct rspamd_task *task;
-	struct lua_locked_state *nL;
+struct composites_weight_data {
+	struct rspamd_config *cfg;
+	struct metric *metric;
+	GHashTable *seen;
+	gdouble pos;
+	gdouble neg;
 };
 
+static void
+composites_weight_symbol (struct composites_weight_data *wd, const gchar *sym)
+{
+	struct rspamd_symbol_def *sdef;
+	gdouble w;
+
+	if (g_hash_table_lookup (wd->seen, sym) != NULL) {
+		return;
+	}
 
-void
-rspamd_process_statistics (struct rspamd_task *task)
+	g_hash_table_insert (wd->seen, (gpointer)sym, (gpointer)sym);
+	sdef = g_hash_table_lookup (wd->metric->symbols, sym);
+
+	if (sdef != NULL) {
+		w = *sdef->weight_ptr;
+
+		/* Removal of a positive weight decreases the score and vice versa */
+		if (w > 0) {
+			wd->neg -= w;
+		}
+		else {
+			wd->pos -= w;
+		}
+	}
+}
+
+static void
+composites_weight_atom (rspamd_expression_atom_t *atom, gpointer ud)
 {
-	if (RSPAMD_TASK_IS_SKIPPED (task)) {
+	struct composites_weight_data *wd = ud;
+	struct rspamd_symbols_group *gr;
+	struct rspamd_symbol_def *sdef;
+	struct composite_atom *catom = atom->data;
+	const gchar *sym = catom->sym;
+
+	if (catom->op == '~' || catom->op == '-') {
+		/* Weight is preserved */
 		return;
 	}
 
-	/* TODO: handle err here */
-	rspamd_stat_classify (task, task->cfg->lua_state, NULL);
+	if (catom->is_group) {
+		gr = g_hash_table_lookup (wd->cfg->symbols_groups, sym);
 
-	/* Process results */
-	rspamd_make_composites (task);
+		if (gr != NULL) {
+			LL_FOREACH (gr->symbols, sdef) {
+				composites_weight_symbol (wd, sdef->name);
+			}
+		}
+	}
+	else {
+		composites_weight_symbol (wd, sym);
+	}
+}
+
+static void
+composites_weight_callback (gpointer key, gpointer value, gpointer data)
+{
+	struct rspamd_composite *composite = value;
+
+	rspamd_expression_atom_foreach (composite->expr, composites_weight_atom,
+			data);
 }
 
 void
-rspamd_process_statistic_threaded (gpointer data, gpointer user_data)
+rspamd_composites_removed_weight (struct rspamd_config *cfg,
+	struct metric *metric,
+	gdouble *pos,
+	gdouble *neg)
 {
-	struct rspamd_task *task = (struct rspamd_task *)data;
-	struct lua_locked_state *nL = user_data;
+	struct composites_weight_data wd;
+
+	wd.cfg = cfg;
+	wd.metric = metric;
+	wd.pos = 0;
+	wd.neg = 0;
+	wd.seen = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
 
+	g_hash_table_foreach (cfg->composite_symbols, composites_weight_callback,
+			&wd);
+	g_hash_table_unref (wd.seen);
+
+	*pos = wd.pos;
+	*neg = wd.neg;
+}
+
+struct classifiers_cbdata {
+	struct rspamd_task *task;
+	struct lua_locked_state *nL;
+};
+
+
+void
+rspamd_process_statistics (struct rspamd_task *task)
+{
 	if (RSPAMD_TASK_IS_SKIPPED (task)) {
-		remove_async_thread (task->s);
 		return;
 	}
 
-	/* TODO: handle err here */
-	rspamd_mutex_lock (nL->m);
-	rspamd_stat_classify (task, nL->L, NULL);
-	rspamd_mutex_unlock (nL->m);
-	remove_async_thread (task->s);
+	if (!(task->flags & RSPAMD_TASK_FLAG_OVERLOAD)) {
+		/* TODO: handle err here */
+		rspamd_stat_classify (task, task->cfg->lua_state, NULL);
+	}
+
+	/* Process results */
+	rspamd_make_composites (task);
 }
 
 static void
@@ -888,20 +1461,11 @@ rspamd_action_to_str (enum rspamd_metric_action action)
 }
 
 static double
-get_specific_action_score (const ucl_object_t *metric,
+get_specific_action_score (struct rspamd_metric_settings *ms,
 		struct metric_action *action)
 {
-	const ucl_object_t *act, *sact;
-	double score;
-
-	if (metric) {
-		act = ucl_object_find_key (metric, "actions");
-		if (act) {
-			sact = ucl_object_find_key (act, rspamd_action_to_str (action->action));
-			if (sact != NULL && ucl_object_todouble_safe (sact, &score)) {
-				return score;
-			}
-		}
+	if (ms) {
+		return ms->actions[action - ms->metric->actions];
 	}
 
 	return action->score;
@@ -913,12 +1477,10 @@ rspamd_check_action_metric (struct rspamd_task *task,
 {
 	struct metric_action *action, *selected_action = NULL;
 	double max_score = 0;
-	const ucl_object_t *ms = NULL;
+	struct rspamd_metric_settings *ms;
 	int i;
 
-	if (task->settings) {
-		ms = ucl_object_find_key (task->settings, metric->name);
-	}
+	ms = rspamd_task_metric_settings (task, metric);
 
 	for (i = METRIC_ACTION_REJECT; i < METRIC_ACTION_MAX; i++) {
 		double sc;
@@ -9,6 +9,7 @@
 #include "config.h"
 #include "symbols_cache.h"
 #include "task.h"
+#include "ref.h"
 
 struct rspamd_task;
 struct rspamd_settings;
@@ -37,6 +38,7 @@ struct symbol {
 	GList *options;                                 /**< list of symbol's options				*/
 	const gchar *name;
 	struct rspamd_symbol_def *def;					/**< symbol configuration					*/
+	gint id;                                        /**< id of symbol in cache or -1			*/
 };
 
 struct metric_action {
@@ -68,12 +70,36 @@ struct metric_result {
 	double score;                                   /**< total score							*/
 	enum rspamd_metric_action action;				/**< the current action						*/
 	GHashTable *symbols;                            /**< symbols of metric						*/
+	struct symbol **symbols_by_id;                  /**< symbols of metric indexed by cache id	*/
+	guint nsymbols_by_id;                           /**< size of symbols_by_id					*/
 	GHashTable *sym_groups;							/**< groups of symbols						*/
 	gboolean checked;                               /**< whether metric result is consolidated  */
 	double grow_factor;                             /**< current grow factor					*/
 };
 
 
+/**
+ * Settings of a metric compiled from a settings object
+ */
+struct rspamd_metric_settings {
+	struct metric *metric;
+	gdouble actions[METRIC_ACTION_MAX];             /**< scores of actions						*/
+	gdouble *weights;                               /**< weights indexed by cache id			*/
+	guint8 *redefined;                              /**< bits of weights that are redefined	*/
+	guint nweights;                                 /**< size of weights						*/
+	GHashTable *symbols;                            /**< weights of symbols that are not cached	*/
+};
+
+/**
+ * Settings object compiled once and shared by all tasks it is applied to
+ */
+struct rspamd_settings {
+	ucl_object_t *obj;                              /**< source settings object				*/
+	gboolean whitelist;                             /**< whether messages are whitelisted		*/
+	GHashTable *metrics;                            /**< rspamd_metric_settings by metric		*/
+	ref_entry_t ref;
+};
+
 /**
  * Subr for composite expressions
  */
@@ -95,6 +121,25 @@ struct rspamd_composite {
 struct metric_result * rspamd_create_metric_result (struct rspamd_task *task,
 		const gchar *name);
 
+/**
+ * Compile settings object for the specified configuration
+ * @param cfg configuration
+ * @param obj settings object, it is referenced by the compiled settings
+ * @return new settings with refcount 1
+ */
+struct rspamd_settings * rspamd_settings_new (struct rspamd_config *cfg,
+		ucl_object_t *obj);
+
+/**
+ * Increase refcount of settings
+ */
+struct rspamd_settings * rspamd_settings_ref (struct rspamd_settings *settings);
+
+/**
+ * Decrease refcount of settings and destroy them if needed
+ */
+void rspamd_settings_unref (struct rspamd_settings *settings);
+
 /**
  * Process all filters
  * @param task worker's task that present message from user
@@ -108,12 +153,6 @@ gint rspamd_process_filters (struct rspamd_task *task);
  */
 void rspamd_process_statistics (struct rspamd_task *task);
 
-/**
- * Process message with statfiles threaded
- * @param data worker's task that present message from user
- */
-void rspamd_process_statistic_threaded (gpointer data, gpointer user_data);
-
 /**
  * Insert a result to task
  * @param task worker's task that present message from user
@@ -146,6 +185,19 @@ void rspamd_task_insert_result_single (struct rspamd_task *task,
  */
 void rspamd_make_composites (struct rspamd_task *task);
 
+/**
+ * Get the maximum change of a metric score that could be caused by removal
+ * of symbols weights by composites
+ * @param cfg config
+ * @param metric metric
+ * @param pos maximum increase of the score
+ * @param neg maximum decrease of the score (a negative value)
+ */
+void rspamd_composites_removed_weight (struct rspamd_config *cfg,
+	struct metric *metric,
+	gdouble *pos,
+	gdouble *neg);
+
 /**
  * Default consolidation function for metric, it get all symbols and multiply symbol
  * weight by some factor that is specified in config. Default factor is 1.
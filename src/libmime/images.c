@@ -25,6 +25,7 @@
 #include "images.h"
 #include "main.h"
 #include "message.h"
+#include "cryptobox.h"
 
 static const guint8 png_signature[] = {137, 80, 78, 71, 13, 10, 26, 10};
 static const guint8 jpg_sig1[] = {0xff, 0xd8};
@@ -32,21 +33,74 @@ static const guint8 jpg_sig2[] = {'J', 'F', 'I', 'F'};
 static const guint8 gif_signature[] = {'G', 'I', 'F', '8'};
 static const guint8 bmp_signature[] = {'B', 'M'};
 
-static void process_image (struct rspamd_task *task, struct mime_part *part);
+/* Base64 encoded bytes of a lazy image decoded to parse its header */
+#define IMAGE_HEAD_ENCODED_LEN 8192
 
+static gboolean process_image (struct rspamd_task *task,
+	struct mime_part *part, GByteArray *data);
+
+/*
+ * Decode the beginning of a lazy part without decoding the whole content
+ */
+static GByteArray *
+rspamd_image_decode_head (struct mime_part *part, gboolean *truncated)
+{
+	GMimeDataWrapper *wrapper;
+	GMimeStream *stream;
+	GByteArray *head;
+	gchar buf[IMAGE_HEAD_ENCODED_LEN];
+	gssize r;
+	gsize olen;
+
+	wrapper = g_mime_part_get_content_object (GMIME_PART (part->mime));
+
+	if (wrapper == NULL) {
+		return NULL;
+	}
+
+	stream = g_mime_data_wrapper_get_stream (wrapper);
+	g_mime_stream_reset (stream);
+	r = g_mime_stream_read (stream, buf, sizeof (buf));
+	g_mime_stream_reset (stream);
+
+	if (r <= 0) {
+		return NULL;
+	}
+
+	olen = r / 4 * 3 + 3;
+	head = g_byte_array_sized_new (olen);
+	rspamd_cryptobox_base64_decode (buf, r, head->data, &olen);
+	head->len = olen;
+	*truncated = (r == sizeof (buf));
+
+	return head;
+}
 
 void
 process_images (struct rspamd_task *task)
 {
 	GList *cur;
 	struct mime_part *part;
+	GByteArray *head;
+	gboolean truncated;
 
 	cur = task->parts;
 	while (cur) {
 		part = cur->data;
-		if (g_mime_content_type_is_type (part->type, "image",
-			"*") && part->content->len > 0) {
-			process_image (task, part);
+		if (g_mime_content_type_is_type (part->type, "image", "*")) {
+			if (part->lazy &&
+					(head = rspamd_image_decode_head (part, &truncated)) != NULL) {
+				/* Header can be beyond the decoded data, e.g. after exif */
+				if (!process_image (task, part, head) && truncated) {
+					process_image (task, part,
+							rspamd_mime_part_get_content (part));
+				}
+
+				g_byte_array_free (head, TRUE);
+			}
+			else if (part->content->len > 0) {
+				process_image (task, part, part->content);
+			}
 		}
 		cur = g_list_next (cur);
 	}
@@ -84,7 +138,8 @@ detect_image_type (GByteArray *data)
 
 
 static struct rspamd_image *
-process_png_image (struct rspamd_task *task, GByteArray *data)
+process_png_image (struct rspamd_task *task, struct mime_part *part,
+	GByteArray *data)
 {
 	struct rspamd_image *img;
 	guint32 t;
@@ -105,7 +160,7 @@ process_png_image (struct rspamd_task *task, GByteArray *data)
 
 	img = rspamd_mempool_alloc (task->task_pool, sizeof (struct rspamd_image));
 	img->type = IMAGE_TYPE_PNG;
-	img->data = data;
+	img->part = part;
 
 	p += 4;
 	memcpy (&t, p, sizeof (guint32));
@@ -118,7 +173,8 @@ process_png_image (struct rspamd_task *task, GByteArray *data)
 }
 
 static struct rspamd_image *
-process_jpg_image (struct rspamd_task *task, GByteArray *data)
+process_jpg_image (struct rspamd_task *task, struct mime_part *part,
+	GByteArray *data)
 {
 	guint8 *p;
 	guint16 t;
@@ -127,7 +183,7 @@ process_jpg_image (struct rspamd_task *task, GByteArray *data)
 
 	img = rspamd_mempool_alloc (task->task_pool, sizeof (struct rspamd_image));
 	img->type = IMAGE_TYPE_JPG;
-	img->data = data;
+	img->part = part;
 
 	p = data->data;
 	remain = data->len;
@@ -148,7 +204,8 @@ process_jpg_image (struct rspamd_task *task, GByteArray *data)
 }
 
 static struct rspamd_image *
-process_gif_image (struct rspamd_task *task, GByteArray *data)
+process_gif_image (struct rspamd_task *task, struct mime_part *part,
+	GByteArray *data)
 {
 	struct rspamd_image *img;
 	guint8 *p;
@@ -161,7 +218,7 @@ process_gif_image (struct rspamd_task *task, GByteArray *data)
 
 	img = rspamd_mempool_alloc (task->task_pool, sizeof (struct rspamd_image));
 	img->type = IMAGE_TYPE_GIF;
-	img->data = data;
+	img->part = part;
 
 	p = data->data + 6;
 	memcpy (&t, p,	   sizeof (guint16));
@@ -173,7 +230,8 @@ process_gif_image (struct rspamd_task *task, GByteArray *data)
 }
 
 static struct rspamd_image *
-process_bmp_image (struct rspamd_task *task, GByteArray *data)
+process_bmp_image (struct rspamd_task *task, struct mime_part *part,
+	GByteArray *data)
 {
 	struct rspamd_image *img;
 	gint32 t;
@@ -188,7 +246,7 @@ process_bmp_image (struct rspamd_task *task, GByteArray *data)
 
 	img = rspamd_mempool_alloc (task->task_pool, sizeof (struct rspamd_image));
 	img->type = IMAGE_TYPE_BMP;
-	img->data = data;
+	img->part = part;
 	p = data->data + 18;
 	memcpy (&t, p,	   sizeof (gint32));
 	img->width = abs (GINT32_FROM_LE (t));
@@ -198,24 +256,25 @@ process_bmp_image (struct rspamd_task *task, GByteArray *data)
 	return img;
 }
 
-static void
-process_image (struct rspamd_task *task, struct mime_part *part)
+static gboolean
+process_image (struct rspamd_task *task, struct mime_part *part,
+	GByteArray *data)
 {
 	enum known_image_types type;
 	struct rspamd_image *img = NULL;
-	if ((type = detect_image_type (part->content)) != IMAGE_TYPE_UNKNOWN) {
+	if ((type = detect_image_type (data)) != IMAGE_TYPE_UNKNOWN) {
 		switch (type) {
 		case IMAGE_TYPE_PNG:
-			img = process_png_image (task, part->content);
+			img = process_png_image (task, part, data);
 			break;
 		case IMAGE_TYPE_JPG:
-			img = process_jpg_image (task, part->content);
+			img = process_jpg_image (task, part, data);
 			break;
 		case IMAGE_TYPE_GIF:
-			img = process_gif_image (task, part->content);
+			img = process_gif_image (task, part, data);
 			break;
 		case IMAGE_TYPE_BMP:
-			img = process_bmp_image (task, part->content);
+			img = process_bmp_image (task, part, data);
 			break;
 		default:
 			img = NULL;
@@ -230,7 +289,11 @@ process_image (struct rspamd_task *task, struct mime_part *part)
 			task->message_id);
 		img->filename = part->filename;
 		task->images = g_list_prepend (task->images, img);
+
+		return TRUE;
 	}
+
+	return FALSE;
 }
 
 const gchar *
@@ -12,9 +12,11 @@ enum known_image_types {
 	IMAGE_TYPE_UNKNOWN = 9000
 };
 
+struct mime_part;
+
 struct rspamd_image {
 	enum known_image_types type;
-	GByteArray *data;
+	struct mime_part *part;     /**< use rspamd_mime_part_get_content for data */
 	guint32 width;
 	guint32 height;
 	const gchar *filename;
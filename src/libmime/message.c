@@ -30,13 +30,23 @@
 #include "html.h"
 #include "images.h"
 #include "utlist.h"
+#include "hash.h"
 #include "tokenizers/tokenizers.h"
 #include "libstemmer.h"
+#include "cryptobox.h"
 
 #include <iconv.h>
 
 #define RECURSION_LIMIT 30
 #define UTF8_CHARSET "UTF-8"
+/* Maximum number of charsets and idle descriptors per charset to cache */
+#define ICONV_CACHE_CHARSETS 64
+#define ICONV_CACHE_DESCRIPTORS 4
+/* Number of stems cached per language and maximum length of a cached word */
+#define STEM_CACHE_SIZE 8192
+#define STEM_CACHE_MAX_WORD 64
+/* Expected number of distinct headers in a mime part */
+#define MIME_PART_HEADERS_HINT 8
 
 #define SET_PART_RAW(part) ((part)->flags &= ~RSPAMD_MIME_PART_FLAG_UTF)
 #define SET_PART_UTF(part) ((part)->flags |= RSPAMD_MIME_PART_FLAG_UTF)
@@ -52,8 +62,8 @@ strip_html_tags (struct rspamd_task *task,
 	gint br, i = 0, depth = 0, in_q = 0;
 	gint state = 0;
 	guint dlen;
+	gsize span;
 	GByteArray *buf;
-	GNode *level_ptr = NULL;
 	gboolean erase = FALSE, html_decode = FALSE;
 
 	if (stateptr)
@@ -70,6 +80,26 @@ strip_html_tags (struct rspamd_task *task,
 	br = 0;
 
 	while (i < (gint)src->len) {
+		if (state == 0 && depth == 0 && !in_q) {
+			/* Copy plain text up to the next tag or entity at once */
+			span = rspamd_html_text_span (p, src->len - i);
+
+			if (span > 0) {
+				if (!erase) {
+					memmove (rp, p, span);
+					rp += span;
+				}
+
+				p += span;
+				i += span;
+
+				if (i < (gint)src->len) {
+					c = *p;
+				}
+				continue;
+			}
+		}
+
 		switch (c) {
 		case '\0':
 			break;
@@ -136,8 +166,7 @@ unbreak_tag:
 						part,
 						tbegin,
 						p - tbegin,
-						end - tbegin,
-						&level_ptr);
+						end - tbegin);
 				break;
 
 			case 2:         /* PHP */
@@ -296,12 +325,48 @@ reg_char:
 	return buf;
 }
 
+/*
+ * Tokens of a received header are copied to a single buffer allocated for
+ * the whole header, they do not overlap in the header so the buffer of
+ * the header's length is enough
+ */
+struct rspamd_recv_tokens {
+	rspamd_mempool_t *pool;
+	gchar *buf;
+	gsize len;
+	gsize off;
+};
+
+static gchar *
+rspamd_recv_token (struct rspamd_recv_tokens *tok, const gchar *begin,
+	gsize len)
+{
+	gchar *res;
+
+	if (tok->buf == NULL) {
+		tok->buf = rspamd_mempool_alloc (tok->pool, tok->len);
+	}
+
+	if (tok->off + len + 1 > tok->len) {
+		res = rspamd_mempool_alloc (tok->pool, len + 1);
+	}
+	else {
+		res = tok->buf + tok->off;
+		tok->off += len + 1;
+	}
+
+	memcpy (res, begin, len);
+	res[len] = '\0';
+
+	return res;
+}
+
 static void
-parse_qmail_recv (rspamd_mempool_t * pool,
+parse_qmail_recv (struct rspamd_recv_tokens *tok,
 	gchar *line,
 	struct received_header *r)
 {
-	gchar *s, *p, t;
+	gchar *s, *p;
 
 	/* We are interested only with received from network headers */
 	if ((p = strstr (line, "from network")) == NULL) {
@@ -322,30 +387,26 @@ parse_qmail_recv (rspamd_mempool_t * pool,
 			return;
 		}
 		else {
-			*p = '\0';
-			r->real_ip = rspamd_mempool_strdup (pool, s);
-			*p = '/';
+			r->real_ip = rspamd_recv_token (tok, s, p - s);
 			/* Now try to parse hostname */
 			s = ++p;
 			while (g_ascii_isalnum (*p) || *p == '.' || *p == '-' || *p ==
 				'_') {
 				p++;
 			}
-			t = *p;
-			*p = '\0';
-			r->real_hostname = rspamd_mempool_strdup (pool, s);
-			*p = t;
+			r->real_hostname = rspamd_recv_token (tok, s, p - s);
 		}
 	}
 }
 
-static void
-parse_recv_header (rspamd_mempool_t * pool,
+void
+rspamd_message_parse_received (rspamd_mempool_t *pool,
 	struct raw_header *rh,
 	struct received_header *r)
 {
-	gchar *p, *s, t, **res = NULL;
+	gchar *p, *s, **res = NULL;
 	gchar *line;
+	struct rspamd_recv_tokens tok;
 	enum {
 		RSPAMD_RECV_STATE_INIT = 0,
 		RSPAMD_RECV_STATE_FROM,
@@ -367,6 +428,10 @@ parse_recv_header (rspamd_mempool_t * pool,
 	g_strstrip (line);
 	p = line;
 	s = line;
+	tok.pool = pool;
+	tok.buf = NULL;
+	tok.len = strlen (line) + 1;
+	tok.off = 0;
 
 	while (*p) {
 		switch (state) {
@@ -386,7 +451,7 @@ parse_recv_header (rspamd_mempool_t * pool,
 			}
 			else {
 				/* This can be qmail header, parse it separately */
-				parse_qmail_recv (pool, line, r);
+				parse_qmail_recv (&tok, line, r);
 				return;
 			}
 			break;
@@ -404,10 +469,7 @@ parse_recv_header (rspamd_mempool_t * pool,
 				p++;
 			}
 			else {
-				t = *p;
-				*p = '\0';
-				r->from_hostname = rspamd_mempool_strdup (pool, s);
-				*p = t;
+				r->from_hostname = rspamd_recv_token (&tok, s, p - s);
 				state = RSPAMD_RECV_STATE_SKIP_SPACES;
 				next_state = RSPAMD_RECV_STATE_IP_BLOCK;
 			}
@@ -476,9 +538,8 @@ parse_recv_header (rspamd_mempool_t * pool,
 								p++;
 							}
 							if (p > s) {
-								r->from_hostname = rspamd_mempool_alloc (pool,
-										p - s + 1);
-								rspamd_strlcpy (r->from_hostname, s, p - s + 1);
+								r->from_hostname = rspamd_recv_token (&tok, s,
+										p - s);
 							}
 						}
 						else if (p - s == 4 && memcmp (s, "port=", 5) == 0) {
@@ -508,10 +569,7 @@ parse_recv_header (rspamd_mempool_t * pool,
 					}
 					else {
 						/* Postfix style (hostname [ip]) */
-						t = *p;
-						*p = '\0';
-						r->real_hostname = rspamd_mempool_strdup (pool, s);
-						*p = t;
+						r->real_hostname = rspamd_recv_token (&tok, s, p - s);
 						/* Now parse ip */
 						p += 2;
 						s = p;
@@ -547,13 +605,10 @@ parse_recv_header (rspamd_mempool_t * pool,
 			else {
 				/* We got something like hostname */
 				if (p[1] != '\0') {
-					t = *p;
-					*p = '\0';
-					r->by_hostname = rspamd_mempool_strdup (pool, s);
-					*p = t;
+					r->by_hostname = rspamd_recv_token (&tok, s, p - s);
 				}
 				else {
-					r->by_hostname = rspamd_mempool_strdup (pool, s);
+					r->by_hostname = rspamd_recv_token (&tok, s, strlen (s));
 				}
 				/* Now end of parsing */
 				if (is_exim) {
@@ -584,9 +639,7 @@ parse_recv_header (rspamd_mempool_t * pool,
 				p++;
 			}
 			else {
-				*p = '\0';
-				*res = rspamd_mempool_strdup (pool, s);
-				*p = ']';
+				*res = rspamd_recv_token (&tok, s, p - s);
 				p++;
 				state = RSPAMD_RECV_STATE_SKIP_SPACES;
 			}
@@ -613,26 +666,68 @@ parse_recv_header (rspamd_mempool_t * pool,
 	return;
 }
 
+/* Interned names of headers, name -> id + 1 */
+static GHashTable *header_ids = NULL;
+static GPtrArray *header_names = NULL;
+
+guint
+rspamd_message_header_id (const gchar *name)
+{
+	gpointer id;
+	gchar *copy;
+
+	if (header_ids == NULL) {
+		header_ids = g_hash_table_new (rspamd_strcase_hash,
+				rspamd_strcase_equal);
+		header_names = g_ptr_array_new ();
+	}
+
+	id = g_hash_table_lookup (header_ids, name);
+
+	if (id != NULL) {
+		return GPOINTER_TO_UINT (id) - 1;
+	}
+
+	copy = g_strdup (name);
+	g_ptr_array_add (header_names, copy);
+	g_hash_table_insert (header_ids, copy,
+			GUINT_TO_POINTER (header_names->len));
+
+	return header_names->len - 1;
+}
+
 static void
-append_raw_header (GHashTable *target, struct raw_header *rh)
+append_raw_header (rspamd_pool_hash_t *target, struct raw_header **by_id,
+	guint nids, struct raw_header *rh)
 {
 	struct raw_header *lp;
+	gpointer id;
 
 	rh->next = NULL;
 	rh->prev = rh;
 	if ((lp =
-			g_hash_table_lookup (target, rh->name)) != NULL) {
+			rspamd_pool_hash_lookup (target, rh->name)) != NULL) {
 		DL_APPEND (lp, rh);
 	}
 	else {
-		g_hash_table_insert (target, rh->name, rh);
+		rspamd_pool_hash_insert (target, rh->name, rh);
+
+		if (by_id != NULL &&
+				(id = g_hash_table_lookup (header_ids, rh->name)) != NULL &&
+				GPOINTER_TO_UINT (id) <= nids) {
+			by_id[GPOINTER_TO_UINT (id) - 1] = rh;
+		}
 	}
 	debug_task ("add raw header %s: %s", rh->name, rh->value);
 }
 
-/* Convert raw headers to a list of struct raw_header * */
+/*
+ * Convert raw headers to a list of struct raw_header *, chains of headers
+ * with interned names are also stored in by_id array if it is not NULL
+ */
 static void
-process_raw_headers (GHashTable *target, rspamd_mempool_t *pool, const gchar *in)
+process_raw_headers (rspamd_pool_hash_t *target, struct raw_header **by_id,
+	guint nids, rspamd_mempool_t *pool, const gchar *in)
 {
 	struct raw_header *new = NULL;
 	const gchar *p, *c;
@@ -770,14 +865,14 @@ process_raw_headers (GHashTable *target, rspamd_mempool_t *pool, const gchar *in
 			new->decoded = g_mime_utils_header_decode_text (new->value);
 			rspamd_mempool_add_destructor (pool,
 					(rspamd_mempool_destruct_t)g_free, new->decoded);
-			append_raw_header (target, new);
+			append_raw_header (target, by_id, nids, new);
 			state = 0;
 			break;
 		case 5:
 			/* Header has only name, no value */
 			new->value = "";
 			new->decoded = NULL;
-			append_raw_header (target, new);
+			append_raw_header (target, by_id, nids, new);
 			state = 0;
 			break;
 		case 99:
@@ -902,6 +997,161 @@ converter_error_quark (void)
 	return g_quark_from_static_string ("conversion error");
 }
 
+/*
+ * Idle iconv descriptors (to utf8) indexed by charset, descriptors are taken
+ * from the cache for a conversion so tasks parsed in different threads never
+ * share the same descriptor
+ */
+static GHashTable *iconv_cache = NULL;
+G_LOCK_DEFINE_STATIC (iconv_cache);
+
+static iconv_t
+rspamd_iconv_get (const gchar *in_enc)
+{
+	GQueue *idle;
+	iconv_t ic = (iconv_t)-1;
+
+	G_LOCK (iconv_cache);
+
+	if (iconv_cache != NULL &&
+			(idle = g_hash_table_lookup (iconv_cache, in_enc)) != NULL &&
+			!g_queue_is_empty (idle)) {
+		ic = g_queue_pop_head (idle);
+	}
+
+	G_UNLOCK (iconv_cache);
+
+	if (ic == (iconv_t)-1) {
+		ic = iconv_open (UTF8_CHARSET, in_enc);
+	}
+
+	return ic;
+}
+
+static void
+rspamd_iconv_release (const gchar *in_enc, iconv_t ic)
+{
+	GQueue *idle;
+
+	/* Reset shift state for the next conversion */
+	iconv (ic, NULL, NULL, NULL, NULL);
+
+	G_LOCK (iconv_cache);
+
+	if (iconv_cache == NULL) {
+		iconv_cache = g_hash_table_new (rspamd_strcase_hash,
+				rspamd_strcase_equal);
+	}
+
+	idle = g_hash_table_lookup (iconv_cache, in_enc);
+
+	if (idle == NULL &&
+			g_hash_table_size (iconv_cache) < ICONV_CACHE_CHARSETS) {
+		idle = g_queue_new ();
+		g_hash_table_insert (iconv_cache, g_strdup (in_enc), idle);
+	}
+
+	if (idle != NULL && g_queue_get_length (idle) < ICONV_CACHE_DESCRIPTORS) {
+		g_queue_push_head (idle, ic);
+		ic = (iconv_t)-1;
+	}
+
+	G_UNLOCK (iconv_cache);
+
+	if (ic != (iconv_t)-1) {
+		iconv_close (ic);
+	}
+}
+
+/*
+ * Returns TRUE if the next 8 bytes have either a non-ASCII or zero byte
+ */
+static inline gboolean
+rspamd_text_word_special (const guchar *p)
+{
+	guint64 w;
+
+	memcpy (&w, p, sizeof (w));
+
+	return ((w & 0x8080808080808080ULL) ||
+			((w - 0x0101010101010101ULL) & ~w & 0x8080808080808080ULL));
+}
+
+/*
+ * Returns length of a prefix of text that contains printable ASCII
+ * characters only (zero bytes are not included)
+ */
+static gsize
+rspamd_text_ascii_prefix (const guchar *p, gsize len)
+{
+	const guchar *c = p, *end = p + len;
+
+	while (end - c >= 8 && !rspamd_text_word_special (c)) {
+		c += 8;
+	}
+
+	while (c < end && *c != 0 && *c < 0x80) {
+		c ++;
+	}
+
+	return c - p;
+}
+
+/*
+ * The same as g_utf8_validate with the specified length, ASCII runs are
+ * checked by words
+ */
+static gboolean
+rspamd_text_utf8_validate (const guchar *p, gsize len)
+{
+	const guchar *c = p, *end = p + len;
+	gunichar uc;
+
+	while (c < end) {
+		c += rspamd_text_ascii_prefix (c, end - c);
+
+		if (c == end) {
+			break;
+		}
+		else if (*c == 0) {
+			return FALSE;
+		}
+
+		uc = g_utf8_get_char_validated ((const gchar *)c, end - c);
+
+		if (uc == (gunichar) -1 || uc == (gunichar) -2) {
+			return FALSE;
+		}
+
+		c = (const guchar *)g_utf8_next_char (c);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Charsets where ASCII characters have the same encoding as in ASCII, so
+ * ASCII-only text needs no conversion
+ */
+static gboolean
+rspamd_charset_ascii_compatible (const gchar *charset)
+{
+	static const gchar *prefixes[] = {
+		"us-ascii", "ascii", "iso-8859", "iso8859", "iso_8859", "windows-",
+		"cp125", "koi8", "latin", "euc-", "gb2312", "gbk", "gb18030", "big5"
+	};
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (prefixes); i ++) {
+		if (g_ascii_strncasecmp (charset, prefixes[i],
+				strlen (prefixes[i])) == 0) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
 static gchar *
 rspamd_text_to_utf8 (struct rspamd_task *task,
 		gchar *input, gsize len, const gchar *in_enc,
@@ -912,7 +1162,7 @@ rspamd_text_to_utf8 (struct rspamd_task *task,
 	iconv_t ic;
 	gsize processed, ret;
 
-	ic = iconv_open (UTF8_CHARSET, in_enc);
+	ic = rspamd_iconv_get (in_enc);
 
 	if (ic == (iconv_t)-1) {
 		g_set_error (err, converter_error_quark(), EINVAL,
@@ -936,7 +1186,7 @@ rspamd_text_to_utf8 (struct rspamd_task *task,
 				g_set_error (err, converter_error_quark(), EINVAL,
 						"output of size %zd is not enough to handle "
 						"converison of %zd bytes", outlen, len);
-				iconv_close (ic);
+				rspamd_iconv_release (in_enc, ic);
 				return NULL;
 			case EILSEQ:
 			case EINVAL:
@@ -958,7 +1208,7 @@ rspamd_text_to_utf8 (struct rspamd_task *task,
 	*d = '\0';
 	*olen = d - res;
 
-	iconv_close (ic);
+	rspamd_iconv_release (in_enc, ic);
 
 	return res;
 }
@@ -996,7 +1246,7 @@ convert_text_to_utf (struct rspamd_task *task,
 
 	if (g_ascii_strcasecmp (ocharset,
 		"utf-8") == 0 || g_ascii_strcasecmp (ocharset, "utf8") == 0) {
-		if (g_utf8_validate (part_content->data, part_content->len, NULL)) {
+		if (rspamd_text_utf8_validate (part_content->data, part_content->len)) {
 			SET_PART_UTF (text_part);
 			return part_content;
 		}
@@ -1008,6 +1258,13 @@ convert_text_to_utf (struct rspamd_task *task,
 			return part_content;
 		}
 	}
+	else if (rspamd_charset_ascii_compatible (ocharset) &&
+			rspamd_text_ascii_prefix (part_content->data,
+					part_content->len) == part_content->len) {
+		/* ASCII text is valid utf8 in these charsets */
+		SET_PART_UTF (text_part);
+		return part_content;
+	}
 	else {
 		res_str = rspamd_text_to_utf8 (task, part_content->data,
 				part_content->len,
@@ -1129,104 +1386,315 @@ detect_text_language (struct mime_text_part *part)
 			{ "nqo", "", G_UNICODE_SCRIPT_NKO }
 	};
 	const struct language_match *lm;
-	const int max_chars = 32;
-
-	if (part != NULL) {
-		if (IS_PART_UTF (part)) {
-			/* Try to detect encoding by several symbols */
-			const gchar *p, *pp;
-			gunichar c;
-			gint32 remain = part->content->len, max = 0, processed = 0;
-			gint32 scripts[G_N_ELEMENTS (language_codes)];
-			GUnicodeScript scc, sel = G_UNICODE_SCRIPT_COMMON;
-
-			p = part->content->data;
-			memset (scripts, 0, sizeof (scripts));
-
-			while (remain > 0 && processed < max_chars) {
-				c = g_utf8_get_char_validated (p, remain);
-				if (c == (gunichar) -2 || c == (gunichar) -1) {
-					break;
-				}
-				if (g_unichar_isalpha (c)) {
-					scc = g_unichar_get_script (c);
-					if (scc < (gint)G_N_ELEMENTS (scripts)) {
-						scripts[scc]++;
+	guint32 max = 0, i;
+	GUnicodeScript sel = G_UNICODE_SCRIPT_COMMON;
+
+	if (part != NULL && part->chars != NULL && IS_PART_UTF (part)) {
+		/* The most used script of the whole part */
+		for (i = 0; i < G_N_ELEMENTS (part->chars->scripts); i ++) {
+			if (part->chars->scripts[i] > max) {
+				max = part->chars->scripts[i];
+				sel = i;
+			}
+		}
+
+		part->script = sel;
+		lm = bsearch (&sel, language_codes, G_N_ELEMENTS (language_codes),
+				sizeof (language_codes[0]), &language_elts_cmp);
+
+		if (lm != NULL) {
+			part->lang_code = lm->code;
+			part->language = lm->name;
+		}
+	}
+}
+
+/* Classes of bytes: not a letter, ASCII letter and non-ASCII character */
+#define TEXT_BYTE_CLASS(c) (((c) & 0x80) ? 2 : (g_ascii_isalpha (c) ? 1 : 0))
+
+const struct rspamd_text_part_chars *
+rspamd_mime_text_part_get_chars (struct rspamd_task *task,
+	struct mime_text_part *part)
+{
+	struct rspamd_text_part_chars *chars;
+	const guchar *p, *end;
+	guint cls, prev = 0, n;
+	gunichar uc;
+	GUnicodeScript scc;
+
+	if (part->chars != NULL || IS_PART_EMPTY (part) || part->content == NULL) {
+		return part->chars;
+	}
+
+	chars = rspamd_mempool_alloc0 (task->task_pool, sizeof (*chars));
+	chars->valid_utf = TRUE;
+	p = part->content->data;
+	end = p + part->content->len;
+
+	/*
+	 * Bytes are classified by a table lookup and only non-ASCII characters
+	 * are decoded, continuation bytes have the same class as the first one
+	 */
+	while (p < end) {
+		cls = TEXT_BYTE_CLASS (*p);
+
+		if (prev && cls) {
+			chars->letter_pairs ++;
+
+			if (prev != cls) {
+				chars->script_changes ++;
+			}
+		}
+
+		prev = cls;
+
+		if (cls != 2) {
+			if (cls == 1) {
+				chars->scripts[G_UNICODE_SCRIPT_LATIN] ++;
+				chars->letters ++;
+			}
+			else if (*p == '\n') {
+				chars->nlines ++;
+			}
+
+			p ++;
+			continue;
+		}
+
+		if (chars->valid_utf) {
+			uc = g_utf8_get_char_validated ((const gchar *)p, end - p);
+
+			if (uc == (gunichar) -2 || uc == (gunichar) -1) {
+				/* Scripts are not counted after invalid characters */
+				chars->valid_utf = FALSE;
+			}
+			else {
+				if (g_unichar_isalpha (uc)) {
+					scc = rspamd_unichar_get_script (uc);
+
+					if (scc < (gint)G_N_ELEMENTS (chars->scripts)) {
+						chars->scripts[scc] ++;
 					}
-					processed ++;
-				}
-				pp = g_utf8_next_char (p);
-				remain -= pp - p;
-				p = pp;
-			}
-			for (remain = 0; remain < (gint)G_N_ELEMENTS (scripts); remain++) {
-				if (scripts[remain] > max) {
-					max = scripts[remain];
-					sel = remain;
+
+					chars->letters ++;
 				}
-			}
-			part->script = sel;
-			lm = bsearch (&sel, language_codes, G_N_ELEMENTS (language_codes),
-					sizeof (language_codes[0]), &language_elts_cmp);
 
-			if (lm != NULL) {
-				part->lang_code = lm->code;
-				part->language = lm->name;
+				n = g_utf8_skip[*p];
+				chars->letter_pairs += n - 1;
+				p += n;
+				continue;
 			}
 		}
+
+		p ++;
 	}
+
+	part->chars = chars;
+
+	return chars;
+}
+
+/*
+ * Stemmer and its recent results for a language, stemmers are shared by all
+ * tasks of a worker, so they are used with the lock held
+ */
+struct rspamd_stem_cache {
+	struct sb_stemmer *stem;
+	rspamd_lru_hash_t *words;
+};
+
+static GHashTable *stem_caches = NULL;
+static guint64 *stem_cache_hits = NULL, *stem_cache_misses = NULL;
+G_LOCK_DEFINE_STATIC (stem_caches);
+
+void
+rspamd_mime_stem_cache_set_counters (guint64 *hits, guint64 *misses)
+{
+	stem_cache_hits = hits;
+	stem_cache_misses = misses;
+}
+
+/* Must be called with the lock held */
+static struct rspamd_stem_cache *
+rspamd_stem_cache_get (struct rspamd_task *task, const gchar *language)
+{
+	struct rspamd_stem_cache *cache;
+
+	if (stem_caches == NULL) {
+		stem_caches = g_hash_table_new (g_str_hash, g_str_equal);
+	}
+
+	cache = g_hash_table_lookup (stem_caches, language);
+
+	if (cache == NULL) {
+		cache = g_slice_alloc0 (sizeof (*cache));
+		cache->stem = sb_stemmer_new (language, "UTF_8");
+
+		if (cache->stem == NULL) {
+			msg_info ("<%s> cannot create lemmatizer for %s language",
+				task->message_id, language);
+		}
+		else {
+			cache->words = rspamd_lru_hash_new_full (STEM_CACHE_SIZE, 0,
+					g_free, g_free, g_str_hash, g_str_equal);
+		}
+
+		/* Languages are static strings */
+		g_hash_table_insert (stem_caches, (gpointer)language, cache);
+	}
+
+	return cache;
+}
+
+static const guchar *
+rspamd_stem_word (struct rspamd_stem_cache *cache, rspamd_fstring_t *w,
+		time_t now, guint64 *hits, guint64 *misses)
+{
+	gchar word[STEM_CACHE_MAX_WORD];
+	const guchar *r;
+
+	if (w->len >= sizeof (word)) {
+		return sb_stemmer_stem (cache->stem, w->begin, w->len);
+	}
+
+	memcpy (word, w->begin, w->len);
+	word[w->len] = '\0';
+
+	r = rspamd_lru_hash_lookup (cache->words, word, now);
+
+	if (r != NULL) {
+		(*hits) ++;
+	}
+	else {
+		r = sb_stemmer_stem (cache->stem, w->begin, w->len);
+
+		if (r != NULL) {
+			r = g_strdup (r);
+			rspamd_lru_hash_insert (cache->words, g_strdup (word),
+					(gpointer)r, now, 0);
+		}
+
+		(*misses) ++;
+	}
+
+	return r;
 }
 
 static void
 rspamd_normalize_text_part (struct rspamd_task *task,
 		struct mime_text_part *part)
 {
-	struct sb_stemmer *stem = NULL;
+	struct rspamd_stem_cache *cache = NULL;
 	rspamd_fstring_t *w;
 	const guchar *r;
 	guint i, nlen;
+	guint64 hits = 0, misses = 0;
+	time_t now;
 	GArray *tmp;
 
-	if (part->language && part->language[0] != '\0' && IS_PART_UTF (part)) {
-		stem = sb_stemmer_new (part->language, "UTF_8");
-		if (stem == NULL) {
-			msg_info ("<%s> cannot create lemmatizer for %s language",
-				task->message_id, part->language);
-		}
-	}
-
 	/* Ugly workaround */
 	tmp = rspamd_tokenize_text (part->content->data,
 			part->content->len, IS_PART_UTF (part), task->cfg->min_word_len,
 			part->urls_offset, FALSE);
 
-	if (tmp) {
-		for (i = 0; i < tmp->len; i ++) {
-			w = &g_array_index (tmp, rspamd_fstring_t, i);
-			if (stem) {
-				r = sb_stemmer_stem (stem, w->begin, w->len);
-			}
+	if (tmp == NULL) {
+		return;
+	}
+
+	if (part->language && part->language[0] != '\0' && IS_PART_UTF (part)) {
+		G_LOCK (stem_caches);
+		cache = rspamd_stem_cache_get (task, part->language);
+
+		if (cache->stem == NULL) {
+			G_UNLOCK (stem_caches);
+			cache = NULL;
+		}
+	}
+
+	now = time (NULL);
 
-			if (stem != NULL && r != NULL) {
-				nlen = strlen (r);
-				nlen = MIN (nlen, w->len);
-				memcpy (w->begin, r, nlen);
-				w->len = nlen;
+	for (i = 0; i < tmp->len; i ++) {
+		w = &g_array_index (tmp, rspamd_fstring_t, i);
+		r = NULL;
+
+		if (cache != NULL) {
+			r = rspamd_stem_word (cache, w, now, &hits, &misses);
+		}
+
+		if (r != NULL) {
+			nlen = strlen (r);
+			nlen = MIN (nlen, w->len);
+			memcpy (w->begin, r, nlen);
+			w->len = nlen;
+		}
+		else {
+			if (IS_PART_UTF (part) &&
+					rspamd_text_ascii_prefix ((const guchar *)w->begin,
+						w->len) != w->len) {
+				rspamd_str_lc_utf8 (w->begin, w->len);
 			}
 			else {
-				if (IS_PART_UTF (part)) {
-					rspamd_str_lc_utf8 (w->begin, w->len);
-				}
-				else {
-					rspamd_str_lc (w->begin, w->len);
-				}
+				rspamd_str_lc (w->begin, w->len);
 			}
 		}
-		part->normalized_words = tmp;
 	}
 
-	if (stem != NULL) {
-		sb_stemmer_delete (stem);
+	part->normalized_words = tmp;
+
+	if (cache != NULL) {
+		if (stem_cache_hits != NULL) {
+			*stem_cache_hits += hits;
+			*stem_cache_misses += misses;
+		}
+
+		G_UNLOCK (stem_caches);
+	}
+}
+
+GArray *
+rspamd_mime_text_part_get_words (struct rspamd_task *task,
+	struct mime_text_part *part)
+{
+	if (!(part->flags & RSPAMD_MIME_PART_FLAG_WORDS)) {
+		part->flags |= RSPAMD_MIME_PART_FLAG_WORDS;
+
+		if (!IS_PART_EMPTY (part) && part->content != NULL) {
+			part->words = rspamd_tokenize_text (part->content->data,
+					part->content->len, IS_PART_UTF (part),
+					task->cfg->min_word_len, part->urls_offset, TRUE);
+			task->lazy_words ++;
+		}
+	}
+
+	return part->words;
+}
+
+GArray *
+rspamd_mime_text_part_get_normalized_words (struct rspamd_task *task,
+	struct mime_text_part *part)
+{
+	if (!(part->flags & RSPAMD_MIME_PART_FLAG_NORMALIZED)) {
+		part->flags |= RSPAMD_MIME_PART_FLAG_NORMALIZED;
+
+		if (!IS_PART_EMPTY (part) && part->content != NULL) {
+			rspamd_normalize_text_part (task, part);
+			task->lazy_normalized ++;
+		}
+	}
+
+	return part->normalized_words;
+}
+
+void
+rspamd_mime_text_parts_prepare_words (struct rspamd_task *task)
+{
+	GList *cur;
+	struct mime_text_part *part;
+
+	for (cur = task->text_parts; cur != NULL; cur = g_list_next (cur)) {
+		part = cur->data;
+		rspamd_mime_text_part_get_words (task, part);
+		rspamd_mime_text_part_get_normalized_words (task, part);
 	}
 }
 
@@ -1239,8 +1707,7 @@ process_text_part (struct rspamd_task *task,
 	gboolean is_empty)
 {
 	struct mime_text_part *text_part;
-	const gchar *cd, *p, *c;
-	guint remain;
+	const gchar *cd;
 
 	/* Skip attachements */
 #ifndef GMIME24
@@ -1281,7 +1748,7 @@ process_text_part (struct rspamd_task *task,
 				text_part->orig,
 				type,
 				text_part);
-		text_part->html_nodes = NULL;
+		text_part->html = NULL;
 		text_part->parent = parent;
 		text_part->mime_part = mime_part;
 
@@ -1292,7 +1759,7 @@ process_text_part (struct rspamd_task *task,
 				part_content,
 				NULL);
 
-		if (text_part->html_nodes != NULL) {
+		if (text_part->html != NULL) {
 			decode_entitles (text_part->content->data,
 				&text_part->content->len);
 		}
@@ -1333,27 +1800,250 @@ process_text_part (struct rspamd_task *task,
 		return;
 	}
 
-	/* Post process part */
+	/*
+	 * Post process part, words are extracted and normalized on demand by
+	 * rspamd_mime_text_part_get_words and
+	 * rspamd_mime_text_part_get_normalized_words
+	 */
+	if (rspamd_mime_text_part_get_chars (task, text_part) != NULL) {
+		text_part->nlines = text_part->chars->nlines;
+	}
+
 	detect_text_language (text_part);
-	text_part->words = rspamd_tokenize_text (text_part->content->data,
-			text_part->content->len, IS_PART_UTF (text_part), task->cfg->min_word_len,
-			text_part->urls_offset, TRUE);
-	rspamd_normalize_text_part (task, text_part);
-
-	/* Calculate number of lines */
-	p = text_part->content->data;
-	remain = text_part->content->len;
-	c = p;
+}
+
+static struct mime_part *
+rspamd_mime_part_new (struct rspamd_task *task, GMimeObject *part,
+	GMimeContentType *type, GByteArray *content)
+{
+	struct mime_part *mime_part;
+	gchar *hdrs;
+
+	mime_part = rspamd_mempool_alloc (task->task_pool,
+			sizeof (struct mime_part));
+
+	hdrs = g_mime_object_get_headers (GMIME_OBJECT (part));
+	mime_part->raw_headers = rspamd_pool_hash_new (task->task_pool,
+			rspamd_strcase_hash, rspamd_strcase_equal, MIME_PART_HEADERS_HINT);
+	if (hdrs != NULL) {
+		process_raw_headers (mime_part->raw_headers, NULL, 0,
+				task->task_pool, hdrs);
+		g_free (hdrs);
+	}
+
+	mime_part->type = type;
+	mime_part->content = content;
+	mime_part->checksum = NULL;
+	mime_part->size = content->len;
+	mime_part->lazy = FALSE;
+	mime_part->parent = task->parser_parent_part;
+	mime_part->filename = g_mime_part_get_filename (GMIME_PART (part));
+	mime_part->mime = part;
+
+	debug_task ("found part with content-type: %s/%s",
+		type->type,
+		type->subtype);
+	task->parts = g_list_prepend (task->parts, mime_part);
+
+	return mime_part;
+}
+
+/*
+ * Binary parts of large messages are not decoded to memory: content is passed
+ * through MD5 filter to get a checksum for fuzzy checks
+ */
+static gboolean
+rspamd_mime_part_hash_large (struct rspamd_task *task, GMimeObject *part,
+	GMimeContentType *type, GMimeDataWrapper *wrapper)
+{
+	static const gchar hexdigits[] = "0123456789abcdef";
+	struct mime_part *mime_part;
+	GMimeStream *stream, *null_stream, *filter_stream;
+	GMimeFilter *md5;
+	guchar digest[16];
+	gint64 len;
+	guint i;
+
+	if (!(task->flags & RSPAMD_TASK_FLAG_LARGE) ||
+			g_mime_content_type_is_type (type, "text", "*") ||
+			g_mime_content_type_is_type (type, "message", "*")) {
+		return FALSE;
+	}
+
+	stream = g_mime_data_wrapper_get_stream (wrapper);
+
+	if (stream == NULL) {
+		return FALSE;
+	}
 
-	while (p != NULL && remain > 0) {
-		p = memchr (c, '\n', remain);
+	len = g_mime_stream_length (stream);
 
-		if (p != NULL) {
-			text_part->nlines ++;
-			remain -= p - c + 1;
-			c = p + 1;
+	if (len < 0 || (gsize)len <= task->cfg->large_part_size) {
+		return FALSE;
+	}
+
+	null_stream = g_mime_stream_null_new ();
+	filter_stream = g_mime_stream_filter_new (null_stream);
+	md5 = g_mime_filter_md5_new ();
+	g_mime_stream_filter_add (GMIME_STREAM_FILTER (filter_stream), md5);
+
+	if (g_mime_data_wrapper_write_to_stream (wrapper, filter_stream) == -1) {
+		msg_warn ("write to stream failed: %d, %s", errno, strerror (errno));
+		g_object_unref (md5);
+		g_object_unref (filter_stream);
+		g_object_unref (null_stream);
+
+		return FALSE;
+	}
+
+	g_mime_stream_flush (filter_stream);
+	g_mime_filter_md5_get_digest (GMIME_FILTER_MD5 (md5), digest);
+
+	mime_part = rspamd_mime_part_new (task, part, type, g_byte_array_new ());
+	mime_part->size = GMIME_STREAM_NULL (null_stream)->written;
+	mime_part->checksum = rspamd_mempool_alloc (task->task_pool,
+			sizeof (digest) * 2 + 1);
+
+	for (i = 0; i < sizeof (digest); i ++) {
+		mime_part->checksum[i * 2] = hexdigits[digest[i] >> 4];
+		mime_part->checksum[i * 2 + 1] = hexdigits[digest[i] & 0xf];
+	}
+
+	mime_part->checksum[i * 2] = '\0';
+
+	g_object_unref (md5);
+	g_object_unref (filter_stream);
+	g_object_unref (null_stream);
+
+	debug_task ("hashed part with content-type %s/%s without decoding",
+		type->type,
+		type->subtype);
+
+	return TRUE;
+}
+
+/*
+ * Base64 encoded images are decoded only when their content is required, their
+ * headers are decoded by images processing
+ */
+static gboolean
+rspamd_mime_part_is_lazy (GMimeContentType *type, GMimeDataWrapper *wrapper)
+{
+#ifdef GMIME24
+	return g_mime_content_type_is_type (type, "image", "*") &&
+		g_mime_data_wrapper_get_encoding (wrapper) ==
+		GMIME_CONTENT_ENCODING_BASE64 &&
+		g_mime_data_wrapper_get_stream (wrapper) != NULL;
+#else
+	return FALSE;
+#endif
+}
+
+/*
+ * Base64 and quoted-printable content is decoded by rspamd directly from the
+ * message buffer, NULL is returned if gmime filters should be used
+ */
+static GByteArray *
+rspamd_mime_part_decode (GMimeDataWrapper *wrapper)
+{
+#ifdef GMIME24
+	GMimeContentEncoding enc;
+	GMimeStream *stream, *top;
+	GByteArray *raw, *res;
+	gint64 start, end;
+	gsize olen;
+
+	enc = g_mime_data_wrapper_get_encoding (wrapper);
+
+	if (enc != GMIME_CONTENT_ENCODING_BASE64 &&
+			enc != GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE) {
+		return NULL;
+	}
+
+	stream = g_mime_data_wrapper_get_stream (wrapper);
+
+	if (stream == NULL) {
+		return NULL;
+	}
+
+	/* Substreams of the persistent message stream share its offsets */
+	for (top = stream; top->super_stream != NULL; top = top->super_stream);
+
+	if (!GMIME_IS_STREAM_MEM (top)) {
+		return NULL;
+	}
+
+	raw = g_mime_stream_mem_get_byte_array (GMIME_STREAM_MEM (top));
+
+	if (raw == NULL) {
+		return NULL;
+	}
+
+	start = stream->bound_start;
+	end = stream->bound_end == -1 ? (gint64)raw->len : stream->bound_end;
+
+	if (start < 0 || end < start || end > (gint64)raw->len) {
+		return NULL;
+	}
+
+	if (enc == GMIME_CONTENT_ENCODING_BASE64) {
+		olen = (end - start) / 4 * 3 + 3;
+		res = g_byte_array_sized_new (olen);
+		rspamd_cryptobox_base64_decode ((const gchar *)raw->data + start,
+				end - start, res->data, &olen);
+	}
+	else {
+		res = g_byte_array_sized_new (end - start);
+		olen = rspamd_decode_qp_buf ((const gchar *)raw->data + start,
+				end - start, (gchar *)res->data, end - start);
+	}
+
+	res->len = olen;
+
+	return res;
+#else
+	return NULL;
+#endif
+}
+
+GByteArray *
+rspamd_mime_part_get_content (struct mime_part *part)
+{
+	GMimeDataWrapper *wrapper;
+	GMimeStream *stream;
+	GByteArray *decoded;
+
+	if (!part->lazy) {
+		return part->content;
+	}
+
+	part->lazy = FALSE;
+	wrapper = g_mime_part_get_content_object (GMIME_PART (part->mime));
+
+	if (wrapper != NULL) {
+		if ((decoded = rspamd_mime_part_decode (wrapper)) != NULL) {
+			g_byte_array_free (part->content, TRUE);
+			part->content = decoded;
 		}
+		else {
+			stream = g_mime_stream_mem_new_with_byte_array (part->content);
+			g_mime_stream_mem_set_owner (GMIME_STREAM_MEM (stream), FALSE);
+
+			if (g_mime_data_wrapper_write_to_stream (wrapper, stream) == -1) {
+				msg_warn ("write to stream failed: %d, %s", errno,
+					strerror (errno));
+			}
+
+			g_object_unref (stream);
+		}
+#ifndef GMIME24
+		g_object_unref (wrapper);
+#endif
 	}
+
+	part->size = part->content->len;
+
+	return part->content;
 }
 
 #ifdef GMIME24
@@ -1457,54 +2147,43 @@ mime_foreach_callback (GMimeObject * part, gpointer user_data)
 #else
 		if (wrapper != NULL) {
 #endif
-			part_stream = g_mime_stream_mem_new ();
-			if (g_mime_data_wrapper_write_to_stream (wrapper,
-				part_stream) != -1) {
-				gchar *hdrs;
-
-				g_mime_stream_mem_set_owner (GMIME_STREAM_MEM (
-						part_stream), FALSE);
-				part_content = g_mime_stream_mem_get_byte_array (GMIME_STREAM_MEM (
-							part_stream));
-				g_object_unref (part_stream);
-				mime_part =
-					rspamd_mempool_alloc (task->task_pool,
-						sizeof (struct mime_part));
-
-				hdrs = g_mime_object_get_headers (GMIME_OBJECT (part));
-				mime_part->raw_headers = g_hash_table_new (rspamd_strcase_hash,
-						rspamd_strcase_equal);
-				rspamd_mempool_add_destructor (task->task_pool,
-					(rspamd_mempool_destruct_t) g_hash_table_destroy,
-					mime_part->raw_headers);
-				if (hdrs != NULL) {
-					process_raw_headers (mime_part->raw_headers,
-							task->task_pool, hdrs);
-					g_free (hdrs);
+			if (rspamd_mime_part_is_lazy (type, wrapper)) {
+				mime_part = rspamd_mime_part_new (task, part, type,
+						g_byte_array_new ());
+				mime_part->lazy = TRUE;
+			}
+			else if (!rspamd_mime_part_hash_large (task, part, type,
+					wrapper)) {
+				part_content = rspamd_mime_part_decode (wrapper);
+
+				if (part_content == NULL) {
+					part_stream = g_mime_stream_mem_new ();
+					if (g_mime_data_wrapper_write_to_stream (wrapper,
+						part_stream) != -1) {
+						g_mime_stream_mem_set_owner (GMIME_STREAM_MEM (
+								part_stream), FALSE);
+						part_content = g_mime_stream_mem_get_byte_array (
+								GMIME_STREAM_MEM (part_stream));
+					}
+					else {
+						msg_warn ("write to stream failed: %d, %s", errno,
+							strerror (errno));
+					}
+
+					g_object_unref (part_stream);
 				}
 
-				mime_part->type = type;
-				mime_part->content = part_content;
-				mime_part->parent = task->parser_parent_part;
-				mime_part->filename = g_mime_part_get_filename (GMIME_PART (
-							part));
-				mime_part->mime = part;
-
-				debug_task ("found part with content-type: %s/%s",
-					type->type,
-					type->subtype);
-				task->parts = g_list_prepend (task->parts, mime_part);
-				/* Skip empty parts */
-				process_text_part (task,
-					part_content,
-					type,
-					mime_part,
-					task->parser_parent_part,
-					(part_content->len <= 0));
-			}
-			else {
-				msg_warn ("write to stream failed: %d, %s", errno,
-					strerror (errno));
+				if (part_content != NULL) {
+					mime_part = rspamd_mime_part_new (task, part, type,
+							part_content);
+					/* Skip empty parts */
+					process_text_part (task,
+						part_content,
+						type,
+						mime_part,
+						task->parser_parent_part,
+						(part_content->len <= 0));
+				}
 			}
 #ifndef GMIME24
 			g_object_unref (wrapper);
@@ -1530,6 +2209,50 @@ destroy_message (void *pointer)
 	g_object_unref (msg);
 }
 
+/*
+ * Find headers of a message in its buffer, they are taken as is instead of
+ * being serialized by gmime. NULL is returned if the header block is not
+ * terminated by an empty line or contains zero bytes
+ */
+static const gchar *
+rspamd_message_headers_block (const gchar *begin, gsize len, gsize *hlen)
+{
+	const gchar *p = begin, *end = begin + len, *start;
+
+	/* Skip mbox separator */
+	if (len > 5 && memcmp (p, "From ", 5) == 0) {
+		if ((p = memchr (p, '\n', len)) == NULL) {
+			return NULL;
+		}
+
+		p ++;
+	}
+
+	start = p;
+
+	if (p < end && (*p == '\n' || *p == '\r')) {
+		/* No headers at all */
+		return NULL;
+	}
+
+	while (p < end && (p = memchr (p, '\n', end - p)) != NULL) {
+		p ++;
+
+		if (p < end && (*p == '\n' ||
+				(*p == '\r' && p + 1 < end && p[1] == '\n'))) {
+			if (memchr (start, '\0', p - start) != NULL) {
+				return NULL;
+			}
+
+			*hlen = p - start;
+
+			return start;
+		}
+	}
+
+	return NULL;
+}
+
 gint
 process_message (struct rspamd_task *task)
 {
@@ -1537,16 +2260,22 @@ process_message (struct rspamd_task *task)
 	GMimeParser *parser;
 	GMimeStream *stream;
 	GByteArray *tmp;
-	GList *first, *cur;
 	GMimePart *part;
 	GMimeDataWrapper *wrapper;
 	struct received_header *recv;
+	struct raw_header *rh;
+	struct rspamd_header_iter it;
+	guint received_id, subject_id;
 	gchar *mid, *url_str;
-	const gchar *url_end, *p, *end;
+	const gchar *url_end, *p, *end, *hdrs;
 	struct rspamd_url *subject_url;
 	gsize len;
 	gint rc, state = 0;
 
+	/* Names must be interned before headers are indexed */
+	received_id = rspamd_message_header_id ("Received");
+	subject_id = rspamd_message_header_id ("Subject");
+
 	tmp = rspamd_mempool_alloc (task->task_pool, sizeof (GByteArray));
 	tmp->data = (guint8 *)task->msg.start;
 	tmp->len = task->msg.len;
@@ -1558,12 +2287,25 @@ process_message (struct rspamd_task *task)
 	 */
 	g_mime_stream_mem_set_owner (GMIME_STREAM_MEM (stream), FALSE);
 
+	if (task->cfg->large_message_size > 0 &&
+			task->msg.len > task->cfg->large_message_size) {
+		msg_info ("<%s> message size %z is above %z, scan it with limits",
+			task->message_id, task->msg.len, task->cfg->large_message_size);
+		task->flags |= RSPAMD_TASK_FLAG_LARGE;
+	}
+
 	if (task->flags & RSPAMD_TASK_FLAG_MIME) {
 
 		debug_task ("construct mime parser from string length %d",
 			(gint)task->msg.len);
 		/* create a new parser object to parse the stream */
 		parser = g_mime_parser_new_with_stream (stream);
+		/*
+		 * Message data lives in task->msg for the whole task lifetime, so
+		 * let gmime keep references to the source stream instead of copying
+		 * the content of each part into its own buffer
+		 */
+		g_mime_parser_set_persist_stream (parser, TRUE);
 		g_object_unref (stream);
 
 		/* parse the message from the stream */
@@ -1602,42 +2344,55 @@ process_message (struct rspamd_task *task)
 			task->queue_id = "undef";
 		}
 
+		if ((hdrs = rspamd_message_headers_block (task->msg.start,
+				task->msg.len, &len)) != NULL) {
+			task->raw_headers_str = rspamd_mempool_alloc (task->task_pool,
+					len + 1);
+			rspamd_strlcpy (task->raw_headers_str, hdrs, len + 1);
+		}
+		else {
+			/* Let gmime reconstruct headers of a malformed message */
 #ifdef GMIME24
-		task->raw_headers_str =
-			g_mime_object_get_headers (GMIME_OBJECT (task->message));
+			task->raw_headers_str =
+				g_mime_object_get_headers (GMIME_OBJECT (task->message));
 #else
-		task->raw_headers_str = g_mime_message_get_headers (task->message);
+			task->raw_headers_str = g_mime_message_get_headers (task->message);
 #endif
+			if (task->raw_headers_str) {
+				rspamd_mempool_add_destructor (task->task_pool,
+						(rspamd_mempool_destruct_t) g_free,
+						task->raw_headers_str);
+			}
+		}
 
 		if (task->raw_headers_str) {
-			rspamd_mempool_add_destructor (task->task_pool,
-					(rspamd_mempool_destruct_t) g_free, task->raw_headers_str);
-			process_raw_headers (task->raw_headers, task->task_pool,
+			if (header_names != NULL && header_names->len > 0) {
+				task->raw_headers_ids = header_names->len;
+				task->raw_headers_by_id = rspamd_mempool_alloc0 (task->task_pool,
+						sizeof (struct raw_header *) * task->raw_headers_ids);
+			}
+
+			process_raw_headers (task->raw_headers, task->raw_headers_by_id,
+					task->raw_headers_ids, task->task_pool,
 					task->raw_headers_str);
 		}
 		process_images (task);
 
-		/* Parse received headers */
-		first =
-			message_get_header (task, "Received", FALSE);
-		cur = first;
-		while (cur) {
-			recv =
-				rspamd_mempool_alloc0 (task->task_pool,
-					sizeof (struct received_header));
-			parse_recv_header (task->task_pool, cur->data, recv);
-			task->received = g_list_prepend (task->received, recv);
-			cur = g_list_next (cur);
-		}
+		/* Received headers are parsed on demand */
+		task->received_pending = rspamd_message_header_first (task,
+				received_id, "Received", FALSE, &it);
 
 		/* Extract data from received header if we were not given IP */
-		if (task->received && (task->flags & RSPAMD_TASK_FLAG_NO_IP)) {
+		if ((task->flags & RSPAMD_TASK_FLAG_NO_IP) &&
+				rspamd_message_get_received (task, 1) != NULL) {
 			recv = task->received->data;
 			if (recv->real_ip) {
-				if (!rspamd_parse_inet_address (&task->from_addr, recv->real_ip)) {
+				task->from_addr = rspamd_parse_inet_address_pool (
+						recv->real_ip, task->task_pool);
+
+				if (task->from_addr == NULL) {
 					msg_warn ("cannot get IP from received header: '%s'",
 							recv->real_ip);
-					task->from_addr = NULL;
 				}
 			}
 			if (recv->real_hostname) {
@@ -1724,9 +2479,9 @@ process_message (struct rspamd_task *task)
 	}
 
 	/* Parse urls inside Subject header */
-	cur = message_get_header (task, "Subject", FALSE);
-	if (cur) {
-		p = cur->data;
+	rh = rspamd_message_header_first (task, subject_id, "Subject", FALSE, &it);
+	if (rh && (rh->decoded || rh->value)) {
+		p = rh->decoded ? rh->decoded : rh->value;
 		len = strlen (p);
 		end = p + len;
 
@@ -1776,7 +2531,7 @@ message_get_header (struct rspamd_task *task,
 	GList *gret = NULL;
 	struct raw_header *rh;
 
-	rh = g_hash_table_lookup (task->raw_headers, field);
+	rh = rspamd_pool_hash_lookup (task->raw_headers, field);
 
 	if (rh == NULL) {
 		return NULL;
@@ -1801,3 +2556,65 @@ message_get_header (struct rspamd_task *task,
 
 	return gret;
 }
+
+GList *
+rspamd_message_get_received (struct rspamd_task *task, guint limit)
+{
+	struct received_header *recv;
+	struct raw_header *rh;
+	guint n;
+
+	if (limit == 0 && task->cfg != NULL) {
+		limit = task->cfg->max_received_headers;
+	}
+
+	n = g_list_length (task->received);
+
+	while ((rh = task->received_pending) != NULL && (limit == 0 || n < limit)) {
+		task->received_pending = rh->next;
+		recv = rspamd_mempool_alloc0 (task->task_pool,
+				sizeof (struct received_header));
+		rspamd_message_parse_received (task->task_pool, rh, recv);
+		task->received = g_list_append (task->received, recv);
+		n ++;
+	}
+
+	return task->received;
+}
+
+struct raw_header *
+rspamd_message_header_next (struct rspamd_header_iter *it)
+{
+	struct raw_header *rh;
+
+	while ((rh = it->cur) != NULL) {
+		it->cur = rh->next;
+
+		if (!it->strong || strcmp (rh->name, it->field) == 0) {
+			return rh;
+		}
+	}
+
+	return NULL;
+}
+
+struct raw_header *
+rspamd_message_header_first (struct rspamd_task *task,
+	guint id,
+	const gchar *field,
+	gboolean strong,
+	struct rspamd_header_iter *it)
+{
+	it->field = field;
+	it->strong = strong;
+
+	if (id < task->raw_headers_ids) {
+		it->cur = task->raw_headers_by_id[id];
+	}
+	else {
+		/* Name has been interned after headers were processed */
+		it->cur = rspamd_pool_hash_lookup (task->raw_headers, field);
+	}
+
+	return rspamd_message_header_next (it);
+}
@@ -8,17 +8,21 @@
 
 #include "config.h"
 #include "fuzzy.h"
+#include "hash.h"
 
 struct rspamd_task;
 struct controller_session;
+struct html_content;
 
 struct mime_part {
 	GMimeContentType *type;
-	GByteArray *content;
+	GByteArray *content;        /**< use rspamd_mime_part_get_content if part is lazy */
 	GMimeObject *parent;
 	GMimeObject *mime;
-	GHashTable *raw_headers;
-	gchar *checksum;
+	rspamd_pool_hash_t *raw_headers;
+	gchar *checksum;            /**< MD5 of content if it is not decoded to memory */
+	gsize size;                 /**< size of decoded content					*/
+	gboolean lazy;              /**< content is not decoded yet					*/
 	const gchar *filename;
 };
 
@@ -26,12 +30,28 @@ struct mime_part {
 #define RSPAMD_MIME_PART_FLAG_BALANCED (1 << 1)
 #define RSPAMD_MIME_PART_FLAG_EMPTY (1 << 2)
 #define RSPAMD_MIME_PART_FLAG_HTML (1 << 3)
+/* Words of a part have been extracted */
+#define RSPAMD_MIME_PART_FLAG_WORDS (1 << 4)
+/* Normalized words of a part have been extracted */
+#define RSPAMD_MIME_PART_FLAG_NORMALIZED (1 << 5)
 
 #define IS_PART_EMPTY(part) ((part)->flags & RSPAMD_MIME_PART_FLAG_EMPTY)
 #define IS_PART_UTF(part) ((part)->flags & RSPAMD_MIME_PART_FLAG_UTF)
 #define IS_PART_RAW(part) (!((part)->flags & RSPAMD_MIME_PART_FLAG_UTF))
 #define IS_PART_HTML(part) ((part)->flags & RSPAMD_MIME_PART_FLAG_HTML)
 
+/*
+ * Characters of a text part counted by a single pass over its content
+ */
+struct rspamd_text_part_chars {
+	guint32 scripts[G_UNICODE_SCRIPT_NKO + 1];  /**< letters of each script (valid UTF only)	*/
+	guint32 letters;                            /**< number of letters (valid UTF only)		*/
+	guint32 letter_pairs;                       /**< adjacent bytes of ASCII letters or non-ASCII characters */
+	guint32 script_changes;                     /**< adjacent ASCII letter and non-ASCII bytes	*/
+	guint32 nlines;                             /**< number of newlines						*/
+	gboolean valid_utf;                         /**< content is valid UTF-8					*/
+};
+
 struct mime_text_part {
 	guint flags;
 	GUnicodeScript script;
@@ -40,15 +60,16 @@ struct mime_text_part {
 	const gchar *real_charset;
 	GByteArray *orig;
 	GByteArray *content;
-	GNode *html_nodes;
+	struct html_content *html;
 	GList *urls_offset;	/**< list of offsets of urls						*/
 	rspamd_fuzzy_t *fuzzy;
 	rspamd_fuzzy_t *double_fuzzy;
 	GMimeObject *parent;
 	struct mime_part *mime_part;
 	rspamd_fstring_t *diff_str;
-	GArray *words;
-	GArray *normalized_words;
+	GArray *words;              /**< use rspamd_mime_text_part_get_words		*/
+	GArray *normalized_words;   /**< use rspamd_mime_text_part_get_normalized_words */
+	struct rspamd_text_part_chars *chars; /**< use rspamd_mime_text_part_get_chars	*/
 	guint nlines;
 };
 
@@ -71,6 +92,13 @@ struct raw_header {
 	struct raw_header *prev, *next;
 };
 
+/* Iterator over headers with the same name */
+struct rspamd_header_iter {
+	struct raw_header *cur;
+	const gchar *field;
+	gboolean strong;
+};
+
 /**
  * Process message with all filters/statfiles, extract mime parts, urls and
  * call metrics consolidation functions
@@ -79,6 +107,57 @@ struct raw_header {
  */
 gint process_message (struct rspamd_task *task);
 
+/**
+ * Get words of a text part, words are extracted on the first call only
+ * @param task task object
+ * @param part text part
+ * @return array of rspamd_fstring_t or NULL
+ */
+GArray * rspamd_mime_text_part_get_words (struct rspamd_task *task,
+	struct mime_text_part *part);
+
+/**
+ * Get counters of characters of a text part, they are computed on the first
+ * call only and used by language detection, chartable and lua
+ * @param task task object
+ * @param part text part
+ * @return counters of characters or NULL for empty parts
+ */
+const struct rspamd_text_part_chars * rspamd_mime_text_part_get_chars (
+	struct rspamd_task *task, struct mime_text_part *part);
+
+/**
+ * Get normalized (stemmed or lowercased) words of a text part, words are
+ * normalized on the first call only
+ * @param task task object
+ * @param part text part
+ * @return array of rspamd_fstring_t or NULL
+ */
+GArray * rspamd_mime_text_part_get_normalized_words (struct rspamd_task *task,
+	struct mime_text_part *part);
+
+/**
+ * Extract words and normalized words of all text parts of a task, it must be
+ * called before the task is passed to another thread
+ * @param task task object
+ */
+void rspamd_mime_text_parts_prepare_words (struct rspamd_task *task);
+
+/**
+ * Get decoded content of a mime part, lazy parts are decoded on the first call
+ * @param part mime part
+ * @return content of the part
+ */
+GByteArray * rspamd_mime_part_get_content (struct mime_part *part);
+
+/**
+ * Set counters of hits and misses of the stems cache used by words
+ * normalization
+ * @param hits pointer to hits counter
+ * @param misses pointer to misses counter
+ */
+void rspamd_mime_stem_cache_set_counters (guint64 *hits, guint64 *misses);
+
 
 /*
  * Get a list of header's values with specified header's name using raw headers
@@ -91,4 +170,57 @@ GList * message_get_header (struct rspamd_task *task,
 	const gchar *field,
 	gboolean strong);
 
+/**
+ * Get parsed Received headers of a task in order of their appearance, headers
+ * are parsed on demand
+ * @param task worker task structure
+ * @param limit number of top headers required, 0 means `max_received_headers`
+ * of configuration which is unlimited by default
+ * @return list of struct received_header
+ */
+GList * rspamd_message_get_received (struct rspamd_task *task, guint limit);
+
+/**
+ * Parse a single Received header, strings of the result are allocated in
+ * a single chunk from the pool
+ * @param pool memory pool
+ * @param rh raw header, its decoded value is stripped by this function
+ * @param r parsed header
+ */
+void rspamd_message_parse_received (rspamd_mempool_t *pool,
+	struct raw_header *rh,
+	struct received_header *r);
+
+/**
+ * Get id of a header's name, names are interned case insensitively. Ids should
+ * be obtained when configuration is loaded, headers of tasks are indexed by
+ * ids that exist when a message is processed
+ * @param name header's name
+ * @return id of header's name
+ */
+guint rspamd_message_header_id (const gchar *name);
+
+/**
+ * Start iteration over headers with the specified name, unlike
+ * message_get_header this function does not allocate memory
+ * @param task worker task structure
+ * @param id id of header's name obtained by rspamd_message_header_id
+ * @param field header's name used for case sensitive comparison
+ * @param strong if this flag is TRUE header's name is case sensitive
+ * @param it iterator to initialize
+ * @return the first header found or NULL
+ */
+struct raw_header * rspamd_message_header_first (struct rspamd_task *task,
+	guint id,
+	const gchar *field,
+	gboolean strong,
+	struct rspamd_header_iter *it);
+
+/**
+ * Get the next header of iteration in order of appearance in a message
+ * @param it iterator
+ * @return the next header or NULL
+ */
+struct raw_header * rspamd_message_header_next (struct rspamd_header_iter *it);
+
 #endif
@@ -114,9 +114,12 @@ struct rspamd_regexp_atom {
 	gchar *regexp_text;                             /**< regexp text representation							*/
 	rspamd_regexp_t *regexp;                        /**< regexp structure									*/
 	gchar *header;                                  /**< header name for header regexps						*/
+	guint header_id;                                /**< interned id of header name							*/
 	gboolean is_test;                               /**< true if this expression must be tested				*/
 	gboolean is_strong;                             /**< true if headers search must be case sensitive		*/
 	gboolean is_multiple;                           /**< true if we need to match all inclusions of atom	*/
+	const gchar *re_class;                          /**< class of regexp for multi-pattern matching			*/
+	guint id;                                       /**< id of regexp in the regexps cache					*/
 };
 
 /**
@@ -498,6 +501,56 @@ rspamd_mime_expr_parse_function_atom (const gchar *input)
 	return res;
 }
 
+/*
+ * Assign id to regexp to cache its results per task. Regexps of the same class
+ * are matched against the same data, so they could also be matched at once by
+ * the multi-pattern engine
+ */
+static void
+rspamd_mime_expr_register_regexp (struct rspamd_config *cfg,
+		rspamd_mempool_t *pool, struct rspamd_regexp_atom *re)
+{
+	gchar class_name[512];
+
+	re->id = rspamd_re_cache_id (cfg->re_cache, re->regexp_text);
+
+	if (re->regexp == NULL || re->is_multiple || re->is_test) {
+		/* Multiple and test regexps are always matched by pcre */
+		return;
+	}
+
+	switch (re->type) {
+	case REGEXP_HEADER:
+	case REGEXP_RAW_HEADER:
+		if (re->header == NULL) {
+			return;
+		}
+		rspamd_snprintf (class_name, sizeof (class_name), "%s:%s:%d",
+				re->type == REGEXP_HEADER ? "header" : "rawheader",
+				re->header, re->is_strong);
+		break;
+	case REGEXP_MIME:
+		rspamd_strlcpy (class_name, "mime", sizeof (class_name));
+		break;
+	case REGEXP_MESSAGE:
+		rspamd_strlcpy (class_name, "message", sizeof (class_name));
+		break;
+	case REGEXP_URL:
+		rspamd_strlcpy (class_name, "url", sizeof (class_name));
+		break;
+	default:
+		return;
+	}
+
+	if (rspamd_re_cache_add (cfg->re_cache, class_name, re->regexp,
+			re->regexp_text)) {
+		re->re_class = rspamd_mempool_strdup (pool, class_name);
+	}
+	else {
+		re->re_class = NULL;
+	}
+}
+
 static rspamd_expression_atom_t *
 rspamd_mime_expr_parse (const gchar *line, gsize len,
 		rspamd_mempool_t *pool, gpointer ud, GError **err)
@@ -506,8 +559,10 @@ rspamd_mime_expr_parse (const gchar *line, gsize len,
 	struct rspamd_mime_atom *mime_atom = NULL;
 	const gchar *p, *end;
 	struct rspamd_config *cfg = ud;
+	struct expression_argument *arg;
 	gchar t;
 	gint type = MIME_ATOM_REGEXP, obraces = 0, ebraces = 0;
+	guint i;
 	enum {
 		in_header = 0,
 		got_slash,
@@ -612,6 +667,12 @@ rspamd_mime_expr_parse (const gchar *line, gsize len,
 			goto set;
 		}
 	}
+
+	if (state == in_header) {
+		/* Name at the end of expression is a lua function as well */
+		type = MIME_ATOM_LUA_FUNCTION;
+		state = end_atom;
+	}
 set:
 
 	if (p - line == 0 || (state != got_ebrace && state != got_second_slash &&
@@ -634,6 +695,13 @@ set:
 					mime_atom->str);
 			goto err;
 		}
+
+		if (mime_atom->d.re->header != NULL) {
+			mime_atom->d.re->header_id = rspamd_message_header_id (
+					mime_atom->d.re->header);
+		}
+
+		rspamd_mime_expr_register_regexp (cfg, pool, mime_atom->d.re);
 	}
 	else if (type == MIME_ATOM_LUA_FUNCTION) {
 		mime_atom->d.lua_function = mime_atom->str;
@@ -656,6 +724,17 @@ set:
 					mime_atom->str);
 			goto err;
 		}
+
+		/* Register regexps arguments to cache their results by id */
+		for (i = 0; i < mime_atom->d.func->args->len; i ++) {
+			arg = &g_array_index (mime_atom->d.func->args,
+					struct expression_argument, i);
+
+			if (arg->type == EXPRESSION_ARGUMENT_REGEXP) {
+				rspamd_re_cache_id (cfg->re_cache,
+						rspamd_regexp_get_pattern (arg->data));
+			}
+		}
 	}
 
 	a = rspamd_mempool_alloc (pool, sizeof (*a));
@@ -703,15 +782,33 @@ rspamd_mime_regexp_type_to_string (struct rspamd_regexp_atom *re)
 	return ret;
 }
 
+/*
+ * Returns maximum length of data scanned by regexps for a task or 0
+ */
+static gsize
+rspamd_mime_expr_data_limit (struct rspamd_task *task)
+{
+	gsize limit = max_re_data;
+
+	if ((task->flags & RSPAMD_TASK_FLAG_LARGE) &&
+			task->cfg->large_scan_size > 0 &&
+			(limit == 0 || task->cfg->large_scan_size < limit)) {
+		limit = task->cfg->large_scan_size;
+	}
+
+	return limit;
+}
+
 static gint
 rspamd_mime_regexp_element_process (struct rspamd_task *task,
 		struct rspamd_regexp_atom *re, const gchar *data, gsize len,
 		gboolean raw)
 {
+	gsize limit;
 	guint r = 0;
 	const gchar *start = NULL, *end = NULL;
 
-	if ((r = rspamd_task_re_cache_check (task, re->regexp_text)) !=
+	if ((r = rspamd_task_re_cache_check_id (task, re->id)) !=
 			RSPAMD_TASK_CACHE_NO_VALUE) {
 		debug_task ("%s regexp %s is found in cache, result: %d",
 				rspamd_mime_regexp_type_to_string (re), re->regexp_text, r);
@@ -728,8 +825,10 @@ rspamd_mime_regexp_element_process (struct rspamd_task *task,
 		len = strlen (data);
 	}
 
-	if (max_re_data > 0 && len > max_re_data) {
-		len = max_re_data;
+	limit = rspamd_mime_expr_data_limit (task);
+
+	if (limit > 0 && len > limit) {
+		len = limit;
 	}
 
 	while (rspamd_regexp_search (re->regexp, data, len, &start, &end, raw)) {
@@ -780,6 +879,159 @@ tree_url_callback (gpointer key, gpointer value, void *data)
 	}
 }
 
+static void
+rspamd_mime_expr_append_data (struct rspamd_task *task, GPtrArray *data,
+		GArray *lens, const gchar *in, gsize len)
+{
+	gsize limit = rspamd_mime_expr_data_limit (task);
+
+	if (limit > 0 && len > limit) {
+		len = limit;
+	}
+
+	g_ptr_array_add (data, (gpointer)in);
+	g_array_append_val (lens, len);
+}
+
+struct url_data_param {
+	struct rspamd_task *task;
+	GPtrArray *data;
+	GArray *lens;
+};
+
+static void
+tree_url_data_callback (gpointer key, gpointer value, void *data)
+{
+	struct url_data_param *param = data;
+	struct rspamd_url *url = value;
+	const gchar *in;
+
+	in = struri (url);
+	rspamd_mime_expr_append_data (param->task, param->data, param->lens, in,
+			strlen (in));
+}
+
+/*
+ * Raw regexps scan the end of a large message as well as its beginning
+ */
+static gboolean
+rspamd_mime_expr_tail_window (struct rspamd_task *task, const gchar **in,
+		gsize *len)
+{
+	gsize limit;
+
+	if (!(task->flags & RSPAMD_TASK_FLAG_LARGE)) {
+		return FALSE;
+	}
+
+	limit = rspamd_mime_expr_data_limit (task);
+
+	if (limit == 0 || task->msg.len <= limit) {
+		return FALSE;
+	}
+
+	*len = MIN (limit, task->msg.len - limit);
+	*in = task->msg.start + task->msg.len - *len;
+
+	return TRUE;
+}
+
+/*
+ * Collect all data for the class of regexp and match all regexps of this class
+ * at once
+ */
+static gboolean
+rspamd_mime_expr_process_class (struct rspamd_regexp_atom *re,
+		struct rspamd_task *task)
+{
+	GPtrArray *data;
+	GArray *lens;
+	struct url_data_param url_param;
+	GList *cur;
+	struct mime_text_part *part;
+	struct raw_header *rh;
+	struct rspamd_header_iter it;
+	const gchar *in;
+	gsize len;
+	gboolean ret;
+	gint span;
+
+	data = g_ptr_array_new ();
+	lens = g_array_new (FALSE, FALSE, sizeof (gsize));
+
+	switch (re->type) {
+	case REGEXP_HEADER:
+	case REGEXP_RAW_HEADER:
+		for (rh = rspamd_message_header_first (task, re->header_id,
+				re->header, re->is_strong, &it);
+				rh != NULL; rh = rspamd_message_header_next (&it)) {
+			if (re->type == REGEXP_RAW_HEADER) {
+				if (rh->value) {
+					rspamd_mime_expr_append_data (task, data, lens, rh->value,
+							strlen (rh->value));
+				}
+			}
+			else if (rh->decoded && g_utf8_validate (rh->decoded, -1, NULL)) {
+				rspamd_mime_expr_append_data (task, data, lens, rh->decoded,
+						strlen (rh->decoded));
+			}
+		}
+		break;
+	case REGEXP_MIME:
+		for (cur = task->text_parts; cur != NULL; cur = g_list_next (cur)) {
+			part = cur->data;
+
+			if (IS_PART_EMPTY (part)) {
+				continue;
+			}
+
+			if (!IS_PART_UTF (part)) {
+				rspamd_mime_expr_append_data (task, data, lens,
+						part->orig->data, part->orig->len);
+			}
+			else {
+				rspamd_mime_expr_append_data (task, data, lens,
+						part->content->data, part->content->len);
+			}
+		}
+		break;
+	case REGEXP_MESSAGE:
+		rspamd_mime_expr_append_data (task, data, lens, task->msg.start,
+				task->msg.len);
+
+		if (rspamd_mime_expr_tail_window (task, &in, &len)) {
+			rspamd_mime_expr_append_data (task, data, lens, in, len);
+		}
+		break;
+	case REGEXP_URL:
+		url_param.task = task;
+		url_param.data = data;
+		url_param.lens = lens;
+
+		if (task->urls) {
+			g_hash_table_foreach (task->urls, tree_url_data_callback,
+					&url_param);
+		}
+		if (task->emails) {
+			g_hash_table_foreach (task->emails, tree_url_data_callback,
+					&url_param);
+		}
+		break;
+	default:
+		break;
+	}
+
+	span = rspamd_task_span_start (task, "regexp", re->re_class);
+	ret = rspamd_re_cache_scan (task->cfg->re_cache, task, re->re_class,
+			(const guchar **)data->pdata, (gsize *)lens->data, data->len);
+	rspamd_task_span_end (task, span);
+
+	g_ptr_array_free (data, TRUE);
+	g_array_free (lens, TRUE);
+
+	return ret;
+}
+
 static gint
 rspamd_mime_expr_process_regexp (struct rspamd_regexp_atom *re,
 		struct rspamd_task *task)
@@ -789,7 +1041,8 @@ rspamd_mime_expr_process_regexp (struct rspamd_regexp_atom *re,
 	gboolean raw = FALSE;
 	const gchar *in;
 	gint ret = 0;
-	GList *cur, *headerlist;
+	guint cached;
+	GList *cur;
 	rspamd_regexp_t *regexp;
 	struct url_regexp_param callback_param = {
 		.task = task,
@@ -798,6 +1051,7 @@ rspamd_mime_expr_process_regexp (struct rspamd_regexp_atom *re,
 	};
 	struct mime_text_part *part;
 	struct raw_header *rh;
+	struct rspamd_header_iter it;
 
 	if (re == NULL) {
 		msg_info ("invalid regexp passed");
@@ -806,6 +1060,23 @@ rspamd_mime_expr_process_regexp (struct rspamd_regexp_atom *re,
 
 	callback_param.regexp = re->regexp;
 
+	if (re->re_class != NULL) {
+		if (rspamd_task_re_cache_check_id (task, re->id) ==
+				RSPAMD_TASK_CACHE_NO_VALUE) {
+			rspamd_mime_expr_process_class (re, task);
+		}
+
+		cached = rspamd_task_re_cache_check_id (task, re->id);
+
+		if (cached != RSPAMD_TASK_CACHE_NO_VALUE) {
+			debug_task ("%s regexp %s is matched by multi-pattern engine: %d",
+					rspamd_mime_regexp_type_to_string (re), re->regexp_text,
+					cached);
+			return cached;
+		}
+
+		/* Fallback to pcre */
+	}
 
 	switch (re->type) {
 	case REGEXP_NONE:
@@ -818,7 +1089,7 @@ rspamd_mime_expr_process_regexp (struct rspamd_regexp_atom *re,
 		if (re->header == NULL) {
 			msg_info ("header regexp without header name: '%s'",
 				re->regexp_text);
-			rspamd_task_re_cache_add (task, re->regexp_text, 0);
+			rspamd_task_re_cache_add_id (task, re->id, 0);
 			return 0;
 		}
 		debug_task ("checking %s header regexp: %s = %s",
@@ -826,11 +1097,10 @@ rspamd_mime_expr_process_regexp (struct rspamd_regexp_atom *re,
 			re->header,
 			re->regexp_text);
 
-		/* Get list of specified headers */
-		headerlist = message_get_header (task,
-				re->header,
-				re->is_strong);
-		if (headerlist == NULL) {
+		/* Get the first of specified headers */
+		rh = rspamd_message_header_first (task, re->header_id, re->header,
+				re->is_strong, &it);
+		if (rh == NULL) {
 			/* Header is not found */
 			if (G_UNLIKELY (re->is_test)) {
 				msg_info (
@@ -844,14 +1114,12 @@ rspamd_mime_expr_process_regexp (struct rspamd_regexp_atom *re,
 			if (re->regexp == NULL) {
 				debug_task ("regexp contains only header and it is found %s",
 					re->header);
-				rspamd_task_re_cache_add (task, re->regexp_text, 1);
+				rspamd_task_re_cache_add_id (task, re->id, 1);
 				ret = 1;
 			}
 			else {
 				/* Iterate through headers */
-				cur = headerlist;
-				while (cur) {
-					rh = cur->data;
+				while (rh) {
 					debug_task ("found header \"%s\" with value \"%s\"",
 							re->header, rh->decoded);
 					regexp = re->regexp;
@@ -864,7 +1132,7 @@ rspamd_mime_expr_process_regexp (struct rspamd_regexp_atom *re,
 						in = rh->decoded;
 						/* Validate input */
 						if (!in || !g_utf8_validate (in, -1, NULL)) {
-							cur = g_list_next (cur);
+							rh = rspamd_message_header_next (&it);
 							continue;
 						}
 					}
@@ -881,7 +1149,7 @@ rspamd_mime_expr_process_regexp (struct rspamd_regexp_atom *re,
 						}
 					}
 
-					cur = g_list_next (cur);
+					rh = rspamd_message_header_next (&it);
 				}
 			}
 		}
@@ -930,6 +1198,11 @@ rspamd_mime_expr_process_regexp (struct rspamd_regexp_atom *re,
 		clen = task->msg.len;
 
 		ret = rspamd_mime_regexp_element_process (task, re, ct, clen, raw);
+
+		if ((ret == 0 || re->is_multiple) &&
+				rspamd_mime_expr_tail_window (task, &in, &clen)) {
+			ret += rspamd_mime_regexp_element_process (task, re, in, clen, raw);
+		}
 		break;
 	case REGEXP_URL:
 		debug_task ("checking url regexp: %s", re->regexp_text);
@@ -960,7 +1233,7 @@ rspamd_mime_expr_process_regexp (struct rspamd_regexp_atom *re,
 			ret = 1;
 		}
 
-		rspamd_task_re_cache_add (task, re->regexp_text, ret);
+		rspamd_task_re_cache_add_id (task, re->id, ret);
 	}
 
 	return ret;
@@ -1082,7 +1355,7 @@ rspamd_mime_expr_process (gpointer input, rspamd_expression_atom_t *atom)
 				ret = lua_toboolean (L, -1);
 			}
 			else if (lua_type (L, -1) == LUA_TNUMBER) {
-				ret = lua_tonumber (L, 1);
+				ret = lua_tonumber (L, -1);
 			}
 			else {
 				msg_err ("%s returned wrong return type: %s",
@@ -1146,7 +1419,6 @@ gboolean
 rspamd_header_exists (struct rspamd_task * task, GArray * args, void *unused)
 {
 	struct expression_argument *arg;
-	GList *headerlist;
 
 	if (args == NULL || task == NULL) {
 		return FALSE;
@@ -1159,13 +1431,8 @@ rspamd_header_exists (struct rspamd_task * task, GArray * args, void *unused)
 	}
 
 	debug_task ("try to get header %s", (gchar *)arg->data);
-	headerlist = message_get_header (task,
-			(gchar *)arg->data,
-			FALSE);
-	if (headerlist) {
-		return TRUE;
-	}
-	return FALSE;
+
+	return rspamd_pool_hash_lookup (task->raw_headers, arg->data) != NULL;
 }
 
 /*
@@ -1174,16 +1441,43 @@ rspamd_header_exists (struct rspamd_task * task, GArray * args, void *unused)
  * its hashes and check for threshold, if value is greater than threshold, return TRUE
  * and return FALSE otherwise.
  */
+/*
+ * Cached distance between text parts, if diff is not greater than limit, then
+ * it is merely an upper bound of the real distance
+ */
+struct rspamd_parts_distance {
+	gint diff;
+	gint limit;
+};
+
+static gboolean
+rspamd_parts_distance_match (gint diff, gint threshold, gint threshold2)
+{
+	if (threshold2 > 0) {
+		if (diff >= MIN (threshold, threshold2) &&
+				diff < MAX (threshold, threshold2)) {
+			return TRUE;
+		}
+	}
+	else {
+		if (diff <= threshold) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
 gboolean
 rspamd_parts_distance (struct rspamd_task * task, GArray * args, void *unused)
 {
-	gint threshold, threshold2 = -1, diff;
+	gint threshold, threshold2 = -1, diff, limit;
 	struct mime_text_part *p1, *p2;
 	GList *cur;
 	struct expression_argument *arg;
 	GMimeObject *parent;
 	const GMimeContentType *ct;
-	gint *pdiff;
+	struct rspamd_parts_distance *pdiff;
 
 	if (args == NULL || args->len == 0) {
 		debug_task ("no threshold is specified, assume it 100");
@@ -1220,36 +1514,39 @@ rspamd_parts_distance (struct rspamd_task * task, GArray * args, void *unused)
 		}
 	}
 
+	/*
+	 * We need the exact distance merely if it is not less than the lowest
+	 * threshold, otherwise the result is known to be TRUE for a single
+	 * threshold and FALSE for a range
+	 */
+	if (threshold2 > 0) {
+		limit = MIN (threshold, threshold2) - 1;
+	}
+	else {
+		limit = threshold;
+	}
+
 	if ((pdiff =
 		rspamd_mempool_get_variable (task->task_pool,
 		"parts_distance")) != NULL) {
-		diff = *pdiff;
-		if (diff != -1) {
-			if (threshold2 > 0) {
-				if (diff >=
-					MIN (threshold,
-					threshold2) && diff < MAX (threshold, threshold2)) {
-					return TRUE;
-				}
-			}
-			else {
-				if (diff <= threshold) {
-					return TRUE;
-				}
-			}
+		diff = pdiff->diff;
+		if (diff == -1) {
 			return FALSE;
 		}
-		else {
-			return FALSE;
+		else if (diff > pdiff->limit || diff <= limit) {
+			/* The cached value is either exact or enough for this threshold */
+			return rspamd_parts_distance_match (diff, threshold, threshold2);
 		}
+		/* Otherwise we need to compute distance with a lower limit */
 	}
 
 	if (g_list_length (task->text_parts) == 2) {
 		cur = g_list_first (task->text_parts);
 		p1 = cur->data;
 		cur = g_list_next (cur);
-		pdiff = rspamd_mempool_alloc (task->task_pool, sizeof (gint));
-		*pdiff = -1;
+		pdiff = rspamd_mempool_alloc (task->task_pool, sizeof (*pdiff));
+		pdiff->diff = -1;
+		pdiff->limit = -1;
 
 		if (cur == NULL) {
 			msg_info ("bad parts list");
@@ -1288,8 +1585,9 @@ rspamd_parts_distance (struct rspamd_task * task, GArray * args, void *unused)
 		}
 		if (!IS_PART_EMPTY (p1) && !IS_PART_EMPTY (p2)) {
 			if (p1->diff_str != NULL && p2->diff_str != NULL) {
-				diff = rspamd_diff_distance_normalized (p1->diff_str,
-						p2->diff_str);
+				diff = rspamd_diff_distance_normalized_bounded (p1->diff_str,
+						p2->diff_str, limit);
+				pdiff->limit = limit;
 			}
 			else {
 				diff = rspamd_fuzzy_compare_parts (p1, p2);
@@ -1298,28 +1596,18 @@ rspamd_parts_distance (struct rspamd_task * task, GArray * args, void *unused)
 				"got likeliness between parts of %d%%, threshold is %d%%",
 				diff,
 				threshold);
-			*pdiff = diff;
+			pdiff->diff = diff;
 			rspamd_mempool_set_variable (task->task_pool,
 				"parts_distance",
 				pdiff,
 				NULL);
-			if (threshold2 > 0) {
-				if (diff >=
-					MIN (threshold,
-					threshold2) && diff < MAX (threshold, threshold2)) {
-					return TRUE;
-				}
-			}
-			else {
-				if (diff <= threshold) {
-					return TRUE;
-				}
-			}
+
+			return rspamd_parts_distance_match (diff, threshold, threshold2);
 		}
 		else if ((IS_PART_EMPTY (p1) &&
 			!IS_PART_EMPTY (p2)) || (!IS_PART_EMPTY (p1)&& IS_PART_EMPTY (p2))) {
 			/* Empty and non empty parts are different */
-			*pdiff = 0;
+			pdiff->diff = 0;
 			rspamd_mempool_set_variable (task->task_pool,
 				"parts_distance",
 				pdiff,
@@ -1655,28 +1943,6 @@ rspamd_is_html_balanced (struct rspamd_task * task, GArray * args, void *unused)
 
 }
 
-struct html_callback_data {
-	struct html_tag *tag;
-	gboolean *res;
-};
-
-static gboolean
-search_html_node_callback (GNode * node, gpointer data)
-{
-	struct html_callback_data *cd = data;
-	struct html_node *nd;
-
-	nd = node->data;
-	if (nd) {
-		if (nd->tag == cd->tag) {
-			*cd->res = TRUE;
-			return TRUE;
-		}
-	}
-
-	return FALSE;
-}
-
 gboolean
 rspamd_has_html_tag (struct rspamd_task * task, GArray * args, void *unused)
 {
@@ -1685,7 +1951,6 @@ rspamd_has_html_tag (struct rspamd_task * task, GArray * args, void *unused)
 	struct expression_argument *arg;
 	struct html_tag *tag;
 	gboolean res = FALSE;
-	struct html_callback_data cd;
 
 	if (args == NULL) {
 		msg_warn ("no parameters to function");
@@ -1706,18 +1971,12 @@ rspamd_has_html_tag (struct rspamd_task * task, GArray * args, void *unused)
 	}
 
 	cur = g_list_first (task->text_parts);
-	cd.res = &res;
-	cd.tag = tag;
 
 	while (cur && res == FALSE) {
 		p = cur->data;
-		if (!IS_PART_EMPTY (p) && IS_PART_HTML (p) && p->html_nodes) {
-			g_node_traverse (p->html_nodes,
-				G_PRE_ORDER,
-				G_TRAVERSE_ALL,
-				-1,
-				search_html_node_callback,
-				&cd);
+		if (!IS_PART_EMPTY (p) && IS_PART_HTML (p) && p->html &&
+				p->html->tags_count[tag->id] > 0) {
+			res = TRUE;
 		}
 		cur = g_list_next (cur);
 	}
@@ -1737,7 +1996,7 @@ rspamd_has_fake_html (struct rspamd_task * task, GArray * args, void *unused)
 
 	while (cur && res == FALSE) {
 		p = cur->data;
-		if (!IS_PART_EMPTY (p) && IS_PART_HTML (p) && p->html_nodes == NULL) {
+		if (!IS_PART_EMPTY (p) && IS_PART_HTML (p) && p->html == NULL) {
 			res = TRUE;
 		}
 		cur = g_list_next (cur);
@@ -1762,7 +2021,7 @@ rspamd_raw_header_exists (struct rspamd_task *task, GArray * args, void *unused)
 		return FALSE;
 	}
 
-	return g_hash_table_lookup (task->raw_headers, arg->data) != NULL;
+	return rspamd_pool_hash_lookup (task->raw_headers, arg->data) != NULL;
 }
 
 static gboolean
@@ -2234,18 +2493,23 @@ compare_subtype (struct rspamd_task *task, GMimeContentType * ct,
 static gboolean
 compare_len (struct mime_part *part, guint min, guint max)
 {
+	gsize len;
+
 	if (min == 0 && max == 0) {
 		return TRUE;
 	}
 
+	rspamd_mime_part_get_content (part);
+	len = part->size;
+
 	if (min == 0) {
-		return part->content->len <= max;
+		return len <= max;
 	}
 	else if (max == 0) {
-		return part->content->len >= min;
+		return len >= min;
 	}
 	else {
-		return part->content->len >= min && part->content->len <= max;
+		return len >= min && len <= max;
 	}
 }
 
@@ -129,6 +129,9 @@ parse_smtp_command (struct smtp_session *session,
 					else if (memcmp (cmd_buf, "VRFY", 4) == 0) {
 						pcmd->command = SMTP_COMMAND_VRFY;
 					}
+					else if (memcmp (cmd_buf, "BDAT", 4) == 0) {
+						pcmd->command = SMTP_COMMAND_BDAT;
+					}
 					else {
 						msg_info ("invalid command: %*s", 4, cmd_buf);
 						return FALSE;
@@ -337,6 +340,43 @@ parse_smtp_rcpt (struct smtp_session *session, struct smtp_command *cmd)
 
 }
 
+gboolean
+parse_smtp_bdat (struct smtp_session *session,
+	struct smtp_command *cmd,
+	gsize *size,
+	gboolean *last)
+{
+	rspamd_fstring_t *arg;
+	GList *cur = cmd->args;
+	gulong chunk_size;
+
+	if (cmd->args == NULL) {
+		session->error = SMTP_ERROR_BAD_ARGUMENTS;
+		return FALSE;
+	}
+	arg = cur->data;
+	/* First argument is the size of chunk */
+	if (!rspamd_strtoul (arg->begin, arg->len, &chunk_size)) {
+		session->error = SMTP_ERROR_BAD_ARGUMENTS;
+		return FALSE;
+	}
+	*size = chunk_size;
+	*last = FALSE;
+	/* Next one is optional LAST */
+	cur = g_list_next (cur);
+	if (cur != NULL) {
+		arg = cur->data;
+		if (arg->len != 4 || g_ascii_strncasecmp (arg->begin, "LAST", 4) != 0 ||
+			g_list_next (cur) != NULL) {
+			session->error = SMTP_ERROR_BAD_ARGUMENTS;
+			return FALSE;
+		}
+		*last = TRUE;
+	}
+
+	return TRUE;
+}
+
 /* Return -1 if there are some error, 1 if all is ok and 0 in case of incomplete reply */
 static gint
 check_smtp_ustream_reply (rspamd_fstring_t *in, gchar success_code)
@@ -587,7 +627,7 @@ smtp_upstream_read_socket (rspamd_fstring_t * in, void *arg)
 			}
 			session->errors++;
 			session->state = SMTP_STATE_RCPT;
-			return TRUE;
+			return smtp_process_pending_commands (session);
 		}
 		else if (r == 1) {
 			if (session->cur_rcpt != NULL) {
@@ -619,6 +659,7 @@ smtp_upstream_read_socket (rspamd_fstring_t * in, void *arg)
 			if (session->state == SMTP_STATE_WAIT_UPSTREAM) {
 				rspamd_dispatcher_restore (session->dispatcher);
 				session->state = SMTP_STATE_RCPT;
+				return smtp_process_pending_commands (session);
 			}
 		}
 		break;
@@ -642,6 +683,16 @@ smtp_upstream_read_socket (rspamd_fstring_t * in, void *arg)
 			return FALSE;
 		}
 		else if (r == 1) {
+			if (session->chunking) {
+				/* Message is received by chunks, so wait for the last one */
+				session->upstream_ready = TRUE;
+				rspamd_dispatcher_pause (session->upstream_dispatcher);
+				if (session->last_chunk &&
+					session->state == SMTP_STATE_WAIT_UPSTREAM) {
+					return process_smtp_data (session);
+				}
+				return TRUE;
+			}
 			if (!make_smtp_tempfile (session)) {
 				session->error = SMTP_ERROR_FILE;
 				session->state = SMTP_STATE_CRITICAL_ERROR;
@@ -670,6 +721,9 @@ smtp_upstream_read_socket (rspamd_fstring_t * in, void *arg)
 		session->error = rspamd_mempool_alloc (session->pool, in->len + 1);
 		rspamd_strlcpy (session->error, in->begin, in->len + 1);
 		session->state = SMTP_STATE_DATA;
+		session->chunking = FALSE;
+		session->last_chunk = FALSE;
+		session->upstream_ready = FALSE;
 		rspamd_dispatcher_restore (session->dispatcher);
 		if (!rspamd_dispatcher_write (session->dispatcher, session->error, 0,
 			FALSE, TRUE)) {
@@ -684,7 +738,7 @@ smtp_upstream_read_socket (rspamd_fstring_t * in, void *arg)
 			goto err;
 		}
 		session->upstream_state = SMTP_STATE_END;
-		return TRUE;
+		return smtp_process_pending_commands (session);
 		break;
 	case SMTP_STATE_END:
 		r = check_smtp_ustream_reply (in, '5');
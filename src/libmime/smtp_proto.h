@@ -16,6 +16,11 @@
 #define SMTP_ERROR_FILE "420 Service not available, filesystem error" CRLF
 #define SMTP_ERROR_OK "250 Requested mail action okay, completed" CRLF
 #define SMTP_ERROR_DATA_OK "354 Start mail input; end with <CRLF>.<CRLF>" CRLF
+#define SMTP_ERROR_CHUNK_OK "250 2.0.0 Chunk accepted" CRLF
+#define SMTP_ERROR_CHUNK_SIZE "552 5.3.4 Chunk is too large" CRLF
+
+/* Maximum size of a BDAT chunk as it is buffered in memory */
+#define SMTP_MAX_CHUNK_SIZE (32 * 1024 * 1024)
 
 #define DATA_END_TRAILER "." CRLF
 
@@ -36,7 +41,8 @@ struct smtp_command {
 		SMTP_COMMAND_DATA,
 		SMTP_COMMAND_VRFY,
 		SMTP_COMMAND_EXPN,
-		SMTP_COMMAND_HELP
+		SMTP_COMMAND_HELP,
+		SMTP_COMMAND_BDAT
 	} command;
 	GList *args;
 };
@@ -74,6 +80,14 @@ gboolean parse_smtp_from (struct smtp_session *session,
 gboolean parse_smtp_rcpt (struct smtp_session *session,
 	struct smtp_command *cmd);
 
+/*
+ * Parse BDAT command, size of chunk and LAST flag are returned
+ */
+gboolean parse_smtp_bdat (struct smtp_session *session,
+	struct smtp_command *cmd,
+	gsize *size,
+	gboolean *last);
+
 /* Upstream SMTP */
 
 /*
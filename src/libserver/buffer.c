@@ -31,13 +31,21 @@
 #include "utlist.h"
 
 #define G_DISPATCHER_ERROR dispatcher_error_quark ()
-#define debug_ip(...) rspamd_conditional_debug (rspamd_main->logger, \
-		NULL, \
-		__FUNCTION__, \
+/* Maximum number of buffers written by a single writev call */
+#define DISPATCHER_IOV_MAX 64
+/* Outputs larger than this are corked to be sent in full packets */
+#define DISPATCHER_CORK_SIZE 65536
+/* Number of free input buffers kept by each process */
+#define DISPATCHER_FREE_BUFFERS 64
+#define debug_ip(...) msg_debug_module (RSPAMD_LOG_MODULE_DISPATCHER, \
 		__VA_ARGS__)
 
 static void dispatcher_cb (gint fd, short what, void *arg);
 
+/* Input buffers of the default size released by closed dispatchers */
+static GTrashStack *free_buffers = NULL;
+static guint free_buffers_count = 0;
+
 static inline GQuark
 dispatcher_error_quark (void)
 {
@@ -191,6 +199,7 @@ sendfile_callback (rspamd_io_dispatcher_t *d)
 #define BUFREMAIN(x) (x)->data->size - ((x)->pos - (x)->data->begin)
 
 #define APPEND_OUT_BUFFER(d, buf) do {                  \
+		(buf)->pos = 0;                                      \
 		DL_APPEND ((d)->out_buffers.buffers, buf);           \
 		(d)->out_buffers.pending++;                        \
 } while (0)
@@ -201,31 +210,57 @@ sendfile_callback (rspamd_io_dispatcher_t *d)
 		(d)->out_buffers.pending--;                        \
 } while (0)
 
+static void
+dispatcher_set_cork (rspamd_io_dispatcher_t *d, gboolean cork)
+{
+#ifdef TCP_CORK
+	gint on = cork ? 1 : 0;
+
+	if (d->corked != cork) {
+		/* Fails silently for non TCP sockets */
+		(void)setsockopt (d->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof (on));
+		d->corked = cork;
+	}
+#endif
+}
+
 static gboolean
 write_buffers (gint fd, rspamd_io_dispatcher_t * d, gboolean is_delayed)
 {
 	GError *err = NULL;
 	struct rspamd_out_buffer_s *cur = NULL, *tmp;
-	ssize_t r;
-	struct iovec *iov;
-	guint i, len;
+	ssize_t r, written;
+	struct iovec iov[DISPATCHER_IOV_MAX];
+	gsize total;
+	guint i;
 
-	len = d->out_buffers.pending;
-	while (len > 0) {
+	while (d->out_buffers.pending > 0) {
 		/* Unset delayed as actually we HAVE buffers to write */
 		is_delayed = TRUE;
-		iov = g_slice_alloc (len * sizeof (struct iovec));
 		i = 0;
-		DL_FOREACH_SAFE (d->out_buffers.buffers, cur, tmp)
+		total = 0;
+
+		DL_FOREACH (d->out_buffers.buffers, cur)
 		{
-			iov[i].iov_base = cur->data->str;
-			iov[i].iov_len = cur->data->len;
+			if (i == DISPATCHER_IOV_MAX) {
+				break;
+			}
+
+			iov[i].iov_base = cur->data->str + cur->pos;
+			iov[i].iov_len = cur->data->len - cur->pos;
+			total += iov[i].iov_len;
 			i++;
 		}
+
+		if (i > 1 && (total >= DISPATCHER_CORK_SIZE ||
+				i < d->out_buffers.pending)) {
+			/* Large output is sent by several calls */
+			dispatcher_set_cork (d, TRUE);
+		}
+
 		/* Now try to write the whole vector */
-		r = writev (fd, iov, len);
+		r = writev (fd, iov, i);
 		if (r == -1 && errno != EAGAIN) {
-			g_slice_free1 (len * sizeof (struct iovec), iov);
 			if (d->err_callback) {
 				err =
 					g_error_new (G_DISPATCHER_ERROR, errno, "%s", strerror (
@@ -235,23 +270,23 @@ write_buffers (gint fd, rspamd_io_dispatcher_t * d, gboolean is_delayed)
 			}
 		}
 		else if (r > 0) {
+			written = r;
 			/* Find pos inside buffers */
 			DL_FOREACH_SAFE (d->out_buffers.buffers, cur, tmp)
 			{
-				if (r >= (ssize_t)cur->data->len) {
+				if (r >= (ssize_t)(cur->data->len - cur->pos)) {
 					/* Mark this buffer as read */
-					r -= cur->data->len;
+					r -= cur->data->len - cur->pos;
 					DELETE_OUT_BUFFER (d, cur);
 				}
 				else {
 					/* This buffer was not written completely */
-					g_string_erase (cur->data, 0, r);
+					cur->pos += r;
 					break;
 				}
 			}
-			g_slice_free1 (len * sizeof (struct iovec), iov);
-			if (d->out_buffers.pending > 0) {
-				/* Wait for other event */
+			if (d->out_buffers.pending > 0 && (gsize)written < total) {
+				/* Socket buffer is full, wait for other event */
 				event_del (d->ev);
 				event_set (d->ev, fd, EV_WRITE, dispatcher_cb, (void *)d);
 				event_base_set (d->ev_base, d->ev);
@@ -261,7 +296,6 @@ write_buffers (gint fd, rspamd_io_dispatcher_t * d, gboolean is_delayed)
 		}
 		else if (r == 0) {
 			/* Got EOF while we wait for data */
-			g_slice_free1 (len * sizeof (struct iovec), iov);
 			if (d->err_callback) {
 				err = g_error_new (G_DISPATCHER_ERROR, EOF, "got EOF");
 				d->err_callback (err, d->user_data);
@@ -269,7 +303,6 @@ write_buffers (gint fd, rspamd_io_dispatcher_t * d, gboolean is_delayed)
 			}
 		}
 		else if (r == -1 && errno == EAGAIN) {
-			g_slice_free1 (len * sizeof (struct iovec), iov);
 			debug_ip ("partially write data, retry");
 			/* Wait for other event */
 			event_del (d->ev);
@@ -278,13 +311,13 @@ write_buffers (gint fd, rspamd_io_dispatcher_t * d, gboolean is_delayed)
 			event_add (d->ev, d->tv);
 			return TRUE;
 		}
-		len = d->out_buffers.pending;
 	}
 
 	if (d->out_buffers.pending == 0) {
 		/* Disable write event for this time */
 
 		debug_ip ("all buffers were written successfully");
+		dispatcher_set_cork (d, FALSE);
 
 		if (is_delayed && d->write_callback) {
 			if (!d->write_callback (d->user_data)) {
@@ -309,6 +342,47 @@ write_buffers (gint fd, rspamd_io_dispatcher_t * d, gboolean is_delayed)
 	return TRUE;
 }
 
+/*
+ * All dispatchers use the same default size of input buffers, so buffers of
+ * closed dispatchers are reused instead of allocating them from new pools
+ */
+static rspamd_fstring_t *
+dispatcher_buffer_alloc (gsize size)
+{
+	rspamd_fstring_t *buf;
+
+	buf = g_trash_stack_pop (&free_buffers);
+
+	if (buf != NULL) {
+		free_buffers_count --;
+	}
+	else {
+		buf = g_malloc (sizeof (*buf) + size);
+	}
+
+	buf->begin = (gchar *)(buf + 1);
+	buf->size = size;
+	buf->len = 0;
+
+	return buf;
+}
+
+static void
+dispatcher_buffer_release (rspamd_io_dispatcher_t *d)
+{
+	if (d->in_buf_pooled) {
+		if (free_buffers_count < DISPATCHER_FREE_BUFFERS) {
+			g_trash_stack_push (&free_buffers, d->in_buf->data);
+			free_buffers_count ++;
+		}
+		else {
+			g_free (d->in_buf->data);
+		}
+
+		d->in_buf_pooled = FALSE;
+	}
+}
+
 static void
 read_buffers (gint fd, rspamd_io_dispatcher_t * d, gboolean skip_read)
 {
@@ -329,7 +403,8 @@ read_buffers (gint fd, rspamd_io_dispatcher_t * d, gboolean skip_read)
 		d->in_buf =
 			rspamd_mempool_alloc_tmp (d->pool, sizeof (rspamd_buffer_t));
 		if (d->policy == BUFFER_LINE || d->policy == BUFFER_ANY) {
-			d->in_buf->data = rspamd_fstralloc_tmp (d->pool, d->default_buf_size);
+			d->in_buf->data = dispatcher_buffer_alloc (d->default_buf_size);
+			d->in_buf_pooled = TRUE;
 		}
 		else {
 			d->in_buf->data = rspamd_fstralloc_tmp (d->pool, d->nchars + 1);
@@ -645,6 +720,7 @@ rspamd_remove_dispatcher (rspamd_io_dispatcher_t * d)
 		{
 			DELETE_OUT_BUFFER (d, cur);
 		}
+		dispatcher_buffer_release (d);
 		event_del (d->ev);
 		rspamd_mempool_delete (d->pool);
 		g_slice_free1 (sizeof (rspamd_io_dispatcher_t), d);
@@ -670,6 +746,7 @@ rspamd_set_dispatcher_policy (rspamd_io_dispatcher_t * d,
 					d->in_buf->data->len);
 				t = d->in_buf->pos - d->in_buf->data->begin;
 				tmp->len = d->in_buf->data->len;
+				dispatcher_buffer_release (d);
 				d->in_buf->data = tmp;
 				d->in_buf->pos = d->in_buf->data->begin + t;
 			}
@@ -681,6 +758,7 @@ rspamd_set_dispatcher_policy (rspamd_io_dispatcher_t * d,
 					d->in_buf->data->len);
 				t = d->in_buf->pos - d->in_buf->data->begin;
 				tmp->len = d->in_buf->data->len;
+				dispatcher_buffer_release (d);
 				d->in_buf->data = tmp;
 				d->in_buf->pos = d->in_buf->data->begin + t;
 			}
@@ -817,6 +895,8 @@ rspamd_dispacther_cleanup (rspamd_io_dispatcher_t *d)
 	{
 		DELETE_OUT_BUFFER (d, cur);
 	}
+	dispatcher_set_cork (d, FALSE);
+	dispatcher_buffer_release (d);
 	/* Cleanup temporary data */
 	rspamd_mempool_cleanup_tmp (d->pool);
 	d->in_buf = NULL;
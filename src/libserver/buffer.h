@@ -33,6 +33,7 @@ typedef struct rspamd_buffer_s {
 
 struct rspamd_out_buffer_s {
 	GString *data;
+	gsize pos;                                                      /**< bytes already written	*/
 	gboolean allocated;
 	struct rspamd_out_buffer_s *prev, *next;
 };
@@ -64,6 +65,8 @@ typedef struct rspamd_io_dispatcher_s {
 	gboolean is_restored;                                           /**< call a callback when dispatcher is restored */
 	gboolean half_closed;                                           /**< connection is half closed */
 	gboolean want_read;                                             /**< whether we want to read more data */
+	gboolean in_buf_pooled;                                         /**< input buffer is taken from the free list */
+	gboolean corked;                                                /**< TCP_CORK is set for a large output */
 	struct event_base *ev_base;                                     /**< event base for io operations */
 #ifndef HAVE_SENDFILE
 	void *map;
@@ -0,0 +1,670 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "cfg_cache.h"
+#include "blake2.h"
+#include <glob.h>
+
+/*
+ * Cache format, numbers are encoded as variable length integers (7 bits per
+ * byte, least significant first) and strings as length and bytes:
+ *
+ * magic, "version", "main file", number of sources,
+ * sources: kind (byte), "path", digest (BLAKE2B_OUTBYTES),
+ * the tree: type (byte), priority (byte) and value of each object,
+ * objects are stored as number of keys and pairs of "key" and object,
+ * values of implicit arrays are stored as separate pairs with the same key
+ */
+
+#define RSPAMD_CFG_CACHE_MAGIC "rcfgc001"
+#define RSPAMD_CFG_CACHE_MAX_DEPTH 128
+
+enum rspamd_config_source_kind {
+	RSPAMD_CFG_SOURCE_FILE = 0,
+	RSPAMD_CFG_SOURCE_MISSING,
+	RSPAMD_CFG_SOURCE_GLOB,
+};
+
+enum rspamd_config_cache_type {
+	RSPAMD_CFG_CACHE_NULL = 0,
+	RSPAMD_CFG_CACHE_OBJECT,
+	RSPAMD_CFG_CACHE_ARRAY,
+	RSPAMD_CFG_CACHE_INT,
+	RSPAMD_CFG_CACHE_FLOAT,
+	RSPAMD_CFG_CACHE_STRING,
+	RSPAMD_CFG_CACHE_BOOLEAN,
+	RSPAMD_CFG_CACHE_TIME,
+};
+
+struct rspamd_config_cache_source {
+	gchar *path;
+	enum rspamd_config_source_kind kind;
+	guchar digest[BLAKE2B_OUTBYTES];
+};
+
+struct rspamd_config_cache_sources {
+	gchar *filename;
+	GArray *sources;
+	gboolean disabled;
+};
+
+struct rspamd_config_cache_reader {
+	const guchar *p;
+	const guchar *end;
+};
+
+static gboolean
+rspamd_config_cache_file_digest (const gchar *path, guchar *digest)
+{
+	gchar *data;
+	gsize len;
+
+	if (!g_file_get_contents (path, &data, &len, NULL)) {
+		return FALSE;
+	}
+
+	blake2b (digest, data, NULL, BLAKE2B_OUTBYTES, len, 0);
+	g_free (data);
+
+	return TRUE;
+}
+
+/*
+ * Digest of a glob pattern covers names and content of all matched files
+ */
+static void
+rspamd_config_cache_glob_digest (const gchar *pattern, guchar *digest)
+{
+	glob_t globbuf;
+	blake2b_state st;
+	guchar file_digest[BLAKE2B_OUTBYTES];
+	gsize i;
+
+	blake2b_init (&st, BLAKE2B_OUTBYTES);
+	memset (&globbuf, 0, sizeof (globbuf));
+
+	if (glob (pattern, 0, NULL, &globbuf) == 0) {
+		/* Matches are sorted by glob */
+		for (i = 0; i < globbuf.gl_pathc; i ++) {
+			blake2b_update (&st, globbuf.gl_pathv[i],
+					strlen (globbuf.gl_pathv[i]) + 1);
+
+			if (rspamd_config_cache_file_digest (globbuf.gl_pathv[i],
+					file_digest)) {
+				blake2b_update (&st, file_digest, sizeof (file_digest));
+			}
+		}
+
+		globfree (&globbuf);
+	}
+
+	blake2b_final (&st, digest, BLAKE2B_OUTBYTES);
+}
+
+static void
+rspamd_config_cache_source_digest (struct rspamd_config_cache_source *s)
+{
+	memset (s->digest, 0, sizeof (s->digest));
+
+	if (s->kind == RSPAMD_CFG_SOURCE_GLOB) {
+		rspamd_config_cache_glob_digest (s->path, s->digest);
+	}
+	else if (rspamd_config_cache_file_digest (s->path, s->digest)) {
+		s->kind = RSPAMD_CFG_SOURCE_FILE;
+	}
+	else {
+		s->kind = RSPAMD_CFG_SOURCE_MISSING;
+	}
+}
+
+static void
+rspamd_config_cache_add_source (struct rspamd_config_cache_sources *src,
+	const gchar *path, gsize len, gboolean is_glob)
+{
+	struct rspamd_config_cache_source s;
+
+	s.path = g_strndup (path, len);
+	s.kind = is_glob ? RSPAMD_CFG_SOURCE_GLOB : RSPAMD_CFG_SOURCE_FILE;
+	rspamd_config_cache_source_digest (&s);
+	g_array_append_val (src->sources, s);
+}
+
+static void
+rspamd_config_cache_include_trace (const guchar *path, gsize len,
+	bool allow_glob, bool is_url, void *ud)
+{
+	struct rspamd_config_cache_sources *src = ud;
+	gboolean is_glob = FALSE;
+	gsize i;
+
+	if (is_url) {
+		/* Remote sources cannot be checked */
+		src->disabled = TRUE;
+		return;
+	}
+
+	if (allow_glob) {
+		for (i = 0; i < len; i ++) {
+			if (path[i] == '*' || path[i] == '?') {
+				is_glob = TRUE;
+				break;
+			}
+		}
+	}
+
+	rspamd_config_cache_add_source (src, path, len, is_glob);
+}
+
+struct rspamd_config_cache_sources *
+rspamd_config_cache_trace (struct ucl_parser *parser, const gchar *filename)
+{
+	struct rspamd_config_cache_sources *src;
+
+	src = g_slice_alloc0 (sizeof (*src));
+	src->filename = g_strdup (filename);
+	src->sources = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_config_cache_source));
+	rspamd_config_cache_add_source (src, filename, strlen (filename), FALSE);
+	ucl_parser_set_include_tracer (parser, rspamd_config_cache_include_trace,
+			src);
+
+	return src;
+}
+
+void
+rspamd_config_cache_disable (struct rspamd_config_cache_sources *src)
+{
+	src->disabled = TRUE;
+}
+
+void
+rspamd_config_cache_sources_free (struct rspamd_config_cache_sources *src)
+{
+	guint i;
+
+	for (i = 0; i < src->sources->len; i ++) {
+		g_free (g_array_index (src->sources,
+				struct rspamd_config_cache_source, i).path);
+	}
+
+	g_array_free (src->sources, TRUE);
+	g_free (src->filename);
+	g_slice_free1 (sizeof (*src), src);
+}
+
+static void
+rspamd_config_cache_write_varint (GByteArray *out, guint64 v)
+{
+	guint8 c;
+
+	do {
+		c = v & 0x7f;
+		v >>= 7;
+
+		if (v != 0) {
+			c |= 0x80;
+		}
+
+		g_byte_array_append (out, &c, 1);
+	} while (v != 0);
+}
+
+static void
+rspamd_config_cache_write_string (GByteArray *out, const gchar *str, gsize len)
+{
+	rspamd_config_cache_write_varint (out, len);
+	g_byte_array_append (out, (const guint8 *)str, len);
+}
+
+static gboolean
+rspamd_config_cache_write_object (GByteArray *out, const ucl_object_t *obj,
+	guint depth)
+{
+	const ucl_object_t *cur, *elt;
+	ucl_object_iter_t it = NULL;
+	const gchar *key;
+	gsize keylen;
+	guint64 n;
+	gint64 iv;
+	gdouble dv;
+	guint8 hdr[2];
+
+	if (depth > RSPAMD_CFG_CACHE_MAX_DEPTH) {
+		return FALSE;
+	}
+
+	hdr[1] = ucl_object_get_priority (obj);
+
+	switch (obj->type) {
+	case UCL_OBJECT:
+		hdr[0] = RSPAMD_CFG_CACHE_OBJECT;
+		g_byte_array_append (out, hdr, sizeof (hdr));
+		n = 0;
+
+		while ((cur = ucl_iterate_object (obj, &it, true)) != NULL) {
+			for (elt = cur; elt != NULL; elt = elt->next) {
+				n ++;
+			}
+		}
+
+		rspamd_config_cache_write_varint (out, n);
+		it = NULL;
+
+		while ((cur = ucl_iterate_object (obj, &it, true)) != NULL) {
+			for (elt = cur; elt != NULL; elt = elt->next) {
+				key = ucl_object_keyl (elt, &keylen);
+				rspamd_config_cache_write_string (out, key, keylen);
+
+				if (!rspamd_config_cache_write_object (out, elt, depth + 1)) {
+					return FALSE;
+				}
+			}
+		}
+		break;
+	case UCL_ARRAY:
+		hdr[0] = RSPAMD_CFG_CACHE_ARRAY;
+		g_byte_array_append (out, hdr, sizeof (hdr));
+		n = 0;
+
+		while ((cur = ucl_iterate_object (obj, &it, true)) != NULL) {
+			n ++;
+		}
+
+		rspamd_config_cache_write_varint (out, n);
+		it = NULL;
+
+		while ((cur = ucl_iterate_object (obj, &it, true)) != NULL) {
+			if (!rspamd_config_cache_write_object (out, cur, depth + 1)) {
+				return FALSE;
+			}
+		}
+		break;
+	case UCL_INT:
+		hdr[0] = RSPAMD_CFG_CACHE_INT;
+		g_byte_array_append (out, hdr, sizeof (hdr));
+		iv = ucl_object_toint (obj);
+		/* Zigzag encoding keeps small negative numbers short */
+		rspamd_config_cache_write_varint (out,
+				((guint64)iv << 1) ^ (guint64)(iv >> 63));
+		break;
+	case UCL_FLOAT:
+	case UCL_TIME:
+		hdr[0] = obj->type == UCL_FLOAT ?
+				RSPAMD_CFG_CACHE_FLOAT : RSPAMD_CFG_CACHE_TIME;
+		g_byte_array_append (out, hdr, sizeof (hdr));
+		dv = ucl_object_todouble (obj);
+		g_byte_array_append (out, (const guint8 *)&dv, sizeof (dv));
+		break;
+	case UCL_STRING:
+		hdr[0] = RSPAMD_CFG_CACHE_STRING;
+		g_byte_array_append (out, hdr, sizeof (hdr));
+		rspamd_config_cache_write_string (out, obj->value.sv, obj->len);
+		break;
+	case UCL_BOOLEAN:
+		hdr[0] = RSPAMD_CFG_CACHE_BOOLEAN;
+		g_byte_array_append (out, hdr, sizeof (hdr));
+		hdr[0] = ucl_object_toboolean (obj);
+		g_byte_array_append (out, hdr, 1);
+		break;
+	case UCL_NULL:
+		hdr[0] = RSPAMD_CFG_CACHE_NULL;
+		g_byte_array_append (out, hdr, sizeof (hdr));
+		break;
+	default:
+		/* Userdata cannot be serialized */
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_config_cache_save (const gchar *cache_file,
+	struct rspamd_config_cache_sources *src,
+	const ucl_object_t *top)
+{
+	struct rspamd_config_cache_source *s;
+	GByteArray *out;
+	gchar *tmp;
+	guint8 kind;
+	guint i;
+	gint fd;
+	gboolean ret = FALSE;
+
+	if (src->disabled) {
+		msg_info ("configuration is not cached as it has been read from URLs "
+				"or has maps includes");
+		return FALSE;
+	}
+
+	out = g_byte_array_sized_new (BUFSIZ);
+	g_byte_array_append (out, RSPAMD_CFG_CACHE_MAGIC,
+			sizeof (RSPAMD_CFG_CACHE_MAGIC) - 1);
+	rspamd_config_cache_write_string (out, RVERSION, sizeof (RVERSION) - 1);
+	rspamd_config_cache_write_string (out, src->filename,
+			strlen (src->filename));
+	rspamd_config_cache_write_varint (out, src->sources->len);
+
+	for (i = 0; i < src->sources->len; i ++) {
+		s = &g_array_index (src->sources, struct rspamd_config_cache_source, i);
+		kind = s->kind;
+		g_byte_array_append (out, &kind, 1);
+		rspamd_config_cache_write_string (out, s->path, strlen (s->path));
+		g_byte_array_append (out, s->digest, sizeof (s->digest));
+	}
+
+	if (!rspamd_config_cache_write_object (out, top, 0)) {
+		msg_info ("configuration is not cached as it has objects that "
+				"cannot be serialized");
+		g_byte_array_free (out, TRUE);
+
+		return FALSE;
+	}
+
+	/* Replace cache atomically, so readers never see a partial file */
+	tmp = g_strdup_printf ("%s.tmp%d", cache_file, (gint)getpid ());
+	fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 00600);
+
+	if (fd == -1) {
+		msg_err ("cannot create config cache %s: %s", tmp, strerror (errno));
+	}
+	else {
+		if (write (fd, out->data, out->len) != (gssize)out->len) {
+			msg_err ("cannot write config cache %s: %s", tmp, strerror (errno));
+			close (fd);
+			unlink (tmp);
+		}
+		else {
+			close (fd);
+
+			if (rename (tmp, cache_file) == -1) {
+				msg_err ("cannot rename %s to %s: %s", tmp, cache_file,
+						strerror (errno));
+				unlink (tmp);
+			}
+			else {
+				msg_info ("saved configuration cache to %s, %ud bytes, "
+						"%ud sources", cache_file, out->len, src->sources->len);
+				ret = TRUE;
+			}
+		}
+	}
+
+	g_free (tmp);
+	g_byte_array_free (out, TRUE);
+
+	return ret;
+}
+
+static gboolean
+rspamd_config_cache_read_varint (struct rspamd_config_cache_reader *rd,
+	guint64 *v)
+{
+	guint shift = 0;
+	guint8 c;
+
+	*v = 0;
+
+	do {
+		if (rd->p >= rd->end || shift > 63) {
+			return FALSE;
+		}
+
+		c = *rd->p++;
+		*v |= (guint64)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_config_cache_read_string (struct rspamd_config_cache_reader *rd,
+	const gchar **str, gsize *len)
+{
+	guint64 l;
+
+	if (!rspamd_config_cache_read_varint (rd, &l) ||
+			l > (guint64)(rd->end - rd->p)) {
+		return FALSE;
+	}
+
+	*str = (const gchar *)rd->p;
+	*len = l;
+	rd->p += l;
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_config_cache_read_bytes (struct rspamd_config_cache_reader *rd,
+	gpointer dst, gsize len)
+{
+	if ((gsize)(rd->end - rd->p) < len) {
+		return FALSE;
+	}
+
+	memcpy (dst, rd->p, len);
+	rd->p += len;
+
+	return TRUE;
+}
+
+static ucl_object_t *
+rspamd_config_cache_read_object (struct rspamd_config_cache_reader *rd,
+	guint depth)
+{
+	ucl_object_t *obj = NULL, *elt;
+	guint8 hdr[2];
+	guint64 n, i, v;
+	const gchar *str;
+	gsize len;
+	gdouble dv;
+
+	if (depth > RSPAMD_CFG_CACHE_MAX_DEPTH ||
+			!rspamd_config_cache_read_bytes (rd, hdr, sizeof (hdr))) {
+		return NULL;
+	}
+
+	switch (hdr[0]) {
+	case RSPAMD_CFG_CACHE_OBJECT:
+	case RSPAMD_CFG_CACHE_ARRAY:
+		if (!rspamd_config_cache_read_varint (rd, &n)) {
+			return NULL;
+		}
+
+		obj = ucl_object_typed_new (hdr[0] == RSPAMD_CFG_CACHE_OBJECT ?
+				UCL_OBJECT : UCL_ARRAY);
+
+		for (i = 0; i < n; i ++) {
+			str = NULL;
+			len = 0;
+
+			if (hdr[0] == RSPAMD_CFG_CACHE_OBJECT &&
+					!rspamd_config_cache_read_string (rd, &str, &len)) {
+				ucl_object_unref (obj);
+				return NULL;
+			}
+
+			elt = rspamd_config_cache_read_object (rd, depth + 1);
+
+			if (elt == NULL) {
+				ucl_object_unref (obj);
+				return NULL;
+			}
+
+			if (hdr[0] == RSPAMD_CFG_CACHE_OBJECT) {
+				/* Values with the same key form an implicit array */
+				ucl_object_insert_key (obj, elt, str, len, true);
+			}
+			else {
+				ucl_array_append (obj, elt);
+			}
+		}
+		break;
+	case RSPAMD_CFG_CACHE_INT:
+		if (!rspamd_config_cache_read_varint (rd, &v)) {
+			return NULL;
+		}
+
+		obj = ucl_object_fromint ((gint64)(v >> 1) ^ -(gint64)(v & 1));
+		break;
+	case RSPAMD_CFG_CACHE_FLOAT:
+	case RSPAMD_CFG_CACHE_TIME:
+		if (!rspamd_config_cache_read_bytes (rd, &dv, sizeof (dv))) {
+			return NULL;
+		}
+
+		obj = ucl_object_fromdouble (dv);
+
+		if (hdr[0] == RSPAMD_CFG_CACHE_TIME) {
+			obj->type = UCL_TIME;
+		}
+		break;
+	case RSPAMD_CFG_CACHE_STRING:
+		if (!rspamd_config_cache_read_string (rd, &str, &len)) {
+			return NULL;
+		}
+
+		obj = ucl_object_fromlstring (str, len);
+		break;
+	case RSPAMD_CFG_CACHE_BOOLEAN:
+		if (!rspamd_config_cache_read_bytes (rd, hdr, 1)) {
+			return NULL;
+		}
+
+		obj = ucl_object_frombool (hdr[0]);
+		break;
+	case RSPAMD_CFG_CACHE_NULL:
+		obj = ucl_object_typed_new (UCL_NULL);
+		break;
+	default:
+		return NULL;
+	}
+
+	if (obj != NULL && hdr[1] != 0) {
+		ucl_object_set_priority (obj, hdr[1]);
+	}
+
+	return obj;
+}
+
+ucl_object_t *
+rspamd_config_cache_load (const gchar *cache_file, const gchar *filename)
+{
+	struct rspamd_config_cache_reader rd;
+	struct rspamd_config_cache_source s;
+	ucl_object_t *top = NULL;
+	gchar *data;
+	gsize len, slen;
+	const gchar *str;
+	guint64 nsources, i;
+	guint8 kind;
+	guchar digest[BLAKE2B_OUTBYTES];
+
+	if (!g_file_get_contents (cache_file, &data, &len, NULL)) {
+		return NULL;
+	}
+
+	rd.p = (const guchar *)data;
+	rd.end = rd.p + len;
+
+	if (len < sizeof (RSPAMD_CFG_CACHE_MAGIC) - 1 ||
+			memcmp (data, RSPAMD_CFG_CACHE_MAGIC,
+					sizeof (RSPAMD_CFG_CACHE_MAGIC) - 1) != 0) {
+		msg_info ("config cache %s has invalid format, ignore it", cache_file);
+		goto end;
+	}
+
+	rd.p += sizeof (RSPAMD_CFG_CACHE_MAGIC) - 1;
+
+	if (!rspamd_config_cache_read_string (&rd, &str, &slen)) {
+		goto err;
+	}
+
+	if (slen != sizeof (RVERSION) - 1 || memcmp (str, RVERSION, slen) != 0) {
+		msg_info ("config cache %s is written by another version, ignore it",
+				cache_file);
+		goto end;
+	}
+
+	if (!rspamd_config_cache_read_string (&rd, &str, &slen)) {
+		goto err;
+	}
+
+	if (slen != strlen (filename) || memcmp (str, filename, slen) != 0) {
+		msg_info ("config cache %s is written for another file, ignore it",
+				cache_file);
+		goto end;
+	}
+
+	if (!rspamd_config_cache_read_varint (&rd, &nsources)) {
+		goto err;
+	}
+
+	for (i = 0; i < nsources; i ++) {
+		if (!rspamd_config_cache_read_bytes (&rd, &kind, 1) ||
+				!rspamd_config_cache_read_string (&rd, &str, &slen) ||
+				!rspamd_config_cache_read_bytes (&rd, digest, sizeof (digest))) {
+			goto err;
+		}
+
+		s.path = g_strndup (str, slen);
+		s.kind = kind == RSPAMD_CFG_SOURCE_GLOB ?
+				RSPAMD_CFG_SOURCE_GLOB : RSPAMD_CFG_SOURCE_FILE;
+		rspamd_config_cache_source_digest (&s);
+
+		if (s.kind != kind || memcmp (s.digest, digest, sizeof (digest)) != 0) {
+			msg_info ("config cache %s is outdated as %s has been changed",
+					cache_file, s.path);
+			g_free (s.path);
+			goto end;
+		}
+
+		g_free (s.path);
+	}
+
+	top = rspamd_config_cache_read_object (&rd, 0);
+
+	if (top == NULL || rd.p != rd.end) {
+		goto err;
+	}
+
+	msg_info ("loaded configuration from cache %s", cache_file);
+	goto end;
+
+err:
+	msg_warn ("config cache %s is corrupted, ignore it", cache_file);
+
+	if (top) {
+		ucl_object_unref (top);
+		top = NULL;
+	}
+
+end:
+	g_free (data);
+
+	return top;
+}
@@ -0,0 +1,83 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CFG_CACHE_H_
+#define CFG_CACHE_H_
+
+#include "config.h"
+#include "ucl.h"
+
+/*
+ * Binary cache of the parsed configuration tree: the tree is stored with
+ * digests of all files it has been read from and it is used instead of
+ * parsing while these files are unchanged
+ */
+
+struct rspamd_config_cache_sources;
+
+/**
+ * Start tracking sources of a configuration, includes of files are traced by
+ * the parser
+ * @param parser ucl parser that is used to read configuration
+ * @param filename main configuration file
+ * @return new sources object
+ */
+struct rspamd_config_cache_sources * rspamd_config_cache_trace (
+	struct ucl_parser *parser,
+	const gchar *filename);
+
+/**
+ * Mark sources as not suitable for caching, e.g. if parsing had side effects
+ * @param src sources object
+ */
+void rspamd_config_cache_disable (struct rspamd_config_cache_sources *src);
+
+/**
+ * Save parsed configuration to the cache file unless it has been read from
+ * URLs or caching has been disabled
+ * @param cache_file cache file name
+ * @param src sources object
+ * @param top parsed configuration
+ * @return TRUE if cache has been written
+ */
+gboolean rspamd_config_cache_save (const gchar *cache_file,
+	struct rspamd_config_cache_sources *src,
+	const ucl_object_t *top);
+
+/**
+ * Free sources object
+ * @param src sources object
+ */
+void rspamd_config_cache_sources_free (struct rspamd_config_cache_sources *src);
+
+/**
+ * Load configuration from the cache if it has been written for the same
+ * main file by the same version and none of sources has been changed
+ * @param cache_file cache file name
+ * @param filename main configuration file
+ * @return configuration tree or NULL if cache is missing or outdated
+ */
+ucl_object_t * rspamd_config_cache_load (const gchar *cache_file,
+	const gchar *filename);
+
+#endif /* CFG_CACHE_H_ */
@@ -13,6 +13,7 @@
 #include "cfg_rcl.h"
 #include "ucl.h"
 #include "regexp.h"
+#include "re_cache.h"
 
 #define DEFAULT_BIND_PORT 11333
 #define DEFAULT_CONTROL_PORT 11334
@@ -20,6 +21,10 @@
 struct expression;
 struct tokenizer;
 struct rspamd_stat_classifier;
+struct rspamd_redis_pool;
+struct rspamd_http_pool;
+struct rspamd_composites_index;
+struct rspamd_dynamic_deltas;
 
 enum { VAL_UNDEF=0, VAL_TRUE, VAL_FALSE };
 
@@ -147,12 +152,15 @@ struct rspamd_worker_conf {
 	GQuark type;                                    /**< type of worker										*/
 	struct rspamd_worker_bind_conf *bind_conf;      /**< bind configuration									*/
 	guint16 count;                                  /**< number of workers									*/
+	guint16 spare;                                  /**< number of standby workers							*/
 	GList *listen_socks;                            /**< listening sockets desctiptors						*/
 	guint32 rlimit_nofile;                          /**< max files limit									*/
 	guint32 rlimit_maxcore;                         /**< maximum core file size								*/
 	GHashTable *params;                             /**< params for worker									*/
 	GQueue *active_workers;                         /**< linked list of spawned workers						*/
 	gboolean has_socket;                            /**< whether we should make listening socket in main process */
+	gboolean reuseport;                             /**< bind a separate SO_REUSEPORT socket in each process */
+	gboolean cpu_affinity;                          /**< pin each worker process to its own cpu				*/
 	gpointer *ctx;                                  /**< worker's context									*/
 	ucl_object_t *options;                  /**< other worker's options								*/
 };
@@ -165,8 +173,10 @@ struct rspamd_config {
 	gchar *rspamd_group;                            /**< group to run as									*/
 	rspamd_mempool_t *cfg_pool;                     /**< memory pool for config								*/
 	gchar *cfg_name;                                /**< name of config file								*/
+	gchar *cfg_cache_file;                          /**< binary cache of parsed config file					*/
 	gchar *pid_file;                                /**< name of pid file									*/
 	gchar *temp_dir;                                /**< dir for temp files									*/
+	gchar *lua_cache_dir;                           /**< dir for compiled lua chunks						*/
 #ifdef WITH_GPERF_TOOLS
 	gchar *profile_path;
 #endif
@@ -179,8 +189,14 @@ struct rspamd_config {
 	gboolean convert_config;                        /**< convert config to XML format						*/
 	gboolean strict_protocol_headers;               /**< strictly check protocol headers					*/
 	gboolean check_all_filters;                     /**< check all filters									*/
+	gboolean shortcut_checks;                       /**< stop checks when action cannot change				*/
+	gboolean allow_spool_files;                     /**< allow to read messages from spool files			*/
 
 	gsize max_diff;                                 /**< maximum diff size for text parts					*/
+	gsize large_message_size;                       /**< messages above this size are scanned with limits	*/
+	gsize large_part_size;                          /**< binary parts of large messages are only hashed above this size */
+	gsize large_scan_size;                          /**< data of large messages scanned by regexps			*/
+	guint max_received_headers;                     /**< received headers parsed by default, 0 for all		*/
 
 	enum rspamd_log_type log_type;                  /**< log type											*/
 	gint log_facility;                              /**< log facility in case of syslog						*/
@@ -188,9 +204,12 @@ struct rspamd_config {
 	gchar *log_file;                                /**< path to logfile in case of file logging			*/
 	gboolean log_buffered;                          /**< whether logging is buffered						*/
 	guint32 log_buf_size;                           /**< length of log buffer								*/
+	gboolean log_async;                             /**< write log from a separate thread					*/
+	gdouble log_flush_interval;                     /**< interval to flush asynchronous log					*/
 	gchar *debug_ip_map;                            /**< turn on debugging for specified ip addresses       */
 	gboolean log_urls;                              /**< whether we should log URLs                         */
 	GList *debug_symbols;                           /**< symbols to debug									*/
+	GList *debug_modules;                           /**< modules to debug, all if empty						*/
 	gboolean log_color;                             /**< output colors for console output                   */
 	gboolean log_extended;                          /**< log extended information							*/
 
@@ -203,6 +222,7 @@ struct rspamd_config {
 	guint16 deliver_family;                         /**< socket family for delivirnig						*/
 	gchar *deliver_agent_path;                      /**< deliver to pipe instead of socket					*/
 	gboolean deliver_lmtp;                          /**< use LMTP instead of SMTP							*/
+	guint deliver_max_connections;                  /**< maximum number of connections to delivery agent	*/
 
 	GList *script_modules;                          /**< linked list of script modules to load				*/
 
@@ -216,6 +236,7 @@ struct rspamd_config {
 	GHashTable * metrics_symbols;                    /**< hash table of metrics indexed by symbol			*/
 	GHashTable * c_modules;                          /**< hash of c modules indexed by module name			*/
 	GHashTable * composite_symbols;                  /**< hash of composite symbols indexed by its name		*/
+	struct rspamd_composites_index *composites_index; /**< composites indexed by symbols they refer to		*/
 	GList *classifiers;                             /**< list of all classifiers defined                    */
 	GList *statfiles;                               /**< list of all statfiles in config file order         */
 	GHashTable *classifiers_symbols;                /**< hashtable indexed by symbol name of classifiers    */
@@ -224,6 +245,8 @@ struct rspamd_config {
 	GList *post_filters;                            /**< list of post-processing lua filters				*/
 	gchar *dynamic_conf;                            /**< path to dynamic configuration						*/
 	ucl_object_t *current_dynamic_conf;              /**< currently loaded dynamic configuration				*/
+	struct rspamd_dynamic_deltas *dynamic_deltas;   /**< changes of dynamic config in shared memory		*/
+	guint64 dynamic_seq;                            /**< number of changes applied by this process		*/
 	GHashTable * domain_settings;                    /**< settings per-domains                               */
 	GHashTable * user_settings;                      /**< settings per-user                                  */
 	gchar * domain_settings_str;                     /**< string representation of settings					*/
@@ -233,8 +256,13 @@ struct rspamd_config {
 	GList *maps;                                    /**< maps active										*/
 	rspamd_mempool_t *map_pool;                     /**< static maps pool									*/
 	gdouble map_timeout;                            /**< maps watch timeout									*/
+	gchar *map_cache_dir;                           /**< directory for maps shared between processes		*/
+	gchar *regexp_cache_dir;                        /**< directory for compiled regexps						*/
+	gchar *cache_snapshot_dir;                      /**< directory for snapshots of shared caches			*/
+	gboolean graceful_reload;                       /**< reload config in workers instead of restarting them	*/
 
 	struct symbols_cache *cache;                    /**< symbols cache object								*/
+	struct rspamd_re_cache *re_cache;               /**< multi-pattern regexps cache						*/
 	gchar *cache_filename;                          /**< filename of cache file								*/
 	struct metric *default_metric;                  /**< default metric										*/
 
@@ -245,6 +273,22 @@ struct rspamd_config {
 	gchar * rrd_file;                               /**< rrd file to store statistics						*/
 
 	gchar * history_file;                           /**< file to save rolling history						*/
+	guint history_rows;                             /**< number of rows in rolling history					*/
+	gchar * scan_log;                               /**< prefix of structured scan log files				*/
+	gsize scan_log_size;                            /**< size of a scan log file							*/
+	gchar * scan_log_udp;                           /**< address to send structured scan log to				*/
+	gboolean timeseries;                            /**< keep time series of scans for graphs				*/
+	gchar * timeseries_file;                        /**< file to keep time series between restarts			*/
+	guint timeseries_max;                           /**< capacity of time series store						*/
+	gchar * trace_dir;                              /**< dir to write traces of tasks						*/
+	gdouble trace_sample_rate;                      /**< part of tasks traced without Trace header			*/
+	gdouble task_timeout;                           /**< time in seconds for async requests of a task		*/
+	gsize task_max_memory;                          /**< memory a task may use before it is stopped		*/
+	gboolean lua_profiler;                          /**< sample lua functions executed by workers			*/
+	guint lua_profiler_count;                       /**< lua instructions between samples					*/
+	gchar * statsd_server;                          /**< statsd address to push metrics to					*/
+	gchar * statsd_prefix;                          /**< prefix of metrics pushed to statsd				*/
+	gdouble statsd_interval;                        /**< interval between pushes of metrics to statsd		*/
 
 	gchar * tld_file;								/**< file to load effective tld list from				*/
 
@@ -253,13 +297,28 @@ struct rspamd_config {
 	guint32 dns_throttling_errors;                  /**< maximum errors for starting resolver throttling	*/
 	guint32 dns_throttling_time;                    /**< time in seconds for DNS throttling					*/
 	guint32 dns_io_per_server;                      /**< number of sockets per DNS server					*/
+	guint32 dns_socket_uses;                        /**< requests sent to a socket before it is reopened	*/
+	guint32 dns_max_outstanding;                    /**< requests in flight, others wait in a queue		*/
+	gdouble dns_slow_factor;                        /**< ratio to the best latency to mark server as dead	*/
+	guint32 dns_cache_size;                         /**< number of DNS replies cached by each worker		*/
+	guint32 dns_cache_min_ttl;                      /**< minimum time in milliseconds to cache a reply		*/
+	guint32 dns_cache_max_ttl;                      /**< maximum time in milliseconds to cache a reply		*/
+	guint32 dns_cache_negative_ttl;                 /**< time in milliseconds to cache negative replies	*/
+	gchar *dns_record_file;                         /**< file to record DNS replies with their latency	*/
+	gchar *dns_replay_file;                         /**< file of recorded DNS replies to serve			*/
 	GList *nameservers;                             /**< list of nameservers or NULL to parse resolv.conf	*/
 
 	guint upstream_max_errors;						/**< upstream max errors before shutting off			*/
 	gdouble upstream_error_time;					/**< rate of upstream errors							*/
 	gdouble upstream_revive_time;					/**< revive timeout for upstreams						*/
+	gdouble upstream_slow_factor;					/**< ratio to the best latency to mark upstream as dead	*/
 
 	guint32 min_word_len;							/**< minimum length of the word to be considered		*/
+
+	struct rspamd_redis_pool *redis_pool;			/**< persistent redis connections of a worker			*/
+	gchar *redis_record_file;                       /**< file to record redis replies with their latency	*/
+	gchar *redis_replay_file;                       /**< file of recorded redis replies to serve			*/
+	struct rspamd_http_pool *http_pool;				/**< persistent http client connections of a worker		*/
 };
 
 
@@ -316,6 +375,14 @@ gchar rspamd_config_parse_flag (const gchar *str, guint len);
  */
 void rspamd_config_post_load (struct rspamd_config *cfg);
 
+/**
+ * Log duration of a startup phase
+ * @param phase name of phase
+ * @param start ticks when phase has been started
+ * @return current ticks to be used as the start of the next phase
+ */
+gdouble rspamd_config_startup_phase (const gchar *phase, gdouble start);
+
 /**
  * Calculate checksum for config file
  * @param cfg config file
@@ -26,6 +26,7 @@
 #include "uthash_strcase.h"
 #include "utlist.h"
 #include "cfg_file.h"
+#include "cfg_cache.h"
 #include "lua/lua_common.h"
 #include "expression.h"
 
@@ -747,7 +748,7 @@ rspamd_rcl_lua_handler (rspamd_mempool_t *pool, const ucl_object_t *obj,
 		cur_dir = g_malloc (PATH_MAX);
 		if (getcwd (cur_dir, PATH_MAX) != NULL && chdir (lua_dir) != -1) {
 			/* Load file */
-			if (luaL_loadfile (L, lua_file) != 0) {
+			if (rspamd_lua_load_file (L, cfg, lua_file) != 0) {
 				g_set_error (err,
 					CFG_RCL_ERROR,
 					EINVAL,
@@ -1205,6 +1206,16 @@ rspamd_rcl_config_init (void)
 		rspamd_rcl_parse_struct_integer,
 		G_STRUCT_OFFSET (struct rspamd_config, log_buf_size),
 		0);
+	rspamd_rcl_add_default_handler (sub,
+		"log_async",
+		rspamd_rcl_parse_struct_boolean,
+		G_STRUCT_OFFSET (struct rspamd_config, log_async),
+		0);
+	rspamd_rcl_add_default_handler (sub,
+		"log_flush_interval",
+		rspamd_rcl_parse_struct_time,
+		G_STRUCT_OFFSET (struct rspamd_config, log_flush_interval),
+		RSPAMD_CL_FLAG_TIME_FLOAT);
 	rspamd_rcl_add_default_handler (sub,
 		"log_urls",
 		rspamd_rcl_parse_struct_boolean,
@@ -1220,6 +1231,11 @@ rspamd_rcl_config_init (void)
 		rspamd_rcl_parse_struct_string_list,
 		G_STRUCT_OFFSET (struct rspamd_config, debug_symbols),
 		0);
+	rspamd_rcl_add_default_handler (sub,
+		"debug_modules",
+		rspamd_rcl_parse_struct_string_list,
+		G_STRUCT_OFFSET (struct rspamd_config, debug_modules),
+		0);
 	rspamd_rcl_add_default_handler (sub,
 		"log_color",
 		rspamd_rcl_parse_struct_boolean,
@@ -1299,6 +1315,51 @@ rspamd_rcl_config_init (void)
 		rspamd_rcl_parse_struct_integer,
 		G_STRUCT_OFFSET (struct rspamd_config, dns_io_per_server),
 		RSPAMD_CL_FLAG_INT_32);
+	rspamd_rcl_add_default_handler (ssub,
+		"socket_uses",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, dns_socket_uses),
+		RSPAMD_CL_FLAG_INT_32);
+	rspamd_rcl_add_default_handler (ssub,
+		"max_outstanding",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, dns_max_outstanding),
+		RSPAMD_CL_FLAG_INT_32);
+	rspamd_rcl_add_default_handler (ssub,
+		"slow_factor",
+		rspamd_rcl_parse_struct_double,
+		G_STRUCT_OFFSET (struct rspamd_config, dns_slow_factor),
+		0);
+	rspamd_rcl_add_default_handler (ssub,
+		"cache_size",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, dns_cache_size),
+		RSPAMD_CL_FLAG_INT_32);
+	rspamd_rcl_add_default_handler (ssub,
+		"cache_min_ttl",
+		rspamd_rcl_parse_struct_time,
+		G_STRUCT_OFFSET (struct rspamd_config, dns_cache_min_ttl),
+		RSPAMD_CL_FLAG_TIME_UINT_32);
+	rspamd_rcl_add_default_handler (ssub,
+		"cache_max_ttl",
+		rspamd_rcl_parse_struct_time,
+		G_STRUCT_OFFSET (struct rspamd_config, dns_cache_max_ttl),
+		RSPAMD_CL_FLAG_TIME_UINT_32);
+	rspamd_rcl_add_default_handler (ssub,
+		"cache_negative_ttl",
+		rspamd_rcl_parse_struct_time,
+		G_STRUCT_OFFSET (struct rspamd_config, dns_cache_negative_ttl),
+		RSPAMD_CL_FLAG_TIME_UINT_32);
+	rspamd_rcl_add_default_handler (ssub,
+		"record",
+		rspamd_rcl_parse_struct_string,
+		G_STRUCT_OFFSET (struct rspamd_config, dns_record_file),
+		0);
+	rspamd_rcl_add_default_handler (ssub,
+		"replay",
+		rspamd_rcl_parse_struct_string,
+		G_STRUCT_OFFSET (struct rspamd_config, dns_replay_file),
+		0);
 
 	/* New upstreams configuration */
 	ssub = rspamd_rcl_add_section (&sub->subsections, "upstream", NULL,
@@ -1318,6 +1379,11 @@ rspamd_rcl_config_init (void)
 		rspamd_rcl_parse_struct_time,
 		G_STRUCT_OFFSET (struct rspamd_config, upstream_revive_time),
 		RSPAMD_CL_FLAG_TIME_FLOAT);
+	rspamd_rcl_add_default_handler (ssub,
+		"slow_factor",
+		rspamd_rcl_parse_struct_double,
+		G_STRUCT_OFFSET (struct rspamd_config, upstream_slow_factor),
+		0);
 
 	rspamd_rcl_add_default_handler (sub,
 		"raw_mode",
@@ -1339,6 +1405,11 @@ rspamd_rcl_config_init (void)
 		rspamd_rcl_parse_struct_string,
 		G_STRUCT_OFFSET (struct rspamd_config, temp_dir),
 		RSPAMD_CL_FLAG_STRING_PATH);
+	rspamd_rcl_add_default_handler (sub,
+		"lua_cache_dir",
+		rspamd_rcl_parse_struct_string,
+		G_STRUCT_OFFSET (struct rspamd_config, lua_cache_dir),
+		RSPAMD_CL_FLAG_STRING_PATH);
 	rspamd_rcl_add_default_handler (sub,
 		"pidfile",
 		rspamd_rcl_parse_struct_string,
@@ -1354,11 +1425,51 @@ rspamd_rcl_config_init (void)
 		rspamd_rcl_parse_struct_integer,
 		G_STRUCT_OFFSET (struct rspamd_config, max_diff),
 		RSPAMD_CL_FLAG_INT_SIZE);
+	rspamd_rcl_add_default_handler (sub,
+		"large_message_size",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, large_message_size),
+		RSPAMD_CL_FLAG_INT_SIZE);
+	rspamd_rcl_add_default_handler (sub,
+		"large_part_size",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, large_part_size),
+		RSPAMD_CL_FLAG_INT_SIZE);
+	rspamd_rcl_add_default_handler (sub,
+		"large_scan_size",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, large_scan_size),
+		RSPAMD_CL_FLAG_INT_SIZE);
+	rspamd_rcl_add_default_handler (sub,
+		"max_received_headers",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, max_received_headers),
+		RSPAMD_CL_FLAG_UINT);
 	rspamd_rcl_add_default_handler (sub,
 		"map_watch_interval",
 		rspamd_rcl_parse_struct_time,
 		G_STRUCT_OFFSET (struct rspamd_config, map_timeout),
 		RSPAMD_CL_FLAG_TIME_FLOAT);
+	rspamd_rcl_add_default_handler (sub,
+		"map_cache_dir",
+		rspamd_rcl_parse_struct_string,
+		G_STRUCT_OFFSET (struct rspamd_config, map_cache_dir),
+		RSPAMD_CL_FLAG_STRING_PATH);
+	rspamd_rcl_add_default_handler (sub,
+		"regexp_cache_dir",
+		rspamd_rcl_parse_struct_string,
+		G_STRUCT_OFFSET (struct rspamd_config, regexp_cache_dir),
+		RSPAMD_CL_FLAG_STRING_PATH);
+	rspamd_rcl_add_default_handler (sub,
+		"cache_snapshot_dir",
+		rspamd_rcl_parse_struct_string,
+		G_STRUCT_OFFSET (struct rspamd_config, cache_snapshot_dir),
+		RSPAMD_CL_FLAG_STRING_PATH);
+	rspamd_rcl_add_default_handler (sub,
+		"graceful_reload",
+		rspamd_rcl_parse_struct_boolean,
+		G_STRUCT_OFFSET (struct rspamd_config, graceful_reload),
+		0);
 	rspamd_rcl_add_default_handler (sub,
 		"dynamic_conf",
 		rspamd_rcl_parse_struct_string,
@@ -1372,6 +1483,96 @@ rspamd_rcl_config_init (void)
 		rspamd_rcl_parse_struct_string,
 		G_STRUCT_OFFSET (struct rspamd_config, history_file),
 		RSPAMD_CL_FLAG_STRING_PATH);
+	rspamd_rcl_add_default_handler (sub,
+		"history_rows",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, history_rows),
+		RSPAMD_CL_FLAG_UINT);
+	rspamd_rcl_add_default_handler (sub,
+		"scan_log",
+		rspamd_rcl_parse_struct_string,
+		G_STRUCT_OFFSET (struct rspamd_config, scan_log),
+		RSPAMD_CL_FLAG_STRING_PATH);
+	rspamd_rcl_add_default_handler (sub,
+		"scan_log_size",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, scan_log_size),
+		RSPAMD_CL_FLAG_INT_SIZE);
+	rspamd_rcl_add_default_handler (sub,
+		"scan_log_udp",
+		rspamd_rcl_parse_struct_string,
+		G_STRUCT_OFFSET (struct rspamd_config, scan_log_udp),
+		0);
+	rspamd_rcl_add_default_handler (sub,
+		"redis_record",
+		rspamd_rcl_parse_struct_string,
+		G_STRUCT_OFFSET (struct rspamd_config, redis_record_file),
+		0);
+	rspamd_rcl_add_default_handler (sub,
+		"redis_replay",
+		rspamd_rcl_parse_struct_string,
+		G_STRUCT_OFFSET (struct rspamd_config, redis_replay_file),
+		0);
+	rspamd_rcl_add_default_handler (sub,
+		"timeseries",
+		rspamd_rcl_parse_struct_boolean,
+		G_STRUCT_OFFSET (struct rspamd_config, timeseries),
+		0);
+	rspamd_rcl_add_default_handler (sub,
+		"timeseries_file",
+		rspamd_rcl_parse_struct_string,
+		G_STRUCT_OFFSET (struct rspamd_config, timeseries_file),
+		RSPAMD_CL_FLAG_STRING_PATH);
+	rspamd_rcl_add_default_handler (sub,
+		"timeseries_max",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, timeseries_max),
+		RSPAMD_CL_FLAG_UINT);
+	rspamd_rcl_add_default_handler (sub,
+		"trace_dir",
+		rspamd_rcl_parse_struct_string,
+		G_STRUCT_OFFSET (struct rspamd_config, trace_dir),
+		RSPAMD_CL_FLAG_STRING_PATH);
+	rspamd_rcl_add_default_handler (sub,
+		"trace_sample_rate",
+		rspamd_rcl_parse_struct_double,
+		G_STRUCT_OFFSET (struct rspamd_config, trace_sample_rate),
+		0);
+	rspamd_rcl_add_default_handler (sub,
+		"task_timeout",
+		rspamd_rcl_parse_struct_time,
+		G_STRUCT_OFFSET (struct rspamd_config, task_timeout),
+		RSPAMD_CL_FLAG_TIME_FLOAT);
+	rspamd_rcl_add_default_handler (sub,
+		"task_max_memory",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, task_max_memory),
+		RSPAMD_CL_FLAG_INT_SIZE);
+	rspamd_rcl_add_default_handler (sub,
+		"lua_profiler",
+		rspamd_rcl_parse_struct_boolean,
+		G_STRUCT_OFFSET (struct rspamd_config, lua_profiler),
+		0);
+	rspamd_rcl_add_default_handler (sub,
+		"lua_profiler_count",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, lua_profiler_count),
+		RSPAMD_CL_FLAG_UINT);
+	rspamd_rcl_add_default_handler (sub,
+		"statsd_server",
+		rspamd_rcl_parse_struct_string,
+		G_STRUCT_OFFSET (struct rspamd_config, statsd_server),
+		0);
+	rspamd_rcl_add_default_handler (sub,
+		"statsd_prefix",
+		rspamd_rcl_parse_struct_string,
+		G_STRUCT_OFFSET (struct rspamd_config, statsd_prefix),
+		0);
+	rspamd_rcl_add_default_handler (sub,
+		"statsd_interval",
+		rspamd_rcl_parse_struct_time,
+		G_STRUCT_OFFSET (struct rspamd_config, statsd_interval),
+		RSPAMD_CL_FLAG_TIME_FLOAT);
 	rspamd_rcl_add_default_handler (sub,
 		"use_mlock",
 		rspamd_rcl_parse_struct_boolean,
@@ -1392,6 +1593,16 @@ rspamd_rcl_config_init (void)
 		rspamd_rcl_parse_struct_boolean,
 		G_STRUCT_OFFSET (struct rspamd_config, check_all_filters),
 		0);
+	rspamd_rcl_add_default_handler (sub,
+		"shortcut_checks",
+		rspamd_rcl_parse_struct_boolean,
+		G_STRUCT_OFFSET (struct rspamd_config, shortcut_checks),
+		0);
+	rspamd_rcl_add_default_handler (sub,
+		"allow_spool_files",
+		rspamd_rcl_parse_struct_boolean,
+		G_STRUCT_OFFSET (struct rspamd_config, allow_spool_files),
+		0);
 	rspamd_rcl_add_default_handler (sub,
 		"min_word_len",
 		rspamd_rcl_parse_struct_integer,
@@ -1432,6 +1643,11 @@ rspamd_rcl_config_init (void)
 		rspamd_rcl_parse_struct_integer,
 		G_STRUCT_OFFSET (struct rspamd_worker_conf, count),
 		RSPAMD_CL_FLAG_INT_16);
+	rspamd_rcl_add_default_handler (sub,
+		"spare",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_worker_conf, spare),
+		RSPAMD_CL_FLAG_INT_16);
 	rspamd_rcl_add_default_handler (sub,
 		"max_files",
 		rspamd_rcl_parse_struct_integer,
@@ -1442,6 +1658,16 @@ rspamd_rcl_config_init (void)
 		rspamd_rcl_parse_struct_integer,
 		G_STRUCT_OFFSET (struct rspamd_worker_conf, rlimit_maxcore),
 		RSPAMD_CL_FLAG_INT_32);
+	rspamd_rcl_add_default_handler (sub,
+		"reuseport",
+		rspamd_rcl_parse_struct_boolean,
+		G_STRUCT_OFFSET (struct rspamd_worker_conf, reuseport),
+		0);
+	rspamd_rcl_add_default_handler (sub,
+		"cpu_affinity",
+		rspamd_rcl_parse_struct_boolean,
+		G_STRUCT_OFFSET (struct rspamd_worker_conf, cpu_affinity),
+		0);
 
 	/**
 	 * Modules handler
@@ -2100,7 +2326,9 @@ rspamd_rcl_parse_struct_addr (rspamd_mempool_t *pool,
 	if (ucl_object_type (obj) == UCL_STRING) {
 		val = ucl_object_tostring (obj);
 
-		if (!rspamd_parse_inet_address (target, val)) {
+		*target = rspamd_parse_inet_address_pool (val, pool);
+
+		if (*target == NULL) {
 			g_set_error (err,
 				CFG_RCL_ERROR,
 				EINVAL,
@@ -2261,6 +2489,16 @@ rspamd_config_read (struct rspamd_config *cfg, const gchar *filename,
 	GError *err = NULL;
 	struct rspamd_rcl_section *top, *logger;
 	struct ucl_parser *parser;
+	struct rspamd_config_cache_sources *sources = NULL;
+	guint nmaps;
+
+	if (cfg->cfg_cache_file != NULL) {
+		cfg->rcl_obj = rspamd_config_cache_load (cfg->cfg_cache_file, filename);
+
+		if (cfg->rcl_obj != NULL) {
+			goto parse;
+		}
+	}
 
 	if (stat (filename, &st) == -1) {
 		msg_err ("cannot stat %s: %s", filename, strerror (errno));
@@ -2283,16 +2521,39 @@ rspamd_config_read (struct rspamd_config *cfg, const gchar *filename,
 	parser = ucl_parser_new (0);
 	rspamd_ucl_add_conf_variables (parser);
 	rspamd_ucl_add_conf_macros (parser, cfg);
+
+	if (cfg->cfg_cache_file != NULL) {
+		sources = rspamd_config_cache_trace (parser, filename);
+	}
+
+	nmaps = g_list_length (cfg->maps);
+
 	if (!ucl_parser_add_chunk (parser, data, st.st_size)) {
 		msg_err ("ucl parser error: %s", ucl_parser_get_error (parser));
 		ucl_parser_free (parser);
 		munmap (data, st.st_size);
+
+		if (sources) {
+			rspamd_config_cache_sources_free (sources);
+		}
+
 		return FALSE;
 	}
 	munmap (data, st.st_size);
 	cfg->rcl_obj = ucl_parser_get_object (parser);
 	ucl_parser_free (parser);
 
+	if (sources) {
+		/* Maps included by macros are not restored from the cache */
+		if (g_list_length (cfg->maps) != nmaps) {
+			rspamd_config_cache_disable (sources);
+		}
+
+		rspamd_config_cache_save (cfg->cfg_cache_file, sources, cfg->rcl_obj);
+		rspamd_config_cache_sources_free (sources);
+	}
+
+parse:
 	top = rspamd_rcl_config_init ();
 	err = NULL;
 
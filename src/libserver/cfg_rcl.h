@@ -260,7 +260,7 @@ gboolean rspamd_rcl_parse_struct_keypair (rspamd_mempool_t *pool,
 	GError **err);
 
 /**
- * Parse a inet addr field of a structure
+ * Parse a inet addr field of a structure, the address is allocated in the pool
  * @param cfg config pointer
  * @param obj object to parse
  * @param ud struct_parser structure (flags mean the exact structure used)
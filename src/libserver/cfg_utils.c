@@ -35,6 +35,8 @@
 #include "dynamic_cfg.h"
 #include "utlist.h"
 #include "stat_api.h"
+#include "redis_pool.h"
+#include "http_pool.h"
 
 #define DEFAULT_SCORE 10.0
 
@@ -42,6 +44,9 @@
 #define DEFAULT_RLIMIT_MAXCORE 0
 #define DEFAULT_MAP_TIMEOUT 10
 #define DEFAULT_MIN_WORD 4
+#define DEFAULT_TASK_TIMEOUT 8.0
+#define DEFAULT_LUA_PROFILER_COUNT 1000
+#define DEFAULT_STATSD_INTERVAL 10.0
 
 struct rspamd_ucl_map_cbdata {
 	struct rspamd_config *cfg;
@@ -151,9 +156,22 @@ rspamd_config_defaults (struct rspamd_config *cfg)
 	cfg->dns_throttling_time = 10000;
 	/* 16 sockets per DNS server */
 	cfg->dns_io_per_server = 16;
+	/* Reopen sockets to change source ports */
+	cfg->dns_socket_uses = 10000;
+	cfg->dns_max_outstanding = 1024;
+	cfg->dns_slow_factor = 5.0;
+	/* Cache 1024 replies per worker for at most 10 minutes */
+	cfg->dns_cache_size = 1024;
+	cfg->dns_cache_min_ttl = 0;
+	cfg->dns_cache_max_ttl = 600000;
+	cfg->dns_cache_negative_ttl = 60000;
 
 	/* 20 Kb */
 	cfg->max_diff = 20480;
+	/* Large messages are scanned completely unless a limit is set */
+	cfg->large_message_size = 0;
+	cfg->large_part_size = 1024 * 1024;
+	cfg->large_scan_size = 1024 * 1024;
 
 	cfg->metrics = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
 	if (cfg->c_modules == NULL) {
@@ -173,6 +191,9 @@ rspamd_config_defaults (struct rspamd_config *cfg)
 	cfg->log_extended = TRUE;
 
 	cfg->min_word_len = DEFAULT_MIN_WORD;
+	cfg->task_timeout = DEFAULT_TASK_TIMEOUT;
+	cfg->lua_profiler_count = DEFAULT_LUA_PROFILER_COUNT;
+	cfg->statsd_interval = DEFAULT_STATSD_INTERVAL;
 }
 
 void
@@ -196,6 +217,15 @@ rspamd_config_free (struct rspamd_config *cfg)
 	}
 	g_list_free (cfg->classifiers);
 	g_list_free (cfg->metrics_list);
+
+	if (cfg->redis_pool) {
+		rspamd_redis_pool_destroy (cfg->redis_pool);
+	}
+
+	if (cfg->http_pool) {
+		rspamd_http_pool_destroy (cfg->http_pool);
+	}
+
 	rspamd_mempool_delete (cfg->cfg_pool);
 }
 
@@ -344,6 +374,29 @@ rspamd_config_calculate_checksum (struct rspamd_config *cfg)
 /*
  * Perform post load actions
  */
+gdouble
+rspamd_config_startup_phase (const gchar *phase, gdouble start)
+{
+	gdouble now = rspamd_get_ticks ();
+
+	msg_info ("startup phase %s has taken %.3f ms", phase,
+		(now - start) * 1000.0);
+
+	return now;
+}
+
+/* TLD trie does not depend on the rest of config, so it is built in parallel */
+static gpointer
+rspamd_config_url_thread (gpointer ud)
+{
+	gdouble start = rspamd_get_ticks ();
+
+	rspamd_url_init (ud);
+	rspamd_config_startup_phase ("url trie", start);
+
+	return NULL;
+}
+
 void
 rspamd_config_post_load (struct rspamd_config *cfg)
 {
@@ -351,6 +404,9 @@ rspamd_config_post_load (struct rspamd_config *cfg)
 	struct timespec ts;
 #endif
 	struct metric *def_metric;
+	GThread *url_thr;
+	GError *err = NULL;
+	gdouble start;
 
 #ifdef HAVE_CLOCK_GETTIME
 #ifdef HAVE_CLOCK_PROCESS_CPUTIME_ID
@@ -407,12 +463,27 @@ rspamd_config_post_load (struct rspamd_config *cfg)
 		g_string_free (fpath, TRUE);
 	}
 
+	url_thr = rspamd_create_thread ("url", rspamd_config_url_thread,
+			(gpointer)cfg->tld_file, &err);
+
+	if (url_thr == NULL) {
+		msg_warn ("cannot start url trie thread: %e", err);
+		g_error_free (err);
+		rspamd_url_init (cfg->tld_file);
+	}
+
 	/* Lua options */
+	start = rspamd_get_ticks ();
 	(void)rspamd_lua_post_load_config (cfg);
 	init_dynamic_config (cfg);
+	start = rspamd_config_startup_phase ("lua config", start);
 
 	rspamd_stat_init (cfg);
-	rspamd_url_init (cfg->tld_file);
+	rspamd_config_startup_phase ("statistics", start);
+
+	if (url_thr != NULL) {
+		g_thread_join (url_thr);
+	}
 
 	/* Insert classifiers symbols */
 	(void)rspamd_config_insert_classify_symbols (cfg);
@@ -906,15 +977,13 @@ rspamd_init_cfg (struct rspamd_config *cfg, gboolean init_lua)
 	if (init_lua) {
 		cfg->lua_state = rspamd_lua_init (cfg);
 		rspamd_mempool_add_destructor (cfg->cfg_pool,
-				(rspamd_mempool_destruct_t)lua_close, cfg->lua_state);
+				(rspamd_mempool_destruct_t)rspamd_lua_close, cfg->lua_state);
 	}
 
 	/* Pre-init of cache */
-	cfg->cache = g_new0 (struct symbols_cache, 1);
-	cfg->cache->static_pool = rspamd_mempool_new (
-		rspamd_mempool_suggest_size ());
+	cfg->cache = rspamd_symbols_cache_new ();
 	cfg->cache->cfg = cfg;
-	cfg->cache->items_by_symbol = g_hash_table_new (
-		rspamd_str_hash,
-		rspamd_str_equal);
+	cfg->re_cache = rspamd_re_cache_new ();
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			(rspamd_mempool_destruct_t)rspamd_re_cache_destroy, cfg->re_cache);
 }
@@ -0,0 +1,348 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "classify_executor.h"
+#include "events.h"
+#include "task.h"
+#include "message.h"
+#include "lua/lua_common.h"
+#include "libstat/stat_api.h"
+#include "mpmc_queue.h"
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+/* Maximum number of tasks taken by a thread at once */
+#define CLASSIFY_MAX_BATCH 64
+
+struct rspamd_classify_job {
+	struct rspamd_task *task;
+	gdouble queued;
+	gdouble started;
+};
+
+struct rspamd_classify_thread {
+	GThread *thr;
+	lua_State *L;
+	struct rspamd_classify_executor *exec;
+};
+
+struct rspamd_classify_executor {
+	struct rspamd_mpmc_queue *input;        /* tasks to classify				*/
+	struct rspamd_mpmc_queue *output;       /* classified tasks				*/
+	struct rspamd_classify_thread *threads;
+	guint nthreads;
+	guint batch;
+	guint queue_size;
+	guint inflight;                         /* accessed from event loop only	*/
+	gint stop;
+	gint sleepers;                          /* threads waiting for new tasks	*/
+	gint signalled;                         /* wakeup is pending in event loop	*/
+	rspamd_mutex_t *mtx;
+	GCond *cond;
+	gint wake_fd[2];
+	struct event wake_ev;
+	struct rspamd_stat *stat;
+};
+
+/* Called when session is finished or destroyed */
+static void
+rspamd_classify_job_fin (gpointer ud)
+{
+	struct rspamd_classify_job *job = ud;
+
+	job->task = NULL;
+}
+
+static void
+rspamd_classify_executor_notify (struct rspamd_classify_executor *exec)
+{
+	guint64 val = 1;
+
+	if (g_atomic_int_compare_and_exchange (&exec->signalled, 0, 1)) {
+		if (write (exec->wake_fd[1], &val, sizeof (val)) == -1 &&
+				errno != EAGAIN) {
+			msg_err ("cannot wake up worker: %s", strerror (errno));
+		}
+	}
+}
+
+static gpointer
+rspamd_classify_thread_func (gpointer ud)
+{
+	struct rspamd_classify_thread *thr = ud;
+	struct rspamd_classify_executor *exec = thr->exec;
+	struct rspamd_classify_job *jobs[CLASSIFY_MAX_BATCH], *job;
+	struct rspamd_task *task;
+	guint i, n;
+	gboolean r;
+
+	for (;;) {
+		n = 0;
+
+		while (n < exec->batch &&
+				(job = rspamd_mpmc_queue_pop (exec->input)) != NULL) {
+			jobs[n ++] = job;
+		}
+
+		if (n == 0) {
+			if (g_atomic_int_get (&exec->stop)) {
+				break;
+			}
+
+			rspamd_mutex_lock (exec->mtx);
+			g_atomic_int_inc (&exec->sleepers);
+
+			while (rspamd_mpmc_queue_empty (exec->input) &&
+					!g_atomic_int_get (&exec->stop)) {
+				rspamd_cond_wait (exec->cond, exec->mtx);
+			}
+
+			g_atomic_int_add (&exec->sleepers, -1);
+			rspamd_mutex_unlock (exec->mtx);
+
+			continue;
+		}
+
+		for (i = 0; i < n; i ++) {
+			job = jobs[i];
+			job->started = rspamd_get_ticks ();
+			task = job->task;
+
+			if (!RSPAMD_TASK_IS_SKIPPED (task)) {
+				/* TODO: handle err here */
+				rspamd_stat_classify (task, thr->L, NULL);
+			}
+
+			/* Task must not be touched after this point */
+			remove_async_thread (task->s);
+
+			/* Output queue can hold all tasks in flight */
+			r = rspamd_mpmc_queue_push (exec->output, job);
+			g_assert (r);
+		}
+
+		rspamd_classify_executor_notify (exec);
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_classify_executor_wakeup (gint fd, short what, gpointer ud)
+{
+	struct rspamd_classify_executor *exec = ud;
+	struct rspamd_classify_job *job;
+	struct rspamd_task *task;
+	guint64 val, usec;
+
+	while (read (fd, &val, sizeof (val)) > 0);
+
+	/* Threads will signal again if they finish tasks after this point */
+	g_atomic_int_set (&exec->signalled, 0);
+
+	while ((job = rspamd_mpmc_queue_pop (exec->output)) != NULL) {
+		exec->inflight --;
+
+		if (exec->stat != NULL) {
+			usec = (job->started - job->queued) * 1000000.0;
+			exec->stat->classify_tasks ++;
+			exec->stat->classify_queue_time += usec;
+
+			if (usec > exec->stat->classify_queue_max) {
+				exec->stat->classify_queue_max = usec;
+			}
+		}
+
+		task = job->task;
+
+		if (task != NULL) {
+			/* Continue processing of session */
+			remove_normal_event (task->s, rspamd_classify_job_fin, job);
+		}
+
+		g_slice_free1 (sizeof (*job), job);
+	}
+}
+
+struct rspamd_classify_executor *
+rspamd_classify_executor_new (struct rspamd_config *cfg,
+		struct event_base *ev_base,
+		guint nthreads, guint queue_size, guint batch,
+		struct rspamd_stat *stat, GError **err)
+{
+	struct rspamd_classify_executor *exec;
+	struct rspamd_classify_thread *thr;
+	guint i;
+
+	g_assert (nthreads > 0);
+
+	exec = g_slice_alloc0 (sizeof (*exec));
+
+#ifdef HAVE_SYS_EVENTFD_H
+	exec->wake_fd[0] = eventfd (0, EFD_NONBLOCK);
+	exec->wake_fd[1] = exec->wake_fd[0];
+
+	if (exec->wake_fd[0] == -1) {
+#else
+	if (pipe (exec->wake_fd) == -1) {
+#endif
+		g_set_error (err, g_quark_from_static_string ("classify-executor"),
+				errno, "cannot create wakeup descriptor: %s", strerror (errno));
+		g_slice_free1 (sizeof (*exec), exec);
+
+		return NULL;
+	}
+
+#ifndef HAVE_SYS_EVENTFD_H
+	rspamd_socket_nonblocking (exec->wake_fd[0]);
+	rspamd_socket_nonblocking (exec->wake_fd[1]);
+#endif
+
+	exec->queue_size = MAX (queue_size, 1);
+	exec->batch = MIN (MAX (batch, 1), CLASSIFY_MAX_BATCH);
+	exec->input = rspamd_mpmc_queue_new (exec->queue_size);
+	exec->output = rspamd_mpmc_queue_new (exec->queue_size);
+	exec->stat = stat;
+	exec->mtx = rspamd_mutex_new ();
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
+	exec->cond = g_cond_new ();
+#else
+	exec->cond = g_malloc0 (sizeof (GCond));
+	g_cond_init (exec->cond);
+#endif
+
+	event_set (&exec->wake_ev, exec->wake_fd[0], EV_READ | EV_PERSIST,
+			rspamd_classify_executor_wakeup, exec);
+	event_base_set (ev_base, &exec->wake_ev);
+	event_add (&exec->wake_ev, NULL);
+
+	exec->threads = g_new0 (struct rspamd_classify_thread, nthreads);
+
+	for (i = 0; i < nthreads; i ++) {
+		thr = &exec->threads[i];
+		thr->exec = exec;
+		thr->L = rspamd_lua_init (cfg);
+		thr->thr = rspamd_create_thread ("classify", rspamd_classify_thread_func,
+				thr, err);
+
+		if (thr->thr == NULL) {
+			rspamd_lua_close (thr->L);
+			break;
+		}
+
+		exec->nthreads ++;
+	}
+
+	if (exec->nthreads == 0) {
+		rspamd_classify_executor_destroy (exec);
+
+		return NULL;
+	}
+
+	return exec;
+}
+
+gboolean
+rspamd_classify_executor_push (struct rspamd_classify_executor *exec,
+		struct rspamd_task *task)
+{
+	struct rspamd_classify_job *job;
+	gboolean r;
+
+	if (exec->inflight >= exec->queue_size) {
+		if (exec->stat != NULL) {
+			exec->stat->classify_overflows ++;
+		}
+
+		return FALSE;
+	}
+
+	job = g_slice_alloc (sizeof (*job));
+	job->task = task;
+	job->queued = rspamd_get_ticks ();
+	job->started = job->queued;
+
+	/* Do not extract words lazily from the classify thread */
+	rspamd_mime_text_parts_prepare_words (task);
+	register_async_event (task->s, rspamd_classify_job_fin, job,
+			g_quark_from_static_string ("classifier"));
+	register_async_thread (task->s);
+
+	/* Input queue cannot be full as we limit number of tasks in flight */
+	r = rspamd_mpmc_queue_push (exec->input, job);
+	g_assert (r);
+	exec->inflight ++;
+
+	if (g_atomic_int_get (&exec->sleepers) > 0) {
+		rspamd_mutex_lock (exec->mtx);
+		g_cond_signal (exec->cond);
+		rspamd_mutex_unlock (exec->mtx);
+	}
+
+	return TRUE;
+}
+
+void
+rspamd_classify_executor_destroy (struct rspamd_classify_executor *exec)
+{
+	struct rspamd_classify_job *job;
+	guint i;
+
+	g_atomic_int_set (&exec->stop, 1);
+	rspamd_mutex_lock (exec->mtx);
+	g_cond_broadcast (exec->cond);
+	rspamd_mutex_unlock (exec->mtx);
+
+	for (i = 0; i < exec->nthreads; i ++) {
+		g_thread_join (exec->threads[i].thr);
+		rspamd_lua_close (exec->threads[i].L);
+	}
+
+	/* Jobs of the tasks that are still alive */
+	while ((job = rspamd_mpmc_queue_pop (exec->output)) != NULL) {
+		g_slice_free1 (sizeof (*job), job);
+	}
+
+	event_del (&exec->wake_ev);
+	close (exec->wake_fd[0]);
+
+	if (exec->wake_fd[1] != exec->wake_fd[0]) {
+		close (exec->wake_fd[1]);
+	}
+
+	rspamd_mpmc_queue_free (exec->input);
+	rspamd_mpmc_queue_free (exec->output);
+	rspamd_mutex_free (exec->mtx);
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
+	g_cond_free (exec->cond);
+#else
+	g_cond_clear (exec->cond);
+	g_free (exec->cond);
+#endif
+	g_free (exec->threads);
+	g_slice_free1 (sizeof (*exec), exec);
+}
@@ -0,0 +1,71 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef CLASSIFY_EXECUTOR_H_
+#define CLASSIFY_EXECUTOR_H_
+
+#include "config.h"
+#include <event.h>
+
+/*
+ * Classifier executor: tasks are classified by a set of threads, each thread
+ * has its own lua state. Tasks are passed through bounded lock-free queues,
+ * finished tasks are returned to the event loop of the worker via eventfd
+ * (or pipe where eventfd is unavailable)
+ */
+struct rspamd_classify_executor;
+struct rspamd_task;
+struct rspamd_config;
+struct rspamd_stat;
+
+/**
+ * Create new executor and start classifier threads
+ * @param cfg configuration
+ * @param ev_base event base of the worker
+ * @param nthreads number of classifier threads
+ * @param queue_size maximum number of tasks being classified
+ * @param batch maximum number of tasks taken by a thread at once
+ * @param stat server statistics to update queue metrics in (may be NULL)
+ * @return new executor or NULL in case of error
+ */
+struct rspamd_classify_executor * rspamd_classify_executor_new (
+		struct rspamd_config *cfg, struct event_base *ev_base,
+		guint nthreads, guint queue_size, guint batch,
+		struct rspamd_stat *stat, GError **err);
+
+/**
+ * Push task to the executor, session of the task is not finished until
+ * the task is classified
+ * @param exec executor
+ * @param task task
+ * @return FALSE if the queue is full and task should be classified inline
+ */
+gboolean rspamd_classify_executor_push (struct rspamd_classify_executor *exec,
+		struct rspamd_task *task);
+
+/**
+ * Stop threads and destroy executor
+ * @param exec executor
+ */
+void rspamd_classify_executor_destroy (struct rspamd_classify_executor *exec);
+
+#endif /* CLASSIFY_EXECUTOR_H_ */
@@ -27,6 +27,9 @@
 #include "dkim.h"
 #include "dns.h"
 #include "utlist.h"
+#include "platform_config.h"
+
+extern unsigned long cpu_config;
 
 /* Parser of dkim params */
 typedef gboolean (*dkim_parse_param_f) (rspamd_dkim_context_t * ctx,
@@ -728,7 +731,7 @@ rspamd_create_dkim_context (const gchar *sig,
 	}
 	if (new->sig_alg == DKIM_SIGN_RSASHA1) {
 		/* Check bh length */
-		if (new->bhlen != (guint)g_checksum_type_get_length (G_CHECKSUM_SHA1)) {
+		if (new->bhlen != rspamd_cryptobox_SHA1BYTES) {
 			g_set_error (err,
 				DKIM_ERROR,
 				DKIM_SIGERROR_BADSIG,
@@ -739,8 +742,7 @@ rspamd_create_dkim_context (const gchar *sig,
 
 	}
 	else if (new->sig_alg == DKIM_SIGN_RSASHA256) {
-		if (new->bhlen !=
-			(guint)g_checksum_type_get_length (G_CHECKSUM_SHA256)) {
+		if (new->bhlen != rspamd_cryptobox_SHA256BYTES) {
 			g_set_error (err,
 				DKIM_ERROR,
 				DKIM_SIGERROR_BADSIG,
@@ -780,12 +782,12 @@ rspamd_create_dkim_context (const gchar *sig,
 
 	/* Create checksums for further operations */
 	if (new->sig_alg == DKIM_SIGN_RSASHA1) {
-		new->body_hash = g_checksum_new (G_CHECKSUM_SHA1);
-		new->headers_hash = g_checksum_new (G_CHECKSUM_SHA1);
+		rspamd_cryptobox_sha_init (&new->body_hash, RSPAMD_CRYPTOBOX_SHA1);
+		rspamd_cryptobox_sha_init (&new->headers_hash, RSPAMD_CRYPTOBOX_SHA1);
 	}
 	else if (new->sig_alg == DKIM_SIGN_RSASHA256) {
-		new->body_hash = g_checksum_new (G_CHECKSUM_SHA256);
-		new->headers_hash = g_checksum_new (G_CHECKSUM_SHA256);
+		rspamd_cryptobox_sha_init (&new->body_hash, RSPAMD_CRYPTOBOX_SHA256);
+		rspamd_cryptobox_sha_init (&new->headers_hash, RSPAMD_CRYPTOBOX_SHA256);
 	}
 	else {
 		g_set_error (err,
@@ -795,13 +797,6 @@ rspamd_create_dkim_context (const gchar *sig,
 		return NULL;
 	}
 
-	rspamd_mempool_add_destructor (new->pool,
-		(rspamd_mempool_destruct_t)g_checksum_free,
-		new->body_hash);
-	rspamd_mempool_add_destructor (new->pool,
-		(rspamd_mempool_destruct_t)g_checksum_free,
-		new->headers_hash);
-
 	return new;
 }
 
@@ -811,6 +806,42 @@ struct rspamd_dkim_key_cbdata {
 	gpointer ud;
 };
 
+static gboolean
+rspamd_dkim_load_key (rspamd_dkim_key_t *key, GError **err)
+{
+#ifdef HAVE_OPENSSL
+	key->key_bio = BIO_new_mem_buf (key->keydata, key->decoded_len);
+	if (key->key_bio == NULL) {
+		g_set_error (err,
+			DKIM_ERROR,
+			DKIM_SIGERROR_KEYFAIL,
+			"cannot make ssl bio from key");
+		return FALSE;
+	}
+
+	key->key_evp = d2i_PUBKEY_bio (key->key_bio, NULL);
+	if (key->key_evp == NULL) {
+		g_set_error (err,
+			DKIM_ERROR,
+			DKIM_SIGERROR_KEYFAIL,
+			"cannot extract pubkey from bio");
+		return FALSE;
+	}
+
+	key->key_rsa = EVP_PKEY_get1_RSA (key->key_evp);
+	if (key->key_rsa == NULL) {
+		g_set_error (err,
+			DKIM_ERROR,
+			DKIM_SIGERROR_KEYFAIL,
+			"cannot extract rsa key from evp key");
+		return FALSE;
+	}
+
+#endif
+
+	return TRUE;
+}
+
 static rspamd_dkim_key_t *
 rspamd_dkim_make_key (const gchar *keydata, guint keylen, GError **err)
 {
@@ -835,39 +866,41 @@ rspamd_dkim_make_key (const gchar *keydata, guint keylen, GError **err)
 #else
 	g_base64_decode_inplace (key->keydata, &key->decoded_len);
 #endif
-#ifdef HAVE_OPENSSL
-	key->key_bio = BIO_new_mem_buf (key->keydata, key->decoded_len);
-	if (key->key_bio == NULL) {
-		g_set_error (err,
-			DKIM_ERROR,
-			DKIM_SIGERROR_KEYFAIL,
-			"cannot make ssl bio from key");
+
+	if (!rspamd_dkim_load_key (key, err)) {
 		rspamd_dkim_key_free (key);
 		return NULL;
 	}
 
-	key->key_evp = d2i_PUBKEY_bio (key->key_bio, NULL);
-	if (key->key_evp == NULL) {
+	return key;
+}
+
+rspamd_dkim_key_t *
+rspamd_dkim_key_from_der (const guint8 *der, gsize len, guint ttl,
+	GError **err)
+{
+	rspamd_dkim_key_t *key;
+
+	if (len == 0) {
 		g_set_error (err,
 			DKIM_ERROR,
 			DKIM_SIGERROR_KEYFAIL,
-			"cannot extract pubkey from bio");
-		rspamd_dkim_key_free (key);
+			"empty key");
 		return NULL;
 	}
 
-	key->key_rsa = EVP_PKEY_get1_RSA (key->key_evp);
-	if (key->key_rsa == NULL) {
-		g_set_error (err,
-			DKIM_ERROR,
-			DKIM_SIGERROR_KEYFAIL,
-			"cannot extract rsa key from evp key");
+	key = g_slice_alloc0 (sizeof (rspamd_dkim_key_t));
+	key->keydata = g_slice_alloc (len);
+	memcpy (key->keydata, der, len);
+	key->keylen = len;
+	key->decoded_len = len;
+	key->ttl = ttl;
+
+	if (!rspamd_dkim_load_key (key, err)) {
 		rspamd_dkim_key_free (key);
 		return NULL;
 	}
 
-#endif
-
 	return key;
 }
 
@@ -1018,15 +1051,166 @@ rspamd_get_dkim_key (rspamd_dkim_context_t *ctx,
 			   ctx->dns_key);
 }
 
+/*
+ * Relaxed body canonicalization only has to look at whitespace and line
+ * breaks, both are below 0x21, so the runs of other characters are found by
+ * a vectorized scan and copied as a whole
+ */
+#define DKIM_BODY_HASHES_VAR "dkim_body_hashes"
+
+typedef struct rspamd_dkim_scan_impl_s {
+	unsigned long cpu_flags;
+	const char *desc;
+	const gchar * (*find) (const gchar *p, const gchar *end);
+} rspamd_dkim_scan_impl_t;
+
+#define DKIM_SCAN_DECLARE(ext) \
+		static const gchar * rspamd_dkim_scan_##ext (const gchar *p, \
+				const gchar *end);
+#define DKIM_SCAN_IMPL(cpuflags, desc, ext) \
+		{(cpuflags), desc, rspamd_dkim_scan_##ext}
+
+#if defined(HAVE_AVX2) && defined(HAVE_TARGET_ATTRIBUTE)
+	DKIM_SCAN_DECLARE(avx2)
+	#define DKIM_SCAN_AVX2 DKIM_SCAN_IMPL(CPUID_AVX2, "avx2", avx2)
+#endif
+#if defined(HAVE_SSE2) && defined(HAVE_TARGET_ATTRIBUTE)
+	DKIM_SCAN_DECLARE(sse2)
+	#define DKIM_SCAN_SSE2 DKIM_SCAN_IMPL(CPUID_SSE2, "sse2", sse2)
+#endif
+
+DKIM_SCAN_DECLARE(generic)
+#define DKIM_SCAN_GENERIC DKIM_SCAN_IMPL(0, "generic", generic)
+
+static const rspamd_dkim_scan_impl_t dkim_scan_list[] = {
+	DKIM_SCAN_GENERIC,
+#if defined(DKIM_SCAN_AVX2)
+	DKIM_SCAN_AVX2,
+#endif
+#if defined(DKIM_SCAN_SSE2)
+	DKIM_SCAN_SSE2
+#endif
+};
+
+static const rspamd_dkim_scan_impl_t *dkim_scan_impl = NULL;
+
+/* Body hash computed for a message, shared by signatures with same params */
+struct rspamd_dkim_body_hash {
+	gint body_canon_type;
+	gint sig_alg;
+	gsize len;
+	gsize dlen;
+	guchar digest[64];
+	struct rspamd_dkim_body_hash *next;
+};
+
+struct rspamd_dkim_body_cache {
+	const gchar *body_start;
+	struct rspamd_dkim_body_hash *hashes;
+};
+
+/* Returns the first byte that is either a space or a control character */
+static const gchar *
+rspamd_dkim_scan_generic (const gchar *p, const gchar *end)
+{
+	while (p < end) {
+		if ((guchar)*p <= ' ') {
+			return p;
+		}
+		p ++;
+	}
+
+	return end;
+}
+
+#if defined(HAVE_AVX2) && defined(HAVE_TARGET_ATTRIBUTE)
+#include <immintrin.h>
+
+__attribute__((target("avx2"))) static const gchar *
+rspamd_dkim_scan_avx2 (const gchar *p, const gchar *end)
+{
+	__m256i sp, v;
+	guint32 mask;
+
+	sp = _mm256_set1_epi8 (' ');
+
+	while (end - p >= 32) {
+		v = _mm256_loadu_si256 ((const __m256i *)p);
+		/* min (v, ' ') == v means v <= ' ' (unsigned) */
+		mask = _mm256_movemask_epi8 (
+				_mm256_cmpeq_epi8 (_mm256_min_epu8 (v, sp), v));
+
+		if (mask != 0) {
+			return p + __builtin_ctz (mask);
+		}
+
+		p += 32;
+	}
+
+	return rspamd_dkim_scan_generic (p, end);
+}
+#endif
+
+#if defined(HAVE_SSE2) && defined(HAVE_TARGET_ATTRIBUTE)
+#include <emmintrin.h>
+
+__attribute__((target("sse2"))) static const gchar *
+rspamd_dkim_scan_sse2 (const gchar *p, const gchar *end)
+{
+	__m128i sp, v;
+	guint32 mask;
+
+	sp = _mm_set1_epi8 (' ');
+
+	while (end - p >= 16) {
+		v = _mm_loadu_si128 ((const __m128i *)p);
+		mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_min_epu8 (v, sp), v));
+
+		if (mask != 0) {
+			return p + __builtin_ctz (mask);
+		}
+
+		p += 16;
+	}
+
+	return rspamd_dkim_scan_generic (p, end);
+}
+#endif
+
+static const rspamd_dkim_scan_impl_t *
+rspamd_dkim_get_scan_impl (void)
+{
+	guint i;
+
+	if (dkim_scan_impl == NULL) {
+		dkim_scan_impl = &dkim_scan_list[0];
+
+		if (cpu_config != 0) {
+			for (i = 0; i < G_N_ELEMENTS (dkim_scan_list); i ++) {
+				if (dkim_scan_list[i].cpu_flags & cpu_config) {
+					dkim_scan_impl = &dkim_scan_list[i];
+					break;
+				}
+			}
+		}
+
+		msg_debug ("use %s kernel for dkim body canonicalization",
+				dkim_scan_impl->desc);
+	}
+
+	return dkim_scan_impl;
+}
+
 static gboolean
-rspamd_dkim_relaxed_body_step (GChecksum *ck, const gchar **start, guint size,
-		guint *remain)
+rspamd_dkim_relaxed_body_step (rspamd_cryptobox_sha_state_t *ck,
+		const gchar **start, guint size, guint *remain)
 {
 	const gchar *h;
 	static gchar buf[BUFSIZ];
 	gchar *t;
-	guint len, inlen, added = 0;
+	guint len, inlen, added = 0, run;
 	gboolean got_sp;
+	const rspamd_dkim_scan_impl_t *scan = rspamd_dkim_get_scan_impl ();
 
 	len = size;
 	inlen = sizeof (buf) - 1;
@@ -1071,6 +1255,17 @@ rspamd_dkim_relaxed_body_step (GChecksum *ck, const gchar **start, guint size,
 		}
 		else {
 			got_sp = FALSE;
+			/* Copy the whole run of characters that are kept as is */
+			run = scan->find (h, h + MIN (len, inlen)) - h;
+
+			if (run > 0) {
+				memcpy (t, h, run);
+				t += run;
+				h += run;
+				inlen -= run;
+				len -= run;
+				continue;
+			}
 		}
 		*t++ = *h++;
 		inlen--;
@@ -1081,7 +1276,7 @@ rspamd_dkim_relaxed_body_step (GChecksum *ck, const gchar **start, guint size,
 
 	if (*remain > 0) {
 		size_t cklen = MIN(t - buf, *remain + added);
-		g_checksum_update (ck, buf, cklen);
+		rspamd_cryptobox_sha_update (ck, (const guchar *)buf, cklen);
 		*remain = *remain - (cklen - added);
 #if 0
 		msg_debug ("update signature with buffer (%ud size, %ud remain, %ud added): %*s",
@@ -1097,8 +1292,8 @@ rspamd_dkim_relaxed_body_step (GChecksum *ck, const gchar **start, guint size,
 }
 
 static gboolean
-rspamd_dkim_simple_body_step (GChecksum *ck, const gchar **start, guint size,
-		guint *remain)
+rspamd_dkim_simple_body_step (rspamd_cryptobox_sha_state_t *ck,
+		const gchar **start, guint size, guint *remain)
 {
 	const gchar *h;
 	static gchar buf[BUFSIZ];
@@ -1134,7 +1329,7 @@ rspamd_dkim_simple_body_step (GChecksum *ck, const gchar **start, guint size,
 
 	if (*remain > 0) {
 		size_t cklen = MIN(t - buf, *remain + added);
-		g_checksum_update (ck, buf, cklen);
+		rspamd_cryptobox_sha_update (ck, (const guchar *)buf, cklen);
 		*remain = *remain - (cklen - added);
 		msg_debug ("update signature with body buffer "
 				"(%ud size, %ud remain, %ud added)",
@@ -1155,10 +1350,12 @@ rspamd_dkim_canonize_body (rspamd_dkim_context_t *ctx,
 	if (start == NULL) {
 		/* Empty body */
 		if (ctx->body_canon_type == DKIM_CANON_SIMPLE) {
-			g_checksum_update (ctx->body_hash, CRLF, sizeof (CRLF) - 1);
+			rspamd_cryptobox_sha_update (&ctx->body_hash,
+					(const guchar *)CRLF, sizeof (CRLF) - 1);
 		}
 		else {
-			g_checksum_update (ctx->body_hash, "", 0);
+			rspamd_cryptobox_sha_update (&ctx->body_hash,
+					(const guchar *)"", 0);
 		}
 	}
 	else {
@@ -1182,10 +1379,12 @@ rspamd_dkim_canonize_body (rspamd_dkim_context_t *ctx,
 		if (end == start) {
 			/* Empty body */
 			if (ctx->body_canon_type == DKIM_CANON_SIMPLE) {
-				g_checksum_update (ctx->body_hash, CRLF, sizeof (CRLF) - 1);
+				rspamd_cryptobox_sha_update (&ctx->body_hash,
+						(const guchar *)CRLF, sizeof (CRLF) - 1);
 			}
 			else {
-				g_checksum_update (ctx->body_hash, "", 0);
+				rspamd_cryptobox_sha_update (&ctx->body_hash,
+						(const guchar *)"", 0);
 			}
 		}
 		else {
@@ -1208,7 +1407,8 @@ rspamd_dkim_canonize_body (rspamd_dkim_context_t *ctx,
 
 /* Update hash converting all CR and LF to CRLF */
 static void
-rspamd_dkim_hash_update (GChecksum *ck, const gchar *begin, gsize len)
+rspamd_dkim_hash_update (rspamd_cryptobox_sha_state_t *ck, const gchar *begin,
+	gsize len)
 {
 	const gchar *p, *c, *end;
 
@@ -1217,8 +1417,9 @@ rspamd_dkim_hash_update (GChecksum *ck, const gchar *begin, gsize len)
 	c = p;
 	while (p != end) {
 		if (*p == '\r') {
-			g_checksum_update (ck, c,	 p - c);
-			g_checksum_update (ck, CRLF, sizeof (CRLF) - 1);
+			rspamd_cryptobox_sha_update (ck, (const guchar *)c, p - c);
+			rspamd_cryptobox_sha_update (ck,
+					(const guchar *)CRLF, sizeof (CRLF) - 1);
 			p++;
 			if (*p == '\n') {
 				p++;
@@ -1226,8 +1427,9 @@ rspamd_dkim_hash_update (GChecksum *ck, const gchar *begin, gsize len)
 			c = p;
 		}
 		else if (*p == '\n') {
-			g_checksum_update (ck, c,	 p - c);
-			g_checksum_update (ck, CRLF, sizeof (CRLF) - 1);
+			rspamd_cryptobox_sha_update (ck, (const guchar *)c, p - c);
+			rspamd_cryptobox_sha_update (ck,
+					(const guchar *)CRLF, sizeof (CRLF) - 1);
 			p++;
 			c = p;
 		}
@@ -1236,7 +1438,7 @@ rspamd_dkim_hash_update (GChecksum *ck, const gchar *begin, gsize len)
 		}
 	}
 	if (p != c) {
-		g_checksum_update (ck, c, p - c);
+		rspamd_cryptobox_sha_update (ck, (const guchar *)c, p - c);
 	}
 }
 
@@ -1261,7 +1463,7 @@ rspamd_dkim_signature_update (rspamd_dkim_context_t *ctx,
 			msg_debug ("initial update hash with signature part: %*s",
 				p - c + 2,
 				c);
-			rspamd_dkim_hash_update (ctx->headers_hash, c, p - c + 2);
+			rspamd_dkim_hash_update (&ctx->headers_hash, c, p - c + 2);
 			skip = TRUE;
 		}
 		else if (skip && (*p == ';' || p == end - 1)) {
@@ -1285,7 +1487,7 @@ rspamd_dkim_signature_update (rspamd_dkim_context_t *ctx,
 
 	if (p - c + 1 > 0) {
 		msg_debug ("final update hash with signature part: %*s", p - c + 1, c);
-		rspamd_dkim_hash_update (ctx->headers_hash, c, p - c + 1);
+		rspamd_dkim_hash_update (&ctx->headers_hash, c, p - c + 1);
 	}
 }
 
@@ -1353,7 +1555,8 @@ rspamd_dkim_canonize_header_relaxed (rspamd_dkim_context_t *ctx,
 
 	if (!is_sign) {
 		msg_debug ("update signature with header: %s", buf);
-		g_checksum_update (ctx->headers_hash, buf, t - buf);
+		rspamd_cryptobox_sha_update (&ctx->headers_hash,
+				(const guchar *)buf, t - buf);
 	}
 	else {
 		rspamd_dkim_signature_update (ctx, buf, t - buf);
@@ -1462,7 +1665,7 @@ rspamd_dkim_canonize_header_simple (rspamd_dkim_context_t *ctx,
 					msg_debug ("update signature with header: %*s",
 						elt->len,
 						elt->begin);
-					rspamd_dkim_hash_update (ctx->headers_hash,
+					rspamd_dkim_hash_update (&ctx->headers_hash,
 						elt->begin,
 						elt->len);
 				}
@@ -1470,7 +1673,7 @@ rspamd_dkim_canonize_header_simple (rspamd_dkim_context_t *ctx,
 					msg_debug ("update signature with header: %*s",
 						elt->len + 1,
 						elt->begin);
-					rspamd_dkim_hash_update (ctx->headers_hash,
+					rspamd_dkim_hash_update (&ctx->headers_hash,
 						elt->begin,
 						elt->len + 1);
 				}
@@ -1511,7 +1714,7 @@ rspamd_dkim_canonize_header (rspamd_dkim_context_t *ctx,
 				   is_sig);
 	}
 	else {
-		rh = g_hash_table_lookup (task->raw_headers, header_name);
+		rh = rspamd_pool_hash_lookup (task->raw_headers, header_name);
 		if (rh) {
 			if (!is_sig) {
 				rh_iter = rh;
@@ -1566,37 +1769,11 @@ rspamd_dkim_canonize_header (rspamd_dkim_context_t *ctx,
 	return FALSE;
 }
 
-/**
- * Check task for dkim context using dkim key
- * @param ctx dkim verify context
- * @param key dkim key (from cache or from dns request)
- * @param task task to check
- * @return
- */
-gint
-rspamd_dkim_check (rspamd_dkim_context_t *ctx,
-	rspamd_dkim_key_t *key,
-	struct rspamd_task *task)
+static const gchar *
+rspamd_dkim_find_body (const gchar *start, const gchar *end)
 {
-	const gchar *p, *headers_end = NULL, *end, *body_end;
+	const gchar *p = start, *headers_end = NULL;
 	gboolean got_cr = FALSE, got_crlf = FALSE, got_lf = FALSE;
-	gchar *digest;
-	gsize dlen;
-	gint res = DKIM_CONTINUE;
-	guint i;
-	struct rspamd_dkim_header *dh;
-#ifdef HAVE_OPENSSL
-	gint nid;
-#endif
-
-	g_return_val_if_fail (ctx != NULL,		 DKIM_ERROR);
-	g_return_val_if_fail (key != NULL,		 DKIM_ERROR);
-	g_return_val_if_fail (task->msg.len > 0, DKIM_ERROR);
-
-	/* First of all find place of body */
-	p = task->msg.start;
-
-	end = task->msg.start + task->msg.len;
 
 	while (p <= end) {
 		/* Search for \r\n\r\n at the end of headers */
@@ -1660,9 +1837,85 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 		p++;
 	}
 
+	return headers_end;
+}
+
+/*
+ * Body hash depends on the canonicalization, the hash algorithm and the
+ * length limit only, so it is computed once per message for each distinct
+ * combination of these and reused by all signatures of a message
+ */
+static struct rspamd_dkim_body_hash *
+rspamd_dkim_get_body_hash (rspamd_dkim_context_t *ctx,
+	struct rspamd_task *task)
+{
+	struct rspamd_dkim_body_cache *cache;
+	struct rspamd_dkim_body_hash *bh;
+	const gchar *end;
+
+	end = task->msg.start + task->msg.len;
+	cache = rspamd_mempool_get_variable (task->task_pool, DKIM_BODY_HASHES_VAR);
+
+	if (cache == NULL) {
+		cache = rspamd_mempool_alloc0 (task->task_pool, sizeof (*cache));
+		cache->body_start = rspamd_dkim_find_body (task->msg.start, end);
+		rspamd_mempool_set_variable (task->task_pool, DKIM_BODY_HASHES_VAR,
+				cache, NULL);
+	}
+
+	LL_FOREACH (cache->hashes, bh) {
+		if (bh->body_canon_type == ctx->body_canon_type &&
+				bh->sig_alg == ctx->sig_alg &&
+				bh->len == ctx->len) {
+			msg_debug ("reuse body hash for canon %d, alg %d and length %z",
+					bh->body_canon_type, bh->sig_alg, bh->len);
+			return bh;
+		}
+	}
+
+	if (!rspamd_dkim_canonize_body (ctx, cache->body_start, end)) {
+		return NULL;
+	}
+
+	bh = rspamd_mempool_alloc (task->task_pool, sizeof (*bh));
+	bh->body_canon_type = ctx->body_canon_type;
+	bh->sig_alg = ctx->sig_alg;
+	bh->len = ctx->len;
+	bh->dlen = rspamd_cryptobox_sha_final (&ctx->body_hash, bh->digest);
+	LL_PREPEND (cache->hashes, bh);
+
+	return bh;
+}
+
+/**
+ * Check task for dkim context using dkim key
+ * @param ctx dkim verify context
+ * @param key dkim key (from cache or from dns request)
+ * @param task task to check
+ * @return
+ */
+gint
+rspamd_dkim_check (rspamd_dkim_context_t *ctx,
+	rspamd_dkim_key_t *key,
+	struct rspamd_task *task)
+{
+	guchar *digest;
+	gsize dlen;
+	gint res = DKIM_CONTINUE;
+	guint i;
+	struct rspamd_dkim_header *dh;
+	struct rspamd_dkim_body_hash *bh;
+#ifdef HAVE_OPENSSL
+	gint nid;
+#endif
+
+	g_return_val_if_fail (ctx != NULL,		 DKIM_ERROR);
+	g_return_val_if_fail (key != NULL,		 DKIM_ERROR);
+	g_return_val_if_fail (task->msg.len > 0, DKIM_ERROR);
+
 	/* Start canonization of body part */
-	body_end = end;
-	if (!rspamd_dkim_canonize_body (ctx, headers_end, body_end)) {
+	bh = rspamd_dkim_get_body_hash (ctx, task);
+	if (bh == NULL) {
 		return DKIM_RECORD_ERROR;
 	}
 	/* Now canonize headers */
@@ -1675,17 +1928,16 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 	rspamd_dkim_canonize_header (ctx, task, DKIM_SIGNHEADER, 1, TRUE);
 
 	dlen = ctx->bhlen;
-	digest = g_alloca (dlen);
-	g_checksum_get_digest (ctx->body_hash, digest, &dlen);
 
 	/* Check bh field */
-	if (memcmp (ctx->bh, digest, dlen) != 0) {
+	if (bh->dlen != dlen || memcmp (ctx->bh, bh->digest, dlen) != 0) {
 		msg_debug ("bh value missmatch: %*xs versus %*xs", dlen, ctx->bh,
-				dlen, digest);
+				dlen, bh->digest);
 		return DKIM_REJECT;
 	}
 
-	g_checksum_get_digest (ctx->headers_hash, digest, &dlen);
+	digest = g_alloca (dlen);
+	dlen = rspamd_cryptobox_sha_final (&ctx->headers_hash, digest);
 #ifdef HAVE_OPENSSL
 	/* Check headers signature */
 
@@ -28,6 +28,7 @@
 #include "config.h"
 #include "event.h"
 #include "dns.h"
+#include "cryptobox.h"
 #ifdef HAVE_OPENSSL
 #include <openssl/rsa.h>
 #include <openssl/engine.h>
@@ -147,8 +148,8 @@ typedef struct rspamd_dkim_context_s {
 	GPtrArray *hlist;
 	guint ver;
 	gchar *dns_key;
-	GChecksum *headers_hash;
-	GChecksum *body_hash;
+	rspamd_cryptobox_sha_state_t headers_hash;
+	rspamd_cryptobox_sha_state_t body_hash;
 } rspamd_dkim_context_t;
 
 typedef struct rspamd_dkim_key_s {
@@ -207,6 +208,17 @@ gint rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 	rspamd_dkim_key_t *key,
 	struct rspamd_task *task);
 
+/**
+ * Make DKIM key from its decoded DER representation
+ * @param der public key in DER format
+ * @param len length of key
+ * @param ttl time to live of key
+ * @param err pointer to error object
+ * @return new key or NULL
+ */
+rspamd_dkim_key_t * rspamd_dkim_key_from_der (const guint8 *der, gsize len,
+	guint ttl, GError **err);
+
 /**
  * Free DKIM key
  * @param key
@@ -30,14 +30,341 @@
 #include "uthash.h"
 #include "rdns_event.h"
 
+/* Check sockets to be reopened every minute */
+#define DNS_SOCKETS_CHECK_TIME 60.0
+
+struct rspamd_dns_inflight;
+
 struct rspamd_dns_request_ud {
 	struct rspamd_async_session *session;
 	dns_callback_type cb;
 	gpointer ud;
 	rspamd_mempool_t *pool;
 	struct rdns_request *req;
+	struct rspamd_async_watcher *w;
+	struct rspamd_dns_resolver *resolver;
+	gdouble start;
+	/* Cached requests: reply is passed from the timer */
+	struct rdns_reply *reply;
+	struct event ev;
+	/* Requests waiting for the same name to be resolved */
+	struct rspamd_dns_inflight *inflight;
+	struct rspamd_dns_request_ud *prev, *next;
+};
+
+/* Request that is sent to DNS servers on behalf of all its waiters */
+struct rspamd_dns_inflight {
+	gchar *key;
+	struct rspamd_dns_resolver *resolver;
+	gdouble start;
+	struct rspamd_dns_request_ud *waiters;
+};
+
+/* Retained request that owns the reply */
+struct rspamd_dns_cached_reply {
+	struct rdns_request *req;
+	struct rdns_reply *reply;
 };
 
+/* Recorded replies of a request, they are served in turn */
+struct rspamd_dns_replay_elt {
+	GPtrArray *replies;
+	guint cur;
+};
+
+static const enum rdns_request_type rspamd_dns_types[] = {
+	RDNS_REQUEST_A,
+	RDNS_REQUEST_NS,
+	RDNS_REQUEST_SOA,
+	RDNS_REQUEST_PTR,
+	RDNS_REQUEST_MX,
+	RDNS_REQUEST_TXT,
+	RDNS_REQUEST_SRV,
+	RDNS_REQUEST_SPF,
+	RDNS_REQUEST_AAAA,
+	RDNS_REQUEST_TLSA,
+	RDNS_REQUEST_ANY
+};
+
+static gboolean
+rspamd_dns_type_from_str (const gchar *str, enum rdns_request_type *type)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (rspamd_dns_types); i ++) {
+		if (g_ascii_strcasecmp (str, rdns_strtype (rspamd_dns_types[i])) == 0) {
+			*type = rspamd_dns_types[i];
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static gchar *
+rspamd_dns_request_key (enum rdns_request_type type, const gchar *name)
+{
+	gchar *key;
+
+	key = g_strdup_printf ("%s %s", rdns_strtype (type), name);
+	rspamd_str_lc (key, strlen (key));
+
+	return key;
+}
+
+static ucl_object_t *
+rspamd_dns_entry_to_ucl (struct rdns_reply_entry *elt)
+{
+	ucl_object_t *obj;
+	gchar addrbuf[INET6_ADDRSTRLEN + 1], *b64;
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromstring (rdns_strtype (elt->type)),
+			"type", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (elt->ttl), "ttl", 0, false);
+
+	switch (elt->type) {
+	case RDNS_REQUEST_A:
+		inet_ntop (AF_INET, &elt->content.a.addr, addrbuf, sizeof (addrbuf));
+		ucl_object_insert_key (obj, ucl_object_fromstring (addrbuf),
+				"addr", 0, true);
+		break;
+	case RDNS_REQUEST_AAAA:
+		inet_ntop (AF_INET6, &elt->content.aaa.addr, addrbuf, sizeof (addrbuf));
+		ucl_object_insert_key (obj, ucl_object_fromstring (addrbuf),
+				"addr", 0, true);
+		break;
+	case RDNS_REQUEST_PTR:
+		ucl_object_insert_key (obj,
+				ucl_object_fromstring (elt->content.ptr.name), "name", 0, false);
+		break;
+	case RDNS_REQUEST_NS:
+		ucl_object_insert_key (obj,
+				ucl_object_fromstring (elt->content.ns.name), "name", 0, false);
+		break;
+	case RDNS_REQUEST_MX:
+		ucl_object_insert_key (obj,
+				ucl_object_fromstring (elt->content.mx.name), "name", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromint (elt->content.mx.priority),
+				"priority", 0, false);
+		break;
+	case RDNS_REQUEST_TXT:
+	case RDNS_REQUEST_SPF:
+		ucl_object_insert_key (obj,
+				ucl_object_fromstring (elt->content.txt.data), "data", 0, false);
+		break;
+	case RDNS_REQUEST_SRV:
+		ucl_object_insert_key (obj,
+				ucl_object_fromstring (elt->content.srv.target),
+				"target", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromint (elt->content.srv.priority),
+				"priority", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromint (elt->content.srv.weight),
+				"weight", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromint (elt->content.srv.port),
+				"port", 0, false);
+		break;
+	case RDNS_REQUEST_SOA:
+		ucl_object_insert_key (obj,
+				ucl_object_fromstring (elt->content.soa.mname),
+				"mname", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromstring (elt->content.soa.admin),
+				"admin", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromint (elt->content.soa.serial),
+				"serial", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromint (elt->content.soa.refresh),
+				"refresh", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromint (elt->content.soa.retry),
+				"retry", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromint (elt->content.soa.expire),
+				"expire", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromint (elt->content.soa.minimum),
+				"minimum", 0, false);
+		break;
+	case RDNS_REQUEST_TLSA:
+		ucl_object_insert_key (obj,
+				ucl_object_fromint (elt->content.tlsa.usage),
+				"usage", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromint (elt->content.tlsa.selector),
+				"selector", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromint (elt->content.tlsa.match_type),
+				"match_type", 0, false);
+		b64 = g_base64_encode (elt->content.tlsa.data,
+				elt->content.tlsa.datalen);
+		ucl_object_insert_key (obj, ucl_object_fromstring (b64),
+				"data", 0, false);
+		g_free (b64);
+		break;
+	default:
+		break;
+	}
+
+	return obj;
+}
+
+static gchar *
+rspamd_dns_ucl_strdup (const ucl_object_t *obj, const gchar *key)
+{
+	const ucl_object_t *elt;
+
+	elt = ucl_object_find_key (obj, key);
+
+	/* Entries are freed by librdns, so strings are allocated by malloc */
+	return strdup (elt != NULL ? ucl_object_tostring_forced (elt) : "");
+}
+
+static gint64
+rspamd_dns_ucl_int (const ucl_object_t *obj, const gchar *key)
+{
+	const ucl_object_t *elt;
+
+	elt = ucl_object_find_key (obj, key);
+
+	return elt != NULL ? ucl_object_toint (elt) : 0;
+}
+
+static struct rdns_reply_entry *
+rspamd_dns_entry_from_ucl (const ucl_object_t *obj)
+{
+	struct rdns_reply_entry *elt;
+	const ucl_object_t *cur;
+	enum rdns_request_type type;
+	const gchar *str;
+	guchar *data;
+	gsize dlen;
+
+	cur = ucl_object_find_key (obj, "type");
+
+	if (cur == NULL || !rspamd_dns_type_from_str (ucl_object_tostring (cur),
+			&type)) {
+		return NULL;
+	}
+
+	elt = calloc (1, sizeof (*elt));
+	elt->type = type;
+	elt->ttl = rspamd_dns_ucl_int (obj, "ttl");
+
+	switch (type) {
+	case RDNS_REQUEST_A:
+	case RDNS_REQUEST_AAAA:
+		cur = ucl_object_find_key (obj, "addr");
+		str = cur != NULL ? ucl_object_tostring (cur) : NULL;
+
+		if (str == NULL || inet_pton (type == RDNS_REQUEST_A ? AF_INET : AF_INET6,
+				str, type == RDNS_REQUEST_A ? (gpointer)&elt->content.a.addr :
+				(gpointer)&elt->content.aaa.addr) != 1) {
+			free (elt);
+			return NULL;
+		}
+		break;
+	case RDNS_REQUEST_PTR:
+		elt->content.ptr.name = rspamd_dns_ucl_strdup (obj, "name");
+		break;
+	case RDNS_REQUEST_NS:
+		elt->content.ns.name = rspamd_dns_ucl_strdup (obj, "name");
+		break;
+	case RDNS_REQUEST_MX:
+		elt->content.mx.name = rspamd_dns_ucl_strdup (obj, "name");
+		elt->content.mx.priority = rspamd_dns_ucl_int (obj, "priority");
+		break;
+	case RDNS_REQUEST_TXT:
+	case RDNS_REQUEST_SPF:
+		elt->content.txt.data = rspamd_dns_ucl_strdup (obj, "data");
+		break;
+	case RDNS_REQUEST_SRV:
+		elt->content.srv.target = rspamd_dns_ucl_strdup (obj, "target");
+		elt->content.srv.priority = rspamd_dns_ucl_int (obj, "priority");
+		elt->content.srv.weight = rspamd_dns_ucl_int (obj, "weight");
+		elt->content.srv.port = rspamd_dns_ucl_int (obj, "port");
+		break;
+	case RDNS_REQUEST_SOA:
+		elt->content.soa.mname = rspamd_dns_ucl_strdup (obj, "mname");
+		elt->content.soa.admin = rspamd_dns_ucl_strdup (obj, "admin");
+		elt->content.soa.serial = rspamd_dns_ucl_int (obj, "serial");
+		elt->content.soa.refresh = rspamd_dns_ucl_int (obj, "refresh");
+		elt->content.soa.retry = rspamd_dns_ucl_int (obj, "retry");
+		elt->content.soa.expire = rspamd_dns_ucl_int (obj, "expire");
+		elt->content.soa.minimum = rspamd_dns_ucl_int (obj, "minimum");
+		break;
+	case RDNS_REQUEST_TLSA:
+		elt->content.tlsa.usage = rspamd_dns_ucl_int (obj, "usage");
+		elt->content.tlsa.selector = rspamd_dns_ucl_int (obj, "selector");
+		elt->content.tlsa.match_type = rspamd_dns_ucl_int (obj, "match_type");
+		cur = ucl_object_find_key (obj, "data");
+		str = cur != NULL ? ucl_object_tostring (cur) : "";
+		data = rspamd_decode_base64 (str, strlen (str), &dlen);
+		elt->content.tlsa.data = malloc (MAX (dlen, 1));
+		memcpy (elt->content.tlsa.data, data, dlen);
+		elt->content.tlsa.datalen = dlen;
+		g_free (data);
+		break;
+	default:
+		break;
+	}
+
+	return elt;
+}
+
+static void
+rspamd_dns_record_reply (struct rspamd_dns_resolver *resolver,
+	struct rdns_reply *reply, gdouble start)
+{
+	const struct rdns_request_name *rn;
+	struct rdns_reply_entry *elt;
+	ucl_object_t *obj, *answers;
+	guchar *out;
+	GString *line;
+
+	rn = rdns_request_get_name (reply->request, NULL);
+
+	if (rn == NULL) {
+		return;
+	}
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromstring (rn->name),
+			"name", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromstring (rdns_strtype (rn->type)),
+			"type", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (reply->code),
+			"rcode", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (rspamd_get_ticks () - start),
+			"latency", 0, false);
+	answers = ucl_object_typed_new (UCL_ARRAY);
+
+	LL_FOREACH (reply->entries, elt) {
+		ucl_object_array_push (answers, rspamd_dns_entry_to_ucl (elt));
+	}
+
+	ucl_object_insert_key (obj, answers, "answers", 0, false);
+
+	out = ucl_object_emit (obj, UCL_EMIT_JSON_COMPACT);
+	line = g_string_new ((const gchar *)out);
+	g_string_append_c (line, '\n');
+
+	/* Single write of a line keeps records of processes apart */
+	if (write (resolver->record_fd, line->str, line->len) == -1) {
+		msg_err ("cannot write DNS record: %s", strerror (errno));
+	}
+
+	g_string_free (line, TRUE);
+	free (out);
+	ucl_object_unref (obj);
+}
+
 static void
 rspamd_dns_fin_cb (gpointer arg)
 {
@@ -54,9 +381,22 @@ rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
 {
 	struct rspamd_dns_request_ud *reqdata = ud;
 
+	if (reqdata->resolver->record_fd != -1) {
+		rspamd_dns_record_reply (reqdata->resolver, reply, reqdata->start);
+	}
+
+	/*
+	 * Requests made from the callback should be attached to the same watcher
+	 * as the original request
+	 */
+	if (reqdata->session) {
+		rspamd_session_watcher_push (reqdata->session, reqdata->w);
+	}
+
 	reqdata->cb (reply, reqdata->ud);
 
 	if (reqdata->session) {
+		rspamd_session_watcher_pop (reqdata->session, reqdata->w);
 		/*
 		 * Ref event to avoid double unref by
 		 * event removing
@@ -69,6 +409,401 @@ rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
 	}
 }
 
+static void
+rspamd_dns_cached_reply_free (gpointer p)
+{
+	struct rspamd_dns_cached_reply *cached = p;
+
+	rdns_request_release (cached->req);
+	g_slice_free1 (sizeof (*cached), cached);
+}
+
+/*
+ * Finalizer of requests served by cache: either from the cache itself or
+ * from a request that is already being resolved
+ */
+static void
+rspamd_dns_waiter_fin (gpointer arg)
+{
+	struct rspamd_dns_request_ud *reqdata = arg;
+
+	if (reqdata->inflight != NULL) {
+		DL_DELETE (reqdata->inflight->waiters, reqdata);
+		reqdata->inflight = NULL;
+	}
+
+	if (reqdata->req != NULL) {
+		event_del (&reqdata->ev);
+		rdns_request_release (reqdata->req);
+		reqdata->req = NULL;
+	}
+
+	if (reqdata->pool == NULL) {
+		g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
+	}
+}
+
+static void
+rspamd_dns_waiter_deliver (struct rspamd_dns_request_ud *reqdata,
+	struct rdns_reply *reply)
+{
+	if (reqdata->session) {
+		rspamd_session_watcher_push (reqdata->session, reqdata->w);
+		reqdata->cb (reply, reqdata->ud);
+		rspamd_session_watcher_pop (reqdata->session, reqdata->w);
+		remove_normal_event (reqdata->session, rspamd_dns_waiter_fin, reqdata);
+	}
+	else {
+		reqdata->cb (reply, reqdata->ud);
+		rspamd_dns_waiter_fin (reqdata);
+	}
+}
+
+static void
+rspamd_dns_cached_timer_cb (gint fd, short what, gpointer arg)
+{
+	struct rspamd_dns_request_ud *reqdata = arg;
+
+	rspamd_dns_waiter_deliver (reqdata, reqdata->reply);
+}
+
+/*
+ * Positive replies live for the minimal TTL of their records; negative
+ * answers (NXDOMAIN or no records, RFC 2308) live for the negative TTL as
+ * SOA records are not available from the reply
+ */
+static gboolean
+rspamd_dns_reply_ttl (struct rspamd_dns_resolver *resolver,
+	struct rdns_reply *reply, guint *pttl)
+{
+	struct rdns_reply_entry *elt;
+	gint32 min_ttl = G_MAXINT32;
+	guint ttl;
+
+	if (reply->code == RDNS_RC_NOERROR && reply->entries != NULL) {
+		LL_FOREACH (reply->entries, elt) {
+			min_ttl = MIN (min_ttl, elt->ttl);
+		}
+
+		ttl = MAX (min_ttl, 0);
+	}
+	else if (reply->code == RDNS_RC_NOERROR || reply->code == RDNS_RC_NXDOMAIN) {
+		ttl = resolver->cache_negative_ttl;
+	}
+	else {
+		/* Do not cache failures */
+		return FALSE;
+	}
+
+	ttl = CLAMP (ttl, resolver->cache_min_ttl, resolver->cache_max_ttl);
+
+	if (ttl == 0) {
+		return FALSE;
+	}
+
+	*pttl = ttl;
+
+	return TRUE;
+}
+
+static void
+rspamd_dns_inflight_callback (struct rdns_reply *reply, gpointer arg)
+{
+	struct rspamd_dns_inflight *inflight = arg;
+	struct rspamd_dns_resolver *resolver = inflight->resolver;
+	struct rspamd_dns_cached_reply *cached;
+	struct rspamd_dns_request_ud *reqdata;
+	guint ttl;
+
+	g_hash_table_remove (resolver->inflight, inflight->key);
+
+	if (resolver->record_fd != -1) {
+		rspamd_dns_record_reply (resolver, reply, inflight->start);
+	}
+
+	if (rspamd_dns_reply_ttl (resolver, reply, &ttl)) {
+		cached = g_slice_alloc (sizeof (*cached));
+		cached->req = rdns_request_retain (reply->request);
+		cached->reply = reply;
+		/* Key is owned by cache now */
+		rspamd_lru_hash_insert (resolver->cache, inflight->key, cached,
+				time (NULL), ttl);
+		inflight->key = NULL;
+	}
+
+	/* Callbacks may finish sessions of other waiters, so pop them one by one */
+	while ((reqdata = inflight->waiters) != NULL) {
+		DL_DELETE (inflight->waiters, reqdata);
+		reqdata->inflight = NULL;
+		rspamd_dns_waiter_deliver (reqdata, reply);
+	}
+
+	g_free (inflight->key);
+	g_slice_free1 (sizeof (*inflight), inflight);
+}
+
+static gboolean
+rspamd_dns_cached_request (struct rspamd_dns_resolver *resolver,
+	struct rspamd_dns_request_ud *reqdata,
+	enum rdns_request_type type,
+	const char *name)
+{
+	struct rspamd_dns_cached_reply *cached;
+	struct rspamd_dns_inflight *inflight;
+	struct timeval tv;
+	gchar *key;
+
+	key = rspamd_dns_request_key (type, name);
+	cached = rspamd_lru_hash_lookup (resolver->cache, key, time (NULL));
+
+	if (cached != NULL) {
+		if (resolver->cache_hits) {
+			(*resolver->cache_hits) ++;
+		}
+
+		g_free (key);
+		/* Reply is delivered asynchronously as callers expect */
+		reqdata->req = rdns_request_retain (cached->req);
+		reqdata->reply = cached->reply;
+		evtimer_set (&reqdata->ev, rspamd_dns_cached_timer_cb, reqdata);
+		event_base_set (resolver->ev_base, &reqdata->ev);
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		evtimer_add (&reqdata->ev, &tv);
+	}
+	else {
+		inflight = g_hash_table_lookup (resolver->inflight, key);
+
+		if (inflight == NULL) {
+			if (resolver->cache_misses) {
+				(*resolver->cache_misses) ++;
+			}
+
+			inflight = g_slice_alloc0 (sizeof (*inflight));
+			inflight->resolver = resolver;
+			inflight->key = key;
+			inflight->start = reqdata->start;
+
+			if (rdns_make_request_full (resolver->r,
+					rspamd_dns_inflight_callback, inflight,
+					resolver->request_timeout, resolver->max_retransmits, 1,
+					name, type) == NULL) {
+				g_free (key);
+				g_slice_free1 (sizeof (*inflight), inflight);
+
+				return FALSE;
+			}
+
+			g_hash_table_insert (resolver->inflight, inflight->key, inflight);
+		}
+		else {
+			/* The same request is already sent */
+			if (resolver->cache_hits) {
+				(*resolver->cache_hits) ++;
+			}
+
+			g_free (key);
+		}
+
+		reqdata->inflight = inflight;
+		DL_APPEND (inflight->waiters, reqdata);
+	}
+
+	if (reqdata->session) {
+		register_async_event (reqdata->session,
+				(event_finalizer_t)rspamd_dns_waiter_fin,
+				reqdata,
+				g_quark_from_static_string ("dns resolver"));
+	}
+
+	return TRUE;
+}
+
+/*
+ * Serve a recorded reply after its latency
+ */
+static gboolean
+rspamd_dns_replay_request (struct rspamd_dns_resolver *resolver,
+	struct rspamd_dns_request_ud *reqdata,
+	enum rdns_request_type type,
+	const char *name)
+{
+	struct rspamd_dns_replay_elt *elt;
+	const ucl_object_t *obj, *answers, *cur;
+	struct rdns_reply *reply;
+	struct rdns_reply_entry *entry;
+	ucl_object_iter_t it = NULL;
+	struct timeval tv;
+	gdouble latency;
+	gchar *key;
+
+	key = rspamd_dns_request_key (type, name);
+	elt = g_hash_table_lookup (resolver->replay, key);
+	g_free (key);
+
+	if (elt == NULL) {
+		return FALSE;
+	}
+
+	obj = g_ptr_array_index (elt->replies, elt->cur);
+	elt->cur = (elt->cur + 1) % elt->replies->len;
+
+	reply = rdns_make_fake_reply (resolver->r, name, type,
+			rspamd_dns_ucl_int (obj, "rcode"));
+
+	if (reply == NULL) {
+		return FALSE;
+	}
+
+	answers = ucl_object_find_key (obj, "answers");
+
+	while ((cur = ucl_iterate_object (answers, &it, true)) != NULL) {
+		entry = rspamd_dns_entry_from_ucl (cur);
+
+		if (entry != NULL) {
+			DL_APPEND (reply->entries, entry);
+		}
+	}
+
+	cur = ucl_object_find_key (obj, "latency");
+	latency = cur != NULL ? ucl_object_todouble (cur) : 0;
+
+	reqdata->req = reply->request;
+	reqdata->reply = reply;
+	evtimer_set (&reqdata->ev, rspamd_dns_cached_timer_cb, reqdata);
+	event_base_set (resolver->ev_base, &reqdata->ev);
+	double_to_tv (MAX (latency, 0), &tv);
+	evtimer_add (&reqdata->ev, &tv);
+
+	if (reqdata->session) {
+		register_async_event (reqdata->session,
+				(event_finalizer_t)rspamd_dns_waiter_fin,
+				reqdata,
+				g_quark_from_static_string ("dns resolver"));
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_dns_resolver_record (struct rspamd_dns_resolver *resolver,
+	const gchar *path)
+{
+	gint fd;
+
+	fd = open (path, O_WRONLY | O_CREAT | O_APPEND, 00644);
+
+	if (fd == -1) {
+		msg_err ("cannot open DNS records file %s: %s", path, strerror (errno));
+		return FALSE;
+	}
+
+	if (resolver->record_fd != -1) {
+		close (resolver->record_fd);
+	}
+
+	resolver->record_fd = fd;
+
+	return TRUE;
+}
+
+static void
+rspamd_dns_replay_elt_free (gpointer p)
+{
+	struct rspamd_dns_replay_elt *elt = p;
+
+	g_ptr_array_free (elt->replies, TRUE);
+	g_slice_free1 (sizeof (*elt), elt);
+}
+
+gboolean
+rspamd_dns_resolver_replay (struct rspamd_dns_resolver *resolver,
+	const gchar *path)
+{
+	struct rspamd_dns_replay_elt *elt;
+	struct ucl_parser *parser;
+	const ucl_object_t *name, *type;
+	ucl_object_t *obj;
+	enum rdns_request_type rtype;
+	GError *err = NULL;
+	gchar *data, **lines, *key;
+	gsize len;
+	guint i, nreplies = 0;
+
+	if (!g_file_get_contents (path, &data, &len, &err)) {
+		msg_err ("cannot read DNS records file %s: %e", path, err);
+		g_error_free (err);
+		return FALSE;
+	}
+
+	if (resolver->replay == NULL) {
+		resolver->replay = g_hash_table_new_full (g_str_hash, g_str_equal,
+				g_free, rspamd_dns_replay_elt_free);
+	}
+
+	lines = g_strsplit (data, "\n", -1);
+	g_free (data);
+
+	for (i = 0; lines[i] != NULL; i ++) {
+		if (lines[i][0] == '\0') {
+			continue;
+		}
+
+		parser = ucl_parser_new (0);
+
+		if (!ucl_parser_add_string (parser, lines[i], 0)) {
+			msg_warn ("invalid DNS record at line %ud of %s: %s", i + 1, path,
+					ucl_parser_get_error (parser));
+			ucl_parser_free (parser);
+			continue;
+		}
+
+		obj = ucl_parser_get_object (parser);
+		ucl_parser_free (parser);
+		name = ucl_object_find_key (obj, "name");
+		type = ucl_object_find_key (obj, "type");
+
+		if (name == NULL || type == NULL ||
+				!rspamd_dns_type_from_str (ucl_object_tostring (type), &rtype)) {
+			msg_warn ("invalid DNS record at line %ud of %s", i + 1, path);
+			ucl_object_unref (obj);
+			continue;
+		}
+
+		key = rspamd_dns_request_key (rtype, ucl_object_tostring (name));
+		elt = g_hash_table_lookup (resolver->replay, key);
+
+		if (elt == NULL) {
+			elt = g_slice_alloc0 (sizeof (*elt));
+			elt->replies = g_ptr_array_new_with_free_func (
+					(GDestroyNotify)ucl_object_unref);
+			g_hash_table_insert (resolver->replay, key, elt);
+		}
+		else {
+			g_free (key);
+		}
+
+		g_ptr_array_add (elt->replies, obj);
+		nreplies ++;
+	}
+
+	g_strfreev (lines);
+	msg_info ("loaded %ud recorded DNS replies of %ud requests from %s",
+			nreplies, g_hash_table_size (resolver->replay), path);
+
+	return TRUE;
+}
+
+void
+rspamd_dns_resolver_set_counters (struct rspamd_dns_resolver *resolver,
+	guint64 *hits, guint64 *misses)
+{
+	g_assert (resolver != NULL);
+
+	resolver->cache_hits = hits;
+	resolver->cache_misses = misses;
+}
+
 gboolean
 make_dns_request (struct rspamd_dns_resolver *resolver,
 	struct rspamd_async_session *session,
@@ -80,6 +815,11 @@ make_dns_request (struct rspamd_dns_resolver *resolver,
 {
 	struct rdns_request *req;
 	struct rspamd_dns_request_ud *reqdata = NULL;
+	gdouble timeout, total;
+
+	if (resolver->offline) {
+		return FALSE;
+	}
 
 	if (pool != NULL) {
 		reqdata =
@@ -92,9 +832,58 @@ make_dns_request (struct rspamd_dns_resolver *resolver,
 	reqdata->session = session;
 	reqdata->cb = cb;
 	reqdata->ud = ud;
+	reqdata->w = rspamd_session_get_watcher (session);
+	reqdata->resolver = resolver;
+	reqdata->start = rspamd_get_ticks ();
+
+	if (resolver->replay != NULL) {
+		reqdata->req = NULL;
+		reqdata->inflight = NULL;
+		reqdata->prev = NULL;
+		reqdata->next = NULL;
+
+		if (!rspamd_dns_replay_request (resolver, reqdata, type, name)) {
+			if (pool == NULL) {
+				g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
+			}
+
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+	if (resolver->cache != NULL) {
+		reqdata->req = NULL;
+		reqdata->inflight = NULL;
+		reqdata->prev = NULL;
+		reqdata->next = NULL;
+
+		if (!rspamd_dns_cached_request (resolver, reqdata, type, name)) {
+			if (pool == NULL) {
+				g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
+			}
+
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+	/* All retransmits of a request should fit the session's deadline */
+	timeout = resolver->request_timeout;
+
+	if (resolver->max_retransmits > 0) {
+		total = timeout * resolver->max_retransmits;
+		timeout = rspamd_session_clamp_timeout (session, total) /
+				resolver->max_retransmits;
+	}
+	else {
+		timeout = rspamd_session_clamp_timeout (session, timeout);
+	}
 
 	req = rdns_make_request_full (resolver->r, rspamd_dns_callback, reqdata,
-			resolver->request_timeout, resolver->max_retransmits, 1, name,
+			timeout, resolver->max_retransmits, 1, name,
 			type);
 	reqdata->req = req;
 
@@ -117,6 +906,24 @@ make_dns_request (struct rspamd_dns_resolver *resolver,
 	return TRUE;
 }
 
+static void
+rspamd_dns_prefetch_callback (struct rdns_reply *reply, gpointer ud)
+{
+	/* Reply is already in the cache */
+}
+
+gboolean
+rspamd_dns_prefetch (struct rspamd_dns_resolver *resolver,
+	enum rdns_request_type type,
+	const char *name)
+{
+	if (resolver->cache == NULL) {
+		return FALSE;
+	}
+
+	return make_dns_request (resolver, NULL, NULL,
+			rspamd_dns_prefetch_callback, NULL, type, name);
+}
 
 struct rspamd_dns_resolver *
 dns_resolver_init (rspamd_logger_t *logger,
@@ -130,6 +937,7 @@ dns_resolver_init (rspamd_logger_t *logger,
 
 	new = g_slice_alloc0 (sizeof (struct rspamd_dns_resolver));
 	new->ev_base = ev_base;
+	new->record_fd = -1;
 	if (cfg != NULL) {
 		new->request_timeout = cfg->dns_timeout;
 		new->max_retransmits = cfg->dns_retransmits;
@@ -143,7 +951,14 @@ dns_resolver_init (rspamd_logger_t *logger,
 	rdns_bind_libevent (new->r, new->ev_base);
 
 	if (cfg != NULL) {
-		rdns_resolver_set_log_level (new->r, cfg->log_level);
+		if (cfg->log_level >= G_LOG_LEVEL_DEBUG &&
+				!rspamd_log_module_debug (RSPAMD_LOG_MODULE_DNS)) {
+			/* Debug of resolver is not requested */
+			rdns_resolver_set_log_level (new->r, G_LOG_LEVEL_INFO);
+		}
+		else {
+			rdns_resolver_set_log_level (new->r, cfg->log_level);
+		}
 	}
 	rdns_resolver_set_logger (new->r,
 		(rdns_log_function)rspamd_common_logv,
@@ -191,5 +1006,37 @@ dns_resolver_init (rspamd_logger_t *logger,
 
 	rdns_resolver_init (new->r);
 
+	if (cfg != NULL) {
+		if (cfg->dns_socket_uses > 0) {
+			rdns_resolver_set_max_io_uses (new->r, cfg->dns_socket_uses,
+					DNS_SOCKETS_CHECK_TIME);
+		}
+
+		rdns_resolver_set_max_outstanding (new->r, cfg->dns_max_outstanding);
+		rdns_resolver_set_slow_factor (new->r, cfg->dns_slow_factor);
+	}
+
+	if (cfg != NULL && cfg->dns_cache_size > 0) {
+		/* Options are in milliseconds */
+		new->cache_min_ttl = cfg->dns_cache_min_ttl / 1000;
+		new->cache_max_ttl = MAX (cfg->dns_cache_max_ttl / 1000,
+				new->cache_min_ttl);
+		new->cache_negative_ttl = cfg->dns_cache_negative_ttl / 1000;
+
+		if (new->cache_max_ttl > 0) {
+			new->cache = rspamd_lru_hash_new_full (cfg->dns_cache_size,
+					new->cache_max_ttl, g_free, rspamd_dns_cached_reply_free,
+					g_str_hash, g_str_equal);
+			new->inflight = g_hash_table_new (g_str_hash, g_str_equal);
+		}
+	}
+
+	if (cfg != NULL && cfg->dns_replay_file != NULL) {
+		rspamd_dns_resolver_replay (new, cfg->dns_replay_file);
+	}
+	else if (cfg != NULL && cfg->dns_record_file != NULL) {
+		rspamd_dns_resolver_record (new, cfg->dns_record_file);
+	}
+
 	return new;
 }
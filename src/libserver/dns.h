@@ -31,12 +31,28 @@
 #include "events.h"
 #include "logger.h"
 #include "rdns.h"
+#include "hash.h"
 
 struct rspamd_dns_resolver {
 	struct rdns_resolver *r;
 	struct event_base *ev_base;
 	gdouble request_timeout;
 	guint max_retransmits;
+	/* Replies cache, NULL if disabled */
+	rspamd_lru_hash_t *cache;
+	/* Requests being resolved indexed by cache key */
+	GHashTable *inflight;
+	guint cache_min_ttl;
+	guint cache_max_ttl;
+	guint cache_negative_ttl;
+	guint64 *cache_hits;
+	guint64 *cache_misses;
+	/* Requests fail without sending, used to get reproducible benchmarks */
+	gboolean offline;
+	/* Replies received from servers are appended to this file or -1 */
+	gint record_fd;
+	/* Recorded replies indexed by type and name, no requests are sent */
+	GHashTable *replay;
 };
 
 /* Rspamd DNS API */
@@ -47,6 +63,34 @@ struct rspamd_dns_resolver {
 struct rspamd_dns_resolver * dns_resolver_init (rspamd_logger_t *logger,
 	struct event_base *ev_base, struct rspamd_config *cfg);
 
+/**
+ * Append replies received from DNS servers to a file, each reply is written
+ * as a JSON object on a separate line with the latency of its request
+ * @param resolver resolver object
+ * @param path file name
+ * @return TRUE if file has been opened
+ */
+gboolean rspamd_dns_resolver_record (struct rspamd_dns_resolver *resolver,
+	const gchar *path);
+
+/**
+ * Serve replies recorded by rspamd_dns_resolver_record instead of sending
+ * requests: each reply is delivered after its recorded latency, replies of
+ * the same request are served in turn and requests that have not been
+ * recorded fail immediately
+ * @param resolver resolver object
+ * @param path file name
+ * @return TRUE if file has been loaded
+ */
+gboolean rspamd_dns_resolver_replay (struct rspamd_dns_resolver *resolver,
+	const gchar *path);
+
+/**
+ * Set counters of requests served from the cache and sent to DNS servers
+ */
+void rspamd_dns_resolver_set_counters (struct rspamd_dns_resolver *resolver,
+	guint64 *hits, guint64 *misses);
+
 /**
  * Make a DNS request
  * @param resolver resolver object
@@ -66,4 +110,16 @@ gboolean make_dns_request (struct rspamd_dns_resolver *resolver,
 	enum rdns_request_type type,
 	const char *name);
 
+/**
+ * Send a DNS request without waiting for its reply, the reply is stored in the
+ * replies cache and requests made meanwhile wait for it
+ * @param resolver resolver object
+ * @param type request type
+ * @param name name to resolve
+ * @return TRUE if request was sent, FALSE if it failed or cache is disabled
+ */
+gboolean rspamd_dns_prefetch (struct rspamd_dns_resolver *resolver,
+	enum rdns_request_type type,
+	const char *name);
+
 #endif
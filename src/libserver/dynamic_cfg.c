@@ -26,6 +26,56 @@
 #include "map.h"
 #include "filter.h"
 #include "dynamic_cfg.h"
+#include "xxhash.h"
+
+/* Number of the last changes kept in shared memory */
+#define DYNAMIC_DELTAS_MAX 512
+#define DYNAMIC_METRIC_LEN 64
+
+enum rspamd_dynamic_delta_type {
+	RSPAMD_DYNAMIC_SYMBOL = 0,
+	RSPAMD_DYNAMIC_ACTION
+};
+
+/*
+ * Change of a symbol weight or an action score
+ */
+struct rspamd_dynamic_delta {
+	enum rspamd_dynamic_delta_type type;
+	gint action;
+	gdouble value;
+	gchar metric[DYNAMIC_METRIC_LEN];
+	gchar name[MAX_SYMBOL];
+};
+
+/*
+ * Changes published by controllers for all processes, each process applies
+ * changes newer than cfg->dynamic_seq in place
+ */
+struct rspamd_dynamic_deltas {
+	rspamd_mempool_mutex_t *mtx;
+	volatile guint64 seq;                   /**< number of changes published	*/
+	guint64 dump_seq;                       /**< changes written by the last dump	*/
+	guint64 dump_hash;                      /**< hash of the last dump			*/
+	struct rspamd_dynamic_delta deltas[DYNAMIC_DELTAS_MAX];
+};
+
+/*
+ * Writer of dynamic configuration running in a separate thread
+ */
+struct rspamd_dynamic_dumper {
+	struct rspamd_config *cfg;
+	struct event_base *ev_base;
+	GThread *thr;
+	struct event ev;
+	gint wake_fd[2];
+	GString *data;
+	mode_t mode;
+	gchar *err;
+	gboolean pending;
+};
+
+static struct rspamd_dynamic_dumper *dynamic_dumper = NULL;
 
 struct config_json_buf {
 	gchar *buf;
@@ -186,8 +236,10 @@ void
 json_config_fin_cb (rspamd_mempool_t * pool, struct map_cb_data *data)
 {
 	struct config_json_buf *jb;
+	struct rspamd_dynamic_deltas *d;
 	ucl_object_t *top;
 	struct ucl_parser *parser;
+	guint64 hash, dump_hash = 0, dump_seq = 0, seq = 0;
 
 	if (data->prev_data) {
 		jb = data->prev_data;
@@ -213,6 +265,23 @@ json_config_fin_cb (rspamd_mempool_t * pool, struct map_cb_data *data)
 	/* NULL terminate current buf */
 	*jb->pos = '\0';
 
+	hash = XXH64 (jb->buf, jb->pos - jb->buf, 0);
+	d = jb->cfg->dynamic_deltas;
+
+	if (d != NULL) {
+		rspamd_mempool_lock_mutex (d->mtx);
+		dump_hash = d->dump_hash;
+		dump_seq = d->dump_seq;
+		seq = d->seq;
+		rspamd_mempool_unlock_mutex (d->mtx);
+
+		if (hash == dump_hash && jb->cfg->current_dynamic_conf != NULL &&
+				jb->cfg->dynamic_seq >= dump_seq) {
+			/* File has been written by a controller after changes applied */
+			return;
+		}
+	}
+
 	parser = ucl_parser_new (0);
 	if (!ucl_parser_add_chunk (parser, jb->buf, jb->pos - jb->buf)) {
 		msg_err ("cannot load json data: parse error %s",
@@ -242,6 +311,15 @@ json_config_fin_cb (rspamd_mempool_t * pool, struct map_cb_data *data)
 	apply_dynamic_conf (jb->obj, jb->cfg);
 
 	jb->cfg->current_dynamic_conf = jb->obj;
+
+	if (d != NULL) {
+		/*
+		 * Changes published after the dump are applied again, whilst a file
+		 * written by someone else overrides all changes
+		 */
+		jb->cfg->dynamic_seq = hash == dump_hash ? dump_seq : seq;
+		rspamd_dynamic_config_sync (jb->cfg);
+	}
 }
 
 /**
@@ -258,6 +336,12 @@ init_dynamic_config (struct rspamd_config *cfg)
 		return;
 	}
 
+	/* Config is loaded before workers are forked, so they share changes */
+	cfg->dynamic_deltas = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+			sizeof (*cfg->dynamic_deltas));
+	cfg->dynamic_deltas->mtx = rspamd_mempool_get_mutex (cfg->cfg_pool);
+	cfg->dynamic_seq = 0;
+
 	/* Now try to add map with json data */
 	jb = g_malloc0 (sizeof (struct config_json_buf));
 	pjb = g_malloc (sizeof (struct config_json_buf *));
@@ -270,23 +354,152 @@ init_dynamic_config (struct rspamd_config *cfg)
 	}
 }
 
+/*
+ * Write data to a temporary file and rename it to path, returns an error
+ * message on failure
+ */
+static gchar *
+dynamic_config_write (const gchar *path, GString *data, mode_t mode)
+{
+	gchar *dir, pathbuf[PATH_MAX];
+	gint fd;
+	gssize r;
+	gsize written = 0;
+
+	dir = g_path_get_dirname (path);
+	rspamd_snprintf (pathbuf,
+		sizeof (pathbuf),
+		"%s%crconf-XXXXXX",
+		dir,
+		G_DIR_SEPARATOR);
+	g_free (dir);
+#ifdef HAVE_MKSTEMP
+	/* Umask is set before */
+	fd = mkstemp (pathbuf);
+#else
+	fd = g_mkstemp_full (pathbuf, O_RDWR, S_IWUSR | S_IRUSR);
+#endif
+	if (fd == -1) {
+		return g_strdup_printf ("mkstemp error: %s", strerror (errno));
+	}
+
+	while (written < data->len) {
+		r = write (fd, data->str + written, data->len - written);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			close (fd);
+			unlink (pathbuf);
+
+			return g_strdup_printf ("cannot write %s: %s", pathbuf,
+					strerror (errno));
+		}
+
+		written += r;
+	}
+
+	close (fd);
+
+	/* Rename replaces the old config atomically */
+	if (rename (pathbuf, path) == -1) {
+		unlink (pathbuf);
+
+		return g_strdup_printf ("rename error: %s", strerror (errno));
+	}
+
+	/* Set permissions */
+	if (chmod (path, mode) == -1) {
+		return g_strdup_printf ("chmod failed: %s", strerror (errno));
+	}
+
+	return NULL;
+}
+
+static gpointer
+dynamic_config_dump_thread (gpointer ud)
+{
+	struct rspamd_dynamic_dumper *dumper = ud;
+	guchar c = 1;
+
+	dumper->err = dynamic_config_write (dumper->cfg->dynamic_conf,
+			dumper->data, dumper->mode);
+
+	/* Wake up event loop */
+	while (write (dumper->wake_fd[1], &c, sizeof (c)) == -1 && errno == EINTR);
+
+	return NULL;
+}
+
+static void
+dynamic_config_dumper_free (struct rspamd_dynamic_dumper *dumper)
+{
+	close (dumper->wake_fd[0]);
+	close (dumper->wake_fd[1]);
+	g_string_free (dumper->data, TRUE);
+	g_free (dumper->err);
+	g_slice_free1 (sizeof (*dumper), dumper);
+}
+
+/**
+ * Called from the event loop when dump thread is done
+ */
+static void
+dynamic_config_dump_finish (gint fd, short what, void *ud)
+{
+	struct rspamd_dynamic_dumper *dumper = ud;
+	struct rspamd_config *cfg = dumper->cfg;
+	struct event_base *ev_base = dumper->ev_base;
+	gboolean pending = dumper->pending;
+
+	event_del (&dumper->ev);
+	g_thread_join (dumper->thr);
+
+	if (dumper->err != NULL) {
+		msg_err ("cannot dump dynamic config %s: %s", cfg->dynamic_conf,
+				dumper->err);
+	}
+	else {
+		msg_info ("dynamic config has been saved to %s", cfg->dynamic_conf);
+	}
+
+	dynamic_config_dumper_free (dumper);
+	dynamic_dumper = NULL;
+
+	if (pending) {
+		/* Changes made while writing */
+		dump_dynamic_config (cfg, ev_base);
+	}
+}
+
 /**
  * Dump dynamic configuration to the disk
  * @param cfg
  * @return
  */
 gboolean
-dump_dynamic_config (struct rspamd_config *cfg)
+dump_dynamic_config (struct rspamd_config *cfg, struct event_base *ev_base)
 {
+	struct rspamd_dynamic_dumper *dumper;
 	struct stat st;
-	gchar *dir, pathbuf[PATH_MAX];
-	gint fd;
+	gchar *dir, *err;
+	GError *gerr = NULL;
+	GString *data;
+	mode_t mode;
 
 	if (cfg->dynamic_conf == NULL || cfg->current_dynamic_conf == NULL) {
 		/* No dynamic conf has been specified, so do not try to dump it */
 		return FALSE;
 	}
 
+	if (dynamic_dumper != NULL) {
+		/* The current state is written when the previous dump is finished */
+		dynamic_dumper->pending = TRUE;
+		return TRUE;
+	}
+
 	dir = g_path_get_dirname (cfg->dynamic_conf);
 	if (dir == NULL) {
 		msg_err ("invalid path: %s", cfg->dynamic_conf);
@@ -296,54 +509,76 @@ dump_dynamic_config (struct rspamd_config *cfg)
 	if (stat (cfg->dynamic_conf, &st) == -1) {
 		msg_debug ("%s is unavailable: %s", cfg->dynamic_conf,
 			strerror (errno));
-		st.st_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+		mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+	}
+	else {
+		mode = st.st_mode;
 	}
 	if (access (dir, W_OK | R_OK) == -1) {
 		msg_warn ("%s is inaccessible: %s", dir, strerror (errno));
 		g_free (dir);
 		return FALSE;
 	}
-	rspamd_snprintf (pathbuf,
-		sizeof (pathbuf),
-		"%s%crconf-XXXXXX",
-		dir,
-		G_DIR_SEPARATOR);
 	g_free (dir);
-#ifdef HAVE_MKSTEMP
-	/* Umask is set before */
-	fd = mkstemp (pathbuf);
-#else
-	fd = g_mkstemp_full (pathbuf, O_RDWR, S_IWUSR | S_IRUSR);
-#endif
-	if (fd == -1) {
-		msg_err ("mkstemp error: %s", strerror (errno));
 
-		return FALSE;
-	}
+	data = g_string_sized_new (BUFSIZ);
+	rspamd_ucl_emit_gstring (cfg->current_dynamic_conf, UCL_EMIT_JSON, data);
 
-	if (!ucl_object_emit_full (cfg->current_dynamic_conf, UCL_EMIT_JSON,
-			ucl_object_emit_fd_funcs (fd))) {
-		msg_err ("cannot emit ucl object: %s", strerror (errno));
-		close (fd);
-		return FALSE;
+	if (cfg->dynamic_deltas != NULL) {
+		/* Let other processes skip parsing of the changes they have */
+		rspamd_mempool_lock_mutex (cfg->dynamic_deltas->mtx);
+		cfg->dynamic_deltas->dump_hash = XXH64 (data->str, data->len, 0);
+		cfg->dynamic_deltas->dump_seq = cfg->dynamic_seq;
+		rspamd_mempool_unlock_mutex (cfg->dynamic_deltas->mtx);
 	}
 
-	(void)unlink (cfg->dynamic_conf);
+	if (ev_base != NULL) {
+		dumper = g_slice_alloc0 (sizeof (*dumper));
 
-	/* Rename old config */
-	if (rename (pathbuf, cfg->dynamic_conf) == -1) {
-		msg_err ("rename error: %s", strerror (errno));
-		close (fd);
-		unlink (pathbuf);
-		return FALSE;
+		if (pipe (dumper->wake_fd) == -1) {
+			msg_err ("cannot create pipe for config dumper: %s",
+					strerror (errno));
+			g_slice_free1 (sizeof (*dumper), dumper);
+		}
+		else {
+			dumper->cfg = cfg;
+			dumper->ev_base = ev_base;
+			dumper->data = data;
+			dumper->mode = mode;
+
+			event_set (&dumper->ev, dumper->wake_fd[0], EV_READ,
+					dynamic_config_dump_finish, dumper);
+			event_base_set (ev_base, &dumper->ev);
+			event_add (&dumper->ev, NULL);
+
+			dumper->thr = rspamd_create_thread ("dynconf",
+					dynamic_config_dump_thread, dumper, &gerr);
+
+			if (dumper->thr != NULL) {
+				dynamic_dumper = dumper;
+				return TRUE;
+			}
+
+			msg_err ("cannot start config dumper thread: %e", gerr);
+			g_error_free (gerr);
+			event_del (&dumper->ev);
+			/* Data is written synchronously */
+			dumper->data = NULL;
+			close (dumper->wake_fd[0]);
+			close (dumper->wake_fd[1]);
+			g_slice_free1 (sizeof (*dumper), dumper);
+		}
 	}
-	/* Set permissions */
 
-	if (chmod (cfg->dynamic_conf, st.st_mode) == -1) {
-		msg_warn ("chmod failed: %s", strerror (errno));
+	err = dynamic_config_write (cfg->dynamic_conf, data, mode);
+	g_string_free (data, TRUE);
+
+	if (err != NULL) {
+		msg_err ("cannot dump dynamic config %s: %s", cfg->dynamic_conf, err);
+		g_free (err);
+		return FALSE;
 	}
 
-	close (fd);
 	return TRUE;
 }
 
@@ -420,6 +655,138 @@ new_dynamic_elt (ucl_object_t *arr, const gchar *name, gdouble value)
 	return n;
 }
 
+static void
+dynamic_elt_set (ucl_object_t *elt, gdouble value)
+{
+	/* Value may be parsed as an integer */
+	elt->type = UCL_FLOAT;
+	elt->value.dv = value;
+}
+
+static ucl_object_t *
+dynamic_metric_get_elts (struct rspamd_config *cfg, const gchar *metric_name,
+	const gchar *key)
+{
+	ucl_object_t *metric;
+
+	if (cfg->current_dynamic_conf == NULL) {
+		return NULL;
+	}
+
+	metric = dynamic_metric_find_metric (cfg->current_dynamic_conf,
+			metric_name);
+	if (metric == NULL) {
+		metric = new_dynamic_metric (metric_name, cfg->current_dynamic_conf);
+	}
+
+	return (ucl_object_t *)ucl_object_find_key (metric, key);
+}
+
+/*
+ * Apply a change to the loaded dynamic config and to metric in place
+ */
+static void
+dynamic_config_apply_delta (struct rspamd_config *cfg,
+	const struct rspamd_dynamic_delta *delta)
+{
+	struct metric *metric;
+	struct rspamd_symbol_def *s;
+	ucl_object_t *elts, *elt;
+
+	metric = g_hash_table_lookup (cfg->metrics, delta->metric);
+
+	if (metric == NULL) {
+		msg_warn ("cannot find metric %s", delta->metric);
+		return;
+	}
+
+	elts = dynamic_metric_get_elts (cfg, delta->metric,
+			delta->type == RSPAMD_DYNAMIC_SYMBOL ? "symbols" : "actions");
+
+	if (elts != NULL) {
+		elt = dynamic_metric_find_elt (elts, delta->name);
+
+		if (elt) {
+			dynamic_elt_set (elt, delta->value);
+		}
+		else {
+			new_dynamic_elt (elts, delta->name, delta->value);
+		}
+	}
+
+	if (delta->type == RSPAMD_DYNAMIC_SYMBOL) {
+		if ((s = g_hash_table_lookup (metric->symbols, delta->name)) != NULL) {
+			*s->weight_ptr = delta->value;
+		}
+	}
+	else {
+		metric->actions[delta->action].action = delta->action;
+		metric->actions[delta->action].score = delta->value;
+	}
+}
+
+void
+rspamd_dynamic_config_sync (struct rspamd_config *cfg)
+{
+	struct rspamd_dynamic_deltas *d = cfg->dynamic_deltas;
+	guint64 cur;
+
+	if (d == NULL || d->seq == cfg->dynamic_seq) {
+		return;
+	}
+
+	rspamd_mempool_lock_mutex (d->mtx);
+	cur = cfg->dynamic_seq;
+
+	if (d->seq - cur > DYNAMIC_DELTAS_MAX) {
+		/* Older changes are still loaded from the saved file */
+		msg_warn ("%L changes of dynamic config are lost",
+				(gint64)(d->seq - cur - DYNAMIC_DELTAS_MAX));
+		cur = d->seq - DYNAMIC_DELTAS_MAX;
+	}
+
+	for (; cur < d->seq; cur ++) {
+		dynamic_config_apply_delta (cfg,
+				&d->deltas[cur % DYNAMIC_DELTAS_MAX]);
+	}
+
+	cfg->dynamic_seq = cur;
+	rspamd_mempool_unlock_mutex (d->mtx);
+}
+
+static gboolean
+dynamic_config_publish (struct rspamd_config *cfg,
+	struct rspamd_dynamic_delta *delta,
+	const gchar *metric_name,
+	const gchar *name)
+{
+	struct rspamd_dynamic_deltas *d = cfg->dynamic_deltas;
+
+	if (strlen (metric_name) >= sizeof (delta->metric) ||
+			strlen (name) >= sizeof (delta->name)) {
+		msg_err ("name is too long: %s", name);
+		return FALSE;
+	}
+
+	rspamd_strlcpy (delta->metric, metric_name, sizeof (delta->metric));
+	rspamd_strlcpy (delta->name, name, sizeof (delta->name));
+
+	if (d == NULL) {
+		dynamic_config_apply_delta (cfg, delta);
+		return TRUE;
+	}
+
+	rspamd_mempool_lock_mutex (d->mtx);
+	memcpy (&d->deltas[d->seq % DYNAMIC_DELTAS_MAX], delta, sizeof (*delta));
+	d->seq ++;
+	rspamd_mempool_unlock_mutex (d->mtx);
+
+	/* Changes are applied in the same order by all processes */
+	rspamd_dynamic_config_sync (cfg);
+
+	return TRUE;
+}
+
 /**
  * Add symbol for specified metric
  * @param cfg config file object
@@ -434,35 +801,18 @@ add_dynamic_symbol (struct rspamd_config *cfg,
 	const gchar *symbol,
 	gdouble value)
 {
-	ucl_object_t *metric, *syms;
+	struct rspamd_dynamic_delta delta;
 
 	if (cfg->dynamic_conf == NULL) {
 		msg_info ("dynamic conf is disabled");
 		return FALSE;
 	}
 
-	metric = dynamic_metric_find_metric (cfg->current_dynamic_conf,
-			metric_name);
-	if (metric == NULL) {
-		metric = new_dynamic_metric (metric_name, cfg->current_dynamic_conf);
-	}
-
-	syms = (ucl_object_t *)ucl_object_find_key (metric, "symbols");
-	if (syms != NULL) {
-		ucl_object_t *sym;
+	delta.type = RSPAMD_DYNAMIC_SYMBOL;
+	delta.action = 0;
+	delta.value = value;
 
-		sym = dynamic_metric_find_elt (syms, symbol);
-		if (sym) {
-			sym->value.dv = value;
-		}
-		else {
-			new_dynamic_elt (syms, symbol, value);
-		}
-	}
-
-	apply_dynamic_conf (cfg->current_dynamic_conf, cfg);
-
-	return TRUE;
+	return dynamic_config_publish (cfg, &delta, metric_name, symbol);
 }
 
 
@@ -480,34 +830,17 @@ add_dynamic_action (struct rspamd_config *cfg,
 	guint action,
 	gdouble value)
 {
-	ucl_object_t *metric, *acts;
-	const gchar *action_name = rspamd_action_to_str (action);
+	struct rspamd_dynamic_delta delta;
 
 	if (cfg->dynamic_conf == NULL) {
 		msg_info ("dynamic conf is disabled");
 		return FALSE;
 	}
 
-	metric = dynamic_metric_find_metric (cfg->current_dynamic_conf,
-			metric_name);
-	if (metric == NULL) {
-		metric = new_dynamic_metric (metric_name, cfg->current_dynamic_conf);
-	}
-
-	acts = (ucl_object_t *)ucl_object_find_key (metric, "actions");
-	if (acts != NULL) {
-		ucl_object_t *act;
+	delta.type = RSPAMD_DYNAMIC_ACTION;
+	delta.action = action;
+	delta.value = value;
 
-		act = dynamic_metric_find_elt (acts, action_name);
-		if (act) {
-			act->value.dv = value;
-		}
-		else {
-			new_dynamic_elt (acts, action_name, value);
-		}
-	}
-
-	apply_dynamic_conf (cfg->current_dynamic_conf, cfg);
-
-	return TRUE;
+	return dynamic_config_publish (cfg, &delta, metric_name,
+			rspamd_action_to_str (action));
 }
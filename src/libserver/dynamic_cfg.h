@@ -35,11 +35,21 @@
 void init_dynamic_config (struct rspamd_config *cfg);
 
 /**
- * Dump dynamic configuration to the disk
+ * Dump dynamic configuration to the disk, if ev_base is not NULL then file is
+ * written by a separate thread
  * @param cfg
+ * @param ev_base event base to get notification when file is written
  * @return
  */
-gboolean dump_dynamic_config (struct rspamd_config *cfg);
+gboolean dump_dynamic_config (struct rspamd_config *cfg,
+	struct event_base *ev_base);
+
+/**
+ * Apply changes of symbols and actions made by controllers since the last
+ * call, the changes are applied in place without reloading of the config
+ * @param cfg config file object
+ */
+void rspamd_dynamic_config_sync (struct rspamd_config *cfg);
 
 /**
  * Add symbol for specified metric
@@ -25,6 +25,38 @@
 #include "config.h"
 #include "main.h"
 #include "events.h"
+#include "utlist.h"
+
+#define msg_debug_session(...) msg_debug_module (RSPAMD_LOG_MODULE_EVENTS, \
+		__VA_ARGS__)
+
+/* Events started after the deadline are given this time to fail */
+#define RSPAMD_SESSION_MIN_TIMEOUT 0.001
+
+/*
+ * Timer wheel has 3 levels of 256 slots, a slot of level N covers 256^N ticks,
+ * so the wheel spans 256^3 ticks
+ */
+#define RSPAMD_WHEEL_RESOLUTION 0.01
+#define RSPAMD_WHEEL_BITS 8
+#define RSPAMD_WHEEL_SLOTS (1 << RSPAMD_WHEEL_BITS)
+#define RSPAMD_WHEEL_MASK (RSPAMD_WHEEL_SLOTS - 1)
+#define RSPAMD_WHEEL_LEVELS 3
+#define RSPAMD_WHEEL_SPAN (G_GUINT64_CONSTANT (1) << \
+	(RSPAMD_WHEEL_BITS * RSPAMD_WHEEL_LEVELS))
+
+struct rspamd_timer_wheel {
+	struct event_base *ev_base;
+	struct event tick_ev;
+	gboolean armed;
+	gdouble start;
+	guint64 now;
+	guint count;
+	struct rspamd_timer *slots[RSPAMD_WHEEL_LEVELS][RSPAMD_WHEEL_SLOTS];
+};
+
+/* Wheels of event bases, normally a worker has a single event base */
+static GHashTable *timer_wheels = NULL;
 
 static gboolean
 rspamd_event_equal (gconstpointer a, gconstpointer b)
@@ -100,10 +132,18 @@ new_async_session (rspamd_mempool_t * pool, session_finalizer_t fin,
 		new->cond);
 #endif
 	new->threads = 0;
+	new->cur_watcher = NULL;
+	new->watchers_stack = g_ptr_array_new ();
+	new->trace = NULL;
+	new->trace_ud = NULL;
+	new->deadline = 0;
 
 	rspamd_mempool_add_destructor (pool,
 		(rspamd_mempool_destruct_t) g_hash_table_destroy,
 		new->events);
+	rspamd_mempool_add_destructor (pool,
+		(rspamd_mempool_destruct_t) rspamd_ptr_array_free_hard,
+		new->watchers_stack);
 
 	return new;
 }
@@ -127,10 +167,16 @@ register_async_event (struct rspamd_async_session *session,
 	new->fin = fin;
 	new->user_data = user_data;
 	new->subsystem = subsystem;
+	new->w = session->cur_watcher;
+	new->start = session->trace ? rspamd_get_ticks () : 0;
+
+	if (new->w != NULL) {
+		new->w->remain ++;
+	}
 
 	g_hash_table_insert (session->events, new, new);
 
-	msg_debug ("added event: %p, pending %d events, subsystem: %s",
+	msg_debug_session ("added event: %p, pending %d events, subsystem: %s",
 		user_data,
 		g_hash_table_size (session->events),
 		g_quark_to_string (subsystem));
@@ -144,6 +190,9 @@ remove_normal_event (struct rspamd_async_session *session,
 	void *ud)
 {
 	struct rspamd_async_event search_ev, *found_ev;
+	struct rspamd_async_watcher *w = NULL;
+	GQuark subsystem = 0;
+	gdouble start = 0;
 
 	if (session == NULL) {
 		msg_info ("session is NULL");
@@ -157,14 +206,31 @@ remove_normal_event (struct rspamd_async_session *session,
 	if ((found_ev =
 		g_hash_table_lookup (session->events, &search_ev)) != NULL) {
 		g_hash_table_remove (session->events, found_ev);
-		msg_debug ("removed event: %p, subsystem: %s, pending %d events", ud,
+		msg_debug_session ("removed event: %p, subsystem: %s, pending %d events", ud,
 			g_quark_to_string (found_ev->subsystem),
 			g_hash_table_size (session->events));
+		w = found_ev->w;
+		subsystem = found_ev->subsystem;
+		start = found_ev->start;
 		/* Remove event */
 		fin (ud);
 	}
 	g_mutex_unlock (session->mtx);
 
+	if (subsystem != 0 && session->trace != NULL) {
+		session->trace (subsystem, start, rspamd_get_ticks (),
+				session->trace_ud);
+	}
+
+	/* Watcher callback may register new events, so call it without lock */
+	if (w != NULL) {
+		g_assert (w->remain > 0);
+
+		if (--w->remain == 0) {
+			w->cb (w->ud);
+		}
+	}
+
 	check_session_pending (session);
 }
 
@@ -174,7 +240,7 @@ rspamd_session_destroy (gpointer k, gpointer v, gpointer unused)
 	struct rspamd_async_event *ev = v;
 
 	/* Call event's finalizer */
-	msg_debug ("removed event on destroy: %p, subsystem: %s", ev->user_data,
+	msg_debug_session ("removed event on destroy: %p, subsystem: %s", ev->user_data,
 		g_quark_to_string (ev->subsystem));
 
 	if (ev->fin != NULL) {
@@ -255,7 +321,7 @@ void
 register_async_thread (struct rspamd_async_session *session)
 {
 	g_atomic_int_inc (&session->threads);
-	msg_debug ("added thread: pending %d thread", session->threads);
+	msg_debug_session ("added thread: pending %d thread", session->threads);
 }
 
 /**
@@ -271,5 +337,309 @@ remove_async_thread (struct rspamd_async_session *session)
 		g_cond_signal (session->cond);
 		g_mutex_unlock (session->mtx);
 	}
-	msg_debug ("removed thread: pending %d thread", session->threads);
+	msg_debug_session ("removed thread: pending %d thread", session->threads);
+}
+
+void
+rspamd_session_watch_start (struct rspamd_async_session *s,
+	event_watcher_t cb,
+	gpointer ud)
+{
+	struct rspamd_async_watcher *w;
+
+	g_assert (s != NULL);
+
+	w = rspamd_mempool_alloc (s->pool, sizeof (*w));
+	w->cb = cb;
+	w->remain = 0;
+	w->ud = ud;
+
+	g_ptr_array_add (s->watchers_stack, s->cur_watcher);
+	s->cur_watcher = w;
+}
+
+guint
+rspamd_session_watch_stop (struct rspamd_async_session *s)
+{
+	struct rspamd_async_watcher *w;
+
+	g_assert (s != NULL && s->cur_watcher != NULL);
+
+	w = s->cur_watcher;
+	g_assert (s->watchers_stack->len > 0);
+	s->cur_watcher = g_ptr_array_index (s->watchers_stack,
+			s->watchers_stack->len - 1);
+	g_ptr_array_remove_index_fast (s->watchers_stack,
+			s->watchers_stack->len - 1);
+
+	return w->remain;
+}
+
+struct rspamd_async_watcher *
+rspamd_session_get_watcher (struct rspamd_async_session *s)
+{
+	if (s == NULL) {
+		return NULL;
+	}
+
+	return s->cur_watcher;
+}
+
+void
+rspamd_session_watcher_push (struct rspamd_async_session *s,
+	struct rspamd_async_watcher *w)
+{
+	g_assert (s != NULL);
+
+	g_ptr_array_add (s->watchers_stack, s->cur_watcher);
+	s->cur_watcher = w;
+
+	if (w != NULL) {
+		/* Do not allow watcher to be fired while it is current */
+		w->remain ++;
+	}
+}
+
+void
+rspamd_session_watcher_pop (struct rspamd_async_session *s,
+	struct rspamd_async_watcher *w)
+{
+	g_assert (s != NULL);
+	g_assert (s->watchers_stack->len > 0);
+
+	s->cur_watcher = g_ptr_array_index (s->watchers_stack,
+			s->watchers_stack->len - 1);
+	g_ptr_array_remove_index_fast (s->watchers_stack,
+			s->watchers_stack->len - 1);
+
+	if (w != NULL) {
+		g_assert (w->remain > 0);
+
+		if (--w->remain == 0) {
+			w->cb (w->ud);
+		}
+	}
+}
+
+void
+rspamd_session_set_trace (struct rspamd_async_session *s,
+	event_trace_t trace, gpointer ud)
+{
+	g_assert (s != NULL);
+
+	s->trace = trace;
+	s->trace_ud = ud;
+}
+
+void
+rspamd_session_set_deadline (struct rspamd_async_session *s,
+	gdouble deadline)
+{
+	g_assert (s != NULL);
+
+	s->deadline = deadline;
+}
+
+gdouble
+rspamd_session_clamp_timeout (struct rspamd_async_session *s,
+	gdouble timeout)
+{
+	gdouble remain;
+
+	if (s == NULL || s->deadline <= 0) {
+		return timeout;
+	}
+
+	remain = s->deadline - rspamd_get_ticks ();
+
+	if (remain < RSPAMD_SESSION_MIN_TIMEOUT) {
+		remain = RSPAMD_SESSION_MIN_TIMEOUT;
+	}
+
+	return MIN (timeout, remain);
+}
+
+static inline guint64
+rspamd_timer_wheel_ticks (struct rspamd_timer_wheel *wheel)
+{
+	return (rspamd_get_ticks () - wheel->start) / RSPAMD_WHEEL_RESOLUTION;
+}
+
+static void
+rspamd_timer_wheel_place (struct rspamd_timer_wheel *wheel,
+	struct rspamd_timer *t)
+{
+	guint64 delta;
+	guint level, slot;
+
+	if (t->expire < wheel->now) {
+		t->expire = wheel->now;
+	}
+
+	delta = t->expire - wheel->now;
+
+	for (level = 0; level < RSPAMD_WHEEL_LEVELS - 1; level ++) {
+		if (delta < (G_GUINT64_CONSTANT (1) <<
+				(RSPAMD_WHEEL_BITS * (level + 1)))) {
+			break;
+		}
+	}
+
+	slot = (t->expire >> (RSPAMD_WHEEL_BITS * level)) & RSPAMD_WHEEL_MASK;
+	t->head = &wheel->slots[level][slot];
+	DL_APPEND (*t->head, t);
+}
+
+/* Move timers of an upper level slot to the lower levels */
+static void
+rspamd_timer_wheel_cascade (struct rspamd_timer_wheel *wheel, guint level)
+{
+	struct rspamd_timer *t, *cur, *tmp;
+	guint slot;
+
+	slot = (wheel->now >> (RSPAMD_WHEEL_BITS * level)) & RSPAMD_WHEEL_MASK;
+	t = wheel->slots[level][slot];
+	wheel->slots[level][slot] = NULL;
+
+	DL_FOREACH_SAFE (t, cur, tmp) {
+		cur->prev = NULL;
+		cur->next = NULL;
+		rspamd_timer_wheel_place (wheel, cur);
+	}
+}
+
+static void rspamd_timer_wheel_arm (struct rspamd_timer_wheel *wheel);
+
+static void
+rspamd_timer_wheel_tick (gint fd, short what, gpointer ud)
+{
+	struct rspamd_timer_wheel *wheel = ud;
+	struct rspamd_timer **head, *t;
+	guint64 target;
+	guint level;
+
+	wheel->armed = FALSE;
+	target = rspamd_timer_wheel_ticks (wheel);
+
+	while (wheel->now < target && wheel->count > 0) {
+		wheel->now ++;
+
+		for (level = 1; level < RSPAMD_WHEEL_LEVELS; level ++) {
+			if ((wheel->now & ((G_GUINT64_CONSTANT (1) <<
+					(RSPAMD_WHEEL_BITS * level)) - 1)) != 0) {
+				break;
+			}
+
+			rspamd_timer_wheel_cascade (wheel, level);
+		}
+
+		head = &wheel->slots[0][wheel->now & RSPAMD_WHEEL_MASK];
+
+		/* Callbacks can add and remove any timers */
+		while ((t = *head) != NULL) {
+			DL_DELETE (*head, t);
+			t->head = NULL;
+			wheel->count --;
+			t->cb (t->ud);
+		}
+	}
+
+	if (wheel->now < target) {
+		/* No timers are pending */
+		wheel->now = target;
+	}
+
+	rspamd_timer_wheel_arm (wheel);
+}
+
+static void
+rspamd_timer_wheel_arm (struct rspamd_timer_wheel *wheel)
+{
+	struct timeval tv;
+
+	if (!wheel->armed && wheel->count > 0) {
+		/* Wheel is not ticking while it is empty */
+		double_to_tv (RSPAMD_WHEEL_RESOLUTION, &tv);
+		event_add (&wheel->tick_ev, &tv);
+		wheel->armed = TRUE;
+	}
+}
+
+static struct rspamd_timer_wheel *
+rspamd_timer_wheel_get (struct event_base *ev_base)
+{
+	struct rspamd_timer_wheel *wheel;
+
+	if (timer_wheels == NULL) {
+		timer_wheels = g_hash_table_new (g_direct_hash, g_direct_equal);
+	}
+
+	wheel = g_hash_table_lookup (timer_wheels, ev_base);
+
+	if (wheel == NULL) {
+		wheel = g_slice_alloc0 (sizeof (*wheel));
+		wheel->ev_base = ev_base;
+		wheel->start = rspamd_get_ticks ();
+		evtimer_set (&wheel->tick_ev, rspamd_timer_wheel_tick, wheel);
+		event_base_set (ev_base, &wheel->tick_ev);
+		g_hash_table_insert (timer_wheels, ev_base, wheel);
+	}
+
+	return wheel;
+}
+
+void
+rspamd_timer_init (struct rspamd_timer *t, rspamd_timer_cb_t cb, gpointer ud)
+{
+	g_assert (t != NULL);
+
+	memset (t, 0, sizeof (*t));
+	t->cb = cb;
+	t->ud = ud;
+}
+
+void
+rspamd_timer_add (struct event_base *ev_base, struct rspamd_timer *t,
+	gdouble timeout)
+{
+	struct rspamd_timer_wheel *wheel;
+	guint64 ticks;
+
+	g_assert (ev_base != NULL && t != NULL);
+
+	rspamd_timer_del (t);
+	wheel = rspamd_timer_wheel_get (ev_base);
+
+	if (wheel->count == 0) {
+		/* Idle wheel is not ticking, so catch up with the time */
+		wheel->now = rspamd_timer_wheel_ticks (wheel);
+	}
+
+	ticks = timeout > 0 ? timeout / RSPAMD_WHEEL_RESOLUTION + 1 : 1;
+
+	if (ticks >= RSPAMD_WHEEL_SPAN) {
+		ticks = RSPAMD_WHEEL_SPAN - 1;
+	}
+
+	t->expire = rspamd_timer_wheel_ticks (wheel) + ticks;
+	t->wheel = wheel;
+	rspamd_timer_wheel_place (wheel, t);
+	wheel->count ++;
+	rspamd_timer_wheel_arm (wheel);
+}
+
+void
+rspamd_timer_del (struct rspamd_timer *t)
+{
+	if (t->head != NULL) {
+		DL_DELETE (*t->head, t);
+		t->head = NULL;
+		t->wheel->count --;
+	}
+}
+
+gboolean
+rspamd_timer_pending (struct rspamd_timer *t)
+{
+	return t->head != NULL;
 }
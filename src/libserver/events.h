@@ -5,15 +5,34 @@
 #include "mem_pool.h"
 
 struct rspamd_async_event;
+struct rspamd_async_watcher;
+struct rspamd_timer_wheel;
 
 typedef void (*event_finalizer_t)(void *user_data);
 typedef gboolean (*session_finalizer_t)(void *user_data);
+typedef void (*event_watcher_t)(gpointer ud);
+typedef void (*event_trace_t)(GQuark subsystem, gdouble start, gdouble end,
+	gpointer ud);
+typedef void (*rspamd_timer_cb_t)(gpointer ud);
 
 struct rspamd_async_event {
 	GQuark subsystem;
 	event_finalizer_t fin;
 	void *user_data;
 	guint ref;
+	struct rspamd_async_watcher *w;
+	gdouble start;
+};
+
+/*
+ * Watcher is called when all events registered while it was active are
+ * finished (including events registered from the callbacks of those events
+ * when they explicitly push the watcher back)
+ */
+struct rspamd_async_watcher {
+	event_watcher_t cb;
+	guint remain;
+	gpointer ud;
 };
 
 struct rspamd_async_session {
@@ -27,6 +46,24 @@ struct rspamd_async_session {
 	guint threads;
 	GMutex *mtx;
 	GCond *cond;
+	struct rspamd_async_watcher *cur_watcher;
+	GPtrArray *watchers_stack;
+	event_trace_t trace;
+	gpointer trace_ud;
+	gdouble deadline;
+};
+
+/*
+ * Timer of a coarse timer wheel, it is embedded into a structure that owns it
+ * like `struct event`, timers are fired with resolution of 10 milliseconds
+ */
+struct rspamd_timer {
+	rspamd_timer_cb_t cb;
+	gpointer ud;
+	guint64 expire;
+	struct rspamd_timer_wheel *wheel;
+	struct rspamd_timer **head;
+	struct rspamd_timer *prev, *next;
 };
 
 /**
@@ -87,4 +124,113 @@ void register_async_thread (struct rspamd_async_session *session);
  */
 void remove_async_thread (struct rspamd_async_session *session);
 
+/**
+ * Start watching for events in the session, so the specified watcher will be
+ * added to all subsequent events until `rspamd_session_watch_stop` is called
+ * @param s session object
+ * @param cb watcher callback that is called when all events watched are destroyed
+ * @param ud opaque data for the callback
+ */
+void rspamd_session_watch_start (struct rspamd_async_session *s,
+	event_watcher_t cb,
+	gpointer ud);
+
+/**
+ * Stop watching mode, if no events are watched since the last `watch_start`,
+ * then this function returns 0 and the callback will never be called
+ * @param s session object
+ * @return number of events watched
+ */
+guint rspamd_session_watch_stop (struct rspamd_async_session *s);
+
+/**
+ * Returns the current watcher of the session (or NULL)
+ * @param s session object
+ * @return
+ */
+struct rspamd_async_watcher *rspamd_session_get_watcher (
+	struct rspamd_async_session *s);
+
+/**
+ * Make the specified watcher current for the session: all events registered
+ * until `rspamd_session_watcher_pop` is called are attached to this watcher
+ * @param s session object
+ * @param w watcher object (NULL is allowed)
+ */
+void rspamd_session_watcher_push (struct rspamd_async_session *s,
+	struct rspamd_async_watcher *w);
+
+/**
+ * Restore the previous watcher and call the watcher callback if no events
+ * are pending for it
+ * @param s session object
+ * @param w watcher object (NULL is allowed)
+ */
+void rspamd_session_watcher_pop (struct rspamd_async_session *s,
+	struct rspamd_async_watcher *w);
+
+/**
+ * Call trace callback with start and finish time of each event removed from
+ * a session
+ * @param s session
+ * @param trace callback or NULL to disable tracing
+ * @param ud data for callback
+ */
+void rspamd_session_set_trace (struct rspamd_async_session *s,
+	event_trace_t trace, gpointer ud);
+
+/**
+ * Set the time when all events of a session should be finished, subsystems
+ * started from the session do not wait for replies after this time
+ * @param s session
+ * @param deadline absolute time in the scale of `rspamd_get_ticks` or 0 to
+ * disable the deadline
+ */
+void rspamd_session_set_deadline (struct rspamd_async_session *s,
+	gdouble deadline);
+
+/**
+ * Clamp timeout of an event to the time remaining until the session's deadline,
+ * if the deadline is already passed, then a small timeout is returned so the
+ * event fails as timed out
+ * @param s session (NULL is allowed)
+ * @param timeout timeout in seconds
+ * @return timeout in seconds that is not greater than the specified one
+ */
+gdouble rspamd_session_clamp_timeout (struct rspamd_async_session *s,
+	gdouble timeout);
+
+/**
+ * Initialize timer, it must be called before any other timer function
+ * @param t timer
+ * @param cb callback called when timer expires
+ * @param ud opaque data for the callback
+ */
+void rspamd_timer_init (struct rspamd_timer *t, rspamd_timer_cb_t cb,
+	gpointer ud);
+
+/**
+ * Schedule timer in the wheel of the specified event base, a pending timer is
+ * rescheduled. Timeouts longer than the wheel's span (about 46 hours) are
+ * truncated to the span
+ * @param ev_base event base driving the wheel
+ * @param t timer
+ * @param timeout timeout in seconds
+ */
+void rspamd_timer_add (struct event_base *ev_base, struct rspamd_timer *t,
+	gdouble timeout);
+
+/**
+ * Cancel timer, it is safe to cancel a timer that is not pending
+ * @param t timer
+ */
+void rspamd_timer_del (struct rspamd_timer *t);
+
+/**
+ * Check whether timer is scheduled
+ * @param t timer
+ * @return TRUE if timer is pending
+ */
+gboolean rspamd_timer_pending (struct rspamd_timer *t);
+
 #endif /* RSPAMD_EVENTS_H */
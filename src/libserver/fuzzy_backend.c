@@ -25,6 +25,9 @@
 #include "main.h"
 #include "fuzzy_backend.h"
 #include "fuzzy_storage.h"
+#include "fuzzy_index.h"
+#include "fuzzy_compact.h"
+#include "xxhash.h"
 
 #include <sqlite3.h>
 
@@ -43,8 +46,16 @@ struct rspamd_fuzzy_backend {
 	char *path;
 	gsize count;
 	gsize expired;
+	gsize expire_backlog;
+	struct rspamd_fuzzy_index *index;
+	/* Index holds only hashes added after the image has been built */
+	struct rspamd_fuzzy_compact *compact;
 };
 
+/* Part of the memory index that is checked for expired hashes on each sync */
+#define FUZZY_INDEX_EXPIRE_DIVISOR 16
+#define FUZZY_INDEX_EXPIRE_MIN 65536
+
 
 static const char *create_tables_sql =
 		"BEGIN;"
@@ -79,7 +90,11 @@ enum rspamd_fuzzy_statement_idx {
 	RSPAMD_FUZZY_BACKEND_DELETE,
 	RSPAMD_FUZZY_BACKEND_COUNT,
 	RSPAMD_FUZZY_BACKEND_EXPIRE,
+	RSPAMD_FUZZY_BACKEND_COUNT_EXPIRED,
 	RSPAMD_FUZZY_BACKEND_VACUUM,
+	RSPAMD_FUZZY_BACKEND_LOAD_DIGESTS,
+	RSPAMD_FUZZY_BACKEND_LOAD_SHINGLES,
+	RSPAMD_FUZZY_BACKEND_LOAD_SHINGLES_DIGESTS,
 	RSPAMD_FUZZY_BACKEND_MAX
 };
 static struct rspamd_fuzzy_stmts {
@@ -172,17 +187,48 @@ static struct rspamd_fuzzy_stmts {
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_EXPIRE,
-		.sql = "DELETE FROM digests WHERE time < ?1;",
-		.args = "I",
+		.sql = "DELETE FROM digests WHERE id IN (SELECT id FROM digests "
+				"WHERE time < ?1 ORDER BY time LIMIT ?2);",
+		.args = "II",
 		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_COUNT_EXPIRED,
+		.sql = "SELECT COUNT(*) FROM digests WHERE time < ?1;",
+		.args = "I",
+		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_VACUUM,
 		.sql = "VACUUM;",
 		.args = "",
 		.stmt = NULL,
 		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_LOAD_DIGESTS,
+		.sql = "SELECT id, digest, value, time, flag FROM digests ORDER BY id;",
+		.args = "",
+		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_LOAD_SHINGLES,
+		.sql = "SELECT value, number, digest_id FROM shingles;",
+		.args = "",
+		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_LOAD_SHINGLES_DIGESTS,
+		.sql = "SELECT shingles.value, shingles.number, digests.digest "
+				"FROM shingles JOIN digests ON digests.id=shingles.digest_id "
+				"ORDER BY shingles.value, shingles.number;",
+		.args = "",
+		.stmt = NULL,
+		.result = SQLITE_ROW
 	}
 };
 
@@ -346,7 +392,10 @@ rspamd_fuzzy_backend_create_db (const gchar *path, gboolean add_index,
 	bk->path = g_strdup (path);
 	bk->db = sqlite;
 	bk->expired = 0;
+	bk->expire_backlog = 0;
 	bk->count = 0;
+	bk->index = NULL;
+	bk->compact = NULL;
 
 	/*
 	 * Here we need to run create prior to preparing other statements
@@ -392,6 +441,10 @@ rspamd_fuzzy_backend_open_db (const gchar *path, GError **err)
 	bk->path = g_strdup (path);
 	bk->db = sqlite;
 	bk->expired = 0;
+	bk->expire_backlog = 0;
+	bk->count = 0;
+	bk->index = NULL;
+	bk->compact = NULL;
 
 	/* Cleanup database */
 	rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_VACUUM, bk, NULL);
@@ -547,11 +600,537 @@ rspamd_fuzzy_backend_open (const gchar *path, GError **err)
 }
 
 static gint
-rspamd_fuzzy_backend_int64_cmp (const void *a, const void *b)
+rspamd_fuzzy_backend_id_cmp (const void *a, const void *b)
 {
 	gint64 ia = *(gint64 *)a, ib = *(gint64 *)b;
 
-	return (ia - ib);
+	if (ia < ib) {
+		return -1;
+	}
+
+	return ia > ib ? 1 : 0;
+}
+
+gboolean
+rspamd_fuzzy_backend_build_index (struct rspamd_fuzzy_backend *backend,
+		GError **err)
+{
+	struct rspamd_fuzzy_index *index;
+	struct rspamd_fuzzy_index_elt *elt;
+	sqlite3_stmt *stmt;
+	GArray *ids;
+	GPtrArray *elts;
+	guchar digest[RSPAMD_FUZZY_INDEX_DIGEST_LEN];
+	const guchar *text;
+	gint64 id, *found;
+	gint rc, len;
+	gsize nshingles = 0;
+
+	if (backend->index != NULL) {
+		return TRUE;
+	}
+
+	index = rspamd_fuzzy_index_new ();
+	/* Ids are loaded in ascending order, so we can use bsearch for shingles */
+	ids = g_array_new (FALSE, FALSE, sizeof (gint64));
+	elts = g_ptr_array_new ();
+
+	rc = rspamd_fuzzy_backend_run_stmt (backend,
+			RSPAMD_FUZZY_BACKEND_LOAD_DIGESTS);
+	stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_LOAD_DIGESTS].stmt;
+
+	while (rc == SQLITE_OK) {
+		id = sqlite3_column_int64 (stmt, 0);
+		text = sqlite3_column_text (stmt, 1);
+		len = sqlite3_column_bytes (stmt, 1);
+		memset (digest, 0, sizeof (digest));
+
+		if (text != NULL) {
+			memcpy (digest, text, MIN (len, (gint)sizeof (digest)));
+		}
+
+		elt = rspamd_fuzzy_index_insert (index, digest,
+				sqlite3_column_int64 (stmt, 2),
+				sqlite3_column_int (stmt, 4),
+				sqlite3_column_int64 (stmt, 3));
+		g_array_append_val (ids, id);
+		g_ptr_array_add (elts, elt);
+
+		rc = sqlite3_step (stmt);
+		rc = rc == SQLITE_ROW ? SQLITE_OK : rc;
+	}
+
+	if (rc == SQLITE_DONE) {
+		rc = rspamd_fuzzy_backend_run_stmt (backend,
+				RSPAMD_FUZZY_BACKEND_LOAD_SHINGLES);
+	}
+
+	stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_LOAD_SHINGLES].stmt;
+
+	while (rc == SQLITE_OK) {
+		id = sqlite3_column_int64 (stmt, 2);
+		found = bsearch (&id, ids->data, ids->len, sizeof (gint64),
+				rspamd_fuzzy_backend_id_cmp);
+
+		if (found != NULL) {
+			elt = g_ptr_array_index (elts, found - (gint64 *)ids->data);
+			rspamd_fuzzy_index_add_shingle (index,
+					sqlite3_column_int64 (stmt, 0),
+					sqlite3_column_int (stmt, 1), elt);
+			nshingles ++;
+		}
+
+		rc = sqlite3_step (stmt);
+		rc = rc == SQLITE_ROW ? SQLITE_OK : rc;
+	}
+
+	g_array_free (ids, TRUE);
+	g_ptr_array_free (elts, TRUE);
+
+	if (rc != SQLITE_DONE) {
+		g_set_error (err, rspamd_fuzzy_backend_quark (),
+				rc, "Cannot load hashes from %s: %s",
+				backend->path, sqlite3_errmsg (backend->db));
+		rspamd_fuzzy_index_destroy (index);
+
+		return FALSE;
+	}
+
+	msg_info ("loaded %z hashes and %z shingles to the memory index",
+			rspamd_fuzzy_index_count (index), nshingles);
+	backend->index = index;
+
+	return TRUE;
+}
+
+gboolean
+rspamd_fuzzy_backend_build_compact (struct rspamd_fuzzy_backend *backend,
+		const gchar *path, GError **err)
+{
+	struct rspamd_fuzzy_compact_builder *b;
+	struct rspamd_fuzzy_compact *compact;
+	sqlite3_stmt *stmt;
+	guchar digest[RSPAMD_FUZZY_INDEX_DIGEST_LEN];
+	const guchar *text;
+	gboolean ret = TRUE;
+	gint rc, len;
+
+	if (backend->index != NULL) {
+		return TRUE;
+	}
+
+	if ((b = rspamd_fuzzy_compact_builder_new (path, err)) == NULL) {
+		return FALSE;
+	}
+
+	rc = rspamd_fuzzy_backend_run_stmt (backend,
+			RSPAMD_FUZZY_BACKEND_LOAD_DIGESTS);
+	stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_LOAD_DIGESTS].stmt;
+
+	while (rc == SQLITE_OK && ret) {
+		text = sqlite3_column_text (stmt, 1);
+		len = sqlite3_column_bytes (stmt, 1);
+		memset (digest, 0, sizeof (digest));
+
+		if (text != NULL) {
+			memcpy (digest, text, MIN (len, (gint)sizeof (digest)));
+		}
+
+		ret = rspamd_fuzzy_compact_builder_add_digest (b, digest,
+				sqlite3_column_int64 (stmt, 2),
+				sqlite3_column_int (stmt, 4),
+				sqlite3_column_int64 (stmt, 3), err);
+
+		rc = sqlite3_step (stmt);
+		rc = rc == SQLITE_ROW ? SQLITE_OK : rc;
+	}
+
+	if (ret && rc == SQLITE_DONE) {
+		ret = rspamd_fuzzy_compact_builder_sort (b, err);
+
+		if (ret) {
+			/* Shingles are read in order of the shingles index */
+			rc = rspamd_fuzzy_backend_run_stmt (backend,
+					RSPAMD_FUZZY_BACKEND_LOAD_SHINGLES_DIGESTS);
+		}
+	}
+
+	stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_LOAD_SHINGLES_DIGESTS].stmt;
+
+	while (rc == SQLITE_OK && ret) {
+		text = sqlite3_column_text (stmt, 2);
+		len = sqlite3_column_bytes (stmt, 2);
+		memset (digest, 0, sizeof (digest));
+
+		if (text != NULL) {
+			memcpy (digest, text, MIN (len, (gint)sizeof (digest)));
+		}
+
+		ret = rspamd_fuzzy_compact_builder_add_shingle (b,
+				sqlite3_column_int64 (stmt, 0),
+				sqlite3_column_int (stmt, 1), digest, err);
+
+		rc = sqlite3_step (stmt);
+		rc = rc == SQLITE_ROW ? SQLITE_OK : rc;
+	}
+
+	if (!ret) {
+		rspamd_fuzzy_compact_builder_destroy (b);
+
+		return FALSE;
+	}
+
+	if (rc != SQLITE_DONE) {
+		g_set_error (err, rspamd_fuzzy_backend_quark (),
+				rc, "Cannot load hashes from %s: %s",
+				backend->path, sqlite3_errmsg (backend->db));
+		rspamd_fuzzy_compact_builder_destroy (b);
+
+		return FALSE;
+	}
+
+	if ((compact = rspamd_fuzzy_compact_builder_finish (b, err)) == NULL) {
+		return FALSE;
+	}
+
+	msg_info ("built compact image %s of %z hashes", path,
+			rspamd_fuzzy_compact_count (compact));
+	backend->compact = compact;
+	backend->index = rspamd_fuzzy_index_new ();
+
+	return TRUE;
+}
+
+/*
+ * Filter is a bloom filter over digests: the header is followed by `nbits`
+ * bits, positions are derived from two hashes of a digest
+ */
+RSPAMD_PACKED(rspamd_fuzzy_filter_header) {
+	gchar magic[8];
+	guint32 nhashes;
+	guint32 unused;
+	guint64 nbits;
+};
+
+#define RSPAMD_FUZZY_FILTER_MAGIC "rsfzflt1"
+#define RSPAMD_FUZZY_FILTER_HASHES 7
+/* Gives about 1% of false positives */
+#define RSPAMD_FUZZY_FILTER_BITS_PER_HASH 10
+#define RSPAMD_FUZZY_FILTER_MIN_BITS 8192
+
+static gboolean
+rspamd_fuzzy_filter_header_valid (const guchar *filter, gsize len)
+{
+	const struct rspamd_fuzzy_filter_header *hdr;
+
+	if (len < sizeof (*hdr)) {
+		return FALSE;
+	}
+
+	hdr = (const struct rspamd_fuzzy_filter_header *)filter;
+
+	return memcmp (hdr->magic, RSPAMD_FUZZY_FILTER_MAGIC,
+			sizeof (hdr->magic)) == 0 &&
+			hdr->nhashes > 0 && hdr->nhashes <= 32 &&
+			hdr->nbits > 0 && (hdr->nbits & (hdr->nbits - 1)) == 0 &&
+			len == sizeof (*hdr) + hdr->nbits / NBBY;
+}
+
+gboolean
+rspamd_fuzzy_filter_valid (const guchar *filter, gsize len)
+{
+	return rspamd_fuzzy_filter_header_valid (filter, len);
+}
+
+void
+rspamd_fuzzy_filter_add (GByteArray *filter, const gchar *digest)
+{
+	struct rspamd_fuzzy_filter_header *hdr;
+	guchar *bits;
+	guint64 h1, h2, pos;
+	guint i;
+
+	hdr = (struct rspamd_fuzzy_filter_header *)filter->data;
+	bits = filter->data + sizeof (*hdr);
+	h1 = XXH64 (digest, RSPAMD_FUZZY_INDEX_DIGEST_LEN, 0);
+	h2 = XXH64 (digest, RSPAMD_FUZZY_INDEX_DIGEST_LEN, h1) | 1;
+
+	for (i = 0; i < hdr->nhashes; i ++) {
+		pos = (h1 + i * h2) & (hdr->nbits - 1);
+		bits[pos / NBBY] |= 1 << (pos % NBBY);
+	}
+}
+
+gboolean
+rspamd_fuzzy_filter_check (const guchar *filter, gsize len,
+		const gchar *digest)
+{
+	const struct rspamd_fuzzy_filter_header *hdr;
+	const guchar *bits;
+	guint64 h1, h2, pos;
+	guint i;
+
+	if (filter == NULL || !rspamd_fuzzy_filter_header_valid (filter, len)) {
+		/* Unknown filter cannot exclude anything */
+		return TRUE;
+	}
+
+	hdr = (const struct rspamd_fuzzy_filter_header *)filter;
+	bits = filter + sizeof (*hdr);
+	h1 = XXH64 (digest, RSPAMD_FUZZY_INDEX_DIGEST_LEN, 0);
+	h2 = XXH64 (digest, RSPAMD_FUZZY_INDEX_DIGEST_LEN, h1) | 1;
+
+	for (i = 0; i < hdr->nhashes; i ++) {
+		pos = (h1 + i * h2) & (hdr->nbits - 1);
+
+		if (!(bits[pos / NBBY] & (1 << (pos % NBBY)))) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+GByteArray *
+rspamd_fuzzy_backend_build_filter (struct rspamd_fuzzy_backend *backend,
+		GError **err)
+{
+	struct rspamd_fuzzy_filter_header *hdr;
+	GByteArray *filter;
+	sqlite3_stmt *stmt;
+	gchar digest[RSPAMD_FUZZY_INDEX_DIGEST_LEN];
+	const guchar *text;
+	guint64 nbits = RSPAMD_FUZZY_FILTER_MIN_BITS;
+	gsize count;
+	gint rc, len;
+
+	count = rspamd_fuzzy_backend_count (backend);
+
+	while (nbits < count * RSPAMD_FUZZY_FILTER_BITS_PER_HASH) {
+		nbits <<= 1;
+	}
+
+	filter = g_byte_array_sized_new (sizeof (*hdr) + nbits / NBBY);
+	g_byte_array_set_size (filter, sizeof (*hdr) + nbits / NBBY);
+	memset (filter->data, 0, filter->len);
+	hdr = (struct rspamd_fuzzy_filter_header *)filter->data;
+	memcpy (hdr->magic, RSPAMD_FUZZY_FILTER_MAGIC, sizeof (hdr->magic));
+	hdr->nhashes = RSPAMD_FUZZY_FILTER_HASHES;
+	hdr->nbits = nbits;
+
+	rc = rspamd_fuzzy_backend_run_stmt (backend,
+			RSPAMD_FUZZY_BACKEND_LOAD_DIGESTS);
+	stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_LOAD_DIGESTS].stmt;
+
+	while (rc == SQLITE_OK) {
+		text = sqlite3_column_text (stmt, 1);
+		len = sqlite3_column_bytes (stmt, 1);
+		/* Digests are padded by zeroes as in commands */
+		memset (digest, 0, sizeof (digest));
+
+		if (text != NULL) {
+			memcpy (digest, text, MIN (len, (gint)sizeof (digest)));
+		}
+
+		rspamd_fuzzy_filter_add (filter, digest);
+
+		rc = sqlite3_step (stmt);
+		rc = rc == SQLITE_ROW ? SQLITE_OK : rc;
+	}
+
+	if (rc != SQLITE_DONE) {
+		g_set_error (err, rspamd_fuzzy_backend_quark (),
+				rc, "Cannot load hashes from %s: %s",
+				backend->path, sqlite3_errmsg (backend->db));
+		g_byte_array_free (filter, TRUE);
+
+		return NULL;
+	}
+
+	return filter;
+}
+
+/*
+ * Digests that have shingles matched: each shingle is stored for a single
+ * digest, so there can be at most RSPAMD_SHINGLE_SIZE candidates
+ */
+struct rspamd_fuzzy_shingle_candidates {
+	gint64 ids[RSPAMD_SHINGLE_SIZE];
+	gpointer data[RSPAMD_SHINGLE_SIZE];
+	guint counts[RSPAMD_SHINGLE_SIZE];
+	guint n;
+	guint best;
+	guint best_cnt;
+};
+
+static void
+rspamd_fuzzy_candidates_add (struct rspamd_fuzzy_shingle_candidates *cd,
+		gint64 id, gpointer data)
+{
+	guint i;
+
+	for (i = 0; i < cd->n; i ++) {
+		if (cd->ids[i] == id) {
+			break;
+		}
+	}
+
+	if (i == cd->n) {
+		cd->ids[i] = id;
+		cd->data[i] = data;
+		cd->counts[i] = 0;
+		cd->n ++;
+	}
+
+	/* The first candidate that gets the maximum count wins */
+	if (++cd->counts[i] > cd->best_cnt) {
+		cd->best_cnt = cd->counts[i];
+		cd->best = i;
+	}
+}
+
+/*
+ * Clients ignore matches of half of shingles or less, so there is no need to
+ * look for the remaining shingles if no digest can get enough of them
+ */
+static inline gboolean
+rspamd_fuzzy_candidates_hopeless (struct rspamd_fuzzy_shingle_candidates *cd,
+		guint checked)
+{
+	return cd->best_cnt + (RSPAMD_SHINGLE_SIZE - checked) <=
+			RSPAMD_SHINGLE_SIZE / 2;
+}
+
+/*
+ * Removes expired element from both the index and the database
+ */
+static gboolean
+rspamd_fuzzy_backend_index_expired (struct rspamd_fuzzy_backend *backend,
+		struct rspamd_fuzzy_index_elt *elt, gint64 expire)
+{
+	if (time (NULL) - elt->time > expire) {
+		msg_debug ("requested hash has been expired");
+		rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_DELETE,
+				elt->digest);
+		backend->count -= sqlite3_changes (backend->db);
+		backend->expired ++;
+		rspamd_fuzzy_index_remove (backend->index, elt->digest);
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Expired record is removed from the image only, the database is cleaned
+ * by the periodic expire
+ */
+static gboolean
+rspamd_fuzzy_backend_compact_expired (struct rspamd_fuzzy_backend *backend,
+		struct rspamd_fuzzy_compact_rec *rec, gint64 expire)
+{
+	if (time (NULL) - rec->time > expire) {
+		msg_debug ("requested hash has been expired");
+		rspamd_fuzzy_compact_remove (backend->compact, rec);
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static struct rspamd_fuzzy_reply
+rspamd_fuzzy_backend_check_index (struct rspamd_fuzzy_backend *backend,
+		const struct rspamd_fuzzy_cmd *cmd, gint64 expire)
+{
+	struct rspamd_fuzzy_reply rep = {0, 0, 0, 0.0};
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct rspamd_fuzzy_index_elt *elt;
+	struct rspamd_fuzzy_compact_rec *rec = NULL;
+	struct rspamd_fuzzy_shingle_candidates cd;
+	guint i;
+
+	elt = rspamd_fuzzy_index_find (backend->index,
+			(const guchar *)cmd->digest);
+
+	if (elt == NULL && backend->compact != NULL) {
+		rec = rspamd_fuzzy_compact_find (backend->compact,
+				(const guchar *)cmd->digest);
+	}
+
+	if (elt != NULL) {
+		if (!rspamd_fuzzy_backend_index_expired (backend, elt, expire)) {
+			rep.value = elt->value;
+			rep.prob = 1.0;
+			rep.flag = elt->flag;
+		}
+	}
+	else if (rec != NULL) {
+		if (!rspamd_fuzzy_backend_compact_expired (backend, rec, expire)) {
+			rep.value = rec->value;
+			rep.prob = 1.0;
+			rep.flag = rec->flag;
+		}
+	}
+	else if (cmd->shingles_count > 0) {
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+
+		memset (&cd, 0, sizeof (cd));
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			elt = rspamd_fuzzy_index_find_shingle (backend->index,
+					shcmd->sgl.hashes[i], RSPAMD_FUZZY_SHINGLE_NUMBER (cmd, i));
+
+			if (elt != NULL) {
+				rspamd_fuzzy_candidates_add (&cd, elt->id, elt);
+			}
+			else if (backend->compact != NULL &&
+					(rec = rspamd_fuzzy_compact_find_shingle (backend->compact,
+					shcmd->sgl.hashes[i],
+					RSPAMD_FUZZY_SHINGLE_NUMBER (cmd, i))) != NULL) {
+				/* Negative ids are used for records of the image */
+				rspamd_fuzzy_candidates_add (&cd,
+						-1 - (gint64)rspamd_fuzzy_compact_pos (backend->compact,
+						rec), rec);
+			}
+			else if (rspamd_fuzzy_candidates_hopeless (&cd, i + 1)) {
+				break;
+			}
+		}
+
+		if (cd.n > 0 && !rspamd_fuzzy_candidates_hopeless (&cd,
+				RSPAMD_SHINGLE_SIZE)) {
+			rep.prob = (gdouble)cd.best_cnt / (gdouble)RSPAMD_SHINGLE_SIZE;
+			msg_debug ("found fuzzy hash with probability %.2f", rep.prob);
+
+			if (cd.ids[cd.best] < 0) {
+				rec = cd.data[cd.best];
+
+				if (rspamd_fuzzy_backend_compact_expired (backend, rec,
+						expire)) {
+					rep.prob = 0.0;
+				}
+				else {
+					rep.value = rec->value;
+					rep.flag = rec->flag;
+				}
+			}
+			else {
+				elt = cd.data[cd.best];
+
+				if (rspamd_fuzzy_backend_index_expired (backend, elt, expire)) {
+					rep.prob = 0.0;
+				}
+				else {
+					rep.value = elt->value;
+					rep.flag = elt->flag;
+				}
+			}
+		}
+	}
+
+	return rep;
 }
 
 struct rspamd_fuzzy_reply
@@ -561,11 +1140,14 @@ rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *backend,
 	struct rspamd_fuzzy_reply rep = {0, 0, 0, 0.0};
 	const struct rspamd_fuzzy_shingle_cmd *shcmd;
 	int rc;
-	gint64 timestamp;
-	gint64 shingle_values[RSPAMD_SHINGLE_SIZE], i, sel_id, cur_id,
-		cur_cnt, max_cnt;
+	gint64 timestamp, i;
+	struct rspamd_fuzzy_shingle_candidates cd;
 	const char *digest;
 
+	if (backend->index != NULL) {
+		return rspamd_fuzzy_backend_check_index (backend, cmd, expire);
+	}
+
 	/* Try direct match first of all */
 	rc = rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_CHECK,
 			cmd->digest);
@@ -591,56 +1173,31 @@ rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *backend,
 	else if (cmd->shingles_count > 0) {
 		/* Fuzzy match */
 		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+		memset (&cd, 0, sizeof (cd));
+
 		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
 			rc = rspamd_fuzzy_backend_run_stmt (backend,
 					RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE,
-					shcmd->sgl.hashes[i], i);
+					shcmd->sgl.hashes[i], RSPAMD_FUZZY_SHINGLE_NUMBER (cmd, i));
+			msg_debug ("looking for shingle %L -> %L: %d", i, shcmd->sgl.hashes[i], rc);
+
 			if (rc == SQLITE_OK) {
-				shingle_values[i] = sqlite3_column_int64 (
+				rspamd_fuzzy_candidates_add (&cd, sqlite3_column_int64 (
 						prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE].stmt,
-						0);
-			}
-			else {
-				shingle_values[i] = -1;
+						0), NULL);
 			}
-			msg_debug ("looking for shingle %d -> %L: %d", i, shcmd->sgl.hashes[i], rc);
-		}
-		qsort (shingle_values, RSPAMD_SHINGLE_SIZE, sizeof (gint64),
-				rspamd_fuzzy_backend_int64_cmp);
-		sel_id = -1;
-		cur_id = -1;
-		cur_cnt = 0;
-		max_cnt = 0;
-
-		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-			if (shingle_values[i] == -1) {
-				continue;
-			}
-
-			/* We have some value here, so we need to check it */
-			if (shingle_values[i] == cur_id) {
-				cur_cnt ++;
-			}
-			else {
-				cur_id = shingle_values[i];
-				if (cur_cnt >= max_cnt) {
-					max_cnt = cur_cnt;
-					sel_id = cur_id;
-				}
-				cur_cnt = 0;
+			else if (rspamd_fuzzy_candidates_hopeless (&cd, i + 1)) {
+				break;
 			}
 		}
 
-		if (cur_cnt > max_cnt) {
-			max_cnt = cur_cnt;
-		}
-
-		if (sel_id != -1) {
+		if (cd.n > 0 && !rspamd_fuzzy_candidates_hopeless (&cd,
+				RSPAMD_SHINGLE_SIZE)) {
 			/* We have some id selected here */
-			rep.prob = (gdouble)max_cnt / (gdouble)RSPAMD_SHINGLE_SIZE;
+			rep.prob = (gdouble)cd.best_cnt / (gdouble)RSPAMD_SHINGLE_SIZE;
 			msg_debug ("found fuzzy hash with probability %.2f", rep.prob);
 			rc = rspamd_fuzzy_backend_run_stmt (backend,
-					RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID, sel_id);
+					RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID, cd.ids[cd.best]);
 			if (rc == SQLITE_OK) {
 				digest = sqlite3_column_text (
 						prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt, 0);
@@ -674,22 +1231,60 @@ rspamd_fuzzy_backend_add (struct rspamd_fuzzy_backend *backend,
 	int rc, i;
 	gint64 id;
 	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct rspamd_fuzzy_index_elt *elt = NULL;
+	struct rspamd_fuzzy_compact_rec *rec = NULL;
+	gint64 now = time (NULL);
 
-	rc = rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_CHECK,
+	if (backend->compact != NULL) {
+		rec = rspamd_fuzzy_compact_find (backend->compact,
+				(const guchar *)cmd->digest);
+	}
+
+	if (rec != NULL) {
+		rc = rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_UPDATE,
+			(gint64)cmd->value, cmd->digest);
+
+		if (rc == SQLITE_OK && sqlite3_changes (backend->db) > 0) {
+			rec->value += cmd->value;
+
+			return TRUE;
+		}
+
+		/* Hash has been expired in the database but not in the image */
+		rspamd_fuzzy_compact_remove (backend->compact, rec);
+	}
+
+	if (backend->index != NULL) {
+		elt = rspamd_fuzzy_index_find (backend->index,
+				(const guchar *)cmd->digest);
+		rc = elt != NULL ? SQLITE_OK : SQLITE_DONE;
+	}
+	else {
+		rc = rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_CHECK,
 				cmd->digest);
+	}
 
 	if (rc == SQLITE_OK) {
 		/* We need to increase weight */
 		rc = rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_UPDATE,
 			(gint64)cmd->value, cmd->digest);
+
+		if (rc == SQLITE_OK && elt != NULL) {
+			elt->value += cmd->value;
+		}
 	}
 	else {
 		rc = rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_INSERT,
-			(gint)cmd->flag, cmd->digest, (gint64)cmd->value, (gint64)time (NULL));
+			(gint)cmd->flag, cmd->digest, (gint64)cmd->value, now);
 
 		if (rc == SQLITE_OK) {
 			backend->count ++;
 
+			if (backend->index != NULL) {
+				elt = rspamd_fuzzy_index_insert (backend->index,
+						(const guchar *)cmd->digest, cmd->value, cmd->flag, now);
+			}
+
 			if (cmd->shingles_count > 0) {
 				id = sqlite3_last_insert_rowid (backend->db);
 				shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
@@ -697,8 +1292,15 @@ rspamd_fuzzy_backend_add (struct rspamd_fuzzy_backend *backend,
 				for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
 					rspamd_fuzzy_backend_run_stmt (backend,
 							RSPAMD_FUZZY_BACKEND_INSERT_SHINGLE,
-							shcmd->sgl.hashes[i], i, id);
+							shcmd->sgl.hashes[i], RSPAMD_FUZZY_SHINGLE_NUMBER (cmd, i),
+							id);
 					msg_debug ("add shingle %d -> %L: %d", i, shcmd->sgl.hashes[i], id);
+
+					if (elt != NULL) {
+						rspamd_fuzzy_index_add_shingle (backend->index,
+								shcmd->sgl.hashes[i],
+								RSPAMD_FUZZY_SHINGLE_NUMBER (cmd, i), elt);
+					}
 				}
 			}
 		}
@@ -712,6 +1314,7 @@ gboolean
 rspamd_fuzzy_backend_del (struct rspamd_fuzzy_backend *backend,
 		const struct rspamd_fuzzy_cmd *cmd)
 {
+	struct rspamd_fuzzy_compact_rec *rec;
 	int rc;
 
 	rc = rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_DELETE,
@@ -719,40 +1322,101 @@ rspamd_fuzzy_backend_del (struct rspamd_fuzzy_backend *backend,
 
 	backend->count -= sqlite3_changes (backend->db);
 
+	if (backend->index != NULL) {
+		rspamd_fuzzy_index_remove (backend->index, (const guchar *)cmd->digest);
+	}
+
+	if (backend->compact != NULL) {
+		rec = rspamd_fuzzy_compact_find (backend->compact,
+				(const guchar *)cmd->digest);
+
+		if (rec != NULL) {
+			rspamd_fuzzy_compact_remove (backend->compact, rec);
+		}
+	}
+
 	return (rc == SQLITE_OK);
 }
 
-gboolean
-rspamd_fuzzy_backend_sync (struct rspamd_fuzzy_backend *backend, gint64 expire)
+gsize
+rspamd_fuzzy_backend_expire (struct rspamd_fuzzy_backend *backend,
+		gint64 expire, gsize max_elts)
 {
-	gboolean ret = FALSE;
-	gint64 expire_lim, expired;
+	gint64 expire_lim;
+	gsize expired = 0;
 	gint rc;
-	GError *err = NULL;
 
-	/* Perform expire */
-	if (expire > 0) {
-		expire_lim = time (NULL) - expire;
+	if (expire <= 0) {
+		return 0;
+	}
 
-		if (expire_lim > 0) {
-			rc = rspamd_fuzzy_backend_run_stmt (backend,
-					RSPAMD_FUZZY_BACKEND_EXPIRE, expire_lim);
+	expire_lim = time (NULL) - expire;
 
-			if (rc == SQLITE_OK) {
-				expired = sqlite3_changes (backend->db);
+	if (expire_lim <= 0) {
+		return 0;
+	}
 
-				if (expired > 0) {
-					backend->expired += expired;
-					msg_info ("expired %L hashes", expired);
-				}
+	/* Negative limit means no limit for sqlite */
+	rc = rspamd_fuzzy_backend_run_stmt (backend,
+			RSPAMD_FUZZY_BACKEND_EXPIRE, expire_lim,
+			max_elts > 0 ? (gint64)max_elts : (gint64)-1);
+
+	if (rc == SQLITE_OK) {
+		expired = sqlite3_changes (backend->db);
+
+		if (expired > 0) {
+			backend->expired += expired;
+			backend->count -= MIN (backend->count, expired);
+			msg_debug ("expired %z hashes", expired);
+		}
+	}
+	else {
+		msg_warn ("cannot execute expired statement: %s",
+				sqlite3_errmsg (backend->db));
+	}
+
+	if (max_elts > 0 && expired == max_elts) {
+		/*
+		 * There are likely more expired hashes, so recount them only when
+		 * the previous estimation is exhausted
+		 */
+		if (backend->expire_backlog <= expired) {
+			if (rspamd_fuzzy_backend_run_stmt (backend,
+					RSPAMD_FUZZY_BACKEND_COUNT_EXPIRED, expire_lim) == SQLITE_OK) {
+				backend->expire_backlog = sqlite3_column_int64 (
+						prepared_stmts[RSPAMD_FUZZY_BACKEND_COUNT_EXPIRED].stmt, 0);
 			}
 			else {
-				msg_warn ("cannot execute expired statement: %s",
-						sqlite3_errmsg (backend->db));
+				backend->expire_backlog = 0;
 			}
 		}
+		else {
+			backend->expire_backlog -= expired;
+		}
+	}
+	else {
+		backend->expire_backlog = 0;
+	}
 
+	if (backend->index != NULL) {
+		/* Database is already cleaned, so just drop elements */
+		rspamd_fuzzy_index_expire (backend->index, expire_lim,
+				MAX (rspamd_fuzzy_index_count (backend->index) /
+				FUZZY_INDEX_EXPIRE_DIVISOR, FUZZY_INDEX_EXPIRE_MIN));
 	}
+
+	return expired;
+}
+
+gboolean
+rspamd_fuzzy_backend_sync (struct rspamd_fuzzy_backend *backend, gint64 expire)
+{
+	gboolean ret = FALSE;
+	GError *err = NULL;
+
+	/* Perform expire */
+	rspamd_fuzzy_backend_expire (backend, expire, 0);
+
 	ret = rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT,
 			backend, &err);
 
@@ -782,6 +1446,14 @@ rspamd_fuzzy_backend_close (struct rspamd_fuzzy_backend *backend)
 			g_free (backend->path);
 		}
 
+		if (backend->index != NULL) {
+			rspamd_fuzzy_index_destroy (backend->index);
+		}
+
+		if (backend->compact != NULL) {
+			rspamd_fuzzy_compact_destroy (backend->compact);
+		}
+
 		g_slice_free1 (sizeof (*backend), backend);
 	}
 }
@@ -798,3 +1470,9 @@ rspamd_fuzzy_backend_expired (struct rspamd_fuzzy_backend *backend)
 {
 	return backend->expired;
 }
+
+gsize
+rspamd_fuzzy_backend_expire_backlog (struct rspamd_fuzzy_backend *backend)
+{
+	return backend->expire_backlog;
+}
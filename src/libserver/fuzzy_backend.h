@@ -38,6 +38,67 @@ struct rspamd_fuzzy_backend;
 struct rspamd_fuzzy_backend* rspamd_fuzzy_backend_open (const gchar *path,
 		GError **err);
 
+/**
+ * Load all hashes and shingles to the memory index, after this call all
+ * checks are served from memory and the database is used for persistence only
+ * @param backend
+ * @param err error pointer
+ * @return TRUE if index has been built
+ */
+gboolean rspamd_fuzzy_backend_build_index (struct rspamd_fuzzy_backend *backend,
+		GError **err);
+
+/**
+ * Build compact memory mapped image of all hashes and shingles, after this
+ * call all checks are served from the image and the memory index of hashes
+ * added later, the database is used for persistence only
+ * @param backend
+ * @param path path of image, it is rebuilt on each call
+ * @param err error pointer
+ * @return TRUE if image has been built
+ */
+gboolean rspamd_fuzzy_backend_build_compact (
+		struct rspamd_fuzzy_backend *backend,
+		const gchar *path,
+		GError **err);
+
+/**
+ * Build an approximate membership filter of all digests stored, it can be
+ * used by clients to skip checks of digests that are definitely not stored
+ * @param backend
+ * @param err error pointer
+ * @return filter data or NULL
+ */
+GByteArray * rspamd_fuzzy_backend_build_filter (
+		struct rspamd_fuzzy_backend *backend,
+		GError **err);
+
+/**
+ * Add digest to a filter built by `rspamd_fuzzy_backend_build_filter`
+ * @param filter
+ * @param digest digest of 64 bytes
+ */
+void rspamd_fuzzy_filter_add (GByteArray *filter, const gchar *digest);
+
+/**
+ * Check whether a digest may be stored, invalid filter gives TRUE for all
+ * digests
+ * @param filter filter data
+ * @param len length of filter
+ * @param digest digest of 64 bytes
+ * @return FALSE if digest is definitely not stored
+ */
+gboolean rspamd_fuzzy_filter_check (const guchar *filter, gsize len,
+		const gchar *digest);
+
+/**
+ * Check whether filter data is valid
+ * @param filter filter data
+ * @param len length of filter
+ * @return TRUE if filter is valid
+ */
+gboolean rspamd_fuzzy_filter_valid (const guchar *filter, gsize len);
+
 /**
  * Check specified fuzzy in the backend
  * @param backend
@@ -72,11 +133,22 @@ gboolean rspamd_fuzzy_backend_del (
 /**
  * Sync storage
  * @param backend
+ * @param expire if positive then remove all hashes older than this value
  * @return
  */
 gboolean rspamd_fuzzy_backend_sync (struct rspamd_fuzzy_backend *backend,
 		gint64 expire);
 
+/**
+ * Remove hashes older than `expire` seconds starting from the oldest ones
+ * @param backend
+ * @param expire expire time in seconds
+ * @param max_elts maximum number of hashes to remove, 0 means no limit
+ * @return number of removed hashes
+ */
+gsize rspamd_fuzzy_backend_expire (struct rspamd_fuzzy_backend *backend,
+		gint64 expire, gsize max_elts);
+
 /**
  * Close storage
  * @param backend
@@ -85,5 +157,9 @@ void rspamd_fuzzy_backend_close (struct rspamd_fuzzy_backend *backend);
 
 gsize rspamd_fuzzy_backend_count (struct rspamd_fuzzy_backend *backend);
 gsize rspamd_fuzzy_backend_expired (struct rspamd_fuzzy_backend *backend);
+/**
+ * Returns the estimated number of expired hashes that have not been removed yet
+ */
+gsize rspamd_fuzzy_backend_expire_backlog (struct rspamd_fuzzy_backend *backend);
 
 #endif /* FUZZY_BACKEND_H_ */
@@ -0,0 +1,719 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "fuzzy_compact.h"
+#include "fuzzy_index.h"
+#include "xxhash.h"
+
+#define RSPAMD_FUZZY_COMPACT_MAGIC "rsfzcmp1"
+/* Number of shingles in a block of list, blocks are found by skip entries */
+#define RSPAMD_FUZZY_COMPACT_BLOCK 128
+#define RSPAMD_FUZZY_COMPACT_CHECK_SEED 0xd1c2a3b4e5f60718ULL
+/* Shingles are ordered as signed values by sqlite */
+#define RSPAMD_FUZZY_COMPACT_KEY(v) ((guint64)(v) ^ G_GUINT64_CONSTANT (0x8000000000000000))
+#define RSPAMD_FUZZY_COMPACT_WRITE_BUF 65536
+
+/*
+ * Image layout: header, records, blocks of shingles lists, skip entries of
+ * lists and the lists directory
+ */
+RSPAMD_PACKED(rspamd_fuzzy_compact_header) {
+	gchar magic[8];
+	guint32 rec_size;
+	guint32 nlists;
+	guint64 nrecords;
+	guint64 records_off;
+	guint64 lists_off;
+	guint64 size;
+};
+
+RSPAMD_PACKED(rspamd_fuzzy_compact_list) {
+	guint64 count;
+	guint64 nblocks;
+	guint64 skip_off;
+};
+
+/* Block data is a sequence of varint pairs: delta of key and record number */
+RSPAMD_PACKED(rspamd_fuzzy_compact_skip) {
+	guint64 first;
+	guint64 off;
+};
+
+struct rspamd_fuzzy_compact {
+	guchar *map;
+	gsize size;
+	struct rspamd_fuzzy_compact_header *hdr;
+	struct rspamd_fuzzy_compact_rec *records;
+	struct rspamd_fuzzy_compact_list *lists;
+	gsize removed;
+};
+
+struct rspamd_fuzzy_compact_builder_list {
+	GArray *skips;
+	GByteArray *block;
+	guint64 count;
+	guint64 prev;
+};
+
+struct rspamd_fuzzy_compact_builder {
+	gchar *path;
+	gchar *tmp;
+	gint fd;
+	GByteArray *buf;
+	guint64 off;
+	guint64 nrecords;
+	guchar *map;
+	gsize map_size;
+	struct rspamd_fuzzy_compact_rec *records;
+	struct rspamd_fuzzy_compact_builder_list lists[RSPAMD_FUZZY_COMPACT_LISTS];
+};
+
+static GQuark
+rspamd_fuzzy_compact_quark (void)
+{
+	return g_quark_from_static_string ("fuzzy-compact");
+}
+
+static inline void
+rspamd_fuzzy_compact_rec_init (struct rspamd_fuzzy_compact_rec *rec,
+		const guchar *digest)
+{
+	memcpy (&rec->prefix, digest, sizeof (rec->prefix));
+	rec->check = XXH64 (digest, RSPAMD_FUZZY_INDEX_DIGEST_LEN,
+			RSPAMD_FUZZY_COMPACT_CHECK_SEED);
+}
+
+static gint
+rspamd_fuzzy_compact_rec_cmp (const void *a, const void *b)
+{
+	const struct rspamd_fuzzy_compact_rec *ra = a, *rb = b;
+
+	if (ra->prefix != rb->prefix) {
+		return ra->prefix < rb->prefix ? -1 : 1;
+	}
+
+	if (ra->check != rb->check) {
+		return ra->check < rb->check ? -1 : 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns position of the first record that is not less than key
+ */
+static gsize
+rspamd_fuzzy_compact_lower_bound (struct rspamd_fuzzy_compact_rec *records,
+		gsize nrecords, const struct rspamd_fuzzy_compact_rec *key)
+{
+	gsize lo = 0, hi = nrecords, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (rspamd_fuzzy_compact_rec_cmp (&records[mid], key) < 0) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+static inline void
+rspamd_fuzzy_compact_varint_append (GByteArray *ar, guint64 v)
+{
+	guchar buf[10];
+	guint len = 0;
+
+	while (v >= 0x80) {
+		buf[len++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+
+	buf[len++] = v;
+	g_byte_array_append (ar, buf, len);
+}
+
+static inline gboolean
+rspamd_fuzzy_compact_varint_read (const guchar **p, const guchar *end,
+		guint64 *v)
+{
+	guint64 res = 0;
+	guint shift = 0;
+
+	while (*p < end && shift < 64) {
+		res |= (guint64)(**p & 0x7f) << shift;
+
+		if (!(*(*p)++ & 0x80)) {
+			*v = res;
+			return TRUE;
+		}
+
+		shift += 7;
+	}
+
+	return FALSE;
+}
+
+static gboolean
+rspamd_fuzzy_compact_builder_flush (struct rspamd_fuzzy_compact_builder *b,
+		GError **err)
+{
+	gsize written = 0;
+	gssize r;
+
+	while (written < b->buf->len) {
+		r = write (b->fd, b->buf->data + written, b->buf->len - written);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			g_set_error (err, rspamd_fuzzy_compact_quark (), errno,
+					"cannot write to %s: %s", b->tmp, strerror (errno));
+
+			return FALSE;
+		}
+
+		written += r;
+	}
+
+	g_byte_array_set_size (b->buf, 0);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_fuzzy_compact_builder_append (struct rspamd_fuzzy_compact_builder *b,
+		gconstpointer data, gsize len, GError **err)
+{
+	g_byte_array_append (b->buf, data, len);
+	b->off += len;
+
+	if (b->buf->len >= RSPAMD_FUZZY_COMPACT_WRITE_BUF) {
+		return rspamd_fuzzy_compact_builder_flush (b, err);
+	}
+
+	return TRUE;
+}
+
+struct rspamd_fuzzy_compact_builder *
+rspamd_fuzzy_compact_builder_new (const gchar *path, GError **err)
+{
+	struct rspamd_fuzzy_compact_builder *b;
+	struct rspamd_fuzzy_compact_header hdr;
+	guint i;
+
+	b = g_slice_alloc0 (sizeof (*b));
+	b->path = g_strdup (path);
+	b->tmp = g_strconcat (path, ".new", NULL);
+
+	if ((b->fd = open (b->tmp, O_RDWR | O_CREAT | O_TRUNC, 00644)) == -1) {
+		g_set_error (err, rspamd_fuzzy_compact_quark (), errno,
+				"cannot create %s: %s", b->tmp, strerror (errno));
+		g_free (b->tmp);
+		g_free (b->path);
+		g_slice_free1 (sizeof (*b), b);
+
+		return NULL;
+	}
+
+	b->buf = g_byte_array_sized_new (RSPAMD_FUZZY_COMPACT_WRITE_BUF);
+
+	for (i = 0; i < RSPAMD_FUZZY_COMPACT_LISTS; i ++) {
+		b->lists[i].skips = g_array_new (FALSE, FALSE,
+				sizeof (struct rspamd_fuzzy_compact_skip));
+		b->lists[i].block = g_byte_array_new ();
+	}
+
+	/* Header is written when image is finished */
+	memset (&hdr, 0, sizeof (hdr));
+
+	if (!rspamd_fuzzy_compact_builder_append (b, &hdr, sizeof (hdr), err)) {
+		rspamd_fuzzy_compact_builder_destroy (b);
+
+		return NULL;
+	}
+
+	return b;
+}
+
+gboolean
+rspamd_fuzzy_compact_builder_add_digest (struct rspamd_fuzzy_compact_builder *b,
+		const guchar *digest, gint32 value, guint32 flag, gint64 time,
+		GError **err)
+{
+	struct rspamd_fuzzy_compact_rec rec;
+
+	g_assert (b->map == NULL);
+
+	memset (&rec, 0, sizeof (rec));
+	rspamd_fuzzy_compact_rec_init (&rec, digest);
+	rec.time = MAX (time, 0);
+	rec.value = value;
+	rec.flag = flag;
+	b->nrecords ++;
+
+	return rspamd_fuzzy_compact_builder_append (b, &rec, sizeof (rec), err);
+}
+
+gboolean
+rspamd_fuzzy_compact_builder_sort (struct rspamd_fuzzy_compact_builder *b,
+		GError **err)
+{
+	g_assert (b->map == NULL);
+
+	if (!rspamd_fuzzy_compact_builder_flush (b, err)) {
+		return FALSE;
+	}
+
+	/* Records are sorted in place, so kernel can page them out if needed */
+	b->map_size = b->off;
+	b->map = mmap (NULL, b->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			b->fd, 0);
+
+	if (b->map == MAP_FAILED) {
+		b->map = NULL;
+		g_set_error (err, rspamd_fuzzy_compact_quark (), errno,
+				"cannot mmap %s: %s", b->tmp, strerror (errno));
+
+		return FALSE;
+	}
+
+	b->records = (struct rspamd_fuzzy_compact_rec *)(b->map +
+			sizeof (struct rspamd_fuzzy_compact_header));
+	qsort (b->records, b->nrecords, sizeof (*b->records),
+			rspamd_fuzzy_compact_rec_cmp);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_fuzzy_compact_builder_flush_block (struct rspamd_fuzzy_compact_builder *b,
+		struct rspamd_fuzzy_compact_builder_list *l, GError **err)
+{
+	struct rspamd_fuzzy_compact_skip *skip;
+
+	if (l->block->len == 0) {
+		return TRUE;
+	}
+
+	skip = &g_array_index (l->skips, struct rspamd_fuzzy_compact_skip,
+			l->skips->len - 1);
+	skip->off = b->off;
+
+	if (!rspamd_fuzzy_compact_builder_append (b, l->block->data,
+			l->block->len, err)) {
+		return FALSE;
+	}
+
+	g_byte_array_set_size (l->block, 0);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_fuzzy_compact_builder_add_shingle (struct rspamd_fuzzy_compact_builder *b,
+		guint64 value, guint number, const guchar *digest, GError **err)
+{
+	struct rspamd_fuzzy_compact_builder_list *l;
+	struct rspamd_fuzzy_compact_rec key;
+	struct rspamd_fuzzy_compact_skip skip;
+	guint64 k, delta;
+	gsize pos;
+
+	g_assert (b->map != NULL);
+
+	if (number >= RSPAMD_FUZZY_COMPACT_LISTS) {
+		return TRUE;
+	}
+
+	l = &b->lists[number];
+	k = RSPAMD_FUZZY_COMPACT_KEY (value);
+
+	if (l->count > 0 && k <= l->prev) {
+		return TRUE;
+	}
+
+	rspamd_fuzzy_compact_rec_init (&key, digest);
+	pos = rspamd_fuzzy_compact_lower_bound (b->records, b->nrecords, &key);
+
+	if (pos == b->nrecords ||
+			rspamd_fuzzy_compact_rec_cmp (&b->records[pos], &key) != 0) {
+		return TRUE;
+	}
+
+	if (l->count % RSPAMD_FUZZY_COMPACT_BLOCK == 0) {
+		/* Blocks of different lists are interleaved in the file */
+		if (!rspamd_fuzzy_compact_builder_flush_block (b, l, err)) {
+			return FALSE;
+		}
+
+		skip.first = k;
+		skip.off = 0;
+		g_array_append_val (l->skips, skip);
+		delta = 0;
+	}
+	else {
+		delta = k - l->prev;
+	}
+
+	rspamd_fuzzy_compact_varint_append (l->block, delta);
+	rspamd_fuzzy_compact_varint_append (l->block, pos);
+	l->prev = k;
+	l->count ++;
+
+	return TRUE;
+}
+
+struct rspamd_fuzzy_compact *
+rspamd_fuzzy_compact_builder_finish (struct rspamd_fuzzy_compact_builder *b,
+		GError **err)
+{
+	struct rspamd_fuzzy_compact_header hdr;
+	struct rspamd_fuzzy_compact_list dir[RSPAMD_FUZZY_COMPACT_LISTS];
+	struct rspamd_fuzzy_compact_builder_list *l;
+	struct rspamd_fuzzy_compact *c;
+	guint i;
+
+	if (b->map == NULL && !rspamd_fuzzy_compact_builder_sort (b, err)) {
+		rspamd_fuzzy_compact_builder_destroy (b);
+
+		return NULL;
+	}
+
+	for (i = 0; i < RSPAMD_FUZZY_COMPACT_LISTS; i ++) {
+		l = &b->lists[i];
+
+		if (!rspamd_fuzzy_compact_builder_flush_block (b, l, err)) {
+			rspamd_fuzzy_compact_builder_destroy (b);
+
+			return NULL;
+		}
+
+		dir[i].count = l->count;
+		dir[i].nblocks = l->skips->len;
+		dir[i].skip_off = b->off;
+
+		if (!rspamd_fuzzy_compact_builder_append (b, l->skips->data,
+				l->skips->len * sizeof (struct rspamd_fuzzy_compact_skip),
+				err)) {
+			rspamd_fuzzy_compact_builder_destroy (b);
+
+			return NULL;
+		}
+	}
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, RSPAMD_FUZZY_COMPACT_MAGIC, sizeof (hdr.magic));
+	hdr.rec_size = sizeof (struct rspamd_fuzzy_compact_rec);
+	hdr.nlists = RSPAMD_FUZZY_COMPACT_LISTS;
+	hdr.nrecords = b->nrecords;
+	hdr.records_off = sizeof (hdr);
+	hdr.lists_off = b->off;
+	hdr.size = b->off + sizeof (dir);
+
+	if (!rspamd_fuzzy_compact_builder_append (b, dir, sizeof (dir), err) ||
+			!rspamd_fuzzy_compact_builder_flush (b, err)) {
+		rspamd_fuzzy_compact_builder_destroy (b);
+
+		return NULL;
+	}
+
+	/* Header is written the last, so incomplete images are never valid */
+	if (msync (b->map, b->map_size, MS_SYNC) == -1 ||
+			pwrite (b->fd, &hdr, sizeof (hdr), 0) != sizeof (hdr) ||
+			fsync (b->fd) == -1 ||
+			rename (b->tmp, b->path) == -1) {
+		g_set_error (err, rspamd_fuzzy_compact_quark (), errno,
+				"cannot write %s: %s", b->path, strerror (errno));
+		rspamd_fuzzy_compact_builder_destroy (b);
+
+		return NULL;
+	}
+
+	/* Temporary file has been renamed */
+	g_free (b->tmp);
+	b->tmp = NULL;
+	c = rspamd_fuzzy_compact_open (b->path, err);
+	rspamd_fuzzy_compact_builder_destroy (b);
+
+	return c;
+}
+
+void
+rspamd_fuzzy_compact_builder_destroy (struct rspamd_fuzzy_compact_builder *b)
+{
+	guint i;
+
+	if (b != NULL) {
+		if (b->map != NULL) {
+			munmap (b->map, b->map_size);
+		}
+
+		if (b->fd != -1) {
+			close (b->fd);
+		}
+
+		if (b->tmp != NULL) {
+			(void)unlink (b->tmp);
+			g_free (b->tmp);
+		}
+
+		for (i = 0; i < RSPAMD_FUZZY_COMPACT_LISTS; i ++) {
+			g_array_free (b->lists[i].skips, TRUE);
+			g_byte_array_free (b->lists[i].block, TRUE);
+		}
+
+		g_byte_array_free (b->buf, TRUE);
+		g_free (b->path);
+		g_slice_free1 (sizeof (*b), b);
+	}
+}
+
+static gboolean
+rspamd_fuzzy_compact_valid (const guchar *map, gsize size)
+{
+	const struct rspamd_fuzzy_compact_header *hdr;
+	const struct rspamd_fuzzy_compact_list *lists;
+	guint i;
+
+	if (size < sizeof (*hdr)) {
+		return FALSE;
+	}
+
+	hdr = (const struct rspamd_fuzzy_compact_header *)map;
+
+	if (memcmp (hdr->magic, RSPAMD_FUZZY_COMPACT_MAGIC,
+			sizeof (hdr->magic)) != 0 ||
+			hdr->rec_size != sizeof (struct rspamd_fuzzy_compact_rec) ||
+			hdr->nlists != RSPAMD_FUZZY_COMPACT_LISTS ||
+			hdr->size != size ||
+			hdr->records_off != sizeof (*hdr) ||
+			hdr->nrecords > (size - hdr->records_off) / hdr->rec_size ||
+			hdr->lists_off > size ||
+			size - hdr->lists_off != hdr->nlists * sizeof (*lists)) {
+		return FALSE;
+	}
+
+	lists = (const struct rspamd_fuzzy_compact_list *)(map + hdr->lists_off);
+
+	for (i = 0; i < hdr->nlists; i ++) {
+		if (lists[i].nblocks != (lists[i].count + RSPAMD_FUZZY_COMPACT_BLOCK - 1) /
+				RSPAMD_FUZZY_COMPACT_BLOCK ||
+				lists[i].skip_off > hdr->lists_off ||
+				lists[i].nblocks > (hdr->lists_off - lists[i].skip_off) /
+				sizeof (struct rspamd_fuzzy_compact_skip)) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+struct rspamd_fuzzy_compact *
+rspamd_fuzzy_compact_open (const gchar *path, GError **err)
+{
+	struct rspamd_fuzzy_compact *c;
+	struct stat st;
+	guchar *map;
+	gint fd;
+
+	if ((fd = open (path, O_RDONLY)) == -1) {
+		g_set_error (err, rspamd_fuzzy_compact_quark (), errno,
+				"cannot open %s: %s", path, strerror (errno));
+
+		return NULL;
+	}
+
+	if (fstat (fd, &st) == -1) {
+		g_set_error (err, rspamd_fuzzy_compact_quark (), errno,
+				"cannot stat %s: %s", path, strerror (errno));
+		close (fd);
+
+		return NULL;
+	}
+
+	/* Private mapping allows to update records without writing to the file */
+	map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		g_set_error (err, rspamd_fuzzy_compact_quark (), errno,
+				"cannot mmap %s: %s", path, strerror (errno));
+
+		return NULL;
+	}
+
+	if (!rspamd_fuzzy_compact_valid (map, st.st_size)) {
+		g_set_error (err, rspamd_fuzzy_compact_quark (), EINVAL,
+				"invalid compact image %s", path);
+		munmap (map, st.st_size);
+
+		return NULL;
+	}
+
+	if (madvise (map, st.st_size, MADV_RANDOM) == -1) {
+		msg_info ("madvise failed: %s", strerror (errno));
+	}
+
+	c = g_slice_alloc0 (sizeof (*c));
+	c->map = map;
+	c->size = st.st_size;
+	c->hdr = (struct rspamd_fuzzy_compact_header *)map;
+	c->records = (struct rspamd_fuzzy_compact_rec *)(map + c->hdr->records_off);
+	c->lists = (struct rspamd_fuzzy_compact_list *)(map + c->hdr->lists_off);
+
+	return c;
+}
+
+struct rspamd_fuzzy_compact_rec *
+rspamd_fuzzy_compact_find (struct rspamd_fuzzy_compact *c,
+		const guchar *digest)
+{
+	struct rspamd_fuzzy_compact_rec key;
+	gsize pos;
+
+	rspamd_fuzzy_compact_rec_init (&key, digest);
+	pos = rspamd_fuzzy_compact_lower_bound (c->records, c->hdr->nrecords,
+			&key);
+
+	if (pos < c->hdr->nrecords &&
+			rspamd_fuzzy_compact_rec_cmp (&c->records[pos], &key) == 0 &&
+			c->records[pos].time >= 0) {
+		return &c->records[pos];
+	}
+
+	return NULL;
+}
+
+struct rspamd_fuzzy_compact_rec *
+rspamd_fuzzy_compact_find_shingle (struct rspamd_fuzzy_compact *c,
+		guint64 value, guint number)
+{
+	const struct rspamd_fuzzy_compact_list *l;
+	const struct rspamd_fuzzy_compact_skip *skips;
+	const guchar *p, *end;
+	guint64 k, cur, delta, pos, n, i;
+	gsize lo, hi, mid;
+
+	if (number >= RSPAMD_FUZZY_COMPACT_LISTS) {
+		return NULL;
+	}
+
+	l = &c->lists[number];
+
+	if (l->count == 0) {
+		return NULL;
+	}
+
+	k = RSPAMD_FUZZY_COMPACT_KEY (value);
+	skips = (const struct rspamd_fuzzy_compact_skip *)(c->map + l->skip_off);
+	/* Find the last block that starts with key not greater than ours */
+	lo = 0;
+	hi = l->nblocks;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (skips[mid].first <= k) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	if (lo == 0 || skips[lo - 1].off >= c->hdr->lists_off) {
+		return NULL;
+	}
+
+	lo --;
+	n = lo == l->nblocks - 1 ?
+			l->count - lo * RSPAMD_FUZZY_COMPACT_BLOCK :
+			RSPAMD_FUZZY_COMPACT_BLOCK;
+	p = c->map + skips[lo].off;
+	end = c->map + c->hdr->lists_off;
+	cur = skips[lo].first;
+
+	for (i = 0; i < n; i ++) {
+		if (!rspamd_fuzzy_compact_varint_read (&p, end, &delta) ||
+				!rspamd_fuzzy_compact_varint_read (&p, end, &pos)) {
+			return NULL;
+		}
+
+		cur += delta;
+
+		if (cur > k) {
+			break;
+		}
+
+		if (cur == k) {
+			if (pos < c->hdr->nrecords && c->records[pos].time >= 0) {
+				return &c->records[pos];
+			}
+
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+gsize
+rspamd_fuzzy_compact_pos (struct rspamd_fuzzy_compact *c,
+		const struct rspamd_fuzzy_compact_rec *rec)
+{
+	return rec - c->records;
+}
+
+void
+rspamd_fuzzy_compact_remove (struct rspamd_fuzzy_compact *c,
+		struct rspamd_fuzzy_compact_rec *rec)
+{
+	if (rec->time >= 0) {
+		rec->time = -1;
+		c->removed ++;
+	}
+}
+
+gsize
+rspamd_fuzzy_compact_count (struct rspamd_fuzzy_compact *c)
+{
+	return c->hdr->nrecords - c->removed;
+}
+
+void
+rspamd_fuzzy_compact_destroy (struct rspamd_fuzzy_compact *c)
+{
+	if (c != NULL) {
+		munmap (c->map, c->size);
+		g_slice_free1 (sizeof (*c), c);
+	}
+}
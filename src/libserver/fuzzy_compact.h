@@ -0,0 +1,173 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef FUZZY_COMPACT_H_
+#define FUZZY_COMPACT_H_
+
+#include "config.h"
+#include "shingles.h"
+
+/*
+ * Compact image of fuzzy hashes: fixed width records sorted by digest prefix
+ * and delta encoded lists of shingles for each shingle number. Image is
+ * memory mapped, so it is paged in by kernel on demand
+ */
+struct rspamd_fuzzy_compact;
+struct rspamd_fuzzy_compact_builder;
+
+/* Numbers of both normal and fast shingles */
+#define RSPAMD_FUZZY_COMPACT_LISTS (RSPAMD_SHINGLE_SIZE * 2)
+
+struct rspamd_fuzzy_compact_rec {
+	guint64 prefix;         /* the first 8 bytes of digest */
+	guint64 check;          /* hash of the whole digest to verify matches */
+	gint64 time;            /* negative for removed records */
+	gint32 value;
+	guint32 flag;
+};
+
+/**
+ * Start building of a new image, it is written to a temporary file and
+ * replaces the existing image when it is finished
+ * @param path path of image
+ * @param err error pointer
+ * @return builder or NULL
+ */
+struct rspamd_fuzzy_compact_builder * rspamd_fuzzy_compact_builder_new (
+		const gchar *path, GError **err);
+
+/**
+ * Add digest to the image, all digests must be added before shingles
+ * @param b builder
+ * @param digest digest of RSPAMD_FUZZY_INDEX_DIGEST_LEN bytes
+ * @param value value of hash
+ * @param flag flag of hash
+ * @param time time of hash creation
+ * @param err error pointer
+ * @return TRUE if digest has been written
+ */
+gboolean rspamd_fuzzy_compact_builder_add_digest (
+		struct rspamd_fuzzy_compact_builder *b, const guchar *digest,
+		gint32 value, guint32 flag, gint64 time, GError **err);
+
+/**
+ * Finish digests and sort their records, this must be called before adding
+ * of shingles
+ * @param b builder
+ * @param err error pointer
+ * @return TRUE if records have been sorted
+ */
+gboolean rspamd_fuzzy_compact_builder_sort (
+		struct rspamd_fuzzy_compact_builder *b, GError **err);
+
+/**
+ * Add shingle of a digest, shingles of each number must be added in
+ * ascending order of their values interpreted as signed integers, shingles
+ * out of order and shingles of unknown digests are ignored
+ * @param b builder
+ * @param value shingle value
+ * @param number number of shingle
+ * @param digest digest which shingle belongs to
+ * @param err error pointer
+ * @return TRUE if there were no write errors
+ */
+gboolean rspamd_fuzzy_compact_builder_add_shingle (
+		struct rspamd_fuzzy_compact_builder *b, guint64 value, guint number,
+		const guchar *digest, GError **err);
+
+/**
+ * Write the remaining parts of image, replace the old image and open it,
+ * builder is destroyed by this function
+ * @param b builder
+ * @param err error pointer
+ * @return image or NULL
+ */
+struct rspamd_fuzzy_compact * rspamd_fuzzy_compact_builder_finish (
+		struct rspamd_fuzzy_compact_builder *b, GError **err);
+
+/**
+ * Destroy unfinished builder and remove its temporary file
+ * @param b builder
+ */
+void rspamd_fuzzy_compact_builder_destroy (
+		struct rspamd_fuzzy_compact_builder *b);
+
+/**
+ * Open and map image, modifications of records are private for a process
+ * and they are not written to the file
+ * @param path path of image
+ * @param err error pointer
+ * @return image or NULL
+ */
+struct rspamd_fuzzy_compact * rspamd_fuzzy_compact_open (const gchar *path,
+		GError **err);
+
+/**
+ * Find live record by its digest
+ * @param c image
+ * @param digest digest of RSPAMD_FUZZY_INDEX_DIGEST_LEN bytes
+ * @return record or NULL if digest is not found
+ */
+struct rspamd_fuzzy_compact_rec * rspamd_fuzzy_compact_find (
+		struct rspamd_fuzzy_compact *c, const guchar *digest);
+
+/**
+ * Find live record which shingle belongs to
+ * @param c image
+ * @param value shingle value
+ * @param number number of shingle
+ * @return record or NULL if shingle is not found
+ */
+struct rspamd_fuzzy_compact_rec * rspamd_fuzzy_compact_find_shingle (
+		struct rspamd_fuzzy_compact *c, guint64 value, guint number);
+
+/**
+ * Get position of a record in the image
+ * @param c image
+ * @param rec record
+ * @return position of record
+ */
+gsize rspamd_fuzzy_compact_pos (struct rspamd_fuzzy_compact *c,
+		const struct rspamd_fuzzy_compact_rec *rec);
+
+/**
+ * Mark record as removed, its shingles are not matched any longer
+ * @param c image
+ * @param rec record
+ */
+void rspamd_fuzzy_compact_remove (struct rspamd_fuzzy_compact *c,
+		struct rspamd_fuzzy_compact_rec *rec);
+
+/**
+ * Get number of live records in the image
+ * @param c image
+ * @return number of records
+ */
+gsize rspamd_fuzzy_compact_count (struct rspamd_fuzzy_compact *c);
+
+/**
+ * Unmap and destroy image
+ * @param c image
+ */
+void rspamd_fuzzy_compact_destroy (struct rspamd_fuzzy_compact *c);
+
+#endif /* FUZZY_COMPACT_H_ */
@@ -0,0 +1,499 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "fuzzy_index.h"
+#include "xxhash.h"
+
+/* Number of shards, must be power of 2 */
+#define FUZZY_INDEX_SHARDS 64
+/* Initial number of slots in each shard, must be power of 2 */
+#define FUZZY_INDEX_INITIAL_SLOTS 1024
+/* Number of elements in each chunk of elements storage */
+#define FUZZY_INDEX_CHUNK_SHIFT 16
+#define FUZZY_INDEX_CHUNK_SIZE (1 << FUZZY_INDEX_CHUNK_SHIFT)
+
+#define FUZZY_INDEX_EMPTY 0
+#define FUZZY_INDEX_DELETED G_MAXUINT32
+
+struct rspamd_fuzzy_digest_shard {
+	guint32 *slots;         /* element id + 1, 0 for empty slot */
+	gsize size;
+	gsize used;
+	gsize filled;           /* used slots plus deleted ones */
+};
+
+struct rspamd_fuzzy_shingle_slot {
+	guint64 value;
+	guint32 elt;            /* element id + 1, 0 for empty slot */
+	guint16 number;
+	guint16 gen;            /* generation of element when it was added */
+};
+
+struct rspamd_fuzzy_shingle_shard {
+	struct rspamd_fuzzy_shingle_slot *slots;
+	gsize size;
+	gsize used;
+};
+
+struct rspamd_fuzzy_index {
+	struct rspamd_fuzzy_digest_shard digests[FUZZY_INDEX_SHARDS];
+	struct rspamd_fuzzy_shingle_shard shingles[FUZZY_INDEX_SHARDS];
+	GPtrArray *chunks;
+	GArray *free_elts;
+	guint32 nelts;
+	guint32 expire_pos;
+	gsize count;
+	guint64 seed;
+};
+
+static inline struct rspamd_fuzzy_index_elt *
+rspamd_fuzzy_index_elt_by_id (struct rspamd_fuzzy_index *idx, guint32 id)
+{
+	struct rspamd_fuzzy_index_elt *chunk;
+
+	chunk = g_ptr_array_index (idx->chunks, id >> FUZZY_INDEX_CHUNK_SHIFT);
+
+	return &chunk[id & (FUZZY_INDEX_CHUNK_SIZE - 1)];
+}
+
+static inline guint64
+rspamd_fuzzy_index_digest_hash (struct rspamd_fuzzy_index *idx,
+		const guchar *digest)
+{
+	return XXH64 (digest, RSPAMD_FUZZY_INDEX_DIGEST_LEN, idx->seed);
+}
+
+static inline guint64
+rspamd_fuzzy_index_shingle_hash (struct rspamd_fuzzy_index *idx,
+		guint64 value, guint number)
+{
+	guint64 key[2];
+
+	key[0] = value;
+	key[1] = number;
+
+	return XXH64 (key, sizeof (key), idx->seed);
+}
+
+struct rspamd_fuzzy_index *
+rspamd_fuzzy_index_new (void)
+{
+	struct rspamd_fuzzy_index *idx;
+	guint i;
+
+	idx = g_slice_alloc0 (sizeof (*idx));
+	idx->chunks = g_ptr_array_new ();
+	idx->free_elts = g_array_new (FALSE, FALSE, sizeof (guint32));
+	idx->seed = rspamd_hash_seed ();
+
+	for (i = 0; i < FUZZY_INDEX_SHARDS; i ++) {
+		idx->digests[i].size = FUZZY_INDEX_INITIAL_SLOTS;
+		idx->digests[i].slots = g_malloc0 (FUZZY_INDEX_INITIAL_SLOTS *
+				sizeof (guint32));
+		idx->shingles[i].size = FUZZY_INDEX_INITIAL_SLOTS;
+		idx->shingles[i].slots = g_malloc0 (FUZZY_INDEX_INITIAL_SLOTS *
+				sizeof (struct rspamd_fuzzy_shingle_slot));
+	}
+
+	return idx;
+}
+
+/*
+ * Returns position of the slot with the specified digest or, if it is not
+ * found, position of the first free slot (set in found to FALSE)
+ */
+static gsize
+rspamd_fuzzy_index_digest_slot (struct rspamd_fuzzy_index *idx,
+		struct rspamd_fuzzy_digest_shard *shard, guint64 h,
+		const guchar *digest, gboolean *found)
+{
+	gsize mask = shard->size - 1, pos, free_pos = G_MAXSIZE;
+	guint32 cur;
+	struct rspamd_fuzzy_index_elt *elt;
+
+	pos = (h / FUZZY_INDEX_SHARDS) & mask;
+
+	for (;;) {
+		cur = shard->slots[pos];
+
+		if (cur == FUZZY_INDEX_EMPTY) {
+			*found = FALSE;
+
+			return free_pos != G_MAXSIZE ? free_pos : pos;
+		}
+		else if (cur == FUZZY_INDEX_DELETED) {
+			if (free_pos == G_MAXSIZE) {
+				free_pos = pos;
+			}
+		}
+		else {
+			elt = rspamd_fuzzy_index_elt_by_id (idx, cur - 1);
+
+			if (memcmp (elt->digest, digest, sizeof (elt->digest)) == 0) {
+				*found = TRUE;
+
+				return pos;
+			}
+		}
+
+		pos = (pos + 1) & mask;
+	}
+}
+
+static void
+rspamd_fuzzy_index_digest_resize (struct rspamd_fuzzy_index *idx,
+		struct rspamd_fuzzy_digest_shard *shard)
+{
+	guint32 *old = shard->slots, cur;
+	gsize old_size = shard->size, i, pos, mask;
+	struct rspamd_fuzzy_index_elt *elt;
+
+	/* Grow table if it is really filled and not just polluted by deletions */
+	if (shard->used * 2 >= shard->size) {
+		shard->size *= 2;
+	}
+
+	shard->slots = g_malloc0 (shard->size * sizeof (guint32));
+	shard->filled = shard->used;
+	mask = shard->size - 1;
+
+	for (i = 0; i < old_size; i ++) {
+		cur = old[i];
+
+		if (cur != FUZZY_INDEX_EMPTY && cur != FUZZY_INDEX_DELETED) {
+			elt = rspamd_fuzzy_index_elt_by_id (idx, cur - 1);
+			pos = (rspamd_fuzzy_index_digest_hash (idx, elt->digest) /
+					FUZZY_INDEX_SHARDS) & mask;
+
+			while (shard->slots[pos] != FUZZY_INDEX_EMPTY) {
+				pos = (pos + 1) & mask;
+			}
+
+			shard->slots[pos] = cur;
+		}
+	}
+
+	g_free (old);
+}
+
+struct rspamd_fuzzy_index_elt *
+rspamd_fuzzy_index_find (struct rspamd_fuzzy_index *idx, const guchar *digest)
+{
+	struct rspamd_fuzzy_digest_shard *shard;
+	guint64 h;
+	gsize pos;
+	gboolean found;
+
+	h = rspamd_fuzzy_index_digest_hash (idx, digest);
+	shard = &idx->digests[h & (FUZZY_INDEX_SHARDS - 1)];
+	pos = rspamd_fuzzy_index_digest_slot (idx, shard, h, digest, &found);
+
+	if (found) {
+		return rspamd_fuzzy_index_elt_by_id (idx, shard->slots[pos] - 1);
+	}
+
+	return NULL;
+}
+
+static struct rspamd_fuzzy_index_elt *
+rspamd_fuzzy_index_elt_new (struct rspamd_fuzzy_index *idx)
+{
+	struct rspamd_fuzzy_index_elt *elt, *chunk;
+	guint32 id, i;
+
+	if (idx->free_elts->len > 0) {
+		id = g_array_index (idx->free_elts, guint32, idx->free_elts->len - 1);
+		g_array_set_size (idx->free_elts, idx->free_elts->len - 1);
+
+		return rspamd_fuzzy_index_elt_by_id (idx, id);
+	}
+
+	g_assert (idx->nelts < FUZZY_INDEX_DELETED - 1);
+
+	if ((idx->nelts & (FUZZY_INDEX_CHUNK_SIZE - 1)) == 0) {
+		chunk = g_malloc0 (FUZZY_INDEX_CHUNK_SIZE * sizeof (*chunk));
+
+		for (i = 0; i < FUZZY_INDEX_CHUNK_SIZE; i ++) {
+			chunk[i].id = idx->nelts + i;
+		}
+
+		g_ptr_array_add (idx->chunks, chunk);
+	}
+
+	elt = rspamd_fuzzy_index_elt_by_id (idx, idx->nelts);
+	idx->nelts ++;
+
+	return elt;
+}
+
+struct rspamd_fuzzy_index_elt *
+rspamd_fuzzy_index_insert (struct rspamd_fuzzy_index *idx,
+		const guchar *digest, gint32 value, guint32 flag, gint64 time)
+{
+	struct rspamd_fuzzy_digest_shard *shard;
+	struct rspamd_fuzzy_index_elt *elt;
+	guint64 h;
+	gsize pos;
+	gboolean found;
+
+	h = rspamd_fuzzy_index_digest_hash (idx, digest);
+	shard = &idx->digests[h & (FUZZY_INDEX_SHARDS - 1)];
+
+	/* Keep load factor of the shard below 3/4 */
+	if ((shard->filled + 1) * 4 > shard->size * 3) {
+		rspamd_fuzzy_index_digest_resize (idx, shard);
+	}
+
+	pos = rspamd_fuzzy_index_digest_slot (idx, shard, h, digest, &found);
+
+	if (found) {
+		return rspamd_fuzzy_index_elt_by_id (idx, shard->slots[pos] - 1);
+	}
+
+	elt = rspamd_fuzzy_index_elt_new (idx);
+	memcpy (elt->digest, digest, sizeof (elt->digest));
+	elt->value = value;
+	elt->flag = flag;
+	elt->time = time;
+	elt->live = TRUE;
+
+	if (shard->slots[pos] == FUZZY_INDEX_EMPTY) {
+		shard->filled ++;
+	}
+
+	shard->slots[pos] = elt->id + 1;
+	shard->used ++;
+	idx->count ++;
+
+	return elt;
+}
+
+gboolean
+rspamd_fuzzy_index_remove (struct rspamd_fuzzy_index *idx,
+		const guchar *digest)
+{
+	struct rspamd_fuzzy_digest_shard *shard;
+	struct rspamd_fuzzy_index_elt *elt;
+	guint64 h;
+	gsize pos;
+	gboolean found;
+
+	h = rspamd_fuzzy_index_digest_hash (idx, digest);
+	shard = &idx->digests[h & (FUZZY_INDEX_SHARDS - 1)];
+	pos = rspamd_fuzzy_index_digest_slot (idx, shard, h, digest, &found);
+
+	if (!found) {
+		return FALSE;
+	}
+
+	elt = rspamd_fuzzy_index_elt_by_id (idx, shard->slots[pos] - 1);
+	shard->slots[pos] = FUZZY_INDEX_DELETED;
+	shard->used --;
+	idx->count --;
+
+	/* Shingles pointing to this element become stale as generation changes */
+	elt->live = FALSE;
+	elt->gen ++;
+	g_array_append_val (idx->free_elts, elt->id);
+
+	return TRUE;
+}
+
+static inline gboolean
+rspamd_fuzzy_index_shingle_valid (struct rspamd_fuzzy_index *idx,
+		struct rspamd_fuzzy_shingle_slot *slot)
+{
+	struct rspamd_fuzzy_index_elt *elt;
+
+	elt = rspamd_fuzzy_index_elt_by_id (idx, slot->elt - 1);
+
+	return elt->live && elt->gen == slot->gen;
+}
+
+static void
+rspamd_fuzzy_index_shingle_resize (struct rspamd_fuzzy_index *idx,
+		struct rspamd_fuzzy_shingle_shard *shard)
+{
+	struct rspamd_fuzzy_shingle_slot *old = shard->slots, *cur;
+	gsize old_size = shard->size, i, pos, mask, valid = 0;
+
+	for (i = 0; i < old_size; i ++) {
+		if (old[i].elt != FUZZY_INDEX_EMPTY &&
+				rspamd_fuzzy_index_shingle_valid (idx, &old[i])) {
+			valid ++;
+		}
+	}
+
+	/* Stale shingles are dropped, so we grow only if there are many valid */
+	if (valid * 2 >= shard->size) {
+		shard->size *= 2;
+	}
+
+	shard->slots = g_malloc0 (shard->size * sizeof (*shard->slots));
+	shard->used = 0;
+	mask = shard->size - 1;
+
+	for (i = 0; i < old_size; i ++) {
+		cur = &old[i];
+
+		if (cur->elt != FUZZY_INDEX_EMPTY &&
+				rspamd_fuzzy_index_shingle_valid (idx, cur)) {
+			pos = (rspamd_fuzzy_index_shingle_hash (idx, cur->value,
+					cur->number) / FUZZY_INDEX_SHARDS) & mask;
+
+			while (shard->slots[pos].elt != FUZZY_INDEX_EMPTY) {
+				pos = (pos + 1) & mask;
+			}
+
+			shard->slots[pos] = *cur;
+			shard->used ++;
+		}
+	}
+
+	g_free (old);
+}
+
+static struct rspamd_fuzzy_shingle_slot *
+rspamd_fuzzy_index_shingle_slot (struct rspamd_fuzzy_shingle_shard *shard,
+		guint64 h, guint64 value, guint number)
+{
+	gsize mask = shard->size - 1, pos;
+	struct rspamd_fuzzy_shingle_slot *slot;
+
+	pos = (h / FUZZY_INDEX_SHARDS) & mask;
+
+	for (;;) {
+		slot = &shard->slots[pos];
+
+		if (slot->elt == FUZZY_INDEX_EMPTY ||
+				(slot->value == value && slot->number == number)) {
+			return slot;
+		}
+
+		pos = (pos + 1) & mask;
+	}
+}
+
+void
+rspamd_fuzzy_index_add_shingle (struct rspamd_fuzzy_index *idx,
+		guint64 value, guint number, struct rspamd_fuzzy_index_elt *elt)
+{
+	struct rspamd_fuzzy_shingle_shard *shard;
+	struct rspamd_fuzzy_shingle_slot *slot;
+	guint64 h;
+
+	h = rspamd_fuzzy_index_shingle_hash (idx, value, number);
+	shard = &idx->shingles[h & (FUZZY_INDEX_SHARDS - 1)];
+
+	if ((shard->used + 1) * 4 > shard->size * 3) {
+		rspamd_fuzzy_index_shingle_resize (idx, shard);
+	}
+
+	slot = rspamd_fuzzy_index_shingle_slot (shard, h, value, number);
+
+	if (slot->elt == FUZZY_INDEX_EMPTY) {
+		shard->used ++;
+	}
+
+	slot->value = value;
+	slot->number = number;
+	slot->elt = elt->id + 1;
+	slot->gen = elt->gen;
+}
+
+struct rspamd_fuzzy_index_elt *
+rspamd_fuzzy_index_find_shingle (struct rspamd_fuzzy_index *idx,
+		guint64 value, guint number)
+{
+	struct rspamd_fuzzy_shingle_shard *shard;
+	struct rspamd_fuzzy_shingle_slot *slot;
+	guint64 h;
+
+	h = rspamd_fuzzy_index_shingle_hash (idx, value, number);
+	shard = &idx->shingles[h & (FUZZY_INDEX_SHARDS - 1)];
+	slot = rspamd_fuzzy_index_shingle_slot (shard, h, value, number);
+
+	if (slot->elt != FUZZY_INDEX_EMPTY &&
+			rspamd_fuzzy_index_shingle_valid (idx, slot)) {
+		return rspamd_fuzzy_index_elt_by_id (idx, slot->elt - 1);
+	}
+
+	return NULL;
+}
+
+gsize
+rspamd_fuzzy_index_expire (struct rspamd_fuzzy_index *idx, gint64 lim,
+		gsize max_check)
+{
+	struct rspamd_fuzzy_index_elt *elt;
+	gsize expired = 0;
+
+	max_check = MIN (max_check, idx->nelts);
+
+	while (max_check > 0) {
+		if (idx->expire_pos >= idx->nelts) {
+			idx->expire_pos = 0;
+		}
+
+		elt = rspamd_fuzzy_index_elt_by_id (idx, idx->expire_pos);
+
+		if (elt->live && elt->time < lim) {
+			rspamd_fuzzy_index_remove (idx, elt->digest);
+			expired ++;
+		}
+
+		idx->expire_pos ++;
+		max_check --;
+	}
+
+	return expired;
+}
+
+gsize
+rspamd_fuzzy_index_count (struct rspamd_fuzzy_index *idx)
+{
+	return idx->count;
+}
+
+void
+rspamd_fuzzy_index_destroy (struct rspamd_fuzzy_index *idx)
+{
+	guint i;
+
+	if (idx != NULL) {
+		for (i = 0; i < FUZZY_INDEX_SHARDS; i ++) {
+			g_free (idx->digests[i].slots);
+			g_free (idx->shingles[i].slots);
+		}
+
+		for (i = 0; i < idx->chunks->len; i ++) {
+			g_free (g_ptr_array_index (idx->chunks, i));
+		}
+
+		g_ptr_array_free (idx->chunks, TRUE);
+		g_array_free (idx->free_elts, TRUE);
+		g_slice_free1 (sizeof (*idx), idx);
+	}
+}
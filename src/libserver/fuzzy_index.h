@@ -0,0 +1,127 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef FUZZY_INDEX_H_
+#define FUZZY_INDEX_H_
+
+#include "config.h"
+
+#define RSPAMD_FUZZY_INDEX_DIGEST_LEN 64
+
+/*
+ * In-memory index of fuzzy hashes: digests are stored in sharded open
+ * addressing tables, shingles are mapped to the digests they belong to
+ */
+struct rspamd_fuzzy_index;
+
+struct rspamd_fuzzy_index_elt {
+	guchar digest[RSPAMD_FUZZY_INDEX_DIGEST_LEN];
+	gint64 time;
+	gint32 value;
+	guint32 flag;
+	guint32 id;
+	guint16 gen;
+	guint16 live;
+};
+
+/**
+ * Create new empty index
+ * @return new index
+ */
+struct rspamd_fuzzy_index * rspamd_fuzzy_index_new (void);
+
+/**
+ * Find element by its digest
+ * @param idx index
+ * @param digest digest of RSPAMD_FUZZY_INDEX_DIGEST_LEN bytes
+ * @return element or NULL if digest is not found
+ */
+struct rspamd_fuzzy_index_elt * rspamd_fuzzy_index_find (
+		struct rspamd_fuzzy_index *idx, const guchar *digest);
+
+/**
+ * Insert new element to the index, digest must not be already in the index
+ * @param idx index
+ * @param digest digest of RSPAMD_FUZZY_INDEX_DIGEST_LEN bytes
+ * @param value value of hash
+ * @param flag flag of hash
+ * @param time time of hash creation
+ * @return new element
+ */
+struct rspamd_fuzzy_index_elt * rspamd_fuzzy_index_insert (
+		struct rspamd_fuzzy_index *idx, const guchar *digest,
+		gint32 value, guint32 flag, gint64 time);
+
+/**
+ * Remove element from the index, shingles of the element are invalidated
+ * @param idx index
+ * @param digest digest of RSPAMD_FUZZY_INDEX_DIGEST_LEN bytes
+ * @return TRUE if element has been removed
+ */
+gboolean rspamd_fuzzy_index_remove (struct rspamd_fuzzy_index *idx,
+		const guchar *digest);
+
+/**
+ * Map shingle to the specified element replacing the previous mapping
+ * @param idx index
+ * @param value shingle value
+ * @param number number of shingle
+ * @param elt element
+ */
+void rspamd_fuzzy_index_add_shingle (struct rspamd_fuzzy_index *idx,
+		guint64 value, guint number, struct rspamd_fuzzy_index_elt *elt);
+
+/**
+ * Find element which shingle belongs to
+ * @param idx index
+ * @param value shingle value
+ * @param number number of shingle
+ * @return element or NULL if shingle is not found
+ */
+struct rspamd_fuzzy_index_elt * rspamd_fuzzy_index_find_shingle (
+		struct rspamd_fuzzy_index *idx, guint64 value, guint number);
+
+/**
+ * Remove elements older than the limit, the index is checked incrementally
+ * starting from the position where the previous call has stopped
+ * @param idx index
+ * @param lim time limit
+ * @param max_check maximum number of elements to check
+ * @return number of removed elements
+ */
+gsize rspamd_fuzzy_index_expire (struct rspamd_fuzzy_index *idx, gint64 lim,
+		gsize max_check);
+
+/**
+ * Get number of elements in the index
+ * @param idx index
+ * @return number of elements
+ */
+gsize rspamd_fuzzy_index_count (struct rspamd_fuzzy_index *idx);
+
+/**
+ * Destroy index
+ * @param idx index
+ */
+void rspamd_fuzzy_index_destroy (struct rspamd_fuzzy_index *idx);
+
+#endif /* FUZZY_INDEX_H_ */
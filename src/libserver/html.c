@@ -28,8 +28,24 @@
 #include "message.h"
 #include "html.h"
 #include "url.h"
+#include "platform_config.h"
+
+extern unsigned long cpu_config;
+
+/*
+ * Perfect hash of a static table: a key is assigned to a bucket by its hash
+ * and each bucket has a displacement that places all keys of the bucket to
+ * distinct slots, so a lookup needs one hash and a single comparison
+ */
+struct html_phash {
+	guint16 *disp;
+	gint16 *slots;
+	guint nbuckets;
+	guint nslots;
+};
 
 static sig_atomic_t tags_sorted = 0;
+static struct html_phash tags_hash;
 
 static struct html_tag tag_defs[] = {
 	/* W3C defined elements */
@@ -158,6 +174,8 @@ static struct html_tag tag_defs[] = {
 };
 
 static sig_atomic_t entities_sorted = 0;
+static struct html_phash entities_hash;
+static struct html_phash entities_num_hash;
 struct _entity;
 typedef struct _entity entity;
 
@@ -439,48 +457,383 @@ static entity entities_defs[] = {
 	{"euro", 8364, "E"},
 };
 
-static entity entities_defs_num[ (G_N_ELEMENTS (entities_defs)) ];
+/* Maximum length of an entity name */
+#define HTML_ENTITY_MAX 16
 
-static gint
-tag_cmp (const void *m1, const void *m2)
+static inline guint64
+html_phash_mix (guint64 h)
 {
-	const struct html_tag *p1 = m1;
-	const struct html_tag *p2 = m2;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
 
-	return g_ascii_strcasecmp (p1->name, p2->name);
+	return h;
 }
 
-static gint
-entity_cmp (const void *m1, const void *m2)
+static inline guint64
+html_phash_key (const guchar *key, gsize len, gboolean lc)
 {
-	const entity *p1 = m1;
-	const entity *p2 = m2;
+	guint64 h = 0xcbf29ce484222325ULL;
+	gsize i;
 
-	return g_ascii_strcasecmp (p1->name, p2->name);
+	for (i = 0; i < len; i ++) {
+		h ^= lc ? g_ascii_tolower (key[i]) : key[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return html_phash_mix (h);
+}
+
+static inline guint
+html_phash_slot (const struct html_phash *ph, guint64 h, guint d)
+{
+	return html_phash_mix (h + d * 0x9E3779B97F4A7C15ULL) & (ph->nslots - 1);
 }
 
 static gint
-entity_cmp_num (const void *m1, const void *m2)
+html_phash_bucket_cmp (gconstpointer a, gconstpointer b, gpointer ud)
 {
-	const entity *p1 = m1;
-	const entity *p2 = m2;
+	const guint *sizes = ud;
 
-	return p1->code - p2->code;
+	return (gint)sizes[*(const guint *)b] - (gint)sizes[*(const guint *)a];
 }
 
-static GNode *
-construct_html_node (rspamd_mempool_t * pool, gchar *text, gsize tag_len)
+/*
+ * Build perfect hash for n keys, larger buckets are placed first as they
+ * are harder to place
+ */
+static void
+html_phash_build (struct html_phash *ph, const guchar **keys,
+		const gsize *lens, guint n, gboolean lc)
 {
-	struct html_node *html;
-	GNode *n = NULL;
-	struct html_tag key, *found;
-	gchar t;
+	guint64 *hashes;
+	guint *order, *sizes, *slots, i, j, k, d, b;
+	gboolean placed = FALSE;
 
-	if (text == NULL || *text == '\0') {
+	hashes = g_malloc (n * sizeof (*hashes));
+
+	for (i = 0; i < n; i ++) {
+		hashes[i] = html_phash_key (keys[i], lens[i], lc);
+	}
+
+	ph->nslots = 1;
+	while (ph->nslots < n) {
+		ph->nslots <<= 1;
+	}
+
+	for (;;) {
+		ph->nbuckets = MAX (ph->nslots / 4, 1);
+		ph->disp = g_malloc0 (ph->nbuckets * sizeof (*ph->disp));
+		ph->slots = g_malloc (ph->nslots * sizeof (*ph->slots));
+		memset (ph->slots, 0xff, ph->nslots * sizeof (*ph->slots));
+		order = g_malloc (ph->nbuckets * sizeof (*order));
+		sizes = g_malloc0 (ph->nbuckets * sizeof (*sizes));
+		slots = g_malloc (n * sizeof (*slots));
+
+		for (i = 0; i < n; i ++) {
+			sizes[(hashes[i] >> 32) & (ph->nbuckets - 1)] ++;
+		}
+
+		for (i = 0; i < ph->nbuckets; i ++) {
+			order[i] = i;
+		}
+
+		g_qsort_with_data (order, ph->nbuckets, sizeof (*order),
+				html_phash_bucket_cmp, sizes);
+
+		for (b = 0; b < ph->nbuckets && sizes[order[b]] > 0; b ++) {
+			placed = FALSE;
+
+			for (d = 0; d <= G_MAXUINT16 && !placed; d ++) {
+				k = 0;
+
+				for (i = 0; i < n; i ++) {
+					if (((hashes[i] >> 32) & (ph->nbuckets - 1)) != order[b]) {
+						continue;
+					}
+
+					slots[k] = html_phash_slot (ph, hashes[i], d);
+
+					if (ph->slots[slots[k]] != -1) {
+						break;
+					}
+
+					for (j = 0; j < k; j ++) {
+						if (slots[j] == slots[k]) {
+							break;
+						}
+					}
+
+					if (j != k) {
+						break;
+					}
+
+					k ++;
+				}
+
+				if (i == n) {
+					/* All keys of the bucket are placed */
+					ph->disp[order[b]] = d;
+					k = 0;
+
+					for (i = 0; i < n; i ++) {
+						if (((hashes[i] >> 32) & (ph->nbuckets - 1)) ==
+								order[b]) {
+							ph->slots[slots[k ++]] = i;
+						}
+					}
+
+					placed = TRUE;
+				}
+			}
+
+			if (!placed) {
+				break;
+			}
+		}
+
+		g_free (order);
+		g_free (sizes);
+		g_free (slots);
+
+		if (b == ph->nbuckets || placed) {
+			break;
+		}
+
+		/* Retry with a larger table */
+		g_free (ph->disp);
+		g_free (ph->slots);
+		ph->nslots <<= 1;
+	}
+
+	g_free (hashes);
+}
+
+/* Returns index of the only candidate for a key or -1 */
+static inline gint
+html_phash_find (const struct html_phash *ph, const guchar *key, gsize len,
+		gboolean lc)
+{
+	guint64 h;
+
+	if (ph->slots == NULL) {
+		return -1;
+	}
+
+	h = html_phash_key (key, len, lc);
+
+	return ph->slots[html_phash_slot (ph, h,
+			ph->disp[(h >> 32) & (ph->nbuckets - 1)])];
+}
+
+static struct html_tag *
+html_find_tag (const gchar *name, gsize len)
+{
+	gint idx;
+
+	idx = html_phash_find (&tags_hash, (const guchar *)name, len, TRUE);
+
+	if (idx != -1 && g_ascii_strncasecmp (tag_defs[idx].name, name, len) == 0
+			&& tag_defs[idx].name[len] == '\0') {
+		return &tag_defs[idx];
+	}
+
+	return NULL;
+}
+
+/* Exact names are preferred, other cases are matched case insensitively */
+static entity *
+html_find_entity (const gchar *name, gsize len)
+{
+	gchar lcbuf[HTML_ENTITY_MAX];
+	gint idx;
+	gsize i;
+
+	idx = html_phash_find (&entities_hash, (const guchar *)name, len,
+			FALSE);
+
+	if (idx != -1 && strncmp (entities_defs[idx].name, name, len) == 0 &&
+			entities_defs[idx].name[len] == '\0') {
+		return &entities_defs[idx];
+	}
+
+	if (len > sizeof (lcbuf)) {
 		return NULL;
 	}
 
-	html = rspamd_mempool_alloc0 (pool, sizeof (struct html_node));
+	for (i = 0; i < len; i ++) {
+		lcbuf[i] = g_ascii_tolower (name[i]);
+	}
+
+	idx = html_phash_find (&entities_hash, (const guchar *)lcbuf, len,
+			FALSE);
+
+	if (idx != -1 && g_ascii_strncasecmp (entities_defs[idx].name, name,
+			len) == 0 && entities_defs[idx].name[len] == '\0') {
+		return &entities_defs[idx];
+	}
+
+	return NULL;
+}
+
+static entity *
+html_find_entity_num (uint code)
+{
+	gint idx;
+
+	idx = html_phash_find (&entities_num_hash, (const guchar *)&code,
+			sizeof (code), FALSE);
+
+	if (idx != -1 && entities_defs[idx].code == code) {
+		return &entities_defs[idx];
+	}
+
+	return NULL;
+}
+
+static gsize html_text_span_generic (const guchar *p, gsize len);
+
+typedef struct rspamd_html_span_impl_s {
+	unsigned long cpu_flags;
+	const char *desc;
+	gsize (*span) (const guchar *p, gsize len);
+} rspamd_html_span_impl_t;
+
+#define HTML_SPAN_DECLARE(ext) \
+		static gsize html_text_span_##ext (const guchar *p, gsize len);
+#define HTML_SPAN_IMPL(cpuflags, desc, ext) \
+		{(cpuflags), desc, html_text_span_##ext}
+
+#if defined(HAVE_AVX2) && defined(HAVE_TARGET_ATTRIBUTE)
+	HTML_SPAN_DECLARE(avx2)
+	#define HTML_SPAN_AVX2 HTML_SPAN_IMPL(CPUID_AVX2, "avx2", avx2)
+#endif
+#if defined(HAVE_SSE2) && defined(HAVE_TARGET_ATTRIBUTE)
+	HTML_SPAN_DECLARE(sse2)
+	#define HTML_SPAN_SSE2 HTML_SPAN_IMPL(CPUID_SSE2, "sse2", sse2)
+#endif
+
+#define HTML_SPAN_GENERIC HTML_SPAN_IMPL(0, "generic", generic)
+
+static const rspamd_html_span_impl_t html_span_list[] = {
+	HTML_SPAN_GENERIC,
+#if defined(HTML_SPAN_AVX2)
+	HTML_SPAN_AVX2,
+#endif
+#if defined(HTML_SPAN_SSE2)
+	HTML_SPAN_SSE2
+#endif
+};
+
+static const rspamd_html_span_impl_t *html_span_impl = &html_span_list[0];
+
+/* Characters that stop plain text: tags, entities and zero bytes */
+#define HTML_IS_MARKUP(c) ((c) == '<' || (c) == '&' || (c) == ';' || \
+	(c) == '\0')
+
+static gsize
+html_text_span_generic (const guchar *p, gsize len)
+{
+	gsize i;
+
+	for (i = 0; i < len; i ++) {
+		if (HTML_IS_MARKUP (p[i])) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+#if defined(HAVE_AVX2) && defined(HAVE_TARGET_ATTRIBUTE)
+#include <immintrin.h>
+
+__attribute__((target("avx2"))) static gsize
+html_text_span_avx2 (const guchar *p, gsize len)
+{
+	__m256i lt, amp, semi, zero, v, m;
+	guint32 mask;
+	gsize i = 0;
+
+	lt = _mm256_set1_epi8 ('<');
+	amp = _mm256_set1_epi8 ('&');
+	semi = _mm256_set1_epi8 (';');
+	zero = _mm256_setzero_si256 ();
+
+	while (len - i >= 32) {
+		v = _mm256_loadu_si256 ((const __m256i *)(p + i));
+		m = _mm256_or_si256 (
+				_mm256_or_si256 (_mm256_cmpeq_epi8 (v, lt),
+						_mm256_cmpeq_epi8 (v, amp)),
+				_mm256_or_si256 (_mm256_cmpeq_epi8 (v, semi),
+						_mm256_cmpeq_epi8 (v, zero)));
+		mask = _mm256_movemask_epi8 (m);
+
+		if (mask != 0) {
+			return i + __builtin_ctz (mask);
+		}
+
+		i += 32;
+	}
+
+	return i + html_text_span_generic (p + i, len - i);
+}
+#endif
+
+#if defined(HAVE_SSE2) && defined(HAVE_TARGET_ATTRIBUTE)
+#include <emmintrin.h>
+
+__attribute__((target("sse2"))) static gsize
+html_text_span_sse2 (const guchar *p, gsize len)
+{
+	__m128i lt, amp, semi, zero, v, m;
+	guint32 mask;
+	gsize i = 0;
+
+	lt = _mm_set1_epi8 ('<');
+	amp = _mm_set1_epi8 ('&');
+	semi = _mm_set1_epi8 (';');
+	zero = _mm_setzero_si128 ();
+
+	while (len - i >= 16) {
+		v = _mm_loadu_si128 ((const __m128i *)(p + i));
+		m = _mm_or_si128 (
+				_mm_or_si128 (_mm_cmpeq_epi8 (v, lt),
+						_mm_cmpeq_epi8 (v, amp)),
+				_mm_or_si128 (_mm_cmpeq_epi8 (v, semi),
+						_mm_cmpeq_epi8 (v, zero)));
+		mask = _mm_movemask_epi8 (m);
+
+		if (mask != 0) {
+			return i + __builtin_ctz (mask);
+		}
+
+		i += 16;
+	}
+
+	return i + html_text_span_generic (p + i, len - i);
+}
+#endif
+
+gsize
+rspamd_html_text_span (const guchar *p, gsize len)
+{
+	return html_span_impl->span (p, len);
+}
+
+static gboolean
+construct_html_node (struct html_node *html, gchar *text, gsize tag_len)
+{
+	struct html_tag *found;
+	gchar *name;
+
+	if (text == NULL || *text == '\0') {
+		return FALSE;
+	}
+
+	memset (html, 0, sizeof (*html));
 
 	/* Check whether this tag is fully closed */
 	if (*(text + tag_len - 1) == '/') {
@@ -504,57 +857,56 @@ construct_html_node (rspamd_mempool_t * pool, gchar *text, gsize tag_len)
 		}
 
 		/* Find end of tag name */
-		key.name = text;
+		name = text;
 		while (*text && g_ascii_isalnum (*(++text))) ;
 
-		t = *text;
-		*text = '\0';
-
 		/* Match tag id by tag name */
-		if ((found =
-			bsearch (&key, tag_defs, G_N_ELEMENTS (tag_defs),
-			sizeof (struct html_tag), tag_cmp)) != NULL) {
-			*text = t;
+		if ((found = html_find_tag (name, text - name)) != NULL) {
 			html->tag = found;
 		}
 		else {
-			*text = t;
-			return NULL;
+			return FALSE;
 		}
 	}
 
-	n = g_node_new (html);
+	return TRUE;
+}
+
+static void
+html_push_tag (rspamd_mempool_t *pool, struct html_content *hc, tag_id_t id)
+{
+	tag_id_t *nstack;
+
+	if (hc->depth == hc->stack_size) {
+		hc->stack_size = hc->stack_size ? hc->stack_size * 2 : 32;
+		nstack = rspamd_mempool_alloc (pool,
+				hc->stack_size * sizeof (tag_id_t));
+
+		if (hc->depth > 0) {
+			memcpy (nstack, hc->stack, hc->depth * sizeof (tag_id_t));
+		}
+
+		hc->stack = nstack;
+	}
 
-	return n;
+	hc->stack[hc->depth ++] = id;
 }
 
+/*
+ * Closing tag closes the nearest open tag with the same id and all tags
+ * opened after it
+ */
 static gboolean
-check_balance (GNode * node, GNode ** cur_level)
+check_balance (struct html_content *hc, tag_id_t id)
 {
-	struct html_node *arg = node->data, *tmp;
-	GNode *cur;
-
-	if (arg->flags & FL_CLOSING) {
-		/* First of all check whether this tag is closing tag for parent node */
-		cur = node->parent;
-		while (cur && cur->data) {
-			tmp = cur->data;
-			if ((tmp->tag &&
-				arg->tag) && tmp->tag->id == arg->tag->id &&
-				(tmp->flags & FL_CLOSED) == 0) {
-				tmp->flags |= FL_CLOSED;
-				/* Destroy current node as we find corresponding parent node */
-				g_node_destroy (node);
-				/* Change level */
-				*cur_level = cur->parent;
-				return TRUE;
-			}
-			cur = cur->parent;
+	guint i;
+
+	for (i = hc->depth; i > 0; i --) {
+		if (hc->stack[i - 1] == id) {
+			hc->depth = i - 1;
+			return TRUE;
 		}
 	}
-	else {
-		return TRUE;
-	}
 
 	return FALSE;
 }
@@ -562,12 +914,7 @@ check_balance (GNode * node, GNode ** cur_level)
 struct html_tag *
 get_tag_by_name (const gchar *name)
 {
-	struct html_tag key;
-
-	key.name = name;
-
-	return bsearch (&key, tag_defs, G_N_ELEMENTS (tag_defs),
-			   sizeof (struct html_tag), tag_cmp);
+	return html_find_tag (name, strlen (name));
 }
 
 /* Decode HTML entitles in text */
@@ -577,7 +924,7 @@ decode_entitles (gchar *s, guint * len)
 	guint l, rep_len;
 	gchar *t = s, *h = s, *e = s, *end_ptr;
 	gint state = 0, val, base;
-	entity *found, key;
+	entity *found;
 
 	if (len == NULL || *len == 0) {
 		l = strlen (s);
@@ -590,29 +937,33 @@ decode_entitles (gchar *s, guint * len)
 		switch (state) {
 		/* Out of entitle */
 		case 0:
-			if (*h == '&') {
-				state = 1;
-				e = h;
-				h++;
-				continue;
+			/* Copy text up to the next entity at once */
+			e = memchr (h, '&', l - (h - s));
+
+			if (e == NULL) {
+				e = s + l;
 			}
-			else {
-				*t = *h;
+
+			if (t != h) {
+				memmove (t, h, e - h);
+			}
+
+			t += e - h;
+			h = e;
+
+			if (h - s < (gint)l) {
+				state = 1;
 				h++;
-				t++;
 			}
-			break;
+			continue;
 		case 1:
 			if (*h == ';') {
 				/* Determine base */
 				/* First find in entities table */
 
-				key.name = e + 1;
 				*h = '\0';
 				if (*(e + 1) != '#' &&
-					(found =
-					bsearch (&key, entities_defs, G_N_ELEMENTS (entities_defs),
-					sizeof (entity), entity_cmp)) != NULL) {
+					(found = html_find_entity (e + 1, h - e - 1)) != NULL) {
 					if (found->replacement) {
 						rep_len = strlen (found->replacement);
 						memcpy (t, found->replacement, rep_len);
@@ -641,11 +992,7 @@ decode_entitles (gchar *s, guint * len)
 					}
 					else {
 						/* Search for a replacement */
-						key.code = val;
-						found =
-							bsearch (&key, entities_defs_num, G_N_ELEMENTS (
-									entities_defs), sizeof (entity),
-								entity_cmp_num);
+						found = html_find_entity_num (val);
 						if (found) {
 							if (found->replacement) {
 								rep_len = strlen (found->replacement);
@@ -872,97 +1219,117 @@ parse_tag_url (struct rspamd_task *task,
 	}
 }
 
-gboolean
-add_html_node (struct rspamd_task *task,
-	rspamd_mempool_t * pool,
-	struct mime_text_part *part,
-	gchar *tag_text,
-	gsize tag_len,
-	gsize remain,
-	GNode ** cur_level)
+void
+rspamd_html_init (void)
 {
-	GNode *new;
-	struct html_node *data;
+	const guchar *keys[MAX (G_N_ELEMENTS (tag_defs),
+			G_N_ELEMENTS (entities_defs))];
+	gsize lens[G_N_ELEMENTS (keys)];
+	guint i;
 
 	if (!tags_sorted) {
-		qsort (tag_defs, G_N_ELEMENTS (
-				tag_defs), sizeof (struct html_tag), tag_cmp);
+		for (i = 0; i < G_N_ELEMENTS (tag_defs); i ++) {
+			keys[i] = (const guchar *)tag_defs[i].name;
+			lens[i] = strlen (tag_defs[i].name);
+		}
+
+		html_phash_build (&tags_hash, keys, lens, G_N_ELEMENTS (tag_defs),
+				TRUE);
 		tags_sorted = 1;
 	}
 	if (!entities_sorted) {
-		qsort (entities_defs, G_N_ELEMENTS (
-				entities_defs), sizeof (entity), entity_cmp);
-		memcpy (entities_defs_num, entities_defs, sizeof (entities_defs));
-		qsort (entities_defs_num, G_N_ELEMENTS (
-				entities_defs), sizeof (entity), entity_cmp_num);
+		for (i = 0; i < G_N_ELEMENTS (entities_defs); i ++) {
+			keys[i] = (const guchar *)entities_defs[i].name;
+			lens[i] = strlen (entities_defs[i].name);
+		}
+
+		html_phash_build (&entities_hash, keys, lens,
+				G_N_ELEMENTS (entities_defs), FALSE);
+
+		for (i = 0; i < G_N_ELEMENTS (entities_defs); i ++) {
+			keys[i] = (const guchar *)&entities_defs[i].code;
+			lens[i] = sizeof (entities_defs[i].code);
+		}
+
+		html_phash_build (&entities_num_hash, keys, lens,
+				G_N_ELEMENTS (entities_defs), FALSE);
 		entities_sorted = 1;
+
+		if (cpu_config != 0) {
+			for (i = 0; i < G_N_ELEMENTS (html_span_list); i ++) {
+				if (html_span_list[i].cpu_flags & cpu_config) {
+					html_span_impl = &html_span_list[i];
+					break;
+				}
+			}
+		}
 	}
+}
+
+gboolean
+add_html_node (struct rspamd_task *task,
+	rspamd_mempool_t * pool,
+	struct mime_text_part *part,
+	gchar *tag_text,
+	gsize tag_len,
+	gsize remain)
+{
+	struct html_node node;
+	struct html_content *hc;
+
+	rspamd_html_init ();
 
 	/* First call of this function */
-	if (part->html_nodes == NULL) {
-		/* Insert root node */
-		new = g_node_new (NULL);
-		*cur_level = new;
-		part->html_nodes = new;
-		rspamd_mempool_add_destructor (pool,
-			(rspamd_mempool_destruct_t) g_node_destroy,
-			part->html_nodes);
-		/* Call once again with root node */
-		return add_html_node (task,
-				   pool,
-				   part,
-				   tag_text,
-				   tag_len,
-				   remain,
-				   cur_level);
+	if (part->html == NULL) {
+		part->html = rspamd_mempool_alloc0 (pool, sizeof (struct html_content));
 	}
-	else {
-		new = construct_html_node (pool, tag_text, tag_len);
-		if (new == NULL) {
-			debug_task ("cannot construct HTML node for text '%*s'",
-				tag_len,
-				tag_text);
-			return FALSE;
-		}
-		data = new->data;
-		if (data->tag &&
-			(data->tag->id == Tag_A ||
-			data->tag->id == Tag_IMG) && ((data->flags & FL_CLOSING) == 0)) {
-			parse_tag_url (task, part, data->tag->id, tag_text, tag_len,
-				remain);
-		}
 
-		if (data->flags & FL_CLOSING) {
-			if (!*cur_level) {
-				debug_task ("bad parent node");
-				return FALSE;
-			}
-			g_node_append (*cur_level, new);
-			if (!check_balance (new, cur_level)) {
-				debug_task (
-					"mark part as unbalanced as it has not pairable closing tags");
-				part->flags &= ~RSPAMD_MIME_PART_FLAG_BALANCED;
+	hc = part->html;
+
+	if (!construct_html_node (&node, tag_text, tag_len)) {
+		debug_task ("cannot construct HTML node for text '%*s'",
+			tag_len,
+			tag_text);
+		return FALSE;
+	}
+
+	if (node.tag) {
+		if ((node.flags & FL_CLOSING) == 0) {
+			hc->tags_count[node.tag->id] ++;
+			hc->total_tags ++;
+
+			if (node.tag->id == Tag_A || node.tag->id == Tag_IMG) {
+				parse_tag_url (task, part, node.tag->id, tag_text, tag_len,
+					remain);
 			}
 		}
-		else if ((data->flags & (FL_XML|FL_SGML)) == 0) {
+	}
 
-			g_node_append (*cur_level, new);
-			if ((data->flags & FL_CLOSED) == 0) {
-				*cur_level = new;
-			}
-			/* Skip some tags */
-			if (data->tag && (data->tag->id == Tag_STYLE ||
-				data->tag->id == Tag_SCRIPT ||
-				data->tag->id == Tag_OBJECT ||
-				data->tag->id == Tag_TITLE)) {
-				return FALSE;
-			}
+	if (node.flags & FL_CLOSING) {
+		if (!check_balance (hc, node.tag->id)) {
+			debug_task (
+				"mark part as unbalanced as it has not pairable closing tags");
+			part->flags &= ~RSPAMD_MIME_PART_FLAG_BALANCED;
 		}
-		else {
-			/* Destroy ignored nodes */
-			g_node_destroy (new);
+	}
+	else if ((node.flags & (FL_XML|FL_SGML)) == 0) {
+		if ((node.flags & FL_CLOSED) == 0) {
+			html_push_tag (pool, hc, node.tag->id);
+		}
+		/* Skip some tags */
+		if (node.tag->id == Tag_STYLE ||
+			node.tag->id == Tag_SCRIPT ||
+			node.tag->id == Tag_OBJECT ||
+			node.tag->id == Tag_TITLE) {
+			return FALSE;
 		}
 	}
+	else if (node.flags & FL_XML) {
+		hc->flags |= RSPAMD_HTML_FLAG_XML;
+	}
+	else {
+		hc->flags |= RSPAMD_HTML_FLAG_SGML;
+	}
 
 	return TRUE;
 }
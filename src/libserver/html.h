@@ -206,25 +206,56 @@ struct html_node {
 	gint flags;
 };
 
+/* Part has XML declaration */
+#define RSPAMD_HTML_FLAG_XML (1 << 0)
+/* Part has SGML tags (e.g. doctype) */
+#define RSPAMD_HTML_FLAG_SGML (1 << 1)
+
+/*
+ * Summary of tags built while HTML part is being stripped
+ */
+struct html_content {
+	guint total_tags;
+	guint tags_count[N_TAGS];
+	gint flags;
+	/* Currently open tags used to check balance */
+	tag_id_t *stack;
+	guint depth;
+	guint stack_size;
+};
+
 /* Forwarded declaration */
 struct rspamd_task;
 
 /*
- * Add a single node to the tags tree
+ * Build perfect hashes of tags and entities tables and select the text
+ * scanner suitable for the CPU, it must be called before HTML parts are
+ * processed by several threads
+ */
+void rspamd_html_init (void);
+
+/*
+ * Process a single tag of HTML part, returns FALSE if the following text
+ * should not be treated as text content
  */
 gboolean add_html_node (struct rspamd_task *task,
 	rspamd_mempool_t *pool,
 	struct mime_text_part *part,
 	gchar *tag_text,
 	gsize tag_len,
-	gsize remain,
-	GNode **cur_level);
+	gsize remain);
 
 /*
- * Get tag structure by its name (binary search is used)
+ * Get tag structure by its name (perfect hash is used)
  */
 struct html_tag * get_tag_by_name (const gchar *name);
 
+/*
+ * Get length of plain text starting at p, the text ends at '<', '&', ';'
+ * or zero byte
+ */
+gsize rspamd_html_text_span (const guchar *p, gsize len);
+
 /*
  * Decode HTML entitles in text. Text is modified in place.
  */
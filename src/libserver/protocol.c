@@ -29,6 +29,7 @@
 #include "cfg_rcl.h"
 #include "message.h"
 #include "utlist.h"
+#include "scan_log.h"
 
 /* Max line size */
 #define OUTBUFSIZ BUFSIZ
@@ -63,6 +64,10 @@
  * Process this message as described above and return modified message
  */
 #define MSG_CMD_PROCESS "process"
+/*
+ * Check several framed messages passed in a single request
+ */
+#define MSG_CMD_BATCH "batch"
 
 /*
  * Learn specified statfile using message
@@ -98,6 +103,11 @@
 #define DELIVER_TO_HEADER "Deliver-To"
 #define NO_LOG_HEADER "Log"
 #define MLEN_HEADER "Message-Length"
+#define MSGPACK_HEADER "Msgpack"
+#define TRACE_HEADER "Trace"
+#define FILE_HEADER "File"
+#define FILE_OFFSET_HEADER "File-Offset"
+#define FILE_LENGTH_HEADER "File-Length"
 
 static GList *custom_commands = NULL;
 
@@ -173,6 +183,16 @@ rspamd_protocol_handle_url (struct rspamd_task *task,
 	}
 
 	switch (*p) {
+	case 'b':
+	case 'B':
+		/* batch */
+		if (g_ascii_strcasecmp (p + 1, MSG_CMD_BATCH + 1) == 0) {
+			task->cmd = CMD_BATCH;
+		}
+		else {
+			goto err;
+		}
+		break;
 	case 'c':
 	case 'C':
 		/* check */
@@ -249,13 +269,96 @@ err:
 	return FALSE;
 }
 
+struct rspamd_protocol_file_map {
+	gpointer map;
+	gsize len;
+};
+
+static void
+rspamd_protocol_file_unmap (gpointer p)
+{
+	struct rspamd_protocol_file_map *m = p;
+
+	munmap (m->map, m->len);
+}
+
+/*
+ * Map message from the spool file shared with MTA instead of reading it from
+ * the request's body
+ */
+static gboolean
+rspamd_protocol_map_file (struct rspamd_task *task, const gchar *fname,
+	gsize offset, gsize len)
+{
+	struct stat st;
+	struct rspamd_protocol_file_map *m;
+	gpointer map;
+	gsize page_off;
+	gint fd;
+
+	fd = open (fname, O_RDONLY);
+
+	if (fd == -1) {
+		msg_err ("cannot open spool file %s: %s", fname, strerror (errno));
+		return FALSE;
+	}
+
+	if (fstat (fd, &st) == -1 || !S_ISREG (st.st_mode)) {
+		msg_err ("cannot use spool file %s: not a regular file", fname);
+		close (fd);
+		return FALSE;
+	}
+
+	if (offset >= (gsize)st.st_size) {
+		msg_err ("invalid offset %z for spool file %s of size %z", offset,
+				fname, (gsize)st.st_size);
+		close (fd);
+		return FALSE;
+	}
+
+	if (len == 0) {
+		len = st.st_size - offset;
+	}
+	else if (len > st.st_size - offset) {
+		msg_err ("invalid length %z for spool file %s of size %z at offset %z",
+				len, fname, (gsize)st.st_size, offset);
+		close (fd);
+		return FALSE;
+	}
+
+	/* mmap offset must be aligned to a page boundary */
+	page_off = offset % getpagesize ();
+	map = mmap (NULL, len + page_off, PROT_READ, MAP_SHARED, fd,
+			offset - page_off);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		msg_err ("cannot mmap spool file %s: %s", fname, strerror (errno));
+		return FALSE;
+	}
+
+	m = rspamd_mempool_alloc (task->task_pool, sizeof (*m));
+	m->map = map;
+	m->len = len + page_off;
+	rspamd_mempool_add_destructor (task->task_pool, rspamd_protocol_file_unmap,
+			m);
+
+	task->msg.start = (const gchar *)map + page_off;
+	task->msg.len = len;
+	/* Spool file contains a message only */
+	task->flags &= ~RSPAMD_TASK_FLAG_HAS_CONTROL;
+	debug_task ("mapped %z bytes from spool file %s", len, fname);
+
+	return TRUE;
+}
+
 gboolean
 rspamd_protocol_handle_headers (struct rspamd_task *task,
 	struct rspamd_http_message *msg)
 {
-	gchar *headern, *tmp;
+	gchar *headern, *tmp, *fname = NULL;
 	gboolean res = TRUE, validh, fl, has_ip = FALSE;
-	gsize hlen;
+	gsize hlen, foffset = 0, flen = 0;
 	struct rspamd_http_header *h;
 
 	LL_FOREACH (msg->headers, h)
@@ -301,6 +404,19 @@ rspamd_protocol_handle_headers (struct rspamd_task *task,
 					validh = FALSE;
 				}
 			}
+			else if (hlen == sizeof (FILE_HEADER) - 1 &&
+					g_ascii_strncasecmp (headern, FILE_HEADER, hlen) == 0) {
+				fname = rspamd_protocol_header_dup (task, h->value);
+				debug_task ("read file header, value: %s", fname);
+			}
+			else if (hlen == sizeof (FILE_OFFSET_HEADER) - 1 &&
+					g_ascii_strncasecmp (headern, FILE_OFFSET_HEADER, hlen) == 0) {
+				foffset = strtoul (h->value->str, NULL, 10);
+			}
+			else if (hlen == sizeof (FILE_LENGTH_HEADER) - 1 &&
+					g_ascii_strncasecmp (headern, FILE_LENGTH_HEADER, hlen) == 0) {
+				flen = strtoul (h->value->str, NULL, 10);
+			}
 			else {
 				debug_task ("wrong header: %v", h->value);
 				validh = FALSE;
@@ -352,8 +468,10 @@ rspamd_protocol_handle_headers (struct rspamd_task *task,
 		case 'I':
 			if (g_ascii_strncasecmp (headern, IP_ADDR_HEADER, hlen) == 0) {
 				tmp = rspamd_protocol_header_dup (task, h->value);
+				task->from_addr = rspamd_parse_inet_address_pool (tmp,
+						task->task_pool);
 
-				if (!rspamd_parse_inet_address (&task->from_addr, tmp)) {
+				if (task->from_addr == NULL) {
 					msg_err ("bad ip header: '%s'", tmp);
 					return FALSE;
 				}
@@ -428,6 +546,27 @@ rspamd_protocol_handle_headers (struct rspamd_task *task,
 					task->flags |= RSPAMD_TASK_FLAG_HAS_CONTROL;
 				}
 			}
+			else if (g_ascii_strncasecmp (headern, MSGPACK_HEADER, hlen) == 0) {
+				fl = rspamd_config_parse_flag (h->value->str, h->value->len);
+				if (fl) {
+					task->flags |= RSPAMD_TASK_FLAG_MSGPACK;
+				}
+				else {
+					task->flags &= ~RSPAMD_TASK_FLAG_MSGPACK;
+				}
+			}
+			else {
+				validh = FALSE;
+			}
+			break;
+		case 't':
+		case 'T':
+			if (g_ascii_strncasecmp (headern, TRACE_HEADER, hlen) == 0) {
+				fl = rspamd_config_parse_flag (h->value->str, h->value->len);
+				if (fl) {
+					task->flags |= RSPAMD_TASK_FLAG_TRACE;
+				}
+			}
 			else {
 				validh = FALSE;
 			}
@@ -451,6 +590,23 @@ rspamd_protocol_handle_headers (struct rspamd_task *task,
 		return FALSE;
 	}
 
+	if (fname != NULL) {
+		if (!task->cfg->allow_spool_files) {
+			msg_warn ("ignore spool file %s as spool files are not allowed",
+					fname);
+		}
+		else if (!rspamd_protocol_map_file (task, fname, foffset, flen)) {
+			if (task->msg.len > 0) {
+				msg_warn ("cannot map spool file %s, use request body instead",
+						fname);
+			}
+			else {
+				task->last_error = "cannot map spool file";
+				task->error_code = RSPAMD_PROTOCOL_ERROR;
+			}
+		}
+	}
+
 	if (task->hostname == NULL || task->hostname[0] == '\0') {
 		/* We assume that hostname is either "unknown" or existing */
 		task->hostname = rspamd_mempool_strdup (task->task_pool, "unknown");
@@ -568,6 +724,124 @@ rspamd_protocol_handle_control (struct rspamd_task *task,
 	return TRUE;
 }
 
+gboolean
+rspamd_protocol_is_binary_control (const gchar *data, gsize len)
+{
+	return len >= sizeof (RSPAMD_PROTOCOL_BIN_MAGIC) - 1 &&
+			memcmp (data, RSPAMD_PROTOCOL_BIN_MAGIC,
+					sizeof (RSPAMD_PROTOCOL_BIN_MAGIC) - 1) == 0;
+}
+
+gboolean
+rspamd_protocol_handle_binary_control (struct rspamd_task *task,
+		const gchar *data, gsize len)
+{
+	const guchar *p, *end;
+	guint id, flen;
+	guint32 fl;
+	gchar *val;
+
+	if (!rspamd_protocol_is_binary_control (data, len)) {
+		return FALSE;
+	}
+
+	p = (const guchar *)data + sizeof (RSPAMD_PROTOCOL_BIN_MAGIC) - 1;
+	end = (const guchar *)data + len;
+
+	while (p < end) {
+		if (end - p < 3) {
+			msg_warn ("truncated binary control field");
+			return FALSE;
+		}
+
+		id = p[0];
+		flen = ((guint)p[1] << 8) | p[2];
+		p += 3;
+
+		if ((gsize)(end - p) < flen) {
+			msg_warn ("binary control field %ud is too long: %ud", id, flen);
+			return FALSE;
+		}
+
+		if (id == RSPAMD_PROTOCOL_BIN_FLAGS) {
+			if (flen != sizeof (fl)) {
+				msg_warn ("bad binary control flags length: %ud", flen);
+				return FALSE;
+			}
+
+			fl = ((guint32)p[0] << 24) | ((guint32)p[1] << 16) |
+					((guint32)p[2] << 8) | p[3];
+			BOOL_TO_FLAG (fl & RSPAMD_PROTOCOL_BIN_FLAG_PASS_ALL, task->flags,
+					RSPAMD_TASK_FLAG_PASS_ALL);
+			BOOL_TO_FLAG (fl & RSPAMD_PROTOCOL_BIN_FLAG_NO_LOG, task->flags,
+					RSPAMD_TASK_FLAG_NO_LOG);
+			BOOL_TO_FLAG (fl & RSPAMD_PROTOCOL_BIN_FLAG_EXT_URLS, task->flags,
+					RSPAMD_TASK_FLAG_EXT_URLS);
+			BOOL_TO_FLAG (fl & RSPAMD_PROTOCOL_BIN_FLAG_MSGPACK, task->flags,
+					RSPAMD_TASK_FLAG_MSGPACK);
+			p += flen;
+			continue;
+		}
+
+		if (flen == 0) {
+			continue;
+		}
+
+		val = rspamd_mempool_alloc (task->task_pool, flen + 1);
+		rspamd_strlcpy (val, (const gchar *)p, flen + 1);
+
+		switch (id) {
+		case RSPAMD_PROTOCOL_BIN_IP:
+			task->from_addr = rspamd_parse_inet_address_pool (val,
+					task->task_pool);
+
+			if (task->from_addr == NULL) {
+				msg_err ("bad ip field: '%s'", val);
+				return FALSE;
+			}
+			task->flags &= ~RSPAMD_TASK_FLAG_NO_IP;
+			break;
+		case RSPAMD_PROTOCOL_BIN_HELO:
+			task->helo = val;
+			break;
+		case RSPAMD_PROTOCOL_BIN_FROM:
+			if (!rspamd_task_add_sender (task, val)) {
+				msg_err ("bad from field: '%s'", val);
+			}
+			break;
+		case RSPAMD_PROTOCOL_BIN_RCPT:
+			if (!rspamd_task_add_recipient (task, val)) {
+				msg_err ("bad rcpt field: '%s'", val);
+			}
+			break;
+		case RSPAMD_PROTOCOL_BIN_USER:
+			task->user = val;
+			break;
+		case RSPAMD_PROTOCOL_BIN_SETTINGS_ID:
+			g_hash_table_replace (task->request_headers,
+					g_string_new ("Settings-ID"),
+					g_string_new_len (val, flen));
+			break;
+		case RSPAMD_PROTOCOL_BIN_QUEUE_ID:
+			task->queue_id = val;
+			break;
+		case RSPAMD_PROTOCOL_BIN_HOSTNAME:
+			task->hostname = val;
+			break;
+		case RSPAMD_PROTOCOL_BIN_DELIVER_TO:
+			task->deliver_to = val;
+			break;
+		default:
+			debug_task ("unknown binary control field: %ud", id);
+			break;
+		}
+
+		p += flen;
+	}
+
+	return TRUE;
+}
+
 gboolean
 rspamd_protocol_handle_request (struct rspamd_task *task,
 	struct rspamd_http_message *msg)
@@ -595,6 +869,53 @@ rspamd_protocol_handle_request (struct rspamd_task *task,
 	return ret;
 }
 
+gboolean
+rspamd_protocol_parse_batch (const gchar *start, gsize len, GArray *frames)
+{
+	struct rspamd_protocol_batch_frame frame;
+	const gchar *p, *end;
+	gsize flen;
+
+	p = start;
+	end = p + len;
+
+	while (p < end) {
+		flen = 0;
+
+		if (!g_ascii_isdigit (*p)) {
+			return FALSE;
+		}
+
+		while (p < end && g_ascii_isdigit (*p)) {
+			flen = flen * 10 + (*p - '0');
+
+			if (flen > len) {
+				return FALSE;
+			}
+			p++;
+		}
+
+		if (p < end && *p == '\r') {
+			p++;
+		}
+		if (p >= end || *p != '\n') {
+			return FALSE;
+		}
+		p++;
+
+		if (flen == 0 || flen > (gsize)(end - p)) {
+			return FALSE;
+		}
+
+		frame.start = p;
+		frame.len = flen;
+		g_array_append_val (frames, frame);
+		p += flen;
+	}
+
+	return frames->len > 0;
+}
+
 static void
 write_hashes_to_log (struct rspamd_task *task, GString *logbuf)
 {
@@ -606,20 +927,44 @@ write_hashes_to_log (struct rspamd_task *task, GString *logbuf)
 	while (cur) {
 		text_part = cur->data;
 		if (text_part->fuzzy) {
+			g_string_append_len (logbuf, " part: ", sizeof (" part: ") - 1);
+			rspamd_gstring_append_hex (logbuf, text_part->fuzzy->h, TRUE);
+
 			if (cur->next != NULL) {
-				rspamd_printf_gstring (logbuf,
-					" part: %Xd,",
-					text_part->fuzzy->h);
-			}
-			else {
-				rspamd_printf_gstring (logbuf, " part: %Xd",
-					text_part->fuzzy->h);
+				g_string_append_c (logbuf, ',');
 			}
 		}
 		cur = g_list_next (cur);
 	}
 }
 
+static void
+rspamd_protocol_log_header (struct rspamd_task *task, GString *logbuf)
+{
+	if (logbuf != NULL) {
+		rspamd_printf_gstring (logbuf,
+				"id: <%s>, qid: <%s>, ",
+				task->message_id,
+				task->queue_id);
+
+		if (task->user) {
+			rspamd_printf_gstring (logbuf, "user: %s, ", task->user);
+		}
+	}
+}
+
+static void
+rspamd_protocol_log_url (struct rspamd_task *task, struct rspamd_url *url)
+{
+	if (task->cfg->log_urls) {
+		msg_info ("<%s> URL: %s - %s: %s",
+			task->message_id,
+			task->user ?
+			task->user : "unknown",
+			rspamd_inet_address_to_string (task->from_addr),
+			struri (url));
+	}
+}
 
 /* Structure for writing tree data */
 struct tree_cb_data {
@@ -660,15 +1005,7 @@ urls_protocol_cb (gpointer key, gpointer value, gpointer ud)
 		ucl_object_insert_key (obj, elt, "phished", 0, false);
 	}
 	ucl_array_append (cb->top, obj);
-
-	if (cb->task->cfg->log_urls) {
-		msg_info ("<%s> URL: %s - %s: %s",
-			cb->task->message_id,
-			cb->task->user ?
-			cb->task->user : "unknown",
-			rspamd_inet_address_to_string (cb->task->from_addr),
-			struri (url));
-	}
+	rspamd_protocol_log_url (cb->task, url);
 }
 
 static ucl_object_t *
@@ -777,7 +1114,8 @@ rspamd_metric_symbol_ucl (struct rspamd_task *task, struct metric *m,
 	const gchar *description = NULL;
 
 	if (logbuf != NULL) {
-		rspamd_printf_gstring (logbuf, "%s,", sym->name);
+		g_string_append (logbuf, sym->name);
+		g_string_append_c (logbuf, ',');
 	}
 
 	description = g_hash_table_lookup (m->descriptions, sym->name);
@@ -799,20 +1137,19 @@ rspamd_metric_symbol_ucl (struct rspamd_task *task, struct metric *m,
 	return obj;
 }
 
-static ucl_object_t *
-rspamd_metric_result_ucl (struct rspamd_task *task,
+/*
+ * Check action of the metric result and start its log entry
+ */
+static enum rspamd_metric_action
+rspamd_metric_result_action (struct rspamd_task *task,
 	struct metric_result *mres,
+	double *preq_score,
 	GString *logbuf)
 {
-	GHashTableIter hiter;
-	struct symbol *sym;
 	struct metric *m;
 	gboolean is_spam;
 	enum rspamd_metric_action action = METRIC_ACTION_NOACTION;
-	ucl_object_t *obj = NULL, *sobj;;
-	gpointer h, v;
 	double required_score;
-	const gchar *subject;
 	gchar action_char;
 
 	m = mres->metric;
@@ -845,6 +1182,51 @@ rspamd_metric_result_ucl (struct rspamd_task *task,
 				mres->score, required_score);
 	}
 
+	*preq_score = required_score;
+
+	return action;
+}
+
+static void
+rspamd_metric_result_log_tail (struct rspamd_task *task, GString *logbuf)
+{
+	if (logbuf != NULL) {
+		/* Cut the trailing comma if needed */
+		if (logbuf->str[logbuf->len - 1] == ',') {
+			logbuf->len--;
+		}
+
+		rspamd_printf_gstring (logbuf, "]), len: %z, time: %s, dns req: %d, "
+				"mem: %Hz,",
+				task->msg.len,
+				calculate_check_time (task->time_real,
+						task->time_virtual,
+						task->cfg->clock_res,
+						&task->scan_milliseconds),
+				task->dns_requests,
+				rspamd_task_memory_used (task));
+	}
+}
+
+static ucl_object_t *
+rspamd_metric_result_ucl (struct rspamd_task *task,
+	struct metric_result *mres,
+	GString *logbuf)
+{
+	GHashTableIter hiter;
+	struct symbol *sym;
+	struct metric *m;
+	gboolean is_spam;
+	enum rspamd_metric_action action;
+	ucl_object_t *obj = NULL, *sobj;
+	gpointer h, v;
+	double required_score;
+	const gchar *subject;
+
+	m = mres->metric;
+	action = rspamd_metric_result_action (task, mres, &required_score, logbuf);
+	is_spam = (action == METRIC_ACTION_REJECT);
+
 	obj = ucl_object_typed_new (UCL_OBJECT);
 	ucl_object_insert_key (obj,	  ucl_object_frombool (is_spam),
 		"is_spam", 0, false);
@@ -871,61 +1253,496 @@ rspamd_metric_result_ucl (struct rspamd_task *task,
 		ucl_object_insert_key (obj, sobj, h, 0, false);
 	}
 
-	if (logbuf != NULL) {
-		/* Cut the trailing comma if needed */
-		if (logbuf->str[logbuf->len - 1] == ',') {
-			logbuf->len--;
-		}
-
-		rspamd_printf_gstring (logbuf, "]), len: %z, time: %s, dns req: %d,",
-				task->msg.len,
-				calculate_check_time (task->time_real,
-						task->time_virtual,
-						task->cfg->clock_res,
-						&task->scan_milliseconds),
-				task->dns_requests);
-	}
+	rspamd_metric_result_log_tail (task, logbuf);
 
 	return obj;
 }
 
+/*
+ * Streaming emitter of scan results: JSON or msgpack is written directly to
+ * the reply buffer without building an intermediate ucl object
+ */
+struct rspamd_protocol_emitter {
+	GString *out;
+	gboolean msgpack;
+	/* JSON only: the next element must be preceded by a comma */
+	gboolean need_comma;
+};
+
 static void
-rspamd_ucl_torspamc_output (struct rspamd_task *task,
-	ucl_object_t *top,
-	GString *out)
+rspamd_protocol_emit_msgpack_hdr (GString *out, guint len, guchar fix,
+	guint fixmax, guchar t8, guchar t16, guchar t32)
 {
-	const ucl_object_t *metric, *score,
-	*required_score, *is_spam, *elt, *cur;
-	ucl_object_iter_t iter = NULL;
+	guchar buf[5];
 
-	metric = ucl_object_find_key (top, DEFAULT_METRIC);
-	if (metric != NULL) {
-		score = ucl_object_find_key (metric, "score");
-		required_score = ucl_object_find_key (metric, "required_score");
-		is_spam = ucl_object_find_key (metric, "is_spam");
-		g_string_append_printf (out,
-			"Metric: default; %s; %.2f / %.2f / 0.0\r\n",
-			ucl_object_toboolean (is_spam) ? "True" : "False",
-			ucl_object_todouble (score),
-			ucl_object_todouble (required_score));
-		elt = ucl_object_find_key (metric, "action");
-		if (elt != NULL) {
-			g_string_append_printf (out, "Action: %s\r\n",
-				ucl_object_tostring (elt));
-		}
+	if (len <= fixmax) {
+		g_string_append_c (out, fix | len);
+	}
+	else if (t8 != 0 && len <= G_MAXUINT8) {
+		buf[0] = t8;
+		buf[1] = len;
+		g_string_append_len (out, (const gchar *)buf, 2);
+	}
+	else if (len <= G_MAXUINT16) {
+		buf[0] = t16;
+		buf[1] = (len >> 8) & 0xff;
+		buf[2] = len & 0xff;
+		g_string_append_len (out, (const gchar *)buf, 3);
+	}
+	else {
+		buf[0] = t32;
+		buf[1] = (len >> 24) & 0xff;
+		buf[2] = (len >> 16) & 0xff;
+		buf[3] = (len >> 8) & 0xff;
+		buf[4] = len & 0xff;
+		g_string_append_len (out, (const gchar *)buf, 5);
+	}
+}
 
-		iter = NULL;
-		while ((elt = ucl_iterate_object (metric, &iter, true)) != NULL) {
-			if (elt->type == UCL_OBJECT) {
-				const ucl_object_t *sym_score;
-				sym_score = ucl_object_find_key (elt, "score");
-				g_string_append_printf (out, "Symbol: %s(%.2f)\r\n",
-					ucl_object_key (elt),
-					ucl_object_todouble (sym_score));
-			}
+static void
+rspamd_protocol_emit_sep (struct rspamd_protocol_emitter *e)
+{
+	if (!e->msgpack) {
+		if (e->need_comma) {
+			g_string_append_c (e->out, ',');
 		}
 
-		elt = ucl_object_find_key (metric, "subject");
+		e->need_comma = TRUE;
+	}
+}
+
+static void
+rspamd_protocol_emit_json_string (GString *out, const gchar *str, gsize len)
+{
+	const guchar *p = (const guchar *)str, *end = p + len, *c = p;
+
+	g_string_append_c (out, '"');
+
+	while (p < end) {
+		if (*p < 0x20 || *p == '"' || *p == '\\') {
+			g_string_append_len (out, (const gchar *)c, p - c);
+
+			switch (*p) {
+			case '\n':
+				g_string_append_len (out, "\\n", 2);
+				break;
+			case '\r':
+				g_string_append_len (out, "\\r", 2);
+				break;
+			case '\t':
+				g_string_append_len (out, "\\t", 2);
+				break;
+			case '\b':
+				g_string_append_len (out, "\\b", 2);
+				break;
+			case '\f':
+				g_string_append_len (out, "\\f", 2);
+				break;
+			case '"':
+				g_string_append_len (out, "\\\"", 2);
+				break;
+			case '\\':
+				g_string_append_len (out, "\\\\", 2);
+				break;
+			default:
+				g_string_append_printf (out, "\\u%04x", (guint)*p);
+				break;
+			}
+
+			c = p + 1;
+		}
+
+		p ++;
+	}
+
+	g_string_append_len (out, (const gchar *)c, p - c);
+	g_string_append_c (out, '"');
+}
+
+static void
+rspamd_protocol_emit_string (struct rspamd_protocol_emitter *e,
+	const gchar *str, gsize len)
+{
+	rspamd_protocol_emit_sep (e);
+
+	if (e->msgpack) {
+		rspamd_protocol_emit_msgpack_hdr (e->out, len, 0xa0, 31,
+				0xd9, 0xda, 0xdb);
+		g_string_append_len (e->out, str, len);
+	}
+	else {
+		rspamd_protocol_emit_json_string (e->out, str, len);
+	}
+}
+
+static void
+rspamd_protocol_emit_key (struct rspamd_protocol_emitter *e, const gchar *key)
+{
+	rspamd_protocol_emit_string (e, key, strlen (key));
+
+	if (!e->msgpack) {
+		g_string_append_c (e->out, ':');
+		e->need_comma = FALSE;
+	}
+}
+
+static void
+rspamd_protocol_emit_double (struct rspamd_protocol_emitter *e, gdouble val)
+{
+	gchar numbuf[G_ASCII_DTOSTR_BUF_SIZE];
+	guchar buf[9];
+	guint64 bits;
+	guint i;
+
+	rspamd_protocol_emit_sep (e);
+
+	if (e->msgpack) {
+		memcpy (&bits, &val, sizeof (bits));
+		buf[0] = 0xcb;
+
+		for (i = 0; i < 8; i ++) {
+			buf[i + 1] = (bits >> (56 - i * 8)) & 0xff;
+		}
+
+		g_string_append_len (e->out, (const gchar *)buf, sizeof (buf));
+	}
+	else {
+		/* Same as ucl emits doubles: integral values have a single decimal */
+		g_ascii_formatd (numbuf, sizeof (numbuf),
+				val == (gdouble)(gint64)val ? "%.1f" : "%.15g", val);
+		g_string_append (e->out, numbuf);
+	}
+}
+
+static void
+rspamd_protocol_emit_bool (struct rspamd_protocol_emitter *e, gboolean val)
+{
+	rspamd_protocol_emit_sep (e);
+
+	if (e->msgpack) {
+		g_string_append_c (e->out, val ? 0xc3 : 0xc2);
+	}
+	else {
+		g_string_append (e->out, val ? "true" : "false");
+	}
+}
+
+static void
+rspamd_protocol_emit_start (struct rspamd_protocol_emitter *e, guint nelts,
+	gboolean is_array)
+{
+	rspamd_protocol_emit_sep (e);
+
+	if (e->msgpack) {
+		if (is_array) {
+			rspamd_protocol_emit_msgpack_hdr (e->out, nelts, 0x90, 15,
+					0, 0xdc, 0xdd);
+		}
+		else {
+			rspamd_protocol_emit_msgpack_hdr (e->out, nelts, 0x80, 15,
+					0, 0xde, 0xdf);
+		}
+	}
+	else {
+		g_string_append_c (e->out, is_array ? '[' : '{');
+		e->need_comma = FALSE;
+	}
+}
+
+static void
+rspamd_protocol_emit_end (struct rspamd_protocol_emitter *e,
+	gboolean is_array)
+{
+	if (!e->msgpack) {
+		g_string_append_c (e->out, is_array ? ']' : '}');
+		e->need_comma = TRUE;
+	}
+}
+
+static void
+rspamd_protocol_emit_str_list (struct rspamd_protocol_emitter *e,
+	GList *str_list)
+{
+	GList *cur;
+
+	rspamd_protocol_emit_start (e, g_list_length (str_list), TRUE);
+
+	for (cur = str_list; cur != NULL; cur = g_list_next (cur)) {
+		rspamd_protocol_emit_string (e, cur->data, strlen (cur->data));
+	}
+
+	rspamd_protocol_emit_end (e, TRUE);
+}
+
+static void
+rspamd_protocol_emit_symbol (struct rspamd_protocol_emitter *e,
+	struct rspamd_task *task, struct metric *m,
+	struct symbol *sym, GString *logbuf)
+{
+	const gchar *description = NULL;
+	guint nkeys = 2;
+
+	if (logbuf != NULL) {
+		g_string_append (logbuf, sym->name);
+		g_string_append_c (logbuf, ',');
+	}
+
+	description = g_hash_table_lookup (m->descriptions, sym->name);
+
+	if (description) {
+		nkeys ++;
+	}
+	if (sym->options != NULL) {
+		nkeys ++;
+	}
+
+	rspamd_protocol_emit_key (e, sym->name);
+	rspamd_protocol_emit_start (e, nkeys, FALSE);
+	rspamd_protocol_emit_key (e, "name");
+	rspamd_protocol_emit_string (e, sym->name, strlen (sym->name));
+	rspamd_protocol_emit_key (e, "score");
+	rspamd_protocol_emit_double (e, sym->score);
+
+	if (description) {
+		rspamd_protocol_emit_key (e, "description");
+		rspamd_protocol_emit_string (e, description, strlen (description));
+	}
+	if (sym->options != NULL) {
+		rspamd_protocol_emit_key (e, "options");
+		rspamd_protocol_emit_str_list (e, sym->options);
+	}
+
+	rspamd_protocol_emit_end (e, FALSE);
+}
+
+static void
+rspamd_protocol_emit_metric_result (struct rspamd_protocol_emitter *e,
+	struct rspamd_task *task,
+	struct metric_result *mres,
+	GString *logbuf)
+{
+	GHashTableIter hiter;
+	struct metric *m;
+	enum rspamd_metric_action action;
+	gpointer h, v;
+	double required_score;
+	const gchar *subject = NULL;
+	guint nkeys = 5;
+
+	m = mres->metric;
+	action = rspamd_metric_result_action (task, mres, &required_score, logbuf);
+
+	if (action == METRIC_ACTION_REWRITE_SUBJECT) {
+		subject = make_rewritten_subject (m, task);
+
+		if (subject != NULL) {
+			nkeys ++;
+		}
+	}
+
+	nkeys += g_hash_table_size (mres->symbols);
+	rspamd_protocol_emit_key (e, m->name);
+	rspamd_protocol_emit_start (e, nkeys, FALSE);
+	rspamd_protocol_emit_key (e, "is_spam");
+	rspamd_protocol_emit_bool (e, action == METRIC_ACTION_REJECT);
+	rspamd_protocol_emit_key (e, "is_skipped");
+	rspamd_protocol_emit_bool (e, RSPAMD_TASK_IS_SKIPPED (task));
+	rspamd_protocol_emit_key (e, "score");
+	rspamd_protocol_emit_double (e, mres->score);
+	rspamd_protocol_emit_key (e, "required_score");
+	rspamd_protocol_emit_double (e, required_score);
+	rspamd_protocol_emit_key (e, "action");
+	rspamd_protocol_emit_string (e, rspamd_action_to_str (action),
+			strlen (rspamd_action_to_str (action)));
+
+	if (subject != NULL) {
+		rspamd_protocol_emit_key (e, "subject");
+		rspamd_protocol_emit_string (e, subject, strlen (subject));
+	}
+
+	g_hash_table_iter_init (&hiter, mres->symbols);
+	while (g_hash_table_iter_next (&hiter, &h, &v)) {
+		rspamd_protocol_emit_symbol (e, task, m, (struct symbol *)v, logbuf);
+	}
+
+	rspamd_protocol_emit_end (e, FALSE);
+	rspamd_metric_result_log_tail (task, logbuf);
+}
+
+static void
+rspamd_protocol_emit_url (struct rspamd_protocol_emitter *e,
+	struct rspamd_task *task, struct rspamd_url *url)
+{
+	guint nkeys = 2;
+
+	if (!(task->flags & RSPAMD_TASK_FLAG_EXT_URLS)) {
+		rspamd_protocol_emit_string (e, url->host, url->hostlen);
+	}
+	else {
+		if (url->hostlen > 0) {
+			nkeys ++;
+		}
+		if (url->surbllen > 0) {
+			nkeys ++;
+		}
+
+		rspamd_protocol_emit_start (e, nkeys, FALSE);
+		rspamd_protocol_emit_key (e, "url");
+		rspamd_protocol_emit_string (e, url->string, strlen (url->string));
+
+		if (url->hostlen > 0) {
+			rspamd_protocol_emit_key (e, "host");
+			rspamd_protocol_emit_string (e, url->host, url->hostlen);
+		}
+		if (url->surbllen > 0) {
+			rspamd_protocol_emit_key (e, "surbl");
+			rspamd_protocol_emit_string (e, url->surbl, url->surbllen);
+		}
+
+		rspamd_protocol_emit_key (e, "phished");
+		rspamd_protocol_emit_bool (e, url->is_phished);
+		rspamd_protocol_emit_end (e, FALSE);
+	}
+
+	rspamd_protocol_log_url (task, url);
+}
+
+static void
+rspamd_protocol_emit_result (struct rspamd_task *task, GString *out,
+	GString *logbuf, gboolean msgpack)
+{
+	struct rspamd_protocol_emitter e;
+	struct rspamd_url *url;
+	GHashTableIter hiter;
+	gpointer h, v;
+	guint nkeys;
+
+	e.out = out;
+	e.msgpack = msgpack;
+	e.need_comma = FALSE;
+
+	rspamd_protocol_log_header (task, logbuf);
+
+	nkeys = g_hash_table_size (task->results);
+	if (task->messages != NULL) {
+		nkeys ++;
+	}
+	if (g_hash_table_size (task->urls) > 0) {
+		nkeys ++;
+	}
+	if (g_hash_table_size (task->emails) > 0) {
+		nkeys ++;
+	}
+	if (task->message_id != NULL) {
+		nkeys ++;
+	}
+
+	rspamd_protocol_emit_start (&e, nkeys, FALSE);
+
+	g_hash_table_iter_init (&hiter, task->results);
+	while (g_hash_table_iter_next (&hiter, &h, &v)) {
+		rspamd_protocol_emit_metric_result (&e, task,
+				(struct metric_result *)v, logbuf);
+	}
+
+	if (task->messages != NULL) {
+		rspamd_protocol_emit_key (&e, "messages");
+		rspamd_protocol_emit_str_list (&e, task->messages);
+	}
+	if (g_hash_table_size (task->urls) > 0) {
+		rspamd_protocol_emit_key (&e, "urls");
+		rspamd_protocol_emit_start (&e, g_hash_table_size (task->urls), TRUE);
+		g_hash_table_iter_init (&hiter, task->urls);
+
+		while (g_hash_table_iter_next (&hiter, &h, &v)) {
+			rspamd_protocol_emit_url (&e, task, v);
+		}
+
+		rspamd_protocol_emit_end (&e, TRUE);
+	}
+	if (g_hash_table_size (task->emails) > 0) {
+		rspamd_protocol_emit_key (&e, "emails");
+		rspamd_protocol_emit_start (&e, g_hash_table_size (task->emails), TRUE);
+		g_hash_table_iter_init (&hiter, task->emails);
+
+		while (g_hash_table_iter_next (&hiter, &h, &v)) {
+			url = v;
+			rspamd_protocol_emit_string (&e, url->user,
+					url->userlen + url->hostlen + 1);
+		}
+
+		rspamd_protocol_emit_end (&e, TRUE);
+	}
+	if (task->message_id != NULL) {
+		rspamd_protocol_emit_key (&e, "message-id");
+		rspamd_protocol_emit_string (&e, task->message_id,
+				strlen (task->message_id));
+	}
+
+	rspamd_protocol_emit_end (&e, FALSE);
+
+	if (logbuf != NULL) {
+		write_hashes_to_log (task, logbuf);
+	}
+}
+
+static void
+rspamd_protocol_emit_error (struct rspamd_task *task, GString *out,
+	gboolean msgpack)
+{
+	struct rspamd_protocol_emitter e;
+	const gchar *err = task->last_error ? task->last_error : "unknown error";
+
+	e.out = out;
+	e.msgpack = msgpack;
+	e.need_comma = FALSE;
+
+	rspamd_protocol_emit_start (&e, 1, FALSE);
+	rspamd_protocol_emit_key (&e, "error");
+	rspamd_protocol_emit_string (&e, err, strlen (err));
+	rspamd_protocol_emit_end (&e, FALSE);
+}
+
+static void
+rspamd_ucl_torspamc_output (struct rspamd_task *task,
+	ucl_object_t *top,
+	GString *out)
+{
+	const ucl_object_t *metric, *score,
+	*required_score, *is_spam, *elt, *cur;
+	ucl_object_iter_t iter = NULL;
+
+	metric = ucl_object_find_key (top, DEFAULT_METRIC);
+	if (metric != NULL) {
+		score = ucl_object_find_key (metric, "score");
+		required_score = ucl_object_find_key (metric, "required_score");
+		is_spam = ucl_object_find_key (metric, "is_spam");
+		g_string_append_printf (out,
+			"Metric: default; %s; %.2f / %.2f / 0.0\r\n",
+			ucl_object_toboolean (is_spam) ? "True" : "False",
+			ucl_object_todouble (score),
+			ucl_object_todouble (required_score));
+		elt = ucl_object_find_key (metric, "action");
+		if (elt != NULL) {
+			g_string_append_printf (out, "Action: %s\r\n",
+				ucl_object_tostring (elt));
+		}
+
+		iter = NULL;
+		while ((elt = ucl_iterate_object (metric, &iter, true)) != NULL) {
+			if (elt->type == UCL_OBJECT) {
+				const ucl_object_t *sym_score;
+				sym_score = ucl_object_find_key (elt, "score");
+				g_string_append_len (out, "Symbol: ", sizeof ("Symbol: ") - 1);
+				g_string_append (out, ucl_object_key (elt));
+				g_string_append_c (out, '(');
+				rspamd_gstring_append_double (out,
+						ucl_object_todouble (sym_score), 2);
+				g_string_append_len (out, ")" CRLF, sizeof (")" CRLF) - 1);
+			}
+		}
+
+		elt = ucl_object_find_key (metric, "subject");
 		if (elt != NULL) {
 			g_string_append_printf (out, "Subject: %s\r\n",
 				ucl_object_tostring (elt));
@@ -968,8 +1785,8 @@ rspamd_ucl_tospamc_output (struct rspamd_task *task,
 
 		while ((elt = ucl_iterate_object (metric, &iter, true)) != NULL) {
 			if (elt->type == UCL_OBJECT) {
-				g_string_append_printf (out, "%s,",
-					ucl_object_key (elt));
+				g_string_append (out, ucl_object_key (elt));
+				g_string_append_c (out, ',');
 			}
 		}
 		/* Ugly hack, but the whole spamc is ugly */
@@ -980,6 +1797,33 @@ rspamd_ucl_tospamc_output (struct rspamd_task *task,
 	}
 }
 
+static ucl_object_t *
+rspamd_protocol_limits_ucl (struct rspamd_task *task)
+{
+	ucl_object_t *obj;
+	struct mime_part *part;
+	GList *cur;
+	guint hashed = 0;
+
+	for (cur = task->parts; cur != NULL; cur = g_list_next (cur)) {
+		part = cur->data;
+
+		if (part->checksum != NULL) {
+			hashed ++;
+		}
+	}
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromint (task->msg.len),
+			"message_size", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (task->cfg->large_scan_size),
+			"scan_size", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (hashed),
+			"hashed_parts", 0, false);
+
+	return obj;
+}
+
 ucl_object_t *
 rspamd_protocol_write_ucl (struct rspamd_task *task, GString *logbuf)
 {
@@ -988,16 +1832,7 @@ rspamd_protocol_write_ucl (struct rspamd_task *task, GString *logbuf)
 	GHashTableIter hiter;
 	gpointer h, v;
 
-	if (logbuf != NULL) {
-		rspamd_printf_gstring (logbuf,
-				"id: <%s>, qid: <%s>, ",
-				task->message_id,
-				task->queue_id);
-
-		if (task->user) {
-			rspamd_printf_gstring (logbuf, "user: %s, ", task->user);
-		}
-	}
+	rspamd_protocol_log_header (task, logbuf);
 
 	g_hash_table_iter_init (&hiter, task->results);
 	top = ucl_object_typed_new (UCL_OBJECT);
@@ -1021,6 +1856,11 @@ rspamd_protocol_write_ucl (struct rspamd_task *task, GString *logbuf)
 				"emails", 0, false);
 	}
 
+	if (task->flags & RSPAMD_TASK_FLAG_LARGE) {
+		ucl_object_insert_key (top, rspamd_protocol_limits_ucl (task),
+				"limits", 0, false);
+	}
+
 	ucl_object_insert_key (top, ucl_object_fromstring (task->message_id),
 			"message-id", 0, false);
 
@@ -1031,20 +1871,72 @@ rspamd_protocol_write_ucl (struct rspamd_task *task, GString *logbuf)
 	return top;
 }
 
-void
-rspamd_protocol_http_reply (struct rspamd_http_message *msg,
-	struct rspamd_task *task)
+/*
+ * Log the scan result, update history and statistics
+ */
+static void
+rspamd_protocol_result_done (struct rspamd_task *task, GString *logbuf)
 {
-	GString *logbuf;
 	struct metric_result *metric_res;
-	GHashTableIter hiter;
-	gpointer h, v;
-	ucl_object_t *top = NULL;
 	gdouble required_score;
 	gint action;
 
+	if (!(task->flags & RSPAMD_TASK_FLAG_NO_LOG)) {
+		rspamd_roll_history_update (task->worker->srv->history, task);
+	}
+
+	if (!(task->flags & RSPAMD_TASK_FLAG_NO_LOG)) {
+		msg_info ("%v", logbuf);
+		rspamd_scan_log_write (task);
+	}
+	g_string_free (logbuf, TRUE);
+
+	/* Update stat for default metric */
+	metric_res = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+	if (metric_res != NULL) {
+		action = rspamd_check_action_metric (task, metric_res->score, &required_score,
+				metric_res->metric);
+		if (action <= METRIC_ACTION_NOACTION) {
+			task->worker->srv->stat->actions_stat[action]++;
+
+			if (task->worker->srv->ts) {
+				rspamd_ts_store_add (task->worker->srv->ts->store,
+						task->worker->srv->ts->actions[action], 1);
+			}
+		}
+	}
+
+	/* Increase counters */
+	task->worker->srv->stat->messages_scanned++;
+
+	if (task->worker->srv->ts) {
+		rspamd_ts_store_add (task->worker->srv->ts->store,
+				task->worker->srv->ts->scanned, 1);
+	}
+}
+
+ucl_object_t *
+rspamd_protocol_write_result (struct rspamd_task *task)
+{
+	GString *logbuf;
+	ucl_object_t *top = NULL;
+
 	/* Output the first line - check status */
 	logbuf = g_string_sized_new (BUFSIZ);
+	top = rspamd_protocol_write_ucl (task, logbuf);
+	rspamd_protocol_result_done (task, logbuf);
+
+	return top;
+}
+
+void
+rspamd_protocol_http_reply (struct rspamd_http_message *msg,
+	struct rspamd_task *task)
+{
+	GHashTableIter hiter;
+	GString *logbuf;
+	gpointer h, v;
+	ucl_object_t *top = NULL;
 
 	/* Write custom headers */
 	g_hash_table_iter_init (&hiter, task->reply_headers);
@@ -1054,44 +1946,27 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 		rspamd_http_message_add_header (msg, hn->str, hv->str);
 	}
 
-	top = rspamd_protocol_write_ucl (task, logbuf);
-
-	if (!(task->flags & RSPAMD_TASK_FLAG_NO_LOG)) {
-		rspamd_roll_history_update (task->worker->srv->history, task);
-	}
-
-	if (!(task->flags & RSPAMD_TASK_FLAG_NO_LOG)) {
-		msg_info ("%v", logbuf);
-	}
-	g_string_free (logbuf, TRUE);
-
 	msg->body = g_string_sized_new (BUFSIZ);
 
 	if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task)) {
-		rspamd_ucl_emit_gstring (top, UCL_EMIT_JSON_COMPACT, msg->body);
+		/* Emit the reply directly, without building an ucl object */
+		logbuf = g_string_sized_new (BUFSIZ);
+		rspamd_protocol_emit_result (task, msg->body, logbuf,
+				RSPAMD_TASK_IS_MSGPACK (task));
+		rspamd_protocol_result_done (task, logbuf);
 	}
 	else {
+		top = rspamd_protocol_write_result (task);
+
 		if (RSPAMD_TASK_IS_SPAMC (task)) {
 			rspamd_ucl_tospamc_output (task, top, msg->body);
 		}
 		else {
 			rspamd_ucl_torspamc_output (task, top, msg->body);
 		}
-	}
-	ucl_object_unref (top);
 
-	/* Update stat for default metric */
-	metric_res = g_hash_table_lookup (task->results, DEFAULT_METRIC);
-	if (metric_res != NULL) {
-		action = rspamd_check_action_metric (task, metric_res->score, &required_score,
-				metric_res->metric);
-		if (action <= METRIC_ACTION_NOACTION) {
-			task->worker->srv->stat->actions_stat[action]++;
-		}
+		ucl_object_unref (top);
 	}
-
-	/* Increase counters */
-	task->worker->srv->stat->messages_scanned++;
 }
 
 void
@@ -1113,23 +1988,30 @@ rspamd_protocol_write_reply (struct rspamd_task *task)
 	if (RSPAMD_TASK_IS_SPAMC (task)) {
 		msg->flags |= RSPAMD_HTTP_FLAG_SPAMC;
 	}
+	if (task->flags & RSPAMD_TASK_FLAG_KEEP_ALIVE) {
+		msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+	}
 
 	msg->date = time (NULL);
 
 	task->state = WRITING_REPLY;
+	rspamd_task_stage_done (task, RSPAMD_TASK_STAGE_MAX);
 
 	debug_task ("writing reply to client");
-	if (task->error_code != 0) {
-		ucl_object_t *top = NULL;
+	if (RSPAMD_TASK_IS_MSGPACK (task) && RSPAMD_TASK_IS_JSON (task) &&
+			!RSPAMD_TASK_IS_SPAMC (task)) {
+		ctype = "application/msgpack";
+	}
+	else {
+		task->flags &= ~RSPAMD_TASK_FLAG_MSGPACK;
+	}
 
-		top = ucl_object_typed_new (UCL_OBJECT);
+	if (task->error_code != 0) {
 		msg->code = 500 + task->error_code % 100;
 		msg->status = g_string_new (task->last_error);
-		ucl_object_insert_key (top, ucl_object_fromstring (task->last_error),
-			"error", 0, false);
 		msg->body = g_string_sized_new (256);
-		rspamd_ucl_emit_gstring (top, UCL_EMIT_JSON_COMPACT, msg->body);
-		ucl_object_unref (top);
+		rspamd_protocol_emit_error (task, msg->body,
+				RSPAMD_TASK_IS_MSGPACK (task));
 	}
 	else {
 		switch (task->cmd) {
@@ -1145,6 +2027,7 @@ rspamd_protocol_write_reply (struct rspamd_task *task)
 			msg->body = g_string_new ("pong" CRLF);
 			ctype = "text/plain";
 			break;
+		case CMD_BATCH:
 		case CMD_OTHER:
 			msg_err ("BROKEN");
 			break;
@@ -17,6 +17,7 @@
 #define RSPAMD_PROTOCOL_ERROR RSPAMD_BASE_ERROR + 3
 #define RSPAMD_LENGTH_ERROR RSPAMD_BASE_ERROR + 4
 #define RSPAMD_STATFILE_ERROR RSPAMD_BASE_ERROR + 5
+#define RSPAMD_MEMORY_ERROR RSPAMD_BASE_ERROR + 6
 
 struct metric;
 
@@ -38,6 +39,50 @@ gboolean rspamd_protocol_handle_headers (struct rspamd_task *task,
 gboolean rspamd_protocol_handle_control (struct rspamd_task *task,
 		const ucl_object_t *control);
 
+/*
+ * Binary control chunk: RSPAMD_PROTOCOL_BIN_MAGIC followed by fields, each
+ * field is encoded as 1 byte of field id, 2 bytes of big endian length and
+ * the value itself
+ */
+#define RSPAMD_PROTOCOL_BIN_MAGIC "RSPB"
+
+enum rspamd_protocol_bin_field {
+	RSPAMD_PROTOCOL_BIN_IP = 1,
+	RSPAMD_PROTOCOL_BIN_HELO,
+	RSPAMD_PROTOCOL_BIN_FROM,
+	RSPAMD_PROTOCOL_BIN_RCPT,
+	RSPAMD_PROTOCOL_BIN_USER,
+	RSPAMD_PROTOCOL_BIN_SETTINGS_ID,
+	RSPAMD_PROTOCOL_BIN_QUEUE_ID,
+	RSPAMD_PROTOCOL_BIN_HOSTNAME,
+	RSPAMD_PROTOCOL_BIN_DELIVER_TO,
+	/* 4 bytes big endian, RSPAMD_PROTOCOL_BIN_FLAG_* */
+	RSPAMD_PROTOCOL_BIN_FLAGS
+};
+
+#define RSPAMD_PROTOCOL_BIN_FLAG_PASS_ALL (1 << 0)
+#define RSPAMD_PROTOCOL_BIN_FLAG_NO_LOG (1 << 1)
+#define RSPAMD_PROTOCOL_BIN_FLAG_EXT_URLS (1 << 2)
+#define RSPAMD_PROTOCOL_BIN_FLAG_MSGPACK (1 << 3)
+
+/**
+ * Check whether control chunk is in the binary format
+ * @param data control chunk
+ * @param len length of chunk
+ * @return TRUE if a chunk starts with the binary magic
+ */
+gboolean rspamd_protocol_is_binary_control (const gchar *data, gsize len);
+
+/**
+ * Process binary control chunk and update task structure accordingly
+ * @param task
+ * @param data control chunk
+ * @param len length of chunk
+ * @return FALSE if a chunk is malformed
+ */
+gboolean rspamd_protocol_handle_binary_control (struct rspamd_task *task,
+		const gchar *data, gsize len);
+
 /**
  * Process HTTP request to the task structure
  * @param task
@@ -47,6 +92,25 @@ gboolean rspamd_protocol_handle_control (struct rspamd_task *task,
 gboolean rspamd_protocol_handle_request (struct rspamd_task *task,
 	struct rspamd_http_message *msg);
 
+/*
+ * Message of a batch request
+ */
+struct rspamd_protocol_batch_frame {
+	const gchar *start;
+	gsize len;
+};
+
+/**
+ * Split batch into messages: each message is preceded by its decimal length
+ * followed by a newline
+ * @param start batch data
+ * @param len length of batch
+ * @param frames array of `struct rspamd_protocol_batch_frame`
+ * @return TRUE if batch is valid and is not empty
+ */
+gboolean rspamd_protocol_parse_batch (const gchar *start, gsize len,
+	GArray *frames);
+
 /**
  * Write task results to http message
  * @param msg
@@ -64,6 +128,13 @@ void rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 ucl_object_t * rspamd_protocol_write_ucl (struct rspamd_task *task,
 		GString *logbuf);
 
+/**
+ * Write task results to ucl object, log them and update scan statistics
+ * @param task
+ * @return new ucl object
+ */
+ucl_object_t * rspamd_protocol_write_result (struct rspamd_task *task);
+
 /**
  * Write reply for specified task command
  * @param task task object
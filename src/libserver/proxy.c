@@ -34,12 +34,67 @@ proxy_error_quark (void)
 	return g_quark_from_static_string ("proxy-error");
 }
 
+static void
+rspamd_proxy_close_pipe (rspamd_proxy_t *proxy)
+{
+	if (proxy->pipe[0] != -1) {
+		close (proxy->pipe[0]);
+		close (proxy->pipe[1]);
+		proxy->pipe[0] = -1;
+		proxy->pipe[1] = -1;
+	}
+}
+
+/*
+ * Data is moved through a pipe by splice where it is possible, so it is not
+ * copied to user space, otherwise it is read to the exchange buffer. Data is
+ * never read before the previous chunk is written, so the pipe is empty
+ * whenever we switch to the buffer
+ */
+static gssize
+rspamd_proxy_read (rspamd_proxy_t *proxy, gint fd)
+{
+#ifdef HAVE_SPLICE
+	gssize r;
+
+	if (proxy->pipe[0] != -1) {
+		r = splice (fd, NULL, proxy->pipe[1], NULL, proxy->bufsize,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+		if (r >= 0 || (errno != EINVAL && errno != ENOSYS)) {
+			return r;
+		}
+
+		/* Descriptor does not support splicing */
+		rspamd_proxy_close_pipe (proxy);
+	}
+#endif
+
+	return read (fd, proxy->buf, proxy->bufsize);
+}
+
+static gssize
+rspamd_proxy_write (rspamd_proxy_t *proxy, gint fd)
+{
+#ifdef HAVE_SPLICE
+	if (proxy->pipe[0] != -1) {
+		return splice (proxy->pipe[0], NULL, fd, NULL,
+				proxy->read_len - proxy->buf_offset,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	}
+#endif
+
+	return write (fd, proxy->buf + proxy->buf_offset,
+			proxy->read_len - proxy->buf_offset);
+}
+
 void
 rspamd_proxy_close (rspamd_proxy_t *proxy)
 {
 	if (!proxy->closed) {
 		close (proxy->cfd);
 		close (proxy->bfd);
+		rspamd_proxy_close_pipe (proxy);
 
 		event_del (&proxy->client_ev);
 		event_del (&proxy->backend_ev);
@@ -57,7 +112,7 @@ rspamd_proxy_client_handler (gint fd, gshort what, gpointer data)
 	if (what == EV_READ) {
 		/* Got data from client */
 		event_del (&proxy->client_ev);
-		r = read (proxy->cfd, proxy->buf, proxy->bufsize);
+		r = rspamd_proxy_read (proxy, proxy->cfd);
 		if (r > 0) {
 			/* Write this buffer to backend */
 			proxy->read_len = r;
@@ -89,9 +144,7 @@ rspamd_proxy_client_handler (gint fd, gshort what, gpointer data)
 	}
 	else if (what == EV_WRITE) {
 		/* Can write to client */
-		r = write (proxy->cfd,
-				proxy->buf + proxy->buf_offset,
-				proxy->read_len - proxy->buf_offset);
+		r = rspamd_proxy_write (proxy, proxy->cfd);
 		if (r > 0) {
 			/* We wrote something */
 			proxy->buf_offset += r;
@@ -114,7 +167,7 @@ rspamd_proxy_client_handler (gint fd, gshort what, gpointer data)
 			}
 			else {
 				/* Plan another write event */
-				event_add (&proxy->backend_ev, proxy->tv);
+				event_add (&proxy->client_ev, proxy->tv);
 			}
 		}
 		else {
@@ -152,14 +205,14 @@ rspamd_proxy_backend_handler (gint fd, gshort what, gpointer data)
 	if (what == EV_READ) {
 		/* Got data from backend */
 		event_del (&proxy->backend_ev);
-		r = read (proxy->bfd, proxy->buf, proxy->bufsize);
+		r = rspamd_proxy_read (proxy, proxy->bfd);
 		if (r > 0) {
 			/* Write this buffer to client */
 			proxy->read_len = r;
 			proxy->buf_offset = 0;
 			event_del (&proxy->client_ev);
 			event_set (&proxy->client_ev,
-				proxy->bfd,
+				proxy->cfd,
 				EV_WRITE,
 				rspamd_proxy_client_handler,
 				proxy);
@@ -184,9 +237,7 @@ rspamd_proxy_backend_handler (gint fd, gshort what, gpointer data)
 	}
 	else if (what == EV_WRITE) {
 		/* Can write to backend */
-		r = write (proxy->bfd,
-				proxy->buf + proxy->buf_offset,
-				proxy->read_len - proxy->buf_offset);
+		r = rspamd_proxy_write (proxy, proxy->bfd);
 		if (r > 0) {
 			/* We wrote something */
 			proxy->buf_offset += r;
@@ -269,6 +320,25 @@ rspamd_create_proxy (gint cfd,
 	new->err_cb = err_cb;
 	new->user_data = ud;
 	new->tv = tv;
+	new->pipe[0] = -1;
+	new->pipe[1] = -1;
+
+#ifdef HAVE_SPLICE
+	if (pipe (new->pipe) == -1) {
+		msg_info ("cannot create pipe, proxy data via buffer: %s",
+				strerror (errno));
+		new->pipe[0] = -1;
+		new->pipe[1] = -1;
+	}
+	else {
+		rspamd_socket_nonblocking (new->pipe[0]);
+		rspamd_socket_nonblocking (new->pipe[1]);
+#ifdef F_SETPIPE_SZ
+		/* Allow to move the whole buffer at once */
+		(void)fcntl (new->pipe[1], F_SETPIPE_SZ, (gint)bufsize);
+#endif
+	}
+#endif
 
 	/* Set client's and backend's interfaces to read events */
 	event_set (&new->client_ev,
@@ -43,6 +43,7 @@ typedef struct rspamd_proxy_s {
 	gint cfd;                               /**< client's socket */
 	gint bfd;                               /**< backend's socket */
 	guint8 *buf;                            /**< exchange buffer */
+	gint pipe[2];                           /**< pipe to splice data or -1 */
 	gsize bufsize;                          /**< buffer size */
 	gint read_len;                          /**< read length */
 	gint buf_offset;                        /**< offset to write */
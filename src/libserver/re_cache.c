@@ -0,0 +1,503 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "task.h"
+#include "re_cache.h"
+#include "blake2.h"
+#include <pcre.h>
+#ifdef WITH_HYPERSCAN
+#include "hs.h"
+#endif
+
+struct rspamd_re_cache_elt {
+	rspamd_regexp_t *re;
+	const gchar *key;
+	guint id;
+};
+
+struct rspamd_re_class {
+	gchar *name;
+	/* Regexps that are matched by the multi-pattern engine */
+	GPtrArray *elts;
+	/* Keys of all regexps of this class */
+	GHashTable *keys;
+#ifdef WITH_HYPERSCAN
+	hs_database_t *db;
+#endif
+};
+
+struct rspamd_re_cache {
+	GHashTable *classes;
+	/* Ids of regexps indexed by their keys */
+	GHashTable *ids;
+	guint nelts;
+	gboolean compiled;
+#ifdef WITH_HYPERSCAN
+	hs_scratch_t *scratch;
+#endif
+};
+
+static void
+rspamd_re_cache_class_dtor (gpointer p)
+{
+	struct rspamd_re_class *cls = p;
+	struct rspamd_re_cache_elt *elt;
+	guint i;
+
+	for (i = 0; i < cls->elts->len; i ++) {
+		elt = g_ptr_array_index (cls->elts, i);
+		rspamd_regexp_unref (elt->re);
+		g_slice_free1 (sizeof (*elt), elt);
+	}
+
+	g_ptr_array_free (cls->elts, TRUE);
+	g_hash_table_unref (cls->keys);
+#ifdef WITH_HYPERSCAN
+	if (cls->db) {
+		hs_free_database (cls->db);
+	}
+#endif
+	g_free (cls->name);
+	g_slice_free1 (sizeof (*cls), cls);
+}
+
+struct rspamd_re_cache *
+rspamd_re_cache_new (void)
+{
+	struct rspamd_re_cache *cache;
+
+	cache = g_slice_alloc0 (sizeof (*cache));
+	cache->classes = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			NULL, rspamd_re_cache_class_dtor);
+	cache->ids = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			g_free, NULL);
+
+	return cache;
+}
+
+guint
+rspamd_re_cache_id (struct rspamd_re_cache *cache, const gchar *key)
+{
+	gpointer p;
+
+	g_assert (cache != NULL);
+	g_assert (key != NULL);
+
+	p = g_hash_table_lookup (cache->ids, key);
+
+	if (p != NULL) {
+		return GPOINTER_TO_UINT (p) - 1;
+	}
+
+	/* Store id + 1 to distinguish zero id from missing values */
+	g_hash_table_insert (cache->ids, g_strdup (key),
+			GUINT_TO_POINTER (cache->nelts + 1));
+
+	return cache->nelts ++;
+}
+
+gint
+rspamd_re_cache_lookup_id (struct rspamd_re_cache *cache, const gchar *key)
+{
+	gpointer p;
+
+	g_assert (cache != NULL);
+
+	p = g_hash_table_lookup (cache->ids, key);
+
+	if (p != NULL) {
+		return GPOINTER_TO_UINT (p) - 1;
+	}
+
+	return -1;
+}
+
+guint
+rspamd_re_cache_nelts (struct rspamd_re_cache *cache)
+{
+	g_assert (cache != NULL);
+
+	return cache->nelts;
+}
+
+#ifdef WITH_HYPERSCAN
+/*
+ * Translate flags of a regexp to hyperscan flags, returns FALSE if the regexp
+ * cannot be handled by hyperscan
+ */
+static gboolean
+rspamd_re_cache_hs_flags (rspamd_regexp_t *re, guint *hs_flags)
+{
+	gint flags, pcre_flags;
+	hs_expr_info_t *info = NULL;
+	hs_compile_error_t *err = NULL;
+
+	flags = rspamd_regexp_get_flags (re);
+	pcre_flags = rspamd_regexp_get_pcre_flags (re);
+
+	/* Utf8 and full match regexps are left for pcre */
+	if (!(flags & RSPAMD_REGEXP_FLAG_RAW) ||
+			(flags & RSPAMD_REGEXP_FLAG_FULL_MATCH) ||
+			(pcre_flags & (PCRE_EXTENDED|PCRE_UTF8))) {
+		return FALSE;
+	}
+
+	*hs_flags = HS_FLAG_SINGLEMATCH;
+
+	if (pcre_flags & PCRE_CASELESS) {
+		*hs_flags |= HS_FLAG_CASELESS;
+	}
+	if (pcre_flags & PCRE_MULTILINE) {
+		*hs_flags |= HS_FLAG_MULTILINE;
+	}
+	if (pcre_flags & PCRE_DOTALL) {
+		*hs_flags |= HS_FLAG_DOTALL;
+	}
+
+	/* Check whether hyperscan supports all constructs of this pattern */
+	if (hs_expression_info (rspamd_regexp_get_pattern (re), *hs_flags,
+			&info, &err) != HS_SUCCESS) {
+		msg_debug ("pattern %s cannot be used with hyperscan: %s",
+				rspamd_regexp_get_pattern (re), err->message);
+		hs_free_compile_error (err);
+
+		return FALSE;
+	}
+
+	free (info);
+
+	return TRUE;
+}
+#endif
+
+gboolean
+rspamd_re_cache_add (struct rspamd_re_cache *cache,
+	const gchar *class_name,
+	rspamd_regexp_t *re,
+	const gchar *key)
+{
+#ifdef WITH_HYPERSCAN
+	struct rspamd_re_class *cls;
+	struct rspamd_re_cache_elt *elt;
+	guint hs_flags;
+
+	g_assert (cache != NULL);
+	g_assert (re != NULL);
+
+	if (cache->compiled) {
+		/* Classes are immutable after compilation */
+		return FALSE;
+	}
+
+	cls = g_hash_table_lookup (cache->classes, class_name);
+
+	if (cls != NULL && g_hash_table_lookup (cls->keys, key) != NULL) {
+		/* Already added */
+		return TRUE;
+	}
+
+	if (!rspamd_re_cache_hs_flags (re, &hs_flags)) {
+		return FALSE;
+	}
+
+	if (cls == NULL) {
+		cls = g_slice_alloc0 (sizeof (*cls));
+		cls->name = g_strdup (class_name);
+		cls->elts = g_ptr_array_new ();
+		cls->keys = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+		g_hash_table_insert (cache->classes, cls->name, cls);
+	}
+
+	elt = g_slice_alloc (sizeof (*elt));
+	elt->re = rspamd_regexp_ref (re);
+	elt->key = key;
+	elt->id = rspamd_re_cache_id (cache, key);
+	g_ptr_array_add (cls->elts, elt);
+	g_hash_table_insert (cls->keys, (gpointer)key, elt);
+
+	return TRUE;
+#else
+	/* Regexps are matched one by one by pcre */
+	return FALSE;
+#endif
+}
+
+#ifdef WITH_HYPERSCAN
+/*
+ * Path of the serialized database of a class, it depends on patterns, their
+ * flags, hyperscan version and features of the current CPU
+ */
+static gchar *
+rspamd_re_cache_hs_path (struct rspamd_re_class *cls, const gchar *cache_dir,
+		const gchar **patterns, const guint *flags)
+{
+	blake2b_state st;
+	hs_platform_info_t plt;
+	guchar digest[16];
+	gchar *b32, *path;
+	const gchar *ver;
+	guint i;
+
+	memset (&plt, 0, sizeof (plt));
+	hs_populate_platform (&plt);
+	ver = hs_version ();
+
+	blake2b_init (&st, sizeof (digest));
+	blake2b_update (&st, ver, strlen (ver));
+	blake2b_update (&st, (const guint8 *)&plt, sizeof (plt));
+	blake2b_update (&st, cls->name, strlen (cls->name) + 1);
+
+	for (i = 0; i < cls->elts->len; i ++) {
+		blake2b_update (&st, (const guint8 *)&flags[i], sizeof (flags[i]));
+		blake2b_update (&st, patterns[i], strlen (patterns[i]) + 1);
+	}
+
+	blake2b_final (&st, digest, sizeof (digest));
+	b32 = rspamd_encode_base32 (digest, sizeof (digest));
+	path = g_strdup_printf ("%s%c%s.hsdb", cache_dir, G_DIR_SEPARATOR, b32);
+	g_free (b32);
+
+	return path;
+}
+
+static gboolean
+rspamd_re_cache_hs_load (struct rspamd_re_class *cls, const gchar *path)
+{
+	gchar *data;
+	gsize len;
+
+	if (!g_file_get_contents (path, &data, &len, NULL)) {
+		return FALSE;
+	}
+
+	if (hs_deserialize_database (data, len, &cls->db) != HS_SUCCESS) {
+		msg_warn ("cannot load hyperscan database %s, recompile it", path);
+		cls->db = NULL;
+		g_free (data);
+
+		return FALSE;
+	}
+
+	g_free (data);
+
+	return TRUE;
+}
+
+static void
+rspamd_re_cache_hs_save (struct rspamd_re_class *cls, const gchar *path)
+{
+	gchar *data = NULL, *tmp_path;
+	gsize len;
+	GError *err = NULL;
+
+	if (hs_serialize_database (cls->db, &data, &len) != HS_SUCCESS) {
+		msg_warn ("cannot serialize hyperscan database of class %s",
+				cls->name);
+		return;
+	}
+
+	/* Other processes might read the old file at the same time */
+	tmp_path = g_strdup_printf ("%s.new", path);
+
+	if (!g_file_set_contents (tmp_path, data, len, &err) ||
+			rename (tmp_path, path) == -1) {
+		msg_warn ("cannot save hyperscan database %s: %s", path,
+				err ? err->message : strerror (errno));
+		unlink (tmp_path);
+
+		if (err) {
+			g_error_free (err);
+		}
+	}
+
+	g_free (tmp_path);
+	free (data);
+}
+#endif
+
+void
+rspamd_re_cache_compile (struct rspamd_re_cache *cache, const gchar *cache_dir)
+{
+#ifdef WITH_HYPERSCAN
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_re_class *cls;
+	struct rspamd_re_cache_elt *elt;
+	const gchar **patterns;
+	guint *flags, *ids, i;
+	gchar *path;
+	gboolean loaded;
+	hs_compile_error_t *err = NULL;
+
+	g_assert (cache != NULL);
+
+	if (cache->compiled) {
+		return;
+	}
+
+	g_hash_table_iter_init (&it, cache->classes);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		cls = v;
+		patterns = g_new (const gchar *, cls->elts->len);
+		flags = g_new (guint, cls->elts->len);
+		ids = g_new (guint, cls->elts->len);
+		path = NULL;
+		loaded = FALSE;
+
+		for (i = 0; i < cls->elts->len; i ++) {
+			elt = g_ptr_array_index (cls->elts, i);
+			patterns[i] = rspamd_regexp_get_pattern (elt->re);
+			rspamd_re_cache_hs_flags (elt->re, &flags[i]);
+			ids[i] = i;
+		}
+
+		if (cache_dir != NULL) {
+			path = rspamd_re_cache_hs_path (cls, cache_dir, patterns, flags);
+
+			if (rspamd_re_cache_hs_load (cls, path)) {
+				loaded = TRUE;
+				msg_info ("loaded %ud compiled regexps of class %s from %s",
+						cls->elts->len, cls->name, path);
+			}
+		}
+
+		if (cls->db == NULL && hs_compile_multi (patterns, flags, ids,
+				cls->elts->len, HS_MODE_BLOCK, NULL, &cls->db,
+				&err) != HS_SUCCESS) {
+			msg_err ("cannot compile %ud regexps of class %s: %s, "
+					"fallback to pcre", cls->elts->len, cls->name,
+					err->message);
+			hs_free_compile_error (err);
+			cls->db = NULL;
+		}
+		else if (hs_alloc_scratch (cls->db, &cache->scratch) != HS_SUCCESS) {
+			msg_err ("cannot allocate scratch space for class %s, "
+					"fallback to pcre", cls->name);
+			hs_free_database (cls->db);
+			cls->db = NULL;
+		}
+		else if (!loaded) {
+			msg_info ("compiled %ud regexps of class %s", cls->elts->len,
+					cls->name);
+
+			if (path != NULL) {
+				rspamd_re_cache_hs_save (cls, path);
+			}
+		}
+
+		g_free (path);
+		g_free (patterns);
+		g_free (flags);
+		g_free (ids);
+	}
+#endif
+
+	cache->compiled = TRUE;
+}
+
+#ifdef WITH_HYPERSCAN
+static gint
+rspamd_re_cache_hs_cb (guint id,
+		unsigned long long from,
+		unsigned long long to,
+		guint flags,
+		void *ud)
+{
+	guint8 *matched = ud;
+
+	matched[id] = 1;
+
+	/* Continue scanning */
+	return 0;
+}
+#endif
+
+gboolean
+rspamd_re_cache_scan (struct rspamd_re_cache *cache,
+	struct rspamd_task *task,
+	const gchar *class_name,
+	const guchar **data,
+	gsize *lens,
+	guint count)
+{
+#ifdef WITH_HYPERSCAN
+	struct rspamd_re_class *cls;
+	struct rspamd_re_cache_elt *elt;
+	guint8 *matched;
+	guint i;
+
+	g_assert (cache != NULL);
+
+	if (!cache->compiled) {
+		rspamd_re_cache_compile (cache, NULL);
+	}
+
+	cls = g_hash_table_lookup (cache->classes, class_name);
+
+	if (cls == NULL || cls->db == NULL) {
+		return FALSE;
+	}
+
+	matched = rspamd_mempool_alloc0 (task->task_pool, cls->elts->len);
+
+	for (i = 0; i < count; i ++) {
+		if (lens[i] == 0) {
+			continue;
+		}
+
+		if (hs_scan (cls->db, (const char *)data[i], lens[i], 0,
+				cache->scratch, rspamd_re_cache_hs_cb, matched) != HS_SUCCESS) {
+			msg_err ("cannot scan data for class %s, fallback to pcre",
+					cls->name);
+			return FALSE;
+		}
+	}
+
+	for (i = 0; i < cls->elts->len; i ++) {
+		elt = g_ptr_array_index (cls->elts, i);
+		rspamd_task_re_cache_add_id (task, elt->id, matched[i]);
+	}
+
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+void
+rspamd_re_cache_destroy (struct rspamd_re_cache *cache)
+{
+	if (cache != NULL) {
+		g_hash_table_unref (cache->classes);
+		g_hash_table_unref (cache->ids);
+#ifdef WITH_HYPERSCAN
+		if (cache->scratch) {
+			hs_free_scratch (cache->scratch);
+		}
+#endif
+		g_slice_free1 (sizeof (*cache), cache);
+	}
+}
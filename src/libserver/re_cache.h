@@ -0,0 +1,122 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef RSPAMD_RE_CACHE_H
+#define RSPAMD_RE_CACHE_H
+
+#include "config.h"
+#include "regexp.h"
+
+struct rspamd_task;
+
+/*
+ * Regexps cache groups regular expressions into classes: all regexps of a
+ * class are matched against the same data (e.g. the same header or mime
+ * parts). When rspamd is built with hyperscan, each class is compiled into a
+ * single multi-pattern database, so the data is scanned only once for all
+ * regexps of the class.
+ */
+struct rspamd_re_cache;
+
+/**
+ * Create new empty regexps cache
+ * @return new cache
+ */
+struct rspamd_re_cache * rspamd_re_cache_new (void);
+
+/**
+ * Get a stable id of regexp by its key, a new id is assigned if this key has
+ * not been registered before. Ids are dense and start from zero, so they
+ * could be used as indices in the per task cache of results.
+ * @param cache regexps cache
+ * @param key key of regexp (e.g. its text representation)
+ * @return id of regexp
+ */
+guint rspamd_re_cache_id (struct rspamd_re_cache *cache, const gchar *key);
+
+/**
+ * Find id of regexp by its key
+ * @param cache regexps cache
+ * @param key key of regexp
+ * @return id of regexp or -1 if the key is not registered
+ */
+gint rspamd_re_cache_lookup_id (struct rspamd_re_cache *cache,
+	const gchar *key);
+
+/**
+ * Get number of regexps ids registered in the cache
+ * @param cache regexps cache
+ * @return number of ids
+ */
+guint rspamd_re_cache_nelts (struct rspamd_re_cache *cache);
+
+/**
+ * Add regexp to the specified class
+ * @param cache regexps cache
+ * @param class_name name of class, regexps of a class share the same input
+ * @param re regexp
+ * @param key key of regexp used to get its id in the task's cache
+ * @return TRUE if regexp can be matched by the multi-pattern engine, if
+ * FALSE is returned then a caller should match regexp by itself
+ */
+gboolean rspamd_re_cache_add (struct rspamd_re_cache *cache,
+	const gchar *class_name,
+	rspamd_regexp_t *re,
+	const gchar *key);
+
+/**
+ * Compile all classes of the cache, it is called automatically on the first
+ * scan if it has not been called before. If `cache_dir` is not NULL, the
+ * compiled databases are loaded from and saved to this directory
+ * @param cache regexps cache
+ * @param cache_dir directory of serialized databases or NULL
+ */
+void rspamd_re_cache_compile (struct rspamd_re_cache *cache,
+	const gchar *cache_dir);
+
+/**
+ * Scan the data of a class and store results of all its regexps in the task's
+ * cache. Regexps are treated as single match ones so the result is either
+ * 0 or 1.
+ * @param cache regexps cache
+ * @param task task object
+ * @param class_name name of class
+ * @param data array of input buffers
+ * @param lens array of lengths of input buffers
+ * @param count number of input buffers
+ * @return TRUE if results have been stored, FALSE if a caller should fallback
+ * to the individual matching of regexps
+ */
+gboolean rspamd_re_cache_scan (struct rspamd_re_cache *cache,
+	struct rspamd_task *task,
+	const gchar *class_name,
+	const guchar **data,
+	gsize *lens,
+	guint count);
+
+/**
+ * Destroy regexps cache
+ * @param cache regexps cache
+ */
+void rspamd_re_cache_destroy (struct rspamd_re_cache *cache);
+
+#endif
@@ -0,0 +1,516 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "redis_pool.h"
+#include "hiredis.h"
+#include "async.h"
+#include "adapters/libevent.h"
+
+/* Maximum number of connections to a single server per event base */
+#define REDIS_POOL_MAX_CONNS 4
+/* Open a new connection if each existing one has that many pending commands */
+#define REDIS_POOL_MAX_ACTIVE 16
+/* Idle connections are closed after this timeout in seconds */
+#define REDIS_POOL_IDLE_TIMEOUT 60.0
+
+struct rspamd_redis_pool_elt;
+
+struct rspamd_redis_pool_connection {
+	redisAsyncContext *ctx;
+	struct rspamd_redis_pool_elt *elt;
+	struct event_base *ev_base;
+	struct event idle_timeout;
+	/* Number of requests waiting for replies */
+	guint active;
+	gboolean idle_armed;
+};
+
+struct rspamd_redis_pool_elt {
+	gchar *key;
+	GQueue *conns;
+};
+
+/* Recorded replies of a command, they are served in turn */
+struct rspamd_redis_replay_elt {
+	GPtrArray *replies;
+	guint cur;
+};
+
+struct rspamd_redis_pool {
+	/* Servers indexed by `ip:port` */
+	GHashTable *elts;
+	/* Replies received from servers are appended to this file or -1 */
+	gint record_fd;
+	/* Recorded replies indexed by command, no requests are sent */
+	GHashTable *replay;
+};
+
+static void
+rspamd_redis_pool_elt_dtor (gpointer p)
+{
+	struct rspamd_redis_pool_elt *elt = p;
+
+	g_queue_free (elt->conns);
+	g_free (elt->key);
+	g_slice_free1 (sizeof (*elt), elt);
+}
+
+struct rspamd_redis_pool *
+rspamd_redis_pool_init (void)
+{
+	struct rspamd_redis_pool *pool;
+
+	pool = g_slice_alloc0 (sizeof (*pool));
+	pool->elts = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+			rspamd_redis_pool_elt_dtor);
+	pool->record_fd = -1;
+
+	return pool;
+}
+
+/*
+ * Forget about connection, hiredis frees the context itself or it is freed
+ * by a caller
+ */
+static void
+rspamd_redis_pool_conn_free (struct rspamd_redis_pool_connection *conn)
+{
+	g_queue_remove (conn->elt->conns, conn);
+
+	if (conn->idle_armed) {
+		event_del (&conn->idle_timeout);
+	}
+
+	conn->ctx->data = NULL;
+	g_slice_free1 (sizeof (*conn), conn);
+}
+
+static void
+rspamd_redis_pool_conn_close (struct rspamd_redis_pool_connection *conn)
+{
+	redisAsyncContext *ctx = conn->ctx;
+
+	rspamd_redis_pool_conn_free (conn);
+	/* Callbacks of pending commands are called with NULL replies */
+	redisAsyncFree (ctx);
+}
+
+static void
+rspamd_redis_pool_on_connect (const redisAsyncContext *ctx, int status)
+{
+	struct rspamd_redis_pool_connection *conn = ctx->data;
+
+	if (status != REDIS_OK && conn != NULL) {
+		msg_info ("cannot connect to redis server %s: %s", conn->elt->key,
+				ctx->errstr);
+		rspamd_redis_pool_conn_free (conn);
+	}
+}
+
+static void
+rspamd_redis_pool_on_disconnect (const redisAsyncContext *ctx, int status)
+{
+	struct rspamd_redis_pool_connection *conn = ctx->data;
+
+	if (conn != NULL) {
+		rspamd_redis_pool_conn_free (conn);
+	}
+}
+
+static void
+rspamd_redis_pool_idle_timeout (gint fd, short what, gpointer d)
+{
+	struct rspamd_redis_pool_connection *conn = d;
+
+	conn->idle_armed = FALSE;
+	rspamd_redis_pool_conn_close (conn);
+}
+
+static struct rspamd_redis_pool_connection *
+rspamd_redis_pool_new_connection (struct rspamd_redis_pool_elt *elt,
+		struct event_base *ev_base,
+		const gchar *ip, guint16 port)
+{
+	struct rspamd_redis_pool_connection *conn;
+	redisAsyncContext *ctx;
+
+	ctx = redisAsyncConnect (ip, port);
+
+	if (ctx == NULL) {
+		return NULL;
+	}
+
+	if (ctx->err) {
+		msg_info ("cannot connect to redis server %s: %s", elt->key,
+				ctx->errstr);
+		redisAsyncFree (ctx);
+
+		return NULL;
+	}
+
+	conn = g_slice_alloc0 (sizeof (*conn));
+	conn->ctx = ctx;
+	conn->elt = elt;
+	conn->ev_base = ev_base;
+	ctx->data = conn;
+
+	redisLibeventAttach (ctx, ev_base);
+	redisAsyncSetConnectCallback (ctx, rspamd_redis_pool_on_connect);
+	redisAsyncSetDisconnectCallback (ctx, rspamd_redis_pool_on_disconnect);
+	g_queue_push_tail (elt->conns, conn);
+
+	return conn;
+}
+
+struct redisAsyncContext *
+rspamd_redis_pool_connect (struct rspamd_redis_pool *pool,
+		struct event_base *ev_base,
+		const gchar *ip, guint16 port)
+{
+	struct rspamd_redis_pool_elt *elt;
+	struct rspamd_redis_pool_connection *conn, *best = NULL, *nconn;
+	gchar key[128];
+	GList *cur;
+	guint nconns = 0;
+
+	g_assert (pool != NULL);
+	rspamd_snprintf (key, sizeof (key), "%s:%ud", ip, (guint)port);
+	elt = g_hash_table_lookup (pool->elts, key);
+
+	if (elt == NULL) {
+		elt = g_slice_alloc (sizeof (*elt));
+		elt->key = g_strdup (key);
+		elt->conns = g_queue_new ();
+		g_hash_table_insert (pool->elts, elt->key, elt);
+	}
+
+	/* Select the least loaded connection */
+	for (cur = elt->conns->head; cur != NULL; cur = g_list_next (cur)) {
+		conn = cur->data;
+
+		if (conn->ev_base == ev_base) {
+			nconns ++;
+
+			if (best == NULL || conn->active < best->active) {
+				best = conn;
+			}
+		}
+	}
+
+	if (best == NULL ||
+			(best->active >= REDIS_POOL_MAX_ACTIVE &&
+			nconns < REDIS_POOL_MAX_CONNS)) {
+		nconn = rspamd_redis_pool_new_connection (elt, ev_base, ip, port);
+
+		if (nconn != NULL) {
+			best = nconn;
+		}
+	}
+
+	if (best == NULL) {
+		return NULL;
+	}
+
+	if (best->idle_armed) {
+		event_del (&best->idle_timeout);
+		best->idle_armed = FALSE;
+	}
+
+	best->active ++;
+
+	return best->ctx;
+}
+
+void
+rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
+		struct redisAsyncContext *ctx, gboolean is_fatal)
+{
+	struct rspamd_redis_pool_connection *conn;
+	struct timeval tv;
+
+	g_assert (pool != NULL);
+	conn = ctx->data;
+
+	if (conn == NULL) {
+		/* Connection has been already closed */
+		return;
+	}
+
+	if (conn->active > 0) {
+		conn->active --;
+	}
+
+	if (is_fatal || ctx->err) {
+		rspamd_redis_pool_conn_close (conn);
+	}
+	else if (conn->active == 0) {
+		double_to_tv (REDIS_POOL_IDLE_TIMEOUT, &tv);
+		evtimer_set (&conn->idle_timeout, rspamd_redis_pool_idle_timeout, conn);
+		event_base_set (conn->ev_base, &conn->idle_timeout);
+		event_add (&conn->idle_timeout, &tv);
+		conn->idle_armed = TRUE;
+	}
+}
+
+gboolean
+rspamd_redis_pool_record (struct rspamd_redis_pool *pool, const gchar *path)
+{
+	gint fd;
+
+	fd = open (path, O_WRONLY | O_CREAT | O_APPEND, 00644);
+
+	if (fd == -1) {
+		msg_err ("cannot open redis records file %s: %s", path,
+				strerror (errno));
+		return FALSE;
+	}
+
+	if (pool->record_fd != -1) {
+		close (pool->record_fd);
+	}
+
+	pool->record_fd = fd;
+
+	return TRUE;
+}
+
+static ucl_object_t *
+rspamd_redis_reply_to_ucl (const redisReply *r)
+{
+	ucl_object_t *obj, *value = NULL;
+	const gchar *type;
+	gsize i;
+
+	switch (r->type) {
+	case REDIS_REPLY_STRING:
+		type = "string";
+		value = ucl_object_fromlstring (r->str, r->len);
+		break;
+	case REDIS_REPLY_STATUS:
+		type = "status";
+		value = ucl_object_fromlstring (r->str, r->len);
+		break;
+	case REDIS_REPLY_ERROR:
+		type = "error";
+		value = ucl_object_fromlstring (r->str, r->len);
+		break;
+	case REDIS_REPLY_INTEGER:
+		type = "integer";
+		value = ucl_object_fromint (r->integer);
+		break;
+	case REDIS_REPLY_ARRAY:
+		type = "array";
+		value = ucl_object_typed_new (UCL_ARRAY);
+
+		for (i = 0; i < r->elements; i ++) {
+			ucl_array_append (value, rspamd_redis_reply_to_ucl (r->element[i]));
+		}
+		break;
+	default:
+		type = "nil";
+		break;
+	}
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromstring (type), "type", 0, false);
+
+	if (value) {
+		ucl_object_insert_key (obj, value, "value", 0, false);
+	}
+
+	return obj;
+}
+
+void
+rspamd_redis_pool_record_reply (struct rspamd_redis_pool *pool,
+	const gchar *command, const redisReply *r, gdouble latency)
+{
+	ucl_object_t *obj;
+	guchar *out;
+	GString *line;
+
+	if (pool->record_fd == -1) {
+		return;
+	}
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromstring (command),
+			"command", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (latency),
+			"latency", 0, false);
+	ucl_object_insert_key (obj, rspamd_redis_reply_to_ucl (r),
+			"reply", 0, false);
+
+	out = ucl_object_emit (obj, UCL_EMIT_JSON_COMPACT);
+	line = g_string_new ((const gchar *)out);
+	g_string_append_c (line, '\n');
+
+	/* Single write of a line keeps records of processes apart */
+	if (write (pool->record_fd, line->str, line->len) == -1) {
+		msg_err ("cannot write redis record: %s", strerror (errno));
+	}
+
+	g_string_free (line, TRUE);
+	free (out);
+	ucl_object_unref (obj);
+}
+
+static void
+rspamd_redis_replay_elt_free (gpointer p)
+{
+	struct rspamd_redis_replay_elt *elt = p;
+
+	g_ptr_array_free (elt->replies, TRUE);
+	g_slice_free1 (sizeof (*elt), elt);
+}
+
+gboolean
+rspamd_redis_pool_replay (struct rspamd_redis_pool *pool, const gchar *path)
+{
+	struct rspamd_redis_replay_elt *elt;
+	struct ucl_parser *parser;
+	const ucl_object_t *command;
+	ucl_object_t *obj;
+	GError *err = NULL;
+	gchar *data, **lines;
+	gsize len;
+	guint i, nreplies = 0;
+
+	if (!g_file_get_contents (path, &data, &len, &err)) {
+		msg_err ("cannot read redis records file %s: %e", path, err);
+		g_error_free (err);
+		return FALSE;
+	}
+
+	if (pool->replay == NULL) {
+		pool->replay = g_hash_table_new_full (g_str_hash, g_str_equal,
+				g_free, rspamd_redis_replay_elt_free);
+	}
+
+	lines = g_strsplit (data, "\n", -1);
+	g_free (data);
+
+	for (i = 0; lines[i] != NULL; i ++) {
+		if (lines[i][0] == '\0') {
+			continue;
+		}
+
+		parser = ucl_parser_new (0);
+
+		if (!ucl_parser_add_string (parser, lines[i], 0)) {
+			msg_warn ("invalid redis record at line %ud of %s: %s", i + 1,
+					path, ucl_parser_get_error (parser));
+			ucl_parser_free (parser);
+			continue;
+		}
+
+		obj = ucl_parser_get_object (parser);
+		ucl_parser_free (parser);
+		command = ucl_object_find_key (obj, "command");
+
+		if (command == NULL || ucl_object_type (command) != UCL_STRING ||
+				ucl_object_find_key (obj, "reply") == NULL) {
+			msg_warn ("invalid redis record at line %ud of %s", i + 1, path);
+			ucl_object_unref (obj);
+			continue;
+		}
+
+		elt = g_hash_table_lookup (pool->replay, ucl_object_tostring (command));
+
+		if (elt == NULL) {
+			elt = g_slice_alloc0 (sizeof (*elt));
+			elt->replies = g_ptr_array_new_with_free_func (
+					(GDestroyNotify)ucl_object_unref);
+			g_hash_table_insert (pool->replay,
+					g_strdup (ucl_object_tostring (command)), elt);
+		}
+
+		g_ptr_array_add (elt->replies, obj);
+		nreplies ++;
+	}
+
+	g_strfreev (lines);
+	msg_info ("loaded %ud recorded redis replies of %ud commands from %s",
+			nreplies, g_hash_table_size (pool->replay), path);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_redis_pool_replaying (struct rspamd_redis_pool *pool)
+{
+	return pool->replay != NULL;
+}
+
+const ucl_object_t *
+rspamd_redis_pool_replay_reply (struct rspamd_redis_pool *pool,
+	const gchar *command,
+	gdouble *latency)
+{
+	struct rspamd_redis_replay_elt *elt;
+	const ucl_object_t *obj, *cur;
+
+	if (pool->replay == NULL ||
+			(elt = g_hash_table_lookup (pool->replay, command)) == NULL) {
+		return NULL;
+	}
+
+	obj = g_ptr_array_index (elt->replies, elt->cur);
+	elt->cur = (elt->cur + 1) % elt->replies->len;
+	cur = ucl_object_find_key (obj, "latency");
+	*latency = cur != NULL ? MAX (ucl_object_todouble (cur), 0) : 0;
+
+	return ucl_object_find_key (obj, "reply");
+}
+
+void
+rspamd_redis_pool_destroy (struct rspamd_redis_pool *pool)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_redis_pool_elt *elt;
+
+	g_hash_table_iter_init (&it, pool->elts);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		elt = v;
+
+		while (!g_queue_is_empty (elt->conns)) {
+			rspamd_redis_pool_conn_close (g_queue_peek_head (elt->conns));
+		}
+	}
+
+	g_hash_table_unref (pool->elts);
+
+	if (pool->replay) {
+		g_hash_table_unref (pool->replay);
+	}
+
+	if (pool->record_fd != -1) {
+		close (pool->record_fd);
+	}
+
+	g_slice_free1 (sizeof (*pool), pool);
+}
@@ -0,0 +1,131 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef RSPAMD_REDIS_POOL_H
+#define RSPAMD_REDIS_POOL_H
+
+#include "config.h"
+#include "ucl.h"
+
+struct redisAsyncContext;
+struct redisReply;
+struct event_base;
+
+/*
+ * Pool of persistent asynchronous redis connections of a worker. Connections
+ * are indexed by server address and event base and they are shared between
+ * requests: hiredis pipelines commands sent over the same connection, so a
+ * new connection is opened merely if all existing ones are too busy. Idle
+ * connections are closed after some time of inactivity.
+ */
+struct rspamd_redis_pool;
+
+/**
+ * Create new empty pool
+ * @return new pool
+ */
+struct rspamd_redis_pool * rspamd_redis_pool_init (void);
+
+/**
+ * Get a connection to the specified server, it is either an existing one or
+ * a newly created connection attached to `ev_base`
+ * @param pool pool object
+ * @param ev_base event base
+ * @param ip server address
+ * @param port server port
+ * @return async context or NULL if a connection cannot be established
+ */
+struct redisAsyncContext * rspamd_redis_pool_connect (
+	struct rspamd_redis_pool *pool,
+	struct event_base *ev_base,
+	const gchar *ip, guint16 port);
+
+/**
+ * Release a connection obtained by rspamd_redis_pool_connect, it must be
+ * called once per each connect call when the reply is received or the
+ * request is cancelled
+ * @param pool pool object
+ * @param ctx async context
+ * @param is_fatal if TRUE, then the connection is closed, as its state is
+ * unknown (e.g. on errors or timeouts) and all pending commands are failed
+ */
+void rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
+	struct redisAsyncContext *ctx, gboolean is_fatal);
+
+/**
+ * Append replies received from servers to a file, each reply is written as
+ * a JSON object on a separate line with its command and latency
+ * @param pool pool object
+ * @param path file name
+ * @return TRUE if file has been opened
+ */
+gboolean rspamd_redis_pool_record (struct rspamd_redis_pool *pool,
+	const gchar *path);
+
+/**
+ * Record a reply if recording is enabled for the pool
+ * @param pool pool object
+ * @param command command with its arguments separated by spaces
+ * @param r reply
+ * @param latency latency of the request in seconds
+ */
+void rspamd_redis_pool_record_reply (struct rspamd_redis_pool *pool,
+	const gchar *command, const struct redisReply *r, gdouble latency);
+
+/**
+ * Load replies recorded by rspamd_redis_pool_record, commands sent via this
+ * pool should then be served by rspamd_redis_pool_replay_reply
+ * @param pool pool object
+ * @param path file name
+ * @return TRUE if file has been loaded
+ */
+gboolean rspamd_redis_pool_replay (struct rspamd_redis_pool *pool,
+	const gchar *path);
+
+/**
+ * Check if the pool serves recorded replies
+ * @param pool pool object
+ * @return TRUE if replies are replayed
+ */
+gboolean rspamd_redis_pool_replaying (struct rspamd_redis_pool *pool);
+
+/**
+ * Get the next recorded reply of a command, replies of the same command are
+ * served in turn. A reply is an object with `type` (`string`, `status`,
+ * `error`, `integer`, `nil` or `array`) and `value` keys
+ * @param pool pool object
+ * @param command command with its arguments separated by spaces
+ * @param latency recorded latency of the request
+ * @return reply or NULL if the command has not been recorded
+ */
+const ucl_object_t * rspamd_redis_pool_replay_reply (
+	struct rspamd_redis_pool *pool,
+	const gchar *command,
+	gdouble *latency);
+
+/**
+ * Close all connections and destroy the pool
+ * @param pool pool object
+ */
+void rspamd_redis_pool_destroy (struct rspamd_redis_pool *pool);
+
+#endif
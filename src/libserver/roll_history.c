@@ -27,15 +27,16 @@
 #include "main.h"
 #include "roll_history.h"
 
-static const gchar rspamd_history_magic[] = {'r', 's', 'h', '1'};
+static const gchar rspamd_history_magic[] = {'r', 's', 'h', '2'};
 
 /**
  * Returns new roll history
  * @param pool pool for shared memory
+ * @param nrows number of rows (HISTORY_DEFAULT_ROWS if 0)
  * @return new structure
  */
 struct roll_history *
-rspamd_roll_history_new (rspamd_mempool_t *pool)
+rspamd_roll_history_new (rspamd_mempool_t *pool, guint nrows)
 {
 	struct roll_history *new;
 
@@ -43,9 +44,15 @@ rspamd_roll_history_new (rspamd_mempool_t *pool)
 		return NULL;
 	}
 
+	if (nrows == 0) {
+		nrows = HISTORY_DEFAULT_ROWS;
+	}
+
 	new = rspamd_mempool_alloc0_shared (pool, sizeof (struct roll_history));
+	new->rows = rspamd_mempool_alloc0_shared (pool,
+			sizeof (struct roll_history_row) * nrows);
+	new->nrows = nrows;
 	new->pool = pool;
-	new->mtx = rspamd_mempool_get_mutex (pool);
 
 	return new;
 }
@@ -78,35 +85,25 @@ void
 rspamd_roll_history_update (struct roll_history *history,
 	struct rspamd_task *task)
 {
-	gint row_num;
+	guint ticket, seq;
 	struct roll_history_row *row;
 	struct metric_result *metric_res;
 	struct history_metric_callback_data cbdata;
 
-	if (history->need_lock) {
-		/* Some process is getting history, so wait on a mutex */
-		rspamd_mempool_lock_mutex (history->mtx);
-		history->need_lock = FALSE;
-		rspamd_mempool_unlock_mutex (history->mtx);
-	}
-
-	/* First of all obtain check and obtain row number */
-	g_atomic_int_compare_and_exchange (&history->cur_row, HISTORY_MAX_ROWS, 0);
+	/* First of all obtain a ticket, it defines both row and sequence number */
 #if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
-	row_num = g_atomic_int_add (&history->cur_row, 1);
+	ticket = g_atomic_int_add ((gint *)&history->cur_row, 1);
 #else
-	row_num = g_atomic_int_exchange_and_add (&history->cur_row, 1);
+	ticket = g_atomic_int_exchange_and_add ((gint *)&history->cur_row, 1);
 #endif
-
-	if (row_num < HISTORY_MAX_ROWS) {
-		row = &history->rows[row_num];
-		row->completed = FALSE;
-	}
-	else {
-		/* Race condition */
-		history->cur_row = 0;
-		return;
-	}
+	row = &history->rows[ticket % history->nrows];
+	/*
+	 * Odd sequence means that a row is being written, if another writer
+	 * claims the same row after the whole cycle, then it overwrites the
+	 * sequence and our final update fails
+	 */
+	seq = ticket * 2 + 1;
+	g_atomic_int_set ((gint *)&row->seq, seq);
 
 	/* Add information from task to roll history */
 	if (task->from_addr) {
@@ -156,7 +153,39 @@ rspamd_roll_history_update (struct roll_history *history,
 
 	row->scan_time = task->scan_milliseconds;
 	row->len = task->msg.len;
-	row->completed = TRUE;
+	g_atomic_int_compare_and_exchange ((gint *)&row->seq, seq, seq + 1);
+}
+
+gboolean
+rspamd_roll_history_get_row (struct roll_history *history, guint n,
+	struct roll_history_row *dest)
+{
+	struct roll_history_row *row;
+	guint seq;
+
+	g_assert (n < history->nrows);
+	row = &history->rows[n];
+	seq = g_atomic_int_get ((gint *)&row->seq);
+
+	if (seq == 0 || (seq & 1)) {
+		/* Empty or incomplete row */
+		return FALSE;
+	}
+
+	memcpy (dest, row, sizeof (*dest));
+
+	if (g_atomic_int_get ((gint *)&row->seq) != seq) {
+		/* Row has been changed while copying */
+		return FALSE;
+	}
+
+	/* Late writers can still mix strings, so always terminate them */
+	dest->message_id[sizeof (dest->message_id) - 1] = '\0';
+	dest->symbols[sizeof (dest->symbols) - 1] = '\0';
+	dest->user[sizeof (dest->user) - 1] = '\0';
+	dest->from_addr[sizeof (dest->from_addr) - 1] = '\0';
+
+	return TRUE;
 }
 
 /**
@@ -171,6 +200,8 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
 	gint fd;
 	struct stat st;
 	gchar magic[sizeof(rspamd_history_magic)];
+	gsize nrows, i;
+	guint seq;
 
 	if (stat (filename, &st) == -1) {
 		msg_info ("cannot load history from %s: %s", filename,
@@ -178,11 +209,17 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
 		return FALSE;
 	}
 
-	if (st.st_size != sizeof (history->rows) + sizeof (rspamd_history_magic)) {
+	if (st.st_size < (off_t)sizeof (rspamd_history_magic) ||
+			(st.st_size - sizeof (rspamd_history_magic)) %
+			sizeof (struct roll_history_row) != 0) {
 		msg_info ("cannot load history from %s: size mismatch", filename);
 		return FALSE;
 	}
 
+	nrows = (st.st_size - sizeof (rspamd_history_magic)) /
+			sizeof (struct roll_history_row);
+	nrows = MIN (nrows, history->nrows);
+
 	if ((fd = open (filename, O_RDONLY)) == -1) {
 		msg_info ("cannot load history from %s: %s", filename,
 			strerror (errno));
@@ -202,7 +239,8 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
 		return FALSE;
 	}
 
-	if (read (fd, history->rows, sizeof (history->rows)) == -1) {
+	if (read (fd, history->rows, nrows * sizeof (struct roll_history_row))
+			== -1) {
 		close (fd);
 		msg_info ("cannot read history from %s: %s", filename,
 			strerror (errno));
@@ -211,6 +249,24 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
 
 	close (fd);
 
+	/* Renumber loaded rows so they are not confused with new ones */
+	for (i = 0; i < nrows; i ++) {
+		seq = history->rows[i].seq;
+
+		if (seq != 0 && !(seq & 1)) {
+			history->rows[i].seq = 2;
+		}
+		else {
+			history->rows[i].seq = 0;
+		}
+	}
+
+	/*
+	 * New rows get greater ids than loaded ones and still replace rows
+	 * starting from the first one
+	 */
+	history->cur_row = history->nrows;
+
 	return TRUE;
 }
 
@@ -236,7 +292,8 @@ rspamd_roll_history_save (struct roll_history *history, const gchar *filename)
 		return FALSE;
 	}
 
-	if (write (fd, history->rows, sizeof (history->rows)) == -1) {
+	if (write (fd, history->rows,
+			history->nrows * sizeof (struct roll_history_row)) == -1) {
 		close (fd);
 		msg_info ("cannot write history to %s: %s", filename, strerror (errno));
 		return FALSE;
@@ -31,17 +31,28 @@
 /*
  * Roll history is a special cycled buffer for checked messages, it is designed for writing history messages
  * and displaying them in webui
+ *
+ * Writers claim rows by an atomic increment of the rows counter, each row is
+ * protected by a sequence number: it is odd while a row is being written,
+ * so readers copy rows without locking and skip rows changed while copying
  */
 
 #define HISTORY_MAX_ID 100
 #define HISTORY_MAX_SYMBOLS 200
 #define HISTORY_MAX_USER 20
 #define HISTORY_MAX_ADDR 32
-#define HISTORY_MAX_ROWS 200
+#define HISTORY_DEFAULT_ROWS 200
+
+/*
+ * Id of a row copied by `rspamd_roll_history_get_row`, newer rows have greater
+ * ids and the id of the newest row is equal to `cur_row`
+ */
+#define ROLL_HISTORY_ROW_ID(row) ((row)->seq / 2)
 
 struct rspamd_task;
 
 struct roll_history_row {
+	guint seq;
 	struct timeval tv;
 	gchar message_id[HISTORY_MAX_ID];
 	gchar symbols[HISTORY_MAX_SYMBOLS];
@@ -52,23 +63,23 @@ struct roll_history_row {
 	gint action;
 	gdouble score;
 	gdouble required_score;
-	guint8 completed;
 };
 
 struct roll_history {
-	struct roll_history_row rows[HISTORY_MAX_ROWS];
-	gint cur_row;
+	struct roll_history_row *rows;
+	guint nrows;
+	guint cur_row;
 	rspamd_mempool_t *pool;
-	gboolean need_lock;
-	rspamd_mempool_mutex_t *mtx;
 };
 
 /**
  * Returns new roll history
  * @param pool pool for shared memory
+ * @param nrows number of rows (HISTORY_DEFAULT_ROWS if 0)
  * @return new structure
  */
-struct roll_history * rspamd_roll_history_new (rspamd_mempool_t *pool);
+struct roll_history * rspamd_roll_history_new (rspamd_mempool_t *pool,
+	guint nrows);
 
 /**
  * Update roll history with data from task
@@ -78,6 +89,16 @@ struct roll_history * rspamd_roll_history_new (rspamd_mempool_t *pool);
 void rspamd_roll_history_update (struct roll_history *history,
 	struct rspamd_task *task);
 
+/**
+ * Copy consistent row of history without locking
+ * @param history roll history object
+ * @param n number of row
+ * @param dest destination row
+ * @return TRUE if a row has been written completely and copied
+ */
+gboolean rspamd_roll_history_get_row (struct roll_history *history, guint n,
+	struct roll_history_row *dest);
+
 /**
  * Load previously saved history from file
  * @param history roll history object
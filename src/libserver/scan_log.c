@@ -0,0 +1,364 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "scan_log.h"
+
+/* Default size of the scan log file of a process */
+#define SCAN_LOG_DEFAULT_SIZE (64 * 1024 * 1024)
+/* Limit of UDP batch to avoid fragmentation */
+#define SCAN_LOG_UDP_BATCH 1400
+/* Incomplete batch is sent if its first record is older than this interval */
+#define SCAN_LOG_UDP_INTERVAL 1.0
+#define SCAN_LOG_DEFAULT_PORT 11336
+
+struct rspamd_scan_log_ctx {
+	pid_t pid;
+	GByteArray *rec;
+	/* File sink */
+	gchar *path;
+	guchar *map;
+	gsize size;
+	gsize used;
+	gint fd;
+	/* UDP sink */
+	gint udp_fd;
+	GByteArray *batch;
+	gdouble batch_start;
+};
+
+/* Sinks of the current process */
+static struct rspamd_scan_log_ctx *scan_log = NULL;
+
+static inline void
+rspamd_scan_log_put8 (GByteArray *ar, guint8 v)
+{
+	g_byte_array_append (ar, &v, sizeof (v));
+}
+
+static inline void
+rspamd_scan_log_put16 (GByteArray *ar, guint16 v)
+{
+	v = htons (v);
+	g_byte_array_append (ar, (const guint8 *)&v, sizeof (v));
+}
+
+static inline void
+rspamd_scan_log_put32 (GByteArray *ar, guint32 v)
+{
+	v = htonl (v);
+	g_byte_array_append (ar, (const guint8 *)&v, sizeof (v));
+}
+
+static inline void
+rspamd_scan_log_put_score (GByteArray *ar, gdouble score)
+{
+	rspamd_scan_log_put32 (ar, (gint32)(score * 1000.0 +
+			(score < 0 ? -0.5 : 0.5)));
+}
+
+static inline void
+rspamd_scan_log_put_str (GByteArray *ar, const gchar *str)
+{
+	gsize len = str ? strlen (str) : 0;
+
+	len = MIN (len, G_MAXUINT8);
+	rspamd_scan_log_put8 (ar, len);
+	g_byte_array_append (ar, (const guint8 *)str, len);
+}
+
+static void
+rspamd_scan_log_build (struct rspamd_task *task, GByteArray *ar)
+{
+	struct metric_result *metric_res;
+	struct symbol *sym;
+	GHashTableIter it;
+	gpointer k, v;
+	gdouble required_score = 0, score = 0;
+	gint action = METRIC_ACTION_NOACTION, af;
+	guint nsymbols = 0, klen;
+	guint8 addr[16];
+	guchar *key;
+	guint32 *plen;
+
+	g_byte_array_set_size (ar, 0);
+	metric_res = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+
+	if (metric_res != NULL) {
+		score = metric_res->score;
+		action = rspamd_check_action_metric (task, metric_res->score,
+				&required_score, metric_res->metric);
+		nsymbols = MIN (g_hash_table_size (metric_res->symbols), G_MAXUINT16);
+	}
+
+	/* Length is filled at the end */
+	rspamd_scan_log_put32 (ar, 0);
+	rspamd_scan_log_put32 (ar, task->tv.tv_sec);
+	rspamd_scan_log_put32 (ar, task->tv.tv_usec);
+	rspamd_scan_log_put32 (ar,
+			(rspamd_get_ticks () - task->time_real) * 1000);
+	rspamd_scan_log_put32 (ar,
+			(rspamd_get_virtual_ticks () - task->time_virtual) * 1000);
+	rspamd_scan_log_put_score (ar, score);
+	rspamd_scan_log_put_score (ar, required_score);
+	rspamd_scan_log_put8 (ar, action);
+
+	memset (addr, 0, sizeof (addr));
+	af = task->from_addr ? rspamd_inet_address_get_af (task->from_addr) : 0;
+
+	if (af == AF_INET || af == AF_INET6) {
+		key = rspamd_inet_address_get_radix_key (task->from_addr, &klen);
+		memcpy (addr, key, MIN (klen, sizeof (addr)));
+		rspamd_scan_log_put8 (ar, af == AF_INET ? 4 : 6);
+	}
+	else {
+		rspamd_scan_log_put8 (ar, 0);
+	}
+
+	rspamd_scan_log_put16 (ar, nsymbols);
+	g_byte_array_append (ar, addr, sizeof (addr));
+	rspamd_scan_log_put_str (ar, task->message_id);
+	rspamd_scan_log_put_str (ar, task->queue_id);
+
+	if (nsymbols > 0) {
+		g_hash_table_iter_init (&it, metric_res->symbols);
+
+		while (nsymbols > 0 && g_hash_table_iter_next (&it, &k, &v)) {
+			sym = v;
+			rspamd_scan_log_put_score (ar, sym->score);
+			rspamd_scan_log_put_str (ar, sym->name);
+			nsymbols --;
+		}
+	}
+
+	plen = (guint32 *)ar->data;
+	*plen = htonl (ar->len);
+}
+
+static gboolean
+rspamd_scan_log_file_open (struct rspamd_scan_log_ctx *ctx)
+{
+	guint16 v;
+	guint64 used;
+
+	ctx->fd = open (ctx->path, O_RDWR | O_CREAT | O_TRUNC, 00640);
+
+	if (ctx->fd == -1) {
+		msg_err ("cannot open scan log %s: %s", ctx->path, strerror (errno));
+		return FALSE;
+	}
+
+	if (ftruncate (ctx->fd, ctx->size) == -1) {
+		msg_err ("cannot allocate %z bytes for scan log %s: %s", ctx->size,
+				ctx->path, strerror (errno));
+		close (ctx->fd);
+		ctx->fd = -1;
+		return FALSE;
+	}
+
+	ctx->map = mmap (NULL, ctx->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			ctx->fd, 0);
+
+	if (ctx->map == MAP_FAILED) {
+		msg_err ("cannot mmap scan log %s: %s", ctx->path, strerror (errno));
+		ctx->map = NULL;
+		close (ctx->fd);
+		ctx->fd = -1;
+		return FALSE;
+	}
+
+	memcpy (ctx->map, RSPAMD_SCAN_LOG_MAGIC, 4);
+	v = htons (RSPAMD_SCAN_LOG_VERSION);
+	memcpy (ctx->map + 4, &v, sizeof (v));
+	v = 0;
+	memcpy (ctx->map + 6, &v, sizeof (v));
+	ctx->used = RSPAMD_SCAN_LOG_HDR_LEN;
+	used = GUINT64_TO_BE (ctx->used);
+	memcpy (ctx->map + 8, &used, sizeof (used));
+
+	return TRUE;
+}
+
+static void
+rspamd_scan_log_file_close (struct rspamd_scan_log_ctx *ctx)
+{
+	if (ctx->map != NULL) {
+		munmap (ctx->map, ctx->size);
+		ctx->map = NULL;
+	}
+
+	if (ctx->fd != -1) {
+		/* Do not keep preallocated space that is not used */
+		if (ftruncate (ctx->fd, ctx->used) == -1) {
+			msg_warn ("cannot truncate scan log %s: %s", ctx->path,
+					strerror (errno));
+		}
+
+		close (ctx->fd);
+		ctx->fd = -1;
+	}
+}
+
+static void
+rspamd_scan_log_file_append (struct rspamd_scan_log_ctx *ctx,
+	const GByteArray *rec)
+{
+	gchar old_path[PATH_MAX];
+	guint64 used;
+
+	if (ctx->used + rec->len > ctx->size) {
+		if (rec->len + RSPAMD_SCAN_LOG_HDR_LEN > ctx->size) {
+			/* Record cannot fit even in the empty file */
+			return;
+		}
+
+		rspamd_scan_log_file_close (ctx);
+		rspamd_snprintf (old_path, sizeof (old_path), "%s.old", ctx->path);
+
+		if (rename (ctx->path, old_path) == -1) {
+			msg_warn ("cannot rotate scan log %s: %s", ctx->path,
+					strerror (errno));
+		}
+
+		if (!rspamd_scan_log_file_open (ctx)) {
+			return;
+		}
+	}
+
+	memcpy (ctx->map + ctx->used, rec->data, rec->len);
+	ctx->used += rec->len;
+	/* Readers use this length to find the end of the complete records */
+	used = GUINT64_TO_BE (ctx->used);
+	memcpy (ctx->map + 8, &used, sizeof (used));
+}
+
+static void
+rspamd_scan_log_udp_flush (struct rspamd_scan_log_ctx *ctx)
+{
+	if (ctx->batch->len > 0) {
+		if (send (ctx->udp_fd, ctx->batch->data, ctx->batch->len, 0) == -1) {
+			msg_debug ("cannot send scan log batch: %s", strerror (errno));
+		}
+
+		g_byte_array_set_size (ctx->batch, 0);
+	}
+}
+
+static void
+rspamd_scan_log_udp_append (struct rspamd_scan_log_ctx *ctx,
+	const GByteArray *rec)
+{
+	gdouble now = rspamd_get_ticks ();
+
+	if (ctx->batch->len + rec->len > SCAN_LOG_UDP_BATCH) {
+		rspamd_scan_log_udp_flush (ctx);
+	}
+
+	if (ctx->batch->len == 0) {
+		ctx->batch_start = now;
+	}
+
+	g_byte_array_append (ctx->batch, rec->data, rec->len);
+
+	if (ctx->batch->len >= SCAN_LOG_UDP_BATCH ||
+			now - ctx->batch_start > SCAN_LOG_UDP_INTERVAL) {
+		rspamd_scan_log_udp_flush (ctx);
+	}
+}
+
+static struct rspamd_scan_log_ctx *
+rspamd_scan_log_init (struct rspamd_config *cfg)
+{
+	struct rspamd_scan_log_ctx *ctx;
+	GPtrArray *addrs = NULL;
+
+	ctx = g_slice_alloc0 (sizeof (*ctx));
+	ctx->pid = getpid ();
+	ctx->rec = g_byte_array_sized_new (512);
+	ctx->fd = -1;
+	ctx->udp_fd = -1;
+
+	if (cfg->scan_log != NULL) {
+		ctx->path = g_strdup_printf ("%s.%d", cfg->scan_log, (gint)ctx->pid);
+		ctx->size = cfg->scan_log_size > RSPAMD_SCAN_LOG_HDR_LEN ?
+				cfg->scan_log_size : SCAN_LOG_DEFAULT_SIZE;
+
+		if (!rspamd_scan_log_file_open (ctx)) {
+			g_free (ctx->path);
+			ctx->path = NULL;
+		}
+	}
+
+	if (cfg->scan_log_udp != NULL) {
+		if (!rspamd_parse_host_port (cfg->scan_log_udp, &addrs, NULL,
+				SCAN_LOG_DEFAULT_PORT, NULL)) {
+			msg_err ("cannot parse scan log address: %s", cfg->scan_log_udp);
+		}
+		else {
+			ctx->udp_fd = rspamd_inet_address_connect (
+					g_ptr_array_index (addrs, 0), SOCK_DGRAM, TRUE);
+
+			if (ctx->udp_fd == -1) {
+				msg_err ("cannot create socket for scan log %s: %s",
+						cfg->scan_log_udp, strerror (errno));
+			}
+			else {
+				ctx->batch = g_byte_array_sized_new (SCAN_LOG_UDP_BATCH);
+			}
+
+			g_ptr_array_free (addrs, TRUE);
+		}
+	}
+
+	return ctx;
+}
+
+void
+rspamd_scan_log_write (struct rspamd_task *task)
+{
+	struct rspamd_config *cfg = task->cfg;
+
+	if (cfg->scan_log == NULL && cfg->scan_log_udp == NULL) {
+		return;
+	}
+
+	if (scan_log == NULL || scan_log->pid != getpid ()) {
+		/* Sinks are opened for each process */
+		scan_log = rspamd_scan_log_init (cfg);
+	}
+
+	if (scan_log->map == NULL && scan_log->udp_fd == -1) {
+		return;
+	}
+
+	rspamd_scan_log_build (task, scan_log->rec);
+
+	if (scan_log->map != NULL) {
+		rspamd_scan_log_file_append (scan_log, scan_log->rec);
+	}
+
+	if (scan_log->udp_fd != -1) {
+		rspamd_scan_log_udp_append (scan_log, scan_log->rec);
+	}
+}
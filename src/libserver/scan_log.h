@@ -0,0 +1,60 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef RSPAMD_SCAN_LOG_H
+#define RSPAMD_SCAN_LOG_H
+
+#include "config.h"
+
+struct rspamd_task;
+
+/*
+ * Structured log of scans for analytics. Each scan produces a record with
+ * the following layout, all integers are in network byte order and scores
+ * are stored in thousandths:
+ *
+ * u32 length of the whole record
+ * u32 seconds and u32 microseconds of the scan start
+ * u32 real and u32 cpu time of the scan in milliseconds
+ * i32 score, i32 required score
+ * u8 action, u8 address family (0, 4 or 6), u16 number of symbols
+ * u8[16] client address (IPv4 address is stored in the first 4 bytes)
+ * u8 length and message-id, u8 length and queue id
+ * for each symbol: i32 score, u8 length and name
+ *
+ * Records are either appended to a memory mapped file of each process
+ * (`scan_log` option with pid suffix, the previous file is renamed to
+ * `.old` when the current one is full) or sent over UDP in batches. The
+ * file starts with RSPAMD_SCAN_LOG_MAGIC, u16 version, u16 reserved bytes
+ * and u64 length of the written data, followed by records.
+ */
+#define RSPAMD_SCAN_LOG_MAGIC "RSPL"
+#define RSPAMD_SCAN_LOG_VERSION 1
+#define RSPAMD_SCAN_LOG_HDR_LEN 16
+
+/**
+ * Write record of a finished scan to the configured sinks
+ * @param task task object
+ */
+void rspamd_scan_log_write (struct rspamd_task *task);
+
+#endif
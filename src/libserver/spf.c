@@ -48,17 +48,31 @@
 /** SPF limits for avoiding abuse **/
 #define SPF_MAX_NESTING 10
 #define SPF_MAX_DNS_REQUESTS 30
+#define SPF_MAX_RESOLVE_TIME 5.0
+
+struct spf_library_ctx {
+	gint max_dns_nesting;
+	gint max_dns_requests;
+	gdouble max_resolve_time;
+};
+
+static struct spf_library_ctx spf_lib_ctx = {
+	.max_dns_nesting = SPF_MAX_NESTING,
+	.max_dns_requests = SPF_MAX_DNS_REQUESTS,
+	.max_resolve_time = SPF_MAX_RESOLVE_TIME
+};
 
 struct spf_resolved_element {
 	GPtrArray *elts;
 	gchar *cur_domain;
+	gint depth; /* Number of includes and redirects from the top record */
 	gboolean redirected; /* Ingnore level, it's redirected */
 };
 
 struct spf_record {
-	gint nested;
 	gint dns_requests;
 	gint requests_inflight;
+	gdouble start_time;
 
 	guint ttl;
 	GPtrArray *resolved; /* Array of struct spf_resolved_element */
@@ -104,17 +118,58 @@ struct spf_dns_cb {
 
 #define CHECK_REC(rec)                                          \
 	do {                                                        \
-		if ((rec)->nested > SPF_MAX_NESTING ||                  \
-			(rec)->dns_requests > SPF_MAX_DNS_REQUESTS) {       \
-			msg_info ("<%s> spf recursion limit %d is reached, domain: %s", \
-				(rec)->task->message_id, (rec)->dns_requests,   \
-				(rec)->sender_domain);                          \
+		if (!spf_record_check_limits (rec)) {                   \
 			return FALSE;                                       \
 		}                                                       \
 	} while (0)                                                 \
 
 static gboolean start_spf_parse (struct spf_record *rec,
 		struct spf_resolved_element *resolved, gchar *begin);
+static struct spf_resolved_element * rspamd_spf_new_addr_list (
+		struct spf_record *rec, const gchar *domain);
+
+/* Check whether record is allowed to make more DNS requests */
+static gboolean
+spf_record_check_limits (struct spf_record *rec)
+{
+	if (rec->dns_requests > spf_lib_ctx.max_dns_requests) {
+		msg_info ("<%s> spf dns requests limit %d is reached, domain: %s",
+			rec->task->message_id, rec->dns_requests,
+			rec->sender_domain);
+		return FALSE;
+	}
+
+	if (spf_lib_ctx.max_resolve_time > 0 &&
+			rspamd_get_ticks () - rec->start_time >
+			spf_lib_ctx.max_resolve_time) {
+		msg_info ("<%s> spf resolve time limit %.2f is reached, domain: %s",
+			rec->task->message_id, spf_lib_ctx.max_resolve_time,
+			rec->sender_domain);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Create list of addresses for the record included from the current one */
+static struct spf_resolved_element *
+rspamd_spf_new_nested_list (struct spf_record *rec,
+		struct spf_resolved_element *parent, const gchar *domain)
+{
+	struct spf_resolved_element *resolved;
+
+	if (parent->depth >= spf_lib_ctx.max_dns_nesting) {
+		msg_info ("<%s> spf nesting limit %d is reached, domain: %s",
+			rec->task->message_id, spf_lib_ctx.max_dns_nesting,
+			rec->sender_domain);
+		return NULL;
+	}
+
+	resolved = rspamd_spf_new_addr_list (rec, domain);
+	resolved->depth = parent->depth + 1;
+
+	return resolved;
+}
 
 /* Determine spf mech */
 static spf_mech_t
@@ -179,6 +234,7 @@ rspamd_spf_new_addr_list (struct spf_record *rec, const gchar *domain)
 
 	resolved = g_slice_alloc (sizeof (*resolved));
 	resolved->redirected = FALSE;
+	resolved->depth = 0;
 	resolved->cur_domain = g_strdup (domain);
 	resolved->elts = g_ptr_array_new_full (8, rspamd_spf_free_addr);
 
@@ -449,6 +505,10 @@ spf_record_dns_callback (struct rdns_reply *reply, gpointer arg)
 			switch (cb->cur_action) {
 			case SPF_RESOLVE_MX:
 				if (elt_data->type == RDNS_REQUEST_MX) {
+					if (!spf_record_check_limits (cb->rec)) {
+						break;
+					}
+
 					/* Now resolve A record for this MX */
 					msg_debug ("resolve %s after resolving of MX",
 							elt_data->content.mx.name);
@@ -478,7 +538,8 @@ spf_record_dns_callback (struct rdns_reply *reply, gpointer arg)
 			case SPF_RESOLVE_PTR:
 				if (elt_data->type == RDNS_REQUEST_PTR) {
 					/* Validate returned records prior to making A requests */
-					if (spf_check_ptr_host (cb, elt_data->content.ptr.name)) {
+					if (spf_check_ptr_host (cb, elt_data->content.ptr.name) &&
+							spf_record_check_limits (cb->rec)) {
 						msg_debug ("resolve %s after resolving of PTR",
 								elt_data->content.ptr.name);
 						if (make_dns_request (task->resolver, task->s,
@@ -609,10 +670,10 @@ spf_record_dns_callback (struct rdns_reply *reply, gpointer arg)
  * dual-cidr-length = [ ip4-cidr-length ] [ "/" ip6-cidr-length ]
  */
 static const gchar *
-parse_spf_domain_mask (struct spf_record *rec, struct spf_addr *addr,
+parse_spf_domain_mask (struct spf_record *rec,
+		struct spf_resolved_element *resolved, struct spf_addr *addr,
 		gboolean allow_mask)
 {
-	struct spf_resolved_element *resolved;
 	struct rspamd_task *task = rec->task;
 	enum {
 		parse_spf_elt = 0,
@@ -629,7 +690,6 @@ parse_spf_domain_mask (struct spf_record *rec, struct spf_addr *addr,
 	gchar t;
 	guint16 cur_mask = 0;
 
-	resolved = g_ptr_array_index (rec->resolved, rec->resolved->len - 1);
 	host = resolved->cur_domain;
 	c = p;
 
@@ -735,17 +795,16 @@ parse_spf_domain_mask (struct spf_record *rec, struct spf_addr *addr,
 }
 
 static gboolean
-parse_spf_a (struct spf_record *rec, struct spf_addr *addr)
+parse_spf_a (struct spf_record *rec,
+		struct spf_resolved_element *resolved, struct spf_addr *addr)
 {
 	struct spf_dns_cb *cb;
 	const gchar *host = NULL;
 	struct rspamd_task *task = rec->task;
-	struct spf_resolved_element *resolved;
 
-	resolved = g_ptr_array_index (rec->resolved, rec->resolved->len - 1);
 	CHECK_REC (rec);
 
-	host = parse_spf_domain_mask (rec, addr, TRUE);
+	host = parse_spf_domain_mask (rec, resolved, addr, TRUE);
 
 	if (host == NULL) {
 		return FALSE;
@@ -771,18 +830,17 @@ parse_spf_a (struct spf_record *rec, struct spf_addr *addr)
 }
 
 static gboolean
-parse_spf_ptr (struct spf_record *rec, struct spf_addr *addr)
+parse_spf_ptr (struct spf_record *rec,
+		struct spf_resolved_element *resolved, struct spf_addr *addr)
 {
 	struct spf_dns_cb *cb;
 	const gchar *host;
 	gchar *ptr;
 	struct rspamd_task *task = rec->task;
-	struct spf_resolved_element *resolved;
 
-	resolved = g_ptr_array_index (rec->resolved, rec->resolved->len - 1);
 	CHECK_REC (rec);
 
-	host = parse_spf_domain_mask (rec, addr, FALSE);
+	host = parse_spf_domain_mask (rec, resolved, addr, FALSE);
 
 	rec->dns_requests++;
 	cb = rspamd_mempool_alloc (task->task_pool, sizeof (struct spf_dns_cb));
@@ -813,18 +871,16 @@ parse_spf_ptr (struct spf_record *rec, struct spf_addr *addr)
 }
 
 static gboolean
-parse_spf_mx (struct spf_record *rec, struct spf_addr *addr)
+parse_spf_mx (struct spf_record *rec,
+		struct spf_resolved_element *resolved, struct spf_addr *addr)
 {
 	struct spf_dns_cb *cb;
 	const gchar *host;
 	struct rspamd_task *task = rec->task;
-	struct spf_resolved_element *resolved;
-
-	resolved = g_ptr_array_index (rec->resolved, rec->resolved->len - 1);
 
 	CHECK_REC (rec);
 
-	host = parse_spf_domain_mask (rec, addr, TRUE);
+	host = parse_spf_domain_mask (rec, resolved, addr, TRUE);
 
 	if (host == NULL) {
 		return FALSE;
@@ -871,8 +927,6 @@ parse_spf_ip4 (struct spf_record *rec, struct spf_addr *addr)
 	gchar ipbuf[INET_ADDRSTRLEN + 1];
 	guint32 mask;
 
-	CHECK_REC (rec);
-
 	semicolon = strchr (addr->spf_string, ':');
 
 	if (semicolon == NULL) {
@@ -920,8 +974,6 @@ parse_spf_ip6 (struct spf_record *rec, struct spf_addr *addr)
 	gchar ipbuf[INET6_ADDRSTRLEN + 1];
 	guint32 mask;
 
-	CHECK_REC (rec);
-
 	semicolon = strchr (addr->spf_string, ':');
 
 	if (semicolon == NULL) {
@@ -962,11 +1014,13 @@ parse_spf_ip6 (struct spf_record *rec, struct spf_addr *addr)
 
 
 static gboolean
-parse_spf_include (struct spf_record *rec, struct spf_addr *addr)
+parse_spf_include (struct spf_record *rec,
+		struct spf_resolved_element *resolved, struct spf_addr *addr)
 {
 	struct spf_dns_cb *cb;
 	const gchar *domain;
 	struct rspamd_task *task = rec->task;
+	struct spf_resolved_element *nested;
 
 	CHECK_REC (rec);
 	domain = strchr (addr->spf_string, ':');
@@ -976,6 +1030,12 @@ parse_spf_include (struct spf_record *rec, struct spf_addr *addr)
 	}
 
 	domain++;
+	addr->m.idx = rec->resolved->len;
+	nested = rspamd_spf_new_nested_list (rec, resolved, domain);
+
+	if (nested == NULL) {
+		return FALSE;
+	}
 
 	rec->dns_requests++;
 
@@ -983,8 +1043,7 @@ parse_spf_include (struct spf_record *rec, struct spf_addr *addr)
 	cb->rec = rec;
 	cb->addr = addr;
 	cb->cur_action = SPF_RESOLVE_INCLUDE;
-	addr->m.idx = rec->resolved->len;
-	cb->resolved = rspamd_spf_new_addr_list (rec, domain);
+	cb->resolved = nested;
 	/* Set reference */
 	addr->flags |= RSPAMD_SPF_FLAG_REFRENCE;
 	msg_debug ("resolve include %s", domain);
@@ -1004,8 +1063,6 @@ parse_spf_include (struct spf_record *rec, struct spf_addr *addr)
 static gboolean
 parse_spf_exp (struct spf_record *rec, struct spf_addr *addr)
 {
-	CHECK_REC (rec);
-
 	msg_info ("exp record is ignored");
 	return TRUE;
 }
@@ -1018,6 +1075,7 @@ parse_spf_redirect (struct spf_record *rec,
 	const gchar *domain;
 	struct spf_addr *cur;
 	struct rspamd_task *task = rec->task;
+	struct spf_resolved_element *nested;
 	guint i;
 
 	CHECK_REC (rec);
@@ -1029,6 +1087,13 @@ parse_spf_redirect (struct spf_record *rec,
 	}
 
 	domain++;
+	/* Reference is the index of the new list */
+	addr->m.idx = rec->resolved->len;
+	nested = rspamd_spf_new_nested_list (rec, resolved, domain);
+
+	if (nested == NULL) {
+		return FALSE;
+	}
 
 	rec->dns_requests++;
 	resolved->redirected = TRUE;
@@ -1045,12 +1110,11 @@ parse_spf_redirect (struct spf_record *rec,
 	cb = rspamd_mempool_alloc (task->task_pool, sizeof (struct spf_dns_cb));
 	/* Set reference */
 	addr->flags |= RSPAMD_SPF_FLAG_REFRENCE;
-	addr->m.idx = rec->resolved->len;
 
 	cb->rec = rec;
 	cb->addr = addr;
 	cb->cur_action = SPF_RESOLVE_REDIRECT;
-	cb->resolved = rspamd_spf_new_addr_list (rec, domain);
+	cb->resolved = nested;
 	msg_debug ("resolve redirect %s", domain);
 
 	if (make_dns_request (task->resolver, task->s, task->task_pool,
@@ -1065,14 +1129,13 @@ parse_spf_redirect (struct spf_record *rec,
 }
 
 static gboolean
-parse_spf_exists (struct spf_record *rec, struct spf_addr *addr)
+parse_spf_exists (struct spf_record *rec,
+		struct spf_resolved_element *resolved, struct spf_addr *addr)
 {
 	struct spf_dns_cb *cb;
 	const gchar *host;
 	struct rspamd_task *task = rec->task;
-	struct spf_resolved_element *resolved;
 
-	resolved = g_ptr_array_index (rec->resolved, rec->resolved->len - 1);
 	CHECK_REC (rec);
 
 	host = strchr (addr->spf_string, ':');
@@ -1135,6 +1198,7 @@ reverse_spf_ip (gchar *ip, gint len)
 
 static const gchar *
 expand_spf_macro (struct spf_record *rec,
+	struct spf_resolved_element *resolved,
 	const gchar *begin)
 {
 	const gchar *p;
@@ -1143,13 +1207,11 @@ expand_spf_macro (struct spf_record *rec,
 	gchar ip_buf[INET6_ADDRSTRLEN];
 	gboolean need_expand = FALSE;
 	struct rspamd_task *task;
-	struct spf_resolved_element *resolved;
 
 	g_assert (rec != NULL);
 	g_assert (begin != NULL);
 
 	task = rec->task;
-	resolved = g_ptr_array_index (rec->resolved, rec->resolved->len - 1);
 	p = begin;
 	/* Calculate length */
 	while (*p) {
@@ -1413,7 +1475,7 @@ parse_spf_record (struct spf_record *rec, struct spf_resolved_element *resolved,
 	}
 
 	task = rec->task;
-	begin = expand_spf_macro (rec, elt);
+	begin = expand_spf_macro (rec, resolved, elt);
 	addr = rspamd_spf_new_addr (rec, resolved, begin);
 	g_assert (addr != NULL);
 	t = g_ascii_tolower (addr->spf_string[0]);
@@ -1429,7 +1491,7 @@ parse_spf_record (struct spf_record *rec, struct spf_resolved_element *resolved,
 		}
 		else if (g_ascii_strncasecmp (begin, SPF_A,
 				sizeof (SPF_A) - 1) == 0) {
-			res = parse_spf_a (rec, addr);
+			res = parse_spf_a (rec, resolved, addr);
 		}
 		else {
 			msg_info ("<%s>: spf error for domain %s: bad spf command %s",
@@ -1444,7 +1506,7 @@ parse_spf_record (struct spf_record *rec, struct spf_resolved_element *resolved,
 		}
 		else if (g_ascii_strncasecmp (begin, SPF_INCLUDE,
 				sizeof (SPF_INCLUDE) - 1) == 0) {
-			res = parse_spf_include (rec, addr);
+			res = parse_spf_include (rec, resolved, addr);
 		}
 		else if (g_ascii_strncasecmp (begin, SPF_IP6, sizeof (SPF_IP6) -
 				1) == 0) {
@@ -1458,7 +1520,7 @@ parse_spf_record (struct spf_record *rec, struct spf_resolved_element *resolved,
 	case 'm':
 		/* mx */
 		if (g_ascii_strncasecmp (begin, SPF_MX, sizeof (SPF_MX) - 1) == 0) {
-			res = parse_spf_mx (rec, addr);
+			res = parse_spf_mx (rec, resolved, addr);
 		}
 		else {
 			msg_info ("<%s>: spf error for domain %s: bad spf command %s",
@@ -1469,7 +1531,7 @@ parse_spf_record (struct spf_record *rec, struct spf_resolved_element *resolved,
 		/* ptr */
 		if (g_ascii_strncasecmp (begin, SPF_PTR,
 				sizeof (SPF_PTR) - 1) == 0) {
-			res = parse_spf_ptr (rec, addr);
+			res = parse_spf_ptr (rec, resolved, addr);
 		}
 		else {
 			msg_info ("<%s>: spf error for domain %s: bad spf command %s",
@@ -1484,7 +1546,7 @@ parse_spf_record (struct spf_record *rec, struct spf_resolved_element *resolved,
 		}
 		else if (g_ascii_strncasecmp (begin, SPF_EXISTS,
 				sizeof (SPF_EXISTS) - 1) == 0) {
-			res = parse_spf_exists (rec, addr);
+			res = parse_spf_exists (rec, resolved, addr);
 		}
 		else {
 			msg_info ("<%s>: spf error for domain %s: bad spf command %s",
@@ -1548,11 +1610,59 @@ parse_spf_scopes (struct spf_record *rec, gchar **begin)
 	}
 }
 
+/*
+ * Find terms of record that require DNS requests, so the whole record can be
+ * checked against the limits before any request is sent
+ */
+static gint
+spf_prescan_record (gchar **elts, gboolean *has_all, gint *redirect)
+{
+	const gchar *elt;
+	gint nrequests = 0, i;
+
+	*has_all = FALSE;
+	*redirect = -1;
+
+	for (i = 0; elts[i] != NULL; i ++) {
+		elt = elts[i];
+
+		if (*elt == '+' || *elt == '-' || *elt == '~' || *elt == '?') {
+			elt ++;
+		}
+
+		if (g_ascii_strncasecmp (elt, SPF_ALL, sizeof (SPF_ALL) - 1) == 0) {
+			*has_all = TRUE;
+		}
+		else if (g_ascii_strncasecmp (elt, SPF_REDIRECT,
+				sizeof (SPF_REDIRECT) - 1) == 0) {
+			if (*redirect == -1) {
+				*redirect = i;
+			}
+		}
+		else if (g_ascii_strncasecmp (elt, SPF_INCLUDE,
+				sizeof (SPF_INCLUDE) - 1) == 0 ||
+				g_ascii_strncasecmp (elt, SPF_EXISTS,
+				sizeof (SPF_EXISTS) - 1) == 0 ||
+				g_ascii_strncasecmp (elt, SPF_PTR,
+				sizeof (SPF_PTR) - 1) == 0 ||
+				g_ascii_strncasecmp (elt, SPF_MX,
+				sizeof (SPF_MX) - 1) == 0 ||
+				g_ascii_strncasecmp (elt, SPF_A,
+				sizeof (SPF_A) - 1) == 0) {
+			nrequests ++;
+		}
+	}
+
+	return nrequests;
+}
+
 static gboolean
 start_spf_parse (struct spf_record *rec, struct spf_resolved_element *resolved,
 		gchar *begin)
 {
 	gchar **elts, **cur_elt;
+	gboolean has_all;
+	gint nrequests, redirect, i;
 
 	/* Skip spaces */
 	while (g_ascii_isspace (*begin)) {
@@ -1596,11 +1706,40 @@ start_spf_parse (struct spf_record *rec, struct spf_resolved_element *resolved,
 	elts = g_strsplit_set (begin, " ", 0);
 
 	if (elts) {
-		cur_elt = elts;
+		nrequests = spf_prescan_record (elts, &has_all, &redirect);
+
+		if (redirect != -1) {
+			if (has_all) {
+				/* Redirect is ignored if there is `all` (RFC 7208, 6.1) */
+				msg_info ("<%s>: spf error for domain %s: redirect is ignored "
+						"as the record of %s has `all`",
+						rec->task->message_id, rec->sender_domain,
+						resolved->cur_domain);
+			}
+			else {
+				/* Other terms are not used if there is redirect */
+				nrequests = 1;
+			}
+		}
+
+		if (rec->dns_requests + nrequests > spf_lib_ctx.max_dns_requests) {
+			msg_info ("<%s>: spf error for domain %s: record of %s needs %d "
+					"dns requests, %d are allowed",
+					rec->task->message_id, rec->sender_domain,
+					resolved->cur_domain, nrequests,
+					spf_lib_ctx.max_dns_requests - rec->dns_requests);
+			g_strfreev (elts);
+
+			return FALSE;
+		}
+
+		/* Now send all requests of this record at once */
+		for (cur_elt = elts, i = 0; *cur_elt; cur_elt ++, i ++) {
+			if (redirect != -1 && (has_all ? i == redirect : i != redirect)) {
+				continue;
+			}
 
-		while (*cur_elt) {
 			parse_spf_record (rec, resolved, *cur_elt);
-			cur_elt ++;
 		}
 
 		g_strfreev (elts);
@@ -1667,6 +1806,7 @@ resolve_spf (struct rspamd_task *task, spf_cb_t callback)
 	rec = rspamd_mempool_alloc0 (task->task_pool, sizeof (struct spf_record));
 	rec->task = task;
 	rec->callback = callback;
+	rec->start_time = rspamd_get_ticks ();
 
 	rec->resolved = g_ptr_array_sized_new (8);
 
@@ -1705,6 +1845,15 @@ resolve_spf (struct rspamd_task *task, spf_cb_t callback)
 	return FALSE;
 }
 
+void
+spf_library_config (gint max_dns_requests, gint max_dns_nesting,
+	gdouble max_resolve_time)
+{
+	spf_lib_ctx.max_dns_requests = max_dns_requests;
+	spf_lib_ctx.max_dns_nesting = max_dns_nesting;
+	spf_lib_ctx.max_resolve_time = max_resolve_time;
+}
+
 struct spf_resolved *
 spf_record_ref (struct spf_resolved *rec)
 {
@@ -1717,3 +1866,111 @@ spf_record_unref (struct spf_resolved *rec)
 {
 	REF_RELEASE (rec);
 }
+
+/* Serialized record is a header, domain and elements followed by strings */
+struct spf_serialized_hdr {
+	guint32 ttl;
+	guint32 nelts;
+	guint32 domain_len;
+};
+
+struct spf_serialized_addr {
+	guchar addr6[sizeof (struct in6_addr)];
+	guchar addr4[sizeof (struct in_addr)];
+	guint32 idx;
+	guint32 flags;
+	guint32 mech;
+	guint32 str_len;
+};
+
+void
+spf_record_serialize (struct spf_resolved *rec, GByteArray *out)
+{
+	struct spf_serialized_hdr hdr;
+	struct spf_serialized_addr saddr;
+	struct spf_addr *addr;
+	guint i;
+
+	hdr.ttl = rec->ttl;
+	hdr.nelts = rec->elts->len;
+	hdr.domain_len = rec->domain ? strlen (rec->domain) : 0;
+	g_byte_array_append (out, (const guint8 *)&hdr, sizeof (hdr));
+
+	if (hdr.domain_len > 0) {
+		g_byte_array_append (out, (const guint8 *)rec->domain, hdr.domain_len);
+	}
+
+	for (i = 0; i < rec->elts->len; i ++) {
+		addr = &g_array_index (rec->elts, struct spf_addr, i);
+		memcpy (saddr.addr6, addr->addr6, sizeof (saddr.addr6));
+		memcpy (saddr.addr4, addr->addr4, sizeof (saddr.addr4));
+		saddr.idx = addr->m.idx;
+		saddr.flags = addr->flags;
+		saddr.mech = addr->mech;
+		saddr.str_len = addr->spf_string ? strlen (addr->spf_string) : 0;
+		g_byte_array_append (out, (const guint8 *)&saddr, sizeof (saddr));
+
+		if (saddr.str_len > 0) {
+			g_byte_array_append (out, (const guint8 *)addr->spf_string,
+					saddr.str_len);
+		}
+	}
+}
+
+struct spf_resolved *
+spf_record_deserialize (const guchar *data, gsize len)
+{
+	struct spf_serialized_hdr hdr;
+	struct spf_serialized_addr saddr;
+	struct spf_resolved *res;
+	struct spf_addr addr;
+	const guchar *p = data, *end = data + len;
+	guint i;
+
+	if (len < sizeof (hdr)) {
+		return NULL;
+	}
+
+	memcpy (&hdr, p, sizeof (hdr));
+	p += sizeof (hdr);
+
+	if (hdr.domain_len > (gsize)(end - p)) {
+		return NULL;
+	}
+
+	res = g_slice_alloc (sizeof (*res));
+	res->elts = g_array_sized_new (FALSE, FALSE, sizeof (struct spf_addr),
+			hdr.nelts);
+	res->domain = hdr.domain_len > 0 ? g_strndup ((const gchar *)p, hdr.domain_len) : NULL;
+	res->ttl = hdr.ttl;
+	REF_INIT_RETAIN (res, rspamd_flatten_record_dtor);
+	p += hdr.domain_len;
+
+	for (i = 0; i < hdr.nelts; i ++) {
+		if ((gsize)(end - p) < sizeof (saddr)) {
+			REF_RELEASE (res);
+			return NULL;
+		}
+
+		memcpy (&saddr, p, sizeof (saddr));
+		p += sizeof (saddr);
+
+		if (saddr.str_len > (gsize)(end - p)) {
+			REF_RELEASE (res);
+			return NULL;
+		}
+
+		memset (&addr, 0, sizeof (addr));
+		memcpy (addr.addr6, saddr.addr6, sizeof (addr.addr6));
+		memcpy (addr.addr4, saddr.addr4, sizeof (addr.addr4));
+		addr.m.idx = saddr.idx;
+		addr.flags = saddr.flags;
+		addr.mech = saddr.mech;
+		addr.spf_string = saddr.str_len > 0 ?
+				g_strndup ((const gchar *)p, saddr.str_len) : NULL;
+		p += saddr.str_len;
+		g_array_append_val (res->elts, addr);
+	}
+
+	return res;
+}
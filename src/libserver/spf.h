@@ -68,6 +68,14 @@ gboolean resolve_spf (struct rspamd_task *task, spf_cb_t callback);
 const gchar * get_spf_domain (struct rspamd_task *task);
 
 
+/*
+ * Set limits for each record: the total number of DNS requests, the depth of
+ * includes and redirects and the time in seconds to send new requests (0 to
+ * disable the time limit)
+ */
+void spf_library_config (gint max_dns_requests, gint max_dns_nesting,
+	gdouble max_resolve_time);
+
 /*
  * Increase refcount
  */
@@ -78,4 +86,14 @@ struct spf_resolved * spf_record_ref (struct spf_resolved *rec);
  */
 void spf_record_unref (struct spf_resolved *rec);
 
+/*
+ * Write flattened record to a flat buffer, e.g. to store it in shared memory
+ */
+void spf_record_serialize (struct spf_resolved *rec, GByteArray *out);
+
+/*
+ * Restore flattened record from a buffer, returns NULL if buffer is invalid
+ */
+struct spf_resolved * spf_record_deserialize (const guchar *data, gsize len);
+
 #endif
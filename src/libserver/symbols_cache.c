@@ -28,6 +28,11 @@
 #include "message.h"
 #include "symbols_cache.h"
 #include "cfg_file.h"
+#include "filter.h"
+#include "lua/lua_common.h"
+
+#define msg_debug_cache(...) msg_debug_module (RSPAMD_LOG_MODULE_SYMBOLS, \
+		__VA_ARGS__)
 
 #define WEIGHT_MULT 4.0
 #define FREQUENCY_MULT 10.0
@@ -35,19 +40,27 @@
 
 /* After which number of messages try to resort cache */
 #define MAX_USES 100
+/* Maximum interval between merges of local counters (seconds) */
+#define COUNTERS_MERGE_INTERVAL 10.0
 /*
  * Symbols cache utility functions
  */
 
 #define MIN_CACHE 17
 
+#ifndef NBBY
+#define NBBY 8
+#endif
+#define NBYTES(nbits) (((nbits) + NBBY - 1) / NBBY)
+
 static guint64 total_frequency = 0;
 static guint32 nsymbols = 0;
 
-gint
-cache_cmp (const void *p1, const void *p2)
+static gint
+cache_cmp (gconstpointer p1, gconstpointer p2)
 {
-	const struct cache_item *i1 = p1, *i2 = p2;
+	const struct cache_item *i1 = *(struct cache_item **)p1,
+			*i2 = *(struct cache_item **)p2;
 
 	return strcmp (i1->s->symbol, i2->s->symbol);
 }
@@ -56,14 +69,21 @@ cache_cmp (const void *p1, const void *p2)
 #define TIME_ALPHA (1.0 / 10000000.0)
 #define SCORE_FUN(w, f, t) (((w) > 0 ? (w) : 1) * ((f) > 0 ? (f) : 1) / (t > TIME_ALPHA ? t : TIME_ALPHA))
 
-gint
-cache_logic_cmp (const void *p1, const void *p2)
+static gint
+cache_logic_cmp (gconstpointer p1, gconstpointer p2)
 {
-	const struct cache_item *i1 = p1, *i2 = p2;
+	const struct cache_item *i1 = *(struct cache_item **)p1,
+			*i2 = *(struct cache_item **)p2;
 	double w1, w2;
 	double weight1, weight2;
 	double f1 = 0, f2 = 0, t1, t2;
 
+	/* Negative items are always checked first */
+	if ((i1->flags & RSPAMD_SYMBOL_FLAG_NEGATIVE) !=
+			(i2->flags & RSPAMD_SYMBOL_FLAG_NEGATIVE)) {
+		return (i1->flags & RSPAMD_SYMBOL_FLAG_NEGATIVE) ? -1 : 1;
+	}
+
 	if (i1->priority == 0 && i2->priority == 0) {
 		f1 = (double)i1->s->frequency;
 		f2 = (double)i2->s->frequency;
@@ -73,7 +93,7 @@ cache_logic_cmp (const void *p1, const void *p2)
 		t2 = i2->s->avg_time / 1000000.0;
 		w1 = SCORE_FUN (abs (weight1), f1, t1);
 		w2 = SCORE_FUN (abs (weight2), f2, t2);
-		msg_debug ("%s -> %.2f, %s -> %.2f", i1->s->symbol, w1, i2->s->symbol, w2);
+		msg_debug_cache ("%s -> %.2f, %s -> %.2f", i1->s->symbol, w1, i2->s->symbol, w2);
 	}
 	else {
 		/* Strict sorting */
@@ -84,94 +104,162 @@ cache_logic_cmp (const void *p1, const void *p2)
 	return (gint)w2 - w1;
 }
 
-/**
- * Set counter for a symbol
- */
-static double
-rspamd_set_counter (struct cache_item *item, guint32 value)
+void
+rspamd_symbols_cache_inc_frequency (struct cache_item *item)
 {
+	g_atomic_int_inc (&item->local->frequency);
+}
+
+void
+rspamd_symbols_cache_merge_counters (struct symbols_cache *cache)
+{
+	struct cache_item *item;
 	struct counter_data *cd;
-	cd = item->cd;
+	gint freq;
+	guint i;
 
-	/* Cumulative moving average */
-	rspamd_mempool_lock_mutex (item->mtx);
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
 
-	if (cd->number == 0) {
-		cd->value = 0;
-	}
+		/* Frequency can be incremented from classifier threads */
+		do {
+			freq = g_atomic_int_get (&item->local->frequency);
+		} while (freq != 0 && !g_atomic_int_compare_and_exchange (
+				&item->local->frequency, freq, 0));
 
-	cd->value = cd->value + (value - cd->value) / (++cd->number);
+		if (freq == 0 && item->local->checks == 0) {
+			continue;
+		}
+
+		cd = item->cd;
+		rspamd_mempool_lock_mutex (item->mtx);
+
+		item->s->frequency += freq;
 
-	rspamd_mempool_unlock_mutex (item->mtx);
+		if (item->local->checks > 0) {
+			/* Cumulative moving average of all checks */
+			cd->value = (cd->value * cd->number + item->local->time_sum) /
+					(cd->number + item->local->checks);
+			cd->number += item->local->checks;
+			item->s->avg_time = cd->value;
+
+			if (item->hist != NULL) {
+				rspamd_histogram_merge (item->hist, item->local->hist);
+				rspamd_histogram_reset (item->local->hist);
+			}
+		}
 
-	return cd->value;
+		rspamd_mempool_unlock_mutex (item->mtx);
+
+		item->local->checks = 0;
+		item->local->time_sum = 0;
+	}
+
+	cache->last_merge = rspamd_get_ticks ();
 }
 
 static GChecksum *
 get_mem_cksum (struct symbols_cache *cache)
 {
 	GChecksum *result;
-	GList *cur, *l;
+	GPtrArray *sorted;
 	struct cache_item *item;
+	guint i;
 
 	result = g_checksum_new (G_CHECKSUM_SHA1);
 
-	l = g_list_copy (cache->negative_items);
-	l = g_list_sort (l, cache_cmp);
-	cur = g_list_first (l);
-	while (cur) {
-		item = cur->data;
-		if (item->s->symbol[0] != '\0') {
-			g_checksum_update (result, item->s->symbol,
-				strlen (item->s->symbol));
-		}
-		cur = g_list_next (cur);
+	sorted = g_ptr_array_sized_new (cache->items_by_id->len);
+
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		g_ptr_array_add (sorted, g_ptr_array_index (cache->items_by_id, i));
 	}
-	g_list_free (l);
 
+	g_ptr_array_sort (sorted, cache_cmp);
+
+	for (i = 0; i < sorted->len; i ++) {
+		item = g_ptr_array_index (sorted, i);
 
-	l = g_list_copy (cache->static_items);
-	l = g_list_sort (l, cache_cmp);
-	cur = g_list_first (l);
-	while (cur) {
-		item = cur->data;
 		if (item->s->symbol[0] != '\0') {
 			g_checksum_update (result, item->s->symbol,
 				strlen (item->s->symbol));
 		}
-		total_frequency += item->s->frequency;
-		cur = g_list_next (cur);
 	}
-	g_list_free (l);
+
+	g_ptr_array_free (sorted, TRUE);
 
 	return result;
 }
 
+static void rspamd_symbols_cache_calculate_weights (
+		struct symbols_cache *cache);
+
 /* Sort items in logical order */
 static void
 post_cache_init (struct symbols_cache *cache)
 {
-	GList *cur;
 	struct cache_item *item;
+	guint i;
 
 	total_frequency = 0;
 	nsymbols = cache->used_items;
-	cur = g_list_first (cache->negative_items);
-	while (cur) {
-		item = cur->data;
+
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
 		total_frequency += item->s->frequency;
-		cur = g_list_next (cur);
 	}
-	cur = g_list_first (cache->static_items);
-	while (cur) {
-		item = cur->data;
-		total_frequency += item->s->frequency;
-		cur = g_list_next (cur);
+
+	g_ptr_array_sort (cache->items_by_order, cache_logic_cmp);
+
+	if (cache->metric_weights != NULL) {
+		/* Weights could be changed dynamically */
+		rspamd_symbols_cache_calculate_weights (cache);
+	}
+}
+
+/*
+ * Move all items registered so far to a single contiguous array, so
+ * processing of symbols doesn't need to chase pointers over the pool
+ */
+static void
+rspamd_symbols_cache_compact (struct symbols_cache *cache)
+{
+	struct cache_item *items, *item;
+	guint i, nitems;
+
+	nitems = cache->items_by_id->len;
+
+	if (nitems == 0 || cache->items != NULL) {
+		return;
 	}
 
-	cache->negative_items =
-		g_list_sort (cache->negative_items, cache_logic_cmp);
-	cache->static_items = g_list_sort (cache->static_items, cache_logic_cmp);
+	items = g_new (struct cache_item, nitems);
+	cache->counters = g_new0 (struct cache_item_counters, nitems);
+	cache->local_hists = g_new0 (struct rspamd_histogram, nitems);
+
+	for (i = 0; i < nitems; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
+		memcpy (&items[i], item, sizeof (*item));
+		memcpy (&cache->counters[i], item->local, sizeof (*item->local));
+
+		if (item->local->hist != NULL) {
+			memcpy (&cache->local_hists[i], item->local->hist,
+					sizeof (struct rspamd_histogram));
+			cache->counters[i].hist = &cache->local_hists[i];
+		}
+
+		items[i].local = &cache->counters[i];
+		g_ptr_array_index (cache->items_by_id, i) = &items[i];
+		g_hash_table_insert (cache->items_by_symbol, items[i].s->symbol,
+				&items[i]);
+	}
+
+	g_ptr_array_set_size (cache->items_by_order, 0);
+
+	for (i = 0; i < nitems; i ++) {
+		g_ptr_array_add (cache->items_by_order, &items[i]);
+	}
+
+	cache->items = items;
 }
 
 /* Unmap cache file */
@@ -181,20 +269,36 @@ unmap_cache_file (gpointer arg)
 	struct symbols_cache *cache = arg;
 
 	/* A bit ugly usage */
-	munmap (cache->map, cache->used_items * sizeof (struct saved_cache_item));
+	munmap (cache->map, cache->map_len);
 }
 
 static gboolean
 mmap_cache_file (struct symbols_cache *cache, gint fd, rspamd_mempool_t *pool)
 {
 	guint8 *map;
-	gint i;
-	GList *cur;
+	guint i, nrecords;
+	struct stat st;
+	struct saved_cache_item *rec;
 	struct cache_item *item;
 
 	if (cache->used_items > 0) {
+		if (fstat (fd, &st) == -1) {
+			msg_err ("cannot stat cache file: %d, %s", errno, strerror (errno));
+			close (fd);
+			return FALSE;
+		}
+
+		nrecords = MIN (cache->used_items,
+				st.st_size / sizeof (struct saved_cache_item));
+
+		if (nrecords == 0) {
+			close (fd);
+			post_cache_init (cache);
+			return TRUE;
+		}
+
 		map = mmap (NULL,
-				cache->used_items * sizeof (struct saved_cache_item),
+				nrecords * sizeof (struct saved_cache_item),
 				PROT_READ | PROT_WRITE,
 				MAP_SHARED,
 				fd,
@@ -207,25 +311,17 @@ mmap_cache_file (struct symbols_cache *cache, gint fd, rspamd_mempool_t *pool)
 		/* Close descriptor as it would never be used */
 		close (fd);
 		cache->map = map;
-		/* Now free old values for saved cache items and fill them with mmapped ones */
-		i = 0;
-		cur = g_list_first (cache->negative_items);
-		while (cur) {
-			item = cur->data;
-			item->s =
-				(struct saved_cache_item *)(map + i *
-				sizeof (struct saved_cache_item));
-			cur = g_list_next (cur);
-			i++;
-		}
-		cur = g_list_first (cache->static_items);
-		while (cur) {
-			item = cur->data;
-			item->s =
-				(struct saved_cache_item *)(map + i *
-				sizeof (struct saved_cache_item));
-			cur = g_list_next (cur);
-			i++;
+		cache->map_len = nrecords * sizeof (struct saved_cache_item);
+		/* Now replace saved cache items with the mmapped ones by name */
+		for (i = 0; i < nrecords; i ++) {
+			rec = (struct saved_cache_item *)(map +
+					i * sizeof (struct saved_cache_item));
+			rec->symbol[sizeof (rec->symbol) - 1] = '\0';
+			item = g_hash_table_lookup (cache->items_by_symbol, rec->symbol);
+
+			if (item != NULL) {
+				item->s = rec;
+			}
 		}
 
 		post_cache_init (cache);
@@ -244,7 +340,7 @@ create_cache_file (struct symbols_cache *cache,
 	GChecksum *cksum;
 	u_char *digest;
 	gsize cklen;
-	GList *cur;
+	guint i;
 	struct cache_item *item;
 
 	/* Calculate checksum */
@@ -260,9 +356,8 @@ create_cache_file (struct symbols_cache *cache,
 
 	g_checksum_get_digest (cksum, digest, &cklen);
 	/* Now write data to file */
-	cur = g_list_first (cache->negative_items);
-	while (cur) {
-		item = cur->data;
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
 		if (write (fd, item->s, sizeof (struct saved_cache_item)) == -1) {
 			msg_err ("cannot write to file %d, %s", errno, strerror (errno));
 			close (fd);
@@ -270,19 +365,6 @@ create_cache_file (struct symbols_cache *cache,
 			g_free (digest);
 			return FALSE;
 		}
-		cur = g_list_next (cur);
-	}
-	cur = g_list_first (cache->static_items);
-	while (cur) {
-		item = cur->data;
-		if (write (fd, item->s, sizeof (struct saved_cache_item)) == -1) {
-			msg_err ("cannot write to file %d, %s", errno, strerror (errno));
-			close (fd);
-			g_checksum_free (cksum);
-			g_free (digest);
-			return FALSE;
-		}
-		cur = g_list_next (cur);
 	}
 	/* Write checksum */
 	if (write (fd, digest, cklen) == -1) {
@@ -316,18 +398,14 @@ register_symbol_common (struct symbols_cache **cache,
 {
 	struct cache_item *item = NULL;
 	struct symbols_cache *pcache = *cache;
-	GList **target, *cur;
+	GList *cur;
 	struct metric *m;
 	struct rspamd_symbol_def *s;
 	gboolean skipped, ghost = (weight == 0.0);
 
 	if (*cache == NULL) {
-		pcache = g_new0 (struct symbols_cache, 1);
+		pcache = rspamd_symbols_cache_new ();
 		*cache = pcache;
-		pcache->static_pool =
-			rspamd_mempool_new (rspamd_mempool_suggest_size ());
-		pcache->items_by_symbol = g_hash_table_new (rspamd_str_hash,
-				rspamd_str_equal);
 	}
 
 	item = rspamd_mempool_alloc0 (pcache->static_pool,
@@ -339,6 +417,8 @@ register_symbol_common (struct symbols_cache **cache,
 			sizeof (struct counter_data));
 
 	item->mtx = rspamd_mempool_get_mutex (pcache->static_pool);
+	item->local = rspamd_mempool_alloc0 (pcache->static_pool,
+			sizeof (struct cache_item_counters));
 
 	rspamd_strlcpy (item->s->symbol, name, sizeof (item->s->symbol));
 	item->func = func;
@@ -349,13 +429,20 @@ register_symbol_common (struct symbols_cache **cache,
 	case SYMBOL_TYPE_NORMAL:
 		break;
 	case SYMBOL_TYPE_VIRTUAL:
-		item->is_virtual = TRUE;
+		item->flags |= RSPAMD_SYMBOL_FLAG_VIRTUAL;
 		break;
 	case SYMBOL_TYPE_CALLBACK:
-		item->is_callback = TRUE;
+		item->flags |= RSPAMD_SYMBOL_FLAG_CALLBACK;
 		break;
 	}
 
+	if (!(item->flags & RSPAMD_SYMBOL_FLAG_VIRTUAL)) {
+		item->hist = rspamd_mempool_alloc0_shared (pcache->static_pool,
+				sizeof (struct rspamd_histogram));
+		item->local->hist = rspamd_mempool_alloc0 (pcache->static_pool,
+				sizeof (struct rspamd_histogram));
+	}
+
 	/* Handle weight using default metric */
 	if (pcache->cfg && pcache->cfg->default_metric &&
 		(s =
@@ -369,7 +456,7 @@ register_symbol_common (struct symbols_cache **cache,
 
 	/* Check whether this item is skipped */
 	skipped = !ghost;
-	if (!ghost && !item->is_callback && pcache->cfg &&
+	if (!ghost && !(item->flags & RSPAMD_SYMBOL_FLAG_CALLBACK) && pcache->cfg &&
 			g_hash_table_lookup (pcache->cfg->metrics_symbols, name) == NULL) {
 		cur = g_list_first (pcache->cfg->metrics_list);
 		while (cur) {
@@ -403,44 +490,38 @@ register_symbol_common (struct symbols_cache **cache,
 		skipped = FALSE;
 	}
 
-	item->is_skipped = skipped;
-	item->is_ghost = ghost;
-
 	if (skipped) {
+		item->flags |= RSPAMD_SYMBOL_FLAG_SKIPPED;
 		msg_warn ("symbol %s is not registered in any metric, so skip its check",
 				name);
 	}
 
 	if (ghost) {
-		msg_debug ("symbol %s is registered as ghost symbol, it won't be inserted "
+		item->flags |= RSPAMD_SYMBOL_FLAG_GHOST;
+		msg_debug_cache ("symbol %s is registered as ghost symbol, it won't be inserted "
 				"to any metric", name);
 	}
 
 	/* If we have undefined priority determine list according to weight */
 	if (priority == 0) {
-		if (item->s->weight >= 0) {
-			target = &(*cache)->static_items;
-		}
-		else {
-			target = &(*cache)->negative_items;
+		if (item->s->weight < 0) {
+			item->flags |= RSPAMD_SYMBOL_FLAG_NEGATIVE;
 		}
 	}
 	else {
 		/* Items with more priority are called before items with less priority */
 		if (priority < 0) {
-			target = &(*cache)->negative_items;
-		}
-		else {
-			target = &(*cache)->static_items;
+			item->flags |= RSPAMD_SYMBOL_FLAG_NEGATIVE;
 		}
 	}
 
+	item->id = pcache->used_items;
+	item->ts_id = -1;
 	pcache->used_items++;
+	g_ptr_array_add (pcache->items_by_id, item);
+	g_ptr_array_add (pcache->items_by_order, item);
 	g_hash_table_insert (pcache->items_by_symbol, item->s->symbol, item);
-	msg_debug ("used items: %d, added symbol: %s", (*cache)->used_items, name);
-	rspamd_set_counter (item, 0);
-
-	*target = g_list_prepend (*target, item);
+	msg_debug_cache ("used items: %d, added symbol: %s", (*cache)->used_items, name);
 }
 
 void
@@ -503,7 +584,175 @@ register_callback_symbol_priority (struct symbols_cache **cache,
 		SYMBOL_TYPE_CALLBACK);
 }
 
+struct symbols_cache *
+rspamd_symbols_cache_new (void)
+{
+	struct symbols_cache *cache;
+
+	cache = g_new0 (struct symbols_cache, 1);
+	cache->static_pool =
+			rspamd_mempool_new (rspamd_mempool_suggest_size ());
+	cache->items_by_symbol = g_hash_table_new (rspamd_str_hash,
+			rspamd_str_equal);
+	cache->items_by_id = g_ptr_array_new ();
+	cache->items_by_order = g_ptr_array_new ();
 
+	return cache;
+}
+
+void
+rspamd_symbols_cache_add_dependency (struct symbols_cache *cache,
+	const gchar *from,
+	const gchar *to)
+{
+	struct cache_item *source;
+	struct cache_dependency *dep;
+
+	g_assert (cache != NULL);
+
+	source = g_hash_table_lookup (cache->items_by_symbol, from);
+
+	if (source == NULL) {
+		msg_err ("cannot add dependency from an unknown symbol %s to %s",
+				from, to);
+		return;
+	}
+
+	if (source->deps == NULL) {
+		source->deps = g_ptr_array_new ();
+		rspamd_mempool_add_destructor (cache->static_pool,
+				(rspamd_mempool_destruct_t)rspamd_ptr_array_free_hard,
+				source->deps);
+	}
+
+	/* Target is resolved when all symbols are registered */
+	dep = rspamd_mempool_alloc (cache->static_pool, sizeof (*dep));
+	dep->sym = rspamd_mempool_strdup (cache->static_pool, to);
+	dep->item = NULL;
+	g_ptr_array_add (source->deps, dep);
+}
+
+struct cache_item *
+rspamd_symbols_cache_find_symbol (struct symbols_cache *cache,
+	const gchar *name)
+{
+	if (cache == NULL || name == NULL) {
+		return NULL;
+	}
+
+	return g_hash_table_lookup (cache->items_by_symbol, name);
+}
+
+enum {
+	CACHE_DEP_WHITE = 0,
+	CACHE_DEP_GREY,
+	CACHE_DEP_BLACK
+};
+
+/* Breaks all dependencies that form cycles starting from this item */
+static void
+rspamd_symbols_cache_check_cycles (struct cache_item *item, guint8 *colors)
+{
+	struct cache_dependency *dep;
+	guint i;
+
+	if (colors[item->id] == CACHE_DEP_BLACK) {
+		return;
+	}
+
+	colors[item->id] = CACHE_DEP_GREY;
+
+	if (item->deps) {
+		for (i = 0; i < item->deps->len; i ++) {
+			dep = g_ptr_array_index (item->deps, i);
+
+			if (dep->item == NULL) {
+				continue;
+			}
+
+			if (colors[dep->item->id] == CACHE_DEP_GREY) {
+				msg_err ("cyclic dependency found: %s -> %s, remove it",
+						item->s->symbol, dep->sym);
+				dep->item = NULL;
+			}
+			else {
+				rspamd_symbols_cache_check_cycles (dep->item, colors);
+			}
+		}
+	}
+
+	colors[item->id] = CACHE_DEP_BLACK;
+}
+
+static void
+rspamd_symbols_cache_resolve_deps (struct symbols_cache *cache)
+{
+	struct cache_item *item, *target;
+	struct cache_dependency *dep, *rdep;
+	guint8 *colors;
+	guint i, j;
+
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
+
+		if (item->deps == NULL) {
+			continue;
+		}
+
+		for (j = 0; j < item->deps->len; j ++) {
+			dep = g_ptr_array_index (item->deps, j);
+
+			if (dep->item != NULL) {
+				/* Already resolved */
+				continue;
+			}
+
+			target = g_hash_table_lookup (cache->items_by_symbol, dep->sym);
+
+			if (target == NULL) {
+				msg_err ("symbol %s depends on unknown symbol %s, ignore "
+						"dependency", item->s->symbol, dep->sym);
+				continue;
+			}
+			else if (target->flags & RSPAMD_SYMBOL_FLAG_VIRTUAL) {
+				/* Virtual symbols are inserted by their parents callbacks */
+				msg_err ("symbol %s depends on virtual symbol %s, ignore "
+						"dependency; use the symbol of callback instead",
+						item->s->symbol, dep->sym);
+				continue;
+			}
+			else if (target == item) {
+				msg_err ("symbol %s depends on itself, ignore dependency",
+						item->s->symbol);
+				continue;
+			}
+
+			dep->item = target;
+
+			if (target->rdeps == NULL) {
+				target->rdeps = g_ptr_array_new ();
+				rspamd_mempool_add_destructor (cache->static_pool,
+						(rspamd_mempool_destruct_t)rspamd_ptr_array_free_hard,
+						target->rdeps);
+			}
+
+			rdep = rspamd_mempool_alloc (cache->static_pool, sizeof (*rdep));
+			rdep->sym = item->s->symbol;
+			rdep->item = item;
+			g_ptr_array_add (target->rdeps, rdep);
+			msg_debug_cache ("symbol %s depends on %s", item->s->symbol, dep->sym);
+		}
+	}
+
+	colors = g_malloc0 (cache->items_by_id->len);
+
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
+		rspamd_symbols_cache_check_cycles (item, colors);
+	}
+
+	g_free (colors);
+}
 
 static void
 free_cache (gpointer arg)
@@ -514,13 +763,17 @@ free_cache (gpointer arg)
 		unmap_cache_file (cache);
 	}
 
-	if (cache->static_items) {
-		g_list_free (cache->static_items);
-	}
-	if (cache->negative_items) {
-		g_list_free (cache->negative_items);
-	}
 	g_hash_table_destroy (cache->items_by_symbol);
+	g_ptr_array_free (cache->items_by_id, TRUE);
+	g_ptr_array_free (cache->items_by_order, TRUE);
+
+	if (cache->metric_weights != NULL) {
+		g_ptr_array_free (cache->metric_weights, TRUE);
+	}
+
+	g_free (cache->items);
+	g_free (cache->counters);
+	g_free (cache->local_hists);
 	rspamd_mempool_delete (cache->static_pool);
 
 	g_free (cache);
@@ -545,6 +798,8 @@ init_symbols_cache (rspamd_mempool_t * pool,
 	}
 
 	cache->cfg = cfg;
+	rspamd_symbols_cache_compact (cache);
+	rspamd_symbols_cache_resolve_deps (cache);
 
 	/* Just in-memory cache */
 	if (filename == NULL) {
@@ -692,31 +947,106 @@ static void
 rspamd_symbols_cache_metric_cb (gpointer k, gpointer v, gpointer ud)
 {
 	struct symbols_cache *cache = (struct symbols_cache *)ud;
-	GList *cur;
 	const gchar *sym = k;
 	struct rspamd_symbol_def *s = (struct rspamd_symbol_def *)v;
-	gdouble weight;
 	struct cache_item *item;
 
-	weight = *s->weight_ptr;
-	cur = cache->negative_items;
-	while (cur) {
-		item = cur->data;
-		if (strcmp (item->s->symbol, sym) == 0) {
-			item->metric_weight = weight;
-			return;
-		}
-		cur = g_list_next (cur);
+	item = g_hash_table_lookup (cache->items_by_symbol, sym);
+
+	/* Avoid writes to items that are shared with other workers */
+	if (item != NULL && item->metric_weight != *s->weight_ptr) {
+		item->metric_weight = *s->weight_ptr;
+	}
+}
+
+/*
+ * Collect weights of symbols for each metric: items own only their own
+ * symbols, whilst weights of all other symbols (virtual ones, composites,
+ * classifiers) are kept in the total sums forever
+ */
+static void
+rspamd_symbols_cache_calculate_weights (struct symbols_cache *cache)
+{
+	struct cache_metric_weights *mw;
+	struct cache_item *item;
+	struct rspamd_symbol_def *sdef;
+	struct metric *metric;
+	GHashTableIter it;
+	gpointer k, v;
+	GList *cur;
+	gdouble w, cpos, cneg;
+	guint i, nitems, idx = 0;
+
+	if (cache->cfg == NULL) {
+		return;
+	}
+
+	if (cache->metric_weights == NULL) {
+		cache->metric_weights = g_ptr_array_new ();
 	}
-	cur = cache->static_items;
+
+	nitems = cache->items_by_id->len;
+	cur = cache->cfg->metrics_list;
+
 	while (cur) {
-		item = cur->data;
-		if (strcmp (item->s->symbol, sym) == 0) {
-			item->metric_weight = weight;
-			return;
+		metric = cur->data;
+
+		if (idx < cache->metric_weights->len) {
+			mw = g_ptr_array_index (cache->metric_weights, idx);
+		}
+		else {
+			mw = rspamd_mempool_alloc0 (cache->static_pool, sizeof (*mw));
+			g_ptr_array_add (cache->metric_weights, mw);
+		}
+
+		if (mw->nitems != nitems) {
+			mw->weights = rspamd_mempool_alloc (cache->static_pool,
+					nitems * sizeof (gdouble));
+			mw->nitems = nitems;
 		}
+
+		mw->metric = metric;
+		mw->pos = 0;
+		mw->neg = 0;
+
+		g_hash_table_iter_init (&it, metric->symbols);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			sdef = v;
+			w = *sdef->weight_ptr;
+
+			if (w > 0) {
+				mw->pos += w;
+			}
+			else {
+				mw->neg += w;
+			}
+		}
+
+		rspamd_composites_removed_weight (cache->cfg, metric, &cpos, &cneg);
+		mw->pos += cpos;
+		mw->neg += cneg;
+
+		for (i = 0; i < nitems; i ++) {
+			item = g_ptr_array_index (cache->items_by_id, i);
+			mw->weights[i] = 0;
+
+			if (item->flags & RSPAMD_SYMBOL_FLAG_VIRTUAL) {
+				continue;
+			}
+
+			sdef = g_hash_table_lookup (metric->symbols, item->s->symbol);
+
+			if (sdef != NULL) {
+				mw->weights[i] = *sdef->weight_ptr;
+			}
+		}
+
+		idx ++;
 		cur = g_list_next (cur);
 	}
+
+	g_ptr_array_set_size (cache->metric_weights, idx);
 }
 
 gboolean
@@ -724,9 +1054,7 @@ validate_cache (struct symbols_cache *cache,
 	struct rspamd_config *cfg,
 	gboolean strict)
 {
-	struct cache_item *item;
-	GList *cur, *p, *metric_symbols;
-	gboolean res;
+	GList *cur, *metric_symbols;
 
 	if (cache == NULL) {
 		msg_err ("empty cache is invalid");
@@ -737,28 +1065,7 @@ validate_cache (struct symbols_cache *cache,
 	metric_symbols = g_hash_table_get_keys (cfg->metrics_symbols);
 	cur = metric_symbols;
 	while (cur) {
-		res = FALSE;
-		p = cache->negative_items;
-		while (p) {
-			item = p->data;
-			if (strcmp (item->s->symbol, cur->data) == 0) {
-				res = TRUE;
-				break;
-			}
-			p = g_list_next (p);
-		}
-		if (!res) {
-			p = cache->static_items;
-			while (p) {
-				item = p->data;
-				if (strcmp (item->s->symbol, cur->data) == 0) {
-					res = TRUE;
-					break;
-				}
-				p = g_list_next (p);
-			}
-		}
-		if (!res) {
+		if (g_hash_table_lookup (cache->items_by_symbol, cur->data) == NULL) {
 			msg_warn (
 				"symbol '%s' has its score defined but there is no "
 				"corresponding rule registered",
@@ -779,106 +1086,180 @@ validate_cache (struct symbols_cache *cache,
 			rspamd_symbols_cache_metric_cb,
 			cache);
 		/* Resort caches */
-		cache->negative_items = g_list_sort (cache->negative_items,
-				cache_logic_cmp);
-		cache->static_items =
-			g_list_sort (cache->static_items, cache_logic_cmp);
+		g_ptr_array_sort (cache->items_by_order, cache_logic_cmp);
 	}
 
 	return TRUE;
 }
 
-struct symbol_callback_data {
-	enum {
-		CACHE_STATE_NEGATIVE,
-		CACHE_STATE_STATIC
-	} state;
-	struct cache_item *saved_item;
-	GList *list_pointer;
+/*
+ * Each item has two bits in the per-task bitmap: the first is set when a check
+ * is started and the second one when it is finished including all its
+ * asynchronous events
+ */
+#define CACHE_ITEM_STARTED(cp, item) \
+	((cp)->processed_bits[((item)->id * 2) / NBBY] & \
+	(1 << (((item)->id * 2) % NBBY)))
+#define CACHE_ITEM_FINISHED(cp, item) \
+	((cp)->processed_bits[((item)->id * 2 + 1) / NBBY] & \
+	(1 << (((item)->id * 2 + 1) % NBBY)))
+#define CACHE_ITEM_SET_STARTED(cp, item) \
+	((cp)->processed_bits[((item)->id * 2) / NBBY] |= \
+	(1 << (((item)->id * 2) % NBBY)))
+#define CACHE_ITEM_SET_FINISHED(cp, item) \
+	((cp)->processed_bits[((item)->id * 2 + 1) / NBBY] |= \
+	(1 << (((item)->id * 2 + 1) % NBBY)))
+
+struct cache_savepoint {
+	/* Position in the ordered items array */
+	guint pos;
+	/* Bitmap of processed items indexed by item's id */
+	guint8 *processed_bits;
+	/* Items that are waiting for their dependencies */
+	GPtrArray *waitq;
+	/* Positive and negative weights left for each metric (shortcut mode) */
+	gdouble *remain;
+};
+
+struct cache_watcher_data {
+	struct rspamd_task *task;
+	struct cache_item *item;
+	gdouble start;
 };
 
-gboolean
-call_symbol_callback (struct rspamd_task * task,
-	struct symbols_cache * cache,
-	gpointer *save)
+static void rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
+		struct symbols_cache *cache,
+		struct cache_item *item,
+		struct cache_savepoint *cp);
+
+static gboolean
+rspamd_symbols_cache_deps_finished (struct cache_item *item,
+		struct cache_savepoint *cp)
 {
-	double t1, t2;
-	guint64 diff;
-	struct cache_item *item = NULL;
-	struct symbol_callback_data *s = *save;
+	struct cache_dependency *dep;
+	guint i;
 
-	if (s == NULL) {
-		if (cache == NULL) {
-			return FALSE;
-		}
-		if (cache->uses++ >= MAX_USES) {
-			msg_info ("resort symbols cache");
-			cache->uses = 0;
-			/* Resort while having write lock */
-			post_cache_init (cache);
-		}
-		s =
-			rspamd_mempool_alloc0 (task->task_pool,
-				sizeof (struct symbol_callback_data));
-		*save = s;
-		if (cache->negative_items != NULL) {
-			s->list_pointer = g_list_first (cache->negative_items);
-			s->saved_item = s->list_pointer->data;
-			s->state = CACHE_STATE_NEGATIVE;
-		}
-		else {
-			s->state = CACHE_STATE_STATIC;
-			s->list_pointer = g_list_first (cache->static_items);
-			if (s->list_pointer) {
-				s->saved_item = s->list_pointer->data;
-			}
-			else {
+	if (item->deps != NULL) {
+		for (i = 0; i < item->deps->len; i ++) {
+			dep = g_ptr_array_index (item->deps, i);
+
+			if (dep->item != NULL && !CACHE_ITEM_FINISHED (cp, dep->item)) {
 				return FALSE;
 			}
 		}
-		item = s->saved_item;
 	}
-	else {
-		if (cache == NULL) {
-			return FALSE;
-		}
-		switch (s->state) {
-		case CACHE_STATE_NEGATIVE:
-			s->list_pointer = g_list_next (s->list_pointer);
-			if (s->list_pointer == NULL) {
-				s->state = CACHE_STATE_STATIC;
-				s->list_pointer = g_list_first (cache->static_items);
-				if (s->list_pointer) {
-					s->saved_item = s->list_pointer->data;
+
+	return TRUE;
+}
+
+static void
+rspamd_symbols_cache_item_finished (struct rspamd_task *task,
+		struct symbols_cache *cache,
+		struct cache_item *item,
+		struct cache_savepoint *cp)
+{
+	struct cache_item *waiting;
+	gboolean found;
+	guint i;
+
+	CACHE_ITEM_SET_FINISHED (cp, item);
+
+	if (cp->remain != NULL) {
+		struct cache_metric_weights *mw;
+		gdouble w;
+
+		for (i = 0; i < cache->metric_weights->len; i ++) {
+			mw = g_ptr_array_index (cache->metric_weights, i);
+
+			if ((guint)item->id < mw->nitems) {
+				w = mw->weights[item->id];
+
+				if (w > 0) {
+					cp->remain[i * 2] -= w;
 				}
 				else {
-					return FALSE;
+					cp->remain[i * 2 + 1] -= w;
 				}
 			}
-			else {
-				s->saved_item = s->list_pointer->data;
-			}
-			item = s->saved_item;
-			break;
-		case CACHE_STATE_STATIC:
-			/* Next pointer */
-			s->list_pointer = g_list_next (s->list_pointer);
-			if (s->list_pointer) {
-				s->saved_item = s->list_pointer->data;
-			}
-			else {
-				return FALSE;
+		}
+	}
+
+	if (item->rdeps == NULL) {
+		return;
+	}
+
+	/* Start all items that were waiting only for this one */
+	do {
+		found = FALSE;
+
+		for (i = 0; i < cp->waitq->len; i ++) {
+			waiting = g_ptr_array_index (cp->waitq, i);
+
+			if (rspamd_symbols_cache_deps_finished (waiting, cp)) {
+				g_ptr_array_remove_index (cp->waitq, i);
+				msg_debug_cache ("all dependencies of %s are finished, check it",
+						waiting->s->symbol);
+				rspamd_symbols_cache_check_symbol (task, cache, waiting, cp);
+				found = TRUE;
+				break;
 			}
-			item = s->saved_item;
-			break;
 		}
+	} while (found);
+}
+
+static void
+rspamd_symbols_cache_watcher_cb (gpointer ud)
+{
+	struct cache_watcher_data *wd = ud;
+	struct rspamd_task *task = wd->task;
+
+	/* Whole time of a symbol including its asynchronous events */
+	rspamd_task_span_add (task, "symbol_async", wd->item->s->symbol,
+			wd->start, rspamd_get_ticks ());
+	rspamd_symbols_cache_item_finished (task, task->cfg->cache, wd->item,
+			task->checkpoint);
+}
+
+static void
+rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
+		struct symbols_cache *cache,
+		struct cache_item *item,
+		struct cache_savepoint *cp)
+{
+	double t1, t2;
+	guint64 diff;
+	gsize lua_mem, lua_mem_end;
+	guint pending = 0;
+	struct cache_watcher_data *wd;
+
+	if (CACHE_ITEM_STARTED (cp, item)) {
+		return;
 	}
-	if (!item) {
-		return FALSE;
+
+	if (!rspamd_symbols_cache_deps_finished (item, cp)) {
+		msg_debug_cache ("delay symbol %s as its dependencies are not finished",
+				item->s->symbol);
+		g_ptr_array_add (cp->waitq, item);
+		return;
 	}
-	if (!item->is_virtual && !item->is_skipped) {
+
+	CACHE_ITEM_SET_STARTED (cp, item);
+
+	if (!(item->flags &
+			(RSPAMD_SYMBOL_FLAG_VIRTUAL|RSPAMD_SYMBOL_FLAG_SKIPPED))) {
 		t1 = rspamd_get_ticks ();
 
+		if (task->s != NULL) {
+			wd = rspamd_mempool_alloc (task->task_pool, sizeof (*wd));
+			wd->task = task;
+			wd->item = item;
+			wd->start = t1;
+			rspamd_session_watch_start (task->s,
+					rspamd_symbols_cache_watcher_cb, wd);
+		}
+
+		lua_mem = rspamd_lua_memory_used (task->cfg->lua_state);
+
 		if (G_UNLIKELY (check_debug_symbol (task->cfg, item->s->symbol))) {
 			rspamd_log_debug (rspamd_main->logger);
 			item->func (task, item->user_data);
@@ -888,14 +1269,142 @@ call_symbol_callback (struct rspamd_task * task,
 			item->func (task, item->user_data);
 		}
 
+		/* Lua memory is charged to the task if it has grown */
+		lua_mem_end = rspamd_lua_memory_used (task->cfg->lua_state);
+
+		if (lua_mem_end > lua_mem) {
+			task->lua_memory += lua_mem_end - lua_mem;
+		}
+
 		t2 = rspamd_get_ticks ();
 
 		diff = (t2 - t1) * 1000000;
-		item->s->avg_time = rspamd_set_counter (item, diff);
+		item->local->checks ++;
+		item->local->time_sum += diff;
+
+		if (item->local->hist != NULL) {
+			rspamd_histogram_add (item->local->hist, diff);
+		}
+
+		rspamd_task_span_add (task, "symbol", item->s->symbol, t1, t2);
+
+		if (task->s != NULL) {
+			pending = rspamd_session_watch_stop (task->s);
+		}
+	}
+
+	if (pending == 0) {
+		/* Watcher would not be called, so the item is finished now */
+		rspamd_symbols_cache_item_finished (task, cache, item, cp);
 	}
+}
+
+static void
+rspamd_symbols_cache_init_remain (struct symbols_cache *cache,
+		struct rspamd_task *task,
+		struct cache_savepoint *cp)
+{
+	struct cache_metric_weights *mw;
+	guint i;
 
-	s->saved_item = item;
+	if (cache->metric_weights == NULL) {
+		rspamd_symbols_cache_calculate_weights (cache);
+
+		if (cache->metric_weights == NULL) {
+			return;
+		}
+	}
+
+	cp->remain = rspamd_mempool_alloc (task->task_pool,
+			cache->metric_weights->len * 2 * sizeof (gdouble));
+
+	for (i = 0; i < cache->metric_weights->len; i ++) {
+		mw = g_ptr_array_index (cache->metric_weights, i);
+		cp->remain[i * 2] = mw->pos;
+		cp->remain[i * 2 + 1] = mw->neg;
+	}
+}
+
+gboolean
+call_symbol_callback (struct rspamd_task * task,
+	struct symbols_cache * cache,
+	gpointer *save)
+{
+	struct cache_item *item;
+	struct cache_savepoint *cp = *save;
+
+	if (cache == NULL) {
+		return FALSE;
+	}
+
+	if (cp == NULL) {
+		if (cache->uses++ >= MAX_USES) {
+			msg_info ("resort symbols cache");
+			cache->uses = 0;
+			rspamd_symbols_cache_merge_counters (cache);
+			/* Resort using merged counters of all workers */
+			post_cache_init (cache);
+		}
+		else if (rspamd_get_ticks () - cache->last_merge >
+				COUNTERS_MERGE_INTERVAL) {
+			/* Do not keep counters stale for slow workers */
+			rspamd_symbols_cache_merge_counters (cache);
+		}
+
+		cp = rspamd_mempool_alloc0 (task->task_pool,
+				sizeof (struct cache_savepoint));
+		cp->processed_bits = rspamd_mempool_alloc0 (task->task_pool,
+				NBYTES (cache->used_items * 2));
+		cp->waitq = g_ptr_array_new ();
+		rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t)rspamd_ptr_array_free_hard,
+				cp->waitq);
+
+		if (task->cfg->shortcut_checks ||
+				(task->flags & RSPAMD_TASK_FLAG_OVERLOAD)) {
+			rspamd_symbols_cache_init_remain (cache, task, cp);
+		}
+
+		*save = cp;
+	}
+
+	if (cp->pos >= cache->items_by_order->len) {
+		return FALSE;
+	}
+
+	item = g_ptr_array_index (cache->items_by_order, cp->pos);
+	cp->pos ++;
+
+	rspamd_symbols_cache_check_symbol (task, cache, item, cp);
 
 	return TRUE;
+}
+
+gboolean
+rspamd_symbols_cache_remaining_weight (struct rspamd_task *task,
+	struct symbols_cache *cache,
+	struct metric *metric,
+	gdouble *pos,
+	gdouble *neg)
+{
+	struct cache_savepoint *cp = task->checkpoint;
+	struct cache_metric_weights *mw;
+	guint i;
+
+	if (cp == NULL || cp->remain == NULL) {
+		return FALSE;
+	}
+
+	for (i = 0; i < cache->metric_weights->len; i ++) {
+		mw = g_ptr_array_index (cache->metric_weights, i);
+
+		if (mw->metric == metric) {
+			*pos = cp->remain[i * 2];
+			*neg = cp->remain[i * 2 + 1];
 
+			return TRUE;
+		}
+	}
+
+	return FALSE;
 }
@@ -3,11 +3,13 @@
 
 #include "config.h"
 #include "radix.h"
+#include "histogram.h"
 
 #define MAX_SYMBOL 128
 
 struct rspamd_task;
 struct rspamd_config;
+struct metric;
 
 typedef void (*symbol_func_t)(struct rspamd_task *task, gpointer user_data);
 
@@ -29,32 +31,75 @@ struct counter_data {
 	gint number;
 };
 
+/*
+ * Counters that are local for a worker, they are merged to the shared
+ * `saved_cache_item` and `counter_data` periodically to avoid contention
+ */
+struct cache_item_counters {
+	volatile gint frequency;
+	guint checks;
+	gdouble time_sum;
+	struct rspamd_histogram *hist;
+};
+
+#define RSPAMD_SYMBOL_FLAG_VIRTUAL (1 << 0)
+#define RSPAMD_SYMBOL_FLAG_CALLBACK (1 << 1)
+#define RSPAMD_SYMBOL_FLAG_GHOST (1 << 2)
+#define RSPAMD_SYMBOL_FLAG_SKIPPED (1 << 3)
+#define RSPAMD_SYMBOL_FLAG_NEGATIVE (1 << 4)
+
 struct cache_item {
+	/* Hot data used on each check */
+	/* Callback data */
+	symbol_func_t func;
+	gpointer user_data;
+	guint flags;
+	/* Priority */
+	gint priority;
+	/* Unique id of an item (order of registration) */
+	gint id;
+	/* Id of hits time series or -1 */
+	gint ts_id;
+	gdouble metric_weight;
+	/* Counters since the last merge, they are stored apart from items */
+	struct cache_item_counters *local;
+
 	/* Static item's data */
 	struct saved_cache_item *s;
 	struct counter_data *cd;
+	/* Shared latency histogram, NULL for virtual symbols */
+	struct rspamd_histogram *hist;
 
+	/* Cold data */
 	rspamd_mempool_mutex_t *mtx;
 
 	/* For dynamic rules */
 	struct dynamic_map_item *networks;
 	guint32 networks_number;
-	gboolean is_dynamic;
-
-	gboolean is_skipped;
 
-	/* Callback data */
-	symbol_func_t func;
-	gpointer user_data;
+	/* Dependencies */
+	GPtrArray *deps;
+	/* Reverse dependencies */
+	GPtrArray *rdeps;
+};
 
-	/* Flags of virtual symbols */
-	gboolean is_virtual;
-	gboolean is_callback;
-	gboolean is_ghost;
+struct cache_dependency {
+	struct cache_item *item;
+	gchar *sym;
+};
 
-	/* Priority */
-	gint priority;
-	gdouble metric_weight;
+/*
+ * Weights of items for a metric used to estimate how much the score of a task
+ * can still be changed by the checks that are not finished yet
+ */
+struct cache_metric_weights {
+	struct metric *metric;
+	/* Weight of the own symbol of an item indexed by item's id */
+	gdouble *weights;
+	guint nitems;
+	/* Sums of all positive and negative weights that could be inserted */
+	gdouble pos;
+	gdouble neg;
 };
 
 enum rspamd_symbol_type {
@@ -64,11 +109,20 @@ enum rspamd_symbol_type {
 };
 
 struct symbols_cache {
-	/* Normal cache items */
-	GList *static_items;
+	/* All items indexed by their id, each item is stored in `items` after init */
+	GPtrArray *items_by_id;
 
-	/* Items that have negative weights */
-	GList *negative_items;
+	/* Items in the order of checks: negative items go first */
+	GPtrArray *items_by_order;
+
+	/* Contiguous storage of items */
+	struct cache_item *items;
+	/*
+	 * Counters written by each check are kept in separate arrays, so items
+	 * themselves are not modified after fork and stay shared between workers
+	 */
+	struct cache_item_counters *counters;
+	struct rspamd_histogram *local_hists;
 
 	/* Hash table for fast access */
 	GHashTable *items_by_symbol;
@@ -78,10 +132,20 @@ struct symbols_cache {
 	guint cur_items;
 	guint used_items;
 	guint uses;
+	gdouble last_merge;
+	/* Weights per metric, used for shortcut checks */
+	GPtrArray *metric_weights;
 	gpointer map;
+	gsize map_len;
 	struct rspamd_config *cfg;
 };
 
+/**
+ * Creates new empty symbols cache
+ * @return new cache object
+ */
+struct symbols_cache * rspamd_symbols_cache_new (void);
+
 /**
  * Load symbols cache from file, must be called _after_ init_symbols_cache
  */
@@ -180,6 +244,57 @@ gboolean call_symbol_callback (struct rspamd_task *task,
 	struct symbols_cache *cache,
 	gpointer *save);
 
+/**
+ * Find cache item by symbol's name
+ * @param cache symbols cache
+ * @param name symbol's name
+ * @return cache item or NULL
+ */
+struct cache_item * rspamd_symbols_cache_find_symbol (
+	struct symbols_cache *cache,
+	const gchar *name);
+
+/**
+ * Account a hit of the specified item, it is safe to call this function from
+ * any thread
+ * @param item cache item
+ */
+void rspamd_symbols_cache_inc_frequency (struct cache_item *item);
+
+/**
+ * Merge local counters of this process to the shared ones
+ * @param cache symbols cache
+ */
+void rspamd_symbols_cache_merge_counters (struct symbols_cache *cache);
+
+/**
+ * Add a dependency between symbols: symbol `from` is checked only when symbol
+ * `to` is checked and all its asynchronous events are finished
+ * @param cache symbols cache
+ * @param from symbol that depends on `to`
+ * @param to symbol that `from` depends on
+ */
+void rspamd_symbols_cache_add_dependency (struct symbols_cache *cache,
+	const gchar *from,
+	const gchar *to);
+
+/**
+ * Get the bounds of the score that could still be added for the specified
+ * metric by the checks of this task that are not finished yet. Symbols that
+ * are not bound to a specific check (e.g. virtual ones) are always counted.
+ * @param task task object
+ * @param cache symbols cache
+ * @param metric metric
+ * @param pos maximum positive score that could be added
+ * @param neg maximum negative score that could be added
+ * @return TRUE if bounds are known for this metric
+ */
+gboolean rspamd_symbols_cache_remaining_weight (struct rspamd_task *task,
+	struct symbols_cache *cache,
+	struct metric *metric,
+	gdouble *pos,
+	gdouble *neg);
+
 /**
  * Remove all dynamic rules from cache
  * @param cache symbols cache
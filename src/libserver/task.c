@@ -27,6 +27,47 @@
 #include "protocol.h"
 #include "message.h"
 #include "lua/lua_common.h"
+#include "ottery.h"
+#include "dynamic_cfg.h"
+
+#ifndef NBBY
+#define NBBY 8
+#endif
+
+/* Maximum size of free pages kept for task pools */
+#define TASK_POOL_CACHE_SIZE (16 * 1024 * 1024)
+
+/*
+ * Pages of task pools are reused by subsequent tasks of the same process,
+ * the size of the first page is adapted to the actual usage of pools
+ */
+static rspamd_mempool_cache_t *task_pool_cache = NULL;
+
+/*
+ * Pool hashes of tasks are preallocated for the moving average of elements
+ * in hashes of the previous tasks
+ */
+static guint raw_headers_hint = 32;
+static guint re_cache_hint = 8;
+
+#define TASK_HASH_HINT_UPDATE(hint, size) ((hint) = ((hint) * 7 + (size)) / 8)
+
+/* Interval to merge stages latencies of a worker to the shared statistics */
+#define STAGES_MERGE_INTERVAL 1.0
+
+static const gchar *task_stage_names[RSPAMD_TASK_STAGE_MAX] = {
+	[RSPAMD_TASK_STAGE_READ] = "read",
+	[RSPAMD_TASK_STAGE_PROCESS_MESSAGE] = "process_message",
+	[RSPAMD_TASK_STAGE_PRE_FILTERS] = "pre_filters",
+	[RSPAMD_TASK_STAGE_FILTERS] = "filters",
+	[RSPAMD_TASK_STAGE_CLASSIFY] = "classify",
+	[RSPAMD_TASK_STAGE_POST_FILTERS] = "post_filters",
+	[RSPAMD_TASK_STAGE_REPLY] = "reply",
+};
+
+/* Latencies recorded by this worker since the last merge */
+static struct rspamd_histogram local_stages[RSPAMD_TASK_STAGE_MAX];
+static gdouble local_stages_merged = 0;
 
 static void
 gstring_destruct (gpointer ptr)
@@ -50,27 +91,35 @@ rspamd_task_new (struct rspamd_worker *worker)
 	new_task->state = READ_MESSAGE;
 	if (worker) {
 		new_task->cfg = worker->srv->cfg;
+		rspamd_dynamic_config_sync (new_task->cfg);
+
 		if (new_task->cfg->check_all_filters) {
 			new_task->flags |= RSPAMD_TASK_FLAG_PASS_ALL;
 		}
+		if (new_task->cfg->trace_sample_rate > 0 &&
+				ottery_rand_uint32 () <
+				new_task->cfg->trace_sample_rate * G_MAXUINT32) {
+			new_task->flags |= RSPAMD_TASK_FLAG_TRACE;
+		}
 	}
 
 	gettimeofday (&new_task->tv, NULL);
 	new_task->time_real = rspamd_get_ticks ();
 	new_task->time_virtual = rspamd_get_virtual_ticks ();
+	new_task->stage_time = new_task->time_real;
+
+	if (task_pool_cache == NULL) {
+		task_pool_cache = rspamd_mempool_cache_new (TASK_POOL_CACHE_SIZE);
+	}
 
-	new_task->task_pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+	new_task->task_pool = rspamd_mempool_new_cached (task_pool_cache);
 
 	new_task->results = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
 	rspamd_mempool_add_destructor (new_task->task_pool,
 		(rspamd_mempool_destruct_t) g_hash_table_unref,
 		new_task->results);
-	new_task->re_cache = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_unref,
-		new_task->re_cache);
-	new_task->raw_headers = g_hash_table_new (rspamd_strcase_hash,
-			rspamd_strcase_equal);
+	new_task->raw_headers = rspamd_pool_hash_new (new_task->task_pool,
+			rspamd_strcase_hash, rspamd_strcase_equal, raw_headers_hint);
 	new_task->request_headers = g_hash_table_new_full ((GHashFunc)g_string_hash,
 		(GEqualFunc)g_string_equal, gstring_destruct, gstring_destruct);
 	rspamd_mempool_add_destructor (new_task->task_pool,
@@ -81,9 +130,6 @@ rspamd_task_new (struct rspamd_worker *worker)
 	rspamd_mempool_add_destructor (new_task->task_pool,
 		(rspamd_mempool_destruct_t) g_hash_table_unref,
 		new_task->reply_headers);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_unref,
-		new_task->raw_headers);
 	new_task->emails = g_hash_table_new (rspamd_url_hash, rspamd_emails_cmp);
 	rspamd_mempool_add_destructor (new_task->task_pool,
 		(rspamd_mempool_destruct_t) g_hash_table_unref,
@@ -102,6 +148,231 @@ rspamd_task_new (struct rspamd_worker *worker)
 }
 
 
+const gchar *
+rspamd_task_stage_name (enum rspamd_task_stage stage)
+{
+	if (stage < RSPAMD_TASK_STAGE_MAX) {
+		return task_stage_names[stage];
+	}
+
+	return "unknown";
+}
+
+static void
+rspamd_task_stages_merge (struct rspamd_main *srv)
+{
+	guint i;
+
+	if (srv->stat == NULL || srv->stat_mtx == NULL) {
+		return;
+	}
+
+	rspamd_mempool_lock_mutex (srv->stat_mtx);
+
+	for (i = 0; i < RSPAMD_TASK_STAGE_MAX; i ++) {
+		if (local_stages[i].count > 0) {
+			rspamd_histogram_merge (&srv->stat->stages[i], &local_stages[i]);
+			rspamd_histogram_reset (&local_stages[i]);
+		}
+	}
+
+	rspamd_mempool_unlock_mutex (srv->stat_mtx);
+}
+
+struct rspamd_histogram *
+rspamd_task_local_stages (void)
+{
+	return local_stages;
+}
+
+void
+rspamd_task_stage_done (struct rspamd_task *task,
+	enum rspamd_task_stage stage)
+{
+	gdouble now;
+
+	now = rspamd_get_ticks ();
+
+	if (stage < RSPAMD_TASK_STAGE_MAX) {
+		/* Tasks without a worker are processed by tools, e.g. benchmarks */
+		rspamd_histogram_add (&local_stages[stage],
+				(now - task->stage_time) * 1000000);
+	}
+
+	if (stage < RSPAMD_TASK_STAGE_MAX && task->worker != NULL) {
+		if (task->worker->srv->ts) {
+			rspamd_ts_store_add_latency (task->worker->srv->ts->store,
+					task->worker->srv->ts->stages[stage],
+					now - task->stage_time);
+		}
+
+		if (now - local_stages_merged > STAGES_MERGE_INTERVAL) {
+			rspamd_task_stages_merge (task->worker->srv);
+			local_stages_merged = now;
+		}
+	}
+
+	if (task->spans != NULL && stage < RSPAMD_TASK_STAGE_MAX) {
+		rspamd_task_span_add (task, "stage", task_stage_names[stage],
+				task->stage_time, now);
+	}
+
+	task->stage_time = now;
+}
+
+void
+rspamd_task_span_add (struct rspamd_task *task, const gchar *cat,
+	const gchar *name, gdouble start, gdouble end)
+{
+	struct rspamd_task_span span;
+
+	if (task->spans == NULL || task->spans->len >= RSPAMD_TASK_MAX_SPANS) {
+		return;
+	}
+
+	span.cat = cat;
+	span.name = name;
+	span.start = start;
+	span.end = end;
+	g_array_append_val (task->spans, span);
+}
+
+gint
+rspamd_task_span_start (struct rspamd_task *task, const gchar *cat,
+	const gchar *name)
+{
+	if (task->spans == NULL || task->spans->len >= RSPAMD_TASK_MAX_SPANS) {
+		return -1;
+	}
+
+	rspamd_task_span_add (task, cat, name, rspamd_get_ticks (), 0);
+
+	return task->spans->len - 1;
+}
+
+void
+rspamd_task_span_end (struct rspamd_task *task, gint id)
+{
+	struct rspamd_task_span *span;
+
+	if (task->spans == NULL || id < 0 || (guint)id >= task->spans->len) {
+		return;
+	}
+
+	span = &g_array_index (task->spans, struct rspamd_task_span, id);
+	span->end = rspamd_get_ticks ();
+}
+
+static void
+rspamd_task_trace_event (GQuark subsystem, gdouble start, gdouble end,
+	gpointer ud)
+{
+	struct rspamd_task *task = ud;
+
+	rspamd_task_span_add (task, "async", g_quark_to_string (subsystem),
+			start, end);
+}
+
+static void
+rspamd_task_trace_start (struct rspamd_task *task)
+{
+	task->spans = g_array_sized_new (FALSE, FALSE,
+			sizeof (struct rspamd_task_span), 64);
+	rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)rspamd_array_free_hard, task->spans);
+
+	if (task->s != NULL) {
+		rspamd_session_set_trace (task->s, rspamd_task_trace_event, task);
+	}
+}
+
+/*
+ * Write spans of a task in chrome trace events format, timestamps are in
+ * microseconds since the task has been created
+ */
+static void
+rspamd_task_trace_write (struct rspamd_task *task)
+{
+	ucl_object_t *top, *events, *ev;
+	struct rspamd_task_span *span;
+	const gchar *dir;
+	gchar path[PATH_MAX];
+	GString *out;
+	static guint ntraces = 0;
+	pid_t pid = getpid ();
+	gint fd;
+	guint i;
+
+	if (task->spans->len == 0) {
+		return;
+	}
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	events = ucl_object_typed_new (UCL_ARRAY);
+
+	for (i = 0; i < task->spans->len; i ++) {
+		span = &g_array_index (task->spans, struct rspamd_task_span, i);
+
+		if (span->end < span->start) {
+			/* Span has never been finished */
+			continue;
+		}
+
+		ev = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (ev, ucl_object_fromstring (span->name),
+				"name", 0, false);
+		ucl_object_insert_key (ev, ucl_object_fromstring (span->cat),
+				"cat", 0, false);
+		ucl_object_insert_key (ev, ucl_object_fromstring ("X"), "ph", 0, false);
+		ucl_object_insert_key (ev,
+				ucl_object_fromdouble ((span->start - task->time_real) * 1e6),
+				"ts", 0, false);
+		ucl_object_insert_key (ev,
+				ucl_object_fromdouble ((span->end - span->start) * 1e6),
+				"dur", 0, false);
+		ucl_object_insert_key (ev, ucl_object_fromint (pid), "pid", 0, false);
+		ucl_object_insert_key (ev, ucl_object_fromint (0), "tid", 0, false);
+		ucl_array_append (events, ev);
+	}
+
+	ucl_object_insert_key (top, events, "traceEvents", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromstring (task->message_id),
+			"message_id", 0, true);
+	ucl_object_insert_key (top, ucl_object_fromstring (task->queue_id),
+			"queue_id", 0, true);
+
+	dir = task->cfg->trace_dir;
+
+	if (dir == NULL) {
+		dir = task->cfg->temp_dir ? task->cfg->temp_dir : "/tmp";
+	}
+
+	rspamd_snprintf (path, sizeof (path), "%s%crspamd-trace-%P-%ud.json",
+			dir, G_DIR_SEPARATOR, pid, ntraces ++);
+	out = g_string_sized_new (task->spans->len * 96);
+	rspamd_ucl_emit_gstring (top, UCL_EMIT_JSON_COMPACT, out);
+	ucl_object_unref (top);
+
+	fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+
+	if (fd == -1) {
+		msg_err ("cannot open trace file %s: %s", path, strerror (errno));
+	}
+	else {
+		if (write (fd, out->str, out->len) == -1) {
+			msg_err ("cannot write trace file %s: %s", path, strerror (errno));
+		}
+		else {
+			msg_info ("written %ud spans of task %s to %s", task->spans->len,
+					task->message_id, path);
+		}
+
+		close (fd);
+	}
+
+	g_string_free (out, TRUE);
+}
+
 static void
 rspamd_task_reply (struct rspamd_task *task)
 {
@@ -113,6 +384,21 @@ rspamd_task_reply (struct rspamd_task *task)
 	}
 }
 
+/*
+ * Pass task to classifier threads, if the queue is full then the task is
+ * classified from rspamd_task_fin
+ */
+static void
+rspamd_task_offload_classify (struct rspamd_task *task)
+{
+	if (!RSPAMD_TASK_IS_SKIPPED (task) && task->classify_executor != NULL &&
+			!(task->flags & RSPAMD_TASK_FLAG_OVERLOAD)) {
+		if (rspamd_classify_executor_push (task->classify_executor, task)) {
+			task->flags |= RSPAMD_TASK_FLAG_CLASSIFY_OFFLOAD;
+		}
+	}
+}
+
 /*
  * Called if all filters are processed
  * @return TRUE if session should be terminated
@@ -122,7 +408,10 @@ rspamd_task_fin (void *arg)
 {
 	struct rspamd_task *task = (struct rspamd_task *) arg;
 	gint r;
-	GError *err = NULL;
+
+	if (task->state != WRITE_REPLY && rspamd_task_check_memory (task)) {
+		task->state = WRITE_REPLY;
+	}
 
 	/* Task is already finished or skipped */
 	if (task->state == WRITE_REPLY) {
@@ -132,10 +421,13 @@ rspamd_task_fin (void *arg)
 
 	/* We processed all filters and want to process statfiles */
 	if (task->state != WAIT_POST_FILTER && task->state != WAIT_PRE_FILTER) {
+		rspamd_task_stage_done (task, RSPAMD_TASK_STAGE_FILTERS);
+
 		/* Process all statfiles */
-		if (task->classify_pool == NULL) {
+		if (!(task->flags & RSPAMD_TASK_FLAG_CLASSIFY_OFFLOAD)) {
 			/* Non-threaded version */
 			rspamd_process_statistics (task);
+			rspamd_task_stage_done (task, RSPAMD_TASK_STAGE_CLASSIFY);
 		}
 		else {
 			/* Just process composites */
@@ -152,12 +444,18 @@ rspamd_task_fin (void *arg)
 
 	/* We are on post-filter waiting state */
 	if (task->state != WAIT_PRE_FILTER) {
+		if (task->state == WAIT_POST_FILTER) {
+			rspamd_task_stage_done (task, RSPAMD_TASK_STAGE_POST_FILTERS);
+		}
+
 		/* Check if we have all events finished */
 		task->state = WRITE_REPLY;
 		rspamd_task_reply (task);
 	}
 	else {
 		/* We were waiting for pre-filter */
+		rspamd_task_stage_done (task, RSPAMD_TASK_STAGE_PRE_FILTERS);
+
 		if (task->pre_result.action != METRIC_ACTION_NOACTION) {
 			/* Write result based on pre filters */
 			task->state = WRITE_REPLY;
@@ -174,16 +472,7 @@ rspamd_task_fin (void *arg)
 				rspamd_task_reply (task);
 				return TRUE;
 			}
-			/* Add task to classify to classify pool */
-			if (!RSPAMD_TASK_IS_SKIPPED (task) && task->classify_pool) {
-				register_async_thread (task->s);
-				g_thread_pool_push (task->classify_pool, task, &err);
-				if (err != NULL) {
-					msg_err ("cannot pull task to the pool: %s", err->message);
-					remove_async_thread (task->s);
-					g_error_free (err);
-				}
-			}
+			rspamd_task_offload_classify (task);
 			if (RSPAMD_TASK_IS_SKIPPED (task)) {
 				rspamd_task_reply (task);
 			}
@@ -223,7 +512,9 @@ rspamd_task_free (struct rspamd_task *task, gboolean is_soft)
 	struct mime_text_part *tp;
 
 	if (task) {
-		debug_task ("free pointer %p", task);
+		debug_task ("free pointer %p, words are extracted from %ud and "
+				"normalized for %ud text parts", task, task->lazy_words,
+				task->lazy_normalized);
 		while ((part = g_list_first (task->parts))) {
 			task->parts = g_list_remove_link (task->parts, part);
 			p = (struct mime_part *) part->data;
@@ -263,12 +554,24 @@ rspamd_task_free (struct rspamd_task *task, gboolean is_soft)
 		if (task->settings != NULL) {
 			ucl_object_unref (task->settings);
 		}
+		if (task->compiled_settings != NULL) {
+			rspamd_settings_unref (task->compiled_settings);
+		}
 		if (task->client_addr) {
 			rspamd_inet_address_destroy (task->client_addr);
 		}
-		if (task->from_addr) {
-			rspamd_inet_address_destroy (task->from_addr);
+		if (task->spans != NULL && task->cfg != NULL) {
+			rspamd_task_trace_write (task);
+		}
+		if (task->message != NULL) {
+			TASK_HASH_HINT_UPDATE (raw_headers_hint,
+					rspamd_pool_hash_size (task->raw_headers));
 		}
+		if (task->re_cache != NULL) {
+			TASK_HASH_HINT_UPDATE (re_cache_hint,
+					rspamd_pool_hash_size (task->re_cache));
+		}
+		/* Pool hashes are released with the pool */
 		rspamd_mempool_delete (task->task_pool);
 		g_slice_free1 (sizeof (struct rspamd_task), task);
 	}
@@ -291,29 +594,133 @@ rspamd_task_free_soft (gpointer ud)
 }
 
 
+/*
+ * Parse message, it can be called from a scheduler thread
+ */
+static gint
+rspamd_task_parse_message (struct rspamd_task *task)
+{
+	gint r;
+
+	r = process_message (task);
+
+	if (r != -1 && task->scheduler != NULL) {
+		/* Do not tokenize text parts in the event loop */
+		rspamd_mime_text_parts_prepare_words (task);
+	}
+
+	return r;
+}
+
+/*
+ * Start filters of a parsed message
+ * @return FALSE if reply should be written immediately
+ */
+static gboolean
+rspamd_task_process_filters (struct rspamd_task *task, gint r)
+{
+	rspamd_task_stage_done (task, RSPAMD_TASK_STAGE_PROCESS_MESSAGE);
+
+	if (r == -1) {
+		msg_warn ("processing of message failed");
+		task->last_error = "MIME processing error";
+		task->error_code = RSPAMD_FILTER_ERROR;
+		task->state = WRITE_REPLY;
+		return FALSE;
+	}
+	if (rspamd_task_check_memory (task)) {
+		task->state = WRITE_REPLY;
+		return FALSE;
+	}
+	if ((task->flags & RSPAMD_TASK_FLAG_SKIP_EXTRA) ||
+			task->cfg->pre_filters == NULL) {
+		r = rspamd_process_filters (task);
+		if (r == -1) {
+			task->last_error = "filter processing error";
+			task->error_code = RSPAMD_FILTER_ERROR;
+			task->state = WRITE_REPLY;
+			return FALSE;
+		}
+		rspamd_task_offload_classify (task);
+		if (RSPAMD_TASK_IS_SKIPPED (task)) {
+			/* Call write_socket to write reply and exit */
+			task->state = WRITE_REPLY;
+		}
+		task->s->wanna_die = TRUE;
+	}
+	else {
+		rspamd_lua_call_pre_filters (task);
+		/* We want fin_task after pre filters are processed */
+		task->s->wanna_die = TRUE;
+		task->state = WAIT_PRE_FILTER;
+	}
+
+	check_session_pending (task->s);
+
+	return TRUE;
+}
+
+/*
+ * Called from the event loop when message is parsed by a scheduler thread,
+ * reply is written by session finalizer if filters cannot be started
+ */
+static void
+rspamd_task_message_parsed (struct rspamd_task *task, gint r)
+{
+	if (!rspamd_task_process_filters (task, r)) {
+		task->state = WRITE_REPLY;
+	}
+}
+
 gboolean
 rspamd_task_process (struct rspamd_task *task,
 	struct rspamd_http_message *msg, const gchar *start, gsize len,
-	GThreadPool *classify_pool,
+	struct rspamd_classify_executor *executor,
 	gboolean process_extra_filters)
 {
 	gint r;
 	guint control_len;
 	struct ucl_parser *parser;
 	ucl_object_t *control_obj;
-	GError *err = NULL;
 
 	task->msg.start = start;
 	task->msg.len = len;
+	task->classify_executor = executor;
+	/* Persistent connections are idle before the next request is read */
+	rspamd_task_stage_done (task, task->conn_requests == 0 ?
+			RSPAMD_TASK_STAGE_READ : RSPAMD_TASK_STAGE_MAX);
 	debug_task ("got string of length %z", task->msg.len);
 
 	/* We got body, set wanna_die flag */
 	task->s->wanna_die = TRUE;
 
+	/* Async requests of the task are limited by the time since the body */
+	if (task->cfg->task_timeout > 0) {
+		rspamd_session_set_deadline (task->s,
+				rspamd_get_ticks () + task->cfg->task_timeout);
+	}
+
 	if (msg) {
 		rspamd_protocol_handle_headers (task, msg);
 	}
 
+	if ((task->flags & RSPAMD_TASK_FLAG_TRACE) && task->spans == NULL) {
+		rspamd_task_trace_start (task);
+	}
+
+	/* Message may be mapped from a spool file instead of the body */
+	if (task->msg.len == 0) {
+		msg_err ("got zero length body, cannot continue");
+
+		if (task->last_error == NULL) {
+			task->last_error = "message's body is empty";
+			task->error_code = RSPAMD_LENGTH_ERROR;
+		}
+
+		task->state = WRITE_REPLY;
+		return FALSE;
+	}
+
 	if (task->flags & RSPAMD_TASK_FLAG_HAS_CONTROL) {
 		/* We have control chunk, so we need to process it separately */
 		if (task->msg.len < task->message_len) {
@@ -326,7 +733,17 @@ rspamd_task_process (struct rspamd_task *task,
 		}
 		control_len = task->msg.len - task->message_len;
 
-		if (control_len > 0) {
+		if (control_len > 0 &&
+				rspamd_protocol_is_binary_control (task->msg.start, control_len)) {
+			if (!rspamd_protocol_handle_binary_control (task, task->msg.start,
+					control_len)) {
+				msg_warn ("processing of binary control chunk failed");
+			}
+
+			task->msg.start += control_len;
+			task->msg.len -= control_len;
+		}
+		else if (control_len > 0) {
 			parser = ucl_parser_new (UCL_PARSER_KEY_LOWERCASE);
 
 			if (!ucl_parser_add_chunk (parser, task->msg.start, control_len)) {
@@ -346,52 +763,91 @@ rspamd_task_process (struct rspamd_task *task,
 		}
 	}
 
-	r = process_message (task);
-	if (r == -1) {
-		msg_warn ("processing of message failed");
-		task->last_error = "MIME processing error";
-		task->error_code = RSPAMD_FILTER_ERROR;
+	if (!process_extra_filters) {
+		task->flags |= RSPAMD_TASK_FLAG_SKIP_EXTRA;
+	}
+
+	if (task->pre_result.action != METRIC_ACTION_NOACTION) {
+		/* Action is set before scanning, e.g. by admission control */
 		task->state = WRITE_REPLY;
 		return FALSE;
 	}
-	if (!process_extra_filters) {
-		task->flags |= RSPAMD_TASK_FLAG_SKIP_EXTRA;
+
+	if (task->scheduler != NULL &&
+			rspamd_task_scheduler_push (task->scheduler, task,
+					rspamd_task_parse_message, rspamd_task_message_parsed)) {
+		return TRUE;
 	}
-	if (!process_extra_filters || task->cfg->pre_filters == NULL) {
-		r = rspamd_process_filters (task);
-		if (r == -1) {
-			task->last_error = "filter processing error";
-			task->error_code = RSPAMD_FILTER_ERROR;
-			task->state = WRITE_REPLY;
-			return FALSE;
-		}
-		/* Add task to classify to classify pool */
-		if (!RSPAMD_TASK_IS_SKIPPED (task) && classify_pool) {
-			register_async_thread (task->s);
-			g_thread_pool_push (classify_pool, task, &err);
-			if (err != NULL) {
-				msg_err ("cannot pull task to the pool: %s", err->message);
-				remove_async_thread (task->s);
-				g_error_free (err);
-			}
-			else {
-				task->classify_pool = classify_pool;
-			}
-		}
-		if (RSPAMD_TASK_IS_SKIPPED (task)) {
-			/* Call write_socket to write reply and exit */
-			task->state = WRITE_REPLY;
-		}
-		task->s->wanna_die = TRUE;
+
+	r = rspamd_task_parse_message (task);
+
+	return rspamd_task_process_filters (task, r);
+}
+
+gboolean
+rspamd_task_set_pre_result (struct rspamd_task *task,
+	enum rspamd_metric_action action, const gchar *str)
+{
+	struct metric_result *mres;
+	gchar *action_str;
+
+	if (action >= task->pre_result.action || action >= METRIC_ACTION_MAX) {
+		return FALSE;
+	}
+
+	/* We also need to set the default metric to that result */
+	mres = rspamd_create_metric_result (task, DEFAULT_METRIC);
+	if (mres != NULL) {
+		mres->score = mres->metric->actions[action].score;
+		mres->action = action;
+	}
+	task->pre_result.action = action;
+	if (str != NULL) {
+		action_str = rspamd_mempool_strdup (task->task_pool, str);
+		task->pre_result.str = action_str;
+		task->messages = g_list_prepend (task->messages, action_str);
 	}
 	else {
-		rspamd_lua_call_pre_filters (task);
-		/* We want fin_task after pre filters are processed */
-		task->s->wanna_die = TRUE;
-		task->state = WAIT_PRE_FILTER;
+		task->pre_result.str = "unknown";
 	}
+	msg_info ("<%s>: set pre-result to %s: '%s'",
+				task->message_id, rspamd_action_to_str (action),
+				task->pre_result.str);
 
-	check_session_pending (task->s);
+	return TRUE;
+}
+
+gsize
+rspamd_task_memory_used (struct rspamd_task *task)
+{
+	return rspamd_mempool_get_used (task->task_pool) + task->lua_memory;
+}
+
+gboolean
+rspamd_task_check_memory (struct rspamd_task *task)
+{
+	gsize used;
+
+	if (task->flags & RSPAMD_TASK_FLAG_MEMORY_LIMIT) {
+		return TRUE;
+	}
+
+	if (task->cfg->task_max_memory == 0) {
+		return FALSE;
+	}
+
+	used = rspamd_task_memory_used (task);
+
+	if (used <= task->cfg->task_max_memory) {
+		return FALSE;
+	}
+
+	msg_warn ("<%s> has used %Hz of memory which is more than %Hz allowed, "
+			"stop processing", task->message_id, used,
+			task->cfg->task_max_memory);
+	task->flags |= RSPAMD_TASK_FLAG_MEMORY_LIMIT | RSPAMD_TASK_FLAG_SKIP;
+	task->last_error = "memory limit exceeded";
+	task->error_code = RSPAMD_MEMORY_ERROR;
 
 	return TRUE;
 }
@@ -490,6 +946,73 @@ rspamd_task_add_sender (struct rspamd_task *task, const gchar *sender)
 }
 
 
+static void
+rspamd_task_re_cache_init (struct rspamd_task *task)
+{
+	guint nbytes;
+
+	if (task->cfg != NULL && task->cfg->re_cache != NULL) {
+		task->re_nelts = rspamd_re_cache_nelts (task->cfg->re_cache);
+	}
+
+	nbytes = (task->re_nelts + NBBY - 1) / NBBY;
+	task->re_checked = rspamd_mempool_alloc0 (task->task_pool, MAX (nbytes, 1));
+	task->re_results = rspamd_mempool_alloc (task->task_pool,
+			MAX (task->re_nelts, 1) * sizeof (guint));
+}
+
+guint
+rspamd_task_re_cache_add_id (struct rspamd_task *task, guint id,
+		guint value)
+{
+	guint ret = RSPAMD_TASK_CACHE_NO_VALUE;
+
+	if (task->re_checked == NULL) {
+		rspamd_task_re_cache_init (task);
+	}
+
+	if (id >= task->re_nelts) {
+		/* Regexp has been registered after this task was started */
+		return ret;
+	}
+
+	if (task->re_checked[id / NBBY] & (1 << (id % NBBY))) {
+		ret = task->re_results[id];
+	}
+
+	task->re_checked[id / NBBY] |= (1 << (id % NBBY));
+	task->re_results[id] = value;
+
+	return ret;
+}
+
+guint
+rspamd_task_re_cache_check_id (struct rspamd_task *task, guint id)
+{
+	guint ret = RSPAMD_TASK_CACHE_NO_VALUE;
+
+	if (task->re_checked == NULL) {
+		rspamd_task_re_cache_init (task);
+	}
+
+	if (id < task->re_nelts &&
+			(task->re_checked[id / NBBY] & (1 << (id % NBBY)))) {
+		ret = task->re_results[id];
+	}
+
+	return ret;
+}
+
+static gint
+rspamd_task_re_cache_lookup_id (struct rspamd_task *task, const gchar *re)
+{
+	if (task->cfg == NULL || task->cfg->re_cache == NULL) {
+		return -1;
+	}
+
+	return rspamd_re_cache_lookup_id (task->cfg->re_cache, re);
+}
+
 guint
 rspamd_task_re_cache_add (struct rspamd_task *task, const gchar *re,
 		guint value)
@@ -497,14 +1020,24 @@ rspamd_task_re_cache_add (struct rspamd_task *task, const gchar *re,
 	guint ret = RSPAMD_TASK_CACHE_NO_VALUE;
 	static const guint32 mask = 1 << 31;
 	gpointer p;
+	gint id;
+
+	if ((id = rspamd_task_re_cache_lookup_id (task, re)) != -1) {
+		return rspamd_task_re_cache_add_id (task, id, value);
+	}
+
+	if (task->re_cache == NULL) {
+		task->re_cache = rspamd_pool_hash_new (task->task_pool,
+				rspamd_str_hash, rspamd_str_equal, re_cache_hint);
+	}
 
-	p = g_hash_table_lookup (task->re_cache, re);
+	p = rspamd_pool_hash_lookup (task->re_cache, re);
 
 	if (p != NULL) {
 		ret = GPOINTER_TO_INT (p) & ~mask;
 	}
 
-	g_hash_table_insert (task->re_cache, (gpointer)re,
+	rspamd_pool_hash_insert (task->re_cache, (gpointer)re,
 			GINT_TO_POINTER (value | mask));
 
 	return ret;
@@ -516,8 +1049,17 @@ rspamd_task_re_cache_check (struct rspamd_task *task, const gchar *re)
 	guint ret = RSPAMD_TASK_CACHE_NO_VALUE;
 	static const guint32 mask = 1 << 31;
 	gpointer p;
+	gint id;
+
+	if ((id = rspamd_task_re_cache_lookup_id (task, re)) != -1) {
+		return rspamd_task_re_cache_check_id (task, id);
+	}
+
+	if (task->re_cache == NULL) {
+		return ret;
+	}
 
-	p = g_hash_table_lookup (task->re_cache, re);
+	p = rspamd_pool_hash_lookup (task->re_cache, re);
 
 	if (p != NULL) {
 		ret = GPOINTER_TO_INT (p) & ~mask;
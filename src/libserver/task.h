@@ -29,6 +29,10 @@
 #include "util.h"
 #include "mem_pool.h"
 #include "dns.h"
+#include "classify_executor.h"
+#include "task_scheduler.h"
+
+struct rspamd_histogram;
 
 enum rspamd_command {
 	CMD_CHECK,
@@ -38,6 +42,7 @@ enum rspamd_command {
 	CMD_SKIP,
 	CMD_PING,
 	CMD_PROCESS,
+	CMD_BATCH,
 	CMD_OTHER
 };
 
@@ -61,10 +66,28 @@ enum rspamd_metric_action {
 #define RSPAMD_TASK_FLAG_NO_LOG (1 << 7)
 #define RSPAMD_TASK_FLAG_NO_IP (1 << 8)
 #define RSPAMD_TASK_FLAG_HAS_CONTROL (1 << 9)
+#define RSPAMD_TASK_FLAG_KEEP_ALIVE (1 << 10)
+#define RSPAMD_TASK_FLAG_CLASSIFY_OFFLOAD (1 << 11)
+#define RSPAMD_TASK_FLAG_MSGPACK (1 << 12)
+#define RSPAMD_TASK_FLAG_TRACE (1 << 13)
+/* Worker is overloaded: statistics and extra filters are skipped */
+#define RSPAMD_TASK_FLAG_OVERLOAD (1 << 14)
+/* DNS records for envelope and message headers have been prefetched */
+#define RSPAMD_TASK_FLAG_PREFETCH_ENVELOPE (1 << 15)
+#define RSPAMD_TASK_FLAG_PREFETCH_HEADERS (1 << 16)
+/* Message is larger than large_message_size and it is scanned with limits */
+#define RSPAMD_TASK_FLAG_LARGE (1 << 17)
+/* Learns are queued to be processed after the reply is written */
+#define RSPAMD_TASK_FLAG_LEARN_ASYNC (1 << 18)
+#define RSPAMD_TASK_FLAG_LEARN_SPAM (1 << 19)
+#define RSPAMD_TASK_FLAG_LEARN_HAM (1 << 20)
+/* Processing is stopped as the task has used more than `task_max_memory` */
+#define RSPAMD_TASK_FLAG_MEMORY_LIMIT (1 << 21)
 
 #define RSPAMD_TASK_IS_SKIPPED(task) (((task)->flags & RSPAMD_TASK_FLAG_SKIP))
 #define RSPAMD_TASK_IS_JSON(task) (((task)->flags & RSPAMD_TASK_FLAG_JSON))
 #define RSPAMD_TASK_IS_SPAMC(task) (((task)->flags & RSPAMD_TASK_FLAG_SPAMC))
+#define RSPAMD_TASK_IS_MSGPACK(task) (((task)->flags & RSPAMD_TASK_FLAG_MSGPACK))
 
 typedef gint (*protocol_reply_func)(struct rspamd_task *task);
 
@@ -73,6 +96,33 @@ struct custom_command {
 	protocol_reply_func func;
 };
 
+/**
+ * Stages of task processing measured by latency histograms
+ */
+enum rspamd_task_stage {
+	RSPAMD_TASK_STAGE_READ = 0,
+	RSPAMD_TASK_STAGE_PROCESS_MESSAGE,
+	RSPAMD_TASK_STAGE_PRE_FILTERS,
+	RSPAMD_TASK_STAGE_FILTERS,
+	RSPAMD_TASK_STAGE_CLASSIFY,
+	RSPAMD_TASK_STAGE_POST_FILTERS,
+	RSPAMD_TASK_STAGE_REPLY,
+	RSPAMD_TASK_STAGE_MAX
+};
+
+/* Maximum number of spans recorded for a traced task */
+#define RSPAMD_TASK_MAX_SPANS 4096
+
+/**
+ * Span of a traced task, names must live longer than the task
+ */
+struct rspamd_task_span {
+	const gchar *cat;
+	const gchar *name;
+	gdouble start;
+	gdouble end;
+};
+
 /**
  * Worker task structure
  */
@@ -117,11 +167,14 @@ struct rspamd_task {
 	GList *parts;                                               /**< list of parsed parts							*/
 	GList *text_parts;                                          /**< list of text parts								*/
 	gchar *raw_headers_str;                                     /**< list of raw headers							*/
-	GList *received;                                            /**< list of received headers						*/
+	GList *received;                                            /**< use rspamd_message_get_received				*/
+	struct raw_header *received_pending;                        /**< received headers that are not parsed yet		*/
 	GHashTable *urls;                                           /**< list of parsed urls							*/
 	GHashTable *emails;                                         /**< list of parsed emails							*/
 	GList *images;                                              /**< list of images									*/
-	GHashTable *raw_headers;                                    /**< list of raw headers							*/
+	rspamd_pool_hash_t *raw_headers;                            /**< list of raw headers							*/
+	struct raw_header **raw_headers_by_id;                      /**< raw headers indexed by header name ids		*/
+	guint raw_headers_ids;                                      /**< number of elements in raw_headers_by_id		*/
 	GHashTable *results;                                        /**< hash table of metric_result indexed by
 	                                                             *    metric's name									*/
 	GHashTable *tokens;                                         /**< hash table of tokens indexed by tokenizer
@@ -133,13 +186,17 @@ struct rspamd_task {
 	InternetAddressList *from_envelope;
 
 	GList *messages;                                            /**< list of messages that would be reported		*/
-	GHashTable *re_cache;                                       /**< cache for matched or not matched regexps		*/
+	rspamd_pool_hash_t *re_cache;                               /**< cache for regexps without id					*/
+	guint8 *re_checked;                                         /**< bitset of regexps ids with cached results		*/
+	guint *re_results;                                          /**< cached results of regexps indexed by id		*/
+	guint re_nelts;                                             /**< number of elements in regexps cache			*/
 	struct rspamd_config *cfg;                                  /**< pointer to config object						*/
 	gchar *last_error;                                          /**< last error										*/
 	gint error_code;                                                /**< code of last error								*/
 	rspamd_mempool_t *task_pool;                                    /**< memory pool for task							*/
 	double time_real;
 	double time_virtual;
+	double stage_time;                                          /**< start of the current stage						*/
 	struct timeval tv;
 	guint32 scan_milliseconds;                                  /**< how much milliseconds passed					*/
 	guint32 parser_recursion;                                   /**< for avoiding recursion stack overflow			*/
@@ -147,11 +204,16 @@ struct rspamd_task {
 	void *fin_arg;                                              /**< argument for fin callback						*/
 
 	guint32 dns_requests;                                       /**< number of DNS requests per this task			*/
+	guint32 lazy_words;                                         /**< number of parts tokenized on demand			*/
+	guint32 lazy_normalized;                                    /**< number of parts normalized on demand			*/
+	guint32 conn_requests;                                      /**< requests processed before over the connection	*/
+	gsize lua_memory;                                           /**< growth of lua memory while running symbols		*/
 
 	struct rspamd_dns_resolver *resolver;                       /**< DNS resolver									*/
 	struct event_base *ev_base;                                 /**< Event base										*/
 
-	GThreadPool *classify_pool;                                 /**< A pool of classify threads                     */
+	struct rspamd_classify_executor *classify_executor;         /**< Classifier threads (or NULL)					*/
+	struct rspamd_task_scheduler *scheduler;                    /**< Threads for CPU bound stages (or NULL)			*/
 	gpointer classify_data;										/**< Opaque classifiers data						*/
 
 	struct {
@@ -160,6 +222,10 @@ struct rspamd_task {
 	} pre_result;                                               /**< Result of pre-filters							*/
 
 	ucl_object_t *settings;                                     /**< Settings applied to task						*/
+	struct rspamd_settings *compiled_settings;                  /**< Compiled settings applied to task				*/
+
+	gpointer checkpoint;										/**< Opaque checkpoint data of symbols cache		*/
+	GArray *spans;                                              /**< spans of a traced task (or NULL)				*/
 };
 
 /**
@@ -188,15 +254,90 @@ gboolean rspamd_task_fin (void *arg);
  * Process task from http message and write reply or call task->fin_handler
  * @param task task to process
  * @param msg incoming http message
- * @param classify_pool classify pool (or NULL)
+ * @param executor classifier executor (or NULL)
  * @param process_extra_filters whether to check pre and post filters
  * @return task has been successfully parsed and processed
  */
 gboolean rspamd_task_process (struct rspamd_task *task,
 	struct rspamd_http_message *msg, const gchar *start, gsize len,
-	GThreadPool *classify_pool,
+	struct rspamd_classify_executor *executor,
 	gboolean process_extra_filters);
 
+/**
+ * Record time of the finished stage and start the next one, stage may be
+ * RSPAMD_TASK_STAGE_MAX to start the next stage without recording
+ * @param task task object
+ * @param stage finished stage
+ */
+void rspamd_task_stage_done (struct rspamd_task *task,
+	enum rspamd_task_stage stage);
+
+/**
+ * Get latencies of stages recorded by this process since they were merged to
+ * the shared statistics, they are never merged for tasks without a worker
+ * @return array of RSPAMD_TASK_STAGE_MAX histograms
+ */
+struct rspamd_histogram * rspamd_task_local_stages (void);
+
+/**
+ * Get name of a stage
+ * @param stage stage
+ * @return symbolic name used in statistics
+ */
+const gchar * rspamd_task_stage_name (enum rspamd_task_stage stage);
+
+/**
+ * Add finished span to a traced task, does nothing if a task is not traced
+ * @param task task object
+ * @param cat category of span
+ * @param name name of span
+ * @param start start time
+ * @param end finish time
+ */
+void rspamd_task_span_add (struct rspamd_task *task, const gchar *cat,
+	const gchar *name, gdouble start, gdouble end);
+
+/**
+ * Start span of a traced task
+ * @return id of span or -1 if a task is not traced
+ */
+gint rspamd_task_span_start (struct rspamd_task *task, const gchar *cat,
+	const gchar *name);
+
+/**
+ * Finish span started by rspamd_task_span_start
+ * @param task task object
+ * @param id id of span
+ */
+void rspamd_task_span_end (struct rspamd_task *task, gint id);
+
+/**
+ * Set action of a task before filters are finished, the action is changed
+ * only if it is stronger than the current one
+ * @param task task object
+ * @param action action
+ * @param str description of action (or NULL)
+ * @return TRUE if the action has been changed
+ */
+gboolean rspamd_task_set_pre_result (struct rspamd_task *task,
+	enum rspamd_metric_action action, const gchar *str);
+
+/**
+ * Get number of bytes used by a task: pages of its memory pool and growth of
+ * lua memory while its symbols were running
+ * @param task task object
+ * @return number of bytes
+ */
+gsize rspamd_task_memory_used (struct rspamd_task *task);
+
+/**
+ * Check whether a task has used more memory than `task_max_memory`, in this
+ * case processing of the task is stopped and the reply is an error
+ * @param task task object
+ * @return TRUE if the limit is exceeded
+ */
+gboolean rspamd_task_check_memory (struct rspamd_task *task);
+
 /**
  * Return address of sender or NULL
  * @param task
@@ -239,4 +380,22 @@ guint rspamd_task_re_cache_add (struct rspamd_task *task, const gchar *re,
  */
 guint rspamd_task_re_cache_check (struct rspamd_task *task, const gchar *re);
 
+/**
+ * Add or replace the value to the task cache of regular expressions results
+ * @param task task object
+ * @param id id of regexp in the regexps cache of config
+ * @param value value to add
+ * @return previous value of element or RSPAMD_TASK_CACHE_NO_VALUE
+ */
+guint rspamd_task_re_cache_add_id (struct rspamd_task *task, guint id,
+		guint value);
+
+/**
+ * Check for cached result of re inside cache
+ * @param task task object
+ * @param id id of regexp in the regexps cache of config
+ * @return the current value of element or RSPAMD_TASK_CACHE_NO_VALUE
+ */
+guint rspamd_task_re_cache_check_id (struct rspamd_task *task, guint id);
+
 #endif /* TASK_H_ */
@@ -0,0 +1,351 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "task_scheduler.h"
+#include "events.h"
+#include "task.h"
+#include "html.h"
+#include "mpmc_queue.h"
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+struct rspamd_task_job {
+	struct rspamd_task *task;
+	rspamd_task_stage_func func;
+	rspamd_task_stage_fin fin;
+	gint res;
+};
+
+struct rspamd_task_scheduler_thread {
+	GThread *thr;
+	struct rspamd_mpmc_queue *queue;        /* jobs assigned to this thread	*/
+	guint idx;
+	struct rspamd_task_scheduler *sched;
+};
+
+struct rspamd_task_scheduler {
+	struct rspamd_task_scheduler_thread *threads;
+	struct rspamd_mpmc_queue *output;       /* finished jobs					*/
+	guint nthreads;
+	guint queue_size;
+	guint inflight;                         /* accessed from event loop only	*/
+	guint next;                             /* accessed from event loop only	*/
+	gint pending;                           /* jobs that are not taken yet	*/
+	gint stop;
+	gint sleepers;                          /* threads waiting for new jobs	*/
+	gint signalled;                         /* wakeup is pending in event loop	*/
+	rspamd_mutex_t *mtx;
+	GCond *cond;
+	gint wake_fd[2];
+	struct event wake_ev;
+};
+
+/* Called when session is finished or destroyed */
+static void
+rspamd_task_job_fin (gpointer ud)
+{
+	struct rspamd_task_job *job = ud;
+
+	job->task = NULL;
+}
+
+static void
+rspamd_task_scheduler_notify (struct rspamd_task_scheduler *sched)
+{
+	guint64 val = 1;
+
+	if (g_atomic_int_compare_and_exchange (&sched->signalled, 0, 1)) {
+		if (write (sched->wake_fd[1], &val, sizeof (val)) == -1 &&
+				errno != EAGAIN) {
+			msg_err ("cannot wake up worker: %s", strerror (errno));
+		}
+	}
+}
+
+/*
+ * Take job from the own queue of a thread or steal it from other threads
+ */
+static struct rspamd_task_job *
+rspamd_task_scheduler_take (struct rspamd_task_scheduler_thread *thr)
+{
+	struct rspamd_task_scheduler *sched = thr->sched;
+	struct rspamd_task_job *job;
+	guint i;
+
+	job = rspamd_mpmc_queue_pop (thr->queue);
+
+	for (i = 1; job == NULL && i < sched->nthreads; i ++) {
+		job = rspamd_mpmc_queue_pop (
+				sched->threads[(thr->idx + i) % sched->nthreads].queue);
+	}
+
+	if (job != NULL) {
+		g_atomic_int_add (&sched->pending, -1);
+	}
+
+	return job;
+}
+
+static gpointer
+rspamd_task_scheduler_thread_func (gpointer ud)
+{
+	struct rspamd_task_scheduler_thread *thr = ud;
+	struct rspamd_task_scheduler *sched = thr->sched;
+	struct rspamd_task_job *job;
+	struct rspamd_task *task;
+	gboolean r;
+
+	for (;;) {
+		job = rspamd_task_scheduler_take (thr);
+
+		if (job == NULL) {
+			if (g_atomic_int_get (&sched->stop)) {
+				break;
+			}
+
+			rspamd_mutex_lock (sched->mtx);
+			g_atomic_int_inc (&sched->sleepers);
+
+			while (g_atomic_int_get (&sched->pending) == 0 &&
+					!g_atomic_int_get (&sched->stop)) {
+				rspamd_cond_wait (sched->cond, sched->mtx);
+			}
+
+			g_atomic_int_add (&sched->sleepers, -1);
+			rspamd_mutex_unlock (sched->mtx);
+
+			continue;
+		}
+
+		task = job->task;
+		job->res = job->func (task);
+
+		/* Task must not be touched after this point */
+		remove_async_thread (task->s);
+
+		/* Output queue can hold all jobs in flight */
+		r = rspamd_mpmc_queue_push (sched->output, job);
+		g_assert (r);
+
+		rspamd_task_scheduler_notify (sched);
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_task_scheduler_wakeup (gint fd, short what, gpointer ud)
+{
+	struct rspamd_task_scheduler *sched = ud;
+	struct rspamd_task_job *job;
+	struct rspamd_task *task;
+	guint64 val;
+
+	while (read (fd, &val, sizeof (val)) > 0);
+
+	/* Threads will signal again if they finish jobs after this point */
+	g_atomic_int_set (&sched->signalled, 0);
+
+	while ((job = rspamd_mpmc_queue_pop (sched->output)) != NULL) {
+		sched->inflight --;
+		task = job->task;
+
+		if (task != NULL) {
+			/* Our event keeps session alive while the next stage is started */
+			job->fin (task, job->res);
+			remove_normal_event (task->s, rspamd_task_job_fin, job);
+		}
+
+		g_slice_free1 (sizeof (*job), job);
+	}
+}
+
+struct rspamd_task_scheduler *
+rspamd_task_scheduler_new (struct event_base *ev_base,
+		guint nthreads, guint queue_size,
+		GError **err)
+{
+	struct rspamd_task_scheduler *sched;
+	struct rspamd_task_scheduler_thread *thr;
+	guint i;
+
+	g_assert (nthreads > 0);
+
+	sched = g_slice_alloc0 (sizeof (*sched));
+
+#ifdef HAVE_SYS_EVENTFD_H
+	sched->wake_fd[0] = eventfd (0, EFD_NONBLOCK);
+	sched->wake_fd[1] = sched->wake_fd[0];
+
+	if (sched->wake_fd[0] == -1) {
+#else
+	if (pipe (sched->wake_fd) == -1) {
+#endif
+		g_set_error (err, g_quark_from_static_string ("task-scheduler"),
+				errno, "cannot create wakeup descriptor: %s", strerror (errno));
+		g_slice_free1 (sizeof (*sched), sched);
+
+		return NULL;
+	}
+
+#ifndef HAVE_SYS_EVENTFD_H
+	rspamd_socket_nonblocking (sched->wake_fd[0]);
+	rspamd_socket_nonblocking (sched->wake_fd[1]);
+#endif
+
+	/* Lazily initialized static tables are not safe for threads */
+	rspamd_html_init ();
+
+	sched->queue_size = MAX (queue_size, 1);
+	sched->output = rspamd_mpmc_queue_new (sched->queue_size);
+	sched->mtx = rspamd_mutex_new ();
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
+	sched->cond = g_cond_new ();
+#else
+	sched->cond = g_malloc0 (sizeof (GCond));
+	g_cond_init (sched->cond);
+#endif
+
+	event_set (&sched->wake_ev, sched->wake_fd[0], EV_READ | EV_PERSIST,
+			rspamd_task_scheduler_wakeup, sched);
+	event_base_set (ev_base, &sched->wake_ev);
+	event_add (&sched->wake_ev, NULL);
+
+	sched->threads = g_new0 (struct rspamd_task_scheduler_thread, nthreads);
+
+	/* Queues must exist before any thread tries to steal from them */
+	for (i = 0; i < nthreads; i ++) {
+		thr = &sched->threads[i];
+		thr->sched = sched;
+		thr->idx = i;
+		/* Any queue can hold all jobs in flight */
+		thr->queue = rspamd_mpmc_queue_new (sched->queue_size);
+	}
+
+	/* Threads are not running yet, so they see the final number of them */
+	sched->nthreads = nthreads;
+
+	for (i = 0; i < nthreads; i ++) {
+		thr = &sched->threads[i];
+		thr->thr = rspamd_create_thread ("scheduler",
+				rspamd_task_scheduler_thread_func, thr, err);
+
+		if (thr->thr == NULL) {
+			break;
+		}
+	}
+
+	if (i < nthreads) {
+		rspamd_task_scheduler_destroy (sched);
+
+		return NULL;
+	}
+
+	return sched;
+}
+
+gboolean
+rspamd_task_scheduler_push (struct rspamd_task_scheduler *sched,
+		struct rspamd_task *task,
+		rspamd_task_stage_func func,
+		rspamd_task_stage_fin fin)
+{
+	struct rspamd_task_job *job;
+	gboolean r;
+
+	if (sched->inflight >= sched->queue_size) {
+		return FALSE;
+	}
+
+	job = g_slice_alloc (sizeof (*job));
+	job->task = task;
+	job->func = func;
+	job->fin = fin;
+	job->res = 0;
+
+	register_async_event (task->s, rspamd_task_job_fin, job,
+			g_quark_from_static_string ("scheduler"));
+	register_async_thread (task->s);
+
+	/* Queue cannot be full as we limit number of jobs in flight */
+	r = rspamd_mpmc_queue_push (sched->threads[sched->next].queue, job);
+	g_assert (r);
+	sched->next = (sched->next + 1) % sched->nthreads;
+	sched->inflight ++;
+	g_atomic_int_inc (&sched->pending);
+
+	if (g_atomic_int_get (&sched->sleepers) > 0) {
+		rspamd_mutex_lock (sched->mtx);
+		g_cond_signal (sched->cond);
+		rspamd_mutex_unlock (sched->mtx);
+	}
+
+	return TRUE;
+}
+
+void
+rspamd_task_scheduler_destroy (struct rspamd_task_scheduler *sched)
+{
+	struct rspamd_task_job *job;
+	guint i;
+
+	g_atomic_int_set (&sched->stop, 1);
+	rspamd_mutex_lock (sched->mtx);
+	g_cond_broadcast (sched->cond);
+	rspamd_mutex_unlock (sched->mtx);
+
+	for (i = 0; i < sched->nthreads; i ++) {
+		if (sched->threads[i].thr != NULL) {
+			g_thread_join (sched->threads[i].thr);
+		}
+
+		rspamd_mpmc_queue_free (sched->threads[i].queue);
+	}
+
+	/* Jobs of the tasks that are still alive */
+	while ((job = rspamd_mpmc_queue_pop (sched->output)) != NULL) {
+		g_slice_free1 (sizeof (*job), job);
+	}
+
+	event_del (&sched->wake_ev);
+	close (sched->wake_fd[0]);
+
+	if (sched->wake_fd[1] != sched->wake_fd[0]) {
+		close (sched->wake_fd[1]);
+	}
+
+	rspamd_mpmc_queue_free (sched->output);
+	rspamd_mutex_free (sched->mtx);
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
+	g_cond_free (sched->cond);
+#else
+	g_cond_clear (sched->cond);
+	g_free (sched->cond);
+#endif
+	g_free (sched->threads);
+	g_slice_free1 (sizeof (*sched), sched);
+}
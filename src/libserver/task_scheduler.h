@@ -0,0 +1,82 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TASK_SCHEDULER_H_
+#define TASK_SCHEDULER_H_
+
+#include "config.h"
+#include <event.h>
+
+/*
+ * Task scheduler: CPU bound stages of tasks are executed by a set of threads.
+ * Each thread has its own queue, tasks are spread over queues and threads
+ * that have nothing to do steal tasks from queues of other threads. I/O of
+ * tasks is performed by the event loop of the worker only, finished stages
+ * are returned to it via eventfd (or pipe where eventfd is unavailable)
+ */
+struct rspamd_task_scheduler;
+struct rspamd_task;
+
+/*
+ * Stage function that is called from a scheduler thread, it must not use
+ * lua, events or any other state that is not owned by the task
+ */
+typedef gint (*rspamd_task_stage_func) (struct rspamd_task *task);
+/*
+ * Continuation that is called from the event loop with the result of stage
+ */
+typedef void (*rspamd_task_stage_fin) (struct rspamd_task *task, gint res);
+
+/**
+ * Create new scheduler and start its threads
+ * @param ev_base event base of the worker
+ * @param nthreads number of threads
+ * @param queue_size maximum number of tasks in flight
+ * @return new scheduler or NULL in case of error
+ */
+struct rspamd_task_scheduler * rspamd_task_scheduler_new (
+		struct event_base *ev_base,
+		guint nthreads, guint queue_size,
+		GError **err);
+
+/**
+ * Execute stage of a task in scheduler threads, session of the task is not
+ * finished until `fin` is called
+ * @param sched scheduler
+ * @param task task
+ * @param func stage function
+ * @param fin continuation
+ * @return FALSE if too many tasks are in flight and the stage should be
+ * executed inline
+ */
+gboolean rspamd_task_scheduler_push (struct rspamd_task_scheduler *sched,
+		struct rspamd_task *task,
+		rspamd_task_stage_func func,
+		rspamd_task_stage_fin fin);
+
+/**
+ * Stop threads and destroy scheduler
+ * @param sched scheduler
+ */
+void rspamd_task_scheduler_destroy (struct rspamd_task_scheduler *sched);
+
+#endif /* TASK_SCHEDULER_H_ */
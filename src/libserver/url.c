@@ -32,6 +32,10 @@
 #include "message.h"
 #include "http.h"
 #include "acism.h"
+#include "xxhash.h"
+#include "platform_config.h"
+
+extern unsigned long cpu_config;
 
 typedef struct url_match_s {
 	const gchar *m_begin;
@@ -128,14 +132,79 @@ struct url_matcher static_matchers[] = {
 	  URL_FLAG_NOHTML }
 };
 
+#define URL_TLD_NORMAL (1 << 0)
+#define URL_TLD_STAR (1 << 1)
+#define URL_TLD_EXCEPTION (1 << 2)
+
+/* Open addressing table of public suffixes used to find TLD of a host */
+struct url_tld_entry {
+	guint32 hash;
+	guint32 off;
+	guint16 len;
+	guint16 flags;
+};
+
+struct url_tld_table {
+	struct url_tld_entry *entries;
+	gchar *names;
+	guint32 mask;
+	guint32 nelts;
+};
+
 struct url_match_scanner {
 	GArray *matchers;
 	GArray *patterns;
 	ac_trie_t *search_trie;
+	struct url_tld_table tlds;
+	/* Max bytes of pattern before and from its first anchor, -1 if unused */
+	gint anchor_before;
+	gint anchor_after;
 };
 
 struct url_match_scanner *url_scanner = NULL;
 
+/*
+ * Every pattern contains one of these characters, so text without them
+ * cannot contain urls and is skipped before running the trie
+ */
+#define URL_IS_ANCHOR(c) ((c) == ':' || (c) == '.' || (c) == '@')
+
+typedef struct rspamd_url_anchor_impl_s {
+	unsigned long cpu_flags;
+	const char *desc;
+	const gchar * (*find) (const gchar *p, const gchar *end);
+} rspamd_url_anchor_impl_t;
+
+#define URL_ANCHOR_DECLARE(ext) \
+		static const gchar * rspamd_url_anchor_##ext (const gchar *p, \
+				const gchar *end);
+#define URL_ANCHOR_IMPL(cpuflags, desc, ext) \
+		{(cpuflags), desc, rspamd_url_anchor_##ext}
+
+#if defined(HAVE_AVX2) && defined(HAVE_TARGET_ATTRIBUTE)
+	URL_ANCHOR_DECLARE(avx2)
+	#define URL_ANCHOR_AVX2 URL_ANCHOR_IMPL(CPUID_AVX2, "avx2", avx2)
+#endif
+#if defined(HAVE_SSE2) && defined(HAVE_TARGET_ATTRIBUTE)
+	URL_ANCHOR_DECLARE(sse2)
+	#define URL_ANCHOR_SSE2 URL_ANCHOR_IMPL(CPUID_SSE2, "sse2", sse2)
+#endif
+
+URL_ANCHOR_DECLARE(generic)
+#define URL_ANCHOR_GENERIC URL_ANCHOR_IMPL(0, "generic", generic)
+
+static const rspamd_url_anchor_impl_t url_anchor_list[] = {
+	URL_ANCHOR_GENERIC,
+#if defined(URL_ANCHOR_AVX2)
+	URL_ANCHOR_AVX2,
+#endif
+#if defined(URL_ANCHOR_SSE2)
+	URL_ANCHOR_SSE2
+#endif
+};
+
+static const rspamd_url_anchor_impl_t *url_anchor_impl = &url_anchor_list[0];
+
 static guchar url_scanner_table[256] = {
 	1,  1,  1,  1,  1,  1,  1,  1,  1,  9,  9,  1,  1,  9,  1,  1,
 	1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
@@ -279,6 +348,150 @@ rspamd_url_strerror (enum uri_errno err)
 	return NULL;
 }
 
+static inline guint32
+rspamd_url_tld_hash (const gchar *name, gsize len)
+{
+	return XXH64 (name, len, 0xdeadbabe);
+}
+
+static struct url_tld_entry *
+rspamd_url_tld_find (struct url_tld_table *tbl, const gchar *name, gsize len)
+{
+	struct url_tld_entry *e;
+	guint32 h, i;
+
+	if (tbl->entries == NULL) {
+		return NULL;
+	}
+
+	h = rspamd_url_tld_hash (name, len);
+
+	for (i = h & tbl->mask; ; i = (i + 1) & tbl->mask) {
+		e = &tbl->entries[i];
+
+		if (e->len == 0) {
+			return NULL;
+		}
+
+		if (e->hash == h && e->len == len &&
+				memcmp (tbl->names + e->off, name, len) == 0) {
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Build table from names array (NUL separated) and the list of entries with
+ * offsets, lengths and flags filled
+ */
+static void
+rspamd_url_tld_build (struct url_tld_table *tbl, GString *names,
+		GArray *pending)
+{
+	struct url_tld_entry *src, *e;
+	guint32 i, j, size = 16;
+
+	while (size < pending->len * 2) {
+		size <<= 1;
+	}
+
+	tbl->entries = g_malloc0 (size * sizeof (struct url_tld_entry));
+	tbl->mask = size - 1;
+	tbl->nelts = 0;
+	tbl->names = g_string_free (names, FALSE);
+
+	for (i = 0; i < pending->len; i ++) {
+		src = &g_array_index (pending, struct url_tld_entry, i);
+		e = rspamd_url_tld_find (tbl, tbl->names + src->off, src->len);
+
+		if (e != NULL) {
+			/* The same suffix may be listed with different rules */
+			e->flags |= src->flags;
+			continue;
+		}
+
+		for (j = src->hash & tbl->mask; tbl->entries[j].len != 0;
+				j = (j + 1) & tbl->mask);
+
+		tbl->entries[j] = *src;
+		tbl->nelts ++;
+	}
+}
+
+static void
+rspamd_url_tld_add (GString *names, GArray *pending, const gchar *name,
+		gint flags)
+{
+	struct url_tld_entry e;
+	gsize len = strlen (name);
+
+	if (len == 0 || len > G_MAXUINT16) {
+		return;
+	}
+
+	e.off = names->len;
+	e.len = len;
+	e.flags = flags;
+	g_string_append_len (names, name, len);
+	g_string_append_c (names, '\0');
+	rspamd_str_lc (names->str + e.off, len);
+	e.hash = rspamd_url_tld_hash (names->str + e.off, len);
+	g_array_append_val (pending, e);
+}
+
+/*
+ * Find the longest public suffix of the host that is not the host itself
+ * and return the start of the domain registered under it
+ */
+static const gchar *
+rspamd_url_tld_resolve (const gchar *host, gsize hostlen)
+{
+	struct url_tld_table *tbl = &url_scanner->tlds;
+	struct url_tld_entry *e;
+	const gchar *p, *end = host + hostlen, *suffix = end, *etld = NULL;
+	gboolean star = FALSE;
+
+	p = end;
+
+	while (p > host) {
+		/* Go to the dot before the next label */
+		p --;
+		while (p > host && *p != '.') {
+			p --;
+		}
+
+		if (*p != '.') {
+			break;
+		}
+
+		e = rspamd_url_tld_find (tbl, p + 1, end - p - 1);
+
+		if (e != NULL && (e->flags & URL_TLD_EXCEPTION)) {
+			/* Exceptions are registered domains under a star rule */
+			etld = suffix;
+			break;
+		}
+
+		if (star || (e != NULL && (e->flags & (URL_TLD_NORMAL|URL_TLD_STAR)))) {
+			etld = p + 1;
+		}
+
+		star = e != NULL && (e->flags & URL_TLD_STAR);
+		suffix = p + 1;
+	}
+
+	if (etld == NULL || etld == end) {
+		return NULL;
+	}
+
+	/* Include one more label */
+	for (p = etld - 1; p > host && *(p - 1) != '.'; p --);
+
+	return p;
+}
+
 static void
 rspamd_url_parse_tld_file (const gchar *fname, struct url_match_scanner *scanner)
 {
@@ -289,6 +502,8 @@ rspamd_url_parse_tld_file (const gchar *fname, struct url_match_scanner *scanner
 	gsize buflen = 0, patlen;
 	gssize r;
 	gint flags;
+	GString *names;
+	GArray *pending;
 
 	f = fopen (fname, "r");
 
@@ -297,6 +512,10 @@ rspamd_url_parse_tld_file (const gchar *fname, struct url_match_scanner *scanner
 		return;
 	}
 
+	names = g_string_sized_new (BUFSIZ);
+	pending = g_array_sized_new (FALSE, FALSE, sizeof (struct url_tld_entry),
+			BUFSIZ);
+
 	m.end = url_tld_end;
 	m.start = url_tld_start;
 	m.prefix = "http://";
@@ -309,9 +528,9 @@ rspamd_url_parse_tld_file (const gchar *fname, struct url_match_scanner *scanner
 
 		g_strchomp (linebuf);
 
-		/* TODO: add support for ! patterns */
+		/* Exceptions are used for TLD lookups only */
 		if (linebuf[0] == '!') {
-			msg_debug ("skip '!' patterns from parsing for now: %s", linebuf);
+			rspamd_url_tld_add (names, pending, linebuf + 1, URL_TLD_EXCEPTION);
 			continue;
 		}
 
@@ -326,9 +545,11 @@ rspamd_url_parse_tld_file (const gchar *fname, struct url_match_scanner *scanner
 				continue;
 			}
 			p ++;
+			rspamd_url_tld_add (names, pending, p, URL_TLD_STAR);
 		}
 		else {
 			p = linebuf;
+			rspamd_url_tld_add (names, pending, p, URL_TLD_NORMAL);
 		}
 
 		patlen = strlen (p);
@@ -344,6 +565,10 @@ rspamd_url_parse_tld_file (const gchar *fname, struct url_match_scanner *scanner
 
 	free (linebuf);
 	fclose (f);
+
+	rspamd_url_tld_build (&scanner->tlds, names, pending);
+	g_array_free (pending, TRUE);
+	msg_info ("loaded %ud public suffixes from %s", scanner->tlds.nelts, fname);
 }
 
 static void
@@ -361,11 +586,124 @@ rspamd_url_add_static_matchers (struct url_match_scanner *sc)
 	}
 }
 
+static const gchar *
+rspamd_url_anchor_generic (const gchar *p, const gchar *end)
+{
+	while (p < end) {
+		if (URL_IS_ANCHOR (*p)) {
+			return p;
+		}
+		p ++;
+	}
+
+	return end;
+}
+
+#if defined(HAVE_AVX2) && defined(HAVE_TARGET_ATTRIBUTE)
+#include <immintrin.h>
+
+__attribute__((target("avx2"))) static const gchar *
+rspamd_url_anchor_avx2 (const gchar *p, const gchar *end)
+{
+	__m256i colon, dot, at, v, m;
+	guint32 mask;
+
+	colon = _mm256_set1_epi8 (':');
+	dot = _mm256_set1_epi8 ('.');
+	at = _mm256_set1_epi8 ('@');
+
+	while (end - p >= 32) {
+		v = _mm256_loadu_si256 ((const __m256i *)p);
+		m = _mm256_or_si256 (_mm256_cmpeq_epi8 (v, colon),
+				_mm256_or_si256 (_mm256_cmpeq_epi8 (v, dot),
+						_mm256_cmpeq_epi8 (v, at)));
+		mask = _mm256_movemask_epi8 (m);
+
+		if (mask != 0) {
+			return p + __builtin_ctz (mask);
+		}
+
+		p += 32;
+	}
+
+	return rspamd_url_anchor_generic (p, end);
+}
+#endif
+
+#if defined(HAVE_SSE2) && defined(HAVE_TARGET_ATTRIBUTE)
+#include <emmintrin.h>
+
+__attribute__((target("sse2"))) static const gchar *
+rspamd_url_anchor_sse2 (const gchar *p, const gchar *end)
+{
+	__m128i colon, dot, at, v, m;
+	guint32 mask;
+
+	colon = _mm_set1_epi8 (':');
+	dot = _mm_set1_epi8 ('.');
+	at = _mm_set1_epi8 ('@');
+
+	while (end - p >= 16) {
+		v = _mm_loadu_si128 ((const __m128i *)p);
+		m = _mm_or_si128 (_mm_cmpeq_epi8 (v, colon),
+				_mm_or_si128 (_mm_cmpeq_epi8 (v, dot),
+						_mm_cmpeq_epi8 (v, at)));
+		mask = _mm_movemask_epi8 (m);
+
+		if (mask != 0) {
+			return p + __builtin_ctz (mask);
+		}
+
+		p += 16;
+	}
+
+	return rspamd_url_anchor_generic (p, end);
+}
+#endif
+
+/*
+ * Find how far a pattern may extend around its first anchor character
+ */
+static void
+rspamd_url_init_anchors (struct url_match_scanner *sc)
+{
+	ac_trie_pat_t *pat;
+	guint i;
+	gsize j;
+
+	sc->anchor_before = 0;
+	sc->anchor_after = 0;
+
+	for (i = 0; i < sc->patterns->len; i ++) {
+		pat = &g_array_index (sc->patterns, ac_trie_pat_t, i);
+
+		for (j = 0; j < pat->len; j ++) {
+			if (URL_IS_ANCHOR (pat->ptr[j])) {
+				break;
+			}
+		}
+
+		if (j == pat->len) {
+			msg_info ("pattern %*s has no anchor chars, disable url prefilter",
+					(gint)pat->len, pat->ptr);
+			sc->anchor_before = -1;
+			sc->anchor_after = -1;
+
+			return;
+		}
+
+		sc->anchor_before = MAX (sc->anchor_before, (gint)j);
+		sc->anchor_after = MAX (sc->anchor_after, (gint)(pat->len - j));
+	}
+}
+
 void
 rspamd_url_init (const gchar *tld_file)
 {
+	guint i;
+
 	if (url_scanner == NULL) {
-		url_scanner = g_malloc (sizeof (struct url_match_scanner));
+		url_scanner = g_malloc0 (sizeof (struct url_match_scanner));
 		url_scanner->matchers = g_array_sized_new (FALSE, TRUE,
 				sizeof (struct url_matcher), 512);
 		url_scanner->patterns = g_array_sized_new (FALSE, TRUE,
@@ -384,9 +722,28 @@ rspamd_url_init (const gchar *tld_file)
 				url_scanner->patterns->len);
 
 		msg_info ("initialized ac_trie of %ud elements", url_scanner->patterns->len);
+
+		rspamd_url_init_anchors (url_scanner);
+
+		if (cpu_config != 0) {
+			for (i = 0; i < G_N_ELEMENTS (url_anchor_list); i ++) {
+				if (url_anchor_list[i].cpu_flags & cpu_config) {
+					url_anchor_impl = &url_anchor_list[i];
+					break;
+				}
+			}
+		}
+
+		msg_debug ("use %s kernel for url anchors", url_anchor_impl->desc);
 	}
 }
 
+const gchar *
+rspamd_url_scanner_impl (void)
+{
+	return url_anchor_impl->desc;
+}
+
 #define SET_U(u, field) do {												\
 	if ((u) != NULL) {														\
 		(u)->field_set |= 1 << (field);										\
@@ -919,69 +1276,14 @@ out:
 
 #undef SET_U
 
-static gint
-rspamd_tld_trie_callback (int strnum, int textpos, void *context)
-{
-	struct url_matcher *matcher;
-	const gchar *start, *pos, *p;
-	struct rspamd_url *url = context;
-	ac_trie_pat_t *pat;
-	gint ndots = 1;
-
-	matcher = &g_array_index (url_scanner->matchers, struct url_matcher, strnum);
-	pat = &g_array_index (url_scanner->patterns, ac_trie_pat_t, strnum);
-
-	if (matcher->flags & URL_FLAG_STAR_MATCH) {
-		/* Skip one more tld component */
-		ndots = 2;
-	}
-
-	pos = url->host + textpos - pat->len;
-	p = pos - 1;
-	start = url->host;
-
-	if (*pos != '.' || textpos != (gint)url->hostlen) {
-		/* Something weird has been found */
-		if (textpos == (gint)url->hostlen - 1) {
-			pos = url->host + textpos;
-			if (*pos == '.') {
-				/* This is dot at the end of domain */
-				url->hostlen --;
-			}
-		}
-		else {
-			return 0;
-		}
-	}
-
-	/* Now we need to find top level domain */
-	pos = start;
-	while (p >= start && ndots > 0) {
-		if (*p == '.') {
-			ndots --;
-			pos = p + 1;
-		}
-
-		p --;
-	}
-
-	if (ndots == 0 || p == start - 1) {
-		url->tld = (gchar *)pos;
-		url->tldlen = url->host + url->hostlen - pos;
-	}
-
-	return 1;
-}
-
 enum uri_errno
 rspamd_url_parse (struct rspamd_url *uri, gchar *uristring, gsize len,
 		rspamd_mempool_t *pool)
 {
 	struct http_parser_url u;
 	gchar *p, *comp, t;
-	const gchar *end;
-	guint i, complen, ret;
-	gint state = 0;
+	const gchar *end, *tld;
+	guint i, complen, ret, hostlen;
 
 	const struct {
 		enum rspamd_url_protocol proto;
@@ -1109,9 +1411,21 @@ rspamd_url_parse (struct rspamd_url *uri, gchar *uristring, gsize len,
 		}
 	}
 
-	/* Find TLD part */
-	if (acism_lookup (url_scanner->search_trie, uri->host, uri->hostlen,
-			rspamd_tld_trie_callback, uri, &state, true) == 0) {
+	/* Find TLD part, we allow . at the end of the domain however */
+	hostlen = uri->hostlen;
+
+	if (hostlen > 1 && uri->host[hostlen - 1] == '.') {
+		hostlen --;
+	}
+
+	tld = rspamd_url_tld_resolve (uri->host, hostlen);
+
+	if (tld != NULL) {
+		uri->hostlen = hostlen;
+		uri->tld = (gchar *)tld;
+		uri->tldlen = uri->host + hostlen - tld;
+	}
+	else {
 		/* Ignore URL's without TLD if it is not a numeric URL */
 		for (i = 0; i < uri->hostlen; i ++) {
 			t = uri->host[i];
@@ -1479,6 +1793,7 @@ struct url_callback_data {
 	const gchar *start;
 	const gchar *fin;
 	const gchar *end;
+	gsize offset;
 };
 
 static gint
@@ -1498,7 +1813,7 @@ rspamd_url_trie_callback (int strnum, int textpos, void *context)
 
 	if (matcher->flags & URL_FLAG_TLD_MATCH) {
 		/* Immediately check pos for valid chars */
-		pos = &cb->begin[textpos];
+		pos = &cb->begin[cb->offset + textpos];
 		if (pos < cb->end) {
 			if (!g_ascii_isspace (*pos) && *pos != '/' && *pos != '?' && *pos != ':') {
 				if (*pos == '.') {
@@ -1523,7 +1838,7 @@ rspamd_url_trie_callback (int strnum, int textpos, void *context)
 	m.pattern = matcher->pattern;
 	m.prefix = matcher->prefix;
 	m.add_prefix = FALSE;
-	pos = cb->begin + textpos - pat->len;
+	pos = cb->begin + cb->offset + textpos - pat->len;
 
 	if (matcher->start (cb->begin, cb->end, pos,
 			&m) && matcher->end (cb->begin, cb->end, pos, &m)) {
@@ -1555,6 +1870,54 @@ rspamd_url_trie_callback (int strnum, int textpos, void *context)
 	return 0;
 }
 
+/*
+ * Run the trie only over segments around anchor characters. Any match lies
+ * within [anchor - before, anchor + after) of its first anchor, and
+ * overlapping windows are merged, so segments can be searched independently
+ */
+static gint
+rspamd_url_find_anchored (struct url_callback_data *cb)
+{
+	const gchar *p, *a, *next, *seg_start, *seg_end, *end = cb->end;
+	gsize before = url_scanner->anchor_before,
+			after = url_scanner->anchor_after;
+	gint ret, state;
+
+	p = cb->begin;
+	next = url_anchor_impl->find (p, end);
+
+	while (next < end) {
+		a = next;
+		seg_start = (gsize)(a - p) > before ? a - before : p;
+		seg_end = (gsize)(end - a) > after ? a + after : end;
+
+		for (;;) {
+			next = url_anchor_impl->find (a + 1, end);
+
+			if (next == end ||
+					(next >= seg_end && (gsize)(next - seg_end) >= before)) {
+				break;
+			}
+
+			a = next;
+			seg_end = (gsize)(end - a) > after ? a + after : end;
+		}
+
+		state = 0;
+		cb->offset = seg_start - cb->begin;
+		ret = acism_lookup (url_scanner->search_trie, seg_start,
+				seg_end - seg_start, rspamd_url_trie_callback, cb, &state, true);
+
+		if (ret) {
+			return ret;
+		}
+
+		p = seg_end;
+	}
+
+	return 0;
+}
+
 gboolean
 rspamd_url_find (rspamd_mempool_t *pool,
 	const gchar *begin,
@@ -1581,8 +1944,15 @@ rspamd_url_find (rspamd_mempool_t *pool,
 		state = 0;
 	}
 
-	ret = acism_lookup (url_scanner->search_trie, begin, len,
-			rspamd_url_trie_callback, &cb, &state, true);
+	if (url_scanner->anchor_before >= 0) {
+		/* Segments are searched from scratch, so there is no state to keep */
+		ret = rspamd_url_find_anchored (&cb);
+		state = 0;
+	}
+	else {
+		ret = acism_lookup (url_scanner->search_trie, begin, len,
+				rspamd_url_trie_callback, &cb, &state, true);
+	}
 
 	if (statep) {
 		*statep = state;
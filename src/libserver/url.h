@@ -64,6 +64,11 @@ enum rspamd_url_protocol {
  */
 void rspamd_url_init (const gchar *tld_file);
 
+/**
+ * Returns name of the kernel used to find url anchors in text
+ */
+const gchar * rspamd_url_scanner_impl (void);
+
 /*
  * Parse urls inside text
  * @param pool memory pool
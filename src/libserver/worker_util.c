@@ -24,6 +24,8 @@
 #include "config.h"
 #include "main.h"
 #include "message.h"
+#include "map.h"
+#include "upstream.h"
 #include "lua/lua_common.h"
 
 /**
@@ -89,6 +91,23 @@ rspamd_worker_usr1_handler (gint fd, short what, void *arg)
 	}
 }
 
+/*
+ * Spare worker replaces a dead one, it is fully initialized at this moment so
+ * it just starts accepting connections
+ */
+static void
+rspamd_worker_spare_handler (gint fd, short what, void *arg)
+{
+	struct rspamd_worker_signal_handler *sigh =
+			(struct rspamd_worker_signal_handler *)arg;
+
+	if (sigh->worker->spare && !wanna_die) {
+		msg_info ("spare worker is activated");
+		sigh->worker->spare = FALSE;
+		rspamd_worker_pause_accept (sigh->worker, FALSE);
+	}
+}
+
 static void
 rspamd_worker_term_handler (gint fd, short what, void *arg)
 {
@@ -112,6 +131,28 @@ rspamd_worker_term_handler (gint fd, short what, void *arg)
 	}
 }
 
+/*
+ * Config reload in place for workers that support it, post handler of this
+ * signal reloads config
+ */
+static void
+rspamd_worker_hup_handler (gint fd, short what, void *arg)
+{
+	struct rspamd_worker_signal_handler *sigh =
+			(struct rspamd_worker_signal_handler *)arg;
+
+	if (!sigh->worker->srv->cfg->graceful_reload) {
+		/* Main process restarts workers in this case */
+		sigh->post_handler = NULL;
+		rspamd_worker_term_handler (fd, what, arg);
+	}
+	else if (!wanna_die) {
+		msg_info ("reloading config after receiving %s signal",
+				strsignal (sigh->signo));
+		sigh->post_handler (sigh->handler_data);
+	}
+}
+
 static void
 rspamd_worker_ignore_signal (int signo)
 {
@@ -165,6 +206,8 @@ rspamd_worker_init_signals (struct rspamd_worker *worker, struct event_base *bas
 			rspamd_worker_usr1_handler);
 	rspamd_worker_set_signal_handler (SIGUSR2, worker, base,
 			rspamd_worker_usr2_handler);
+	rspamd_worker_set_signal_handler (RSPAMD_SPARE_SIGNAL, worker, base,
+			rspamd_worker_spare_handler);
 
 	/* Unblock all signals processed */
 	sigemptyset (&signals.sa_mask);
@@ -176,6 +219,7 @@ rspamd_worker_init_signals (struct rspamd_worker *worker, struct event_base *bas
 	sigaddset (&signals.sa_mask, SIGUSR2);
 	sigaddset (&signals.sa_mask, SIGALRM);
 	sigaddset (&signals.sa_mask, SIGPIPE);
+	sigaddset (&signals.sa_mask, RSPAMD_SPARE_SIGNAL);
 
 	sigprocmask (SIG_UNBLOCK, &signals.sa_mask, NULL);
 }
@@ -213,7 +257,11 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 			event_set (accept_event, listen_socket, EV_READ | EV_PERSIST,
 				accept_handler, worker);
 			event_base_set (ev_base, accept_event);
-			event_add (accept_event, NULL);
+
+			if (!worker->spare) {
+				event_add (accept_event, NULL);
+			}
+
 			worker->accept_events = g_list_prepend (worker->accept_events,
 					accept_event);
 		}
@@ -257,6 +305,120 @@ rspamd_worker_stop_accept (struct rspamd_worker *worker)
 	g_hash_table_unref (worker->signal_events);
 }
 
+void
+rspamd_worker_pause_accept (struct rspamd_worker *worker, gboolean pause)
+{
+	GList *cur;
+	struct event *event;
+
+	if (worker->spare) {
+		/* Spare workers accept nothing until they are activated */
+		return;
+	}
+
+	/* New connections wait in the listen queue */
+	for (cur = worker->accept_events; cur != NULL; cur = g_list_next (cur)) {
+		event = cur->data;
+
+		if (pause) {
+			event_del (event);
+		}
+		else {
+			event_add (event, NULL);
+		}
+	}
+}
+
+void
+rspamd_worker_set_reload_handler (struct rspamd_worker *worker,
+	void (*handler)(void *ud), void *ud)
+{
+	struct rspamd_worker_signal_handler *sigh;
+
+	sigh = g_hash_table_lookup (worker->signal_events, GINT_TO_POINTER (SIGHUP));
+	g_assert (sigh != NULL);
+
+	event_del (&sigh->ev);
+	signal_set (&sigh->ev, SIGHUP, rspamd_worker_hup_handler, sigh);
+	event_base_set (sigh->base, &sigh->ev);
+	signal_add (&sigh->ev, NULL);
+	sigh->post_handler = handler;
+	sigh->handler_data = ud;
+}
+
+struct rspamd_config *
+rspamd_worker_read_config (struct rspamd_worker *worker)
+{
+	struct rspamd_config *cfg, *old_cfg = worker->srv->cfg;
+	gchar *path;
+
+	cfg = g_malloc0 (sizeof (*cfg));
+	rspamd_init_cfg (cfg, FALSE);
+	cfg->lua_state = old_cfg->lua_state;
+	cfg->cfg_name = rspamd_mempool_strdup (cfg->cfg_pool, old_cfg->cfg_name);
+	cfg->cfg_cache_file = old_cfg->cfg_cache_file;
+	cfg->c_modules = g_hash_table_ref (old_cfg->c_modules);
+
+	/* Logging is not reconfigured as the logger is shared with old config */
+	if (!rspamd_config_read (cfg, cfg->cfg_name, NULL, NULL, NULL)) {
+		rspamd_config_free (cfg);
+		g_free (cfg);
+
+		return NULL;
+	}
+
+	if (!cfg->temp_dir) {
+		cfg->temp_dir = rspamd_mempool_strdup (cfg->cfg_pool,
+				old_cfg->temp_dir);
+	}
+
+	if (cfg->regexp_cache_dir) {
+		/* The main process has just saved patterns of the new config */
+		path = g_build_filename (cfg->regexp_cache_dir, "pcre.cache", NULL);
+		rspamd_regexp_library_load_cache (path);
+		g_free (path);
+	}
+
+	return cfg;
+}
+
+void
+rspamd_worker_switch_config (struct rspamd_worker *worker,
+	struct rspamd_config *cfg,
+	struct event_base *ev_base)
+{
+	static gboolean reloaded = FALSE;
+	struct rspamd_config *old_cfg = worker->srv->cfg;
+
+	rspamd_map_remove_all (old_cfg);
+	worker->srv->cfg = cfg;
+
+	rspamd_config_post_load (cfg);
+	rspamd_init_filters (cfg, TRUE);
+
+	if (!init_symbols_cache (cfg->cfg_pool, cfg->cache, cfg,
+			cfg->cache_filename, FALSE)) {
+		msg_err ("cannot init symbols cache of the new config");
+	}
+
+	rspamd_re_cache_compile (cfg->re_cache, cfg->regexp_cache_dir);
+	rspamd_map_watch (cfg, ev_base);
+	rspamd_upstreams_library_config (cfg);
+
+	/*
+	 * The config the worker has been forked with owns worker's own config
+	 * and context and its pages are shared with the main process, so it is
+	 * never freed
+	 */
+	if (reloaded) {
+		rspamd_config_free (old_cfg);
+		g_free (old_cfg);
+	}
+
+	reloaded = TRUE;
+	msg_info ("config has been reloaded");
+}
+
 void
 rspamd_controller_send_error (struct rspamd_http_connection_entry *entry,
 	gint code, const gchar *error_msg, ...)
@@ -41,6 +41,7 @@ typedef void (*rspamd_sig_handler_t) (gint, siginfo_t *, void *);
 #endif
 
 struct rspamd_worker;
+struct rspamd_config;
 
 /**
  * Prepare worker's startup
@@ -60,6 +61,42 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
  */
 void rspamd_worker_stop_accept (struct rspamd_worker *worker);
 
+/**
+ * Temporary stop or resume accepting new connections for a worker
+ * @param worker
+ * @param pause TRUE to stop accepting, FALSE to resume
+ */
+void rspamd_worker_pause_accept (struct rspamd_worker *worker, gboolean pause);
+
+/**
+ * Reload config in place on SIGHUP instead of terminating a worker, the
+ * worker type must be marked as reloadable
+ * @param worker
+ * @param handler function called when the config should be reloaded
+ * @param ud data for handler
+ */
+void rspamd_worker_set_reload_handler (struct rspamd_worker *worker,
+	void (*handler)(void *ud), void *ud);
+
+/**
+ * Read and validate the current config file of a worker, the config that
+ * is used by the worker is not changed
+ * @param worker
+ * @return new config or NULL if config cannot be read
+ */
+struct rspamd_config * rspamd_worker_read_config (struct rspamd_worker *worker);
+
+/**
+ * Finish loading of the new config and use it for new tasks, the old
+ * config must not be used by any task after this call
+ * @param worker
+ * @param cfg config returned by `rspamd_worker_read_config`
+ * @param ev_base event base to watch maps of the new config
+ */
+void rspamd_worker_switch_config (struct rspamd_worker *worker,
+	struct rspamd_config *cfg,
+	struct event_base *ev_base);
+
 typedef gint (*rspamd_controller_func_t) (
 	struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg,
@@ -39,6 +39,7 @@ struct rspamd_token_result;
 struct rspamd_statfile_runtime;
 struct token_node_s;
 struct rspamd_task;
+struct event_base;
 
 struct rspamd_stat_backend {
 	const char *name;
@@ -47,6 +48,9 @@ struct rspamd_stat_backend {
 			struct rspamd_statfile_config *stcf, gboolean learn, gpointer ctx);
 	gboolean (*process_token)(struct token_node_s *tok,
 			struct rspamd_token_result *res, gpointer ctx);
+	/* Optional: fetches values of all tokens for a statfile at once */
+	gboolean (*process_tokens)(struct rspamd_task *task, GArray *tokens,
+			gint id, gpointer runtime, gpointer ctx);
 	gboolean (*learn_token)(struct token_node_s *tok,
 			struct rspamd_token_result *res, gpointer ctx);
 	gulong (*total_learns)(struct rspamd_statfile_runtime *runtime, gpointer ctx);
@@ -54,6 +58,9 @@ struct rspamd_stat_backend {
 	gulong (*inc_learns)(struct rspamd_statfile_runtime *runtime, gpointer ctx);
 	gulong (*dec_learns)(struct rspamd_statfile_runtime *runtime, gpointer ctx);
 	ucl_object_t* (*get_stat)(struct rspamd_statfile_runtime *runtime, gpointer ctx);
+	/* Optional: resizes storage of a statfile in background */
+	gboolean (*resize)(struct rspamd_statfile_config *stcf, gsize size,
+			struct event_base *ev_base, gpointer ctx, GError **err);
 	gpointer ctx;
 };
 
@@ -64,6 +71,11 @@ gpointer rspamd_mmaped_file_runtime (struct rspamd_task *task,
 gboolean rspamd_mmaped_file_process_token (struct token_node_s *tok,
 		struct rspamd_token_result *res,
 		gpointer ctx);
+gboolean rspamd_mmaped_file_process_tokens (struct rspamd_task *task,
+		GArray *tokens,
+		gint id,
+		gpointer runtime,
+		gpointer ctx);
 gboolean rspamd_mmaped_file_learn_token (struct token_node_s *tok,
 		struct rspamd_token_result *res,
 		gpointer ctx);
@@ -77,11 +89,21 @@ gulong rspamd_mmaped_file_dec_learns (struct rspamd_statfile_runtime *runtime,
 		gpointer ctx);
 ucl_object_t * rspamd_mmaped_file_get_stat (struct rspamd_statfile_runtime *runtime,
 		gpointer ctx);
+gboolean rspamd_mmaped_file_resize (struct rspamd_statfile_config *stcf,
+		gsize size,
+		struct event_base *ev_base,
+		gpointer ctx,
+		GError **err);
 
 gpointer rspamd_redis_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg);
 gpointer rspamd_redis_runtime (struct rspamd_task *task,
 		struct rspamd_statfile_config *stcf,
 		gboolean learn, gpointer ctx);
+gboolean rspamd_redis_process_tokens (struct rspamd_task *task,
+		GArray *tokens,
+		gint id,
+		gpointer runtime,
+		gpointer ctx);
 gboolean rspamd_redis_process_token (struct token_node_s *tok,
 		struct rspamd_token_result *res,
 		gpointer ctx);
@@ -94,9 +116,37 @@ gulong rspamd_redis_total_learns (struct rspamd_statfile_runtime *runtime,
 		gpointer ctx);
 gulong rspamd_redis_inc_learns (struct rspamd_statfile_runtime *runtime,
 		gpointer ctx);
-gulong rspamd_redis_learns (struct rspamd_statfile_runtime *runtime,
+gulong rspamd_redis_dec_learns (struct rspamd_statfile_runtime *runtime,
 		gpointer ctx);
 ucl_object_t * rspamd_redis_get_stat (struct rspamd_statfile_runtime *runtime,
 		gpointer ctx);
 
+#ifdef WITH_LMDB
+gpointer rspamd_lmdb_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg);
+gpointer rspamd_lmdb_runtime (struct rspamd_task *task,
+		struct rspamd_statfile_config *stcf,
+		gboolean learn, gpointer ctx);
+gboolean rspamd_lmdb_process_tokens (struct rspamd_task *task,
+		GArray *tokens,
+		gint id,
+		gpointer runtime,
+		gpointer ctx);
+gboolean rspamd_lmdb_process_token (struct token_node_s *tok,
+		struct rspamd_token_result *res,
+		gpointer ctx);
+gboolean rspamd_lmdb_learn_token (struct token_node_s *tok,
+		struct rspamd_token_result *res,
+		gpointer ctx);
+void rspamd_lmdb_finalize_learn (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
+gulong rspamd_lmdb_total_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
+gulong rspamd_lmdb_inc_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
+gulong rspamd_lmdb_dec_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
+ucl_object_t * rspamd_lmdb_get_stat (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
+#endif
+
 #endif /* BACKENDS_H_ */
@@ -0,0 +1,604 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "stat_internal.h"
+#include <lmdb.h>
+
+#define LMDB_CTX(p) (struct lmdb_stat_ctx *)(p)
+#define LMDB_STATFILE(p) (struct lmdb_statfile *)(p)
+#define LMDB_BACKEND_TYPE "lmdb"
+/* Size of the map is an upper bound only, the file grows on demand */
+#define LMDB_DEFAULT_MAP_SIZE (1024 * 1024 * 1024)
+#define LMDB_TOKENS_DB "tokens"
+#define LMDB_META_DB "meta"
+#define LMDB_LEARNS_KEY "learns"
+
+struct lmdb_stat_ctx {
+	GHashTable *files;
+	rspamd_mutex_t *lock;
+};
+
+struct lmdb_pending_token {
+	guint64 data;
+	gdouble value;
+	guint seq;
+};
+
+struct lmdb_statfile {
+	struct rspamd_statfile_config *stcf;
+	const gchar *filename;
+	gsize map_size;
+	/* Environment is opened after fork, so each process has its own one */
+	MDB_env *env;
+	pid_t pid;
+	MDB_dbi tokens_dbi;
+	MDB_dbi meta_dbi;
+	/* Updates accumulated until finalize_learn writes them at once */
+	GArray *pending;
+	guint64 learns;
+	gint64 learns_delta;
+	rspamd_mutex_t *lock;
+};
+
+static gint
+rspamd_lmdb_token_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct lmdb_pending_token *t1 = a, *t2 = b;
+	gint r;
+
+	/* Keys are visited in the order of the tree */
+	r = memcmp (&t1->data, &t2->data, sizeof (t1->data));
+
+	if (r == 0) {
+		return (gint)t1->seq - (gint)t2->seq;
+	}
+
+	return r;
+}
+
+static gboolean
+rspamd_lmdb_read_learns (struct lmdb_statfile *lf, MDB_txn *txn,
+		guint64 *learns)
+{
+	MDB_val k, v;
+	gint rc;
+
+	k.mv_data = LMDB_LEARNS_KEY;
+	k.mv_size = sizeof (LMDB_LEARNS_KEY) - 1;
+
+	rc = mdb_get (txn, lf->meta_dbi, &k, &v);
+
+	if (rc == MDB_NOTFOUND) {
+		*learns = 0;
+		return TRUE;
+	}
+	else if (rc != 0 || v.mv_size != sizeof (*learns)) {
+		msg_err ("cannot read learns count of %s: %s", lf->filename,
+				rc != 0 ? mdb_strerror (rc) : "bad value size");
+		return FALSE;
+	}
+
+	memcpy (learns, v.mv_data, sizeof (*learns));
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_lmdb_open (struct lmdb_statfile *lf)
+{
+	MDB_txn *txn;
+	gint rc;
+
+	if (lf->env != NULL && lf->pid == getpid ()) {
+		return TRUE;
+	}
+
+	/*
+	 * Environment inherited from the parent process must not be used or
+	 * closed, as its locks belong to the parent
+	 */
+	lf->env = NULL;
+	lf->pid = getpid ();
+
+	if ((rc = mdb_env_create (&lf->env)) != 0) {
+		msg_err ("cannot create lmdb environment: %s", mdb_strerror (rc));
+		lf->env = NULL;
+		return FALSE;
+	}
+
+	mdb_env_set_maxdbs (lf->env, 2);
+	mdb_env_set_mapsize (lf->env, lf->map_size);
+
+	/* Transactions are not bound to threads as classification is threaded */
+	rc = mdb_env_open (lf->env, lf->filename, MDB_NOSUBDIR | MDB_NOTLS, 0644);
+
+	if (rc != 0) {
+		msg_err ("cannot open lmdb statfile %s: %s", lf->filename,
+				mdb_strerror (rc));
+		goto err;
+	}
+
+	if ((rc = mdb_txn_begin (lf->env, NULL, 0, &txn)) != 0) {
+		msg_err ("cannot start transaction for %s: %s", lf->filename,
+				mdb_strerror (rc));
+		goto err;
+	}
+
+	if ((rc = mdb_dbi_open (txn, LMDB_TOKENS_DB, MDB_CREATE,
+			&lf->tokens_dbi)) != 0 ||
+			(rc = mdb_dbi_open (txn, LMDB_META_DB, MDB_CREATE,
+			&lf->meta_dbi)) != 0) {
+		msg_err ("cannot open databases of %s: %s", lf->filename,
+				mdb_strerror (rc));
+		mdb_txn_abort (txn);
+		goto err;
+	}
+
+	if (!rspamd_lmdb_read_learns (lf, txn, &lf->learns)) {
+		mdb_txn_abort (txn);
+		goto err;
+	}
+
+	if ((rc = mdb_txn_commit (txn)) != 0) {
+		msg_err ("cannot commit transaction for %s: %s", lf->filename,
+				mdb_strerror (rc));
+		goto err;
+	}
+
+	msg_info ("opened lmdb statfile %s, %uL learns", lf->filename, lf->learns);
+
+	return TRUE;
+
+err:
+	mdb_env_close (lf->env);
+	lf->env = NULL;
+
+	return FALSE;
+}
+
+gpointer
+rspamd_lmdb_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg)
+{
+	struct lmdb_stat_ctx *new;
+	struct lmdb_statfile *lf;
+	struct rspamd_classifier_config *clf;
+	struct rspamd_statfile_config *stf;
+	GList *cur, *curst;
+	const ucl_object_t *filenameo, *sizeo;
+
+	new = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*new));
+	new->files = g_hash_table_new (g_direct_hash, g_direct_equal);
+	new->lock = rspamd_mutex_new ();
+
+	/* Iterate over all classifiers and load matching statfiles */
+	cur = cfg->classifiers;
+
+	while (cur) {
+		clf = cur->data;
+
+		curst = clf->statfiles;
+		while (curst) {
+			stf = curst->data;
+
+			if (stf->backend != NULL &&
+					strcmp (stf->backend, LMDB_BACKEND_TYPE) == 0) {
+				/*
+				 * Check configuration sanity
+				 */
+				filenameo = ucl_object_find_key (stf->opts, "filename");
+				if (filenameo == NULL || ucl_object_type (filenameo) != UCL_STRING) {
+					filenameo = ucl_object_find_key (stf->opts, "path");
+					if (filenameo == NULL || ucl_object_type (filenameo) != UCL_STRING) {
+						msg_err ("statfile %s has no filename defined", stf->symbol);
+						curst = curst->next;
+						continue;
+					}
+				}
+
+				lf = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*lf));
+				lf->stcf = stf;
+				lf->filename = ucl_object_tostring (filenameo);
+				lf->map_size = LMDB_DEFAULT_MAP_SIZE;
+
+				sizeo = ucl_object_find_key (stf->opts, "size");
+				if (sizeo != NULL && ucl_object_type (sizeo) == UCL_INT &&
+						ucl_object_toint (sizeo) > 0) {
+					lf->map_size = ucl_object_toint (sizeo);
+				}
+
+				lf->pending = g_array_new (FALSE, FALSE,
+						sizeof (struct lmdb_pending_token));
+				rspamd_mempool_add_destructor (cfg->cfg_pool,
+						rspamd_array_free_hard, lf->pending);
+				lf->lock = rspamd_mutex_new ();
+				g_hash_table_insert (new->files, stf, lf);
+
+				ctx->statfiles ++;
+			}
+
+			curst = curst->next;
+		}
+
+		cur = g_list_next (cur);
+	}
+
+	return (gpointer)new;
+}
+
+gpointer
+rspamd_lmdb_runtime (struct rspamd_task *task,
+		struct rspamd_statfile_config *stcf,
+		gboolean learn, gpointer c)
+{
+	struct lmdb_stat_ctx *ctx = LMDB_CTX (c);
+	struct lmdb_statfile *lf;
+	gboolean ret;
+
+	g_assert (ctx != NULL);
+	g_assert (stcf != NULL);
+
+	lf = g_hash_table_lookup (ctx->files, stcf);
+
+	if (lf == NULL) {
+		return NULL;
+	}
+
+	rspamd_mutex_lock (ctx->lock);
+	ret = rspamd_lmdb_open (lf);
+	rspamd_mutex_unlock (ctx->lock);
+
+	/*
+	 * All tasks share the same runtime, so learns of a batch are written
+	 * in a single transaction
+	 */
+	return ret ? (gpointer)lf : NULL;
+}
+
+gboolean
+rspamd_lmdb_process_tokens (struct rspamd_task *task,
+		GArray *tokens,
+		gint id,
+		gpointer runtime,
+		gpointer ctx)
+{
+	struct lmdb_statfile *lf = LMDB_STATFILE (runtime);
+	struct lmdb_pending_token *lookups;
+	rspamd_token_t *tok;
+	MDB_txn *txn;
+	MDB_val k, v;
+	gdouble val;
+	guint i;
+	gint rc;
+
+	if (lf == NULL || lf->env == NULL || tokens->len == 0) {
+		return FALSE;
+	}
+
+	/* Readers do not block each other nor writers */
+	if ((rc = mdb_txn_begin (lf->env, NULL, MDB_RDONLY, &txn)) != 0) {
+		msg_err ("cannot start read transaction for %s: %s", lf->filename,
+				mdb_strerror (rc));
+		return FALSE;
+	}
+
+	lookups = g_malloc (tokens->len * sizeof (*lookups));
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = &g_array_index (tokens, rspamd_token_t, i);
+		lookups[i].data = tok->data;
+		lookups[i].seq = i;
+	}
+
+	/* Sorted keys touch each page of the tree once */
+	qsort (lookups, tokens->len, sizeof (*lookups), rspamd_lmdb_token_cmp);
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = &g_array_index (tokens, rspamd_token_t, lookups[i].seq);
+		k.mv_data = &tok->data;
+		k.mv_size = sizeof (tok->data);
+		val = 0.0;
+
+		if (mdb_get (txn, lf->tokens_dbi, &k, &v) == 0 &&
+				v.mv_size == sizeof (val)) {
+			memcpy (&val, v.mv_data, sizeof (val));
+		}
+
+		tok->results[id].value = val;
+	}
+
+	mdb_txn_abort (txn);
+	g_free (lookups);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_lmdb_process_token (struct token_node_s *tok,
+		struct rspamd_token_result *res,
+		gpointer ctx)
+{
+	struct lmdb_statfile *lf;
+	MDB_txn *txn;
+	MDB_val k, v;
+
+	g_assert (res != NULL);
+	g_assert (res->st_runtime != NULL);
+
+	lf = LMDB_STATFILE (res->st_runtime->backend_runtime);
+	res->value = 0.0;
+
+	if (lf == NULL || lf->env == NULL ||
+			mdb_txn_begin (lf->env, NULL, MDB_RDONLY, &txn) != 0) {
+		return FALSE;
+	}
+
+	k.mv_data = &tok->data;
+	k.mv_size = sizeof (tok->data);
+
+	if (mdb_get (txn, lf->tokens_dbi, &k, &v) == 0 &&
+			v.mv_size == sizeof (res->value)) {
+		memcpy (&res->value, v.mv_data, sizeof (res->value));
+	}
+
+	mdb_txn_abort (txn);
+
+	return res->value > 0.0;
+}
+
+gboolean
+rspamd_lmdb_learn_token (struct token_node_s *tok,
+		struct rspamd_token_result *res,
+		gpointer ctx)
+{
+	struct lmdb_statfile *lf;
+	struct lmdb_pending_token pt;
+
+	g_assert (res != NULL);
+	g_assert (res->st_runtime != NULL);
+
+	lf = LMDB_STATFILE (res->st_runtime->backend_runtime);
+
+	if (lf == NULL || lf->env == NULL) {
+		return FALSE;
+	}
+
+	rspamd_mutex_lock (lf->lock);
+	pt.data = tok->data;
+	pt.value = res->value;
+	pt.seq = lf->pending->len;
+	g_array_append_val (lf->pending, pt);
+	rspamd_mutex_unlock (lf->lock);
+
+	return TRUE;
+}
+
+void
+rspamd_lmdb_finalize_learn (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx)
+{
+	struct lmdb_statfile *lf = LMDB_STATFILE (runtime);
+	struct lmdb_pending_token *pt;
+	MDB_txn *txn;
+	MDB_val k, v;
+	guint64 learns;
+	guint i, n;
+	gint rc;
+
+	if (lf == NULL || lf->env == NULL) {
+		return;
+	}
+
+	rspamd_mutex_lock (lf->lock);
+
+	if (lf->pending->len == 0 && lf->learns_delta == 0) {
+		rspamd_mutex_unlock (lf->lock);
+		return;
+	}
+
+	/* Write transactions of all processes are serialized by lmdb itself */
+	if ((rc = mdb_txn_begin (lf->env, NULL, 0, &txn)) != 0) {
+		msg_err ("cannot start write transaction for %s: %s", lf->filename,
+				mdb_strerror (rc));
+		goto end;
+	}
+
+	qsort (lf->pending->data, lf->pending->len, sizeof (*pt),
+			rspamd_lmdb_token_cmp);
+
+	for (i = 0, n = 0; i < lf->pending->len; i ++) {
+		pt = &g_array_index (lf->pending, struct lmdb_pending_token, i);
+
+		/* The latest update of a token wins */
+		if (i + 1 < lf->pending->len && (pt + 1)->data == pt->data) {
+			continue;
+		}
+
+		k.mv_data = &pt->data;
+		k.mv_size = sizeof (pt->data);
+		v.mv_data = &pt->value;
+		v.mv_size = sizeof (pt->value);
+
+		if ((rc = mdb_put (txn, lf->tokens_dbi, &k, &v, 0)) != 0) {
+			goto fail;
+		}
+
+		n ++;
+	}
+
+	/* Other processes could have learned since we have read the counter */
+	if (!rspamd_lmdb_read_learns (lf, txn, &learns)) {
+		rc = MDB_CORRUPTED;
+		goto fail;
+	}
+
+	if (lf->learns_delta < 0 && (guint64)-lf->learns_delta > learns) {
+		learns = 0;
+	}
+	else {
+		learns += lf->learns_delta;
+	}
+
+	k.mv_data = LMDB_LEARNS_KEY;
+	k.mv_size = sizeof (LMDB_LEARNS_KEY) - 1;
+	v.mv_data = &learns;
+	v.mv_size = sizeof (learns);
+
+	if ((rc = mdb_put (txn, lf->meta_dbi, &k, &v, 0)) != 0) {
+		goto fail;
+	}
+
+	if ((rc = mdb_txn_commit (txn)) != 0) {
+		msg_err ("cannot commit learns to %s: %s", lf->filename,
+				mdb_strerror (rc));
+		goto end;
+	}
+
+	lf->learns = learns;
+	msg_debug ("written %ud tokens to %s, %uL learns", n, lf->filename,
+			learns);
+	goto end;
+
+fail:
+	msg_err ("cannot learn tokens to %s: %s%s", lf->filename,
+			mdb_strerror (rc),
+			rc == MDB_MAP_FULL ? ", increase size of statfile" : "");
+	mdb_txn_abort (txn);
+
+end:
+	g_array_set_size (lf->pending, 0);
+	lf->learns_delta = 0;
+	rspamd_mutex_unlock (lf->lock);
+}
+
+gulong
+rspamd_lmdb_total_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx)
+{
+	struct lmdb_statfile *lf = LMDB_STATFILE (runtime);
+	MDB_txn *txn;
+	guint64 learns;
+
+	if (lf == NULL || lf->env == NULL) {
+		return 0;
+	}
+
+	/* Counter is refreshed as other processes learn the same file */
+	if (mdb_txn_begin (lf->env, NULL, MDB_RDONLY, &txn) == 0) {
+		if (rspamd_lmdb_read_learns (lf, txn, &learns)) {
+			lf->learns = learns;
+		}
+
+		mdb_txn_abort (txn);
+	}
+
+	return lf->learns;
+}
+
+gulong
+rspamd_lmdb_inc_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx)
+{
+	struct lmdb_statfile *lf = LMDB_STATFILE (runtime);
+	gulong ret;
+
+	if (lf == NULL) {
+		return 0;
+	}
+
+	rspamd_mutex_lock (lf->lock);
+	lf->learns_delta ++;
+	ret = lf->learns + lf->learns_delta;
+	rspamd_mutex_unlock (lf->lock);
+
+	return ret;
+}
+
+gulong
+rspamd_lmdb_dec_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx)
+{
+	struct lmdb_statfile *lf = LMDB_STATFILE (runtime);
+	gulong ret;
+
+	if (lf == NULL) {
+		return 0;
+	}
+
+	rspamd_mutex_lock (lf->lock);
+
+	if ((gint64)lf->learns + lf->learns_delta > 0) {
+		lf->learns_delta --;
+	}
+
+	ret = lf->learns + lf->learns_delta;
+	rspamd_mutex_unlock (lf->lock);
+
+	return ret;
+}
+
+ucl_object_t *
+rspamd_lmdb_get_stat (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx)
+{
+	struct lmdb_statfile *lf = LMDB_STATFILE (runtime);
+	ucl_object_t *res = NULL;
+	MDB_txn *txn;
+	MDB_stat st;
+	MDB_envinfo info;
+	guint64 learns = 0;
+
+	if (lf == NULL || lf->env == NULL) {
+		return NULL;
+	}
+
+	memset (&st, 0, sizeof (st));
+
+	if (mdb_txn_begin (lf->env, NULL, MDB_RDONLY, &txn) == 0) {
+		rspamd_lmdb_read_learns (lf, txn, &learns);
+		mdb_stat (txn, lf->tokens_dbi, &st);
+		mdb_txn_abort (txn);
+	}
+
+	mdb_env_info (lf->env, &info);
+
+	res = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (res, ucl_object_fromint (learns), "revision",
+			0, false);
+	ucl_object_insert_key (res, ucl_object_fromint (info.me_mapsize), "size",
+			0, false);
+	ucl_object_insert_key (res, ucl_object_fromint (st.ms_entries), "used",
+			0, false);
+	ucl_object_insert_key (res, ucl_object_fromint (
+			(info.me_last_pgno + 1) * st.ms_psize), "file_size", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromstring (lf->stcf->symbol),
+			"symbol", 0, false);
+
+	if (lf->stcf->label) {
+		ucl_object_insert_key (res, ucl_object_fromstring (lf->stcf->label),
+				"label", 0, false);
+	}
+
+	return res;
+}
@@ -52,9 +52,13 @@ struct stat_file_header {
 	guint64 used_blocks;                    /**< used blocks number					*/
 	guint64 total_blocks;                   /**< total number of blocks				*/
 	guint64 tokenizer_conf_len;				/**< length of tokenizer configuration	*/
-	u_char unused[231];                     /**< some bytes that can be used in future */
+	u_char unused[223];                     /**< some bytes that can be used in future */
+	guint64 flags;                          /**< statfile flags						*/
 };
 
+/* Statfile has been replaced by a resized copy and should be reopened */
+#define RSPAMD_STATFILE_FLAG_REPLACED 0x1
+
 /**
  * Section header
  */
@@ -96,6 +100,8 @@ typedef struct {
 	struct stat_file_section cur_section;   /**< current section					*/
 	size_t len;                             /**< length of file(in bytes)			*/
 	struct rspamd_statfile_config *cf;
+	gboolean locked;                        /**< pages are locked in memory			*/
+	struct rspamd_mmaped_file_resize_s *resize; /**< resize in progress			*/
 } rspamd_mmaped_file_t;
 
 /**
@@ -104,12 +110,35 @@ typedef struct {
 typedef struct  {
 	GHashTable *files;                     /**< hash table of opened files indexed by name	*/
 	rspamd_mempool_t *pool;                 /**< memory pool object					*/
-	rspamd_mempool_mutex_t *lock;               /**< mutex								*/
+	rspamd_mutex_t *lock;                   /**< protects files from classify threads */
 	gboolean mlock_ok;                      /**< whether it is possible to use mlock (2) to avoid statfiles unloading */
+	GList *retired;                         /**< replaced files that are still mapped */
 } rspamd_mmaped_file_ctx;
 
+/**
+ * Background resize of a statfile
+ */
+struct rspamd_mmaped_file_resize_s {
+	rspamd_mmaped_file_ctx *pool;
+	rspamd_mmaped_file_t *old;
+	rspamd_mmaped_file_t *target;           /**< new file being filled				*/
+	gchar *tmpname;
+	guint64 pos;                            /**< next block of the old file to copy	*/
+	struct event ev;
+	struct timeval tv;
+};
+
 #define RSPAMD_STATFILE_VERSION {'1', '2'}
 #define BACKUP_SUFFIX ".old"
+#define RESIZE_SUFFIX ".new"
+/* Number of blocks copied per event loop iteration while resizing */
+#define RESIZE_CHUNK 65536
+
+static GQuark
+rspamd_mmaped_file_quark (void)
+{
+	return g_quark_from_static_string ("mmaped-statfile");
+}
 
 static void rspamd_mmaped_file_set_block_common (
 	rspamd_mmaped_file_ctx * pool, rspamd_mmaped_file_t * file,
@@ -122,24 +151,32 @@ rspamd_mmaped_file_t * rspamd_mmaped_file_open (rspamd_mmaped_file_ctx * pool,
 gint rspamd_mmaped_file_create (rspamd_mmaped_file_ctx * pool,
 		const gchar *filename, size_t size, struct rspamd_statfile_config *stcf);
 
-double
-rspamd_mmaped_file_get_block (rspamd_mmaped_file_ctx * pool,
-	rspamd_mmaped_file_t * file,
+/* Number of lookups to prefetch ahead in batched mode */
+#define MMAPED_PREFETCH_DISTANCE 8
+
+#if defined(__GNUC__)
+#define MMAPED_PREFETCH(p) __builtin_prefetch ((p), 0, 1)
+#else
+#define MMAPED_PREFETCH(p) (void)(p)
+#endif
+
+static inline struct stat_file_block *
+rspamd_mmaped_file_chain (rspamd_mmaped_file_t *file, guint blocknum)
+{
+	return (struct stat_file_block *)((u_char *) file->map + file->seek_pos +
+			blocknum * sizeof (struct stat_file_block));
+}
+
+static inline double
+rspamd_mmaped_file_lookup (rspamd_mmaped_file_t *file,
+	guint blocknum,
 	guint32 h1,
 	guint32 h2)
 {
 	struct stat_file_block *block;
-	guint i, blocknum;
-	u_char *c;
+	guint i;
 
-	if (!file->map) {
-		return 0;
-	}
-
-	blocknum = h1 % file->cur_section.length;
-	c = (u_char *) file->map + file->seek_pos + blocknum *
-		sizeof (struct stat_file_block);
-	block = (struct stat_file_block *)c;
+	block = rspamd_mmaped_file_chain (file, blocknum);
 
 	for (i = 0; i < CHAIN_LENGTH; i++) {
 		if (i + blocknum >= file->cur_section.length) {
@@ -148,14 +185,26 @@ rspamd_mmaped_file_get_block (rspamd_mmaped_file_ctx * pool,
 		if (block->hash1 == h1 && block->hash2 == h2) {
 			return block->value;
 		}
-		c += sizeof (struct stat_file_block);
-		block = (struct stat_file_block *)c;
+		block ++;
 	}
 
-
 	return 0;
 }
 
+double
+rspamd_mmaped_file_get_block (rspamd_mmaped_file_ctx * pool,
+	rspamd_mmaped_file_t * file,
+	guint32 h1,
+	guint32 h2)
+{
+	if (!file->map) {
+		return 0;
+	}
+
+	return rspamd_mmaped_file_lookup (file, h1 % file->cur_section.length,
+			h1, h2);
+}
+
 static void
 rspamd_mmaped_file_set_block_common (rspamd_mmaped_file_ctx * pool,
 		rspamd_mmaped_file_t * file,
@@ -247,6 +296,12 @@ rspamd_mmaped_file_set_block (rspamd_mmaped_file_ctx * pool,
 	double value)
 {
 	rspamd_mmaped_file_set_block_common (pool, file, h1, h2, value);
+
+	if (file->resize != NULL) {
+		/* Keep the new file in sync while it is being filled */
+		rspamd_mmaped_file_set_block_common (pool, file->resize->target,
+				h1, h2, value);
+	}
 }
 
 rspamd_mmaped_file_t *
@@ -533,6 +588,11 @@ rspamd_mmaped_file_preload (rspamd_mmaped_file_t *file)
 			(void)t;
 			pos += size;
 		}
+
+		/* Lookups are random, so readahead is useless further on */
+		if (madvise (file->map, file->len, MADV_RANDOM) == -1) {
+			msg_info ("madvise failed: %s", strerror (errno));
+		}
 	}
 }
 
@@ -545,6 +605,8 @@ rspamd_mmaped_file_open (rspamd_mmaped_file_ctx * pool,
 	rspamd_mmaped_file_t *new_file;
 	struct rspamd_stat_tokenizer *tokenizer;
 	struct stat_file_header *header;
+	const ucl_object_t *elt;
+	gboolean hugepages = FALSE, hugetlb = FALSE, lock_pages = pool->mlock_ok;
 
 	if ((new_file = rspamd_mmaped_file_is_open (pool, stcf)) != NULL) {
 		return new_file;
@@ -577,7 +639,31 @@ rspamd_mmaped_file_open (rspamd_mmaped_file_ctx * pool,
 		return NULL;
 	}
 
-	if ((new_file->map =
+	elt = ucl_object_find_key (stcf->opts, "hugepages");
+	if (elt != NULL) {
+		hugepages = ucl_object_toboolean (elt);
+	}
+
+	elt = ucl_object_find_key (stcf->opts, "mlock");
+	if (elt != NULL) {
+		lock_pages = ucl_object_toboolean (elt);
+	}
+
+	new_file->map = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	if (hugepages) {
+		/* This works merely for files placed on hugetlbfs */
+		new_file->map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_HUGETLB, new_file->fd, 0);
+
+		if (new_file->map != MAP_FAILED) {
+			hugetlb = TRUE;
+		}
+	}
+#endif
+
+	if (new_file->map == MAP_FAILED && (new_file->map =
 		mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
 		new_file->fd, 0)) == MAP_FAILED) {
 		close (new_file->fd);
@@ -592,13 +678,30 @@ rspamd_mmaped_file_open (rspamd_mmaped_file_ctx * pool,
 
 	rspamd_strlcpy (new_file->filename, filename, sizeof (new_file->filename));
 	new_file->len = st.st_size;
+
+#ifdef MADV_HUGEPAGE
+	if (hugepages && !hugetlb) {
+		/* Ask for transparent huge pages to reduce TLB misses */
+		if (madvise (new_file->map, new_file->len, MADV_HUGEPAGE) == -1) {
+			msg_info ("cannot use huge pages for statfile %s: %s",
+					filename, strerror (errno));
+		}
+	}
+#endif
+
 	/* Try to lock pages in RAM */
-	if (pool->mlock_ok) {
+	if (lock_pages) {
 		if (mlock (new_file->map, new_file->len) == -1) {
 			msg_warn (
 				"mlock of statfile failed, maybe you need to increase RLIMIT_MEMLOCK limit for a process: %s",
 				strerror (errno));
-			pool->mlock_ok = FALSE;
+
+			if (pool->mlock_ok) {
+				pool->mlock_ok = FALSE;
+			}
+		}
+		else {
+			new_file->locked = TRUE;
 		}
 	}
 	/* Acquire lock for this operation */
@@ -613,7 +716,10 @@ rspamd_mmaped_file_open (rspamd_mmaped_file_ctx * pool,
 
 	new_file->cf = stcf;
 
-	rspamd_mmaped_file_preload (new_file);
+	if (!new_file->locked) {
+		/* Locked pages are already in memory */
+		rspamd_mmaped_file_preload (new_file);
+	}
 
 	/* Check tokenizer compatibility */
 	header = new_file->map;
@@ -637,6 +743,50 @@ rspamd_mmaped_file_open (rspamd_mmaped_file_ctx * pool,
 	return new_file;
 }
 
+static void
+rspamd_mmaped_file_free (rspamd_mmaped_file_t *file)
+{
+	if (file->map) {
+		msg_info ("syncing statfile %s", file->filename);
+		msync (file->map, file->len, MS_ASYNC);
+		munmap (file->map, file->len);
+	}
+	if (file->fd != -1) {
+		close (file->fd);
+	}
+
+	g_slice_free1 (sizeof (*file), file);
+}
+
+static void
+rspamd_mmaped_file_resize_cancel (struct rspamd_mmaped_file_resize_s *rs)
+{
+	event_del (&rs->ev);
+	rs->old->resize = NULL;
+	rspamd_mmaped_file_free (rs->target);
+	unlink (rs->tmpname);
+	g_free (rs->tmpname);
+	g_slice_free1 (sizeof (*rs), rs);
+}
+
+/*
+ * Replaced files might still be used by other threads, so they are unmapped
+ * only when the next file is replaced or on shutdown
+ */
+static void
+rspamd_mmaped_file_retire (rspamd_mmaped_file_ctx *pool,
+		rspamd_mmaped_file_t *file)
+{
+	GList *cur;
+
+	for (cur = pool->retired; cur != NULL; cur = g_list_next (cur)) {
+		rspamd_mmaped_file_free (cur->data);
+	}
+
+	g_list_free (pool->retired);
+	pool->retired = g_list_prepend (NULL, file);
+}
+
 gint
 rspamd_mmaped_file_close (rspamd_mmaped_file_ctx * pool,
 	rspamd_mmaped_file_t * file)
@@ -648,25 +798,35 @@ rspamd_mmaped_file_close (rspamd_mmaped_file_ctx * pool,
 		return -1;
 	}
 
-	if (file->map) {
-		msg_info ("syncing statfile %s", file->filename);
-		msync (file->map, file->len, MS_ASYNC);
-		munmap (file->map, file->len);
-	}
-	if (file->fd != -1) {
-		close (file->fd);
+	if (file->resize) {
+		msg_info ("cancel resizing of statfile %s", file->filename);
+		rspamd_mmaped_file_resize_cancel (file->resize);
 	}
 
 	g_hash_table_remove (pool->files, file->cf);
-
-	g_slice_free1 (sizeof (*file), file);
+	rspamd_mmaped_file_free (file);
 
 	return 0;
 }
 
+static gint rspamd_mmaped_file_create_file (const gchar *filename,
+		size_t size, struct rspamd_statfile_config *stcf);
+
 gint
 rspamd_mmaped_file_create (rspamd_mmaped_file_ctx * pool, const gchar *filename,
 		size_t size, struct rspamd_statfile_config *stcf)
+{
+	if (rspamd_mmaped_file_is_open (pool, stcf) != NULL) {
+		msg_info ("file %s is already opened", filename);
+		return 0;
+	}
+
+	return rspamd_mmaped_file_create_file (filename, size, stcf);
+}
+
+static gint
+rspamd_mmaped_file_create_file (const gchar *filename,
+		size_t size, struct rspamd_statfile_config *stcf)
 {
 	struct stat_file_header header = {
 		.magic = {'r', 's', 'd'},
@@ -687,11 +847,6 @@ rspamd_mmaped_file_create (rspamd_mmaped_file_ctx * pool, const gchar *filename,
 	gpointer tok_conf;
 	gsize tok_conf_len;
 
-	if (rspamd_mmaped_file_is_open (pool, stcf) != NULL) {
-		msg_info ("file %s is already opened", filename);
-		return 0;
-	}
-
 	if (size <
 		sizeof (struct stat_file_header) + sizeof (struct stat_file_section) +
 		sizeof (block)) {
@@ -803,6 +958,7 @@ rspamd_mmaped_file_destroy (rspamd_mmaped_file_ctx * pool)
 	GHashTableIter it;
 	gpointer k, v;
 	rspamd_mmaped_file_t *f;
+	GList *cur;
 
 	g_hash_table_iter_init (&it, pool->files);
 	while (g_hash_table_iter_next (&it, &k, &v)) {
@@ -811,6 +967,13 @@ rspamd_mmaped_file_destroy (rspamd_mmaped_file_ctx * pool)
 	}
 
 	g_hash_table_destroy (pool->files);
+
+	for (cur = pool->retired; cur != NULL; cur = g_list_next (cur)) {
+		rspamd_mmaped_file_free (cur->data);
+	}
+
+	g_list_free (pool->retired);
+	rspamd_mutex_free (pool->lock);
 	rspamd_mempool_delete (pool->pool);
 }
 
@@ -826,7 +989,7 @@ rspamd_mmaped_file_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg)
 	gsize size;
 
 	new = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (rspamd_mmaped_file_ctx));
-	new->lock = rspamd_mempool_get_mutex (new->pool);
+	new->lock = rspamd_mutex_new ();
 	new->mlock_ok = cfg->mlock_statfile_pool;
 	new->files = g_hash_table_new (g_direct_hash, g_direct_equal);
 
@@ -844,7 +1007,7 @@ rspamd_mmaped_file_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg)
 			 * By default, all statfiles are treated as mmaped files
 			 */
 			if (stf->backend == NULL ||
-					strcmp (stf->backend, MMAPED_BACKEND_TYPE)) {
+					strcmp (stf->backend, MMAPED_BACKEND_TYPE) == 0) {
 				/*
 				 * Check configuration sanity
 				 */
@@ -883,6 +1046,36 @@ rspamd_mmaped_file_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg)
 	return (gpointer)new;
 }
 
+static gboolean
+rspamd_mmaped_file_is_replaced (rspamd_mmaped_file_t *file)
+{
+	struct stat_file_header *header = file->map;
+
+	return file->resize == NULL &&
+			(header->flags & RSPAMD_STATFILE_FLAG_REPLACED) != 0;
+}
+
+static rspamd_mmaped_file_t *
+rspamd_mmaped_file_reopen (rspamd_mmaped_file_ctx *pool,
+		rspamd_mmaped_file_t *file)
+{
+	struct rspamd_statfile_config *stcf = file->cf;
+	struct stat st;
+
+	msg_info ("statfile %s has been replaced, reopening", file->filename);
+	g_hash_table_remove (pool->files, stcf);
+	rspamd_mmaped_file_retire (pool, file);
+
+	if (stat (file->filename, &st) == -1) {
+		msg_err ("cannot stat file %s, error %s", file->filename,
+				strerror (errno));
+		return NULL;
+	}
+
+	/* Use the actual size, as it can differ from the configured one now */
+	return rspamd_mmaped_file_open (pool, file->filename, st.st_size, stcf);
+}
+
 gpointer
 rspamd_mmaped_file_runtime (struct rspamd_task *task,
 		struct rspamd_statfile_config *stcf,
@@ -897,8 +1090,13 @@ rspamd_mmaped_file_runtime (struct rspamd_task *task,
 
 	g_assert (ctx != NULL);
 
+	rspamd_mutex_lock (ctx->lock);
 	mf = rspamd_mmaped_file_is_open (ctx, stcf);
 
+	if (mf != NULL && rspamd_mmaped_file_is_replaced (mf)) {
+		mf = rspamd_mmaped_file_reopen (ctx, mf);
+	}
+
 	if (mf == NULL) {
 		/* Create file here */
 
@@ -907,6 +1105,7 @@ rspamd_mmaped_file_runtime (struct rspamd_task *task,
 			filenameo = ucl_object_find_key (stcf->opts, "path");
 			if (filenameo == NULL || ucl_object_type (filenameo) != UCL_STRING) {
 				msg_err ("statfile %s has no filename defined", stcf->symbol);
+				rspamd_mutex_unlock (ctx->lock);
 				return NULL;
 			}
 		}
@@ -916,6 +1115,7 @@ rspamd_mmaped_file_runtime (struct rspamd_task *task,
 		sizeo = ucl_object_find_key (stcf->opts, "size");
 		if (sizeo == NULL || ucl_object_type (sizeo) != UCL_INT) {
 			msg_err ("statfile %s has no size defined", stcf->symbol);
+			rspamd_mutex_unlock (ctx->lock);
 			return NULL;
 		}
 
@@ -928,6 +1128,8 @@ rspamd_mmaped_file_runtime (struct rspamd_task *task,
 		mf = rspamd_mmaped_file_open (ctx, filename, size, stcf);
 	}
 
+	rspamd_mutex_unlock (ctx->lock);
+
 	return (gpointer)mf;
 }
 
@@ -944,7 +1146,6 @@ rspamd_mmaped_file_process_token (rspamd_token_t *tok,
 	g_assert (p != NULL);
 	g_assert (res->st_runtime != NULL);
 	g_assert (tok != NULL);
-	g_assert (tok->datalen >= sizeof (guint32) * 2);
 
 	mf = (rspamd_mmaped_file_t *)res->st_runtime->backend_runtime;
 
@@ -954,8 +1155,8 @@ rspamd_mmaped_file_process_token (rspamd_token_t *tok,
 		return FALSE;
 	}
 
-	memcpy (&h1, tok->data, sizeof (h1));
-	memcpy (&h2, tok->data + sizeof (h1), sizeof (h2));
+	memcpy (&h1, (guchar *)&tok->data, sizeof (h1));
+	memcpy (&h2, ((guchar *)&tok->data) + sizeof (h1), sizeof (h2));
 	res->value = rspamd_mmaped_file_get_block (ctx, mf, h1, h2);
 
 	if (res->value > 0.0) {
@@ -965,6 +1166,81 @@ rspamd_mmaped_file_process_token (rspamd_token_t *tok,
 	return FALSE;
 }
 
+struct rspamd_mmaped_file_lookup {
+	guint32 blocknum;
+	guint32 idx;
+};
+
+static gint
+rspamd_mmaped_file_lookup_cmp (const void *a, const void *b)
+{
+	const struct rspamd_mmaped_file_lookup *l1 = a, *l2 = b;
+
+	if (l1->blocknum < l2->blocknum) {
+		return -1;
+	}
+	else if (l1->blocknum > l2->blocknum) {
+		return 1;
+	}
+
+	return 0;
+}
+
+gboolean
+rspamd_mmaped_file_process_tokens (struct rspamd_task *task,
+		GArray *tokens,
+		gint id,
+		gpointer p,
+		gpointer ctx)
+{
+	rspamd_mmaped_file_t *mf = (rspamd_mmaped_file_t *)p;
+	struct rspamd_mmaped_file_lookup *lookups;
+	rspamd_token_t *tok;
+	guint32 h1, h2;
+	guint i;
+
+	if (mf == NULL || mf->map == NULL || tokens->len == 0) {
+		return FALSE;
+	}
+
+	/*
+	 * Visit chains in the order of their positions in the file and prefetch
+	 * chains a few lookups ahead, so cache and TLB misses are overlapped
+	 */
+	lookups = g_malloc (tokens->len * sizeof (*lookups));
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = &g_array_index (tokens, rspamd_token_t, i);
+		memcpy (&h1, (guchar *)&tok->data, sizeof (h1));
+		lookups[i].blocknum = h1 % mf->cur_section.length;
+		lookups[i].idx = i;
+	}
+
+	qsort (lookups, tokens->len, sizeof (*lookups),
+			rspamd_mmaped_file_lookup_cmp);
+
+	for (i = 0; i < MIN (tokens->len, MMAPED_PREFETCH_DISTANCE); i ++) {
+		MMAPED_PREFETCH (rspamd_mmaped_file_chain (mf, lookups[i].blocknum));
+	}
+
+	for (i = 0; i < tokens->len; i ++) {
+		if (i + MMAPED_PREFETCH_DISTANCE < tokens->len) {
+			MMAPED_PREFETCH (rspamd_mmaped_file_chain (mf,
+					lookups[i + MMAPED_PREFETCH_DISTANCE].blocknum));
+		}
+
+		tok = &g_array_index (tokens, rspamd_token_t, lookups[i].idx);
+		memcpy (&h1, (guchar *)&tok->data, sizeof (h1));
+		memcpy (&h2, ((guchar *)&tok->data) + sizeof (h1), sizeof (h2));
+		tok->results[id].value = rspamd_mmaped_file_lookup (mf,
+				lookups[i].blocknum, h1, h2);
+	}
+
+	g_free (lookups);
+
+	return TRUE;
+}
+
 gboolean
 rspamd_mmaped_file_learn_token (rspamd_token_t *tok,
 		struct rspamd_token_result *res,
@@ -978,7 +1254,6 @@ rspamd_mmaped_file_learn_token (rspamd_token_t *tok,
 	g_assert (p != NULL);
 	g_assert (res->st_runtime != NULL);
 	g_assert (tok != NULL);
-	g_assert (tok->datalen >= sizeof (guint32) * 2);
 
 	mf = (rspamd_mmaped_file_t *)res->st_runtime->backend_runtime;
 
@@ -988,8 +1263,8 @@ rspamd_mmaped_file_learn_token (rspamd_token_t *tok,
 		return FALSE;
 	}
 
-	memcpy (&h1, tok->data, sizeof (h1));
-	memcpy (&h2, tok->data + sizeof (h1), sizeof (h2));
+	memcpy (&h1, (guchar *)&tok->data, sizeof (h1));
+	memcpy (&h2, ((guchar *)&tok->data) + sizeof (h1), sizeof (h2));
 	rspamd_mmaped_file_set_block (ctx, mf, h1, h2, res->value);
 
 	return TRUE;
@@ -1084,3 +1359,182 @@ rspamd_mmaped_file_finalize_learn (struct rspamd_statfile_runtime *runtime,
 		msync (mf->map, mf->len, MS_INVALIDATE | MS_ASYNC);
 	}
 }
+
+/*
+ * Maps file without registering it in the pool
+ */
+static rspamd_mmaped_file_t *
+rspamd_mmaped_file_map_file (const gchar *filename,
+		struct rspamd_statfile_config *stcf)
+{
+	rspamd_mmaped_file_t *new_file;
+	struct stat st;
+
+	new_file = g_slice_alloc0 (sizeof (rspamd_mmaped_file_t));
+
+	if ((new_file->fd = open (filename, O_RDWR)) == -1 ||
+			fstat (new_file->fd, &st) == -1) {
+		msg_err ("cannot open file %s, error %d, %s", filename, errno,
+				strerror (errno));
+
+		if (new_file->fd != -1) {
+			close (new_file->fd);
+		}
+
+		g_slice_free1 (sizeof (*new_file), new_file);
+		return NULL;
+	}
+
+	if ((new_file->map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, new_file->fd, 0)) == MAP_FAILED) {
+		msg_err ("cannot mmap file %s, error %d, %s", filename, errno,
+				strerror (errno));
+		close (new_file->fd);
+		g_slice_free1 (sizeof (*new_file), new_file);
+		return NULL;
+	}
+
+	rspamd_strlcpy (new_file->filename, filename, sizeof (new_file->filename));
+	new_file->len = st.st_size;
+	new_file->cf = stcf;
+
+	if (rspamd_mmaped_file_check (new_file) == -1) {
+		rspamd_mmaped_file_free (new_file);
+		return NULL;
+	}
+
+	return new_file;
+}
+
+static void
+rspamd_mmaped_file_resize_finish (struct rspamd_mmaped_file_resize_s *rs)
+{
+	rspamd_mmaped_file_t *old = rs->old, *target = rs->target;
+	struct stat_file_header *header;
+	guint64 rev;
+	time_t t;
+
+	rspamd_mmaped_file_get_revision (old, &rev, &t);
+	rspamd_mmaped_file_set_revision (target, rev, t);
+
+	if (msync (target->map, target->len, MS_SYNC) == -1 ||
+			rename (rs->tmpname, old->filename) == -1) {
+		msg_err ("cannot replace statfile %s: %s", old->filename,
+				strerror (errno));
+		rspamd_mmaped_file_resize_cancel (rs);
+
+		return;
+	}
+
+	/* All processes that have the old file mapped will reopen it */
+	header = old->map;
+	header->flags |= RSPAMD_STATFILE_FLAG_REPLACED;
+
+	msg_info ("statfile %s has been resized from %z to %z bytes, "
+			"%uL of %uL blocks used",
+			old->filename, old->len, target->len,
+			rspamd_mmaped_file_get_used (target),
+			rspamd_mmaped_file_get_total (target));
+
+	rspamd_strlcpy (target->filename, old->filename, sizeof (target->filename));
+	old->resize = NULL;
+	g_hash_table_insert (rs->pool->files, old->cf, target);
+	rspamd_mmaped_file_retire (rs->pool, old);
+
+	g_free (rs->tmpname);
+	g_slice_free1 (sizeof (*rs), rs);
+}
+
+static void
+rspamd_mmaped_file_resize_step (gint fd, short what, gpointer ud)
+{
+	struct rspamd_mmaped_file_resize_s *rs = ud;
+	struct stat_file_block *block;
+	guint64 end;
+
+	end = MIN (rs->pos + RESIZE_CHUNK, rs->old->cur_section.length);
+	block = rspamd_mmaped_file_chain (rs->old, rs->pos);
+
+	/* Rehash blocks, empty and zero valued blocks are dropped */
+	for (; rs->pos < end; rs->pos ++, block ++) {
+		if ((block->hash1 != 0 || block->hash2 != 0) && block->value != 0) {
+			rspamd_mmaped_file_set_block_common (rs->pool, rs->target,
+					block->hash1, block->hash2, block->value);
+		}
+	}
+
+	if (rs->pos < rs->old->cur_section.length) {
+		evtimer_add (&rs->ev, &rs->tv);
+	}
+	else {
+		rspamd_mmaped_file_resize_finish (rs);
+	}
+}
+
+gboolean
+rspamd_mmaped_file_resize (struct rspamd_statfile_config *stcf,
+		gsize size,
+		struct event_base *ev_base,
+		gpointer p,
+		GError **err)
+{
+	rspamd_mmaped_file_ctx *ctx = (rspamd_mmaped_file_ctx *)p;
+	rspamd_mmaped_file_t *mf;
+	struct rspamd_mmaped_file_resize_s *rs;
+	gchar *tmpname;
+
+	mf = rspamd_mmaped_file_is_open (ctx, stcf);
+
+	if (mf == NULL) {
+		g_set_error (err, rspamd_mmaped_file_quark (), 404,
+				"statfile %s is not opened", stcf->symbol);
+		return FALSE;
+	}
+
+	if (mf->resize != NULL) {
+		g_set_error (err, rspamd_mmaped_file_quark (), 409,
+				"statfile %s is already being resized", stcf->symbol);
+		return FALSE;
+	}
+
+	if (size == 0) {
+		/* Just compact statfile */
+		size = mf->len;
+	}
+
+	tmpname = g_strconcat (mf->filename, RESIZE_SUFFIX, NULL);
+
+	if (rspamd_mmaped_file_create_file (tmpname, size, stcf) != 0) {
+		g_set_error (err, rspamd_mmaped_file_quark (), 500,
+				"cannot create file %s", tmpname);
+		g_free (tmpname);
+		return FALSE;
+	}
+
+	rs = g_slice_alloc0 (sizeof (*rs));
+	rs->target = rspamd_mmaped_file_map_file (tmpname, stcf);
+
+	if (rs->target == NULL) {
+		g_set_error (err, rspamd_mmaped_file_quark (), 500,
+				"cannot open file %s", tmpname);
+		unlink (tmpname);
+		g_free (tmpname);
+		g_slice_free1 (sizeof (*rs), rs);
+		return FALSE;
+	}
+
+	rs->tmpname = tmpname;
+	rs->pool = ctx;
+	rs->old = mf;
+	mf->resize = rs;
+
+	/* Copy blocks from the event loop, so scanning continues meanwhile */
+	evtimer_set (&rs->ev, rspamd_mmaped_file_resize_step, rs);
+	event_base_set (ev_base, &rs->ev);
+	evtimer_add (&rs->ev, &rs->tv);
+
+	msg_info ("start resizing statfile %s from %z to %z bytes",
+			mf->filename, mf->len, size);
+
+	return TRUE;
+}
@@ -25,7 +25,6 @@
 #include "main.h"
 #include "stat_internal.h"
 #include "hiredis.h"
-#include "adapters/libevent.h"
 #include "upstream.h"
 
 #define REDIS_CTX(p) (struct redis_stat_ctx *)(p)
@@ -33,6 +32,10 @@
 #define REDIS_BACKEND_TYPE "redis"
 #define REDIS_DEFAULT_PORT 6379
 #define REDIS_DEFAULT_OBJECT "%s%l"
+#define REDIS_DEFAULT_TIMEOUT 0.5
+/* Maximum number of fields in a single HMGET command */
+#define REDIS_MAX_FIELDS 1024
+#define REDIS_LEARNS_FIELD "learns"
 
 struct redis_stat_ctx_elt {
 	struct upstream_list *read_servers;
@@ -40,18 +43,45 @@ struct redis_stat_ctx_elt {
 
 	const gchar *redis_object;
 	gdouble timeout;
+	/* Tokens are distributed over all servers by their hashes */
+	gboolean sharded;
 };
 
 struct redis_stat_ctx {
 	GHashTable *redis_elts;
+	/* Idle connections indexed by upstream */
+	GHashTable *conns;
+	rspamd_mutex_t *mtx;
+};
+
+struct redis_stat_shard {
+	struct upstream *selected;
+	redisContext *redis;
+	/* Number of commands queued inside MULTI */
+	guint pending;
+	/* Number of replies expected for pipelined requests */
+	guint nreqs;
+	gboolean failed;
 };
 
 struct redis_stat_runtime {
+	struct redis_stat_ctx *ctx;
+	struct redis_stat_ctx_elt *elt;
 	struct rspamd_task *task;
-	struct upstream *selected;
+	struct upstream_list *ups;
+	/* Connections used by this runtime, one per server */
+	struct redis_stat_shard *shards;
+	guint nshards;
+	guint max_shards;
+	/* Shard that holds the learns counter */
+	struct redis_stat_shard *main_shard;
+	/* Values fetched for each token */
 	GArray *results;
+	GArray *tokens;
+	/* Index of the shard for each token */
+	guint *token_shards;
 	gchar *redis_object_expanded;
-	redisAsyncContext *redis;
+	gulong learns;
 };
 
 #define GET_TASK_ELT(task, elt) (task == NULL ? NULL : (task)->elt)
@@ -62,12 +92,190 @@ rspamd_redis_stat_quark (void)
 	return g_quark_from_static_string ("redis-statistics");
 }
 
+static redisContext *
+rspamd_redis_get_connection (struct redis_stat_ctx *ctx,
+		struct redis_stat_ctx_elt *elt,
+		struct upstream *up)
+{
+	GQueue *idle;
+	redisContext *redis = NULL;
+	rspamd_inet_addr_t *addr;
+	struct timeval tv;
+
+	rspamd_mutex_lock (ctx->mtx);
+	idle = g_hash_table_lookup (ctx->conns, up);
+
+	if (idle != NULL) {
+		redis = g_queue_pop_head (idle);
+	}
+
+	rspamd_mutex_unlock (ctx->mtx);
+
+	if (redis != NULL) {
+		return redis;
+	}
+
+	addr = rspamd_upstream_addr (up);
+	g_assert (addr != NULL);
+	double_to_tv (elt->timeout, &tv);
+	redis = redisConnectWithTimeout (rspamd_inet_address_to_string (addr),
+			rspamd_inet_address_get_port (addr), tv);
+
+	if (redis == NULL || redis->err) {
+		msg_err ("cannot connect to redis server %s: %s",
+				rspamd_upstream_name (up),
+				redis ? redis->errstr : strerror (errno));
+		rspamd_upstream_fail (up);
+
+		if (redis != NULL) {
+			redisFree (redis);
+		}
+
+		return NULL;
+	}
+
+	redisSetTimeout (redis, tv);
+
+	return redis;
+}
+
 static void
-rspamd_redis_fin (gpointer data)
+rspamd_redis_release_connection (gpointer data)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (data);
+	struct redis_stat_shard *shard;
+	GQueue *idle;
+	guint i;
+
+	for (i = 0; i < rt->nshards; i ++) {
+		shard = &rt->shards[i];
+
+		if (shard->redis == NULL) {
+			continue;
+		}
+
+		if (shard->failed || shard->pending > 0 || shard->nreqs > 0 ||
+				shard->redis->err) {
+			/* Connection state is unknown, so do not reuse it */
+			redisFree (shard->redis);
+		}
+		else {
+			rspamd_mutex_lock (rt->ctx->mtx);
+			idle = g_hash_table_lookup (rt->ctx->conns, shard->selected);
+
+			if (idle == NULL) {
+				idle = g_queue_new ();
+				g_hash_table_insert (rt->ctx->conns, shard->selected, idle);
+			}
+
+			g_queue_push_head (idle, shard->redis);
+			rspamd_mutex_unlock (rt->ctx->mtx);
+		}
+
+		shard->redis = NULL;
+	}
+}
+
+static void
+rspamd_redis_runtime_fail (struct redis_stat_runtime *rt,
+		struct redis_stat_shard *shard, const gchar *what)
+{
+	msg_err ("cannot %s for %s on redis server %s: %s", what,
+			rt->redis_object_expanded,
+			rspamd_upstream_name (shard->selected),
+			shard->redis->err ? shard->redis->errstr : "protocol error");
+	rspamd_upstream_fail (shard->selected);
+	shard->failed = TRUE;
+}
+
+/*
+ * Returns a shard for the specified upstream connecting to it if needed
+ */
+static struct redis_stat_shard *
+rspamd_redis_get_shard (struct redis_stat_runtime *rt, struct upstream *up)
+{
+	struct redis_stat_shard *shard;
+	guint i;
+
+	for (i = 0; i < rt->nshards; i ++) {
+		if (rt->shards[i].selected == up) {
+			return &rt->shards[i];
+		}
+	}
+
+	g_assert (rt->nshards < rt->max_shards);
+	shard = &rt->shards[rt->nshards ++];
+	shard->selected = up;
+	shard->redis = rspamd_redis_get_connection (rt->ctx, rt->elt, up);
+
+	if (shard->redis == NULL) {
+		shard->failed = TRUE;
+	}
+
+	return shard;
+}
+
+static guint
+rspamd_redis_token_shard (struct redis_stat_runtime *rt, rspamd_token_t *tok)
+{
+	struct upstream *up;
+
+	if (!rt->elt->sharded) {
+		return 0;
+	}
+
+	up = rspamd_upstream_get (rt->ups, RSPAMD_UPSTREAM_HASHED,
+			(const guint8 *)&tok->data, (guint)sizeof (tok->data));
+
+	return rspamd_redis_get_shard (rt, up) - rt->shards;
+}
+
+/*
+ * Sends all pipelined commands of a shard, so all servers process requests
+ * in parallel while we wait for replies of the first one
+ */
+static void
+rspamd_redis_flush_shard (struct redis_stat_runtime *rt,
+		struct redis_stat_shard *shard)
+{
+	gint done = 0;
+
+	if (shard->failed || shard->redis == NULL) {
+		return;
+	}
+
+	while (!done) {
+		if (redisBufferWrite (shard->redis, &done) != REDIS_OK) {
+			rspamd_redis_runtime_fail (rt, shard, "send commands");
+			return;
+		}
+	}
+}
+
+static gdouble
+rspamd_redis_reply_number (redisReply *reply)
+{
+	if (reply->type == REDIS_REPLY_STRING) {
+		return strtod (reply->str, NULL);
+	}
+	else if (reply->type == REDIS_REPLY_INTEGER) {
+		return reply->integer;
+	}
+
+	return 0;
+}
 
-	redisAsyncFree (rt->redis);
+static void
+rspamd_redis_queue_incr (struct redis_stat_runtime *rt,
+		struct redis_stat_shard *shard, const gchar *field, gint64 delta)
+{
+	if (shard->pending == 0) {
+		redisAppendCommand (shard->redis, "MULTI");
+	}
+
+	redisAppendCommand (shard->redis, "HINCRBY %s %s %lld",
+			rt->redis_object_expanded, field, (long long)delta);
+	shard->pending ++;
 }
 
 /*
@@ -284,6 +492,8 @@ rspamd_redis_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg)
 
 	new = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*new));
 	new->redis_elts = g_hash_table_new (g_direct_hash, g_direct_equal);
+	new->conns = g_hash_table_new (g_direct_hash, g_direct_equal);
+	new->mtx = rspamd_mutex_new ();
 
 	/* Iterate over all classifiers and load matching statfiles */
 	cur = cfg->classifiers;
@@ -298,7 +508,8 @@ rspamd_redis_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg)
 			/*
 			 * By default, all statfiles are treated as mmaped files
 			 */
-			if (stf->backend != NULL && strcmp (stf->backend, REDIS_BACKEND_TYPE)) {
+			if (stf->backend != NULL &&
+					strcmp (stf->backend, REDIS_BACKEND_TYPE) == 0) {
 				/*
 				 * Check configuration sanity
 				 */
@@ -356,6 +567,19 @@ rspamd_redis_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg)
 					}
 				}
 
+				elt = ucl_object_find_key (stf->opts, "timeout");
+				if (elt != NULL) {
+					backend->timeout = ucl_object_todouble (elt);
+				}
+				else {
+					backend->timeout = REDIS_DEFAULT_TIMEOUT;
+				}
+
+				elt = ucl_object_find_key (stf->opts, "sharded");
+				if (elt != NULL) {
+					backend->sharded = ucl_object_toboolean (elt);
+				}
+
 				g_hash_table_insert (new->redis_elts, stf, backend);
 
 				ctx->statfiles ++;
@@ -370,6 +594,7 @@ rspamd_redis_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg)
 	return (gpointer)new;
 }
 
+
 gpointer
 rspamd_redis_runtime (struct rspamd_task *task,
 		struct rspamd_statfile_config *stcf,
@@ -378,25 +603,45 @@ rspamd_redis_runtime (struct rspamd_task *task,
 	struct redis_stat_ctx *ctx = REDIS_CTX (c);
 	struct redis_stat_ctx_elt *elt;
 	struct redis_stat_runtime *rt;
+	struct redis_stat_shard *shard;
 	struct upstream *up;
-	rspamd_inet_addr_t *addr;
+	redisReply *reply;
 
 	g_assert (ctx != NULL);
 	g_assert (stcf != NULL);
 
+	if (task == NULL) {
+		/* Objects are expanded per task, so there is nothing to show */
+		return NULL;
+	}
+
 	elt = g_hash_table_lookup (ctx->redis_elts, stcf);
-	g_assert (elt != NULL);
+
+	if (elt == NULL) {
+		return NULL;
+	}
 
 	if (learn && elt->write_servers == NULL) {
 		msg_err ("no write servers defined for %s, cannot learn", stcf->symbol);
 		return NULL;
 	}
 
-	if (learn) {
-		up = rspamd_upstream_get (elt->write_servers, RSPAMD_UPSTREAM_MASTER_SLAVE);
+	rt = rspamd_mempool_alloc0 (task->task_pool, sizeof (*rt));
+	rspamd_redis_expand_object (elt->redis_object, stcf, task,
+			&rt->redis_object_expanded);
+	rt->ups = learn ? elt->write_servers : elt->read_servers;
+
+	if (elt->sharded) {
+		/* The learns counter is stored on the shard of the object itself */
+		up = rspamd_upstream_get (rt->ups, RSPAMD_UPSTREAM_HASHED,
+				(const guint8 *)rt->redis_object_expanded,
+				(guint)strlen (rt->redis_object_expanded));
+	}
+	else if (learn) {
+		up = rspamd_upstream_get (rt->ups, RSPAMD_UPSTREAM_MASTER_SLAVE);
 	}
 	else {
-		up = rspamd_upstream_get (elt->read_servers, RSPAMD_UPSTREAM_ROUND_ROBIN);
+		up = rspamd_upstream_get (rt->ups, RSPAMD_UPSTREAM_ROUND_ROBIN);
 	}
 
 	if (up == NULL) {
@@ -404,38 +649,354 @@ rspamd_redis_runtime (struct rspamd_task *task,
 		return NULL;
 	}
 
-	rt = rspamd_mempool_alloc (task->task_pool, sizeof (*rt));
-	rspamd_redis_expand_object (elt->redis_object, stcf, task,
-			&rt->redis_object_expanded);
-	rt->selected = up;
 	rt->task = task;
+	rt->ctx = ctx;
+	rt->elt = elt;
+	rt->max_shards = elt->sharded ? rspamd_upstreams_count (rt->ups) : 1;
+	rt->shards = rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (*rt->shards) * rt->max_shards);
+	rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_redis_release_connection, rt);
 
-	addr = rspamd_upstream_addr (up);
-	g_assert (addr != NULL);
-	rt->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
-			rspamd_inet_address_get_port (addr));
-	g_assert (rt->redis != NULL);
+	shard = rspamd_redis_get_shard (rt, up);
+
+	if (shard->failed) {
+		return NULL;
+	}
+
+	rt->main_shard = shard;
+	reply = redisCommand (shard->redis, "HGET %s %s", rt->redis_object_expanded,
+			REDIS_LEARNS_FIELD);
+
+	if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+		rspamd_redis_runtime_fail (rt, shard, "get learns count");
+
+		if (reply != NULL) {
+			freeReplyObject (reply);
+		}
+
+		return NULL;
+	}
 
-	redisLibeventAttach (rt->redis, task->ev_base);
-	register_async_event (task->s, rspamd_redis_fin, rt,
-			rspamd_redis_stat_quark ());
+	rt->learns = rspamd_redis_reply_number (reply);
+	freeReplyObject (reply);
 
 	return rt;
 }
 
-gboolean rspamd_redis_process_token (struct token_node_s *tok,
+gboolean
+rspamd_redis_process_tokens (struct rspamd_task *task,
+		GArray *tokens,
+		gint id,
+		gpointer runtime,
+		gpointer ctx)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
+	struct redis_stat_shard *shard;
+	rspamd_token_t *tok;
+	redisReply *reply;
+	const gchar **argv;
+	gsize *argvlen;
+	gchar (*fields)[24];
+	gdouble val;
+	guint *order, *offsets, i, j, k, n, s, start, end;
+	gboolean ret = FALSE;
+
+	if (rt == NULL || rt->main_shard->failed || tokens->len == 0) {
+		return FALSE;
+	}
+
+	rt->tokens = tokens;
+	rt->results = g_array_sized_new (FALSE, TRUE, sizeof (gdouble), tokens->len);
+	g_array_set_size (rt->results, tokens->len);
+	rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_array_free_hard, rt->results);
+	rt->token_shards = rspamd_mempool_alloc (task->task_pool,
+			sizeof (*rt->token_shards) * tokens->len);
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = &g_array_index (tokens, rspamd_token_t, i);
+		rt->token_shards[i] = rspamd_redis_token_shard (rt, tok);
+	}
+
+	/* Group tokens by shards preserving their order */
+	offsets = g_malloc0 ((rt->nshards + 1) * sizeof (*offsets));
+	order = g_malloc (tokens->len * sizeof (*order));
+
+	for (i = 0; i < tokens->len; i ++) {
+		offsets[rt->token_shards[i] + 1] ++;
+	}
+
+	for (s = 0; s < rt->nshards; s ++) {
+		offsets[s + 1] += offsets[s];
+	}
+
+	for (i = 0; i < tokens->len; i ++) {
+		order[offsets[rt->token_shards[i]] ++] = i;
+	}
+
+	/* Offsets have been moved to the ends of groups */
+	memmove (offsets + 1, offsets, rt->nshards * sizeof (*offsets));
+	offsets[0] = 0;
+
+	n = MIN (tokens->len, REDIS_MAX_FIELDS);
+	argv = g_malloc ((n + 2) * sizeof (*argv));
+	argvlen = g_malloc ((n + 2) * sizeof (*argvlen));
+	fields = g_malloc (n * sizeof (*fields));
+	argv[0] = "HMGET";
+	argvlen[0] = sizeof ("HMGET") - 1;
+	argv[1] = rt->redis_object_expanded;
+	argvlen[1] = strlen (rt->redis_object_expanded);
+
+	/* Pipeline all requests of all shards and then read all replies */
+	for (s = 0; s < rt->nshards; s ++) {
+		shard = &rt->shards[s];
+
+		if (shard->failed) {
+			continue;
+		}
+
+		for (i = offsets[s]; i < offsets[s + 1]; i += REDIS_MAX_FIELDS) {
+			n = MIN (REDIS_MAX_FIELDS, offsets[s + 1] - i);
+
+			for (k = 0; k < n; k ++) {
+				tok = &g_array_index (tokens, rspamd_token_t, order[i + k]);
+				argvlen[k + 2] = rspamd_snprintf (fields[k], sizeof (fields[k]),
+						"%uL", tok->data);
+				argv[k + 2] = fields[k];
+			}
+
+			redisAppendCommandArgv (shard->redis, n + 2, argv, argvlen);
+			shard->nreqs ++;
+		}
+	}
+
+	g_free (argv);
+	g_free (argvlen);
+	g_free (fields);
+
+	for (s = 0; s < rt->nshards; s ++) {
+		rspamd_redis_flush_shard (rt, &rt->shards[s]);
+	}
+
+	for (s = 0; s < rt->nshards; s ++) {
+		shard = &rt->shards[s];
+		start = offsets[s];
+		end = offsets[s + 1];
+
+		for (j = start; shard->nreqs > 0 && !shard->failed; shard->nreqs --) {
+			if (redisGetReply (shard->redis, (void **)&reply) != REDIS_OK) {
+				rspamd_redis_runtime_fail (rt, shard, "get tokens");
+				break;
+			}
+
+			if (reply->type != REDIS_REPLY_ARRAY) {
+				freeReplyObject (reply);
+				j += MIN (REDIS_MAX_FIELDS, end - j);
+				continue;
+			}
+
+			for (k = 0; k < reply->elements && j < end; k ++, j ++) {
+				tok = &g_array_index (tokens, rspamd_token_t, order[j]);
+				val = rspamd_redis_reply_number (reply->element[k]);
+				g_array_index (rt->results, gdouble, order[j]) = val;
+				tok->results[id].value = val;
+			}
+
+			freeReplyObject (reply);
+		}
+
+		if (!shard->failed) {
+			rspamd_upstream_ok (shard->selected);
+			ret = TRUE;
+		}
+	}
+
+	g_free (order);
+	g_free (offsets);
+
+	return ret;
+}
+
+gboolean
+rspamd_redis_process_token (struct token_node_s *tok,
 		struct rspamd_token_result *res,
-		gpointer ctx);
-gboolean rspamd_redis_learn_token (struct token_node_s *tok,
+		gpointer ctx)
+{
+	struct redis_stat_runtime *rt;
+
+	g_assert (res != NULL);
+	g_assert (res->st_runtime != NULL);
+
+	rt = REDIS_RUNTIME (res->st_runtime->backend_runtime);
+
+	if (rt == NULL || rt->results == NULL) {
+		res->value = 0.0;
+		return FALSE;
+	}
+
+	/* Value has been already fetched by rspamd_redis_process_tokens */
+	return res->value > 0.0;
+}
+
+gboolean
+rspamd_redis_learn_token (struct token_node_s *tok,
 		struct rspamd_token_result *res,
-		gpointer ctx);
-void rspamd_redis_finalize_learn (struct rspamd_statfile_runtime *runtime,
-		gpointer ctx);
-gulong rspamd_redis_total_learns (struct rspamd_statfile_runtime *runtime,
-		gpointer ctx);
-gulong rspamd_redis_inc_learns (struct rspamd_statfile_runtime *runtime,
-		gpointer ctx);
-gulong rspamd_redis_learns (struct rspamd_statfile_runtime *runtime,
-		gpointer ctx);
-ucl_object_t * rspamd_redis_get_stat (struct rspamd_statfile_runtime *runtime,
-		gpointer ctx);
+		gpointer ctx)
+{
+	struct redis_stat_runtime *rt;
+	struct redis_stat_shard *shard;
+	gchar field[24];
+	gdouble delta;
+	guint idx;
+
+	g_assert (res != NULL);
+	g_assert (res->st_runtime != NULL);
+
+	rt = REDIS_RUNTIME (res->st_runtime->backend_runtime);
+
+	if (rt == NULL || rt->tokens == NULL) {
+		return FALSE;
+	}
+
+	/* Tokens are stored in a flat array, so we can find a fetched value */
+	idx = tok - (rspamd_token_t *)rt->tokens->data;
+	g_assert (idx < rt->tokens->len);
+	shard = &rt->shards[rt->token_shards[idx]];
+
+	if (shard->failed) {
+		return FALSE;
+	}
+
+	delta = res->value - g_array_index (rt->results, gdouble, idx);
+
+	if (delta != 0) {
+		rspamd_snprintf (field, sizeof (field), "%uL", tok->data);
+		rspamd_redis_queue_incr (rt, shard, field, delta);
+	}
+
+	return TRUE;
+}
+
+void
+rspamd_redis_finalize_learn (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
+	struct redis_stat_shard *shard;
+	redisReply *reply;
+	guint i, s;
+
+	if (rt == NULL) {
+		return;
+	}
+
+	/* Transactions of all shards are executed in parallel */
+	for (s = 0; s < rt->nshards; s ++) {
+		shard = &rt->shards[s];
+
+		if (!shard->failed && shard->pending > 0) {
+			redisAppendCommand (shard->redis, "EXEC");
+			rspamd_redis_flush_shard (rt, shard);
+		}
+	}
+
+	for (s = 0; s < rt->nshards; s ++) {
+		shard = &rt->shards[s];
+
+		if (shard->failed || shard->pending == 0) {
+			continue;
+		}
+
+		/* MULTI, all queued commands and EXEC */
+		for (i = 0; i < shard->pending + 2; i ++) {
+			if (redisGetReply (shard->redis, (void **)&reply) != REDIS_OK) {
+				rspamd_redis_runtime_fail (rt, shard, "learn tokens");
+				break;
+			}
+
+			if (reply->type == REDIS_REPLY_ERROR) {
+				msg_err ("cannot learn tokens for %s on redis server %s: %s",
+						rt->redis_object_expanded,
+						rspamd_upstream_name (shard->selected),
+						reply->str);
+			}
+
+			freeReplyObject (reply);
+		}
+
+		if (!shard->failed) {
+			shard->pending = 0;
+			rspamd_upstream_ok (shard->selected);
+		}
+	}
+}
+
+gulong
+rspamd_redis_total_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
+
+	if (rt == NULL) {
+		return 0;
+	}
+
+	return rt->learns;
+}
+
+gulong
+rspamd_redis_inc_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
+
+	if (rt == NULL || rt->main_shard->failed) {
+		return 0;
+	}
+
+	rspamd_redis_queue_incr (rt, rt->main_shard, REDIS_LEARNS_FIELD, 1);
+
+	return ++rt->learns;
+}
+
+gulong
+rspamd_redis_dec_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
+
+	if (rt == NULL || rt->main_shard->failed) {
+		return 0;
+	}
+
+	if (rt->learns > 0) {
+		rspamd_redis_queue_incr (rt, rt->main_shard, REDIS_LEARNS_FIELD, -1);
+		rt->learns --;
+	}
+
+	return rt->learns;
+}
+
+ucl_object_t *
+rspamd_redis_get_stat (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
+	ucl_object_t *res = NULL;
+
+	if (rt != NULL) {
+		res = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (res, ucl_object_fromint (rt->learns),
+				"revision", 0, false);
+		ucl_object_insert_key (res, ucl_object_fromstring (
+				rt->redis_object_expanded), "object", 0, false);
+
+		if (rt->elt->sharded) {
+			ucl_object_insert_key (res, ucl_object_fromint (
+					rspamd_upstreams_count (rt->ups)), "shards", 0, false);
+		}
+	}
+
+	return res;
+}
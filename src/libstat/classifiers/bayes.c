@@ -80,22 +80,89 @@ inv_chi_square (gdouble value, gint freedom_deg)
 static const double feature_weight[] = { 0, 3125, 256, 27, 4, 1 };
 
 #define PROB_COMBINE(prob, cnt, weight, assumed) (((weight) * (assumed) + (cnt) * (prob)) / ((weight) + (cnt)))
+
 /*
- * In this callback we calculate local probabilities for tokens
+ * Log probabilities of a token depend merely on its counts, its window and
+ * total counts of classifier, the latter are constant during classification.
+ * Most tokens have small counts, so their probabilities are computed once per
+ * classification for long documents
  */
-static gboolean
-bayes_classify_callback (gpointer key, gpointer value, gpointer data)
+#define BAYES_CACHE_COUNTS 16
+#define BAYES_CACHE_MIN_TOKENS 256
+
+struct bayes_log_cache {
+	gdouble spam_log[G_N_ELEMENTS (feature_weight)][BAYES_CACHE_COUNTS][BAYES_CACHE_COUNTS];
+	gdouble ham_log[G_N_ELEMENTS (feature_weight)][BAYES_CACHE_COUNTS][BAYES_CACHE_COUNTS];
+	guint8 filled[G_N_ELEMENTS (feature_weight)][BAYES_CACHE_COUNTS][BAYES_CACHE_COUNTS];
+};
+
+static void
+bayes_token_logs (guint64 spam_count, guint64 ham_count, guint window_idx,
+		struct rspamd_classifier_runtime *rt,
+		gdouble *spam_log, gdouble *ham_log)
+{
+	guint64 total_count = spam_count + ham_count;
+	double spam_prob, spam_freq, ham_freq, bayes_spam_prob, bayes_ham_prob,
+		ham_prob, fw, w, norm_sum, norm_sub;
+
+	spam_freq = ((double)spam_count / MAX (1., (double)rt->total_spam));
+	ham_freq = ((double)ham_count / MAX (1., (double)rt->total_ham));
+	spam_prob = spam_freq / (spam_freq + ham_freq);
+	ham_prob = ham_freq / (spam_freq + ham_freq);
+	fw = feature_weight[window_idx];
+	norm_sum = (spam_freq + ham_freq) * (spam_freq + ham_freq);
+	norm_sub = (spam_freq - ham_freq) * (spam_freq - ham_freq);
+	w = (norm_sub) / (norm_sum) *
+			(fw * total_count) / (4.0 * (1.0 + fw * total_count));
+	bayes_spam_prob = PROB_COMBINE (spam_prob, total_count, w, 0.5);
+	norm_sub = (ham_freq - spam_freq) * (ham_freq - spam_freq);
+	w = (norm_sub) / (norm_sum) *
+			(fw * total_count) / (4.0 * (1.0 + fw * total_count));
+	bayes_ham_prob = PROB_COMBINE (ham_prob, total_count, w, 0.5);
+	*spam_log = log (bayes_spam_prob);
+	*ham_log = log (bayes_ham_prob);
+}
+
+/*
+ * Sum of logs with independent accumulators, so that additions are not
+ * serialized and can be vectorized by compiler
+ */
+static gdouble
+bayes_sum_logs (const gdouble *v, guint n)
 {
-	rspamd_token_t *node = value;
-	struct rspamd_classifier_runtime *rt = (struct rspamd_classifier_runtime *)data;
+	gdouble s0 = 0, s1 = 0, s2 = 0, s3 = 0;
 	guint i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		s0 += v[i];
+		s1 += v[i + 1];
+		s2 += v[i + 2];
+		s3 += v[i + 3];
+	}
+
+	for (; i < n; i ++) {
+		s0 += v[i];
+	}
+
+	return (s0 + s1) + (s2 + s3);
+}
+
+/*
+ * Here we calculate local probabilities for tokens, returns TRUE if a token
+ * has been found in statfiles
+ */
+static gboolean
+bayes_classify_token (rspamd_token_t *node,
+		struct rspamd_classifier_runtime *rt,
+		struct bayes_log_cache *cache,
+		gdouble *spam_log, gdouble *ham_log)
+{
+	guint i, widx;
 	struct rspamd_token_result *res;
 	guint64 spam_count = 0, ham_count = 0, total_count = 0;
-	double spam_prob, spam_freq, ham_freq, bayes_spam_prob, bayes_ham_prob,
-		ham_prob, fw, w, norm_sum, norm_sub;
 
 	for (i = rt->start_pos; i < rt->end_pos; i++) {
-		res = &g_array_index (node->results, struct rspamd_token_result, i);
+		res = &node->results[i];
 
 		if (res->value > 0) {
 			if (res->st_runtime->st->is_spam) {
@@ -111,23 +178,28 @@ bayes_classify_callback (gpointer key, gpointer value, gpointer data)
 
 	/* Probability for this token */
 	if (total_count > 0) {
-		spam_freq = ((double)spam_count / MAX (1., (double)rt->total_spam));
-		ham_freq = ((double)ham_count / MAX (1., (double)rt->total_ham));
-		spam_prob = spam_freq / (spam_freq + ham_freq);
-		ham_prob = ham_freq / (spam_freq + ham_freq);
-		fw = feature_weight[node->window_idx % G_N_ELEMENTS (feature_weight)];
-		norm_sum = (spam_freq + ham_freq) * (spam_freq + ham_freq);
-		norm_sub = (spam_freq - ham_freq) * (spam_freq - ham_freq);
-		w = (norm_sub) / (norm_sum) *
-				(fw * total_count) / (4.0 * (1.0 + fw * total_count));
-		bayes_spam_prob = PROB_COMBINE (spam_prob, total_count, w, 0.5);
-		norm_sub = (ham_freq - spam_freq) * (ham_freq - spam_freq);
-		w = (norm_sub) / (norm_sum) *
-				(fw * total_count) / (4.0 * (1.0 + fw * total_count));
-		bayes_ham_prob = PROB_COMBINE (ham_prob, total_count, w, 0.5);
-		rt->spam_prob += log (bayes_spam_prob);
-		rt->ham_prob += log (bayes_ham_prob);
+		widx = node->window_idx % G_N_ELEMENTS (feature_weight);
+
+		if (cache != NULL && spam_count < BAYES_CACHE_COUNTS &&
+				ham_count < BAYES_CACHE_COUNTS) {
+			if (!cache->filled[widx][spam_count][ham_count]) {
+				bayes_token_logs (spam_count, ham_count, widx, rt,
+						&cache->spam_log[widx][spam_count][ham_count],
+						&cache->ham_log[widx][spam_count][ham_count]);
+				cache->filled[widx][spam_count][ham_count] = 1;
+			}
+
+			*spam_log = cache->spam_log[widx][spam_count][ham_count];
+			*ham_log = cache->ham_log[widx][spam_count][ham_count];
+		}
+		else {
+			bayes_token_logs (spam_count, ham_count, widx, rt,
+					spam_log, ham_log);
+		}
+
 		res->cl_runtime->processed_tokens ++;
+
+		return TRUE;
 	}
 
 	return FALSE;
@@ -148,13 +220,14 @@ bayes_init (rspamd_mempool_t *pool, struct rspamd_classifier_config *cfg)
 
 gboolean
 bayes_classify (struct classifier_ctx * ctx,
-	GTree *input,
+	GArray *input,
 	struct rspamd_classifier_runtime *rt,
 	struct rspamd_task *task)
 {
-	double final_prob, h, s;
-	guint maxhits = 0;
+	double final_prob, h, s, *spam_logs, *ham_logs;
+	guint maxhits = 0, i, n;
 	struct rspamd_statfile_runtime *st, *selected_st = NULL;
+	struct bayes_log_cache *cache = NULL;
 	GList *cur;
 	char *sumbuf;
 
@@ -164,7 +237,26 @@ bayes_classify (struct classifier_ctx * ctx,
 	g_assert (rt->end_pos > rt->start_pos);
 
 	if (rt->stage == RSPAMD_STAT_STAGE_PRE) {
-		g_tree_foreach (input, bayes_classify_callback, rt);
+		spam_logs = g_malloc (sizeof (gdouble) * input->len * 2);
+		ham_logs = spam_logs + input->len;
+
+		if (input->len >= BAYES_CACHE_MIN_TOKENS) {
+			cache = g_malloc (sizeof (*cache));
+			memset (cache->filled, 0, sizeof (cache->filled));
+		}
+
+		for (i = 0, n = 0; i < input->len; i ++) {
+			if (bayes_classify_token (&g_array_index (input, rspamd_token_t, i),
+					rt, cache, &spam_logs[n], &ham_logs[n])) {
+				n ++;
+			}
+		}
+
+		rt->spam_prob += bayes_sum_logs (spam_logs, n);
+		rt->ham_prob += bayes_sum_logs (ham_logs, n);
+
+		g_free (cache);
+		g_free (spam_logs);
 	}
 	else {
 
@@ -180,7 +272,7 @@ bayes_classify (struct classifier_ctx * ctx,
 			msg_debug ("<%s> got ham prob %.2f -> %.2f and spam prob %.2f -> %.2f,"
 					" %L tokens processed of %ud total tokens",
 					task->message_id, rt->ham_prob, h, rt->spam_prob, s,
-					rt->processed_tokens, g_tree_nnodes (input));
+					rt->processed_tokens, input->len);
 		}
 
 		if (rt->processed_tokens > 0 && fabs (final_prob - 0.5) > 0.05) {
@@ -225,17 +317,16 @@ bayes_classify (struct classifier_ctx * ctx,
 	return TRUE;
 }
 
-static gboolean
-bayes_learn_spam_callback (gpointer key, gpointer value, gpointer data)
+static void
+bayes_learn_spam_token (rspamd_token_t *node,
+		struct rspamd_classifier_runtime *rt)
 {
-	rspamd_token_t *node = value;
 	struct rspamd_token_result *res;
-	struct rspamd_classifier_runtime *rt = (struct rspamd_classifier_runtime *)data;
 	guint i;
 
 
 	for (i = rt->start_pos; i < rt->end_pos; i++) {
-		res = &g_array_index (node->results, struct rspamd_token_result, i);
+		res = &node->results[i];
 
 		if (res->st_runtime->st->is_spam) {
 			res->value ++;
@@ -245,21 +336,18 @@ bayes_learn_spam_callback (gpointer key, gpointer value, gpointer data)
 			res->value --;
 		}
 	}
-
-	return FALSE;
 }
 
-static gboolean
-bayes_learn_ham_callback (gpointer key, gpointer value, gpointer data)
+static void
+bayes_learn_ham_token (rspamd_token_t *node,
+		struct rspamd_classifier_runtime *rt)
 {
-	rspamd_token_t *node = value;
 	struct rspamd_token_result *res;
-	struct rspamd_classifier_runtime *rt = (struct rspamd_classifier_runtime *)data;
 	guint i;
 
 
 	for (i = rt->start_pos; i < rt->end_pos; i++) {
-		res = &g_array_index (node->results, struct rspamd_token_result, i);
+		res = &node->results[i];
 
 		if (!res->st_runtime->st->is_spam) {
 			res->value ++;
@@ -268,28 +356,34 @@ bayes_learn_ham_callback (gpointer key, gpointer value, gpointer data)
 			res->value --;
 		}
 	}
-
-	return FALSE;
 }
 
 gboolean
 bayes_learn_spam (struct classifier_ctx * ctx,
-	GTree *input,
+	GArray *input,
 	struct rspamd_classifier_runtime *rt,
 	struct rspamd_task *task,
 	gboolean is_spam,
 	GError **err)
 {
+	guint i;
+
 	g_assert (ctx != NULL);
 	g_assert (input != NULL);
 	g_assert (rt != NULL);
 	g_assert (rt->end_pos > rt->start_pos);
 
 	if (is_spam) {
-		g_tree_foreach (input, bayes_learn_spam_callback, rt);
+		for (i = 0; i < input->len; i ++) {
+			bayes_learn_spam_token (&g_array_index (input, rspamd_token_t, i),
+					rt);
+		}
 	}
 	else {
-		g_tree_foreach (input, bayes_learn_ham_callback, rt);
+		for (i = 0; i < input->len; i ++) {
+			bayes_learn_ham_token (&g_array_index (input, rspamd_token_t, i),
+					rt);
+		}
 	}
 
 
@@ -30,6 +30,7 @@
 #include "ucl.h"
 #include "fstring.h"
 #include "message.h"
+#include "cuckoo.h"
 #include <sqlite3.h>
 
 static const char *create_tables_sql =
@@ -42,11 +43,93 @@ static const char *create_tables_sql =
 		"COMMIT;";
 
 #define SQLITE_CACHE_PATH RSPAMD_DBDIR "/learn_cache.sqlite"
+#define SQLITE_CACHE_FILTER_SUFFIX ".filter"
+/* Minimum capacity of digests filter */
+#define SQLITE_CACHE_FILTER_MIN 65536
+/* Save filter after this number of new digests */
+#define SQLITE_CACHE_FILTER_SYNC 128
 
 struct rspamd_stat_sqlite3_ctx {
 	sqlite3 *db;
+	rspamd_cuckoo_filter_t *filter;         /* learned digests			*/
+	gchar *filter_path;
+	guint changes;                          /* unsaved filter changes	*/
 };
 
+static rspamd_cuckoo_filter_t *
+rspamd_stat_cache_sqlite3_build_filter (sqlite3 *db, gsize capacity)
+{
+	static const gchar count_sql[] = "SELECT COUNT(*) FROM learns";
+	static const gchar select_sql[] = "SELECT digest FROM learns";
+	rspamd_cuckoo_filter_t *filter;
+	sqlite3_stmt *st = NULL;
+	gint rc;
+
+	if (sqlite3_prepare_v2 (db, count_sql, -1, &st, NULL) != SQLITE_OK) {
+		msg_err ("Cannot prepare sql %s: %s", count_sql, sqlite3_errmsg (db));
+		return NULL;
+	}
+
+	if (sqlite3_step (st) == SQLITE_ROW) {
+		capacity = MAX (capacity, (gsize)sqlite3_column_int64 (st, 0) * 2);
+	}
+
+	sqlite3_finalize (st);
+
+	if (sqlite3_prepare_v2 (db, select_sql, -1, &st, NULL) != SQLITE_OK) {
+		msg_err ("Cannot prepare sql %s: %s", select_sql, sqlite3_errmsg (db));
+		return NULL;
+	}
+
+	filter = rspamd_cuckoo_create (MAX (capacity, SQLITE_CACHE_FILTER_MIN));
+
+	while ((rc = sqlite3_step (st)) == SQLITE_ROW) {
+		rspamd_cuckoo_add (filter, sqlite3_column_blob (st, 0),
+				sqlite3_column_bytes (st, 0));
+	}
+
+	sqlite3_finalize (st);
+
+	if (rc != SQLITE_DONE) {
+		msg_err ("Cannot load learned digests: %s", sqlite3_errmsg (db));
+		rspamd_cuckoo_destroy (filter);
+
+		return NULL;
+	}
+
+	return filter;
+}
+
+static void
+rspamd_stat_cache_sqlite3_filter_add (struct rspamd_stat_sqlite3_ctx *ctx,
+		const guchar *h, gsize len)
+{
+	if (ctx->filter == NULL) {
+		return;
+	}
+
+	if (!rspamd_cuckoo_add (ctx->filter, h, len)) {
+		/* Filter is full, so allocate a larger one */
+		msg_info ("learn cache filter is full (%uL elements), rebuilding",
+				ctx->filter->count);
+		rspamd_cuckoo_destroy (ctx->filter);
+		ctx->filter = rspamd_stat_cache_sqlite3_build_filter (ctx->db, 0);
+
+		if (ctx->filter == NULL) {
+			return;
+		}
+	}
+
+	if (++ctx->changes >= SQLITE_CACHE_FILTER_SYNC) {
+		if (!rspamd_cuckoo_save (ctx->filter, ctx->filter_path)) {
+			msg_warn ("Cannot save learn cache filter %s: %s",
+					ctx->filter_path, strerror (errno));
+		}
+
+		ctx->changes = 0;
+	}
+}
+
 gpointer
 rspamd_stat_cache_sqlite3_init(struct rspamd_stat_ctx *ctx,
 		struct rspamd_config *cfg)
@@ -110,8 +193,17 @@ rspamd_stat_cache_sqlite3_init(struct rspamd_stat_ctx *ctx,
 			return NULL;
 		}
 
-		new = g_slice_alloc (sizeof (*new));
+		new = g_slice_alloc0 (sizeof (*new));
 		new->db = sqlite;
+		new->filter_path = g_strconcat (dbpath, SQLITE_CACHE_FILTER_SUFFIX,
+				NULL);
+		new->filter = rspamd_cuckoo_load (new->filter_path);
+
+		if (new->filter == NULL || new->filter->victim != 0) {
+			/* Absent, broken or overfilled filter */
+			rspamd_cuckoo_destroy (new->filter);
+			new->filter = rspamd_stat_cache_sqlite3_build_filter (sqlite, 0);
+		}
 	}
 
 	return new;
@@ -175,7 +267,11 @@ rspamd_stat_cache_sqlite3_check (const guchar *h, gsize len, gboolean is_spam,
 		else {
 			sqlite3_bind_text (st, 1, h, len, SQLITE_STATIC);
 			sqlite3_bind_int (st, 2, is_spam ? 1 : 0);
-			sqlite3_step (st);
+
+			if (sqlite3_step (st) == SQLITE_DONE) {
+				rspamd_stat_cache_sqlite3_filter_add (ctx, h, len);
+			}
+
 			sqlite3_finalize (st);
 		}
 	}
@@ -183,6 +279,46 @@ rspamd_stat_cache_sqlite3_check (const guchar *h, gsize len, gboolean is_spam,
 	return ret;
 }
 
+/*
+ * Digests that are not in the filter are definitely not learned, so they are
+ * inserted without looking up. Unique index on digest protects from stale
+ * filters: if insertion fails, we fall back to the full check.
+ */
+static rspamd_learn_t
+rspamd_stat_cache_sqlite3_insert (const guchar *h, gsize len, gboolean is_spam,
+		struct rspamd_stat_sqlite3_ctx *ctx)
+{
+	static const gchar insert_sql[] = "INSERT INTO learns(digest, flag) VALUES "
+				"(?1, ?2);";
+	sqlite3_stmt *st = NULL;
+	gint rc;
+
+	if ((rc = sqlite3_prepare_v2 (ctx->db, insert_sql,
+			-1, &st, NULL)) != SQLITE_OK) {
+		msg_err ("Cannot prepare sql %s: %s", insert_sql,
+				sqlite3_errmsg (ctx->db));
+		return rspamd_stat_cache_sqlite3_check (h, len, is_spam, ctx);
+	}
+
+	sqlite3_bind_text (st, 1, h, len, SQLITE_STATIC);
+	sqlite3_bind_int (st, 2, is_spam ? 1 : 0);
+	rc = sqlite3_step (st);
+	sqlite3_finalize (st);
+
+	if (rc == SQLITE_DONE) {
+		rspamd_stat_cache_sqlite3_filter_add (ctx, h, len);
+
+		return RSPAMD_LEARN_OK;
+	}
+
+	if (rc == SQLITE_CONSTRAINT) {
+		/* Digest has been learned by another process */
+		rspamd_stat_cache_sqlite3_filter_add (ctx, h, len);
+	}
+
+	return rspamd_stat_cache_sqlite3_check (h, len, is_spam, ctx);
+}
+
 gint
 rspamd_stat_cache_sqlite3_process (struct rspamd_task *task,
 		gboolean is_spam, gpointer c)
@@ -193,6 +329,7 @@ rspamd_stat_cache_sqlite3_process (struct rspamd_task *task,
 	rspamd_fstring_t *word;
 	guchar out[BLAKE2B_OUTBYTES];
 	GList *cur;
+	GArray *words;
 	guint i;
 
 	if (ctx != NULL && ctx->db != NULL) {
@@ -201,9 +338,10 @@ rspamd_stat_cache_sqlite3_process (struct rspamd_task *task,
 
 		while (cur) {
 			part = (struct mime_text_part *)cur->data;
+			words = rspamd_mime_text_part_get_words (task, part);
 
-			for (i = 0; i < part->words->len; i ++) {
-				word = &g_array_index (part->words, rspamd_fstring_t, i);
+			for (i = 0; words != NULL && i < words->len; i ++) {
+				word = &g_array_index (words, rspamd_fstring_t, i);
 				blake2b_update (&st, word->begin, word->len);
 			}
 
@@ -212,6 +350,12 @@ rspamd_stat_cache_sqlite3_process (struct rspamd_task *task,
 
 		blake2b_final (&st, out, sizeof (out));
 
+		if (ctx->filter != NULL &&
+				!rspamd_cuckoo_check (ctx->filter, out, sizeof (out))) {
+			return rspamd_stat_cache_sqlite3_insert (out, sizeof (out),
+					is_spam, ctx);
+		}
+
 		return rspamd_stat_cache_sqlite3_check (out, sizeof (out), is_spam, ctx);
 	}
 
@@ -224,6 +368,17 @@ rspamd_stat_cache_sqlite3_close (gpointer c)
 	struct rspamd_stat_sqlite3_ctx *ctx = (struct rspamd_stat_sqlite3_ctx *)c;
 
 	if (ctx != NULL) {
+		if (ctx->filter != NULL) {
+			if (ctx->changes > 0 &&
+					!rspamd_cuckoo_save (ctx->filter, ctx->filter_path)) {
+				msg_warn ("Cannot save learn cache filter %s: %s",
+						ctx->filter_path, strerror (errno));
+			}
+
+			rspamd_cuckoo_destroy (ctx->filter);
+		}
+
+		g_free (ctx->filter_path);
 		sqlite3_close (ctx->db);
 		g_slice_free1 (sizeof (*ctx), ctx);
 	}
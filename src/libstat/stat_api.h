@@ -69,6 +69,40 @@ rspamd_stat_result_t rspamd_stat_learn (struct rspamd_task *task,
 		gboolean spam, lua_State *L,
 		GError **err);
 
+struct rspamd_stat_learn_batch;
+
+/**
+ * Create a batch of messages to be learned as spam or ham at once
+ * @param spam if TRUE learn spam, otherwise learn ham
+ * @return new batch
+ */
+struct rspamd_stat_learn_batch * rspamd_stat_learn_batch_new (gboolean spam);
+
+/**
+ * Tokenize task and add its tokens to the batch, task must be processed
+ * prior to this call and must not be freed before the batch is committed
+ * @param batch batch of messages
+ * @param task task to learn
+ * @return RSPAMD_STAT_PROCESS_OK if task has been added to the batch
+ */
+rspamd_stat_result_t rspamd_stat_learn_batch_add (
+		struct rspamd_stat_learn_batch *batch,
+		struct rspamd_task *task, lua_State *L,
+		GError **err);
+
+/**
+ * Write accumulated tokens to statfiles with a single update per statfile
+ * @param batch batch of messages
+ * @return number of messages learned
+ */
+guint rspamd_stat_learn_batch_commit (struct rspamd_stat_learn_batch *batch);
+
+/**
+ * Destroy batch discarding uncommitted updates
+ * @param batch batch of messages
+ */
+void rspamd_stat_learn_batch_destroy (struct rspamd_stat_learn_batch *batch);
+
 /**
  * Get the overall statistics for all statfile backends
  * @param cfg configuration
@@ -78,6 +112,17 @@ rspamd_stat_result_t rspamd_stat_learn (struct rspamd_task *task,
 ucl_object_t * rspamd_stat_statistics (struct rspamd_config *cfg,
 		guint64 *total_learns);
 
+/**
+ * Resize (or compact if size is 0) the storage of the specified statfile,
+ * the operation is performed in background using the event base specified
+ * @param cfg configuration
+ * @param symbol symbol of statfile
+ * @param size new size in bytes
+ * @return TRUE if resizing has been started
+ */
+gboolean rspamd_stat_resize (struct rspamd_config *cfg, const gchar *symbol,
+		gsize size, struct event_base *ev_base, GError **err);
+
 void rspamd_stat_unload (void);
 
 #endif /* STAT_API_H_ */
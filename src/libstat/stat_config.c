@@ -61,13 +61,43 @@ static struct rspamd_stat_backend stat_backends[] = {
 		.init = rspamd_mmaped_file_init,
 		.runtime = rspamd_mmaped_file_runtime,
 		.process_token = rspamd_mmaped_file_process_token,
+		.process_tokens = rspamd_mmaped_file_process_tokens,
 		.learn_token = rspamd_mmaped_file_learn_token,
 		.finalize_learn = rspamd_mmaped_file_finalize_learn,
 		.total_learns = rspamd_mmaped_file_total_learns,
 		.inc_learns = rspamd_mmaped_file_inc_learns,
 		.dec_learns = rspamd_mmaped_file_dec_learns,
-		.get_stat = rspamd_mmaped_file_get_stat
-	}
+		.get_stat = rspamd_mmaped_file_get_stat,
+		.resize = rspamd_mmaped_file_resize
+	},
+	{
+		.name = "redis",
+		.init = rspamd_redis_init,
+		.runtime = rspamd_redis_runtime,
+		.process_token = rspamd_redis_process_token,
+		.process_tokens = rspamd_redis_process_tokens,
+		.learn_token = rspamd_redis_learn_token,
+		.finalize_learn = rspamd_redis_finalize_learn,
+		.total_learns = rspamd_redis_total_learns,
+		.inc_learns = rspamd_redis_inc_learns,
+		.dec_learns = rspamd_redis_dec_learns,
+		.get_stat = rspamd_redis_get_stat
+	},
+#ifdef WITH_LMDB
+	{
+		.name = "lmdb",
+		.init = rspamd_lmdb_init,
+		.runtime = rspamd_lmdb_runtime,
+		.process_token = rspamd_lmdb_process_token,
+		.process_tokens = rspamd_lmdb_process_tokens,
+		.learn_token = rspamd_lmdb_learn_token,
+		.finalize_learn = rspamd_lmdb_finalize_learn,
+		.total_learns = rspamd_lmdb_total_learns,
+		.inc_learns = rspamd_lmdb_inc_learns,
+		.dec_learns = rspamd_lmdb_dec_learns,
+		.get_stat = rspamd_lmdb_get_stat
+	},
+#endif
 };
 
 static struct rspamd_stat_cache stat_caches[] = {
@@ -82,6 +112,10 @@ static struct rspamd_stat_cache stat_caches[] = {
 void
 rspamd_stat_init (struct rspamd_config *cfg)
 {
+	struct rspamd_classifier_config *clf;
+	const ucl_object_t *elt;
+	GList *cur;
+	gsize cache_size = 0;
 	guint i;
 
 	if (stat_ctx == NULL) {
@@ -97,6 +131,9 @@ rspamd_stat_init (struct rspamd_config *cfg)
 	stat_ctx->caches = stat_caches;
 	stat_ctx->caches_count = G_N_ELEMENTS (stat_caches);
 
+	rspamd_tokenizer_osb_load ();
+	msg_debug ("use %s kernel for osb tokenizer", rspamd_tokenizer_osb_impl ());
+
 	/* Init backends */
 	for (i = 0; i < stat_ctx->backends_count; i ++) {
 		stat_ctx->backends[i].ctx = stat_ctx->backends[i].init (stat_ctx, cfg);
@@ -108,6 +145,25 @@ rspamd_stat_init (struct rspamd_config *cfg)
 		stat_ctx->caches[i].ctx = stat_ctx->caches[i].init (stat_ctx, cfg);
 		msg_debug ("added cache %s", stat_ctx->caches[i].name);
 	}
+
+	/* Shared tokens cache must be allocated before workers are forked */
+	if (stat_ctx->token_cache != NULL) {
+		rspamd_stat_token_cache_destroy (stat_ctx->token_cache);
+		stat_ctx->token_cache = NULL;
+	}
+
+	for (cur = cfg->classifiers; cur != NULL; cur = g_list_next (cur)) {
+		clf = cur->data;
+		elt = ucl_object_find_key (clf->opts, "token_cache");
+
+		if (elt != NULL && ucl_object_toint (elt) > 0) {
+			cache_size += ucl_object_toint (elt);
+		}
+	}
+
+	if (cache_size > 0) {
+		stat_ctx->token_cache = rspamd_stat_token_cache_new (cache_size);
+	}
 }
 
 struct rspamd_stat_ctx *
@@ -29,16 +29,25 @@
 #include "tokenizers/tokenizers.h"
 #include "backends/backends.h"
 #include "learn_cache/learn_cache.h"
+#include "token_cache.h"
 
 enum stat_process_stage {
 	RSPAMD_STAT_STAGE_PRE = 0,
 	RSPAMD_STAT_STAGE_POST
 };
 
+/*
+ * Tokens of a task shared by all classifiers with the same tokenizer, the
+ * same normalized tokenizer options and the same words normalization
+ */
 struct rspamd_tokenizer_runtime {
-	GTree *tokens;
+	GArray *tokens;
 	const gchar *name;
 	struct rspamd_stat_tokenizer *tokenizer;
+	gpointer config;
+	gsize conf_len;
+	gboolean compat;
+	gboolean tokenized;
 	struct rspamd_tokenizer_runtime *next;
 };
 
@@ -72,12 +81,15 @@ struct rspamd_token_result {
 	struct rspamd_classifier_runtime *cl_runtime;
 };
 
-#define RSPAMD_MAX_TOKEN_LEN 16
+/*
+ * Tokens are stored in a flat array that is sorted and deduplicated after
+ * tokenization, `results` points to a slice of a per-task results vector
+ * with one slot per statfile
+ */
 typedef struct token_node_s {
-	guchar data[RSPAMD_MAX_TOKEN_LEN];
+	guint64 data;
 	guint window_idx;
-	guint datalen;
-	GArray *results;
+	struct rspamd_token_result *results;
 } rspamd_token_t;
 
 struct rspamd_stat_ctx {
@@ -89,8 +101,11 @@ struct rspamd_stat_ctx {
 	guint backends_count;
 	struct rspamd_stat_cache *caches;
 	guint caches_count;
+	struct rspamd_stat_token_cache *token_cache;
 
 	guint statfiles;
+	guint64 tokens_processed;		/**< tokens passed to classifiers	*/
+	guint64 tokens_lookups;			/**< token lookups in statfiles		*/
 };
 
 typedef enum rspamd_learn_cache_result {
@@ -32,6 +32,8 @@
 #define RSPAMD_CLASSIFY_OP 0
 #define RSPAMD_LEARN_OP 1
 #define RSPAMD_UNLEARN_OP 2
+/* Initial size of tokens array */
+#define RSPAMD_STAT_TOKENS_PREALLOC 1024
 
 struct preprocess_cb_data {
 	struct rspamd_task *task;
@@ -40,15 +42,40 @@ struct preprocess_cb_data {
 	guint results_count;
 	gboolean unlearn;
 	gboolean spam;
+	gboolean learn;
 };
 
+static gboolean
+rspamd_stat_classifier_compat (struct rspamd_classifier_config *clcf)
+{
+	const ucl_object_t *obj;
+
+	obj = ucl_object_find_key (clcf->opts, "compat");
+
+	if (obj != NULL) {
+		return ucl_object_toboolean (obj);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Find tokens runtime of a classifier, classifiers whose tokenizers have
+ * equal normalized options share the same runtime, so a task is tokenized
+ * once for all of them
+ */
 static struct rspamd_tokenizer_runtime *
-rspamd_stat_get_tokenizer_runtime (struct rspamd_tokenizer_config *cf,
+rspamd_stat_get_tokenizer_runtime (struct rspamd_classifier_config *clcf,
 		rspamd_mempool_t *pool,
 		struct rspamd_tokenizer_runtime **ls)
 {
 	struct rspamd_tokenizer_runtime *tok = NULL, *cur;
+	struct rspamd_tokenizer_config *cf = clcf->tokenizer;
+	struct rspamd_stat_tokenizer *tokenizer;
 	const gchar *name;
+	gpointer conf = NULL;
+	gsize conf_len = 0;
+	gboolean compat;
 
 	if (cf == NULL || cf->name == NULL) {
 		name = RSPAMD_DEFAULT_TOKENIZER;
@@ -57,60 +84,168 @@ rspamd_stat_get_tokenizer_runtime (struct rspamd_tokenizer_config *cf,
 		name = cf->name;
 	}
 
+	tokenizer = rspamd_stat_get_tokenizer (name);
+
+	if (tokenizer == NULL) {
+		return NULL;
+	}
+
+	compat = rspamd_stat_classifier_compat (clcf);
+
+	if (tokenizer->get_config != NULL) {
+		conf = tokenizer->get_config (cf, &conf_len);
+	}
+
 	LL_FOREACH (*ls, cur) {
-		if (strcmp (cur->name, name) == 0) {
+		if (cur->tokenizer == tokenizer && cur->compat == compat &&
+				cur->conf_len == conf_len &&
+				(conf_len == 0 || memcmp (cur->config, conf, conf_len) == 0)) {
 			tok = cur;
 			break;
 		}
 	}
 
 	if (tok == NULL) {
-		tok = rspamd_mempool_alloc (pool, sizeof (*tok));
-		tok->tokenizer = rspamd_stat_get_tokenizer (name);
+		tok = rspamd_mempool_alloc0 (pool, sizeof (*tok));
+		tok->tokenizer = tokenizer;
+		tok->tokens = g_array_sized_new (FALSE, FALSE, sizeof (rspamd_token_t),
+				RSPAMD_STAT_TOKENS_PREALLOC);
+		rspamd_mempool_add_destructor (pool,
+				rspamd_array_free_hard, tok->tokens);
+		tok->name = name;
+		tok->compat = compat;
 
-		if (tok->tokenizer == NULL) {
-			return NULL;
+		if (conf_len > 0) {
+			tok->config = rspamd_mempool_alloc (pool, conf_len);
+			memcpy (tok->config, conf, conf_len);
+			tok->conf_len = conf_len;
 		}
 
-		tok->tokens = g_tree_new (token_node_compare_func);
-		rspamd_mempool_add_destructor (pool,
-				(rspamd_mempool_destruct_t)g_tree_destroy, tok->tokens);
-		tok->name = name;
 		LL_PREPEND(*ls, tok);
 	}
 
+	if (conf != NULL) {
+		g_slice_free1 (conf_len, conf);
+	}
+
 	return tok;
 }
 
+/*
+ * Get values of tokens from the shared cache, the rest is requested from the
+ * backend and is stored in the cache afterwards
+ */
 static gboolean
-preprocess_init_stat_token (gpointer k, gpointer v, gpointer d)
+rspamd_stat_process_cached_tokens (struct preprocess_cb_data *cbdata,
+		struct rspamd_stat_token_cache *cache,
+		struct rspamd_classifier_runtime *cl_runtime,
+		struct rspamd_statfile_runtime *st_runtime,
+		gint id)
 {
-	rspamd_token_t *t = (rspamd_token_t *)v;
-	struct preprocess_cb_data *cbdata = (struct preprocess_cb_data *)d;
+	GArray *tokens = cbdata->tok->tokens, *misses;
+	struct rspamd_stat_backend *bk = st_runtime->backend;
+	struct rspamd_token_result *res;
+	rspamd_token_t *t;
+	guint64 version, *keys;
+	guint *miss_idx, nmisses = 0, j;
+
+	version = bk->total_learns (st_runtime->backend_runtime, bk->ctx);
+	keys = g_malloc (tokens->len * sizeof (*keys));
+	miss_idx = g_malloc (tokens->len * sizeof (*miss_idx));
+	misses = g_array_sized_new (FALSE, FALSE, sizeof (rspamd_token_t),
+			tokens->len);
+
+	for (j = 0; j < tokens->len; j ++) {
+		t = &g_array_index (tokens, rspamd_token_t, j);
+		res = &t->results[id];
+		res->cl_runtime = cl_runtime;
+		res->st_runtime = st_runtime;
+		keys[j] = rspamd_stat_token_cache_key (t->data, st_runtime->st->symbol);
+
+		if (!rspamd_stat_token_cache_lookup (cache, keys[j], version,
+				&res->value)) {
+			/* Copy shares results with the original token */
+			g_array_append_val (misses, *t);
+			miss_idx[nmisses ++] = j;
+		}
+	}
+
+	if (nmisses > 0) {
+		if (bk->process_tokens == NULL ||
+				!bk->process_tokens (cbdata->task, misses, id,
+						st_runtime->backend_runtime, bk->ctx)) {
+			for (j = 0; j < nmisses; j ++) {
+				t = &g_array_index (misses, rspamd_token_t, j);
+				bk->process_token (t, &t->results[id], bk->ctx);
+			}
+		}
+
+		for (j = 0; j < nmisses; j ++) {
+			t = &g_array_index (misses, rspamd_token_t, j);
+			rspamd_stat_token_cache_insert (cache, keys[miss_idx[j]], version,
+					t->results[id].value);
+		}
+	}
+
+	msg_debug ("<%s> got %ud of %ud tokens of %s from cache",
+			cbdata->task->message_id, tokens->len - nmisses, tokens->len,
+			st_runtime->st->symbol);
+
+	g_array_free (misses, TRUE);
+	g_free (miss_idx);
+	g_free (keys);
+
+	return TRUE;
+}
+
+static void
+preprocess_init_stat_tokens (struct preprocess_cb_data *cbdata)
+{
+	GArray *tokens = cbdata->tok->tokens;
+	rspamd_token_t *t;
 	struct rspamd_statfile_runtime *st_runtime;
 	struct rspamd_classifier_runtime *cl_runtime;
-	struct rspamd_token_result *res;
+	struct rspamd_token_result *results, *res;
+	struct rspamd_stat_token_cache *cache = NULL;
+	struct rspamd_stat_ctx *st_ctx;
 	GList *cur, *curst;
-	gint i = 0;
+	gboolean *batched, found;
+	guint i, j;
+
+	if (tokens->len == 0) {
+		return;
+	}
 
-	t->results = g_array_sized_new (FALSE, TRUE,
-			sizeof (struct rspamd_token_result), cbdata->results_count);
-	g_array_set_size (t->results, cbdata->results_count);
-	rspamd_mempool_add_destructor (cbdata->task->task_pool,
-			rspamd_array_free_hard, t->results);
+	st_ctx = rspamd_stat_get_ctx ();
+	st_ctx->tokens_processed += tokens->len;
+	st_ctx->tokens_lookups += (guint64)tokens->len * cbdata->results_count;
+
+	if (!cbdata->learn) {
+		/* Learning needs actual values from backends */
+		cache = st_ctx->token_cache;
+	}
+
+	batched = g_alloca (cbdata->results_count * sizeof (*batched));
+	memset (batched, 0, cbdata->results_count * sizeof (*batched));
+
+	/* Results for all tokens are stored in a single contiguous vector */
+	results = rspamd_mempool_alloc0 (cbdata->task->task_pool,
+			sizeof (*results) * cbdata->results_count * tokens->len);
+
+	for (j = 0; j < tokens->len; j ++) {
+		t = &g_array_index (tokens, rspamd_token_t, j);
+		t->results = &results[j * cbdata->results_count];
+	}
 
+	/* Let backends that support it fetch all tokens in a single request */
 	cur = g_list_first (cbdata->classifier_runtimes);
+	i = 0;
 
 	while (cur) {
 		cl_runtime = (struct rspamd_classifier_runtime *)cur->data;
 
 		if (cl_runtime->clcf->min_tokens > 0 &&
-				(guint32)g_tree_nnodes (cbdata->tok->tokens) < cl_runtime->clcf->min_tokens) {
-			/* Skip this classifier */
-			msg_debug ("<%s> contains less tokens than required for %s classifier: "
-					"%ud < %ud", cbdata->task->message_id, cl_runtime->clcf->name,
-					g_tree_nnodes (cbdata->tok->tokens),
-					cl_runtime->clcf->min_tokens);
+				tokens->len < cl_runtime->clcf->min_tokens) {
 			cur = g_list_next (cur);
 			continue;
 		}
@@ -118,34 +253,83 @@ preprocess_init_stat_token (gpointer k, gpointer v, gpointer d)
 		curst = cl_runtime->st_runtime;
 
 		while (curst) {
-
 			st_runtime = (struct rspamd_statfile_runtime *)curst->data;
-			res = &g_array_index (t->results, struct rspamd_token_result, i);
-			res->cl_runtime = cl_runtime;
-			res->st_runtime = st_runtime;
 
-			if (st_runtime->backend->process_token (t, res,
-					st_runtime->backend->ctx)) {
-
-				if (cl_runtime->clcf->max_tokens > 0 &&
-						cl_runtime->processed_tokens > cl_runtime->clcf->max_tokens) {
-					msg_debug ("<%s> contains more tokens than allowed for %s classifier: "
-							"%ud > %ud", cbdata->task, cl_runtime->clcf->name,
-							cl_runtime->processed_tokens,
-							cl_runtime->clcf->max_tokens);
-
-					return TRUE;
-				}
+			if (cache != NULL &&
+					ucl_object_find_key (cl_runtime->clcf->opts, "token_cache")) {
+				batched[i] = rspamd_stat_process_cached_tokens (cbdata, cache,
+						cl_runtime, st_runtime, i);
+			}
+			else if (st_runtime->backend->process_tokens) {
+				batched[i] = st_runtime->backend->process_tokens (cbdata->task,
+						tokens, i, st_runtime->backend_runtime,
+						st_runtime->backend->ctx);
 			}
 
 			i ++;
 			curst = g_list_next (curst);
 		}
+
 		cur = g_list_next (cur);
 	}
 
+	for (j = 0; j < tokens->len; j ++) {
+		t = &g_array_index (tokens, rspamd_token_t, j);
+		cur = g_list_first (cbdata->classifier_runtimes);
+		i = 0;
 
-	return FALSE;
+		while (cur) {
+			cl_runtime = (struct rspamd_classifier_runtime *)cur->data;
+
+			if (cl_runtime->clcf->min_tokens > 0 &&
+					tokens->len < cl_runtime->clcf->min_tokens) {
+				/* Skip this classifier */
+				msg_debug ("<%s> contains less tokens than required for %s classifier: "
+						"%ud < %ud", cbdata->task->message_id, cl_runtime->clcf->name,
+						tokens->len,
+						cl_runtime->clcf->min_tokens);
+				cur = g_list_next (cur);
+				continue;
+			}
+
+			curst = cl_runtime->st_runtime;
+
+			while (curst) {
+
+				st_runtime = (struct rspamd_statfile_runtime *)curst->data;
+				res = &t->results[i];
+				res->cl_runtime = cl_runtime;
+				res->st_runtime = st_runtime;
+
+				if (batched[i]) {
+					/* Value has been already fetched */
+					found = res->value > 0;
+				}
+				else {
+					found = st_runtime->backend->process_token (t, res,
+							st_runtime->backend->ctx);
+				}
+
+				if (found) {
+
+					if (cl_runtime->clcf->max_tokens > 0 &&
+							cl_runtime->processed_tokens > cl_runtime->clcf->max_tokens) {
+						msg_debug ("<%s> contains more tokens than allowed for %s classifier: "
+								"%uL > %ud", cbdata->task->message_id,
+								cl_runtime->clcf->name,
+								cl_runtime->processed_tokens,
+								cl_runtime->clcf->max_tokens);
+
+						return;
+					}
+				}
+
+				i ++;
+				curst = g_list_next (curst);
+			}
+			cur = g_list_next (cur);
+		}
+	}
 }
 
 static GList*
@@ -193,7 +377,7 @@ rspamd_stat_preprocess (struct rspamd_stat_ctx *st_ctx,
 		}
 
 		cl_runtime->clcf = clcf;
-		cl_runtime->tok = rspamd_stat_get_tokenizer_runtime (clcf->tokenizer,
+		cl_runtime->tok = rspamd_stat_get_tokenizer_runtime (clcf,
 				task->task_pool,
 				&tklist);
 
@@ -270,8 +454,8 @@ rspamd_stat_preprocess (struct rspamd_stat_ctx *st_ctx,
 		cbdata.classifier_runtimes = cl_runtimes;
 		cbdata.task = task;
 		cbdata.tok = cl_runtime->tok;
-		g_tree_foreach (cl_runtime->tok->tokens, preprocess_init_stat_token,
-				&cbdata);
+		cbdata.learn = (op != RSPAMD_CLASSIFY_OP);
+		preprocess_init_stat_tokens (&cbdata);
 	}
 
 	return cl_runtimes;
@@ -296,14 +480,17 @@ rspamd_stat_process_tokenize (struct rspamd_tokenizer_config *cf,
 	while (cur != NULL) {
 		part = (struct mime_text_part *)cur->data;
 
-		if (!IS_PART_EMPTY (part) && part->words != NULL) {
+		if (!IS_PART_EMPTY (part)) {
 			if (compat) {
-				tok->tokenizer->tokenize_func (cf, task->task_pool,
-					part->words, tok->tokens, IS_PART_UTF (part));
+				words = rspamd_mime_text_part_get_words (task, part);
 			}
 			else {
+				words = rspamd_mime_text_part_get_normalized_words (task, part);
+			}
+
+			if (words != NULL) {
 				tok->tokenizer->tokenize_func (cf, task->task_pool,
-					part->normalized_words, tok->tokens, IS_PART_UTF (part));
+					words, tok->tokens, IS_PART_UTF (part));
 			}
 		}
 
@@ -342,8 +529,7 @@ rspamd_stat_classify (struct rspamd_task *task, lua_State *L, GError **err)
 	struct classifier_ctx *cl_ctx;
 	GList *cl_runtimes;
 	GList *cur;
-	gboolean ret = RSPAMD_STAT_PROCESS_ERROR, compat = TRUE;
-	const ucl_object_t *obj;
+	gboolean ret = RSPAMD_STAT_PROCESS_ERROR;
 
 	st_ctx = rspamd_stat_get_ctx ();
 	g_assert (st_ctx != NULL);
@@ -361,12 +547,7 @@ rspamd_stat_classify (struct rspamd_task *task, lua_State *L, GError **err)
 			return RSPAMD_STAT_PROCESS_ERROR;
 		}
 
-		obj = ucl_object_find_key (clcf->opts, "compat");
-		if (obj != NULL) {
-			compat = ucl_object_toboolean (obj);
-		}
-
-		tok = rspamd_stat_get_tokenizer_runtime (clcf->tokenizer, task->task_pool,
+		tok = rspamd_stat_get_tokenizer_runtime (clcf, task->task_pool,
 				&tklist);
 
 		if (tok == NULL) {
@@ -376,11 +557,20 @@ rspamd_stat_classify (struct rspamd_task *task, lua_State *L, GError **err)
 			return RSPAMD_STAT_PROCESS_ERROR;
 		}
 
-		rspamd_stat_process_tokenize (clcf->tokenizer, st_ctx, task, tok, compat);
+		if (!tok->tokenized) {
+			rspamd_stat_process_tokenize (clcf->tokenizer, st_ctx, task, tok,
+					tok->compat);
+			tok->tokenized = TRUE;
+		}
 
 		cur = g_list_next (cur);
 	}
 
+	/* Sort and deduplicate tokens produced for all parts */
+	LL_FOREACH (tklist, tok) {
+		rspamd_tokenizer_finalize (tok->tokens);
+	}
+
 	/* Initialize classifiers and statfiles runtime */
 	if ((cl_runtimes = rspamd_stat_preprocess (st_ctx, task, tklist, L,
 			RSPAMD_CLASSIFY_OP, FALSE, err)) == NULL) {
@@ -427,89 +617,84 @@ rspamd_stat_classify (struct rspamd_task *task, lua_State *L, GError **err)
 	return ret;
 }
 
-static gboolean
-rspamd_stat_learn_token (gpointer k, gpointer v, gpointer d)
+static void
+rspamd_stat_learn_tokens (struct preprocess_cb_data *cbdata)
 {
-	rspamd_token_t *t = (rspamd_token_t *)v;
-	struct preprocess_cb_data *cbdata = (struct preprocess_cb_data *)d;
+	GArray *tokens = cbdata->tok->tokens;
+	rspamd_token_t *t;
 	struct rspamd_statfile_runtime *st_runtime;
 	struct rspamd_classifier_runtime *cl_runtime;
 	struct rspamd_token_result *res;
 	GList *cur, *curst;
-	gint i = 0;
-
-	cur = g_list_first (cbdata->classifier_runtimes);
+	guint i, j;
 
-	while (cur) {
-		cl_runtime = (struct rspamd_classifier_runtime *)cur->data;
+	for (j = 0; j < tokens->len; j ++) {
+		t = &g_array_index (tokens, rspamd_token_t, j);
+		cur = g_list_first (cbdata->classifier_runtimes);
+		i = 0;
 
-		if (cl_runtime->clcf->min_tokens > 0 &&
-				(guint32)g_tree_nnodes (cbdata->tok->tokens) < cl_runtime->clcf->min_tokens) {
-			/* Skip this classifier */
-			msg_debug ("<%s> contains less tokens than required for %s classifier: "
-					"%ud < %ud", cbdata->task->message_id, cl_runtime->clcf->name,
-					g_tree_nnodes (cbdata->tok->tokens),
-					cl_runtime->clcf->min_tokens);
-			cur = g_list_next (cur);
-			continue;
-		}
+		while (cur) {
+			cl_runtime = (struct rspamd_classifier_runtime *)cur->data;
+
+			if (cl_runtime->clcf->min_tokens > 0 &&
+					tokens->len < cl_runtime->clcf->min_tokens) {
+				/* Skip this classifier */
+				msg_debug ("<%s> contains less tokens than required for %s classifier: "
+						"%ud < %ud", cbdata->task->message_id, cl_runtime->clcf->name,
+						tokens->len,
+						cl_runtime->clcf->min_tokens);
+				cur = g_list_next (cur);
+				continue;
+			}
 
-		curst = cl_runtime->st_runtime;
+			curst = cl_runtime->st_runtime;
 
-		while (curst) {
-			res = &g_array_index (t->results, struct rspamd_token_result, i);
-			st_runtime = (struct rspamd_statfile_runtime *)curst->data;
+			while (curst) {
+				res = &t->results[i];
+				st_runtime = (struct rspamd_statfile_runtime *)curst->data;
 
-			if (st_runtime->backend->learn_token (t, res,
-					st_runtime->backend->ctx)) {
-				cl_runtime->processed_tokens ++;
+				if (st_runtime->backend->learn_token (t, res,
+						st_runtime->backend->ctx)) {
+					cl_runtime->processed_tokens ++;
 
-				if (cl_runtime->clcf->max_tokens > 0 &&
-						cl_runtime->processed_tokens > cl_runtime->clcf->max_tokens) {
-					msg_debug ("<%s> contains more tokens than allowed for %s classifier: "
-							"%ud > %ud", cbdata->task, cl_runtime->clcf->name,
-							cl_runtime->processed_tokens,
-							cl_runtime->clcf->max_tokens);
+					if (cl_runtime->clcf->max_tokens > 0 &&
+							cl_runtime->processed_tokens > cl_runtime->clcf->max_tokens) {
+						msg_debug ("<%s> contains more tokens than allowed for %s classifier: "
+								"%uL > %ud", cbdata->task->message_id,
+								cl_runtime->clcf->name,
+								cl_runtime->processed_tokens,
+								cl_runtime->clcf->max_tokens);
 
-					return TRUE;
+						return;
+					}
 				}
+
+				i ++;
+				curst = g_list_next (curst);
 			}
 
-			i ++;
-			curst = g_list_next (curst);
+			cur = g_list_next (cur);
 		}
-
-		cur = g_list_next (cur);
 	}
-
-
-	return FALSE;
 }
 
-rspamd_stat_result_t
-rspamd_stat_learn (struct rspamd_task *task, gboolean spam, lua_State *L,
+/*
+ * Tokenize task for learning and check whether it has been already learned
+ */
+static gboolean
+rspamd_stat_learn_prepare (struct rspamd_stat_ctx *st_ctx,
+		struct rspamd_task *task, gboolean spam,
+		struct rspamd_tokenizer_runtime **ptklist, gboolean *unlearn,
 		GError **err)
 {
 	struct rspamd_stat_classifier *cls;
 	struct rspamd_classifier_config *clcf;
-	struct rspamd_stat_ctx *st_ctx;
-	struct rspamd_tokenizer_runtime *tklist = NULL, *tok;
-	struct rspamd_classifier_runtime *cl_run;
-	struct rspamd_statfile_runtime *st_run;
-	struct classifier_ctx *cl_ctx;
-	struct preprocess_cb_data cbdata;
-	const ucl_object_t *obj;
-	GList *cl_runtimes;
-	GList *cur, *curst;
-	gboolean ret = RSPAMD_STAT_PROCESS_ERROR, unlearn = FALSE;
-	gulong nrev;
+	struct rspamd_tokenizer_runtime *tok;
+	GList *cur;
 	rspamd_learn_t learn_res = RSPAMD_LEARN_OK;
 	guint i;
-	gboolean compat = TRUE;
-
-	st_ctx = rspamd_stat_get_ctx ();
-	g_assert (st_ctx != NULL);
 
+	*unlearn = FALSE;
 	cur = g_list_first (task->cfg->classifiers);
 
 	/* Tokenization */
@@ -520,29 +705,33 @@ rspamd_stat_learn (struct rspamd_task *task, gboolean spam, lua_State *L,
 		if (cls == NULL) {
 			g_set_error (err, rspamd_stat_quark (), 500, "type %s is not defined"
 					"for classifiers", clcf->classifier);
-			return RSPAMD_STAT_PROCESS_ERROR;
+			return FALSE;
 		}
 
-		obj = ucl_object_find_key (clcf->opts, "compat");
-		if (obj != NULL) {
-			compat = ucl_object_toboolean (obj);
-		}
-
-		tok = rspamd_stat_get_tokenizer_runtime (clcf->tokenizer, task->task_pool,
-				&tklist);
+		tok = rspamd_stat_get_tokenizer_runtime (clcf, task->task_pool,
+				ptklist);
 
 		if (tok == NULL) {
 			g_set_error (err, rspamd_stat_quark (), 500, "type %s is not defined"
 					"for tokenizers", clcf->tokenizer ?
 							clcf->tokenizer->name : "unknown");
-			return RSPAMD_STAT_PROCESS_ERROR;
+			return FALSE;
 		}
 
-		rspamd_stat_process_tokenize (clcf->tokenizer, st_ctx, task, tok, compat);
+		if (!tok->tokenized) {
+			rspamd_stat_process_tokenize (clcf->tokenizer, st_ctx, task, tok,
+					tok->compat);
+			tok->tokenized = TRUE;
+		}
 
 		cur = g_list_next (cur);
 	}
 
+	/* Sort and deduplicate tokens produced for all parts */
+	LL_FOREACH (*ptklist, tok) {
+		rspamd_tokenizer_finalize (tok->tokens);
+	}
+
 	/* Check whether we have learned that file */
 	for (i = 0; i < st_ctx->caches_count; i ++) {
 		learn_res = st_ctx->caches[i].process (task, spam,
@@ -553,13 +742,39 @@ rspamd_stat_learn (struct rspamd_task *task, gboolean spam, lua_State *L,
 			g_set_error (err, rspamd_stat_quark (), 404, "<%s> has been already "
 					"learned as %s, ignore it", task->message_id,
 					spam ? "spam" : "ham");
-			return RSPAMD_STAT_PROCESS_ERROR;
+			return FALSE;
 		}
 		else if (learn_res == RSPAMD_LEARN_UNLEARN) {
-			unlearn = TRUE;
+			*unlearn = TRUE;
 		}
 	}
 
+	return TRUE;
+}
+
+rspamd_stat_result_t
+rspamd_stat_learn (struct rspamd_task *task, gboolean spam, lua_State *L,
+		GError **err)
+{
+	struct rspamd_stat_ctx *st_ctx;
+	struct rspamd_tokenizer_runtime *tklist = NULL;
+	struct rspamd_classifier_runtime *cl_run;
+	struct rspamd_statfile_runtime *st_run;
+	struct classifier_ctx *cl_ctx;
+	struct preprocess_cb_data cbdata;
+	GList *cl_runtimes;
+	GList *cur, *curst;
+	gboolean ret = RSPAMD_STAT_PROCESS_ERROR, unlearn = FALSE;
+	gulong nrev;
+
+	st_ctx = rspamd_stat_get_ctx ();
+	g_assert (st_ctx != NULL);
+
+	if (!rspamd_stat_learn_prepare (st_ctx, task, spam, &tklist, &unlearn,
+			err)) {
+		return RSPAMD_STAT_PROCESS_ERROR;
+	}
+
 	/* Initialize classifiers and statfiles runtime */
 	if ((cl_runtimes = rspamd_stat_preprocess (st_ctx, task, tklist, L,
 			unlearn ? RSPAMD_UNLEARN_OP : RSPAMD_LEARN_OP, spam, err)) == NULL) {
@@ -586,8 +801,7 @@ rspamd_stat_learn (struct rspamd_task *task, gboolean spam, lua_State *L,
 					cbdata.tok = cl_run->tok;
 					cbdata.unlearn = unlearn;
 					cbdata.spam = spam;
-					g_tree_foreach (cl_run->tok->tokens, rspamd_stat_learn_token,
-							&cbdata);
+					rspamd_stat_learn_tokens (&cbdata);
 
 					curst = g_list_first (cl_run->st_runtime);
 
@@ -626,6 +840,367 @@ rspamd_stat_learn (struct rspamd_task *task, gboolean spam, lua_State *L,
 	return ret;
 }
 
+/*
+ * Batch learning: token deltas of many messages are accumulated per statfile
+ * and are written to backends at once
+ */
+struct rspamd_stat_batch_delta {
+	guint64 data;
+	gint delta;
+};
+
+struct rspamd_stat_batch_statfile {
+	struct rspamd_statfile_config *stcf;
+	struct rspamd_stat_backend *bk;
+	gpointer backend_runtime;
+	/* Task that owns backend runtime */
+	struct rspamd_task *task;
+	GArray *deltas;
+	guint compacted;
+	gint learns;
+};
+
+struct rspamd_stat_learn_batch {
+	GPtrArray *statfiles;
+	guint messages;
+	gboolean spam;
+};
+
+static gint
+rspamd_stat_batch_delta_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_stat_batch_delta *d1 = a, *d2 = b;
+
+	if (d1->data < d2->data) {
+		return -1;
+	}
+	else if (d1->data > d2->data) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Sort deltas and merge ones that belong to the same token
+ */
+static void
+rspamd_stat_batch_compact (struct rspamd_stat_batch_statfile *bst)
+{
+	struct rspamd_stat_batch_delta *d, *last;
+	guint i, n = 0;
+
+	if (bst->deltas->len == 0) {
+		return;
+	}
+
+	g_array_sort (bst->deltas, rspamd_stat_batch_delta_cmp);
+	last = &g_array_index (bst->deltas, struct rspamd_stat_batch_delta, 0);
+
+	for (i = 1; i < bst->deltas->len; i ++) {
+		d = &g_array_index (bst->deltas, struct rspamd_stat_batch_delta, i);
+
+		if (d->data == last->data) {
+			last->delta += d->delta;
+		}
+		else {
+			last = &g_array_index (bst->deltas, struct rspamd_stat_batch_delta,
+					++ n);
+			*last = *d;
+		}
+	}
+
+	g_array_set_size (bst->deltas, n + 1);
+	bst->compacted = bst->deltas->len;
+}
+
+static struct rspamd_stat_batch_statfile *
+rspamd_stat_batch_get_statfile (struct rspamd_stat_learn_batch *batch,
+		struct rspamd_task *task, struct rspamd_statfile_config *stcf,
+		struct rspamd_stat_backend *bk, gpointer backend_runtime)
+{
+	struct rspamd_stat_batch_statfile *bst;
+	guint i;
+
+	/*
+	 * Backends that keep statfiles opened return the same runtime for all
+	 * tasks, so their updates are merged
+	 */
+	for (i = 0; i < batch->statfiles->len; i ++) {
+		bst = g_ptr_array_index (batch->statfiles, i);
+
+		if (bst->stcf == stcf && bst->backend_runtime == backend_runtime) {
+			return bst;
+		}
+	}
+
+	bst = g_slice_alloc0 (sizeof (*bst));
+	bst->stcf = stcf;
+	bst->bk = bk;
+	bst->backend_runtime = backend_runtime;
+	bst->task = task;
+	bst->deltas = g_array_sized_new (FALSE, FALSE,
+			sizeof (struct rspamd_stat_batch_delta),
+			RSPAMD_STAT_TOKENS_PREALLOC);
+	g_ptr_array_add (batch->statfiles, bst);
+
+	return bst;
+}
+
+struct rspamd_stat_learn_batch *
+rspamd_stat_learn_batch_new (gboolean spam)
+{
+	struct rspamd_stat_learn_batch *batch;
+
+	batch = g_slice_alloc0 (sizeof (*batch));
+	batch->spam = spam;
+	batch->statfiles = g_ptr_array_new ();
+
+	return batch;
+}
+
+rspamd_stat_result_t
+rspamd_stat_learn_batch_add (struct rspamd_stat_learn_batch *batch,
+		struct rspamd_task *task, lua_State *L, GError **err)
+{
+	struct rspamd_stat_ctx *st_ctx;
+	struct rspamd_tokenizer_runtime *tklist = NULL, *tok;
+	struct rspamd_classifier_config *clcf;
+	struct rspamd_statfile_config *stcf;
+	struct rspamd_stat_classifier *cls;
+	struct rspamd_stat_backend *bk;
+	struct rspamd_stat_batch_statfile *bst;
+	struct rspamd_stat_batch_delta d;
+	rspamd_token_t *t;
+	gpointer backend_runtime;
+	GList *cur, *curst, *st_list;
+	gboolean unlearn = FALSE, ret = RSPAMD_STAT_PROCESS_ERROR;
+	gint delta;
+	guint i, ntokens;
+
+	st_ctx = rspamd_stat_get_ctx ();
+	g_assert (st_ctx != NULL);
+	g_assert (batch != NULL);
+
+	if (!rspamd_stat_learn_prepare (st_ctx, task, batch->spam, &tklist,
+			&unlearn, err)) {
+		return RSPAMD_STAT_PROCESS_ERROR;
+	}
+
+	cur = g_list_first (task->cfg->classifiers);
+
+	while (cur) {
+		clcf = (struct rspamd_classifier_config *)cur->data;
+		cls = rspamd_stat_get_classifier (clcf->classifier);
+
+		/* Deltas are computed according to bayes learning rules */
+		if (cls->learn_spam_func != bayes_learn_spam) {
+			g_set_error (err, rspamd_stat_quark (), 500, "classifier %s does "
+					"not support batch learning", clcf->name);
+			return RSPAMD_STAT_PROCESS_ERROR;
+		}
+
+		tok = rspamd_stat_get_tokenizer_runtime (clcf,
+				task->task_pool, &tklist);
+		ntokens = tok->tokens->len;
+
+		if (clcf->min_tokens > 0 && ntokens < clcf->min_tokens) {
+			msg_debug ("<%s> contains less tokens than required for %s classifier: "
+					"%ud < %ud", task->message_id, clcf->name,
+					ntokens, clcf->min_tokens);
+			cur = g_list_next (cur);
+			continue;
+		}
+
+		if (clcf->max_tokens > 0 && ntokens > clcf->max_tokens) {
+			ntokens = clcf->max_tokens;
+		}
+
+		st_list = NULL;
+
+		if (clcf->pre_callbacks != NULL) {
+			st_list = rspamd_lua_call_cls_pre_callbacks (clcf, task, FALSE,
+					FALSE, L);
+		}
+		if (st_list != NULL) {
+			rspamd_mempool_add_destructor (task->task_pool,
+					(rspamd_mempool_destruct_t)g_list_free, st_list);
+		}
+		else {
+			st_list = clcf->statfiles;
+		}
+
+		for (curst = st_list; curst != NULL; curst = g_list_next (curst)) {
+			stcf = (struct rspamd_statfile_config *)curst->data;
+
+			if (stcf->is_spam == batch->spam) {
+				delta = 1;
+			}
+			else if (unlearn) {
+				delta = -1;
+			}
+			else {
+				continue;
+			}
+
+			bk = rspamd_stat_get_backend (stcf->backend);
+
+			if (bk == NULL) {
+				msg_warn ("backend of type %s is not defined", stcf->backend);
+				continue;
+			}
+
+			backend_runtime = bk->runtime (task, stcf, TRUE, bk->ctx);
+
+			if (backend_runtime == NULL) {
+				continue;
+			}
+
+			bst = rspamd_stat_batch_get_statfile (batch, task, stcf, bk,
+					backend_runtime);
+
+			for (i = 0; i < ntokens; i ++) {
+				t = &g_array_index (tok->tokens, rspamd_token_t, i);
+				d.data = t->data;
+				d.delta = delta;
+				g_array_append_val (bst->deltas, d);
+			}
+
+			bst->learns += delta;
+			ret = RSPAMD_STAT_PROCESS_OK;
+
+			/* Do not let repeated tokens grow the batch too much */
+			if (bst->deltas->len > MAX (bst->compacted * 2,
+					RSPAMD_STAT_TOKENS_PREALLOC * 64)) {
+				rspamd_stat_batch_compact (bst);
+			}
+		}
+
+		cur = g_list_next (cur);
+	}
+
+	if (ret == RSPAMD_STAT_PROCESS_OK) {
+		batch->messages ++;
+	}
+
+	return ret;
+}
+
+static void
+rspamd_stat_batch_commit_statfile (struct rspamd_stat_batch_statfile *bst)
+{
+	struct rspamd_stat_backend *bk = bst->bk;
+	struct rspamd_statfile_runtime st_runtime;
+	struct rspamd_token_result *results, *res;
+	struct rspamd_stat_batch_delta *d;
+	rspamd_token_t t, *pt;
+	GArray *tokens;
+	gdouble val;
+	gulong nrev = 0;
+	guint i;
+	gint n;
+
+	rspamd_stat_batch_compact (bst);
+
+	memset (&st_runtime, 0, sizeof (st_runtime));
+	st_runtime.st = bst->stcf;
+	st_runtime.backend = bk;
+	st_runtime.backend_runtime = bst->backend_runtime;
+
+	tokens = g_array_sized_new (FALSE, FALSE, sizeof (rspamd_token_t),
+			bst->deltas->len);
+	results = g_malloc0 (sizeof (*results) * bst->deltas->len);
+
+	for (i = 0; i < bst->deltas->len; i ++) {
+		d = &g_array_index (bst->deltas, struct rspamd_stat_batch_delta, i);
+		t.data = d->data;
+		t.window_idx = 0;
+		t.results = &results[i];
+		t.results->st_runtime = &st_runtime;
+		g_array_append_val (tokens, t);
+	}
+
+	/* Fetch current values of all tokens */
+	if (bk->process_tokens == NULL ||
+			!bk->process_tokens (bst->task, tokens, 0, bst->backend_runtime,
+					bk->ctx)) {
+		for (i = 0; i < tokens->len; i ++) {
+			pt = &g_array_index (tokens, rspamd_token_t, i);
+			bk->process_token (pt, pt->results, bk->ctx);
+		}
+	}
+
+	for (i = 0; i < tokens->len; i ++) {
+		pt = &g_array_index (tokens, rspamd_token_t, i);
+		d = &g_array_index (bst->deltas, struct rspamd_stat_batch_delta, i);
+		res = pt->results;
+		val = res->value + d->delta;
+		res->value = val > 0 ? val : 0;
+		bk->learn_token (pt, res, bk->ctx);
+	}
+
+	for (n = 0; n < ABS (bst->learns); n ++) {
+		if (bst->learns > 0) {
+			nrev = bk->inc_learns (bst->backend_runtime, bk->ctx);
+		}
+		else {
+			nrev = bk->dec_learns (bst->backend_runtime, bk->ctx);
+		}
+	}
+
+	bk->finalize_learn (bst->backend_runtime, bk->ctx);
+
+	msg_debug ("learned %ud tokens of %s at once, new revision: %ul",
+			tokens->len, bst->stcf->symbol, nrev);
+
+	g_array_free (tokens, TRUE);
+	g_free (results);
+	g_array_set_size (bst->deltas, 0);
+	bst->compacted = 0;
+	bst->learns = 0;
+}
+
+guint
+rspamd_stat_learn_batch_commit (struct rspamd_stat_learn_batch *batch)
+{
+	struct rspamd_stat_batch_statfile *bst;
+	guint i, messages;
+
+	g_assert (batch != NULL);
+
+	for (i = 0; i < batch->statfiles->len; i ++) {
+		bst = g_ptr_array_index (batch->statfiles, i);
+		rspamd_stat_batch_commit_statfile (bst);
+		g_array_free (bst->deltas, TRUE);
+		g_slice_free1 (sizeof (*bst), bst);
+	}
+
+	g_ptr_array_set_size (batch->statfiles, 0);
+	messages = batch->messages;
+	batch->messages = 0;
+
+	return messages;
+}
+
+void
+rspamd_stat_learn_batch_destroy (struct rspamd_stat_learn_batch *batch)
+{
+	struct rspamd_stat_batch_statfile *bst;
+	guint i;
+
+	if (batch != NULL) {
+		/* Uncommitted updates are discarded */
+		for (i = 0; i < batch->statfiles->len; i ++) {
+			bst = g_ptr_array_index (batch->statfiles, i);
+			g_array_free (bst->deltas, TRUE);
+			g_slice_free1 (sizeof (*bst), bst);
+		}
+
+		g_ptr_array_free (batch->statfiles, TRUE);
+		g_slice_free1 (sizeof (*batch), batch);
+	}
+}
+
 ucl_object_t *
 rspamd_stat_statistics (struct rspamd_config *cfg, guint64 *total_learns)
 {
@@ -682,3 +1257,54 @@ rspamd_stat_statistics (struct rspamd_config *cfg, guint64 *total_learns)
 
 	return res;
 }
+
+gboolean
+rspamd_stat_resize (struct rspamd_config *cfg, const gchar *symbol,
+		gsize size, struct event_base *ev_base, GError **err)
+{
+	struct rspamd_classifier_config *clcf;
+	struct rspamd_statfile_config *stcf;
+	struct rspamd_stat_backend *bk;
+	GList *cur, *curst;
+
+	for (cur = cfg->classifiers; cur != NULL; cur = g_list_next (cur)) {
+		clcf = (struct rspamd_classifier_config *)cur->data;
+
+		for (curst = clcf->statfiles; curst != NULL;
+				curst = g_list_next (curst)) {
+			stcf = (struct rspamd_statfile_config *)curst->data;
+
+			if (strcmp (stcf->symbol, symbol) != 0) {
+				continue;
+			}
+
+			bk = rspamd_stat_get_backend (stcf->backend);
+
+			if (bk == NULL) {
+				g_set_error (err, rspamd_stat_quark (), 500,
+						"backend of type %s is not defined", stcf->backend);
+				return FALSE;
+			}
+
+			if (bk->resize == NULL) {
+				g_set_error (err, rspamd_stat_quark (), 400,
+						"backend %s does not support resizing", bk->name);
+				return FALSE;
+			}
+
+			/* Ensure that statfile is opened */
+			if (bk->runtime (NULL, stcf, FALSE, bk->ctx) == NULL) {
+				g_set_error (err, rspamd_stat_quark (), 500,
+						"cannot open statfile %s", symbol);
+				return FALSE;
+			}
+
+			return bk->resize (stcf, size, ev_base, bk->ctx, err);
+		}
+	}
+
+	g_set_error (err, rspamd_stat_quark (), 404, "statfile %s is not found",
+			symbol);
+
+	return FALSE;
+}
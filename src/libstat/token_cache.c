@@ -0,0 +1,200 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "token_cache.h"
+#include "xxhash.h"
+
+/* Number of entries in a single set */
+#define TOKEN_CACHE_WAYS 8
+
+struct rspamd_token_cache_entry {
+	guint64 key;                            /* 0 for an empty entry		*/
+	guint64 version;
+	gdouble value;
+	guint32 atime;
+	guint32 unused;
+};
+
+/*
+ * Writers make sequence odd while they modify a set, readers never wait:
+ * if a set is being modified, lookup is treated as a miss
+ */
+struct rspamd_token_cache_set {
+	guint32 seq;
+	guint32 unused;
+	struct rspamd_token_cache_entry entries[TOKEN_CACHE_WAYS];
+};
+
+struct rspamd_stat_token_cache {
+	guint64 nsets;                          /* power of 2					*/
+	guint32 clock;                          /* approximate LRU clock		*/
+	gsize len;
+	struct rspamd_token_cache_set *sets;
+};
+
+struct rspamd_stat_token_cache *
+rspamd_stat_token_cache_new (gsize nelts)
+{
+	struct rspamd_stat_token_cache *cache;
+	guint64 nsets = 1;
+	gsize len;
+	gpointer map;
+
+	while (nsets * TOKEN_CACHE_WAYS < nelts) {
+		nsets <<= 1;
+	}
+
+	len = sizeof (*cache) + nsets * sizeof (struct rspamd_token_cache_set);
+
+#if defined(HAVE_MMAP_ANON)
+	map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED,
+			-1, 0);
+#elif defined(HAVE_MMAP_ZERO)
+	gint fd;
+
+	fd = open ("/dev/zero", O_RDWR);
+
+	if (fd == -1) {
+		msg_err ("cannot open /dev/zero: %s", strerror (errno));
+		return NULL;
+	}
+
+	map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+#else
+#       error No mmap methods are defined
+#endif
+
+	if (map == MAP_FAILED) {
+		msg_err ("cannot allocate %z bytes for tokens cache: %s", len,
+				strerror (errno));
+		return NULL;
+	}
+
+	/* Mapping is zero filled, so all entries are empty */
+	cache = map;
+	cache->nsets = nsets;
+	cache->len = len;
+	cache->sets = (struct rspamd_token_cache_set *)(cache + 1);
+
+	return cache;
+}
+
+guint64
+rspamd_stat_token_cache_key (guint64 token, const gchar *symbol)
+{
+	guint64 key;
+
+	key = XXH64 (&token, sizeof (token), XXH64 (symbol, strlen (symbol), 0));
+
+	return key != 0 ? key : 1;
+}
+
+gboolean
+rspamd_stat_token_cache_lookup (struct rspamd_stat_token_cache *cache,
+		guint64 key, guint64 version, gdouble *value)
+{
+	struct rspamd_token_cache_set *set;
+	struct rspamd_token_cache_entry *entry;
+	guint32 seq;
+	gdouble v = 0;
+	gboolean found = FALSE;
+	guint i;
+
+	set = &cache->sets[key & (cache->nsets - 1)];
+	seq = g_atomic_int_get (&set->seq);
+
+	if (seq & 1) {
+		return FALSE;
+	}
+
+	for (i = 0; i < TOKEN_CACHE_WAYS; i ++) {
+		entry = &set->entries[i];
+
+		if (entry->key == key && entry->version == version) {
+			v = entry->value;
+			entry->atime = cache->clock;
+			found = TRUE;
+			break;
+		}
+	}
+
+	if (!found || g_atomic_int_get (&set->seq) != seq) {
+		return FALSE;
+	}
+
+	*value = v;
+
+	return TRUE;
+}
+
+void
+rspamd_stat_token_cache_insert (struct rspamd_stat_token_cache *cache,
+		guint64 key, guint64 version, gdouble value)
+{
+	struct rspamd_token_cache_set *set;
+	struct rspamd_token_cache_entry *entry, *victim = NULL;
+	guint32 seq;
+	guint i;
+
+	set = &cache->sets[key & (cache->nsets - 1)];
+	seq = g_atomic_int_get (&set->seq);
+
+	/* Do not wait for another writer, it is just a cache */
+	if ((seq & 1) ||
+			!g_atomic_int_compare_and_exchange (&set->seq, seq, seq + 1)) {
+		return;
+	}
+
+	for (i = 0; i < TOKEN_CACHE_WAYS; i ++) {
+		entry = &set->entries[i];
+
+		if (entry->key == key) {
+			victim = entry;
+			break;
+		}
+
+		if (victim == NULL || entry->key == 0 ||
+				(victim->key != 0 &&
+				(gint32)(entry->atime - victim->atime) < 0)) {
+			victim = entry;
+		}
+	}
+
+	victim->key = key;
+	victim->version = version;
+	victim->value = value;
+	victim->atime = ++cache->clock;
+
+	g_atomic_int_set (&set->seq, seq + 2);
+}
+
+void
+rspamd_stat_token_cache_destroy (struct rspamd_stat_token_cache *cache)
+{
+	if (cache != NULL) {
+		munmap (cache, cache->len);
+	}
+}
@@ -0,0 +1,78 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TOKEN_CACHE_H_
+#define TOKEN_CACHE_H_
+
+#include "config.h"
+
+/*
+ * Cache of token values shared by all workers: the table is set associative
+ * and lives in anonymous shared memory allocated before workers are forked.
+ * Each value is stored with the number of learns of its statfile, so values
+ * become stale as soon as the statfile is learned.
+ */
+struct rspamd_stat_token_cache;
+
+/**
+ * Create new shared cache
+ * @param nelts maximum number of cached values
+ * @return new cache or NULL
+ */
+struct rspamd_stat_token_cache * rspamd_stat_token_cache_new (gsize nelts);
+
+/**
+ * Make a cache key for the token of the specified statfile
+ * @param token token data
+ * @param symbol symbol of statfile
+ * @return key
+ */
+guint64 rspamd_stat_token_cache_key (guint64 token, const gchar *symbol);
+
+/**
+ * Find value in the cache
+ * @param cache cache
+ * @param key key of token
+ * @param version current number of learns of the statfile
+ * @param value value is stored here
+ * @return TRUE if value with the same version has been found
+ */
+gboolean rspamd_stat_token_cache_lookup (struct rspamd_stat_token_cache *cache,
+		guint64 key, guint64 version, gdouble *value);
+
+/**
+ * Insert value to the cache replacing the least recently used one
+ * @param cache cache
+ * @param key key of token
+ * @param version current number of learns of the statfile
+ * @param value value of token
+ */
+void rspamd_stat_token_cache_insert (struct rspamd_stat_token_cache *cache,
+		guint64 key, guint64 version, gdouble value);
+
+/**
+ * Unmap cache
+ * @param cache cache
+ */
+void rspamd_stat_token_cache_destroy (struct rspamd_stat_token_cache *cache);
+
+#endif /* TOKEN_CACHE_H_ */
@@ -30,6 +30,7 @@
 #include "stat_internal.h"
 #include "libstemmer.h"
 #include "xxhash.h"
+#include "xxh3.h"
 #include "cryptobox.h"
 
 /* Size for features pipe */
@@ -54,7 +55,8 @@ static const guchar osb_tokenizer_magic[] = {'o', 's', 'b', 't', 'o', 'k', 'v',
 enum rspamd_osb_hash_type {
 	RSPAMD_OSB_HASH_COMPAT = 0,
 	RSPAMD_OSB_HASH_XXHASH,
-	RSPAMD_OSB_HASH_SIPHASH
+	RSPAMD_OSB_HASH_SIPHASH,
+	RSPAMD_OSB_HASH_XXH3
 };
 
 struct rspamd_osb_tokenizer_config {
@@ -109,7 +111,15 @@ rspamd_tokenizer_osb_config_from_ucl (rspamd_mempool_t * pool,
 
 	elt = ucl_object_find_key (obj, "hash");
 	if (elt != NULL && ucl_object_type (elt) == UCL_STRING) {
-		if (g_ascii_strncasecmp (ucl_object_tostring (elt), "xxh", 3)
+		if (g_ascii_strncasecmp (ucl_object_tostring (elt), "xxh3", 4)
+				== 0) {
+			cf->ht = RSPAMD_OSB_HASH_XXH3;
+			elt = ucl_object_find_key (obj, "seed");
+			if (elt != NULL && ucl_object_type (elt) == UCL_INT) {
+				cf->seed = ucl_object_toint (elt);
+			}
+		}
+		else if (g_ascii_strncasecmp (ucl_object_tostring (elt), "xxh", 3)
 				== 0) {
 			cf->ht = RSPAMD_OSB_HASH_XXHASH;
 			elt = ucl_object_find_key (obj, "seed");
@@ -211,17 +221,18 @@ gint
 rspamd_tokenizer_osb (struct rspamd_tokenizer_config *cf,
 	rspamd_mempool_t * pool,
 	GArray * input,
-	GTree * tree,
+	GArray * tokens,
 	gboolean is_utf)
 {
-	rspamd_token_t *new = NULL;
+	rspamd_token_t new;
 	rspamd_fstring_t *token;
 	struct rspamd_osb_tokenizer_config *osb_cf;
-	guint64 *hashpipe, cur;
+	struct rspamd_cryptobox_segment segs[64];
+	guint64 *hashes, *hashpipe, *mult, *comb, cur;
 	guint32 h1, h2;
-	guint processed = 0, i, w, window_size;
+	guint i, w, cnt, window_size;
 
-	g_assert (tree != NULL);
+	g_assert (tokens != NULL);
 
 	if (input == NULL) {
 		return FALSE;
@@ -236,89 +247,119 @@ rspamd_tokenizer_osb (struct rspamd_tokenizer_config *cf,
 
 	window_size = osb_cf->window_size;
 
-	hashpipe = g_alloca (window_size * sizeof (hashpipe[0]));
-	memset (hashpipe, 0xfe, window_size * sizeof (hashpipe[0]));
+	if (input->len == 0 || window_size == 0) {
+		return TRUE;
+	}
+
+	/* Hash all words at once */
+	hashes = g_malloc (input->len * sizeof (*hashes));
 
-	for (w = 0; w < input->len; w ++) {
-		token = &g_array_index (input, rspamd_fstring_t, w);
+	if (osb_cf->ht == RSPAMD_OSB_HASH_SIPHASH) {
+		/* Words are hashed by groups in parallel lanes */
+		for (w = 0; w < input->len; w += cnt) {
+			cnt = MIN (input->len - w, G_N_ELEMENTS (segs));
 
-		if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) {
-			cur = rspamd_fstrhash_lc (token, is_utf);
+			for (i = 0; i < cnt; i ++) {
+				token = &g_array_index (input, rspamd_fstring_t, w + i);
+				segs[i].data = (guchar *)token->begin;
+				segs[i].len = token->len;
+			}
+
+			rspamd_cryptobox_siphash_multi (&hashes[w], segs, cnt,
+					osb_cf->sk);
 		}
-		else {
-			/* We know that the words are normalized */
-			if (osb_cf->ht == RSPAMD_OSB_HASH_XXHASH) {
-				cur = XXH64 (token->begin, token->len, osb_cf->seed);
+	}
+	else {
+		for (w = 0; w < input->len; w ++) {
+			token = &g_array_index (input, rspamd_fstring_t, w);
+
+			if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) {
+				hashes[w] = rspamd_fstrhash_lc (token, is_utf);
+			}
+			else if (osb_cf->ht == RSPAMD_OSB_HASH_XXH3) {
+				/* XXH3 is much faster than XXH64 for short words */
+				hashes[w] = XXH3_64bits_withSeed (token->begin, token->len,
+						osb_cf->seed);
 			}
 			else {
-				rspamd_cryptobox_siphash ((guchar *)&cur, token->begin,
-						token->len, osb_cf->sk);
+				/* We know that the words are normalized */
+				hashes[w] = XXH64 (token->begin, token->len, osb_cf->seed);
 			}
 		}
+	}
 
-		if (processed < window_size) {
-			/* Just fill a hashpipe */
-			hashpipe[window_size - ++processed] = cur;
-		}
-		else {
-			/* Shift hashpipe */
-			for (i = window_size - 1; i > 0; i--) {
-				hashpipe[i] = hashpipe[i - 1];
-			}
-			hashpipe[0] = cur;
-			processed++;
-
-			for (i = 1; i < window_size; i++) {
-				new = rspamd_mempool_alloc0 (pool, sizeof (rspamd_token_t));
-				new->datalen = sizeof (gint64);
+	memset (&new, 0, sizeof (new));
 
-				if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) {
-					h1 = ((guint32)hashpipe[0]) * primes[0] +
-							((guint32)hashpipe[i]) * primes[i << 1];
-					h2 = ((guint32)hashpipe[0]) * primes[1] +
-							((guint32)hashpipe[i]) * primes[(i << 1) - 1];
+	/*
+	 * Word `w` is combined with the previous words `w - i`, `i` is the
+	 * window index. Previous words are contiguous in `hashes`, so for 64 bit
+	 * hashes we combine the whole window at once using multipliers stored in
+	 * reversed order: mult[k] corresponds to window index `window_size - 1 - k`
+	 */
+	mult = g_alloca (window_size * sizeof (*mult));
+	comb = g_alloca (window_size * sizeof (*comb));
 
-					memcpy(new->data, &h1, sizeof (h1));
-					memcpy(new->data + sizeof (h1), &h2, sizeof (h2));
-				}
-				else {
-					cur = hashpipe[0] * primes[0] + hashpipe[i] * primes[i << 1];
-					memcpy (new->data, &cur, sizeof (cur));
-				}
+	for (i = 1; i < window_size; i ++) {
+		mult[window_size - 1 - i] = primes[i << 1];
+	}
 
-				new->window_idx = i;
+	for (w = window_size; w < input->len; w ++) {
+		if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) {
+			for (i = 1; i < window_size; i ++) {
+				h1 = ((guint32)hashes[w]) * primes[0] +
+						((guint32)hashes[w - i]) * primes[i << 1];
+				h2 = ((guint32)hashes[w]) * primes[1] +
+						((guint32)hashes[w - i]) * primes[(i << 1) - 1];
+
+				memcpy ((guchar *)&new.data, &h1, sizeof (h1));
+				memcpy ((guchar *)&new.data + sizeof (h1), &h2, sizeof (h2));
+				new.window_idx = i;
+				g_array_append_val (tokens, new);
+			}
+		}
+		else {
+			rspamd_tokenizer_osb_combine (hashes[w] * primes[0],
+					&hashes[w - window_size + 1], mult, comb, window_size - 1);
 
-				if (g_tree_lookup (tree, new) == NULL) {
-					g_tree_insert (tree, new, new);
-				}
+			for (i = 1; i < window_size; i ++) {
+				new.data = comb[window_size - 1 - i];
+				new.window_idx = i;
+				g_array_append_val (tokens, new);
 			}
 		}
 	}
 
-	if (processed <= window_size) {
-		for (i = 1; i < processed; i++) {
-			new = rspamd_mempool_alloc0 (pool, sizeof (rspamd_token_t));
-			new->datalen = sizeof (gint64);
+	if (input->len <= window_size) {
+		/* Short text: the hashpipe has not been filled completely */
+		hashpipe = g_alloca (window_size * sizeof (hashpipe[0]));
+		memset (hashpipe, 0xfe, window_size * sizeof (hashpipe[0]));
 
+		for (w = 0; w < input->len; w ++) {
+			hashpipe[window_size - 1 - w] = hashes[w];
+		}
+
+		new.window_idx = 0;
+
+		for (i = 1; i < input->len; i++) {
 			if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) {
 				h1 = ((guint32)hashpipe[0]) * primes[0] +
 						((guint32)hashpipe[i]) * primes[i << 1];
 				h2 = ((guint32)hashpipe[0]) * primes[1] +
 						((guint32)hashpipe[i]) * primes[(i << 1) - 1];
-				memcpy(new->data, &h1, sizeof (h1));
-				memcpy(new->data + sizeof (h1), &h2, sizeof (h2));
+				memcpy ((guchar *)&new.data, &h1, sizeof (h1));
+				memcpy ((guchar *)&new.data + sizeof (h1), &h2, sizeof (h2));
 			}
 			else {
 				cur = hashpipe[0] * primes[0] + hashpipe[i] * primes[i << 1];
-				memcpy (new->data, &cur, sizeof (cur));
+				new.data = cur;
 			}
 
-			if (g_tree_lookup (tree, new) == NULL) {
-				g_tree_insert (tree, new, new);
-			}
+			g_array_append_val (tokens, new);
 		}
 	}
 
+	g_free (hashes);
+
 	return TRUE;
 }
 
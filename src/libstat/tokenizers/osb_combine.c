@@ -0,0 +1,165 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Window combination kernels for OSB tokenizer: for each element of the
+ * window computes `cur + prev[k] * mult[k]` modulo 2^64. Multipliers are
+ * small primes, so 64x64 multiplication is done as two 32x32 multiplications
+ * which gives exactly the same result as the scalar code.
+ */
+
+#include "config.h"
+#include "tokenizers.h"
+#include "platform_config.h"
+
+extern unsigned long cpu_config;
+
+typedef struct rspamd_osb_combine_impl_s {
+	unsigned long cpu_flags;
+	const char *desc;
+	void (*combine) (guint64 cur, const guint64 *prev, const guint64 *mult,
+			guint64 *out, guint n);
+} rspamd_osb_combine_impl_t;
+
+#define OSB_COMBINE_DECLARE(ext) \
+		static void rspamd_osb_combine_##ext (guint64 cur, const guint64 *prev, \
+				const guint64 *mult, guint64 *out, guint n);
+#define OSB_COMBINE_IMPL(cpuflags, desc, ext) \
+		{(cpuflags), desc, rspamd_osb_combine_##ext}
+
+#if defined(HAVE_AVX2) && defined(HAVE_TARGET_ATTRIBUTE)
+	OSB_COMBINE_DECLARE(avx2)
+	#define OSB_COMBINE_AVX2 OSB_COMBINE_IMPL(CPUID_AVX2, "avx2", avx2)
+#endif
+#if defined(HAVE_SSE2) && defined(HAVE_TARGET_ATTRIBUTE)
+	OSB_COMBINE_DECLARE(sse2)
+	#define OSB_COMBINE_SSE2 OSB_COMBINE_IMPL(CPUID_SSE2, "sse2", sse2)
+#endif
+
+OSB_COMBINE_DECLARE(generic)
+#define OSB_COMBINE_GENERIC OSB_COMBINE_IMPL(0, "generic", generic)
+
+static const rspamd_osb_combine_impl_t osb_combine_list[] = {
+	OSB_COMBINE_GENERIC,
+#if defined(OSB_COMBINE_AVX2)
+	OSB_COMBINE_AVX2,
+#endif
+#if defined(OSB_COMBINE_SSE2)
+	OSB_COMBINE_SSE2
+#endif
+};
+
+static const rspamd_osb_combine_impl_t *osb_combine_impl = &osb_combine_list[0];
+
+static void
+rspamd_osb_combine_generic (guint64 cur, const guint64 *prev,
+		const guint64 *mult, guint64 *out, guint n)
+{
+	guint i;
+
+	for (i = 0; i < n; i ++) {
+		out[i] = cur + prev[i] * mult[i];
+	}
+}
+
+#if defined(HAVE_AVX2) && defined(HAVE_TARGET_ATTRIBUTE)
+#include <immintrin.h>
+
+__attribute__((target("avx2"))) static void
+rspamd_osb_combine_avx2 (guint64 cur, const guint64 *prev,
+		const guint64 *mult, guint64 *out, guint n)
+{
+	__m256i c, a, m, lo, hi;
+	guint i;
+
+	c = _mm256_set1_epi64x (cur);
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		a = _mm256_loadu_si256 ((const __m256i *)(prev + i));
+		m = _mm256_loadu_si256 ((const __m256i *)(mult + i));
+		lo = _mm256_mul_epu32 (a, m);
+		hi = _mm256_mul_epu32 (_mm256_srli_epi64 (a, 32), m);
+		lo = _mm256_add_epi64 (lo, _mm256_slli_epi64 (hi, 32));
+		_mm256_storeu_si256 ((__m256i *)(out + i), _mm256_add_epi64 (c, lo));
+	}
+
+	for (; i < n; i ++) {
+		out[i] = cur + prev[i] * mult[i];
+	}
+}
+#endif
+
+#if defined(HAVE_SSE2) && defined(HAVE_TARGET_ATTRIBUTE)
+#include <emmintrin.h>
+
+__attribute__((target("sse2"))) static void
+rspamd_osb_combine_sse2 (guint64 cur, const guint64 *prev,
+		const guint64 *mult, guint64 *out, guint n)
+{
+	__m128i c, a, m, lo, hi;
+	guint i;
+
+	c = _mm_set1_epi64x (cur);
+
+	for (i = 0; i + 2 <= n; i += 2) {
+		a = _mm_loadu_si128 ((const __m128i *)(prev + i));
+		m = _mm_loadu_si128 ((const __m128i *)(mult + i));
+		lo = _mm_mul_epu32 (a, m);
+		hi = _mm_mul_epu32 (_mm_srli_epi64 (a, 32), m);
+		lo = _mm_add_epi64 (lo, _mm_slli_epi64 (hi, 32));
+		_mm_storeu_si128 ((__m128i *)(out + i), _mm_add_epi64 (c, lo));
+	}
+
+	for (; i < n; i ++) {
+		out[i] = cur + prev[i] * mult[i];
+	}
+}
+#endif
+
+void
+rspamd_tokenizer_osb_load (void)
+{
+	guint i;
+
+	if (cpu_config != 0) {
+		for (i = 0; i < G_N_ELEMENTS (osb_combine_list); i ++) {
+			if (osb_combine_list[i].cpu_flags & cpu_config) {
+				osb_combine_impl = &osb_combine_list[i];
+				break;
+			}
+		}
+	}
+}
+
+const gchar *
+rspamd_tokenizer_osb_impl (void)
+{
+	return osb_combine_impl->desc;
+}
+
+void
+rspamd_tokenizer_osb_combine (guint64 cur, const guint64 *prev,
+		const guint64 *mult, guint64 *out, guint n)
+{
+	osb_combine_impl->combine (cur, prev, mult, out, n);
+}
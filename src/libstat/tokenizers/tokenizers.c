@@ -68,11 +68,38 @@ token_node_compare_func (gconstpointer a, gconstpointer b)
 {
 	const rspamd_token_t *aa = a, *bb = b;
 
-	if (aa->datalen != bb->datalen) {
-		return aa->datalen - bb->datalen;
+	return memcmp (&aa->data, &bb->data, sizeof (aa->data));
+}
+
+void
+rspamd_tokenizer_finalize (GArray *tokens)
+{
+	rspamd_token_t *tok, *prev;
+	guint i, j;
+
+	if (tokens == NULL || tokens->len <= 1) {
+		return;
+	}
+
+	/* Stable sort, so the first occurrence of a token is preserved */
+	g_array_sort (tokens, token_node_compare_func);
+	prev = &g_array_index (tokens, rspamd_token_t, 0);
+
+	for (i = 1, j = 1; i < tokens->len; i ++) {
+		tok = &g_array_index (tokens, rspamd_token_t, i);
+
+		if (tok->data != prev->data) {
+			prev = &g_array_index (tokens, rspamd_token_t, j);
+
+			if (i != j) {
+				memcpy (prev, tok, sizeof (*tok));
+			}
+
+			j ++;
+		}
 	}
 
-	return memcmp (aa->data, bb->data, aa->datalen);
+	g_array_set_size (tokens, j);
 }
 
 /* Get next word from specified f_str_t buf */
@@ -168,6 +195,28 @@ rspamd_tokenizer_get_word_compat (rspamd_fstring_t * buf,
 	return TRUE;
 }
 
+/*
+ * Decodes the next character and checks if it can be a part of a word,
+ * ASCII characters are checked without unicode tables
+ */
+static inline gboolean
+rspamd_tokenizer_word_char (const gchar *p, gchar **next_p)
+{
+	gunichar uc;
+
+	if (!(*p & 0x80)) {
+		*next_p = (gchar *)p + 1;
+
+		/* Other printable ASCII characters are punctuation or symbols */
+		return g_ascii_isalnum (*p);
+	}
+
+	uc = g_utf8_get_char (p);
+	*next_p = g_utf8_next_char (p);
+
+	return g_unichar_isgraph (uc) && !g_unichar_ispunct (uc);
+}
+
 static gboolean
 rspamd_tokenizer_get_word (rspamd_fstring_t * buf,
 		gchar **cur, rspamd_fstring_t * token,
@@ -175,7 +224,7 @@ rspamd_tokenizer_get_word (rspamd_fstring_t * buf,
 {
 	gsize remain, pos;
 	gchar *p, *next_p;
-	gunichar uc;
+	gboolean word_char;
 	guint processed = 0;
 	struct process_exception *ex = NULL;
 	enum {
@@ -211,8 +260,7 @@ rspamd_tokenizer_get_word (rspamd_fstring_t * buf,
 	token->begin = p;
 
 	while (remain > 0) {
-		uc = g_utf8_get_char (p);
-		next_p = g_utf8_next_char (p);
+		word_char = rspamd_tokenizer_word_char (p, &next_p);
 
 		if (next_p - p > (gint)remain) {
 			return FALSE;
@@ -226,7 +274,7 @@ rspamd_tokenizer_get_word (rspamd_fstring_t * buf,
 				state = skip_exception;
 				continue;
 			}
-			else if (g_unichar_isgraph (uc) && !g_unichar_ispunct (uc)) {
+			else if (word_char) {
 				state = feed_token;
 				token->begin = p;
 				continue;
@@ -236,7 +284,7 @@ rspamd_tokenizer_get_word (rspamd_fstring_t * buf,
 			if (ex != NULL && p - buf->begin == (gint)ex->pos) {
 				goto set_token;
 			}
-			else if (!g_unichar_isgraph (uc) || g_unichar_ispunct (uc)) {
+			else if (!word_char) {
 				goto set_token;
 			}
 			processed ++;
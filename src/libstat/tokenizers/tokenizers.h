@@ -18,13 +18,16 @@ struct rspamd_stat_tokenizer {
 	gint (*tokenize_func)(struct rspamd_tokenizer_config *cf,
 			rspamd_mempool_t *pool,
 			GArray *words,
-			GTree *result,
+			GArray *result,
 			gboolean is_utf);
 };
 
 /* Compare two token nodes */
 gint token_node_compare_func (gconstpointer a, gconstpointer b);
 
+/* Sort tokens array and remove duplicates keeping the first occurrence */
+void rspamd_tokenizer_finalize (GArray *tokens);
+
 
 /* Tokenize text into array of words (rspamd_fstring_t type) */
 GArray * rspamd_tokenize_text (gchar *text, gsize len, gboolean is_utf,
@@ -34,7 +37,7 @@ GArray * rspamd_tokenize_text (gchar *text, gsize len, gboolean is_utf,
 gint rspamd_tokenizer_osb (struct rspamd_tokenizer_config *cf,
 	rspamd_mempool_t *pool,
 	GArray *input,
-	GTree *tokens,
+	GArray *tokens,
 	gboolean is_utf);
 
 gpointer rspamd_tokenizer_osb_get_config (struct rspamd_tokenizer_config *cf,
@@ -44,6 +47,16 @@ gboolean
 rspamd_tokenizer_osb_compatible_config (struct rspamd_tokenizer_config *cf,
 			gpointer ptr, gsize len);
 
+/* Select the fastest window combination kernel for the current CPU */
+void rspamd_tokenizer_osb_load (void);
+
+/* Returns description of the selected kernel */
+const gchar * rspamd_tokenizer_osb_impl (void);
+
+/* Computes out[k] = cur + prev[k] * mult[k] for k < n */
+void rspamd_tokenizer_osb_combine (guint64 cur, const guint64 *prev,
+		const guint64 *mult, guint64 *out, guint n);
+
 #endif
 /*
  * vi:ts=4
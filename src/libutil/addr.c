@@ -100,15 +100,29 @@ rspamd_ip_validate_af (rspamd_inet_addr_t *addr)
 }
 
 
+/*
+ * Addresses allocated in a pool must not be destroyed explicitly
+ */
 static rspamd_inet_addr_t *
-rspamd_inet_addr_create (gint af)
+rspamd_inet_addr_create (gint af, rspamd_mempool_t *pool)
 {
 	rspamd_inet_addr_t *addr;
 
-	addr = g_slice_alloc0 (sizeof (rspamd_inet_addr_t));
+	if (pool != NULL) {
+		addr = rspamd_mempool_alloc0 (pool, sizeof (rspamd_inet_addr_t));
+	}
+	else {
+		addr = g_slice_alloc0 (sizeof (rspamd_inet_addr_t));
+	}
 
 	if (af == AF_UNIX) {
-		addr->u.un = g_slice_alloc (sizeof (*addr->u.un));
+		if (pool != NULL) {
+			addr->u.un = rspamd_mempool_alloc (pool, sizeof (*addr->u.un));
+		}
+		else {
+			addr->u.un = g_slice_alloc (sizeof (*addr->u.un));
+		}
+
 		addr->slen = sizeof (addr->u.un->addr);
 		/* Zero terminate to avoid issues with SUN_LEN */
 		addr->u.un->addr.sun_path[0] = '\0';
@@ -213,7 +227,7 @@ rspamd_accept_from_socket (gint sock, rspamd_inet_addr_t **target)
 		return -1;
 	}
 
-	addr = rspamd_inet_addr_create (su.sa.sa_family);
+	addr = rspamd_inet_addr_create (su.sa.sa_family, NULL);
 	addr->slen = len;
 
 	if (addr->af == AF_UNIX) {
@@ -255,7 +269,8 @@ out:
 }
 
 static gboolean
-rspamd_parse_unix_path (rspamd_inet_addr_t **target, const char *src)
+rspamd_parse_unix_path (rspamd_inet_addr_t **target, const char *src,
+	rspamd_mempool_t *pool)
 {
 	gchar **tokens, **cur_tok, *p, *pwbuf;
 	gint pwlen;
@@ -265,7 +280,7 @@ rspamd_parse_unix_path (rspamd_inet_addr_t **target, const char *src)
 
 	tokens = g_strsplit_set (src, " ", -1);
 
-	addr = rspamd_inet_addr_create (AF_UNIX);
+	addr = rspamd_inet_addr_create (AF_UNIX, pool);
 
 	rspamd_strlcpy (addr->u.un->addr.sun_path, tokens[0],
 			sizeof (addr->u.un->addr.sun_path));
@@ -324,11 +339,13 @@ rspamd_parse_unix_path (rspamd_inet_addr_t **target, const char *src)
 		cur_tok ++;
 	}
 
+	g_strfreev (tokens);
+
 	if (target) {
 		rspamd_ip_validate_af (addr);
 		*target = addr;
 	}
-	else {
+	else if (pool == NULL) {
 		rspamd_inet_address_destroy (addr);
 	}
 
@@ -336,20 +353,193 @@ rspamd_parse_unix_path (rspamd_inet_addr_t **target, const char *src)
 
 err:
 
-	rspamd_inet_address_destroy (addr);
+	g_strfreev (tokens);
+
+	if (pool == NULL) {
+		rspamd_inet_address_destroy (addr);
+	}
+
 	return FALSE;
 }
 
 gboolean
-rspamd_parse_inet_address (rspamd_inet_addr_t **target, const char *src)
+rspamd_parse_inet_address_ip4 (const guchar *text, gsize len, gpointer target)
+{
+	const guchar *p, *end;
+	guint32 addr = 0, octet = 0;
+	guint dots = 0, digits = 0;
+
+	g_assert (text != NULL);
+	g_assert (target != NULL);
+
+	for (p = text, end = text + len; p < end; p ++) {
+		if (g_ascii_isdigit (*p)) {
+			/* Leading zeros are rejected as inet_pton does */
+			if (digits > 0 && octet == 0) {
+				return FALSE;
+			}
+
+			octet = octet * 10 + (*p - '0');
+
+			if (octet > 255) {
+				return FALSE;
+			}
+
+			digits ++;
+		}
+		else if (*p == '.' && digits > 0 && dots < 3) {
+			addr = (addr << 8) | octet;
+			octet = 0;
+			digits = 0;
+			dots ++;
+		}
+		else {
+			return FALSE;
+		}
+	}
+
+	if (dots != 3 || digits == 0) {
+		return FALSE;
+	}
+
+	addr = htonl ((addr << 8) | octet);
+	memcpy (target, &addr, sizeof (addr));
+
+	return TRUE;
+}
+
+gboolean
+rspamd_parse_inet_address_ip6 (const guchar *text, gsize len, gpointer target)
+{
+	guchar tmp[16], *tp, *endp, *colonp = NULL;
+	const guchar *p, *end, *curtok;
+	guint val = 0, digits = 0, n;
+
+	g_assert (text != NULL);
+	g_assert (target != NULL);
+
+	memset (tmp, 0, sizeof (tmp));
+	tp = tmp;
+	endp = tmp + sizeof (tmp);
+	p = text;
+	end = text + len;
+
+	if (len < 2) {
+		return FALSE;
+	}
+
+	/* Leading `::` requires some special handling */
+	if (*p == ':') {
+		if (p[1] != ':') {
+			return FALSE;
+		}
+
+		p ++;
+	}
+
+	curtok = p;
+
+	while (p < end) {
+		if (g_ascii_isxdigit (*p)) {
+			val = (val << 4) | g_ascii_xdigit_value (*p);
+
+			if (++digits > 4) {
+				return FALSE;
+			}
+
+			p ++;
+		}
+		else if (*p == ':') {
+			p ++;
+			curtok = p;
+
+			if (digits == 0) {
+				if (colonp != NULL) {
+					return FALSE;
+				}
+
+				colonp = tp;
+				continue;
+			}
+			else if (p == end || tp + 2 > endp) {
+				return FALSE;
+			}
+
+			*tp++ = (val >> 8) & 0xff;
+			*tp++ = val & 0xff;
+			digits = 0;
+			val = 0;
+		}
+		else if (*p == '.' && tp + 4 <= endp &&
+				rspamd_parse_inet_address_ip4 (curtok, end - curtok, tp)) {
+			/* IPv4 mapped address as the last part */
+			tp += 4;
+			digits = 0;
+			break;
+		}
+		else {
+			return FALSE;
+		}
+	}
+
+	if (digits > 0) {
+		if (tp + 2 > endp) {
+			return FALSE;
+		}
+
+		*tp++ = (val >> 8) & 0xff;
+		*tp++ = val & 0xff;
+	}
+
+	if (colonp != NULL) {
+		if (tp == endp) {
+			return FALSE;
+		}
+
+		/* Shift groups after `::` to the end */
+		n = tp - colonp;
+		memmove (endp - n, colonp, n);
+		memset (colonp, 0, endp - n - colonp);
+		tp = endp;
+	}
+
+	if (tp != endp) {
+		return FALSE;
+	}
+
+	memcpy (target, tmp, sizeof (tmp));
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_parse_port (const gchar *src, guint *port)
+{
+	gchar *err_str;
+	gulong portnum;
+
+	errno = 0;
+	portnum = strtoul (src, &err_str, 10);
+
+	if (*err_str != '\0' || errno != 0 || portnum > G_MAXUINT16) {
+		return FALSE;
+	}
+
+	*port = portnum;
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_parse_inet_address_common (rspamd_inet_addr_t **target,
+	const char *src, rspamd_mempool_t *pool)
 {
 	gboolean ret = FALSE;
 	rspamd_inet_addr_t *addr = NULL;
 	union sa_inet su;
-	const char *end;
-	char ipbuf[INET6_ADDRSTRLEN + 1];
-	guint iplen;
-	guint portnum;
+	const char *end = NULL;
+	guint portnum = 0;
+	gsize len;
 
 	g_assert (src != NULL);
 	g_assert (target != NULL);
@@ -357,93 +547,95 @@ rspamd_parse_inet_address (rspamd_inet_addr_t **target, const char *src)
 	rspamd_ip_check_ipv6 ();
 
 	if (src[0] == '/' || src[0] == '.') {
-		return rspamd_parse_unix_path (target, src);
+		return rspamd_parse_unix_path (target, src, pool);
 	}
 
+	len = strlen (src);
+
 	if (src[0] == '[') {
 		/* Ipv6 address in format [::1]:port or just [::1] */
 		end = strrchr (src + 1, ']');
 
-		if (end == NULL) {
+		if (end == NULL || end == src + 1) {
 			return FALSE;
 		}
 
-		iplen = end - src - 1;
-
-		if (iplen == 0 || iplen > sizeof (ipbuf)) {
+		if (end[1] == ':') {
+			if (!rspamd_parse_port (end + 2, &portnum)) {
+				return FALSE;
+			}
+		}
+		else if (end[1] != '\0') {
 			return FALSE;
 		}
 
-		rspamd_strlcpy (ipbuf, src + 1, iplen);
-
 		if (ipv6_status == RSPAMD_IPV6_SUPPORTED &&
-				inet_pton (AF_INET6, ipbuf, &su.s6.sin6_addr) == 1) {
-			addr = rspamd_inet_addr_create (AF_INET6);
+				rspamd_parse_inet_address_ip6 ((const guchar *)src + 1,
+						end - src - 1,
+						&su.s6.sin6_addr)) {
+			addr = rspamd_inet_addr_create (AF_INET6, pool);
 			memcpy (&addr->u.in.addr.s6.sin6_addr, &su.s6.sin6_addr,
 					sizeof (struct in6_addr));
 			ret = TRUE;
 		}
+	}
+	else if (rspamd_parse_inet_address_ip4 ((const guchar *)src, len,
+			&su.s4.sin_addr)) {
+		addr = rspamd_inet_addr_create (AF_INET, pool);
+		memcpy (&addr->u.in.addr.s4.sin_addr, &su.s4.sin_addr,
+				sizeof (struct in_addr));
+		ret = TRUE;
+	}
+	else if ((end = strchr (src, ':')) != NULL) {
+		/* This is either port number and ipv4 addr or ipv6 addr */
+		if (ipv6_status == RSPAMD_IPV6_SUPPORTED &&
+				rspamd_parse_inet_address_ip6 ((const guchar *)src, len,
+					&su.s6.sin6_addr)) {
+			addr = rspamd_inet_addr_create (AF_INET6, pool);
+			memcpy (&addr->u.in.addr.s6.sin6_addr, &su.s6.sin6_addr,
+					sizeof (struct in6_addr));
+			ret = TRUE;
+		}
+		else if (rspamd_parse_inet_address_ip4 ((const guchar *)src, end - src,
+					&su.s4.sin_addr) &&
+				rspamd_parse_port (end + 1, &portnum)) {
+			/* Not ipv6, so try ip:port */
+			addr = rspamd_inet_addr_create (AF_INET, pool);
+			memcpy (&addr->u.in.addr.s4.sin_addr, &su.s4.sin_addr,
+					sizeof (struct in_addr));
+			ret = TRUE;
+		}
+	}
 
-		if (ret && end[1] == ':') {
-			/* Port part */
-			portnum = strtoul (end + 1, NULL, 10);
+	if (ret) {
+		if (portnum != 0) {
 			rspamd_inet_address_set_port (addr, portnum);
 		}
+
+		*target = addr;
 	}
-	else {
 
-		if ((end = strchr (src, ':')) != NULL) {
-			/* This is either port number and ipv4 addr or ipv6 addr */
-			if (ipv6_status == RSPAMD_IPV6_SUPPORTED &&
-					inet_pton (AF_INET6, src, &su.s6.sin6_addr) == 1) {
-				addr = rspamd_inet_addr_create (AF_INET6);
-				memcpy (&addr->u.in.addr.s6.sin6_addr, &su.s6.sin6_addr,
-						sizeof (struct in6_addr));
-				ret = TRUE;
-			}
-			else {
-				/* Not ipv6, so try ip:port */
-				iplen = end - src;
+	return ret;
+}
 
-				if (iplen > sizeof (ipbuf)) {
-					return FALSE;
-				}
-				else {
-					rspamd_strlcpy (ipbuf, src, iplen);
-				}
+gboolean
+rspamd_parse_inet_address (rspamd_inet_addr_t **target, const char *src)
+{
+	return rspamd_parse_inet_address_common (target, src, NULL);
+}
 
-				if (inet_pton (AF_INET, ipbuf, &su.s4.sin_addr) == 1) {
-					addr = rspamd_inet_addr_create (AF_INET);
-					memcpy (&addr->u.in.addr.s4.sin_addr, &su.s4.sin_addr,
-							sizeof (struct in_addr));
-					portnum = strtoul (end + 1, NULL, 10);
-					rspamd_inet_address_set_port (addr, portnum);
-					ret = TRUE;
-				}
-			}
-		}
-		else {
-			if (inet_pton (AF_INET, src, &su.s4.sin_addr) == 1) {
-				addr = rspamd_inet_addr_create (AF_INET);
-				memcpy (&addr->u.in.addr.s4.sin_addr, &su.s4.sin_addr,
-						sizeof (struct in_addr));
-				ret = TRUE;
-			}
-			else if (ipv6_status == RSPAMD_IPV6_SUPPORTED &&
-					inet_pton (AF_INET6, src, &su.s6.sin6_addr) == 1) {
-				addr = rspamd_inet_addr_create (AF_INET6);
-				memcpy (&addr->u.in.addr.s6.sin6_addr, &su.s6.sin6_addr,
-						sizeof (struct in6_addr));
-				ret = TRUE;
-			}
-		}
-	}
+rspamd_inet_addr_t *
+rspamd_parse_inet_address_pool (const char *src, rspamd_mempool_t *pool)
+{
+	rspamd_inet_addr_t *addr = NULL;
 
-	if (ret && target) {
-		*target = addr;
+	g_assert (pool != NULL);
+
+	if (!rspamd_parse_inet_address_common (&addr, src, pool)) {
+		return NULL;
 	}
 
-	return ret;
+	return addr;
 }
 
 const char *
@@ -534,7 +726,7 @@ rspamd_inet_address_connect (const rspamd_inet_addr_t *addr, gint type,
 
 int
 rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
-		gboolean async)
+		gboolean async, gboolean reuseport)
 {
 	gint fd, r;
 	gint on = 1;
@@ -564,6 +756,18 @@ rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
 
 	setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, (const void *)&on, sizeof (gint));
 
+	if (reuseport) {
+#ifdef SO_REUSEPORT
+		if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, (const void *)&on,
+				sizeof (gint)) == -1) {
+			msg_warn ("cannot set SO_REUSEPORT: %d, '%s'", errno,
+					strerror (errno));
+		}
+#else
+		msg_warn ("SO_REUSEPORT is not supported on this platform");
+#endif
+	}
+
 #ifdef HAVE_IPV6_V6ONLY
 	if (addr->af == AF_INET6) {
 		/* We need to set this flag to avoid errors */
@@ -631,7 +835,7 @@ rspamd_inet_address_recvfrom (gint fd, void *buf, gsize len, gint fl,
 	}
 
 	if (target) {
-		addr = rspamd_inet_addr_create (su.sa.sa_family);
+		addr = rspamd_inet_addr_create (su.sa.sa_family, NULL);
 		addr->slen = slen;
 
 		if (addr->af == AF_UNIX) {
@@ -682,7 +886,8 @@ rspamd_parse_host_port_priority_strv (gchar **tokens,
 	gchar *err_str, portbuf[8];
 	const gchar *cur_tok, *cur_port;
 	struct addrinfo hints, *res, *cur;
-	rspamd_inet_addr_t *cur_addr;
+	rspamd_inet_addr_t *cur_addr = NULL;
+	union sa_inet su;
 	guint addr_cnt;
 	guint port_parsed, priority_parsed, saved_errno = errno;
 	gint r;
@@ -757,7 +962,36 @@ rspamd_parse_host_port_priority_strv (gchar **tokens,
 		cur_port = NULL;
 	}
 
-	if (*tokens[0] != '/') {
+	if (cur_tok != NULL && (hints.ai_flags & AI_NUMERICSERV)) {
+		/* Numeric addresses do not need getaddrinfo */
+		if (rspamd_parse_inet_address_ip4 ((const guchar *)cur_tok,
+				strlen (cur_tok), &su.s4.sin_addr)) {
+			cur_addr = rspamd_inet_address_new (AF_INET, &su.s4.sin_addr);
+		}
+		else if (ipv6_status == RSPAMD_IPV6_SUPPORTED &&
+				rspamd_parse_inet_address_ip6 ((const guchar *)cur_tok,
+						strlen (cur_tok), &su.s6.sin6_addr)) {
+			cur_addr = rspamd_inet_address_new (AF_INET6, &su.s6.sin6_addr);
+		}
+	}
+
+	if (cur_addr != NULL) {
+		if (cur_port != NULL) {
+			rspamd_inet_address_set_port (cur_addr, strtoul (cur_port, NULL,
+					10));
+		}
+
+		*addrs = g_ptr_array_new_full (1,
+				(GDestroyNotify)rspamd_inet_address_destroy);
+
+		if (pool != NULL) {
+			rspamd_mempool_add_destructor (pool,
+					rspamd_ptr_array_free_hard, *addrs);
+		}
+
+		g_ptr_array_add (*addrs, cur_addr);
+	}
+	else if (*tokens[0] != '/') {
 		if ((r = getaddrinfo (cur_tok, cur_port, &hints, &res)) == 0) {
 			/* Now copy up to max_addrs of addresses */
 			addr_cnt = 0;
@@ -900,7 +1134,7 @@ rspamd_inet_address_new (int af, const void *init)
 {
 	rspamd_inet_addr_t *addr;
 
-	addr = rspamd_inet_addr_create (af);
+	addr = rspamd_inet_addr_create (af, NULL);
 
 	if (init != NULL) {
 		if (af == AF_UNIX) {
@@ -930,7 +1164,7 @@ rspamd_inet_address_from_sa (const struct sockaddr *sa, socklen_t slen)
 	g_assert (sa != NULL);
 	g_assert (slen >= sizeof (struct sockaddr));
 
-	addr = rspamd_inet_addr_create (sa->sa_family);
+	addr = rspamd_inet_addr_create (sa->sa_family, NULL);
 
 	if (sa->sa_family == AF_UNIX) {
 		/* Init is a path */
@@ -1052,7 +1286,7 @@ rspamd_inet_address_copy (const rspamd_inet_addr_t *addr)
 		return NULL;
 	}
 
-	n = rspamd_inet_addr_create (addr->af);
+	n = rspamd_inet_addr_create (addr->af, NULL);
 
 	if (n->af == AF_UNIX) {
 		memcpy (n->u.un, addr->u.un, sizeof (*addr->u.un));
@@ -57,6 +57,36 @@ rspamd_inet_addr_t * rspamd_inet_address_from_sa (const struct sockaddr *sa,
 gboolean rspamd_parse_inet_address (rspamd_inet_addr_t **target,
 	const char *src);
 
+/**
+ * Try to parse address from string allocating it in the memory pool, such
+ * address must not be destroyed by `rspamd_inet_address_destroy`
+ * @param src IP string representation
+ * @param pool memory pool
+ * @return new inet addr or NULL if it cannot be parsed
+ */
+rspamd_inet_addr_t * rspamd_parse_inet_address_pool (const char *src,
+	rspamd_mempool_t *pool);
+
+/**
+ * Parse IPv4 address in dotted decimal notation without allocations
+ * @param text string (not necessarily zero terminated)
+ * @param len length of string
+ * @param target struct in_addr to fill
+ * @return TRUE if the whole string is a valid address
+ */
+gboolean rspamd_parse_inet_address_ip4 (const guchar *text, gsize len,
+	gpointer target);
+
+/**
+ * Parse IPv6 address without allocations
+ * @param text string (not necessarily zero terminated)
+ * @param len length of string
+ * @param target struct in6_addr to fill
+ * @return TRUE if the whole string is a valid address
+ */
+gboolean rspamd_parse_inet_address_ip6 (const guchar *text, gsize len,
+	gpointer target);
+
 /**
  * Returns string representation of inet address
  * @param addr
@@ -128,10 +158,11 @@ int rspamd_inet_address_connect (const rspamd_inet_addr_t *addr, gint type,
  * @param addr
  * @param type
  * @param async
+ * @param reuseport set SO_REUSEPORT to allow several sockets on the same address
  * @return
  */
 int rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
-	gboolean async);
+	gboolean async, gboolean reuseport);
 /**
  * Check whether specified ip is valid (not INADDR_ANY or INADDR_NONE) for ipv4 or ipv6
  * @param ptr pointer to struct in_addr or struct in6_addr
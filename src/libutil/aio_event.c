@@ -33,6 +33,22 @@
 #include <aio.h>
 #endif
 
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+/* These numbers are the same for all platforms */
+# ifndef __NR_io_uring_setup
+#  define __NR_io_uring_setup 425
+# endif
+# ifndef __NR_io_uring_enter
+#  define __NR_io_uring_enter 426
+# endif
+# ifndef __NR_io_uring_register
+#  define __NR_io_uring_register 427
+# endif
+#endif
+
 /* Linux syscall numbers */
 #if defined(__i386__)
 # define SYS_io_setup      245
@@ -66,6 +82,9 @@ struct io_cbdata {
 	gpointer buf;
 	gpointer io_buf;
 	gpointer ud;
+#ifdef HAVE_LINUX_IO_URING_H
+	struct iovec iov;
+#endif
 };
 
 #ifdef LINUX
@@ -179,6 +198,28 @@ eventfd (guint initval, guint flags)
 
 #endif
 
+#ifdef HAVE_LINUX_IO_URING_H
+/* Rings shared with kernel */
+struct rspamd_uring {
+	gint fd;
+	guint32 entries;
+	guint32 *sq_head;
+	guint32 *sq_tail;
+	guint32 *sq_mask;
+	guint32 *sq_array;
+	struct io_uring_sqe *sqes;
+	guint32 *cq_head;
+	guint32 *cq_tail;
+	guint32 *cq_mask;
+	struct io_uring_cqe *cqes;
+	gpointer sq_ring;
+	gsize sq_ring_size;
+	gpointer cq_ring;
+	gsize cq_ring_size;
+	gsize sqes_size;
+};
+#endif
+
 /**
  * AIO context
  */
@@ -190,12 +231,177 @@ struct aio_context {
 	gint event_fd;
 	struct event eventfd_ev;
 	aio_context_t io_ctx;
+#ifdef HAVE_LINUX_IO_URING_H
+	/* If io_uring is available, it is used instead of io (3) */
+	gboolean has_uring;
+	struct rspamd_uring uring;
+#endif
 #elif defined(HAVE_AIO_H)
 	/* POSIX aio */
 	struct event rtsigs[128];
 #endif
 };
 
+#ifdef LINUX
+static void
+rspamd_aio_cbdata_done (struct io_cbdata *ev_data, gint64 res)
+{
+	ev_data->cb (ev_data->fd,
+		res,
+		ev_data->len,
+		ev_data->buf,
+		ev_data->ud);
+	if (ev_data->io_buf) {
+		free (ev_data->io_buf);
+	}
+	g_slice_free1 (sizeof (struct io_cbdata), ev_data);
+}
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+static void
+rspamd_uring_destroy (struct rspamd_uring *ring)
+{
+	if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+		munmap (ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED) {
+		munmap (ring->cq_ring, ring->cq_ring_size);
+	}
+	if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+		munmap (ring->sq_ring, ring->sq_ring_size);
+	}
+	close (ring->fd);
+	memset (ring, 0, sizeof (*ring));
+	ring->fd = -1;
+}
+
+/*
+ * Setup rings and register eventfd to be notified about completions
+ */
+static gboolean
+rspamd_uring_setup (struct rspamd_uring *ring, gint event_fd)
+{
+	struct io_uring_params p;
+	guchar *sq, *cq;
+
+	memset (&p, 0, sizeof (p));
+	memset (ring, 0, sizeof (*ring));
+	ring->fd = syscall (__NR_io_uring_setup, MAX_AIO_EV, &p);
+
+	if (ring->fd == -1) {
+		return FALSE;
+	}
+
+	ring->entries = p.sq_entries;
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (guint32);
+	ring->cq_ring_size = p.cq_off.cqes +
+			p.cq_entries * sizeof (struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+
+	ring->sq_ring = mmap (NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap (NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+			ring->sqes == MAP_FAILED) {
+		msg_err ("cannot map io_uring: %s", strerror (errno));
+		rspamd_uring_destroy (ring);
+
+		return FALSE;
+	}
+
+	sq = ring->sq_ring;
+	cq = ring->cq_ring;
+	ring->sq_head = (guint32 *)(sq + p.sq_off.head);
+	ring->sq_tail = (guint32 *)(sq + p.sq_off.tail);
+	ring->sq_mask = (guint32 *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (guint32 *)(sq + p.sq_off.array);
+	ring->cq_head = (guint32 *)(cq + p.cq_off.head);
+	ring->cq_tail = (guint32 *)(cq + p.cq_off.tail);
+	ring->cq_mask = (guint32 *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	if (syscall (__NR_io_uring_register, ring->fd, IORING_REGISTER_EVENTFD,
+			&event_fd, 1) == -1) {
+		msg_err ("cannot register eventfd for io_uring: %s", strerror (errno));
+		rspamd_uring_destroy (ring);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Submit a single request, returns FALSE if it cannot be queued, so the
+ * caller can fall back to the blocking variant
+ */
+static gboolean
+rspamd_uring_submit (struct rspamd_uring *ring, guint8 opcode,
+	struct io_cbdata *cbdata, gpointer buf, guint64 offset)
+{
+	struct io_uring_sqe *sqe;
+	guint32 tail, idx;
+
+	tail = *ring->sq_tail;
+
+	if (tail - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE) >=
+			ring->entries) {
+		return FALSE;
+	}
+
+	/* Vector is read by kernel when request is started */
+	cbdata->iov.iov_base = buf;
+	cbdata->iov.iov_len = cbdata->len;
+
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset (sqe, 0, sizeof (*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = cbdata->fd;
+	sqe->addr = (guint64)((uintptr_t)&cbdata->iov);
+	sqe->len = 1;
+	sqe->off = offset;
+	sqe->user_data = (guint64)((uintptr_t)cbdata);
+	ring->sq_array[idx] = idx;
+	__atomic_store_n (ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (syscall (__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) != 1) {
+		/* Kernel has not consumed the entry, so it can be taken back */
+		__atomic_store_n (ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_uring_reap (struct rspamd_uring *ring)
+{
+	struct io_uring_cqe *cqe;
+	struct io_cbdata *ev_data;
+	guint32 head;
+	gint64 res;
+
+	head = *ring->cq_head;
+
+	while (head != __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		ev_data = (struct io_cbdata *)(uintptr_t)cqe->user_data;
+		res = cqe->res;
+		/* Release entry before callback as it can submit new requests */
+		head ++;
+		__atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+		rspamd_aio_cbdata_done (ev_data, res);
+	}
+}
+#endif
+
 #ifdef LINUX
 /* Eventfd read callback */
 static void
@@ -216,6 +422,15 @@ rspamd_eventfdcb (gint fd, gshort what, gpointer ud)
 		msg_err ("eventfd read returned error: %s", strerror (errno));
 	}
 
+#ifdef HAVE_LINUX_IO_URING_H
+	if (ctx->has_uring) {
+		/* Completion queue is checked directly, counter is not needed */
+		rspamd_uring_reap (&ctx->uring);
+
+		return;
+	}
+#endif
+
 	ts.tv_sec = 0;
 	ts.tv_nsec = 0;
 
@@ -229,15 +444,7 @@ rspamd_eventfdcb (gint fd, gshort what, gpointer ud)
 			for (i = 0; i < done; i++) {
 				ev_data = (struct io_cbdata *) (uintptr_t) event[i].data;
 				/* Call this callback */
-				ev_data->cb (ev_data->fd,
-					event[i].res,
-					ev_data->len,
-					ev_data->buf,
-					ev_data->ud);
-				if (ev_data->io_buf) {
-					free (ev_data->io_buf);
-				}
-				g_slice_free1 (sizeof (struct io_cbdata), ev_data);
+				rspamd_aio_cbdata_done (ev_data, event[i].res);
 			}
 		}
 		else if (done == 0) {
@@ -285,6 +492,14 @@ rspamd_aio_init (struct event_base *base)
 				new);
 			event_base_set (new->base, &new->eventfd_ev);
 			event_add (&new->eventfd_ev, NULL);
+#ifdef HAVE_LINUX_IO_URING_H
+			if (rspamd_uring_setup (&new->uring, new->event_fd)) {
+				new->has_uring = TRUE;
+				new->has_aio = TRUE;
+
+				return new;
+			}
+#endif
 			if (io_setup (MAX_AIO_EV, &new->io_ctx) == -1) {
 				msg_err ("io_setup failed: %s", strerror (errno));
 				close (new->event_fd);
@@ -313,6 +528,12 @@ rspamd_aio_open (struct aio_context *ctx, const gchar *path, int flags)
 		return open (path, flags);
 	}
 #ifdef LINUX
+#ifdef HAVE_LINUX_IO_URING_H
+	/* Unlike io (3), io_uring does not require direct io to be async */
+	if (ctx->has_uring) {
+		return open (path, flags);
+	}
+#endif
 
 	fd = open (path, flags | O_DIRECT);
 
@@ -351,6 +572,18 @@ rspamd_aio_read (gint fd,
 		cbdata->fd = fd;
 		cbdata->io_buf = NULL;
 
+#ifdef HAVE_LINUX_IO_URING_H
+		if (ctx->has_uring) {
+			if (rspamd_uring_submit (&ctx->uring, IORING_OP_READV, cbdata,
+					buf, offset)) {
+				return len;
+			}
+
+			g_slice_free1 (sizeof (struct io_cbdata), cbdata);
+			goto blocking;
+		}
+#endif
+
 		iocb[0] = alloca (sizeof (struct iocb));
 		memset (iocb[0], 0, sizeof (struct iocb));
 		iocb[0]->aio_fildes = fd;
@@ -381,19 +614,12 @@ rspamd_aio_read (gint fd,
 	else {
 		/* Blocking variant */
 blocking:
-#ifdef _LARGEFILE64_SOURCE
-		r = lseek64 (fd, offset, SEEK_SET);
-#else
-		r = lseek (fd, offset, SEEK_SET);
-#endif
-		if (r > 0) {
-			r = read (fd, buf, len);
-			if (r >= 0) {
-				cb (fd, 0, r, buf, ud);
-			}
-			else {
-				cb (fd, r, -1, buf, ud);
-			}
+		r = pread (fd, buf, len, offset);
+		if (r >= 0) {
+			cb (fd, 0, r, buf, ud);
+		}
+		else {
+			cb (fd, r, -1, buf, ud);
 		}
 	}
 
@@ -431,6 +657,19 @@ rspamd_aio_write (gint fd,
 		}
 		memcpy (cbdata->io_buf, buf, len);
 
+#ifdef HAVE_LINUX_IO_URING_H
+		if (ctx->has_uring) {
+			if (rspamd_uring_submit (&ctx->uring, IORING_OP_WRITEV, cbdata,
+					cbdata->io_buf, offset)) {
+				return len;
+			}
+
+			free (cbdata->io_buf);
+			g_slice_free1 (sizeof (struct io_cbdata), cbdata);
+			goto blocking;
+		}
+#endif
+
 		iocb[0] = alloca (sizeof (struct iocb));
 		memset (iocb[0], 0, sizeof (struct iocb));
 		iocb[0]->aio_fildes = fd;
@@ -461,19 +700,12 @@ rspamd_aio_write (gint fd,
 	else {
 		/* Blocking variant */
 blocking:
-#ifdef _LARGEFILE64_SOURCE
-		r = lseek64 (fd, offset, SEEK_SET);
-#else
-		r = lseek (fd, offset, SEEK_SET);
-#endif
-		if (r > 0) {
-			r = write (fd, buf, len);
-			if (r >= 0) {
-				cb (fd, 0, r, buf, ud);
-			}
-			else {
-				cb (fd, r, -1, buf, ud);
-			}
+		r = pwrite (fd, buf, len, offset);
+		if (r >= 0) {
+			cb (fd, 0, r, buf, ud);
+		}
+		else {
+			cb (fd, r, -1, buf, ud);
 		}
 	}
 
@@ -497,6 +729,13 @@ rspamd_aio_close (gint fd, struct aio_context *ctx)
 		iocb.aio_fildes = fd;
 		iocb.aio_lio_opcode = IO_CMD_NOOP;
 
+#ifdef HAVE_LINUX_IO_URING_H
+		if (ctx->has_uring) {
+			/* Pending requests hold their own reference to the file */
+			return close (fd);
+		}
+#endif
+
 		/* Iocb is copied to kernel internally, so it is safe to put it on stack */
 		r = io_cancel (ctx->io_ctx, &iocb, &ev);
 		close (fd);
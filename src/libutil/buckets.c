@@ -0,0 +1,412 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "buckets.h"
+#include "logger.h"
+#include "util.h"
+#include "xxhash.h"
+
+/* Number of entries in a single set */
+#define BUCKETS_WAYS 4
+/* How many times processes try to lock a busy set */
+#define BUCKETS_LOCK_ATTEMPTS 1024
+
+struct rspamd_bucket_entry {
+	guint64 key;                            /* 0 for an empty entry		*/
+	gdouble atime;                          /* time of the last leak		*/
+	gdouble level;                          /* level including local hits	*/
+	gdouble rate;
+	gdouble pending;                        /* hits not sent to storage	*/
+	guint32 lru;
+	guint32 unused;
+	gchar name[RSPAMD_BUCKET_NAME_LEN];
+};
+
+/* Processes make sequence odd while they access buckets of a set */
+struct rspamd_buckets_set {
+	guint32 seq;
+	guint32 unused;
+	struct rspamd_bucket_entry entries[BUCKETS_WAYS];
+};
+
+struct rspamd_buckets {
+	guint64 nsets;                          /* power of 2					*/
+	guint64 cursor;                         /* next set to collect		*/
+	gsize len;
+	guint32 clock;                          /* approximate LRU clock		*/
+	guint32 last_sync;
+	struct rspamd_buckets_set *sets;
+};
+
+static guint64
+rspamd_buckets_key (const gchar *name)
+{
+	guint64 h;
+
+	h = XXH64 (name, strlen (name), 0);
+
+	return h != 0 ? h : 1;
+}
+
+static gboolean
+rspamd_buckets_lock_set (struct rspamd_buckets_set *set, guint32 *pseq)
+{
+	guint32 seq;
+	guint i;
+
+	for (i = 0; i < BUCKETS_LOCK_ATTEMPTS; i ++) {
+		seq = g_atomic_int_get (&set->seq);
+
+		if (!(seq & 1) &&
+				g_atomic_int_compare_and_exchange (&set->seq, seq, seq + 1)) {
+			*pseq = seq;
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static inline void
+rspamd_buckets_unlock_set (struct rspamd_buckets_set *set, guint32 seq)
+{
+	g_atomic_int_set (&set->seq, seq + 2);
+}
+
+static inline gdouble
+rspamd_buckets_leak (struct rspamd_bucket_entry *entry, gdouble now)
+{
+	gdouble level;
+
+	level = entry->level - entry->rate * (now - entry->atime);
+
+	return level > 0 ? level : 0;
+}
+
+static struct rspamd_bucket_entry *
+rspamd_buckets_find (struct rspamd_buckets_set *set, guint64 key,
+		const gchar *name)
+{
+	struct rspamd_bucket_entry *entry;
+	guint i;
+
+	for (i = 0; i < BUCKETS_WAYS; i ++) {
+		entry = &set->entries[i];
+
+		if (entry->key == key && strcmp (entry->name, name) == 0) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Find a place for a new bucket: empty entries are used first, then buckets
+ * with no pending hits, as their state is already stored remotely
+ */
+static struct rspamd_bucket_entry *
+rspamd_buckets_victim (struct rspamd_buckets_set *set)
+{
+	struct rspamd_bucket_entry *entry, *victim = NULL;
+	guint i;
+
+	for (i = 0; i < BUCKETS_WAYS; i ++) {
+		entry = &set->entries[i];
+
+		if (entry->key == 0) {
+			return entry;
+		}
+
+		if (victim == NULL ||
+				(victim->pending > 0 && entry->pending == 0) ||
+				((victim->pending > 0) == (entry->pending > 0) &&
+				(gint32)(entry->lru - victim->lru) < 0)) {
+			victim = entry;
+		}
+	}
+
+	return victim;
+}
+
+static struct rspamd_bucket_entry *
+rspamd_buckets_insert (struct rspamd_buckets_set *set, guint64 key,
+		const gchar *name, gdouble now)
+{
+	struct rspamd_bucket_entry *entry;
+
+	entry = rspamd_buckets_victim (set);
+	memset (entry, 0, sizeof (*entry));
+	entry->key = key;
+	entry->atime = now;
+	rspamd_strlcpy (entry->name, name, sizeof (entry->name));
+
+	return entry;
+}
+
+struct rspamd_buckets *
+rspamd_buckets_new (gsize nelts)
+{
+	struct rspamd_buckets *b;
+	guint64 nsets = 1;
+	gsize len;
+	gpointer map;
+
+	while (nsets * BUCKETS_WAYS < nelts) {
+		nsets <<= 1;
+	}
+
+	len = sizeof (*b) + nsets * sizeof (struct rspamd_buckets_set);
+
+#if defined(HAVE_MMAP_ANON)
+	map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED,
+			-1, 0);
+#elif defined(HAVE_MMAP_ZERO)
+	gint fd;
+
+	fd = open ("/dev/zero", O_RDWR);
+
+	if (fd == -1) {
+		msg_err ("cannot open /dev/zero: %s", strerror (errno));
+		return NULL;
+	}
+
+	map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+#else
+#       error No mmap methods are defined
+#endif
+
+	if (map == MAP_FAILED) {
+		msg_err ("cannot allocate %z bytes for buckets: %s", len,
+				strerror (errno));
+		return NULL;
+	}
+
+	/* Mapping is zero filled, so all entries are empty */
+	b = map;
+	b->nsets = nsets;
+	b->len = len;
+	b->sets = (struct rspamd_buckets_set *)(b + 1);
+
+	return b;
+}
+
+gboolean
+rspamd_buckets_check (struct rspamd_buckets *b,
+		const gchar *name, gdouble now, gdouble *level)
+{
+	struct rspamd_buckets_set *set;
+	struct rspamd_bucket_entry *entry;
+	guint64 key;
+	guint32 seq;
+	gboolean found = FALSE;
+
+	key = rspamd_buckets_key (name);
+	set = &b->sets[key & (b->nsets - 1)];
+
+	if (!rspamd_buckets_lock_set (set, &seq)) {
+		return FALSE;
+	}
+
+	entry = rspamd_buckets_find (set, key, name);
+
+	if (entry != NULL) {
+		*level = rspamd_buckets_leak (entry, now);
+		entry->lru = ++b->clock;
+		found = TRUE;
+	}
+
+	rspamd_buckets_unlock_set (set, seq);
+
+	return found;
+}
+
+gboolean
+rspamd_buckets_inc (struct rspamd_buckets *b,
+		const gchar *name, gdouble rate, gdouble now, gdouble *level)
+{
+	struct rspamd_buckets_set *set;
+	struct rspamd_bucket_entry *entry;
+	guint64 key;
+	guint32 seq;
+
+	if (strlen (name) >= RSPAMD_BUCKET_NAME_LEN) {
+		return FALSE;
+	}
+
+	key = rspamd_buckets_key (name);
+	set = &b->sets[key & (b->nsets - 1)];
+
+	if (!rspamd_buckets_lock_set (set, &seq)) {
+		return FALSE;
+	}
+
+	entry = rspamd_buckets_find (set, key, name);
+
+	if (entry == NULL) {
+		entry = rspamd_buckets_insert (set, key, name, now);
+	}
+
+	entry->rate = rate;
+	entry->level = rspamd_buckets_leak (entry, now) + 1;
+	entry->atime = now;
+	entry->pending += 1;
+	entry->lru = ++b->clock;
+
+	if (level) {
+		*level = entry->level;
+	}
+
+	rspamd_buckets_unlock_set (set, seq);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_buckets_try_sync (struct rspamd_buckets *b, gdouble now,
+		guint interval)
+{
+	guint32 last, cur = now;
+
+	last = g_atomic_int_get (&b->last_sync);
+
+	if (cur - last < interval) {
+		return FALSE;
+	}
+
+	return g_atomic_int_compare_and_exchange (&b->last_sync, last, cur);
+}
+
+guint
+rspamd_buckets_collect (struct rspamd_buckets *b, guint max,
+		GArray *out)
+{
+	struct rspamd_buckets_set *set;
+	struct rspamd_bucket_entry *entry;
+	struct rspamd_bucket_delta delta;
+	guint64 i, idx;
+	guint32 seq;
+	guint j, n = 0;
+
+	/* Continue from the set where the previous collection has stopped */
+	for (i = 0; i < b->nsets && n < max; i ++) {
+		idx = (b->cursor + i) & (b->nsets - 1);
+		set = &b->sets[idx];
+
+		if (!rspamd_buckets_lock_set (set, &seq)) {
+			continue;
+		}
+
+		for (j = 0; j < BUCKETS_WAYS && n < max; j ++) {
+			entry = &set->entries[j];
+
+			if (entry->key != 0 && entry->pending > 0) {
+				memcpy (delta.name, entry->name, sizeof (delta.name));
+				delta.rate = entry->rate;
+				delta.pending = entry->pending;
+				entry->pending = 0;
+				g_array_append_val (out, delta);
+				n ++;
+			}
+		}
+
+		rspamd_buckets_unlock_set (set, seq);
+	}
+
+	b->cursor = (b->cursor + i) & (b->nsets - 1);
+
+	return n;
+}
+
+void
+rspamd_buckets_merge (struct rspamd_buckets *b,
+		const gchar *name, gdouble now, gdouble level)
+{
+	struct rspamd_buckets_set *set;
+	struct rspamd_bucket_entry *entry;
+	guint64 key;
+	guint32 seq;
+
+	if (strlen (name) >= RSPAMD_BUCKET_NAME_LEN) {
+		return;
+	}
+
+	key = rspamd_buckets_key (name);
+	set = &b->sets[key & (b->nsets - 1)];
+
+	if (!rspamd_buckets_lock_set (set, &seq)) {
+		return;
+	}
+
+	entry = rspamd_buckets_find (set, key, name);
+
+	if (entry == NULL) {
+		entry = rspamd_buckets_insert (set, key, name, now);
+	}
+	else {
+		/* Hits made after collection are not known to storage yet */
+		level += entry->pending;
+	}
+
+	entry->level = level;
+	entry->atime = now;
+	entry->lru = ++b->clock;
+
+	rspamd_buckets_unlock_set (set, seq);
+}
+
+void
+rspamd_buckets_restore (struct rspamd_buckets *b,
+		const gchar *name, gdouble pending)
+{
+	struct rspamd_buckets_set *set;
+	struct rspamd_bucket_entry *entry;
+	guint64 key;
+	guint32 seq;
+
+	key = rspamd_buckets_key (name);
+	set = &b->sets[key & (b->nsets - 1)];
+
+	if (!rspamd_buckets_lock_set (set, &seq)) {
+		return;
+	}
+
+	entry = rspamd_buckets_find (set, key, name);
+
+	if (entry != NULL) {
+		entry->pending += pending;
+	}
+
+	rspamd_buckets_unlock_set (set, seq);
+}
+
+void
+rspamd_buckets_destroy (struct rspamd_buckets *b)
+{
+	if (b != NULL) {
+		munmap (b, b->len);
+	}
+}
@@ -0,0 +1,124 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef BUCKETS_H_
+#define BUCKETS_H_
+
+#include "config.h"
+
+/*
+ * Leaked buckets shared by all processes of a host: the table is set
+ * associative and lives in anonymous shared memory allocated before workers
+ * are forked. Each bucket counts hits made on this host that have not been
+ * sent to a remote storage yet, so buckets are checked and updated locally
+ * and remote storage is reconciled periodically in batches.
+ */
+struct rspamd_buckets;
+
+/* Maximum length of a bucket's name including trailing zero */
+#define RSPAMD_BUCKET_NAME_LEN 96
+
+struct rspamd_bucket_delta {
+	gchar name[RSPAMD_BUCKET_NAME_LEN];
+	gdouble rate;
+	gdouble pending;
+};
+
+/**
+ * Create new shared buckets table
+ * @param nelts maximum number of buckets
+ * @return new table or NULL
+ */
+struct rspamd_buckets * rspamd_buckets_new (gsize nelts);
+
+/**
+ * Get the level of a bucket leaked to the specified time
+ * @param b buckets table
+ * @param name name of bucket
+ * @param now current time
+ * @param level level is stored here
+ * @return TRUE if bucket has been found
+ */
+gboolean rspamd_buckets_check (struct rspamd_buckets *b,
+		const gchar *name, gdouble now, gdouble *level);
+
+/**
+ * Add a hit to a bucket, bucket is created if it does not exist
+ * @param b buckets table
+ * @param name name of bucket
+ * @param rate leak rate of bucket (hits per second)
+ * @param now current time
+ * @param level new level is stored here if not NULL
+ * @return FALSE if name is too long or a bucket cannot be locked
+ */
+gboolean rspamd_buckets_inc (struct rspamd_buckets *b,
+		const gchar *name, gdouble rate, gdouble now, gdouble *level);
+
+/**
+ * Claim the right to reconcile buckets with remote storage, only one process
+ * succeeds in each interval
+ * @param b buckets table
+ * @param now current time
+ * @param interval minimal interval between reconciliations
+ * @return TRUE if caller should reconcile buckets
+ */
+gboolean rspamd_buckets_try_sync (struct rspamd_buckets *b, gdouble now,
+		guint interval);
+
+/**
+ * Move pending hits of buckets to an array, pending counters are reset, so
+ * hits are sent to remote storage exactly once
+ * @param b buckets table
+ * @param max maximum number of buckets to collect
+ * @param out array of struct rspamd_bucket_delta
+ * @return number of buckets collected
+ */
+guint rspamd_buckets_collect (struct rspamd_buckets *b, guint max,
+		GArray *out);
+
+/**
+ * Set level of a bucket received from remote storage, hits made on this
+ * host after the bucket has been collected are added to that level
+ * @param b buckets table
+ * @param name name of bucket
+ * @param now current time
+ * @param level remote level of bucket leaked to `now`
+ */
+void rspamd_buckets_merge (struct rspamd_buckets *b,
+		const gchar *name, gdouble now, gdouble level);
+
+/**
+ * Return hits that could not be sent to remote storage to their bucket
+ * @param b buckets table
+ * @param name name of bucket
+ * @param pending number of hits collected
+ */
+void rspamd_buckets_restore (struct rspamd_buckets *b,
+		const gchar *name, gdouble pending);
+
+/**
+ * Unmap buckets table
+ * @param b buckets table
+ */
+void rspamd_buckets_destroy (struct rspamd_buckets *b);
+
+#endif /* BUCKETS_H_ */
@@ -0,0 +1,342 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "cuckoo.h"
+#include "xxhash.h"
+#include "ottery.h"
+#include "printf.h"
+
+/* Maximum number of relocations before the filter is considered full */
+#define CUCKOO_MAX_KICKS 500
+#define CUCKOO_MAGIC "rcf1"
+
+struct rspamd_cuckoo_file_header {
+	gchar magic[4];
+	guint32 victim;
+	guint64 nbuckets;
+	guint64 count;
+	guint64 seed;
+	guint64 victim_idx;
+};
+
+#define CUCKOO_SLOT(f, i, j) ((f)->table[(i) * RSPAMD_CUCKOO_BUCKET_SIZE + (j)])
+
+static inline void
+rspamd_cuckoo_hash (rspamd_cuckoo_filter_t *f, const void *data, gsize len,
+		guint16 *fp, guint64 *idx)
+{
+	guint64 h;
+
+	h = XXH64 (data, len, f->seed);
+	/* Zero fingerprint marks an empty slot */
+	*fp = (h >> 48) ? (h >> 48) : 1;
+	*idx = h & (f->nbuckets - 1);
+}
+
+/* Partial key cuckoo hashing: alternate bucket depends on fingerprint only */
+static inline guint64
+rspamd_cuckoo_alt (rspamd_cuckoo_filter_t *f, guint64 idx, guint16 fp)
+{
+	return (idx ^ ((guint64)fp * 0x5bd1e995ULL)) & (f->nbuckets - 1);
+}
+
+static gboolean
+rspamd_cuckoo_bucket_insert (rspamd_cuckoo_filter_t *f, guint64 idx,
+		guint16 fp)
+{
+	guint j;
+
+	for (j = 0; j < RSPAMD_CUCKOO_BUCKET_SIZE; j ++) {
+		if (CUCKOO_SLOT (f, idx, j) == 0) {
+			CUCKOO_SLOT (f, idx, j) = fp;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static gboolean
+rspamd_cuckoo_bucket_delete (rspamd_cuckoo_filter_t *f, guint64 idx,
+		guint16 fp)
+{
+	guint j;
+
+	for (j = 0; j < RSPAMD_CUCKOO_BUCKET_SIZE; j ++) {
+		if (CUCKOO_SLOT (f, idx, j) == fp) {
+			CUCKOO_SLOT (f, idx, j) = 0;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static gboolean
+rspamd_cuckoo_bucket_find (rspamd_cuckoo_filter_t *f, guint64 idx,
+		guint16 fp)
+{
+	guint j;
+
+	for (j = 0; j < RSPAMD_CUCKOO_BUCKET_SIZE; j ++) {
+		if (CUCKOO_SLOT (f, idx, j) == fp) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static rspamd_cuckoo_filter_t *
+rspamd_cuckoo_alloc (guint64 nbuckets, guint64 seed)
+{
+	rspamd_cuckoo_filter_t *f;
+
+	f = g_slice_alloc0 (sizeof (*f));
+	f->nbuckets = nbuckets;
+	f->seed = seed;
+	f->table = g_new0 (guint16, nbuckets * RSPAMD_CUCKOO_BUCKET_SIZE);
+
+	return f;
+}
+
+rspamd_cuckoo_filter_t *
+rspamd_cuckoo_create (gsize capacity)
+{
+	guint64 nbuckets = 1;
+
+	/* Aim at 50% load to keep insertions cheap */
+	while (nbuckets * RSPAMD_CUCKOO_BUCKET_SIZE < capacity * 2) {
+		nbuckets <<= 1;
+	}
+
+	return rspamd_cuckoo_alloc (nbuckets, ottery_rand_uint64 ());
+}
+
+void
+rspamd_cuckoo_destroy (rspamd_cuckoo_filter_t *f)
+{
+	if (f != NULL) {
+		g_free (f->table);
+		g_slice_free1 (sizeof (*f), f);
+	}
+}
+
+static gboolean
+rspamd_cuckoo_add_fp (rspamd_cuckoo_filter_t *f, guint64 idx, guint16 fp)
+{
+	guint16 tmp;
+	guint n, j;
+
+	if (f->victim != 0) {
+		/* Filter is full */
+		return FALSE;
+	}
+
+	f->count ++;
+
+	if (rspamd_cuckoo_bucket_insert (f, idx, fp)) {
+		return TRUE;
+	}
+
+	idx = rspamd_cuckoo_alt (f, idx, fp);
+
+	if (rspamd_cuckoo_bucket_insert (f, idx, fp)) {
+		return TRUE;
+	}
+
+	/* Relocate existing fingerprints to their alternate buckets */
+	for (n = 0; n < CUCKOO_MAX_KICKS; n ++) {
+		j = ottery_rand_range (RSPAMD_CUCKOO_BUCKET_SIZE - 1);
+		tmp = CUCKOO_SLOT (f, idx, j);
+		CUCKOO_SLOT (f, idx, j) = fp;
+		fp = tmp;
+		idx = rspamd_cuckoo_alt (f, idx, fp);
+
+		if (rspamd_cuckoo_bucket_insert (f, idx, fp)) {
+			return TRUE;
+		}
+	}
+
+	/* Keep the last evicted fingerprint so that no element is lost */
+	f->victim = fp;
+	f->victim_idx = idx;
+
+	return TRUE;
+}
+
+gboolean
+rspamd_cuckoo_add (rspamd_cuckoo_filter_t *f, const void *data, gsize len)
+{
+	guint16 fp;
+	guint64 idx;
+
+	rspamd_cuckoo_hash (f, data, len, &fp, &idx);
+
+	return rspamd_cuckoo_add_fp (f, idx, fp);
+}
+
+gboolean
+rspamd_cuckoo_del (rspamd_cuckoo_filter_t *f, const void *data, gsize len)
+{
+	guint16 fp;
+	guint64 idx, alt;
+
+	rspamd_cuckoo_hash (f, data, len, &fp, &idx);
+	alt = rspamd_cuckoo_alt (f, idx, fp);
+
+	if (rspamd_cuckoo_bucket_delete (f, idx, fp) ||
+			rspamd_cuckoo_bucket_delete (f, alt, fp)) {
+		f->count --;
+
+		if (f->victim != 0) {
+			/* We have got some free space for the victim */
+			fp = f->victim;
+			idx = f->victim_idx;
+			f->victim = 0;
+			f->count --;
+			rspamd_cuckoo_add_fp (f, idx, fp);
+		}
+
+		return TRUE;
+	}
+
+	if (f->victim == fp && (f->victim_idx == idx || f->victim_idx == alt)) {
+		f->victim = 0;
+		f->count --;
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+gboolean
+rspamd_cuckoo_check (rspamd_cuckoo_filter_t *f, const void *data, gsize len)
+{
+	guint16 fp;
+	guint64 idx, alt;
+
+	rspamd_cuckoo_hash (f, data, len, &fp, &idx);
+	alt = rspamd_cuckoo_alt (f, idx, fp);
+
+	if (f->victim == fp && (f->victim_idx == idx || f->victim_idx == alt)) {
+		return TRUE;
+	}
+
+	return rspamd_cuckoo_bucket_find (f, idx, fp) ||
+			rspamd_cuckoo_bucket_find (f, alt, fp);
+}
+
+gboolean
+rspamd_cuckoo_save (rspamd_cuckoo_filter_t *f, const gchar *path)
+{
+	struct rspamd_cuckoo_file_header hdr;
+	gchar tmppath[PATH_MAX];
+	gsize tlen;
+	gint fd;
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, CUCKOO_MAGIC, sizeof (hdr.magic));
+	hdr.victim = f->victim;
+	hdr.nbuckets = f->nbuckets;
+	hdr.count = f->count;
+	hdr.seed = f->seed;
+	hdr.victim_idx = f->victim_idx;
+	tlen = f->nbuckets * RSPAMD_CUCKOO_BUCKET_SIZE * sizeof (guint16);
+
+	/* Write to a temporary file so that readers never see a partial filter */
+	rspamd_snprintf (tmppath, sizeof (tmppath), "%s.tmp", path);
+
+	if ((fd = open (tmppath, O_WRONLY | O_CREAT | O_TRUNC, 00644)) == -1) {
+		return FALSE;
+	}
+
+	if (write (fd, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+			write (fd, f->table, tlen) != (gssize)tlen) {
+		close (fd);
+		unlink (tmppath);
+
+		return FALSE;
+	}
+
+	close (fd);
+
+	if (rename (tmppath, path) == -1) {
+		unlink (tmppath);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+rspamd_cuckoo_filter_t *
+rspamd_cuckoo_load (const gchar *path)
+{
+	struct rspamd_cuckoo_file_header hdr;
+	rspamd_cuckoo_filter_t *f;
+	struct stat st;
+	gsize tlen;
+	gint fd;
+
+	if ((fd = open (path, O_RDONLY)) == -1) {
+		return NULL;
+	}
+
+	if (fstat (fd, &st) == -1 ||
+			read (fd, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+			memcmp (hdr.magic, CUCKOO_MAGIC, sizeof (hdr.magic)) != 0 ||
+			hdr.nbuckets == 0 ||
+			(hdr.nbuckets & (hdr.nbuckets - 1)) != 0 ||
+			hdr.victim > G_MAXUINT16) {
+		close (fd);
+
+		return NULL;
+	}
+
+	tlen = hdr.nbuckets * RSPAMD_CUCKOO_BUCKET_SIZE * sizeof (guint16);
+
+	if ((gsize)st.st_size != sizeof (hdr) + tlen) {
+		close (fd);
+
+		return NULL;
+	}
+
+	f = rspamd_cuckoo_alloc (hdr.nbuckets, hdr.seed);
+	f->count = hdr.count;
+	f->victim = hdr.victim;
+	f->victim_idx = hdr.victim_idx & (hdr.nbuckets - 1);
+
+	if (read (fd, f->table, tlen) != (gssize)tlen) {
+		close (fd);
+		rspamd_cuckoo_destroy (f);
+
+		return NULL;
+	}
+
+	close (fd);
+
+	return f;
+}
@@ -0,0 +1,83 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef CUCKOO_H_
+#define CUCKOO_H_
+
+#include "config.h"
+
+/* Number of fingerprints stored in a single bucket */
+#define RSPAMD_CUCKOO_BUCKET_SIZE 4
+
+/*
+ * Cuckoo filter: approximate set membership with deletion support, as
+ * for bloom filters positive results must be checked elsewhere
+ */
+typedef struct rspamd_cuckoo_filter_s {
+	guint64 nbuckets;                       /**< number of buckets, power of 2	*/
+	guint64 count;                          /**< number of stored elements		*/
+	guint64 seed;                           /**< hash seed						*/
+	guint16 victim;                         /**< fingerprint that did not fit	*/
+	guint64 victim_idx;                     /**< bucket of the victim			*/
+	guint16 *table;
+} rspamd_cuckoo_filter_t;
+
+/*
+ * Create new cuckoo filter
+ * @param capacity expected number of elements
+ */
+rspamd_cuckoo_filter_t * rspamd_cuckoo_create (gsize capacity);
+
+/*
+ * Destroy cuckoo filter
+ */
+void rspamd_cuckoo_destroy (rspamd_cuckoo_filter_t *f);
+
+/*
+ * Add an element to the filter, returns FALSE if the filter is full
+ */
+gboolean rspamd_cuckoo_add (rspamd_cuckoo_filter_t *f, const void *data,
+		gsize len);
+
+/*
+ * Delete an element from the filter, the element must have been added before
+ */
+gboolean rspamd_cuckoo_del (rspamd_cuckoo_filter_t *f, const void *data,
+		gsize len);
+
+/*
+ * Check whether this element is in the filter (FALSE-POSITIVES are possible)
+ */
+gboolean rspamd_cuckoo_check (rspamd_cuckoo_filter_t *f, const void *data,
+		gsize len);
+
+/*
+ * Save filter to the specified file
+ */
+gboolean rspamd_cuckoo_save (rspamd_cuckoo_filter_t *f, const gchar *path);
+
+/*
+ * Load filter from the specified file, returns NULL on error
+ */
+rspamd_cuckoo_filter_t * rspamd_cuckoo_load (const gchar *path);
+
+#endif /* CUCKOO_H_ */
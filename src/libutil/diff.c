@@ -61,8 +61,8 @@ static
 void
 maybe_resize_array (GArray *arr, guint k)
 {
-	if (k > arr->len) {
-		g_array_set_size (arr, k);
+	if (k >= arr->len) {
+		g_array_set_size (arr, k + 1);
 	}
 
 }
@@ -305,7 +305,8 @@ rspamd_diff (const void *a, gint aoff, gint n, const void *b, gint boff, gint m,
 	gint d, x, y;
 	GArray *tmp;
 
-	tmp = g_array_sized_new (FALSE, TRUE, sizeof(gint), dmax);
+	/* Both vectors of diagonals up to dmax are packed into the same array */
+	tmp = g_array_sized_new (FALSE, TRUE, sizeof(gint), dmax * 2 + 4);
 	ctx.buf = tmp;
 	ctx.ses = ses;
 	ctx.si = 0;
@@ -374,20 +375,59 @@ rspamd_diff_distance (rspamd_fstring_t *s1, rspamd_fstring_t *s2)
 }
 
 
-guint32
-rspamd_diff_distance_normalized (rspamd_fstring_t *s1, rspamd_fstring_t *s2)
+/*
+ * Lower bound of the number of differences between two normalized strings:
+ * each insertion or deletion changes exactly one character counter
+ */
+static guint64
+rspamd_diff_histogram_bound (rspamd_fstring_t *s1, rspamd_fstring_t *s2)
+{
+	gint64 hist[256];
+	guint64 bound = 0;
+	gsize i;
+
+	memset (hist, 0, sizeof (hist));
+
+	for (i = 0; i < s1->len; i ++) {
+		if (!g_ascii_isspace (s1->begin[i])) {
+			hist[(guchar)g_ascii_tolower (s1->begin[i])] ++;
+		}
+	}
+
+	for (i = 0; i < s2->len; i ++) {
+		if (!g_ascii_isspace (s2->begin[i])) {
+			hist[(guchar)g_ascii_tolower (s2->begin[i])] --;
+		}
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (hist); i ++) {
+		bound += hist[i] > 0 ? hist[i] : -hist[i];
+	}
+
+	return bound;
+}
+
+/*
+ * Returns number of differences between normalized strings, if it reaches
+ * budget then the diff is stopped and some value not less than budget
+ * is returned
+ */
+static guint64
+rspamd_diff_normalized_common (rspamd_fstring_t *s1, rspamd_fstring_t *s2,
+	guint64 budget)
 {
 	gchar b1[BUFSIZ], b2[BUFSIZ], *t, *h, *p1, *p2;
 	gsize r1, r2;
 	rspamd_fstring_t t1, t2;
-	guint32 cur_diff = 0;
+	guint64 cur_diff = 0;
+	gint d;
 
 	r1 = s1->len;
 	r2 = s2->len;
 	p1 = s1->begin;
 	p2 = s2->begin;
 
-	while (r1 > 0 && r2 > 0) {
+	while (r1 > 0 && r2 > 0 && cur_diff < budget) {
 		/* Copy strings to the buffer normalized */
 		h = p1;
 		t = b1;
@@ -420,7 +460,21 @@ rspamd_diff_distance_normalized (rspamd_fstring_t *s1, rspamd_fstring_t *s2)
 		t2.begin = b2;
 		t2.len = t - b2;
 
-		cur_diff += compare_diff_distance_unnormalized (&t1, &t2);
+		if (budget == G_MAXUINT64) {
+			cur_diff += compare_diff_distance_unnormalized (&t1, &t2);
+		}
+		else {
+			/* We need merely the number of differences up to the budget */
+			d = rspamd_diff (t1.begin, 0, t1.len, t2.begin, 0, t2.len,
+					MIN (MAX_DIFF, budget - cur_diff), NULL, NULL);
+
+			if (d == -1) {
+				/* Diff failed, strings are different */
+				return budget;
+			}
+
+			cur_diff += d;
+		}
 	}
 
 	if (r1 > 0) {
@@ -444,5 +498,50 @@ rspamd_diff_distance_normalized (rspamd_fstring_t *s1, rspamd_fstring_t *s2)
 		}
 	}
 
-	return 100 - (2 * cur_diff * 100) / (s1->len + s2->len);
+	return cur_diff;
+}
+
+static guint32
+rspamd_diff_percents (guint64 ndiff, gsize len)
+{
+	if (len == 0) {
+		return 100;
+	}
+
+	return 100 - MIN (100, (2 * ndiff * 100) / len);
+}
+
+guint32
+rspamd_diff_distance_normalized (rspamd_fstring_t *s1, rspamd_fstring_t *s2)
+{
+	return rspamd_diff_percents (rspamd_diff_normalized_common (s1, s2,
+			G_MAXUINT64), s1->len + s2->len);
+}
+
+guint32
+rspamd_diff_distance_normalized_bounded (rspamd_fstring_t *s1,
+	rspamd_fstring_t *s2, gint limit)
+{
+	guint64 budget, ndiff;
+	gsize len = s1->len + s2->len;
+
+	if (limit < 0 || len == 0) {
+		return rspamd_diff_distance_normalized (s1, s2);
+	}
+	else if (limit >= 100) {
+		/* Any distance is within the limit */
+		return 100;
+	}
+
+	/* Number of differences that makes distance to be within the limit */
+	budget = ((100 - limit) * (guint64)len + 199) / 200;
+
+	if (rspamd_diff_histogram_bound (s1, s2) >= budget) {
+		ndiff = budget;
+	}
+	else {
+		ndiff = rspamd_diff_normalized_common (s1, s2, budget);
+	}
+
+	return rspamd_diff_percents (ndiff, len);
 }
@@ -78,4 +78,14 @@ guint32 rspamd_diff_distance (rspamd_fstring_t *s1, rspamd_fstring_t *s2);
  */
 guint32 rspamd_diff_distance_normalized (rspamd_fstring_t *s1, rspamd_fstring_t *s2);
 
+/*
+ * The same as rspamd_diff_distance_normalized but diff is stopped as soon as
+ * distance is known to be not greater than limit.
+ * @param limit distance limit, negative value means no limit
+ * @return exact distance if it is greater than limit, otherwise some value not
+ * less than the exact distance and not greater than limit
+ */
+guint32 rspamd_diff_distance_normalized_bounded (rspamd_fstring_t *s1,
+	rspamd_fstring_t *s2, gint limit);
+
 #endif /* DIFF_H_ */
@@ -31,7 +31,6 @@
 #include "ottery.h"
 
 #define RSPAMD_EXPR_FLAG_NEGATE (1 << 0)
-#define RSPAMD_EXPR_FLAG_PROCESSED (1 << 1)
 
 #define MIN_RESORT_EVALS 50
 #define MAX_RESORT_EVALS 150
@@ -67,8 +66,36 @@ struct rspamd_expression_elt {
 		} lim;
 	} p;
 	gint flags;
-	gint value;
 	gint priority;
+	/* Expected cost and probability of truth estimated on resort */
+	gdouble cost;
+	gdouble prob;
+};
+
+/*
+ * AST is compiled to a flat program that is evaluated without recursion:
+ * each operation opens a frame with its accumulator and limit, result of each
+ * operand is applied to the frame of its operation and the frame is closed
+ * when all operands are processed or when the result is known in advance
+ */
+struct rspamd_expression_insn {
+	enum {
+		INSN_ATOM = 0,  /* evaluate atom to the result register */
+		INSN_CONST,     /* load limit to the result register */
+		INSN_LIMIT,     /* set limit of the current frame */
+		INSN_OPEN,      /* open frame of an operation */
+		INSN_APPLY,     /* apply result register to the current frame */
+		INSN_CLOSE      /* move accumulator to result register, close frame */
+	} type;
+	struct rspamd_expression_elt *elt;
+	struct rspamd_expression_elt *parelt;
+	gint lim;
+	guint jump;
+};
+
+struct rspamd_expression_frame {
+	gint acc;
+	gint lim;
 };
 
 struct rspamd_expression {
@@ -76,8 +103,11 @@ struct rspamd_expression {
 	GArray *expressions;
 	GPtrArray *expression_stack;
 	GNode *ast;
+	GArray *program;
+	struct rspamd_expression_frame *frames;
 	guint next_resort;
 	guint evals;
+	gdouble default_cost;
 };
 
 static GQuark
@@ -362,6 +392,8 @@ rspamd_expression_destroy (struct rspamd_expression *expr)
 
 		g_array_free (expr->expressions, TRUE);
 		g_ptr_array_free (expr->expression_stack, TRUE);
+		g_array_free (expr->program, TRUE);
+		g_free (expr->frames);
 		g_node_destroy (expr->ast);
 	}
 }
@@ -467,49 +499,253 @@ rspamd_ast_priority_traverse (GNode *node, gpointer d)
 				elt->priority = RSPAMD_EXPRESSION_MAX_PRIORITY -
 						expr->subr->priority (elt->p.atom);
 			}
-			elt->p.atom->hits = 0;
-			elt->p.atom->avg_ticks = 0.0;
 		}
 	}
 
 	return FALSE;
 }
 
-#define ATOM_PRIORITY(a) ((a)->p.atom->hits / ((a)->p.atom->avg_ticks > 0 ?	\
-				(a)->p.atom->avg_ticks * 10000000 : 1.0))
+/*
+ * Probabilities are clamped to avoid division by zero for atoms that have
+ * always (or never) matched so far
+ */
+#define PROB_CLAMP(p) (MIN (MAX ((p), 0.01), 0.99))
+
+/*
+ * Expected cost of evaluating a branch until it becomes decisive for the
+ * parent: false operands stop AND, true operands stop OR
+ */
+static gdouble
+rspamd_ast_branch_weight (struct rspamd_expression_elt *elt,
+		enum rspamd_expression_op op)
+{
+	if (op == OP_OR) {
+		return elt->cost / PROB_CLAMP (elt->prob);
+	}
+
+	return elt->cost / (1.0 - PROB_CLAMP (elt->prob));
+}
 
 static gint
 rspamd_ast_priority_cmp (GNode *a, GNode *b)
 {
-	struct rspamd_expression_elt *ea = a->data, *eb = b->data;
+	struct rspamd_expression_elt *ea = a->data, *eb = b->data, *par;
 	gdouble w1, w2;
 
-	/* Special logic for atoms */
-	if (ea->type == ELT_ATOM && eb->type == ELT_ATOM &&
-			ea->priority == eb->priority) {
-		w1 = ATOM_PRIORITY (ea);
-		w2 = ATOM_PRIORITY (eb);
+	par = a->parent->data;
 
-		ea->p.atom->hits = 0;
-		ea->p.atom->avg_ticks = 0.0;
+	/* Short circuit operations are ordered by measured cost and selectivity */
+	if (ea->type != ELT_LIMIT && eb->type != ELT_LIMIT &&
+			(par->p.op == OP_AND || par->p.op == OP_MULT ||
+			par->p.op == OP_OR)) {
+		w1 = rspamd_ast_branch_weight (ea, par->p.op);
+		w2 = rspamd_ast_branch_weight (eb, par->p.op);
 
-		return w1 - w2;
+		if (w1 != w2) {
+			return w1 < w2 ? -1 : 1;
+		}
 	}
-	else {
-		return ea->priority - eb->priority;
+
+	return ea->priority - eb->priority;
+}
+
+/*
+ * Estimates cost and probability of truth for each node and sorts operands so
+ * that cheap and decisive ones are evaluated first, atoms statistics decays
+ * so the order follows changes of the traffic
+ */
+static gboolean
+rspamd_ast_resort_traverse (GNode *node, gpointer d)
+{
+	struct rspamd_expression_elt *elt = node->data, *celt;
+	struct rspamd_expression *expr = d;
+	rspamd_expression_atom_t *atom;
+	gdouble stop;
+	GNode *cld;
+
+	if (node->children == NULL) {
+		if (elt->type == ELT_ATOM) {
+			atom = elt->p.atom;
+			/* Atoms without samples are weighted by their static priority */
+			elt->cost = atom->avg_ticks > 0 ? atom->avg_ticks :
+					expr->default_cost * (0.5 + (gdouble)elt->priority /
+					RSPAMD_EXPRESSION_MAX_PRIORITY);
+			elt->prob = (atom->hits + 1.0) / (atom->evals + 2.0);
+			atom->hits /= 2;
+			atom->evals /= 2;
+		}
+		else {
+			elt->cost = 0;
+			elt->prob = 0.5;
+		}
+
+		return FALSE;
+	}
+
+	DL_SORT (node->children, rspamd_ast_priority_cmp);
+
+	switch (elt->p.op) {
+	case OP_AND:
+	case OP_MULT:
+	case OP_OR:
+		/* Each operand is evaluated if all previous have not been decisive */
+		elt->cost = 0;
+		stop = 1.0;
+
+		DL_FOREACH (node->children, cld) {
+			celt = cld->data;
+			elt->cost += stop * celt->cost;
+			stop *= elt->p.op == OP_OR ? 1.0 - celt->prob : celt->prob;
+		}
+
+		elt->prob = elt->p.op == OP_OR ? 1.0 - stop : stop;
+		break;
+	case OP_NOT:
+		celt = node->children->data;
+		elt->cost = celt->cost;
+		elt->prob = 1.0 - celt->prob;
+		break;
+	default:
+		elt->cost = 0;
+		elt->prob = 0.5;
+
+		DL_FOREACH (node->children, cld) {
+			celt = cld->data;
+			elt->cost += celt->cost;
+		}
+		break;
 	}
+
+	return FALSE;
 }
 
 static gboolean
-rspamd_ast_resort_traverse (GNode *node, gpointer unused)
+rspamd_ast_cost_traverse (GNode *node, gpointer d)
 {
-	if (node->children) {
-		DL_SORT (node->children, rspamd_ast_priority_cmp);
+	struct rspamd_expression_elt *elt = node->data;
+	gdouble *costs = d;
+
+	if (elt->type == ELT_ATOM && elt->p.atom->avg_ticks > 0) {
+		costs[0] += elt->p.atom->avg_ticks;
+		costs[1] ++;
 	}
 
 	return FALSE;
 }
 
+static void rspamd_expression_compile (struct rspamd_expression *expr);
+
+static void
+rspamd_ast_resort (struct rspamd_expression *expr)
+{
+	gdouble costs[2] = {0, 0};
+
+	/* Average cost of measured atoms is used for not measured ones */
+	g_node_traverse (expr->ast, G_IN_ORDER, G_TRAVERSE_LEAVES, -1,
+			rspamd_ast_cost_traverse, costs);
+	expr->default_cost = costs[1] > 0 ? costs[0] / costs[1] : 1.0;
+
+	/* Now set less expensive branches to be evaluated first */
+	g_node_traverse (expr->ast, G_POST_ORDER, G_TRAVERSE_ALL, -1,
+			rspamd_ast_resort_traverse, expr);
+	rspamd_expression_compile (expr);
+}
+
+static void
+rspamd_ast_compile_node (GArray *program, GNode *node)
+{
+	struct rspamd_expression_elt *elt = node->data, *celt;
+	struct rspamd_expression_insn insn, *pinsn;
+	GNode *cld;
+	guint i, open_idx;
+
+	memset (&insn, 0, sizeof (insn));
+	insn.elt = elt;
+
+	switch (elt->type) {
+	case ELT_ATOM:
+		insn.type = INSN_ATOM;
+		g_array_append_val (program, insn);
+		break;
+	case ELT_LIMIT:
+		/* Limits are values only if they are not operands of some operation */
+		insn.type = node->parent ? INSN_LIMIT : INSN_CONST;
+		insn.lim = elt->p.lim.val;
+		g_array_append_val (program, insn);
+		break;
+	case ELT_OP:
+		g_assert (node->children != NULL);
+		insn.lim = G_MININT;
+
+		/* Try to find limit at the parent node */
+		if (node->parent) {
+			insn.parelt = node->parent->data;
+			celt = node->parent->children->data;
+
+			if (celt->type == ELT_LIMIT) {
+				insn.lim = celt->p.lim.val;
+			}
+		}
+
+		insn.type = INSN_OPEN;
+		open_idx = program->len;
+		g_array_append_val (program, insn);
+
+		DL_FOREACH (node->children, cld) {
+			rspamd_ast_compile_node (program, cld);
+			celt = cld->data;
+
+			if (celt->type != ELT_LIMIT) {
+				insn.type = INSN_APPLY;
+				g_array_append_val (program, insn);
+			}
+		}
+
+		insn.type = INSN_CLOSE;
+		g_array_append_val (program, insn);
+
+		/* Operands of this operation jump to its end when the result is known */
+		for (i = open_idx; i < program->len; i ++) {
+			pinsn = &g_array_index (program, struct rspamd_expression_insn, i);
+
+			if (pinsn->type == INSN_APPLY && pinsn->elt == elt) {
+				pinsn->jump = program->len - 1;
+			}
+		}
+		break;
+	}
+}
+
+static guint
+rspamd_ast_max_depth (GNode *node)
+{
+	guint depth = 0, cur;
+	GNode *cld;
+
+	DL_FOREACH (node->children, cld) {
+		cur = rspamd_ast_max_depth (cld);
+		depth = MAX (depth, cur);
+	}
+
+	return depth + 1;
+}
+
+static void
+rspamd_expression_compile (struct rspamd_expression *expr)
+{
+	if (expr->program == NULL) {
+		expr->program = g_array_new (FALSE, FALSE,
+				sizeof (struct rspamd_expression_insn));
+		expr->frames = g_malloc (sizeof (struct rspamd_expression_frame) *
+				rspamd_ast_max_depth (expr->ast));
+	}
+	else {
+		g_array_set_size (expr->program, 0);
+	}
+
+	rspamd_ast_compile_node (expr->program, expr->ast);
+}
+
 static struct rspamd_expression_elt *
 rspamd_expr_dup_elt (rspamd_mempool_t *pool, struct rspamd_expression_elt *elt)
 {
@@ -560,6 +796,8 @@ rspamd_parse_expression (const gchar *line, gsize len,
 			sizeof (struct rspamd_expression_elt));
 	operand_stack = g_ptr_array_sized_new (32);
 	e->ast = NULL;
+	e->program = NULL;
+	e->frames = NULL;
 	e->expression_stack = g_ptr_array_sized_new (32);
 	e->subr = subr;
 	e->evals = 0;
@@ -606,6 +844,9 @@ rspamd_parse_expression (const gchar *line, gsize len,
 					}
 					g_assert (atom->len != 0);
 					p = p + atom->len;
+					atom->avg_ticks = 0.0;
+					atom->hits = 0;
+					atom->evals = 0;
 
 					/* Push to output */
 					elt.type = ELT_ATOM;
@@ -777,13 +1018,10 @@ rspamd_parse_expression (const gchar *line, gsize len,
 	e->ast = rspamd_expr_stack_elt_pop (operand_stack);
 	g_ptr_array_free (operand_stack, TRUE);
 
-	/* Set priorities for branches */
+	/* Set static priorities for branches */
 	g_node_traverse (e->ast, G_POST_ORDER, G_TRAVERSE_ALL, -1,
 			rspamd_ast_priority_traverse, e);
-
-	/* Now set less expensive branches to be evaluated first */
-	g_node_traverse (e->ast, G_POST_ORDER, G_TRAVERSE_NON_LEAVES, -1,
-			rspamd_ast_resort_traverse, NULL);
+	rspamd_ast_resort (e);
 
 	if (target) {
 		*target = e;
@@ -904,105 +1142,99 @@ rspamd_ast_do_op (struct rspamd_expression_elt *elt, gint val, gint acc, gint li
 }
 
 static gint
-rspamd_ast_process_node (struct rspamd_expression *expr, gint flags, GNode *node,
-		gpointer data)
+rspamd_ast_process_atom (struct rspamd_expression *expr,
+		struct rspamd_expression_elt *elt, gpointer data)
 {
-	struct rspamd_expression_elt *elt, *celt, *parelt = NULL;
-	GNode *cld;
-	gint acc = G_MININT, lim = G_MININT, val;
-	gdouble t1, t2;
+	gint val;
+	gdouble t1 = 0, t2;
 	gboolean calc_ticks = FALSE;
 
-	elt = node->data;
-
-	switch (elt->type) {
-	case ELT_ATOM:
-		if (!(elt->flags & RSPAMD_EXPR_FLAG_PROCESSED)) {
-
-			/*
-			 * Sometimes get ticks for this expression. 'Sometimes' here means
-			 * that we get lowest 5 bits of the counter `evals` and 5 bits
-			 * of some shifted address to provide some sort of jittering for
-			 * ticks evaluation
-			 */
-			if ((expr->evals & 0x1F) == (GPOINTER_TO_UINT (node) >> 4 & 0x1F)) {
-				calc_ticks = TRUE;
-				t1 = rspamd_get_ticks ();
-			}
+	/*
+	 * Sometimes get ticks for this expression. 'Sometimes' here means
+	 * that we get lowest 5 bits of the counter `evals` and 5 bits
+	 * of some shifted address to provide some sort of jittering for
+	 * ticks evaluation
+	 */
+	if ((expr->evals & 0x1F) == (GPOINTER_TO_UINT (elt) >> 4 & 0x1F)) {
+		calc_ticks = TRUE;
+		t1 = rspamd_get_ticks ();
+	}
 
-			elt->value = expr->subr->process (data, elt->p.atom);
+	val = expr->subr->process (data, elt->p.atom);
+	elt->p.atom->evals ++;
 
-			if (elt->value) {
-				elt->p.atom->hits ++;
-			}
+	if (val) {
+		elt->p.atom->hits ++;
+	}
 
-			if (calc_ticks) {
-				t2 = rspamd_get_ticks ();
-				elt->p.atom->avg_ticks += ((t2 - t1) - elt->p.atom->avg_ticks) /
-						(expr->evals);
-			}
+	if (calc_ticks) {
+		t2 = rspamd_get_ticks ();
 
-			elt->flags |= RSPAMD_EXPR_FLAG_PROCESSED;
+		/* Moving average of sampled times */
+		if (elt->p.atom->avg_ticks > 0) {
+			elt->p.atom->avg_ticks += ((t2 - t1) - elt->p.atom->avg_ticks) *
+					0.125;
 		}
-
-		return elt->value;
-		break;
-	case ELT_LIMIT:
-
-		return elt->p.lim.val;
-		break;
-	case ELT_OP:
-		g_assert (node->children != NULL);
-		cld = node->children;
-
-		/* Try to find limit at the parent node */
-		if (node->parent) {
-			parelt = node->parent->data;
-			celt = node->parent->children->data;
-
-			if (celt->type == ELT_LIMIT) {
-				lim = celt->p.lim.val;
-			}
+		else {
+			elt->p.atom->avg_ticks = t2 - t1;
 		}
+	}
 
-		DL_FOREACH (node->children, cld) {
-			celt = cld->data;
+	return val;
+}
 
-			/* Save limit if we've found it */
-			if (celt->type == ELT_LIMIT) {
-				lim = celt->p.lim.val;
-				continue;
-			}
+static gint
+rspamd_ast_process_program (struct rspamd_expression *expr, gint flags,
+		gpointer data)
+{
+	struct rspamd_expression_insn *insn;
+	struct rspamd_expression_frame *frame = NULL;
+	gint val = 0;
+	guint pc = 0;
 
-			val = rspamd_ast_process_node (expr, flags, cld, data);
+	while (pc < expr->program->len) {
+		insn = &g_array_index (expr->program, struct rspamd_expression_insn, pc);
 
-			if (acc == G_MININT) {
-				acc = val;
+		switch (insn->type) {
+		case INSN_ATOM:
+			val = rspamd_ast_process_atom (expr, insn->elt, data);
+			break;
+		case INSN_CONST:
+			val = insn->lim;
+			break;
+		case INSN_LIMIT:
+			frame->lim = insn->lim;
+			break;
+		case INSN_OPEN:
+			frame = frame ? frame + 1 : expr->frames;
+			frame->acc = G_MININT;
+			frame->lim = insn->lim;
+			break;
+		case INSN_APPLY:
+			if (frame->acc == G_MININT) {
+				frame->acc = val;
 			}
 
-			acc = rspamd_ast_do_op (elt, val, acc, lim);
+			frame->acc = rspamd_ast_do_op (insn->elt, val, frame->acc,
+					frame->lim);
 
-			if (!(flags & RSPAMD_EXPRESSION_FLAG_NOOPT)) {
-				if (rspamd_ast_node_done (elt, parelt, acc, lim)) {
-					return acc;
-				}
+			if (!(flags & RSPAMD_EXPRESSION_FLAG_NOOPT) &&
+					rspamd_ast_node_done (insn->elt, insn->parelt, frame->acc,
+					frame->lim)) {
+				pc = insn->jump;
+				continue;
 			}
+			break;
+		case INSN_CLOSE:
+			val = frame->acc;
+			frame = frame == expr->frames ? NULL : frame - 1;
+			break;
 		}
-		break;
-	}
-
-	return acc;
-}
-
-static gboolean
-rspamd_ast_cleanup_traverse (GNode *n, gpointer d)
-{
-	struct rspamd_expression_elt *elt = n->data;
 
-	elt->value = 0;
-	elt->flags = 0;
+		pc ++;
+	}
 
-	return FALSE;
+	return val;
 }
 
 gint
@@ -1015,11 +1247,7 @@ rspamd_process_expression (struct rspamd_expression *expr, gint flags,
 	/* Ensure that stack is empty at this point */
 	g_assert (expr->expression_stack->len == 0);
 
-	ret = rspamd_ast_process_node (expr, flags, expr->ast, data);
-
-	/* Cleanup */
-	g_node_traverse (expr->ast, G_IN_ORDER, G_TRAVERSE_ALL, -1,
-			rspamd_ast_cleanup_traverse, NULL);
+	ret = rspamd_ast_process_program (expr, flags, data);
 
 	expr->evals ++;
 
@@ -1027,13 +1255,7 @@ rspamd_process_expression (struct rspamd_expression *expr, gint flags,
 	if (expr->evals == expr->next_resort) {
 		expr->next_resort = ottery_rand_range (MAX_RESORT_EVALS) +
 				MIN_RESORT_EVALS;
-		/* Set priorities for branches */
-		g_node_traverse (expr->ast, G_POST_ORDER, G_TRAVERSE_ALL, -1,
-				rspamd_ast_priority_traverse, expr);
-
-		/* Now set less expensive branches to be evaluated first */
-		g_node_traverse (expr->ast, G_POST_ORDER, G_TRAVERSE_NON_LEAVES, -1,
-				rspamd_ast_resort_traverse, NULL);
+		rspamd_ast_resort (expr);
 	}
 
 	return ret;
@@ -1073,6 +1295,25 @@ rspamd_ast_string_traverse (GNode *n, gpointer d)
 	return FALSE;
 }
 
+void
+rspamd_expression_atom_foreach (struct rspamd_expression *expr,
+		rspamd_expression_atom_foreach_cb cb, gpointer cbdata)
+{
+	guint i;
+	struct rspamd_expression_elt *elt;
+
+	g_assert (expr != NULL);
+
+	for (i = 0; i < expr->expressions->len; i ++) {
+		elt = &g_array_index (expr->expressions,
+				struct rspamd_expression_elt, i);
+
+		if (elt->type == ELT_ATOM) {
+			cb (elt->p.atom, cbdata);
+		}
+	}
+}
+
 GString *
 rspamd_expression_tostring (struct rspamd_expression *expr)
 {
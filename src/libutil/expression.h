@@ -45,6 +45,8 @@ typedef struct rspamd_expression_atom_s {
 	gdouble avg_ticks;
 	/* Amount of positive triggers */
 	guint hits;
+	/* Amount of evaluations */
+	guint evals;
 } rspamd_expression_atom_t;
 
 struct rspamd_atom_subr {
@@ -86,6 +88,18 @@ gboolean rspamd_parse_expression (const gchar *line, gsize len,
 gint rspamd_process_expression (struct rspamd_expression *expr, gint flags,
 		gpointer data);
 
+typedef void (*rspamd_expression_atom_foreach_cb) (
+		rspamd_expression_atom_t *atom, gpointer ud);
+
+/**
+ * Calls the specified callback for each atom of an expression
+ * @param expr expression
+ * @param cb callback
+ * @param cbdata opaque data for the callback
+ */
+void rspamd_expression_atom_foreach (struct rspamd_expression *expr,
+		rspamd_expression_atom_foreach_cb cb, gpointer cbdata);
+
 /**
  * Shows string representation of an expression
  * @param expr expression to show
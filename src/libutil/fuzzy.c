@@ -137,19 +137,70 @@ fuzzy_update2 (rspamd_fuzzy_t * h1, rspamd_fuzzy_t *h2, guint c)
 }
 
 /*
- * Levenshtein distance between string1 and string2.
- *
- * Replace cost is normally 1, and 2 with nonzero xcost.
+ * Bit-parallel Levenshtein distance (G. Myers, "A fast bit-vector algorithm
+ * for approximate string matching based on dynamic programming", with
+ * the blocks extension by H. Hyyro): each column of the dynamic programming
+ * matrix is represented by vertical positive and negative deltas packed into
+ * 64 bits words
  */
+struct rspamd_levinstein_block {
+	guint64 pv;
+	guint64 mv;
+};
+
+/*
+ * Advances a block to the next column, returns horizontal delta of its last
+ * row
+ */
+static inline gint
+rspamd_levinstein_advance_block (struct rspamd_levinstein_block *blk,
+	guint64 eq, guint64 hibit, gint hin)
+{
+	guint64 pv = blk->pv, mv = blk->mv, xv, xh, ph, mh;
+	gint hout = 0;
+
+	xv = eq | mv;
+
+	if (hin < 0) {
+		eq |= 1;
+	}
+
+	xh = (((eq & pv) + pv) ^ pv) | eq;
+	ph = mv | ~(xh | pv);
+	mh = pv & xh;
+
+	if (ph & hibit) {
+		hout = 1;
+	}
+	else if (mh & hibit) {
+		hout = -1;
+	}
+
+	ph <<= 1;
+	mh <<= 1;
+
+	if (hin < 0) {
+		mh |= 1;
+	}
+	else if (hin > 0) {
+		ph |= 1;
+	}
+
+	blk->pv = mh | ~(xv | ph);
+	blk->mv = ph & xv;
+
+	return hout;
+}
+
 guint32
-rspamd_levinstein_distance (gchar *s1, gint len1, gchar *s2, gint len2)
+rspamd_levinstein_distance_bounded (const gchar *s1, gint len1,
+	const gchar *s2, gint len2, guint32 max)
 {
-	gint i;
-	gint *row;                              /* we only need to keep one row of costs */
-	gint *end;
-	gint half, nx;
-	gchar *sx, *char2p, char1;
-	gint *p, D, x, offset, c3;
+	struct rspamd_levinstein_block blk, *blocks;
+	guint64 peq[256], *bpeq, hibit, eq;
+	const gchar *sx;
+	gint i, j, nx, nblocks, hin;
+	guint32 score;
 
 	/* strip common prefix */
 	while (len1 > 0 && len2 > 0 && *s1 == *s2) {
@@ -165,16 +216,7 @@ rspamd_levinstein_distance (gchar *s1, gint len1, gchar *s2, gint len2)
 		len2--;
 	}
 
-	/* catch trivial cases */
-	if (len1 == 0) {
-		return len2;
-	}
-
-	if (len2 == 0) {
-		return len1;
-	}
-
-	/* make the inner cycle (i.e. string2) the longer one */
+	/* make the text (i.e. string2) the longer one */
 	if (len1 > len2) {
 		nx = len1;
 		sx = s1;
@@ -183,75 +225,79 @@ rspamd_levinstein_distance (gchar *s1, gint len1, gchar *s2, gint len2)
 		s1 = s2;
 		s2 = sx;
 	}
-	/* check len1 == 1 separately */
-	if (len1 == 1) {
-		return len2 - (memchr (s2, *s1, len2) != NULL);
-	}
-
-	len1++;
-	len2++;
-	half = len1 >> 1;
-
-	/* initalize first row */
-	row = g_malloc (len2 * sizeof (gint));
-	end = row + len2 - 1;
-	for (i = 0; i < len2; i++) {
-		row[i] = i;
-	}
-
-	/* in this case we don't have to scan two corner triangles (of size len1/2)
-	 * in the matrix because no best path can go throught them. note this
-	 * breaks when len1 == len2 == 2 so the memchr() special case above is
-	 * necessary */
-	row[0] = len1 - half - 1;
-	for (i = 1; i < len1; i++) {
-		char1 = s1[i - 1];
-		/* skip the upper triangle */
-		if (i >= len1 - half) {
-			offset = i - (len1 - half);
-			char2p = s2 + offset;
-			p = row + offset;
-			c3 = *(p++) + (char1 != *(char2p++));
-			x = *p;
-			x++;
-			D = x;
-			if (x > c3)
-				x = c3;
-			*(p++) = x;
+
+	/* catch trivial cases */
+	if (len1 == 0 || (guint32)(len2 - len1) > max) {
+		return MIN ((guint32)len2, max + 1);
+	}
+
+	score = len1;
+
+	if (len1 <= 64) {
+		memset (peq, 0, sizeof (peq));
+
+		for (i = 0; i < len1; i ++) {
+			peq[(guchar)s1[i]] |= 1ULL << i;
 		}
-		else {
-			p = row + 1;
-			char2p = s2;
-			D = x = i;
+
+		blk.pv = G_MAXUINT64;
+		blk.mv = 0;
+		hibit = 1ULL << (len1 - 1);
+
+		for (j = 0; j < len2; j ++) {
+			score += rspamd_levinstein_advance_block (&blk,
+					peq[(guchar)s2[j]], hibit, 1);
+
+			/* Each of the remaining columns can decrease score by one only */
+			if (score > max && score - max > (guint32)(len2 - j - 1)) {
+				return max + 1;
+			}
 		}
-		/* skip the lower triangle */
-		if (i <= half + 1)
-			end = row + len2 + i - half - 2;
-		/* main */
-		while (p <= end) {
-			c3 = --D + (char1 != *(char2p++));
-			x++;
-			if (x > c3)
-				x = c3;
-			D = *p;
-			D++;
-			if (x > D)
-				x = D;
-			*(p++) = x;
+
+		return MIN (score, max + 1);
+	}
+
+	nblocks = (len1 + 63) / 64;
+	bpeq = g_malloc0 (nblocks * 256 * sizeof (guint64));
+	blocks = g_malloc (nblocks * sizeof (*blocks));
+
+	for (i = 0; i < len1; i ++) {
+		bpeq[(i / 64) * 256 + (guchar)s1[i]] |= 1ULL << (i % 64);
+	}
+
+	for (i = 0; i < nblocks; i ++) {
+		blocks[i].pv = G_MAXUINT64;
+		blocks[i].mv = 0;
+	}
+
+	for (j = 0; j < len2; j ++) {
+		hin = 1;
+
+		for (i = 0; i < nblocks; i ++) {
+			eq = bpeq[i * 256 + (guchar)s2[j]];
+			hibit = i == nblocks - 1 ? 1ULL << ((len1 - 1) % 64) : 1ULL << 63;
+			hin = rspamd_levinstein_advance_block (&blocks[i], eq, hibit, hin);
 		}
-		/* lower triangle sentinel */
-		if (i <= half) {
-			c3 = --D + (char1 != *char2p);
-			x++;
-			if (x > c3)
-				x = c3;
-			*p = x;
+
+		score += hin;
+
+		if (score > max && score - max > (guint32)(len2 - j - 1)) {
+			score = max + 1;
+			break;
 		}
 	}
 
-	i = *end;
-	g_free (row);
-	return i;
+	g_free (bpeq);
+	g_free (blocks);
+
+	return MIN (score, max + 1);
+}
+
+guint32
+rspamd_levinstein_distance (gchar *s1, gint len1, gchar *s2, gint len2)
+{
+	return rspamd_levinstein_distance_bounded (s1, len1, s2, len2,
+			G_MAXUINT32 - 1);
 }
 
 /* Calculate fuzzy hash for specified string */
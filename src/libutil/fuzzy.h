@@ -67,6 +67,14 @@ gint rspamd_fuzzy_compare_parts (struct mime_text_part *p1, struct mime_text_par
  */
 guint32 rspamd_levinstein_distance (gchar *s1, gint len1, gchar *s2, gint len2);
 
+/*
+ * Calculate levenstein distance between two strings stopping as soon as it is
+ * known to be greater than max
+ * @return distance or max + 1 if distance is greater than max
+ */
+guint32 rspamd_levinstein_distance_bounded (const gchar *s1, gint len1,
+	const gchar *s2, gint len2, guint32 max);
+
 /*
  * Hash table utilities
  */
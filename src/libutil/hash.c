@@ -28,89 +28,260 @@
 
 /**
  * LRU hashing
+ *
+ * Elements are stored in an open addressing table with linear probing and
+ * evicted by CLOCK: lookups set the reference bit of an element and the hand
+ * evicts the first element without it, clearing bits as it passes. Concurrent
+ * hashes are split into segments with their own locks.
  */
 
+#define RSPAMD_LRU_SEGMENTS 16
+
 typedef struct rspamd_lru_element_s {
 	gpointer data;
 	gpointer key;
 	time_t store_time;
 	guint ttl;
-	rspamd_lru_hash_t *hash;
-	GList *link;
-
+	guint hv;
+	gboolean used;
 } rspamd_lru_element_t;
 
+struct rspamd_lru_segment {
+	rspamd_lru_element_t *elts;
+	guint mask;
+	guint nelts;
+	guint maxsize;
+	guint hand;
+	rspamd_mutex_t *mtx;
+};
+
 struct rspamd_lru_hash_s {
 	gint maxsize;
 	gint maxage;
 	GDestroyNotify value_destroy;
 	GDestroyNotify key_destroy;
+	GBoxedCopyFunc value_ref;
+	GHashFunc hfunc;
+	GEqualFunc eqfunc;
 
-	GHashTable *tbl;
-	GQueue *exp; /* Elements are inserted to the tail and removed from the front */
+	struct rspamd_lru_segment *segs;
+	guint nsegs;
 };
 
+static inline struct rspamd_lru_segment *
+rspamd_lru_segment (rspamd_lru_hash_t *hash, guint hv)
+{
+	if (hash->nsegs == 1) {
+		return hash->segs;
+	}
+
+	/* High bits are used as slots are selected by low bits */
+	return &hash->segs[(hv * 0x9E3779B1U) >> 28];
+}
+
+static inline void
+rspamd_lru_lock (struct rspamd_lru_segment *seg)
+{
+	if (seg->mtx) {
+		rspamd_mutex_lock (seg->mtx);
+	}
+}
+
+static inline void
+rspamd_lru_unlock (struct rspamd_lru_segment *seg)
+{
+	if (seg->mtx) {
+		rspamd_mutex_unlock (seg->mtx);
+	}
+}
+
+/*
+ * Returns the slot of a key or the empty slot where it should be inserted
+ */
+static guint
+rspamd_lru_find (rspamd_lru_hash_t *hash, struct rspamd_lru_segment *seg,
+	gconstpointer key, guint hv)
+{
+	rspamd_lru_element_t *elt;
+	guint i = hv & seg->mask;
+
+	/* Load factor is kept below 3/4, so there is always an empty slot */
+	for (;;) {
+		elt = &seg->elts[i];
+
+		if (elt->key == NULL ||
+				(elt->hv == hv && hash->eqfunc (elt->key, key))) {
+			return i;
+		}
+
+		i = (i + 1) & seg->mask;
+	}
+}
+
+/*
+ * Remove an element and shift the following elements of its cluster back, so
+ * lookups do not need tombstones
+ */
 static void
-rspamd_lru_destroy_node (gpointer value)
+rspamd_lru_remove (rspamd_lru_hash_t *hash, struct rspamd_lru_segment *seg,
+	guint i)
 {
-	rspamd_lru_element_t *elt = (rspamd_lru_element_t *)value;
+	rspamd_lru_element_t *elt = &seg->elts[i];
+	guint j, k;
 
-	if (elt) {
-		if (elt->hash && elt->hash->key_destroy) {
-			elt->hash->key_destroy (elt->key);
+	if (hash->key_destroy) {
+		hash->key_destroy (elt->key);
+	}
+	if (hash->value_destroy) {
+		hash->value_destroy (elt->data);
+	}
+
+	j = i;
+
+	for (;;) {
+		j = (j + 1) & seg->mask;
+
+		if (seg->elts[j].key == NULL) {
+			break;
 		}
-		if (elt->hash && elt->hash->value_destroy) {
-			elt->hash->value_destroy (elt->data);
+
+		k = seg->elts[j].hv & seg->mask;
+
+		/* Move the element if its home slot is not in (i, j] */
+		if ((i <= j) ? (k <= i || k > j) : (k <= i && k > j)) {
+			seg->elts[i] = seg->elts[j];
+			i = j;
 		}
-		if (elt->hash && elt->link) {
-			g_queue_delete_link (elt->hash->exp, elt->link);
+	}
+
+	memset (&seg->elts[i], 0, sizeof (seg->elts[i]));
+	seg->nelts --;
+}
+
+static inline gboolean
+rspamd_lru_expired (rspamd_lru_hash_t *hash, rspamd_lru_element_t *elt,
+	time_t now)
+{
+	if (elt->ttl != 0 && now - elt->store_time > elt->ttl) {
+		return TRUE;
+	}
+	if (hash->maxage > 0 && now - elt->store_time > hash->maxage) {
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void
+rspamd_lru_evict (rspamd_lru_hash_t *hash, struct rspamd_lru_segment *seg,
+	time_t now)
+{
+	rspamd_lru_element_t *elt;
+
+	/* Terminates in two sweeps at most as bits are cleared by the first */
+	for (;;) {
+		elt = &seg->elts[seg->hand];
+
+		if (elt->key != NULL) {
+			if (!elt->used || rspamd_lru_expired (hash, elt, now)) {
+				rspamd_lru_remove (hash, seg, seg->hand);
+				return;
+			}
+
+			elt->used = FALSE;
 		}
 
-		g_slice_free1 (sizeof (*elt), elt);
+		seg->hand = (seg->hand + 1) & seg->mask;
 	}
 }
 
-static rspamd_lru_element_t *
-rspamd_lru_create_node (rspamd_lru_hash_t *hash,
-	gpointer key,
-	gpointer value,
-	time_t now,
-	guint ttl)
+static void
+rspamd_lru_grow (struct rspamd_lru_segment *seg)
 {
-	rspamd_lru_element_t *node;
+	rspamd_lru_element_t *old = seg->elts;
+	guint i, j, oldsize = seg->mask + 1;
+
+	seg->mask = oldsize * 2 - 1;
+	seg->elts = g_malloc0 (sizeof (*seg->elts) * (seg->mask + 1));
+	seg->hand = 0;
 
-	node = g_slice_alloc (sizeof (rspamd_lru_element_t));
-	node->data = value;
-	node->key = key;
-	node->store_time = now;
-	node->ttl = ttl;
-	node->hash = hash;
+	for (i = 0; i < oldsize; i ++) {
+		if (old[i].key != NULL) {
+			j = old[i].hv & seg->mask;
 
-	return node;
+			while (seg->elts[j].key != NULL) {
+				j = (j + 1) & seg->mask;
+			}
+
+			seg->elts[j] = old[i];
+		}
+	}
+
+	g_free (old);
 }
 
-rspamd_lru_hash_t *
-rspamd_lru_hash_new_full (
-	gint maxsize,
+static rspamd_lru_hash_t *
+rspamd_lru_hash_create (gint maxsize,
 	gint maxage,
 	GDestroyNotify key_destroy,
 	GDestroyNotify value_destroy,
+	GBoxedCopyFunc value_ref,
 	GHashFunc hf,
-	GEqualFunc cmpf)
+	GEqualFunc cmpf,
+	guint nsegs)
 {
 	rspamd_lru_hash_t *new;
+	struct rspamd_lru_segment *seg;
+	guint i, size, segsize = 0;
 
 	new = g_slice_alloc (sizeof (rspamd_lru_hash_t));
-	new->tbl = g_hash_table_new_full (hf, cmpf, NULL, rspamd_lru_destroy_node);
-	new->exp = g_queue_new ();
 	new->maxage = maxage;
 	new->maxsize = maxsize;
 	new->value_destroy = value_destroy;
 	new->key_destroy = key_destroy;
+	new->value_ref = value_ref;
+	new->hfunc = hf;
+	new->eqfunc = cmpf;
+	new->nsegs = nsegs;
+	new->segs = g_malloc0 (sizeof (*new->segs) * nsegs);
+
+	if (maxsize > 0) {
+		segsize = (maxsize + nsegs - 1) / nsegs;
+	}
+
+	for (i = 0; i < nsegs; i ++) {
+		seg = &new->segs[i];
+		size = 8;
+
+		while (size < segsize + segsize / 3 + 1) {
+			size *= 2;
+		}
+
+		seg->maxsize = segsize;
+		seg->mask = size - 1;
+		seg->elts = g_malloc0 (sizeof (*seg->elts) * size);
+
+		if (nsegs > 1) {
+			seg->mtx = rspamd_mutex_new ();
+		}
+	}
 
 	return new;
 }
 
+rspamd_lru_hash_t *
+rspamd_lru_hash_new_full (
+	gint maxsize,
+	gint maxage,
+	GDestroyNotify key_destroy,
+	GDestroyNotify value_destroy,
+	GHashFunc hf,
+	GEqualFunc cmpf)
+{
+	return rspamd_lru_hash_create (maxsize, maxage, key_destroy,
+			value_destroy, NULL, hf, cmpf, 1);
+}
+
 rspamd_lru_hash_t *
 rspamd_lru_hash_new (
 	gint maxsize,
@@ -123,109 +294,272 @@ rspamd_lru_hash_new (
 			rspamd_strcase_hash, rspamd_strcase_equal);
 }
 
+rspamd_lru_hash_t *
+rspamd_lru_hash_new_concurrent (
+	gint maxsize,
+	gint maxage,
+	GDestroyNotify key_destroy,
+	GDestroyNotify value_destroy,
+	GBoxedCopyFunc value_ref,
+	GHashFunc hf,
+	GEqualFunc cmpf)
+{
+	g_assert (value_ref != NULL);
+
+	return rspamd_lru_hash_create (maxsize, maxage, key_destroy,
+			value_destroy, value_ref, hf, cmpf, RSPAMD_LRU_SEGMENTS);
+}
+
 gpointer
 rspamd_lru_hash_lookup (rspamd_lru_hash_t *hash, gconstpointer key, time_t now)
 {
+	struct rspamd_lru_segment *seg;
 	rspamd_lru_element_t *res;
-	GList *cur, *tmp;
-
-	res = g_hash_table_lookup (hash->tbl, key);
-	if (res != NULL) {
-		if (res->ttl != 0) {
-			if (now - res->store_time > res->ttl) {
-				g_hash_table_remove (hash->tbl, key);
-				return NULL;
-			}
-		}
-		if (hash->maxage > 0) {
-			if (now - res->store_time > hash->maxage) {
-				/* Expire elements from queue head */
-				cur = hash->exp->head;
-				while (cur) {
-					tmp = cur->next;
-					res = (rspamd_lru_element_t *)cur->data;
-
-					if (now - res->store_time > hash->maxage) {
-						/* That would also remove element from the queue */
-						g_hash_table_remove (hash->tbl, res->key);
-					}
-					else {
-						break;
-					}
-
-					cur = tmp;
-				}
+	gpointer data = NULL;
+	guint hv, i;
 
-				return NULL;
-			}
+	hv = hash->hfunc (key);
+	seg = rspamd_lru_segment (hash, hv);
+	rspamd_lru_lock (seg);
+	i = rspamd_lru_find (hash, seg, key, hv);
+	res = &seg->elts[i];
+
+	if (res->key != NULL) {
+		if (rspamd_lru_expired (hash, res, now)) {
+			rspamd_lru_remove (hash, seg, i);
 		}
 		else {
-			res->store_time = now;
-			/* Reinsert element to the tail */
-			g_queue_unlink (hash->exp, res->link);
-			g_queue_push_tail_link (hash->exp, res->link);
-		}
+			res->used = TRUE;
+			data = res->data;
 
-		return res->data;
+			if (hash->value_ref) {
+				data = hash->value_ref (data);
+			}
+		}
 	}
 
-	return NULL;
+	rspamd_lru_unlock (seg);
+
+	return data;
 }
 
 void
 rspamd_lru_hash_insert (rspamd_lru_hash_t *hash, gpointer key, gpointer value,
 	time_t now, guint ttl)
 {
+	struct rspamd_lru_segment *seg;
 	rspamd_lru_element_t *res;
-	gint removed = 0;
-	GList *cur, *tmp;
-
-	res = g_hash_table_lookup (hash->tbl, key);
-	if (res != NULL) {
-		g_hash_table_remove (hash->tbl, key);
-	}
-	else {
-		if (hash->maxsize > 0 &&
-			(gint)g_hash_table_size (hash->tbl) >= hash->maxsize) {
-			/* Expire some elements */
-			if (hash->maxage > 0) {
-				cur = hash->exp->head;
-				while (cur) {
-					tmp = cur->next;
-					res = (rspamd_lru_element_t *)cur->data;
-
-					if (now - res->store_time > hash->maxage) {
-						/* That would also remove element from the queue */
-						g_hash_table_remove (hash->tbl, res->key);
-						removed ++;
-					}
-					else {
-						break;
-					}
-
-					cur = tmp;
+	guint hv, i;
+
+	g_assert (key != NULL);
+
+	hv = hash->hfunc (key);
+	seg = rspamd_lru_segment (hash, hv);
+	rspamd_lru_lock (seg);
+	i = rspamd_lru_find (hash, seg, key, hv);
+
+	if (seg->elts[i].key != NULL) {
+		rspamd_lru_remove (hash, seg, i);
+	}
+	else if (seg->maxsize > 0) {
+		if (seg->nelts >= seg->maxsize) {
+			rspamd_lru_evict (hash, seg, now);
+		}
+	}
+	else if ((seg->nelts + 1) * 4 >= (seg->mask + 1) * 3) {
+		rspamd_lru_grow (seg);
+	}
+
+	/* Elements could be moved by removal */
+	i = rspamd_lru_find (hash, seg, key, hv);
+	res = &seg->elts[i];
+	res->key = key;
+	res->data = value;
+	res->hv = hv;
+	res->store_time = now;
+	res->ttl = ttl;
+	res->used = FALSE;
+	seg->nelts ++;
+
+	rspamd_lru_unlock (seg);
+}
+
+void
+rspamd_lru_hash_remove (rspamd_lru_hash_t *hash, gconstpointer key)
+{
+	struct rspamd_lru_segment *seg;
+	guint hv, i;
+
+	hv = hash->hfunc (key);
+	seg = rspamd_lru_segment (hash, hv);
+	rspamd_lru_lock (seg);
+	i = rspamd_lru_find (hash, seg, key, hv);
+
+	if (seg->elts[i].key != NULL) {
+		rspamd_lru_remove (hash, seg, i);
+	}
+
+	rspamd_lru_unlock (seg);
+}
+
+void
+rspamd_lru_hash_destroy (rspamd_lru_hash_t *hash)
+{
+	struct rspamd_lru_segment *seg;
+	guint i, j;
+
+	for (i = 0; i < hash->nsegs; i ++) {
+		seg = &hash->segs[i];
+
+		for (j = 0; j <= seg->mask; j ++) {
+			if (seg->elts[j].key != NULL) {
+				if (hash->key_destroy) {
+					hash->key_destroy (seg->elts[j].key);
+				}
+				if (hash->value_destroy) {
+					hash->value_destroy (seg->elts[j].data);
 				}
 			}
-			if (removed == 0) {
-				/* Just unlink the element at the head */
-				res = (rspamd_lru_element_t *)hash->exp->head->data;
-				g_hash_table_remove (hash->tbl, res->key);
+		}
+
+		if (seg->mtx) {
+			rspamd_mutex_free (seg->mtx);
+		}
+
+		g_free (seg->elts);
+	}
+
+	g_free (hash->segs);
+	g_slice_free1 (sizeof (rspamd_lru_hash_t), hash);
+}
+
+/**
+ * Pool hashing
+ */
+
+struct rspamd_pool_hash_elt {
+	gpointer key;
+	gpointer value;
+	guint hv;
+};
+
+struct rspamd_pool_hash_s {
+	rspamd_mempool_t *pool;
+	GHashFunc hfunc;
+	GEqualFunc eqfunc;
+	struct rspamd_pool_hash_elt *elts;
+	guint mask;
+	guint nelts;
+};
+
+static struct rspamd_pool_hash_elt *
+rspamd_pool_hash_find (rspamd_pool_hash_t *hash, gconstpointer key, guint hv)
+{
+	struct rspamd_pool_hash_elt *elt;
+	guint i = hv & hash->mask;
+
+	/* Load factor is kept below 3/4, so there is always an empty slot */
+	for (;;) {
+		elt = &hash->elts[i];
+
+		if (elt->key == NULL ||
+				(elt->hv == hv && hash->eqfunc (elt->key, key))) {
+			return elt;
+		}
+
+		i = (i + 1) & hash->mask;
+	}
+}
+
+static void
+rspamd_pool_hash_grow (rspamd_pool_hash_t *hash)
+{
+	struct rspamd_pool_hash_elt *old = hash->elts, *elt;
+	guint i, oldsize = hash->mask + 1;
+
+	/* Old storage is released with the pool */
+	hash->mask = oldsize * 2 - 1;
+	hash->elts = rspamd_mempool_alloc0 (hash->pool,
+			sizeof (*hash->elts) * (hash->mask + 1));
+
+	for (i = 0; i < oldsize; i ++) {
+		if (old[i].key != NULL) {
+			elt = &hash->elts[old[i].hv & hash->mask];
+
+			while (elt->key != NULL) {
+				elt = &hash->elts[(elt - hash->elts + 1) & hash->mask];
 			}
+
+			*elt = old[i];
 		}
 	}
+}
+
+rspamd_pool_hash_t *
+rspamd_pool_hash_new (rspamd_mempool_t *pool,
+	GHashFunc hfunc,
+	GEqualFunc eqfunc,
+	guint size_hint)
+{
+	rspamd_pool_hash_t *hash;
+	guint size = 8;
+
+	while (size < size_hint + size_hint / 3 + 1) {
+		size *= 2;
+	}
+
+	hash = rspamd_mempool_alloc (pool, sizeof (*hash));
+	hash->pool = pool;
+	hash->hfunc = hfunc;
+	hash->eqfunc = eqfunc;
+	hash->mask = size - 1;
+	hash->nelts = 0;
+	hash->elts = rspamd_mempool_alloc0 (pool, sizeof (*hash->elts) * size);
+
+	return hash;
+}
 
-	res = rspamd_lru_create_node (hash, key, value, now, ttl);
-	g_hash_table_insert (hash->tbl, key, res);
-	g_queue_push_tail (hash->exp, res);
-	res->link = hash->exp->tail;
+gpointer
+rspamd_pool_hash_lookup (rspamd_pool_hash_t *hash, gconstpointer key)
+{
+	struct rspamd_pool_hash_elt *elt;
+
+	elt = rspamd_pool_hash_find (hash, key, hash->hfunc (key));
+
+	return elt->key != NULL ? elt->value : NULL;
 }
 
 void
-rspamd_lru_hash_destroy (rspamd_lru_hash_t *hash)
+rspamd_pool_hash_insert (rspamd_pool_hash_t *hash,
+	gpointer key,
+	gpointer value)
 {
-	g_hash_table_unref (hash->tbl);
-	g_queue_free (hash->exp);
-	g_slice_free1 (sizeof (rspamd_lru_hash_t), hash);
+	struct rspamd_pool_hash_elt *elt;
+	guint hv;
+
+	g_assert (key != NULL);
+
+	hv = hash->hfunc (key);
+	elt = rspamd_pool_hash_find (hash, key, hv);
+
+	if (elt->key != NULL) {
+		elt->value = value;
+		return;
+	}
+
+	elt->key = key;
+	elt->value = value;
+	elt->hv = hv;
+
+	if (++hash->nelts * 4 >= (hash->mask + 1) * 3) {
+		rspamd_pool_hash_grow (hash);
+	}
+}
+
+guint
+rspamd_pool_hash_size (rspamd_pool_hash_t *hash)
+{
+	return hash->nelts;
 }
 
 /*
@@ -8,10 +8,14 @@
 #define RSPAMD_HASH_H
 
 #include "config.h"
+#include "mem_pool.h"
 
 struct rspamd_lru_hash_s;
 typedef struct rspamd_lru_hash_s rspamd_lru_hash_t;
 
+struct rspamd_pool_hash_s;
+typedef struct rspamd_pool_hash_s rspamd_pool_hash_t;
+
 /**
  * Create new lru hash
  * @param maxsize maximum elements in a hash
@@ -43,11 +47,33 @@ rspamd_lru_hash_t * rspamd_lru_hash_new_full (
 	GHashFunc hfunc,
 	GEqualFunc eqfunc);
 
+/**
+ * Create new lru hash that can be used by several threads, the hash is split
+ * into segments with their own locks
+ * @param maxsize maximum elements in a hash
+ * @param maxage maximum age of elemnt
+ * @param value_ref function that returns a new reference of value, it is
+ * called by lookup under lock, so a value cannot be destroyed by another
+ * thread while it is used
+ * @param hash_func pointer to hash function
+ * @param key_equal_func pointer to function for comparing keys
+ * @return new rspamd_hash object
+ */
+rspamd_lru_hash_t * rspamd_lru_hash_new_concurrent (
+	gint maxsize,
+	gint maxage,
+	GDestroyNotify key_destroy,
+	GDestroyNotify value_destroy,
+	GBoxedCopyFunc value_ref,
+	GHashFunc hfunc,
+	GEqualFunc eqfunc);
+
 /**
  * Lookup item from hash
  * @param hash hash object
  * @param key key to find
- * @return value of key or NULL if key is not found
+ * @return value of key or NULL if key is not found, for concurrent hashes it
+ * is a new reference that should be released by caller
  */
 gpointer rspamd_lru_hash_lookup (rspamd_lru_hash_t *hash,
 	gconstpointer key,
@@ -64,6 +90,14 @@ void rspamd_lru_hash_insert (rspamd_lru_hash_t *hash,
 	time_t now,
 	guint ttl);
 
+/**
+ * Remove item from hash
+ * @param hash hash object
+ * @param key key to remove
+ */
+void rspamd_lru_hash_remove (rspamd_lru_hash_t *hash,
+	gconstpointer key);
+
 /**
  * Remove lru hash
  * @param hash hash object
@@ -71,6 +105,47 @@ void rspamd_lru_hash_insert (rspamd_lru_hash_t *hash,
 
 void rspamd_lru_hash_destroy (rspamd_lru_hash_t *hash);
 
+/**
+ * Create new open addressing hash allocated from a memory pool, elements can
+ * not be removed and the whole hash is freed with the pool
+ * @param pool memory pool
+ * @param hfunc pointer to hash function
+ * @param eqfunc pointer to function for comparing keys
+ * @param size_hint expected number of elements
+ * @return new hash object
+ */
+rspamd_pool_hash_t * rspamd_pool_hash_new (rspamd_mempool_t *pool,
+	GHashFunc hfunc,
+	GEqualFunc eqfunc,
+	guint size_hint);
+
+/**
+ * Lookup item from pool hash
+ * @param hash hash object
+ * @param key key to find
+ * @return value of key or NULL if key is not found
+ */
+gpointer rspamd_pool_hash_lookup (rspamd_pool_hash_t *hash,
+	gconstpointer key);
+
+/**
+ * Insert item in pool hash replacing the value of an existing key, key
+ * must not be NULL
+ * @param hash hash object
+ * @param key key to insert
+ * @param value value of key
+ */
+void rspamd_pool_hash_insert (rspamd_pool_hash_t *hash,
+	gpointer key,
+	gpointer value);
+
+/**
+ * Get number of elements in pool hash
+ * @param hash hash object
+ * @return number of elements
+ */
+guint rspamd_pool_hash_size (rspamd_pool_hash_t *hash);
+
 #endif
 
 /*
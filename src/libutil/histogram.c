@@ -0,0 +1,170 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "histogram.h"
+#include "printf.h"
+
+#define SUB_BUCKETS (1 << RSPAMD_HISTOGRAM_SUB_BITS)
+
+static inline guint
+rspamd_histogram_index (guint64 value)
+{
+	guint msb, idx;
+
+	if (value < SUB_BUCKETS) {
+		return value;
+	}
+
+	msb = 63 - __builtin_clzll (value);
+
+	if (msb >= RSPAMD_HISTOGRAM_MAX_BITS) {
+		return RSPAMD_HISTOGRAM_BUCKETS - 1;
+	}
+
+	/* The first bits after msb select the sub bucket */
+	idx = (msb - RSPAMD_HISTOGRAM_SUB_BITS + 1) * SUB_BUCKETS +
+			((value >> (msb - RSPAMD_HISTOGRAM_SUB_BITS)) & (SUB_BUCKETS - 1));
+
+	return idx;
+}
+
+guint64
+rspamd_histogram_bucket_low (guint idx)
+{
+	guint shift;
+
+	if (idx < SUB_BUCKETS) {
+		return idx;
+	}
+
+	shift = idx / SUB_BUCKETS - 1;
+
+	return (guint64)(SUB_BUCKETS + idx % SUB_BUCKETS) << shift;
+}
+
+void
+rspamd_histogram_add (struct rspamd_histogram *h, guint64 value)
+{
+	h->buckets[rspamd_histogram_index (value)] ++;
+	h->count ++;
+	h->sum += value;
+
+	if (value > h->max) {
+		h->max = value;
+	}
+}
+
+void
+rspamd_histogram_merge (struct rspamd_histogram *dst,
+		const struct rspamd_histogram *src)
+{
+	guint i;
+
+	for (i = 0; i < RSPAMD_HISTOGRAM_BUCKETS; i ++) {
+		dst->buckets[i] += src->buckets[i];
+	}
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+
+	if (src->max > dst->max) {
+		dst->max = src->max;
+	}
+}
+
+void
+rspamd_histogram_reset (struct rspamd_histogram *h)
+{
+	memset (h, 0, sizeof (*h));
+}
+
+guint64
+rspamd_histogram_percentile (const struct rspamd_histogram *h, gdouble q)
+{
+	guint64 target, seen = 0;
+	guint i;
+
+	if (h->count == 0) {
+		return 0;
+	}
+
+	target = (guint64)(h->count * q / 100.0);
+
+	if (target == 0) {
+		target = 1;
+	}
+
+	for (i = 0; i < RSPAMD_HISTOGRAM_BUCKETS; i ++) {
+		seen += h->buckets[i];
+
+		if (seen >= target) {
+			if (i == RSPAMD_HISTOGRAM_BUCKETS - 1) {
+				return h->max;
+			}
+
+			return MIN (rspamd_histogram_bucket_low (i + 1), h->max);
+		}
+	}
+
+	return h->max;
+}
+
+void
+rspamd_histogram_write_prometheus (GString *out, const gchar *name,
+		const gchar *labels, const struct rspamd_histogram *h)
+{
+	guint64 cumulative = 0;
+	guint i;
+	const gchar *sep = (labels && *labels) ? "," : "";
+
+	if (labels == NULL) {
+		labels = "";
+	}
+
+	for (i = 0; i < RSPAMD_HISTOGRAM_BUCKETS; i ++) {
+		cumulative += h->buckets[i];
+
+		/* Emit a bucket at each power of 2 boundary */
+		if ((i + 1) % SUB_BUCKETS == 0 && i != RSPAMD_HISTOGRAM_BUCKETS - 1) {
+			rspamd_printf_gstring (out, "%s_bucket{%s%sle=\"%.6f\"} %uL\n",
+					name, labels, sep,
+					rspamd_histogram_bucket_low (i + 1) / 1000000.0,
+					cumulative);
+		}
+	}
+
+	rspamd_printf_gstring (out, "%s_bucket{%s%sle=\"+Inf\"} %uL\n",
+			name, labels, sep, h->count);
+
+	if (*labels) {
+		rspamd_printf_gstring (out, "%s_sum{%s} %.6f\n", name, labels,
+				h->sum / 1000000.0);
+		rspamd_printf_gstring (out, "%s_count{%s} %uL\n", name, labels,
+				h->count);
+	}
+	else {
+		rspamd_printf_gstring (out, "%s_sum %.6f\n", name, h->sum / 1000000.0);
+		rspamd_printf_gstring (out, "%s_count %uL\n", name, h->count);
+	}
+}
@@ -0,0 +1,93 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include "config.h"
+
+/*
+ * Values below 2^RSPAMD_HISTOGRAM_SUB_BITS are counted exactly, larger values
+ * are counted in log-linear buckets: each power of 2 is split into
+ * 2^RSPAMD_HISTOGRAM_SUB_BITS buckets, so relative error is below 12.5%
+ */
+#define RSPAMD_HISTOGRAM_SUB_BITS 3
+#define RSPAMD_HISTOGRAM_MAX_BITS 32
+#define RSPAMD_HISTOGRAM_BUCKETS \
+	((RSPAMD_HISTOGRAM_MAX_BITS - RSPAMD_HISTOGRAM_SUB_BITS + 1) << \
+	RSPAMD_HISTOGRAM_SUB_BITS)
+
+/*
+ * Latency histogram, values are in microseconds. It has a fixed size and no
+ * pointers, so it can be placed in shared memory
+ */
+struct rspamd_histogram {
+	guint64 count;                          /**< number of values			*/
+	guint64 sum;                            /**< sum of all values			*/
+	guint64 max;                            /**< maximum value				*/
+	guint64 buckets[RSPAMD_HISTOGRAM_BUCKETS];
+};
+
+/*
+ * Add value to histogram
+ * @param h histogram
+ * @param value value in microseconds
+ */
+void rspamd_histogram_add (struct rspamd_histogram *h, guint64 value);
+
+/*
+ * Add all values of src histogram to dst histogram
+ */
+void rspamd_histogram_merge (struct rspamd_histogram *dst,
+		const struct rspamd_histogram *src);
+
+/*
+ * Remove all values from histogram
+ */
+void rspamd_histogram_reset (struct rspamd_histogram *h);
+
+/*
+ * Get the lowest value that is counted by a bucket
+ */
+guint64 rspamd_histogram_bucket_low (guint idx);
+
+/*
+ * Get estimation of a percentile value
+ * @param h histogram
+ * @param q percentile from 0 to 100
+ * @return upper bound of the bucket that contains the percentile
+ */
+guint64 rspamd_histogram_percentile (const struct rspamd_histogram *h,
+		gdouble q);
+
+/*
+ * Write histogram in Prometheus text format, buckets are merged to powers of 2
+ * and values are written in seconds
+ * @param out output string
+ * @param name metric name
+ * @param labels labels without braces, e.g. `stage="read"`, or NULL
+ * @param h histogram
+ */
+void rspamd_histogram_write_prometheus (GString *out, const gchar *name,
+		const gchar *labels, const struct rspamd_histogram *h);
+
+#endif /* HISTOGRAM_H_ */
@@ -33,6 +33,12 @@
 #include "keypair_private.h"
 #include "cryptobox.h"
 #include <limits.h>
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#define msg_debug_http(...) msg_debug_module (RSPAMD_LOG_MODULE_HTTP, \
+		__VA_ARGS__)
 
 #define ENCRYPTED_VERSION " HTTP/1.0"
 
@@ -43,6 +49,7 @@ struct rspamd_http_connection_private {
 	} *buf;
 	gboolean new_header;
 	gboolean encrypted;
+	gboolean accept_gzip;
 	gpointer peer_key;
 	struct rspamd_http_keypair *local_key;
 	struct rspamd_http_header *header;
@@ -56,6 +63,7 @@ struct rspamd_http_connection_private {
 	guint outlen;
 	gsize wr_pos;
 	gsize wr_total;
+	GString *pending;
 };
 
 enum http_magic_type {
@@ -70,20 +78,49 @@ enum http_magic_type {
 static const struct _rspamd_http_magic {
 	const gchar *ext;
 	const gchar *ct;
+	gboolean compress;
 } http_file_types[] = {
-	[HTTP_MAGIC_PLAIN] = { "txt", "text/plain" },
-	[HTTP_MAGIC_HTML] = { "html", "text/html" },
-	[HTTP_MAGIC_CSS] = { "css", "text/css" },
-	[HTTP_MAGIC_JS] = { "js", "application/javascript" },
-	[HTTP_MAGIC_PNG] = { "png", "image/png" },
-	[HTTP_MAGIC_JPG] = { "jpg", "image/jpeg" },
+	[HTTP_MAGIC_PLAIN] = { "txt", "text/plain", TRUE },
+	[HTTP_MAGIC_HTML] = { "html", "text/html", TRUE },
+	[HTTP_MAGIC_CSS] = { "css", "text/css", TRUE },
+	[HTTP_MAGIC_JS] = { "js", "application/javascript", TRUE },
+	[HTTP_MAGIC_PNG] = { "png", "image/png", FALSE },
+	[HTTP_MAGIC_JPG] = { "jpg", "image/jpeg", FALSE },
+};
+
+/* Static files larger than this are read on each request */
+#define RSPAMD_HTTP_FILE_CACHE_MAX_FILE (1024 * 1024)
+/* Total size of static files cached by a router */
+#define RSPAMD_HTTP_FILE_CACHE_MAX (16 * 1024 * 1024)
+/* Static files are compressed once, so use the best compression */
+#define RSPAMD_HTTP_GZIP_FILE_LEVEL 9
+/* Replies are compressed for each request */
+#define RSPAMD_HTTP_GZIP_REPLY_LEVEL 1
+/* Smaller replies are not compressed */
+#define RSPAMD_HTTP_GZIP_REPLY_MIN 4096
+
+/*
+ * Static file served by a router, it is valid while the file's inode, size and
+ * modification time are the same
+ */
+struct rspamd_http_file {
+	gchar *data;
+	gsize len;
+	gchar *gz_data;
+	gsize gz_len;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	gboolean cached;
+	gchar etag[64];
 };
 
 static const gchar *http_week[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
 static const gchar *http_month[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
 							   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
-static const gchar *key_header = "Key";
-static const gchar *date_header = "Date";
+static const gchar key_header[] = "Key";
+static const gchar date_header[] = "Date";
+static const gchar accept_encoding_header[] = "Accept-Encoding";
 
 #define RSPAMD_HTTP_KEY_ID_LEN 5
 
@@ -122,6 +159,9 @@ rspamd_http_code_to_str (gint code)
 	else if (code == 404) {
 		return "Not found";
 	}
+	else if (code == 304) {
+		return "Not Modified";
+	}
 	else if (code == 403 || code == 401) {
 		return "Not authorized";
 	}
@@ -455,15 +495,113 @@ static inline void
 rspamd_http_check_special_header (struct rspamd_http_connection *conn,
 		struct rspamd_http_connection_private *priv)
 {
-	if (g_ascii_strncasecmp (priv->header->name->str, date_header,
-			priv->header->name->len) == 0) {
+	const GString *name = priv->header->name;
+
+	/* Most of headers are not special, so compare lengths first */
+	if (name->len == sizeof (date_header) - 1 &&
+			g_ascii_strncasecmp (name->str, date_header, name->len) == 0) {
 		priv->msg->date = rspamd_http_parse_date (priv->header->value->str,
 				priv->header->value->len);
 	}
-	else if (g_ascii_strncasecmp (priv->header->name->str, key_header,
-			priv->header->name->len) == 0) {
+	else if (name->len == sizeof (key_header) - 1 &&
+			g_ascii_strncasecmp (name->str, key_header, name->len) == 0) {
 		rspamd_http_parse_key (priv->header->value, conn, priv);
 	}
+	else if (name->len == sizeof (accept_encoding_header) - 1 &&
+			g_ascii_strncasecmp (name->str, accept_encoding_header,
+					name->len) == 0) {
+		/* Used for the reply to this request */
+		priv->accept_gzip = g_strstr_len (priv->header->value->str,
+				priv->header->value->len, "gzip") != NULL;
+	}
+}
+
+/*
+ * Compress data to gzip format, returns NULL if compression is not available
+ * or the result is not smaller than the data
+ */
+static gchar *
+rspamd_http_gzip (const gchar *in, gsize len, gint level, gsize *outlen)
+{
+#ifdef WITH_ZLIB
+	z_stream strm;
+	gchar *out;
+	gsize bound;
+
+	memset (&strm, 0, sizeof (strm));
+
+	/* 31 bits window means gzip format */
+	if (deflateInit2 (&strm, level, Z_DEFLATED, 31, 8,
+			Z_DEFAULT_STRATEGY) != Z_OK) {
+		return NULL;
+	}
+
+	bound = deflateBound (&strm, len);
+	out = g_malloc (bound);
+	strm.next_in = (guchar *)in;
+	strm.avail_in = len;
+	strm.next_out = (guchar *)out;
+	strm.avail_out = bound;
+
+	if (deflate (&strm, Z_FINISH) != Z_STREAM_END || strm.total_out >= len) {
+		/* Compression is useless */
+		g_free (out);
+		out = NULL;
+	}
+	else {
+		*outlen = strm.total_out;
+	}
+
+	deflateEnd (&strm);
+
+	return out;
+#else
+	return NULL;
+#endif
+}
+
+/*
+ * Header with its name and value slices allocated as a single chunk
+ */
+struct rspamd_http_header_chunk {
+	struct rspamd_http_header hdr;
+	GString name;
+	GString value;
+};
+
+static struct rspamd_http_header *
+rspamd_http_header_new (gsize len)
+{
+	struct rspamd_http_header_chunk *chunk;
+
+	chunk = g_slice_alloc0 (sizeof (*chunk));
+	chunk->hdr.name = &chunk->name;
+	chunk->hdr.value = &chunk->value;
+	chunk->hdr.combined = g_string_sized_new (len);
+
+	return &chunk->hdr;
+}
+
+static void
+rspamd_http_header_free (struct rspamd_http_header *hdr)
+{
+	g_string_free (hdr->combined, TRUE);
+	g_slice_free1 (sizeof (struct rspamd_http_header_chunk), hdr);
+}
+
+/* Set name and value slices of the current header and add it to a message */
+static void
+rspamd_http_finish_header (struct rspamd_http_connection *conn,
+		struct rspamd_http_connection_private *priv)
+{
+	g_string_append_len (priv->header->combined, "\r\n", 2);
+	priv->header->value->str = priv->header->combined->str +
+			priv->header->name->len + 2;
+	priv->header->value->len = priv->header->combined->len -
+			priv->header->name->len - 4;
+	DL_APPEND (priv->msg->headers, priv->header);
+	rspamd_http_check_special_header (conn, priv);
+	priv->header = NULL;
 }
 
 static gint
@@ -510,24 +648,12 @@ rspamd_http_on_header_field (http_parser * parser,
 
 	priv = conn->priv;
 
+	if (priv->header != NULL && priv->new_header) {
+		rspamd_http_finish_header (conn, priv);
+	}
+
 	if (priv->header == NULL) {
-		priv->header = g_slice_alloc (sizeof (struct rspamd_http_header));
-		priv->header->name = g_slice_alloc0 (sizeof (GString));
-		priv->header->value = g_slice_alloc0 (sizeof (GString));
-		priv->header->combined = g_string_sized_new (64);
-	}
-	else if (priv->new_header) {
-		g_string_append_len (priv->header->combined, "\r\n", 2);
-		priv->header->value->len = priv->header->combined->len -
-				priv->header->name->len - 4;
-		priv->header->value->str = priv->header->combined->str +
-				priv->header->name->len + 2;
-		DL_APPEND (priv->msg->headers, priv->header);
-		rspamd_http_check_special_header (conn, priv);
-		priv->header = g_slice_alloc (sizeof (struct rspamd_http_header));
-		priv->header->name = g_slice_alloc0 (sizeof (GString));
-		priv->header->value = g_slice_alloc0 (sizeof (GString));
-		priv->header->combined = g_string_sized_new (64);
+		priv->header = rspamd_http_header_new (MAX (length + 4, 64));
 	}
 
 	priv->new_header = FALSE;
@@ -574,14 +700,7 @@ rspamd_http_on_headers_complete (http_parser * parser)
 	priv = conn->priv;
 
 	if (priv->header != NULL) {
-		g_string_append_len (priv->header->combined, "\r\n", 2);
-		priv->header->value->str = priv->header->combined->str +
-			priv->header->name->len + 2;
-		priv->header->value->len = priv->header->combined->len -
-			priv->header->name->len - 4;
-		DL_APPEND (priv->msg->headers, priv->header);
-		rspamd_http_check_special_header (conn, priv);
-		priv->header = NULL;
+		rspamd_http_finish_header (conn, priv);
 		priv->new_header = FALSE;
 	}
 
@@ -596,6 +715,10 @@ rspamd_http_on_headers_complete (http_parser * parser)
 		priv->msg->flags |= RSPAMD_HTTP_FLAG_SPAMC;
 	}
 
+	if ((conn->opts & RSPAMD_HTTP_KEEP_ALIVE) && http_should_keep_alive (parser)) {
+		priv->msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+	}
+
 	priv->msg->body_buf.str = priv->msg->body->str;
 	priv->msg->method = parser->method;
 	priv->msg->code = parser->status_code;
@@ -632,14 +755,7 @@ rspamd_http_on_body_decrypted (http_parser * parser, const gchar *at, size_t len
 	priv = conn->priv;
 
 	if (priv->header != NULL) {
-		g_string_append_len (priv->header->combined, "\r\n", 2);
-		priv->header->value->str = priv->header->combined->str +
-				priv->header->name->len + 2;
-		priv->header->value->len = priv->header->combined->len -
-				priv->header->name->len - 4;
-		DL_APPEND (priv->msg->headers, priv->header);
-		rspamd_http_check_special_header (conn, priv);
-		priv->header = NULL;
+		rspamd_http_finish_header (conn, priv);
 	}
 
 	if (priv->msg->body->str == 0) {
@@ -689,10 +805,7 @@ rspamd_http_decrypt_message (struct rspamd_http_connection *conn,
 
 	/* Cleanup message */
 	DL_FOREACH_SAFE (msg->headers, hdr, hdrtmp) {
-		g_string_free (hdr->combined, TRUE);
-		g_slice_free1 (sizeof (GString), hdr->name);
-		g_slice_free1 (sizeof (GString), hdr->value);
-		g_slice_free1 (sizeof (struct rspamd_http_header), hdr);
+		rspamd_http_header_free (hdr);
 	}
 	msg->headers = NULL;
 	if (msg->url != NULL) {
@@ -779,11 +892,35 @@ rspamd_http_on_message_complete (http_parser * parser)
 		ret = conn->finish_handler (conn, priv->msg);
 		conn->finished = TRUE;
 		rspamd_http_connection_unref (conn);
+
+		if (conn->opts & RSPAMD_HTTP_KEEP_ALIVE) {
+			/* Stop here and leave pipelined data for the next message */
+			http_parser_pause (parser, 1);
+		}
 	}
 
 	return ret;
 }
 
+static void
+rspamd_http_connection_keep_pending (struct rspamd_http_connection *conn,
+	const gchar *data, gsize len)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+
+	if (priv->pending == NULL) {
+		priv->pending = g_string_sized_new (len);
+	}
+
+	/* Data that is not parsed yet goes before the rest of pending data */
+	g_string_prepend_len (priv->pending, data, len);
+
+	if (event_pending (&priv->ev, EV_READ, NULL)) {
+		/* Reading of the next message has been already started */
+		event_active (&priv->ev, EV_READ, 0);
+	}
+}
+
 static void
 rspamd_http_simple_client_helper (struct rspamd_http_connection *conn)
 {
@@ -890,6 +1027,7 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 	struct _rspamd_http_privbuf *pbuf;
 	GString *buf;
 	gssize r;
+	gsize nparsed;
 	GError *err;
 
 	priv = conn->priv;
@@ -899,7 +1037,15 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 	buf = priv->buf->data;
 
 	if (what == EV_READ) {
-		r = read (fd, buf->str, buf->allocated_len);
+		if (priv->pending != NULL && priv->pending->len > 0) {
+			/* Process pipelined data first */
+			r = MIN (priv->pending->len, buf->allocated_len);
+			memcpy (buf->str, priv->pending->str, r);
+			g_string_erase (priv->pending, 0, r);
+		}
+		else {
+			r = read (fd, buf->str, buf->allocated_len);
+		}
 		if (r == -1) {
 			err = g_error_new (HTTP_ERROR,
 					errno,
@@ -930,9 +1076,19 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 		}
 		else {
 			buf->len = r;
+			nparsed = http_parser_execute (&priv->parser, &priv->parser_cb,
+					buf->str, r);
 
-			if (http_parser_execute (&priv->parser, &priv->parser_cb, buf->str,
-				r) != (size_t)r || priv->parser.http_errno != 0) {
+			if (priv->parser.http_errno == HPE_PAUSED) {
+				/* Message is complete, the rest belongs to the next one */
+				http_parser_pause (&priv->parser, 0);
+
+				if (nparsed < (gsize)r) {
+					rspamd_http_connection_keep_pending (conn,
+							buf->str + nparsed, r - nparsed);
+				}
+			}
+			else if (nparsed != (gsize)r || priv->parser.http_errno != 0) {
 				err = g_error_new (HTTP_ERROR, priv->parser.http_errno,
 						"HTTP parser error: %s",
 						http_errno_description (priv->parser.http_errno));
@@ -944,6 +1100,10 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 
 				return;
 			}
+			else if (priv->pending != NULL && priv->pending->len > 0) {
+				/* Message continues in pipelined data */
+				event_active (&priv->ev, EV_READ, 0);
+			}
 		}
 	}
 	else if (what == EV_TIMEOUT) {
@@ -1091,6 +1251,9 @@ rspamd_http_connection_free (struct rspamd_http_connection *conn)
 			peer_key = (struct rspamd_http_keypair *)priv->peer_key;
 			REF_RELEASE (peer_key);
 		}
+		if (priv->pending) {
+			g_string_free (priv->pending, TRUE);
+		}
 
 		g_slice_free1 (sizeof (struct rspamd_http_connection_private), priv);
 	}
@@ -1140,6 +1303,11 @@ rspamd_http_connection_read_message (struct rspamd_http_connection *conn,
 		event_base_set (base, &priv->ev);
 	}
 	event_add (&priv->ev, priv->ptv);
+
+	if (priv->pending != NULL && priv->pending->len > 0) {
+		/* We have pipelined data read with the previous message */
+		event_active (&priv->ev, EV_READ, 0);
+	}
 }
 
 static void
@@ -1245,6 +1413,37 @@ rspamd_http_connection_encrypt_message (
 	g_free (segments);
 }
 
+/* Compress a large reply if the client accepts gzip */
+static void
+rspamd_http_message_gzip_body (struct rspamd_http_message *msg,
+	const gchar *mime_type)
+{
+	gchar *gz;
+	gsize gzlen;
+
+	if (msg->body == NULL || msg->body->len < RSPAMD_HTTP_GZIP_REPLY_MIN ||
+			msg->method >= HTTP_SYMBOLS) {
+		return;
+	}
+
+	if ((mime_type != NULL && g_ascii_strncasecmp (mime_type, "image/", 6) == 0)
+			|| rspamd_http_message_find_header (msg, "Content-Encoding")) {
+		/* Already compressed */
+		return;
+	}
+
+	gz = rspamd_http_gzip (msg->body->str, msg->body->len,
+			RSPAMD_HTTP_GZIP_REPLY_LEVEL, &gzlen);
+
+	if (gz != NULL) {
+		/* Compressed data is smaller, so the body is not reallocated */
+		g_string_truncate (msg->body, 0);
+		g_string_append_len (msg->body, gz, gzlen);
+		g_free (gz);
+		rspamd_http_message_add_header (msg, "Content-Encoding", "gzip");
+	}
+}
+
 void
 rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg, const gchar *host, const gchar *mime_type,
@@ -1263,11 +1462,23 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 		id[BLAKE2B_OUTBYTES];
 	guchar *np = NULL, *mp = NULL, *meth_pos = NULL;
 	struct rspamd_http_keypair *peer_key = NULL;
+	const gchar *conn_type = "close";
 
 	conn->fd = fd;
 	conn->ud = ud;
 	priv->msg = msg;
 
+	if (conn->type == RSPAMD_HTTP_SERVER && priv->accept_gzip) {
+		/* Reply is compressed before it is encrypted */
+		rspamd_http_message_gzip_body (msg, mime_type);
+	}
+
+	priv->accept_gzip = FALSE;
+
+	if (msg->flags & RSPAMD_HTTP_FLAG_KEEP_ALIVE) {
+		conn_type = "keep-alive";
+	}
+
 	if (timeout == NULL) {
 		priv->ptv = NULL;
 	}
@@ -1423,7 +1634,7 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 				/* Internal reply (encrypted) */
 				meth_len = rspamd_snprintf (repbuf, sizeof (repbuf),
 						"HTTP/1.1 %d %s\r\n"
-						"Connection: close\r\n"
+						"Connection: %s\r\n"
 						"Server: %s\r\n"
 						"Date: %s\r\n"
 						"Content-Length: %z\r\n"
@@ -1431,6 +1642,7 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 						msg->code,
 						msg->status ? msg->status->str :
 								rspamd_http_code_to_str (msg->code),
+						conn_type,
 						"rspamd/" RVERSION,
 						datebuf,
 						bodylen,
@@ -1438,17 +1650,18 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 				enclen += meth_len;
 				/* External reply */
 				rspamd_printf_gstring (buf, "HTTP/1.1 200 OK\r\n"
-						"Connection: close\r\n"
+						"Connection: %s\r\n"
 						"Server: rspamd\r\n"
 						"Date: %s\r\n"
 						"Content-Length: %z\r\n"
 						"Content-Type: application/octet-stream\r\n",
+						conn_type,
 						datebuf,
 						enclen);
 			}
 			else {
 				rspamd_printf_gstring (buf, "HTTP/1.1 %d %s\r\n"
-						"Connection: close\r\n"
+						"Connection: %s\r\n"
 						"Server: %s\r\n"
 						"Date: %s\r\n"
 						"Content-Length: %z\r\n"
@@ -1456,6 +1669,7 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 						msg->code,
 						msg->status ? msg->status->str :
 							rspamd_http_code_to_str (msg->code),
+						conn_type,
 						"rspamd/" RVERSION,
 						datebuf,
 						bodylen,
@@ -1492,25 +1706,31 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 					msg->url->str,
 					bodylen);
 			}
+			/* HTTP/1.0 connections are closed unless asked explicitly */
+			if (msg->flags & RSPAMD_HTTP_FLAG_KEEP_ALIVE) {
+				rspamd_printf_gstring (buf, "Connection: keep-alive\r\n");
+			}
 		}
 		else {
 			if (encrypted) {
 				rspamd_printf_gstring (buf, "%s %s HTTP/1.1\r\n"
-						"Connection: close\r\n"
+						"Connection: %s\r\n"
 						"Host: %s\r\n"
 						"Content-Length: %z\r\n",
 						"POST",
 						"/post",
+						conn_type,
 						host != NULL ? host : msg->host->str,
 						enclen);
 			}
 			else {
 				rspamd_printf_gstring (buf, "%s %s HTTP/1.1\r\n"
-						"Connection: close\r\n"
+						"Connection: %s\r\n"
 						"Host: %s\r\n"
 						"Content-Length: %z\r\n",
 						http_method_str (msg->method),
 						msg->url->str,
+						conn_type,
 						host != NULL ? host : msg->host->str,
 						bodylen);
 			}
@@ -1692,10 +1912,7 @@ rspamd_http_message_free (struct rspamd_http_message *msg)
 
 	LL_FOREACH_SAFE (msg->headers, hdr, tmp_hdr)
 	{
-		g_string_free (hdr->combined, TRUE);
-		g_slice_free1 (sizeof (GString), hdr->name);
-		g_slice_free1 (sizeof (GString), hdr->value);
-		g_slice_free1 (sizeof (struct rspamd_http_header), hdr);
+		rspamd_http_header_free (hdr);
 	}
 	if (msg->body != NULL) {
 		g_string_free (msg->body, FALSE);
@@ -1725,13 +1942,10 @@ rspamd_http_message_add_header (struct rspamd_http_message *msg,
 	guint nlen, vlen;
 
 	if (msg != NULL && name != NULL && value != NULL) {
-		hdr = g_slice_alloc (sizeof (struct rspamd_http_header));
 		nlen = strlen (name);
 		vlen = strlen (value);
-		hdr->combined = g_string_sized_new (nlen + vlen + 4);
+		hdr = rspamd_http_header_new (nlen + vlen + 4);
 		rspamd_printf_gstring (hdr->combined, "%s: %s\r\n", name, value);
-		hdr->value = g_slice_alloc (sizeof (GString));
-		hdr->name = g_slice_alloc (sizeof (GString));
 		hdr->name->str = hdr->combined->str;
 		hdr->name->len = nlen;
 		hdr->value->str = hdr->combined->str + nlen + 2;
@@ -1776,10 +1990,7 @@ gboolean rspamd_http_message_remove_header (struct rspamd_http_message *msg,
 				if (g_ascii_strncasecmp (hdr->name->str, name, slen) == 0) {
 					res = TRUE;
 					DL_DELETE (msg->headers, hdr);
-					g_string_free (hdr->combined, TRUE);
-					g_slice_free1 (sizeof (GString), hdr->value);
-					g_slice_free1 (sizeof (GString), hdr->name);
-					g_slice_free1 (sizeof (*hdr), hdr);
+					rspamd_http_header_free (hdr);
 				}
 			}
 		}
@@ -1843,25 +2054,101 @@ rspamd_http_router_error_handler (struct rspamd_http_connection *conn,
 	}
 }
 
-static const gchar *
-rspamd_http_router_detect_ct (const gchar *path)
+static const struct _rspamd_http_magic *
+rspamd_http_router_detect_type (const gchar *path)
 {
 	const gchar *dot;
 	guint i;
 
 	dot = strrchr (path, '.');
 	if (dot == NULL) {
-		return http_file_types[HTTP_MAGIC_PLAIN].ct;
+		return &http_file_types[HTTP_MAGIC_PLAIN];
 	}
 	dot++;
 
 	for (i = 0; i < G_N_ELEMENTS (http_file_types); i++) {
 		if (strcmp (http_file_types[i].ext, dot) == 0) {
-			return http_file_types[i].ct;
+			return &http_file_types[i];
+		}
+	}
+
+	return &http_file_types[HTTP_MAGIC_PLAIN];
+}
+
+static void
+rspamd_http_file_free (gpointer p)
+{
+	struct rspamd_http_file *file = p;
+
+	g_free (file->data);
+	g_free (file->gz_data);
+	g_slice_free1 (sizeof (*file), file);
+}
+
+/*
+ * Get contents of a static file from the cache of router or read it if the
+ * file has been changed
+ */
+static struct rspamd_http_file *
+rspamd_http_router_get_file (struct rspamd_http_connection_router *router,
+	const gchar *path, struct stat *st,
+	const struct _rspamd_http_magic *type)
+{
+	struct rspamd_http_file *file;
+	gint fd;
+
+	if (router->files == NULL) {
+		router->files = g_hash_table_new_full (g_str_hash, g_str_equal,
+				g_free, rspamd_http_file_free);
+	}
+
+	file = g_hash_table_lookup (router->files, path);
+
+	if (file != NULL) {
+		if (file->ino == st->st_ino && file->size == st->st_size &&
+				file->mtime == st->st_mtime) {
+			return file;
+		}
+
+		router->files_size -= file->len + file->gz_len;
+		g_hash_table_remove (router->files, path);
+	}
+
+	fd = open (path, O_RDONLY);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	file = g_slice_alloc0 (sizeof (*file));
+	file->data = g_malloc (st->st_size + 1);
+	file->len = st->st_size;
+
+	if (read (fd, file->data, st->st_size) != st->st_size) {
+		close (fd);
+		rspamd_http_file_free (file);
+		return NULL;
+	}
+
+	close (fd);
+	file->data[file->len] = '\0';
+	file->ino = st->st_ino;
+	file->size = st->st_size;
+	file->mtime = st->st_mtime;
+	rspamd_snprintf (file->etag, sizeof (file->etag), "\"%uxL-%uxL-%uxL\"",
+			(guint64)st->st_ino, (guint64)st->st_size, (guint64)st->st_mtime);
+
+	if (file->len <= RSPAMD_HTTP_FILE_CACHE_MAX_FILE &&
+			router->files_size + file->len <= RSPAMD_HTTP_FILE_CACHE_MAX) {
+		if (type->compress && file->len > 0) {
+			file->gz_data = rspamd_http_gzip (file->data, file->len,
+					RSPAMD_HTTP_GZIP_FILE_LEVEL, &file->gz_len);
 		}
+		file->cached = TRUE;
+		router->files_size += file->len + file->gz_len;
+		g_hash_table_insert (router->files, g_strdup (path), file);
 	}
 
-	return http_file_types[HTTP_MAGIC_PLAIN].ct;
+	return file;
 }
 
 static gboolean
@@ -1892,8 +2179,12 @@ rspamd_http_router_try_file (struct rspamd_http_connection_entry *entry,
 	struct rspamd_http_message *msg, gboolean expand_path)
 {
 	struct stat st;
-	gint fd;
 	gchar filebuf[PATH_MAX], realbuf[PATH_MAX], *dir;
+	const gchar *data;
+	gsize len;
+	const GString *hdr;
+	const struct _rspamd_http_magic *type;
+	struct rspamd_http_file *file;
 	struct rspamd_http_message *reply_msg;
 
 	rspamd_snprintf (filebuf, sizeof (filebuf), "%s%c%v",
@@ -1923,35 +2214,61 @@ rspamd_http_router_try_file (struct rspamd_http_connection_entry *entry,
 		return FALSE;
 	}
 
-	fd = open (realbuf, O_RDONLY);
-	if (fd == -1) {
+	type = rspamd_http_router_detect_type (realbuf);
+	file = rspamd_http_router_get_file (entry->rt, realbuf, &st, type);
+
+	if (file == NULL) {
 		return FALSE;
 	}
 
 	reply_msg = rspamd_http_new_message (HTTP_RESPONSE);
 	reply_msg->date = time (NULL);
 	reply_msg->code = 200;
+	hdr = rspamd_http_message_find_header (msg, "If-None-Match");
 
-	reply_msg->body = g_string_sized_new (st.st_size);
-	reply_msg->body->len = st.st_size;
-	reply_msg->body_buf.len = st.st_size;
-	reply_msg->body_buf.str = reply_msg->body->str;
+	if (hdr != NULL && hdr->len == strlen (file->etag) &&
+			memcmp (hdr->str, file->etag, hdr->len) == 0) {
+		reply_msg->code = 304;
+	}
+	else {
+		data = file->data;
+		len = file->len;
+
+		if (file->gz_data != NULL) {
+			hdr = rspamd_http_message_find_header (msg, "Accept-Encoding");
+
+			if (hdr != NULL &&
+					g_strstr_len (hdr->str, hdr->len, "gzip") != NULL) {
+				data = file->gz_data;
+				len = file->gz_len;
+				rspamd_http_message_add_header (reply_msg, "Content-Encoding",
+						"gzip");
+			}
+		}
 
-	if (read (fd, reply_msg->body->str, st.st_size) != st.st_size) {
-		close (fd);
-		rspamd_http_message_free (reply_msg);
-		return FALSE;
+		reply_msg->body = g_string_sized_new (len);
+		memcpy (reply_msg->body->str, data, len);
+		reply_msg->body->len = len;
+		reply_msg->body->str[len] = '\0';
+		reply_msg->body_buf.len = len;
+		reply_msg->body_buf.str = reply_msg->body->str;
 	}
 
-	reply_msg->body_buf.str[st.st_size] = '\0';
+	rspamd_http_message_add_header (reply_msg, "ETag", file->etag);
 
-	close (fd);
+	if (file->gz_data != NULL) {
+		rspamd_http_message_add_header (reply_msg, "Vary", "Accept-Encoding");
+	}
+
+	if (!file->cached) {
+		rspamd_http_file_free (file);
+	}
 
 	rspamd_http_connection_reset (entry->conn);
 
-	msg_debug ("requested file %s", realbuf);
+	msg_debug_http ("requested file %s", realbuf);
 	rspamd_http_connection_write_message (entry->conn, reply_msg, NULL,
-		rspamd_http_router_detect_ct (realbuf), entry, entry->conn->fd,
+		type->ct, entry, entry->conn->fd,
 		entry->rt->ptv, entry->rt->ev_base);
 
 	return TRUE;
@@ -1979,7 +2296,7 @@ rspamd_http_router_finish_handler (struct rspamd_http_connection *conn,
 		if (msg->url != NULL && msg->url->len != 0) {
 			found = g_hash_table_lookup (entry->rt->paths, msg->url->str);
 			memcpy (&handler, &found, sizeof (found));
-			msg_debug ("requested known path: %v", msg->url);
+			msg_debug_http ("requested known path: %v", msg->url);
 		}
 		entry->is_reply = TRUE;
 		if (handler != NULL) {
@@ -2136,6 +2453,9 @@ rspamd_http_router_free (struct rspamd_http_connection_router *router)
 		if (router->default_fs_path != NULL) {
 			g_free (router->default_fs_path);
 		}
+		if (router->files != NULL) {
+			g_hash_table_unref (router->files);
+		}
 		g_hash_table_unref (router->paths);
 		g_slice_free1 (sizeof (struct rspamd_http_connection_router), router);
 	}
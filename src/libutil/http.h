@@ -54,6 +54,10 @@ struct rspamd_http_header {
  * Legacy spamc protocol
  */
 #define RSPAMD_HTTP_FLAG_SPAMC 1 << 1
+/**
+ * Connection should be kept alive after this message
+ */
+#define RSPAMD_HTTP_FLAG_KEEP_ALIVE 1 << 2
 
 /**
  * HTTP message structure, used for requests and replies
@@ -81,7 +85,8 @@ struct rspamd_http_message {
 enum rspamd_http_options {
 	RSPAMD_HTTP_BODY_PARTIAL = 0x1, /**< Call body handler on all body data portions */
 	RSPAMD_HTTP_CLIENT_SIMPLE = 0x2, /**< Read HTTP client reply automatically */
-	RSPAMD_HTTP_CLIENT_ENCRYPTED = 0x4 /**< Encrypt data for client */
+	RSPAMD_HTTP_CLIENT_ENCRYPTED = 0x4, /**< Encrypt data for client */
+	RSPAMD_HTTP_KEEP_ALIVE = 0x8 /**< Allow persistent connections with pipelined messages */
 };
 
 struct rspamd_http_connection_private;
@@ -142,6 +147,8 @@ struct rspamd_http_connection_router {
 	struct event_base *ev_base;
 	struct rspamd_keypair_cache *cache;
 	gchar *default_fs_path;
+	GHashTable *files;                  /**< cached static files by their paths */
+	gsize files_size;                   /**< size of cached files */
 	gpointer key;
 	rspamd_http_router_error_handler_t error_handler;
 	rspamd_http_router_finish_handler_t finish_handler;
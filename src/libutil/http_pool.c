@@ -0,0 +1,282 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "http_pool.h"
+
+#define msg_debug_http(...) msg_debug_module (RSPAMD_LOG_MODULE_HTTP, \
+		__VA_ARGS__)
+
+/* Maximum number of idle connections to a single server */
+#define HTTP_POOL_MAX_IDLE 8
+/* A connection is closed after that many requests */
+#define HTTP_POOL_MAX_REQUESTS 100
+/* Idle connections are closed after this timeout in seconds */
+#define HTTP_POOL_IDLE_TIMEOUT 30.0
+
+struct rspamd_http_pool_elt;
+
+struct rspamd_http_pool_connection {
+	struct rspamd_http_connection *conn;
+	struct rspamd_http_pool_elt *elt;
+	struct event_base *ev_base;
+	/* Watches for both idle timeout and close of connection by a server */
+	struct event idle_ev;
+	guint requests;
+};
+
+struct rspamd_http_pool_elt {
+	gchar *key;
+	GQueue *idle;
+};
+
+struct rspamd_http_pool {
+	GHashTable *elts;
+	/* Connections given to callers indexed by connection objects */
+	GHashTable *active;
+};
+
+static void
+rspamd_http_pool_elt_dtor (gpointer p)
+{
+	struct rspamd_http_pool_elt *elt = p;
+
+	g_assert (g_queue_get_length (elt->idle) == 0);
+	g_queue_free (elt->idle);
+	g_free (elt->key);
+	g_slice_free1 (sizeof (*elt), elt);
+}
+
+static gchar *
+rspamd_http_pool_key (const rspamd_inet_addr_t *addr, gpointer peer_key)
+{
+	GString *pk;
+	gchar *key;
+
+	if (peer_key != NULL) {
+		pk = rspamd_http_connection_print_key (peer_key,
+				RSPAMD_KEYPAIR_PUBKEY | RSPAMD_KEYPAIR_BASE32);
+		key = g_strdup_printf ("%s:%d:%s", rspamd_inet_address_to_string (addr),
+				(gint)rspamd_inet_address_get_port (addr), pk->str);
+		g_string_free (pk, TRUE);
+	}
+	else {
+		key = g_strdup_printf ("%s:%d", rspamd_inet_address_to_string (addr),
+				(gint)rspamd_inet_address_get_port (addr));
+	}
+
+	return key;
+}
+
+static void
+rspamd_http_pool_conn_close (struct rspamd_http_pool_connection *pconn)
+{
+	gint fd = pconn->conn->fd;
+
+	rspamd_http_connection_unref (pconn->conn);
+
+	if (fd != -1) {
+		close (fd);
+	}
+
+	g_slice_free1 (sizeof (*pconn), pconn);
+}
+
+static void
+rspamd_http_pool_idle_cb (gint fd, short what, gpointer ud)
+{
+	struct rspamd_http_pool_connection *pconn = ud;
+
+	/*
+	 * Either timeout or a server has closed connection (or sent us some
+	 * garbage), in all cases this connection cannot be used any longer
+	 */
+	msg_debug_http ("close idle http connection to %s", pconn->elt->key);
+	g_queue_remove (pconn->elt->idle, pconn);
+	rspamd_http_pool_conn_close (pconn);
+}
+
+struct rspamd_http_pool *
+rspamd_http_pool_init (void)
+{
+	struct rspamd_http_pool *pool;
+
+	pool = g_slice_alloc0 (sizeof (*pool));
+	pool->elts = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+			rspamd_http_pool_elt_dtor);
+	pool->active = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	return pool;
+}
+
+struct rspamd_http_connection *
+rspamd_http_pool_connect (struct rspamd_http_pool *pool,
+	struct event_base *ev_base,
+	const rspamd_inet_addr_t *addr,
+	gpointer peer_key,
+	rspamd_http_body_handler_t body_handler,
+	rspamd_http_error_handler_t error_handler,
+	rspamd_http_finish_handler_t finish_handler,
+	unsigned opts)
+{
+	struct rspamd_http_pool_elt *elt;
+	struct rspamd_http_pool_connection *pconn = NULL;
+	struct rspamd_http_connection *conn;
+	GList *cur;
+	gchar *key;
+	gint fd;
+
+	g_assert (pool != NULL);
+	g_assert (addr != NULL);
+
+	key = rspamd_http_pool_key (addr, peer_key);
+	elt = g_hash_table_lookup (pool->elts, key);
+
+	if (elt == NULL) {
+		elt = g_slice_alloc (sizeof (*elt));
+		elt->key = key;
+		elt->idle = g_queue_new ();
+		g_hash_table_insert (pool->elts, elt->key, elt);
+	}
+	else {
+		g_free (key);
+	}
+
+	/* The most recently used connections are at the head of queue */
+	for (cur = elt->idle->head; cur != NULL; cur = g_list_next (cur)) {
+		pconn = cur->data;
+
+		if (pconn->ev_base == ev_base) {
+			g_queue_delete_link (elt->idle, cur);
+			event_del (&pconn->idle_ev);
+			break;
+		}
+
+		pconn = NULL;
+	}
+
+	if (pconn != NULL) {
+		conn = pconn->conn;
+		/* Finish handler of the previous request could set it again */
+		rspamd_http_connection_reset (conn);
+		conn->body_handler = body_handler;
+		conn->error_handler = error_handler;
+		conn->finish_handler = finish_handler;
+		conn->opts = opts | RSPAMD_HTTP_KEEP_ALIVE;
+		conn->ud = NULL;
+		msg_debug_http ("reuse http connection to %s, %ud requests sent before",
+				elt->key, pconn->requests);
+	}
+	else {
+		fd = rspamd_inet_address_connect (addr, SOCK_STREAM, TRUE);
+
+		if (fd == -1) {
+			msg_info ("cannot connect to http server %s: %s", elt->key,
+					strerror (errno));
+			return NULL;
+		}
+
+		conn = rspamd_http_connection_new (body_handler, error_handler,
+				finish_handler, opts | RSPAMD_HTTP_KEEP_ALIVE,
+				RSPAMD_HTTP_CLIENT, NULL);
+		conn->fd = fd;
+
+		pconn = g_slice_alloc0 (sizeof (*pconn));
+		pconn->conn = conn;
+		pconn->elt = elt;
+		pconn->ev_base = ev_base;
+	}
+
+	pconn->requests ++;
+	g_hash_table_insert (pool->active, conn, pconn);
+
+	return conn;
+}
+
+void
+rspamd_http_pool_release (struct rspamd_http_pool *pool,
+	struct rspamd_http_connection *conn, gboolean reuse)
+{
+	struct rspamd_http_pool_connection *pconn;
+	struct timeval tv;
+
+	g_assert (pool != NULL);
+
+	pconn = g_hash_table_lookup (pool->active, conn);
+	g_assert (pconn != NULL);
+	g_hash_table_remove (pool->active, conn);
+
+	if (reuse && conn->fd != -1 && pconn->requests < HTTP_POOL_MAX_REQUESTS &&
+			g_queue_get_length (pconn->elt->idle) < HTTP_POOL_MAX_IDLE) {
+		/* Stops connection's events, so we can watch its socket */
+		rspamd_http_connection_reset (conn);
+		conn->ud = NULL;
+
+		event_set (&pconn->idle_ev, conn->fd, EV_READ,
+				rspamd_http_pool_idle_cb, pconn);
+		event_base_set (pconn->ev_base, &pconn->idle_ev);
+		double_to_tv (HTTP_POOL_IDLE_TIMEOUT, &tv);
+		event_add (&pconn->idle_ev, &tv);
+		g_queue_push_head (pconn->elt->idle, pconn);
+	}
+	else {
+		rspamd_http_pool_conn_close (pconn);
+	}
+}
+
+void
+rspamd_http_pool_destroy (struct rspamd_http_pool *pool)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_http_pool_elt *elt;
+	struct rspamd_http_pool_connection *pconn;
+
+	if (pool == NULL) {
+		return;
+	}
+
+	g_hash_table_iter_init (&it, pool->elts);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		elt = v;
+
+		while ((pconn = g_queue_pop_head (elt->idle)) != NULL) {
+			event_del (&pconn->idle_ev);
+			rspamd_http_pool_conn_close (pconn);
+		}
+	}
+
+	/* Active connections are owned by their callers */
+	g_hash_table_iter_init (&it, pool->active);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		pconn = v;
+		g_slice_free1 (sizeof (*pconn), pconn);
+	}
+
+	g_hash_table_unref (pool->active);
+	g_hash_table_unref (pool->elts);
+	g_slice_free1 (sizeof (*pool), pool);
+}
@@ -0,0 +1,95 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef RSPAMD_HTTP_POOL_H
+#define RSPAMD_HTTP_POOL_H
+
+#include "config.h"
+#include "http.h"
+#include "addr.h"
+
+struct event_base;
+
+/*
+ * Pool of persistent HTTP client connections of a worker. Connections are
+ * indexed by server address, port and the peer's public key (if a connection
+ * is encrypted). A connection serves a single request at a time, and when
+ * the server agrees to keep it alive, it is parked in the pool to be reused
+ * by the next request to the same server. Idle connections are closed after
+ * some time of inactivity or when a server closes them.
+ */
+struct rspamd_http_pool;
+
+/**
+ * Create new empty pool
+ * @return new pool
+ */
+struct rspamd_http_pool * rspamd_http_pool_init (void);
+
+/**
+ * Get a client connection to the specified server, it is either an idle
+ * connection from the pool or a new connection. Handlers and options are set
+ * for the returned connection, `RSPAMD_HTTP_KEEP_ALIVE` is always added to
+ * options. Connection's socket is stored in `conn->fd` and it is owned by the
+ * pool, messages should be written with `RSPAMD_HTTP_FLAG_KEEP_ALIVE` flag to
+ * ask a server to keep a connection open
+ * @param pool pool object
+ * @param ev_base event base
+ * @param addr server address with port
+ * @param peer_key peer key for encrypted connections or NULL
+ * @param body_handler body handler
+ * @param error_handler error handler
+ * @param finish_handler finish handler
+ * @param opts connection options
+ * @return new connection or NULL if a connection cannot be established
+ */
+struct rspamd_http_connection * rspamd_http_pool_connect (
+	struct rspamd_http_pool *pool,
+	struct event_base *ev_base,
+	const rspamd_inet_addr_t *addr,
+	gpointer peer_key,
+	rspamd_http_body_handler_t body_handler,
+	rspamd_http_error_handler_t error_handler,
+	rspamd_http_finish_handler_t finish_handler,
+	unsigned opts);
+
+/**
+ * Release a connection obtained by rspamd_http_pool_connect, it must be
+ * called once per each connect call. It is safe to call this function from
+ * the finish handler of a connection, but the reply is freed then
+ * @param pool pool object
+ * @param conn connection
+ * @param reuse if TRUE, then the connection is returned to the pool, it should
+ * be set merely if a reply has been completely read and it has
+ * `RSPAMD_HTTP_FLAG_KEEP_ALIVE` flag, otherwise the connection is closed
+ */
+void rspamd_http_pool_release (struct rspamd_http_pool *pool,
+	struct rspamd_http_connection *conn, gboolean reuse);
+
+/**
+ * Close all idle connections and destroy pool, active connections are not
+ * closed
+ * @param pool pool object
+ */
+void rspamd_http_pool_destroy (struct rspamd_http_pool *pool);
+
+#endif
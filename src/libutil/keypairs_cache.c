@@ -37,6 +37,8 @@ struct rspamd_keypair_elt {
 
 struct rspamd_keypair_cache {
 	rspamd_lru_hash_t *hash;
+	guint64 *hits;
+	guint64 *misses;
 };
 
 static void
@@ -72,7 +74,7 @@ rspamd_keypair_cache_new (guint max_items)
 
 	g_assert (max_items > 0);
 
-	c = g_slice_alloc (sizeof (*c));
+	c = g_slice_alloc0 (sizeof (*c));
 	c->hash = rspamd_lru_hash_new_full (max_items, -1, NULL,
 			rspamd_keypair_destroy, rspamd_keypair_hash, rspamd_keypair_equal);
 
@@ -96,6 +98,10 @@ rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 	new = rspamd_lru_hash_lookup (c->hash, &search, time (NULL));
 
 	if (new == NULL) {
+		if (c->misses) {
+			(*c->misses) ++;
+		}
+
 		new = g_slice_alloc (sizeof (*new));
 		memcpy (new->pair, kp_remote->pk, rspamd_cryptobox_PKBYTES);
 		memcpy (&new->pair[rspamd_cryptobox_PKBYTES], kp_local->sk,
@@ -103,6 +109,9 @@ rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 		rspamd_cryptobox_nm (new->nm, kp_remote->pk, kp_local->sk);
 		rspamd_lru_hash_insert (c->hash, new, new, time (NULL), -1);
 	}
+	else if (c->hits) {
+		(*c->hits) ++;
+	}
 
 	g_assert (new != NULL);
 
@@ -110,6 +119,16 @@ rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 	memcpy (kp_local->nm, new->nm, rspamd_cryptobox_NMBYTES);
 }
 
+void
+rspamd_keypair_cache_set_counters (struct rspamd_keypair_cache *c,
+		guint64 *hits, guint64 *misses)
+{
+	g_assert (c != NULL);
+
+	c->hits = hits;
+	c->misses = misses;
+}
+
 void
 rspamd_keypair_cache_destroy (struct rspamd_keypair_cache *c)
 {
@@ -46,6 +46,16 @@ struct rspamd_keypair_cache * rspamd_keypair_cache_new (guint max_items);
 void rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 		gpointer lk, gpointer rk);
 
+/**
+ * Set counters that are incremented on each cache hit and miss, counters
+ * might be placed in the shared memory to be aggregated between processes
+ * @param c cache object
+ * @param hits pointer to the hits counter (or NULL)
+ * @param misses pointer to the misses counter (or NULL)
+ */
+void rspamd_keypair_cache_set_counters (struct rspamd_keypair_cache *c,
+		guint64 *hits, guint64 *misses);
+
 /**
  * Destroy old keypair cache
  * @param c cache object
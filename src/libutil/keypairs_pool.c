@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "config.h"
+#include "main.h"
+#include "keypairs_pool.h"
+#include "http.h"
+
+struct rspamd_keypair_pool {
+	GQueue *keys;
+	guint size;
+	gint stop;
+	rspamd_mutex_t *mtx;
+	GCond *cond;
+	GThread *thr;
+};
+
+/*
+ * Generates keypairs while the pool is not full and sleeps otherwise
+ */
+static gpointer
+rspamd_keypair_pool_thread (gpointer ud)
+{
+	struct rspamd_keypair_pool *p = ud;
+	gpointer kp;
+
+	rspamd_mutex_lock (p->mtx);
+
+	while (!g_atomic_int_get (&p->stop)) {
+		if (p->keys->length >= p->size) {
+			rspamd_cond_wait (p->cond, p->mtx);
+			continue;
+		}
+
+		/* Scalar multiplication is done without lock */
+		rspamd_mutex_unlock (p->mtx);
+		kp = rspamd_http_connection_gen_key ();
+		rspamd_mutex_lock (p->mtx);
+		g_queue_push_tail (p->keys, kp);
+	}
+
+	rspamd_mutex_unlock (p->mtx);
+
+	return NULL;
+}
+
+static void
+rspamd_keypair_pool_wake (struct rspamd_keypair_pool *p)
+{
+	rspamd_mutex_lock (p->mtx);
+	g_cond_signal (p->cond);
+	rspamd_mutex_unlock (p->mtx);
+}
+
+struct rspamd_keypair_pool *
+rspamd_keypair_pool_new (guint size)
+{
+	struct rspamd_keypair_pool *p;
+	GError *err = NULL;
+
+	g_assert (size > 0);
+
+	p = g_slice_alloc0 (sizeof (*p));
+	p->keys = g_queue_new ();
+	p->size = size;
+	p->mtx = rspamd_mutex_new ();
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
+	p->cond = g_cond_new ();
+#else
+	p->cond = g_malloc0 (sizeof (GCond));
+	g_cond_init (p->cond);
+#endif
+	p->thr = rspamd_create_thread ("keypairs", rspamd_keypair_pool_thread, p,
+			&err);
+
+	if (p->thr == NULL) {
+		/* Keypairs are generated on demand then */
+		msg_warn ("cannot start keypairs thread: %s",
+				err ? err->message : "unknown error");
+
+		if (err) {
+			g_error_free (err);
+		}
+	}
+
+	return p;
+}
+
+gpointer
+rspamd_keypair_pool_get (struct rspamd_keypair_pool *p)
+{
+	gpointer kp;
+
+	g_assert (p != NULL);
+
+	rspamd_mutex_lock (p->mtx);
+	kp = g_queue_pop_head (p->keys);
+
+	if (p->thr != NULL) {
+		g_cond_signal (p->cond);
+	}
+
+	rspamd_mutex_unlock (p->mtx);
+
+	if (kp == NULL) {
+		kp = rspamd_http_connection_gen_key ();
+	}
+
+	return kp;
+}
+
+void
+rspamd_keypair_pool_destroy (struct rspamd_keypair_pool *p)
+{
+	gpointer kp;
+
+	if (p != NULL) {
+		if (p->thr != NULL) {
+			g_atomic_int_set (&p->stop, 1);
+			rspamd_keypair_pool_wake (p);
+			g_thread_join (p->thr);
+		}
+
+		while ((kp = g_queue_pop_head (p->keys)) != NULL) {
+			rspamd_http_connection_key_unref (kp);
+		}
+
+		g_queue_free (p->keys);
+		rspamd_mutex_free (p->mtx);
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
+		g_cond_free (p->cond);
+#else
+		g_cond_clear (p->cond);
+		g_free (p->cond);
+#endif
+		g_slice_free1 (sizeof (*p), p);
+	}
+}
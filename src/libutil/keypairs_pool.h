@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KEYPAIRS_POOL_H_
+#define KEYPAIRS_POOL_H_
+
+#include "config.h"
+
+struct rspamd_keypair_pool;
+
+/**
+ * Create new pool of pregenerated keypairs, the pool is refilled by a
+ * separate thread, so it must be created in the process that uses it
+ * @param size number of keypairs kept ready
+ * @return new pool
+ */
+struct rspamd_keypair_pool * rspamd_keypair_pool_new (guint size);
+
+/**
+ * Get a new keypair, if the pool is empty a keypair is generated in place
+ * @param p pool of keypairs
+ * @return opaque keypair as returned by rspamd_http_connection_gen_key
+ */
+gpointer rspamd_keypair_pool_get (struct rspamd_keypair_pool *p);
+
+/**
+ * Stop the refilling thread and destroy the pool with all unused keypairs
+ * @param p pool of keypairs
+ */
+void rspamd_keypair_pool_destroy (struct rspamd_keypair_pool *p);
+
+#endif /* KEYPAIRS_POOL_H_ */
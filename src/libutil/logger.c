@@ -34,6 +34,10 @@
 #define REPEATS_MIN 3
 #define REPEATS_MAX 300
 #define RSPAMD_LOGBUF_SIZE 8192
+/* Minimal and default sizes of the asynchronous log ring */
+#define RSPAMD_LOG_RING_MIN (16 * RSPAMD_LOGBUF_SIZE)
+#define RSPAMD_LOG_RING_DEFAULT (1024 * 1024)
+#define RSPAMD_LOG_FLUSH_INTERVAL 0.5
 
 /**
  * Static structure that store logging parameters
@@ -59,15 +63,46 @@ struct rspamd_logger_s {
 	guint32 repeats;
 	GQuark process_type;
 	radix_compressed_t *debug_ip;
+	guint debug_mask;
 	guint64 last_line_cksum;
 	gchar *saved_message;
 	gchar *saved_function;
 	rspamd_mempool_t *pool;
 	rspamd_mempool_mutex_t *mtx;
+	gboolean is_async;
+	/*
+	 * Ring of formatted lines written by a thread of the process: lines are
+	 * added under mtx, so the ring has a single producer and a single consumer
+	 */
+	struct {
+		gchar *buf;
+		guint size;
+		guint head;
+		guint tail;
+		guint dropped;
+		gint stop;
+		gint sleeping;
+		pid_t owner;
+		GThread *thr;
+		rspamd_mutex_t *mtx;
+		GCond *cond;
+	} async;
 };
 
 static const gchar lf_chr = '\n';
 
+volatile guint rspamd_log_debug_mask = G_MAXUINT;
+
+static const gchar *log_modules[RSPAMD_LOG_MODULE_MAX] = {
+	[RSPAMD_LOG_MODULE_DEFAULT] = "default",
+	[RSPAMD_LOG_MODULE_DNS] = "dns",
+	[RSPAMD_LOG_MODULE_SYMBOLS] = "symbols",
+	[RSPAMD_LOG_MODULE_HTTP] = "http",
+	[RSPAMD_LOG_MODULE_EVENTS] = "events",
+	[RSPAMD_LOG_MODULE_DISPATCHER] = "dispatcher",
+	[RSPAMD_LOG_MODULE_TASK] = "task",
+};
+
 static rspamd_logger_t *default_logger = NULL;
 
 
@@ -141,6 +176,223 @@ direct_write_log_line (rspamd_logger_t *rspamd_log,
 	}
 }
 
+static void
+rspamd_log_async_wake (rspamd_logger_t *rspamd_log)
+{
+	rspamd_mutex_lock (rspamd_log->async.mtx);
+	g_cond_signal (rspamd_log->async.cond);
+	rspamd_mutex_unlock (rspamd_log->async.mtx);
+}
+
+static gpointer
+rspamd_log_writer_thread (gpointer ud)
+{
+	rspamd_logger_t *rspamd_log = ud;
+	guint head, tail, off, len, mask;
+	gint stop;
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
+	gint64 deadline;
+#else
+	GTimeVal tv;
+#endif
+	gdouble interval;
+
+	mask = rspamd_log->async.size - 1;
+	tail = rspamd_log->async.tail;
+	interval = rspamd_log->cfg->log_flush_interval > 0 ?
+			rspamd_log->cfg->log_flush_interval : RSPAMD_LOG_FLUSH_INTERVAL;
+
+	for (;;) {
+		stop = g_atomic_int_get (&rspamd_log->async.stop);
+		head = g_atomic_int_get ((gint *)&rspamd_log->async.head);
+
+		while (tail != head) {
+			off = tail & mask;
+			len = MIN (head - tail, rspamd_log->async.size - off);
+			direct_write_log_line (rspamd_log, rspamd_log->async.buf + off,
+					len, FALSE);
+			tail += len;
+			g_atomic_int_set ((gint *)&rspamd_log->async.tail, tail);
+		}
+
+		if (stop) {
+			break;
+		}
+
+		rspamd_mutex_lock (rspamd_log->async.mtx);
+		g_atomic_int_set (&rspamd_log->async.sleeping, 1);
+
+		if (g_atomic_int_get ((gint *)&rspamd_log->async.head) == tail &&
+				!g_atomic_int_get (&rspamd_log->async.stop)) {
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
+			deadline = g_get_monotonic_time () + interval * G_TIME_SPAN_SECOND;
+			g_cond_wait_until (rspamd_log->async.cond,
+					&rspamd_log->async.mtx->mtx, deadline);
+#else
+			g_get_current_time (&tv);
+			g_time_val_add (&tv, interval * G_USEC_PER_SEC);
+			g_cond_timed_wait (rspamd_log->async.cond,
+					g_static_mutex_get_mutex (&rspamd_log->async.mtx->mtx), &tv);
+#endif
+		}
+
+		g_atomic_int_set (&rspamd_log->async.sleeping, 0);
+		rspamd_mutex_unlock (rspamd_log->async.mtx);
+	}
+
+	return NULL;
+}
+
+/*
+ * Start writer thread for the current process, lines left in the ring by
+ * the parent process are dropped
+ */
+static gboolean
+rspamd_log_async_start (rspamd_logger_t *rspamd_log)
+{
+	GError *err = NULL;
+
+	rspamd_log->async.head = 0;
+	rspamd_log->async.tail = 0;
+	rspamd_log->async.dropped = 0;
+	rspamd_log->async.stop = 0;
+	rspamd_log->async.sleeping = 0;
+	rspamd_log->async.owner = getpid ();
+	rspamd_log->async.mtx = rspamd_mutex_new ();
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
+	rspamd_log->async.cond = g_cond_new ();
+#else
+	rspamd_log->async.cond = g_malloc0 (sizeof (GCond));
+	g_cond_init (rspamd_log->async.cond);
+#endif
+	rspamd_log->async.thr = rspamd_create_thread ("logger",
+			rspamd_log_writer_thread, rspamd_log, &err);
+
+	if (rspamd_log->async.thr == NULL) {
+		/* We cannot use logger here */
+		fprintf (stderr, "cannot start logger thread, logging is sync: %s\n",
+				err ? err->message : "unknown error");
+
+		if (err) {
+			g_error_free (err);
+		}
+
+		rspamd_log->is_async = FALSE;
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Write all pending lines and stop the writer thread of the current process
+ */
+static void
+rspamd_log_async_stop (rspamd_logger_t *rspamd_log)
+{
+	if (rspamd_log->async.thr == NULL ||
+			rspamd_log->async.owner != getpid ()) {
+		/* Thread of another process */
+		rspamd_log->async.thr = NULL;
+		rspamd_log->async.owner = 0;
+		return;
+	}
+
+	g_atomic_int_set (&rspamd_log->async.stop, 1);
+	rspamd_log_async_wake (rspamd_log);
+	g_thread_join (rspamd_log->async.thr);
+	rspamd_log->async.thr = NULL;
+	rspamd_log->async.owner = 0;
+
+	rspamd_mutex_free (rspamd_log->async.mtx);
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
+	g_cond_free (rspamd_log->async.cond);
+#else
+	g_cond_clear (rspamd_log->async.cond);
+	g_free (rspamd_log->async.cond);
+#endif
+}
+
+static void
+rspamd_log_async_copy (rspamd_logger_t *rspamd_log, guint pos,
+	const void *data, gsize len)
+{
+	guint off, first;
+
+	off = pos & (rspamd_log->async.size - 1);
+	first = MIN (len, rspamd_log->async.size - off);
+	memcpy (rspamd_log->async.buf + off, data, first);
+
+	if (first < len) {
+		memcpy (rspamd_log->async.buf, (const gchar *)data + first,
+				len - first);
+	}
+}
+
+/*
+ * Add line to the ring, lines are dropped when the writer cannot keep up
+ */
+static gboolean
+rspamd_log_async_push (rspamd_logger_t *rspamd_log,
+	const struct iovec *iov,
+	gint iovcnt)
+{
+	guint head, tail, used;
+	gsize len = 0;
+	gchar tmpbuf[64];
+	struct iovec drop_iov;
+	gint i;
+
+	if (rspamd_log->async.owner != getpid () &&
+			!rspamd_log_async_start (rspamd_log)) {
+		return FALSE;
+	}
+
+	if (rspamd_log->async.dropped > 0) {
+		used = rspamd_log->async.dropped;
+		rspamd_log->async.dropped = 0;
+		drop_iov.iov_base = tmpbuf;
+		drop_iov.iov_len = rspamd_snprintf (tmpbuf, sizeof (tmpbuf),
+				"%ud log messages have been dropped\n", used);
+		rspamd_log_async_push (rspamd_log, &drop_iov, 1);
+
+		if (rspamd_log->async.dropped > 0) {
+			/* Still no space */
+			rspamd_log->async.dropped = used + 1;
+			return TRUE;
+		}
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+
+	head = rspamd_log->async.head;
+	tail = g_atomic_int_get ((gint *)&rspamd_log->async.tail);
+
+	if (rspamd_log->async.size - (head - tail) < len) {
+		rspamd_log->async.dropped ++;
+		return TRUE;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		rspamd_log_async_copy (rspamd_log, head, iov[i].iov_base,
+				iov[i].iov_len);
+		head += iov[i].iov_len;
+	}
+
+	g_atomic_int_set ((gint *)&rspamd_log->async.head, head);
+
+	/* Flush by size, otherwise the writer wakes up by timeout */
+	if (head - tail >= rspamd_log->async.size / 4 &&
+			g_atomic_int_get (&rspamd_log->async.sleeping)) {
+		rspamd_log_async_wake (rspamd_log);
+	}
+
+	return TRUE;
+}
+
 static void
 rspamd_escape_log_string (gchar *str)
 {
@@ -197,6 +449,10 @@ rspamd_log_close_priv (rspamd_logger_t *rspamd_log, uid_t uid, gid_t gid)
 	gchar tmpbuf[256];
 	rspamd_log_flush (rspamd_log);
 
+	if (rspamd_log->is_async) {
+		rspamd_log_async_stop (rspamd_log);
+	}
+
 	switch (rspamd_log->type) {
 	case RSPAMD_LOG_CONSOLE:
 		/* Do nothing special */
@@ -317,6 +573,24 @@ rspamd_set_logger (struct rspamd_config *cfg,
 	}
 
 	rspamd->logger->cfg = cfg;
+	/* Set up asynchronous writing */
+	if (rspamd->logger->is_async) {
+		rspamd_log_async_stop (rspamd->logger);
+		g_free (rspamd->logger->async.buf);
+		rspamd->logger->async.buf = NULL;
+		rspamd->logger->is_async = FALSE;
+	}
+	if (rspamd->cfg->log_async && cfg->log_type != RSPAMD_LOG_SYSLOG) {
+		rspamd->logger->async.size = RSPAMD_LOG_RING_MIN;
+
+		while (rspamd->logger->async.size < (rspamd->cfg->log_buf_size ?
+				rspamd->cfg->log_buf_size : RSPAMD_LOG_RING_DEFAULT)) {
+			rspamd->logger->async.size <<= 1;
+		}
+
+		rspamd->logger->async.buf = g_malloc (rspamd->logger->async.size);
+		rspamd->logger->is_async = TRUE;
+	}
 	/* Set up buffer */
 	if (rspamd->cfg->log_buffered) {
 		if (rspamd->cfg->log_buf_size != 0) {
@@ -349,6 +623,55 @@ rspamd_set_logger (struct rspamd_config *cfg,
 	}
 
 	default_logger = rspamd->logger;
+	rspamd_log_update_debug_mask (rspamd->logger);
+}
+
+gint
+rspamd_log_module_by_name (const gchar *name)
+{
+	gint i;
+
+	for (i = 0; i < RSPAMD_LOG_MODULE_MAX; i ++) {
+		if (g_ascii_strcasecmp (log_modules[i], name) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void
+rspamd_log_update_debug_mask (rspamd_logger_t *rspamd_log)
+{
+	struct rspamd_config *cfg = rspamd_log->cfg;
+	GList *cur;
+	guint mask = 0;
+	gint id;
+
+	if (cfg->log_level >= G_LOG_LEVEL_DEBUG) {
+		if (cfg->debug_modules == NULL) {
+			mask = G_MAXUINT;
+		}
+		else {
+			/* Debug only the specified modules */
+			for (cur = cfg->debug_modules; cur != NULL; cur = g_list_next (cur)) {
+				id = rspamd_log_module_by_name (cur->data);
+
+				if (id == -1) {
+					msg_warn ("unknown log module: %s", cur->data);
+				}
+				else {
+					mask |= 1U << id;
+				}
+			}
+		}
+	}
+
+	rspamd_log->debug_mask = mask;
+
+	if (!rspamd_log->is_debug) {
+		g_atomic_int_set ((volatile gint *)&rspamd_log_debug_mask, mask);
+	}
 }
 
 /**
@@ -367,7 +690,13 @@ rspamd_log_update_pid (GQuark ptype, rspamd_logger_t *rspamd_log)
 void
 rspamd_log_flush (rspamd_logger_t *rspamd_log)
 {
-	if (rspamd_log->is_buffered &&
+	if (rspamd_log->is_async) {
+		if (rspamd_log->async.thr != NULL &&
+				rspamd_log->async.owner == getpid ()) {
+			rspamd_log_async_wake (rspamd_log);
+		}
+	}
+	else if (rspamd_log->is_buffered &&
 		(rspamd_log->type == RSPAMD_LOG_CONSOLE || rspamd_log->type ==
 		RSPAMD_LOG_FILE)) {
 		direct_write_log_line (rspamd_log,
@@ -482,6 +811,11 @@ file_log_helper (rspamd_logger_t *rspamd_log,
 	size_t len = 0;
 	gint i;
 
+	if (rspamd_log->is_async && rspamd_log_async_push (rspamd_log, iov, iovcnt)) {
+		/* Line is written by the writer thread */
+		return;
+	}
+
 	if (!rspamd_log->is_buffered) {
 		/* Write string directly */
 		direct_write_log_line (rspamd_log, (void *)iov, iovcnt, TRUE);
@@ -831,6 +1165,7 @@ void
 rspamd_log_debug (rspamd_logger_t *rspamd_log)
 {
 	rspamd_log->is_debug = TRUE;
+	g_atomic_int_set ((volatile gint *)&rspamd_log_debug_mask, G_MAXUINT);
 }
 
 /**
@@ -840,4 +1175,6 @@ void
 rspamd_log_nodebug (rspamd_logger_t *rspamd_log)
 {
 	rspamd_log->is_debug = FALSE;
+	g_atomic_int_set ((volatile gint *)&rspamd_log_debug_mask,
+			rspamd_log->debug_mask);
 }
@@ -13,6 +13,29 @@ typedef void (*rspamd_log_func_t)(const gchar * log_domain,
 	gboolean forced, gpointer arg);
 
 typedef struct rspamd_logger_s rspamd_logger_t;
+
+/**
+ * Modules that have separate debug output, ids are fixed at compile time
+ */
+enum rspamd_log_module {
+	RSPAMD_LOG_MODULE_DEFAULT = 0,
+	RSPAMD_LOG_MODULE_DNS,
+	RSPAMD_LOG_MODULE_SYMBOLS,
+	RSPAMD_LOG_MODULE_HTTP,
+	RSPAMD_LOG_MODULE_EVENTS,
+	RSPAMD_LOG_MODULE_DISPATCHER,
+	RSPAMD_LOG_MODULE_TASK,
+	RSPAMD_LOG_MODULE_MAX
+};
+
+/*
+ * Mask of modules for which debug is enabled, it is checked before arguments
+ * of debug messages are evaluated
+ */
+extern volatile guint rspamd_log_debug_mask;
+
+#define rspamd_log_module_debug(mod) \
+	G_UNLIKELY (rspamd_log_debug_mask & (1U << (mod)))
 /**
  * Init logger
  */
@@ -98,6 +121,18 @@ void rspamd_default_logv (GLogLevelFlags log_level,
 	const gchar *fmt,
 	va_list args);
 
+/**
+ * Get module id by its name
+ * @return module id or -1 if a module is unknown
+ */
+gint rspamd_log_module_by_name (const gchar *name);
+
+/**
+ * Update mask of debugged modules from the log level and `debug_modules`
+ * of configuration
+ */
+void rspamd_log_update_debug_mask (rspamd_logger_t *logger);
+
 /**
  * Temporary turn on debug
  */
@@ -124,14 +159,22 @@ void rspamd_log_nodebug (rspamd_logger_t *logger);
 		G_LOG_LEVEL_INFO, \
 		__FUNCTION__, \
 		__VA_ARGS__)
-#define msg_debug(...)  rspamd_conditional_debug (rspamd_main->logger, \
-		NULL, \
-		__FUNCTION__, \
-		__VA_ARGS__)
-#define debug_task(...) rspamd_conditional_debug (rspamd_main->logger, \
-		task->from_addr, \
-		__FUNCTION__, \
-		__VA_ARGS__)
+#define msg_debug_module(mod, ...) do { \
+	if (rspamd_log_module_debug (mod)) { \
+		rspamd_conditional_debug (rspamd_main->logger, \
+			NULL, \
+			__FUNCTION__, \
+			__VA_ARGS__); \
+	} \
+} while (0)
+#define debug_task_module(mod, ...) do { \
+	if (rspamd_log_module_debug (mod)) { \
+		rspamd_conditional_debug (rspamd_main->logger, \
+			task->from_addr, \
+			__FUNCTION__, \
+			__VA_ARGS__); \
+	} \
+} while (0)
 #else
 #define msg_err(...)    rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
 		__FUNCTION__, \
@@ -142,12 +185,17 @@ void rspamd_log_nodebug (rspamd_logger_t *logger);
 #define msg_info(...)   rspamd_default_log_function (G_LOG_LEVEL_INFO, \
 		__FUNCTION__, \
 		__VA_ARGS__)
-#define msg_debug(...)  rspamd_default_log_function (G_LOG_LEVEL_DEBUG, \
-		__FUNCTION__, \
-		__VA_ARGS__)
-#define debug_task(...) rspamd_default_log_function (G_LOG_LEVEL_DEBUG, \
-		__FUNCTION__, \
-		__VA_ARGS__)
+#define msg_debug_module(mod, ...) do { \
+	if (rspamd_log_module_debug (mod)) { \
+		rspamd_default_log_function (G_LOG_LEVEL_DEBUG, \
+			__FUNCTION__, \
+			__VA_ARGS__); \
+	} \
+} while (0)
+#define debug_task_module(mod, ...) msg_debug_module (mod, __VA_ARGS__)
 #endif
 
+#define msg_debug(...) msg_debug_module (RSPAMD_LOG_MODULE_DEFAULT, __VA_ARGS__)
+#define debug_task(...) debug_task_module (RSPAMD_LOG_MODULE_TASK, __VA_ARGS__)
+
 #endif
@@ -28,12 +28,24 @@
 #include "config.h"
 #include "map.h"
 #include "http.h"
+#include "http_pool.h"
 #include "main.h"
 #include "util.h"
 #include "mem_pool.h"
+#include "regexp.h"
+#include "acism.h"
+#include "cdb.h"
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+#include <pcre.h>
 
 static const gchar *hash_fill = "1";
 
+/* Headers used for delta updates of HTTP maps */
+#define MAP_VERSION_HEADER "X-Map-Version"
+#define MAP_DELTA_HEADER "X-Map-Delta"
+
 /**
  * Data specific to file maps
  */
@@ -42,17 +54,29 @@ struct file_map_data {
 	struct stat st;
 };
 
+/**
+ * Data specific to CDB maps
+ */
+struct cdb_map_data {
+	const gchar *filename;
+	struct stat st;
+};
+
 /**
  * Data specific to HTTP maps
  */
 struct http_map_data {
 	struct addrinfo *addr;
+	rspamd_inet_addr_t *inet_addr;
 	guint16 port;
 	gchar *path;
 	gchar *host;
 	time_t last_checked;
 	gboolean request_sent;
+	/* Pooled connection of the current request or NULL */
 	struct rspamd_http_connection *conn;
+	gchar etag[128];
+	gchar version[64];
 };
 
 
@@ -66,8 +90,54 @@ struct http_callback_data {
 	GString *remain_buf;
 
 	gint fd;
+	gboolean reuse;
+};
+
+/**
+ * Background reload of a map: data is parsed in a separate thread and then
+ * published from the event loop
+ */
+struct rspamd_map_loader {
+	struct rspamd_map *map;
+	struct map_cb_data cbdata;
+	GThread *thr;
+	GString *buf;
+	gchar *filename;
+	struct event ev;
+	gint wake_fd[2];
+	gboolean success;
+	/* Shared image to write or NULL */
+	gchar *image_path;
+	gboolean image_written;
+	/* Loader owns map lock (it is not set when loading image from others) */
+	gboolean unlock;
+	gint generation;
 };
 
+/**
+ * Map state shared between processes: one process fetches map data and
+ * writes an image of the specified generation, others just load it
+ */
+struct rspamd_map_shared {
+	gint generation;
+	time_t last_fetch;
+	time_t last_modified;
+	gchar etag[128];
+};
+
+/**
+ * Previous version of map data that can still be used by pending tasks
+ */
+struct rspamd_map_retired {
+	struct rspamd_map *map;
+	void *data;
+	struct event ev;
+	struct timeval tv;
+};
+
+static gboolean rspamd_map_start_loader (struct rspamd_map *map,
+	const gchar *filename, GString *buf, gboolean shared_image);
+
 /* Value in seconds after whitch we would try to do stat on list file */
 
 /* HTTP timeouts */
@@ -75,24 +145,12 @@ struct http_callback_data {
 #define HTTP_READ_TIMEOUT 10
 
 /**
- * Helper for HTTP connection establishment
+ * Common lists maps can be updated by deltas
  */
-static gint
-connect_http (struct rspamd_map *map,
-	struct http_map_data *data,
-	gboolean is_async)
+static inline gboolean
+rspamd_map_can_delta (struct rspamd_map *map)
 {
-	gint sock;
-
-	if ((sock = rspamd_socket_tcp (data->addr, FALSE, is_async)) == -1) {
-		msg_info ("cannot connect to http server %s: %d, %s",
-			data->host,
-			errno,
-			strerror (errno));
-		return -1;
-	}
-
-	return sock;
+	return map->shared == NULL && map->threaded;
 }
 
 /**
@@ -104,34 +162,224 @@ write_http_request (struct http_callback_data *cbd)
 	gchar datebuf[128];
 	struct tm *tm;
 	struct rspamd_http_message *msg;
+	const gchar *etag;
+	time_t last_checked;
 
 	msg = rspamd_http_new_message (HTTP_REQUEST);
 
 	msg->url = g_string_new (cbd->data->path);
-	if (cbd->data->last_checked != 0) {
-		tm = gmtime (&cbd->data->last_checked);
+	/* Connection is returned to the worker's pool if server agrees */
+	msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+	last_checked = cbd->data->last_checked;
+	etag = cbd->data->etag;
+
+	if (cbd->map->shared != NULL &&
+			cbd->map->generation == cbd->map->shared->generation) {
+		/* Data could be fetched by another process */
+		last_checked = cbd->map->shared->last_modified;
+		etag = cbd->map->shared->etag;
+	}
+
+	if (last_checked != 0) {
+		tm = gmtime (&last_checked);
 		strftime (datebuf, sizeof (datebuf), "%a, %d %b %Y %H:%M:%S %Z", tm);
 
 		rspamd_http_message_add_header (msg, "If-Modified-Since", datebuf);
 	}
 
+	if (etag[0] != '\0') {
+		rspamd_http_message_add_header (msg, "If-None-Match", etag);
+	}
+
+	if (rspamd_map_can_delta (cbd->map) && cbd->data->version[0] != '\0') {
+		/* Server can reply with changes since this version */
+		rspamd_http_message_add_header (msg, MAP_VERSION_HEADER,
+				cbd->data->version);
+	}
+
+#ifdef WITH_ZLIB
+	rspamd_http_message_add_header (msg, "Accept-Encoding", "gzip");
+#endif
+
 	rspamd_http_connection_write_message (cbd->data->conn, msg, cbd->data->host,
 		NULL, cbd, cbd->fd, &cbd->tv, cbd->ev_base);
 }
 
+static void
+rspamd_map_store_header (struct rspamd_http_message *msg, const gchar *name,
+	gchar *buf, gsize len)
+{
+	const GString *hdr;
+
+	hdr = rspamd_http_message_find_header (msg, name);
+
+	if (hdr != NULL && hdr->len < len) {
+		rspamd_strlcpy (buf, hdr->str, hdr->len + 1);
+	}
+	else {
+		/* Too long values are not stored */
+		buf[0] = '\0';
+	}
+}
+
+static gboolean
+rspamd_map_reply_is_gzip (struct rspamd_http_message *msg)
+{
+	const GString *hdr;
+
+	hdr = rspamd_http_message_find_header (msg, "Content-Encoding");
+
+	return hdr != NULL && hdr->len == sizeof ("gzip") - 1 &&
+			g_ascii_strncasecmp (hdr->str, "gzip", hdr->len) == 0;
+}
+
+#ifdef WITH_ZLIB
+static GString *
+rspamd_map_inflate (const GString *in)
+{
+	z_stream strm;
+	GString *out;
+	gint rc;
+
+	memset (&strm, 0, sizeof (strm));
+
+	/* Accept gzip header */
+	if (inflateInit2 (&strm, MAX_WBITS + 16) != Z_OK) {
+		return NULL;
+	}
+
+	out = g_string_sized_new (in->len * 4 + BUFSIZ);
+	strm.next_in = (Bytef *)in->str;
+	strm.avail_in = in->len;
+
+	do {
+		if (out->allocated_len - out->len <= 1) {
+			g_string_set_size (out, out->allocated_len * 2);
+			g_string_truncate (out, strm.total_out);
+		}
+
+		strm.next_out = (Bytef *)out->str + out->len;
+		strm.avail_out = out->allocated_len - out->len - 1;
+		rc = inflate (&strm, Z_NO_FLUSH);
+		g_string_set_size (out, strm.total_out);
+	} while (rc == Z_OK);
+
+	inflateEnd (&strm);
+
+	if (rc != Z_STREAM_END) {
+		msg_err ("cannot inflate map data: %s", strm.msg ? strm.msg : "error");
+		g_string_free (out, TRUE);
+		return NULL;
+	}
+
+	return out;
+}
+#endif
+
+/**
+ * Apply delta to the current map data: each line starts with '+' for
+ * adding element or '-' for removing it
+ */
+static gboolean
+rspamd_map_apply_delta (struct rspamd_map *map, const GString *delta)
+{
+	gchar **lines, **cur, *line, *value;
+	gchar op;
+	void *data;
+	guint added = 0, removed = 0;
+
+	data = g_atomic_pointer_get (map->user_data);
+
+	if (data == NULL) {
+		return FALSE;
+	}
+
+	lines = g_strsplit_set (delta->str, "\r\n", -1);
+
+	for (cur = lines; *cur != NULL; cur ++) {
+		line = g_strstrip (*cur);
+
+		if (*line == '\0' || *line == '#') {
+			continue;
+		}
+
+		op = *line ++;
+		line = g_strchug (line);
+
+		if ((op != '+' && op != '-') || *line == '\0') {
+			msg_warn ("invalid delta line for map %s: %s", map->uri, *cur);
+			continue;
+		}
+
+		if (map->read_callback == rspamd_radix_read) {
+			if (op == '+') {
+				added += rspamd_radix_add_iplist (line, " ,;", data);
+			}
+			else {
+				removed += rspamd_radix_del_iplist (line, " ,;", data);
+			}
+
+			continue;
+		}
+
+		if (map->read_callback == rspamd_kv_list_read) {
+			/* Key is separated from value by spaces */
+			value = line;
+
+			while (*value != '\0' && !g_ascii_isspace (*value)) {
+				value ++;
+			}
+
+			if (*value != '\0') {
+				*value++ = '\0';
+				value = g_strchug (value);
+			}
+		}
+		else {
+			value = (gchar *)hash_fill;
+		}
+
+		if (op == '+') {
+			g_hash_table_insert (data, rspamd_mempool_strdup (map->pool, line),
+					value == hash_fill ? value :
+					rspamd_mempool_strdup (map->pool, value));
+			added ++;
+		}
+		else if (g_hash_table_remove (data, line)) {
+			removed ++;
+		}
+	}
+
+	g_strfreev (lines);
+
+	if (map->read_callback == rspamd_radix_read) {
+		radix_compile_compressed (data);
+	}
+
+	msg_info ("applied delta to map %s: %ud added, %ud removed", map->uri,
+			added, removed);
+
+	return TRUE;
+}
+
 /**
  * Callback for destroying HTTP callback data
  */
 static void
 free_http_cbdata (struct http_callback_data *cbd)
 {
-	g_atomic_int_set (cbd->map->locked, 0);
+	if (cbd->map->loader == NULL || !cbd->map->loader->unlock) {
+		/* Otherwise unlocked when loader finishes */
+		g_atomic_int_set (cbd->map->locked, 0);
+	}
+
 	if (cbd->remain_buf) {
 		g_string_free (cbd->remain_buf, TRUE);
 	}
 
-	rspamd_http_connection_reset (cbd->data->conn);
-	close (cbd->fd);
+	rspamd_http_pool_release (cbd->map->cfg->http_pool, cbd->data->conn,
+			cbd->reuse);
+	cbd->data->conn = NULL;
 	g_slice_free1 (sizeof (struct http_callback_data), cbd);
 }
 
@@ -155,9 +403,84 @@ http_map_finish (struct rspamd_http_connection *conn,
 {
 	struct http_callback_data *cbd = conn->ud;
 	struct rspamd_map *map;
+	const GString *delta_base;
+	GString *body;
 
 	map = cbd->map;
+	cbd->reuse = (msg->flags & RSPAMD_HTTP_FLAG_KEEP_ALIVE) != 0;
+
+	if (map->shared != NULL && (msg->code == 200 || msg->code == 304)) {
+		map->shared->last_modified = msg->date;
+
+		if (msg->code == 200) {
+			rspamd_map_store_header (msg, "ETag", map->shared->etag,
+					sizeof (map->shared->etag));
+		}
+	}
+
+	if (msg->code == 200 && cbd->remain_buf != NULL &&
+			rspamd_map_reply_is_gzip (msg)) {
+#ifdef WITH_ZLIB
+		body = rspamd_map_inflate (cbd->remain_buf);
+#else
+		body = NULL;
+#endif
+		if (body == NULL) {
+			msg_err ("cannot decompress map %s from %s", map->uri,
+					cbd->data->host);
+			free_http_cbdata (cbd);
+
+			return 0;
+		}
+
+		g_string_free (cbd->remain_buf, TRUE);
+		cbd->remain_buf = body;
+	}
+
 	if (msg->code == 200) {
+		rspamd_map_store_header (msg, "ETag", cbd->data->etag,
+				sizeof (cbd->data->etag));
+	}
+
+	delta_base = rspamd_http_message_find_header (msg, MAP_DELTA_HEADER);
+
+	if (msg->code == 200 && delta_base != NULL) {
+		if (rspamd_map_can_delta (map) && cbd->remain_buf != NULL &&
+				strlen (cbd->data->version) == delta_base->len &&
+				memcmp (cbd->data->version, delta_base->str,
+						delta_base->len) == 0 &&
+				rspamd_map_apply_delta (map, cbd->remain_buf)) {
+			cbd->data->last_checked = msg->date;
+			rspamd_map_store_header (msg, MAP_VERSION_HEADER,
+					cbd->data->version, sizeof (cbd->data->version));
+		}
+		else {
+			/* Request the whole map next time */
+			msg_info ("cannot apply delta to map %s from %s, reload it",
+					map->uri, cbd->data->host);
+			cbd->data->last_checked = 0;
+			cbd->data->etag[0] = '\0';
+			cbd->data->version[0] = '\0';
+		}
+	}
+	else if (msg->code == 200 && map->threaded && cbd->remain_buf != NULL) {
+		cbd->data->last_checked = msg->date;
+		rspamd_map_store_header (msg, MAP_VERSION_HEADER,
+				cbd->data->version, sizeof (cbd->data->version));
+
+		if (rspamd_map_start_loader (map, NULL, cbd->remain_buf, FALSE)) {
+			/* Buffer is owned by loader now */
+			cbd->remain_buf = NULL;
+			msg_info ("read map data from %s", cbd->data->host);
+		}
+		else {
+			map->read_callback (map->pool, cbd->remain_buf->str,
+					cbd->remain_buf->len, &cbd->cbdata);
+			map->fin_callback (map->pool, &cbd->cbdata);
+			*map->user_data = cbd->cbdata.cur_data;
+		}
+	}
+	else if (msg->code == 200) {
 		if (cbd->remain_buf != NULL) {
 			map->read_callback (map->pool, cbd->remain_buf->str,
 					cbd->remain_buf->len, &cbd->cbdata);
@@ -166,6 +489,8 @@ http_map_finish (struct rspamd_http_connection *conn,
 		map->fin_callback (map->pool, &cbd->cbdata);
 		*map->user_data = cbd->cbdata.cur_data;
 		cbd->data->last_checked = msg->date;
+		rspamd_map_store_header (msg, MAP_VERSION_HEADER,
+				cbd->data->version, sizeof (cbd->data->version));
 		msg_info ("read map data from %s", cbd->data->host);
 	}
 	else if (msg->code == 304) {
@@ -199,6 +524,22 @@ http_map_read (struct rspamd_http_connection *conn,
 	}
 
 	map = cbd->map;
+
+	if (map->threaded || rspamd_map_reply_is_gzip (msg) ||
+			rspamd_http_message_find_header (msg, MAP_DELTA_HEADER) != NULL) {
+		/*
+		 * Collect the whole reply to parse it outside of the event loop,
+		 * compressed replies and deltas are also processed when finished
+		 */
+		if (cbd->remain_buf == NULL) {
+			cbd->remain_buf = g_string_sized_new (MAX (len, BUFSIZ));
+		}
+
+		g_string_append_len (cbd->remain_buf, chunk, len);
+
+		return 0;
+	}
+
 	if (cbd->remain_buf != NULL) {
 		/* We need to concatenate incoming buf with the remaining buf */
 		g_string_append_len (cbd->remain_buf, chunk, len);
@@ -229,37 +570,28 @@ http_map_read (struct rspamd_http_connection *conn,
 }
 
 /**
- * Callback for reading data from file
+ * Feed file contents to map read callback, returns length of the unparsed
+ * tail or -1 if file cannot be opened
  */
-static void
-read_map_file (struct rspamd_map *map, struct file_map_data *data)
+static gint
+read_map_file_data (struct rspamd_map *map, const gchar *filename,
+	struct map_cb_data *cbdata)
 {
-	struct map_cb_data cbdata;
 	gchar buf[BUFSIZ], *remain;
 	ssize_t r;
 	gint fd, rlen;
 
-	if (map->read_callback == NULL || map->fin_callback == NULL) {
-		msg_err ("bad callback for reading map file");
-		return;
-	}
-
-	if ((fd = open (data->filename, O_RDONLY)) == -1) {
-		msg_warn ("cannot open file '%s': %s", data->filename,
+	if ((fd = open (filename, O_RDONLY)) == -1) {
+		msg_warn ("cannot open file '%s': %s", filename,
 			strerror (errno));
-		return;
+		return -1;
 	}
 
-	cbdata.state = 0;
-	cbdata.prev_data = *map->user_data;
-	cbdata.cur_data = NULL;
-	cbdata.map = map;
-
 	rlen = 0;
 	while ((r = read (fd, buf + rlen, sizeof (buf) - rlen - 1)) > 0) {
 		r += rlen;
 		buf[r] = '\0';
-		remain = map->read_callback (map->pool, buf, r, &cbdata);
+		remain = map->read_callback (map->pool, buf, r, cbdata);
 		if (remain != NULL) {
 			/* copy remaining buffer to start of buffer */
 			rlen = r - (remain - buf);
@@ -269,12 +601,412 @@ read_map_file (struct rspamd_map *map, struct file_map_data *data)
 
 	close (fd);
 
-	if (rlen > 0) {
+	return rlen;
+}
+
+/**
+ * Callback for reading data from file
+ */
+static void
+read_map_file (struct rspamd_map *map, struct file_map_data *data)
+{
+	struct map_cb_data cbdata;
+
+	if (map->read_callback == NULL || map->fin_callback == NULL) {
+		msg_err ("bad callback for reading map file");
+		return;
+	}
+
+	cbdata.state = 0;
+	cbdata.prev_data = *map->user_data;
+	cbdata.cur_data = NULL;
+	cbdata.map = map;
+
+	if (read_map_file_data (map, data->filename, &cbdata) > 0) {
 		map->fin_callback (map->pool, &cbdata);
 		*map->user_data = cbdata.cur_data;
 	}
 }
 
+/**
+ * Free map data by calling fin callback with it as previous data
+ */
+static void
+rspamd_map_free_data (struct rspamd_map *map, void *data)
+{
+	struct map_cb_data cbdata;
+
+	cbdata.state = 0;
+	cbdata.prev_data = data;
+	cbdata.cur_data = *map->user_data;
+	cbdata.map = map;
+
+	map->fin_callback (map->pool, &cbdata);
+}
+
+static void
+rspamd_map_retired_free (struct rspamd_map_retired *ret)
+{
+	if (ret->data != NULL) {
+		rspamd_map_free_data (ret->map, ret->data);
+		ret->data = NULL;
+	}
+
+	ret->map->retired = NULL;
+	g_slice_free1 (sizeof (*ret), ret);
+}
+
+static void
+rspamd_map_retired_callback (gint fd, short what, void *ud)
+{
+	rspamd_map_retired_free (ud);
+}
+
+/**
+ * Publish new map data and schedule the previous version to be freed later
+ */
+static void
+rspamd_map_publish (struct rspamd_map *map, void *data)
+{
+	struct rspamd_map_retired *ret;
+	void *old;
+
+	old = g_atomic_pointer_get (map->user_data);
+	g_atomic_pointer_set (map->user_data, data);
+
+	if (map->retired != NULL) {
+		/* Previous version is older than one reload period */
+		evtimer_del (&map->retired->ev);
+		rspamd_map_retired_free (map->retired);
+	}
+
+	if (old == NULL) {
+		return;
+	}
+
+	ret = g_slice_alloc0 (sizeof (*ret));
+	ret->map = map;
+	ret->data = old;
+	map->retired = ret;
+
+	evtimer_set (&ret->ev, rspamd_map_retired_callback, ret);
+	event_base_set (map->ev_base, &ret->ev);
+	double_to_tv (map->cfg->map_timeout, &ret->tv);
+	evtimer_add (&ret->ev, &ret->tv);
+}
+
+static void
+rspamd_map_loader_free (struct rspamd_map_loader *ld)
+{
+	if (ld->buf) {
+		g_string_free (ld->buf, TRUE);
+	}
+
+	g_free (ld->filename);
+	g_free (ld->image_path);
+	close (ld->wake_fd[0]);
+	close (ld->wake_fd[1]);
+	g_slice_free1 (sizeof (*ld), ld);
+}
+
+static void
+rspamd_map_image_path (struct rspamd_map *map, gint generation, gchar *buf,
+	gsize len)
+{
+	rspamd_snprintf (buf, len, "%s/rspamd-map-%ud-%d.img",
+		map->cfg->map_cache_dir, map->id, generation);
+}
+
+static inline gboolean
+rspamd_map_is_radix (struct rspamd_map *map)
+{
+	return map->read_callback == rspamd_radix_read;
+}
+
+/**
+ * Write image atomically, so other processes either see the whole image or
+ * nothing
+ */
+static gboolean
+rspamd_map_write_image (const gchar *path, const guchar *data, gsize len)
+{
+	gchar tmp_path[PATH_MAX];
+	gssize r;
+	gint fd;
+
+	rspamd_snprintf (tmp_path, sizeof (tmp_path), "%s.tmp", path);
+
+	if ((fd = open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 00644)) == -1) {
+		msg_err ("cannot create map image %s: %s", tmp_path, strerror (errno));
+		return FALSE;
+	}
+
+	while (len > 0) {
+		if ((r = write (fd, data, len)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			msg_err ("cannot write map image %s: %s", tmp_path,
+				strerror (errno));
+			close (fd);
+			unlink (tmp_path);
+			return FALSE;
+		}
+
+		data += r;
+		len -= r;
+	}
+
+	close (fd);
+
+	if (rename (tmp_path, path) == -1) {
+		msg_err ("cannot rename map image %s: %s", tmp_path, strerror (errno));
+		unlink (tmp_path);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static radix_compressed_t *
+rspamd_map_load_radix_image (const gchar *path)
+{
+	radix_compressed_t *tree;
+	struct stat st;
+	gpointer map;
+	gint fd;
+
+	if ((fd = open (path, O_RDONLY)) == -1) {
+		msg_warn ("cannot open map image %s: %s", path, strerror (errno));
+		return NULL;
+	}
+
+	if (fstat (fd, &st) == -1 || st.st_size == 0) {
+		msg_warn ("cannot stat map image %s: %s", path, strerror (errno));
+		close (fd);
+		return NULL;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		msg_warn ("cannot mmap map image %s: %s", path, strerror (errno));
+		return NULL;
+	}
+
+	tree = radix_create_compressed_image (map, st.st_size, TRUE);
+
+	if (tree == NULL) {
+		munmap (map, st.st_size);
+	}
+
+	return tree;
+}
+
+/**
+ * Use image written by another process if it is newer than the current
+ * data, returns TRUE if it is loaded or being loaded
+ */
+static gboolean
+rspamd_map_check_shared (struct rspamd_map *map)
+{
+	radix_compressed_t *tree;
+	struct file_map_data *fdata;
+	gchar path[PATH_MAX];
+	gint gen;
+
+	if (map->shared == NULL || map->loader != NULL) {
+		return FALSE;
+	}
+
+	gen = g_atomic_int_get (&map->shared->generation);
+
+	if (gen == 0 || gen == map->generation) {
+		return FALSE;
+	}
+
+	rspamd_map_image_path (map, gen, path, sizeof (path));
+
+	if (rspamd_map_is_radix (map)) {
+		if ((tree = rspamd_map_load_radix_image (path)) == NULL) {
+			return FALSE;
+		}
+
+		map->generation = gen;
+		rspamd_map_publish (map, tree);
+		msg_info ("map %s has been loaded from image %s", map->uri, path);
+	}
+	else if (!rspamd_map_start_loader (map, path, NULL, TRUE)) {
+		return FALSE;
+	}
+	else {
+		map->loader->generation = gen;
+	}
+
+	if (map->protocol == MAP_PROTO_FILE) {
+		/* Do not reread file that has been already processed */
+		fdata = map->map_data;
+		(void)stat (fdata->filename, &fdata->st);
+	}
+
+	return TRUE;
+}
+
+static gpointer
+rspamd_map_loader_thread (gpointer ud)
+{
+	struct rspamd_map_loader *ld = ud;
+	struct rspamd_map *map = ld->map;
+	GByteArray *img;
+	guchar c = 1;
+
+	if (ld->buf != NULL) {
+		map->read_callback (map->pool, ld->buf->str, ld->buf->len,
+				&ld->cbdata);
+		ld->success = ld->cbdata.cur_data != NULL;
+	}
+	else {
+		ld->success = read_map_file_data (map, ld->filename,
+				&ld->cbdata) != -1 && ld->cbdata.cur_data != NULL;
+	}
+
+	if (ld->success && rspamd_map_is_radix (map)) {
+		/* Build lookup tries out of the event loop as well */
+		radix_compile_compressed (ld->cbdata.cur_data);
+	}
+
+	if (ld->success && ld->image_path != NULL) {
+		if (rspamd_map_is_radix (map)) {
+			img = radix_serialize_compressed (ld->cbdata.cur_data);
+			ld->image_written = rspamd_map_write_image (ld->image_path,
+					img->data, img->len);
+			g_byte_array_free (img, TRUE);
+		}
+		else if (ld->buf != NULL) {
+			/* Others parse the raw reply but do not fetch it */
+			ld->image_written = rspamd_map_write_image (ld->image_path,
+					(const guchar *)ld->buf->str, ld->buf->len);
+		}
+	}
+
+	/* Wake up event loop */
+	while (write (ld->wake_fd[1], &c, sizeof (c)) == -1 && errno == EINTR);
+
+	return NULL;
+}
+
+/**
+ * Called from the event loop when loader thread is done
+ */
+static void
+rspamd_map_loader_finish (gint fd, short what, void *ud)
+{
+	struct rspamd_map_loader *ld = ud;
+	struct rspamd_map *map = ld->map;
+	gchar path[PATH_MAX];
+	gint old_gen;
+
+	event_del (&ld->ev);
+	g_thread_join (ld->thr);
+
+	if (ld->success) {
+		rspamd_map_publish (map, ld->cbdata.cur_data);
+		msg_info ("map %s has been reloaded", map->uri);
+
+		if (ld->image_written) {
+			/* Let other processes use the new image */
+			old_gen = g_atomic_int_get (&map->shared->generation);
+			g_atomic_int_set (&map->shared->generation, ld->generation);
+
+			if (old_gen != 0) {
+				rspamd_map_image_path (map, old_gen, path, sizeof (path));
+				unlink (path);
+			}
+		}
+
+		if (ld->image_written || ld->image_path == NULL) {
+			map->generation = ld->generation;
+		}
+	}
+	else if (ld->cbdata.cur_data != NULL) {
+		rspamd_map_free_data (map, ld->cbdata.cur_data);
+	}
+
+	map->loader = NULL;
+
+	if (ld->unlock) {
+		g_atomic_int_set (map->locked, 0);
+	}
+
+	rspamd_map_loader_free (ld);
+}
+
+/**
+ * Start parsing map data in a separate thread, takes ownership of buf on
+ * success. If shared_image is TRUE then filename is an image written by
+ * another process, otherwise this process holds map lock and writes image
+ * for others if map is shared.
+ */
+static gboolean
+rspamd_map_start_loader (struct rspamd_map *map, const gchar *filename,
+	GString *buf, gboolean shared_image)
+{
+	struct rspamd_map_loader *ld;
+	gchar path[PATH_MAX];
+	GError *err = NULL;
+
+	if (map->loader != NULL || map->ev_base == NULL) {
+		return FALSE;
+	}
+
+	ld = g_slice_alloc0 (sizeof (*ld));
+
+	if (pipe (ld->wake_fd) == -1) {
+		msg_err ("cannot create pipe for map loader: %s", strerror (errno));
+		g_slice_free1 (sizeof (*ld), ld);
+		return FALSE;
+	}
+
+	ld->map = map;
+	ld->buf = buf;
+	ld->filename = g_strdup (filename);
+	ld->cbdata.state = 0;
+	ld->cbdata.prev_data = *map->user_data;
+	ld->cbdata.cur_data = NULL;
+	ld->cbdata.map = map;
+	ld->unlock = !shared_image;
+	ld->generation = map->generation;
+
+	if (!shared_image && map->shared != NULL &&
+			(rspamd_map_is_radix (map) || buf != NULL)) {
+		ld->generation = g_atomic_int_get (&map->shared->generation) + 1;
+		rspamd_map_image_path (map, ld->generation, path, sizeof (path));
+		ld->image_path = g_strdup (path);
+	}
+
+	event_set (&ld->ev, ld->wake_fd[0], EV_READ, rspamd_map_loader_finish, ld);
+	event_base_set (map->ev_base, &ld->ev);
+	event_add (&ld->ev, NULL);
+
+	ld->thr = rspamd_create_thread ("map", rspamd_map_loader_thread, ld, &err);
+
+	if (ld->thr == NULL) {
+		msg_err ("cannot start map loader thread: %e", err);
+		g_error_free (err);
+		event_del (&ld->ev);
+		/* Buffer is still owned by caller */
+		ld->buf = NULL;
+		rspamd_map_loader_free (ld);
+		return FALSE;
+	}
+
+	map->loader = ld;
+
+	return TRUE;
+}
+
 static void
 jitter_timeout_event (struct rspamd_map *map, gboolean locked, gboolean initial)
 {
@@ -306,6 +1038,11 @@ file_callback (gint fd, short what, void *ud)
 	struct file_map_data *data = map->map_data;
 	struct stat st;
 
+	if (rspamd_map_check_shared (map)) {
+		jitter_timeout_event (map, FALSE, FALSE);
+		return;
+	}
+
 	if (g_atomic_int_get (map->locked)) {
 		msg_info (
 			"don't try to reread map as it is locked by other process, will reread it later");
@@ -327,10 +1064,82 @@ file_callback (gint fd, short what, void *ud)
 	}
 
 	msg_info ("rereading map file %s", data->filename);
+
+	if (map->threaded && map->read_callback != NULL &&
+			map->fin_callback != NULL &&
+			rspamd_map_start_loader (map, data->filename, NULL, FALSE)) {
+		/* Unlocked when loader finishes */
+		return;
+	}
+
 	read_map_file (map, data);
 	g_atomic_int_set (map->locked, 0);
 }
 
+static struct cdb *
+rspamd_cdb_map_open (const gchar *filename)
+{
+	struct cdb *cdb;
+	gint fd;
+
+	if ((fd = open (filename, O_RDONLY)) == -1) {
+		msg_warn ("cannot open cdb map '%s': %s", filename, strerror (errno));
+		return NULL;
+	}
+
+	cdb = g_slice_alloc0 (sizeof (*cdb));
+
+	if (cdb_init (cdb, fd) == -1) {
+		msg_warn ("cannot load cdb map '%s': %s", filename, strerror (errno));
+		close (fd);
+		g_slice_free1 (sizeof (*cdb), cdb);
+
+		return NULL;
+	}
+
+	/* File is mapped to memory, so descriptor is not needed */
+	close (fd);
+	cdb->cdb_fd = -1;
+
+	return cdb;
+}
+
+static void
+rspamd_cdb_map_fin (rspamd_mempool_t *pool, struct map_cb_data *data)
+{
+	if (data->prev_data) {
+		rspamd_cdb_map_free (data->prev_data);
+	}
+}
+
+/**
+ * CDB maps are not parsed: a new file is mapped to memory and published, so
+ * all processes share the same pages. Files should be replaced atomically by
+ * rename, a new inode is treated as a new version even if mtime is the same
+ */
+static void
+cdb_callback (gint fd, short what, void *ud)
+{
+	struct rspamd_map *map = ud;
+	struct cdb_map_data *data = map->map_data;
+	struct cdb *cdb;
+	struct stat st;
+
+	jitter_timeout_event (map, FALSE, FALSE);
+
+	if (stat (data->filename, &st) == -1 ||
+			(st.st_ino == data->st.st_ino && st.st_dev == data->st.st_dev &&
+			st.st_mtime == data->st.st_mtime && st.st_size == data->st.st_size)) {
+		return;
+	}
+
+	if ((cdb = rspamd_cdb_map_open (data->filename)) != NULL) {
+		memcpy (&data->st, &st, sizeof (struct stat));
+		msg_info ("reloaded cdb map %s", data->filename);
+		rspamd_map_publish (map, cdb);
+	}
+}
+
 /**
  * Async HTTP callback
  */
@@ -339,13 +1148,18 @@ http_callback (gint fd, short what, void *ud)
 {
 	struct rspamd_map *map = ud;
 	struct http_map_data *data = map->map_data;
-	gint sock;
 	struct http_callback_data *cbd;
+	time_t now;
+
+	if (rspamd_map_check_shared (map)) {
+		jitter_timeout_event (map, FALSE, FALSE);
+		return;
+	}
 
 	if (g_atomic_int_get (map->locked)) {
 		msg_info (
 			"don't try to reread map as it is locked by other process, will reread it later");
-		if (data->conn->ud == NULL) {
+		if (data->conn == NULL) {
 			jitter_timeout_event (map, TRUE, TRUE);
 		}
 		else {
@@ -356,8 +1170,32 @@ http_callback (gint fd, short what, void *ud)
 
 	g_atomic_int_inc (map->locked);
 	jitter_timeout_event (map, FALSE, FALSE);
+
+	if (map->shared != NULL) {
+		now = time (NULL);
+
+		if (map->generation == map->shared->generation &&
+				now - map->shared->last_fetch < map->cfg->map_timeout) {
+			/* Another process has just checked this map */
+			g_atomic_int_set (map->locked, 0);
+			return;
+		}
+
+		map->shared->last_fetch = now;
+	}
+
+	/* Pool is created after fork, so each worker has its own connections */
+	if (map->cfg->http_pool == NULL) {
+		map->cfg->http_pool = rspamd_http_pool_init ();
+	}
+
 	/* Connect asynced */
-	if ((sock = connect_http (map, data, TRUE)) == -1) {
+	data->conn = rspamd_http_pool_connect (map->cfg->http_pool, map->ev_base,
+			data->inet_addr, NULL, http_map_read, http_map_error,
+			http_map_finish,
+			RSPAMD_HTTP_BODY_PARTIAL | RSPAMD_HTTP_CLIENT_SIMPLE);
+
+	if (data->conn == NULL) {
 		g_atomic_int_set (map->locked, 0);
 		return;
 	}
@@ -374,7 +1212,8 @@ http_callback (gint fd, short what, void *ud)
 		cbd->cbdata.map = cbd->map;
 		cbd->tv.tv_sec = HTTP_CONNECT_TIMEOUT;
 		cbd->tv.tv_usec = 0;
-		cbd->fd = sock;
+		cbd->fd = data->conn->fd;
+		cbd->reuse = FALSE;
 		data->conn->ud = cbd;
 		msg_debug ("reading map data from %s", data->host);
 		write_http_request (cbd);
@@ -382,12 +1221,43 @@ http_callback (gint fd, short what, void *ud)
 }
 
 /* Start watching event for all maps */
+/* Maximum number of maps read concurrently on start */
+#define MAP_INITIAL_READERS 8
+
+static gpointer
+rspamd_map_initial_read_thread (gpointer ud)
+{
+	struct rspamd_map *map = ud;
+
+	read_map_file (map, map->map_data);
+
+	return NULL;
+}
+
+static void
+rspamd_map_join_readers (GPtrArray *readers)
+{
+	guint i;
+
+	for (i = 0; i < readers->len; i ++) {
+		g_thread_join (g_ptr_array_index (readers, i));
+	}
+
+	g_ptr_array_set_size (readers, 0);
+}
+
 void
 rspamd_map_watch (struct rspamd_config *cfg, struct event_base *ev_base)
 {
 	GList *cur = cfg->maps;
 	struct rspamd_map *map;
 	struct file_map_data *fdata;
+	struct cdb_map_data *cdata;
+	GPtrArray *readers;
+	GThread *thr;
+	GError *err = NULL;
+
+	readers = g_ptr_array_new ();
 
 	/* First of all do synced read of data */
 	while (cur) {
@@ -398,9 +1268,35 @@ rspamd_map_watch (struct rspamd_config *cfg, struct event_base *ev_base)
 			evtimer_set (&map->ev, file_callback, map);
 			/* Read initial data */
 			fdata = map->map_data;
-			if (fdata->st.st_mtime != -1) {
+			if (rspamd_map_check_shared (map)) {
+				/* Loaded from image written by another process */
+			}
+			else if (fdata->st.st_mtime != -1) {
 				/* Do not try to read non-existent file */
-				read_map_file (map, map->map_data);
+				thr = NULL;
+
+				if (map->threaded) {
+					/* Common lists are parsed concurrently */
+					if (readers->len >= MAP_INITIAL_READERS) {
+						rspamd_map_join_readers (readers);
+					}
+
+					thr = rspamd_create_thread ("map",
+							rspamd_map_initial_read_thread, map, &err);
+
+					if (thr == NULL) {
+						msg_warn ("cannot start map reader thread: %e", err);
+						g_error_free (err);
+						err = NULL;
+					}
+					else {
+						g_ptr_array_add (readers, thr);
+					}
+				}
+
+				if (thr == NULL) {
+					read_map_file (map, map->map_data);
+				}
 			}
 			/* Plan event with jitter */
 			jitter_timeout_event (map, FALSE, TRUE);
@@ -409,13 +1305,65 @@ rspamd_map_watch (struct rspamd_config *cfg, struct event_base *ev_base)
 			evtimer_set (&map->ev, http_callback, map);
 			jitter_timeout_event (map, FALSE, TRUE);
 		}
+		else if (map->protocol == MAP_PROTO_CDB) {
+			evtimer_set (&map->ev, cdb_callback, map);
+			cdata = map->map_data;
+
+			if (*map->user_data == NULL && cdata->st.st_mtime != -1) {
+				*map->user_data = rspamd_cdb_map_open (cdata->filename);
+			}
+
+			jitter_timeout_event (map, FALSE, FALSE);
+		}
 		cur = g_list_next (cur);
 	}
+
+	rspamd_map_join_readers (readers);
+	g_ptr_array_free (readers, TRUE);
 }
 
 void
 rspamd_map_remove_all (struct rspamd_config *cfg)
 {
+	GList *cur;
+	struct rspamd_map *map;
+	struct rspamd_map_loader *ld;
+	gchar path[PATH_MAX];
+
+	for (cur = cfg->maps; cur != NULL; cur = g_list_next (cur)) {
+		map = cur->data;
+
+		if (map->loader != NULL) {
+			/* Wait for loader and drop its data */
+			ld = map->loader;
+			event_del (&ld->ev);
+			g_thread_join (ld->thr);
+
+			if (ld->cbdata.cur_data != NULL) {
+				rspamd_map_free_data (map, ld->cbdata.cur_data);
+			}
+
+			map->loader = NULL;
+
+			if (ld->unlock) {
+				g_atomic_int_set (map->locked, 0);
+			}
+
+			rspamd_map_loader_free (ld);
+		}
+
+		if (map->retired != NULL) {
+			evtimer_del (&map->retired->ev);
+			rspamd_map_retired_free (map->retired);
+		}
+
+		if (map->shared != NULL && map->shared->generation != 0) {
+			rspamd_map_image_path (map, map->shared->generation, path,
+				sizeof (path));
+			unlink (path);
+		}
+	}
+
 	g_list_free (cfg->maps);
 	cfg->maps = NULL;
 	if (cfg->map_pool != NULL) {
@@ -441,6 +1389,12 @@ rspamd_map_check_proto (const gchar *map_line, gint *res, const gchar **pos)
 			*pos = map_line + sizeof ("file://") - 1;
 		}
 	}
+	else if (rspamd_map_is_cdb (map_line)) {
+		if (res && pos) {
+			*res = MAP_PROTO_CDB;
+			*pos = map_line + sizeof ("cdb://") - 1;
+		}
+	}
 	else if (*map_line == '/') {
 		/* Trivial file case */
 		*res = MAP_PROTO_FILE;
@@ -466,6 +1420,7 @@ rspamd_map_add (struct rspamd_config *cfg,
 	enum fetch_proto proto;
 	const gchar *def, *p, *hostend;
 	struct file_map_data *fdata;
+	struct cdb_map_data *cdata;
 	struct http_map_data *hdata;
 	gchar portbuf[6];
 	gint i, s, r;
@@ -475,6 +1430,11 @@ rspamd_map_add (struct rspamd_config *cfg,
 	if (!rspamd_map_check_proto (map_line, (int *)&proto, &def)) {
 		return FALSE;
 	}
+	if (proto == MAP_PROTO_CDB && read_callback != NULL) {
+		msg_err ("cdb map %s cannot be used as %s", map_line,
+			description ? description : "a list");
+		return FALSE;
+	}
 	/* Constant pool */
 	if (cfg->map_pool == NULL) {
 		cfg->map_pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
@@ -486,10 +1446,26 @@ rspamd_map_add (struct rspamd_config *cfg,
 	new_map->protocol = proto;
 	new_map->cfg = cfg;
 	new_map->id = g_random_int ();
+	/* Common lists callbacks do not depend on the event loop state */
+	new_map->threaded = (read_callback == rspamd_radix_read ||
+		read_callback == rspamd_hosts_read ||
+		read_callback == rspamd_kv_list_read);
+
+	if (cfg->map_cache_dir != NULL && new_map->threaded &&
+			(proto == MAP_PROTO_HTTP || read_callback == rspamd_radix_read)) {
+		/* Should be allocated before workers are forked to be really shared */
+		new_map->shared = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+				sizeof (struct rspamd_map_shared));
+	}
 	new_map->locked =
 		rspamd_mempool_alloc0_shared (cfg->cfg_pool, sizeof (gint));
 
-	if (proto == MAP_PROTO_FILE) {
+	if (proto == MAP_PROTO_CDB) {
+		/* Used to free retired versions */
+		new_map->fin_callback = rspamd_cdb_map_fin;
+	}
+
+	if (proto == MAP_PROTO_FILE || proto == MAP_PROTO_CDB) {
 		new_map->uri = rspamd_mempool_strdup (cfg->cfg_pool, def);
 		def = new_map->uri;
 	}
@@ -500,29 +1476,49 @@ rspamd_map_add (struct rspamd_config *cfg,
 		new_map->description =
 			rspamd_mempool_strdup (cfg->cfg_pool, description);
 	}
-
-	/* Now check for each proto separately */
-	if (proto == MAP_PROTO_FILE) {
-		fdata =
+
+	/* Now check for each proto separately */
+	if (proto == MAP_PROTO_FILE) {
+		fdata =
+			rspamd_mempool_alloc0 (cfg->map_pool,
+				sizeof (struct file_map_data));
+		if (access (def, R_OK) == -1) {
+			if (errno != ENOENT) {
+				msg_err ("cannot open file '%s': %s", def, strerror (errno));
+				return FALSE;
+
+			}
+			msg_info (
+				"map '%s' is not found, but it can be loaded automatically later",
+				def);
+			/* We still can add this file */
+			fdata->st.st_mtime = -1;
+		}
+		else {
+			stat (def, &fdata->st);
+		}
+		fdata->filename = rspamd_mempool_strdup (cfg->map_pool, def);
+		new_map->map_data = fdata;
+	}
+	else if (proto == MAP_PROTO_CDB) {
+		cdata =
 			rspamd_mempool_alloc0 (cfg->map_pool,
-				sizeof (struct file_map_data));
+				sizeof (struct cdb_map_data));
 		if (access (def, R_OK) == -1) {
 			if (errno != ENOENT) {
 				msg_err ("cannot open file '%s': %s", def, strerror (errno));
 				return FALSE;
-
 			}
 			msg_info (
 				"map '%s' is not found, but it can be loaded automatically later",
 				def);
-			/* We still can add this file */
-			fdata->st.st_mtime = -1;
+			cdata->st.st_mtime = -1;
 		}
 		else {
-			stat (def, &fdata->st);
+			stat (def, &cdata->st);
 		}
-		fdata->filename = rspamd_mempool_strdup (cfg->map_pool, def);
-		new_map->map_data = fdata;
+		cdata->filename = rspamd_mempool_strdup (cfg->map_pool, def);
+		new_map->map_data = cdata;
 	}
 	else if (proto == MAP_PROTO_HTTP) {
 		hdata =
@@ -587,10 +1583,12 @@ rspamd_map_add (struct rspamd_config *cfg,
 			return FALSE;
 		}
 		close (s);
-		hdata->conn = rspamd_http_connection_new (http_map_read, http_map_error,
-			http_map_finish,
-			RSPAMD_HTTP_BODY_PARTIAL | RSPAMD_HTTP_CLIENT_SIMPLE,
-			RSPAMD_HTTP_CLIENT, NULL);
+		/* Connections of http maps are shared with other http clients */
+		hdata->inet_addr = rspamd_inet_address_from_sa (hdata->addr->ai_addr,
+				hdata->addr->ai_addrlen);
+		rspamd_mempool_add_destructor (cfg->cfg_pool,
+			(rspamd_mempool_destruct_t)rspamd_inet_address_destroy,
+			hdata->inet_addr);
 		new_map->map_data = hdata;
 	}
 	/* Temp pool */
@@ -873,7 +1871,606 @@ rspamd_radix_read (rspamd_mempool_t * pool,
 void
 rspamd_radix_fin (rspamd_mempool_t * pool, struct map_cb_data *data)
 {
+	if (data->cur_data) {
+		radix_compile_compressed (data->cur_data);
+	}
 	if (data->prev_data) {
 		radix_destroy_compressed (data->prev_data);
 	}
 }
+
+/*
+ * Regexp maps
+ *
+ * All entries of a map are compiled to a single matcher: the longest literal
+ * that must occur in a match of an entry is extracted and all literals are
+ * placed to two Aho-Corasick tries (case sensitive and caseless ones). When
+ * a string is checked, only entries whose literals were found by tries (or
+ * entries which have no usable literals) are verified by pcre.
+ */
+#define REGEXP_MAP_MIN_LITERAL 3
+
+struct rspamd_regexp_map_literal {
+	gchar *str;
+	gsize len;
+	GArray *ids;
+};
+
+struct rspamd_regexp_map {
+	GPtrArray *regexps;
+	GPtrArray *patterns;
+	GPtrArray *literals;
+	GHashTable *literals_hash;
+	GArray *exact_ids;
+	GArray *caseless_ids;
+	GArray *unfiltered;
+	ac_trie_t *exact_trie;
+	ac_trie_t *caseless_trie;
+	gboolean glob;
+	gboolean compiled;
+};
+
+struct rspamd_regexp_map_cbdata {
+	GArray *literal_ids;
+	GPtrArray *literals;
+	guchar *candidates;
+};
+
+static struct rspamd_regexp_map *
+rspamd_regexp_map_create (gboolean glob)
+{
+	struct rspamd_regexp_map *re_map;
+
+	re_map = g_slice_alloc0 (sizeof (*re_map));
+	re_map->regexps = g_ptr_array_new ();
+	re_map->patterns = g_ptr_array_new ();
+	re_map->literals = g_ptr_array_new ();
+	re_map->literals_hash = g_hash_table_new (g_str_hash, g_str_equal);
+	re_map->unfiltered = g_array_new (FALSE, FALSE, sizeof (guint));
+	re_map->glob = glob;
+
+	return re_map;
+}
+
+static void
+rspamd_regexp_map_destroy (struct rspamd_regexp_map *re_map)
+{
+	struct rspamd_regexp_map_literal *lit;
+	guint i;
+
+	for (i = 0; i < re_map->regexps->len; i ++) {
+		rspamd_regexp_unref (g_ptr_array_index (re_map->regexps, i));
+		g_free (g_ptr_array_index (re_map->patterns, i));
+	}
+
+	for (i = 0; i < re_map->literals->len; i ++) {
+		lit = g_ptr_array_index (re_map->literals, i);
+		g_free (lit->str);
+		g_array_free (lit->ids, TRUE);
+		g_slice_free1 (sizeof (*lit), lit);
+	}
+
+	if (re_map->literals_hash) {
+		g_hash_table_destroy (re_map->literals_hash);
+	}
+	if (re_map->exact_trie) {
+		acism_destroy (re_map->exact_trie);
+	}
+	if (re_map->caseless_trie) {
+		acism_destroy (re_map->caseless_trie);
+	}
+	if (re_map->exact_ids) {
+		g_array_free (re_map->exact_ids, TRUE);
+	}
+	if (re_map->caseless_ids) {
+		g_array_free (re_map->caseless_ids, TRUE);
+	}
+
+	g_ptr_array_free (re_map->regexps, TRUE);
+	g_ptr_array_free (re_map->patterns, TRUE);
+	g_ptr_array_free (re_map->literals, TRUE);
+	g_array_free (re_map->unfiltered, TRUE);
+	g_slice_free1 (sizeof (*re_map), re_map);
+}
+
+static inline void
+rspamd_regexp_map_flush_literal (GString *cur, GString *best)
+{
+	if (cur->len > best->len) {
+		g_string_assign (best, cur->str);
+	}
+
+	g_string_truncate (cur, 0);
+}
+
+/*
+ * Extract the longest literal that must be present in any string matched by
+ * the pattern. The parser is conservative: it refuses to extract literals
+ * from patterns with alternations, extended syntax or unknown escapes.
+ */
+static gboolean
+rspamd_regexp_map_extract_literal (const gchar *pattern, gboolean caseless,
+		GString *best)
+{
+	const gchar *p = pattern;
+	GString *cur;
+	gint depth = 0;
+	gboolean ret = FALSE;
+	gchar c;
+
+	cur = g_string_sized_new (32);
+	g_string_truncate (best, 0);
+
+	while (*p) {
+		c = *p;
+
+		if (c == '\\') {
+			p ++;
+			c = *p;
+
+			if (c == '\0') {
+				goto end;
+			}
+			else if (depth > 0) {
+				/* Just skip escaped character */
+			}
+			else if (strchr ("dDwWsSbBAzZG", c) != NULL) {
+				rspamd_regexp_map_flush_literal (cur, best);
+			}
+			else if (c == 'n' || c == 't' || c == 'r') {
+				g_string_append_c (cur, c == 'n' ? '\n' :
+						(c == 't' ? '\t' : '\r'));
+			}
+			else if (g_ascii_ispunct (c) || c == ' ') {
+				g_string_append_c (cur,
+						caseless ? g_ascii_tolower (c) : c);
+			}
+			else {
+				/* Backreferences, hex codes, properties and so on */
+				goto end;
+			}
+
+			p ++;
+			continue;
+		}
+
+		if (c == '[') {
+			/* Character class is skipped entirely */
+			rspamd_regexp_map_flush_literal (cur, best);
+			p ++;
+
+			if (*p == '^') {
+				p ++;
+			}
+			if (*p == ']') {
+				p ++;
+			}
+
+			while (*p && *p != ']') {
+				if (*p == '\\' && p[1] != '\0') {
+					p ++;
+				}
+				p ++;
+			}
+
+			if (*p == '\0') {
+				goto end;
+			}
+
+			p ++;
+			continue;
+		}
+
+		switch (c) {
+		case '(':
+			if (p[1] == '?') {
+				/* Inline flags, lookarounds and other extensions */
+				goto end;
+			}
+			if (depth == 0) {
+				rspamd_regexp_map_flush_literal (cur, best);
+			}
+			depth ++;
+			break;
+		case ')':
+			if (depth == 0) {
+				goto end;
+			}
+			depth --;
+			break;
+		case '|':
+			if (depth == 0) {
+				goto end;
+			}
+			break;
+		case '*':
+		case '?':
+		case '{':
+			if (depth == 0) {
+				/* Previous character is optional */
+				if (cur->len > 0) {
+					g_string_truncate (cur, cur->len - 1);
+				}
+				rspamd_regexp_map_flush_literal (cur, best);
+			}
+			if (c == '{') {
+				while (*p && *p != '}') {
+					p ++;
+				}
+				if (*p == '\0') {
+					goto end;
+				}
+			}
+			break;
+		case '+':
+		case '.':
+		case '^':
+		case '$':
+			if (depth == 0) {
+				rspamd_regexp_map_flush_literal (cur, best);
+			}
+			break;
+		default:
+			if (depth == 0) {
+				if (caseless && (guchar)c >= 0x80) {
+					/* We cannot lowercase utf8 characters here */
+					goto end;
+				}
+				g_string_append_c (cur, caseless ? g_ascii_tolower (c) : c);
+			}
+			break;
+		}
+
+		p ++;
+	}
+
+	if (depth == 0) {
+		/* A quantifier may follow the last character, ignore it */
+		rspamd_regexp_map_flush_literal (cur, best);
+		ret = best->len >= REGEXP_MAP_MIN_LITERAL;
+	}
+
+end:
+	g_string_free (cur, TRUE);
+
+	return ret;
+}
+
+/*
+ * Convert glob pattern to a regular expression matching the whole string
+ */
+static gchar *
+rspamd_regexp_map_glob_to_re (const gchar *glob)
+{
+	GString *res;
+	const gchar *p;
+
+	res = g_string_sized_new (strlen (glob) * 2 + 2);
+	g_string_append_c (res, '^');
+
+	for (p = glob; *p; p ++) {
+		if (*p == '*') {
+			g_string_append (res, ".*");
+		}
+		else if (*p == '?') {
+			g_string_append_c (res, '.');
+		}
+		else if ((guchar)*p < 0x80 && !g_ascii_isalnum (*p)) {
+			g_string_append_c (res, '\\');
+			g_string_append_c (res, *p);
+		}
+		else {
+			g_string_append_c (res, *p);
+		}
+	}
+
+	g_string_append_c (res, '$');
+
+	return g_string_free (res, FALSE);
+}
+
+static void
+rspamd_regexp_map_insert_helper (gpointer st, gconstpointer key,
+		gconstpointer value)
+{
+	struct rspamd_regexp_map *re_map = st;
+	const gchar *line = key;
+	struct rspamd_regexp_map_literal *lit;
+	rspamd_regexp_t *re;
+	GError *err = NULL;
+	GString *literal;
+	gchar *glob_re, *lit_key;
+	gboolean caseless;
+	guint id;
+
+	if (re_map->glob) {
+		glob_re = rspamd_regexp_map_glob_to_re (line);
+		re = rspamd_regexp_new (glob_re, "i", &err);
+		g_free (glob_re);
+	}
+	else {
+		/* Lines that are not enclosed in slashes are plain patterns */
+		re = rspamd_regexp_new (line, *line == '/' ? NULL : "", &err);
+	}
+
+	if (re == NULL) {
+		msg_warn ("cannot parse regexp map entry '%s': %s", line,
+				err ? err->message : "unknown error");
+		if (err) {
+			g_error_free (err);
+		}
+
+		return;
+	}
+
+	id = re_map->regexps->len;
+	g_ptr_array_add (re_map->regexps, re);
+	g_ptr_array_add (re_map->patterns, g_strdup (line));
+
+	caseless = (rspamd_regexp_get_pcre_flags (re) & PCRE_CASELESS) != 0;
+	literal = g_string_sized_new (32);
+
+	if ((rspamd_regexp_get_pcre_flags (re) & PCRE_EXTENDED) == 0 &&
+			rspamd_regexp_map_extract_literal (rspamd_regexp_get_pattern (re),
+					caseless, literal)) {
+		/* Literals are prefixed by the kind of a trie they belong to */
+		lit_key = g_strdup_printf ("%c%s", caseless ? 'i' : 'e', literal->str);
+		lit = g_hash_table_lookup (re_map->literals_hash, lit_key);
+
+		if (lit == NULL) {
+			lit = g_slice_alloc (sizeof (*lit));
+			lit->str = lit_key;
+			lit->len = literal->len;
+			lit->ids = g_array_sized_new (FALSE, FALSE, sizeof (guint), 1);
+			g_ptr_array_add (re_map->literals, lit);
+			g_hash_table_insert (re_map->literals_hash, lit->str, lit);
+		}
+		else {
+			g_free (lit_key);
+		}
+
+		g_array_append_val (lit->ids, id);
+	}
+	else {
+		g_array_append_val (re_map->unfiltered, id);
+	}
+
+	g_string_free (literal, TRUE);
+}
+
+static void
+rspamd_regexp_map_compile (struct rspamd_regexp_map *re_map)
+{
+	struct rspamd_regexp_map_literal *lit;
+	ac_trie_pat_t *exact, *caseless;
+	guint i, nexact = 0, ncaseless = 0;
+
+	if (re_map->compiled) {
+		return;
+	}
+
+	exact = g_new (ac_trie_pat_t, re_map->literals->len);
+	caseless = g_new (ac_trie_pat_t, re_map->literals->len);
+	re_map->exact_ids = g_array_new (FALSE, FALSE, sizeof (guint));
+	re_map->caseless_ids = g_array_new (FALSE, FALSE, sizeof (guint));
+
+	for (i = 0; i < re_map->literals->len; i ++) {
+		lit = g_ptr_array_index (re_map->literals, i);
+
+		if (lit->str[0] == 'i') {
+			caseless[ncaseless].ptr = lit->str + 1;
+			caseless[ncaseless].len = lit->len;
+			ncaseless ++;
+			g_array_append_val (re_map->caseless_ids, i);
+		}
+		else {
+			exact[nexact].ptr = lit->str + 1;
+			exact[nexact].len = lit->len;
+			nexact ++;
+			g_array_append_val (re_map->exact_ids, i);
+		}
+	}
+
+	if (nexact > 0) {
+		re_map->exact_trie = acism_create (exact, nexact);
+	}
+	if (ncaseless > 0) {
+		re_map->caseless_trie = acism_create (caseless, ncaseless);
+	}
+
+	g_free (exact);
+	g_free (caseless);
+	g_hash_table_destroy (re_map->literals_hash);
+	re_map->literals_hash = NULL;
+	re_map->compiled = TRUE;
+
+	msg_info ("compiled regexp map of %ud entries, %ud of them are "
+			"not prefiltered", re_map->regexps->len, re_map->unfiltered->len);
+}
+
+static gint
+rspamd_regexp_map_trie_cb (gint strnum, gint textpos, void *context)
+{
+	struct rspamd_regexp_map_cbdata *cbd = context;
+	struct rspamd_regexp_map_literal *lit;
+	guint i;
+
+	lit = g_ptr_array_index (cbd->literals,
+			g_array_index (cbd->literal_ids, guint, strnum));
+
+	for (i = 0; i < lit->ids->len; i ++) {
+		cbd->candidates[g_array_index (lit->ids, guint, i)] = 1;
+	}
+
+	return 0;
+}
+
+gchar *
+rspamd_regexp_list_read (rspamd_mempool_t *pool,
+	gchar *chunk,
+	gint len,
+	struct map_cb_data *data)
+{
+	if (data->cur_data == NULL) {
+		data->cur_data = rspamd_regexp_map_create (FALSE);
+	}
+	return rspamd_parse_abstract_list (pool,
+			   chunk,
+			   len,
+			   data,
+			   (insert_func) rspamd_regexp_map_insert_helper);
+}
+
+gchar *
+rspamd_glob_list_read (rspamd_mempool_t *pool,
+	gchar *chunk,
+	gint len,
+	struct map_cb_data *data)
+{
+	if (data->cur_data == NULL) {
+		data->cur_data = rspamd_regexp_map_create (TRUE);
+	}
+	return rspamd_parse_abstract_list (pool,
+			   chunk,
+			   len,
+			   data,
+			   (insert_func) rspamd_regexp_map_insert_helper);
+}
+
+void
+rspamd_regexp_list_fin (rspamd_mempool_t *pool, struct map_cb_data *data)
+{
+	if (data->cur_data) {
+		rspamd_regexp_map_compile (data->cur_data);
+	}
+	if (data->prev_data) {
+		rspamd_regexp_map_destroy (data->prev_data);
+	}
+}
+
+void
+rspamd_regexp_map_free (struct rspamd_regexp_map *re_map)
+{
+	if (re_map != NULL) {
+		rspamd_regexp_map_destroy (re_map);
+	}
+}
+
+GArray *
+rspamd_match_regexp_map (struct rspamd_regexp_map *re_map,
+	const gchar *in, gsize len)
+{
+	struct rspamd_regexp_map_cbdata cbd;
+	GArray *res = NULL;
+	rspamd_regexp_t *re;
+	guint i;
+	gint state;
+
+	if (re_map == NULL || re_map->regexps->len == 0 || in == NULL) {
+		return NULL;
+	}
+
+	g_assert (re_map->compiled);
+
+	cbd.literals = re_map->literals;
+	cbd.candidates = g_malloc0 (re_map->regexps->len);
+
+	for (i = 0; i < re_map->unfiltered->len; i ++) {
+		cbd.candidates[g_array_index (re_map->unfiltered, guint, i)] = 1;
+	}
+
+	if (re_map->exact_trie) {
+		state = 0;
+		cbd.literal_ids = re_map->exact_ids;
+		acism_lookup (re_map->exact_trie, in, len, rspamd_regexp_map_trie_cb,
+				&cbd, &state, false);
+	}
+	if (re_map->caseless_trie) {
+		state = 0;
+		cbd.literal_ids = re_map->caseless_ids;
+		acism_lookup (re_map->caseless_trie, in, len, rspamd_regexp_map_trie_cb,
+				&cbd, &state, true);
+	}
+
+	for (i = 0; i < re_map->regexps->len; i ++) {
+		if (cbd.candidates[i]) {
+			re = g_ptr_array_index (re_map->regexps, i);
+
+			if (rspamd_regexp_search (re, in, len, NULL, NULL, FALSE)) {
+				if (res == NULL) {
+					res = g_array_new (FALSE, FALSE, sizeof (guint));
+				}
+				g_array_append_val (res, i);
+			}
+		}
+	}
+
+	g_free (cbd.candidates);
+
+	return res;
+}
+
+const gchar *
+rspamd_regexp_map_pattern (struct rspamd_regexp_map *re_map, guint id)
+{
+	if (re_map == NULL || id >= re_map->patterns->len) {
+		return NULL;
+	}
+
+	return g_ptr_array_index (re_map->patterns, id);
+}
+
+/*
+ * CDB maps
+ */
+gboolean
+rspamd_map_is_cdb (const gchar *map_line)
+{
+	return g_ascii_strncasecmp (map_line, "cdb://", sizeof ("cdb://") - 1) == 0;
+}
+
+const gchar *
+rspamd_match_cdb_map (struct cdb *cdb, const gchar *key, gsize keylen,
+	gsize *vlen)
+{
+	gchar keybuf[1024], *lc;
+	const gchar *ret = NULL;
+
+	if (cdb == NULL || key == NULL) {
+		return NULL;
+	}
+
+	/* Keys are matched caselessly like keys of hash maps */
+	if (keylen < sizeof (keybuf)) {
+		lc = keybuf;
+	}
+	else {
+		lc = g_malloc (keylen);
+	}
+
+	memcpy (lc, key, keylen);
+	rspamd_str_lc (lc, keylen);
+
+	if (cdb_find (cdb, lc, keylen) > 0) {
+		ret = cdb_getdata (cdb);
+
+		if (ret != NULL && vlen) {
+			*vlen = cdb_datalen (cdb);
+		}
+	}
+
+	if (lc != keybuf) {
+		g_free (lc);
+	}
+
+	return ret;
+}
+
+void
+rspamd_cdb_map_free (struct cdb *cdb)
+{
+	if (cdb != NULL) {
+		cdb_free (cdb);
+		g_slice_free1 (sizeof (*cdb), cdb);
+	}
+}
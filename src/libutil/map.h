@@ -14,6 +14,7 @@
 enum fetch_proto {
 	MAP_PROTO_FILE,
 	MAP_PROTO_HTTP,
+	MAP_PROTO_CDB,
 };
 struct map_cb_data;
 
@@ -28,6 +29,9 @@ typedef void (*map_fin_cb_t)(rspamd_mempool_t *pool, struct map_cb_data *data);
  * Common map object
  */
 struct rspamd_config;
+struct rspamd_map_loader;
+struct rspamd_map_retired;
+struct rspamd_map_shared;
 struct rspamd_map {
 	rspamd_mempool_t *pool;
 	struct rspamd_config *cfg;
@@ -45,6 +49,16 @@ struct rspamd_map {
 	guint32 checksum;
 	/* Shared lock for temporary disabling of map reading (e.g. when this map is written by UI) */
 	gint *locked;
+	/* Callbacks can be called outside of the event loop thread */
+	gboolean threaded;
+	/* Background reload in progress */
+	struct rspamd_map_loader *loader;
+	/* Previous version of data waiting to be freed */
+	struct rspamd_map_retired *retired;
+	/* State shared with other processes when map_cache_dir is set */
+	struct rspamd_map_shared *shared;
+	/* Generation of the shared image used by this process */
+	gint generation;
 };
 
 /**
@@ -63,7 +77,15 @@ struct map_cb_data {
  */
 gboolean rspamd_map_check_proto (const gchar *map_line, gint *res, const gchar **pos);
 /**
- * Add map from line
+ * Add map from line. Maps that use the common callbacks below are parsed
+ * in a separate thread on reload and then published atomically to
+ * `user_data`, the previous data is freed after `map_timeout` seconds by
+ * calling `fin_callback` from the event loop.
+ * If `map_cache_dir` is set, radix maps and HTTP maps of this kind are
+ * fetched by one process only and shared with others via files in this
+ * directory: radix maps are compiled to images that are mapped by workers.
+ * CDB maps (`cdb://path`) must be added with NULL callbacks, their data is
+ * `struct cdb *` which is mapped to memory and replaced when file changes.
  */
 gboolean rspamd_map_add (struct rspamd_config *cfg,
 	const gchar *map_line,
@@ -116,6 +138,79 @@ gchar * rspamd_kv_list_read (rspamd_mempool_t *pool,
 	struct map_cb_data *data);
 void rspamd_kv_list_fin (rspamd_mempool_t *pool, struct map_cb_data *data);
 
+/**
+ * Regexp list is a list of regular expressions, either plain or enclosed in
+ * slashes with flags (`/re/i`), glob list is a list of shell-like patterns
+ * that match the whole string caselessly. Both are compiled to a single
+ * matcher on each reload
+ */
+struct rspamd_regexp_map;
+
+gchar * rspamd_regexp_list_read (rspamd_mempool_t *pool,
+	gchar *chunk,
+	gint len,
+	struct map_cb_data *data);
+gchar * rspamd_glob_list_read (rspamd_mempool_t *pool,
+	gchar *chunk,
+	gint len,
+	struct map_cb_data *data);
+void rspamd_regexp_list_fin (rspamd_mempool_t *pool, struct map_cb_data *data);
+
+/**
+ * Match a string against all entries of a regexp map at once
+ * @param re_map regexp map
+ * @param in input string
+ * @param len length of input
+ * @return array of ids (guint) of matched entries in ascending order or NULL,
+ * array must be freed by caller
+ */
+GArray * rspamd_match_regexp_map (struct rspamd_regexp_map *re_map,
+	const gchar *in, gsize len);
+
+/**
+ * Get the map line of an entry of a regexp map
+ * @param re_map regexp map
+ * @param id id of entry
+ * @return pattern or NULL
+ */
+const gchar * rspamd_regexp_map_pattern (struct rspamd_regexp_map *re_map,
+	guint id);
+
+/**
+ * Free regexp map data
+ */
+void rspamd_regexp_map_free (struct rspamd_regexp_map *re_map);
+
+/**
+ * CDB maps are constant databases that are mapped by all processes and used
+ * instead of hash maps of hosts or key-value lists. Keys should be stored in
+ * lowercase, as they are matched caselessly
+ */
+struct cdb;
+
+/**
+ * Check whether map line defines a CDB map
+ * @param map_line map line
+ * @return TRUE if this is a `cdb://` map
+ */
+gboolean rspamd_map_is_cdb (const gchar *map_line);
+
+/**
+ * Find value of a key in a CDB map, lookups are not thread safe
+ * @param cdb map data
+ * @param key key to find
+ * @param keylen length of key
+ * @param vlen length of value found
+ * @return value (not zero terminated) or NULL if key is not found
+ */
+const gchar * rspamd_match_cdb_map (struct cdb *cdb, const gchar *key,
+	gsize keylen, gsize *vlen);
+
+/**
+ * Unmap and free data of a CDB map
+ */
+void rspamd_cdb_map_free (struct cdb *cdb);
+
 /**
  * FSM for lists parsing (support comments, blank lines and partial replies)
  */
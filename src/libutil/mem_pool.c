@@ -29,6 +29,11 @@
 #include "util.h"
 #include "main.h"
 
+#ifdef HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 /* Sleep time for spin lock in nanoseconds */
 #define MUTEX_SLEEP_TIME 10000000L
 #define MUTEX_SPIN_COUNT 100
@@ -46,6 +51,21 @@
  */
 #undef MEMORY_GREEDY
 
+/* Size classes of cached pages: from 4Kb to 1Mb */
+#define POOL_CACHE_MIN_SHIFT 12
+#define POOL_CACHE_MAX_SHIFT 20
+#define POOL_CACHE_CLASSES (POOL_CACHE_MAX_SHIFT - POOL_CACHE_MIN_SHIFT + 1)
+/* Initial number of destructors */
+#define POOL_DESTRUCTORS_PREALLOC 32
+
+struct memory_pool_cache_s {
+	struct _pool_chain *free_chains[POOL_CACHE_CLASSES];
+	gsize cached_bytes;
+	gsize max_bytes;
+	gsize peak_avg;                         /**< moving average of pools peak usage	*/
+	struct rspamd_mutex_s *mtx;
+};
+
 /* Internal statistic */
 static rspamd_mempool_stat_t *mem_pool_stat = NULL;
 /* Environment variable */
@@ -92,6 +112,128 @@ pool_chain_new (gsize size)
 	return chain;
 }
 
+static void
+pool_chain_free_chain (struct _pool_chain *chain)
+{
+	g_atomic_int_inc (&mem_pool_stat->chunks_freed);
+	g_atomic_int_add (&mem_pool_stat->bytes_allocated, -chain->len);
+	g_slice_free1 (chain->len, chain->begin);
+	g_slice_free (struct _pool_chain, chain);
+}
+
+/*
+ * Returns size class of a page or -1 if pages of such size are not cached
+ */
+static gint
+pool_cache_class (gsize size)
+{
+	gint shift = POOL_CACHE_MIN_SHIFT;
+
+	while (shift <= POOL_CACHE_MAX_SHIFT && ((gsize)1 << shift) < size) {
+		shift ++;
+	}
+
+	if (shift > POOL_CACHE_MAX_SHIFT) {
+		return -1;
+	}
+
+	return shift - POOL_CACHE_MIN_SHIFT;
+}
+
+/*
+ * Get new page for pool, it is taken from the cache if possible
+ */
+static struct _pool_chain *
+pool_chain_get (rspamd_mempool_t *pool, gsize size)
+{
+	rspamd_mempool_cache_t *cache = pool->cache;
+	struct _pool_chain *chain = NULL;
+	gint cl;
+
+	if (cache == NULL || (cl = pool_cache_class (size)) == -1) {
+		return pool_chain_new (size);
+	}
+
+	rspamd_mutex_lock (cache->mtx);
+	chain = cache->free_chains[cl];
+
+	if (chain != NULL) {
+		cache->free_chains[cl] = chain->next;
+		cache->cached_bytes -= chain->len;
+	}
+
+	rspamd_mutex_unlock (cache->mtx);
+
+	if (chain == NULL) {
+		/* Round size to allow reusing of this page */
+		return pool_chain_new ((gsize)1 << (cl + POOL_CACHE_MIN_SHIFT));
+	}
+
+	chain->pos = align_ptr (chain->begin, MEM_ALIGNMENT);
+	chain->next = NULL;
+	g_atomic_int_inc (&mem_pool_stat->chunks_reused);
+
+	return chain;
+}
+
+/*
+ * Return list of pages to the cache or free them
+ */
+static void
+pool_chain_release (rspamd_mempool_t *pool, struct _pool_chain *chain)
+{
+	rspamd_mempool_cache_t *cache = pool->cache;
+	struct _pool_chain *tmp;
+	gint cl;
+
+	if (cache != NULL) {
+		rspamd_mutex_lock (cache->mtx);
+	}
+
+	while (chain) {
+		tmp = chain;
+		chain = chain->next;
+
+		if (cache != NULL && cache->cached_bytes + tmp->len <= cache->max_bytes &&
+				(cl = pool_cache_class (tmp->len)) != -1 &&
+				((gsize)1 << (cl + POOL_CACHE_MIN_SHIFT)) == tmp->len) {
+			tmp->next = cache->free_chains[cl];
+			cache->free_chains[cl] = tmp;
+			cache->cached_bytes += tmp->len;
+			g_atomic_int_inc (&mem_pool_stat->chunks_cached);
+		}
+		else {
+			pool_chain_free_chain (tmp);
+		}
+	}
+
+	if (cache != NULL) {
+		rspamd_mutex_unlock (cache->mtx);
+	}
+}
+
+/*
+ * Lock-free bump allocation in a shared chain, returns NULL if there is
+ * not enough space left in this chain
+ */
+static inline guint8 *
+pool_chain_alloc_shared_atomic (struct _pool_chain_shared *chain, gsize size)
+{
+	guint8 *pos, *tmp;
+
+	do {
+		pos = g_atomic_pointer_get (&chain->pos);
+		tmp = align_ptr (pos, MEM_ALIGNMENT);
+
+		if (tmp + size > chain->begin + chain->len) {
+			return NULL;
+		}
+	} while (!g_atomic_pointer_compare_and_exchange (&chain->pos, pos,
+			tmp + size));
+
+	return tmp;
+}
+
 static struct _pool_chain_shared *
 pool_chain_new_shared (gsize size)
 {
@@ -148,18 +290,11 @@ pool_chain_new_shared (gsize size)
 }
 
 
-/**
- * Allocate new memory poll
- * @param size size of pool's page
- * @return new memory pool object
- */
-rspamd_mempool_t *
-rspamd_mempool_new (gsize size)
+static void
+rspamd_mempool_init_globals (void)
 {
-	rspamd_mempool_t *new;
 	gpointer map;
 
-	g_return_val_if_fail (size > 0, NULL);
 	/* Allocate statistic structure if it is not allocated before */
 	if (mem_pool_stat == NULL) {
 #if defined(HAVE_MMAP_ANON)
@@ -208,6 +343,15 @@ rspamd_mempool_new (gsize size)
 		}
 		env_checked = TRUE;
 	}
+}
+
+static rspamd_mempool_t *
+rspamd_mempool_new_common (gsize size, rspamd_mempool_cache_t *cache)
+{
+	rspamd_mempool_t *new;
+
+	g_return_val_if_fail (size > 0, NULL);
+	rspamd_mempool_init_globals ();
 
 	new = g_slice_alloc (sizeof (rspamd_mempool_t));
 	if (new == NULL) {
@@ -216,11 +360,14 @@ rspamd_mempool_new (gsize size)
 		abort ();
 	}
 
-	new->cur_pool = pool_chain_new (size);
+	new->cache = cache;
+	new->cur_pool = pool_chain_get (new, size);
+	new->bytes_used = new->cur_pool->len;
 	new->shared_pool = NULL;
 	new->first_pool = new->cur_pool;
 	new->cur_pool_tmp = NULL;
 	new->first_pool_tmp = NULL;
+	/* Allocated upon first call of add destructor */
 	new->destructors = NULL;
 	/* Set it upon first call of set variable */
 	new->variables = NULL;
@@ -231,6 +378,67 @@ rspamd_mempool_new (gsize size)
 	return new;
 }
 
+/**
+ * Allocate new memory poll
+ * @param size size of pool's page
+ * @return new memory pool object
+ */
+rspamd_mempool_t *
+rspamd_mempool_new (gsize size)
+{
+	return rspamd_mempool_new_common (size, NULL);
+}
+
+rspamd_mempool_cache_t *
+rspamd_mempool_cache_new (gsize max_size)
+{
+	rspamd_mempool_cache_t *cache;
+
+	cache = g_slice_alloc0 (sizeof (*cache));
+	cache->max_bytes = max_size;
+	cache->mtx = rspamd_mutex_new ();
+
+	return cache;
+}
+
+rspamd_mempool_t *
+rspamd_mempool_new_cached (rspamd_mempool_cache_t *cache)
+{
+	gsize size;
+
+	g_assert (cache != NULL);
+
+	/* Try to fit all allocations of a pool into its first page */
+	rspamd_mutex_lock (cache->mtx);
+	size = cache->peak_avg + cache->peak_avg / 4;
+	rspamd_mutex_unlock (cache->mtx);
+	size = MAX (size, rspamd_mempool_suggest_size ());
+
+	return rspamd_mempool_new_common (size, cache);
+}
+
+void
+rspamd_mempool_cache_destroy (rspamd_mempool_cache_t *cache)
+{
+	struct _pool_chain *cur, *tmp;
+	guint i;
+
+	if (cache != NULL) {
+		for (i = 0; i < POOL_CACHE_CLASSES; i ++) {
+			cur = cache->free_chains[i];
+
+			while (cur) {
+				tmp = cur;
+				cur = cur->next;
+				pool_chain_free_chain (tmp);
+			}
+		}
+
+		rspamd_mutex_free (cache->mtx);
+		g_slice_free1 (sizeof (*cache), cache);
+	}
+}
+
 static void *
 memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size, gboolean is_tmp)
 {
@@ -244,6 +452,7 @@ memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size, gboolean is_tmp)
 			void *ptr;
 
 			ptr = g_malloc (size);
+			pool->bytes_used += size;
 			POOL_MTX_UNLOCK ();
 			rspamd_mempool_add_destructor (pool, g_free, ptr);
 
@@ -275,10 +484,10 @@ memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size, gboolean is_tmp)
 			/* Allocate new pool */
 			if (cur == NULL) {
 				if (pool->first_pool->len >= size + MEM_ALIGNMENT) {
-					new = pool_chain_new (pool->first_pool->len);
+					new = pool_chain_get (pool, pool->first_pool->len);
 				}
 				else {
-					new = pool_chain_new (
+					new = pool_chain_get (pool,
 						size + pool->first_pool->len + MEM_ALIGNMENT);
 				}
 				/* Connect to pool subsystem */
@@ -291,11 +500,11 @@ memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size, gboolean is_tmp)
 			}
 			else {
 				if (cur->len >= size + MEM_ALIGNMENT) {
-					new = pool_chain_new (cur->len);
+					new = pool_chain_get (pool, cur->len);
 				}
 				else {
 					mem_pool_stat->oversized_chunks++;
-					new = pool_chain_new (
+					new = pool_chain_get (pool,
 						size + pool->first_pool->len + MEM_ALIGNMENT);
 				}
 				/* Attach new pool to chain */
@@ -307,6 +516,7 @@ memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size, gboolean is_tmp)
 			else {
 				pool->cur_pool = new;
 			}
+			pool->bytes_used += new->len;
 			/* No need to align again */
 			tmp = new->pos;
 			new->pos = tmp + size;
@@ -370,45 +580,67 @@ rspamd_mempool_alloc_shared (rspamd_mempool_t * pool, gsize size)
 {
 	guint8 *tmp;
 	struct _pool_chain_shared *new, *cur;
-	gint free;
 
 	if (pool) {
 		g_return_val_if_fail (size > 0, NULL);
 
-		POOL_MTX_LOCK ()
-		;
-		cur = pool->shared_pool;
-		if (!cur) {
-			cur = pool_chain_new_shared (pool->first_pool->len);
-			pool->shared_pool = cur;
-		}
+		/* Fast path: bump pointer in one of the existing chains */
+		cur = g_atomic_pointer_get (&pool->shared_pool);
 
-		/* Find free space in pool chain */
-		while ((free = pool_chain_free ((struct _pool_chain *) cur))
-			< (gint) size && cur->next) {
-			cur = cur->next;
+		while (cur != NULL) {
+			tmp = pool_chain_alloc_shared_atomic (cur, size);
+
+			if (tmp != NULL) {
+				return tmp;
+			}
+
+			if (g_atomic_pointer_get (&cur->next) == NULL) {
+				break;
+			}
+
+			cur = g_atomic_pointer_get (&cur->next);
 		}
-		if (free < (gint) size && cur->next == NULL) {
-			/* Allocate new pool */
 
-			if (cur->len >= size + MEM_ALIGNMENT) {
-				new = pool_chain_new_shared (cur->len);
+		/* Slow path: attach a new chain, other allocators can still go on */
+		POOL_MTX_LOCK ();
+		cur = pool->shared_pool;
+
+		if (cur != NULL) {
+			while (cur->next != NULL) {
+				cur = cur->next;
 			}
-			else {
-				mem_pool_stat->oversized_chunks++;
-				new = pool_chain_new_shared (
-					size + pool->first_pool->len + MEM_ALIGNMENT);
+
+			/* Somebody could have attached a chain while we were waiting */
+			tmp = pool_chain_alloc_shared_atomic (cur, size);
+
+			if (tmp != NULL) {
+				POOL_MTX_UNLOCK ();
+				return tmp;
 			}
-			/* Attach new pool to chain */
-			cur->next = new;
-			new->pos += size;
-			g_atomic_int_add (&mem_pool_stat->bytes_allocated, size);
+		}
 
-			POOL_MTX_UNLOCK ();
-			return new->begin;
+		if (cur == NULL || cur->len >= size + MEM_ALIGNMENT) {
+			new = pool_chain_new_shared (cur ? cur->len : pool->first_pool->len);
 		}
-		tmp = align_ptr (cur->pos, MEM_ALIGNMENT);
-		cur->pos = tmp + size;
+		else {
+			mem_pool_stat->oversized_chunks++;
+			new = pool_chain_new_shared (
+				size + pool->first_pool->len + MEM_ALIGNMENT);
+		}
+
+		pool->bytes_used += new->len;
+		/* Reserve space before the chain becomes visible for others */
+		tmp = align_ptr (new->pos, MEM_ALIGNMENT);
+		new->pos = tmp + size;
+		g_atomic_int_add (&mem_pool_stat->bytes_allocated, size);
+
+		if (cur == NULL) {
+			g_atomic_pointer_set (&pool->shared_pool, new);
+		}
+		else {
+			g_atomic_pointer_set (&cur->next, new);
+		}
+
 		POOL_MTX_UNLOCK ();
 		return tmp;
 	}
@@ -523,27 +755,20 @@ rspamd_mempool_add_destructor_full (rspamd_mempool_t * pool,
 	const gchar *function,
 	const gchar *line)
 {
-	struct _pool_destructors *cur;
+	struct _pool_destructors cur;
 
-	if (always_malloc) {
-		/* Ugly workaround */
-		always_malloc = FALSE;
-		cur = rspamd_mempool_alloc (pool, sizeof (struct _pool_destructors));
-		always_malloc = TRUE;
-	}
-	else {
-		cur = rspamd_mempool_alloc (pool, sizeof (struct _pool_destructors));
-	}
-	if (cur) {
-		POOL_MTX_LOCK ();
-		cur->func = func;
-		cur->data = data;
-		cur->function = function;
-		cur->loc = line;
-		cur->prev = pool->destructors;
-		pool->destructors = cur;
-		POOL_MTX_UNLOCK ();
+	cur.func = func;
+	cur.data = data;
+	cur.function = function;
+	cur.loc = line;
+
+	POOL_MTX_LOCK ();
+	if (pool->destructors == NULL) {
+		pool->destructors = g_array_sized_new (FALSE, FALSE,
+				sizeof (struct _pool_destructors), POOL_DESTRUCTORS_PREALLOC);
 	}
+	g_array_append_val (pool->destructors, cur);
+	POOL_MTX_UNLOCK ();
 }
 
 void
@@ -553,54 +778,81 @@ rspamd_mempool_replace_destructor (rspamd_mempool_t * pool,
 	void *new_data)
 {
 	struct _pool_destructors *tmp;
+	guint i;
+
+	if (pool->destructors == NULL) {
+		return;
+	}
+
+	/* Search from the recently added destructors */
+	for (i = pool->destructors->len; i > 0; i --) {
+		tmp = &g_array_index (pool->destructors, struct _pool_destructors,
+				i - 1);
 
-	tmp = pool->destructors;
-	while (tmp) {
 		if (tmp->func == func && tmp->data == old_data) {
-			tmp->func = func;
 			tmp->data = new_data;
 			break;
 		}
-		tmp = tmp->prev;
+	}
+}
+
+/*
+ * Update average peak usage of pools allocated from the cache
+ */
+static void
+rspamd_mempool_update_peak (rspamd_mempool_t *pool)
+{
+	struct _pool_chain *cur;
+	gsize used = 0, avg;
+
+	for (cur = pool->first_pool; cur != NULL; cur = cur->next) {
+		used += cur->pos - cur->begin;
 	}
 
+	rspamd_mutex_lock (pool->cache->mtx);
+	avg = pool->cache->peak_avg;
+
+	if (avg == 0) {
+		avg = used;
+	}
+	else {
+		avg = avg - avg / 8 + used / 8;
+	}
+
+	pool->cache->peak_avg = avg;
+	rspamd_mutex_unlock (pool->cache->mtx);
 }
 
 void
 rspamd_mempool_delete (rspamd_mempool_t * pool)
 {
-	struct _pool_chain *cur = pool->first_pool, *tmp;
 	struct _pool_chain_shared *cur_shared = pool->shared_pool, *tmp_shared;
-	struct _pool_destructors *destructor = pool->destructors;
+	struct _pool_destructors *destructor;
+	guint i;
 
 	POOL_MTX_LOCK ();
-	/* Call all pool destructors */
-	while (destructor) {
-		/* Avoid calling destructors for NULL pointers */
-		if (destructor->data != NULL) {
-			destructor->func (destructor->data);
+	/* Call all pool destructors in reverse order */
+	if (pool->destructors != NULL) {
+		for (i = pool->destructors->len; i > 0; i --) {
+			destructor = &g_array_index (pool->destructors,
+					struct _pool_destructors, i - 1);
+
+			/* Avoid calling destructors for NULL pointers */
+			if (destructor->data != NULL) {
+				destructor->func (destructor->data);
+			}
 		}
-		destructor = destructor->prev;
+
+		g_array_free (pool->destructors, TRUE);
 	}
 
-	while (cur) {
-		tmp = cur;
-		cur = cur->next;
-		g_atomic_int_inc (&mem_pool_stat->chunks_freed);
-		g_atomic_int_add (&mem_pool_stat->bytes_allocated, -tmp->len);
-		g_slice_free1 (tmp->len, tmp->begin);
-		g_slice_free (struct _pool_chain, tmp);
+	if (pool->cache != NULL) {
+		rspamd_mempool_update_peak (pool);
 	}
+
+	pool_chain_release (pool, pool->first_pool);
 	/* Clean temporary pools */
-	cur = pool->first_pool_tmp;
-	while (cur) {
-		tmp = cur;
-		cur = cur->next;
-		g_atomic_int_inc (&mem_pool_stat->chunks_freed);
-		g_atomic_int_add (&mem_pool_stat->bytes_allocated, -tmp->len);
-		g_slice_free1 (tmp->len, tmp->begin);
-		g_slice_free (struct _pool_chain, tmp);
-	}
+	pool_chain_release (pool, pool->first_pool_tmp);
 	/* Unmap shared memory */
 	while (cur_shared) {
 		tmp_shared = cur_shared;
@@ -623,22 +875,21 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 void
 rspamd_mempool_cleanup_tmp (rspamd_mempool_t * pool)
 {
-	struct _pool_chain *cur = pool->first_pool, *tmp;
-
 	POOL_MTX_LOCK ();
-	cur = pool->first_pool_tmp;
-	while (cur) {
-		tmp = cur;
-		cur = cur->next;
-		g_atomic_int_inc (&mem_pool_stat->chunks_freed);
-		g_atomic_int_add (&mem_pool_stat->bytes_allocated, -tmp->len);
-		g_slice_free1 (tmp->len, tmp->begin);
-		g_slice_free (struct _pool_chain, tmp);
-	}
+	pool_chain_release (pool, pool->first_pool_tmp);
+	/* Pages could be reused by other pools */
+	pool->first_pool_tmp = NULL;
+	pool->cur_pool_tmp = NULL;
 	g_atomic_int_inc (&mem_pool_stat->pools_freed);
 	POOL_MTX_UNLOCK ();
 }
 
+gsize
+rspamd_mempool_get_used (rspamd_mempool_t *pool)
+{
+	return pool->bytes_used;
+}
+
 void
 rspamd_mempool_stat (rspamd_mempool_stat_t * st)
 {
@@ -651,6 +902,8 @@ rspamd_mempool_stat (rspamd_mempool_stat_t * st)
 		st->shared_chunks_allocated = mem_pool_stat->shared_chunks_allocated;
 		st->chunks_freed = mem_pool_stat->chunks_freed;
 		st->oversized_chunks = mem_pool_stat->oversized_chunks;
+		st->chunks_reused = mem_pool_stat->chunks_reused;
+		st->chunks_cached = mem_pool_stat->chunks_cached;
 	}
 }
 
@@ -674,7 +927,183 @@ rspamd_mempool_suggest_size (void)
 #endif
 }
 
-#ifndef HAVE_PTHREAD_PROCESS_SHARED
+#if defined(HAVE_LINUX_FUTEX_H)
+/*
+ * Futex based shared mutexes: lock is 0 when unlocked, 1 when locked and 2
+ * when locked and there might be waiters. Waiters sleep in kernel and are
+ * woken up on unlock, so there is no spinning. Wait is limited by
+ * MUTEX_SLEEP_TIME to detect a dead owner.
+ */
+static inline gint
+rspamd_futex_wait (gint *addr, gint val)
+{
+	struct timespec ts;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = MUTEX_SLEEP_TIME;
+
+	return syscall (SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static inline void
+rspamd_futex_wake (gint *addr, gint nwake)
+{
+	(void)syscall (SYS_futex, addr, FUTEX_WAKE, nwake, NULL, NULL, 0);
+}
+
+/* Compare and exchange returning the old value */
+static inline gint
+rspamd_futex_cmpxchg (gint *addr, gint old, gint new)
+{
+	gint cur;
+
+	do {
+		if (g_atomic_int_compare_and_exchange (addr, old, new)) {
+			return old;
+		}
+
+		cur = g_atomic_int_get (addr);
+	} while (cur == old);
+
+	return cur;
+}
+
+static void
+rspamd_futex_check_owner (rspamd_mempool_mutex_t *mutex, gint val)
+{
+	pid_t owner = mutex->owner;
+
+	if (owner != 0 && owner != getpid () && kill (owner, 0) == -1 &&
+			errno == ESRCH) {
+		/* Owner process was not found, so release lock */
+		if (g_atomic_int_compare_and_exchange (&mutex->lock, val, 0)) {
+			mutex->owner = 0;
+		}
+	}
+}
+
+rspamd_mempool_mutex_t *
+rspamd_mempool_get_mutex (rspamd_mempool_t * pool)
+{
+	rspamd_mempool_mutex_t *res;
+	if (pool != NULL) {
+		res =
+			rspamd_mempool_alloc_shared (pool, sizeof (rspamd_mempool_mutex_t));
+		res->lock = 0;
+		res->owner = 0;
+		res->spin = 0;
+		return res;
+	}
+	return NULL;
+}
+
+void
+rspamd_mempool_lock_mutex (rspamd_mempool_mutex_t * mutex)
+{
+	gint c;
+
+	if ((c = rspamd_futex_cmpxchg (&mutex->lock, 0, 1)) != 0) {
+		do {
+			if (c == 2 || rspamd_futex_cmpxchg (&mutex->lock, 1, 2) != 0) {
+				if (rspamd_futex_wait (&mutex->lock, 2) == -1 &&
+						errno == ETIMEDOUT) {
+					rspamd_futex_check_owner (mutex, 2);
+				}
+			}
+		} while ((c = rspamd_futex_cmpxchg (&mutex->lock, 0, 2)) != 0);
+	}
+
+	mutex->owner = getpid ();
+}
+
+void
+rspamd_mempool_unlock_mutex (rspamd_mempool_mutex_t * mutex)
+{
+	mutex->owner = 0;
+
+	if (!g_atomic_int_dec_and_test (&mutex->lock)) {
+		/* There are waiters */
+		g_atomic_int_set (&mutex->lock, 0);
+		rspamd_futex_wake (&mutex->lock, 1);
+	}
+}
+
+rspamd_mempool_rwlock_t *
+rspamd_mempool_get_rwlock (rspamd_mempool_t * pool)
+{
+	rspamd_mempool_rwlock_t *lock;
+
+	lock = rspamd_mempool_alloc_shared (pool, sizeof (rspamd_mempool_rwlock_t));
+	lock->__r_lock = rspamd_mempool_get_mutex (pool);
+	lock->__w_lock = rspamd_mempool_get_mutex (pool);
+
+	return lock;
+}
+
+/*
+ * For rwlock __r_lock->lock is the number of active readers and
+ * __w_lock is a normal mutex held by writer
+ */
+void
+rspamd_mempool_rlock_rwlock (rspamd_mempool_rwlock_t * lock)
+{
+	gint w;
+
+	for (;;) {
+		while ((w = g_atomic_int_get (&lock->__w_lock->lock)) != 0) {
+			if (rspamd_futex_wait (&lock->__w_lock->lock, w) == -1 &&
+					errno == ETIMEDOUT) {
+				rspamd_futex_check_owner (lock->__w_lock, w);
+			}
+		}
+
+		g_atomic_int_inc (&lock->__r_lock->lock);
+
+		if (g_atomic_int_get (&lock->__w_lock->lock) == 0) {
+			break;
+		}
+
+		/* Writer came in between, step back and let it go */
+		if (g_atomic_int_dec_and_test (&lock->__r_lock->lock)) {
+			rspamd_futex_wake (&lock->__r_lock->lock, G_MAXINT);
+		}
+	}
+
+	lock->__r_lock->owner = getpid ();
+}
+
+void
+rspamd_mempool_wlock_rwlock (rspamd_mempool_rwlock_t * lock)
+{
+	gint r;
+
+	rspamd_mempool_lock_mutex (lock->__w_lock);
+
+	/* Wait all readers */
+	while ((r = g_atomic_int_get (&lock->__r_lock->lock)) != 0) {
+		(void)rspamd_futex_wait (&lock->__r_lock->lock, r);
+	}
+}
+
+void
+rspamd_mempool_runlock_rwlock (rspamd_mempool_rwlock_t * lock)
+{
+	if (g_atomic_int_get (&lock->__r_lock->lock)) {
+		if (g_atomic_int_dec_and_test (&lock->__r_lock->lock)) {
+			/* Last reader, wake writer */
+			rspamd_futex_wake (&lock->__r_lock->lock, G_MAXINT);
+		}
+	}
+}
+
+void
+rspamd_mempool_wunlock_rwlock (rspamd_mempool_rwlock_t * lock)
+{
+	rspamd_mempool_unlock_mutex (lock->__w_lock);
+	/* Readers wait on the write lock word regardless of its state */
+	rspamd_futex_wake (&lock->__w_lock->lock, G_MAXINT);
+}
+#elif !defined(HAVE_PTHREAD_PROCESS_SHARED)
 /*
  * Own emulation
  */
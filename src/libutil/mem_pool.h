@@ -13,7 +13,7 @@
 #define RSPAMD_MEM_POOL_H
 
 #include "config.h"
-#ifdef HAVE_PTHREAD_PROCESS_SHARED
+#if defined(HAVE_PTHREAD_PROCESS_SHARED) && !defined(HAVE_LINUX_FUTEX_H)
 #include <pthread.h>
 #endif
 
@@ -29,9 +29,9 @@ struct f_str_s;
 typedef void (*rspamd_mempool_destruct_t)(void *ptr);
 
 /**
- * Pool mutex structure
+ * Pool mutex structure, futex based on linux
  */
-#ifndef HAVE_PTHREAD_PROCESS_SHARED
+#if !defined(HAVE_PTHREAD_PROCESS_SHARED) || defined(HAVE_LINUX_FUTEX_H)
 typedef struct memory_pool_mutex_s {
 	gint lock;
 	pid_t owner;
@@ -71,16 +71,20 @@ struct _pool_chain_shared {
 };
 
 /**
- * Destructors list item structure
+ * Destructors array item structure
  */
 struct _pool_destructors {
 	rspamd_mempool_destruct_t func;             /**< pointer to destructor					*/
 	void *data;                             /**< data to free							*/
 	const gchar *function;                  /**< function from which this destructor was added */
 	const gchar *loc;                       /**< line number                            */
-	struct _pool_destructors *prev;         /**< chain link								*/
 };
 
+/**
+ * Cache of free pool pages
+ */
+typedef struct memory_pool_cache_s rspamd_mempool_cache_t;
+
 /**
  * Memory pool type
  */
@@ -91,9 +95,11 @@ typedef struct memory_pool_s {
 	struct _pool_chain *cur_pool_tmp;       /**< currently used temporary page			*/
 	struct _pool_chain *first_pool_tmp;     /**< first temporary page					*/
 	struct _pool_chain_shared *shared_pool; /**< shared chain							*/
-	struct _pool_destructors *destructors;  /**< destructors chain						*/
+	GArray *destructors;                    /**< destructors called in reverse order	*/
 	GHashTable *variables;                  /**< private memory pool variables			*/
 	struct rspamd_mutex_s *mtx;             /**< threads lock							*/
+	rspamd_mempool_cache_t *cache;          /**< cache of pages (or NULL)				*/
+	gsize bytes_used;                       /**< bytes of pages allocated for the pool	*/
 } rspamd_mempool_t;
 
 /**
@@ -107,6 +113,8 @@ typedef struct memory_pool_stat_s {
 	guint shared_chunks_allocated;      /**< shared chunks allocated							*/
 	guint chunks_freed;                 /**< chunks freed										*/
 	guint oversized_chunks;             /**< oversized chunks									*/
+	guint chunks_reused;                /**< chunks taken from a cache instead of allocating	*/
+	guint chunks_cached;                /**< chunks returned to a cache instead of freeing		*/
 } rspamd_mempool_stat_t;
 
 
@@ -118,6 +126,28 @@ typedef struct memory_pool_stat_s {
  */
 rspamd_mempool_t * rspamd_mempool_new (gsize size);
 
+/**
+ * Create cache of pool pages, pools created from the cache return their
+ * pages to it and the size of their first page is adapted to the average
+ * peak usage of pools
+ * @param max_size maximum size of cached pages in bytes
+ * @return new cache object
+ */
+rspamd_mempool_cache_t * rspamd_mempool_cache_new (gsize max_size);
+
+/**
+ * Allocate new memory pool using pages from the cache
+ * @param cache cache of pages
+ * @return new memory pool object
+ */
+rspamd_mempool_t * rspamd_mempool_new_cached (rspamd_mempool_cache_t *cache);
+
+/**
+ * Free cache and all pages in it, cache must not be used by any pool
+ * @param cache cache of pages
+ */
+void rspamd_mempool_cache_destroy (rspamd_mempool_cache_t *cache);
+
 /**
  * Get memory from pool
  * @param pool memory pool object
@@ -278,6 +308,14 @@ void rspamd_mempool_runlock_rwlock (rspamd_mempool_rwlock_t *lock);
  */
 void rspamd_mempool_wunlock_rwlock (rspamd_mempool_rwlock_t *lock);
 
+/**
+ * Get number of bytes allocated for a pool including its pages and
+ * allocations done with the system allocator
+ * @param pool memory pool object
+ * @return number of bytes
+ */
+gsize rspamd_mempool_get_used (rspamd_mempool_t *pool);
+
 /**
  * Get pool allocator statistics
  * @param st stat pool struct
@@ -0,0 +1,150 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "mpmc_queue.h"
+
+#define MPMC_CACHELINE 64
+
+struct rspamd_mpmc_cell {
+	guint seq;
+	gpointer data;
+};
+
+struct rspamd_mpmc_queue {
+	struct rspamd_mpmc_cell *cells;
+	guint mask;
+	gchar pad1[MPMC_CACHELINE];
+	guint enqueue_pos;
+	gchar pad2[MPMC_CACHELINE];
+	guint dequeue_pos;
+	gchar pad3[MPMC_CACHELINE];
+};
+
+struct rspamd_mpmc_queue *
+rspamd_mpmc_queue_new (guint size)
+{
+	struct rspamd_mpmc_queue *q;
+	guint i, n = 2;
+
+	while (n < size) {
+		n <<= 1;
+	}
+
+	q = g_slice_alloc0 (sizeof (*q));
+	q->cells = g_new0 (struct rspamd_mpmc_cell, n);
+	q->mask = n - 1;
+
+	for (i = 0; i < n; i ++) {
+		q->cells[i].seq = i;
+	}
+
+	return q;
+}
+
+void
+rspamd_mpmc_queue_free (struct rspamd_mpmc_queue *q)
+{
+	g_free (q->cells);
+	g_slice_free1 (sizeof (*q), q);
+}
+
+gboolean
+rspamd_mpmc_queue_push (struct rspamd_mpmc_queue *q, gpointer data)
+{
+	struct rspamd_mpmc_cell *cell;
+	guint pos, seq;
+	gint dif;
+
+	pos = g_atomic_int_get (&q->enqueue_pos);
+
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+		seq = g_atomic_int_get (&cell->seq);
+		dif = (gint)(seq - pos);
+
+		if (dif == 0) {
+			if (g_atomic_int_compare_and_exchange (&q->enqueue_pos,
+					pos, pos + 1)) {
+				break;
+			}
+		}
+		else if (dif < 0) {
+			/* Queue is full */
+			return FALSE;
+		}
+
+		pos = g_atomic_int_get (&q->enqueue_pos);
+	}
+
+	cell->data = data;
+	g_atomic_int_set (&cell->seq, pos + 1);
+
+	return TRUE;
+}
+
+gpointer
+rspamd_mpmc_queue_pop (struct rspamd_mpmc_queue *q)
+{
+	struct rspamd_mpmc_cell *cell;
+	guint pos, seq;
+	gint dif;
+	gpointer data;
+
+	pos = g_atomic_int_get (&q->dequeue_pos);
+
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+		seq = g_atomic_int_get (&cell->seq);
+		dif = (gint)(seq - (pos + 1));
+
+		if (dif == 0) {
+			if (g_atomic_int_compare_and_exchange (&q->dequeue_pos,
+					pos, pos + 1)) {
+				break;
+			}
+		}
+		else if (dif < 0) {
+			/* Queue is empty */
+			return NULL;
+		}
+
+		pos = g_atomic_int_get (&q->dequeue_pos);
+	}
+
+	data = cell->data;
+	g_atomic_int_set (&cell->seq, pos + q->mask + 1);
+
+	return data;
+}
+
+gboolean
+rspamd_mpmc_queue_empty (struct rspamd_mpmc_queue *q)
+{
+	guint pos, seq;
+
+	pos = g_atomic_int_get (&q->dequeue_pos);
+	seq = g_atomic_int_get (&q->cells[pos & q->mask].seq);
+
+	return (gint)(seq - (pos + 1)) < 0;
+}
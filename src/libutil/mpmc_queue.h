@@ -0,0 +1,70 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef MPMC_QUEUE_H_
+#define MPMC_QUEUE_H_
+
+#include "config.h"
+
+/*
+ * Bounded queue by D. Vyukov: each cell has a sequence number that tells
+ * whether the cell is ready to be written or to be read at the current
+ * position, so producers and consumers do not need locks
+ */
+struct rspamd_mpmc_queue;
+
+/**
+ * Create new queue
+ * @param size minimal number of elements, it is rounded to the power of 2
+ * @return new queue
+ */
+struct rspamd_mpmc_queue * rspamd_mpmc_queue_new (guint size);
+
+/**
+ * Push element to the queue
+ * @param q queue
+ * @param data element (must not be NULL)
+ * @return FALSE if the queue is full
+ */
+gboolean rspamd_mpmc_queue_push (struct rspamd_mpmc_queue *q, gpointer data);
+
+/**
+ * Pop element from the queue
+ * @param q queue
+ * @return element or NULL if the queue is empty
+ */
+gpointer rspamd_mpmc_queue_pop (struct rspamd_mpmc_queue *q);
+
+/**
+ * Check if the queue is empty, the result can be outdated when it is returned
+ * @param q queue
+ * @return TRUE if the queue has no elements
+ */
+gboolean rspamd_mpmc_queue_empty (struct rspamd_mpmc_queue *q);
+
+/**
+ * Free queue, elements are not freed
+ * @param q queue
+ */
+void rspamd_mpmc_queue_free (struct rspamd_mpmc_queue *q);
+
+#endif /* MPMC_QUEUE_H_ */
@@ -33,6 +33,22 @@
 static const int maxscale = 6;
 static const gchar _hex[] = "0123456789abcdef";
 static const gchar _HEX[] = "0123456789ABCDEF";
+/* Pairs of decimal digits, numbers are converted by two digits per division */
+static const gchar _digits[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+static const guint64 _pow10[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+	10000000ULL, 100000000ULL, 1000000000ULL
+};
 
 static gchar *
 rspamd_humanize_number (gchar *buf, gchar *last, gint64 num, gboolean bytes)
@@ -92,47 +108,68 @@ rspamd_humanize_number (gchar *buf, gchar *last, gint64 num, gboolean bytes)
 }
 
 
+/*
+ * Write decimal digits of a number backwards ending at `end`
+ */
+static inline gchar *
+rspamd_uint64_digits (gchar *end, guint64 ui64)
+{
+	gchar *p = end;
+	guint32 ui32, d;
+
+	/*
+	 * To divide 64-bit numbers and to find remainders
+	 * on the x86 platform gcc and icc call the libc functions
+	 * [u]divdi3() and [u]moddi3(), they call another function
+	 * in its turn.  On FreeBSD it is the qdivrem() function,
+	 * its source code is about 170 lines of the code.
+	 * The glibc counterpart is about 150 lines of the code.
+	 *
+	 * For 32-bit numbers and some divisors gcc and icc use
+	 * a inlined multiplication and shifts.  For example,
+	 * guint "i32 / 10" is compiled to
+	 *
+	 *	 (i32 * 0xCCCCCCCD) >> 35
+	 */
+	while (ui64 > G_MAXUINT32) {
+		d = (ui64 % 100) * 2;
+		ui64 /= 100;
+		*--p = _digits[d + 1];
+		*--p = _digits[d];
+	}
+
+	ui32 = (guint32) ui64;
+
+	while (ui32 >= 100) {
+		d = (ui32 % 100) * 2;
+		ui32 /= 100;
+		*--p = _digits[d + 1];
+		*--p = _digits[d];
+	}
+
+	if (ui32 >= 10) {
+		d = ui32 * 2;
+		*--p = _digits[d + 1];
+		*--p = _digits[d];
+	}
+	else {
+		*--p = (gchar) (ui32 + '0');
+	}
+
+	return p;
+}
+
 static gchar *
 rspamd_sprintf_num (gchar *buf, gchar *last, guint64 ui64, gchar zero,
 	guint hexadecimal, guint width)
 {
 	gchar *p, temp[sizeof ("18446744073709551615")];
 	size_t len;
-	guint32 ui32;
 
 	p = temp + sizeof(temp);
 
 	if (hexadecimal == 0) {
-
-		if (ui64 <= G_MAXUINT32) {
-
-			/*
-			 * To divide 64-bit numbers and to find remainders
-			 * on the x86 platform gcc and icc call the libc functions
-			 * [u]divdi3() and [u]moddi3(), they call another function
-			 * in its turn.  On FreeBSD it is the qdivrem() function,
-			 * its source code is about 170 lines of the code.
-			 * The glibc counterpart is about 150 lines of the code.
-			 *
-			 * For 32-bit numbers and some divisors gcc and icc use
-			 * a inlined multiplication and shifts.  For example,
-			 * guint "i32 / 10" is compiled to
-			 *
-			 *	 (i32 * 0xCCCCCCCD) >> 35
-			 */
-
-			ui32 = (guint32) ui64;
-
-			do {
-				*--p = (gchar) (ui32 % 10 + '0');
-			} while (ui32 /= 10);
-
-		} else {
-			do {
-				*--p = (gchar) (ui64 % 10 + '0');
-			} while (ui64 /= 10);
-		}
-
+		p = rspamd_uint64_digits (p, ui64);
 	} else if (hexadecimal == 1) {
 
 		do {
@@ -171,6 +208,136 @@ rspamd_sprintf_num (gchar *buf, gchar *last, guint64 ui64, gchar zero,
 	return ((gchar *)memcpy (buf, p, len)) + len;
 }
 
+/*
+ * Fixed point conversion of a double rounded to `frac_width` digits, numbers
+ * that do not fit in 64 bits after scaling are converted by libc
+ */
+static gchar *
+rspamd_sprintf_double (gchar *buf, gchar *last, gdouble d, guint frac_width,
+	gchar zero, guint width)
+{
+	gchar fmt[16];
+	guint64 scaled, ipart;
+	gdouble limit;
+	size_t len;
+
+	if (frac_width >= G_N_ELEMENTS (_pow10)) {
+		frac_width = G_N_ELEMENTS (_pow10) - 1;
+	}
+
+	limit = (gdouble)G_MAXINT64 / _pow10[frac_width];
+
+	if (G_UNLIKELY (!(d > -limit && d < limit))) {
+		/* Also handles NaN and infinities */
+		rspamd_snprintf (fmt, sizeof (fmt), "%%.%udf", frac_width);
+		len = last - buf;
+		g_ascii_formatd (buf, len, fmt, d);
+
+		return buf + strlen (buf);
+	}
+
+	if (d < 0) {
+		if (buf < last) {
+			*buf++ = '-';
+		}
+
+		d = -d;
+	}
+
+	scaled = (guint64)(d * _pow10[frac_width] + 0.5);
+	ipart = scaled / _pow10[frac_width];
+	buf = rspamd_sprintf_num (buf, last, ipart, zero, 0, width);
+
+	if (frac_width > 0) {
+		if (buf < last) {
+			*buf++ = '.';
+		}
+
+		buf = rspamd_sprintf_num (buf, last,
+				scaled - ipart * _pow10[frac_width], '0', 0, frac_width);
+	}
+
+	return buf;
+}
+
+gchar *
+rspamd_print_uint64 (gchar *buf, guint64 v)
+{
+	gchar temp[sizeof ("18446744073709551615")], *p;
+	size_t len;
+
+	p = rspamd_uint64_digits (temp + sizeof (temp), v);
+	len = temp + sizeof (temp) - p;
+	memcpy (buf, p, len);
+
+	return buf + len;
+}
+
+gchar *
+rspamd_print_int64 (gchar *buf, gint64 v)
+{
+	if (v < 0) {
+		*buf++ = '-';
+
+		return rspamd_print_uint64 (buf, -(guint64)v);
+	}
+
+	return rspamd_print_uint64 (buf, v);
+}
+
+gchar *
+rspamd_print_double (gchar *buf, gdouble v, guint frac_width)
+{
+	return rspamd_sprintf_double (buf, buf + RSPAMD_PRINT_NUM_BUF - 1, v,
+			frac_width, ' ', 0);
+}
+
+void
+rspamd_gstring_append_int (GString *s, gint64 v)
+{
+	gsize len = s->len;
+	gchar *end;
+
+	/* Write straight to the string */
+	g_string_set_size (s, len + RSPAMD_PRINT_NUM_BUF);
+	end = rspamd_print_int64 (s->str + len, v);
+	g_string_truncate (s, end - s->str);
+}
+
+void
+rspamd_gstring_append_uint (GString *s, guint64 v)
+{
+	gsize len = s->len;
+	gchar *end;
+
+	g_string_set_size (s, len + RSPAMD_PRINT_NUM_BUF);
+	end = rspamd_print_uint64 (s->str + len, v);
+	g_string_truncate (s, end - s->str);
+}
+
+void
+rspamd_gstring_append_hex (GString *s, guint64 v, gboolean upper)
+{
+	gsize len = s->len;
+	gchar *end;
+
+	g_string_set_size (s, len + RSPAMD_PRINT_NUM_BUF);
+	end = rspamd_sprintf_num (s->str + len, s->str + s->len, v, '0',
+			upper ? 2 : 1, 0);
+	g_string_truncate (s, end - s->str);
+}
+
+void
+rspamd_gstring_append_double (GString *s, gdouble v, guint frac_width)
+{
+	gsize len = s->len;
+	gchar *end;
+
+	g_string_set_size (s, len + RSPAMD_PRINT_NUM_BUF);
+	end = rspamd_print_double (s->str + len, v, frac_width);
+	g_string_truncate (s, end - s->str);
+}
+
 struct rspamd_printf_char_buf {
 	char *begin;
 	char *pos;
@@ -570,13 +737,19 @@ rspamd_vprintf_common (rspamd_printf_append_func func,
 
 
 			case 'f':
-			case 'F':
-				if (*fmt == 'f') {
-					f = (long double) va_arg (args, double);
-				}
-				else {
-					f = (long double) va_arg (args, long double);
+				if (frac_width == 0) {
+					frac_width = 6;
 				}
+
+				p = rspamd_sprintf_double (numbuf, numbuf + sizeof (numbuf),
+						va_arg (args, double), frac_width, zero, width);
+				slen = p - numbuf;
+				RSPAMD_PRINTF_APPEND (numbuf, slen);
+
+				continue;
+
+			case 'F':
+				f = (long double) va_arg (args, long double);
 				p = numbuf;
 				last = p + sizeof (numbuf);
 				if (f < 0) {
@@ -81,4 +81,36 @@ glong rspamd_vprintf_common (rspamd_printf_append_func func,
 	const gchar *fmt,
 	va_list args);
 
+/*
+ * Typed conversions for hot paths: they do not parse a format string, are
+ * checked by the compiler and write directly to the output buffer
+ */
+
+/* Buffer size sufficient for any number printed by rspamd_print_* */
+#define RSPAMD_PRINT_NUM_BUF G_ASCII_DTOSTR_BUF_SIZE
+
+/**
+ * Print decimal number to a buffer of RSPAMD_PRINT_NUM_BUF bytes
+ * @return pointer after the last character written, no '\0' is appended
+ */
+gchar * rspamd_print_uint64 (gchar *buf, guint64 v);
+gchar * rspamd_print_int64 (gchar *buf, gint64 v);
+
+/**
+ * Print double as a fixed point number rounded to `frac_width` digits (up to
+ * 9) to a buffer of RSPAMD_PRINT_NUM_BUF bytes, halfway values are rounded
+ * away from zero, so the last digit may differ from libc `%.*f`
+ * @return pointer after the last character written, no '\0' is appended
+ */
+gchar * rspamd_print_double (gchar *buf, gdouble v, guint frac_width);
+
+/**
+ * Append numbers to a string, equal to `%L`, `%uL`, `%xL`/`%XL` and `%.*f`
+ * formats of rspamd_printf_gstring
+ */
+void rspamd_gstring_append_int (GString *s, gint64 v);
+void rspamd_gstring_append_uint (GString *s, guint64 v);
+void rspamd_gstring_append_hex (GString *s, guint64 v, gboolean upper);
+void rspamd_gstring_append_double (GString *s, gdouble v, guint frac_width);
+
 #endif /* PRINTF_H_ */
@@ -45,29 +45,62 @@ struct radix_compressed_node {
 };
 
 
+struct radix_poptrie;
+
 struct radix_tree_compressed {
 	struct radix_compressed_node *root;
 	rspamd_mempool_t *pool;
 	size_t size;
+	/* Inserted prefixes and tries compiled from them */
+	GArray *prefixes;
+	guint32 seq;
+	struct radix_poptrie *pt4;
+	struct radix_poptrie *pt6;
+	/* Compiled image, tree is read only if it is set */
+	const struct radix_image_hdr *image;
+	gsize image_len;
+	gboolean image_mapped;
+};
+
+/*
+ * Compiled image does not contain pointers, so it can be written to a file
+ * and mapped by several processes: it is a header followed by nodes array
+ * and keys of compressed nodes. Node 0 is unused and stands for NULL.
+ */
+#define RADIX_IMAGE_MAGIC "rdximg1"
+
+struct radix_image_hdr {
+	gchar magic[8];
+	guint32 nnodes;
+	guint32 root;
+	guint64 keys_len;
+};
+
+struct radix_image_node {
+	guint64 value;
+	guint32 left;        /**< left child or key offset for compressed nodes */
+	guint32 right;       /**< right child or key length for compressed nodes */
+	guint32 level;
+	guint32 skipped;
 };
 
 static gboolean
-radix_compare_compressed (struct radix_compressed_node *node,
-		guint8 *key, guint keylen, guint cur_level)
+radix_compare_key (const guint8 *nkey, guint nkeylen, guint level,
+		const guint8 *key, guint keylen, guint cur_level)
 {
-	guint8 *nk;
-	guint8 *k;
+	const guint8 *nk;
+	const guint8 *k;
 	guint8 bit;
 	guint shift, rbits, skip;
 
-	if (node->d.s.keylen > keylen) {
+	if (nkeylen > keylen) {
 		/* Obvious case */
 		return FALSE;
 	}
 
 
 	/* Compare byte aligned levels of a compressed node */
-	shift = node->d.s.level / NBBY;
+	shift = level / NBBY;
 	/*
 	 * We know that at least of cur_level bits are the same,
 	 * se we can optimize search slightly
@@ -75,15 +108,15 @@ radix_compare_compressed (struct radix_compressed_node *node,
 	if (shift > 0) {
 		skip = cur_level / NBBY;
 		if (shift > skip &&
-				memcmp (node->d.s.key + skip, key + skip, shift - skip) != 0) {
+				memcmp (nkey + skip, key + skip, shift - skip) != 0) {
 			return FALSE;
 		}
 	}
 
-	rbits = node->d.s.level % NBBY;
+	rbits = level % NBBY;
 	if (rbits > 0) {
 		/* Precisely compare remaining bits */
-		nk = node->d.s.key + shift;
+		nk = nkey + shift;
 		k = key + shift;
 
 		bit = 1U << 7;
@@ -100,6 +133,300 @@ radix_compare_compressed (struct radix_compressed_node *node,
 	return TRUE;
 }
 
+static inline gboolean
+radix_compare_compressed (struct radix_compressed_node *node,
+		guint8 *key, guint keylen, guint cur_level)
+{
+	return radix_compare_key (node->d.s.key, node->d.s.keylen, node->d.s.level,
+			key, keylen, cur_level);
+}
+
+/*
+ * Poptrie-like multibit trie compiled from all inserted prefixes: each node
+ * covers RADIX_POPTRIE_STRIDE bits of key, children and leaves of a node are
+ * stored contiguously in flat arrays, so their positions are found by
+ * population count of node bitmaps. Runs of equal leaves are stored once.
+ */
+#define RADIX_POPTRIE_STRIDE 6
+
+struct radix_poptrie_node {
+	guint64 vector;         /**< slots that point to children					*/
+	guint64 leafvec;        /**< slots where runs of equal leaves start		*/
+	guint32 base_leaf;
+	guint32 base_child;
+};
+
+struct radix_poptrie {
+	struct radix_poptrie_node *nodes;
+	uintptr_t *leaves;
+	guint keylen;
+};
+
+struct radix_prefix {
+	guint8 key[16];
+	guint8 keylen;
+	guint8 plen;
+	guint32 seq;
+	uintptr_t value;
+};
+
+static inline guint
+radix_popcount64 (guint64 v)
+{
+#ifdef __GNUC__
+	return __builtin_popcountll (v);
+#else
+	v = v - ((v >> 1) & 0x5555555555555555ULL);
+	v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+	v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+
+	return (v * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+/* Get stride bits of key starting from bit `off`, bits after key are zero */
+static inline guint
+radix_key_bits (const guint8 *key, guint keylen, guint off)
+{
+	guint byte = off / NBBY;
+	guint w;
+
+	w = (byte < keylen ? key[byte] : 0) << 8;
+	w |= byte + 1 < keylen ? key[byte + 1] : 0;
+
+	return (w >> (16 - off % NBBY - RADIX_POPTRIE_STRIDE)) &
+			((1U << RADIX_POPTRIE_STRIDE) - 1);
+}
+
+static uintptr_t
+radix_poptrie_lookup (const struct radix_poptrie *pt, const guint8 *key)
+{
+	const struct radix_poptrie_node *node = &pt->nodes[0];
+	guint64 bit, mask;
+	guint off = 0;
+
+	for (;;) {
+		bit = 1ULL << radix_key_bits (key, pt->keylen, off);
+		/* Overflows to all ones for the last slot */
+		mask = (bit << 1) - 1;
+
+		if (node->vector & bit) {
+			node = &pt->nodes[node->base_child +
+					radix_popcount64 (node->vector & mask) - 1];
+			off += RADIX_POPTRIE_STRIDE;
+		}
+		else {
+			return pt->leaves[node->base_leaf +
+					radix_popcount64 (node->leafvec & mask) - 1];
+		}
+	}
+}
+
+static gint
+radix_prefix_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct radix_prefix *p1 = a, *p2 = b;
+	gint r;
+
+	if (p1->keylen != p2->keylen) {
+		return (gint)p1->keylen - (gint)p2->keylen;
+	}
+
+	r = memcmp (p1->key, p2->key, p1->keylen);
+
+	if (r != 0) {
+		return r;
+	}
+
+	if (p1->plen != p2->plen) {
+		return (gint)p1->plen - (gint)p2->plen;
+	}
+
+	return p1->seq < p2->seq ? -1 : (p1->seq > p2->seq);
+}
+
+/*
+ * Build node `idx` from sorted prefixes that share the first `off` bits and
+ * are longer than `off` bits
+ */
+static void
+radix_poptrie_build_node (GArray *nodes, GArray *leaves, guint32 idx,
+		const struct radix_prefix *p, gsize n, guint keylen, guint off,
+		uintptr_t def)
+{
+	const guint nslots = 1U << RADIX_POPTRIE_STRIDE;
+	uintptr_t slot_val[1U << RADIX_POPTRIE_STRIDE], last = 0;
+	gsize child_start[1U << RADIX_POPTRIE_STRIDE];
+	gsize child_cnt[1U << RADIX_POPTRIE_STRIDE];
+	struct radix_poptrie_node *node;
+	guint i, j, slot, plen, first, nchildren = 0;
+	guint64 vector = 0, leafvec = 0;
+	guint32 base_leaf, base_child;
+	gboolean have_leaf = FALSE;
+	gsize k;
+
+	for (i = 0; i < nslots; i ++) {
+		slot_val[i] = def;
+		child_cnt[i] = 0;
+	}
+
+	/* Expand short prefixes, longer ones override shorter ones */
+	for (plen = off + 1; plen <= off + RADIX_POPTRIE_STRIDE; plen ++) {
+		for (k = 0; k < n; k ++) {
+			if (p[k].plen != plen) {
+				continue;
+			}
+
+			first = radix_key_bits (p[k].key, keylen, off);
+
+			for (j = 0; j < 1U << (off + RADIX_POPTRIE_STRIDE - plen); j ++) {
+				slot_val[first + j] = p[k].value;
+			}
+		}
+	}
+
+	/* Longer prefixes of the same slot are adjacent in the sorted array */
+	for (k = 0; k < n; k ++) {
+		if (p[k].plen > off + RADIX_POPTRIE_STRIDE) {
+			slot = radix_key_bits (p[k].key, keylen, off);
+
+			if (child_cnt[slot] == 0) {
+				child_start[slot] = k;
+				nchildren ++;
+			}
+
+			child_cnt[slot] ++;
+		}
+	}
+
+	base_leaf = leaves->len;
+
+	for (i = 0; i < nslots; i ++) {
+		if (child_cnt[i] > 0) {
+			vector |= 1ULL << i;
+		}
+		else if (!have_leaf || slot_val[i] != last) {
+			leafvec |= 1ULL << i;
+			g_array_append_val (leaves, slot_val[i]);
+			last = slot_val[i];
+			have_leaf = TRUE;
+		}
+	}
+
+	base_child = nodes->len;
+	g_array_set_size (nodes, nodes->len + nchildren);
+
+	/* Nodes array can be reallocated, so set node before recursion */
+	node = &g_array_index (nodes, struct radix_poptrie_node, idx);
+	node->vector = vector;
+	node->leafvec = leafvec;
+	node->base_leaf = base_leaf;
+	node->base_child = base_child;
+
+	for (i = 0, j = 0; i < nslots; i ++) {
+		if (child_cnt[i] > 0) {
+			radix_poptrie_build_node (nodes, leaves, base_child + j,
+					p + child_start[i], child_cnt[i], keylen,
+					off + RADIX_POPTRIE_STRIDE, slot_val[i]);
+			j ++;
+		}
+	}
+}
+
+static struct radix_poptrie *
+radix_poptrie_build (const struct radix_prefix *p, gsize n, guint keylen)
+{
+	struct radix_poptrie *pt;
+	GArray *nodes, *leaves;
+	uintptr_t def = RADIX_NO_VALUE;
+
+	/* Default route is not a part of any node */
+	while (n > 0 && p->plen == 0) {
+		def = p->value;
+		p ++;
+		n --;
+	}
+
+	nodes = g_array_sized_new (FALSE, TRUE, sizeof (struct radix_poptrie_node),
+			n / 4 + 1);
+	leaves = g_array_sized_new (FALSE, FALSE, sizeof (uintptr_t), n + 1);
+	g_array_set_size (nodes, 1);
+	radix_poptrie_build_node (nodes, leaves, 0, p, n, keylen, 0, def);
+
+	pt = g_slice_alloc (sizeof (*pt));
+	pt->keylen = keylen;
+	pt->nodes = (struct radix_poptrie_node *)g_array_free (nodes, FALSE);
+	pt->leaves = (uintptr_t *)g_array_free (leaves, FALSE);
+
+	return pt;
+}
+
+static void
+radix_poptrie_destroy (struct radix_poptrie *pt)
+{
+	if (pt != NULL) {
+		g_free (pt->nodes);
+		g_free (pt->leaves);
+		g_slice_free1 (sizeof (*pt), pt);
+	}
+}
+
+static uintptr_t
+radix_find_image (radix_compressed_t *tree, guint8 *key, gsize keylen)
+{
+	const struct radix_image_node *nodes, *node;
+	const guint8 *keys;
+	guint32 bit, idx;
+	gsize kremain = keylen / sizeof (guint32);
+	uintptr_t value;
+	guint32 *k = (guint32 *)key;
+	guint32 kv = ntohl (*k);
+	guint cur_level = 0;
+
+	nodes = (const struct radix_image_node *)(tree->image + 1);
+	keys = (const guint8 *)(nodes + tree->image->nnodes);
+	bit = 1U << 31;
+	value = RADIX_NO_VALUE;
+	idx = tree->image->root;
+
+	while (idx != 0 && kremain) {
+		node = &nodes[idx];
+
+		if (node->skipped) {
+			/* It is obviously a leaf node */
+			if (radix_compare_key (keys + node->left, node->right, node->level,
+					key, keylen, cur_level) &&
+					node->value != (guint64)RADIX_NO_VALUE) {
+				return node->value;
+			}
+			else {
+				return value;
+			}
+		}
+		if (node->value != (guint64)RADIX_NO_VALUE) {
+			value = node->value;
+		}
+
+		if (kv & bit) {
+			idx = node->right;
+		}
+		else {
+			idx = node->left;
+		}
+
+		bit >>= 1;
+		if (bit == 0) {
+			k ++;
+			bit = 1U << 31;
+			kv = ntohl (*k);
+			kremain --;
+		}
+		cur_level ++;
+	}
+
+	return value;
+}
+
 uintptr_t
 radix_find_compressed (radix_compressed_t * tree, guint8 *key, gsize keylen)
 {
@@ -111,6 +438,17 @@ radix_find_compressed (radix_compressed_t * tree, guint8 *key, gsize keylen)
 	guint32 kv = ntohl (*k);
 	guint cur_level = 0;
 
+	if (tree->image != NULL) {
+		return radix_find_image (tree, key, keylen);
+	}
+
+	if (keylen == 4 && tree->pt4 != NULL) {
+		return radix_poptrie_lookup (tree->pt4, key);
+	}
+	else if (keylen == 16 && tree->pt6 != NULL) {
+		return radix_poptrie_lookup (tree->pt6, key);
+	}
+
 	bit = 1U << 31;
 	value = RADIX_NO_VALUE;
 	node = tree->root;
@@ -119,7 +457,8 @@ radix_find_compressed (radix_compressed_t * tree, guint8 *key, gsize keylen)
 	while (node && kremain) {
 		if (node->skipped) {
 			/* It is obviously a leaf node */
-			if (radix_compare_compressed (node, key, keylen, cur_level)) {
+			if (radix_compare_compressed (node, key, keylen, cur_level) &&
+					node->value != RADIX_NO_VALUE) {
 				return node->value;
 			}
 			else {
@@ -394,6 +733,86 @@ radix_uncompress_node (radix_compressed_t *tree,
 }
 
 
+static void
+radix_drop_compiled (radix_compressed_t *tree)
+{
+	radix_poptrie_destroy (tree->pt4);
+	radix_poptrie_destroy (tree->pt6);
+	tree->pt4 = NULL;
+	tree->pt6 = NULL;
+}
+
+static void
+radix_record_prefix (radix_compressed_t *tree, const guint8 *key,
+		gsize keylen, guint plen, uintptr_t value)
+{
+	struct radix_prefix pfx;
+	guint i;
+
+	if (keylen != 4 && keylen != 16) {
+		/* Such keys are always looked up in the tree */
+		return;
+	}
+
+	memset (&pfx, 0, sizeof (pfx));
+	memcpy (pfx.key, key, keylen);
+
+	/* Clear bits after prefix */
+	for (i = plen; i < keylen * NBBY; i ++) {
+		pfx.key[i / NBBY] &= ~(1U << (7 - i % NBBY));
+	}
+
+	pfx.keylen = keylen;
+	pfx.plen = plen;
+	pfx.seq = tree->seq ++;
+	pfx.value = value;
+	g_array_append_val (tree->prefixes, pfx);
+
+	/* Compiled tries are outdated now */
+	radix_drop_compiled (tree);
+}
+
+void
+radix_compile_compressed (radix_compressed_t *tree)
+{
+	struct radix_prefix *p;
+	gsize i, n = 0, lo;
+
+	if (tree->image != NULL) {
+		return;
+	}
+
+	radix_drop_compiled (tree);
+	g_array_sort (tree->prefixes, radix_prefix_cmp);
+	p = (struct radix_prefix *)tree->prefixes->data;
+
+	/* Keep the last value of each prefix and skip removed prefixes */
+	for (i = 0; i < tree->prefixes->len; i ++) {
+		if (i + 1 < tree->prefixes->len && p[i].keylen == p[i + 1].keylen &&
+				p[i].plen == p[i + 1].plen &&
+				memcmp (p[i].key, p[i + 1].key, p[i].keylen) == 0) {
+			continue;
+		}
+
+		if (p[i].value == RADIX_NO_VALUE) {
+			continue;
+		}
+
+		p[n] = p[i];
+		p[n].seq = n;
+		n ++;
+	}
+
+	g_array_set_size (tree->prefixes, n);
+	tree->seq = n;
+
+	/* Prefixes are sorted by key length, so IPv4 ones go first */
+	for (lo = 0; lo < n && p[lo].keylen == 4; lo ++);
+
+	tree->pt4 = radix_poptrie_build (p, lo, 4);
+	tree->pt6 = radix_poptrie_build (p + lo, n - lo, 16);
+}
+
 uintptr_t
 radix_insert_compressed (radix_compressed_t * tree,
 	guint8 *key, gsize keylen,
@@ -412,7 +831,14 @@ radix_insert_compressed (radix_compressed_t * tree,
 	node = tree->root;
 
 	g_assert (keybits >= masklen);
+
+	if (tree->image != NULL) {
+		msg_err ("cannot insert value to a compiled radix tree");
+		return RADIX_NO_VALUE;
+	}
+
 	msg_debug ("want insert value %p with mask %z", value, masklen);
+	radix_record_prefix (tree, key, keylen, keybits - masklen, value);
 
 	node = tree->root;
 	next = node;
@@ -530,6 +956,13 @@ radix_create_compressed (void)
 	tree->pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
 	tree->size = 0;
 	tree->root = NULL;
+	tree->image = NULL;
+	tree->image_len = 0;
+	tree->image_mapped = FALSE;
+	tree->prefixes = g_array_new (FALSE, FALSE, sizeof (struct radix_prefix));
+	tree->seq = 0;
+	tree->pt4 = NULL;
+	tree->pt6 = NULL;
 
 	return tree;
 }
@@ -537,10 +970,138 @@ radix_create_compressed (void)
 void
 radix_destroy_compressed (radix_compressed_t *tree)
 {
-	rspamd_mempool_delete (tree->pool);
+	if (tree->image != NULL) {
+		if (tree->image_mapped) {
+			munmap ((gpointer)tree->image, tree->image_len);
+		}
+		else {
+			g_free ((gpointer)tree->image);
+		}
+	}
+	else {
+		radix_drop_compiled (tree);
+		g_array_free (tree->prefixes, TRUE);
+		rspamd_mempool_delete (tree->pool);
+	}
+
 	g_slice_free1 (sizeof (*tree), tree);
 }
 
+static guint32
+radix_serialize_node (struct radix_compressed_node *node, GArray *nodes,
+		GByteArray *keys)
+{
+	struct radix_image_node *inode;
+	guint32 idx, left = 0, right = 0;
+
+	if (node == NULL) {
+		return 0;
+	}
+
+	idx = nodes->len;
+	g_array_set_size (nodes, idx + 1);
+
+	if (node->skipped) {
+		left = keys->len;
+		right = node->d.s.keylen;
+		g_byte_array_append (keys, node->d.s.key, node->d.s.keylen);
+	}
+	else {
+		/* Array can be reallocated here, so do not keep pointers to it */
+		left = radix_serialize_node (node->d.n.left, nodes, keys);
+		right = radix_serialize_node (node->d.n.right, nodes, keys);
+	}
+
+	inode = &g_array_index (nodes, struct radix_image_node, idx);
+	inode->value = node->value;
+	inode->left = left;
+	inode->right = right;
+	inode->level = node->skipped ? node->d.s.level : 0;
+	inode->skipped = node->skipped;
+
+	return idx;
+}
+
+GByteArray *
+radix_serialize_compressed (radix_compressed_t *tree)
+{
+	struct radix_image_hdr hdr;
+	GArray *nodes;
+	GByteArray *keys, *res;
+
+	g_assert (tree->image == NULL);
+
+	nodes = g_array_sized_new (FALSE, TRUE, sizeof (struct radix_image_node),
+			tree->size + 1);
+	keys = g_byte_array_new ();
+	/* Reserved NULL node */
+	g_array_set_size (nodes, 1);
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, RADIX_IMAGE_MAGIC, sizeof (hdr.magic));
+	hdr.root = radix_serialize_node (tree->root, nodes, keys);
+	hdr.nnodes = nodes->len;
+	hdr.keys_len = keys->len;
+
+	res = g_byte_array_sized_new (sizeof (hdr) +
+			nodes->len * sizeof (struct radix_image_node) + keys->len);
+	g_byte_array_append (res, (const guint8 *)&hdr, sizeof (hdr));
+	g_byte_array_append (res, (const guint8 *)nodes->data,
+			nodes->len * sizeof (struct radix_image_node));
+	g_byte_array_append (res, keys->data, keys->len);
+
+	g_array_free (nodes, TRUE);
+	g_byte_array_free (keys, TRUE);
+
+	return res;
+}
+
+radix_compressed_t *
+radix_create_compressed_image (const guchar *data, gsize len,
+		gboolean mapped)
+{
+	radix_compressed_t *tree;
+	const struct radix_image_hdr *hdr = (const struct radix_image_hdr *)data;
+	const struct radix_image_node *nodes;
+	guint32 i;
+
+	if (len < sizeof (*hdr) ||
+			memcmp (hdr->magic, RADIX_IMAGE_MAGIC, sizeof (hdr->magic)) != 0 ||
+			hdr->nnodes == 0 || hdr->root >= hdr->nnodes ||
+			(len - sizeof (*hdr)) / sizeof (*nodes) < hdr->nnodes ||
+			len != sizeof (*hdr) + hdr->nnodes * sizeof (*nodes) +
+			hdr->keys_len) {
+		msg_err ("invalid radix image of %z bytes", len);
+		return NULL;
+	}
+
+	nodes = (const struct radix_image_node *)(hdr + 1);
+
+	/* Check all links as the image comes from outside */
+	for (i = 1; i < hdr->nnodes; i ++) {
+		if (nodes[i].skipped) {
+			if ((guint64)nodes[i].left + nodes[i].right > hdr->keys_len ||
+					nodes[i].level > nodes[i].right * NBBY) {
+				msg_err ("invalid radix image: bad key in node %ud", i);
+				return NULL;
+			}
+		}
+		else if (nodes[i].left >= hdr->nnodes ||
+				nodes[i].right >= hdr->nnodes) {
+			msg_err ("invalid radix image: bad link in node %ud", i);
+			return NULL;
+		}
+	}
+
+	tree = g_slice_alloc0 (sizeof (*tree));
+	tree->image = hdr;
+	tree->image_len = len;
+	tree->image_mapped = mapped;
+	tree->size = hdr->nnodes - 1;
+
+	return tree;
+}
+
 uintptr_t
 radix_find_compressed_addr (radix_compressed_t *tree, rspamd_inet_addr_t *addr)
 {
@@ -560,9 +1121,9 @@ radix_find_compressed_addr (radix_compressed_t *tree, rspamd_inet_addr_t *addr)
 	return RADIX_NO_VALUE;
 }
 
-gint
-rspamd_radix_add_iplist (const gchar *list, const gchar *separators,
-		radix_compressed_t *tree)
+static gint
+rspamd_radix_insert_iplist (const gchar *list, const gchar *separators,
+		radix_compressed_t *tree, uintptr_t value)
 {
 	gchar *token, *ipnet, *err_str, **strv, **cur;
 	struct in_addr ina;
@@ -613,7 +1174,7 @@ rspamd_radix_add_iplist (const gchar *list, const gchar *separators,
 				k = 32;
 			}
 			radix_insert_compressed (tree, (guint8 *)&ina, sizeof (ina),
-					32 - k, 1);
+					32 - k, value);
 			res ++;
 		}
 		else if (af == AF_INET6){
@@ -621,7 +1182,7 @@ rspamd_radix_add_iplist (const gchar *list, const gchar *separators,
 				k = 128;
 			}
 			radix_insert_compressed (tree, (guint8 *)&ina6, sizeof (ina6),
-					128 - k, 1);
+					128 - k, value);
 			res ++;
 		}
 		cur++;
@@ -632,14 +1193,34 @@ rspamd_radix_add_iplist (const gchar *list, const gchar *separators,
 	return res;
 }
 
+gint
+rspamd_radix_add_iplist (const gchar *list, const gchar *separators,
+		radix_compressed_t *tree)
+{
+	return rspamd_radix_insert_iplist (list, separators, tree, 1);
+}
+
+gint
+rspamd_radix_del_iplist (const gchar *list, const gchar *separators,
+		radix_compressed_t *tree)
+{
+	/* Nodes are not removed, just their values are cleared */
+	return rspamd_radix_insert_iplist (list, separators, tree, RADIX_NO_VALUE);
+}
+
 gboolean
 radix_add_generic_iplist (const gchar *ip_list, radix_compressed_t **tree)
 {
+	gboolean ret;
+
 	if (*tree == NULL) {
 		*tree = radix_create_compressed ();
 	}
 
-	return (rspamd_radix_add_iplist (ip_list, ",; ", *tree) > 0);
+	ret = (rspamd_radix_add_iplist (ip_list, ",; ", *tree) > 0);
+	radix_compile_compressed (*tree);
+
+	return ret;
 }
 
 /*
@@ -80,6 +80,32 @@ void radix_destroy_compressed (radix_compressed_t *tree);
  */
 radix_compressed_t *radix_create_compressed (void);
 
+/**
+ * Compile all prefixes inserted to the trie into flat multibit tries for
+ * IPv4 and IPv6 keys that are used for lookups until the next insertion
+ * @param tree radix trie
+ */
+void radix_compile_compressed (radix_compressed_t *tree);
+
+/**
+ * Write radix trie to a position independent image that can be stored in
+ * a file and used by other processes
+ * @param tree radix trie
+ * @return new byte array with image
+ */
+GByteArray *radix_serialize_compressed (radix_compressed_t *tree);
+
+/**
+ * Create read only radix trie from compiled image, trie owns the data and
+ * frees it when destroyed
+ * @param data image data
+ * @param len length of image
+ * @param mapped if TRUE then data is unmapped on destroy, otherwise g_free'd
+ * @return new trie or NULL if image is invalid
+ */
+radix_compressed_t *radix_create_compressed_image (const guchar *data,
+		gsize len, gboolean mapped);
+
 /**
  * Insert list of ip addresses and masks to the radix tree
  * @param list string line of addresses
@@ -90,6 +116,16 @@ radix_compressed_t *radix_create_compressed (void);
 gint rspamd_radix_add_iplist (const gchar *list, const gchar *separators,
 		radix_compressed_t *tree);
 
+/**
+ * Remove values for all networks in list from trie
+ * @param list string with networks
+ * @param separators separators between networks
+ * @param tree radix trie
+ * @return number of networks processed
+ */
+gint rspamd_radix_del_iplist (const gchar *list, const gchar *separators,
+		radix_compressed_t *tree);
+
 /**
  * Generic version of @see rspamd_radix_add_iplist. This function creates tree
  * if `tree` is NULL.
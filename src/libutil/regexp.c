@@ -29,13 +29,51 @@
 #include "ref.h"
 #include "util.h"
 #include "main.h"
+#include "xxhash.h"
 #include <pcre.h>
 
 typedef guchar regexp_id_t[BLAKE2B_OUTBYTES];
 
-#define RSPAMD_REGEXP_FLAG_RAW (1 << 1)
-#define RSPAMD_REGEXP_FLAG_NOOPT (1 << 2)
-#define RSPAMD_REGEXP_FLAG_FULL_MATCH (1 << 3)
+#define RSPAMD_REGEXP_BC_MAGIC "rsre\0\0\0\1"
+#define RSPAMD_REGEXP_BC_ALIGN 8
+#define RSPAMD_REGEXP_BC_ALIGNED(len) \
+	(((len) + RSPAMD_REGEXP_BC_ALIGN - 1) & ~(RSPAMD_REGEXP_BC_ALIGN - 1))
+
+/*
+ * On disk cache of compiled pcre patterns, the file is mapped to memory and
+ * patterns are used directly from the mapping. As mapping is shared, all
+ * processes that load the same cache share these pages.
+ */
+struct rspamd_regexp_bc_hdr {
+	gchar magic[8];
+	guint32 nelts;
+	guint32 ptr_size;
+	gchar pcre_version[64];
+	guint64 checksum;
+};
+
+struct rspamd_regexp_bc_record {
+	regexp_id_t id;
+	guint32 len;
+	guint32 unused;
+};
+
+struct rspamd_regexp_bc_elt {
+	const guchar *data;
+	gsize len;
+	/* Data is owned by an element and not mapped from the cache file */
+	gboolean owned;
+	/* Element has been requested since the cache file was loaded */
+	gboolean used;
+};
+
+struct rspamd_regexp_bc_cache {
+	gpointer map;
+	gsize maplen;
+	GHashTable *elts;
+	gboolean dirty;
+	ref_entry_t ref;
+};
 
 struct rspamd_regexp_s {
 	gdouble exec_time;
@@ -48,10 +86,15 @@ struct rspamd_regexp_s {
 #endif
 	pcre *raw_re;
 	pcre_extra *raw_extra;
+	/* Set if bytecode of re or raw_re belongs to the bytecode cache */
+	struct rspamd_regexp_bc_cache *bc;
+	gboolean re_mapped;
+	gboolean raw_mapped;
 	regexp_id_t id;
 	ref_entry_t ref;
 	gpointer ud;
 	gint flags;
+	gint pcre_flags;
 };
 
 struct rspamd_regexp_cache {
@@ -59,6 +102,8 @@ struct rspamd_regexp_cache {
 };
 
 static struct rspamd_regexp_cache *global_re_cache = NULL;
+static struct rspamd_regexp_bc_cache *global_bc_cache = NULL;
+static rspamd_mutex_t *bc_mtx = NULL;
 static gboolean can_jit = FALSE;
 
 static GQuark
@@ -83,12 +128,128 @@ rspamd_regexp_generate_id (const gchar *pattern, const gchar *flags,
 	blake2b_final (&st, out, sizeof (regexp_id_t));
 }
 
+static void
+rspamd_regexp_bc_elt_free (gpointer p)
+{
+	struct rspamd_regexp_bc_elt *elt = p;
+
+	if (elt->owned) {
+		g_free ((gpointer)elt->data);
+	}
+
+	g_slice_free1 (sizeof (*elt), elt);
+}
+
+static void
+rspamd_regexp_bc_cache_dtor (struct rspamd_regexp_bc_cache *bc)
+{
+	g_hash_table_unref (bc->elts);
+
+	if (bc->map) {
+		munmap (bc->map, bc->maplen);
+	}
+
+	g_slice_free1 (sizeof (*bc), bc);
+}
+
+static struct rspamd_regexp_bc_cache *
+rspamd_regexp_bc_cache_new (void)
+{
+	struct rspamd_regexp_bc_cache *bc;
+
+	bc = g_slice_alloc0 (sizeof (*bc));
+	bc->elts = g_hash_table_new_full (rspamd_regexp_hash, rspamd_regexp_equal,
+			g_free, rspamd_regexp_bc_elt_free);
+	REF_INIT_RETAIN (bc, rspamd_regexp_bc_cache_dtor);
+
+	return bc;
+}
+
+/*
+ * Compile pattern or take its bytecode from the bytecode cache, *mapped is
+ * set to TRUE if the result belongs to the cache and must not be freed
+ */
+static pcre *
+rspamd_regexp_compile_pattern (rspamd_regexp_t *re, const gchar *pattern,
+		gint flags, const gchar **err_str, gint *err_off, gboolean *mapped)
+{
+	struct rspamd_regexp_bc_elt *elt = NULL;
+	regexp_id_t id;
+	blake2b_state st;
+	pcre *r;
+	gsize len = 0;
+	gchar *id_copy;
+
+	*mapped = FALSE;
+
+	if (bc_mtx == NULL) {
+		return pcre_compile (pattern, flags, err_str, err_off, NULL);
+	}
+
+	blake2b_init (&st, sizeof (id));
+	blake2b_update (&st, (const guint8 *)&flags, sizeof (flags));
+	blake2b_update (&st, pattern, strlen (pattern));
+	blake2b_final (&st, id, sizeof (id));
+
+	rspamd_mutex_lock (bc_mtx);
+
+	if (global_bc_cache != NULL) {
+		elt = g_hash_table_lookup (global_bc_cache->elts, id);
+
+		if (elt != NULL && !elt->owned) {
+			elt->used = TRUE;
+
+			if (re->bc == NULL) {
+				REF_RETAIN (global_bc_cache);
+				re->bc = global_bc_cache;
+			}
+
+			/* Another cache might have been loaded in between */
+			if (re->bc == global_bc_cache) {
+				rspamd_mutex_unlock (bc_mtx);
+				*mapped = TRUE;
+
+				return (pcre *)elt->data;
+			}
+		}
+	}
+
+	rspamd_mutex_unlock (bc_mtx);
+
+	r = pcre_compile (pattern, flags, err_str, err_off, NULL);
+
+	if (r != NULL && elt == NULL &&
+			pcre_fullinfo (r, NULL, PCRE_INFO_SIZE, &len) == 0) {
+		rspamd_mutex_lock (bc_mtx);
+
+		if (global_bc_cache != NULL &&
+				g_hash_table_lookup (global_bc_cache->elts, id) == NULL) {
+			elt = g_slice_alloc0 (sizeof (*elt));
+			elt->data = g_malloc (len);
+			memcpy ((gpointer)elt->data, r, len);
+			elt->len = len;
+			elt->owned = TRUE;
+			elt->used = TRUE;
+			id_copy = g_malloc (sizeof (id));
+			memcpy (id_copy, id, sizeof (id));
+			g_hash_table_insert (global_bc_cache->elts, id_copy, elt);
+			global_bc_cache->dirty = TRUE;
+		}
+
+		rspamd_mutex_unlock (bc_mtx);
+	}
+
+	return r;
+}
+
 static void
 rspamd_regexp_dtor (rspamd_regexp_t *re)
 {
 	if (re) {
 		if (re->raw_re && re->raw_re != re->re) {
-			pcre_free (re->raw_re);
+			if (!re->raw_mapped) {
+				pcre_free (re->raw_re);
+			}
 #ifdef HAVE_PCRE_JIT
 			if (re->raw_extra) {
 				pcre_free_study (re->raw_extra);
@@ -101,7 +262,9 @@ rspamd_regexp_dtor (rspamd_regexp_t *re)
 #endif
 		}
 		if (re->re) {
-			pcre_free (re->re);
+			if (!re->re_mapped) {
+				pcre_free (re->re);
+			}
 #ifdef HAVE_PCRE_JIT
 			if (re->extra) {
 				pcre_free_study (re->extra);
@@ -117,6 +280,10 @@ rspamd_regexp_dtor (rspamd_regexp_t *re)
 		if (re->pattern) {
 			g_free (re->pattern);
 		}
+
+		if (re->bc) {
+			REF_RELEASE (re->bc);
+		}
 	}
 }
 
@@ -129,7 +296,7 @@ rspamd_regexp_new (const gchar *pattern, const gchar *flags,
 	pcre *r;
 	gchar sep = 0, *real_pattern;
 	gint regexp_flags = 0, rspamd_flags = 0, err_off, study_flags = 0;
-	gboolean strict_flags = FALSE;
+	gboolean strict_flags = FALSE, mapped;
 
 	rspamd_regexp_library_init ();
 
@@ -225,30 +392,36 @@ fin:
 	real_pattern = g_malloc (end - start + 1);
 	rspamd_strlcpy (real_pattern, start, end - start + 1);
 
-	r = pcre_compile (real_pattern, regexp_flags, &err_str, &err_off, NULL);
+	/* Now allocate the target structure */
+	res = g_slice_alloc0 (sizeof (*res));
+	REF_INIT_RETAIN (res, rspamd_regexp_dtor);
+	res->flags = rspamd_flags;
+	res->pcre_flags = regexp_flags;
+	res->pattern = real_pattern;
+
+	r = rspamd_regexp_compile_pattern (res, real_pattern, regexp_flags,
+			&err_str, &err_off, &mapped);
 
 	if (r == NULL) {
 		g_set_error (err, rspamd_regexp_quark(), EINVAL,
 			"invalid regexp pattern: '%s': %s at position %d",
 			pattern, err_str, err_off);
-		g_free (real_pattern);
+		REF_RELEASE (res);
+		g_slice_free1 (sizeof (*res), res);
 
 		return NULL;
 	}
 
-	/* Now allocate the target structure */
-	res = g_slice_alloc0 (sizeof (*res));
-	REF_INIT_RETAIN (res, rspamd_regexp_dtor);
-	res->flags = rspamd_flags;
-	res->pattern = real_pattern;
-
 	if (rspamd_flags & RSPAMD_REGEXP_FLAG_RAW) {
 		res->raw_re = r;
+		res->raw_mapped = mapped;
 	}
 	else {
 		res->re = r;
-		res->raw_re = pcre_compile (pattern, regexp_flags & ~PCRE_UTF8,
-				&err_str, &err_off, NULL);
+		res->re_mapped = mapped;
+		res->raw_re = rspamd_regexp_compile_pattern (res, pattern,
+				regexp_flags & ~PCRE_UTF8,
+				&err_str, &err_off, &res->raw_mapped);
 
 		if (res->raw_re == NULL) {
 			msg_warn ("invalid raw regexp pattern: '%s': %s at position %d",
@@ -449,6 +622,22 @@ rspamd_regexp_get_pattern (rspamd_regexp_t *re)
 	return re->pattern;
 }
 
+gint
+rspamd_regexp_get_flags (rspamd_regexp_t *re)
+{
+	g_assert (re != NULL);
+
+	return re->flags;
+}
+
+gint
+rspamd_regexp_get_pcre_flags (rspamd_regexp_t *re)
+{
+	g_assert (re != NULL);
+
+	return re->pcre_flags;
+}
+
 gboolean
 rspamd_regexp_match (rspamd_regexp_t *re, const gchar *text, gsize len,
 		gboolean raw)
@@ -470,6 +659,10 @@ rspamd_regexp_match (rspamd_regexp_t *re, const gchar *text, gsize len,
 void
 rspamd_regexp_unref (rspamd_regexp_t *re)
 {
+	if (re != NULL && (re->flags & RSPAMD_REGEXP_FLAG_STATIC)) {
+		return;
+	}
+
 	REF_RELEASE (re);
 }
 
@@ -478,7 +671,9 @@ rspamd_regexp_ref (rspamd_regexp_t *re)
 {
 	g_assert (re != NULL);
 
-	REF_RETAIN (re);
+	if (!(re->flags & RSPAMD_REGEXP_FLAG_STATIC)) {
+		REF_RETAIN (re);
+	}
 
 	return re;
 }
@@ -616,6 +811,29 @@ rspamd_regexp_cache_remove (struct rspamd_regexp_cache *cache,
 	return g_hash_table_remove (cache->tbl, re->id);
 }
 
+void
+rspamd_regexp_cache_freeze (struct rspamd_regexp_cache *cache)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	rspamd_regexp_t *re;
+
+	if (cache == NULL) {
+		cache = global_re_cache;
+	}
+
+	if (cache == NULL) {
+		return;
+	}
+
+	g_hash_table_iter_init (&it, cache->tbl);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		re = v;
+		re->flags |= RSPAMD_REGEXP_FLAG_STATIC;
+	}
+}
+
 void
 rspamd_regexp_cache_destroy (struct rspamd_regexp_cache *cache)
 {
@@ -624,6 +842,244 @@ rspamd_regexp_cache_destroy (struct rspamd_regexp_cache *cache)
 	}
 }
 
+static void
+rspamd_regexp_bc_fill_hdr (struct rspamd_regexp_bc_hdr *hdr)
+{
+	memset (hdr, 0, sizeof (*hdr));
+	memcpy (hdr->magic, RSPAMD_REGEXP_BC_MAGIC, sizeof (hdr->magic));
+	hdr->ptr_size = sizeof (gpointer);
+	/* Bytecode is compatible between the same versions of pcre only */
+	rspamd_strlcpy (hdr->pcre_version, pcre_version (),
+			sizeof (hdr->pcre_version));
+}
+
+gboolean
+rspamd_regexp_library_load_cache (const gchar *path)
+{
+	struct rspamd_regexp_bc_cache *bc;
+	struct rspamd_regexp_bc_hdr hdr, *fhdr;
+	struct rspamd_regexp_bc_record *rec;
+	struct rspamd_regexp_bc_elt *elt;
+	struct stat st;
+	const guchar *p, *end;
+	gchar *id;
+	gsize len;
+	guint i;
+	gint fd;
+
+	g_assert (path != NULL);
+
+	rspamd_regexp_library_init ();
+
+	if (bc_mtx == NULL) {
+		bc_mtx = rspamd_mutex_new ();
+	}
+
+	bc = rspamd_regexp_bc_cache_new ();
+
+	if ((fd = open (path, O_RDONLY)) == -1 || fstat (fd, &st) == -1) {
+		if (errno != ENOENT) {
+			msg_warn ("cannot open regexp cache %s: %s", path, strerror (errno));
+		}
+
+		if (fd != -1) {
+			close (fd);
+		}
+
+		goto end;
+	}
+
+	if ((gsize)st.st_size < sizeof (hdr)) {
+		msg_warn ("regexp cache %s is truncated, ignore it", path);
+		close (fd);
+		goto end;
+	}
+
+	bc->map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (bc->map == MAP_FAILED) {
+		msg_warn ("cannot mmap regexp cache %s: %s", path, strerror (errno));
+		bc->map = NULL;
+		goto end;
+	}
+
+	bc->maplen = st.st_size;
+	fhdr = bc->map;
+	rspamd_regexp_bc_fill_hdr (&hdr);
+
+	if (memcmp (fhdr->magic, hdr.magic, sizeof (hdr.magic)) != 0 ||
+			fhdr->ptr_size != hdr.ptr_size ||
+			memcmp (fhdr->pcre_version, hdr.pcre_version,
+					sizeof (hdr.pcre_version)) != 0) {
+		msg_info ("regexp cache %s has been created by another version of "
+				"pcre, ignore it", path);
+		goto end;
+	}
+
+	p = (const guchar *)bc->map + sizeof (hdr);
+	end = (const guchar *)bc->map + bc->maplen;
+
+	if (XXH64 (p, end - p, 0) != fhdr->checksum) {
+		msg_warn ("regexp cache %s is corrupted, ignore it", path);
+		goto end;
+	}
+
+	for (i = 0; i < fhdr->nelts; i ++) {
+		rec = (struct rspamd_regexp_bc_record *)p;
+
+		if (end - p < (gssize)sizeof (*rec) ||
+				end - p - sizeof (*rec) < rec->len) {
+			msg_warn ("regexp cache %s is corrupted, ignore it", path);
+			g_hash_table_remove_all (bc->elts);
+			goto end;
+		}
+
+		p += sizeof (*rec);
+
+		/* Pcre checks magic and byte order of a pattern */
+		if (pcre_fullinfo ((const pcre *)p, NULL, PCRE_INFO_SIZE, &len) != 0 ||
+				len != rec->len) {
+			msg_warn ("regexp cache %s has invalid pattern, ignore it", path);
+			g_hash_table_remove_all (bc->elts);
+			goto end;
+		}
+
+		elt = g_slice_alloc0 (sizeof (*elt));
+		elt->data = p;
+		elt->len = len;
+		id = g_malloc (sizeof (rec->id));
+		memcpy (id, rec->id, sizeof (rec->id));
+		g_hash_table_insert (bc->elts, id, elt);
+
+		p += RSPAMD_REGEXP_BC_ALIGNED (rec->len);
+	}
+
+	msg_info ("loaded %ud compiled regexps from %s", fhdr->nelts, path);
+
+end:
+	rspamd_mutex_lock (bc_mtx);
+
+	if (global_bc_cache) {
+		REF_RELEASE (global_bc_cache);
+	}
+
+	global_bc_cache = bc;
+	rspamd_mutex_unlock (bc_mtx);
+
+	return g_hash_table_size (bc->elts) > 0;
+}
+
+gboolean
+rspamd_regexp_library_save_cache (const gchar *path, GError **err)
+{
+	struct rspamd_regexp_bc_hdr hdr;
+	struct rspamd_regexp_bc_record rec;
+	struct rspamd_regexp_bc_elt *elt;
+	GHashTableIter it;
+	GByteArray *buf;
+	gpointer k, v;
+	gchar tmp_path[PATH_MAX];
+	static const guchar pad[RSPAMD_REGEXP_BC_ALIGN];
+	gboolean ret = TRUE;
+	guint nused = 0;
+	gint fd;
+
+	g_assert (path != NULL);
+
+	if (bc_mtx == NULL) {
+		return TRUE;
+	}
+
+	rspamd_mutex_lock (bc_mtx);
+
+	if (global_bc_cache == NULL) {
+		rspamd_mutex_unlock (bc_mtx);
+		return TRUE;
+	}
+
+	g_hash_table_iter_init (&it, global_bc_cache->elts);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		elt = v;
+
+		if (elt->used) {
+			nused ++;
+		}
+	}
+
+	/* Nothing new is compiled and all cached patterns are still in use */
+	if (!global_bc_cache->dirty &&
+			nused == g_hash_table_size (global_bc_cache->elts)) {
+		rspamd_mutex_unlock (bc_mtx);
+		return TRUE;
+	}
+
+	rspamd_regexp_bc_fill_hdr (&hdr);
+	buf = g_byte_array_new ();
+	g_byte_array_append (buf, (const guint8 *)&hdr, sizeof (hdr));
+	g_hash_table_iter_init (&it, global_bc_cache->elts);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		elt = v;
+
+		if (!elt->used) {
+			continue;
+		}
+
+		memset (&rec, 0, sizeof (rec));
+		memcpy (rec.id, k, sizeof (rec.id));
+		rec.len = elt->len;
+		g_byte_array_append (buf, (const guint8 *)&rec, sizeof (rec));
+		g_byte_array_append (buf, elt->data, elt->len);
+		g_byte_array_append (buf, pad, RSPAMD_REGEXP_BC_ALIGNED (elt->len) - elt->len);
+		hdr.nelts ++;
+	}
+
+	global_bc_cache->dirty = FALSE;
+	rspamd_mutex_unlock (bc_mtx);
+
+	hdr.checksum = XXH64 (buf->data + sizeof (hdr), buf->len - sizeof (hdr), 0);
+	memcpy (buf->data, &hdr, sizeof (hdr));
+
+	/* Write a new file and rename it to keep the mapped one intact */
+	rspamd_snprintf (tmp_path, sizeof (tmp_path), "%s.new", path);
+	fd = open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_regexp_quark (), errno,
+				"cannot open %s: %s", tmp_path, strerror (errno));
+		g_byte_array_free (buf, TRUE);
+
+		return FALSE;
+	}
+
+	if (write (fd, buf->data, buf->len) != (gssize)buf->len) {
+		g_set_error (err, rspamd_regexp_quark (), errno,
+				"cannot write %s: %s", tmp_path, strerror (errno));
+		ret = FALSE;
+	}
+
+	close (fd);
+
+	if (ret && rename (tmp_path, path) == -1) {
+		g_set_error (err, rspamd_regexp_quark (), errno,
+				"cannot rename %s to %s: %s", tmp_path, path, strerror (errno));
+		ret = FALSE;
+	}
+
+	if (!ret) {
+		unlink (tmp_path);
+	}
+	else {
+		msg_info ("saved %ud compiled regexps to %s", hdr.nelts, path);
+	}
+
+	g_byte_array_free (buf, TRUE);
+
+	return ret;
+}
+
 void
 rspamd_regexp_library_init (void)
 {
@@ -660,4 +1116,9 @@ rspamd_regexp_library_finalize (void)
 	if (global_re_cache != NULL) {
 		rspamd_regexp_cache_destroy (global_re_cache);
 	}
+
+	if (global_bc_cache != NULL) {
+		REF_RELEASE (global_bc_cache);
+		global_bc_cache = NULL;
+	}
 }
@@ -27,6 +27,12 @@
 
 #include "config.h"
 
+#define RSPAMD_REGEXP_FLAG_RAW (1 << 1)
+#define RSPAMD_REGEXP_FLAG_NOOPT (1 << 2)
+#define RSPAMD_REGEXP_FLAG_FULL_MATCH (1 << 3)
+/* Regexp is never freed and its refcount is not touched */
+#define RSPAMD_REGEXP_FLAG_STATIC (1 << 4)
+
 typedef struct rspamd_regexp_s rspamd_regexp_t;
 struct rspamd_regexp_cache;
 
@@ -103,6 +109,20 @@ gpointer rspamd_regexp_get_id (rspamd_regexp_t *re);
  */
 const char* rspamd_regexp_get_pattern (rspamd_regexp_t *re);
 
+/**
+ * Get rspamd flags (RSPAMD_REGEXP_FLAG_*) of the specified regexp object
+ * @param re
+ * @return
+ */
+gint rspamd_regexp_get_flags (rspamd_regexp_t *re);
+
+/**
+ * Get flags the pattern was compiled by pcre with
+ * @param re
+ * @return
+ */
+gint rspamd_regexp_get_pcre_flags (rspamd_regexp_t *re);
+
 /**
  * Create new regexp cache
  * @return
@@ -152,6 +172,14 @@ rspamd_regexp_t* rspamd_regexp_cache_create (struct rspamd_regexp_cache *cache,
 gboolean rspamd_regexp_cache_remove (struct rspamd_regexp_cache *cache,
 		rspamd_regexp_t *re);
 
+/**
+ * Mark all regexps of the cache as static, so they are never freed and
+ * ref/unref of these regexps do not write to them. It should be called
+ * before fork to keep the pages of regexps shared between workers
+ * @param cache regexp cache. if NULL, the superglobal cache is used
+ */
+void rspamd_regexp_cache_freeze (struct rspamd_regexp_cache *cache);
+
 /**
  * Destroy regexp cache and unref all elements inside it
  * @param cache
@@ -178,6 +206,26 @@ gboolean rspamd_regexp_equal (gconstpointer a, gconstpointer b);
  */
 void rspamd_regexp_library_init (void);
 
+/**
+ * Load compiled patterns from the on-disk cache, patterns are used directly
+ * from the shared mapping of the cache file, so it should be called before
+ * regexps are created and before workers are forked. Patterns that are not
+ * found in the cache are compiled as usual and remembered to be saved by
+ * `rspamd_regexp_library_save_cache`
+ * @param path path to the cache file
+ * @return TRUE if any patterns have been loaded
+ */
+gboolean rspamd_regexp_library_load_cache (const gchar *path);
+
+/**
+ * Save all patterns used since the cache has been loaded, the file is not
+ * rewritten if nothing has changed
+ * @param path path to the cache file
+ * @param err error pointer
+ * @return TRUE if the cache has been saved or has not been changed
+ */
+gboolean rspamd_regexp_library_save_cache (const gchar *path, GError **err);
+
 /**
  * Cleanup internal library structures
  */
@@ -111,6 +111,115 @@ rspamd_shingles_generate (GArray *input,
 	return res;
 }
 
+/* Multiplier of the window polynomial, it is odd */
+#define SHINGLES_WINDOW_PRIME 0x9E3779B97F4A7C15ULL
+
+static inline guint64
+rspamd_shingles_mix (guint64 h)
+{
+	/* Finalizer of murmur3: both shifts and multiplications are invertible */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+struct rspamd_shingle*
+rspamd_shingles_generate_fast (GArray *input,
+		const guchar key[16],
+		rspamd_mempool_t *pool)
+{
+	struct rspamd_shingle *res;
+	guint64 mul[RSPAMD_SHINGLE_SIZE], add[RSPAMD_SHINGLE_SIZE];
+	guint64 *wh, h, v, pw;
+	guchar shabuf[BLAKE2B_OUTBYTES];
+	rspamd_sipkey_t sipkey;
+	struct rspamd_cryptobox_segment *segs;
+	rspamd_fstring_t *word;
+	blake2b_state bs;
+	gint i, j, nwin, wlen;
+
+	if (pool != NULL) {
+		res = rspamd_mempool_alloc (pool, sizeof (*res));
+	}
+	else {
+		res = g_malloc (sizeof (*res));
+	}
+
+	/*
+	 * Key of words hash and parameters of permutations are derived from the
+	 * initial key by a chain of blake2b hashes, multipliers must be odd to
+	 * make permutations of 64 bit values
+	 */
+	blake2b_init (&bs, BLAKE2B_OUTBYTES);
+	blake2b_update (&bs, key, 16);
+	blake2b_final (&bs, shabuf, sizeof (shabuf));
+	memcpy (sipkey, shabuf, sizeof (sipkey));
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		/* Each round gives 4 pairs of parameters */
+		if (i % 4 == 0) {
+			blake2b_init (&bs, BLAKE2B_OUTBYTES);
+			blake2b_update (&bs, shabuf, sizeof (shabuf));
+			blake2b_final (&bs, shabuf, sizeof (shabuf));
+		}
+
+		memcpy (&mul[i], shabuf + (i % 4) * 16, sizeof (guint64));
+		memcpy (&add[i], shabuf + (i % 4) * 16 + 8, sizeof (guint64));
+		mul[i] |= 1;
+		res->hashes[i] = G_MAXUINT64;
+	}
+
+	/* Windows are the same as in rspamd_shingles_generate */
+	wlen = MIN ((gint)input->len, SHINGLES_WINDOW);
+	nwin = MAX ((gint)input->len - SHINGLES_WINDOW + 1, 1);
+	h = 0;
+	/* Weight of the first word in a window */
+	pw = 1;
+
+	/* Hash all words at once using parallel lanes */
+	wh = g_malloc (MAX (input->len, 1) * sizeof (*wh));
+	segs = g_malloc (MAX (input->len, 1) * sizeof (*segs));
+
+	for (i = 0; i < (gint)input->len; i ++) {
+		word = &g_array_index (input, rspamd_fstring_t, i);
+		segs[i].data = (guchar *)word->begin;
+		segs[i].len = word->len;
+	}
+
+	rspamd_cryptobox_siphash_multi (wh, segs, input->len, sipkey);
+	g_free (segs);
+
+	for (i = 0; i < wlen; i ++) {
+		h = h * SHINGLES_WINDOW_PRIME + wh[i];
+
+		if (i > 0) {
+			pw *= SHINGLES_WINDOW_PRIME;
+		}
+	}
+
+	for (i = 0; i < nwin; i ++) {
+		if (i > 0) {
+			/* Roll window: remove the first word and add the next one */
+			h -= wh[i - 1] * pw;
+			h = h * SHINGLES_WINDOW_PRIME + wh[i + SHINGLES_WINDOW - 1];
+		}
+
+		v = rspamd_shingles_mix (h);
+
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+			res->hashes[j] = MIN (res->hashes[j],
+					rspamd_shingles_mix (v * mul[j] + add[j]));
+		}
+	}
+
+	g_free (wh);
+
+	return res;
+}
 
 guint64
 rspamd_shingles_default_filter (guint64 *input, gsize count,
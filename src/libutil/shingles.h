@@ -57,6 +57,21 @@ struct rspamd_shingle* rspamd_shingles_generate (GArray *input,
 		rspamd_shingles_filter filter,
 		gpointer filterd);
 
+/**
+ * Generate shingles in the fast mode: each word is hashed once, hashes of
+ * words are combined to window hashes arithmetically and shingles are the
+ * minimal values of window hashes under a set of multiply-shift permutations.
+ * The distribution of shingles is the same as for `rspamd_shingles_generate`
+ * with the default filter, but their values are different.
+ * @param input array of `rspamd_fstring_t`
+ * @param key secret key used to generate shingles
+ * @param pool pool to allocate shigles array
+ * @return shingles array
+ */
+struct rspamd_shingle* rspamd_shingles_generate_fast (GArray *input,
+		const guchar key[16],
+		rspamd_mempool_t *pool);
+
 /**
  * Compares two shingles and return result as a floating point value - 1.0
  * for completely similar shingles and 0.0 for completely different ones
@@ -0,0 +1,574 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "shm_cache.h"
+#include "logger.h"
+#include "xxhash.h"
+
+/* Number of entries in a single set */
+#define SHM_CACHE_WAYS 4
+/* How many times writers try to lock a busy set */
+#define SHM_CACHE_LOCK_ATTEMPTS 64
+
+#define SHM_CACHE_FLAG_PENDING (1 << 0)
+
+#define SHM_CACHE_SNAPSHOT_MAGIC "rshmc001"
+
+/* Entry is followed by value of up to slot_size bytes */
+struct rspamd_shm_cache_entry {
+	guint64 key;                            /* 0 for an empty entry		*/
+	guint32 expire;
+	guint32 atime;
+	guint32 len;
+	guint32 flags;
+};
+
+/*
+ * Writers make sequence odd while they modify a set, readers never wait:
+ * if a set is being modified, lookup is treated as a miss
+ */
+struct rspamd_shm_cache_set {
+	guint32 seq;
+	guint32 unused;
+};
+
+/*
+ * Snapshot is a header followed by records of values that have not expired,
+ * each record is followed by its value padded to 8 bytes
+ */
+struct rspamd_shm_cache_snapshot_header {
+	gchar magic[8];
+	guint64 nrecords;
+};
+
+struct rspamd_shm_cache_snapshot_record {
+	guint64 key;
+	guint32 expire;
+	guint32 len;
+};
+
+struct rspamd_shm_cache {
+	guint64 nsets;                          /* power of 2					*/
+	gsize slot_size;
+	gsize entry_size;
+	gsize set_size;
+	gsize len;
+	guint32 clock;                          /* approximate LRU clock		*/
+	guint32 unused;
+	pid_t owner;                            /* process that saves snapshot	*/
+	gchar *snapshot;                        /* snapshot path or NULL		*/
+};
+
+/* Caches with snapshots set by the current process */
+static GList *snapshots = NULL;
+
+static inline struct rspamd_shm_cache_set *
+rspamd_shm_cache_get_set (struct rspamd_shm_cache *cache, guint64 key)
+{
+	return (struct rspamd_shm_cache_set *)((guchar *)(cache + 1) +
+			(key & (cache->nsets - 1)) * cache->set_size);
+}
+
+static inline struct rspamd_shm_cache_entry *
+rspamd_shm_cache_get_entry (struct rspamd_shm_cache *cache,
+		struct rspamd_shm_cache_set *set, guint i)
+{
+	return (struct rspamd_shm_cache_entry *)((guchar *)(set + 1) +
+			i * cache->entry_size);
+}
+
+static inline gboolean
+rspamd_shm_cache_expired (struct rspamd_shm_cache_entry *entry, time_t now)
+{
+	return (gint32)(entry->expire - (guint32)now) <= 0;
+}
+
+static guint64
+rspamd_shm_cache_key (const gchar *key)
+{
+	guint64 h;
+
+	h = XXH64 (key, strlen (key), 0);
+
+	return h != 0 ? h : 1;
+}
+
+static gboolean
+rspamd_shm_cache_lock_set (struct rspamd_shm_cache_set *set, guint32 *pseq)
+{
+	guint32 seq;
+	guint i;
+
+	for (i = 0; i < SHM_CACHE_LOCK_ATTEMPTS; i ++) {
+		seq = g_atomic_int_get (&set->seq);
+
+		if (!(seq & 1) &&
+				g_atomic_int_compare_and_exchange (&set->seq, seq, seq + 1)) {
+			*pseq = seq;
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static struct rspamd_shm_cache_entry *
+rspamd_shm_cache_victim (struct rspamd_shm_cache *cache,
+		struct rspamd_shm_cache_set *set, guint64 key, time_t now)
+{
+	struct rspamd_shm_cache_entry *entry, *victim = NULL;
+	guint i;
+
+	for (i = 0; i < SHM_CACHE_WAYS; i ++) {
+		entry = rspamd_shm_cache_get_entry (cache, set, i);
+
+		if (entry->key == key) {
+			return entry;
+		}
+
+		if (victim == NULL || entry->key == 0 ||
+				rspamd_shm_cache_expired (entry, now) ||
+				(victim->key != 0 && !rspamd_shm_cache_expired (victim, now) &&
+				(gint32)(entry->atime - victim->atime) < 0)) {
+			victim = entry;
+		}
+	}
+
+	return victim;
+}
+
+struct rspamd_shm_cache *
+rspamd_shm_cache_new (gsize nelts, gsize max_len)
+{
+	struct rspamd_shm_cache *cache;
+	guint64 nsets = 1;
+	gsize len, slot_size, entry_size, set_size;
+	gpointer map;
+
+	while (nsets * SHM_CACHE_WAYS < nelts) {
+		nsets <<= 1;
+	}
+
+	slot_size = (max_len + 7) & ~(gsize)7;
+	entry_size = sizeof (struct rspamd_shm_cache_entry) + slot_size;
+	set_size = sizeof (struct rspamd_shm_cache_set) + entry_size * SHM_CACHE_WAYS;
+	len = sizeof (*cache) + nsets * set_size;
+
+#if defined(HAVE_MMAP_ANON)
+	map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED,
+			-1, 0);
+#elif defined(HAVE_MMAP_ZERO)
+	gint fd;
+
+	fd = open ("/dev/zero", O_RDWR);
+
+	if (fd == -1) {
+		msg_err ("cannot open /dev/zero: %s", strerror (errno));
+		return NULL;
+	}
+
+	map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+#else
+#       error No mmap methods are defined
+#endif
+
+	if (map == MAP_FAILED) {
+		msg_err ("cannot allocate %z bytes for shared cache: %s", len,
+				strerror (errno));
+		return NULL;
+	}
+
+	/* Mapping is zero filled, so all entries are empty */
+	cache = map;
+	cache->nsets = nsets;
+	cache->slot_size = slot_size;
+	cache->entry_size = entry_size;
+	cache->set_size = set_size;
+	cache->len = len;
+
+	return cache;
+}
+
+enum rspamd_shm_cache_result
+rspamd_shm_cache_lookup (struct rspamd_shm_cache *cache,
+		const gchar *key,
+		time_t now,
+		guint pending_timeout,
+		GByteArray *out)
+{
+	struct rspamd_shm_cache_set *set;
+	struct rspamd_shm_cache_entry *entry, *found = NULL;
+	enum rspamd_shm_cache_result res = RSPAMD_SHM_CACHE_MISS;
+	guint64 h;
+	guint32 seq, len;
+	guint i;
+
+	h = rspamd_shm_cache_key (key);
+	set = rspamd_shm_cache_get_set (cache, h);
+	seq = g_atomic_int_get (&set->seq);
+
+	if (seq & 1) {
+		return RSPAMD_SHM_CACHE_MISS;
+	}
+
+	for (i = 0; i < SHM_CACHE_WAYS; i ++) {
+		entry = rspamd_shm_cache_get_entry (cache, set, i);
+
+		if (entry->key == h && !rspamd_shm_cache_expired (entry, now)) {
+			found = entry;
+			break;
+		}
+	}
+
+	if (found != NULL) {
+		if (found->flags & SHM_CACHE_FLAG_PENDING) {
+			res = RSPAMD_SHM_CACHE_PENDING;
+		}
+		else {
+			len = found->len;
+
+			if (len <= cache->slot_size) {
+				g_byte_array_set_size (out, len);
+				memcpy (out->data, found + 1, len);
+				found->atime = cache->clock;
+				res = RSPAMD_SHM_CACHE_HIT;
+			}
+		}
+
+		if (g_atomic_int_get (&set->seq) != seq) {
+			/* Set has been modified while we were reading it */
+			g_byte_array_set_size (out, 0);
+			res = RSPAMD_SHM_CACHE_MISS;
+		}
+
+		return res;
+	}
+
+	/* Mark key as pending unless another process has changed the set */
+	if (pending_timeout > 0 &&
+			g_atomic_int_compare_and_exchange (&set->seq, seq, seq + 1)) {
+		entry = rspamd_shm_cache_victim (cache, set, h, now);
+		entry->key = h;
+		entry->expire = now + pending_timeout;
+		entry->len = 0;
+		entry->flags = SHM_CACHE_FLAG_PENDING;
+		entry->atime = ++cache->clock;
+
+		g_atomic_int_set (&set->seq, seq + 2);
+	}
+
+	return RSPAMD_SHM_CACHE_MISS;
+}
+
+static gboolean
+rspamd_shm_cache_insert_hash (struct rspamd_shm_cache *cache,
+		guint64 h,
+		time_t now,
+		guint32 expire,
+		gconstpointer data,
+		gsize len)
+{
+	struct rspamd_shm_cache_set *set;
+	struct rspamd_shm_cache_entry *entry;
+	guint32 seq;
+
+	set = rspamd_shm_cache_get_set (cache, h);
+
+	if (!rspamd_shm_cache_lock_set (set, &seq)) {
+		return FALSE;
+	}
+
+	entry = rspamd_shm_cache_victim (cache, set, h, now);
+	entry->key = h;
+	entry->expire = expire;
+	entry->len = len;
+	entry->flags = 0;
+	entry->atime = ++cache->clock;
+	memcpy (entry + 1, data, len);
+
+	g_atomic_int_set (&set->seq, seq + 2);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_shm_cache_insert (struct rspamd_shm_cache *cache,
+		const gchar *key,
+		time_t now,
+		guint ttl,
+		gconstpointer data,
+		gsize len)
+{
+	guint64 h;
+
+	if (len > cache->slot_size || ttl == 0) {
+		/* Do not let other processes wait for this value */
+		rspamd_shm_cache_remove (cache, key);
+
+		return FALSE;
+	}
+
+	h = rspamd_shm_cache_key (key);
+
+	return rspamd_shm_cache_insert_hash (cache, h, now, now + ttl, data, len);
+}
+
+void
+rspamd_shm_cache_remove (struct rspamd_shm_cache *cache,
+		const gchar *key)
+{
+	struct rspamd_shm_cache_set *set;
+	struct rspamd_shm_cache_entry *entry;
+	guint64 h;
+	guint32 seq;
+	guint i;
+
+	h = rspamd_shm_cache_key (key);
+	set = rspamd_shm_cache_get_set (cache, h);
+
+	if (!rspamd_shm_cache_lock_set (set, &seq)) {
+		return;
+	}
+
+	for (i = 0; i < SHM_CACHE_WAYS; i ++) {
+		entry = rspamd_shm_cache_get_entry (cache, set, i);
+
+		if (entry->key == h) {
+			entry->key = 0;
+			entry->flags = 0;
+			break;
+		}
+	}
+
+	g_atomic_int_set (&set->seq, seq + 2);
+}
+
+gboolean
+rspamd_shm_cache_save (struct rspamd_shm_cache *cache, const gchar *path,
+		time_t now)
+{
+	struct rspamd_shm_cache_snapshot_header hdr;
+	struct rspamd_shm_cache_snapshot_record rec;
+	struct rspamd_shm_cache_set *set;
+	struct rspamd_shm_cache_entry *entry;
+	static const guchar pad[8];
+	gchar tmppath[PATH_MAX];
+	guint64 i;
+	guint j;
+	gsize plen;
+	FILE *f;
+	gint fd;
+
+	/* Write to a temporary file so that loaders never see a partial snapshot */
+	rspamd_snprintf (tmppath, sizeof (tmppath), "%s.tmp", path);
+
+	if ((fd = open (tmppath, O_WRONLY | O_CREAT | O_TRUNC, 00644)) == -1 ||
+			(f = fdopen (fd, "w")) == NULL) {
+		msg_err ("cannot open cache snapshot %s: %s", tmppath, strerror (errno));
+
+		if (fd != -1) {
+			close (fd);
+		}
+
+		return FALSE;
+	}
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, SHM_CACHE_SNAPSHOT_MAGIC, sizeof (hdr.magic));
+	/* Number of records is written when they are counted */
+	fwrite (&hdr, sizeof (hdr), 1, f);
+
+	for (i = 0; i < cache->nsets; i ++) {
+		set = (struct rspamd_shm_cache_set *)((guchar *)(cache + 1) +
+				i * cache->set_size);
+
+		if (g_atomic_int_get (&set->seq) & 1) {
+			/* Set is being modified, skip it */
+			continue;
+		}
+
+		for (j = 0; j < SHM_CACHE_WAYS; j ++) {
+			entry = rspamd_shm_cache_get_entry (cache, set, j);
+
+			if (entry->key == 0 || (entry->flags & SHM_CACHE_FLAG_PENDING) ||
+					rspamd_shm_cache_expired (entry, now) ||
+					entry->len > cache->slot_size) {
+				continue;
+			}
+
+			rec.key = entry->key;
+			rec.expire = entry->expire;
+			rec.len = entry->len;
+			plen = ((rec.len + 7) & ~(gsize)7) - rec.len;
+			fwrite (&rec, sizeof (rec), 1, f);
+			fwrite (entry + 1, rec.len, 1, f);
+			fwrite (pad, plen, 1, f);
+			hdr.nrecords ++;
+		}
+	}
+
+	if (fseek (f, 0, SEEK_SET) == -1 ||
+			fwrite (&hdr, sizeof (hdr), 1, f) != 1 ||
+			fclose (f) != 0) {
+		msg_err ("cannot write cache snapshot %s: %s", tmppath, strerror (errno));
+		unlink (tmppath);
+
+		return FALSE;
+	}
+
+	if (rename (tmppath, path) == -1) {
+		msg_err ("cannot rename cache snapshot %s: %s", tmppath,
+				strerror (errno));
+		unlink (tmppath);
+
+		return FALSE;
+	}
+
+	msg_info ("saved %uL cached values to %s", hdr.nrecords, path);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_shm_cache_load (struct rspamd_shm_cache *cache, const gchar *path,
+		time_t now)
+{
+	const struct rspamd_shm_cache_snapshot_header *hdr;
+	const struct rspamd_shm_cache_snapshot_record *rec;
+	const guchar *map, *p, *end;
+	guint64 i, loaded = 0;
+	struct stat st;
+	gint fd;
+
+	if ((fd = open (path, O_RDONLY)) == -1) {
+		if (errno != ENOENT) {
+			msg_err ("cannot open cache snapshot %s: %s", path,
+					strerror (errno));
+		}
+
+		return FALSE;
+	}
+
+	if (fstat (fd, &st) == -1 || (gsize)st.st_size < sizeof (*hdr)) {
+		close (fd);
+
+		return FALSE;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		msg_err ("cannot mmap cache snapshot %s: %s", path, strerror (errno));
+
+		return FALSE;
+	}
+
+	hdr = (const struct rspamd_shm_cache_snapshot_header *)map;
+
+	if (memcmp (hdr->magic, SHM_CACHE_SNAPSHOT_MAGIC, sizeof (hdr->magic)) != 0) {
+		msg_err ("cannot load cache snapshot %s: bad magic", path);
+		munmap ((gpointer)map, st.st_size);
+
+		return FALSE;
+	}
+
+	p = map + sizeof (*hdr);
+	end = map + st.st_size;
+
+	for (i = 0; i < hdr->nrecords; i ++) {
+		if ((gsize)(end - p) < sizeof (*rec)) {
+			break;
+		}
+
+		rec = (const struct rspamd_shm_cache_snapshot_record *)p;
+		p += sizeof (*rec);
+
+		if ((gsize)(end - p) < rec->len) {
+			break;
+		}
+
+		/* Values keep their absolute expire time, so remaining TTL is honored */
+		if (rec->key != 0 && rec->len <= cache->slot_size &&
+				(gint32)(rec->expire - (guint32)now) > 0) {
+			if (rspamd_shm_cache_insert_hash (cache, rec->key, now,
+					rec->expire, p, rec->len)) {
+				loaded ++;
+			}
+		}
+
+		p += MIN ((gsize)(end - p), (rec->len + 7) & ~(gsize)7);
+	}
+
+	munmap ((gpointer)map, st.st_size);
+	msg_info ("loaded %uL cached values from %s", loaded, path);
+
+	return TRUE;
+}
+
+void
+rspamd_shm_cache_set_snapshot (struct rspamd_shm_cache *cache,
+		const gchar *path, time_t now)
+{
+	if (cache->snapshot == NULL) {
+		snapshots = g_list_prepend (snapshots, cache);
+	}
+
+	g_free (cache->snapshot);
+	cache->snapshot = g_strdup (path);
+	cache->owner = getpid ();
+	rspamd_shm_cache_load (cache, path, now);
+}
+
+void
+rspamd_shm_cache_save_snapshots (void)
+{
+	struct rspamd_shm_cache *cache;
+	GList *cur;
+	time_t now = time (NULL);
+
+	for (cur = snapshots; cur != NULL; cur = g_list_next (cur)) {
+		cache = cur->data;
+
+		if (cache->owner == getpid ()) {
+			rspamd_shm_cache_save (cache, cache->snapshot, now);
+		}
+	}
+}
+
+void
+rspamd_shm_cache_destroy (struct rspamd_shm_cache *cache)
+{
+	if (cache != NULL) {
+		if (cache->snapshot != NULL && cache->owner == getpid ()) {
+			rspamd_shm_cache_save (cache, cache->snapshot, time (NULL));
+			snapshots = g_list_remove (snapshots, cache);
+			g_free (cache->snapshot);
+		}
+
+		munmap (cache, cache->len);
+	}
+}
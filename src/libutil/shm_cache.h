@@ -0,0 +1,139 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef SHM_CACHE_H_
+#define SHM_CACHE_H_
+
+#include "config.h"
+
+/*
+ * Cache of small opaque values shared by all processes of a host: the table
+ * is set associative and lives in anonymous shared memory allocated before
+ * workers are forked. Each value has its own expire time. A process that
+ * misses the cache places a pending marker for the key, so other processes
+ * can wait for its result instead of computing the same value.
+ */
+struct rspamd_shm_cache;
+
+enum rspamd_shm_cache_result {
+	RSPAMD_SHM_CACHE_MISS = 0,  /* value should be computed by caller		*/
+	RSPAMD_SHM_CACHE_HIT,       /* value has been copied					*/
+	RSPAMD_SHM_CACHE_PENDING    /* value is being computed by other process	*/
+};
+
+/**
+ * Create new shared cache
+ * @param nelts maximum number of cached values
+ * @param max_len maximum length of a value
+ * @return new cache or NULL
+ */
+struct rspamd_shm_cache * rspamd_shm_cache_new (gsize nelts, gsize max_len);
+
+/**
+ * Find value in the cache
+ * @param cache cache
+ * @param key string key
+ * @param now current time
+ * @param pending_timeout if not 0, then a missing key is marked as pending for this number of seconds
+ * @param out value is copied here
+ * @return result of lookup
+ */
+enum rspamd_shm_cache_result rspamd_shm_cache_lookup (
+		struct rspamd_shm_cache *cache,
+		const gchar *key,
+		time_t now,
+		guint pending_timeout,
+		GByteArray *out);
+
+/**
+ * Insert value to the cache replacing pending marker or the least recently
+ * used value
+ * @param cache cache
+ * @param key string key
+ * @param now current time
+ * @param ttl time to live in seconds
+ * @param data value
+ * @param len length of value
+ * @return TRUE if value has been inserted
+ */
+gboolean rspamd_shm_cache_insert (struct rspamd_shm_cache *cache,
+		const gchar *key,
+		time_t now,
+		guint ttl,
+		gconstpointer data,
+		gsize len);
+
+/**
+ * Remove value or pending marker from the cache
+ * @param cache cache
+ * @param key string key
+ */
+void rspamd_shm_cache_remove (struct rspamd_shm_cache *cache,
+		const gchar *key);
+
+/**
+ * Save values of the cache that have not expired to a file
+ * @param cache cache
+ * @param path path of snapshot
+ * @param now current time
+ * @return TRUE if snapshot has been saved
+ */
+gboolean rspamd_shm_cache_save (struct rspamd_shm_cache *cache,
+		const gchar *path,
+		time_t now);
+
+/**
+ * Load values saved by `rspamd_shm_cache_save`, values keep their expire
+ * time, so expired ones are skipped
+ * @param cache cache
+ * @param path path of snapshot
+ * @param now current time
+ * @return TRUE if snapshot has been loaded
+ */
+gboolean rspamd_shm_cache_load (struct rspamd_shm_cache *cache,
+		const gchar *path,
+		time_t now);
+
+/**
+ * Load snapshot of the cache and save it back when the cache is destroyed by
+ * the same process
+ * @param cache cache
+ * @param path path of snapshot
+ * @param now current time
+ */
+void rspamd_shm_cache_set_snapshot (struct rspamd_shm_cache *cache,
+		const gchar *path,
+		time_t now);
+
+/**
+ * Save snapshots of all caches which snapshots have been set by the current
+ * process
+ */
+void rspamd_shm_cache_save_snapshots (void);
+
+/**
+ * Unmap cache, its snapshot is saved if it has been set by the current process
+ * @param cache cache
+ */
+void rspamd_shm_cache_destroy (struct rspamd_shm_cache *cache);
+
+#endif /* SHM_CACHE_H_ */
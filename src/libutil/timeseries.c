@@ -0,0 +1,434 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "timeseries.h"
+#include "logger.h"
+#include "util.h"
+
+#define RSPAMD_TS_MAGIC "rsts"
+#define RSPAMD_TS_VERSION 1
+/* Slots of a single ring of both resolutions */
+#define RSPAMD_TS_RING_SLOTS (RSPAMD_TS_SECOND_SLOTS + RSPAMD_TS_MINUTE_SLOTS)
+
+struct rspamd_ts_head {
+	gchar magic[4];
+	guint32 version;
+	guint32 max_rings;
+	guint32 nrings;
+	guint32 nseries;
+	guint32 ring_slots;
+};
+
+struct rspamd_ts_desc {
+	gchar name[RSPAMD_TS_NAME_LEN];
+	guint32 type;
+	guint32 ring;
+};
+
+struct rspamd_ts_store {
+	struct rspamd_ts_head *head;
+	struct rspamd_ts_desc *descs;
+	guint64 *rings;
+	gsize len;
+};
+
+static GQuark
+rspamd_ts_error_quark (void)
+{
+	return g_quark_from_static_string ("timeseries-error");
+}
+
+static gsize
+rspamd_ts_store_len (guint max_rings)
+{
+	return sizeof (struct rspamd_ts_head) +
+			sizeof (struct rspamd_ts_desc) * max_rings +
+			sizeof (guint64) * RSPAMD_TS_RING_SLOTS * max_rings;
+}
+
+struct rspamd_ts_store *
+rspamd_ts_store_new (const gchar *path, guint max_rings, GError **err)
+{
+	struct rspamd_ts_store *store;
+	struct rspamd_ts_head *head;
+	struct stat st;
+	gpointer map;
+	gsize len;
+	gint fd = -1;
+
+	g_assert (max_rings > 0);
+	len = rspamd_ts_store_len (max_rings);
+
+	if (path != NULL) {
+		if ((fd = open (path, O_RDWR | O_CREAT, 00644)) == -1) {
+			g_set_error (err, rspamd_ts_error_quark (), errno,
+					"cannot open %s: %s", path, strerror (errno));
+			return NULL;
+		}
+
+		if (fstat (fd, &st) == -1 || ((gsize)st.st_size != len &&
+				ftruncate (fd, 0) == -1) || ftruncate (fd, len) == -1) {
+			g_set_error (err, rspamd_ts_error_quark (), errno,
+					"cannot resize %s: %s", path, strerror (errno));
+			close (fd);
+			return NULL;
+		}
+
+		map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close (fd);
+	}
+	else {
+#if defined(HAVE_MMAP_ANON)
+		map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED,
+				-1, 0);
+#elif defined(HAVE_MMAP_ZERO)
+		fd = open ("/dev/zero", O_RDWR);
+
+		if (fd == -1) {
+			g_set_error (err, rspamd_ts_error_quark (), errno,
+					"cannot open /dev/zero: %s", strerror (errno));
+			return NULL;
+		}
+
+		map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close (fd);
+#else
+#       error No mmap methods are defined
+#endif
+	}
+
+	if (map == MAP_FAILED) {
+		g_set_error (err, rspamd_ts_error_quark (), errno,
+				"cannot map %z bytes: %s", len, strerror (errno));
+		return NULL;
+	}
+
+	head = map;
+
+	if (memcmp (head->magic, RSPAMD_TS_MAGIC, sizeof (head->magic)) != 0 ||
+			head->version != RSPAMD_TS_VERSION ||
+			head->max_rings != max_rings ||
+			head->ring_slots != RSPAMD_TS_RING_SLOTS) {
+		/* New or incompatible store */
+		memset (map, 0, len);
+		memcpy (head->magic, RSPAMD_TS_MAGIC, sizeof (head->magic));
+		head->version = RSPAMD_TS_VERSION;
+		head->max_rings = max_rings;
+		head->ring_slots = RSPAMD_TS_RING_SLOTS;
+	}
+
+	store = g_slice_alloc (sizeof (*store));
+	store->head = head;
+	store->descs = (struct rspamd_ts_desc *)(head + 1);
+	store->rings = (guint64 *)(store->descs + max_rings);
+	store->len = len;
+
+	return store;
+}
+
+gint
+rspamd_ts_store_find (struct rspamd_ts_store *store, const gchar *name)
+{
+	guint i;
+
+	for (i = 0; i < store->head->nseries; i ++) {
+		if (strncmp (store->descs[i].name, name, RSPAMD_TS_NAME_LEN) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+gint
+rspamd_ts_store_register (struct rspamd_ts_store *store,
+		const gchar *name,
+		enum rspamd_ts_type type)
+{
+	struct rspamd_ts_desc *desc;
+	guint nrings;
+	gint id;
+
+	id = rspamd_ts_store_find (store, name);
+
+	if (id != -1) {
+		if (store->descs[id].type != (guint32)type) {
+			msg_err ("series %s is already registered with another type", name);
+			return -1;
+		}
+
+		return id;
+	}
+
+	nrings = type == RSPAMD_TS_LATENCY ? RSPAMD_TS_LATENCY_BUCKETS : 1;
+
+	if (store->head->nrings + nrings > store->head->max_rings ||
+			store->head->nseries >= store->head->max_rings) {
+		msg_warn ("cannot register series %s: store is full", name);
+		return -1;
+	}
+
+	id = store->head->nseries;
+	desc = &store->descs[id];
+	rspamd_strlcpy (desc->name, name, sizeof (desc->name));
+	desc->type = type;
+	desc->ring = store->head->nrings;
+	store->head->nrings += nrings;
+	/* Series are visible for readers after they are initialized */
+	g_atomic_int_inc (&store->head->nseries);
+
+	return id;
+}
+
+guint
+rspamd_ts_store_count (struct rspamd_ts_store *store)
+{
+	return g_atomic_int_get (&store->head->nseries);
+}
+
+const gchar *
+rspamd_ts_store_name (struct rspamd_ts_store *store,
+		gint id,
+		enum rspamd_ts_type *type)
+{
+	if (id < 0 || (guint)id >= rspamd_ts_store_count (store)) {
+		return NULL;
+	}
+
+	if (type) {
+		*type = store->descs[id].type;
+	}
+
+	return store->descs[id].name;
+}
+
+guint
+rspamd_ts_store_slots (enum rspamd_ts_resolution res)
+{
+	return res == RSPAMD_TS_MINUTE ? RSPAMD_TS_MINUTE_SLOTS :
+			RSPAMD_TS_SECOND_SLOTS;
+}
+
+guint
+rspamd_ts_store_step (enum rspamd_ts_resolution res)
+{
+	return res == RSPAMD_TS_MINUTE ? 60 : 1;
+}
+
+static inline guint64 *
+rspamd_ts_store_ring (struct rspamd_ts_store *store, guint ring,
+		enum rspamd_ts_resolution res)
+{
+	guint64 *slots = store->rings + (gsize)ring * RSPAMD_TS_RING_SLOTS;
+
+	return res == RSPAMD_TS_MINUTE ? slots + RSPAMD_TS_SECOND_SLOTS : slots;
+}
+
+static inline void
+rspamd_ts_slot_add (guint64 *slots, guint nslots, guint32 stamp, guint32 value)
+{
+	guint64 *slot = &slots[stamp % nslots], old, nval;
+	guint32 cur;
+
+	do {
+		old = *(volatile guint64 *)slot;
+
+		if ((guint32)(old >> 32) == stamp) {
+			cur = old & G_MAXUINT32;
+			/* Saturate to avoid overflow to the time stamp */
+			cur = cur > G_MAXUINT32 - value ? G_MAXUINT32 : cur + value;
+		}
+		else {
+			/* Slot is from the previous turn of ring */
+			cur = value;
+		}
+
+		nval = ((guint64)stamp << 32) | cur;
+	} while (!__sync_bool_compare_and_swap (slot, old, nval));
+}
+
+static inline guint32
+rspamd_ts_slot_get (guint64 *slots, guint nslots, guint32 stamp)
+{
+	guint64 val = *(volatile guint64 *)&slots[stamp % nslots];
+
+	return (guint32)(val >> 32) == stamp ? (val & G_MAXUINT32) : 0;
+}
+
+static void
+rspamd_ts_ring_add (struct rspamd_ts_store *store, guint ring, guint32 value)
+{
+	time_t now = time (NULL);
+
+	rspamd_ts_slot_add (rspamd_ts_store_ring (store, ring, RSPAMD_TS_SECOND),
+			RSPAMD_TS_SECOND_SLOTS, now, value);
+	rspamd_ts_slot_add (rspamd_ts_store_ring (store, ring, RSPAMD_TS_MINUTE),
+			RSPAMD_TS_MINUTE_SLOTS, now / 60, value);
+}
+
+void
+rspamd_ts_store_add (struct rspamd_ts_store *store, gint id, guint32 value)
+{
+	if (store == NULL || id < 0 || (guint)id >= store->head->nseries) {
+		return;
+	}
+
+	rspamd_ts_ring_add (store, store->descs[id].ring, value);
+}
+
+void
+rspamd_ts_store_add_latency (struct rspamd_ts_store *store,
+		gint id,
+		gdouble latency)
+{
+	struct rspamd_ts_desc *desc;
+	gdouble ms = latency * 1000.0;
+	guint bucket = 0;
+
+	if (store == NULL || id < 0 || (guint)id >= store->head->nseries) {
+		return;
+	}
+
+	desc = &store->descs[id];
+
+	if (desc->type != RSPAMD_TS_LATENCY) {
+		return;
+	}
+
+	while (ms >= 1.0 && bucket < RSPAMD_TS_LATENCY_BUCKETS - 1) {
+		ms /= 2.0;
+		bucket ++;
+	}
+
+	rspamd_ts_ring_add (store, desc->ring + bucket, 1);
+}
+
+static guint32
+rspamd_ts_read_slot (struct rspamd_ts_store *store,
+		struct rspamd_ts_desc *desc,
+		enum rspamd_ts_resolution res,
+		guint32 stamp,
+		guint32 *buckets)
+{
+	guint i, nrings;
+	guint32 val, total = 0;
+
+	nrings = desc->type == RSPAMD_TS_LATENCY ? RSPAMD_TS_LATENCY_BUCKETS : 1;
+
+	for (i = 0; i < nrings; i ++) {
+		val = rspamd_ts_slot_get (rspamd_ts_store_ring (store,
+				desc->ring + i, res), rspamd_ts_store_slots (res), stamp);
+
+		if (buckets) {
+			buckets[i] = val;
+		}
+
+		total += val;
+	}
+
+	return total;
+}
+
+gboolean
+rspamd_ts_store_read (struct rspamd_ts_store *store,
+		gint id,
+		enum rspamd_ts_resolution res,
+		time_t now,
+		guint count,
+		guint32 *out)
+{
+	guint32 stamp;
+	guint i;
+
+	if (id < 0 || (guint)id >= rspamd_ts_store_count (store) ||
+			count > rspamd_ts_store_slots (res)) {
+		return FALSE;
+	}
+
+	stamp = now / rspamd_ts_store_step (res) - count + 1;
+
+	for (i = 0; i < count; i ++, stamp ++) {
+		out[i] = rspamd_ts_read_slot (store, &store->descs[id], res, stamp,
+				NULL);
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_ts_store_read_percentile (struct rspamd_ts_store *store,
+		gint id,
+		enum rspamd_ts_resolution res,
+		time_t now,
+		guint count,
+		gdouble pct,
+		gdouble *out)
+{
+	guint32 buckets[RSPAMD_TS_LATENCY_BUCKETS], total, stamp;
+	guint64 cum, need;
+	guint i, j;
+
+	if (id < 0 || (guint)id >= rspamd_ts_store_count (store) ||
+			count > rspamd_ts_store_slots (res) ||
+			store->descs[id].type != RSPAMD_TS_LATENCY) {
+		return FALSE;
+	}
+
+	stamp = now / rspamd_ts_store_step (res) - count + 1;
+
+	for (i = 0; i < count; i ++, stamp ++) {
+		total = rspamd_ts_read_slot (store, &store->descs[id], res, stamp,
+				buckets);
+		out[i] = 0;
+
+		if (total == 0) {
+			continue;
+		}
+
+		need = (guint64)(total * pct / 100.0);
+		need = MAX (need, 1);
+		cum = 0;
+
+		for (j = 0; j < RSPAMD_TS_LATENCY_BUCKETS; j ++) {
+			cum += buckets[j];
+
+			if (cum >= need) {
+				/* Upper bound of bucket */
+				out[i] = (1ULL << j) / 1000.0;
+				break;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+void
+rspamd_ts_store_destroy (struct rspamd_ts_store *store)
+{
+	if (store) {
+		munmap (store->head, store->len);
+		g_slice_free1 (sizeof (*store), store);
+	}
+}
@@ -0,0 +1,175 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TIMESERIES_H_
+#define TIMESERIES_H_
+
+#include "config.h"
+
+/*
+ * Store of time series shared by all processes: it is a fixed size mapping
+ * (anonymous or file backed) allocated by the main process before workers are
+ * forked. Each series has a ring of per-second and a ring of per-minute slots,
+ * a slot holds a 32 bit time stamp together with a 32 bit value, so writers
+ * update slots by a single compare and swap without locks. Latency series
+ * consist of counters of logarithmic buckets, percentiles are calculated
+ * when series are read.
+ */
+struct rspamd_ts_store;
+
+enum rspamd_ts_type {
+	RSPAMD_TS_COUNTER = 0,
+	RSPAMD_TS_LATENCY
+};
+
+enum rspamd_ts_resolution {
+	RSPAMD_TS_SECOND = 0,
+	RSPAMD_TS_MINUTE,
+	RSPAMD_TS_RESOLUTION_MAX
+};
+
+/* Length of ring of per-second slots (30 minutes) */
+#define RSPAMD_TS_SECOND_SLOTS 1800
+/* Length of ring of per-minute slots (one day) */
+#define RSPAMD_TS_MINUTE_SLOTS 1440
+/* Latency buckets: bucket i counts values less than 2^i milliseconds */
+#define RSPAMD_TS_LATENCY_BUCKETS 16
+#define RSPAMD_TS_NAME_LEN 64
+
+/**
+ * Create new store or open an existing one
+ * @param path file to keep series between restarts, if NULL then series are
+ * stored in anonymous memory
+ * @param max_rings capacity of store: counter takes one ring and latency
+ * series take RSPAMD_TS_LATENCY_BUCKETS rings
+ * @param err error pointer
+ * @return new store or NULL
+ */
+struct rspamd_ts_store * rspamd_ts_store_new (const gchar *path,
+		guint max_rings,
+		GError **err);
+
+/**
+ * Register new series or find the existing one, this function must be
+ * called by the main process only
+ * @param store store
+ * @param name name of series
+ * @param type type of series
+ * @return id of series or -1 if there is no space in store
+ */
+gint rspamd_ts_store_register (struct rspamd_ts_store *store,
+		const gchar *name,
+		enum rspamd_ts_type type);
+
+/**
+ * Find series by name
+ * @return id of series or -1
+ */
+gint rspamd_ts_store_find (struct rspamd_ts_store *store, const gchar *name);
+
+/**
+ * Get number of registered series
+ */
+guint rspamd_ts_store_count (struct rspamd_ts_store *store);
+
+/**
+ * Get name and type of series
+ * @return name of series or NULL if id is invalid
+ */
+const gchar * rspamd_ts_store_name (struct rspamd_ts_store *store,
+		gint id,
+		enum rspamd_ts_type *type);
+
+/**
+ * Add value to the current slots of a counter series
+ * @param store store
+ * @param id id of series, negative ids are ignored
+ * @param value value to add
+ */
+void rspamd_ts_store_add (struct rspamd_ts_store *store,
+		gint id,
+		guint32 value);
+
+/**
+ * Add sample to a latency series
+ * @param store store
+ * @param id id of series, negative ids are ignored
+ * @param latency latency in seconds
+ */
+void rspamd_ts_store_add_latency (struct rspamd_ts_store *store,
+		gint id,
+		gdouble latency);
+
+/**
+ * Read the last values of a counter series, latency series are read as the
+ * number of samples
+ * @param store store
+ * @param id id of series
+ * @param res resolution
+ * @param now current time, it is the time of the last value
+ * @param count number of values, at most the length of ring
+ * @param out array of `count` values, slots without data are zero
+ * @return TRUE if series exists
+ */
+gboolean rspamd_ts_store_read (struct rspamd_ts_store *store,
+		gint id,
+		enum rspamd_ts_resolution res,
+		time_t now,
+		guint count,
+		guint32 *out);
+
+/**
+ * Read the last percentiles of a latency series
+ * @param store store
+ * @param id id of series
+ * @param res resolution
+ * @param now current time, it is the time of the last value
+ * @param count number of values, at most the length of ring
+ * @param pct percentile (0 - 100)
+ * @param out array of `count` latencies in seconds, slots without data are zero
+ * @return TRUE if latency series exists
+ */
+gboolean rspamd_ts_store_read_percentile (struct rspamd_ts_store *store,
+		gint id,
+		enum rspamd_ts_resolution res,
+		time_t now,
+		guint count,
+		gdouble pct,
+		gdouble *out);
+
+/**
+ * Get length of ring for the specified resolution
+ */
+guint rspamd_ts_store_slots (enum rspamd_ts_resolution res);
+
+/**
+ * Get duration of a slot in seconds
+ */
+guint rspamd_ts_store_step (enum rspamd_ts_resolution res);
+
+/**
+ * Unmap store
+ * @param store store
+ */
+void rspamd_ts_store_destroy (struct rspamd_ts_store *store);
+
+#endif /* TIMESERIES_H_ */
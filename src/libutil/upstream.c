@@ -55,6 +55,11 @@ struct upstream {
 	struct upstream_inet_addr_entry *new_addrs;
 	rspamd_mutex_t *lock;
 
+	gdouble latency;
+	gdouble latency_dev;
+	guint latency_samples;
+	guint inflight;
+
 	ref_entry_t ref;
 };
 
@@ -75,6 +80,17 @@ static gdouble default_revive_jitter = 0.4;
 static gdouble default_error_time = 10;
 static gdouble default_dns_timeout = 1.0;
 static guint default_dns_retransmits = 2;
+/* Latency is considered as too high if it is 5 times greater than the best one */
+static gdouble default_slow_factor = 5.0;
+
+/* Weight of a new sample in the average latency */
+#define UPSTREAM_LATENCY_ALPHA 0.2
+/* Number of samples required to compare latencies */
+#define UPSTREAM_LATENCY_MIN_SAMPLES 8
+/* Upstreams faster than that are never treated as slow */
+#define UPSTREAM_LATENCY_MIN_SLOW 0.01
+/* Added to latency to compare unprobed upstreams by their load */
+#define UPSTREAM_LATENCY_BASE 0.001
 
 void
 rspamd_upstreams_library_config (struct rspamd_config *cfg)
@@ -88,6 +104,9 @@ rspamd_upstreams_library_config (struct rspamd_config *cfg)
 	if (cfg->upstream_revive_time) {
 		default_revive_time = cfg->upstream_max_errors;
 	}
+	if (cfg->upstream_slow_factor) {
+		default_slow_factor = cfg->upstream_slow_factor;
+	}
 	if (cfg->dns_retransmits) {
 		default_dns_retransmits = cfg->dns_retransmits;
 	}
@@ -233,6 +252,10 @@ rspamd_upstream_revive_cb (int fd, short what, void *arg)
 
 	rspamd_mutex_lock (up->lock);
 	event_del (&up->ev);
+	/* Latency is measured again after revive */
+	up->latency = 0;
+	up->latency_dev = 0;
+	up->latency_samples = 0;
 	if (up->ls) {
 		rspamd_upstream_set_active (up->ls, up);
 
@@ -333,6 +356,101 @@ rspamd_upstream_ok (struct upstream *up)
 	rspamd_mutex_unlock (up->lock);
 }
 
+/*
+ * Returns the best average latency of alive upstreams except `up`
+ */
+static gdouble
+rspamd_upstream_best_latency (struct upstream_list *ls, struct upstream *up)
+{
+	struct upstream *cur;
+	gdouble best = G_MAXDOUBLE;
+	guint i;
+
+	rspamd_mutex_lock (ls->lock);
+
+	for (i = 0; i < ls->alive->len; i ++) {
+		cur = g_ptr_array_index (ls->alive, i);
+
+		if (cur != up && cur->latency_samples >= UPSTREAM_LATENCY_MIN_SAMPLES &&
+				cur->latency < best) {
+			best = cur->latency;
+		}
+	}
+
+	rspamd_mutex_unlock (ls->lock);
+
+	return best;
+}
+
+void
+rspamd_upstream_latency (struct upstream *up, gdouble latency)
+{
+	gdouble best;
+
+	rspamd_mutex_lock (up->lock);
+
+	if (up->latency_samples == 0) {
+		up->latency = latency;
+		up->latency_dev = latency / 2.0;
+	}
+	else {
+		up->latency_dev += UPSTREAM_LATENCY_ALPHA *
+				(fabs (latency - up->latency) - up->latency_dev);
+		up->latency += UPSTREAM_LATENCY_ALPHA * (latency - up->latency);
+	}
+
+	up->latency_samples ++;
+
+	if (default_slow_factor > 0 && up->ls && up->active_idx != -1 &&
+			up->latency_samples >= UPSTREAM_LATENCY_MIN_SAMPLES &&
+			up->latency > UPSTREAM_LATENCY_MIN_SLOW) {
+		best = rspamd_upstream_best_latency (up->ls, up);
+
+		if (best < G_MAXDOUBLE && up->latency > best * default_slow_factor) {
+			/* Alive but too slow upstream */
+			up->errors = 0;
+			rspamd_upstream_set_inactive (up->ls, up);
+		}
+	}
+
+	rspamd_mutex_unlock (up->lock);
+}
+
+gdouble
+rspamd_upstream_latency_percentile (struct upstream *up)
+{
+	gdouble ret = 0;
+
+	rspamd_mutex_lock (up->lock);
+
+	if (up->latency_samples >= UPSTREAM_LATENCY_MIN_SAMPLES) {
+		/* Mean deviation is about 0.8 sigma for normal distribution */
+		ret = up->latency + 2.0 * up->latency_dev;
+	}
+
+	rspamd_mutex_unlock (up->lock);
+
+	return ret;
+}
+
+void
+rspamd_upstream_request_start (struct upstream *up)
+{
+	rspamd_mutex_lock (up->lock);
+	up->inflight ++;
+	rspamd_mutex_unlock (up->lock);
+}
+
+void
+rspamd_upstream_request_end (struct upstream *up)
+{
+	rspamd_mutex_lock (up->lock);
+	if (up->inflight > 0) {
+		up->inflight --;
+	}
+	rspamd_mutex_unlock (up->lock);
+}
+
 #define SEED_CONSTANT 0xa574de7df64e9b9dULL
 
 struct upstream_list*
@@ -562,6 +680,49 @@ rspamd_upstream_get_random (struct upstream_list *ups)
 	return g_ptr_array_index (ups->alive, idx);
 }
 
+static inline gdouble
+rspamd_upstream_load_score (struct upstream *up)
+{
+	/* Unprobed upstreams have zero latency, so they are selected soon */
+	return (up->latency + UPSTREAM_LATENCY_BASE) * (up->inflight + 1);
+}
+
+/*
+ * Select the less loaded of two random upstreams (power of two choices)
+ */
+static struct upstream*
+rspamd_upstream_get_latency (struct upstream_list *ups)
+{
+	struct upstream *first, *second;
+	guint i, j;
+
+	rspamd_mutex_lock (ups->lock);
+
+	if (ups->alive->len == 1) {
+		first = g_ptr_array_index (ups->alive, 0);
+		rspamd_mutex_unlock (ups->lock);
+
+		return first;
+	}
+
+	i = ottery_rand_range (ups->alive->len - 1);
+	j = ottery_rand_range (ups->alive->len - 2);
+
+	if (j >= i) {
+		j ++;
+	}
+
+	first = g_ptr_array_index (ups->alive, i);
+	second = g_ptr_array_index (ups->alive, j);
+	rspamd_mutex_unlock (ups->lock);
+
+	if (rspamd_upstream_load_score (second) < rspamd_upstream_load_score (first)) {
+		return second;
+	}
+
+	return first;
+}
+
 static struct upstream*
 rspamd_upstream_get_round_robin (struct upstream_list *ups, gboolean use_cur)
 {
@@ -665,6 +826,8 @@ rspamd_upstream_get (struct upstream_list *ups,
 		return rspamd_upstream_get_round_robin (ups, TRUE);
 	case RSPAMD_UPSTREAM_MASTER_SLAVE:
 		return rspamd_upstream_get_round_robin (ups, FALSE);
+	case RSPAMD_UPSTREAM_LATENCY:
+		return rspamd_upstream_get_latency (ups);
 	case RSPAMD_UPSTREAM_SEQUENTIAL:
 		if (ups->cur_elt >= ups->alive->len) {
 			ups->cur_elt = 0;
@@ -11,7 +11,8 @@ enum rspamd_upstream_rotation {
 	RSPAMD_UPSTREAM_HASHED,
 	RSPAMD_UPSTREAM_ROUND_ROBIN,
 	RSPAMD_UPSTREAM_MASTER_SLAVE,
-	RSPAMD_UPSTREAM_SEQUENTIAL
+	RSPAMD_UPSTREAM_SEQUENTIAL,
+	RSPAMD_UPSTREAM_LATENCY
 };
 
 
@@ -51,6 +52,43 @@ void rspamd_upstream_fail (struct upstream *up);
  */
 void rspamd_upstream_ok (struct upstream *up);
 
+/**
+ * Latency logic
+ * 1. Callers report round trip time of successful requests, it is averaged
+ * with the exponentially weighted moving average
+ * 2. `RSPAMD_UPSTREAM_LATENCY` rotation selects two random alive upstreams
+ * and uses the one with the lower average latency multiplied by the number of
+ * requests in flight
+ * 3. If the average latency of an upstream is more than `slow_factor` times
+ * greater than the best latency of other alive upstreams, then it is marked as
+ * unavailable for dead time as if it has failed
+ */
+
+/**
+ * Report round trip time of a successful request
+ * @param up upstream
+ * @param latency time in seconds
+ */
+void rspamd_upstream_latency (struct upstream *up, gdouble latency);
+
+/**
+ * Get an estimation of the 95th percentile of upstream's latency derived from
+ * the average latency and its mean deviation
+ * @param up upstream
+ * @return latency in seconds or 0 if there are not enough samples
+ */
+gdouble rspamd_upstream_latency_percentile (struct upstream *up);
+
+/**
+ * Count a request sent to an upstream as in flight
+ */
+void rspamd_upstream_request_start (struct upstream *up);
+
+/**
+ * Mark a request started by `rspamd_upstream_request_start` as finished
+ */
+void rspamd_upstream_request_end (struct upstream *up);
+
 /**
  * Create new list of upstreams
  * @return
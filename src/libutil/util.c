@@ -619,6 +619,8 @@ rspamd_signals_init (struct sigaction *signals, void (*sig_handler)(gint))
 	sigaddset (&signals->sa_mask, SIGUSR1);
 	sigaddset (&signals->sa_mask, SIGUSR2);
 	sigaddset (&signals->sa_mask, SIGALRM);
+	/* Spare workers are activated by this signal, see RSPAMD_SPARE_SIGNAL */
+	sigaddset (&signals->sa_mask, SIGWINCH);
 
 
 #ifdef HAVE_SA_SIGINFO
@@ -636,6 +638,7 @@ rspamd_signals_init (struct sigaction *signals, void (*sig_handler)(gint))
 	sigaction (SIGUSR1, signals, NULL);
 	sigaction (SIGUSR2, signals, NULL);
 	sigaction (SIGALRM, signals, NULL);
+	sigaction (SIGWINCH, signals, NULL);
 
 	/* Ignore SIGPIPE as we handle write errors manually */
 	sigemptyset (&sigpipe_act.sa_mask);
@@ -768,6 +771,52 @@ rspamd_str_lc_utf8 (gchar *str, guint size)
 	}
 }
 
+#define UNICHAR_SCRIPT_BLOCK_BITS 8
+#define UNICHAR_SCRIPT_BLOCK_SIZE (1 << UNICHAR_SCRIPT_BLOCK_BITS)
+#define UNICHAR_SCRIPT_MAX 0x110000
+
+static guint8 *unichar_scripts[UNICHAR_SCRIPT_MAX >> UNICHAR_SCRIPT_BLOCK_BITS];
+
+GUnicodeScript
+rspamd_unichar_get_script (gunichar c)
+{
+	guint8 *blk, *nblk;
+	gunichar base;
+	guint i;
+
+	if (c < 0x80) {
+		return g_ascii_isalpha (c) ? G_UNICODE_SCRIPT_LATIN :
+				G_UNICODE_SCRIPT_COMMON;
+	}
+	else if (c >= UNICHAR_SCRIPT_MAX) {
+		return g_unichar_get_script (c);
+	}
+
+	blk = g_atomic_pointer_get (&unichar_scripts[c >> UNICHAR_SCRIPT_BLOCK_BITS]);
+
+	if (blk == NULL) {
+		nblk = g_malloc (UNICHAR_SCRIPT_BLOCK_SIZE);
+		base = c & ~(UNICHAR_SCRIPT_BLOCK_SIZE - 1);
+
+		for (i = 0; i < UNICHAR_SCRIPT_BLOCK_SIZE; i ++) {
+			nblk[i] = g_unichar_get_script (base + i);
+		}
+
+		/* Blocks may be filled concurrently by scanning threads */
+		if (g_atomic_pointer_compare_and_exchange (
+				&unichar_scripts[c >> UNICHAR_SCRIPT_BLOCK_BITS], NULL, nblk)) {
+			blk = nblk;
+		}
+		else {
+			g_free (nblk);
+			blk = g_atomic_pointer_get (
+					&unichar_scripts[c >> UNICHAR_SCRIPT_BLOCK_BITS]);
+		}
+	}
+
+	return blk[c & (UNICHAR_SCRIPT_BLOCK_SIZE - 1)];
+}
+
 #ifndef HAVE_SETPROCTITLE
 
 static gchar *title_buffer = 0;
@@ -2315,6 +2364,78 @@ rspamd_decode_base32 (const gchar *in, gsize inlen, gsize *outlen)
 	return res;
 }
 
+guchar *
+rspamd_decode_base64 (const gchar *in, gsize inlen, gsize *outlen)
+{
+	guchar *res;
+	gsize olen = inlen / 4 * 3 + 3;
+	gboolean ret;
+
+	res = g_malloc (olen);
+	ret = rspamd_cryptobox_base64_decode (in, inlen, res, &olen);
+	g_assert (ret);
+	*outlen = olen;
+
+	return res;
+}
+
+gssize
+rspamd_decode_qp_buf (const gchar *in, gsize inlen,
+	gchar *out, gsize outlen)
+{
+	const gchar *p = in, *end = in + inlen, *eq;
+	gchar *o = out, *oend = out + outlen;
+	gsize run;
+
+	while (p < end) {
+		/* Literal runs are copied as is */
+		eq = memchr (p, '=', end - p);
+		run = (eq != NULL ? eq : end) - p;
+
+		if (run > (gsize)(oend - o)) {
+			return -1;
+		}
+
+		memcpy (o, p, run);
+		o += run;
+		p += run;
+
+		if (eq == NULL) {
+			break;
+		}
+
+		p ++;
+
+		if (p < end && (*p == '\r' || *p == '\n')) {
+			/* Soft line break */
+			if (*p == '\r') {
+				p ++;
+			}
+			if (p < end && *p == '\n') {
+				p ++;
+			}
+
+			continue;
+		}
+
+		if (o == oend) {
+			return -1;
+		}
+
+		if (end - p >= 2 && g_ascii_isxdigit (p[0]) &&
+				g_ascii_isxdigit (p[1])) {
+			*o++ = (g_ascii_xdigit_value (p[0]) << 4) |
+					g_ascii_xdigit_value (p[1]);
+			p += 2;
+		}
+		else {
+			*o++ = '=';
+		}
+	}
+
+	return o - out;
+}
+
 gdouble
 rspamd_get_ticks (void)
 {
@@ -2362,6 +2483,54 @@ rspamd_get_virtual_ticks (void)
 	return res;
 }
 
+gboolean
+rspamd_get_process_memory (pid_t pid, gsize *shared, gsize *private)
+{
+#ifdef __linux__
+	gchar path[PATH_MAX], line[256];
+	gsize sh = 0, pv = 0;
+	gulong val;
+	FILE *f;
+
+	/* smaps_rollup is much cheaper but appeared in linux 4.14 only */
+	rspamd_snprintf (path, sizeof (path), "/proc/%P/smaps_rollup", pid);
+	f = fopen (path, "r");
+
+	if (f == NULL) {
+		rspamd_snprintf (path, sizeof (path), "/proc/%P/smaps", pid);
+		f = fopen (path, "r");
+
+		if (f == NULL) {
+			return FALSE;
+		}
+	}
+
+	while (fgets (line, sizeof (line), f) != NULL) {
+		if (sscanf (line, "Shared_Clean: %lu kB", &val) == 1 ||
+				sscanf (line, "Shared_Dirty: %lu kB", &val) == 1) {
+			sh += val * 1024;
+		}
+		else if (sscanf (line, "Private_Clean: %lu kB", &val) == 1 ||
+				sscanf (line, "Private_Dirty: %lu kB", &val) == 1) {
+			pv += val * 1024;
+		}
+	}
+
+	fclose (f);
+
+	if (shared) {
+		*shared = sh;
+	}
+	if (private) {
+		*private = pv;
+	}
+
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
 /* Required for tweetnacl */
 void
 randombytes (guchar *buf, guint64 len)
@@ -111,6 +111,13 @@ void rspamd_pass_signal (GHashTable *, gint );
 void rspamd_str_lc (gchar *str, guint size);
 void rspamd_str_lc_utf8 (gchar *str, guint size);
 
+/*
+ * The same as g_unichar_get_script but uses a two-level table of scripts that
+ * is filled on demand, so the binary search is done once per block of
+ * characters only
+ */
+GUnicodeScript rspamd_unichar_get_script (gunichar c);
+
 #ifndef HAVE_SETPROCTITLE
 /*
  * Process title utility functions
@@ -428,6 +435,28 @@ gchar * rspamd_encode_base32 (const guchar *in, gsize inlen);
  */
 guchar* rspamd_decode_base32 (const gchar *in, gsize inlen, gsize *outlen);
 
+/**
+ * Decode string using base64 encoding, line breaks and invalid characters
+ * are skipped
+ * @param in input
+ * @param inlen input length
+ * @param outlen output length
+ * @return freshly allocated base64 decoded value
+ */
+guchar* rspamd_decode_base64 (const gchar *in, gsize inlen, gsize *outlen);
+
+/**
+ * Decode quoted-printable encoded buffer, soft line breaks are removed and
+ * invalid escapes are copied as is
+ * @param in input
+ * @param inlen input length
+ * @param out output buffer
+ * @param outlen size of output buffer (inlen is always enough)
+ * @return length of decoded data or -1 if output buffer is too small
+ */
+gssize rspamd_decode_qp_buf (const gchar *in, gsize inlen,
+	gchar *out, gsize outlen);
+
 /**
  * Portably return the current clock ticks as seconds
  * @return
@@ -440,6 +469,16 @@ gdouble rspamd_get_ticks (void);
  */
 gdouble rspamd_get_virtual_ticks (void);
 
+/**
+ * Get resident memory of a process split to pages shared with other processes
+ * and private pages, it is supported on linux only
+ * @param pid pid of process
+ * @param shared output for shared bytes
+ * @param private output for private bytes
+ * @return TRUE if memory usage has been read
+ */
+gboolean rspamd_get_process_memory (pid_t pid, gsize *shared, gsize *private);
+
 /**
  * Special utility to help array freeing in rspamd_mempool
  * @param p
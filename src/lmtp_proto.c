@@ -276,68 +276,290 @@ read_lmtp_input_line (struct rspamd_lmtp_proto *lmtp, rspamd_fstring_t * line)
 	return 0;
 }
 
-struct mta_callback_data {
+/*
+ * Client of delivery agent, connections are kept open between messages and
+ * shared by all tasks of a worker
+ */
+
+/* Default number of parallel connections to delivery agent */
+#define LMTP_DEFAULT_MAX_CONNECTIONS 8
+/* Timeout of io with delivery agent, idle connections are closed after it */
+#define LMTP_MTA_TIMEOUT 60
+
+struct mta_connection;
+
+struct mta_delivery {
 	struct rspamd_task *task;
+	struct mta_connection *conn;
+	guint nrcpt;                                /* number of recipients */
+	guint rcpt_ok;                              /* recipients accepted by agent */
+	guint delivered;                            /* recipients delivered (LMTP) */
+};
+
+struct mta_connection {
+	gint sock;
 	rspamd_io_dispatcher_t *dispatcher;
+	struct mta_delivery *delivery;
 	enum {
 		LMTP_WANT_GREETING,
+		LMTP_WANT_HELO,
+		LMTP_WANT_RSET,
 		LMTP_WANT_MAIL,
 		LMTP_WANT_RCPT,
 		LMTP_WANT_DATA,
 		LMTP_WANT_DOT,
-		LMTP_WANT_CLOSING,
+		LMTP_IDLE
 	} state;
+	GList *cur_rcpt;                            /* next recipient to send */
+	guint replies;                              /* replies got in the current state */
+	gboolean pipelining;                        /* agent supports PIPELINING */
+	gboolean reused;                            /* a message has been sent already */
 };
 
-static gboolean
-parse_mta_str (rspamd_fstring_t * in, struct mta_callback_data *cd)
+struct mta_pool {
+	GQueue *idle;                               /* connections without delivery */
+	GQueue *waiting;                            /* deliveries waiting for connection */
+	guint nconns;
+};
+
+static struct mta_pool *mta_pool = NULL;
+static struct timeval mta_io_tv = { LMTP_MTA_TIMEOUT, 0 };
+
+static gboolean mta_read_socket (rspamd_fstring_t * in, void *arg);
+static void mta_err_socket (GError * err, void *arg);
+static gboolean mta_start_transaction (struct mta_connection *conn);
+
+static guint
+mta_max_connections (struct rspamd_config *cfg)
 {
-	gint r;
-	static rspamd_fstring_t okres1 = {
-		.begin = "250 ",
-		.len = sizeof ("250 ") - 1,
+	return cfg->deliver_max_connections > 0 ?
+		   cfg->deliver_max_connections : LMTP_DEFAULT_MAX_CONNECTIONS;
+}
+
+/* Get code of a reply line, -1 is returned for a malformed line */
+static gint
+mta_reply_code (rspamd_fstring_t *in)
+{
+	if (in->len < 3 || !g_ascii_isdigit (in->begin[0]) ||
+		!g_ascii_isdigit (in->begin[1]) || !g_ascii_isdigit (in->begin[2])) {
+		return -1;
 	}
-	, okres2 = {
-		.begin = "220 ",.len = sizeof ("220 ") - 1,
+
+	return (in->begin[0] - '0') * 100 + (in->begin[1] - '0') * 10 +
+		   (in->begin[2] - '0');
+}
+
+/* Finish delivery of a message and reply to client */
+static void
+mta_delivery_done (struct mta_delivery *delivery, gboolean is_success)
+{
+	if (delivery->conn != NULL) {
+		delivery->conn->delivery = NULL;
+		delivery->conn = NULL;
+	}
+	if (delivery->task == NULL) {
+		return;
 	}
-	, datares = {
-		.begin = "354 ",.len = sizeof ("354 ") - 1,
-	};
 
-	switch (cd->state) {
-	case LMTP_WANT_GREETING:
+	delivery->task->state = CLOSING_CONNECTION;
+	if (is_success) {
+		(void)out_lmtp_reply (delivery->task, LMTP_OK, "",
+			"Delivery completed");
+	}
+	else {
+		(void)out_lmtp_reply (delivery->task, LMTP_FAILURE, "",
+			"Delivery failure");
+	}
+	delivery->task = NULL;
+}
+
+static struct mta_connection *
+mta_connection_new (struct rspamd_task *task)
+{
+	struct mta_connection *conn;
+	struct sockaddr_un *un;
+	gint sock;
+
+	if (task->cfg->deliver_family == AF_UNIX) {
+		un = alloca (sizeof (struct sockaddr_un));
+		sock = rspamd_socket_unix (task->cfg->deliver_host,
+				un,
+				SOCK_STREAM,
+				FALSE,
+				TRUE);
+	}
+	else {
+		sock = rspamd_socket (task->cfg->deliver_host,
+				task->cfg->deliver_port,
+				SOCK_STREAM,
+				TRUE,
+				FALSE,
+				TRUE);
+	}
+	if (sock == -1) {
+		msg_warn ("cannot create socket for %s, %s",
+			task->cfg->deliver_host,
+			strerror (errno));
+		return NULL;
+	}
+
+	conn = g_slice_alloc0 (sizeof (struct mta_connection));
+	conn->sock = sock;
+	conn->state = LMTP_WANT_GREETING;
+	conn->dispatcher = rspamd_create_dispatcher (task->ev_base,
+			sock,
+			BUFFER_LINE,
+			mta_read_socket,
+			NULL,
+			mta_err_socket,
+			&mta_io_tv,
+			(void *)conn);
+	mta_pool->nconns++;
+
+	return conn;
+}
+
+/* Give a connection to the next waiting delivery or keep it idle */
+static void
+mta_connection_release (struct mta_connection *conn)
+{
+	struct mta_delivery *delivery;
+
+	conn->state = LMTP_IDLE;
+	conn->reused = TRUE;
+
+	if ((delivery = g_queue_pop_head (mta_pool->waiting)) != NULL) {
+		delivery->conn = conn;
+		conn->delivery = delivery;
+		/* Broken connection is closed by error handler */
+		(void)mta_start_transaction (conn);
+	}
+	else {
+		g_queue_push_tail (mta_pool->idle, conn);
+	}
+}
+
+static void
+mta_connection_close (struct mta_connection *conn, gboolean is_success)
+{
+	struct mta_delivery *delivery;
+	struct mta_connection *nconn;
+
+	if (conn->delivery != NULL) {
+		mta_delivery_done (conn->delivery, is_success);
+	}
+	g_queue_remove (mta_pool->idle, conn);
+	rspamd_remove_dispatcher (conn->dispatcher);
+	close (conn->sock);
+	g_slice_free1 (sizeof (struct mta_connection), conn);
+	mta_pool->nconns--;
+
+	/* A slot for a new connection is free now */
+	while ((delivery = g_queue_pop_head (mta_pool->waiting)) != NULL) {
+		if ((nconn = mta_connection_new (delivery->task)) != NULL) {
+			nconn->delivery = delivery;
+			delivery->conn = nconn;
+			break;
+		}
+		mta_delivery_done (delivery, FALSE);
+	}
+}
+
+/* Task is destroyed before its message is delivered */
+static void
+mta_delivery_cancel (gpointer ud)
+{
+	struct mta_delivery *delivery = ud;
+
+	delivery->task = NULL;
+	g_queue_remove (mta_pool->waiting, delivery);
+	if (delivery->conn != NULL) {
+		mta_connection_close (delivery->conn, FALSE);
+	}
+}
+
+static gboolean
+mta_write_command (struct mta_connection *conn)
+{
+	struct rspamd_task *task = conn->delivery->task;
+	gchar outbuf[OUTBUFSIZ];
+	gint r = 0;
+
+	switch (conn->state) {
+	case LMTP_WANT_RSET:
+		r = rspamd_snprintf (outbuf, sizeof (outbuf), "RSET" CRLF);
+		break;
 	case LMTP_WANT_MAIL:
+		r = rspamd_snprintf (outbuf, sizeof (outbuf), "MAIL FROM: <%s>" CRLF,
+				task->from);
+		break;
 	case LMTP_WANT_RCPT:
-	case LMTP_WANT_DATA:
-	case LMTP_WANT_CLOSING:
-		r = rspamd_fstrstr (in, &okres1);
-		if (r == -1) {
-			r = rspamd_fstrstr (in, &okres2);
-		}
+		r = rspamd_snprintf (outbuf, sizeof (outbuf), "RCPT TO: <%s>" CRLF,
+				(gchar *)conn->cur_rcpt->data);
+		conn->cur_rcpt = g_list_next (conn->cur_rcpt);
 		break;
-	case LMTP_WANT_DOT:
-		r = rspamd_fstrstr (in, &datares);
+	case LMTP_WANT_DATA:
+		r = rspamd_snprintf (outbuf, sizeof (outbuf), "DATA" CRLF);
 		break;
+	default:
+		return TRUE;
 	}
 
-	return r != -1;
+	return rspamd_dispatcher_write (conn->dispatcher, outbuf, r, FALSE, FALSE);
 }
 
-static void
-close_mta_connection (struct mta_callback_data *cd, gboolean is_success)
+/*
+ * Start sending of a message, all commands of envelope are sent at once if
+ * the agent supports pipelining
+ */
+static gboolean
+mta_start_transaction (struct mta_connection *conn)
 {
-	cd->task->state = CLOSING_CONNECTION;
-	if (is_success) {
-		if (!out_lmtp_reply (cd->task, LMTP_OK, "", "Delivery completed")) {
-			return;
-		}
+	struct mta_delivery *delivery = conn->delivery;
+	struct rspamd_task *task = delivery->task;
+	GString *buf;
+	GList *cur;
+
+	conn->state = conn->reused ? LMTP_WANT_RSET : LMTP_WANT_MAIL;
+	conn->cur_rcpt = task->rcpt;
+	conn->replies = 0;
+	delivery->rcpt_ok = 0;
+	delivery->delivered = 0;
+
+	if (!conn->pipelining) {
+		return mta_write_command (conn);
 	}
-	else {
-		if (!out_lmtp_reply (cd->task, LMTP_FAILURE, "", "Delivery failure")) {
-			return;
-		}
+
+	buf = g_string_sized_new (OUTBUFSIZ);
+	if (conn->reused) {
+		g_string_append (buf, "RSET" CRLF);
 	}
-	rspamd_remove_dispatcher (cd->dispatcher);
+	rspamd_printf_gstring (buf, "MAIL FROM: <%s>" CRLF, task->from);
+	for (cur = task->rcpt; cur != NULL; cur = g_list_next (cur)) {
+		rspamd_printf_gstring (buf, "RCPT TO: <%s>" CRLF, (gchar *)cur->data);
+	}
+	g_string_append (buf, "DATA" CRLF);
+	conn->cur_rcpt = NULL;
+
+	return rspamd_dispatcher_write_string (conn->dispatcher, buf, FALSE, TRUE);
+}
+
+static gboolean
+mta_write_message (struct mta_connection *conn)
+{
+	struct rspamd_task *task = conn->delivery->task;
+	gchar *c;
+
+	c = g_mime_object_to_string ((GMimeObject *) task->message);
+	rspamd_mempool_add_destructor (task->task_pool,
+		(rspamd_mempool_destruct_t) g_free, c);
+	if (!rspamd_dispatcher_write (conn->dispatcher, c, strlen (c), TRUE,
+		TRUE)) {
+		return FALSE;
+	}
+
+	return rspamd_dispatcher_write (conn->dispatcher, CRLF "." CRLF,
+			   sizeof (CRLF "." CRLF) - 1, FALSE, TRUE);
 }
 
 /*
@@ -346,131 +568,134 @@ close_mta_connection (struct mta_callback_data *cd, gboolean is_success)
 static gboolean
 mta_read_socket (rspamd_fstring_t * in, void *arg)
 {
-	struct mta_callback_data *cd = (struct mta_callback_data *)arg;
-	gchar outbuf[1024], *hostbuf, *c;
-	gint hostmax, r;
-	GList *cur;
-	static rspamd_fstring_t contres1 = {
-		.begin = "250-",
-		.len = sizeof ("250-") - 1,
-	}
-	, contres2 = {
-		.begin = "220-",.len = sizeof ("220-") - 1,
+	struct mta_connection *conn = (struct mta_connection *)arg;
+	struct mta_delivery *delivery = conn->delivery;
+	gchar outbuf[1024], *hostbuf;
+	gint hostmax, r, code;
+	gboolean is_last;
+	static rspamd_fstring_t pipelining = {
+		.begin = "PIPELINING",
+		.len = sizeof ("PIPELINING") - 1
 	};
 
-	if (rspamd_fstrstr (in, &contres1) != -1 || rspamd_fstrstr (in, &contres2) != -1) {
-		/* Skip such lines */
+	code = mta_reply_code (in);
+	if (code == -1) {
+		msg_warn ("got bad reply from delivery agent");
+		mta_connection_close (conn, FALSE);
+		return FALSE;
+	}
+	is_last = in->len < 4 || in->begin[3] != '-';
+
+	if (!is_last) {
+		if (conn->state == LMTP_WANT_HELO &&
+			rspamd_fstrstri (in, &pipelining) != -1) {
+			conn->pipelining = TRUE;
+		}
+		/* Skip continuation lines */
 		return TRUE;
 	}
 
-	switch (cd->state) {
+	if (delivery == NULL && conn->state != LMTP_IDLE) {
+		/* Task has gone */
+		mta_connection_close (conn, FALSE);
+		return FALSE;
+	}
+
+	switch (conn->state) {
 	case LMTP_WANT_GREETING:
-		if (!parse_mta_str (in, cd)) {
+		if (code != 220) {
 			msg_warn ("got bad greeting");
-			close_mta_connection (cd, FALSE);
+			mta_connection_close (conn, FALSE);
 			return FALSE;
 		}
 		hostmax = sysconf (_SC_HOST_NAME_MAX) + 1;
 		hostbuf = alloca (hostmax);
 		gethostname (hostbuf, hostmax);
 		hostbuf[hostmax - 1] = '\0';
-		if (cd->task->cfg->deliver_lmtp) {
-			r = rspamd_snprintf (outbuf,
-					sizeof (outbuf),
-					"LHLO %s" CRLF,
-					hostbuf);
-		}
-		else {
-			r = rspamd_snprintf (outbuf,
-					sizeof (outbuf),
-					"HELO %s" CRLF,
-					hostbuf);
-		}
-		if (!rspamd_dispatcher_write (cd->task->dispatcher, outbuf, r, FALSE,
+		r = rspamd_snprintf (outbuf,
+				sizeof (outbuf),
+				"%s %s" CRLF,
+				delivery->task->cfg->deliver_lmtp ? "LHLO" : "EHLO",
+				hostbuf);
+		if (!rspamd_dispatcher_write (conn->dispatcher, outbuf, r, FALSE,
 			FALSE)) {
 			return FALSE;
 		}
-		cd->state = LMTP_WANT_MAIL;
+		conn->state = LMTP_WANT_HELO;
 		break;
-	case LMTP_WANT_MAIL:
-		if (!parse_mta_str (in, cd)) {
+	case LMTP_WANT_HELO:
+		if (rspamd_fstrstri (in, &pipelining) != -1) {
+			conn->pipelining = TRUE;
+		}
+		if (code / 100 != 2) {
 			msg_warn ("got bad helo");
-			close_mta_connection (cd, FALSE);
+			mta_connection_close (conn, FALSE);
 			return FALSE;
 		}
-		r = rspamd_snprintf (outbuf,
-				sizeof (outbuf),
-				"MAIL FROM: <%s>" CRLF,
-				cd->task->from);
-		if (!rspamd_dispatcher_write (cd->task->dispatcher, outbuf, r, FALSE,
-			FALSE)) {
+		return mta_start_transaction (conn);
+	case LMTP_WANT_RSET:
+		if (code / 100 != 2) {
+			msg_warn ("got bad reply to rset");
+			mta_connection_close (conn, FALSE);
 			return FALSE;
 		}
-		cd->state = LMTP_WANT_RCPT;
-		break;
-	case LMTP_WANT_RCPT:
-		if (!parse_mta_str (in, cd)) {
+		conn->state = LMTP_WANT_MAIL;
+		return conn->pipelining || mta_write_command (conn);
+	case LMTP_WANT_MAIL:
+		if (code / 100 != 2) {
 			msg_warn ("got bad mail from");
-			close_mta_connection (cd, FALSE);
+			mta_connection_close (conn, FALSE);
 			return FALSE;
 		}
-		cur = g_list_first (cd->task->rcpt);
-		r = 0;
-		while (cur) {
-			r += rspamd_snprintf (outbuf + r,
-					sizeof (outbuf) - r,
-					"RCPT TO: <%s>" CRLF,
-					(gchar *)cur->data);
-			cur = g_list_next (cur);
+		conn->state = LMTP_WANT_RCPT;
+		return conn->pipelining || mta_write_command (conn);
+	case LMTP_WANT_RCPT:
+		if (code / 100 == 2) {
+			delivery->rcpt_ok++;
 		}
-
-		if (!rspamd_dispatcher_write (cd->task->dispatcher, outbuf, r, FALSE,
-			FALSE)) {
-			return FALSE;
+		else {
+			msg_info ("recipient is rejected: %V", in);
 		}
-		cd->state = LMTP_WANT_DATA;
-		break;
-	case LMTP_WANT_DATA:
-		if (!parse_mta_str (in, cd)) {
-			msg_warn ("got bad rcpt");
-			close_mta_connection (cd, FALSE);
-			return FALSE;
+		if (++conn->replies < delivery->nrcpt) {
+			return conn->pipelining || mta_write_command (conn);
 		}
-		r = rspamd_snprintf (outbuf, sizeof (outbuf), "DATA" CRLF);
-		if (!rspamd_dispatcher_write (cd->task->dispatcher, outbuf, r, FALSE,
-			FALSE)) {
+		if (delivery->rcpt_ok == 0) {
+			msg_warn ("no recipients are accepted");
+			mta_connection_close (conn, FALSE);
 			return FALSE;
 		}
-		cd->state = LMTP_WANT_DOT;
-		break;
-	case LMTP_WANT_DOT:
-		if (!parse_mta_str (in, cd)) {
+		conn->state = LMTP_WANT_DATA;
+		conn->replies = 0;
+		return conn->pipelining || mta_write_command (conn);
+	case LMTP_WANT_DATA:
+		if (code != 354) {
 			msg_warn ("got bad data");
-			close_mta_connection (cd, FALSE);
+			mta_connection_close (conn, FALSE);
 			return FALSE;
 		}
-		c = g_mime_object_to_string ((GMimeObject *) cd->task->message);
-		r = strlen (c);
-		if (!rspamd_dispatcher_write (cd->task->dispatcher, c, r, TRUE, TRUE)) {
-			return FALSE;
+		conn->state = LMTP_WANT_DOT;
+		return mta_write_message (conn);
+	case LMTP_WANT_DOT:
+		/* LMTP agent replies for each accepted recipient */
+		if (code / 100 == 2) {
+			delivery->delivered++;
 		}
-		rspamd_mempool_add_destructor (cd->task->task_pool,
-			(rspamd_mempool_destruct_t) g_free, c);
-		r = rspamd_snprintf (outbuf, sizeof (outbuf), CRLF "." CRLF);
-		if (!rspamd_dispatcher_write (cd->task->dispatcher, outbuf, r, FALSE,
-			FALSE)) {
-			return FALSE;
+		if (delivery->task->cfg->deliver_lmtp &&
+			++conn->replies < delivery->rcpt_ok) {
+			return TRUE;
 		}
-		cd->state = LMTP_WANT_CLOSING;
-		break;
-	case LMTP_WANT_CLOSING:
-		if (!parse_mta_str (in, cd)) {
+		if (delivery->delivered == 0) {
 			msg_warn ("message not delivered");
-			close_mta_connection (cd, FALSE);
+			mta_connection_close (conn, FALSE);
 			return FALSE;
 		}
-		close_mta_connection (cd, TRUE);
+		mta_delivery_done (delivery, TRUE);
+		mta_connection_release (conn);
 		break;
+	case LMTP_IDLE:
+		/* Agent closes an idle connection */
+		mta_connection_close (conn, FALSE);
+		return FALSE;
 	}
 
 	return TRUE;
@@ -482,9 +707,13 @@ mta_read_socket (rspamd_fstring_t * in, void *arg)
 static void
 mta_err_socket (GError * err, void *arg)
 {
-	struct mta_callback_data *cd = (struct mta_callback_data *)arg;
-	msg_info ("abnormaly terminating connection with MTA");
-	close_mta_connection (cd, FALSE);
+	struct mta_connection *conn = (struct mta_connection *)arg;
+
+	if (conn->state != LMTP_IDLE) {
+		msg_info ("abnormally terminating connection with MTA: %s",
+			err->message);
+	}
+	mta_connection_close (conn, FALSE);
 }
 
 /*
@@ -493,45 +722,44 @@ mta_err_socket (GError * err, void *arg)
 static gint
 lmtp_deliver_mta (struct rspamd_task *task)
 {
-	gint sock;
-	struct sockaddr_un *un;
-	struct mta_callback_data *cd;
+	struct mta_delivery *delivery;
+	struct mta_connection *conn;
 
-	if (task->cfg->deliver_family == AF_UNIX) {
-		un = alloca (sizeof (struct sockaddr_un));
-		sock = rspamd_socket_unix (task->cfg->deliver_host,
-				un,
-				SOCK_STREAM,
-				FALSE,
-				TRUE);
+	if (mta_pool == NULL) {
+		mta_pool = g_malloc0 (sizeof (struct mta_pool));
+		mta_pool->idle = g_queue_new ();
+		mta_pool->waiting = g_queue_new ();
 	}
-	else {
-		sock = rspamd_socket (task->cfg->deliver_host,
-				task->cfg->deliver_port,
-				SOCK_STREAM,
-				TRUE,
-				FALSE,
-				TRUE);
+
+	delivery = rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (struct mta_delivery));
+	delivery->task = task;
+	delivery->nrcpt = g_list_length (task->rcpt);
+	if (delivery->nrcpt == 0) {
+		return -1;
 	}
-	if (sock == -1) {
-		msg_warn ("cannot create socket for %s, %s",
-			task->cfg->deliver_host,
-			strerror (errno));
+	rspamd_mempool_add_destructor (task->task_pool, mta_delivery_cancel,
+		delivery);
+
+	if ((conn = g_queue_pop_head (mta_pool->idle)) != NULL) {
+		conn->delivery = delivery;
+		delivery->conn = conn;
+		(void)mta_start_transaction (conn);
+	}
+	else if (mta_pool->nconns < mta_max_connections (task->cfg)) {
+		if ((conn = mta_connection_new (task)) == NULL) {
+			delivery->task = NULL;
+			return -1;
+		}
+		conn->delivery = delivery;
+		delivery->conn = conn;
+	}
+	else {
+		/* Wait for a free connection */
+		g_queue_push_tail (mta_pool->waiting, delivery);
 	}
 
-	cd = rspamd_mempool_alloc (task->task_pool,
-			sizeof (struct mta_callback_data));
-	cd->task = task;
-	cd->state = LMTP_WANT_GREETING;
-	cd->dispatcher = rspamd_create_dispatcher (task->ev_base,
-			sock,
-			BUFFER_LINE,
-			mta_read_socket,
-			NULL,
-			mta_err_socket,
-			NULL,
-			(void *)cd);
-	return 0;
+	return 1;
 }
 
 static gchar *
@@ -723,8 +951,11 @@ lmtp_deliver_message (struct rspamd_task *task)
 		/* Do deliver to LDA */
 		return lmtp_deliver_lda (task);
 	}
+	else if (task->cfg->deliver_host != NULL) {
+		/* Do deliver to LMTP/SMTP agent */
+		return lmtp_deliver_mta (task);
+	}
 	else {
-		/* XXX: do lmtp/smtp client */
 		return -1;
 	}
 }
@@ -0,0 +1,433 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lua_common.h"
+
+/***
+ * @module rspamd_async
+ * This module allows to write asynchronous code in symbol callbacks without
+ * nested callbacks. Each symbol callback is executed within a coroutine, so
+ * it can be suspended while DNS, redis or HTTP requests are being processed
+ * and resumed when their results are ready.
+ * @example
+local async = require "rspamd_async"
+
+rspamd_config:register_symbol('SYMBOL', 1.0, function(task)
+	local r = task:get_resolver()
+	-- Wait for a single request
+	local results, err = async.await(function(cb)
+		r:resolve_a(task:get_session(), task:get_mempool(), 'example.com', cb)
+	end)
+	-- Wait for several requests being executed in parallel
+	local all = async.parallel({
+		function(cb)
+			r:resolve_txt(task:get_session(), task:get_mempool(), 'example.com', cb)
+		end,
+		function(cb)
+			r:resolve_mx(task:get_session(), task:get_mempool(), 'example.com', cb)
+		end,
+	})
+	-- all[1] and all[2] hold the arguments of the corresponding callbacks
+	if all[1][3] and all[2][3] then
+		return true
+	end
+	return false
+end)
+ */
+
+/* Maximum number of idle threads kept for the further symbols */
+#define RSPAMD_LUA_COROUTINES_POOL 64
+
+static const gchar *rspamd_lua_main_state_key = "rspamd_main_state";
+static const gchar *rspamd_lua_coroutines_key = "rspamd_coroutines";
+
+struct lua_coroutine {
+	lua_State *co;
+	lua_State *main;
+	gint ref;
+	guint64 id;
+	rspamd_lua_coroutine_fin_t fin;
+	gpointer ud;
+};
+
+struct lua_async_wait {
+	lua_State *co;
+	guint64 id;
+	gint results_ref;
+	guint pending;
+	gboolean yielded;
+	gboolean single;
+};
+
+/* Coroutines that have not finished yet indexed by their lua_State */
+static GHashTable *running_coroutines = NULL;
+static guint64 coroutines_id = 0;
+
+LUA_FUNCTION_DEF (async, await);
+LUA_FUNCTION_DEF (async, parallel);
+
+static const struct luaL_reg asynclib_f[] = {
+	LUA_INTERFACE_DEF (async, await),
+	LUA_INTERFACE_DEF (async, parallel),
+	{NULL, NULL}
+};
+
+lua_State *
+rspamd_lua_main_state (lua_State *L)
+{
+	lua_State *main;
+
+	lua_getfield (L, LUA_REGISTRYINDEX, rspamd_lua_main_state_key);
+	main = lua_touserdata (L, -1);
+	lua_pop (L, 1);
+
+	return main != NULL ? main : L;
+}
+
+lua_State *
+rspamd_lua_coroutine_new (lua_State *L, rspamd_lua_coroutine_fin_t fin,
+		gpointer ud)
+{
+	struct lua_coroutine *c;
+	lua_State *main = rspamd_lua_main_state (L);
+	gint npooled;
+
+	c = g_slice_alloc (sizeof (*c));
+	c->main = main;
+	c->fin = fin;
+	c->ud = ud;
+	c->id = ++coroutines_id;
+
+	lua_getfield (main, LUA_REGISTRYINDEX, rspamd_lua_coroutines_key);
+	npooled = rspamd_lua_objlen (main, -1);
+
+	if (npooled > 0) {
+		/* Reuse an idle thread */
+		lua_rawgeti (main, -1, npooled);
+		lua_pushnil (main);
+		lua_rawseti (main, -3, npooled);
+		c->co = lua_tothread (main, -1);
+	}
+	else {
+		c->co = lua_newthread (main);
+	}
+
+	c->ref = luaL_ref (main, LUA_REGISTRYINDEX);
+	lua_pop (main, 1);
+
+	if (running_coroutines == NULL) {
+		running_coroutines = g_hash_table_new (g_direct_hash, g_direct_equal);
+	}
+
+	g_hash_table_insert (running_coroutines, c->co, c);
+
+	return c->co;
+}
+
+static void
+rspamd_lua_coroutine_free (struct lua_coroutine *c, gboolean reuse)
+{
+	lua_State *main = c->main;
+	gint npooled;
+
+	g_hash_table_remove (running_coroutines, c->co);
+
+	if (reuse) {
+		lua_getfield (main, LUA_REGISTRYINDEX, rspamd_lua_coroutines_key);
+		npooled = rspamd_lua_objlen (main, -1);
+
+		if (npooled < RSPAMD_LUA_COROUTINES_POOL) {
+			lua_settop (c->co, 0);
+			lua_rawgeti (main, LUA_REGISTRYINDEX, c->ref);
+			lua_rawseti (main, -2, npooled + 1);
+		}
+
+		lua_pop (main, 1);
+	}
+
+	luaL_unref (main, LUA_REGISTRYINDEX, c->ref);
+	g_slice_free1 (sizeof (*c), c);
+}
+
+void
+rspamd_lua_coroutine_resume (lua_State *co, gint nargs)
+{
+	struct lua_coroutine *c;
+	gint status;
+
+	c = g_hash_table_lookup (running_coroutines, co);
+	g_assert (c != NULL);
+
+#if LUA_VERSION_NUM > 501
+	status = lua_resume (co, c->main, nargs);
+#else
+	status = lua_resume (co, nargs);
+#endif
+
+	if (status == LUA_YIELD) {
+		/* Waiting for some asynchronous event */
+		return;
+	}
+
+	if (c->fin) {
+		c->fin (co, status, c->ud);
+	}
+
+	/* A thread that has failed cannot be resumed any longer */
+	rspamd_lua_coroutine_free (c, status == 0);
+}
+
+void
+rspamd_lua_coroutine_abort (lua_State *co)
+{
+	struct lua_coroutine *c;
+
+	if (running_coroutines != NULL) {
+		c = g_hash_table_lookup (running_coroutines, co);
+
+		if (c != NULL) {
+			rspamd_lua_coroutine_free (c, FALSE);
+		}
+	}
+}
+
+gboolean
+rspamd_lua_coroutine_yieldable (lua_State *L)
+{
+	if (running_coroutines == NULL) {
+		return FALSE;
+	}
+
+	return g_hash_table_lookup (running_coroutines, L) != NULL;
+}
+
+static void
+lua_async_wait_finish (lua_State *L, struct lua_async_wait *w)
+{
+	struct lua_coroutine *c;
+	lua_State *co = w->co;
+	gint nret = 1, i;
+
+	c = g_hash_table_lookup (running_coroutines, co);
+
+	if (c == NULL || c->id != w->id) {
+		/* Coroutine has been aborted, e.g. its task is destroyed */
+		luaL_unref (L, LUA_REGISTRYINDEX, w->results_ref);
+		w->results_ref = LUA_NOREF;
+
+		return;
+	}
+
+	lua_rawgeti (co, LUA_REGISTRYINDEX, w->results_ref);
+	luaL_unref (co, LUA_REGISTRYINDEX, w->results_ref);
+	w->results_ref = LUA_NOREF;
+
+	if (w->single) {
+		/* Unpack arguments of the only callback */
+		lua_rawgeti (co, -1, 1);
+		lua_remove (co, -2);
+		lua_getfield (co, -1, "n");
+		nret = lua_tointeger (co, -1);
+		lua_pop (co, 1);
+
+		for (i = 1; i <= nret; i ++) {
+			lua_rawgeti (co, -i, i);
+		}
+
+		lua_remove (co, -(nret + 1));
+	}
+
+	rspamd_lua_coroutine_resume (co, nret);
+}
+
+static gint
+lua_async_resume_cb (lua_State *L)
+{
+	struct lua_async_wait *w = lua_touserdata (L, lua_upvalueindex (1));
+	gint idx = lua_tointeger (L, lua_upvalueindex (2)), nargs, i;
+
+	if (w->results_ref == LUA_NOREF) {
+		return 0;
+	}
+
+	nargs = lua_gettop (L);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, w->results_ref);
+	lua_rawgeti (L, -1, idx);
+
+	if (!lua_isnil (L, -1)) {
+		/* Callback has been called more than once */
+		lua_pop (L, 2);
+
+		return 0;
+	}
+
+	lua_pop (L, 1);
+	lua_createtable (L, nargs, 1);
+
+	for (i = 1; i <= nargs; i ++) {
+		lua_pushvalue (L, i);
+		lua_rawseti (L, -2, i);
+	}
+
+	/* Arguments might be nil, so save their number explicitly */
+	lua_pushinteger (L, nargs);
+	lua_setfield (L, -2, "n");
+	lua_rawseti (L, -2, idx);
+	lua_pop (L, 1);
+
+	w->pending --;
+
+	if (w->pending == 0 && w->yielded) {
+		lua_async_wait_finish (L, w);
+	}
+
+	return 0;
+}
+
+static gint
+lua_async_start (lua_State *L, gboolean single)
+{
+	struct lua_async_wait *w;
+	struct lua_coroutine *c;
+	gint nfuncs, i, wpos;
+
+	if (!rspamd_lua_coroutine_yieldable (L)) {
+		return luaL_error (L, "async functions can be used from symbol "
+				"callbacks only");
+	}
+
+	if (single) {
+		luaL_checktype (L, 1, LUA_TFUNCTION);
+		nfuncs = 1;
+	}
+	else {
+		luaL_checktype (L, 1, LUA_TTABLE);
+		nfuncs = rspamd_lua_objlen (L, 1);
+	}
+
+	c = g_hash_table_lookup (running_coroutines, L);
+	w = lua_newuserdata (L, sizeof (*w));
+	wpos = lua_gettop (L);
+	w->co = L;
+	w->id = c->id;
+	w->pending = nfuncs;
+	w->yielded = FALSE;
+	w->single = single;
+	lua_createtable (L, nfuncs, 0);
+	w->results_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+	for (i = 1; i <= nfuncs; i ++) {
+		if (single) {
+			lua_pushvalue (L, 1);
+		}
+		else {
+			lua_rawgeti (L, 1, i);
+		}
+
+		lua_pushvalue (L, wpos);
+		lua_pushinteger (L, i);
+		lua_pushcclosure (L, lua_async_resume_cb, 2);
+
+		if (lua_pcall (L, 1, 0, 0) != 0) {
+			luaL_unref (L, LUA_REGISTRYINDEX, w->results_ref);
+			w->results_ref = LUA_NOREF;
+
+			return lua_error (L);
+		}
+	}
+
+	if (w->pending > 0) {
+		w->yielded = TRUE;
+
+		return lua_yield (L, 0);
+	}
+
+	/* All callbacks have been called before we have yielded */
+	lua_rawgeti (L, LUA_REGISTRYINDEX, w->results_ref);
+	luaL_unref (L, LUA_REGISTRYINDEX, w->results_ref);
+	w->results_ref = LUA_NOREF;
+
+	if (single) {
+		gint nret;
+
+		lua_rawgeti (L, -1, 1);
+		lua_getfield (L, -1, "n");
+		nret = lua_tointeger (L, -1);
+		lua_pop (L, 1);
+
+		for (i = 1; i <= nret; i ++) {
+			lua_rawgeti (L, -i, i);
+		}
+
+		return nret;
+	}
+
+	return 1;
+}
+
+/***
+ * @function async.await(func)
+ * Calls `func` with a callback argument and suspends the current symbol until
+ * that callback is called. The arguments passed to the callback are returned.
+ * @param {function} func function that starts an asynchronous request
+ * @return {any} arguments of the callback
+ */
+static gint
+lua_async_await (lua_State *L)
+{
+	return lua_async_start (L, TRUE);
+}
+
+/***
+ * @function async.parallel(funcs)
+ * Calls each function from `funcs` with its own callback, so all requests are
+ * executed in parallel, and suspends the current symbol until all callbacks
+ * are called.
+ * @param {table} funcs array of functions that start asynchronous requests
+ * @return {table} array of tables with arguments of each callback, the number of arguments is stored in the field `n`
+ */
+static gint
+lua_async_parallel (lua_State *L)
+{
+	return lua_async_start (L, FALSE);
+}
+
+static gint
+lua_load_async (lua_State * L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, asynclib_f);
+
+	return 1;
+}
+
+void
+luaopen_async (lua_State * L)
+{
+	lua_pushlightuserdata (L, L);
+	lua_setfield (L, LUA_REGISTRYINDEX, rspamd_lua_main_state_key);
+	lua_newtable (L);
+	lua_setfield (L, LUA_REGISTRYINDEX, rspamd_lua_coroutines_key);
+
+	rspamd_lua_add_preload (L, "rspamd_async", lua_load_async);
+}
@@ -0,0 +1,300 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lua_common.h"
+#include "buckets.h"
+
+/***
+ * @module rspamd_buckets
+ * This module provides leaked buckets shared by all processes of a host.
+ * Buckets should be created when configuration is loaded, before workers
+ * are forked, hits are counted locally and then reconciled with a remote
+ * storage (e.g. redis) in batches.
+ * @example
+local rspamd_buckets = require "rspamd_buckets"
+local buckets = rspamd_buckets.create(65536)
+...
+local level = buckets:inc('user@example.com', 0.1, now)
+if level > 100 then
+	task:set_pre_result('soft reject', 'Ratelimit exceeded')
+end
+ */
+
+/***
+ * @function rspamd_buckets.create(nelts)
+ * Creates a new table of shared buckets
+ * @param {number} nelts maximum number of buckets
+ * @return {buckets} new buckets table or nil
+ */
+LUA_FUNCTION_DEF (buckets, create);
+/***
+ * @method buckets:check(name, now)
+ * Returns level of a bucket leaked to the specified time
+ * @param {string} name name of bucket
+ * @param {number} now current time
+ * @return {number} level of bucket or nil if bucket is unknown
+ */
+LUA_FUNCTION_DEF (buckets, check);
+/***
+ * @method buckets:inc(name, rate, now)
+ * Adds hit to a bucket creating it if needed
+ * @param {string} name name of bucket
+ * @param {number} rate leak rate in hits per second
+ * @param {number} now current time
+ * @return {number} new level of bucket or nil if bucket cannot be stored locally
+ */
+LUA_FUNCTION_DEF (buckets, inc);
+/***
+ * @method buckets:try_sync(now, interval)
+ * Checks whether it is time to reconcile buckets, only one process of a host
+ * gets true in each interval
+ * @param {number} now current time
+ * @param {number} interval minimal interval between reconciliations
+ * @return {boolean} true if caller should reconcile buckets
+ */
+LUA_FUNCTION_DEF (buckets, try_sync);
+/***
+ * @method buckets:collect(max)
+ * Collects buckets with hits that have not been sent to a remote storage
+ * @param {number} max maximum number of buckets
+ * @return {table} array of tables with fields `name`, `rate` and `pending`
+ */
+LUA_FUNCTION_DEF (buckets, collect);
+/***
+ * @method buckets:merge(name, now, level)
+ * Sets remote level of a bucket, local hits made since collection are kept
+ * @param {string} name name of bucket
+ * @param {number} now current time
+ * @param {number} level level of bucket in a remote storage
+ */
+LUA_FUNCTION_DEF (buckets, merge);
+/***
+ * @method buckets:restore(name, pending)
+ * Returns collected hits to a bucket if they could not be stored remotely
+ * @param {string} name name of bucket
+ * @param {number} pending number of collected hits
+ */
+LUA_FUNCTION_DEF (buckets, restore);
+LUA_FUNCTION_DEF (buckets, destroy);
+
+static const struct luaL_reg bucketslib_m[] = {
+	LUA_INTERFACE_DEF (buckets, check),
+	LUA_INTERFACE_DEF (buckets, inc),
+	LUA_INTERFACE_DEF (buckets, try_sync),
+	LUA_INTERFACE_DEF (buckets, collect),
+	LUA_INTERFACE_DEF (buckets, merge),
+	LUA_INTERFACE_DEF (buckets, restore),
+	{"__tostring", rspamd_lua_class_tostring},
+	{"__gc", lua_buckets_destroy},
+	{NULL, NULL}
+};
+static const struct luaL_reg bucketslib_f[] = {
+	LUA_INTERFACE_DEF (buckets, create),
+	{NULL, NULL}
+};
+
+static struct rspamd_buckets *
+lua_check_buckets (lua_State * L)
+{
+	void *ud = luaL_checkudata (L, 1, "rspamd{buckets}");
+
+	luaL_argcheck (L, ud != NULL, 1, "'buckets' expected");
+	return ud ? *((struct rspamd_buckets **)ud) : NULL;
+}
+
+static gint
+lua_buckets_create (lua_State *L)
+{
+	struct rspamd_buckets *b, **pb;
+	gint nelts;
+
+	nelts = luaL_checknumber (L, 1);
+
+	if (nelts <= 0 || (b = rspamd_buckets_new (nelts)) == NULL) {
+		lua_pushnil (L);
+	}
+	else {
+		pb = lua_newuserdata (L, sizeof (struct rspamd_buckets *));
+		rspamd_lua_setclass (L, "rspamd{buckets}", -1);
+		*pb = b;
+	}
+
+	return 1;
+}
+
+static gint
+lua_buckets_check (lua_State *L)
+{
+	struct rspamd_buckets *b = lua_check_buckets (L);
+	const gchar *name;
+	gdouble now, level;
+
+	name = luaL_checkstring (L, 2);
+	now = luaL_checknumber (L, 3);
+
+	if (b && rspamd_buckets_check (b, name, now, &level)) {
+		lua_pushnumber (L, level);
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+static gint
+lua_buckets_inc (lua_State *L)
+{
+	struct rspamd_buckets *b = lua_check_buckets (L);
+	const gchar *name;
+	gdouble rate, now, level;
+
+	name = luaL_checkstring (L, 2);
+	rate = luaL_checknumber (L, 3);
+	now = luaL_checknumber (L, 4);
+
+	if (b && rspamd_buckets_inc (b, name, rate, now, &level)) {
+		lua_pushnumber (L, level);
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+static gint
+lua_buckets_try_sync (lua_State *L)
+{
+	struct rspamd_buckets *b = lua_check_buckets (L);
+	gdouble now;
+	guint interval;
+
+	now = luaL_checknumber (L, 2);
+	interval = luaL_checknumber (L, 3);
+
+	lua_pushboolean (L, b && rspamd_buckets_try_sync (b, now, interval));
+
+	return 1;
+}
+
+static gint
+lua_buckets_collect (lua_State *L)
+{
+	struct rspamd_buckets *b = lua_check_buckets (L);
+	struct rspamd_bucket_delta *delta;
+	GArray *ar;
+	guint max, i;
+
+	max = luaL_checknumber (L, 2);
+	ar = g_array_new (FALSE, FALSE, sizeof (struct rspamd_bucket_delta));
+
+	if (b) {
+		rspamd_buckets_collect (b, max, ar);
+	}
+
+	lua_createtable (L, ar->len, 0);
+
+	for (i = 0; i < ar->len; i ++) {
+		delta = &g_array_index (ar, struct rspamd_bucket_delta, i);
+		lua_createtable (L, 0, 3);
+		lua_pushstring (L, "name");
+		lua_pushstring (L, delta->name);
+		lua_settable (L, -3);
+		lua_pushstring (L, "rate");
+		lua_pushnumber (L, delta->rate);
+		lua_settable (L, -3);
+		lua_pushstring (L, "pending");
+		lua_pushnumber (L, delta->pending);
+		lua_settable (L, -3);
+		lua_rawseti (L, -2, i + 1);
+	}
+
+	g_array_free (ar, TRUE);
+
+	return 1;
+}
+
+static gint
+lua_buckets_merge (lua_State *L)
+{
+	struct rspamd_buckets *b = lua_check_buckets (L);
+	const gchar *name;
+	gdouble now, level;
+
+	name = luaL_checkstring (L, 2);
+	now = luaL_checknumber (L, 3);
+	level = luaL_checknumber (L, 4);
+
+	if (b) {
+		rspamd_buckets_merge (b, name, now, level);
+	}
+
+	return 0;
+}
+
+static gint
+lua_buckets_restore (lua_State *L)
+{
+	struct rspamd_buckets *b = lua_check_buckets (L);
+	const gchar *name;
+	gdouble pending;
+
+	name = luaL_checkstring (L, 2);
+	pending = luaL_checknumber (L, 3);
+
+	if (b) {
+		rspamd_buckets_restore (b, name, pending);
+	}
+
+	return 0;
+}
+
+static gint
+lua_buckets_destroy (lua_State *L)
+{
+	struct rspamd_buckets *b = lua_check_buckets (L);
+
+	/* Mapping is removed from this process only */
+	rspamd_buckets_destroy (b);
+
+	return 0;
+}
+
+static gint
+lua_load_buckets (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, bucketslib_f);
+
+	return 1;
+}
+
+void
+luaopen_buckets (lua_State * L)
+{
+	rspamd_lua_new_class (L, "rspamd{buckets}", bucketslib_m);
+	lua_pop (L, 1);                      /* remove metatable from stack */
+
+	rspamd_lua_add_preload (L, "rspamd_buckets", lua_load_buckets);
+}
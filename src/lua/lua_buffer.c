@@ -183,7 +183,7 @@ lua_io_dispatcher_create (lua_State *L)
 			msg_warn ("create new event base as it is not specified");
 			cbdata->base = event_init ();
 		}
-		cbdata->L = L;
+		cbdata->L = rspamd_lua_main_state (L);
 		fd = lua_tointeger (L, 2);
 		lua_pushvalue (L, 3);
 		cbdata->cbref_read = luaL_ref (L, LUA_REGISTRYINDEX);
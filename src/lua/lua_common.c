@@ -23,6 +23,7 @@
  */
 
 #include "lua_common.h"
+#include "blake2.h"
 
 /* Lua module init function */
 #define MODULE_INIT_FUNC "module_init"
@@ -200,12 +201,455 @@ rspamd_lua_set_path (lua_State *L, struct rspamd_config *cfg)
 	lua_pop (L, 1);
 }
 
+/*
+ * Allocator that counts bytes used by a lua state, the counter is passed as
+ * the user data of the allocator
+ */
+static void *
+rspamd_lua_alloc (void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	gsize *used = ud;
+	void *nptr;
+
+	if (nsize == 0) {
+		if (ptr != NULL) {
+			*used -= osize;
+		}
+
+		free (ptr);
+
+		return NULL;
+	}
+
+	nptr = realloc (ptr, nsize);
+
+	if (nptr != NULL) {
+		*used += nsize - (ptr != NULL ? osize : 0);
+	}
+
+	return nptr;
+}
+
+gsize
+rspamd_lua_memory_used (lua_State *L)
+{
+	void *ud;
+
+	if (lua_getallocf (L, &ud) == rspamd_lua_alloc) {
+		return *(gsize *)ud;
+	}
+
+	return (gsize)lua_gc (L, LUA_GCCOUNT, 0) * 1024 +
+			lua_gc (L, LUA_GCCOUNTB, 0);
+}
+
+struct rspamd_lua_gc {
+	lua_State *L;
+	struct event ev;
+	struct rspamd_stat *stat;
+	struct rspamd_worker_stat *wstat;
+	gsize max_memory;
+	gsize limit;                /* full collection is done above this size */
+	gsize threshold;            /* steps are started above this size */
+	guint step;
+	gboolean idle;
+	gboolean cycle;             /* collection cycle is in progress */
+};
+
+/* Worker's slot of statistics, it is registered by the main process */
+static struct rspamd_worker_stat *
+rspamd_lua_gc_stat (struct rspamd_lua_gc *gc)
+{
+	pid_t pid;
+	guint i;
+
+	pid = getpid ();
+
+	if (gc->wstat != NULL && gc->wstat->pid == pid) {
+		return gc->wstat;
+	}
+
+	gc->wstat = NULL;
+
+	if (gc->stat != NULL) {
+		for (i = 0; i < RSPAMD_MAX_WORKERS_STAT; i ++) {
+			if (gc->stat->workers[i].pid == pid) {
+				gc->wstat = &gc->stat->workers[i];
+				break;
+			}
+		}
+	}
+
+	return gc->wstat;
+}
+
+static void
+rspamd_lua_gc_account (struct rspamd_lua_gc *gc, gdouble start,
+	gboolean full)
+{
+	struct rspamd_worker_stat *ws;
+
+	ws = rspamd_lua_gc_stat (gc);
+
+	if (ws != NULL) {
+		ws->lua_gc_time += (rspamd_get_ticks () - start) * 1000000;
+
+		if (full) {
+			ws->lua_gc_full ++;
+		}
+		else {
+			ws->lua_gc_steps ++;
+		}
+	}
+}
+
+/* Start the next cycle when memory has doubled since the previous one */
+static void
+rspamd_lua_gc_cycle_done (struct rspamd_lua_gc *gc)
+{
+	gsize used;
+
+	used = rspamd_lua_memory_used (gc->L);
+	gc->cycle = FALSE;
+	gc->threshold = used * 2;
+	gc->limit = MAX (gc->max_memory, gc->threshold);
+}
+
+static void
+rspamd_lua_gc_step (gint fd, short what, gpointer ud)
+{
+	struct rspamd_lua_gc *gc = ud;
+	struct timeval tv;
+	gdouble start;
+	gint done;
+
+	if (!gc->idle) {
+		return;
+	}
+
+	start = rspamd_get_ticks ();
+	done = lua_gc (gc->L, LUA_GCSTEP, gc->step);
+	/* Some lua versions restart automatic collection after a step */
+	lua_gc (gc->L, LUA_GCSTOP, 0);
+	rspamd_lua_gc_account (gc, start, FALSE);
+
+	if (done) {
+		rspamd_lua_gc_cycle_done (gc);
+	}
+	else {
+		/* Let the event loop handle new connections before the next step */
+		gc->cycle = TRUE;
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		evtimer_add (&gc->ev, &tv);
+	}
+}
+
+struct rspamd_lua_gc *
+rspamd_lua_gc_new (lua_State *L, struct event_base *ev_base, guint step,
+	gsize max_memory, struct rspamd_stat *stat)
+{
+	struct rspamd_lua_gc *gc;
+
+	gc = g_slice_alloc0 (sizeof (*gc));
+	gc->L = L;
+	gc->step = step;
+	gc->max_memory = max_memory;
+	gc->stat = stat;
+	evtimer_set (&gc->ev, rspamd_lua_gc_step, gc);
+	event_base_set (ev_base, &gc->ev);
+
+	lua_gc (L, LUA_GCSTOP, 0);
+	rspamd_lua_gc_cycle_done (gc);
+
+	return gc;
+}
+
+void
+rspamd_lua_gc_set_idle (struct rspamd_lua_gc *gc, gboolean idle)
+{
+	struct timeval tv;
+	gdouble start;
+	gsize used;
+
+	gc->idle = idle;
+	used = rspamd_lua_memory_used (gc->L);
+
+	if (used > gc->limit) {
+		msg_info ("lua uses %Hz of memory which is more than %Hz, "
+				"collect all garbage", used, gc->limit);
+		start = rspamd_get_ticks ();
+		lua_gc (gc->L, LUA_GCCOLLECT, 0);
+		lua_gc (gc->L, LUA_GCSTOP, 0);
+		rspamd_lua_gc_account (gc, start, TRUE);
+		rspamd_lua_gc_cycle_done (gc);
+
+		if (evtimer_pending (&gc->ev, NULL)) {
+			evtimer_del (&gc->ev);
+		}
+
+		return;
+	}
+
+	if (idle) {
+		if ((gc->cycle || used > gc->threshold) &&
+				!evtimer_pending (&gc->ev, NULL)) {
+			tv.tv_sec = 0;
+			tv.tv_usec = 0;
+			evtimer_add (&gc->ev, &tv);
+		}
+	}
+	else if (evtimer_pending (&gc->ev, NULL)) {
+		evtimer_del (&gc->ev);
+	}
+}
+
+void
+rspamd_lua_gc_destroy (struct rspamd_lua_gc *gc)
+{
+	if (gc != NULL) {
+		if (evtimer_pending (&gc->ev, NULL)) {
+			evtimer_del (&gc->ev);
+		}
+
+		lua_gc (gc->L, LUA_GCRESTART, 0);
+		g_slice_free1 (sizeof (*gc), gc);
+	}
+}
+
+/* Number of lines sampled per worker */
+#define RSPAMD_LUA_PROFILE_ENTRIES 256
+/* Time between samples above this is not counted as lua was not running */
+#define RSPAMD_LUA_PROFILE_MAX_GAP 0.01
+
+struct rspamd_lua_profile_entry {
+	guint64 samples;
+	guint64 time;               /* usec */
+	guint32 hash;               /* 0 for a free entry */
+	gint line;
+	gchar source[64];
+	gchar func[32];
+};
+
+/* Profiles are written by workers and read by controller without locking */
+struct rspamd_lua_profile {
+	struct rspamd_lua_profile_entry
+		entries[RSPAMD_MAX_WORKERS_STAT][RSPAMD_LUA_PROFILE_ENTRIES];
+	guint64 dropped[RSPAMD_MAX_WORKERS_STAT];
+};
+
+static struct {
+	struct rspamd_lua_profile *prof;
+	struct rspamd_stat *stat;
+	gint slot;
+	gdouble last;
+} lua_profiler = {
+	.slot = -1
+};
+
+struct rspamd_lua_profile *
+rspamd_lua_profile_new (rspamd_mempool_t *pool)
+{
+	return rspamd_mempool_alloc0_shared (pool,
+			sizeof (struct rspamd_lua_profile));
+}
+
+void
+rspamd_lua_profile_reset (struct rspamd_lua_profile *prof, guint slot)
+{
+	if (prof != NULL && slot < RSPAMD_MAX_WORKERS_STAT) {
+		memset (prof->entries[slot], 0, sizeof (prof->entries[slot]));
+		prof->dropped[slot] = 0;
+	}
+}
+
+static void
+rspamd_lua_profile_hook (lua_State *L, lua_Debug *ar)
+{
+	struct rspamd_lua_profile_entry *entries, *e;
+	gdouble now, gap;
+	guint32 h;
+	guint i, j;
+	pid_t pid;
+
+	now = rspamd_get_ticks ();
+	gap = now - lua_profiler.last;
+	lua_profiler.last = now;
+
+	if (lua_profiler.slot == -1) {
+		/* Worker is registered by the main process after fork */
+		pid = getpid ();
+
+		for (i = 0; i < RSPAMD_MAX_WORKERS_STAT; i ++) {
+			if (lua_profiler.stat->workers[i].pid == pid) {
+				lua_profiler.slot = i;
+				break;
+			}
+		}
+
+		if (lua_profiler.slot == -1) {
+			return;
+		}
+	}
+
+	if (!lua_getinfo (L, "Sln", ar)) {
+		return;
+	}
+
+	h = g_str_hash (ar->short_src) ^ (ar->currentline * 2654435761U);
+
+	if (h == 0) {
+		h = 1;
+	}
+
+	entries = lua_profiler.prof->entries[lua_profiler.slot];
+	e = NULL;
+
+	for (j = 0; j < RSPAMD_LUA_PROFILE_ENTRIES; j ++) {
+		e = &entries[(h + j) & (RSPAMD_LUA_PROFILE_ENTRIES - 1)];
+
+		if (e->hash == 0) {
+			e->line = ar->currentline;
+			rspamd_strlcpy (e->source, ar->short_src, sizeof (e->source));
+			rspamd_strlcpy (e->func, ar->name ? ar->name : "?",
+					sizeof (e->func));
+			e->hash = h;
+			break;
+		}
+
+		if (e->hash == h && e->line == ar->currentline &&
+				strncmp (e->source, ar->short_src, sizeof (e->source) - 1) == 0) {
+			break;
+		}
+	}
+
+	if (j == RSPAMD_LUA_PROFILE_ENTRIES) {
+		lua_profiler.prof->dropped[lua_profiler.slot] ++;
+		return;
+	}
+
+	e->samples ++;
+
+	if (gap >= 0 && gap < RSPAMD_LUA_PROFILE_MAX_GAP) {
+		e->time += gap * 1000000;
+	}
+}
+
+void
+rspamd_lua_profile_start (lua_State *L, struct rspamd_lua_profile *prof,
+	struct rspamd_stat *stat, guint count)
+{
+	lua_profiler.prof = prof;
+	lua_profiler.stat = stat;
+	lua_profiler.slot = -1;
+	lua_profiler.last = rspamd_get_ticks ();
+
+	/* Coroutines inherit hook of the state they are created from */
+	lua_sethook (L, rspamd_lua_profile_hook, LUA_MASKCOUNT, MAX (count, 1));
+}
+
+static gint
+rspamd_lua_profile_entry_cmp (const void *a, const void *b)
+{
+	const struct rspamd_lua_profile_entry *e1 = a, *e2 = b;
+
+	if (e1->time != e2->time) {
+		return e1->time < e2->time ? 1 : -1;
+	}
+
+	if (e1->samples != e2->samples) {
+		return e1->samples < e2->samples ? 1 : -1;
+	}
+
+	return 0;
+}
+
+ucl_object_t *
+rspamd_lua_profile_to_ucl (struct rspamd_lua_profile *prof,
+	struct rspamd_stat *stat)
+{
+	struct rspamd_lua_profile_entry *entries, *e;
+	ucl_object_t *top, *obj, *funcs, *elt;
+	guint i, j, n;
+
+	top = ucl_object_typed_new (UCL_ARRAY);
+	entries = g_malloc (sizeof (prof->entries[0]));
+
+	for (i = 0; i < RSPAMD_MAX_WORKERS_STAT; i ++) {
+		if (stat->workers[i].pid == 0) {
+			continue;
+		}
+
+		n = 0;
+
+		for (j = 0; j < RSPAMD_LUA_PROFILE_ENTRIES; j ++) {
+			e = &prof->entries[i][j];
+
+			if (e->hash != 0) {
+				memcpy (&entries[n], e, sizeof (*e));
+				entries[n].source[sizeof (e->source) - 1] = '\0';
+				entries[n].func[sizeof (e->func) - 1] = '\0';
+				n ++;
+			}
+		}
+
+		if (n == 0) {
+			continue;
+		}
+
+		qsort (entries, n, sizeof (*entries), rspamd_lua_profile_entry_cmp);
+		funcs = ucl_object_typed_new (UCL_ARRAY);
+
+		for (j = 0; j < n; j ++) {
+			e = &entries[j];
+			elt = ucl_object_typed_new (UCL_OBJECT);
+			ucl_object_insert_key (elt, ucl_object_fromstring (e->source),
+					"source", 0, false);
+			ucl_object_insert_key (elt, ucl_object_fromint (e->line),
+					"line", 0, false);
+			ucl_object_insert_key (elt, ucl_object_fromstring (e->func),
+					"function", 0, false);
+			ucl_object_insert_key (elt, ucl_object_fromint (e->samples),
+					"samples", 0, false);
+			ucl_object_insert_key (elt,
+					ucl_object_fromdouble (e->time / 1000.0),
+					"time", 0, false);
+			ucl_array_append (funcs, elt);
+		}
+
+		stat->workers[i].type[sizeof (stat->workers[i].type) - 1] = '\0';
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj, ucl_object_fromint (stat->workers[i].pid),
+				"pid", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromstring (stat->workers[i].type),
+				"type", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (prof->dropped[i]),
+				"dropped", 0, false);
+		ucl_object_insert_key (obj, funcs, "functions", 0, false);
+		ucl_array_append (top, obj);
+	}
+
+	g_free (entries);
+
+	return top;
+}
+
 lua_State *
 rspamd_lua_init (struct rspamd_config *cfg)
 {
 	lua_State *L;
+	gsize *used;
+
+	used = g_malloc0 (sizeof (*used));
+	L = lua_newstate (rspamd_lua_alloc, used);
+
+	if (L == NULL) {
+		/* LuaJIT does not allow custom allocators on 64 bit platforms */
+		g_free (used);
+		L = luaL_newstate ();
+	}
 
-	L = luaL_newstate ();
 	luaL_openlibs (L);
 
 	luaopen_logger (L);
@@ -213,7 +657,10 @@ rspamd_lua_init (struct rspamd_config *cfg)
 	luaopen_config (L);
 	luaopen_radix (L);
 	luaopen_hash_table (L);
+	luaopen_regexp_map (L);
+	luaopen_cdb_map (L);
 	luaopen_trie (L);
+	luaopen_rbl (L);
 	luaopen_task (L);
 	luaopen_textpart (L);
 	luaopen_mimepart (L);
@@ -235,13 +682,31 @@ rspamd_lua_init (struct rspamd_config *cfg)
 	luaopen_ip (L);
 	luaopen_expression (L);
 	luaopen_text (L);
+	luaopen_settings (L);
 	luaopen_util (L);
+	luaopen_async (L);
+	luaopen_buckets (L);
 
 	rspamd_lua_add_preload (L, "ucl", luaopen_ucl);
 
 	return L;
 }
 
+void
+rspamd_lua_close (lua_State *L)
+{
+	void *ud;
+
+	if (lua_getallocf (L, &ud) == rspamd_lua_alloc) {
+		lua_close (L);
+		/* Counter of the allocator is used until the state is closed */
+		g_free (ud);
+	}
+	else {
+		lua_close (L);
+	}
+}
+
 /**
  * Initialize new locked lua_State structure
  */
@@ -266,13 +731,167 @@ rspamd_free_lua_locked (struct lua_locked_state *st)
 {
 	g_assert (st != NULL);
 
-	lua_close (st->L);
-
+	rspamd_lua_close (st->L);
 	rspamd_mutex_free (st->m);
 
 	g_slice_free1 (sizeof (struct lua_locked_state), st);
 }
 
+static gint
+rspamd_lua_bytecode_writer (lua_State *L, const void *p, size_t sz, void *ud)
+{
+	GByteArray *out = ud;
+
+	g_byte_array_append (out, p, sz);
+
+	return 0;
+}
+
+static void
+rspamd_lua_dump_chunk (lua_State *L, GByteArray *out)
+{
+#if LUA_VERSION_NUM >= 503
+	lua_dump (L, rspamd_lua_bytecode_writer, out, 0);
+#else
+	lua_dump (L, rspamd_lua_bytecode_writer, out);
+#endif
+}
+
+/*
+ * Cache file name is a digest of the source, its path that is stored as
+ * chunk name and the bytecode header of the runtime, so sources compiled
+ * by another lua version are never loaded
+ */
+static gchar *
+rspamd_lua_cache_path (lua_State *L, struct rspamd_config *cfg,
+	const gchar *path, const gchar *src, gsize len)
+{
+	blake2b_state st;
+	guchar digest[BLAKE2B_OUTBYTES];
+	GByteArray *hdr;
+	gchar *b32, *res;
+
+	if (luaL_loadstring (L, "") != 0) {
+		lua_pop (L, 1);
+		return NULL;
+	}
+
+	hdr = g_byte_array_new ();
+	rspamd_lua_dump_chunk (L, hdr);
+	lua_pop (L, 1);
+
+	blake2b_init (&st, BLAKE2B_OUTBYTES);
+	blake2b_update (&st, RVERSION, sizeof (RVERSION));
+	blake2b_update (&st, hdr->data, hdr->len);
+	blake2b_update (&st, path, strlen (path) + 1);
+	blake2b_update (&st, src, len);
+	blake2b_final (&st, digest, sizeof (digest));
+	g_byte_array_free (hdr, TRUE);
+
+	b32 = rspamd_encode_base32 (digest, sizeof (digest));
+	res = g_strdup_printf ("%s%c%s.luac", cfg->lua_cache_dir, G_DIR_SEPARATOR,
+			b32);
+	g_free (b32);
+
+	return res;
+}
+
+static void
+rspamd_lua_cache_save (const gchar *cache_path, GByteArray *code)
+{
+	gchar *tmp;
+	gint fd;
+
+	tmp = g_strdup_printf ("%s.tmp%d", cache_path, (gint)getpid ());
+	fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 00600);
+
+	if (fd == -1) {
+		msg_info ("cannot create lua cache %s: %s", tmp, strerror (errno));
+		g_free (tmp);
+		return;
+	}
+
+	if (write (fd, code->data, code->len) != (gssize)code->len) {
+		msg_info ("cannot write lua cache %s: %s", tmp, strerror (errno));
+		close (fd);
+		unlink (tmp);
+	}
+	else {
+		close (fd);
+
+		/* Rename is atomic, so concurrent loaders see either old or new file */
+		if (rename (tmp, cache_path) == -1) {
+			msg_info ("cannot rename %s to %s: %s", tmp, cache_path,
+					strerror (errno));
+			unlink (tmp);
+		}
+	}
+
+	g_free (tmp);
+}
+
+gint
+rspamd_lua_load_file (lua_State *L, struct rspamd_config *cfg,
+	const gchar *path)
+{
+	gchar *src, *code, *cache_path, *chunkname;
+	const gchar *start;
+	gsize len, code_len;
+	GByteArray *out;
+	gint ret;
+
+	if (cfg == NULL || cfg->lua_cache_dir == NULL ||
+			!g_file_get_contents (path, &src, &len, NULL)) {
+		return luaL_loadfile (L, path);
+	}
+
+	start = src;
+
+	if (len > 0 && *src == '#') {
+		/* Skip shebang line as luaL_loadfile does, but keep line numbers */
+		while (len > 1 && *start != '\n') {
+			start ++;
+			len --;
+		}
+	}
+
+	chunkname = g_strconcat ("@", path, NULL);
+	cache_path = rspamd_lua_cache_path (L, cfg, path, start, len);
+
+	if (cache_path != NULL &&
+			g_file_get_contents (cache_path, &code, &code_len, NULL)) {
+		ret = luaL_loadbuffer (L, code, code_len, chunkname);
+		g_free (code);
+
+		if (ret == 0) {
+			g_free (cache_path);
+			g_free (chunkname);
+			g_free (src);
+
+			return 0;
+		}
+
+		msg_info ("cannot load cached bytecode %s of %s: %s", cache_path, path,
+				lua_tostring (L, -1));
+		lua_pop (L, 1);
+	}
+
+	ret = luaL_loadbuffer (L, start, len, chunkname);
+
+	if (ret == 0 && cache_path != NULL) {
+		out = g_byte_array_new ();
+		rspamd_lua_dump_chunk (L, out);
+		rspamd_lua_cache_save (cache_path, out);
+		g_byte_array_free (out, TRUE);
+	}
+
+	g_free (cache_path);
+	g_free (chunkname);
+	g_free (src);
+
+	return ret;
+}
+
 gboolean
 rspamd_init_lua_filters (struct rspamd_config *cfg)
 {
@@ -287,7 +906,7 @@ rspamd_init_lua_filters (struct rspamd_config *cfg)
 	while (cur) {
 		module = cur->data;
 		if (module->path) {
-			if (luaL_loadfile (L, module->path) != 0) {
+			if (rspamd_lua_load_file (L, cfg, module->path) != 0) {
 				msg_info ("load of %s failed: %s", module->path,
 					lua_tostring (L, -1));
 				cur = g_list_next (cur);
@@ -40,6 +40,12 @@ luaL_register (lua_State *L, const gchar *name, const struct luaL_reg *methods)
 }
 #endif
 
+#if LUA_VERSION_NUM > 501
+#define rspamd_lua_objlen(L, pos) lua_rawlen ((L), (pos))
+#else
+#define rspamd_lua_objlen(L, pos) lua_objlen ((L), (pos))
+#endif
+
 /* Interface definitions */
 #define LUA_FUNCTION_DEF(class, name) static gint lua_ ## class ## _ ## name ( \
 		lua_State * L)
@@ -120,6 +126,86 @@ gpointer rspamd_lua_check_class (lua_State *L, gint index, const gchar *name);
  */
 lua_State * rspamd_lua_init (struct rspamd_config *cfg);
 
+/**
+ * Close lua state created by `rspamd_lua_init` and free its memory counter
+ */
+void rspamd_lua_close (lua_State *L);
+
+/**
+ * Get number of bytes used by a lua state, it is counted by the allocator of
+ * the state or taken from the garbage collector if the allocator cannot be
+ * replaced
+ */
+gsize rspamd_lua_memory_used (lua_State *L);
+
+struct rspamd_lua_gc;
+
+/**
+ * Stop automatic garbage collection of a lua state and collect garbage by
+ * incremental steps when a worker is idle instead, full collection is done
+ * only if memory of the state is above the limit
+ * @param L lua state
+ * @param ev_base event base of a worker
+ * @param step size of a step in kilobytes
+ * @param max_memory memory limit that triggers full collection
+ * @param stat server statistics where time of collection is counted by pid
+ * @return new collector
+ */
+struct rspamd_lua_gc * rspamd_lua_gc_new (lua_State *L,
+	struct event_base *ev_base, guint step, gsize max_memory,
+	struct rspamd_stat *stat);
+
+/**
+ * Tell collector whether a worker has tasks in progress, steps are done while
+ * a worker is idle only
+ * @param gc collector
+ * @param idle TRUE if a worker has no tasks in progress
+ */
+void rspamd_lua_gc_set_idle (struct rspamd_lua_gc *gc, gboolean idle);
+
+/**
+ * Destroy collector and restore automatic garbage collection
+ * @param gc collector
+ */
+void rspamd_lua_gc_destroy (struct rspamd_lua_gc *gc);
+
+struct rspamd_lua_profile;
+
+/**
+ * Allocate shared table of lua profiles, it should be created before workers
+ * are forked
+ * @param pool shared memory pool
+ * @return new table of profiles
+ */
+struct rspamd_lua_profile * rspamd_lua_profile_new (rspamd_mempool_t *pool);
+
+/**
+ * Clear profile of a worker
+ * @param prof table of profiles
+ * @param slot index of the worker in statistics
+ */
+void rspamd_lua_profile_reset (struct rspamd_lua_profile *prof, guint slot);
+
+/**
+ * Start sampling of lua functions of the current process, samples are taken
+ * each `count` lua instructions and are written to the slot of the process
+ * @param L lua state
+ * @param prof table of profiles
+ * @param stat server statistics where slots of workers are registered
+ * @param count number of lua instructions between samples
+ */
+void rspamd_lua_profile_start (lua_State *L, struct rspamd_lua_profile *prof,
+	struct rspamd_stat *stat, guint count);
+
+/**
+ * Get profiles of all workers sorted by the time of functions
+ * @param prof table of profiles
+ * @param stat server statistics where slots of workers are registered
+ * @return array of profiles
+ */
+ucl_object_t * rspamd_lua_profile_to_ucl (struct rspamd_lua_profile *prof,
+	struct rspamd_stat *stat);
+
 /**
  * Load and initialize lua plugins
  */
@@ -155,7 +241,7 @@ struct rspamd_lua_text * lua_check_text (lua_State * L, gint pos);
  * Push specific header to lua
  */
 gint rspamd_lua_push_header (lua_State * L,
-	GHashTable *hdrs,
+	rspamd_pool_hash_t *hdrs,
 	const gchar *name,
 	gboolean strong,
 	gboolean full,
@@ -166,6 +252,56 @@ gint rspamd_lua_push_header (lua_State * L,
  */
 struct rspamd_task *lua_check_task (lua_State * L, gint pos);
 
+/*
+ * Plain C accessors for hot task fields, they are intended to be called from
+ * LuaJIT FFI using a pointer returned by task:get_ptr()
+ */
+gsize rspamd_lua_task_ffi_message_len (struct rspamd_task *task);
+guint rspamd_lua_task_ffi_urls_count (struct rspamd_task *task);
+guint rspamd_lua_task_ffi_emails_count (struct rspamd_task *task);
+guint rspamd_lua_task_ffi_text_parts_count (struct rspamd_task *task);
+const gchar * rspamd_lua_task_ffi_message_id (struct rspamd_task *task);
+
+/**
+ * Called when a coroutine is finished, status is 0 if it has returned normally
+ * and the returned values are on the stack of `co`, otherwise the error
+ * message is on the top of the stack
+ */
+typedef void (*rspamd_lua_coroutine_fin_t) (lua_State *co, gint status,
+	gpointer ud);
+
+/**
+ * Return the main lua state for any thread, the states that are stored to
+ * call lua callbacks later must be the main ones as a coroutine might be
+ * suspended or finished when a callback is called
+ */
+lua_State * rspamd_lua_main_state (lua_State *L);
+
+/**
+ * Get a coroutine from the pool of idle threads or create a new one, a caller
+ * should push a function with its arguments to the returned state and call
+ * rspamd_lua_coroutine_resume
+ */
+lua_State * rspamd_lua_coroutine_new (lua_State *L,
+	rspamd_lua_coroutine_fin_t fin,
+	gpointer ud);
+
+/**
+ * Start or resume a coroutine with `nargs` arguments on its stack, `fin` is
+ * called when the coroutine is finished and it is returned to the pool
+ */
+void rspamd_lua_coroutine_resume (lua_State *co, gint nargs);
+
+/**
+ * Forget about a suspended coroutine, its `fin` callback is not called
+ */
+void rspamd_lua_coroutine_abort (lua_State *co);
+
+/**
+ * Returns TRUE if `L` is a coroutine created by rspamd_lua_coroutine_new
+ */
+gboolean rspamd_lua_coroutine_yieldable (lua_State *L);
+
 /**
  * Push ip address from a string (nil is pushed if a string cannot be converted)
  */
@@ -189,7 +325,10 @@ void luaopen_config (lua_State *L);
 void luaopen_metric (lua_State *L);
 void luaopen_radix (lua_State *L);
 void luaopen_hash_table (lua_State *L);
+void luaopen_regexp_map (lua_State *L);
+void luaopen_cdb_map (lua_State *L);
 void luaopen_trie (lua_State * L);
+void luaopen_rbl (lua_State * L);
 void luaopen_textpart (lua_State *L);
 void luaopen_mimepart (lua_State *L);
 void luaopen_image (lua_State *L);
@@ -211,7 +350,10 @@ void luaopen_ip (lua_State * L);
 void luaopen_expression (lua_State * L);
 void luaopen_logger (lua_State * L);
 void luaopen_text (lua_State *L);
+void luaopen_settings (lua_State *L);
 void luaopen_util (lua_State * L);
+void luaopen_async (lua_State * L);
+void luaopen_buckets (lua_State * L);
 
 gint rspamd_lua_call_filter (const gchar *function, struct rspamd_task *task);
 gint rspamd_lua_call_chain_filter (const gchar *function,
@@ -254,6 +396,18 @@ void rspamd_lua_dumpstack (lua_State *L);
 /* Set lua path according to the configuration */
 void rspamd_lua_set_path (lua_State *L, struct rspamd_config *cfg);
 
+/**
+ * Load lua file as a chunk on the top of the stack like luaL_loadfile does.
+ * If `lua_cache_dir` is set, then compiled bytecode is stored there and it is
+ * used instead of compiling while the source and lua runtime are the same
+ * @param L lua state
+ * @param cfg configuration
+ * @param path file to load
+ * @return 0 on success or luaL_loadfile error code with message on the stack
+ */
+gint rspamd_lua_load_file (lua_State *L, struct rspamd_config *cfg,
+	const gchar *path);
+
 struct memory_pool_s * rspamd_lua_check_mempool (lua_State * L, gint pos);
 struct rspamd_config * lua_check_config (lua_State * L, gint pos);
 
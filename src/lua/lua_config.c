@@ -28,6 +28,7 @@
 #include "message.h"
 #include "radix.h"
 #include "expression.h"
+#include "mime_expressions.h"
 #include "utlist.h"
 
 /***
@@ -108,7 +109,9 @@ end
 LUA_FUNCTION_DEF (config, radix_from_config);
 /***
  * @method rspamd_config:add_hash_map(mapline[, description])
- * Creates new dynamic map string objects.
+ * Creates new dynamic map string objects. If mapline is `cdb://path`, then
+ * constant database is used instead of a list, it is mapped to memory and
+ * shared by all processes.
  * @param {string} mapline URL for a map
  * @param {string} description optional map description
  * @return {hash} hash set object
@@ -145,6 +148,32 @@ local function foo(task)
 end
  */
 LUA_FUNCTION_DEF (config, add_kv_map);
+/***
+ * @method rspamd_config:add_regexp_map(mapline[, description[, type]])
+ * Creates new dynamic map of regular expressions. Each line of a map is
+ * either a plain pattern or a pattern enclosed in slashes with flags, e.g.
+ * `/^spam.*\.example\.com$/i`. If type is `glob` then lines are treated as
+ * shell-like patterns (`*.example.com`) that match the whole string
+ * caselessly. All entries are checked at once on each lookup.
+ * @param {string} mapline URL for a map
+ * @param {string} description optional map description
+ * @param {string} type optional type of entries: `regexp` (default) or `glob`
+ * @return {regexp_map} regexp map object
+ * @example
+local re_map = rspamd_config:add_regexp_map ('file:///path/to/file', 'my regexp map')
+...
+local function foo(task)
+	local from = task:get_from()
+	if from then
+		local matched = re_map:match(from[1]['addr'])
+		if matched then
+			return true,matched[1]
+		end
+	end
+	return false
+end
+ */
+LUA_FUNCTION_DEF (config, add_regexp_map);
 /***
  * @method rspamd_config:add_map(mapline[, description], callback)
  * Creates new dynamic map with free-form callback
@@ -193,6 +222,19 @@ LUA_FUNCTION_DEF (config, register_symbols);
  * @param {number} weight initial weight of symbol (can be less than zero to specify non-spam symbols)
  */
 LUA_FUNCTION_DEF (config, register_virtual_symbol);
+/***
+ * @method rspamd_config:register_mime_expression(name, weight, expression)
+ * Register symbol that is inserted when a mime expression (the same as used
+ * by the regexp module) is true. The expression is evaluated natively: regexp
+ * atoms are cached per task and matched by the multi-pattern engine if it is
+ * available, lua functions are called merely for atoms that are identified
+ * by the names of global functions.
+ * @param {string} name symbol's name
+ * @param {number} weight initial weight of symbol
+ * @param {string} expression mime expression
+ * @return {boolean} true if expression has been parsed and symbol registered
+ */
+LUA_FUNCTION_DEF (config, register_mime_expression);
 /***
  * @method rspamd_config:register_callback_symbol(name, weight, callback)
  * Register callback function to be called for a specified symbol with initial weight. Symbol itself is
@@ -203,6 +245,16 @@ LUA_FUNCTION_DEF (config, register_virtual_symbol);
  */
 LUA_FUNCTION_DEF (config, register_callback_symbol);
 LUA_FUNCTION_DEF (config, register_callback_symbol_priority);
+/***
+ * @method rspamd_config:register_dependency(symbol, dependency)
+ * Makes `symbol` to be checked only after `dependency` symbol is checked and
+ * all its asynchronous requests (e.g. DNS) are finished.
+ * @param {string} symbol symbol's name
+ * @param {string} dependency name of symbol that `symbol` depends on
+ * @example
+rspamd_config:register_dependency('DMARC_CHECK', 'R_SPF_FAIL')
+ */
+LUA_FUNCTION_DEF (config, register_dependency);
 
 /**
  * @method rspamd_config:set_metric_symbol(name, weight, [description], [metric])
@@ -298,13 +350,16 @@ static const struct luaL_reg configlib_m[] = {
 	LUA_INTERFACE_DEF (config, radix_from_config),
 	LUA_INTERFACE_DEF (config, add_hash_map),
 	LUA_INTERFACE_DEF (config, add_kv_map),
+	LUA_INTERFACE_DEF (config, add_regexp_map),
 	LUA_INTERFACE_DEF (config, add_map),
 	LUA_INTERFACE_DEF (config, get_classifier),
 	LUA_INTERFACE_DEF (config, register_symbol),
 	LUA_INTERFACE_DEF (config, register_symbols),
 	LUA_INTERFACE_DEF (config, register_virtual_symbol),
+	LUA_INTERFACE_DEF (config, register_mime_expression),
 	LUA_INTERFACE_DEF (config, register_callback_symbol),
 	LUA_INTERFACE_DEF (config, register_callback_symbol_priority),
+	LUA_INTERFACE_DEF (config, register_dependency),
 	LUA_INTERFACE_DEF (config, set_metric_symbol),
 	LUA_INTERFACE_DEF (config, add_composite),
 	LUA_INTERFACE_DEF (config, register_module_option),
@@ -336,6 +391,26 @@ static const struct luaL_reg hashlib_m[] = {
 	{NULL, NULL}
 };
 
+/* CDB map */
+LUA_FUNCTION_DEF (cdb_map, get_key);
+
+static const struct luaL_reg cdbmaplib_m[] = {
+	LUA_INTERFACE_DEF (cdb_map, get_key),
+	{"__tostring", rspamd_lua_class_tostring},
+	{NULL, NULL}
+};
+
+/* Regexp map */
+LUA_FUNCTION_DEF (regexp_map, get_key);
+LUA_FUNCTION_DEF (regexp_map, match);
+
+static const struct luaL_reg regexpmaplib_m[] = {
+	LUA_INTERFACE_DEF (regexp_map, get_key),
+	LUA_INTERFACE_DEF (regexp_map, match),
+	{"__tostring", rspamd_lua_class_tostring},
+	{NULL, NULL}
+};
+
 struct rspamd_config *
 lua_check_config (lua_State * L, gint pos)
 {
@@ -360,6 +435,22 @@ lua_check_hash_table (lua_State * L)
 	return ud ? **((GHashTable ***)ud) : NULL;
 }
 
+static struct cdb *
+lua_check_cdb_map (lua_State * L)
+{
+	void *ud = luaL_checkudata (L, 1, "rspamd{cdb_map}");
+	luaL_argcheck (L, ud != NULL, 1, "'cdb_map' expected");
+	return ud ? **((struct cdb ***)ud) : NULL;
+}
+
+static struct rspamd_regexp_map *
+lua_check_regexp_map (lua_State * L)
+{
+	void *ud = luaL_checkudata (L, 1, "rspamd{regexp_map}");
+	luaL_argcheck (L, ud != NULL, 1, "'regexp_map' expected");
+	return ud ? **((struct rspamd_regexp_map ***)ud) : NULL;
+}
+
 /*** Config functions ***/
 static gint
 lua_config_get_api_version (lua_State *L)
@@ -515,10 +606,13 @@ rspamd_lua_call_post_filters (struct rspamd_task *task)
 	struct lua_callback_data *cd;
 	struct rspamd_task **ptask;
 	GList *cur;
+	gint span;
 
 	cur = task->cfg->post_filters;
 	while (cur) {
 		cd = cur->data;
+		span = rspamd_task_span_start (task, "post_filter",
+				cd->cb_is_ref ? "local function" : cd->callback.name);
 		if (cd->cb_is_ref) {
 			lua_rawgeti (cd->L, LUA_REGISTRYINDEX, cd->callback.ref);
 		}
@@ -535,6 +629,7 @@ rspamd_lua_call_post_filters (struct rspamd_task *task)
 				cd->callback.name,
 				lua_tostring (cd->L, -1));
 		}
+		rspamd_task_span_end (task, span);
 		cur = g_list_next (cur);
 	}
 }
@@ -575,10 +670,13 @@ rspamd_lua_call_pre_filters (struct rspamd_task *task)
 	struct lua_callback_data *cd;
 	struct rspamd_task **ptask;
 	GList *cur;
+	gint span;
 
 	cur = task->cfg->pre_filters;
 	while (cur) {
 		cd = cur->data;
+		span = rspamd_task_span_start (task, "pre_filter",
+				cd->cb_is_ref ? "local function" : cd->callback.name);
 		if (cd->cb_is_ref) {
 			lua_rawgeti (cd->L, LUA_REGISTRYINDEX, cd->callback.ref);
 		}
@@ -595,6 +693,7 @@ rspamd_lua_call_pre_filters (struct rspamd_task *task)
 				cd->callback.name,
 				lua_tostring (cd->L, -1));
 		}
+		rspamd_task_span_end (task, span);
 		cur = g_list_next (cur);
 	}
 }
@@ -698,6 +797,36 @@ lua_config_radix_from_config (lua_State *L)
 	}
 }
 
+static void
+lua_config_cdb_map_dtor (gpointer p)
+{
+	struct cdb **r = p;
+
+	rspamd_cdb_map_free (*r);
+}
+
+static gint
+lua_config_add_cdb_map (lua_State *L, struct rspamd_config *cfg,
+	const gchar *map_line, const gchar *description)
+{
+	struct cdb **r, ***ud;
+
+	r = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (struct cdb *));
+	if (!rspamd_map_add (cfg, map_line, description, NULL, NULL, (void **)r)) {
+		msg_warn ("invalid cdb map %s", map_line);
+		lua_pushnil (L);
+		return 1;
+	}
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+		lua_config_cdb_map_dtor,
+		r);
+	ud = lua_newuserdata (L, sizeof (struct cdb *));
+	*ud = r;
+	rspamd_lua_setclass (L, "rspamd{cdb_map}", -1);
+
+	return 1;
+}
+
 static gint
 lua_config_add_hash_map (lua_State *L)
 {
@@ -708,6 +837,11 @@ lua_config_add_hash_map (lua_State *L)
 	if (cfg) {
 		map_line = luaL_checkstring (L, 2);
 		description = lua_tostring (L, 3);
+
+		if (rspamd_map_is_cdb (map_line)) {
+			return lua_config_add_cdb_map (L, cfg, map_line, description);
+		}
+
 		r = rspamd_mempool_alloc (cfg->cfg_pool, sizeof (GHashTable *));
 		*r = g_hash_table_new (rspamd_strcase_hash, rspamd_strcase_equal);
 		if (!rspamd_map_add (cfg, map_line, description, rspamd_hosts_read, rspamd_hosts_fin,
@@ -732,6 +866,58 @@ lua_config_add_hash_map (lua_State *L)
 
 }
 
+static void
+lua_config_regexp_map_dtor (gpointer p)
+{
+	struct rspamd_regexp_map **r = p;
+
+	rspamd_regexp_map_free (*r);
+}
+
+static gint
+lua_config_add_regexp_map (lua_State *L)
+{
+	struct rspamd_config *cfg = lua_check_config (L, 1);
+	const gchar *map_line, *description, *type;
+	struct rspamd_regexp_map **r, ***ud;
+	map_cb_t read_cb = rspamd_regexp_list_read;
+
+	if (cfg) {
+		map_line = luaL_checkstring (L, 2);
+		description = lua_tostring (L, 3);
+		type = lua_tostring (L, 4);
+
+		if (type != NULL && g_ascii_strcasecmp (type, "glob") == 0) {
+			read_cb = rspamd_glob_list_read;
+		}
+		else if (type != NULL && g_ascii_strcasecmp (type, "regexp") != 0) {
+			msg_err ("invalid type of regexp map %s: %s", map_line, type);
+			lua_pushnil (L);
+			return 1;
+		}
+
+		r = rspamd_mempool_alloc0 (cfg->cfg_pool,
+				sizeof (struct rspamd_regexp_map *));
+		if (!rspamd_map_add (cfg, map_line, description, read_cb,
+			rspamd_regexp_list_fin, (void **)r)) {
+			msg_warn ("invalid regexp map %s", map_line);
+			lua_pushnil (L);
+			return 1;
+		}
+		rspamd_mempool_add_destructor (cfg->cfg_pool,
+			lua_config_regexp_map_dtor,
+			r);
+		ud = lua_newuserdata (L, sizeof (struct rspamd_regexp_map *));
+		*ud = r;
+		rspamd_lua_setclass (L, "rspamd{regexp_map}", -1);
+
+		return 1;
+	}
+
+	lua_pushnil (L);
+	return 1;
+}
+
 static gint
 lua_config_add_kv_map (lua_State *L)
 {
@@ -742,6 +928,11 @@ lua_config_add_kv_map (lua_State *L)
 	if (cfg) {
 		map_line = luaL_checkstring (L, 2);
 		description = lua_tostring (L, 3);
+
+		if (rspamd_map_is_cdb (map_line)) {
+			return lua_config_add_cdb_map (L, cfg, map_line, description);
+		}
+
 		r = rspamd_mempool_alloc (cfg->cfg_pool, sizeof (GHashTable *));
 		*r = g_hash_table_new (rspamd_strcase_hash, rspamd_strcase_equal);
 		if (!rspamd_map_add (cfg, map_line, description, rspamd_kv_list_read, rspamd_kv_list_fin,
@@ -791,30 +982,30 @@ lua_config_get_key (lua_State *L)
 	return 1;
 }
 
+struct lua_callback_state {
+	struct lua_callback_data *cd;
+	struct rspamd_task *task;
+	lua_State *co;
+};
+
 static void
-lua_metric_symbol_callback (struct rspamd_task *task, gpointer ud)
+lua_metric_symbol_callback_fin (lua_State *co, gint status, gpointer ud)
 {
-	struct lua_callback_data *cd = ud;
-	struct rspamd_task **ptask;
-	gint level = lua_gettop (cd->L), nresults;
+	struct lua_callback_state *cbs = ud;
+	struct lua_callback_data *cd = cbs->cd;
+	struct rspamd_task *task = cbs->task;
+	gint nresults;
 
-	if (cd->cb_is_ref) {
-		lua_rawgeti (cd->L, LUA_REGISTRYINDEX, cd->callback.ref);
-	}
-	else {
-		lua_getglobal (cd->L, cd->callback.name);
-	}
-	ptask = lua_newuserdata (cd->L, sizeof (struct rspamd_task *));
-	rspamd_lua_setclass (cd->L, "rspamd{task}", -1);
-	*ptask = task;
+	cbs->co = NULL;
 
-	if (lua_pcall (cd->L, 1, LUA_MULTRET, 0) != 0) {
+	if (status != 0) {
 		msg_info ("call to (%s)%s failed: %s", cd->symbol,
 			cd->cb_is_ref ? "local function" : cd->callback.name,
-			lua_tostring (cd->L, -1));
+			lua_tostring (co, -1));
+		return;
 	}
 
-	nresults = lua_gettop (cd->L) - level;
+	nresults = lua_gettop (co);
 	if (nresults >= 1) {
 		/* Function returned boolean, so maybe we need to insert result? */
 		gboolean res;
@@ -822,20 +1013,20 @@ lua_metric_symbol_callback (struct rspamd_task *task, gpointer ud)
 		gint i;
 		gdouble flag = 1.0;
 
-		if (lua_type (cd->L, level + 1) == LUA_TBOOLEAN) {
-			res = lua_toboolean (cd->L, level + 1);
+		if (lua_type (co, 1) == LUA_TBOOLEAN) {
+			res = lua_toboolean (co, 1);
 			if (res) {
 				gint first_opt = 2;
 
-				if (lua_type (cd->L, level + 2) == LUA_TNUMBER) {
-					flag = lua_tonumber (cd->L, level + 2);
+				if (lua_type (co, 2) == LUA_TNUMBER) {
+					flag = lua_tonumber (co, 2);
 					/* Shift opt index */
 					first_opt = 3;
 				}
 
-				for (i = lua_gettop (cd->L); i >= level + first_opt; i --) {
-					if (lua_type (cd->L, i) == LUA_TSTRING) {
-						const char *opt = lua_tostring (cd->L, i);
+				for (i = nresults; i >= first_opt; i --) {
+					if (lua_type (co, i) == LUA_TSTRING) {
+						const char *opt = lua_tostring (co, i);
 
 						opts = g_list_prepend (opts,
 							rspamd_mempool_strdup (task->task_pool, opt));
@@ -844,7 +1035,53 @@ lua_metric_symbol_callback (struct rspamd_task *task, gpointer ud)
 				rspamd_task_insert_result (task, cd->symbol, flag, opts);
 			}
 		}
-		lua_pop (cd->L, nresults);
+		lua_pop (co, nresults);
+	}
+}
+
+static void
+lua_metric_symbol_callback_abort (gpointer ud)
+{
+	struct lua_callback_state *cbs = ud;
+
+	if (cbs->co != NULL) {
+		/* Task is finished whilst callback is still waiting for results */
+		rspamd_lua_coroutine_abort (cbs->co);
+		cbs->co = NULL;
+	}
+}
+
+static void
+lua_metric_symbol_callback (struct rspamd_task *task, gpointer ud)
+{
+	struct lua_callback_data *cd = ud;
+	struct lua_callback_state *cbs;
+	struct rspamd_task **ptask;
+	lua_State *co;
+
+	cbs = rspamd_mempool_alloc (task->task_pool, sizeof (*cbs));
+	cbs->cd = cd;
+	cbs->task = task;
+	/* Callback is executed in a coroutine to allow it to yield */
+	co = rspamd_lua_coroutine_new (cd->L, lua_metric_symbol_callback_fin, cbs);
+	cbs->co = co;
+
+	if (cd->cb_is_ref) {
+		lua_rawgeti (co, LUA_REGISTRYINDEX, cd->callback.ref);
+	}
+	else {
+		lua_getglobal (co, cd->callback.name);
+	}
+	ptask = lua_newuserdata (co, sizeof (struct rspamd_task *));
+	rspamd_lua_setclass (co, "rspamd{task}", -1);
+	*ptask = task;
+
+	rspamd_lua_coroutine_resume (co, 1);
+
+	if (cbs->co != NULL) {
+		/* Callback is suspended until some asynchronous event */
+		rspamd_mempool_add_destructor (task->task_pool,
+				lua_metric_symbol_callback_abort, cbs);
 	}
 }
 
@@ -990,6 +1227,60 @@ lua_config_register_virtual_symbol (lua_State * L)
 	return 0;
 }
 
+struct lua_mime_expression_item {
+	struct rspamd_expression *expr;
+	const gchar *symbol;
+};
+
+static void
+lua_config_mime_expression_callback (struct rspamd_task *task, gpointer ud)
+{
+	struct lua_mime_expression_item *item = ud;
+	gint res;
+
+	res = rspamd_process_expression (item->expr, 0, task);
+
+	if (res) {
+		rspamd_task_insert_result (task, item->symbol, res, NULL);
+	}
+}
+
+static gint
+lua_config_register_mime_expression (lua_State *L)
+{
+	struct rspamd_config *cfg = lua_check_config (L, 1);
+	struct lua_mime_expression_item *item;
+	struct rspamd_expression *expr = NULL;
+	const gchar *name, *line;
+	GError *err = NULL;
+	gdouble weight;
+	gboolean ret = FALSE;
+
+	name = luaL_checkstring (L, 2);
+	weight = luaL_checknumber (L, 3);
+	line = luaL_checkstring (L, 4);
+
+	if (cfg && name && line) {
+		if (!rspamd_parse_expression (line, 0, &mime_expr_subr, cfg,
+				cfg->cfg_pool, &err, &expr)) {
+			msg_info ("cannot parse mime expression for %s: %e", name, err);
+			g_error_free (err);
+		}
+		else {
+			item = rspamd_mempool_alloc (cfg->cfg_pool, sizeof (*item));
+			item->expr = expr;
+			item->symbol = rspamd_mempool_strdup (cfg->cfg_pool, name);
+			register_symbol (&cfg->cache, item->symbol, weight,
+					lua_config_mime_expression_callback, item);
+			ret = TRUE;
+		}
+	}
+
+	lua_pushboolean (L, ret);
+
+	return 1;
+}
+
 static gint
 lua_config_register_callback_symbol (lua_State * L)
 {
@@ -1054,6 +1345,19 @@ lua_config_register_callback_symbol_priority (lua_State * L)
 	return 0;
 }
 
+static gint
+lua_config_register_dependency (lua_State * L)
+{
+	struct rspamd_config *cfg = lua_check_config (L, 1);
+	const gchar *name = luaL_checkstring (L, 2), *dep = luaL_checkstring (L, 3);
+
+	if (cfg && name && dep) {
+		rspamd_symbols_cache_add_dependency (cfg->cache, name, dep);
+	}
+
+	return 0;
+}
+
 static gint
 lua_config_set_metric_symbol (lua_State * L)
 {
@@ -1445,6 +1749,94 @@ lua_hash_table_get_key (lua_State * L)
 	return 1;
 }
 
+/***
+ * @method cdb_map:get_key(key)
+ * Finds key in a constant database map
+ * @param {string} key key to find, it is matched caselessly
+ * @return {string|nil} value of key or nil
+ */
+static gint
+lua_cdb_map_get_key (lua_State * L)
+{
+	struct cdb *cdb = lua_check_cdb_map (L);
+	const gchar *key, *value;
+	gsize len, vlen = 0;
+
+	if (cdb) {
+		key = luaL_checklstring (L, 2, &len);
+
+		if ((value = rspamd_match_cdb_map (cdb, key, len, &vlen)) != NULL) {
+			lua_pushlstring (L, value, vlen);
+			return 1;
+		}
+	}
+
+	lua_pushnil (L);
+	return 1;
+}
+
+static gint
+lua_regexp_map_get_key (lua_State * L)
+{
+	struct rspamd_regexp_map *re_map = lua_check_regexp_map (L);
+	const gchar *key;
+	gsize len;
+	GArray *ids;
+	gboolean ret = FALSE;
+
+	if (re_map) {
+		key = luaL_checklstring (L, 2, &len);
+		ids = rspamd_match_regexp_map (re_map, key, len);
+
+		if (ids != NULL) {
+			ret = TRUE;
+			g_array_free (ids, TRUE);
+		}
+	}
+
+	lua_pushboolean (L, ret);
+	return 1;
+}
+
+/***
+ * @method regexp_map:match(str)
+ * Checks string against all entries of a map, returns table of the matched
+ * map lines in order of their appearance in a map or nil
+ * @param {string} str string to check
+ * @return {table|nil} matched patterns
+ */
+static gint
+lua_regexp_map_match (lua_State * L)
+{
+	struct rspamd_regexp_map *re_map = lua_check_regexp_map (L);
+	const gchar *key;
+	gsize len;
+	GArray *ids;
+	guint i;
+
+	if (re_map) {
+		key = luaL_checklstring (L, 2, &len);
+		ids = rspamd_match_regexp_map (re_map, key, len);
+
+		if (ids != NULL) {
+			lua_createtable (L, ids->len, 0);
+
+			for (i = 0; i < ids->len; i ++) {
+				lua_pushstring (L, rspamd_regexp_map_pattern (re_map,
+						g_array_index (ids, guint, i)));
+				lua_rawseti (L, -2, i + 1);
+			}
+
+			g_array_free (ids, TRUE);
+
+			return 1;
+		}
+	}
+
+	lua_pushnil (L);
+	return 1;
+}
+
 /* Trie functions */
 
 /* Init functions */
@@ -1473,3 +1865,19 @@ luaopen_hash_table (lua_State * L)
 
 	lua_pop (L, 1);                      /* remove metatable from stack */
 }
+
+void
+luaopen_cdb_map (lua_State * L)
+{
+	rspamd_lua_new_class (L, "rspamd{cdb_map}", cdbmaplib_m);
+
+	lua_pop (L, 1);                      /* remove metatable from stack */
+}
+
+void
+luaopen_regexp_map (lua_State * L)
+{
+	rspamd_lua_new_class (L, "rspamd{regexp_map}", regexpmaplib_m);
+
+	lua_pop (L, 1);                      /* remove metatable from stack */
+}
@@ -248,7 +248,7 @@ lua_dns_resolver_resolve_common (lua_State *L,
 	if (pool != NULL && session != NULL && to_resolve != NULL &&
 		lua_isfunction (L, first + 3)) {
 		cbdata = rspamd_mempool_alloc (pool, sizeof (struct lua_dns_cbdata));
-		cbdata->L = L;
+		cbdata->L = rspamd_lua_main_state (L);
 		cbdata->resolver = resolver;
 		if (type != RDNS_REQUEST_PTR) {
 			cbdata->to_resolve = rspamd_mempool_strdup (pool, to_resolve);
@@ -25,6 +25,7 @@
 #include "buffer.h"
 #include "dns.h"
 #include "http.h"
+#include "http_pool.h"
 #include "utlist.h"
 
 /***
@@ -70,8 +71,10 @@ struct lua_http_cbdata {
 	struct timeval tv;
 	rspamd_inet_addr_t *addr;
 	gchar *mime_type;
+	struct rspamd_http_pool *pool;
 	gint fd;
 	gint cbref;
+	gboolean reuse;
 };
 
 static const int default_http_timeout = 5000;
@@ -94,7 +97,11 @@ lua_http_fin (gpointer arg)
 	struct lua_http_cbdata *cbd = (struct lua_http_cbdata *)arg;
 
 	luaL_unref (cbd->L, LUA_REGISTRYINDEX, cbd->cbref);
-	if (cbd->conn) {
+	if (cbd->conn && cbd->pool) {
+		/* Connection is kept if its reply has been read completely */
+		rspamd_http_pool_release (cbd->pool, cbd->conn, cbd->reuse);
+	}
+	else if (cbd->conn) {
 		/* Here we already have a connection, so we need to unref it */
 		rspamd_http_connection_unref (cbd->conn);
 	}
@@ -172,6 +179,7 @@ lua_http_finish_handler (struct rspamd_http_connection *conn,
 		msg_info ("callback call failed: %s", lua_tostring (cbd->L, -1));
 	}
 
+	cbd->reuse = (msg->flags & RSPAMD_HTTP_FLAG_KEEP_ALIVE) != 0;
 	lua_http_maybe_free (cbd);
 
 	return 0;
@@ -183,16 +191,33 @@ lua_http_make_connection (struct lua_http_cbdata *cbd)
 	int fd;
 
 	rspamd_inet_address_set_port (cbd->addr, cbd->msg->port);
-	fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM, TRUE);
 
-	if (fd == -1) {
-		msg_info ("cannot connect to %v", cbd->msg->host);
-		return FALSE;
+	if (cbd->pool) {
+		cbd->conn = rspamd_http_pool_connect (cbd->pool, cbd->ev_base,
+				cbd->addr, NULL, NULL, lua_http_error_handler,
+				lua_http_finish_handler, RSPAMD_HTTP_CLIENT_SIMPLE);
+
+		if (cbd->conn == NULL) {
+			msg_info ("cannot connect to %v", cbd->msg->host);
+			return FALSE;
+		}
+
+		/* Socket is owned by pool */
+		fd = cbd->conn->fd;
+		cbd->msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+	}
+	else {
+		fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM, TRUE);
+
+		if (fd == -1) {
+			msg_info ("cannot connect to %v", cbd->msg->host);
+			return FALSE;
+		}
+		cbd->fd = fd;
+		cbd->conn = rspamd_http_connection_new (NULL, lua_http_error_handler,
+				lua_http_finish_handler, RSPAMD_HTTP_CLIENT_SIMPLE,
+				RSPAMD_HTTP_CLIENT, NULL);
 	}
-	cbd->fd = fd;
-	cbd->conn = rspamd_http_connection_new (NULL, lua_http_error_handler,
-			lua_http_finish_handler, RSPAMD_HTTP_CLIENT_SIMPLE,
-			RSPAMD_HTTP_CLIENT, NULL);
 
 	rspamd_http_connection_write_message (cbd->conn, cbd->msg,
 			NULL, cbd->mime_type, cbd, fd, &cbd->tv, cbd->ev_base);
@@ -262,6 +287,7 @@ lua_http_push_headers (lua_State *L, struct rspamd_http_message *msg)
  * @param {string} mime_type MIME type of the HTTP content (for example, `text/html`)
  * @param {string/text} body full body content, can be opaque `rspamd{text}` to avoid data copying
  * @param {number} timeout floating point request timeout value in seconds (default is 5.0 seconds)
+ * @param {boolean} keepalive reuse persistent connections of the worker if `task` is specified (default is `true`)
  * @return {boolean} `true` if a request has been successfuly scheduled. If this value is `false` then some error occurred, the callback thus will not be called
  */
 static gint
@@ -278,6 +304,7 @@ lua_http_request (lua_State *L)
 	struct rspamd_task *task = NULL;
 	gdouble timeout = default_http_timeout;
 	gchar *mime_type = NULL;
+	gboolean keepalive = TRUE;
 
 	if (lua_gettop (L) >= 2) {
 		/* url, callback and event_base format */
@@ -391,6 +418,13 @@ lua_http_request (lua_State *L)
 		}
 		lua_pop (L, 1);
 
+		lua_pushstring (L, "keepalive");
+		lua_gettable (L, -2);
+		if (lua_type (L, -1) == LUA_TBOOLEAN) {
+			keepalive = lua_toboolean (L, -1);
+		}
+		lua_pop (L, 1);
+
 		lua_pushstring (L, "mime_type");
 		lua_gettable (L, -2);
 		if (lua_type (L, -1) == LUA_TSTRING) {
@@ -429,13 +463,24 @@ lua_http_request (lua_State *L)
 	}
 
 	cbd = g_slice_alloc0 (sizeof (*cbd));
-	cbd->L = L;
+	cbd->L = rspamd_lua_main_state (L);
 	cbd->cbref = cbref;
 	cbd->msg = msg;
 	cbd->ev_base = ev_base;
 	cbd->mime_type = mime_type;
-	msec_to_tv (timeout, &cbd->tv);
+	/* Do not wait for the reply after the deadline of the session */
+	double_to_tv (rspamd_session_clamp_timeout (session, timeout / 1000.),
+			&cbd->tv);
 	cbd->fd = -1;
+
+	if (task != NULL && keepalive) {
+		/* Pool is created after fork, so each worker has its own connections */
+		if (task->cfg->http_pool == NULL) {
+			task->cfg->http_pool = rspamd_http_pool_init ();
+		}
+
+		cbd->pool = task->cfg->http_pool;
+	}
 	if (session) {
 		cbd->session = session;
 		register_async_event (session,
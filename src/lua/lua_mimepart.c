@@ -97,12 +97,28 @@ LUA_FUNCTION_DEF (textpart, get_fuzzy);
  * @return {string} short abbreviation (such as `ru`) for the script's language
  */
 LUA_FUNCTION_DEF (textpart, get_language);
+/***
+ * @method text_part:get_chars()
+ * Returns counters of characters of the part that are computed once when the
+ * part is parsed and used by language detection and chartable module
+ * @return {table} `letters` (number of letters), `letter_pairs` (adjacent bytes of ASCII letters or non-ASCII characters), `script_changes` (adjacent ASCII letter and non-ASCII bytes), `lines` and `utf` (whether the content is valid UTF-8) or nil for empty parts
+ */
+LUA_FUNCTION_DEF (textpart, get_chars);
 /***
  * @method text_part:get_mimepart()
  * Returns the mime part object corresponding to this text part
  * @return {mimepart} mimepart object
  */
 LUA_FUNCTION_DEF (textpart, get_mimepart);
+/***
+ * @method text_part:get_words(task, [normalized])
+ * Returns words of the text part, words are extracted once and shared with
+ * statistics and fuzzy checks
+ * @param {task} task the task which the text part belongs to
+ * @param {boolean} normalized return stemmed or lowercased words
+ * @return {table of strings} words of the part or nil
+ */
+LUA_FUNCTION_DEF (textpart, get_words);
 /***
  * @method text_part:compare_distance(other)
  * Calculates the difference to another text part.  This function is intended to work with
@@ -123,7 +139,9 @@ static const struct luaL_reg textpartlib_m[] = {
 	LUA_INTERFACE_DEF (textpart, is_html),
 	LUA_INTERFACE_DEF (textpart, get_fuzzy),
 	LUA_INTERFACE_DEF (textpart, get_language),
+	LUA_INTERFACE_DEF (textpart, get_chars),
 	LUA_INTERFACE_DEF (textpart, get_mimepart),
+	LUA_INTERFACE_DEF (textpart, get_words),
 	LUA_INTERFACE_DEF (textpart, compare_distance),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
@@ -387,6 +405,73 @@ lua_textpart_get_language (lua_State * L)
 	return 1;
 }
 
+static gint
+lua_textpart_get_chars (lua_State * L)
+{
+	struct mime_text_part *part = lua_check_textpart (L);
+
+	if (part == NULL || part->chars == NULL) {
+		lua_pushnil (L);
+		return 1;
+	}
+
+	lua_createtable (L, 0, 5);
+	lua_pushstring (L, "letters");
+	lua_pushnumber (L, part->chars->letters);
+	lua_settable (L, -3);
+	lua_pushstring (L, "letter_pairs");
+	lua_pushnumber (L, part->chars->letter_pairs);
+	lua_settable (L, -3);
+	lua_pushstring (L, "script_changes");
+	lua_pushnumber (L, part->chars->script_changes);
+	lua_settable (L, -3);
+	lua_pushstring (L, "lines");
+	lua_pushnumber (L, part->chars->nlines);
+	lua_settable (L, -3);
+	lua_pushstring (L, "utf");
+	lua_pushboolean (L, part->chars->valid_utf);
+	lua_settable (L, -3);
+
+	return 1;
+}
+
+static gint
+lua_textpart_get_words (lua_State * L)
+{
+	struct mime_text_part *part = lua_check_textpart (L);
+	struct rspamd_task *task = lua_check_task (L, 2);
+	GArray *words;
+	rspamd_fstring_t *w;
+	guint i;
+
+	if (part == NULL || task == NULL) {
+		lua_pushnil (L);
+		return 1;
+	}
+
+	if (lua_toboolean (L, 3)) {
+		words = rspamd_mime_text_part_get_normalized_words (task, part);
+	}
+	else {
+		words = rspamd_mime_text_part_get_words (task, part);
+	}
+
+	if (words == NULL) {
+		lua_pushnil (L);
+		return 1;
+	}
+
+	lua_createtable (L, words->len, 0);
+
+	for (i = 0; i < words->len; i ++) {
+		w = &g_array_index (words, rspamd_fstring_t, i);
+		lua_pushlstring (L, w->begin, w->len);
+		lua_rawseti (L, -2, i + 1);
+	}
+
+	return 1;
+}
+
 static gint
 lua_textpart_get_mimepart (lua_State * L)
 {
@@ -468,16 +553,18 @@ lua_mimepart_get_content (lua_State * L)
 {
 	struct mime_part *part = lua_check_mimepart (L);
 	struct rspamd_lua_text *t;
+	GByteArray *content;
 
 	if (part == NULL) {
 		lua_pushnil (L);
 		return 1;
 	}
 
+	content = rspamd_mime_part_get_content (part);
 	t = lua_newuserdata (L, sizeof (*t));
 	rspamd_lua_setclass (L, "rspamd{text}", -1);
-	t->start = part->content->data;
-	t->len = part->content->len;
+	t->start = content->data;
+	t->len = content->len;
 
 	return 1;
 }
@@ -492,7 +579,9 @@ lua_mimepart_get_length (lua_State * L)
 		return 1;
 	}
 
-	lua_pushinteger (L, part->content->len);
+	/* Parts that are only hashed have no content but their size is known */
+	rspamd_mime_part_get_content (part);
+	lua_pushinteger (L, part->size);
 
 	return 1;
 }
@@ -0,0 +1,548 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "lua_common.h"
+#include "dns.h"
+#include "filter.h"
+#include "utlist.h"
+
+/***
+ * @module rspamd_rbl
+ * Rspamd rbl module performs lookups of many names in DNS black lists for a
+ * task. Names of all rules are collected in a batch, equal names are requested
+ * only once and replies are converted to symbols without calling lua for each
+ * of them.
+ *
+ * Here is a typical example of rbl engine usage:
+ * @example
+local rspamd_rbl = require "rspamd_rbl"
+
+local engine = rspamd_rbl.create()
+local rule = engine:add_rule({
+	zone = 'zen.spamhaus.org',
+	symbol = 'RBL_SPAMHAUS',
+	returncodes = {
+		RBL_SPAMHAUS_SBL = '127.0.0.2',
+		RBL_SPAMHAUS_XBL = {'127.0.0.4', '127.0.0.5'},
+	},
+})
+
+local function rbl_cb(task)
+	local batch = engine:batch(task)
+	local ip = task:get_from_ip()
+
+	if ip:is_valid() then
+		batch:add(rule, table.concat(ip:inversed_str_octets(), '.'))
+	end
+	batch:send()
+end
+ */
+
+LUA_FUNCTION_DEF (rbl, create);
+LUA_FUNCTION_DEF (rbl, add_rule);
+LUA_FUNCTION_DEF (rbl, batch);
+LUA_FUNCTION_DEF (rbl, destroy);
+LUA_FUNCTION_DEF (rbl_batch, add);
+LUA_FUNCTION_DEF (rbl_batch, send);
+
+static const struct luaL_reg rbllib_m[] = {
+	LUA_INTERFACE_DEF (rbl, add_rule),
+	LUA_INTERFACE_DEF (rbl, batch),
+	{"__tostring", rspamd_lua_class_tostring},
+	{"__gc", lua_rbl_destroy},
+	{NULL, NULL}
+};
+static const struct luaL_reg rbllib_f[] = {
+	LUA_INTERFACE_DEF (rbl, create),
+	{NULL, NULL}
+};
+static const struct luaL_reg rbl_batchlib_m[] = {
+	LUA_INTERFACE_DEF (rbl_batch, add),
+	LUA_INTERFACE_DEF (rbl_batch, send),
+	{"__tostring", rspamd_lua_class_tostring},
+	{NULL, NULL}
+};
+
+struct lua_rbl_returncode {
+	guint32 addr;
+	gchar *symbol;
+};
+
+struct lua_rbl_rule {
+	gchar *zone;
+	gchar *symbol;
+	gboolean unknown;
+	GArray *returncodes;
+};
+
+struct lua_rbl_engine {
+	GPtrArray *rules;
+};
+
+/* Rules which are interested in a reply for a name */
+struct lua_rbl_target {
+	struct lua_rbl_rule *rule;
+	struct lua_rbl_target *next;
+};
+
+struct lua_rbl_request {
+	struct rspamd_task *task;
+	gchar *name;
+	struct lua_rbl_target *targets;
+};
+
+struct lua_rbl_batch {
+	struct rspamd_task *task;
+	struct lua_rbl_engine *engine;
+	/* Full name -> struct lua_rbl_request */
+	GHashTable *requests;
+	gboolean sent;
+};
+
+static struct lua_rbl_engine *
+lua_check_rbl (lua_State * L, gint idx)
+{
+	void *ud = luaL_checkudata (L, idx, "rspamd{rbl}");
+
+	luaL_argcheck (L, ud != NULL, idx, "'rbl' expected");
+	return ud ? *((struct lua_rbl_engine **)ud) : NULL;
+}
+
+static struct lua_rbl_batch *
+lua_check_rbl_batch (lua_State * L, gint idx)
+{
+	void *ud = luaL_checkudata (L, idx, "rspamd{rbl_batch}");
+
+	luaL_argcheck (L, ud != NULL, idx, "'rbl_batch' expected");
+	return ud ? *((struct lua_rbl_batch **)ud) : NULL;
+}
+
+static void
+lua_rbl_rule_free (gpointer p)
+{
+	struct lua_rbl_rule *rule = p;
+	struct lua_rbl_returncode *rc;
+	guint i;
+
+	for (i = 0; i < rule->returncodes->len; i ++) {
+		rc = &g_array_index (rule->returncodes, struct lua_rbl_returncode, i);
+		g_free (rc->symbol);
+	}
+
+	g_array_free (rule->returncodes, TRUE);
+	g_free (rule->zone);
+	g_free (rule->symbol);
+	g_slice_free1 (sizeof (*rule), rule);
+}
+
+/***
+ * function rbl.create()
+ * Creates new rbl engine
+ * @return {rbl} new rbl engine
+ */
+static gint
+lua_rbl_create (lua_State *L)
+{
+	struct lua_rbl_engine *engine, **pengine;
+
+	engine = g_slice_alloc0 (sizeof (*engine));
+	engine->rules = g_ptr_array_new_with_free_func (lua_rbl_rule_free);
+	pengine = lua_newuserdata (L, sizeof (*pengine));
+	rspamd_lua_setclass (L, "rspamd{rbl}", -1);
+	*pengine = engine;
+
+	return 1;
+}
+
+static gint
+lua_rbl_destroy (lua_State *L)
+{
+	struct lua_rbl_engine *engine = lua_check_rbl (L, 1);
+
+	if (engine) {
+		g_ptr_array_free (engine->rules, TRUE);
+		g_slice_free1 (sizeof (*engine), engine);
+	}
+
+	return 0;
+}
+
+static gboolean
+lua_rbl_add_returncode (struct lua_rbl_rule *rule, const gchar *symbol,
+	const gchar *addr)
+{
+	struct lua_rbl_returncode rc;
+	struct in_addr ina;
+
+	if (addr == NULL || inet_pton (AF_INET, addr, &ina) != 1) {
+		msg_err ("rbl %s: invalid return code for symbol %s: %s", rule->zone,
+			symbol, addr ? addr : "(null)");
+		return FALSE;
+	}
+
+	rc.addr = ina.s_addr;
+	rc.symbol = g_strdup (symbol);
+	g_array_append_val (rule->returncodes, rc);
+
+	return TRUE;
+}
+
+/***
+ * @method rbl:add_rule(rule)
+ * Adds a lookup rule to the engine. Rule is a table with the following fields:
+ * - `zone`: dns zone of the list
+ * - `symbol`: symbol inserted if a name is listed with no return codes or with
+ * unknown return code
+ * - `returncodes`: table of symbols indexed by an address or by an array of
+ * addresses returned by the list
+ * - `unknown`: insert `symbol` for unknown return codes instead of logging them
+ * @param {table} rule rule definition
+ * @return {number} id of rule to be used in `batch:add()` or nil if rule is invalid
+ */
+static gint
+lua_rbl_add_rule (lua_State *L)
+{
+	struct lua_rbl_engine *engine = lua_check_rbl (L, 1);
+	struct lua_rbl_rule *rule;
+	const gchar *symbol;
+	gboolean ok = TRUE;
+
+	if (engine == NULL || !lua_istable (L, 2)) {
+		lua_pushnil (L);
+		return 1;
+	}
+
+	lua_getfield (L, 2, "zone");
+	if (!lua_isstring (L, -1)) {
+		msg_err ("rbl rule has no zone defined");
+		lua_pop (L, 1);
+		lua_pushnil (L);
+		return 1;
+	}
+
+	rule = g_slice_alloc0 (sizeof (*rule));
+	rule->returncodes = g_array_new (FALSE, FALSE,
+			sizeof (struct lua_rbl_returncode));
+	rule->zone = g_strdup (lua_tostring (L, -1));
+	lua_pop (L, 1);
+
+	lua_getfield (L, 2, "symbol");
+	if (lua_isstring (L, -1)) {
+		rule->symbol = g_strdup (lua_tostring (L, -1));
+	}
+	lua_pop (L, 1);
+
+	lua_getfield (L, 2, "unknown");
+	rule->unknown = lua_toboolean (L, -1);
+	lua_pop (L, 1);
+
+	lua_getfield (L, 2, "returncodes");
+	if (lua_istable (L, -1)) {
+		lua_pushnil (L);
+
+		while (ok && lua_next (L, -2) != 0) {
+			symbol = lua_tostring (L, -2);
+
+			if (lua_istable (L, -1)) {
+				lua_pushnil (L);
+
+				while (ok && lua_next (L, -2) != 0) {
+					ok = lua_rbl_add_returncode (rule, symbol,
+							lua_tostring (L, -1));
+					lua_pop (L, 1);
+				}
+
+				if (!ok) {
+					/* Key of the inner table */
+					lua_pop (L, 1);
+				}
+			}
+			else {
+				ok = lua_rbl_add_returncode (rule, symbol, lua_tostring (L, -1));
+			}
+
+			lua_pop (L, 1);
+		}
+
+		if (!ok) {
+			/* Key of the outer table */
+			lua_pop (L, 1);
+		}
+	}
+	lua_pop (L, 1);
+
+	if (!ok) {
+		lua_rbl_rule_free (rule);
+		lua_pushnil (L);
+		return 1;
+	}
+
+	g_ptr_array_add (engine->rules, rule);
+	lua_pushnumber (L, engine->rules->len);
+
+	return 1;
+}
+
+/***
+ * @method rbl:batch(task)
+ * Creates new batch of lookups for a task
+ * @param {task} task task object
+ * @return {rbl_batch} new batch
+ */
+static gint
+lua_rbl_batch (lua_State *L)
+{
+	struct lua_rbl_engine *engine = lua_check_rbl (L, 1);
+	struct rspamd_task *task = lua_check_task (L, 2);
+	struct lua_rbl_batch *batch, **pbatch;
+
+	if (engine == NULL || task == NULL) {
+		lua_pushnil (L);
+		return 1;
+	}
+
+	batch = rspamd_mempool_alloc0 (task->task_pool, sizeof (*batch));
+	batch->task = task;
+	batch->engine = engine;
+	batch->requests = g_hash_table_new (rspamd_strcase_hash,
+			rspamd_strcase_equal);
+	rspamd_mempool_add_destructor (task->task_pool,
+		(rspamd_mempool_destruct_t)g_hash_table_unref, batch->requests);
+	pbatch = lua_newuserdata (L, sizeof (*pbatch));
+	rspamd_lua_setclass (L, "rspamd{rbl_batch}", -1);
+	*pbatch = batch;
+
+	return 1;
+}
+
+/***
+ * @method rbl_batch:add(rule, name)
+ * Adds a name to be checked in the zone of a rule, a name that has been added
+ * for the same zone by any rule is requested only once
+ * @param {number} rule id of rule returned by `rbl:add_rule()`
+ * @param {string} name name to check without zone, e.g. reversed ip address
+ * @return {boolean} true if a new dns request is needed for this name
+ */
+static gint
+lua_rbl_batch_add (lua_State *L)
+{
+	struct lua_rbl_batch *batch = lua_check_rbl_batch (L, 1);
+	struct lua_rbl_rule *rule;
+	struct lua_rbl_request *req;
+	struct lua_rbl_target *target;
+	const gchar *name;
+	gchar *full_name;
+	gsize len;
+	guint id;
+
+	id = luaL_checknumber (L, 2);
+	name = luaL_checkstring (L, 3);
+
+	if (batch == NULL || batch->sent || id == 0 ||
+			id > batch->engine->rules->len) {
+		lua_pushboolean (L, FALSE);
+		return 1;
+	}
+
+	rule = g_ptr_array_index (batch->engine->rules, id - 1);
+	len = strlen (name) + strlen (rule->zone) + 2;
+	full_name = rspamd_mempool_alloc (batch->task->task_pool, len);
+	rspamd_snprintf (full_name, len, "%s.%s", name, rule->zone);
+	req = g_hash_table_lookup (batch->requests, full_name);
+
+	if (req == NULL) {
+		req = rspamd_mempool_alloc0 (batch->task->task_pool, sizeof (*req));
+		req->task = batch->task;
+		req->name = full_name;
+		g_hash_table_insert (batch->requests, full_name, req);
+		lua_pushboolean (L, TRUE);
+	}
+	else {
+		lua_pushboolean (L, FALSE);
+
+		LL_FOREACH (req->targets, target) {
+			if (target->rule == rule) {
+				return 1;
+			}
+		}
+	}
+
+	target = rspamd_mempool_alloc (batch->task->task_pool, sizeof (*target));
+	target->rule = rule;
+	target->next = req->targets;
+	req->targets = target;
+
+	return 1;
+}
+
+static void
+lua_rbl_insert_rule_results (struct rspamd_task *task,
+	struct lua_rbl_request *req,
+	struct lua_rbl_rule *rule,
+	struct rdns_reply *reply)
+{
+	struct rdns_reply_entry *elt;
+	struct lua_rbl_returncode *rc;
+	gboolean found;
+	guint i;
+
+	if (rule->returncodes->len == 0) {
+		if (rule->symbol) {
+			rspamd_task_insert_result (task, rule->symbol, 1, NULL);
+		}
+
+		return;
+	}
+
+	LL_FOREACH (reply->entries, elt) {
+		if (elt->type != RDNS_REQUEST_A) {
+			continue;
+		}
+
+		found = FALSE;
+
+		for (i = 0; i < rule->returncodes->len; i ++) {
+			rc = &g_array_index (rule->returncodes, struct lua_rbl_returncode, i);
+
+			if (rc->addr == elt->content.a.addr.s_addr) {
+				rspamd_task_insert_result (task, rc->symbol, 1, NULL);
+				found = TRUE;
+				break;
+			}
+		}
+
+		if (!found) {
+			if (rule->unknown && rule->symbol) {
+				rspamd_task_insert_result (task, rule->symbol, 1, NULL);
+			}
+			else {
+				msg_err ("<%s> rbl %s returned unknown result %s for %s",
+					task->message_id, rule->zone,
+					inet_ntoa (elt->content.a.addr), req->name);
+			}
+		}
+	}
+}
+
+static void
+lua_rbl_dns_callback (struct rdns_reply *reply, gpointer arg)
+{
+	struct lua_rbl_request *req = arg;
+	struct lua_rbl_target *target;
+
+	if (reply->code == RDNS_RC_NOERROR && reply->entries) {
+		msg_info ("<%s> name [%s] is listed", req->task->message_id,
+			req->name);
+
+		LL_FOREACH (req->targets, target) {
+			lua_rbl_insert_rule_results (req->task, req, target->rule, reply);
+		}
+	}
+	else {
+		msg_debug ("<%s> name [%s] is not listed", req->task->message_id,
+			req->name);
+	}
+}
+
+/***
+ * @method rbl_batch:send()
+ * Sends dns requests for all names added to the batch, no names can be added
+ * after this call
+ * @return {number} number of dns requests sent
+ */
+static gint
+lua_rbl_batch_send (lua_State *L)
+{
+	struct lua_rbl_batch *batch = lua_check_rbl_batch (L, 1);
+	struct rspamd_task *task;
+	struct lua_rbl_request *req;
+	GHashTableIter it;
+	gpointer k, v;
+	guint nsent = 0;
+
+	if (batch == NULL || batch->sent) {
+		lua_pushnumber (L, 0);
+		return 1;
+	}
+
+	task = batch->task;
+	batch->sent = TRUE;
+	g_hash_table_iter_init (&it, batch->requests);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		req = v;
+		debug_task ("send rbl dns request %s", req->name);
+
+		if (make_dns_request (task->resolver, task->s, task->task_pool,
+				lua_rbl_dns_callback, req, RDNS_REQUEST_A, req->name)) {
+			task->dns_requests ++;
+			nsent ++;
+		}
+	}
+
+	lua_pushnumber (L, nsent);
+
+	return 1;
+}
+
+static gint
+lua_load_rbl (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, rbllib_f);
+
+	return 1;
+}
+
+void
+luaopen_rbl (lua_State * L)
+{
+	luaL_newmetatable (L, "rspamd{rbl}");
+	lua_pushstring (L, "__index");
+	lua_pushvalue (L, -2);
+	lua_settable (L, -3);
+
+	lua_pushstring (L, "class");
+	lua_pushstring (L, "rspamd{rbl}");
+	lua_rawset (L, -3);
+
+	luaL_register (L, NULL,			 rbllib_m);
+	rspamd_lua_add_preload (L, "rspamd_rbl", lua_load_rbl);
+
+	lua_pop (L, 1);                      /* remove metatable from stack */
+
+	luaL_newmetatable (L, "rspamd{rbl_batch}");
+	lua_pushstring (L, "__index");
+	lua_pushvalue (L, -2);
+	lua_settable (L, -3);
+
+	lua_pushstring (L, "class");
+	lua_pushstring (L, "rspamd{rbl_batch}");
+	lua_rawset (L, -3);
+
+	luaL_register (L, NULL,			 rbl_batchlib_m);
+
+	lua_pop (L, 1);                      /* remove metatable from stack */
+}
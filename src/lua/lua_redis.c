@@ -23,10 +23,10 @@
 
 #include "lua_common.h"
 #include "dns.h"
+#include "redis_pool.h"
 
 #include "hiredis.h"
 #include "async.h"
-#include "adapters/libevent.h"
 
 #define REDIS_DEFAULT_TIMEOUT 1.0
 
@@ -62,20 +62,32 @@ static const struct luaL_reg redislib_m[] = {
 	{NULL, NULL}
 };
 
+/* Lua callback has been called or the task is finished */
+#define LUA_REDIS_TERMINATED (1 << 0)
+/* Reply is served from recorded replies, there is no connection */
+#define LUA_REDIS_REPLAY (1 << 1)
+/* Timeout is clamped by the deadline of the task, so it is not server's fault */
+#define LUA_REDIS_DEADLINE (1 << 2)
+
 /**
- * Struct for userdata representation
+ * Struct for userdata representation, it is not allocated from the task's
+ * pool as it must live until a reply is received from a shared connection
  */
 struct lua_redis_userdata {
 	redisAsyncContext *ctx;
 	lua_State *L;
 	struct rspamd_task *task;
-	struct event timeout;
+	struct rspamd_redis_pool *pool;
+	struct upstream *up;
+	struct rspamd_timer timeout;
+	gdouble start;
 	gint cbref;
-	gchar *server;
-	gchar *reqline;
-	guint16 port;
 	gchar **args;
 	guint nargs;
+	guint flags;
+	/* Command and arguments used to record and replay replies */
+	gchar *command;
+	const ucl_object_t *replay;
 };
 
 static void
@@ -89,19 +101,35 @@ lua_redis_free_args (struct lua_redis_userdata *ud)
 		}
 
 		g_free (ud->args);
+		ud->args = NULL;
 	}
 }
 
+static void
+lua_redis_free_ud (struct lua_redis_userdata *ud)
+{
+	lua_redis_free_args (ud);
+	g_free (ud->command);
+	g_slice_free1 (sizeof (*ud), ud);
+}
+
 static void
 lua_redis_fin (void *arg)
 {
 	struct lua_redis_userdata *ud = arg;
+	gboolean pending;
 
-	if (ud->ctx) {
-		redisAsyncFree (ud->ctx);
-		lua_redis_free_args (ud);
-		event_del (&ud->timeout);
+	if (!(ud->flags & LUA_REDIS_TERMINATED)) {
+		/* Userdata itself is freed when the reply is received */
+		ud->flags |= LUA_REDIS_TERMINATED;
+		pending = rspamd_timer_pending (&ud->timeout);
+		rspamd_timer_del (&ud->timeout);
 		luaL_unref (ud->L, LUA_REGISTRYINDEX, ud->cbref);
+
+		if ((ud->flags & LUA_REDIS_REPLAY) && pending) {
+			/* Task is finished before recorded reply is delivered */
+			lua_redis_free_ud (ud);
+		}
 	}
 }
 
@@ -194,6 +222,76 @@ lua_redis_push_data (const redisReply *r, struct lua_redis_userdata *ud)
 	remove_normal_event (ud->task->s, lua_redis_fin, ud);
 }
 
+static void
+lua_redis_push_recorded (lua_State *L, const ucl_object_t *obj)
+{
+	const ucl_object_t *type, *value, *cur;
+	ucl_object_iter_t it = NULL;
+	const gchar *t;
+	gsize len;
+	guint i = 0;
+
+	type = ucl_object_find_key (obj, "type");
+	value = ucl_object_find_key (obj, "value");
+	t = type != NULL ? ucl_object_tostring (type) : NULL;
+
+	if (t == NULL || value == NULL) {
+		/* Nil is pushed like in lua_redis_push_reply */
+		lua_newuserdata (L, sizeof (gpointer));
+	}
+	else if (strcmp (t, "integer") == 0) {
+		lua_pushinteger (L, ucl_object_toint (value));
+	}
+	else if (strcmp (t, "array") == 0) {
+		lua_createtable (L, value->len, 0);
+
+		while ((cur = ucl_iterate_object (value, &it, true)) != NULL) {
+			lua_redis_push_recorded (L, cur);
+			lua_rawseti (L, -2, ++i);
+		}
+	}
+	else {
+		t = ucl_object_tolstring (value, &len);
+		lua_pushlstring (L, t != NULL ? t : "", t != NULL ? len : 0);
+	}
+}
+
+/*
+ * Deliver a recorded reply after its latency
+ */
+static void
+lua_redis_replay_timeout (gpointer u)
+{
+	struct lua_redis_userdata *ud = u;
+	const ucl_object_t *type, *value;
+	struct rspamd_task **ptask;
+
+	type = ucl_object_find_key (ud->replay, "type");
+	value = ucl_object_find_key (ud->replay, "value");
+
+	if (type != NULL && type->type == UCL_STRING &&
+			strcmp (ucl_object_tostring (type), "error") == 0) {
+		lua_redis_push_error (value != NULL ? ucl_object_tostring_forced (value) :
+				"recorded error", ud, TRUE);
+	}
+	else {
+		lua_rawgeti (ud->L, LUA_REGISTRYINDEX, ud->cbref);
+		ptask = lua_newuserdata (ud->L, sizeof (struct rspamd_task *));
+		rspamd_lua_setclass (ud->L, "rspamd{task}", -1);
+		*ptask = ud->task;
+		lua_pushnil (ud->L);
+		lua_redis_push_recorded (ud->L, ud->replay);
+
+		if (lua_pcall (ud->L, 3, 0, 0) != 0) {
+			msg_info ("call to callback failed: %s", lua_tostring (ud->L, -1));
+		}
+
+		remove_normal_event (ud->task->s, lua_redis_fin, ud);
+	}
+
+	lua_redis_free_ud (ud);
+}
+
 /**
  * Callback for redis replies
  * @param c context of redis connection
@@ -205,10 +303,19 @@ lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 {
 	redisReply *reply = r;
 	struct lua_redis_userdata *ud = priv;
+	gboolean fatal = FALSE;
 
 	if (c->err == 0) {
 		if (r != NULL) {
-			if (reply->type != REDIS_REPLY_ERROR) {
+			if (ud->command) {
+				rspamd_redis_pool_record_reply (ud->pool, ud->command, reply,
+						rspamd_get_ticks () - ud->start);
+			}
+
+			if (ud->flags & LUA_REDIS_TERMINATED) {
+				/* Nobody is waiting for this reply any longer */
+			}
+			else if (reply->type != REDIS_REPLY_ERROR) {
 				lua_redis_push_data (reply, ud);
 			}
 			else {
@@ -216,26 +323,107 @@ lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 			}
 		}
 		else {
-			lua_redis_push_error ("received no data from server", ud, TRUE);
+			/* Connection is being closed */
+			fatal = TRUE;
+
+			if (!(ud->flags & LUA_REDIS_TERMINATED)) {
+				lua_redis_push_error ("received no data from server", ud, TRUE);
+			}
 		}
 	}
 	else {
-		if (c->err == REDIS_ERR_IO) {
-			lua_redis_push_error (strerror (errno), ud, TRUE);
+		fatal = TRUE;
+
+		if (!(ud->flags & LUA_REDIS_TERMINATED)) {
+			if (c->err == REDIS_ERR_IO) {
+				lua_redis_push_error (strerror (errno), ud, TRUE);
+			}
+			else {
+				lua_redis_push_error (c->errstr, ud, TRUE);
+			}
+		}
+	}
+
+	if (ud->up) {
+		if (fatal) {
+			rspamd_upstream_fail (ud->up);
 		}
 		else {
-			lua_redis_push_error (c->errstr, ud, TRUE);
+			rspamd_upstream_ok (ud->up);
+			rspamd_upstream_latency (ud->up, rspamd_get_ticks () - ud->start);
 		}
+
+		rspamd_upstream_request_end (ud->up);
 	}
+
+	rspamd_redis_pool_release_connection (ud->pool, c, fatal);
+	lua_redis_free_ud (ud);
 }
 
 static void
-lua_redis_timeout (int fd, short what, gpointer u)
+lua_redis_timeout (gpointer u)
 {
 	struct lua_redis_userdata *ud = u;
+	struct rspamd_redis_pool *pool = ud->pool;
+	redisAsyncContext *ctx = ud->ctx;
 
 	msg_info ("timeout while querying redis server");
+
+	if (ud->up) {
+		if (!(ud->flags & LUA_REDIS_DEADLINE)) {
+			rspamd_upstream_fail (ud->up);
+		}
+
+		rspamd_upstream_request_end (ud->up);
+		/* Do not touch upstream when connection is closed */
+		ud->up = NULL;
+	}
+
 	lua_redis_push_error ("timeout while connecting the server", ud, TRUE);
+	/*
+	 * Replies are received in order, so the connection is useless now; when it
+	 * is closed, the callback is called with no reply and frees userdata
+	 */
+	rspamd_redis_pool_release_connection (pool, ctx, TRUE);
+}
+
+static rspamd_inet_addr_t *
+lua_redis_check_host (lua_State *L, gint pos, struct upstream **pup)
+{
+	gpointer ud;
+
+	*pup = NULL;
+
+	if ((ud = rspamd_lua_check_class (L, pos, "rspamd{ip}")) != NULL) {
+		struct rspamd_lua_ip *ip = *((struct rspamd_lua_ip **)ud);
+
+		return ip != NULL ? ip->addr : NULL;
+	}
+	else if ((ud = rspamd_lua_check_class (L, pos, "rspamd{upstream}")) != NULL) {
+		*pup = *((struct upstream **)ud);
+
+		return *pup != NULL ? rspamd_upstream_addr (*pup) : NULL;
+	}
+
+	return NULL;
+}
+
+static struct rspamd_redis_pool *
+lua_redis_get_pool (struct rspamd_config *cfg)
+{
+	/* Pool is created after fork, so each worker has its own connections */
+	if (cfg->redis_pool == NULL) {
+		cfg->redis_pool = rspamd_redis_pool_init ();
+
+		if (cfg->redis_replay_file != NULL) {
+			rspamd_redis_pool_replay (cfg->redis_pool, cfg->redis_replay_file);
+		}
+		else if (cfg->redis_record_file != NULL) {
+			rspamd_redis_pool_record (cfg->redis_pool, cfg->redis_record_file);
+		}
+	}
+
+	return cfg->redis_pool;
 }
 
 
@@ -248,7 +436,7 @@ lua_redis_parse_args (lua_State *L, gint idx, const gchar *cmd,
 
 	if (idx != 0 && lua_type (L, idx) == LUA_TTABLE) {
 		/* Get all arguments */
-		lua_pushvalue (L, 5);
+		lua_pushvalue (L, idx);
 		lua_pushnil (L);
 		top = 0;
 
@@ -285,7 +473,7 @@ lua_redis_parse_args (lua_State *L, gint idx, const gchar *cmd,
  * @function rspamd_redis.make_request({params})
  * Make request to redis server, params is a table of key=value arguments in any order
  * @param {task} task worker task object
- * @param {ip} host server address
+ * @param {ip|upstream} host server address, if it is an upstream object then its state is updated according to the request's result
  * @param {function} callback callback to be called in form `function (task, err, data)`
  * @param {string} cmd command to be sent to redis
  * @param {table} args numeric array of strings used as redis arguments
@@ -296,13 +484,13 @@ static int
 lua_redis_make_request (lua_State *L)
 {
 	struct lua_redis_userdata *ud;
-	struct rspamd_lua_ip *addr = NULL;
+	rspamd_inet_addr_t *addr = NULL;
+	struct upstream *up = NULL;
 	struct rspamd_task *task = NULL;
 	const gchar *cmd = NULL;
-	gint top, cbref = -1;
-	struct timeval tv;
+	gint top, cbref = -1, rc;
 	gboolean ret = FALSE;
-	gdouble timeout = REDIS_DEFAULT_TIMEOUT;
+	gdouble timeout = REDIS_DEFAULT_TIMEOUT, clamped;
 
 	if (lua_istable (L, 1)) {
 		/* Table version */
@@ -331,25 +519,27 @@ lua_redis_make_request (lua_State *L)
 
 		lua_pushstring (L, "host");
 		lua_gettable (L, -2);
-		if (lua_type (L, -1) == LUA_TUSERDATA) {
-			addr = lua_check_ip (L, -1);
-		}
+		addr = lua_redis_check_host (L, -1, &up);
 		lua_pop (L, 1);
 
 		lua_pushstring (L, "timeout");
 		lua_gettable (L, -2);
-		timeout = lua_tonumber (L, -1);
+		if (lua_type (L, -1) == LUA_TNUMBER) {
+			timeout = lua_tonumber (L, -1);
+		}
 		lua_pop (L, 1);
 
 		if (task != NULL && addr != NULL && cbref != -1 && cmd != NULL) {
-			ud =
-					rspamd_mempool_alloc (task->task_pool,
-							sizeof (struct lua_redis_userdata));
+			ud = g_slice_alloc0 (sizeof (struct lua_redis_userdata));
 			ud->task = task;
-			ud->L = L;
+			ud->up = up;
+			ud->L = rspamd_lua_main_state (L);
 			ud->cbref = cbref;
 			lua_pushstring (L, "args");
-			lua_redis_parse_args (L, -1, cmd, ud);
+			lua_gettable (L, -2);
+			lua_redis_parse_args (L, lua_gettop (L), cmd, ud);
+			lua_pop (L, 1);
+			ret = TRUE;
 		}
 		else {
 			if (cbref != -1) {
@@ -360,16 +550,15 @@ lua_redis_make_request (lua_State *L)
 		}
 	}
 	else if ((task = lua_check_task (L, 1)) != NULL) {
-		addr = lua_check_ip (L, 2);
+		addr = lua_redis_check_host (L, 2, &up);
 		top = lua_gettop (L);
 		/* Now get callback */
-		if (lua_isfunction (L, 3) && addr != NULL && addr->addr && top >= 4) {
+		if (lua_isfunction (L, 3) && addr != NULL && top >= 4) {
 			/* Create userdata */
-			ud =
-				rspamd_mempool_alloc (task->task_pool,
-					sizeof (struct lua_redis_userdata));
+			ud = g_slice_alloc0 (sizeof (struct lua_redis_userdata));
 			ud->task = task;
-			ud->L = L;
+			ud->up = up;
+			ud->L = rspamd_lua_main_state (L);
 
 			/* Pop other arguments */
 			lua_pushvalue (L, 3);
@@ -383,6 +572,8 @@ lua_redis_make_request (lua_State *L)
 			else {
 				lua_redis_parse_args (L, 0, cmd, ud);
 			}
+
+			ret = TRUE;
 		}
 		else {
 			msg_err ("incorrect function invocation");
@@ -390,40 +581,92 @@ lua_redis_make_request (lua_State *L)
 	}
 
 	if (ret) {
-		ud->ctx = redisAsyncConnect (rspamd_inet_address_to_string (addr->addr),
-				rspamd_inet_address_get_port (addr->addr));
+		ud->pool = lua_redis_get_pool (task->cfg);
+
+		if (rspamd_redis_pool_replaying (ud->pool) ||
+				task->cfg->redis_record_file != NULL) {
+			ud->command = g_strjoinv (" ", ud->args);
+		}
+
+		if (rspamd_redis_pool_replaying (ud->pool)) {
+			ud->replay = rspamd_redis_pool_replay_reply (ud->pool, ud->command,
+					&timeout);
 
-		if (ud->ctx == NULL || ud->ctx->err) {
-			redisAsyncFree (ud->ctx);
+			if (ud->replay == NULL) {
+				msg_info ("no recorded reply for redis command %s", ud->command);
+				luaL_unref (ud->L, LUA_REGISTRYINDEX, ud->cbref);
+				lua_redis_free_ud (ud);
+				lua_pushboolean (L, FALSE);
+
+				return 1;
+			}
+
+			ud->flags |= LUA_REDIS_REPLAY;
 			lua_redis_free_args (ud);
+			register_async_event (ud->task->s,
+					lua_redis_fin,
+					ud,
+					g_quark_from_static_string ("lua redis"));
+			rspamd_timer_init (&ud->timeout, lua_redis_replay_timeout, ud);
+			rspamd_timer_add (ud->task->ev_base, &ud->timeout, timeout);
+			lua_pushboolean (L, TRUE);
+
+			return 1;
+		}
+
+		ud->ctx = rspamd_redis_pool_connect (ud->pool, task->ev_base,
+				rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr));
+
+		if (ud->ctx == NULL) {
+			if (ud->up) {
+				rspamd_upstream_fail (ud->up);
+			}
+
 			luaL_unref (ud->L, LUA_REGISTRYINDEX, ud->cbref);
+			lua_redis_free_ud (ud);
 			lua_pushboolean (L, FALSE);
 
 			return 1;
 		}
-		redisLibeventAttach (ud->ctx, ud->task->ev_base);
-		ret = redisAsyncCommandArgv (ud->ctx,
+
+		rc = redisAsyncCommandArgv (ud->ctx,
 					lua_redis_callback,
 					ud,
 					ud->nargs,
 					(const gchar **)ud->args,
 					NULL);
-		if (ret == REDIS_OK) {
+		/* Command is already formatted by hiredis */
+		lua_redis_free_args (ud);
+
+		if (rc == REDIS_OK) {
+			ud->start = rspamd_get_ticks ();
+
+			if (ud->up) {
+				rspamd_upstream_request_start (ud->up);
+			}
+
 			register_async_event (ud->task->s,
 					lua_redis_fin,
 					ud,
 					g_quark_from_static_string ("lua redis"));
 
-			double_to_tv (timeout, &tv);
-			event_set (&ud->timeout, -1, EV_TIMEOUT, lua_redis_timeout, ud);
-			event_base_set (ud->task->ev_base, &ud->timeout);
-			event_add (&ud->timeout, &tv);
+			clamped = rspamd_session_clamp_timeout (task->s, timeout);
+
+			if (clamped < timeout) {
+				timeout = clamped;
+				ud->flags |= LUA_REDIS_DEADLINE;
+			}
+
+			rspamd_timer_init (&ud->timeout, lua_redis_timeout, ud);
+			rspamd_timer_add (ud->task->ev_base, &ud->timeout, timeout);
 		}
 		else {
 			msg_info ("call to redis failed: %s", ud->ctx->errstr);
-			lua_redis_free_args (ud);
-			redisAsyncFree (ud->ctx);
+			rspamd_redis_pool_release_connection (ud->pool, ud->ctx, TRUE);
 			luaL_unref (ud->L, LUA_REGISTRYINDEX, ud->cbref);
+			lua_redis_free_ud (ud);
+			ret = FALSE;
 		}
 	}
 
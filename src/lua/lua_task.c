@@ -140,6 +140,7 @@ LUA_FUNCTION_DEF (task, set_pre_result);
 /***
  * @method task:get_urls()
  * Get all URLs found in a message.
+ * The list is created once per task and shared between calls, so it must not be modified.
  * @return {table rspamd_url} list of all urls found
 @example
 local function phishing_cb(task)
@@ -156,6 +157,42 @@ local function phishing_cb(task)
 end
  */
 LUA_FUNCTION_DEF (task, get_urls);
+/***
+ * @method task:get_urls_filtered([filter])
+ * Get URLs of a message matching the filter, url objects are created only for
+ * the matched urls and they are shared with `task:get_urls()`. Filter is a
+ * table with the following optional fields:
+ * - `host`: host of url or its parent domain
+ * - `tld`: tld of url as returned by `url:get_tld()`
+ * - `protocol`: protocol name, e.g. `http` or `mailto`
+ * - `phished`: boolean, select phished or not phished urls only
+ * - `limit`: maximum number of urls returned
+ * @param {table} filter filter of urls
+ * @return {table rspamd_url} list of matched urls
+ */
+LUA_FUNCTION_DEF (task, get_urls_filtered);
+/***
+ * @method task:urls_iter([filter])
+ * Get an iterator over URLs of a message, url objects are created on demand.
+ * Filter has the same format as in `task:get_urls_filtered()`. URLs must not be
+ * added to a task while it is iterated.
+ * @param {table} filter filter of urls
+ * @return {function} iterator returning the next matched url or nil
+@example
+local function bad_host_cb(task)
+	for url in task:urls_iter({host = 'example.com', limit = 1}) do
+		return true
+	end
+	return false
+end
+ */
+LUA_FUNCTION_DEF (task, urls_iter);
+/***
+ * @method task:get_urls_count()
+ * Get number of urls found in a message without creating url objects
+ * @return {number} number of urls
+ */
+LUA_FUNCTION_DEF (task, get_urls_count);
 /***
  * @method task:get_content()
  * Get raw content for the specified task
@@ -165,18 +202,33 @@ LUA_FUNCTION_DEF (task, get_content);
 /***
  * @method task:get_urls()
  * Get all email addresses found in a message.
+ * The list is created once per task and shared between calls, so it must not be modified.
  * @return {table rspamd_url} list of all email addresses found
  */
 LUA_FUNCTION_DEF (task, get_emails);
+/***
+ * @method task:get_emails_count()
+ * Get number of email addresses found in a message without creating url objects
+ * @return {number} number of emails
+ */
+LUA_FUNCTION_DEF (task, get_emails_count);
 /***
  * @method task:get_text_parts()
- * Get all text (and HTML) parts found in a message
+ * Get all text (and HTML) parts found in a message.
+ * The list is created once per task and shared between calls, so it must not be modified.
  * @return {table rspamd_text_part} list of text parts
  */
 LUA_FUNCTION_DEF (task, get_text_parts);
+/***
+ * @method task:get_text_parts_count()
+ * Get number of text parts without creating part objects
+ * @return {number} number of text parts
+ */
+LUA_FUNCTION_DEF (task, get_text_parts_count);
 /***
  * @method task:get_parts()
- * Get all mime parts found in a message
+ * Get all mime parts found in a message.
+ * The list is created once per task and shared between calls, so it must not be modified.
  * @return {table rspamd_mime_part} list of mime parts
  */
 LUA_FUNCTION_DEF (task, get_parts);
@@ -221,6 +273,15 @@ function check_header_delimiter_tab(task, header_name)
 end
  */
 LUA_FUNCTION_DEF (task, get_header_full);
+/***
+ * @method task:get_header_values(name[, case_sensitive])
+ * Get all values of a header as a flat list of strings. Unlike
+ * `get_header_full` this method does not create a table per header.
+ * @param {string} name name of header to get
+ * @param {boolean} case_sensitive case sensitiveness flag to search for a header
+ * @return {list of strings} values of all headers with the specified name
+ */
+LUA_FUNCTION_DEF (task, get_header_values);
 
 /***
  * @method task:get_raw_headers()
@@ -230,9 +291,10 @@ LUA_FUNCTION_DEF (task, get_header_full);
 LUA_FUNCTION_DEF (task, get_raw_headers);
 
 /***
- * @method task:get_received_headers()
- * Returns a list of tables of parsed received headers. A tables returned have
- * the following structure:
+ * @method task:get_received_headers([limit])
+ * Returns a list of tables of parsed received headers. Only the top
+ * `max_received_headers` headers are returned unless `limit` is specified.
+ * A tables returned have the following structure:
  *
  * - `from_hostname` - string that represents hostname provided by a peer
  * - `from_ip` - string representation of IP address as provided by a peer
@@ -340,6 +402,7 @@ LUA_FUNCTION_DEF (task, set_hostname);
 /***
  * @method task:get_images()
  * Returns list of all images found in a task as a table of `rspamd_image`.
+ * The list is created once per task and shared between calls, so it must not be modified.
  * @return {list of rspamd_image} images found in a message
  */
 LUA_FUNCTION_DEF (task, get_images);
@@ -413,16 +476,20 @@ LUA_FUNCTION_DEF (task, get_metric_action);
  * @method task:learn(is_spam[, classifier)
  * Learn classifier `classifier` with the task. If `is_spam` is true then message
  * is learnt as spam. Otherwise HAM is learnt. By default, this function learns
- * `bayes` classifier.
+ * `bayes` classifier. Tasks scanned by a normal worker are learnt in
+ * background after the reply is written unless `learn_queue_size` of the
+ * worker is set to `0`.
  * @param {boolean} is_spam learn spam or ham
  * @param {string} classifier classifier's name
- * @return {boolean} `true` if classifier has been learnt successfully
+ * @return {boolean} `true` if classifier has been learnt successfully or learn is queued
  */
 LUA_FUNCTION_DEF (task, learn);
 /***
  * @method task:set_settings(obj)
  * Set users settings object for a task. The format of this object is described
- * [here](https://rspamd.com/doc/configuration/settings.html).
+ * [here](https://rspamd.com/doc/configuration/settings.html). Settings tables
+ * are compiled once and reused for all tasks, so they should not be modified
+ * after being applied.
  * @param {any} obj any lua object that corresponds to the settings format
  */
 LUA_FUNCTION_DEF (task, set_settings);
@@ -443,6 +510,24 @@ LUA_FUNCTION_DEF (task, cache_get);
  */
 LUA_FUNCTION_DEF (task, cache_set);
 
+/***
+ * @method task:get_ptr()
+ * Returns raw pointer to the task that could be passed to the plain C accessors
+ * `rspamd_lua_task_ffi_*` from LuaJIT FFI
+ * @return {lightuserdata} pointer to the task
+@example
+local ffi = require("ffi")
+ffi.cdef[[
+	struct rspamd_task;
+	unsigned int rspamd_lua_task_ffi_urls_count (struct rspamd_task *task);
+]]
+local function many_urls(task)
+	local t = ffi.cast("struct rspamd_task *", task:get_ptr())
+	return ffi.C.rspamd_lua_task_ffi_urls_count(t) > 10
+end
+ */
+LUA_FUNCTION_DEF (task, get_ptr);
+
 static const struct luaL_reg tasklib_f[] = {
 	LUA_INTERFACE_DEF (task, create_empty),
 	LUA_INTERFACE_DEF (task, create_from_buffer),
@@ -461,13 +546,19 @@ static const struct luaL_reg tasklib_m[] = {
 	LUA_INTERFACE_DEF (task, insert_result),
 	LUA_INTERFACE_DEF (task, set_pre_result),
 	LUA_INTERFACE_DEF (task, get_urls),
+	LUA_INTERFACE_DEF (task, get_urls_filtered),
+	LUA_INTERFACE_DEF (task, urls_iter),
+	LUA_INTERFACE_DEF (task, get_urls_count),
 	LUA_INTERFACE_DEF (task, get_content),
 	LUA_INTERFACE_DEF (task, get_emails),
+	LUA_INTERFACE_DEF (task, get_emails_count),
 	LUA_INTERFACE_DEF (task, get_text_parts),
+	LUA_INTERFACE_DEF (task, get_text_parts_count),
 	LUA_INTERFACE_DEF (task, get_parts),
 	LUA_INTERFACE_DEF (task, get_header),
 	LUA_INTERFACE_DEF (task, get_header_raw),
 	LUA_INTERFACE_DEF (task, get_header_full),
+	LUA_INTERFACE_DEF (task, get_header_values),
 	LUA_INTERFACE_DEF (task, get_raw_headers),
 	LUA_INTERFACE_DEF (task, get_received_headers),
 	LUA_INTERFACE_DEF (task, get_queue_id),
@@ -496,6 +587,7 @@ static const struct luaL_reg tasklib_m[] = {
 	LUA_INTERFACE_DEF (task, set_settings),
 	LUA_INTERFACE_DEF (task, cache_get),
 	LUA_INTERFACE_DEF (task, cache_set),
+	LUA_INTERFACE_DEF (task, get_ptr),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
 };
@@ -744,8 +836,6 @@ static gint
 lua_task_set_pre_result (lua_State * L)
 {
 	struct rspamd_task *task = lua_check_task (L, 1);
-	struct metric_result *mres;
-	gchar *action_str;
 	gint action = METRIC_ACTION_MAX;
 
 	if (task != NULL) {
@@ -755,61 +845,416 @@ lua_task_set_pre_result (lua_State * L)
 		else if (lua_type (L, 2) == LUA_TSTRING) {
 			rspamd_action_from_str (lua_tostring (L, 2), &action);
 		}
-		if (action < (gint)task->pre_result.action &&
-				action < METRIC_ACTION_MAX &&
-				action >= METRIC_ACTION_REJECT) {
-			/* We also need to set the default metric to that result */
-			mres = rspamd_create_metric_result (task, DEFAULT_METRIC);
-			if (mres != NULL) {
-				mres->score = mres->metric->actions[action].score;
-				mres->action = action;
-			}
-			task->pre_result.action = action;
-			if (lua_gettop (L) >= 3) {
-				action_str = rspamd_mempool_strdup (task->task_pool,
-						luaL_checkstring (L, 3));
-				task->pre_result.str = action_str;
-				task->messages = g_list_prepend (task->messages, action_str);
-			}
-			else {
-				task->pre_result.str = "unknown";
-			}
-			msg_info ("<%s>: set pre-result to %s: '%s'",
-						task->message_id, rspamd_action_to_str (action),
-						task->pre_result.str);
+		if (action >= METRIC_ACTION_REJECT) {
+			rspamd_task_set_pre_result (task, action,
+					lua_gettop (L) >= 3 ? luaL_checkstring (L, 3) : NULL);
 		}
 	}
 	return 0;
 }
 
+/*
+ * Lists of task objects are built once per task and kept in a table referenced
+ * from the registry, so all rules get the same userdata instead of allocating
+ * them on each call. Cached lists are shared, so they must not be modified.
+ */
+#define LUA_TASK_OBJECTS_VAR "lua_task_objects"
+
+enum lua_task_objects_list {
+	LUA_TASK_OBJECTS_URLS = 1,
+	LUA_TASK_OBJECTS_EMAILS,
+	LUA_TASK_OBJECTS_TEXT_PARTS,
+	LUA_TASK_OBJECTS_PARTS,
+	LUA_TASK_OBJECTS_IMAGES,
+	LUA_TASK_OBJECTS_URL_WRAPPERS,
+	LUA_TASK_OBJECTS_MAX
+};
+
+struct lua_task_objects_cache {
+	lua_State *L;
+	gint ref;
+	guint nelts[LUA_TASK_OBJECTS_MAX];
+};
+
+static void
+lua_task_objects_cache_dtor (gpointer p)
+{
+	struct lua_task_objects_cache *cache = p;
+
+	luaL_unref (cache->L, LUA_REGISTRYINDEX, cache->ref);
+}
+
+/*
+ * Pushes a cached list if it has the expected number of elements, it is
+ * rebuilt if task objects have been changed since the list was created
+ */
+static gboolean
+lua_task_objects_get (lua_State *L, struct rspamd_task *task,
+	enum lua_task_objects_list type, guint nelts)
+{
+	struct lua_task_objects_cache *cache;
+
+	cache = rspamd_mempool_get_variable (task->task_pool, LUA_TASK_OBJECTS_VAR);
+
+	if (cache == NULL || cache->L != rspamd_lua_main_state (L) ||
+			cache->nelts[type] != nelts) {
+		return FALSE;
+	}
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, cache->ref);
+	lua_rawgeti (L, -1, type);
+	lua_remove (L, -2);
+
+	if (!lua_istable (L, -1)) {
+		lua_pop (L, 1);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Saves a list from the top of the stack leaving it there */
+static void
+lua_task_objects_set (lua_State *L, struct rspamd_task *task,
+	enum lua_task_objects_list type, guint nelts)
+{
+	struct lua_task_objects_cache *cache;
+
+	cache = rspamd_mempool_get_variable (task->task_pool, LUA_TASK_OBJECTS_VAR);
+
+	if (cache == NULL) {
+		cache = rspamd_mempool_alloc0 (task->task_pool, sizeof (*cache));
+		/* Symbols are called from different coroutines of the same state */
+		cache->L = rspamd_lua_main_state (L);
+		lua_newtable (L);
+		cache->ref = luaL_ref (L, LUA_REGISTRYINDEX);
+		rspamd_mempool_set_variable (task->task_pool, LUA_TASK_OBJECTS_VAR,
+				cache, lua_task_objects_cache_dtor);
+	}
+	else if (cache->L != rspamd_lua_main_state (L)) {
+		return;
+	}
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, cache->ref);
+	lua_pushvalue (L, -2);
+	lua_rawseti (L, -2, type);
+	lua_pop (L, 1);
+	cache->nelts[type] = nelts;
+}
+
+struct lua_task_url_filter {
+	const gchar *host;
+	gsize hostlen;
+	const gchar *tld;
+	gsize tldlen;
+	gint protocol;
+	gint phished;
+	guint limit;
+	guint matched;
+};
+
+struct lua_task_url_iter {
+	GHashTableIter it;
+	struct lua_task_url_filter filter;
+};
+
 struct lua_tree_cb_data {
 	lua_State *L;
+	gint wrappers;
+	struct lua_task_url_filter *filter;
 	int i;
 };
 
+static const gchar *lua_url_protocols[] = {
+	[PROTOCOL_FILE] = "file",
+	[PROTOCOL_FTP] = "ftp",
+	[PROTOCOL_HTTP] = "http",
+	[PROTOCOL_HTTPS] = "https",
+	[PROTOCOL_MAILTO] = "mailto",
+	[PROTOCOL_UNKNOWN] = "unknown"
+};
+
+/*
+ * Pushes a table of url objects of a task indexed by url pointers, so every
+ * url object is created once per task and shared between rules
+ */
+static void
+lua_task_push_url_wrappers (lua_State *L, struct rspamd_task *task)
+{
+	if (!lua_task_objects_get (L, task, LUA_TASK_OBJECTS_URL_WRAPPERS, 0)) {
+		lua_newtable (L);
+		lua_task_objects_set (L, task, LUA_TASK_OBJECTS_URL_WRAPPERS, 0);
+	}
+}
+
+/* Pushes an url object creating it in the wrappers table if needed */
+static void
+lua_task_push_url (lua_State *L, gint wrappers, struct rspamd_url *url)
+{
+	struct rspamd_lua_url *lua_url;
+
+	lua_pushlightuserdata (L, url);
+	lua_rawget (L, wrappers);
+
+	if (lua_isnil (L, -1)) {
+		lua_pop (L, 1);
+		lua_url = lua_newuserdata (L, sizeof (struct rspamd_lua_url));
+		rspamd_lua_setclass (L, "rspamd{url}", -1);
+		lua_url->url = url;
+		lua_pushlightuserdata (L, url);
+		lua_pushvalue (L, -2);
+		lua_rawset (L, wrappers);
+	}
+}
+
+/*
+ * Reads filter from a table, strings of the filter are valid while the table
+ * is alive
+ */
+static gboolean
+lua_task_parse_url_filter (lua_State *L, gint idx,
+	struct lua_task_url_filter *filter)
+{
+	const gchar *proto;
+	guint i;
+
+	memset (filter, 0, sizeof (*filter));
+	filter->protocol = -1;
+	filter->phished = -1;
+
+	if (lua_isnoneornil (L, idx)) {
+		return TRUE;
+	}
+
+	if (!lua_istable (L, idx)) {
+		return FALSE;
+	}
+
+	lua_getfield (L, idx, "host");
+	if (lua_isstring (L, -1)) {
+		filter->host = lua_tolstring (L, -1, &filter->hostlen);
+	}
+	lua_pop (L, 1);
+
+	lua_getfield (L, idx, "tld");
+	if (lua_isstring (L, -1)) {
+		filter->tld = lua_tolstring (L, -1, &filter->tldlen);
+	}
+	lua_pop (L, 1);
+
+	lua_getfield (L, idx, "protocol");
+	if (lua_isstring (L, -1)) {
+		proto = lua_tostring (L, -1);
+
+		for (i = 0; i < G_N_ELEMENTS (lua_url_protocols); i ++) {
+			if (g_ascii_strcasecmp (proto, lua_url_protocols[i]) == 0) {
+				filter->protocol = i;
+				break;
+			}
+		}
+
+		if (filter->protocol == -1) {
+			lua_pop (L, 1);
+			return FALSE;
+		}
+	}
+	lua_pop (L, 1);
+
+	lua_getfield (L, idx, "phished");
+	if (lua_isboolean (L, -1)) {
+		filter->phished = lua_toboolean (L, -1);
+	}
+	lua_pop (L, 1);
+
+	lua_getfield (L, idx, "limit");
+	if (lua_isnumber (L, -1)) {
+		filter->limit = lua_tonumber (L, -1);
+	}
+	lua_pop (L, 1);
+
+	return TRUE;
+}
+
+/* Host matches if it is equal to the filter or if it is its subdomain */
+static gboolean
+lua_task_url_match (struct lua_task_url_filter *filter, struct rspamd_url *url)
+{
+	const gchar *host;
+
+	if (filter->protocol != -1 && url->protocol != filter->protocol) {
+		return FALSE;
+	}
+
+	if (filter->phished != -1 && !url->is_phished != !filter->phished) {
+		return FALSE;
+	}
+
+	if (filter->tld != NULL) {
+		if (url->tldlen != filter->tldlen ||
+				g_ascii_strncasecmp (url->tld, filter->tld, url->tldlen) != 0) {
+			return FALSE;
+		}
+	}
+
+	if (filter->host != NULL) {
+		if (url->hostlen < filter->hostlen) {
+			return FALSE;
+		}
+
+		host = url->host + url->hostlen - filter->hostlen;
+
+		if (g_ascii_strncasecmp (host, filter->host, filter->hostlen) != 0) {
+			return FALSE;
+		}
+
+		if (host != url->host && *(host - 1) != '.') {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
 static void
 lua_tree_url_callback (gpointer key, gpointer value, gpointer ud)
 {
-	struct rspamd_lua_url *url;
 	struct lua_tree_cb_data *cb = ud;
 
-	url = lua_newuserdata (cb->L, sizeof (struct rspamd_lua_url));
-	rspamd_lua_setclass (cb->L, "rspamd{url}", -1);
-	url->url = value;
+	if (cb->filter) {
+		if (cb->filter->limit > 0 && cb->filter->matched >= cb->filter->limit) {
+			return;
+		}
+
+		if (!lua_task_url_match (cb->filter, value)) {
+			return;
+		}
+
+		cb->filter->matched ++;
+	}
+
+	lua_task_push_url (cb->L, cb->wrappers, value);
 	lua_rawseti (cb->L, -2, cb->i++);
 }
 
+static void
+lua_task_push_urls (lua_State *L, struct rspamd_task *task, GHashTable *urls,
+	enum lua_task_objects_list type)
+{
+	struct lua_tree_cb_data cb;
+	guint nelts = g_hash_table_size (urls);
+
+	if (!lua_task_objects_get (L, task, type, nelts)) {
+		lua_task_push_url_wrappers (L, task);
+		lua_createtable (L, nelts, 0);
+		cb.i = 1;
+		cb.L = L;
+		cb.wrappers = lua_gettop (L) - 1;
+		cb.filter = NULL;
+		g_hash_table_foreach (urls, lua_tree_url_callback, &cb);
+		lua_remove (L, cb.wrappers);
+		lua_task_objects_set (L, task, type, nelts);
+	}
+}
+
 static gint
 lua_task_get_urls (lua_State * L)
 {
 	struct rspamd_task *task = lua_check_task (L, 1);
+
+	if (task) {
+		lua_task_push_urls (L, task, task->urls, LUA_TASK_OBJECTS_URLS);
+		return 1;
+	}
+
+	lua_pushnil (L);
+	return 1;
+}
+
+static gint
+lua_task_get_urls_filtered (lua_State * L)
+{
+	struct rspamd_task *task = lua_check_task (L, 1);
+	struct lua_task_url_filter filter;
 	struct lua_tree_cb_data cb;
 
 	if (task) {
+		if (!lua_task_parse_url_filter (L, 2, &filter)) {
+			return luaL_error (L, "invalid url filter");
+		}
+
+		lua_task_push_url_wrappers (L, task);
 		lua_newtable (L);
 		cb.i = 1;
 		cb.L = L;
+		cb.wrappers = lua_gettop (L) - 1;
+		cb.filter = &filter;
 		g_hash_table_foreach (task->urls, lua_tree_url_callback, &cb);
+		lua_remove (L, cb.wrappers);
+
+		return 1;
+	}
+
+	lua_pushnil (L);
+	return 1;
+}
+
+static gint
+lua_task_urls_iter_next (lua_State * L)
+{
+	struct lua_task_url_iter *iter;
+	gpointer k, v;
+
+	iter = lua_touserdata (L, lua_upvalueindex (1));
+
+	if (iter->filter.limit > 0 && iter->filter.matched >= iter->filter.limit) {
+		return 0;
+	}
+
+	while (g_hash_table_iter_next (&iter->it, &k, &v)) {
+		if (lua_task_url_match (&iter->filter, v)) {
+			iter->filter.matched ++;
+			lua_task_push_url (L, lua_upvalueindex (3), v);
+
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static gint
+lua_task_urls_iter (lua_State * L)
+{
+	struct rspamd_task *task = lua_check_task (L, 1);
+	struct lua_task_url_iter *iter;
+
+	if (task) {
+		iter = lua_newuserdata (L, sizeof (*iter));
+
+		if (!lua_task_parse_url_filter (L, 2, &iter->filter)) {
+			return luaL_error (L, "invalid url filter");
+		}
+
+		g_hash_table_iter_init (&iter->it, task->urls);
+		/* Filter table keeps strings of the filter alive */
+		lua_pushvalue (L, 2);
+		lua_task_push_url_wrappers (L, task);
+		lua_pushcclosure (L, lua_task_urls_iter_next, 3);
+
+		return 1;
+	}
+
+	lua_pushnil (L);
+	return 1;
+}
+
+static gint
+lua_task_get_urls_count (lua_State * L)
+{
+	struct rspamd_task *task = lua_check_task (L, 1);
+
+	if (task) {
+		lua_pushnumber (L, g_hash_table_size (task->urls));
 		return 1;
 	}
 
@@ -840,13 +1285,23 @@ static gint
 lua_task_get_emails (lua_State * L)
 {
 	struct rspamd_task *task = lua_check_task (L, 1);
-	struct lua_tree_cb_data cb;
 
 	if (task) {
-		lua_newtable (L);
-		cb.i = 1;
-		cb.L = L;
-		g_hash_table_foreach (task->emails, lua_tree_url_callback, &cb);
+		lua_task_push_urls (L, task, task->emails, LUA_TASK_OBJECTS_EMAILS);
+		return 1;
+	}
+
+	lua_pushnil (L);
+	return 1;
+}
+
+static gint
+lua_task_get_emails_count (lua_State * L)
+{
+	struct rspamd_task *task = lua_check_task (L, 1);
+
+	if (task) {
+		lua_pushnumber (L, g_hash_table_size (task->emails));
 		return 1;
 	}
 
@@ -861,9 +1316,17 @@ lua_task_get_text_parts (lua_State * L)
 	struct rspamd_task *task = lua_check_task (L, 1);
 	GList *cur;
 	struct mime_text_part *part, **ppart;
+	guint nelts;
 
 	if (task != NULL) {
-		lua_newtable (L);
+		nelts = g_list_length (task->text_parts);
+
+		if (lua_task_objects_get (L, task, LUA_TASK_OBJECTS_TEXT_PARTS,
+				nelts)) {
+			return 1;
+		}
+
+		lua_createtable (L, nelts, 0);
 		cur = task->text_parts;
 		while (cur) {
 			part = cur->data;
@@ -874,12 +1337,28 @@ lua_task_get_text_parts (lua_State * L)
 			lua_rawseti (L, -2, i++);
 			cur = g_list_next (cur);
 		}
+
+		lua_task_objects_set (L, task, LUA_TASK_OBJECTS_TEXT_PARTS, nelts);
 		return 1;
 	}
 	lua_pushnil (L);
 	return 1;
 }
 
+static gint
+lua_task_get_text_parts_count (lua_State * L)
+{
+	struct rspamd_task *task = lua_check_task (L, 1);
+
+	if (task != NULL) {
+		lua_pushnumber (L, g_list_length (task->text_parts));
+		return 1;
+	}
+
+	lua_pushnil (L);
+	return 1;
+}
+
 static gint
 lua_task_get_parts (lua_State * L)
 {
@@ -887,9 +1366,16 @@ lua_task_get_parts (lua_State * L)
 	struct rspamd_task *task = lua_check_task (L, 1);
 	GList *cur;
 	struct mime_part *part, **ppart;
+	guint nelts;
 
 	if (task != NULL) {
-		lua_newtable (L);
+		nelts = g_list_length (task->parts);
+
+		if (lua_task_objects_get (L, task, LUA_TASK_OBJECTS_PARTS, nelts)) {
+			return 1;
+		}
+
+		lua_createtable (L, nelts, 0);
 		cur = task->parts;
 		while (cur) {
 			part = cur->data;
@@ -900,6 +1386,8 @@ lua_task_get_parts (lua_State * L)
 			lua_rawseti (L, -2, i++);
 			cur = g_list_next (cur);
 		}
+
+		lua_task_objects_set (L, task, LUA_TASK_OBJECTS_PARTS, nelts);
 		return 1;
 	}
 	lua_pushnil (L);
@@ -909,7 +1397,7 @@ lua_task_get_parts (lua_State * L)
 
 gint
 rspamd_lua_push_header (lua_State * L,
-		GHashTable *hdrs,
+		rspamd_pool_hash_t *hdrs,
 		const gchar *name,
 		gboolean strong,
 		gboolean full,
@@ -920,7 +1408,7 @@ rspamd_lua_push_header (lua_State * L,
 	gint i = 1;
 	const gchar *val;
 
-	rh = g_hash_table_lookup (hdrs, name);
+	rh = rspamd_pool_hash_lookup (hdrs, name);
 
 	if (rh == NULL) {
 		lua_pushnil (L);
@@ -1009,6 +1497,42 @@ lua_task_get_header_full (lua_State * L)
 	return lua_task_get_header_common (L, TRUE, TRUE);
 }
 
+static gint
+lua_task_get_header_values (lua_State * L)
+{
+	gboolean strong = FALSE;
+	struct rspamd_task *task = lua_check_task (L, 1);
+	const gchar *name;
+	struct raw_header *rh;
+	gint i = 1;
+
+	name = luaL_checkstring (L, 2);
+
+	if (name && task) {
+		if (lua_gettop (L) == 3) {
+			strong = lua_toboolean (L, 3);
+		}
+
+		lua_newtable (L);
+		rh = rspamd_pool_hash_lookup (task->raw_headers, name);
+
+		while (rh) {
+			if (rh->name != NULL && rh->value != NULL &&
+					(!strong || strcmp (rh->name, name) == 0)) {
+				lua_pushstring (L, rh->value);
+				lua_rawseti (L, -2, i++);
+			}
+
+			rh = rh->next;
+		}
+
+		return 1;
+	}
+
+	lua_pushnil (L);
+	return 1;
+}
+
 static gint
 lua_task_get_header (lua_State * L)
 {
@@ -1047,10 +1571,15 @@ lua_task_get_received_headers (lua_State * L)
 	GList *cur;
 	struct received_header *rh;
 	gint i = 1;
+	guint limit = 0;
 
 	if (task) {
+		if (lua_isnumber (L, 2)) {
+			limit = lua_tonumber (L, 2);
+		}
+
 		lua_newtable (L);
-		cur = g_list_first (task->received);
+		cur = rspamd_message_get_received (task, limit);
 		while (cur) {
 			rh = cur->data;
 			if (rh->is_error || G_UNLIKELY (
@@ -1460,11 +1989,19 @@ lua_task_get_images (lua_State *L)
 	gint i = 1;
 	GList *cur;
 	struct rspamd_image **pimg;
+	guint nelts;
 
 	if (task) {
 		cur = task->images;
 		if (cur != NULL) {
-			lua_newtable (L);
+			nelts = g_list_length (cur);
+
+			if (lua_task_objects_get (L, task, LUA_TASK_OBJECTS_IMAGES,
+					nelts)) {
+				return 1;
+			}
+
+			lua_createtable (L, nelts, 0);
 			while (cur) {
 				pimg = lua_newuserdata (L, sizeof (struct rspamd_image *));
 				rspamd_lua_setclass (L, "rspamd{image}", -1);
@@ -1472,6 +2009,8 @@ lua_task_get_images (lua_State *L)
 				lua_rawseti (L, -2, i++);
 				cur = g_list_next (cur);
 			}
+
+			lua_task_objects_set (L, task, LUA_TASK_OBJECTS_IMAGES, nelts);
 			return 1;
 		}
 	}
@@ -1756,6 +2295,13 @@ lua_task_learn (lua_State *L)
 		lua_pushstring (L, "classifier not found");
 		ret = 2;
 	}
+	else if (task->flags & RSPAMD_TASK_FLAG_LEARN_ASYNC) {
+		/* Worker learns the task after the reply is written */
+		task->flags &= ~(RSPAMD_TASK_FLAG_LEARN_SPAM|RSPAMD_TASK_FLAG_LEARN_HAM);
+		task->flags |= is_spam ? RSPAMD_TASK_FLAG_LEARN_SPAM :
+				RSPAMD_TASK_FLAG_LEARN_HAM;
+		lua_pushboolean (L, TRUE);
+	}
 	else {
 		if (!rspamd_learn_task_spam (cl, task, is_spam, &err)) {
 			lua_pushboolean (L, FALSE);
@@ -1772,15 +2318,110 @@ lua_task_learn (lua_State *L)
 	return ret;
 }
 
+#define LUA_SETTINGS_CACHE "rspamd_settings_cache"
+
+static gint
+lua_settings_gc (lua_State *L)
+{
+	struct rspamd_settings **psettings = lua_touserdata (L, 1);
+
+	rspamd_settings_unref (*psettings);
+
+	return 0;
+}
+
+static const struct luaL_reg settingslib_m[] = {
+	{"__gc", lua_settings_gc},
+	{NULL, NULL}
+};
+
+/*
+ * Returns compiled settings for a lua table, they are cached in a table with
+ * weak keys, so settings are compiled again only if the table is recreated
+ */
+static struct rspamd_settings *
+lua_task_compile_settings (lua_State *L, struct rspamd_config *cfg, gint pos)
+{
+	struct rspamd_settings *settings, **psettings;
+	ucl_object_t *obj;
+
+	lua_getfield (L, LUA_REGISTRYINDEX, LUA_SETTINGS_CACHE);
+
+	if (lua_isnil (L, -1)) {
+		lua_pop (L, 1);
+		lua_newtable (L);
+		lua_newtable (L);
+		lua_pushstring (L, "k");
+		lua_setfield (L, -2, "__mode");
+		lua_setmetatable (L, -2);
+		lua_pushvalue (L, -1);
+		lua_setfield (L, LUA_REGISTRYINDEX, LUA_SETTINGS_CACHE);
+	}
+
+	lua_pushvalue (L, pos);
+	lua_rawget (L, -2);
+
+	if (lua_isuserdata (L, -1)) {
+		psettings = lua_touserdata (L, -1);
+		lua_pop (L, 2);
+
+		return rspamd_settings_ref (*psettings);
+	}
+
+	lua_pop (L, 1);
+	obj = ucl_object_lua_import (L, pos);
+
+	if (obj == NULL) {
+		lua_pop (L, 1);
+		return NULL;
+	}
+
+	settings = rspamd_settings_new (cfg, obj);
+	ucl_object_unref (obj);
+
+	lua_pushvalue (L, pos);
+	psettings = lua_newuserdata (L, sizeof (*psettings));
+	rspamd_lua_setclass (L, "rspamd{settings}", -1);
+	*psettings = settings;
+	lua_rawset (L, -3);
+	lua_pop (L, 1);
+
+	return rspamd_settings_ref (settings);
+}
+
 static gint
 lua_task_set_settings (lua_State *L)
 {
 	struct rspamd_task *task = lua_check_task (L, 1);
-	ucl_object_t *settings;
+	struct rspamd_settings *settings = NULL;
+	ucl_object_t *obj;
+
+	if (task == NULL) {
+		return 0;
+	}
+
+	if (lua_istable (L, 2)) {
+		settings = lua_task_compile_settings (L, task->cfg, 2);
+	}
+	else {
+		obj = ucl_object_lua_import (L, 2);
+
+		if (obj != NULL) {
+			settings = rspamd_settings_new (task->cfg, obj);
+			ucl_object_unref (obj);
+		}
+	}
 
-	settings = ucl_object_lua_import (L, 2);
 	if (settings != NULL) {
-		task->settings = settings;
+		if (task->compiled_settings != NULL) {
+			rspamd_settings_unref (task->compiled_settings);
+		}
+		if (task->settings != NULL) {
+			ucl_object_unref (task->settings);
+		}
+
+		task->compiled_settings = settings;
+		task->settings = ucl_object_ref (settings->obj);
 	}
 
 	return 0;
@@ -1820,6 +2461,51 @@ lua_task_cache_set (lua_State *L)
 	return 1;
 }
 
+static gint
+lua_task_get_ptr (lua_State *L)
+{
+	struct rspamd_task *task = lua_check_task (L, 1);
+
+	if (task) {
+		lua_pushlightuserdata (L, task);
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+gsize
+rspamd_lua_task_ffi_message_len (struct rspamd_task *task)
+{
+	return task->msg.len;
+}
+
+guint
+rspamd_lua_task_ffi_urls_count (struct rspamd_task *task)
+{
+	return g_hash_table_size (task->urls);
+}
+
+guint
+rspamd_lua_task_ffi_emails_count (struct rspamd_task *task)
+{
+	return g_hash_table_size (task->emails);
+}
+
+guint
+rspamd_lua_task_ffi_text_parts_count (struct rspamd_task *task)
+{
+	return g_list_length (task->text_parts);
+}
+
+const gchar *
+rspamd_lua_task_ffi_message_id (struct rspamd_task *task)
+{
+	return task->message_id;
+}
+
 static gint
 lua_task_get_metric_score (lua_State *L)
 {
@@ -1929,7 +2615,7 @@ lua_image_get_size (lua_State *L)
 	struct rspamd_image *img = lua_check_image (L);
 
 	if (img != NULL) {
-		lua_pushinteger (L, img->data->len);
+		lua_pushinteger (L, rspamd_mime_part_get_content (img->part)->len);
 	}
 	else {
 		lua_pushnil (L);
@@ -2033,6 +2719,13 @@ luaopen_text (lua_State *L)
 	lua_pop (L, 1);
 }
 
+void
+luaopen_settings (lua_State *L)
+{
+	rspamd_lua_new_class (L, "rspamd{settings}", settingslib_m);
+	lua_pop (L, 1);
+}
+
 void
 rspamd_lua_task_push (lua_State *L, struct rspamd_task *task)
 {
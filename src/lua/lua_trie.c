@@ -45,6 +45,13 @@ local function trie_callback(number, pos)
 end
 
 trie:match('some big text', trie_callback)
+-- or collect all matches at once without calling lua for each of them
+local matches = trie:match('some big text')
+if matches then
+	for number, positions in pairs(matches) do
+		print('Matched pattern number ' .. tostring(number) .. ' ' .. tostring(#positions) .. ' times')
+	end
+end
  */
 
 /* Suffix trie */
@@ -145,6 +152,9 @@ lua_trie_create (lua_State *L)
 
 struct lua_trie_cbdata {
 	gboolean found;
+	gboolean icase;
+	/* Stack index of the table of matches or 0 if a callback is used */
+	gint res_idx;
 	lua_State *L;
 };
 
@@ -177,43 +187,97 @@ lua_trie_callback (int strnum, int textpos, void *context)
 }
 
 /*
- * We assume that callback argument is at pos 3 and icase is in position 4
+ * Appends position of a match to res[strnum + 1]
  */
 static gint
-lua_trie_search_str (lua_State *L, ac_trie_t *trie, const gchar *str, gsize len,
-		gint *statep)
+lua_trie_collect_callback (int strnum, int textpos, void *context)
 {
-	struct lua_trie_cbdata cb;
-	gboolean icase = FALSE;
+	struct lua_trie_cbdata *cb = context;
+	lua_State *L;
+	gsize npos;
+
+	L = cb->L;
+	cb->found = TRUE;
 
-	if (lua_gettop (L) == 4) {
-		icase = lua_toboolean (L, 4);
+	lua_rawgeti (L, cb->res_idx, strnum + 1);
+
+	if (lua_isnil (L, -1)) {
+		lua_pop (L, 1);
+		lua_createtable (L, 1, 0);
+		lua_pushvalue (L, -1);
+		lua_rawseti (L, cb->res_idx, strnum + 1);
 	}
 
-	cb.L = L;
-	cb.found = FALSE;
+	npos = rspamd_lua_objlen (L, -1);
+	lua_pushnumber (L, textpos);
+	lua_rawseti (L, -2, npos + 1);
+	lua_pop (L, 1);
+
+	return 0;
+}
+
+/*
+ * We assume that callback argument is at pos 3 and icase is in position 4,
+ * if there is no callback, then icase is at pos 3 and matches are collected
+ * to a table that is pushed on the stack
+ */
+static void
+lua_trie_init_cbdata (lua_State *L, struct lua_trie_cbdata *cb)
+{
+	cb->L = L;
+	cb->found = FALSE;
+
+	if (lua_type (L, 3) == LUA_TFUNCTION) {
+		cb->icase = lua_toboolean (L, 4);
+		cb->res_idx = 0;
+	}
+	else {
+		cb->icase = lua_toboolean (L, 3);
+		lua_newtable (L);
+		cb->res_idx = lua_gettop (L);
+	}
+}
+
+static void
+lua_trie_search_str (ac_trie_t *trie, const gchar *str, gsize len,
+		gint *statep, struct lua_trie_cbdata *cb)
+{
 	acism_lookup (trie, str, len,
-			lua_trie_callback, &cb, statep, icase);
+			cb->res_idx ? lua_trie_collect_callback : lua_trie_callback,
+			cb, statep, cb->icase);
+}
 
-	return cb.found;
+static gint
+lua_trie_push_result (lua_State *L, struct lua_trie_cbdata *cb)
+{
+	if (cb->res_idx != 0 && cb->found) {
+		lua_pushvalue (L, cb->res_idx);
+	}
+	else {
+		lua_pushboolean (L, cb->found);
+	}
+
+	return 1;
 }
 
 /***
- * @method trie:match(input, cb[, caseless])
+ * @method trie:match(input, [cb][, caseless])
  * Search for patterns in `input` invoking `cb` optionally ignoring case
  * @param {table or string} input one or several (if `input` is an array) strings of input text
  * @param {function} cb callback called on each pattern match in form `function (idx, pos)` where `idx` is a numeric index of pattern (starting from 1) and `pos` is a numeric offset where the pattern ends
  * @param {boolean} caseless if `true` then match ignores symbols case (ASCII only)
- * @return {boolean} `true` if any pattern has been found (`cb` might be called multiple times however)
+ * @return {boolean or table} `true` if any pattern has been found (`cb` might be called multiple times however); if `cb` is omitted, then a table of matches in form `{[idx] = {pos1, pos2, ...}}` is returned or `false` if nothing has been found
  */
 static gint
 lua_trie_match (lua_State *L)
 {
 	ac_trie_t *trie = lua_check_trie (L, 1);
+	struct lua_trie_cbdata cb;
 	const gchar *text;
 	gint state = 0;
 	gsize len;
-	gboolean found = FALSE;
+
+	lua_trie_init_cbdata (L, &cb);
 
 	if (trie) {
 		if (lua_type (L, 2) == LUA_TTABLE) {
@@ -223,10 +287,7 @@ lua_trie_match (lua_State *L)
 			while (lua_next (L, -2) != 0) {
 				if (lua_isstring (L, -1)) {
 					text = lua_tolstring (L, -1, &len);
-
-					if (lua_trie_search_str (L, trie, text, len, &state)) {
-						found = TRUE;
-					}
+					lua_trie_search_str (trie, text, len, &state, &cb);
 				}
 				lua_pop (L, 1);
 			}
@@ -235,38 +296,36 @@ lua_trie_match (lua_State *L)
 		}
 		else if (lua_type (L, 2) == LUA_TSTRING) {
 			text = lua_tolstring (L, 2, &len);
-
-			if (lua_trie_search_str (L, trie, text, len, &state)) {
-				found = TRUE;
-			}
+			lua_trie_search_str (trie, text, len, &state, &cb);
 		}
 	}
 
-	lua_pushboolean (L, found);
-	return 1;
+	return lua_trie_push_result (L, &cb);
 }
 
 /***
- * @method trie:search_mime(task, cb[, caseless])
+ * @method trie:search_mime(task, [cb][, caseless])
  * This is a helper mehthod to search pattern within text parts of a message in rspamd task
  * @param {task} task object
  * @param {function} cb callback called on each pattern match @see trie:match
  * @param {boolean} caseless if `true` then match ignores symbols case (ASCII only)
- * @return {boolean} `true` if any pattern has been found (`cb` might be called multiple times however)
+ * @return {boolean or table} `true` if any pattern has been found (`cb` might be called multiple times however) or a table of matches if `cb` is omitted @see trie:match
  */
 static gint
 lua_trie_search_mime (lua_State *L)
 {
 	ac_trie_t *trie = lua_check_trie (L, 1);
 	struct rspamd_task *task = lua_check_task (L, 2);
+	struct lua_trie_cbdata cb;
 	struct mime_text_part *part;
 	GList *cur;
 	const gchar *text;
 	gint state = 0;
 	gsize len;
-	gboolean found = FALSE;
 
-	if (trie) {
+	lua_trie_init_cbdata (L, &cb);
+
+	if (trie && task) {
 		cur = task->text_parts;
 
 		while (cur) {
@@ -275,49 +334,43 @@ lua_trie_search_mime (lua_State *L)
 			if (!IS_PART_EMPTY (part) && part->content != NULL) {
 				text = part->content->data;
 				len = part->content->len;
-
-				if (lua_trie_search_str (L, trie, text, len, &state) != 0) {
-					found = TRUE;
-				}
+				lua_trie_search_str (trie, text, len, &state, &cb);
 			}
 
 			cur = g_list_next (cur);
 		}
 	}
 
-	lua_pushboolean (L, found);
-	return 1;
+	return lua_trie_push_result (L, &cb);
 }
 
 /***
- * @method trie:search_rawmsg(task, cb[, caseless])
+ * @method trie:search_rawmsg(task, [cb][, caseless])
  * This is a helper mehthod to search pattern within the whole undecoded content of rspamd task
  * @param {task} task object
  * @param {function} cb callback called on each pattern match @see trie:match
  * @param {boolean} caseless if `true` then match ignores symbols case (ASCII only)
- * @return {boolean} `true` if any pattern has been found (`cb` might be called multiple times however)
+ * @return {boolean or table} `true` if any pattern has been found (`cb` might be called multiple times however) or a table of matches if `cb` is omitted @see trie:match
  */
 static gint
 lua_trie_search_rawmsg (lua_State *L)
 {
 	ac_trie_t *trie = lua_check_trie (L, 1);
 	struct rspamd_task *task = lua_check_task (L, 2);
+	struct lua_trie_cbdata cb;
 	const gchar *text;
 	gint state = 0;
 	gsize len;
-	gboolean found = FALSE;
 
-	if (trie) {
+	lua_trie_init_cbdata (L, &cb);
+
+	if (trie && task) {
 		text = task->msg.start;
 		len = task->msg.len;
-
-		if (lua_trie_search_str (L, trie, text, len, &state) != 0) {
-			found = TRUE;
-		}
+		lua_trie_search_str (trie, text, len, &state, &cb);
 	}
 
-	lua_pushboolean (L, found);
-	return 1;
+	return lua_trie_push_result (L, &cb);
 }
 
 static gint
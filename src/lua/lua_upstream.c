@@ -65,12 +65,14 @@ LUA_FUNCTION_DEF (upstream_list, destroy);
 LUA_FUNCTION_DEF (upstream_list, get_upstream_by_hash);
 LUA_FUNCTION_DEF (upstream_list, get_upstream_round_robin);
 LUA_FUNCTION_DEF (upstream_list, get_upstream_master_slave);
+LUA_FUNCTION_DEF (upstream_list, get_upstream_latency);
 
 static const struct luaL_reg upstream_list_m[] = {
 
 	LUA_INTERFACE_DEF (upstream_list, get_upstream_by_hash),
 	LUA_INTERFACE_DEF (upstream_list, get_upstream_round_robin),
 	LUA_INTERFACE_DEF (upstream_list, get_upstream_master_slave),
+	LUA_INTERFACE_DEF (upstream_list, get_upstream_latency),
 	{"__tostring", rspamd_lua_class_tostring},
 	{"__gc", lua_upstream_list_destroy},
 	{NULL, NULL}
@@ -337,6 +339,37 @@ lua_upstream_list_get_upstream_master_slave (lua_State *L)
 	return 1;
 }
 
+/***
+ * @method upstream_list:get_upstream_latency()
+ * Get upstream with the lower latency and load of two random alive upstreams
+ * @return {upstream} upstream from a list selected by latency
+ */
+static gint
+lua_upstream_list_get_upstream_latency (lua_State *L)
+{
+	struct upstream_list *upl;
+	struct upstream *selected, **pselected;
+
+	upl = lua_check_upstream_list (L);
+	if (upl) {
+
+		selected = rspamd_upstream_get (upl, RSPAMD_UPSTREAM_LATENCY);
+		if (selected) {
+			pselected = lua_newuserdata (L, sizeof (struct upstream *));
+			rspamd_lua_setclass (L, "rspamd{upstream}", -1);
+			*pselected = selected;
+		}
+		else {
+			lua_pushnil (L);
+		}
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
 static gint
 lua_load_upstream_list (lua_State * L)
 {
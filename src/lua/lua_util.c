@@ -45,12 +45,39 @@ LUA_FUNCTION_DEF (util, load_rspamd_config);
  */
 LUA_FUNCTION_DEF (util, config_from_ucl);
 LUA_FUNCTION_DEF (util, process_message);
+/***
+ * @function util.levenshtein_distance(s1, s2[, max])
+ * Returns edit distance between two strings, if `max` is specified then
+ * comparison stops as soon as the distance is known to be greater than `max`
+ * @param {string} s1 the first string
+ * @param {string} s2 the second string
+ * @param {number} max maximum distance of interest
+ * @return {number} distance between strings or `max + 1` if it is greater than `max`
+ */
+LUA_FUNCTION_DEF (util, levenshtein_distance);
+/***
+ * @function util.decode_base64(input)
+ * Decodes base64 encoded string, line breaks and invalid characters are skipped
+ * @param {string} input base64 encoded string
+ * @return {string} decoded data
+ */
+LUA_FUNCTION_DEF (util, decode_base64);
+/***
+ * @function util.decode_qp(input)
+ * Decodes quoted-printable encoded string
+ * @param {string} input quoted-printable encoded string
+ * @return {string} decoded data
+ */
+LUA_FUNCTION_DEF (util, decode_qp);
 
 static const struct luaL_reg utillib_f[] = {
 	LUA_INTERFACE_DEF (util, create_event_base),
 	LUA_INTERFACE_DEF (util, load_rspamd_config),
 	LUA_INTERFACE_DEF (util, config_from_ucl),
 	LUA_INTERFACE_DEF (util, process_message),
+	LUA_INTERFACE_DEF (util, levenshtein_distance),
+	LUA_INTERFACE_DEF (util, decode_base64),
+	LUA_INTERFACE_DEF (util, decode_qp),
 	{NULL, NULL}
 };
 
@@ -194,6 +221,75 @@ lua_util_process_message (lua_State *L)
 	return 1;
 }
 
+static gint
+lua_util_levenshtein_distance (lua_State *L)
+{
+	const gchar *s1, *s2;
+	gsize l1, l2;
+	guint32 max = G_MAXUINT32 - 1;
+
+	s1 = luaL_checklstring (L, 1, &l1);
+	s2 = luaL_checklstring (L, 2, &l2);
+
+	if (lua_isnumber (L, 3)) {
+		max = MIN (lua_tonumber (L, 3), G_MAXUINT32 - 1);
+	}
+
+	if (s1 != NULL && s2 != NULL) {
+		lua_pushnumber (L, rspamd_levinstein_distance_bounded (s1, l1, s2, l2,
+				max));
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+static gint
+lua_util_decode_base64 (lua_State *L)
+{
+	const gchar *s;
+	guchar *out;
+	gsize inlen, outlen;
+
+	s = luaL_checklstring (L, 1, &inlen);
+
+	if (s != NULL) {
+		out = rspamd_decode_base64 (s, inlen, &outlen);
+		lua_pushlstring (L, (const gchar *)out, outlen);
+		g_free (out);
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+static gint
+lua_util_decode_qp (lua_State *L)
+{
+	const gchar *s;
+	gchar *out;
+	gsize inlen;
+	gssize outlen;
+
+	s = luaL_checklstring (L, 1, &inlen);
+
+	if (s != NULL) {
+		out = g_malloc (inlen + 1);
+		outlen = rspamd_decode_qp_buf (s, inlen, out, inlen);
+		lua_pushlstring (L, out, outlen);
+		g_free (out);
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
 static gint
 lua_load_util (lua_State * L)
 {
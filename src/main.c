@@ -27,6 +27,7 @@
 #include "lmtp.h"
 #include "smtp.h"
 #include "libutil/map.h"
+#include "libutil/shm_cache.h"
 #include "fuzzy_storage.h"
 #include "kvstorage_server.h"
 #include "libserver/symbols_cache.h"
@@ -46,6 +47,9 @@
 #endif
 #ifdef HAVE_LOCALE_H
 #include <locale.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
 #define HAVE_SETLOCALE 1
 #endif
 
@@ -55,11 +59,19 @@
 /* 10 seconds after getting termination signal to terminate all workers with SIGKILL */
 #define HARD_TERMINATION_TIME 10
 
+/* Maximum number of NUMA nodes considered for workers placement */
+#define RSPAMD_MAX_NUMA_NODES 64
+
 static struct rspamd_worker * fork_worker (struct rspamd_main *,
-	struct rspamd_worker_conf *);
+	struct rspamd_worker_conf *, gboolean spare);
 static gboolean load_rspamd_config (struct rspamd_config *cfg,
 	gboolean init_modules);
 static void init_cfg_cache (struct rspamd_config *cfg);
+static void init_timeseries (struct rspamd_main *rspamd);
+static void rspamd_worker_stat_update (struct rspamd_main *rspamd, pid_t pid,
+	struct rspamd_worker *wrk);
+static GList * create_listen_socket (GPtrArray *addrs, guint cnt,
+	gint listen_type, gboolean reuseport);
 
 sig_atomic_t do_restart = 0;
 sig_atomic_t do_reopen_log = 0;
@@ -74,6 +86,7 @@ GQueue *signals_info = NULL;
 static gboolean config_test = FALSE;
 static gboolean no_fork = FALSE;
 static gchar **cfg_names = NULL;
+static gchar *cfg_cache_name = NULL;
 static gchar **lua_tests = NULL;
 static gchar **sign_configs = NULL;
 static gchar *privkey = NULL;
@@ -87,6 +100,8 @@ static gboolean gen_keypair = FALSE;
 static gboolean encrypt_password = FALSE;
 /* List of workers that are pending to start */
 static GList *workers_pending = NULL;
+/* List of spare workers that are pending to start */
+static GList *spares_pending = NULL;
 
 #ifdef HAVE_SA_SIGINFO
 static siginfo_t static_sg[64];
@@ -110,6 +125,8 @@ static GOptionEntry entries[] =
 	  "Do not daemonize main process", NULL },
 	{ "config", 'c', 0, G_OPTION_ARG_FILENAME_ARRAY, &cfg_names,
 	  "Specify config file(s)", NULL },
+	{ "config-cache", 0, 0, G_OPTION_ARG_FILENAME, &cfg_cache_name,
+	  "Cache parsed configuration in the specified file", NULL },
 	{ "user", 'u', 0, G_OPTION_ARG_STRING, &rspamd_user,
 	  "User to run rspamd as", NULL },
 	{ "group", 'g', 0, G_OPTION_ARG_STRING, &rspamd_group,
@@ -167,6 +184,7 @@ sig_handler (gint signo, siginfo_t *info, void *unused)
 		do_reopen_log = 1;
 		break;
 	case SIGUSR2:
+	case SIGWINCH:
 		/* Do nothing */
 		break;
 	case SIGALRM:
@@ -242,12 +260,15 @@ read_cmd_line (gint argc, gchar **argv, struct rspamd_config *cfg)
 	else {
 		cfg->cfg_name = cfg_names[0];
 	}
+	cfg->cfg_cache_file = cfg_cache_name;
 	for (i = 1; i < cfg_num; i++) {
 		r = fork ();
 		if (r == 0) {
 			/* Spawning new main process */
 			ottery_init (NULL);
 			cfg->cfg_name = cfg_names[i];
+			/* Cache is written for the first configuration only */
+			cfg->cfg_cache_file = NULL;
 			(void)setsid ();
 		}
 		else if (r == -1) {
@@ -356,45 +377,66 @@ config_logger (rspamd_mempool_t *pool, gpointer ud)
 	}
 }
 
-static void
-reread_config (struct rspamd_main *rspamd)
+static struct rspamd_config *
+read_new_config (struct rspamd_main *rspamd)
 {
 	struct rspamd_config *tmp_cfg;
 	gchar *cfg_file;
 
 	tmp_cfg = (struct rspamd_config *)g_malloc0 (sizeof (struct rspamd_config));
-	if (tmp_cfg) {
+	rspamd_init_cfg (tmp_cfg, FALSE);
+	tmp_cfg->lua_state = rspamd->cfg->lua_state;
+	cfg_file = rspamd_mempool_strdup (tmp_cfg->cfg_pool,
+			rspamd->cfg->cfg_name);
+	/* Save some variables */
+	tmp_cfg->cfg_name = cfg_file;
+	tmp_cfg->cfg_cache_file = rspamd->cfg->cfg_cache_file;
+
+	tmp_cfg->c_modules = g_hash_table_ref (rspamd->cfg->c_modules);
+
+	if (!load_rspamd_config (tmp_cfg, FALSE)) {
+		rspamd_set_logger (rspamd_main->cfg, g_quark_try_string (
+				"main"), rspamd_main);
+		msg_err ("cannot parse new config file, revert to old one");
+		rspamd_config_free (tmp_cfg);
+		g_free (tmp_cfg);
+
+		return NULL;
+	}
 
-		rspamd_init_cfg (tmp_cfg, FALSE);
-		tmp_cfg->lua_state = rspamd->cfg->lua_state;
-		cfg_file = rspamd_mempool_strdup (tmp_cfg->cfg_pool,
-				rspamd->cfg->cfg_name);
-		/* Save some variables */
-		tmp_cfg->cfg_name = cfg_file;
+	return tmp_cfg;
+}
 
-		tmp_cfg->c_modules = g_hash_table_ref (rspamd->cfg->c_modules);
+static void
+replace_config (struct rspamd_main *rspamd, struct rspamd_config *tmp_cfg)
+{
+	msg_debug ("replacing config");
+	rspamd_config_free (rspamd->cfg);
+	g_free (rspamd->cfg);
 
-		if (!load_rspamd_config (tmp_cfg, FALSE)) {
-			rspamd_set_logger (rspamd_main->cfg, g_quark_try_string (
-					"main"), rspamd_main);
-			msg_err ("cannot parse new config file, revert to old one");
-			rspamd_config_free (tmp_cfg);
-		}
-		else {
-			msg_debug ("replacing config");
-			rspamd_config_free (rspamd->cfg);
-			g_free (rspamd->cfg);
-
-			rspamd->cfg = tmp_cfg;
-			/* Force debug log */
-			if (is_debug) {
-				rspamd->cfg->log_level = G_LOG_LEVEL_DEBUG;
-			}
+	rspamd->cfg = tmp_cfg;
+	/* Force debug log */
+	if (is_debug) {
+		rspamd->cfg->log_level = G_LOG_LEVEL_DEBUG;
+		rspamd_log_update_debug_mask (rspamd->logger);
+	}
 
-			rspamd_init_filters (rspamd->cfg, TRUE);
-			init_cfg_cache (rspamd->cfg);
-			msg_info ("config rereaded successfully");
-		}
+	rspamd_init_filters (rspamd->cfg, TRUE);
+	init_cfg_cache (rspamd->cfg);
+	init_regexp_cache (rspamd->cfg);
+	init_timeseries (rspamd);
+	msg_info ("config rereaded successfully");
+}
+
+static void
+reread_config (struct rspamd_main *rspamd)
+{
+	struct rspamd_config *tmp_cfg;
+
+	tmp_cfg = read_new_config (rspamd);
+
+	if (tmp_cfg != NULL) {
+		replace_config (rspamd, tmp_cfg);
 	}
 }
 
@@ -426,8 +468,216 @@ set_worker_limits (struct rspamd_worker_conf *cf)
 	}
 }
 
+/*
+ * Whether each worker process should bind its own socket for this address
+ */
+static gboolean
+bind_conf_reuseport (struct rspamd_worker_conf *cf,
+	struct rspamd_worker_bind_conf *bcf)
+{
+#ifdef SO_REUSEPORT
+	guint i;
+
+	if (!cf->reuseport || bcf->is_systemd) {
+		return FALSE;
+	}
+
+	for (i = 0; i < bcf->cnt; i ++) {
+		/* Unix sockets cannot be shared this way */
+		if (rspamd_inet_address_get_af (g_ptr_array_index (bcf->addrs, i)) ==
+				AF_UNIX) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+static void
+create_worker_sockets (struct rspamd_worker *cur)
+{
+	struct rspamd_worker_bind_conf *bcf;
+	GList *ls;
+
+	LL_FOREACH (cur->cf->bind_conf, bcf) {
+		if (bind_conf_reuseport (cur->cf, bcf)) {
+			ls = create_listen_socket (bcf->addrs, bcf->cnt,
+					cur->cf->worker->listen_type, TRUE);
+
+			if (ls == NULL) {
+				msg_err ("cannot listen on socket %s: %s",
+						bcf->name,
+						strerror (errno));
+				exit (EXIT_FAILURE);
+			}
+
+			cur->cf->listen_socks = g_list_concat (cur->cf->listen_socks, ls);
+		}
+	}
+}
+
+#if defined(HAVE_SCHED_SETAFFINITY) && defined(HAVE_SC_NPROCESSORS_ONLN)
+struct rspamd_cpu_topology {
+	gint node;                      /* NUMA node									*/
+	gint core;                      /* physical core (package and core id)		*/
+};
+
+static gint
+rspamd_sysfs_read_int (const gchar *path, gint def)
+{
+	FILE *f;
+	gint res = def;
+
+	if ((f = fopen (path, "r")) != NULL) {
+		if (fscanf (f, "%d", &res) != 1) {
+			res = def;
+		}
+
+		fclose (f);
+	}
+
+	return res;
+}
+
+/*
+ * Load cpu topology from sysfs (Linux), cpus without this information are
+ * treated as separate cores of node 0
+ */
+static struct rspamd_cpu_topology *
+rspamd_cpu_topology_get (glong ncpus)
+{
+	static struct rspamd_cpu_topology *topology = NULL;
+	static glong topology_cpus = 0;
+	gchar path[PATH_MAX];
+	glong i;
+	gint node, package, core;
+
+	if (topology != NULL && topology_cpus == ncpus) {
+		return topology;
+	}
+
+	g_free (topology);
+	topology = g_malloc (ncpus * sizeof (*topology));
+	topology_cpus = ncpus;
+
+	for (i = 0; i < ncpus; i ++) {
+		rspamd_snprintf (path, sizeof (path),
+				"/sys/devices/system/cpu/cpu%l/topology/physical_package_id", i);
+		package = rspamd_sysfs_read_int (path, 0);
+		rspamd_snprintf (path, sizeof (path),
+				"/sys/devices/system/cpu/cpu%l/topology/core_id", i);
+		core = rspamd_sysfs_read_int (path, i);
+
+		for (node = 0; node < RSPAMD_MAX_NUMA_NODES; node ++) {
+			rspamd_snprintf (path, sizeof (path),
+					"/sys/devices/system/cpu/cpu%l/node%d", i, node);
+
+			if (access (path, F_OK) == 0) {
+				break;
+			}
+		}
+
+		topology[i].node = node < RSPAMD_MAX_NUMA_NODES ? node : 0;
+		topology[i].core = (package << 16) | (core & 0xffff);
+	}
+
+	return topology;
+}
+#endif
+
+/*
+ * Select the cpu for a new worker of this type: workers are spread over NUMA
+ * nodes at first, then over physical cores, and hyperthreads of a busy core
+ * are used at last
+ */
+static gint
+choose_worker_cpu (struct rspamd_main *rspamd, struct rspamd_worker_conf *cf)
+{
+#if defined(HAVE_SCHED_SETAFFINITY) && defined(HAVE_SC_NPROCESSORS_ONLN)
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_worker *w;
+	struct rspamd_cpu_topology *topology;
+	guint *usage, *core_usage, node_usage[RSPAMD_MAX_NUMA_NODES];
+	glong ncpus, i, j;
+	gint best = -1;
+
+	ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+	if (ncpus <= 0) {
+		return -1;
+	}
+
+	topology = rspamd_cpu_topology_get (ncpus);
+	usage = g_malloc0 (ncpus * sizeof (guint));
+	core_usage = g_malloc0 (ncpus * sizeof (guint));
+	memset (node_usage, 0, sizeof (node_usage));
+	g_hash_table_iter_init (&it, rspamd->workers);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		w = v;
+
+		if (w->type == cf->type && w->cpu >= 0 && w->cpu < ncpus) {
+			usage[w->cpu] ++;
+			node_usage[topology[w->cpu].node] ++;
+
+			/* Account all hyperthreads of the same core */
+			for (j = 0; j < ncpus; j ++) {
+				if (topology[j].node == topology[w->cpu].node &&
+						topology[j].core == topology[w->cpu].core) {
+					core_usage[j] ++;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < ncpus; i ++) {
+		if (best == -1 ||
+				node_usage[topology[i].node] < node_usage[topology[best].node] ||
+				(node_usage[topology[i].node] == node_usage[topology[best].node] &&
+				(core_usage[i] < core_usage[best] ||
+				(core_usage[i] == core_usage[best] && usage[i] < usage[best])))) {
+			best = i;
+		}
+	}
+
+	g_free (usage);
+	g_free (core_usage);
+
+	return best;
+#else
+	msg_warn ("cpu affinity is not supported on this platform");
+
+	return -1;
+#endif
+}
+
+static void
+set_worker_affinity (struct rspamd_worker *cur)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t set;
+
+	if (cur->cpu < 0) {
+		return;
+	}
+
+	CPU_ZERO (&set);
+	CPU_SET (cur->cpu, &set);
+
+	if (sched_setaffinity (0, sizeof (set), &set) == -1) {
+		msg_warn ("cannot bind worker to cpu %d: %s", cur->cpu,
+				strerror (errno));
+	}
+#endif
+}
+
 static struct rspamd_worker *
-fork_worker (struct rspamd_main *rspamd, struct rspamd_worker_conf *cf)
+fork_worker (struct rspamd_main *rspamd, struct rspamd_worker_conf *cf,
+	gboolean spare)
 {
 	struct rspamd_worker *cur;
 	/* Starting worker process */
@@ -436,6 +686,8 @@ fork_worker (struct rspamd_main *rspamd, struct rspamd_worker_conf *cf)
 		bzero (cur, sizeof (struct rspamd_worker));
 		cur->srv = rspamd;
 		cur->type = cf->type;
+		cur->cpu = cf->cpu_affinity ? choose_worker_cpu (rspamd, cf) : -1;
+		cur->spare = spare;
 		cur->pid = fork ();
 		cur->cf = g_malloc (sizeof (struct rspamd_worker_conf));
 		memcpy (cur->cf, cf, sizeof (struct rspamd_worker_conf));
@@ -443,12 +695,19 @@ fork_worker (struct rspamd_main *rspamd, struct rspamd_worker_conf *cf)
 		cur->ctx = cf->ctx;
 		switch (cur->pid) {
 		case 0:
+			/*
+			 * Bind to cpu before allocating anything, so the kernel places
+			 * memory of this process on the local NUMA node
+			 */
+			set_worker_affinity (cur);
 			/* Update pid for logging */
 			rspamd_log_update_pid (cf->type, rspamd->logger);
 			/* Lock statfile pool if possible XXX */
 			/* Init PRNG after fork */
 			ottery_init (NULL);
 			g_random_set_seed (ottery_rand_uint32 ());
+			/* Bind private sockets before dropping privilleges */
+			create_worker_sockets (cur);
 			/* Drop privilleges */
 			drop_priv (rspamd);
 			/* Set limits */
@@ -468,7 +727,8 @@ fork_worker (struct rspamd_main *rspamd, struct rspamd_worker_conf *cf)
 			g_thread_init (NULL);
 # endif
 #endif
-			msg_info ("starting %s process %P", cf->worker->name, getpid ());
+			msg_info ("starting %s%s process %P", spare ? "spare " : "",
+					cf->worker->name, getpid ());
 			cf->worker->worker_start_func (cur);
 			break;
 		case -1:
@@ -480,6 +740,7 @@ fork_worker (struct rspamd_main *rspamd, struct rspamd_worker_conf *cf)
 			/* Insert worker into worker's table, pid is index */
 			g_hash_table_insert (rspamd->workers, GSIZE_TO_POINTER (
 					cur->pid), cur);
+			rspamd_worker_stat_update (rspamd, 0, cur);
 			break;
 		}
 	}
@@ -487,6 +748,37 @@ fork_worker (struct rspamd_main *rspamd, struct rspamd_worker_conf *cf)
 	return cur;
 }
 
+/*
+ * Register worker in the shared statistics or unregister the worker with
+ * the specified pid if `wrk` is NULL
+ */
+static void
+rspamd_worker_stat_update (struct rspamd_main *rspamd, pid_t pid,
+	struct rspamd_worker *wrk)
+{
+	struct rspamd_worker_stat *ws;
+	guint i;
+
+	for (i = 0; i < RSPAMD_MAX_WORKERS_STAT; i++) {
+		ws = &rspamd->stat->workers[i];
+
+		if (ws->pid == pid) {
+			if (wrk != NULL) {
+				memset (ws, 0, sizeof (*ws));
+				rspamd_lua_profile_reset (rspamd->lua_profile, i);
+				rspamd_strlcpy (ws->type, g_quark_to_string (wrk->type),
+					sizeof (ws->type));
+				ws->pid = wrk->pid;
+			}
+			else {
+				ws->pid = 0;
+			}
+
+			break;
+		}
+	}
+}
+
 static void
 set_alarm (guint seconds)
 {
@@ -507,14 +799,55 @@ set_alarm (guint seconds)
 }
 
 static void
-delay_fork (struct rspamd_worker_conf *cf)
+delay_fork (struct rspamd_worker_conf *cf, gboolean spare)
 {
-	workers_pending = g_list_prepend (workers_pending, cf);
+	if (spare) {
+		spares_pending = g_list_prepend (spares_pending, cf);
+	}
+	else {
+		workers_pending = g_list_prepend (workers_pending, cf);
+	}
+
 	set_alarm (SOFT_FORK_TIME);
 }
 
+/*
+ * Activate a spare worker of the same config as the dead worker `w`, returns
+ * FALSE if there are no spare workers left
+ */
+static gboolean
+activate_spare_worker (struct rspamd_main *rspamd, struct rspamd_worker *w)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_worker *cur;
+
+	g_hash_table_iter_init (&it, rspamd->workers);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		cur = v;
+
+		if (cur->spare && cur->ctx == w->ctx && cur->type == w->type) {
+			if (kill (cur->pid, RSPAMD_SPARE_SIGNAL) == -1) {
+				msg_err ("cannot activate spare worker %P: %s", cur->pid,
+						strerror (errno));
+				continue;
+			}
+
+			msg_info ("%s process %P replaces process %P",
+					g_quark_to_string (cur->type), cur->pid, w->pid);
+			cur->spare = FALSE;
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
 static GList *
-create_listen_socket (GPtrArray *addrs, guint cnt, gint listen_type)
+create_listen_socket (GPtrArray *addrs, guint cnt, gint listen_type,
+	gboolean reuseport)
 {
 	GList *result = NULL;
 	gint fd;
@@ -523,7 +856,7 @@ create_listen_socket (GPtrArray *addrs, guint cnt, gint listen_type)
 	g_ptr_array_sort (addrs, rspamd_inet_address_compare_ptr);
 	for (i = 0; i < cnt; i ++) {
 		fd = rspamd_inet_address_listen (g_ptr_array_index (addrs, i),
-				listen_type, TRUE);
+				listen_type, TRUE, reuseport);
 		if (fd != -1) {
 			result = g_list_prepend (result, GINT_TO_POINTER (fd));
 		}
@@ -589,7 +922,16 @@ fork_delayed (struct rspamd_main *rspamd)
 		cf = cur->data;
 
 		workers_pending = g_list_remove_link (workers_pending, cur);
-		fork_worker (rspamd, cf);
+		fork_worker (rspamd, cf, FALSE);
+		g_list_free_1 (cur);
+	}
+
+	while (spares_pending != NULL) {
+		cur = spares_pending;
+		cf = cur->data;
+
+		spares_pending = g_list_remove_link (spares_pending, cur);
+		fork_worker (rspamd, cf, TRUE);
 		g_list_free_1 (cur);
 	}
 }
@@ -623,8 +965,12 @@ make_listen_key (struct rspamd_worker_bind_conf *cf)
 	return XXH64_digest (&st);
 }
 
+/*
+ * Spawn workers of the current config, configs found in `skip` are not forked
+ * as they are served by the existing (reloaded in place) processes
+ */
 static void
-spawn_workers (struct rspamd_main *rspamd)
+spawn_workers (struct rspamd_main *rspamd, GHashTable *skip)
 {
 	GList *cur, *ls;
 	struct rspamd_worker_conf *cf;
@@ -646,6 +992,11 @@ spawn_workers (struct rspamd_main *rspamd)
 		else {
 			if (cf->worker->has_socket) {
 				LL_FOREACH (cf->bind_conf, bcf) {
+					if (bind_conf_reuseport (cf, bcf)) {
+						/* Each worker binds its own socket after fork */
+						listen_ok = TRUE;
+						continue;
+					}
 					key = make_listen_key (bcf);
 					if ((p =
 						g_hash_table_lookup (listen_sockets,
@@ -653,7 +1004,7 @@ spawn_workers (struct rspamd_main *rspamd)
 						if (!bcf->is_systemd) {
 							/* Create listen socket */
 							ls = create_listen_socket (bcf->addrs, bcf->cnt,
-									cf->worker->listen_type);
+									cf->worker->listen_type, FALSE);
 						}
 						else {
 							ls = systemd_get_socket (bcf->cnt);
@@ -680,22 +1031,37 @@ spawn_workers (struct rspamd_main *rspamd)
 				}
 			}
 
-			if (listen_ok) {
+			if (listen_ok && skip != NULL && g_hash_table_lookup (skip, cf)) {
+				msg_debug ("skip spawning %s worker: reloaded in place",
+						cf->worker->name);
+			}
+			else if (listen_ok) {
 				if (cf->worker->unique) {
 					if (cf->count > 1) {
 						msg_err ("cannot spawn more than 1 %s worker, so spawn one",
 								cf->worker->name);
 					}
 					else {
-						fork_worker (rspamd, cf);
+						fork_worker (rspamd, cf, FALSE);
 					}
 				}
 				else if (cf->worker->threaded) {
-					fork_worker (rspamd, cf);
+					fork_worker (rspamd, cf, FALSE);
 				}
 				else {
 					for (i = 0; i < cf->count; i++) {
-						fork_worker (rspamd, cf);
+						fork_worker (rspamd, cf, FALSE);
+					}
+
+					if (cf->spare > 0 && cf->reuseport) {
+						/* Kernel would pass connections to spare sockets */
+						msg_warn ("spare %s workers are not supported with "
+								"reuseport", cf->worker->name);
+					}
+					else {
+						for (i = 0; i < cf->spare; i++) {
+							fork_worker (rspamd, cf, TRUE);
+						}
 					}
 				}
 			}
@@ -720,6 +1086,122 @@ kill_old_workers (gpointer key, gpointer value, gpointer unused)
 	msg_info ("send signal to worker %P", w->pid);
 }
 
+/*
+ * Find a worker config in the new config that could be served by a worker
+ * started with `old_cf`: it must have the same type, count and sockets
+ */
+static struct rspamd_worker_conf *
+find_reloadable_conf (struct rspamd_config *cfg,
+	struct rspamd_worker_conf *old_cf,
+	GHashTable *used)
+{
+	GList *cur;
+	struct rspamd_worker_conf *cf;
+	struct rspamd_worker_bind_conf *bcf, *old_bcf;
+	gboolean match;
+
+	cur = cfg->workers;
+
+	while (cur) {
+		cf = cur->data;
+		cur = g_list_next (cur);
+
+		if (cf->worker == NULL || cf->type != old_cf->type ||
+				cf->count != old_cf->count || g_hash_table_lookup (used, cf)) {
+			continue;
+		}
+
+		match = TRUE;
+		old_bcf = old_cf->bind_conf;
+
+		LL_FOREACH (cf->bind_conf, bcf) {
+			if (old_bcf == NULL || strcmp (bcf->name, old_bcf->name) != 0) {
+				match = FALSE;
+				break;
+			}
+
+			old_bcf = old_bcf->next;
+		}
+
+		if (match && old_bcf == NULL) {
+			return cf;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Reread config and tell reloadable workers to switch to it in place, other
+ * workers are restarted as usual
+ */
+static void
+reload_workers_graceful (struct rspamd_main *rspamd)
+{
+	struct rspamd_config *tmp_cfg;
+	struct rspamd_worker *w;
+	struct rspamd_worker_conf *cf;
+	GHashTable *reloaded, *used;
+	GHashTableIter it;
+	gpointer k, v;
+
+	tmp_cfg = read_new_config (rspamd);
+
+	if (tmp_cfg == NULL) {
+		return;
+	}
+
+	/* Worker -> new worker conf */
+	reloaded = g_hash_table_new (g_direct_hash, g_direct_equal);
+	/* Used new worker confs */
+	used = g_hash_table_new (g_direct_hash, g_direct_equal);
+	g_hash_table_iter_init (&it, rspamd->workers);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		w = v;
+		cf = NULL;
+
+		if (w->cf->worker->reloadable && !w->is_dying) {
+			cf = find_reloadable_conf (tmp_cfg, w->cf, used);
+		}
+
+		if (cf != NULL) {
+			g_hash_table_insert (reloaded, w, cf);
+
+			if (cf->worker->unique || cf->worker->threaded) {
+				g_hash_table_insert (used, cf, cf);
+			}
+		}
+		else {
+			kill_old_workers (k, w, NULL);
+		}
+	}
+
+	/* All workers of a non-unique config must be reloaded to skip it */
+	g_hash_table_iter_init (&it, reloaded);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		g_hash_table_insert (used, v, v);
+	}
+
+	rspamd_map_remove_all (rspamd->cfg);
+	replace_config (rspamd, tmp_cfg);
+	spawn_workers (rspamd, used);
+
+	g_hash_table_iter_init (&it, reloaded);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		w = k;
+		/* Old worker conf is freed with the old config */
+		w->cf = v;
+		kill (w->pid, SIGHUP);
+		msg_info ("send reload signal to worker %P", w->pid);
+	}
+
+	g_hash_table_unref (reloaded);
+	g_hash_table_unref (used);
+}
+
 static gboolean
 wait_for_workers (gpointer key, gpointer value, gpointer unused)
 {
@@ -769,11 +1251,24 @@ reopen_log_handler (gpointer key, gpointer value, gpointer unused)
 static gboolean
 load_rspamd_config (struct rspamd_config *cfg, gboolean init_modules)
 {
+	gdouble start = rspamd_get_ticks ();
+
 	if (!rspamd_config_read (cfg, cfg->cfg_name, NULL,
 		config_logger, rspamd_main)) {
 		return FALSE;
 	}
 
+	start = rspamd_config_startup_phase ("config read", start);
+
+	/* Compiled patterns must be loaded before any regexp is created */
+	if (cfg->regexp_cache_dir) {
+		gchar *path;
+
+		path = g_build_filename (cfg->regexp_cache_dir, "pcre.cache", NULL);
+		rspamd_regexp_library_load_cache (path);
+		g_free (path);
+	}
+
 	/* Strictly set temp dir */
 	if (!cfg->temp_dir) {
 		msg_warn ("tempdir is not set, trying to use $TMPDIR");
@@ -788,9 +1283,11 @@ load_rspamd_config (struct rspamd_config *cfg, gboolean init_modules)
 
 	/* Do post-load actions */
 	rspamd_config_post_load (cfg);
+	start = rspamd_config_startup_phase ("post load", start);
 
 	if (init_modules) {
 		rspamd_init_filters (cfg, FALSE);
+		rspamd_config_startup_phase ("modules init", start);
 	}
 
 	return TRUE;
@@ -806,12 +1303,104 @@ init_cfg_cache (struct rspamd_config *cfg)
 	}
 }
 
+/*
+ * Compile multi-pattern regexps before workers are forked, so they share
+ * the compiled databases, and save the compiled patterns for the next start
+ */
+static void
+init_regexp_cache (struct rspamd_config *cfg)
+{
+	GError *err = NULL;
+	gchar *path;
+
+	rspamd_re_cache_compile (cfg->re_cache, cfg->regexp_cache_dir);
+	/* Workers must not touch refcounts of shared regexps */
+	rspamd_regexp_cache_freeze (NULL);
+
+	if (cfg->regexp_cache_dir) {
+		path = g_build_filename (cfg->regexp_cache_dir, "pcre.cache", NULL);
+
+		if (!rspamd_regexp_library_save_cache (path, &err)) {
+			msg_warn ("cannot save regexp cache: %e", err);
+			g_error_free (err);
+		}
+
+		g_free (path);
+	}
+}
+
+/*
+ * Create time series store and register series of the current config,
+ * the store itself is not changed on reload
+ */
+static void
+init_timeseries (struct rspamd_main *rspamd)
+{
+	struct rspamd_config *cfg = rspamd->cfg;
+	struct rspamd_main_timeseries *ts;
+	struct cache_item *item;
+	GError *err = NULL;
+	gchar name[RSPAMD_TS_NAME_LEN];
+	guint i;
+
+	if (!cfg->timeseries && rspamd->ts == NULL) {
+		return;
+	}
+
+	if (rspamd->ts == NULL) {
+		ts = g_slice_alloc0 (sizeof (*ts));
+		ts->store = rspamd_ts_store_new (cfg->timeseries_file,
+				cfg->timeseries_max > 0 ? cfg->timeseries_max : 1024, &err);
+
+		if (ts->store == NULL) {
+			msg_err ("cannot create time series store: %s", err->message);
+			g_error_free (err);
+			g_slice_free1 (sizeof (*ts), ts);
+
+			return;
+		}
+
+		ts->scanned = rspamd_ts_store_register (ts->store, "scanned",
+				RSPAMD_TS_COUNTER);
+
+		for (i = METRIC_ACTION_REJECT; i <= METRIC_ACTION_NOACTION; i ++) {
+			rspamd_snprintf (name, sizeof (name), "action:%s",
+					rspamd_action_to_str (i));
+			ts->actions[i] = rspamd_ts_store_register (ts->store, name,
+					RSPAMD_TS_COUNTER);
+		}
+
+		for (i = 0; i < RSPAMD_TASK_STAGE_MAX; i ++) {
+			rspamd_snprintf (name, sizeof (name), "stage:%s",
+					rspamd_task_stage_name (i));
+			ts->stages[i] = rspamd_ts_store_register (ts->store, name,
+					RSPAMD_TS_LATENCY);
+		}
+
+		rspamd->ts = ts;
+	}
+
+	if (cfg->cache == NULL) {
+		return;
+	}
+
+	/* Symbols of a new config may differ */
+	for (i = 0; i < cfg->cache->items_by_order->len; i ++) {
+		item = g_ptr_array_index (cfg->cache->items_by_order, i);
+
+		if (!(item->flags & RSPAMD_SYMBOL_FLAG_CALLBACK)) {
+			rspamd_snprintf (name, sizeof (name), "symbol:%s", item->s->symbol);
+			item->ts_id = rspamd_ts_store_register (rspamd->ts->store, name,
+					RSPAMD_TS_COUNTER);
+		}
+	}
+}
+
 static void
 print_symbols_cache (struct rspamd_config *cfg)
 {
-	GList *cur;
 	struct cache_item *item;
-	gint i;
+	guint i;
 
 	if (!init_symbols_cache (cfg->cfg_pool, cfg->cache, cfg,
 		cfg->cache_filename, TRUE)) {
@@ -823,27 +1412,9 @@ print_symbols_cache (struct rspamd_config *cfg)
 			"-----------------------------------------------------------------\n");
 		printf (
 			"| Pri  | Symbol                | Weight | Frequency | Avg. time |\n");
-		i = 0;
-		cur = cfg->cache->negative_items;
-		while (cur) {
-			item = cur->data;
-			if (!item->is_callback) {
-				printf (
-						"-----------------------------------------------------------------\n");
-				printf ("| %3d | %22s | %6.1f | %9d | %9.3f |\n",
-					i,
-					item->s->symbol,
-					item->s->weight,
-					item->s->frequency,
-					item->s->avg_time);
-			}
-			cur = g_list_next (cur);
-			i++;
-		}
-		cur = cfg->cache->static_items;
-		while (cur) {
-			item = cur->data;
-			if (!item->is_callback) {
+		for (i = 0; i < cfg->cache->items_by_order->len; i ++) {
+			item = g_ptr_array_index (cfg->cache->items_by_order, i);
+			if (!(item->flags & RSPAMD_SYMBOL_FLAG_CALLBACK)) {
 				printf (
 						"-----------------------------------------------------------------\n");
 				printf ("| %3d | %22s | %6.1f | %9d | %9.3f |\n",
@@ -853,8 +1424,6 @@ print_symbols_cache (struct rspamd_config *cfg)
 					item->s->frequency,
 					item->s->avg_time);
 			}
-			cur = g_list_next (cur);
-			i++;
 		}
 
 		printf (
@@ -1091,8 +1660,7 @@ rspamd_init_main (struct rspamd_main *rspamd)
 		rspamd_mempool_suggest_size ());
 	rspamd_main->stat = rspamd_mempool_alloc0_shared (rspamd_main->server_pool,
 		sizeof (struct rspamd_stat));
-	/* Create rolling history */
-	rspamd_main->history = rspamd_roll_history_new (rspamd_main->server_pool);
+	rspamd_main->stat_mtx = rspamd_mempool_get_mutex (rspamd_main->server_pool);
 }
 
 gint
@@ -1106,6 +1674,7 @@ main (gint argc, gchar **argv, gchar **env)
 	GQuark type;
 	gpointer keypair;
 	GString *keypair_out;
+	gdouble start, startup;
 
 #ifdef HAVE_SA_SIGINFO
 	signals_info = g_queue_new ();
@@ -1219,6 +1788,7 @@ main (gint argc, gchar **argv, gchar **env)
 	}
 
 	/* Load config */
+	startup = rspamd_get_ticks ();
 	if (!load_rspamd_config (rspamd_main->cfg, TRUE)) {
 		exit (EXIT_FAILURE);
 	}
@@ -1231,6 +1801,7 @@ main (gint argc, gchar **argv, gchar **env)
 	/* Force debug log */
 	if (is_debug) {
 		rspamd_main->cfg->log_level = G_LOG_LEVEL_DEBUG;
+		rspamd_log_update_debug_mask (rspamd_main->logger);
 	}
 
 	gperf_profiler_init (rspamd_main->cfg, "main");
@@ -1265,14 +1836,28 @@ main (gint argc, gchar **argv, gchar **env)
 	setproctitle ("main process");
 
 	/* Init config cache */
+	start = rspamd_get_ticks ();
 	init_cfg_cache (rspamd_main->cfg);
+	init_regexp_cache (rspamd_main->cfg);
+	init_timeseries (rspamd_main);
 
 	/* Validate cache */
 	(void)validate_cache (rspamd_main->cfg->cache, rspamd_main->cfg, FALSE);
+	rspamd_config_startup_phase ("symbols cache", start);
 
 	/* Flush log */
 	rspamd_log_flush (rspamd_main->logger);
 
+	/* Create rolling history, its size is not changed on reload */
+	rspamd_main->history = rspamd_roll_history_new (rspamd_main->server_pool,
+			rspamd_main->cfg->history_rows);
+
+	/* Profiles are shared with controller, so they are enabled on start only */
+	if (rspamd_main->cfg->lua_profiler) {
+		rspamd_main->lua_profile = rspamd_lua_profile_new (
+				rspamd_main->server_pool);
+	}
+
 	/* Maybe read roll history */
 	if (rspamd_main->cfg->history_file) {
 		rspamd_roll_history_load (rspamd_main->history,
@@ -1282,9 +1867,11 @@ main (gint argc, gchar **argv, gchar **env)
 #if defined(WITH_GPERF_TOOLS)
 	ProfilerStop ();
 #endif
+	rspamd_config_startup_phase ("total", startup);
+
 	/* Spawn workers */
 	rspamd_main->workers = g_hash_table_new (g_direct_hash, g_direct_equal);
-	spawn_workers (rspamd_main);
+	spawn_workers (rspamd_main, NULL);
 
 	/* Signal processing cycle */
 	for (;; ) {
@@ -1316,6 +1903,7 @@ main (gint argc, gchar **argv, gchar **env)
 
 				g_hash_table_remove (rspamd_main->workers, GSIZE_TO_POINTER (
 						wrk));
+				rspamd_worker_stat_update (rspamd_main, wrk, NULL);
 
 				if (WIFEXITED (res) && WEXITSTATUS (res) == 0) {
 					/* Normal worker termination, do not fork one more */
@@ -1336,8 +1924,17 @@ main (gint argc, gchar **argv, gchar **env)
 							g_quark_to_string (cur->type),
 							cur->pid);
 					}
-					/* Fork another worker in replace of dead one */
-					delay_fork (cur->cf);
+					/*
+					 * Fork another worker in replace of dead one, if there is
+					 * a spare worker, then it takes the load now and the new
+					 * process becomes spare
+					 */
+					if (cur->spare || activate_spare_worker (rspamd_main, cur)) {
+						delay_fork (cur->cf, TRUE);
+					}
+					else {
+						delay_fork (cur->cf, FALSE);
+					}
 				}
 
 				g_free (cur);
@@ -1357,10 +1954,17 @@ main (gint argc, gchar **argv, gchar **env)
 				rspamd_main->workers_uid,
 				rspamd_main->workers_gid);
 			msg_info ("rspamd " RVERSION " is restarting");
-			g_hash_table_foreach (rspamd_main->workers, kill_old_workers, NULL);
-			rspamd_map_remove_all (rspamd_main->cfg);
-			reread_config (rspamd_main);
-			spawn_workers (rspamd_main);
+
+			if (rspamd_main->cfg->graceful_reload) {
+				reload_workers_graceful (rspamd_main);
+			}
+			else {
+				g_hash_table_foreach (rspamd_main->workers, kill_old_workers,
+						NULL);
+				rspamd_map_remove_all (rspamd_main->cfg);
+				reread_config (rspamd_main);
+				spawn_workers (rspamd_main, NULL);
+			}
 		}
 		if (do_reopen_log) {
 			do_reopen_log = 0;
@@ -1403,6 +2007,9 @@ main (gint argc, gchar **argv, gchar **env)
 			rspamd_main->cfg->history_file);
 	}
 
+	/* Workers are terminated, so shared caches are not modified anymore */
+	rspamd_shm_cache_save_snapshots ();
+
 	msg_info ("terminating...");
 
 	rspamd_log_close (rspamd_main->logger);
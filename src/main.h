@@ -13,6 +13,8 @@
 #include "libutil/logger.h"
 #include "libutil/http.h"
 #include "libutil/upstream.h"
+#include "libutil/histogram.h"
+#include "libutil/timeseries.h"
 #include "libserver/url.h"
 #include "libserver/protocol.h"
 #include "libserver/buffer.h"
@@ -57,8 +59,13 @@ struct rspamd_worker {
 	GList *accept_events;                                       /**< socket events									*/
 	struct rspamd_worker_conf *cf;                                      /**< worker config data								*/
 	gpointer ctx;                                               /**< worker's specific data							*/
+	gint cpu;                                                   /**< cpu the worker is bound to or -1				*/
+	gboolean spare;                                             /**< initialized but does not accept connections	*/
 };
 
+/* Signal that makes a spare worker to start accepting connections */
+#define RSPAMD_SPARE_SIGNAL SIGWINCH
+
 struct rspamd_worker_signal_handler {
 	gint signo;
 	gboolean enabled;
@@ -100,6 +107,20 @@ enum rspamd_fuzzy_epoch {
 	RSPAMD_FUZZY_EPOCH_MAX
 };
 
+#define RSPAMD_MAX_WORKERS_STAT 256
+
+/**
+ * Worker process registered by the main process, used to report memory
+ * usage of each worker
+ */
+struct rspamd_worker_stat {
+	pid_t pid;                                          /**< pid of worker or 0 for a free slot				*/
+	gchar type[32];                                     /**< type of worker									*/
+	guint64 lua_gc_time;                                /**< time spent to collect lua garbage (usec)		*/
+	guint64 lua_gc_steps;                               /**< steps of lua collector done in idle time		*/
+	guint64 lua_gc_full;                                /**< full collections as memory was above limit		*/
+};
+
 /**
  * Server statistics
  */
@@ -113,6 +134,36 @@ struct rspamd_stat {
 	guint fuzzy_hashes_expired;                         /**< number of fuzzy hashes expired					*/
 	guint64 fuzzy_hashes_checked[RSPAMD_FUZZY_EPOCH_MAX]; /**< ammount of check requests for each epoch		*/
 	guint64 fuzzy_hashes_found[RSPAMD_FUZZY_EPOCH_MAX]; /**< amount of hashes found by epoch				*/
+	guint fuzzy_updates_pending;                        /**< fuzzy updates waiting to be written			*/
+	guint fuzzy_expire_backlog;                         /**< expired fuzzy hashes not removed yet			*/
+	guint64 fuzzy_ratelimited;                          /**< fuzzy requests dropped by rate limit			*/
+	guint64 keys_cache_hits;                            /**< shared keys reused from the cache				*/
+	guint64 keys_cache_misses;                          /**< shared keys computed for new peers				*/
+	guint64 dns_cache_hits;                             /**< DNS requests served without a query			*/
+	guint64 dns_cache_misses;                           /**< DNS requests sent to resolvers				*/
+	guint64 stem_cache_hits;                            /**< words stemmed by the stems cache				*/
+	guint64 stem_cache_misses;                          /**< words stemmed by the stemmer					*/
+	guint64 fuzzy_cache_hits;                           /**< fuzzy checks served from the replies cache		*/
+	guint64 fuzzy_cache_misses;                         /**< fuzzy checks sent to fuzzy storages			*/
+	guint64 classify_tasks;                             /**< tasks classified by classifier threads			*/
+	guint64 classify_overflows;                         /**< tasks classified inline as the queue was full	*/
+	guint64 classify_queue_time;                        /**< total time tasks waited for classifier (usec)	*/
+	guint64 classify_queue_max;                         /**< maximum time task waited for classifier (usec)	*/
+	guint64 admission_rejected;                         /**< tasks soft rejected by admission control		*/
+	guint64 admission_skipped;                          /**< tasks scanned without expensive checks		*/
+	gdouble statsd_pushed;                              /**< time of the last push of metrics to statsd	*/
+	struct rspamd_histogram stages[RSPAMD_TASK_STAGE_MAX]; /**< latency of task processing stages			*/
+	struct rspamd_worker_stat workers[RSPAMD_MAX_WORKERS_STAT]; /**< running workers					*/
+};
+
+/**
+ * Time series of scans and ids of series updated by workers
+ */
+struct rspamd_main_timeseries {
+	struct rspamd_ts_store *store;
+	gint scanned;                                       /**< number of messages scanned						*/
+	gint actions[METRIC_ACTION_NOACTION + 1];           /**< number of messages with each action			*/
+	gint stages[RSPAMD_TASK_STAGE_MAX];                 /**< latency of task processing stages				*/
 };
 
 /**
@@ -126,6 +177,7 @@ struct rspamd_main {
 	GQuark type;                                                /**< process type									*/
 	guint ev_initialized;                                       /**< is event system is initialized					*/
 	struct rspamd_stat *stat;                                   /**< pointer to statistics							*/
+	rspamd_mempool_mutex_t *stat_mtx;                           /**< lock for merging workers' histograms			*/
 
 	rspamd_mempool_t *server_pool;                                  /**< server's memory pool							*/
 	GHashTable *workers;                                        /**< workers pool indexed by pid                    */
@@ -134,6 +186,8 @@ struct rspamd_main {
 	gid_t workers_gid;                                          /**< worker's gid running to						*/
 	gboolean is_privilleged;                                    /**< true if run in privilleged mode                */
 	struct roll_history *history;                               /**< rolling history								*/
+	struct rspamd_main_timeseries *ts;                          /**< time series of scans							*/
+	struct rspamd_lua_profile *lua_profile;                     /**< samples of lua functions (or NULL)				*/
 };
 
 /**
@@ -120,71 +120,89 @@ chartable_module_reconfig (struct rspamd_config *cfg)
 	return chartable_module_config (cfg);
 }
 
+/*
+ * Decodes the next character, ASCII characters are not validated
+ */
+static inline gunichar
+chartable_next_char (guchar **p, guint32 *remain)
+{
+	guchar *p1;
+	gunichar c;
+
+	if (**p < 0x80) {
+		c = **p;
+		(*p) ++;
+		(*remain) --;
+
+		return c;
+	}
+
+	c = g_utf8_get_char_validated (*p, *remain);
+
+	if (c != (gunichar) - 2 && c != (gunichar) - 1) {
+		p1 = g_utf8_next_char (*p);
+		*remain -= p1 - *p;
+		*p = p1;
+	}
+
+	return c;
+}
+
 static gboolean
-check_part (struct mime_text_part *part, gboolean raw_mode)
+check_part (struct rspamd_task *task, struct mime_text_part *part,
+	gboolean raw_mode)
 {
-	guchar *p, *p1;
+	guchar *p;
 	gunichar c, t;
 	GUnicodeScript scc, sct;
 	guint32 mark = 0, total = 0, max = 0, i;
 	guint32 remain = part->content->len;
 	guint32 scripts[G_UNICODE_SCRIPT_NKO];
+	const struct rspamd_text_part_chars *chars;
 	GUnicodeScript sel = 0;
 
 	p = part->content->data;
 
 	if (IS_PART_UTF (part) || raw_mode) {
-		while (remain > 1) {
-			if ((g_ascii_isalpha (*p) &&
-				(*(p + 1) & 0x80)) ||
-				((*p & 0x80) && g_ascii_isalpha (*(p + 1)))) {
-				mark++;
-				total++;
-			}
-			/* Current and next symbols are of one class */
-			else if (((*p & 0x80) &&
-				(*(p + 1) & 0x80)) ||
-				(g_ascii_isalpha (*p) && g_ascii_isalpha (*(p + 1)))) {
-				total++;
-			}
-			p++;
-			remain--;
+		/*
+		 * Transitions between ASCII letters and other characters are counted
+		 * when the part is parsed
+		 */
+		chars = rspamd_mime_text_part_get_chars (task, part);
+
+		if (chars != NULL) {
+			total = chars->letter_pairs;
+			mark = chars->script_changes;
 		}
 	}
 	else {
 		memset (&scripts, 0, sizeof (scripts));
 		while (remain > 0) {
-			c = g_utf8_get_char_validated (p, remain);
+			c = chartable_next_char (&p, &remain);
 			if (c == (gunichar) - 2 || c == (gunichar) - 1) {
 				/* Invalid characters detected, stop processing */
 				return FALSE;
 			}
 
-			scc = g_unichar_get_script (c);
+			scc = rspamd_unichar_get_script (c);
 			if (scc < (gint)G_N_ELEMENTS (scripts)) {
 				scripts[scc]++;
 			}
-			p1 = g_utf8_next_char (p);
-			remain -= p1 - p;
-			p = p1;
 
 			if (remain > 0) {
-				t = g_utf8_get_char_validated (p, remain);
+				t = chartable_next_char (&p, &remain);
 				if (t == (gunichar) - 2 || t == (gunichar) - 1) {
 					/* Invalid characters detected, stop processing */
 					return FALSE;
 				}
-				sct = g_unichar_get_script (t);
 				if (g_unichar_isalpha (c) && g_unichar_isalpha (t)) {
 					/* We have two unicode alphanumeric characters, so we can check its script */
+					sct = rspamd_unichar_get_script (t);
 					if (sct != scc) {
 						mark++;
 					}
 					total++;
 				}
-				p1 = g_utf8_next_char (p);
-				remain -= p1 - p;
-				p = p1;
 			}
 		}
 		/* Detect the mostly charset of this part */
@@ -213,7 +231,7 @@ chartable_symbol_callback (struct rspamd_task *task, void *unused)
 	cur = g_list_first (task->text_parts);
 	while (cur) {
 		part = cur->data;
-		if (!IS_PART_EMPTY (part) && check_part (part, task->cfg->raw_mode)) {
+		if (!IS_PART_EMPTY (part) && check_part (task, part, task->cfg->raw_mode)) {
 			rspamd_task_insert_result (task, chartable_module_ctx->symbol, 1, NULL);
 		}
 		cur = g_list_next (cur);
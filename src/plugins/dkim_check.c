@@ -35,6 +35,7 @@
  * - time_jitter (number): jitter in seconds to allow time diff while checking
  * - trusted_only (flag): check signatures only for domains in 'domains' map
  * - skip_mutli (flag): skip messages with multiply dkim signatures
+ * - dkim_shared_cache_size (integer): keys cached for all workers (default: 0)
  */
 
 #include "config.h"
@@ -42,6 +43,7 @@
 #include "libserver/dkim.h"
 #include "libutil/hash.h"
 #include "libutil/map.h"
+#include "libutil/shm_cache.h"
 #include "main.h"
 #include "utlist.h"
 
@@ -51,6 +53,10 @@
 #define DEFAULT_CACHE_SIZE 2048
 #define DEFAULT_CACHE_MAXAGE 86400
 #define DEFAULT_TIME_JITTER 60
+/* Maximum length of a decoded key in the shared cache */
+#define SHARED_CACHE_KEY_LEN 1024
+/* Interval in milliseconds to check keys requested by other workers */
+#define SHARED_WAIT_INTERVAL 100
 
 struct dkim_ctx {
 	struct module_ctx ctx;
@@ -64,6 +70,9 @@ struct dkim_ctx {
 	guint strict_multiplier;
 	guint time_jitter;
 	rspamd_lru_hash_t *dkim_hash;
+	struct rspamd_shm_cache *shared_cache;
+	guint shared_wait;
+	guint cache_expire;
 	gboolean trusted_only;
 	gboolean skip_multi;
 };
@@ -74,6 +83,10 @@ struct dkim_check_result {
 	struct rspamd_task *task;
 	gint res;
 	gint mult_allow, mult_deny;
+	/* Waiting for a key requested by another worker */
+	struct event ev;
+	struct timeval tv;
+	guint attempts;
 	struct dkim_check_result *next, *prev, *first;
 };
 
@@ -112,7 +125,7 @@ dkim_module_config (struct rspamd_config *cfg)
 {
 	const ucl_object_t *value;
 	gint res = TRUE;
-	guint cache_size, cache_expire;
+	guint cache_size, cache_expire, shared_size = 0;
 	gboolean got_trusted = FALSE;
 
 	dkim_module_ctx->whitelist_ip = radix_create_compressed ();
@@ -155,6 +168,11 @@ dkim_module_config (struct rspamd_config *cfg)
 	else {
 		cache_expire = DEFAULT_CACHE_MAXAGE;
 	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "dkim",
+		"dkim_shared_cache_size")) != NULL) {
+		shared_size = ucl_obj_toint (value);
+	}
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "dkim", "time_jitter")) != NULL) {
 		dkim_module_ctx->time_jitter = ucl_obj_todouble (value);
@@ -240,6 +258,16 @@ dkim_module_config (struct rspamd_config *cfg)
 				cache_expire,
 				g_free,
 				(GDestroyNotify)rspamd_dkim_key_free);
+		dkim_module_ctx->cache_expire = cache_expire;
+
+		if (shared_size > 0) {
+			/* Shared memory must be allocated before workers are forked */
+			dkim_module_ctx->shared_cache = rspamd_shm_cache_new (shared_size,
+					SHARED_CACHE_KEY_LEN + sizeof (guint32));
+			/* Wait for other workers no longer than they wait for DNS */
+			dkim_module_ctx->shared_wait = cfg->dns_timeout *
+					MAX (cfg->dns_retransmits, 1) / 1000.0 + 1;
+		}
 
 
 #ifndef HAVE_OPENSSL
@@ -256,6 +284,7 @@ dkim_module_reconfig (struct rspamd_config *cfg)
 {
 	rspamd_mempool_delete (dkim_module_ctx->dkim_pool);
 	radix_destroy_compressed (dkim_module_ctx->whitelist_ip);
+	rspamd_shm_cache_destroy (dkim_module_ctx->shared_cache);
 	if (dkim_module_ctx->dkim_domains) {
 		g_hash_table_destroy (dkim_module_ctx->dkim_domains);
 	}
@@ -384,8 +413,24 @@ dkim_module_key_handler (rspamd_dkim_key_t *key,
 	GError *err)
 {
 	struct dkim_check_result *res = ud;
+	GByteArray *buf;
+	guint32 expire;
+	guint ttl;
 
 	if (key != NULL) {
+		if (dkim_module_ctx->shared_cache) {
+			/* Key is stored with its expire time and in DER format */
+			ttl = MIN (key->ttl, dkim_module_ctx->cache_expire);
+			expire = res->task->tv.tv_sec + ttl;
+			buf = g_byte_array_sized_new (sizeof (expire) + key->decoded_len);
+			g_byte_array_append (buf, (const guint8 *)&expire, sizeof (expire));
+			g_byte_array_append (buf, key->keydata, key->decoded_len);
+			rspamd_shm_cache_insert (dkim_module_ctx->shared_cache,
+					ctx->dns_key, res->task->tv.tv_sec, ttl,
+					buf->data, buf->len);
+			g_byte_array_free (buf, TRUE);
+		}
+
 		/* Add new key to the lru cache */
 		rspamd_lru_hash_insert (dkim_module_ctx->dkim_hash,
 			g_strdup (ctx->dns_key),
@@ -393,6 +438,12 @@ dkim_module_key_handler (rspamd_dkim_key_t *key,
 		res->key = key;
 	}
 	else {
+		if (dkim_module_ctx->shared_cache) {
+			/* Let other workers request it by themselves */
+			rspamd_shm_cache_remove (dkim_module_ctx->shared_cache,
+					ctx->dns_key);
+		}
+
 		/* Insert tempfail symbol */
 		msg_info ("cannot get key for domain %s", ctx->dns_key);
 		if (err != NULL) {
@@ -407,6 +458,123 @@ dkim_module_key_handler (rspamd_dkim_key_t *key,
 	dkim_module_check (res);
 }
 
+/*
+ * Check key in the shared cache, the key should be requested by caller on miss
+ */
+static enum rspamd_shm_cache_result
+dkim_module_check_shared (struct dkim_check_result *cur, time_t now)
+{
+	rspamd_dkim_key_t *key;
+	enum rspamd_shm_cache_result r;
+	GByteArray *buf;
+	guint32 expire;
+	GError *err = NULL;
+
+	buf = g_byte_array_new ();
+	r = rspamd_shm_cache_lookup (dkim_module_ctx->shared_cache,
+			cur->ctx->dns_key, now, dkim_module_ctx->shared_wait, buf);
+
+	if (r == RSPAMD_SHM_CACHE_HIT) {
+		key = NULL;
+
+		if (buf->len > sizeof (expire)) {
+			memcpy (&expire, buf->data, sizeof (expire));
+			key = rspamd_dkim_key_from_der (buf->data + sizeof (expire),
+					buf->len - sizeof (expire),
+					(gint32)(expire - (guint32)now) > 0 ? expire - now : 1,
+					&err);
+		}
+
+		if (key != NULL) {
+			rspamd_lru_hash_insert (dkim_module_ctx->dkim_hash,
+				g_strdup (cur->ctx->dns_key),
+				key, now, key->ttl);
+			cur->key = key;
+		}
+		else {
+			if (err != NULL) {
+				msg_info ("cannot load shared key for %s: %s",
+						cur->ctx->dns_key, err->message);
+				g_error_free (err);
+			}
+
+			r = RSPAMD_SHM_CACHE_MISS;
+		}
+	}
+
+	g_byte_array_free (buf, TRUE);
+
+	return r;
+}
+
+static void
+dkim_module_request_key (struct dkim_check_result *cur)
+{
+	struct rspamd_task *task = cur->task;
+
+	debug_task ("request key for %s from DNS", cur->ctx->dns_key);
+	task->dns_requests++;
+
+	if (!rspamd_get_dkim_key (cur->ctx,
+			task->resolver,
+			task->s,
+			dkim_module_key_handler,
+			cur) && dkim_module_ctx->shared_cache) {
+		rspamd_shm_cache_remove (dkim_module_ctx->shared_cache,
+				cur->ctx->dns_key);
+	}
+}
+
+static void
+dkim_module_wait_fin (gpointer ud)
+{
+	struct dkim_check_result *cur = ud;
+
+	event_del (&cur->ev);
+}
+
+static void
+dkim_module_wait_cb (gint fd, short what, gpointer ud)
+{
+	struct dkim_check_result *cur = ud;
+	struct rspamd_task *task = cur->task;
+	enum rspamd_shm_cache_result r;
+
+	r = dkim_module_check_shared (cur, time (NULL));
+
+	if (r == RSPAMD_SHM_CACHE_PENDING && --cur->attempts > 0) {
+		evtimer_add (&cur->ev, &cur->tv);
+		return;
+	}
+
+	if (r == RSPAMD_SHM_CACHE_HIT) {
+		dkim_module_check (cur);
+	}
+	else {
+		/* Either the key is ours now or we are tired of waiting */
+		dkim_module_request_key (cur);
+	}
+
+	remove_normal_event (task->s, dkim_module_wait_fin, cur);
+}
+
+static void
+dkim_module_wait_shared (struct dkim_check_result *cur)
+{
+	struct rspamd_task *task = cur->task;
+
+	cur->attempts = MAX (dkim_module_ctx->shared_wait * 1000 /
+			SHARED_WAIT_INTERVAL, 1);
+	msec_to_tv (SHARED_WAIT_INTERVAL, &cur->tv);
+	evtimer_set (&cur->ev, dkim_module_wait_cb, cur);
+	event_base_set (task->ev_base, &cur->ev);
+	evtimer_add (&cur->ev, &cur->tv);
+	register_async_event (task->s,
+		dkim_module_wait_fin,
+		cur,
+		g_quark_from_static_string ("dkim"));
+}
+
 static void
 dkim_symbol_callback (struct rspamd_task *task, void *unused)
 {
@@ -416,6 +584,7 @@ dkim_symbol_callback (struct rspamd_task *task, void *unused)
 	GError *err = NULL;
 	struct raw_header *rh;
 	struct dkim_check_result *res = NULL, *cur;
+	enum rspamd_shm_cache_result r;
 	/* First check if a message has its signature */
 
 	hlist = message_get_header (task,
@@ -488,13 +657,23 @@ dkim_symbol_callback (struct rspamd_task *task, void *unused)
 						cur->key = key;
 					}
 					else {
-						debug_task ("request key for %s from DNS", ctx->dns_key);
-						task->dns_requests++;
-						rspamd_get_dkim_key (ctx,
-								task->resolver,
-								task->s,
-								dkim_module_key_handler,
-								cur);
+						r = RSPAMD_SHM_CACHE_MISS;
+
+						if (dkim_module_ctx->shared_cache) {
+							r = dkim_module_check_shared (cur, task->tv.tv_sec);
+						}
+
+						if (r == RSPAMD_SHM_CACHE_HIT) {
+							debug_task ("found key for %s in shared cache",
+									ctx->dns_key);
+						}
+						else if (r == RSPAMD_SHM_CACHE_PENDING) {
+							/* Key is being requested by another worker */
+							dkim_module_wait_shared (cur);
+						}
+						else {
+							dkim_module_request_key (cur);
+						}
 					}
 				}
 
@@ -44,10 +44,12 @@
 #include "libutil/map.h"
 #include "libmime/images.h"
 #include "fuzzy_storage.h"
+#include "libserver/fuzzy_backend.h"
 #include "utlist.h"
 #include "main.h"
 #include "blake2.h"
 #include "ottery.h"
+#include "xxhash.h"
 
 #define DEFAULT_SYMBOL "R_FUZZY_HASH"
 #define DEFAULT_UPSTREAM_ERROR_TIME 10
@@ -55,7 +57,12 @@
 #define DEFAULT_UPSTREAM_MAXERRORS 10
 
 #define DEFAULT_IO_TIMEOUT 500
+/* Minimum delay before sending a hedged request in seconds */
+#define FUZZY_HEDGE_MIN_DELAY 0.005
 #define DEFAULT_PORT 11335
+/* Replies are cached for a short time as they can be changed by learning */
+#define DEFAULT_CACHE_SIZE 4096
+#define DEFAULT_CACHE_EXPIRE 30
 
 struct fuzzy_mapping {
 	guint64 fuzzy_flag;
@@ -79,6 +86,14 @@ struct fuzzy_rule {
 	double max_score;
 	gboolean read_only;
 	gboolean skip_unknown;
+	gboolean batch;
+	gboolean hedge;
+	gdouble hedge_delay;
+	gboolean fast_shingles;
+	/* Filter of digests published by storage */
+	GByteArray *filter;
+	/* Digest -> reply of storage */
+	rspamd_lru_hash_t *cache;
 };
 
 struct fuzzy_ctx {
@@ -93,6 +108,8 @@ struct fuzzy_ctx {
 	guint32 min_height;
 	guint32 min_width;
 	guint32 io_timeout;
+	guint32 cache_size;
+	guint32 cache_expire;
 };
 
 struct fuzzy_client_session {
@@ -103,6 +120,12 @@ struct fuzzy_client_session {
 	struct rspamd_task *task;
 	struct upstream *server;
 	struct fuzzy_rule *rule;
+	/* Session sharing the same commands with another upstream */
+	struct fuzzy_client_session *peer;
+	struct rspamd_timer hedge_timer;
+	/* Timeout is clamped by the deadline of the task */
+	gboolean deadline;
+	gdouble start;
 	gint fd;
 };
 
@@ -289,6 +312,58 @@ fuzzy_free_rule (gpointer r)
 
 	g_string_free (rule->hash_key, TRUE);
 	g_string_free (rule->shingles_key, TRUE);
+
+	if (rule->filter != NULL) {
+		g_byte_array_free (rule->filter, TRUE);
+	}
+
+	if (rule->cache != NULL) {
+		rspamd_lru_hash_destroy (rule->cache);
+	}
+}
+
+static guint
+fuzzy_digest_hash (gconstpointer key)
+{
+	return XXH64 (key, sizeof (((struct rspamd_fuzzy_cmd *)NULL)->digest), 0);
+}
+
+static gboolean
+fuzzy_digest_equal (gconstpointer v, gconstpointer v2)
+{
+	return memcmp (v, v2,
+			sizeof (((struct rspamd_fuzzy_cmd *)NULL)->digest)) == 0;
+}
+
+static gchar *
+fuzzy_filter_read (rspamd_mempool_t *pool, gchar *chunk, gint len,
+	struct map_cb_data *data)
+{
+	if (data->cur_data == NULL) {
+		data->cur_data = g_byte_array_new ();
+	}
+
+	g_byte_array_append (data->cur_data, (const guint8 *)chunk, len);
+
+	return NULL;
+}
+
+static void
+fuzzy_filter_fin (rspamd_mempool_t *pool, struct map_cb_data *data)
+{
+	GByteArray *filter = data->cur_data;
+
+	if (filter != NULL && !rspamd_fuzzy_filter_valid (filter->data,
+			filter->len)) {
+		/* All digests are checked online without a filter */
+		msg_err ("invalid fuzzy filter loaded from %s", data->map->uri);
+		g_byte_array_free (filter, TRUE);
+		data->cur_data = NULL;
+	}
+
+	if (data->prev_data) {
+		g_byte_array_free (data->prev_data, TRUE);
+	}
 }
 
 static gint
@@ -333,6 +408,31 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj)
 	if ((value = ucl_object_find_key (obj, "skip_unknown")) != NULL) {
 		rule->skip_unknown = ucl_obj_toboolean (value);
 	}
+	if ((value = ucl_object_find_key (obj, "batch")) != NULL) {
+		rule->batch = ucl_obj_toboolean (value);
+	}
+	if ((value = ucl_object_find_key (obj, "hedge")) != NULL) {
+		rule->hedge = ucl_obj_toboolean (value);
+	}
+	if ((value = ucl_object_find_key (obj, "hedge_delay")) != NULL) {
+		rule->hedge_delay = ucl_obj_todouble (value);
+		rule->hedge = TRUE;
+	}
+	if ((value = ucl_object_find_key (obj, "fast_shingles")) != NULL) {
+		rule->fast_shingles = ucl_obj_toboolean (value);
+	}
+	if (fuzzy_module_ctx->cache_size > 0) {
+		rule->cache = rspamd_lru_hash_new_full (fuzzy_module_ctx->cache_size,
+				fuzzy_module_ctx->cache_expire, g_free, g_free,
+				fuzzy_digest_hash, fuzzy_digest_equal);
+	}
+	if ((value = ucl_object_find_key (obj, "filter")) != NULL) {
+		if (!rspamd_map_add (cfg, ucl_obj_tostring (value),
+				"Fuzzy filter", fuzzy_filter_read, fuzzy_filter_fin,
+				(void **)&rule->filter)) {
+			msg_err ("cannot add fuzzy filter %s", ucl_obj_tostring (value));
+		}
+	}
 
 	if ((value = ucl_object_find_key (obj, "servers")) != NULL) {
 		rule->servers = rspamd_upstreams_create ();
@@ -459,6 +559,22 @@ fuzzy_check_module_config (struct rspamd_config *cfg)
 	else {
 		fuzzy_module_ctx->io_timeout = DEFAULT_IO_TIMEOUT;
 	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "fuzzy_check",
+		"cache_size")) != NULL) {
+		fuzzy_module_ctx->cache_size = ucl_obj_toint (value);
+	}
+	else {
+		fuzzy_module_ctx->cache_size = DEFAULT_CACHE_SIZE;
+	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "fuzzy_check",
+		"cache_expire")) != NULL) {
+		fuzzy_module_ctx->cache_expire = ucl_obj_todouble (value);
+	}
+	else {
+		fuzzy_module_ctx->cache_expire = DEFAULT_CACHE_EXPIRE;
+	}
 
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "fuzzy_check",
@@ -512,24 +628,32 @@ fuzzy_io_fin (void *ud)
 {
 	struct fuzzy_client_session *session = ud;
 
-	if (session->commands) {
+	rspamd_timer_del (&session->hedge_timer);
+
+	if (session->peer) {
+		/* Commands are still used by another session */
+		session->peer->peer = NULL;
+		session->peer = NULL;
+	}
+	else if (session->commands) {
 		g_ptr_array_free (session->commands, TRUE);
 	}
 	event_del (&session->ev);
 	close (session->fd);
+	rspamd_upstream_request_end (session->server);
 }
 
 static GArray *
-fuzzy_preprocess_words (struct mime_text_part *part, rspamd_mempool_t *pool)
+fuzzy_preprocess_words (struct mime_text_part *part, struct rspamd_task *task)
 {
-	GArray *res;
+	GArray *res = NULL;
 
-	if (!IS_PART_UTF (part) || !part->language || part->language[0] == '\0' ||
-			part->normalized_words == NULL) {
-		res = part->words;
+	if (IS_PART_UTF (part) && part->language && part->language[0] != '\0') {
+		res = rspamd_mime_text_part_get_normalized_words (task, part);
 	}
-	else {
-		res = part->normalized_words;
+
+	if (res == NULL) {
+		res = rspamd_mime_text_part_get_words (task, part);
 	}
 
 	return res;
@@ -543,20 +667,25 @@ fuzzy_cmd_from_text_part (struct fuzzy_rule *rule,
 		int c,
 		gint flag,
 		guint32 weight,
-		rspamd_mempool_t *pool,
+		struct rspamd_task *task,
 		struct mime_text_part *part,
 		gboolean legacy,
 		gsize *size)
 {
+	rspamd_mempool_t *pool = task->task_pool;
 	struct rspamd_fuzzy_cmd *cmd;
 	struct rspamd_fuzzy_shingle_cmd *shcmd;
 	struct rspamd_shingle *sh;
 	guint i;
 	blake2b_state st;
 	rspamd_fstring_t *word;
-	GArray *words;
+	GArray *words = NULL;
+
+	if (!legacy) {
+		words = rspamd_mime_text_part_get_words (task, part);
+	}
 
-	if (legacy || part->words == NULL || part->words->len == 0) {
+	if (legacy || words == NULL || words->len == 0) {
 		cmd = rspamd_mempool_alloc0 (pool, sizeof (*cmd));
 
 		cmd->shingles_count = 0;
@@ -574,8 +703,7 @@ fuzzy_cmd_from_text_part (struct fuzzy_rule *rule,
 		 */
 		g_assert (blake2b_init_key (&st, BLAKE2B_OUTBYTES, rule->hash_key->str,
 				rule->hash_key->len) != -1);
-		words = fuzzy_preprocess_words (part, pool);
-
+		words = fuzzy_preprocess_words (part, task);
 		for (i = 0; i < words->len; i ++) {
 			word = &g_array_index (words, rspamd_fstring_t, i);
 			blake2b_update (&st, word->begin, word->len);
@@ -583,12 +711,22 @@ fuzzy_cmd_from_text_part (struct fuzzy_rule *rule,
 		blake2b_final (&st, shcmd->basic.digest, sizeof (shcmd->basic.digest));
 
 		msg_debug ("loading shingles with key %*xs", 16, rule->shingles_key->str);
-		sh = rspamd_shingles_generate (words,
-				rule->shingles_key->str, pool,
-				rspamd_shingles_default_filter, NULL);
+		if (rule->fast_shingles) {
+			sh = rspamd_shingles_generate_fast (words,
+					rule->shingles_key->str, pool);
+		}
+		else {
+			sh = rspamd_shingles_generate (words,
+					rule->shingles_key->str, pool,
+					rspamd_shingles_default_filter, NULL);
+		}
 		if (sh != NULL) {
 			memcpy (&shcmd->sgl, sh, sizeof (shcmd->sgl));
 			shcmd->basic.shingles_count = RSPAMD_SHINGLE_SIZE;
+
+			if (rule->fast_shingles) {
+				shcmd->basic.shingles_count |= RSPAMD_FUZZY_SHINGLES_FAST;
+			}
 		}
 
 		cmd = (struct rspamd_fuzzy_cmd *)shcmd;
@@ -658,8 +796,35 @@ fuzzy_cmd_from_data_part (struct fuzzy_rule *rule,
 	return cmd;
 }
 
+/*
+ * Parts that are not decoded to memory have only MD5 checksum that is the
+ * same as the legacy digest of their content
+ */
+static struct rspamd_fuzzy_cmd *
+fuzzy_cmd_from_checksum (int c,
+		gint flag,
+		guint32 weight,
+		rspamd_mempool_t *pool,
+		const gchar *checksum)
+{
+	struct rspamd_fuzzy_cmd *cmd;
+
+	cmd = rspamd_mempool_alloc0 (pool, sizeof (*cmd));
+	cmd->cmd = c;
+	cmd->version = RSPAMD_FUZZY_VERSION;
+	if (c != FUZZY_CHECK) {
+		cmd->flag = flag;
+		cmd->value = weight;
+	}
+	cmd->shingles_count = 0;
+	cmd->tag = ottery_rand_uint32 ();
+	rspamd_strlcpy (cmd->digest, checksum, sizeof (cmd->digest));
+
+	return cmd;
+}
+
 static gboolean
-fuzzy_cmd_to_wire (gint fd, const struct rspamd_fuzzy_cmd *cmd, gsize len)
+fuzzy_cmd_to_wire (gint fd, const void *cmd, gsize len)
 {
 	const guchar *out = (const guchar *)cmd;
 
@@ -673,13 +838,60 @@ fuzzy_cmd_to_wire (gint fd, const struct rspamd_fuzzy_cmd *cmd, gsize len)
 	return TRUE;
 }
 
+/*
+ * Pack as many commands as possible to each datagram
+ */
 static gboolean
-fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v)
+fuzzy_cmd_vector_to_wire_batch (gint fd, GPtrArray *v)
+{
+	guchar buf[RSPAMD_FUZZY_MAX_DATAGRAM];
+	struct rspamd_fuzzy_multi_cmd *mc = (struct rspamd_fuzzy_multi_cmd *)buf;
+	const struct rspamd_fuzzy_cmd *cmd;
+	gsize len, pos;
+	guint i;
+
+	mc->version = RSPAMD_FUZZY_VERSION;
+	mc->cmd = FUZZY_MULTI;
+	mc->count = 0;
+	pos = sizeof (*mc);
+
+	for (i = 0; i < v->len; i ++) {
+		cmd = g_ptr_array_index (v, i);
+		len = cmd->shingles_count > 0 ? sizeof (struct rspamd_fuzzy_shingle_cmd) :
+				sizeof (struct rspamd_fuzzy_cmd);
+
+		if (pos + len > sizeof (buf)) {
+			if (!fuzzy_cmd_to_wire (fd, buf, pos)) {
+				return FALSE;
+			}
+
+			mc->count = 0;
+			pos = sizeof (*mc);
+		}
+
+		memcpy (buf + pos, cmd, len);
+		pos += len;
+		mc->count ++;
+	}
+
+	if (mc->count > 0) {
+		return fuzzy_cmd_to_wire (fd, buf, pos);
+	}
+
+	return TRUE;
+}
+
+static gboolean
+fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v, struct fuzzy_rule *rule)
 {
 	guint i;
 	const struct rspamd_fuzzy_cmd *cmd;
 	gsize len;
 
+	if (rule->batch) {
+		return fuzzy_cmd_vector_to_wire_batch (fd, v);
+	}
+
 	for (i = 0; i < v->len; i ++) {
 		cmd = g_ptr_array_index (v, i);
 		len = cmd->shingles_count > 0 ? sizeof (struct rspamd_fuzzy_shingle_cmd) :
@@ -696,7 +908,8 @@ fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v)
  * Read replies one-by-one and remove them from req array
  */
 static const struct rspamd_fuzzy_reply *
-fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req)
+fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
+		const struct rspamd_fuzzy_cmd **pcmd)
 {
 	const guchar *p = *pos;
 	gint remain = *r;
@@ -715,6 +928,10 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req)
 	for (i = 0; i < req->len; i ++) {
 		cmd = g_ptr_array_index (req, i);
 		if (cmd->tag == rep->tag) {
+			if (pcmd != NULL) {
+				*pcmd = cmd;
+			}
+
 			g_ptr_array_remove_index (req, i);
 			*pos += sizeof (struct rspamd_fuzzy_reply);
 			*r -= sizeof (struct rspamd_fuzzy_reply);
@@ -727,21 +944,70 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req)
 	return NULL;
 }
 
+/* Insert result of a check reply received from storage or cache */
+static void
+fuzzy_insert_reply (struct rspamd_task *task, struct fuzzy_rule *rule,
+		const struct rspamd_fuzzy_reply *rep)
+{
+	struct fuzzy_mapping *map;
+	const gchar *symbol;
+	gchar buf[64];
+	double nval;
+
+	/* Get mapping by flag */
+	if ((map =
+			g_hash_table_lookup (rule->mappings,
+					GINT_TO_POINTER (rep->flag))) == NULL) {
+		/* Default symbol and default weight */
+		symbol = rule->symbol;
+
+	}
+	else {
+		/* Get symbol and weight from map */
+		symbol = map->symbol;
+	}
+
+	if (rep->prob > 0.5) {
+		nval = fuzzy_normalize (rep->value, rule->max_score);
+		nval *= rep->prob;
+		msg_info (
+				"<%s>, found fuzzy hash with weight: %.2f, in list: %s:%d%s",
+				task->message_id,
+				nval,
+				symbol,
+				rep->flag,
+				map == NULL ? "(unknown)" : "");
+		if (map != NULL || !rule->skip_unknown) {
+			rspamd_snprintf (buf,
+					sizeof (buf),
+					"%d: %.2f / %.2f",
+					rep->flag,
+					rep->prob,
+					nval);
+			rspamd_task_insert_result_single (task,
+					symbol,
+					nval,
+					g_list_prepend (NULL,
+						rspamd_mempool_strdup (
+							task->task_pool, buf)));
+		}
+	}
+}
+
 /* Call this whenever we got data from fuzzy storage */
 static void
 fuzzy_io_callback (gint fd, short what, void *arg)
 {
 	struct fuzzy_client_session *session = arg;
 	const struct rspamd_fuzzy_reply *rep;
-	struct fuzzy_mapping *map;
-	guchar buf[2048], *p;
-	const gchar *symbol;
+	const struct rspamd_fuzzy_cmd *cmd;
+	guchar buf[RSPAMD_FUZZY_MAX_DATAGRAM], *p;
 	gint r;
-	double nval;
 	gint ret = -1;
 
 	if (what == EV_WRITE) {
-		if (!fuzzy_cmd_vector_to_wire (fd, session->commands)) {
+		if (!fuzzy_cmd_vector_to_wire (fd, session->commands,
+				session->rule)) {
 			ret = -1;
 		}
 		else {
@@ -760,45 +1026,17 @@ fuzzy_io_callback (gint fd, short what, void *arg)
 		}
 		else {
 			p = buf;
-			while ((rep = fuzzy_process_reply (&p, &r, session->commands)) != NULL) {
-				/* Get mapping by flag */
-				if ((map =
-						g_hash_table_lookup (session->rule->mappings,
-								GINT_TO_POINTER (rep->flag))) == NULL) {
-					/* Default symbol and default weight */
-					symbol = session->rule->symbol;
-
-				}
-				else {
-					/* Get symbol and weight from map */
-					symbol = map->symbol;
+			while ((rep = fuzzy_process_reply (&p, &r, session->commands,
+					&cmd)) != NULL) {
+				fuzzy_insert_reply (session->task, session->rule, rep);
+
+				if (session->rule->cache != NULL) {
+					rspamd_lru_hash_insert (session->rule->cache,
+							g_memdup (cmd->digest, sizeof (cmd->digest)),
+							g_memdup (rep, sizeof (*rep)),
+							session->task->tv.tv_sec, 0);
 				}
 
-				if (rep->prob > 0.5) {
-					nval = fuzzy_normalize (rep->value, session->rule->max_score);
-					nval *= rep->prob;
-					msg_info (
-							"<%s>, found fuzzy hash with weight: %.2f, in list: %s:%d%s",
-							session->task->message_id,
-							nval,
-							symbol,
-							rep->flag,
-							map == NULL ? "(unknown)" : "");
-					if (map != NULL || !session->rule->skip_unknown) {
-						rspamd_snprintf (buf,
-								sizeof (buf),
-								"%d: %.2f / %.2f",
-								rep->flag,
-								rep->prob,
-								nval);
-						rspamd_task_insert_result_single (session->task,
-								symbol,
-								nval,
-								g_list_prepend (NULL,
-									rspamd_mempool_strdup (
-										session->task->task_pool, buf)));
-					}
-				}
 				ret = 1;
 			}
 		}
@@ -812,16 +1050,32 @@ fuzzy_io_callback (gint fd, short what, void *arg)
 		return;
 	}
 	else if (ret == -1) {
-		msg_err ("got error on IO with server %s, %d, %s",
-			rspamd_upstream_name (session->server),
-			errno,
-			strerror (errno));
-		rspamd_upstream_fail (session->server);
+		if (errno == ETIMEDOUT && session->deadline) {
+			/* Server is not blamed for the deadline of the task */
+			msg_info ("<%s>, no reply from %s before the task deadline",
+				session->task->message_id,
+				rspamd_upstream_name (session->server));
+		}
+		else {
+			msg_err ("got error on IO with server %s, %d, %s",
+				rspamd_upstream_name (session->server),
+				errno,
+				strerror (errno));
+			rspamd_upstream_fail (session->server);
+		}
+
 		remove_normal_event (session->task->s, fuzzy_io_fin, session);
 	}
 	else {
 		rspamd_upstream_ok (session->server);
+		rspamd_upstream_latency (session->server,
+				rspamd_get_ticks () - session->start);
 		if (session->commands->len == 0) {
+			if (session->peer) {
+				/* The first answer wins, drop the other request */
+				remove_normal_event (session->task->s, fuzzy_io_fin,
+						session->peer);
+			}
 			remove_normal_event (session->task->s, fuzzy_io_fin, session);
 		}
 	}
@@ -833,14 +1087,15 @@ fuzzy_learn_callback (gint fd, short what, void *arg)
 	struct fuzzy_learn_session *session = arg;
 	const struct rspamd_fuzzy_reply *rep;
 	struct fuzzy_mapping *map;
-	guchar buf[2048], *p;
+	guchar buf[RSPAMD_FUZZY_MAX_DATAGRAM], *p;
 	const gchar *symbol;
 	gint r;
 	gint ret = 0;
 
 	if (what == EV_WRITE) {
 		/* Send commands to storage */
-		if (!fuzzy_cmd_vector_to_wire (fd, session->commands)) {
+		if (!fuzzy_cmd_vector_to_wire (fd, session->commands,
+				session->rule)) {
 			if (*(session->err) == NULL) {
 				g_set_error (session->err,
 					g_quark_from_static_string ("fuzzy check"),
@@ -868,7 +1123,8 @@ fuzzy_learn_callback (gint fd, short what, void *arg)
 		}
 		else {
 			p = buf;
-			while ((rep = fuzzy_process_reply (&p, &r, session->commands)) != NULL) {
+			while ((rep = fuzzy_process_reply (&p, &r, session->commands,
+					NULL)) != NULL) {
 				if ((map =
 						g_hash_table_lookup (session->rule->mappings,
 								GINT_TO_POINTER (rep->flag))) == NULL) {
@@ -952,9 +1208,11 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 	struct mime_part *mime_part;
 	struct rspamd_image *image;
 	struct rspamd_fuzzy_cmd *cmd;
+	GByteArray *data;
 	gsize hashlen;
 	GList *cur;
 	GPtrArray *res;
+	guint i, nskipped = 0;
 
 	cur = task->text_parts;
 	res = g_ptr_array_new ();
@@ -995,12 +1253,12 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 		/*
 		 * Try legacy first
 		 */
-		cmd = fuzzy_cmd_from_text_part (rule, c, flag, value, task->task_pool,
+		cmd = fuzzy_cmd_from_text_part (rule, c, flag, value, task,
 				part, TRUE, NULL);
 		if (cmd) {
 			g_ptr_array_add (res, cmd);
 		}
-		cmd = fuzzy_cmd_from_text_part (rule, c, flag, value, task->task_pool,
+		cmd = fuzzy_cmd_from_text_part (rule, c, flag, value, task,
 				part, FALSE, NULL);
 		if (cmd) {
 			g_ptr_array_add (res, cmd);
@@ -1008,19 +1266,21 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 
 		cur = g_list_next (cur);
 	}
-	/* Process images */
+	/* Process images, their content is decoded only if dimensions match */
 	cur = task->images;
 	while (cur) {
 		image = cur->data;
-		if (image->data->len > 0) {
-			if (fuzzy_module_ctx->min_height <= 0 || image->height >=
-				fuzzy_module_ctx->min_height) {
-				if (fuzzy_module_ctx->min_width <= 0 || image->width >=
-					fuzzy_module_ctx->min_width) {
+		if (fuzzy_module_ctx->min_height <= 0 || image->height >=
+			fuzzy_module_ctx->min_height) {
+			if (fuzzy_module_ctx->min_width <= 0 || image->width >=
+				fuzzy_module_ctx->min_width) {
+				data = rspamd_mime_part_get_content (image->part);
+
+				if (data->len > 0) {
 					if (c == FUZZY_CHECK) {
 						cmd = fuzzy_cmd_from_data_part (rule, c, flag, value,
 								task->task_pool,
-								image->data->data, image->data->len,
+								data->data, data->len,
 								TRUE, NULL);
 						if (cmd) {
 							g_ptr_array_add (res, cmd);
@@ -1028,7 +1288,7 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 					}
 					cmd = fuzzy_cmd_from_data_part (rule, c, flag, value,
 							task->task_pool,
-							image->data->data, image->data->len,
+							data->data, data->len,
 							FALSE, NULL);
 					if (cmd) {
 						g_ptr_array_add (res, cmd);
@@ -1042,8 +1302,17 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 	cur = task->parts;
 	while (cur) {
 		mime_part = cur->data;
-		if (mime_part->content->len > 0 &&
+		if (mime_part->checksum != NULL &&
 			fuzzy_check_content_type (rule, mime_part->type)) {
+			if (fuzzy_module_ctx->min_bytes <= 0 || mime_part->size >=
+				fuzzy_module_ctx->min_bytes) {
+				cmd = fuzzy_cmd_from_checksum (c, flag, value,
+						task->task_pool, mime_part->checksum);
+				g_ptr_array_add (res, cmd);
+			}
+		}
+		else if (fuzzy_check_content_type (rule, mime_part->type) &&
+			rspamd_mime_part_get_content (mime_part)->len > 0) {
 			if (fuzzy_module_ctx->min_bytes <= 0 || mime_part->content->len >=
 				fuzzy_module_ctx->min_bytes) {
 				if (c == FUZZY_CHECK) {
@@ -1067,6 +1336,28 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 		cur = g_list_next (cur);
 	}
 
+	if (c == FUZZY_CHECK && rule->filter != NULL) {
+		/* Shingles can match similar messages, so they are always checked */
+		for (i = 0; i < res->len; ) {
+			cmd = g_ptr_array_index (res, i);
+
+			if (cmd->shingles_count == 0 &&
+					!rspamd_fuzzy_filter_check (rule->filter->data,
+							rule->filter->len, cmd->digest)) {
+				g_ptr_array_remove_index_fast (res, i);
+				nskipped ++;
+			}
+			else {
+				i ++;
+			}
+		}
+
+		if (nskipped > 0) {
+			msg_debug ("<%s>, skip %ud digests not found in fuzzy filter",
+				task->message_id, nskipped);
+		}
+	}
+
 	if (res->len == 0) {
 		g_ptr_array_free (res, FALSE);
 		return NULL;
@@ -1076,6 +1367,124 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 }
 
 
+static struct fuzzy_client_session *
+fuzzy_client_session_new (struct rspamd_task *task,
+	struct fuzzy_rule *rule,
+	GPtrArray *commands,
+	struct upstream *selected)
+{
+	struct fuzzy_client_session *session;
+	gdouble timeout, clamped;
+	gint sock;
+
+	if ((sock = rspamd_inet_address_connect (rspamd_upstream_addr (selected),
+			SOCK_DGRAM, TRUE)) == -1) {
+		msg_warn ("cannot connect to %s, %d, %s",
+			rspamd_upstream_name (selected),
+			errno,
+			strerror (errno));
+
+		return NULL;
+	}
+
+	/* Create session for a socket */
+	session =
+		rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (struct fuzzy_client_session));
+	event_set (&session->ev, sock, EV_WRITE, fuzzy_io_callback,
+		session);
+	timeout = fuzzy_module_ctx->io_timeout / 1000.0;
+	clamped = rspamd_session_clamp_timeout (task->s, timeout);
+
+	if (clamped < timeout) {
+		session->deadline = TRUE;
+	}
+
+	double_to_tv (clamped, &session->tv);
+	session->state = 0;
+	session->commands = commands;
+	session->task = task;
+	session->fd = sock;
+	session->server = selected;
+	session->rule = rule;
+	session->start = rspamd_get_ticks ();
+	rspamd_upstream_request_start (selected);
+	event_add (&session->ev, &session->tv);
+	register_async_event (task->s,
+		fuzzy_io_fin,
+		session,
+		g_quark_from_static_string ("fuzzy check"));
+
+	return session;
+}
+
+/*
+ * Send a duplicate of the unanswered commands to another upstream
+ */
+static void
+fuzzy_hedge_callback (gpointer arg)
+{
+	struct fuzzy_client_session *session = arg, *hedged;
+	struct upstream *selected = NULL;
+	guint i;
+
+	if (session->peer != NULL || session->commands->len == 0) {
+		return;
+	}
+
+	for (i = 0; i < 3; i ++) {
+		selected = rspamd_upstream_get (session->rule->servers,
+				RSPAMD_UPSTREAM_LATENCY);
+
+		if (selected != session->server) {
+			break;
+		}
+
+		selected = NULL;
+	}
+
+	if (selected == NULL) {
+		return;
+	}
+
+	msg_debug ("no reply from %s, send hedged request to %s",
+			rspamd_upstream_name (session->server),
+			rspamd_upstream_name (selected));
+	hedged = fuzzy_client_session_new (session->task, session->rule,
+			session->commands, selected);
+
+	if (hedged != NULL) {
+		hedged->peer = session;
+		session->peer = hedged;
+	}
+}
+
+static gdouble
+fuzzy_hedge_delay (struct fuzzy_client_session *session)
+{
+	gdouble delay, timeout;
+
+	timeout = fuzzy_module_ctx->io_timeout / 1000.0;
+
+	if (session->rule->hedge_delay > 0) {
+		delay = session->rule->hedge_delay;
+	}
+	else {
+		delay = rspamd_upstream_latency_percentile (session->server);
+
+		if (delay == 0) {
+			/* Not enough data about this upstream */
+			delay = timeout / 2.0;
+		}
+	}
+
+	if (delay < FUZZY_HEDGE_MIN_DELAY) {
+		delay = FUZZY_HEDGE_MIN_DELAY;
+	}
+
+	return delay;
+}
+
 static inline void
 register_fuzzy_client_call (struct rspamd_task *task,
 	struct fuzzy_rule *rule,
@@ -1083,39 +1492,66 @@ register_fuzzy_client_call (struct rspamd_task *task,
 {
 	struct fuzzy_client_session *session;
 	struct upstream *selected;
-	gint sock;
+	gdouble delay;
 
 	/* Get upstream */
-	selected = rspamd_upstream_get (rule->servers, RSPAMD_UPSTREAM_ROUND_ROBIN);
+	selected = rspamd_upstream_get (rule->servers, RSPAMD_UPSTREAM_LATENCY);
 	if (selected) {
-		if ((sock = rspamd_inet_address_connect (rspamd_upstream_addr (selected),
-				SOCK_DGRAM, TRUE)) == -1) {
-			msg_warn ("cannot connect to %s, %d, %s",
-				rspamd_upstream_name (selected),
-				errno,
-				strerror (errno));
+		session = fuzzy_client_session_new (task, rule, commands, selected);
+
+		if (session != NULL && rule->hedge &&
+				rspamd_upstreams_alive (rule->servers) > 1) {
+			delay = fuzzy_hedge_delay (session);
+
+			if (delay < session->tv.tv_sec + session->tv.tv_usec / 1e6) {
+				rspamd_timer_init (&session->hedge_timer, fuzzy_hedge_callback,
+						session);
+				rspamd_timer_add (task->ev_base, &session->hedge_timer, delay);
+			}
+		}
+	}
+}
+
+/*
+ * Process commands that have cached replies, they are removed from commands,
+ * returns FALSE if there are no commands left
+ */
+static gboolean
+fuzzy_check_cached (struct rspamd_task *task, struct fuzzy_rule *rule,
+		GPtrArray *commands)
+{
+	struct rspamd_fuzzy_cmd *cmd;
+	struct rspamd_fuzzy_reply *rep;
+	struct rspamd_stat *stat = NULL;
+	guint i;
+
+	if (task->worker != NULL) {
+		stat = task->worker->srv->stat;
+	}
+
+	for (i = 0; i < commands->len; ) {
+		cmd = g_ptr_array_index (commands, i);
+		rep = rspamd_lru_hash_lookup (rule->cache, cmd->digest,
+				task->tv.tv_sec);
+
+		if (rep != NULL) {
+			fuzzy_insert_reply (task, rule, rep);
+			g_ptr_array_remove_index_fast (commands, i);
+
+			if (stat != NULL) {
+				stat->fuzzy_cache_hits ++;
+			}
 		}
 		else {
-			/* Create session for a socket */
-			session =
-				rspamd_mempool_alloc (task->task_pool,
-					sizeof (struct fuzzy_client_session));
-			event_set (&session->ev, sock, EV_WRITE, fuzzy_io_callback,
-				session);
-			msec_to_tv (fuzzy_module_ctx->io_timeout, &session->tv);
-			session->state = 0;
-			session->commands = commands;
-			session->task = task;
-			session->fd = sock;
-			session->server = selected;
-			session->rule = rule;
-			event_add (&session->ev, &session->tv);
-			register_async_event (task->s,
-				fuzzy_io_fin,
-				session,
-				g_quark_from_static_string ("fuzzy check"));
+			i ++;
+
+			if (stat != NULL) {
+				stat->fuzzy_cache_misses ++;
+			}
 		}
 	}
+
+	return commands->len > 0;
 }
 
 /* This callback is called when we check message in fuzzy hashes storage */
@@ -1142,7 +1578,13 @@ fuzzy_symbol_callback (struct rspamd_task *task, void *unused)
 		rule = cur->data;
 		commands = fuzzy_generate_commands (task, rule, FUZZY_CHECK, 0, 0);
 		if (commands != NULL) {
-			register_fuzzy_client_call (task, rule, commands);
+			if (rule->cache == NULL ||
+					fuzzy_check_cached (task, rule, commands)) {
+				register_fuzzy_client_call (task, rule, commands);
+			}
+			else {
+				g_ptr_array_free (commands, TRUE);
+			}
 		}
 		cur = g_list_next (cur);
 	}
@@ -1207,7 +1649,9 @@ fuzzy_process_handler (struct rspamd_http_connection_entry *conn_ent,
 	GList *cur;
 	GError **err;
 	GPtrArray *commands;
+	struct rspamd_fuzzy_cmd *c;
 	gint r, *saved, rules = 0;
+	guint i;
 
 	/* Prepare task */
 	task = rspamd_task_new (NULL);
@@ -1248,6 +1692,14 @@ fuzzy_process_handler (struct rspamd_http_connection_entry *conn_ent,
 		res = 0;
 		commands = fuzzy_generate_commands (task, rule, cmd, flag, value);
 		if (commands != NULL) {
+			if (rule->cache != NULL) {
+				/* Replies cached by this process are not valid anymore */
+				for (i = 0; i < commands->len; i ++) {
+					c = g_ptr_array_index (commands, i);
+					rspamd_lru_hash_remove (rule->cache, c->digest);
+				}
+			}
+
 			res = register_fuzzy_controller_call (conn_ent, rule, task, commands,
 					saved, err);
 		}
@@ -39,36 +39,84 @@ local prefix = 'ip_score:'
 local normalize_score = 100
 local whitelist = nil
 local expire = 240
+-- Score changes are accumulated by a worker and sent to redis in batches
+local flush_interval = 5
+local flush_batch = 100
+-- Scores read from redis are cached by a worker for this number of seconds
+local cache_ttl = 30
+local cache_size = 10000
+local pending = {}
+local npending = 0
+local last_flush = 0
+local cache = {}
+local ncache = 0
 local rspamd_logger = require "rspamd_logger"
 local rspamd_redis = require "rspamd_redis"
 local upstream_list = require "rspamd_upstream_list"
 local _ = require "fun"
 
--- Set score based on metric's action
-local ip_score_set = function(task)
-  -- Callback generator
-  local make_key_cb = function(ip)
+-- Increments all keys by their values in a single command
+local incr_script = [[
+for i = 1, #KEYS do
+  redis.call('INCRBY', KEYS[i], ARGV[i])
+end
+return #KEYS
+]]
+
+-- Get current time of a task
+local function task_time(task)
+  local tv = task:get_timeval()
+  return tv['tv_usec'] / 1000000. + tv['tv_sec']
+end
+
+-- Send accumulated score changes to redis, one request per server
+local function flush_scores(task)
+  local batches = {}
+
+  for ip_str,score in pairs(pending) do
+    if score ~= 0 then
+      local upstream = upstreams:get_upstream_by_hash(ip_str)
+      if upstream then
+        local addr = upstream:get_addr()
+        local name = string.format('%s:%s', addr:to_string(), addr:get_port())
+        if not batches[name] then
+          batches[name] = {upstream = upstream, keys = {}, values = {}}
+        end
+        table.insert(batches[name]['keys'], prefix .. ip_str)
+        table.insert(batches[name]['values'], tostring(score))
+      end
+      -- Cached scores should include flushed changes
+      local cached = cache[ip_str]
+      if cached then
+        cached[1] = (cached[1] or 0) + score
+      end
+    end
+  end
+
+  pending = {}
+  npending = 0
+  last_flush = task_time(task)
+
+  for _name,batch in pairs(batches) do
+    local upstream = batch['upstream']
     local cb = function(task, err, data)
       if err then
         rspamd_logger.info('got error while IP score changing: ' .. err)
+        upstream:fail()
+      else
+        upstream:ok()
       end
     end
-    return cb
-  end
-  
-  local function process_action(ip, score)
-    local cmd = 'INCRBY'
-    local args = {}
-    table.insert(args, prefix .. ip:to_string())
-    if score > 0 then
-      table.insert(args, score)
-    else
-      cmd = 'DECRBY'
-      table.insert(args, -score)
-    end
-    
-    return cmd, args
+    local args = {incr_script, tostring(#batch['keys'])}
+    _.each(function(k) table.insert(args, k) end, batch['keys'])
+    _.each(function(v) table.insert(args, v) end, batch['values'])
+
+    rspamd_redis.make_request(task, upstream:get_addr(), cb, 'EVAL', args)
   end
+end
+
+-- Set score based on metric's action
+local ip_score_set = function(task)
 
   local action = task:get_metric_action(metric)
   local ip = task:get_from_ip()
@@ -84,49 +132,55 @@ local ip_score_set = function(task)
     end
   end
 
-  local cmd, args
+  local score
   if action then
-    local cb = make_key_cb(ip)
     -- Now check action
     if action == 'reject' then
-      cmd, args = process_action(ip, reject_score)
+      score = reject_score
     elseif action == 'add header' then
-      cmd, args = process_action(ip, add_header_score)
+      score = add_header_score
     elseif action == 'no action' then
-      cmd, args = process_action(ip, no_action_score)
+      score = no_action_score
     end
   end
-  
-  if cmd then
-    local upstream = upstreams:get_upstream_by_hash(ip:to_string())
-    local addr = upstream:get_addr()
-    rspamd_redis.make_request(task, addr, make_key_cb(ip), cmd, args)
+
+  if score then
+    local ip_str = ip:to_string()
+    if not pending[ip_str] then
+      pending[ip_str] = 0
+      npending = npending + 1
+    end
+    pending[ip_str] = pending[ip_str] + score
+  end
+
+  if npending > 0 and (npending >= flush_batch or
+      task_time(task) - last_flush >= flush_interval) then
+    flush_scores(task)
   end
 end
 
 -- Check score for ip in keystorage
 local ip_score_check = function(task)
-  local cb = function(task, err, data)
-    if err then
-      -- Key is not found or error occurred
+  local function insert_score(ip_str, score)
+    -- Changes that are not flushed yet are known to this worker only
+    if pending[ip_str] then
+      score = (score or 0) + pending[ip_str]
+    end
+    if not score then
       return
-    elseif data then
-      local score = tonumber(data)
-      if not score then
-        return
-      end
-      
-      -- Normalize
-      if score > 0 and score > normalize_score then
-        score = 1
-      elseif score < 0 and score < -normalize_score then
-        score = -1
-      else
-        score = score / normalize_score
-      end
-      task:insert_result(symbol, score)
     end
+
+    -- Normalize
+    if score > 0 and score > normalize_score then
+      score = 1
+    elseif score < 0 and score < -normalize_score then
+      score = -1
+    else
+      score = score / normalize_score
+    end
+    task:insert_result(symbol, score)
   end
+
   local ip = task:get_from_ip()
   if ip:is_valid() then
     if whitelist then
@@ -135,9 +189,36 @@ local ip_score_check = function(task)
         return
       end
     end
-    local upstream = upstreams:get_upstream_by_hash(ip:to_string())
+    local ip_str = ip:to_string()
+    local ntime = task_time(task)
+    local cached = cache[ip_str]
+    if cached and ntime - cached[2] < cache_ttl then
+      insert_score(ip_str, cached[1])
+      return
+    end
+
+    local cb = function(task, err, data)
+      if err then
+        -- Key is not found or error occurred
+        return
+      end
+      local score = tonumber(data)
+
+      if not cache[ip_str] then
+        if ncache >= cache_size then
+          -- Drop the whole cache instead of tracking the oldest entries
+          cache = {}
+          ncache = 0
+        end
+        ncache = ncache + 1
+      end
+      -- Missing scores are cached as well
+      cache[ip_str] = {score, ntime}
+      insert_score(ip_str, score)
+    end
+    local upstream = upstreams:get_upstream_by_hash(ip_str)
     local addr = upstream:get_addr()
-    rspamd_redis.make_request(task, addr, cb, 'GET', {prefix .. ip:to_string()})
+    rspamd_redis.make_request(task, addr, cb, 'GET', {prefix .. ip_str})
   end
 end
 
@@ -176,6 +257,18 @@ local configure_ip_score_module = function()
     if opts['prefix'] then
       prefix = opts['prefix']
     end
+    if opts['flush_interval'] then
+      flush_interval = tonumber(opts['flush_interval'])
+    end
+    if opts['flush_batch'] then
+      flush_batch = tonumber(opts['flush_batch'])
+    end
+    if opts['cache_ttl'] then
+      cache_ttl = tonumber(opts['cache_ttl'])
+    end
+    if opts['cache_size'] then
+      cache_size = tonumber(opts['cache_size'])
+    end
     if opts['servers'] then
       upstreams = upstream_list.create(opts['servers'], default_port)
       if not upstreams then
@@ -197,6 +290,10 @@ if rspamd_config:get_api_version() >= 9 then
   rspamd_config:register_module_option('ip_score', 'normalize_score', 'uint')
   rspamd_config:register_module_option('ip_score', 'whitelist', 'map')
   rspamd_config:register_module_option('ip_score', 'expire', 'uint')
+  rspamd_config:register_module_option('ip_score', 'flush_interval', 'uint')
+  rspamd_config:register_module_option('ip_score', 'flush_batch', 'uint')
+  rspamd_config:register_module_option('ip_score', 'cache_ttl', 'uint')
+  rspamd_config:register_module_option('ip_score', 'cache_size', 'uint')
 
   configure_ip_score_module()
   if upstreams and normalize_score > 0 then
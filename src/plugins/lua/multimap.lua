@@ -28,7 +28,6 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 local rules = {}
 local rspamd_logger = require "rspamd_logger"
-local cdb = require "rspamd_cdb"
 local _ = require "fun"
 --local dumper = require 'pl.pretty'.dump
 
@@ -57,9 +56,18 @@ local function check_multimap(task)
         srch = value:to_string()
       end
 
-      ret = r['cdb']:lookup(srch)
+      ret = r['cdb']:get_key(srch)
     elseif r['radix'] then
       ret = r['radix']:get_key(value)
+    elseif r['regexp_map'] then
+      if value then
+        -- All patterns of a map are checked at once
+        local matched = r['regexp_map']:match(value)
+        if matched then
+          task:insert_result(r['symbol'], 1, unpack(matched))
+          return
+        end
+      end
     elseif r['hash'] then
       ret = r['hash']:get_key(value)
     end
@@ -135,8 +143,9 @@ local function add_multimap_rule(key, newrule)
   end
   -- Check cdb flag
   if string.find(newrule['map'], '^cdb://.*$') then
-    local test = cdb.create(newrule['map'])
-    newrule['cdb'] = cdb.create(newrule['map'])
+    -- Database is mapped by all workers and reloaded when it is replaced
+    newrule['cdb'] = rspamd_config:add_hash_map (newrule['map'],
+      newrule['description'])
     if newrule['cdb'] then
       return newrule
     else
@@ -151,6 +160,19 @@ local function add_multimap_rule(key, newrule)
       else
         rspamd_logger.warn('Cannot add rule: map doesn\'t exists: ' .. newrule['map'])
       end
+    elseif (newrule['type'] == 'header' or newrule['type'] == 'rcpt' or newrule['type'] == 'from')
+        and (newrule['regexp'] or newrule['glob']) then
+      local re_type = 'regexp'
+      if newrule['glob'] then
+        re_type = 'glob'
+      end
+      newrule['regexp_map'] = rspamd_config:add_regexp_map (newrule['map'],
+        newrule['description'], re_type)
+      if newrule['regexp_map'] then
+        return newrule
+      else
+        rspamd_logger.warn('Cannot add rule: map doesn\'t exists: ' .. newrule['map'])
+      end
     elseif newrule['type'] == 'header' or newrule['type'] == 'rcpt' or newrule['type'] == 'from' then
       newrule['hash'] = rspamd_config:add_hash_map (newrule['map'], newrule['description'])
       if newrule['hash'] then
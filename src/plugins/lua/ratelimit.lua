@@ -53,9 +53,16 @@ local whitelisted_rcpts = {'postmaster', 'mailer-daemon'}
 local whitelisted_ip = nil
 local max_rcpt = 5
 local upstreams = nil
+-- Host local buckets, limits with burst not greater than strict_burst are
+-- always checked in redis
+local buckets = nil
+local strict_burst = 10
+local sync_interval = 10
+local sync_batch = 100
 
 local rspamd_logger = require "rspamd_logger"
 local rspamd_redis = require "rspamd_redis"
+local rspamd_buckets = require "rspamd_buckets"
 local upstream_list = require "rspamd_upstream_list"
 local _ = require "fun"
 --local dumper = require 'pl.pretty'.dump
@@ -193,6 +200,134 @@ local function set_limits(task, args)
   end
 end
 
+--- Get current time of a task
+local function task_time(task)
+  local tv = task:get_timeval()
+  return tv['tv_usec'] / 1000000. + tv['tv_sec']
+end
+
+--- Check whether a limit is handled by local buckets
+local function is_local_limit(limit)
+  return buckets and limit[1] > strict_burst
+end
+
+--- Send hits of local buckets to redis and merge their global state
+local function sync_buckets(task)
+  local ntime = task_time(task)
+  if not buckets:try_sync(ntime, sync_interval) then
+    return
+  end
+
+  local deltas = buckets:collect(sync_batch)
+  if #deltas == 0 then
+    return
+  end
+
+  -- Group buckets by upstreams to send a single batch to each server
+  local batches = {}
+  _.each(function(d)
+    local upstream = upstreams:get_upstream_by_hash(d['name'])
+    if upstream then
+      local ip = upstream:get_addr()
+      local addr = string.format('%s:%s', ip:to_string(), ip:get_port())
+      if not batches[addr] then
+        batches[addr] = {upstream = upstream, deltas = {}}
+      end
+      table.insert(batches[addr]['deltas'], d)
+    else
+      buckets:restore(d['name'], d['pending'])
+    end
+  end, deltas)
+
+  for _addr,batch in pairs(batches) do
+    local upstream = batch['upstream']
+    local addr = upstream:get_addr()
+    local names = _.totable(_.map(function(d) return d['name'] end,
+      batch['deltas']))
+
+    local function restore_batch()
+      _.each(function(d) buckets:restore(d['name'], d['pending']) end,
+        batch['deltas'])
+    end
+
+    local function sync_set_cb(task, err, data)
+      if err then
+        rspamd_logger.info('got error while syncing limits: ' .. err)
+        upstream:fail()
+        restore_batch()
+      else
+        upstream:ok()
+      end
+    end
+
+    local function sync_get_cb(task, err, data)
+      if data then
+        local values = {}
+        _.each(function(elt, d)
+          local bucket = elt[2] - d['rate'] * (ntime - elt[1])
+          if bucket < 0 then
+            bucket = 0
+          end
+          bucket = bucket + d['pending']
+          buckets:merge(d['name'], ntime, bucket)
+          table.insert(values, d['name'])
+          table.insert(values, string.format('%.3f:%.3f', ntime, bucket))
+        end, _.zip(parse_limits(data), _.iter(batch['deltas'])))
+
+        rspamd_redis.make_request(task, addr, sync_set_cb, 'MSET', values)
+      else
+        if err then
+          rspamd_logger.info('got error while syncing limits: ' .. err)
+        end
+        upstream:fail()
+        restore_batch()
+      end
+    end
+
+    rspamd_redis.make_request(task, addr, sync_get_cb, 'MGET', names)
+  end
+end
+
+--- Check limits of local buckets, other limits are checked in redis
+local function check_local_limits(task, args)
+  local ntime = task_time(task)
+  local strict = {}
+
+  _.each(function(a)
+    if is_local_limit(a[1]) then
+      local bucket = buckets:check(a[2], ntime)
+      if bucket and bucket > a[1][1] then
+        task:set_pre_result('soft reject', 'Ratelimit exceeded')
+      end
+    else
+      table.insert(strict, a)
+    end
+  end, args)
+
+  if #strict > 0 then
+    check_limits(task, strict)
+  end
+end
+
+--- Update local buckets, other limits are updated in redis
+local function set_local_limits(task, args)
+  local ntime = task_time(task)
+  local strict = {}
+
+  _.each(function(a)
+    if not is_local_limit(a[1]) or
+        not buckets:inc(a[2], a[1][2], ntime) then
+      table.insert(strict, a)
+    end
+  end, args)
+
+  if #strict > 0 then
+    set_limits(task, strict)
+  end
+
+  sync_buckets(task)
+end
+
 --- Make rate key
 local function make_rate_key(from, to, ip)
   if from and ip and ip:is_valid() then
@@ -275,11 +410,19 @@ end
 
 --- Check limit
 local function rate_test(task)
-  rate_test_set(task, check_limits)
+  if buckets then
+    rate_test_set(task, check_local_limits)
+  else
+    rate_test_set(task, check_limits)
+  end
 end
 --- Update limit
 local function rate_set(task)
-  rate_test_set(task, set_limits)
+  if buckets then
+    rate_test_set(task, set_local_limits)
+  else
+    rate_test_set(task, set_limits)
+  end
 end
 
 
@@ -348,6 +491,10 @@ if rspamd_config:get_api_version() >= 9 then
   rspamd_config:register_module_option('ratelimit', 'whitelisted_ip', 'map')
   rspamd_config:register_module_option('ratelimit', 'limit', 'string')
   rspamd_config:register_module_option('ratelimit', 'max_rcpt', 'uint')
+  rspamd_config:register_module_option('ratelimit', 'local_buckets', 'uint')
+  rspamd_config:register_module_option('ratelimit', 'strict_burst', 'uint')
+  rspamd_config:register_module_option('ratelimit', 'sync_interval', 'uint')
+  rspamd_config:register_module_option('ratelimit', 'sync_batch', 'uint')
 end
 
 local function parse_whitelisted_rcpts(str)
@@ -375,6 +522,23 @@ if opts then
     max_rcpt = tonumber(opts['max_rcpt'])
   end
 
+  if opts['strict_burst'] then
+    strict_burst = tonumber(opts['strict_burst'])
+  end
+  if opts['sync_interval'] then
+    sync_interval = tonumber(opts['sync_interval'])
+  end
+  if opts['sync_batch'] then
+    sync_batch = tonumber(opts['sync_batch'])
+  end
+  if opts['local_buckets'] and tonumber(opts['local_buckets']) > 0 then
+    -- Buckets are created before workers are forked, so they are shared
+    buckets = rspamd_buckets.create(tonumber(opts['local_buckets']))
+    if not buckets then
+      rspamd_logger.err('cannot create local buckets, use redis only')
+    end
+  end
+
   if not opts['servers'] then
     rspamd_logger.err('no servers are specified')
   else
@@ -35,6 +35,8 @@ local private_ips = nil
 
 local rspamd_logger = require 'rspamd_logger'
 local rspamd_ip = require 'rspamd_ip'
+local rspamd_rbl = require 'rspamd_rbl'
+local rbl_engine = rspamd_rbl.create()
 
 local function validate_dns(lstr)
   if lstr:match('%.%.') then
@@ -63,61 +65,12 @@ local function is_excluded_ip(rip)
   return false
 end
 
-local function ip_to_rbl(ip, rbl)
-  return table.concat(ip:inversed_str_octets(), '.') .. '.' .. rbl
+local function ip_to_rbl(ip)
+  return table.concat(ip:inversed_str_octets(), '.')
 end
 
 local function rbl_cb (task)
-  local function rbl_dns_cb(resolver, to_resolve, results, err, key)
-    if results then
-      local thisrbl = nil
-      for k,r in pairs(rbls) do
-        if k == key then
-          thisrbl = r
-          break
-        end
-      end
-      if thisrbl ~= nil then
-        if thisrbl['returncodes'] == nil then
-          if thisrbl['symbol'] ~= nil then
-            task:insert_result(thisrbl['symbol'], 1)
-          end
-        else
-          for _,result in pairs(results) do 
-            local ipstr = result:to_string()
-            local foundrc = false
-            for s,i in pairs(thisrbl['returncodes']) do
-              if type(i) == 'string' then
-                if string.find(ipstr, '^' .. i .. '$') then
-                  foundrc = true
-                  task:insert_result(s, 1)
-                  break
-                end
-              elseif type(i) == 'table' then
-                for _,v in pairs(i) do
-                  if string.find(ipstr, '^' .. v .. '$') then
-                    foundrc = true
-                    task:insert_result(s, 1)
-                    break
-                  end
-                end
-              end
-            end
-            if not foundrc then
-              if thisrbl['unknown'] and thisrbl['symbol'] then
-                task:insert_result(thisrbl['symbol'], 1)
-              else
-                rspamd_logger.err('RBL ' .. thisrbl['rbl'] ..
-                  ' returned unknown result ' .. ipstr)
-              end
-            end
-          end
-        end
-      end
-    end
-    task:inc_dns_req()
-  end
-
+  local batch = rbl_engine:batch(task)
   local havegot = {}
   local notgot = {}
 
@@ -163,8 +116,7 @@ local function rbl_cb (task)
 	      return
 	    end
 	  end
-	  task:get_resolver():resolve_a(task:get_session(), task:get_mempool(),
-	    havegot['helo'] .. '.' .. rbl['rbl'], rbl_dns_cb, k)
+	  batch:add(rbl['rule_id'], havegot['helo'])
 	end)()
       end
 
@@ -201,13 +153,11 @@ local function rbl_cb (task)
           end
           if rbl['emails'] == 'domain_only' then
             for domain, _ in pairs(havegot['emails']) do
-              task:get_resolver():resolve_a(task:get_session(), task:get_mempool(),
-                domain .. '.' .. rbl['rbl'], rbl_dns_cb, k)
+              batch:add(rbl['rule_id'], domain)
             end
           else
             for _, email in pairs(havegot['emails']) do
-              task:get_resolver():resolve_a(task:get_session(), task:get_mempool(),
-                email .. '.' .. rbl['rbl'], rbl_dns_cb, k)
+              batch:add(rbl['rule_id'], email)
             end
           end
         end)()
@@ -225,8 +175,7 @@ local function rbl_cb (task)
 	      return
 	    end
 	  end
-	  task:get_resolver():resolve_a(task:get_session(), task:get_mempool(),
-	    havegot['rdns'] .. '.' .. rbl['rbl'], rbl_dns_cb, k)
+	  batch:add(rbl['rule_id'], havegot['rdns'])
 	end)()
       end
 
@@ -244,8 +193,7 @@ local function rbl_cb (task)
 	  end
 	  if (havegot['from']:get_version() == 6 and rbl['ipv6']) or
 	    (havegot['from']:get_version() == 4 and rbl['ipv4']) then
-	    task:get_resolver():resolve_a(task:get_session(), task:get_mempool(),
-	      ip_to_rbl(havegot['from'], rbl['rbl']), rbl_dns_cb, k)
+	    batch:add(rbl['rule_id'], ip_to_rbl(havegot['from']))
 	  end
 	end)()
       end
@@ -269,8 +217,7 @@ local function rbl_cb (task)
                 ((rbl['exclude_private_ips'] and not is_private_ip(rh['real_ip'])) or
                 not rbl['exclude_private_ips']) and ((rbl['exclude_local_ips'] and
                 not is_excluded_ip(rh['real_ip'])) or not rbl['exclude_local_ips']) then
-                  task:get_resolver():resolve_a(task:get_session(), task:get_mempool(),
-                    ip_to_rbl(rh['real_ip'], rbl['rbl']), rbl_dns_cb, k)
+                  batch:add(rbl['rule_id'], ip_to_rbl(rh['real_ip']))
               end
 	    end
 	  end
@@ -278,6 +225,8 @@ local function rbl_cb (task)
       end
     end)()
   end
+
+  batch:send()
 end
 
 -- Registration
@@ -373,7 +322,17 @@ for key,rbl in pairs(opts['rbls']) do
       end
     end
   end
-  rbls[key] = rbl
+  rbl['rule_id'] = rbl_engine:add_rule({
+    zone = rbl['rbl'],
+    symbol = rbl['symbol'],
+    returncodes = rbl['returncodes'],
+    unknown = rbl['unknown'],
+  })
+  if rbl['rule_id'] then
+    rbls[key] = rbl
+  else
+    rspamd_logger.err('cannot add RBL ' .. key .. ': invalid definition')
+  end
 end
 for _, w in pairs(white_symbols) do
   for _, b in pairs(black_symbols) do
@@ -47,6 +47,9 @@ local function filter(func, tbl)
   return newtbl
 end
 
+-- Settings tables are compiled once by rspamd, so they are never recreated
+local whitelist_settings = {whitelist = true}
+
 -- Check limit for a task
 local function check_settings(task)
   local function check_addr_setting(rule, addr)
@@ -161,7 +164,7 @@ local function check_settings(task)
 
     if res then
       if rule['whitelist'] then
-        return {whitelist = true}
+        return whitelist_settings
       else
         return rule['apply']
       end
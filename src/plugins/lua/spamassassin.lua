@@ -46,6 +46,8 @@ local known_plugins = {
 -- Internal variables
 local rules = {}
 local atoms = {}
+-- Rules that could be evaluated by mime expressions
+local native_atoms = {}
 local metas = {}
 local freemail_domains = {}
 local freemail_trie
@@ -78,6 +80,85 @@ local function split(str, delim)
   return result
 end
 
+-- Convert '/re/flags' to the parts of mime regexp atom
+local function sa_native_regexp(re_expr)
+  local re, flags = string.match(re_expr, '^/(.*)/([a-z]*)$')
+
+  if not re or string.len(re) == 0 or string.find(flags, '[^imsx]') then
+    return nil
+  end
+
+  -- Mime atom ends at the first unescaped slash
+  local escaped = false
+  for i = 1, string.len(re) do
+    local c = string.sub(re, i, i)
+    if escaped then
+      escaped = false
+    elseif c == '\\' then
+      escaped = true
+    elseif c == '/' then
+      return nil
+    end
+  end
+
+  if escaped then
+    return nil
+  end
+
+  return re, flags
+end
+
+-- Returns mime regexp atom for a rule or nil if it needs lua processing
+local function sa_native_atom(rule)
+  if not rule['re_expr'] then
+    return nil
+  end
+
+  local re, flags = sa_native_regexp(rule['re_expr'])
+  if not re then
+    return nil
+  end
+
+  if rule['multiple'] then
+    flags = flags .. 'A'
+  end
+
+  local t = rule['type']
+  if t == 'header' then
+    local hdrs = rule['header']
+    if not hdrs or #hdrs ~= 1 or rule['unset'] then
+      return nil
+    end
+    local h = hdrs[1]
+    if h['function'] or not string.match(h['header'], '^[%w_%-]+$') then
+      return nil
+    end
+    if h['raw'] then
+      flags = flags .. 'X'
+    else
+      flags = flags .. 'H'
+    end
+    if h['strong'] then
+      flags = flags .. 'S'
+    end
+
+    local atom = string.format('%s=/%s/%s', h['header'], re, flags)
+    if rule['not'] then
+      atom = '!' .. atom
+    end
+
+    return atom
+  elseif t == 'part' then
+    return string.format('/%s/%sP', re, flags)
+  elseif t == 'message' then
+    return string.format('/%s/%sM', re, flags)
+  elseif t == 'uri' then
+    return string.format('/%s/%sU', re, flags)
+  end
+
+  return nil
+end
+
 local function handle_header_def(hline, cur_rule)
   --Now check for modifiers inside header's name
   local hdrs = split(hline, '[^|]+')
@@ -689,6 +770,7 @@ _.each(function(k, r)
     end
     --rspamd_config:register_symbol(k, calculate_score(k), f)
     atoms[k] = f
+    native_atoms[k] = sa_native_atom(r)
   end,
   _.filter(function(k, r)
       return r['type'] == 'header' and r['header']
@@ -746,6 +828,7 @@ _.each(function(k, r)
     end
     --rspamd_config:register_symbol(k, calculate_score(k), f)
     atoms[k] = f
+    native_atoms[k] = sa_native_atom(r)
   end,
   _.filter(function(k, r)
       return r['type'] == 'part'
@@ -765,6 +848,7 @@ _.each(function(k, r)
     end
     --rspamd_config:register_symbol(k, calculate_score(k), f)
      atoms[k] = f
+     native_atoms[k] = sa_native_atom(r)
   end,
   _.filter(function(k, r)
       return r['type'] == 'message'
@@ -791,6 +875,7 @@ _.each(function(k, r)
     end
     --rspamd_config:register_symbol(k, calculate_score(k), f)
      atoms[k] = f
+     native_atoms[k] = sa_native_atom(r)
   end,
   _.filter(function(k, r)
       return r['type'] == 'uri'
@@ -832,6 +917,66 @@ local function process_atom(atom, task)
   return 0
 end
 
+-- Atoms of rules that are not metas, metas are inlined in native expressions
+local rule_atoms = {}
+_.each(function(k, f) rule_atoms[k] = f end, atoms)
+
+-- Lua atoms of native expressions are global functions
+_G['sa_undefined_atom'] = function(task) return 0 end
+
+local function sa_lua_atom(name)
+  local gname = 'sa_atom_' .. name
+  if not _G[gname] then
+    _G[gname] = function(task)
+      return process_atom(name, task)
+    end
+  end
+
+  return gname
+end
+
+-- Convert meta expression to mime expression, returns nil if it is impossible
+local function sa_native_expression(expr, visited)
+  local valid = true
+  local res = string.gsub(expr, '[%w_]+', function(name)
+    if string.match(name, '^%d+$') then
+      return name
+    elseif native_atoms[name] then
+      return '(' .. native_atoms[name] .. ')'
+    elseif rule_atoms[name] then
+      return sa_lua_atom(name)
+    end
+
+    local m = rules[name]
+    if m and m['type'] == 'meta' then
+      if visited[name] then
+        valid = false
+        return name
+      end
+      visited[name] = true
+      local sub = sa_native_expression(m['meta'], visited)
+      visited[name] = nil
+
+      if not sub then
+        valid = false
+        return name
+      end
+
+      return '(' .. sub .. ')'
+    end
+
+    return 'sa_undefined_atom'
+  end)
+
+  if not valid then
+    return nil
+  end
+
+  return res
+end
+
+local nnative, nlua = 0, 0
+
 -- Meta rules
 _.each(function(k, r)
     local expression = nil
@@ -859,7 +1004,17 @@ _.each(function(k, r)
       if r['score'] then
         rspamd_config:set_metric_symbol(k, r['score'], r['description'])
       end
-      rspamd_config:register_symbol(k, calculate_score(k, r), meta_cb)
+
+      -- Prefer native evaluation, lua callback is kept for other lua metas
+      local native = sa_native_expression(r['meta'], {[k] = true})
+      if native and rspamd_config:register_mime_expression(k,
+          calculate_score(k, r), native) then
+        nnative = nnative + 1
+      else
+        rspamd_config:register_symbol(k, calculate_score(k, r), meta_cb)
+        nlua = nlua + 1
+      end
+
       if not atoms[k] then
         atoms[k] = meta_cb
       end
@@ -868,4 +1023,7 @@ _.each(function(k, r)
   _.filter(function(k, r)
       return r['type'] == 'meta'
     end,
-    rules))
\ No newline at end of file
+    rules))
+
+rspamd_logger.infox('registered %1 native and %2 lua spamassassin rules',
+  nnative, nlua)
\ No newline at end of file
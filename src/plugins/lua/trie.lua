@@ -46,34 +46,43 @@ local function tries_callback(task)
   
   local matched = {}
 
-  local function gen_trie_cb(raw)
+  local function process_matches(matches, raw)
     local patterns = mime_patterns
     local params = mime_params
     if raw then
       patterns = raw_patterns
       params = raw_params
     end
-    
-    return function (idx, pos)
+
+    for idx, positions in pairs(matches) do
       local param = params[idx]
       local pattern = patterns[idx]
-      
-      if param['multi'] or not matched[pattern] then
-        rspamd_logger.debugx("<%1> matched pattern %2 at pos %3",
-          task:get_message_id(), pattern, pos)
-        task:insert_result(param['symbol'], 1.0)
-        if not param['multi'] then
-          matched[pattern] = true
+
+      for _, pos in ipairs(positions) do
+        if param['multi'] or not matched[pattern] then
+          rspamd_logger.debugx("<%1> matched pattern %2 at pos %3",
+            task:get_message_id(), pattern, pos)
+          task:insert_result(param['symbol'], 1.0)
+          if not param['multi'] then
+            matched[pattern] = true
+          end
         end
       end
     end
   end
-  
+
+  -- Matches are collected without calling lua for each of them
   if mime_trie then
-    mime_trie:search_mime(task, gen_trie_cb(false))
+    local matches = mime_trie:search_mime(task)
+    if matches then
+      process_matches(matches, false)
+    end
   end
   if raw_trie then
-    raw_trie:search_rawmsg(task, gen_trie_cb(true))
+    local matches = raw_trie:search_rawmsg(task)
+    if matches then
+      process_matches(matches, true)
+    end
   end
 end
 
@@ -35,16 +35,40 @@
 #include "lua/lua_common.h"
 #include "main.h"
 
+#define DEFAULT_REGEXP_MAX_TIME 1.0
+#define DEFAULT_REGEXP_SKIPPED_SYMBOL "REGEXP_SKIPPED"
+#define REGEXP_BUDGET_VAR "regexp_budget"
+
+/*
+ * Once the time budget of a task is spent low priority rules are skipped,
+ * normal rules are skipped after twice the budget, high are always checked
+ */
+enum regexp_rule_priority {
+	REGEXP_PRIORITY_LOW = 0,
+	REGEXP_PRIORITY_NORMAL,
+	REGEXP_PRIORITY_HIGH
+};
+
 struct regexp_module_item {
 	struct rspamd_expression *expr;
 	const gchar *symbol;
 	struct ucl_lua_funcdata *lua_function;
+	enum regexp_rule_priority priority;
 };
 
 struct regexp_ctx {
 	struct module_ctx ctx;
 	rspamd_mempool_t *regexp_pool;
 	gsize max_size;
+	/* Time budget of all rules per task in seconds, 0 means unlimited */
+	gdouble max_time;
+	const gchar *skipped_symbol;
+};
+
+/* Time spent on regexp rules for a task */
+struct regexp_task_budget {
+	gdouble spent;
+	gboolean reported;
 };
 
 static struct regexp_ctx *regexp_module_ctx = NULL;
@@ -92,6 +116,31 @@ read_regexp_expression (rspamd_mempool_t * pool,
 }
 
 
+static enum regexp_rule_priority
+regexp_parse_priority (const gchar *symbol, const ucl_object_t *obj)
+{
+	const gchar *str;
+
+	if (obj == NULL) {
+		return REGEXP_PRIORITY_NORMAL;
+	}
+
+	str = ucl_object_tostring_forced (obj);
+
+	if (g_ascii_strcasecmp (str, "low") == 0) {
+		return REGEXP_PRIORITY_LOW;
+	}
+	else if (g_ascii_strcasecmp (str, "high") == 0) {
+		return REGEXP_PRIORITY_HIGH;
+	}
+	else if (g_ascii_strcasecmp (str, "normal") != 0) {
+		msg_warn ("unknown priority %s of regexp rule %s, use normal",
+				str, symbol);
+	}
+
+	return REGEXP_PRIORITY_NORMAL;
+}
+
 /* Init function */
 gint
 regexp_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
@@ -110,7 +159,7 @@ gint
 regexp_module_config (struct rspamd_config *cfg)
 {
 	struct regexp_module_item *cur_item;
-	const ucl_object_t *sec, *value;
+	const ucl_object_t *sec, *value, *elt;
 	ucl_object_iter_t it = NULL;
 	gint res = TRUE;
 
@@ -121,6 +170,8 @@ regexp_module_config (struct rspamd_config *cfg)
 	}
 
 	regexp_module_ctx->max_size = 0;
+	regexp_module_ctx->max_time = DEFAULT_REGEXP_MAX_TIME;
+	regexp_module_ctx->skipped_symbol = DEFAULT_REGEXP_SKIPPED_SYMBOL;
 
 	while ((value = ucl_iterate_object (sec, &it, true)) != NULL) {
 		if (g_ascii_strncasecmp (ucl_object_key (value), "max_size",
@@ -128,6 +179,15 @@ regexp_module_config (struct rspamd_config *cfg)
 			regexp_module_ctx->max_size = ucl_obj_toint (value);
 			rspamd_mime_expression_set_re_limit (regexp_module_ctx->max_size);
 		}
+		else if (g_ascii_strncasecmp (ucl_object_key (value), "max_time",
+			sizeof ("max_time") - 1) == 0) {
+			regexp_module_ctx->max_time = ucl_obj_todouble (value);
+		}
+		else if (g_ascii_strncasecmp (ucl_object_key (value), "skipped_symbol",
+			sizeof ("skipped_symbol") - 1) == 0) {
+			regexp_module_ctx->skipped_symbol = rspamd_mempool_strdup (
+					regexp_module_ctx->regexp_pool, ucl_obj_tostring (value));
+		}
 		else if (g_ascii_strncasecmp (ucl_object_key (value), "max_threads",
 			sizeof ("max_threads") - 1) == 0) {
 			msg_warn ("regexp module is now single threaded, max_threads is ignored");
@@ -136,6 +196,7 @@ regexp_module_config (struct rspamd_config *cfg)
 			cur_item = rspamd_mempool_alloc0 (regexp_module_ctx->regexp_pool,
 					sizeof (struct regexp_module_item));
 			cur_item->symbol = ucl_object_key (value);
+			cur_item->priority = REGEXP_PRIORITY_NORMAL;
 			if (!read_regexp_expression (regexp_module_ctx->regexp_pool,
 				cur_item, ucl_object_key (value),
 				ucl_obj_tostring (value), cfg)) {
@@ -154,12 +215,41 @@ regexp_module_config (struct rspamd_config *cfg)
 					sizeof (struct regexp_module_item));
 			cur_item->symbol = ucl_object_key (value);
 			cur_item->lua_function = ucl_object_toclosure (value);
+			cur_item->priority = REGEXP_PRIORITY_NORMAL;
 			register_symbol (&cfg->cache,
 				cur_item->symbol,
 				1,
 				process_regexp_item,
 				cur_item);
 		}
+		else if (value->type == UCL_OBJECT) {
+			/* Rule with options: {re = "expression", priority = "low"} */
+			elt = ucl_object_find_key (value, "re");
+
+			if (elt == NULL || ucl_object_type (elt) != UCL_STRING) {
+				msg_warn ("regexp rule %s has no expression defined",
+						ucl_object_key (value));
+				continue;
+			}
+
+			cur_item = rspamd_mempool_alloc0 (regexp_module_ctx->regexp_pool,
+					sizeof (struct regexp_module_item));
+			cur_item->symbol = ucl_object_key (value);
+			cur_item->priority = regexp_parse_priority (cur_item->symbol,
+					ucl_object_find_key (value, "priority"));
+
+			if (!read_regexp_expression (regexp_module_ctx->regexp_pool,
+				cur_item, cur_item->symbol, ucl_object_tostring (elt), cfg)) {
+				res = FALSE;
+			}
+			else {
+				register_symbol (&cfg->cache,
+						cur_item->symbol,
+						1,
+						process_regexp_item,
+						cur_item);
+			}
+		}
 		else {
 			msg_warn ("unknown type of attribute %s for regexp module",
 				ucl_object_key (value));
@@ -237,12 +327,65 @@ static gboolean rspamd_lua_call_expression_func(
 }
 
 
+/*
+ * Returns TRUE if a rule should be skipped as the time budget is spent
+ */
+static gboolean
+regexp_budget_exceeded (struct rspamd_task *task,
+		struct regexp_module_item *item,
+		struct regexp_task_budget *budget)
+{
+	gdouble limit = regexp_module_ctx->max_time;
+	GList *opts;
+
+	if (item->priority == REGEXP_PRIORITY_HIGH || budget->spent < limit) {
+		return FALSE;
+	}
+
+	if (item->priority == REGEXP_PRIORITY_NORMAL && budget->spent < limit * 2) {
+		return FALSE;
+	}
+
+	if (!budget->reported) {
+		msg_info ("<%s> regexp time budget is exceeded: %.3f seconds spent, "
+				"skip rules with lower priority", task->message_id,
+				budget->spent);
+		budget->reported = TRUE;
+	}
+
+	/* Skipped rules are reported as options of a symbol */
+	opts = g_list_prepend (NULL, (gpointer)item->symbol);
+	rspamd_task_insert_result_single (task, regexp_module_ctx->skipped_symbol,
+			1, opts);
+	g_list_free (opts);
+
+	return TRUE;
+}
+
 static void
 process_regexp_item (struct rspamd_task *task, void *user_data)
 {
 	struct regexp_module_item *item = user_data;
+	struct regexp_task_budget *budget = NULL;
+	gdouble t1 = 0;
 	gint res = FALSE;
 
+	if (regexp_module_ctx->max_time > 0) {
+		budget = rspamd_mempool_get_variable (task->task_pool,
+				REGEXP_BUDGET_VAR);
+
+		if (budget == NULL) {
+			budget = rspamd_mempool_alloc0 (task->task_pool, sizeof (*budget));
+			rspamd_mempool_set_variable (task->task_pool, REGEXP_BUDGET_VAR,
+					budget, NULL);
+		}
+		else if (regexp_budget_exceeded (task, item, budget)) {
+			return;
+		}
+
+		t1 = rspamd_get_ticks ();
+	}
+
 	/* Non-threaded version */
 	if (item->lua_function) {
 		/* Just call function */
@@ -263,6 +406,10 @@ process_regexp_item (struct rspamd_task *task, void *user_data)
 		}
 	}
 
+	if (budget != NULL) {
+		budget->spent += rspamd_get_ticks () - t1;
+	}
+
 	if (res) {
 		rspamd_task_insert_result (task, item->symbol, res, NULL);
 	}
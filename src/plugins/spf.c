@@ -30,6 +30,10 @@
  * - symbol_fail (string): symbol to insert (default: 'R_SPF_FAIL')
  * - symbol_softfail (string): symbol to insert (default: 'R_SPF_SOFTFAIL')
  * - whitelist (map): map of whitelisted networks
+ * - spf_shared_cache_size (integer): records cached for all workers (default: 0)
+ * - max_dns_requests (integer): dns requests allowed for a record (default: 30)
+ * - max_dns_nesting (integer): includes and redirects depth (default: 10)
+ * - max_resolve_time (time): time to send new requests for a record (default: 5s)
  */
 
 #include "config.h"
@@ -37,6 +41,7 @@
 #include "libserver/spf.h"
 #include "libutil/hash.h"
 #include "libutil/map.h"
+#include "libutil/shm_cache.h"
 #include "main.h"
 
 #define DEFAULT_SYMBOL_FAIL "R_SPF_FAIL"
@@ -45,6 +50,13 @@
 #define DEFAULT_SYMBOL_ALLOW "R_SPF_ALLOW"
 #define DEFAULT_CACHE_SIZE 2048
 #define DEFAULT_CACHE_MAXAGE 86400
+#define DEFAULT_MAX_DNS_REQUESTS 30
+#define DEFAULT_MAX_DNS_NESTING 10
+#define DEFAULT_MAX_RESOLVE_TIME 5.0
+/* Maximum length of a serialized record in the shared cache */
+#define SHARED_CACHE_RECORD_LEN 4096
+/* Interval in milliseconds to check records resolved by other workers */
+#define SHARED_WAIT_INTERVAL 100
 
 struct spf_ctx {
 	struct module_ctx ctx;
@@ -56,6 +68,18 @@ struct spf_ctx {
 	rspamd_mempool_t *spf_pool;
 	radix_compressed_t *whitelist_ip;
 	rspamd_lru_hash_t *spf_hash;
+	struct rspamd_shm_cache *shared_cache;
+	guint shared_wait;
+	guint cache_expire;
+};
+
+/* Task waiting for a record resolved by another worker */
+struct spf_shared_wait {
+	struct rspamd_task *task;
+	const gchar *domain;
+	struct event ev;
+	struct timeval tv;
+	guint attempts;
 };
 
 static struct spf_ctx *spf_module_ctx = NULL;
@@ -94,7 +118,11 @@ spf_module_config (struct rspamd_config *cfg)
 {
 	const ucl_object_t *value;
 	gint res = TRUE;
-	guint cache_size, cache_expire;
+	guint cache_size, cache_expire, shared_size = 0;
+	gint max_requests = DEFAULT_MAX_DNS_REQUESTS,
+		max_nesting = DEFAULT_MAX_DNS_NESTING;
+	gdouble max_time = DEFAULT_MAX_RESOLVE_TIME;
+	gchar *path;
 
 	spf_module_ctx->whitelist_ip = radix_create_compressed ();
 
@@ -141,6 +169,28 @@ spf_module_config (struct rspamd_config *cfg)
 	else {
 		cache_expire = DEFAULT_CACHE_MAXAGE;
 	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "spf",
+		"spf_shared_cache_size")) != NULL) {
+		shared_size = ucl_obj_toint (value);
+	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "spf",
+		"max_dns_requests")) != NULL) {
+		max_requests = ucl_obj_toint (value);
+	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "spf",
+		"max_dns_nesting")) != NULL) {
+		max_nesting = ucl_obj_toint (value);
+	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "spf",
+		"max_resolve_time")) != NULL) {
+		max_time = ucl_obj_todouble (value);
+	}
+
+	spf_library_config (max_requests, max_nesting, max_time);
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "spf", "whitelist")) != NULL) {
 		if (!rspamd_map_add (cfg, ucl_obj_tostring (value),
@@ -165,6 +215,25 @@ spf_module_config (struct rspamd_config *cfg)
 			cache_expire,
 			NULL,
 			(GDestroyNotify)spf_record_unref);
+	spf_module_ctx->cache_expire = cache_expire;
+
+	if (shared_size > 0) {
+		/* Shared memory must be allocated before workers are forked */
+		spf_module_ctx->shared_cache = rspamd_shm_cache_new (shared_size,
+				SHARED_CACHE_RECORD_LEN);
+
+		if (spf_module_ctx->shared_cache && cfg->cache_snapshot_dir) {
+			/* Records resolved before restart are used until they expire */
+			path = g_build_filename (cfg->cache_snapshot_dir, "spf.cache",
+					NULL);
+			rspamd_shm_cache_set_snapshot (spf_module_ctx->shared_cache, path,
+					time (NULL));
+			g_free (path);
+		}
+		/* Wait for other workers no longer than they wait for DNS */
+		spf_module_ctx->shared_wait = cfg->dns_timeout *
+				MAX (cfg->dns_retransmits, 1) / 1000.0 + 1;
+	}
 
 	return res;
 }
@@ -174,6 +243,7 @@ spf_module_reconfig (struct rspamd_config *cfg)
 {
 	rspamd_mempool_delete (spf_module_ctx->spf_pool);
 	radix_destroy_compressed (spf_module_ctx->whitelist_ip);
+	rspamd_shm_cache_destroy (spf_module_ctx->shared_cache);
 	memset (spf_module_ctx, 0, sizeof (*spf_module_ctx));
 	spf_module_ctx->spf_pool = rspamd_mempool_new (
 		rspamd_mempool_suggest_size ());
@@ -286,35 +356,161 @@ spf_check_list (struct spf_resolved *rec, struct rspamd_task *task)
 	}
 }
 
+static struct spf_resolved *
+spf_cache_record (struct spf_resolved *record, struct rspamd_task *task)
+{
+	struct spf_resolved *l;
+
+	if ((l =
+		rspamd_lru_hash_lookup (spf_module_ctx->spf_hash,
+		record->domain, task->tv.tv_sec)) == NULL) {
+
+		l = spf_record_ref (record);
+		rspamd_lru_hash_insert (spf_module_ctx->spf_hash,
+			record->domain, l,
+			task->tv.tv_sec, record->ttl);
+
+	}
+
+	return l;
+}
+
 static void
 spf_plugin_callback (struct spf_resolved *record, struct rspamd_task *task)
 {
 	struct spf_resolved *l;
+	GByteArray *buf;
 
 	if (record && record->elts->len > 0 && record->domain) {
 
-		if ((l =
-			rspamd_lru_hash_lookup (spf_module_ctx->spf_hash,
-			record->domain, task->tv.tv_sec)) == NULL) {
-
-			l = spf_record_ref (record);
-			rspamd_lru_hash_insert (spf_module_ctx->spf_hash,
-				record->domain, l,
-				task->tv.tv_sec, record->ttl);
-
+		if (spf_module_ctx->shared_cache) {
+			buf = g_byte_array_new ();
+			spf_record_serialize (record, buf);
+			rspamd_shm_cache_insert (spf_module_ctx->shared_cache,
+					record->domain, task->tv.tv_sec,
+					MIN (record->ttl, spf_module_ctx->cache_expire),
+					buf->data, buf->len);
+			g_byte_array_free (buf, TRUE);
 		}
+
+		l = spf_cache_record (record, task);
 		spf_record_ref (l);
 		spf_check_list (l, task);
 		spf_record_unref (l);
 	}
+	else if (record && record->domain && spf_module_ctx->shared_cache) {
+		/* Let other workers resolve it by themselves */
+		rspamd_shm_cache_remove (spf_module_ctx->shared_cache, record->domain);
+	}
 }
 
+static void
+spf_resolve_domain (struct rspamd_task *task, const gchar *domain)
+{
+	if (!resolve_spf (task, spf_plugin_callback)) {
+		msg_info ("cannot make spf request for [%s]", task->message_id);
+
+		if (spf_module_ctx->shared_cache) {
+			rspamd_shm_cache_remove (spf_module_ctx->shared_cache, domain);
+		}
+	}
+}
+
+/*
+ * Check record in the shared cache, the record should be resolved by caller
+ * on miss
+ */
+static enum rspamd_shm_cache_result
+spf_check_shared (struct rspamd_task *task, const gchar *domain, time_t now)
+{
+	struct spf_resolved *record, *l;
+	enum rspamd_shm_cache_result r;
+	GByteArray *buf;
+
+	buf = g_byte_array_new ();
+	r = rspamd_shm_cache_lookup (spf_module_ctx->shared_cache, domain,
+			now, spf_module_ctx->shared_wait, buf);
+
+	if (r == RSPAMD_SHM_CACHE_HIT) {
+		record = spf_record_deserialize (buf->data, buf->len);
+
+		if (record != NULL && record->domain != NULL &&
+				strcmp (record->domain, domain) == 0) {
+			l = spf_cache_record (record, task);
+			spf_record_ref (l);
+			spf_check_list (l, task);
+			spf_record_unref (l);
+		}
+		else {
+			r = RSPAMD_SHM_CACHE_MISS;
+		}
+
+		if (record != NULL) {
+			spf_record_unref (record);
+		}
+	}
+
+	g_byte_array_free (buf, TRUE);
+
+	return r;
+}
+
+static void
+spf_shared_wait_fin (gpointer ud)
+{
+	struct spf_shared_wait *wait = ud;
+
+	event_del (&wait->ev);
+}
+
+static void
+spf_shared_wait_cb (gint fd, short what, gpointer ud)
+{
+	struct spf_shared_wait *wait = ud;
+	struct rspamd_task *task = wait->task;
+	enum rspamd_shm_cache_result r;
+
+	r = spf_check_shared (task, wait->domain, time (NULL));
+
+	if (r == RSPAMD_SHM_CACHE_PENDING && --wait->attempts > 0) {
+		evtimer_add (&wait->ev, &wait->tv);
+		return;
+	}
+
+	if (r != RSPAMD_SHM_CACHE_HIT) {
+		/* Either the record is ours now or we are tired of waiting */
+		spf_resolve_domain (task, wait->domain);
+	}
+
+	remove_normal_event (task->s, spf_shared_wait_fin, wait);
+}
+
+static void
+spf_wait_shared (struct rspamd_task *task, const gchar *domain)
+{
+	struct spf_shared_wait *wait;
+
+	wait = rspamd_mempool_alloc0 (task->task_pool, sizeof (*wait));
+	wait->task = task;
+	wait->domain = rspamd_mempool_strdup (task->task_pool, domain);
+	wait->attempts = MAX (spf_module_ctx->shared_wait * 1000 /
+			SHARED_WAIT_INTERVAL, 1);
+	msec_to_tv (SHARED_WAIT_INTERVAL, &wait->tv);
+	evtimer_set (&wait->ev, spf_shared_wait_cb, wait);
+	event_base_set (task->ev_base, &wait->ev);
+	evtimer_add (&wait->ev, &wait->tv);
+	register_async_event (task->s,
+		spf_shared_wait_fin,
+		wait,
+		g_quark_from_static_string ("spf"));
+}
 
 static void
 spf_symbol_callback (struct rspamd_task *task, void *unused)
 {
 	const gchar *domain;
 	struct spf_resolved *l;
+	enum rspamd_shm_cache_result r = RSPAMD_SHM_CACHE_MISS;
 
 	if (radix_find_compressed_addr (spf_module_ctx->whitelist_ip,
 			task->from_addr) == RADIX_NO_VALUE) {
@@ -326,9 +522,19 @@ spf_symbol_callback (struct rspamd_task *task, void *unused)
 				spf_record_ref (l);
 				spf_check_list (l, task);
 				spf_record_unref (l);
+				return;
+			}
+
+			if (spf_module_ctx->shared_cache) {
+				r = spf_check_shared (task, domain, task->tv.tv_sec);
+			}
+
+			if (r == RSPAMD_SHM_CACHE_PENDING) {
+				/* Record is being resolved by another worker */
+				spf_wait_shared (task, domain);
 			}
-			else if (!resolve_spf (task, spf_plugin_callback)) {
-				msg_info ("cannot make spf request for [%s]", task->message_id);
+			else if (r == RSPAMD_SHM_CACHE_MISS) {
+				spf_resolve_domain (task, domain);
 			}
 		}
 	}
@@ -32,11 +32,17 @@
  * - redirector_connect_timeout (seconds): redirector connect timeout (default: 1s)
  * - redirector_read_timeout (seconds): timeout for reading data (default: 5s)
  * - redirector_hosts_map (map string): map that contains domains to check with redirector
+ * - redirector_max_connections (integer): maximum number of simultaneous connections
+ *   to redirector per worker, urls above this limit are checked as is (default: 0, unlimited)
+ * - redirector_cache_size (integer): redirects cached for all workers (default: 0)
+ * - redirector_cache_expire (seconds): lifetime of cached redirects (default: 1h)
  * Surbl options:
  * - exceptions (map string): map of domains that should be checked via surbl using 3 (e.g. somehost.domain.com)
  *   components of domain name instead of normal 2 (e.g. domain.com)
  * - whitelist (map string): map of domains that should be whitelisted for surbl checks
- * - max_urls (integer): maximum allowed number of urls in message to be checked
+ *   both exceptions and whitelist can be cdb maps (cdb://path) with domains as keys
+ * - max_urls (integer): maximum number of domains in message to be checked by a list, domains
+ *   that are met in fewer urls are checked first
  * - suffix (string): surbl address (for example insecure-bl.rambler.ru), may contain %b if bits are used (read documentation about it)
  * - bit (string): describes a prefix for a single bit
  */
@@ -45,6 +51,8 @@
 #include "libmime/message.h"
 #include "libutil/hash.h"
 #include "libutil/map.h"
+#include "libutil/shm_cache.h"
+#include "libutil/http_pool.h"
 #include "main.h"
 #include "surbl.h"
 #include "regexp.h"
@@ -61,6 +69,23 @@ static void process_dns_results (struct rspamd_task *task,
 
 
 #define NO_REGEXP (gpointer) - 1
+/* Maximum length of an original url with its redirect in the shared cache */
+#define REDIRECTOR_CACHE_RECORD_LEN 2048
+/* Interval in milliseconds to check redirects resolved by other workers */
+#define REDIRECTOR_WAIT_INTERVAL 100
+
+/* Task waiting for a redirect resolved by another worker */
+struct redirector_wait {
+	struct rspamd_url *url;
+	struct rspamd_task *task;
+	struct suffix_item *suffix;
+	GHashTable *tree;
+	const gchar *key;
+	const gchar *rule;
+	struct event ev;
+	struct timeval tv;
+	guint attempts;
+};
 
 #define SURBL_ERROR surbl_error_quark ()
 #define WHITELIST_ERROR 0
@@ -282,6 +307,10 @@ surbl_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 	surbl_module_ctx->tld2_file = NULL;
 	surbl_module_ctx->whitelist_file = NULL;
 	surbl_module_ctx->redirectors = NULL;
+	rspamd_cdb_map_free (surbl_module_ctx->exceptions_cdb);
+	surbl_module_ctx->exceptions_cdb = NULL;
+	rspamd_cdb_map_free (surbl_module_ctx->whitelist_cdb);
+	surbl_module_ctx->whitelist_cdb = NULL;
 	surbl_module_ctx->whitelist = g_hash_table_new (rspamd_strcase_hash,
 			rspamd_strcase_equal);
 	/* Zero exceptions hashes */
@@ -339,8 +368,8 @@ surbl_module_config (struct rspamd_config *cfg)
 	const ucl_object_t *value, *cur, *cur_rule, *cur_bit;
 	ucl_object_iter_t it = NULL;
 	const gchar *redir_val, *ip_val;
-	guint32 bit;
-
+	guint32 bit, cache_size = 0;
+	gchar *path;
 
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "surbl", "redirector")) != NULL) {
@@ -406,6 +435,45 @@ surbl_module_config (struct rspamd_config *cfg)
 			"SURBL redirectors list", read_redirectors_list, fin_redirectors_list,
 			(void **)&surbl_module_ctx->redirector_map_data);
 	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "surbl",
+		"redirector_max_connections")) != NULL) {
+		surbl_module_ctx->redirector_max_connections = ucl_obj_toint (value);
+	}
+	else {
+		surbl_module_ctx->redirector_max_connections = 0;
+	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "surbl",
+		"redirector_cache_size")) != NULL) {
+		cache_size = ucl_obj_toint (value);
+	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "surbl",
+		"redirector_cache_expire")) != NULL) {
+		surbl_module_ctx->redirector_cache_expire = ucl_obj_todouble (value);
+	}
+	else {
+		surbl_module_ctx->redirector_cache_expire =
+			DEFAULT_REDIRECTOR_CACHE_EXPIRE;
+	}
+
+	if (cache_size > 0 && surbl_module_ctx->use_redirector) {
+		/* Shared memory must be allocated before workers are forked */
+		surbl_module_ctx->redirector_cache = rspamd_shm_cache_new (cache_size,
+				REDIRECTOR_CACHE_RECORD_LEN);
+
+		if (surbl_module_ctx->redirector_cache && cfg->cache_snapshot_dir) {
+			path = g_build_filename (cfg->cache_snapshot_dir,
+					"redirector.cache", NULL);
+			rspamd_shm_cache_set_snapshot (surbl_module_ctx->redirector_cache,
+					path, time (NULL));
+			g_free (path);
+		}
+		/* Wait for other workers no longer than they wait for redirector */
+		surbl_module_ctx->redirector_wait = surbl_module_ctx->connect_timeout +
+			surbl_module_ctx->read_timeout + 1;
+	}
 
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "surbl", "max_urls")) != NULL) {
@@ -415,7 +483,13 @@ surbl_module_config (struct rspamd_config *cfg)
 		surbl_module_ctx->max_urls = DEFAULT_SURBL_MAX_URLS;
 	}
 	if ((value =
-		rspamd_config_get_module_opt (cfg, "surbl", "exceptions")) != NULL) {
+		rspamd_config_get_module_opt (cfg, "surbl", "exceptions")) != NULL &&
+		rspamd_map_is_cdb (ucl_obj_tostring (value))) {
+		rspamd_map_add (cfg, ucl_obj_tostring (value),
+			"SURBL exceptions list", NULL, NULL,
+			(void **)&surbl_module_ctx->exceptions_cdb);
+	}
+	else if (value != NULL) {
 		if (rspamd_map_add (cfg, ucl_obj_tostring (value),
 			"SURBL exceptions list", read_exceptions_list, fin_exceptions_list,
 			(void **)&surbl_module_ctx->exceptions)) {
@@ -425,7 +499,13 @@ surbl_module_config (struct rspamd_config *cfg)
 		}
 	}
 	if ((value =
-		rspamd_config_get_module_opt (cfg, "surbl", "whitelist")) != NULL) {
+		rspamd_config_get_module_opt (cfg, "surbl", "whitelist")) != NULL &&
+		rspamd_map_is_cdb (ucl_obj_tostring (value))) {
+		rspamd_map_add (cfg, ucl_obj_tostring (value),
+			"SURBL whitelist", NULL, NULL,
+			(void **)&surbl_module_ctx->whitelist_cdb);
+	}
+	else if (value != NULL) {
 		if (rspamd_map_add (cfg, ucl_obj_tostring (value),
 			"SURBL whitelist", rspamd_hosts_read, rspamd_hosts_fin,
 			(void **)&surbl_module_ctx->whitelist)) {
@@ -589,6 +669,8 @@ surbl_module_reconfig (struct rspamd_config *cfg)
 {
 	/* Delete pool and objects */
 	rspamd_mempool_delete (surbl_module_ctx->surbl_pool);
+	rspamd_shm_cache_destroy (surbl_module_ctx->redirector_cache);
+	surbl_module_ctx->redirector_cache = NULL;
 	/* Reinit module */
 	surbl_module_ctx->use_redirector = 0;
 	surbl_module_ctx->suffixes = NULL;
@@ -723,11 +805,14 @@ format_surbl_request (rspamd_mempool_t * pool,
 		if (!forced) {
 			for (i = MAX_LEVELS - 1; i >= 0; i--) {
 				t = surbl_module_ctx->exceptions[i];
-				if (t != NULL && dots_num >= i + 1) {
+				if ((t != NULL || surbl_module_ctx->exceptions_cdb != NULL) &&
+						dots_num >= i + 1) {
 					f.begin = dots[dots_num - i - 1] + 1;
 					f.len = hostname->len -
 						(dots[dots_num - i - 1] - hostname->begin + 1);
-					if (g_hash_table_lookup (t, &f) != NULL) {
+					if ((t != NULL && g_hash_table_lookup (t, &f) != NULL) ||
+							rspamd_match_cdb_map (surbl_module_ctx->exceptions_cdb,
+							f.begin, f.len, NULL) != NULL) {
 						level = dots_num - i - 1;
 						found_exception = TRUE;
 						break;
@@ -776,22 +861,10 @@ format_surbl_request (rspamd_mempool_t * pool,
 	url->surbl = result;
 	url->surbllen = r;
 
-	if (tree != NULL) {
-		if (g_hash_table_lookup (tree, result) != NULL) {
-			msg_debug ("url %s is already registered", result);
-			g_set_error (err, SURBL_ERROR,
-				DUPLICATE_ERROR,
-				"URL is duplicated: %s",
-				result);
-			return NULL;
-		}
-		else {
-			g_hash_table_insert (tree, result, url);
-		}
-	}
-
 	if (!forced &&
-		g_hash_table_lookup (surbl_module_ctx->whitelist, result) != NULL) {
+		(g_hash_table_lookup (surbl_module_ctx->whitelist, result) != NULL ||
+		rspamd_match_cdb_map (surbl_module_ctx->whitelist_cdb, result, r,
+		NULL) != NULL)) {
 		msg_debug ("url %s is whitelisted", result);
 		g_set_error (err, SURBL_ERROR,
 			WHITELIST_ERROR,
@@ -805,6 +878,21 @@ format_surbl_request (rspamd_mempool_t * pool,
 		rspamd_snprintf (result + r, len - r, ".%s", suffix->suffix);
 	}
 
+	/* Requests are registered with the suffix, as their keys must not change */
+	if (tree != NULL) {
+		if (g_hash_table_lookup (tree, result) != NULL) {
+			msg_debug ("url %s is already registered", result);
+			g_set_error (err, SURBL_ERROR,
+				DUPLICATE_ERROR,
+				"URL is duplicated: %s",
+				result);
+			return NULL;
+		}
+		else {
+			g_hash_table_insert (tree, result, url);
+		}
+	}
+
 	msg_debug ("request: %s, dots: %d, level: %d, orig: %*s",
 		result,
 		dots_num,
@@ -816,43 +904,110 @@ format_surbl_request (rspamd_mempool_t * pool,
 }
 
 static void
-make_surbl_requests (struct rspamd_url *url, struct rspamd_task *task,
+send_surbl_request (struct rspamd_url *url, struct rspamd_task *task,
+	struct suffix_item *suffix, gchar *surbl_req)
+{
+	struct dns_param *param;
+
+	param =
+		rspamd_mempool_alloc (task->task_pool, sizeof (struct dns_param));
+	param->url = url;
+	param->task = task;
+	param->suffix = suffix;
+	param->host_resolve =
+		rspamd_mempool_strdup (task->task_pool, surbl_req);
+	debug_task ("send surbl dns request %s", surbl_req);
+	if (make_dns_request (task->resolver, task->s, task->task_pool,
+		dns_callback,
+		(void *)param, RDNS_REQUEST_A, surbl_req)) {
+		task->dns_requests++;
+	}
+}
+
+static gchar *
+make_surbl_request_string (struct rspamd_url *url, struct rspamd_task *task,
 	struct suffix_item *suffix, gboolean forced, GHashTable *tree)
 {
 	gchar *surbl_req;
 	rspamd_fstring_t f;
 	GError *err = NULL;
-	struct dns_param *param;
 
 	f.begin = url->host;
 	f.len = url->hostlen;
 
 	if ((surbl_req = format_surbl_request (task->task_pool, &f, suffix, TRUE,
 		&err, forced, tree, url)) != NULL) {
-		param =
-			rspamd_mempool_alloc (task->task_pool, sizeof (struct dns_param));
-		param->url = url;
-		param->task = task;
-		param->suffix = suffix;
-		param->host_resolve =
-			rspamd_mempool_strdup (task->task_pool, surbl_req);
-		debug_task ("send surbl dns request %s", surbl_req);
-		if (make_dns_request (task->resolver, task->s, task->task_pool,
-			dns_callback,
-			(void *)param, RDNS_REQUEST_A, surbl_req)) {
-			task->dns_requests++;
-		}
+		return surbl_req;
 	}
 	else if (err != NULL && err->code != WHITELIST_ERROR && err->code !=
 		DUPLICATE_ERROR) {
 		msg_info ("cannot format url string for surbl %s, %e", struri (
 				url), err);
 		g_error_free (err);
-		return;
 	}
 	else if (err != NULL) {
 		g_error_free (err);
 	}
+
+	return NULL;
+}
+
+static void
+make_surbl_requests (struct rspamd_url *url, struct rspamd_task *task,
+	struct suffix_item *suffix, gboolean forced, GHashTable *tree)
+{
+	gchar *surbl_req;
+
+	surbl_req = make_surbl_request_string (url, task, suffix, forced, tree);
+
+	if (surbl_req != NULL) {
+		send_surbl_request (url, task, suffix, surbl_req);
+	}
+}
+
+/*
+ * Collects requests of urls that are not checked by redirector, so that each
+ * domain is requested once and rare domains are requested first
+ */
+static void
+collect_surbl_request (struct rspamd_url *url, struct redirector_param *param)
+{
+	struct surbl_host_item *item;
+	gchar *surbl_req;
+
+	surbl_req = make_surbl_request_string (url, param->task, param->suffix,
+			FALSE, NULL);
+
+	if (surbl_req == NULL) {
+		return;
+	}
+
+	item = g_hash_table_lookup (param->hosts, surbl_req);
+
+	if (item != NULL) {
+		item->count ++;
+	}
+	else {
+		item = rspamd_mempool_alloc (param->task->task_pool, sizeof (*item));
+		item->url = url;
+		item->request = surbl_req;
+		item->count = 1;
+		item->order = g_hash_table_size (param->hosts);
+		g_hash_table_insert (param->hosts, surbl_req, item);
+	}
+}
+
+static gint
+surbl_host_item_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct surbl_host_item *i1 = *(const struct surbl_host_item **)a,
+		*i2 = *(const struct surbl_host_item **)b;
+
+	if (i1->count != i2->count) {
+		return i1->count < i2->count ? -1 : 1;
+	}
+
+	return i1->order < i2->order ? -1 : (i1->order > i2->order);
 }
 
 static void
@@ -923,8 +1078,87 @@ free_redirector_session (void *ud)
 {
 	struct redirector_param *param = (struct redirector_param *)ud;
 
-	rspamd_http_connection_unref (param->conn);
-	close (param->sock);
+	rspamd_http_pool_release (param->task->cfg->http_pool, param->conn,
+			param->reuse);
+	surbl_module_ctx->redirector_connections --;
+}
+
+/*
+ * Replaces url with its redirect and checks the new url
+ */
+static void
+surbl_apply_redirect (struct rspamd_url *url, struct rspamd_task *task,
+	struct suffix_item *suffix, GHashTable *tree,
+	const gchar *redirect, gsize len)
+{
+	gchar *urlstr;
+	gint r;
+
+	urlstr = rspamd_mempool_alloc (task->task_pool, len + 1);
+	rspamd_strlcpy (urlstr, redirect, len + 1);
+	r = rspamd_url_parse (url, urlstr, len, task->task_pool);
+
+	if (r == URI_ERRNO_OK) {
+		make_surbl_requests (url, task, suffix, FALSE, tree);
+	}
+}
+
+/*
+ * Values of the shared cache are the original url and its redirect separated
+ * by zero byte, so that collisions of keys are detected
+ */
+static void
+surbl_cache_redirect (const gchar *key, time_t now, const gchar *redirect,
+	gsize len)
+{
+	GByteArray *buf;
+
+	buf = g_byte_array_sized_new (strlen (key) + len + 1);
+	g_byte_array_append (buf, (const guint8 *)key, strlen (key) + 1);
+	g_byte_array_append (buf, (const guint8 *)redirect, len);
+	rspamd_shm_cache_insert (surbl_module_ctx->redirector_cache, key, now,
+		surbl_module_ctx->redirector_cache_expire, buf->data, buf->len);
+	g_byte_array_free (buf, TRUE);
+}
+
+/*
+ * Check redirect in the shared cache, the url should be sent to redirector by
+ * caller on miss
+ */
+static enum rspamd_shm_cache_result
+surbl_check_redirect_cache (struct rspamd_url *url, struct rspamd_task *task,
+	struct suffix_item *suffix, GHashTable *tree, const gchar *key,
+	time_t now)
+{
+	enum rspamd_shm_cache_result r;
+	GByteArray *buf;
+	gsize keylen;
+
+	buf = g_byte_array_new ();
+	r = rspamd_shm_cache_lookup (surbl_module_ctx->redirector_cache, key,
+			now, surbl_module_ctx->redirector_wait, buf);
+
+	if (r == RSPAMD_SHM_CACHE_HIT) {
+		keylen = strlen (key);
+
+		if (buf->len > keylen + 1 && buf->data[keylen] == '\0' &&
+				memcmp (buf->data, key, keylen) == 0) {
+			msg_info ("<%s> got cached redirect: '%s' -> '%*s'",
+				task->message_id,
+				key,
+				(gint)(buf->len - keylen - 1),
+				buf->data + keylen + 1);
+			surbl_apply_redirect (url, task, suffix, tree,
+				(const gchar *)buf->data + keylen + 1, buf->len - keylen - 1);
+		}
+		else {
+			r = RSPAMD_SHM_CACHE_MISS;
+		}
+	}
+
+	g_byte_array_free (buf, TRUE);
+
+	return r;
 }
 
 static void
@@ -937,6 +1171,12 @@ surbl_redirector_error (struct rspamd_http_connection *conn,
 		rspamd_inet_address_to_string (rspamd_upstream_addr (param->redirector)),
 		err);
 	rspamd_upstream_fail (param->redirector);
+
+	if (surbl_module_ctx->redirector_cache) {
+		rspamd_shm_cache_remove (surbl_module_ctx->redirector_cache,
+			param->key);
+	}
+
 	remove_normal_event (param->task->s, free_redirector_session,
 			param);
 }
@@ -946,9 +1186,7 @@ surbl_redirector_finish (struct rspamd_http_connection *conn,
 		struct rspamd_http_message *msg)
 {
 	struct redirector_param *param = (struct redirector_param *)conn->ud;
-	gint r, urllen;
-	const GString *hdr;
-	gchar *urlstr;
+	const GString *hdr = NULL;
 
 	if (msg->code == 200) {
 		hdr = rspamd_http_message_find_header (msg, "Uri");
@@ -958,20 +1196,14 @@ surbl_redirector_finish (struct rspamd_http_connection *conn,
 					param->task->message_id,
 					struri (param->url),
 					hdr);
-			urllen = hdr->len;
-			urlstr = rspamd_mempool_alloc (param->task->task_pool,
-					urllen + 1);
-			rspamd_strlcpy (urlstr, hdr->str, urllen + 1);
-			r = rspamd_url_parse (param->url, urlstr, urllen,
-					param->task->task_pool);
-
-			if (r == URI_ERRNO_OK) {
-				make_surbl_requests (param->url,
-						param->task,
-						param->suffix,
-						FALSE,
-						param->tree);
+
+			if (surbl_module_ctx->redirector_cache) {
+				surbl_cache_redirect (param->key, time (NULL), hdr->str,
+					hdr->len);
 			}
+
+			surbl_apply_redirect (param->url, param->task, param->suffix,
+				param->tree, hdr->str, hdr->len);
 		}
 	}
 	else {
@@ -980,7 +1212,13 @@ surbl_redirector_finish (struct rspamd_http_connection *conn,
 				struri (param->url));
 	}
 
+	if (hdr == NULL && surbl_module_ctx->redirector_cache) {
+		rspamd_shm_cache_remove (surbl_module_ctx->redirector_cache,
+			param->key);
+	}
+
 	rspamd_upstream_ok (param->redirector);
+	param->reuse = (msg->flags & RSPAMD_HTTP_FLAG_KEEP_ALIVE) != 0;
 	remove_normal_event (param->task->s, free_redirector_session,
 			param);
 
@@ -992,24 +1230,54 @@ static void
 register_redirector_call (struct rspamd_url *url, struct rspamd_task *task,
 	struct suffix_item *suffix, const gchar *rule, GHashTable *tree)
 {
-	gint s = -1;
 	struct redirector_param *param;
+	struct rspamd_http_connection *conn = NULL;
 	struct timeval *timeout;
 	struct upstream *selected;
 	struct rspamd_http_message *msg;
+	const gchar *key;
+
+	key = rspamd_mempool_strdup (task->task_pool, struri (url));
+
+	if (surbl_module_ctx->redirector_max_connections > 0 &&
+			surbl_module_ctx->redirector_connections >=
+			surbl_module_ctx->redirector_max_connections) {
+		msg_info ("<%s> too many connections to redirector, check %s as is",
+			task->message_id,
+			key);
+
+		if (surbl_module_ctx->redirector_cache) {
+			rspamd_shm_cache_remove (surbl_module_ctx->redirector_cache, key);
+		}
+
+		make_surbl_requests (url, task, suffix, FALSE, tree);
+		return;
+	}
 
 	selected = rspamd_upstream_get (surbl_module_ctx->redirectors,
 			RSPAMD_UPSTREAM_ROUND_ROBIN);
 
 	if (selected) {
-		s = rspamd_inet_address_connect (rspamd_upstream_addr (selected),
-				SOCK_STREAM, TRUE);
+		/* Pool is created after fork, so each worker has its own connections */
+		if (task->cfg->http_pool == NULL) {
+			task->cfg->http_pool = rspamd_http_pool_init ();
+		}
+
+		conn = rspamd_http_pool_connect (task->cfg->http_pool, task->ev_base,
+				rspamd_upstream_addr (selected), NULL, NULL,
+				surbl_redirector_error, surbl_redirector_finish,
+				RSPAMD_HTTP_CLIENT_SIMPLE);
 	}
 
-	if (s == -1) {
+	if (conn == NULL) {
 		msg_info ("<%s> cannot create tcp socket failed: %s",
 			task->message_id,
 			strerror (errno));
+
+		if (surbl_module_ctx->redirector_cache) {
+			rspamd_shm_cache_remove (surbl_module_ctx->redirector_cache, key);
+		}
+
 		make_surbl_requests (url, task, suffix, FALSE, tree);
 		return;
 	}
@@ -1018,27 +1286,28 @@ register_redirector_call (struct rspamd_url *url, struct rspamd_task *task,
 		rspamd_mempool_alloc (task->task_pool,
 			sizeof (struct redirector_param));
 	param->url = url;
+	param->key = key;
 	param->task = task;
-	param->conn = rspamd_http_connection_new (NULL, surbl_redirector_error,
-			surbl_redirector_finish,
-			RSPAMD_HTTP_CLIENT_SIMPLE,
-			RSPAMD_HTTP_CLIENT, NULL);
+	param->conn = conn;
+	param->reuse = FALSE;
 	msg = rspamd_http_new_message (HTTP_REQUEST);
 	msg->url = g_string_new (struri (url));
-	param->sock = s;
+	msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+	param->sock = conn->fd;
 	param->suffix = suffix;
 	param->redirector = selected;
 	param->tree = tree;
 	timeout = rspamd_mempool_alloc (task->task_pool, sizeof (struct timeval));
 	double_to_tv (surbl_module_ctx->read_timeout, timeout);
 
+	surbl_module_ctx->redirector_connections ++;
 	register_async_event (task->s,
 		free_redirector_session,
 		param,
 		g_quark_from_static_string ("surbl"));
 
 	rspamd_http_connection_write_message (param->conn, msg, NULL,
-			NULL, param, s, timeout, task->ev_base);
+			NULL, param, param->sock, timeout, task->ev_base);
 
 	msg_info (
 		"<%s> registered redirector call for %s to %s, according to rule: %s",
@@ -1048,6 +1317,80 @@ register_redirector_call (struct rspamd_url *url, struct rspamd_task *task,
 		rule);
 }
 
+static void
+surbl_redirector_wait_fin (gpointer ud)
+{
+	struct redirector_wait *wait = ud;
+
+	event_del (&wait->ev);
+}
+
+static void
+surbl_redirector_wait_cb (gint fd, short what, gpointer ud)
+{
+	struct redirector_wait *wait = ud;
+	struct rspamd_task *task = wait->task;
+	enum rspamd_shm_cache_result r;
+
+	r = surbl_check_redirect_cache (wait->url, task, wait->suffix, wait->tree,
+			wait->key, time (NULL));
+
+	if (r == RSPAMD_SHM_CACHE_PENDING && --wait->attempts > 0) {
+		evtimer_add (&wait->ev, &wait->tv);
+		return;
+	}
+
+	if (r != RSPAMD_SHM_CACHE_HIT) {
+		/* Either the url is ours now or we are tired of waiting */
+		register_redirector_call (wait->url, task, wait->suffix, wait->rule,
+			wait->tree);
+	}
+
+	remove_normal_event (task->s, surbl_redirector_wait_fin, wait);
+}
+
+static void
+surbl_resolve_redirect (struct rspamd_url *url, struct rspamd_task *task,
+	struct suffix_item *suffix, const gchar *rule, GHashTable *tree)
+{
+	struct redirector_wait *wait;
+	enum rspamd_shm_cache_result r;
+	const gchar *key;
+
+	if (surbl_module_ctx->redirector_cache == NULL) {
+		register_redirector_call (url, task, suffix, rule, tree);
+		return;
+	}
+
+	key = rspamd_mempool_strdup (task->task_pool, struri (url));
+	r = surbl_check_redirect_cache (url, task, suffix, tree, key,
+			task->tv.tv_sec);
+
+	if (r == RSPAMD_SHM_CACHE_MISS) {
+		register_redirector_call (url, task, suffix, rule, tree);
+	}
+	else if (r == RSPAMD_SHM_CACHE_PENDING) {
+		/* Url is being resolved by another worker */
+		wait = rspamd_mempool_alloc0 (task->task_pool, sizeof (*wait));
+		wait->url = url;
+		wait->task = task;
+		wait->suffix = suffix;
+		wait->tree = tree;
+		wait->key = key;
+		wait->rule = rule;
+		wait->attempts = MAX (surbl_module_ctx->redirector_wait * 1000 /
+				REDIRECTOR_WAIT_INTERVAL, 1);
+		msec_to_tv (REDIRECTOR_WAIT_INTERVAL, &wait->tv);
+		evtimer_set (&wait->ev, surbl_redirector_wait_cb, wait);
+		event_base_set (task->ev_base, &wait->ev);
+		evtimer_add (&wait->ev, &wait->tv);
+		register_async_event (task->s,
+			surbl_redirector_wait_fin,
+			wait,
+			g_quark_from_static_string ("surbl"));
+	}
+}
+
 static gint
 surbl_redirector_trie_cb (int strnum, int textpos, void *context)
 {
@@ -1098,7 +1441,7 @@ surbl_tree_url_callback (gpointer key, gpointer value, void *data)
 								g_list_prepend (NULL, rspamd_mempool_strdup
 										(task->task_pool, pat->ptr)));
 					}
-					register_redirector_call (url,
+					surbl_resolve_redirect (url,
 							param->task,
 							param->suffix,
 							pat->ptr,
@@ -1107,13 +1450,9 @@ surbl_tree_url_callback (gpointer key, gpointer value, void *data)
 				}
 			}
 		}
-		make_surbl_requests (url, param->task, param->suffix, FALSE,
-			param->tree);
-	}
-	else {
-		make_surbl_requests (url, param->task, param->suffix, FALSE,
-			param->tree);
 	}
+
+	collect_surbl_request (url, param);
 }
 
 static void
@@ -1121,6 +1460,11 @@ surbl_test_url (struct rspamd_task *task, void *user_data)
 {
 	struct redirector_param param;
 	struct suffix_item *suffix = user_data;
+	struct surbl_host_item *item;
+	GPtrArray *items;
+	GHashTableIter it;
+	gpointer k, v;
+	guint i;
 
 	param.task = task;
 	param.suffix = suffix;
@@ -1128,5 +1472,35 @@ surbl_test_url (struct rspamd_task *task, void *user_data)
 	rspamd_mempool_add_destructor (task->task_pool,
 		(rspamd_mempool_destruct_t)g_hash_table_unref,
 		param.tree);
+	param.hosts = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
 	g_hash_table_foreach (task->urls, surbl_tree_url_callback, &param);
+
+	items = g_ptr_array_sized_new (g_hash_table_size (param.hosts));
+	g_hash_table_iter_init (&it, param.hosts);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		g_ptr_array_add (items, v);
+	}
+
+	g_ptr_array_sort (items, surbl_host_item_cmp);
+
+	for (i = 0; i < items->len; i ++) {
+		item = g_ptr_array_index (items, i);
+
+		if (surbl_module_ctx->max_urls > 0 && i >= surbl_module_ctx->max_urls) {
+			msg_info ("<%s> skip %ud domains out of %ud for surbl %s: too many "
+					"domains in the message", task->message_id,
+					items->len - i, items->len, suffix->suffix);
+			break;
+		}
+
+		/* Redirected urls should not repeat the requests sent */
+		if (g_hash_table_lookup (param.tree, item->request) == NULL) {
+			g_hash_table_insert (param.tree, item->request, item->url);
+			send_surbl_request (item->url, task, suffix, item->request);
+		}
+	}
+
+	g_ptr_array_free (items, TRUE);
+	g_hash_table_unref (param.hosts);
 }
@@ -9,6 +9,7 @@
 #define DEFAULT_SURBL_WEIGHT 10
 #define DEFAULT_REDIRECTOR_CONNECT_TIMEOUT 1.0
 #define DEFAULT_REDIRECTOR_READ_TIMEOUT 5.0
+#define DEFAULT_REDIRECTOR_CACHE_EXPIRE 3600
 #define DEFAULT_SURBL_MAX_URLS 1000
 #define DEFAULT_SURBL_URL_EXPIRE 86400
 #define DEFAULT_SURBL_SYMBOL "SURBL_DNS"
@@ -30,11 +31,19 @@ struct surbl_ctx {
 	const gchar *redirector_symbol;
 	GHashTable **exceptions;
 	GHashTable *whitelist;
+	/* Used instead of hashes above if lists are cdb maps */
+	struct cdb *exceptions_cdb;
+	struct cdb *whitelist_cdb;
 	GHashTable *redirector_hosts;
 	void *redirector_map_data;
 	ac_trie_t *redirector_trie;
 	GArray *redirector_ptrs;
 	guint use_redirector;
+	guint redirector_max_connections;
+	guint redirector_connections;
+	guint redirector_cache_expire;
+	guint redirector_wait;
+	struct rspamd_shm_cache *redirector_cache;
 	struct upstream_list *redirectors;
 	rspamd_mempool_t *surbl_pool;
 };
@@ -56,12 +65,22 @@ struct dns_param {
 
 struct redirector_param {
 	struct rspamd_url *url;
+	const gchar *key;
 	struct rspamd_task *task;
 	struct upstream *redirector;
 	struct rspamd_http_connection *conn;
 	gint sock;
 	GHashTable *tree;
+	GHashTable *hosts;
 	struct suffix_item *suffix;
+	gboolean reuse;
+};
+
+struct surbl_host_item {
+	struct rspamd_url *url;
+	gchar *request;
+	guint count;
+	guint order;
 };
 
 struct surbl_bit_item {
@@ -47,6 +47,7 @@
 #define DEFAULT_REJECT_MESSAGE "450 4.5.0 Spam message rejected"
 
 static gboolean smtp_write_socket (void *arg);
+static gboolean smtp_read_socket (rspamd_fstring_t * in, void *arg);
 
 /* Init functions */
 gpointer init_smtp (struct rspamd_config *cfg);
@@ -82,12 +83,56 @@ call_stage_filters (struct smtp_session *session, enum rspamd_smtp_stage stage)
 	return res;
 }
 
+/*
+ * Start receiving of a message by BDAT chunks, upstream is switched to DATA
+ * while chunks are transferred
+ */
+static gboolean
+smtp_start_chunking (struct smtp_session *session)
+{
+	if (!make_smtp_tempfile (session)) {
+		session->error = SMTP_ERROR_FILE;
+		session->state = SMTP_STATE_CRITICAL_ERROR;
+		return FALSE;
+	}
+
+	session->chunking = TRUE;
+	session->chunk_bol = TRUE;
+	session->upstream_ready = FALSE;
+	session->upstream_state = SMTP_STATE_DATA;
+	rspamd_dispatcher_restore (session->upstream_dispatcher);
+	if (!rspamd_dispatcher_write (session->upstream_dispatcher, "DATA" CRLF,
+		sizeof ("DATA" CRLF) - 1, FALSE, TRUE)) {
+		session->error = SMTP_ERROR_UPSTREAM;
+		session->state = SMTP_STATE_CRITICAL_ERROR;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+smtp_stop_chunking (struct smtp_session *session)
+{
+	if (session->chunking) {
+		close (session->temp_fd);
+		session->temp_fd = -1;
+		unlink (session->temp_name);
+		session->temp_name = NULL;
+	}
+	session->chunking = FALSE;
+	session->last_chunk = FALSE;
+	session->upstream_ready = FALSE;
+}
+
 static gboolean
 read_smtp_command (struct smtp_session *session, rspamd_fstring_t *line)
 {
 	struct smtp_command *cmd;
 	gchar outbuf[BUFSIZ];
 	gint r;
+	gsize chunk_size;
+	gboolean last;
 
 	if (!parse_smtp_command (session, line, &cmd)) {
 		session->error = SMTP_ERROR_BAD_COMMAND;
@@ -140,7 +185,7 @@ read_smtp_command (struct smtp_session *session, rspamd_fstring_t *line)
 		}
 		break;
 	case SMTP_COMMAND_RCPT:
-		if (session->state == SMTP_STATE_RCPT) {
+		if (session->state == SMTP_STATE_RCPT && !session->chunking) {
 			if (parse_smtp_rcpt (session, cmd)) {
 				if (!call_stage_filters (session, SMTP_STAGE_RCPT)) {
 					return FALSE;
@@ -183,6 +228,7 @@ read_smtp_command (struct smtp_session *session, rspamd_fstring_t *line)
 		}
 		break;
 	case SMTP_COMMAND_RSET:
+		smtp_stop_chunking (session);
 		session->from = NULL;
 		if (session->rcpt) {
 			g_list_free (session->rcpt);
@@ -196,7 +242,7 @@ read_smtp_command (struct smtp_session *session, rspamd_fstring_t *line)
 		session->state = SMTP_STATE_GREETING;
 		break;
 	case SMTP_COMMAND_DATA:
-		if (session->state == SMTP_STATE_RCPT) {
+		if (session->state == SMTP_STATE_RCPT && !session->chunking) {
 			if (session->rcpt == NULL) {
 				session->error = SMTP_ERROR_RECIPIENTS;
 				session->errors++;
@@ -231,6 +277,47 @@ read_smtp_command (struct smtp_session *session, rspamd_fstring_t *line)
 	case SMTP_COMMAND_HELP:
 		session->error = SMTP_ERROR_UNIMPLIMENTED;
 		return FALSE;
+	case SMTP_COMMAND_BDAT:
+		if (!parse_smtp_bdat (session, cmd, &chunk_size, &last)) {
+			session->errors++;
+			return FALSE;
+		}
+		if (chunk_size > SMTP_MAX_CHUNK_SIZE) {
+			/* Data of chunk cannot be skipped, so close connection */
+			session->error = SMTP_ERROR_CHUNK_SIZE;
+			session->state = SMTP_STATE_CRITICAL_ERROR;
+			return FALSE;
+		}
+		session->chunk_size = chunk_size;
+		session->chunk_state = session->state;
+		session->chunk_discard = TRUE;
+		if (session->state != SMTP_STATE_RCPT) {
+			session->error = SMTP_ERROR_SEQUENCE;
+			session->errors++;
+		}
+		else if (session->rcpt == NULL) {
+			session->error = SMTP_ERROR_RECIPIENTS;
+			session->errors++;
+		}
+		else if (session->upstream == NULL) {
+			session->error = SMTP_ERROR_UPSTREAM;
+			session->state = SMTP_STATE_CRITICAL_ERROR;
+			return FALSE;
+		}
+		else if (!session->chunking &&
+			!call_stage_filters (session, SMTP_STAGE_DATA)) {
+			session->errors++;
+		}
+		else if (!session->chunking && !smtp_start_chunking (session)) {
+			return FALSE;
+		}
+		else {
+			session->chunk_discard = FALSE;
+			session->last_chunk = last;
+		}
+		/* Data of chunk follows the command even if it is rejected */
+		session->state = SMTP_STATE_CHUNK;
+		return !session->chunk_discard;
 	}
 
 	session->error = SMTP_ERROR_OK;
@@ -242,7 +329,7 @@ improper_sequence:
 	return FALSE;
 }
 
-static gboolean
+gboolean
 process_smtp_data (struct smtp_session *session)
 {
 	struct stat st;
@@ -251,6 +338,9 @@ process_smtp_data (struct smtp_session *session)
 	rspamd_fstring_t *f;
 	gchar *s;
 
+	/* Commands received while message is processed are pipelined */
+	session->state = SMTP_STATE_END;
+
 	if (fstat (session->temp_fd, &st) == -1) {
 		msg_err ("fstat failed: %s", strerror (errno));
 		goto err;
@@ -346,6 +436,172 @@ err:
 	return FALSE;
 }
 
+/*
+ * Check whether a complete command follows the current input
+ */
+static gboolean
+smtp_has_more_input (struct smtp_session *session, rspamd_fstring_t *in)
+{
+	rspamd_buffer_t *buf = session->dispatcher->in_buf;
+	gchar *p;
+
+	if (session->in_pending) {
+		return !g_queue_is_empty (session->pending);
+	}
+	if (buf == NULL || in == NULL) {
+		return FALSE;
+	}
+
+	p = in->begin + in->len;
+	if (session->state != SMTP_STATE_CHUNK) {
+		/* Skip the end of the current line */
+		if ((p = memchr (p, '\n', buf->pos - p)) == NULL) {
+			return FALSE;
+		}
+		p++;
+	}
+
+	return p < buf->pos && memchr (p, '\n', buf->pos - p) != NULL;
+}
+
+static rspamd_fstring_t *
+smtp_copy_input (struct smtp_session *session, rspamd_fstring_t *in)
+{
+	rspamd_fstring_t *copy;
+
+	copy = rspamd_fstralloc (session->pool, in->len + 1);
+	memcpy (copy->begin, in->begin, in->len);
+	copy->len = in->len;
+
+	return copy;
+}
+
+/*
+ * Save input received while session waits for upstream
+ */
+static void
+smtp_queue_input (struct smtp_session *session, rspamd_fstring_t *in)
+{
+	struct smtp_command *cmd;
+	gchar *saved_error;
+	gsize size;
+	gboolean last;
+
+	g_queue_push_tail (session->pending, smtp_copy_input (session, in));
+
+	if (session->chunk_queued) {
+		/* This is data of the queued BDAT */
+		session->chunk_queued = FALSE;
+		rspamd_set_dispatcher_policy (session->dispatcher, BUFFER_LINE, 0);
+		return;
+	}
+
+	saved_error = session->error;
+	if (parse_smtp_command (session, in, &cmd) &&
+		cmd->command == SMTP_COMMAND_BDAT &&
+		parse_smtp_bdat (session, cmd, &size, &last) &&
+		size > 0 && size <= SMTP_MAX_CHUNK_SIZE) {
+		/* Data of chunk must not be split into lines */
+		session->chunk_queued = TRUE;
+		rspamd_set_dispatcher_policy (session->dispatcher, BUFFER_CHARACTER,
+			size);
+	}
+	session->error = saved_error;
+}
+
+/*
+ * Write data of chunk to the temporary file, lines that start with a dot are
+ * escaped as the message is sent to upstream by DATA
+ */
+static gboolean
+smtp_write_chunk (struct smtp_session *session, rspamd_fstring_t *in)
+{
+	gchar *p = in->begin, *end = in->begin + in->len, *c;
+
+	while (p < end) {
+		if (session->chunk_bol && *p == '.') {
+			if (write (session->temp_fd, ".", 1) != 1) {
+				return FALSE;
+			}
+		}
+		if ((c = memchr (p, '\n', end - p)) != NULL) {
+			c++;
+			session->chunk_bol = TRUE;
+		}
+		else {
+			c = end;
+			session->chunk_bol = FALSE;
+		}
+		if (write (session->temp_fd, p, c - p) != c - p) {
+			return FALSE;
+		}
+		p = c;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Handle data of BDAT chunk
+ */
+static gboolean
+smtp_read_chunk (struct smtp_session *session, rspamd_fstring_t *in)
+{
+	if (!session->in_pending && session->chunk_size > 0) {
+		session->chunk_queued = FALSE;
+		rspamd_set_dispatcher_policy (session->dispatcher, BUFFER_LINE, 0);
+	}
+
+	if (session->chunk_discard) {
+		/* Error has been set by BDAT command */
+		session->state = session->chunk_state;
+		return smtp_write_socket (session);
+	}
+
+	if (in != NULL && !smtp_write_chunk (session, in)) {
+		msg_err ("cannot write to temp file: %s", strerror (errno));
+		session->error = SMTP_ERROR_FILE;
+		session->state = SMTP_STATE_CRITICAL_ERROR;
+		return smtp_write_socket (session);
+	}
+
+	session->state = SMTP_STATE_RCPT;
+	if (!session->last_chunk) {
+		session->error = SMTP_ERROR_CHUNK_OK;
+		return smtp_write_socket (session);
+	}
+	if (session->upstream_ready) {
+		return process_smtp_data (session);
+	}
+
+	/* Wait for upstream to accept DATA */
+	session->state = SMTP_STATE_WAIT_UPSTREAM;
+	rspamd_dispatcher_pause (session->dispatcher);
+
+	return TRUE;
+}
+
+gboolean
+smtp_process_pending_commands (struct smtp_session *session)
+{
+	rspamd_fstring_t *in;
+
+	session->in_pending = TRUE;
+
+	while (session->state != SMTP_STATE_WAIT_UPSTREAM &&
+		session->state != SMTP_STATE_END &&
+		(in = g_queue_pop_head (session->pending)) != NULL) {
+		if (!smtp_read_socket (in, session)) {
+			/* Session is destroyed */
+			return FALSE;
+		}
+	}
+
+	session->in_pending = FALSE;
+
+	return TRUE;
+}
+
 /*
  * Callback that is called when there is data to read in buffer
  */
@@ -354,6 +610,8 @@ smtp_read_socket (rspamd_fstring_t * in, void *arg)
 {
 	struct smtp_session *session = arg;
 
+	session->batch_replies = smtp_has_more_input (session, in);
+
 	switch (session->state) {
 	case SMTP_STATE_RESOLVE_REVERSE:
 	case SMTP_STATE_RESOLVE_NORMAL:
@@ -370,6 +628,16 @@ smtp_read_socket (rspamd_fstring_t * in, void *arg)
 	case SMTP_STATE_RCPT:
 	case SMTP_STATE_DATA:
 		read_smtp_command (session, in);
+		if (session->state == SMTP_STATE_CHUNK) {
+			if (session->chunk_size == 0) {
+				return smtp_read_chunk (session, NULL);
+			}
+			if (!session->in_pending) {
+				rspamd_set_dispatcher_policy (session->dispatcher,
+					BUFFER_CHARACTER, session->chunk_size);
+			}
+			return TRUE;
+		}
 		if (session->state != SMTP_STATE_WAIT_UPSTREAM) {
 			if (session->errors > session->ctx->max_errors) {
 				session->error = SMTP_ERROR_LIMIT;
@@ -407,7 +675,12 @@ smtp_read_socket (rspamd_fstring_t * in, void *arg)
 			return FALSE;
 		}
 		break;
+	case SMTP_STATE_CHUNK:
+		return smtp_read_chunk (session, in);
 	case SMTP_STATE_WAIT_UPSTREAM:
+	case SMTP_STATE_END:
+		/* Commands are pipelined, process them when upstream replies */
+		smtp_queue_input (session, in);
 		rspamd_dispatcher_pause (session->dispatcher);
 		break;
 	default:
@@ -463,12 +736,14 @@ smtp_write_socket (void *arg)
 	}
 	else {
 		if (session->error != NULL) {
+			/* Replies to pipelined commands are sent together */
 			if (!rspamd_dispatcher_write (session->dispatcher, session->error,
-				0, FALSE, TRUE)) {
+				0, session->batch_replies, TRUE)) {
 				return FALSE;
 			}
 		}
 	}
+	session->batch_replies = FALSE;
 
 	return TRUE;
 }
@@ -706,6 +981,10 @@ accept_socket (gint fd, short what, void *arg)
 	session->session_time = time (NULL);
 	session->resolver = ctx->resolver;
 	session->ev_base = ctx->ev_base;
+	session->pending = g_queue_new ();
+	rspamd_mempool_add_destructor (session->pool,
+		(rspamd_mempool_destruct_t)g_queue_free,
+		session->pending);
 	worker->srv->stat->connections_count++;
 
 	/* Resolve client's addr */
@@ -832,10 +1111,32 @@ static void
 make_capabilities (struct smtp_worker_ctx *ctx, const gchar *line)
 {
 	gchar **strv, *p, *result, *hostbuf;
-	guint32 num, i, len, hostmax;
+	guint32 num, i, j, len, hostmax;
+	GPtrArray *caps;
+	static const gchar *required[] = {"PIPELINING", "CHUNKING"};
 
 	strv = g_strsplit_set (line, ",;", -1);
-	num = g_strv_length (strv);
+	caps = g_ptr_array_new ();
+
+	for (i = 0; strv[i] != NULL; i++) {
+		g_strstrip (strv[i]);
+		if (strv[i][0] != '\0') {
+			g_ptr_array_add (caps, strv[i]);
+		}
+	}
+	/* Pipelining and chunking are always supported */
+	for (i = 0; i < G_N_ELEMENTS (required); i++) {
+		for (j = 0; j < caps->len; j++) {
+			if (g_ascii_strcasecmp (g_ptr_array_index (caps, j),
+				required[i]) == 0) {
+				break;
+			}
+		}
+		if (j == caps->len) {
+			g_ptr_array_add (caps, (gpointer)required[i]);
+		}
+	}
+	num = caps->len;
 
 	hostmax = sysconf (_SC_HOST_NAME_MAX) + 1;
 	hostbuf = alloca (hostmax);
@@ -845,7 +1146,7 @@ make_capabilities (struct smtp_worker_ctx *ctx, const gchar *line)
 	len = sizeof ("250-") + strlen (hostbuf) + sizeof (CRLF) - 1;
 
 	for (i = 0; i < num; i++) {
-		p = strv[i];
+		p = g_ptr_array_index (caps, i);
 		len += sizeof ("250-") + sizeof (CRLF) + strlen (p) - 2;
 	}
 
@@ -863,17 +1164,18 @@ make_capabilities (struct smtp_worker_ctx *ctx, const gchar *line)
 				p += rspamd_snprintf (p,
 						len - (p - result),
 						"250-%s" CRLF,
-						strv[i]);
+						(gchar *)g_ptr_array_index (caps, i));
 			}
 			else {
 				p += rspamd_snprintf (p,
 						len - (p - result),
 						"250 %s" CRLF,
-						strv[i]);
+						(gchar *)g_ptr_array_index (caps, i));
 			}
 		}
 	}
 
+	g_ptr_array_free (caps, TRUE);
 	g_strfreev (strv);
 }
 
@@ -971,9 +1273,10 @@ config_smtp_worker (struct rspamd_worker *worker)
 	}
 
 	/* Parse capabilities */
-	if ((value = ctx->smtp_capabilities_str) != NULL) {
-		make_capabilities (ctx, value);
+	if ((value = ctx->smtp_capabilities_str) == NULL) {
+		value = "";
 	}
+	make_capabilities (ctx, value);
 
 	return TRUE;
 }
@@ -57,6 +57,7 @@ enum rspamd_smtp_state {
 	SMTP_STATE_BEFORE_DATA,
 	SMTP_STATE_DATA,
 	SMTP_STATE_AFTER_DATA,
+	SMTP_STATE_CHUNK,
 	SMTP_STATE_END,
 	SMTP_STATE_QUIT,
 	SMTP_STATE_WAIT_UPSTREAM,
@@ -92,6 +93,18 @@ struct smtp_session {
 
 	guint errors;
 
+	GQueue *pending;                            /* input received while waiting for upstream */
+	gsize chunk_size;                           /* size of the current BDAT chunk */
+	enum rspamd_smtp_state chunk_state;         /* state to return to after a chunk */
+	gboolean chunking;                          /* message is received by BDAT */
+	gboolean last_chunk;                        /* the last BDAT chunk is received */
+	gboolean chunk_discard;                     /* BDAT is rejected, drop its data */
+	gboolean chunk_queued;                      /* data of a pending BDAT is expected */
+	gboolean chunk_bol;                         /* chunk data is at the beginning of a line */
+	gboolean upstream_ready;                    /* upstream has accepted DATA */
+	gboolean in_pending;                        /* pending input is processed */
+	gboolean batch_replies;                     /* more commands follow, delay reply */
+
 	struct rspamd_async_session *s;
 	rspamd_io_dispatcher_t *dispatcher;
 	rspamd_io_dispatcher_t *upstream_dispatcher;
@@ -114,6 +127,17 @@ struct smtp_filter {
 	gpointer filter_data;
 };
 
+/*
+ * Process commands received while the session was waiting for upstream,
+ * returns FALSE if session has been destroyed
+ */
+gboolean smtp_process_pending_commands (struct smtp_session *session);
+
+/*
+ * Scan a message received and send it to upstream
+ */
+gboolean process_smtp_data (struct smtp_session *session);
+
 /*
  * Register new SMTP filter
  * XXX: work is still in progress
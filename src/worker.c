@@ -34,7 +34,11 @@
 #include "libserver/cfg_file.h"
 #include "libserver/url.h"
 #include "libserver/dns.h"
+#include "libserver/dkim.h"
+#include "libserver/classify_executor.h"
+#include "libserver/task_scheduler.h"
 #include "libmime/message.h"
+#include "libstat/stat_api.h"
 #include "main.h"
 #include "keypairs_cache.h"
 
@@ -46,6 +50,33 @@
 
 /* 60 seconds for worker's IO */
 #define DEFAULT_WORKER_IO_TIMEOUT 60000
+/* Messages of a batch request that are processed simultaneously */
+#define DEFAULT_BATCH_CONCURRENCY 8
+/* Tasks waiting for classifier threads */
+#define DEFAULT_CLASSIFY_QUEUE 1024
+#define DEFAULT_SCHEDULER_QUEUE 1024
+/* Interval of admission control in milliseconds */
+#define DEFAULT_ADMISSION_INTERVAL 100
+/* Message headers are scanned for prefetching within this limit */
+#define PREFETCH_HEADERS_MAX (64 * 1024)
+/* Time jitter for DKIM signatures which keys are prefetched */
+#define PREFETCH_DKIM_JITTER 60
+/* Tasks taken by a classifier thread at once */
+#define DEFAULT_CLASSIFY_BATCH 8
+/* 10 seconds to wait for the next request on a persistent connection */
+#define DEFAULT_KEEPALIVE_TIMEOUT 10000
+/* How often tasks are checked while waiting to switch config (seconds) */
+#define RELOAD_CHECK_INTERVAL 0.1
+/* Shared keys cached for encrypted connections */
+#define DEFAULT_KEYS_CACHE_SIZE 256
+/* Number of queued learns processed at once */
+#define DEFAULT_LEARN_QUEUE_SIZE 32
+/* Maximum delay of queued learns */
+#define DEFAULT_LEARN_QUEUE_TIMEOUT 1.0
+/* Kilobytes of lua garbage collected by a step in idle time */
+#define DEFAULT_LUA_GC_STEP 64
+/* Lua memory above which all garbage is collected between tasks */
+#define DEFAULT_LUA_GC_MAX_MEMORY (128 * 1024 * 1024)
 
 gpointer init_worker (struct rspamd_config *cfg);
 void start_worker (struct rspamd_worker *worker);
@@ -58,12 +89,26 @@ worker_t normal_worker = {
 	FALSE,                      /* Non unique */
 	FALSE,                      /* Non threaded */
 	TRUE,                       /* Killable */
-	SOCK_STREAM                 /* TCP socket */
+	SOCK_STREAM,                /* TCP socket */
+	TRUE                        /* Reloadable */
 };
 
 /*
  * Worker's context
  */
+/*
+ * Admission control state, it follows CoDel: if time spent by tasks before
+ * scanning stays above the target for the whole interval, then tasks are shed
+ * at increasing rate until the time drops below the target
+ */
+struct rspamd_worker_admission {
+	gdouble first_above;
+	gdouble drop_next;
+	guint count;
+	gboolean dropping;
+	gboolean reject;
+};
+
 struct rspamd_worker_ctx {
 	guint32 timeout;
 	struct timeval io_tv;
@@ -73,6 +118,8 @@ struct rspamd_worker_ctx {
 	gboolean is_http;
 	/* JSON output                                  */
 	gboolean is_json;
+	/* Start DNS requests while a message is received */
+	gboolean streaming;
 	/* Allow learning throught worker				*/
 	gboolean allow_learn;
 	/* DNS resolver */
@@ -83,37 +130,591 @@ struct rspamd_worker_ctx {
 	guint32 max_tasks;
 	/* Classify threads */
 	guint32 classify_threads;
+	/* Maximum number of tasks waiting for classification */
+	guint32 classify_queue;
+	/* Number of tasks taken by a classify thread at once */
+	guint32 classify_batch;
+	/* Threads for CPU bound stages of tasks */
+	guint32 scheduler_threads;
+	/* Maximum number of tasks waiting for scheduler threads */
+	guint32 scheduler_queue;
+	/* Target of time spent by tasks before scanning (0 disables shedding) */
+	gdouble admission_target;
+	/* Time that tasks should be above the target to start shedding */
+	gdouble admission_interval;
+	/* What to do with shed tasks: "soft reject" or "skip" */
+	gchar *admission_action;
+	struct rspamd_worker_admission admission;
+	/* Limit of messages processed simultaneously in a batch */
+	guint32 batch_concurrency;
+	/* Maximum requests per connection (0 disables keep-alive) */
+	guint32 keepalive_requests;
+	/* Idle timeout for persistent connections */
+	guint32 keepalive_timeout;
+	struct timeval keepalive_tv;
+	/* Number of shared keys cached for encrypted peers */
+	guint32 keys_cache_size;
 	/* Classify threads */
-	GThreadPool *classify_pool;
+	struct rspamd_classify_executor *classify_executor;
+	/* Scheduler threads */
+	struct rspamd_task_scheduler *scheduler;
 	/* Events base */
 	struct event_base *ev_base;
 	/* Encryption key */
 	gpointer key;
 	/* Keys cache */
 	struct rspamd_keypair_cache *keys_cache;
+	/* Persistent connections waiting for the next request */
+	GHashTable *idle_tasks;
+	/* New config waiting for the tasks of the current config to finish */
+	struct rspamd_config *reload_cfg;
+	struct event reload_ev;
+	/* Kilobytes of lua garbage collected by a step (0 to use lua's collector) */
+	guint32 lua_gc_step;
+	/* Lua memory above which full collection is done */
+	gsize lua_gc_max_memory;
+	struct rspamd_lua_gc *lua_gc;
+	/* Tasks waiting for their learns after replies are written */
+	GPtrArray *learn_queue;
+	struct event learn_ev;
+	/* Number of learns processed at once (0 means learning inline) */
+	guint32 learn_queue_size;
+	gdouble learn_queue_timeout;
+};
+
+struct rspamd_worker_idle_task {
+	struct rspamd_worker_ctx *ctx;
+	struct rspamd_task *task;
 };
 
+/*
+ * Collect lua garbage only when there are no tasks in progress
+ */
+static void
+rspamd_worker_gc_update (struct rspamd_worker_ctx *ctx)
+{
+	if (ctx->lua_gc != NULL) {
+		rspamd_lua_gc_set_idle (ctx->lua_gc,
+				ctx->tasks == g_hash_table_size (ctx->idle_tasks));
+	}
+}
+
 /*
  * Reduce number of tasks proceeded
  */
 static void
 reduce_tasks_count (gpointer arg)
 {
-	guint32 *tasks = arg;
+	struct rspamd_worker_ctx *ctx = arg;
+
+	ctx->tasks--;
+	rspamd_worker_gc_update (ctx);
+}
+
+/*
+ * Batch request: a sequence of messages each preceded by its length
+ */
+struct rspamd_worker_batch {
+	struct rspamd_task *task;
+	struct rspamd_worker_ctx *ctx;
+	GArray *frames;
+	GPtrArray *tasks;
+	ucl_object_t *results;
+	struct event ev;
+	guint next;
+	gboolean scheduling;
+};
+
+struct rspamd_worker_batch_item {
+	struct rspamd_worker_batch *batch;
+	guint idx;
+};
+
+static void rspamd_worker_batch_schedule (struct rspamd_worker_batch *batch);
+static void rspamd_worker_batch_fin (gpointer ud);
+
+static void
+rspamd_worker_batch_free_task (gint fd, short what, gpointer ud)
+{
+	struct rspamd_task *task = ud;
+
+	destroy_session (task->s);
+}
+
+static gboolean
+rspamd_worker_batch_item_fin (struct rspamd_task *task, void *ud)
+{
+	struct rspamd_worker_batch_item *item = ud;
+	struct rspamd_worker_batch *batch = item->batch;
+	struct timeval tv = {0, 0};
+	ucl_object_t *res;
+
+	if (task->error_code != 0) {
+		res = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (res, ucl_object_fromstring (task->last_error),
+				"error", 0, false);
+	}
+	else {
+		res = rspamd_protocol_write_result (task);
+	}
+
+	ucl_object_insert_key (res, ucl_object_fromint (item->idx),
+			"index", 0, false);
+	ucl_array_append (batch->results, res);
+	g_ptr_array_remove_fast (batch->tasks, task);
+
+	/* Session cannot be destroyed from its own finalizer */
+	event_base_once (task->ev_base, -1, EV_TIMEOUT,
+			rspamd_worker_batch_free_task, task, &tv);
+	rspamd_worker_batch_schedule (batch);
+
+	return TRUE;
+}
+
+static void
+rspamd_worker_batch_process_frame (struct rspamd_worker_batch *batch,
+	guint idx)
+{
+	struct rspamd_task *task, *parent = batch->task;
+	struct rspamd_protocol_batch_frame *frame;
+	struct rspamd_worker_batch_item *item;
+
+	frame = &g_array_index (batch->frames, struct rspamd_protocol_batch_frame,
+			idx);
+	task = rspamd_task_new (parent->worker);
+	task->scheduler = parent->scheduler;
+	task->flags = parent->flags & ~RSPAMD_TASK_FLAG_HAS_CONTROL;
+	task->cmd = CMD_CHECK;
+	task->resolver = parent->resolver;
+	task->ev_base = parent->ev_base;
+
+	/* Parent task can be terminated before its messages */
+	if (parent->client_addr) {
+		task->client_addr = rspamd_inet_address_copy (parent->client_addr);
+	}
+	if (parent->from_addr) {
+		/* Address of a task is owned by its pool */
+		task->from_addr = rspamd_inet_address_copy (parent->from_addr);
+		rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t)rspamd_inet_address_destroy,
+				task->from_addr);
+	}
+	if (parent->helo) {
+		task->helo = rspamd_mempool_strdup (task->task_pool, parent->helo);
+	}
+	if (parent->hostname) {
+		task->hostname = rspamd_mempool_strdup (task->task_pool,
+				parent->hostname);
+	}
+	if (parent->user) {
+		task->user = rspamd_mempool_strdup (task->task_pool, parent->user);
+	}
+	if (parent->deliver_to) {
+		task->deliver_to = rspamd_mempool_strdup (task->task_pool,
+				parent->deliver_to);
+	}
+
+	item = rspamd_mempool_alloc (task->task_pool, sizeof (*item));
+	item->batch = batch;
+	item->idx = idx;
+	task->fin_callback = rspamd_worker_batch_item_fin;
+	task->fin_arg = item;
+	task->s = new_async_session (task->task_pool, rspamd_task_fin,
+			rspamd_task_restore, rspamd_task_free_hard, task);
+	g_ptr_array_add (batch->tasks, task);
+
+	if (!rspamd_task_process (task, NULL, frame->start, frame->len,
+			batch->ctx->classify_executor, TRUE)) {
+		rspamd_worker_batch_item_fin (task, item);
+	}
+}
+
+static void
+rspamd_worker_batch_schedule (struct rspamd_worker_batch *batch)
+{
+	struct rspamd_task *parent = batch->task;
+	guint limit = MAX (batch->ctx->batch_concurrency, 1);
+
+	/* Messages could be finished synchronously */
+	if (batch->scheduling) {
+		return;
+	}
+
+	batch->scheduling = TRUE;
+
+	while (batch->tasks->len < limit && batch->next < batch->frames->len) {
+		rspamd_worker_batch_process_frame (batch, batch->next++);
+	}
+
+	batch->scheduling = FALSE;
+
+	if (batch->tasks->len == 0 && batch->next == batch->frames->len) {
+		parent->state = WRITE_REPLY;
+		remove_normal_event (parent->s, rspamd_worker_batch_fin, batch);
+	}
+}
+
+static void
+rspamd_worker_batch_start (gint fd, short what, gpointer ud)
+{
+	struct rspamd_worker_batch *batch = ud;
 
-	(*tasks)--;
+	rspamd_worker_batch_schedule (batch);
 }
 
+static void
+rspamd_worker_batch_fin (gpointer ud)
+{
+	struct rspamd_worker_batch *batch = ud;
+	struct rspamd_task *task;
+	guint i;
+
+	if (evtimer_pending (&batch->ev, NULL)) {
+		event_del (&batch->ev);
+	}
+
+	/* Terminate messages that are still processed */
+	for (i = 0; i < batch->tasks->len; i++) {
+		task = g_ptr_array_index (batch->tasks, i);
+		destroy_session (task->s);
+	}
+
+	g_ptr_array_set_size (batch->tasks, 0);
+}
+
+static gboolean
+rspamd_worker_batch_reply (struct rspamd_task *task, void *ud)
+{
+	struct rspamd_worker_batch *batch = ud;
+	struct rspamd_http_message *msg;
+
+	if (task->error_code != 0) {
+		rspamd_protocol_write_reply (task);
+		return TRUE;
+	}
+
+	msg = rspamd_http_new_message (HTTP_RESPONSE);
+	msg->date = time (NULL);
+	msg->body = g_string_sized_new (BUFSIZ);
+	rspamd_ucl_emit_gstring (batch->results, UCL_EMIT_JSON_COMPACT, msg->body);
+
+	if (task->flags & RSPAMD_TASK_FLAG_KEEP_ALIVE) {
+		msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+	}
+
+	task->state = WRITING_REPLY;
+	rspamd_task_stage_done (task, RSPAMD_TASK_STAGE_MAX);
+	rspamd_http_connection_reset (task->http_conn);
+	rspamd_http_connection_write_message (task->http_conn, msg, NULL,
+		"application/json", task, task->sock, &task->tv, task->ev_base);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_worker_batch_init (struct rspamd_task *task,
+	struct rspamd_http_message *msg, const gchar *chunk, gsize len)
+{
+	struct rspamd_worker_batch *batch;
+	struct timeval tv = {0, 0};
+
+	task->msg.start = chunk;
+	task->msg.len = len;
+	task->s->wanna_die = TRUE;
+	rspamd_protocol_handle_headers (task, msg);
+
+	if (task->error_code != 0) {
+		return FALSE;
+	}
+
+	batch = rspamd_mempool_alloc0 (task->task_pool, sizeof (*batch));
+	batch->task = task;
+	batch->ctx = task->worker->ctx;
+	batch->frames = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_protocol_batch_frame));
+	rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)rspamd_array_free_hard, batch->frames);
+
+	if (!rspamd_protocol_parse_batch (task->msg.start, task->msg.len,
+			batch->frames)) {
+		msg_err ("got invalid batch of %z bytes", task->msg.len);
+		task->last_error = "invalid batch";
+		task->error_code = RSPAMD_PROTOCOL_ERROR;
+		return FALSE;
+	}
+
+	batch->tasks = g_ptr_array_new ();
+	rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)rspamd_ptr_array_free_hard, batch->tasks);
+	batch->results = ucl_object_typed_new (UCL_ARRAY);
+	rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)ucl_object_unref, batch->results);
+
+	msg_info ("got batch of %ud messages", batch->frames->len);
+	task->fin_callback = rspamd_worker_batch_reply;
+	task->fin_arg = batch;
+	register_async_event (task->s, rspamd_worker_batch_fin, batch,
+			g_quark_from_static_string ("batch"));
+
+	/* Start processing after the request has been read completely */
+	evtimer_set (&batch->ev, rspamd_worker_batch_start, batch);
+	event_base_set (task->ev_base, &batch->ev);
+	evtimer_add (&batch->ev, &tv);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_worker_admission_ok_to_shed (struct rspamd_worker_ctx *ctx,
+	gdouble sojourn, gdouble now)
+{
+	struct rspamd_worker_admission *adm = &ctx->admission;
+
+	if (sojourn < ctx->admission_target) {
+		adm->first_above = 0;
+	}
+	else if (adm->first_above == 0) {
+		adm->first_above = now + ctx->admission_interval;
+	}
+	else if (now >= adm->first_above) {
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Returns TRUE if a task should be shed
+ */
+static gboolean
+rspamd_worker_admission_check (struct rspamd_worker_ctx *ctx,
+	struct rspamd_task *task)
+{
+	struct rspamd_worker_admission *adm = &ctx->admission;
+	gdouble now;
+	gboolean ok_to_shed;
+
+	now = rspamd_get_ticks ();
+
+	/*
+	 * Persistent connections wait for the next request in the current stage,
+	 * so only new connections tell the time tasks spend before scanning
+	 */
+	if (task->conn_requests == 0) {
+		ok_to_shed = rspamd_worker_admission_ok_to_shed (ctx,
+				now - task->stage_time, now);
+	}
+	else {
+		ok_to_shed = adm->dropping;
+	}
+
+	if (adm->dropping) {
+		if (!ok_to_shed) {
+			adm->dropping = FALSE;
+			msg_info ("worker is not overloaded, stop shedding tasks");
+		}
+		else if (now >= adm->drop_next) {
+			adm->count ++;
+			adm->drop_next = now + ctx->admission_interval / sqrt (adm->count);
+
+			return TRUE;
+		}
+	}
+	else if (ok_to_shed) {
+		adm->dropping = TRUE;
+
+		/* Continue with the previous rate if we have been shedding recently */
+		if (adm->count > 2 &&
+				now - adm->drop_next < ctx->admission_interval * 8) {
+			adm->count -= 2;
+		}
+		else {
+			adm->count = 1;
+		}
+
+		adm->drop_next = now + ctx->admission_interval / sqrt (adm->count);
+		msg_info ("worker is overloaded, start shedding tasks");
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * SPF record of the envelope domain is requested as soon as the request
+ * headers are received
+ */
+static void
+rspamd_worker_prefetch_envelope (struct rspamd_task *task,
+	struct rspamd_http_message *msg)
+{
+	const GString *hdr;
+	const gchar *p, *end, *at;
+	gchar domain[256];
+	gsize dlen;
+
+	hdr = rspamd_http_message_find_header (msg, "From");
+	p = NULL;
+
+	if (hdr != NULL && (at = memchr (hdr->str, '@', hdr->len)) != NULL) {
+		p = at + 1;
+		end = hdr->str + hdr->len;
+	}
+	else {
+		/* SPF is checked for HELO if envelope sender is empty */
+		hdr = rspamd_http_message_find_header (msg, "Helo");
+
+		if (hdr != NULL) {
+			p = hdr->str;
+			end = hdr->str + hdr->len;
+		}
+	}
+
+	if (p == NULL) {
+		return;
+	}
+
+	dlen = 0;
+
+	while (p + dlen < end && p[dlen] != '>' && !g_ascii_isspace (p[dlen])) {
+		dlen ++;
+	}
+
+	if (dlen > 0 && dlen < sizeof (domain)) {
+		rspamd_strlcpy (domain, p, dlen + 1);
+		msg_debug ("prefetch SPF record of %s", domain);
+		rspamd_dns_prefetch (task->resolver, RDNS_REQUEST_TXT, domain);
+	}
+}
+
+static void
+rspamd_worker_prefetch_dkim (struct rspamd_task *task, const gchar *sig,
+	gsize len)
+{
+	rspamd_dkim_context_t *dkim;
+	GString *value;
+	GError *err = NULL;
+	gsize i;
+
+	/* Unfold signature */
+	value = g_string_sized_new (len);
+
+	for (i = 0; i < len; i ++) {
+		if (sig[i] != '\r' && sig[i] != '\n') {
+			g_string_append_c (value, sig[i]);
+		}
+	}
+
+	dkim = rspamd_create_dkim_context (value->str, task->task_pool,
+			PREFETCH_DKIM_JITTER, &err);
+
+	if (dkim != NULL) {
+		msg_debug ("prefetch DKIM key %s", dkim->dns_key);
+		rspamd_dns_prefetch (task->resolver, RDNS_REQUEST_TXT, dkim->dns_key);
+	}
+	else if (err != NULL) {
+		g_error_free (err);
+	}
+
+	g_string_free (value, TRUE);
+}
+
+/*
+ * DKIM keys are requested as soon as the message headers are received
+ */
+static void
+rspamd_worker_prefetch_headers (struct rspamd_task *task,
+	struct rspamd_http_message *msg)
+{
+	const gchar *p, *end, *nl, *hdr_end = NULL, *sig;
+	static const gchar dkim_hdr[] = "DKIM-Signature:";
+
+	p = msg->body->str;
+	end = p + MIN (msg->body->len, PREFETCH_HEADERS_MAX);
+
+	/* Wait for the empty line that ends headers */
+	while (p < end && (nl = memchr (p, '\n', end - p)) != NULL) {
+		if (nl == p || (nl == p + 1 && *p == '\r')) {
+			hdr_end = p;
+			break;
+		}
+
+		p = nl + 1;
+	}
+
+	if (hdr_end == NULL) {
+		if (msg->body->len >= PREFETCH_HEADERS_MAX) {
+			task->flags |= RSPAMD_TASK_FLAG_PREFETCH_HEADERS;
+		}
+
+		return;
+	}
+
+	task->flags |= RSPAMD_TASK_FLAG_PREFETCH_HEADERS;
+	p = msg->body->str;
+
+	while (p < hdr_end) {
+		nl = memchr (p, '\n', hdr_end - p);
+		nl = nl ? nl + 1 : hdr_end;
+
+		if (nl - p > (gint)sizeof (dkim_hdr) &&
+				g_ascii_strncasecmp (p, dkim_hdr, sizeof (dkim_hdr) - 1) == 0) {
+			sig = p + sizeof (dkim_hdr) - 1;
+
+			/* Append continuation lines */
+			while (nl < hdr_end && (*nl == ' ' || *nl == '\t')) {
+				nl = memchr (nl, '\n', hdr_end - nl);
+				nl = nl ? nl + 1 : hdr_end;
+			}
+
+			rspamd_worker_prefetch_dkim (task, sig, nl - sig);
+		}
+
+		p = nl;
+	}
+}
+
+/*
+ * Called for each portion of a request received in streaming mode
+ */
 static gint
-rspamd_worker_body_handler (struct rspamd_http_connection *conn,
+rspamd_worker_body_chunk_handler (struct rspamd_task *task,
+	struct rspamd_http_message *msg)
+{
+	if (!(task->flags & RSPAMD_TASK_FLAG_PREFETCH_ENVELOPE)) {
+		task->flags |= RSPAMD_TASK_FLAG_PREFETCH_ENVELOPE;
+		rspamd_worker_prefetch_envelope (task, msg);
+	}
+
+	if (!(task->flags & RSPAMD_TASK_FLAG_PREFETCH_HEADERS)) {
+		rspamd_worker_prefetch_headers (task, msg);
+	}
+
+	return 0;
+}
+
+static gint
+rspamd_worker_process_request (struct rspamd_task *task,
 	struct rspamd_http_message *msg,
 	const gchar *chunk, gsize len)
 {
-	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
+	struct rspamd_http_connection *conn = task->http_conn;
 	struct rspamd_worker_ctx *ctx;
 
 	ctx = task->worker->ctx;
 
+	/*
+	 * Encrypted connections are not reused as keys are bound to a request,
+	 * connections are not reused as well if a new config is waiting
+	 */
+	if ((msg->flags & RSPAMD_HTTP_FLAG_KEEP_ALIVE) &&
+			task->conn_requests + 1 < ctx->keepalive_requests &&
+			!rspamd_http_connection_is_encrypted (conn) &&
+			ctx->reload_cfg == NULL) {
+		task->flags |= RSPAMD_TASK_FLAG_KEEP_ALIVE;
+	}
+
 	if (!rspamd_protocol_handle_request (task, msg)) {
 		task->state = WRITE_REPLY;
 		return 0;
@@ -124,44 +725,281 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 		return 0;
 	}
 
-	if (msg->body->len == 0) {
-		msg_err ("got zero length body, cannot continue");
-		task->last_error = "message's body is empty";
-		task->error_code = RSPAMD_LENGTH_ERROR;
-		task->state = WRITE_REPLY;
+	if (task->cmd == CMD_BATCH) {
+		if (!rspamd_worker_batch_init (task, msg, chunk, len)) {
+			task->state = WRITE_REPLY;
+		}
 		return 0;
 	}
 
+	if (ctx->admission_target > 0 && rspamd_worker_admission_check (ctx, task)) {
+		if (ctx->admission.reject) {
+			rspamd_task_set_pre_result (task, METRIC_ACTION_SOFT_REJECT,
+					"server is overloaded");
+			task->worker->srv->stat->admission_rejected ++;
+		}
+		else {
+			task->flags |= RSPAMD_TASK_FLAG_OVERLOAD;
+			task->worker->srv->stat->admission_skipped ++;
+		}
+	}
 
-	if (!rspamd_task_process (task, msg, chunk, len, ctx->classify_pool, TRUE)) {
+	if (!rspamd_task_process (task, msg, chunk, len, ctx->classify_executor,
+			TRUE)) {
 		task->state = WRITE_REPLY;
 	}
 
 	return 0;
 }
 
+static gint
+rspamd_worker_body_handler (struct rspamd_http_connection *conn,
+	struct rspamd_http_message *msg,
+	const gchar *chunk, gsize len)
+{
+	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
+	struct rspamd_worker_ctx *ctx;
+
+	ctx = task->worker->ctx;
+
+	g_hash_table_remove (ctx->idle_tasks, task);
+	rspamd_worker_gc_update (ctx);
+
+	if (conn->opts & RSPAMD_HTTP_BODY_PARTIAL) {
+		return rspamd_worker_body_chunk_handler (task, msg);
+	}
+
+	return rspamd_worker_process_request (task, msg, chunk, len);
+}
+
 static void
 rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 {
 	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
 
-	msg_info ("abnormally closing connection from: %s, error: %e",
-		rspamd_inet_address_to_string (task->client_addr), err);
+	if (task->conn_requests > 0 && task->state == READ_MESSAGE) {
+		/* Client has closed a persistent connection or it has expired */
+		msg_debug ("closing persistent connection from: %s, error: %e",
+			rspamd_inet_address_to_string (task->client_addr), err);
+	}
+	else {
+		msg_info ("abnormally closing connection from: %s, error: %e",
+			rspamd_inet_address_to_string (task->client_addr), err);
+	}
 	/* Terminate session immediately */
 	destroy_session (task->s);
 }
 
+static struct rspamd_task *
+rspamd_worker_task_new (struct rspamd_worker *worker,
+	gint fd, rspamd_inet_addr_t *addr, struct rspamd_http_connection *conn)
+{
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	struct rspamd_task *new_task;
+
+	new_task = rspamd_task_new (worker);
+
+	/* Copy some variables */
+	if (ctx->is_mime) {
+		new_task->flags |= RSPAMD_TASK_FLAG_MIME;
+	}
+	else {
+		new_task->flags &= ~RSPAMD_TASK_FLAG_MIME;
+	}
+
+	new_task->sock = fd;
+	new_task->client_addr = addr;
+	new_task->resolver = ctx->resolver;
+	new_task->http_conn = conn;
+	new_task->ev_base = ctx->ev_base;
+	ctx->tasks++;
+	rspamd_mempool_add_destructor (new_task->task_pool,
+		(rspamd_mempool_destruct_t)reduce_tasks_count, ctx);
+	rspamd_worker_gc_update (ctx);
+
+	/* Set up async session */
+	new_task->s = new_async_session (new_task->task_pool, rspamd_task_fin,
+			rspamd_task_restore, rspamd_task_free_hard, new_task);
+
+	new_task->classify_executor = ctx->classify_executor;
+	new_task->scheduler = ctx->scheduler;
+
+	if (ctx->learn_queue_size > 0) {
+		new_task->flags |= RSPAMD_TASK_FLAG_LEARN_ASYNC;
+	}
+
+	return new_task;
+}
+
+/*
+ * Learn all queued tasks with a single batch per class and free them
+ */
+static void
+rspamd_worker_learn_flush (struct rspamd_worker_ctx *ctx)
+{
+	struct rspamd_stat_learn_batch *batches[2];
+	struct rspamd_task *task;
+	GError *err = NULL;
+	guint i, learned;
+	gboolean spam;
+
+	if (evtimer_pending (&ctx->learn_ev, NULL)) {
+		evtimer_del (&ctx->learn_ev);
+	}
+
+	if (ctx->learn_queue->len == 0) {
+		return;
+	}
+
+	batches[0] = rspamd_stat_learn_batch_new (FALSE);
+	batches[1] = rspamd_stat_learn_batch_new (TRUE);
+
+	for (i = 0; i < ctx->learn_queue->len; i ++) {
+		task = g_ptr_array_index (ctx->learn_queue, i);
+		spam = (task->flags & RSPAMD_TASK_FLAG_LEARN_SPAM) != 0;
+
+		/* Already learned messages are rejected by the learn cache */
+		if (rspamd_stat_learn_batch_add (batches[spam], task,
+				task->cfg->lua_state, &err) != RSPAMD_STAT_PROCESS_OK &&
+				err != NULL) {
+			msg_info ("cannot learn <%s> as %s: %s", task->message_id,
+					spam ? "spam" : "ham", err->message);
+			g_error_free (err);
+			err = NULL;
+		}
+	}
+
+	learned = rspamd_stat_learn_batch_commit (batches[0]);
+	learned += rspamd_stat_learn_batch_commit (batches[1]);
+	rspamd_stat_learn_batch_destroy (batches[0]);
+	rspamd_stat_learn_batch_destroy (batches[1]);
+
+	msg_debug ("learned %ud of %ud queued messages", learned,
+			ctx->learn_queue->len);
+
+	for (i = 0; i < ctx->learn_queue->len; i ++) {
+		task = g_ptr_array_index (ctx->learn_queue, i);
+		destroy_session (task->s);
+	}
+
+	g_ptr_array_set_size (ctx->learn_queue, 0);
+}
+
+static void
+rspamd_worker_learn_timer (gint fd, short what, void *arg)
+{
+	struct rspamd_worker_ctx *ctx = arg;
+
+	rspamd_worker_learn_flush (ctx);
+}
+
+/*
+ * Free task once its reply is written, tasks with learns are queued
+ */
+static void
+rspamd_worker_task_done (struct rspamd_task *task)
+{
+	struct rspamd_worker_ctx *ctx = task->worker->ctx;
+	struct timeval tv;
+
+	if (!(task->flags & (RSPAMD_TASK_FLAG_LEARN_SPAM|RSPAMD_TASK_FLAG_LEARN_HAM))) {
+		destroy_session (task->s);
+		return;
+	}
+
+	/* Client should not wait for learns to close connection */
+	if (task->http_conn != NULL) {
+		rspamd_http_connection_unref (task->http_conn);
+		task->http_conn = NULL;
+	}
+	if (task->sock != -1) {
+		close (task->sock);
+		task->sock = -1;
+	}
+
+	g_ptr_array_add (ctx->learn_queue, task);
+
+	if (ctx->learn_queue->len >= ctx->learn_queue_size) {
+		rspamd_worker_learn_flush (ctx);
+	}
+	else if (!evtimer_pending (&ctx->learn_ev, NULL)) {
+		double_to_tv (ctx->learn_queue_timeout, &tv);
+		evtimer_add (&ctx->learn_ev, &tv);
+	}
+}
+
+static void
+rspamd_worker_idle_task_dtor (gpointer ud)
+{
+	struct rspamd_worker_idle_task *it = ud;
+
+	g_hash_table_remove (it->ctx->idle_tasks, it->task);
+}
+
+/*
+ * Pass connection to a new task to read the next request
+ */
+static void
+rspamd_worker_keepalive (struct rspamd_task *task)
+{
+	struct rspamd_worker_ctx *ctx = task->worker->ctx;
+	struct rspamd_task *new_task;
+	struct rspamd_worker_idle_task *it;
+
+	new_task = rspamd_worker_task_new (task->worker, task->sock,
+			task->client_addr, task->http_conn);
+	new_task->conn_requests = task->conn_requests + 1;
+	/* Idle tasks do not delay switching to a new config */
+	it = rspamd_mempool_alloc (new_task->task_pool, sizeof (*it));
+	it->ctx = ctx;
+	it->task = new_task;
+	g_hash_table_insert (ctx->idle_tasks, new_task, new_task);
+	rspamd_mempool_add_destructor (new_task->task_pool,
+		rspamd_worker_idle_task_dtor, it);
+	rspamd_worker_gc_update (ctx);
+	task->sock = -1;
+	task->client_addr = NULL;
+	task->http_conn = NULL;
+	rspamd_worker_task_done (task);
+
+	msg_debug ("waiting for request %ud from: %s",
+		new_task->conn_requests + 1,
+		rspamd_inet_address_to_string (new_task->client_addr));
+	rspamd_http_connection_reset (new_task->http_conn);
+	rspamd_http_connection_read_message (new_task->http_conn,
+		new_task,
+		new_task->sock,
+		&ctx->keepalive_tv,
+		ctx->ev_base);
+}
+
 static gint
 rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
 {
 	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
 
+	if (msg->type == HTTP_REQUEST && (conn->opts & RSPAMD_HTTP_BODY_PARTIAL)) {
+		/* The whole request has been received in streaming mode */
+		rspamd_worker_process_request (task, msg, msg->body->str,
+				msg->body->len);
+	}
+
 	if (task->state == CLOSING_CONNECTION || task->state == WRITING_REPLY) {
+		if (msg->type == HTTP_RESPONSE) {
+			rspamd_task_stage_done (task, RSPAMD_TASK_STAGE_REPLY);
+		}
+
+		if (msg->type == HTTP_RESPONSE &&
+				(task->flags & RSPAMD_TASK_FLAG_KEEP_ALIVE)) {
+			/* Reply is written, wait for the next request */
+			rspamd_worker_keepalive (task);
+			return 0;
+		}
 		/* We are done here */
 		msg_debug ("normally closing connection from: %s",
 			rspamd_inet_address_to_string (task->client_addr));
-		destroy_session (task->s);
+		rspamd_worker_task_done (task);
 	}
 	else if (task->state == WRITE_REPLY) {
 		/*
@@ -196,6 +1034,7 @@ accept_socket (gint fd, short what, void *arg)
 	struct rspamd_worker *worker = (struct rspamd_worker *) arg;
 	struct rspamd_worker_ctx *ctx;
 	struct rspamd_task *new_task;
+	struct rspamd_http_connection *conn;
 	rspamd_inet_addr_t *addr;
 	gint nfd;
 
@@ -218,43 +1057,21 @@ accept_socket (gint fd, short what, void *arg)
 		return;
 	}
 
-	new_task = rspamd_task_new (worker);
-
 	msg_info ("accepted connection from %s port %d",
 		rspamd_inet_address_to_string (addr),
 		rspamd_inet_address_get_port (addr));
 
-	/* Copy some variables */
-	if (ctx->is_mime) {
-		new_task->flags |= RSPAMD_TASK_FLAG_MIME;
-	}
-	else {
-		new_task->flags &= ~RSPAMD_TASK_FLAG_MIME;
-	}
-
-	new_task->sock = nfd;
-	new_task->client_addr = addr;
-
 	worker->srv->stat->connections_count++;
-	new_task->resolver = ctx->resolver;
 
-	new_task->http_conn = rspamd_http_connection_new (
+	conn = rspamd_http_connection_new (
 		rspamd_worker_body_handler,
 		rspamd_worker_error_handler,
 		rspamd_worker_finish_handler,
-		0,
+		(ctx->keepalive_requests > 1 ? RSPAMD_HTTP_KEEP_ALIVE : 0) |
+		(ctx->streaming ? RSPAMD_HTTP_BODY_PARTIAL : 0),
 		RSPAMD_HTTP_SERVER,
 		ctx->keys_cache);
-	new_task->ev_base = ctx->ev_base;
-	ctx->tasks++;
-	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t)reduce_tasks_count, &ctx->tasks);
-
-	/* Set up async session */
-	new_task->s = new_async_session (new_task->task_pool, rspamd_task_fin,
-			rspamd_task_restore, rspamd_task_free_hard, new_task);
-
-	new_task->classify_pool = ctx->classify_pool;
+	new_task = rspamd_worker_task_new (worker, nfd, addr, conn);
 
 	if (ctx->key) {
 		rspamd_http_connection_set_key (new_task->http_conn, ctx->key);
@@ -280,6 +1097,17 @@ init_worker (struct rspamd_config *cfg)
 	ctx->is_mime = TRUE;
 	ctx->timeout = DEFAULT_WORKER_IO_TIMEOUT;
 	ctx->classify_threads = 1;
+	ctx->classify_queue = DEFAULT_CLASSIFY_QUEUE;
+	ctx->classify_batch = DEFAULT_CLASSIFY_BATCH;
+	ctx->scheduler_queue = DEFAULT_SCHEDULER_QUEUE;
+	ctx->admission_interval = DEFAULT_ADMISSION_INTERVAL / 1000.0;
+	ctx->batch_concurrency = DEFAULT_BATCH_CONCURRENCY;
+	ctx->keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+	ctx->keys_cache_size = DEFAULT_KEYS_CACHE_SIZE;
+	ctx->learn_queue_size = DEFAULT_LEARN_QUEUE_SIZE;
+	ctx->learn_queue_timeout = DEFAULT_LEARN_QUEUE_TIMEOUT;
+	ctx->lua_gc_step = DEFAULT_LUA_GC_STEP;
+	ctx->lua_gc_max_memory = DEFAULT_LUA_GC_MAX_MEMORY;
 
 	rspamd_rcl_register_worker_option (cfg, type, "mime",
 		rspamd_rcl_parse_struct_boolean, ctx,
@@ -293,6 +1121,10 @@ init_worker (struct rspamd_config *cfg)
 		rspamd_rcl_parse_struct_boolean, ctx,
 		G_STRUCT_OFFSET (struct rspamd_worker_ctx, is_json), 0);
 
+	rspamd_rcl_register_worker_option (cfg, type, "streaming",
+		rspamd_rcl_parse_struct_boolean, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx, streaming), 0);
+
 	rspamd_rcl_register_worker_option (cfg, type, "allow_learn",
 		rspamd_rcl_parse_struct_boolean, ctx,
 		G_STRUCT_OFFSET (struct rspamd_worker_ctx, allow_learn), 0);
@@ -312,6 +1144,80 @@ init_worker (struct rspamd_config *cfg)
 		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
 		classify_threads), RSPAMD_CL_FLAG_INT_32);
 
+	rspamd_rcl_register_worker_option (cfg, type, "classify_queue",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		classify_queue), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "classify_batch",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		classify_batch), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "scheduler_threads",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		scheduler_threads), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "scheduler_queue",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		scheduler_queue), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "admission_target",
+		rspamd_rcl_parse_struct_time, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		admission_target), RSPAMD_CL_FLAG_TIME_FLOAT);
+
+	rspamd_rcl_register_worker_option (cfg, type, "admission_interval",
+		rspamd_rcl_parse_struct_time, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		admission_interval), RSPAMD_CL_FLAG_TIME_FLOAT);
+
+	rspamd_rcl_register_worker_option (cfg, type, "admission_action",
+		rspamd_rcl_parse_struct_string, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		admission_action), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "batch_concurrency",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		batch_concurrency), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "keepalive_requests",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		keepalive_requests), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "keepalive_timeout",
+		rspamd_rcl_parse_struct_time, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		keepalive_timeout), RSPAMD_CL_FLAG_TIME_INTEGER);
+
+	rspamd_rcl_register_worker_option (cfg, type, "keys_cache_size",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		keys_cache_size), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "learn_queue_size",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		learn_queue_size), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "learn_queue_timeout",
+		rspamd_rcl_parse_struct_time, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		learn_queue_timeout), RSPAMD_CL_FLAG_TIME_FLOAT);
+
+	rspamd_rcl_register_worker_option (cfg, type, "lua_gc_step",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		lua_gc_step), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "lua_gc_max_memory",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		lua_gc_max_memory), RSPAMD_CL_FLAG_INT_SIZE);
 
 	rspamd_rcl_register_worker_option (cfg, type, "keypair",
 		rspamd_rcl_parse_struct_keypair, ctx,
@@ -321,6 +1227,112 @@ init_worker (struct rspamd_config *cfg)
 	return ctx;
 }
 
+static void
+rspamd_worker_init_classify (struct rspamd_worker *worker)
+{
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	GError *err = NULL;
+
+	/* Create classify threads */
+	ctx->classify_executor = NULL;
+	if (ctx->classify_threads > 1) {
+		ctx->classify_executor = rspamd_classify_executor_new (worker->srv->cfg,
+				ctx->ev_base,
+				ctx->classify_threads,
+				ctx->classify_queue,
+				ctx->classify_batch,
+				worker->srv->stat,
+				&err);
+		if (ctx->classify_executor == NULL) {
+			msg_err ("classify threads create failed: %e", err);
+			if (err != NULL) {
+				g_error_free (err);
+			}
+		}
+	}
+}
+
+/*
+ * Switch to the new config when only idle persistent connections are left
+ */
+static void
+rspamd_worker_reload_timer (gint fd, short what, void *arg)
+{
+	struct rspamd_worker *worker = arg;
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	struct rspamd_task *task;
+	GHashTableIter it;
+	GPtrArray *idle;
+	struct timeval tv;
+	gpointer k, v;
+	guint i;
+
+	/* Queued learns should not delay switching to a new config */
+	rspamd_worker_learn_flush (ctx);
+
+	if (ctx->tasks > g_hash_table_size (ctx->idle_tasks)) {
+		double_to_tv (RELOAD_CHECK_INTERVAL, &tv);
+		event_add (&ctx->reload_ev, &tv);
+		return;
+	}
+
+	/* Close idle connections just like on expiry of keep-alive timeout */
+	idle = g_ptr_array_sized_new (g_hash_table_size (ctx->idle_tasks));
+	g_hash_table_iter_init (&it, ctx->idle_tasks);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		g_ptr_array_add (idle, v);
+	}
+
+	for (i = 0; i < idle->len; i ++) {
+		task = g_ptr_array_index (idle, i);
+		destroy_session (task->s);
+	}
+
+	g_ptr_array_free (idle, TRUE);
+
+	/* Classify threads have own lua states built from the old config */
+	if (ctx->classify_executor) {
+		rspamd_classify_executor_destroy (ctx->classify_executor);
+		ctx->classify_executor = NULL;
+	}
+
+	rspamd_worker_switch_config (worker, ctx->reload_cfg, ctx->ev_base);
+	ctx->reload_cfg = NULL;
+	rspamd_worker_init_classify (worker);
+	rspamd_worker_pause_accept (worker, FALSE);
+}
+
+static void
+rspamd_worker_reload (void *ud)
+{
+	struct rspamd_worker *worker = ud;
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+
+	if (ctx->reload_cfg != NULL) {
+		msg_info ("config reload is already in progress");
+		return;
+	}
+
+	ctx->reload_cfg = rspamd_worker_read_config (worker);
+
+	if (ctx->reload_cfg == NULL) {
+		msg_err ("cannot read new config, continue with the old one");
+		return;
+	}
+
+	/*
+	 * Modules are reconfigured globally, so the tasks of the old config must
+	 * be finished first, new connections wait in the listen queue meanwhile
+	 */
+	msg_info ("waiting for %ud tasks to finish before switching config",
+			ctx->tasks - g_hash_table_size (ctx->idle_tasks));
+	rspamd_worker_pause_accept (worker, TRUE);
+	evtimer_set (&ctx->reload_ev, rspamd_worker_reload_timer, worker);
+	event_base_set (ctx->ev_base, &ctx->reload_ev);
+	rspamd_worker_reload_timer (-1, EV_TIMEOUT, worker);
+}
+
 /*
  * Start worker process
  */
@@ -329,41 +1341,95 @@ start_worker (struct rspamd_worker *worker)
 {
 	struct rspamd_worker_ctx *ctx = worker->ctx;
 	GError *err = NULL;
-	struct lua_locked_state *nL;
 
 	ctx->ev_base = rspamd_prepare_worker (worker, "normal", accept_socket);
+	rspamd_worker_set_reload_handler (worker, rspamd_worker_reload, worker);
+	ctx->idle_tasks = g_hash_table_new (g_direct_hash, g_direct_equal);
+	ctx->learn_queue = g_ptr_array_sized_new (MAX (ctx->learn_queue_size, 1));
 	msec_to_tv (ctx->timeout, &ctx->io_tv);
+	msec_to_tv (ctx->keepalive_timeout, &ctx->keepalive_tv);
 
-	rspamd_map_watch (worker->srv->cfg, ctx->ev_base);
+	if (ctx->admission_action != NULL) {
+		if (g_ascii_strcasecmp (ctx->admission_action, "soft reject") == 0 ||
+				g_ascii_strcasecmp (ctx->admission_action, "soft_reject") == 0) {
+			ctx->admission.reject = TRUE;
+		}
+		else if (g_ascii_strcasecmp (ctx->admission_action, "skip") != 0) {
+			msg_warn ("unknown admission action %s, skip expensive checks",
+					ctx->admission_action);
+		}
+	}
 
+	if (ctx->streaming && ctx->key) {
+		/* Encrypted requests can be decrypted only when they are received */
+		msg_warn ("streaming mode is not supported for encrypted connections");
+		ctx->streaming = FALSE;
+	}
+
+	rspamd_map_watch (worker->srv->cfg, ctx->ev_base);
+	evtimer_set (&ctx->learn_ev, rspamd_worker_learn_timer, ctx);
+	event_base_set (ctx->ev_base, &ctx->learn_ev);
 
 	ctx->resolver = dns_resolver_init (worker->srv->logger,
 			ctx->ev_base,
 			worker->srv->cfg);
+	rspamd_dns_resolver_set_counters (ctx->resolver,
+			&worker->srv->stat->dns_cache_hits,
+			&worker->srv->stat->dns_cache_misses);
+
+	if (ctx->streaming && ctx->resolver->cache == NULL) {
+		msg_info ("DNS cache is disabled, streaming mode does not prefetch "
+				"DNS records");
+	}
 
 	rspamd_upstreams_library_init (ctx->resolver->r, ctx->ev_base);
 	rspamd_upstreams_library_config (worker->srv->cfg);
 
-	/* Create classify pool */
-	ctx->classify_pool = NULL;
-	if (ctx->classify_threads > 1) {
-		nL = rspamd_init_lua_locked (worker->srv->cfg);
-		ctx->classify_pool = g_thread_pool_new (rspamd_process_statistic_threaded,
-				nL,
-				ctx->classify_threads,
-				TRUE,
-				&err);
-		if (err != NULL) {
-			msg_err ("pool create failed: %e", err);
-			g_error_free (err);
-			ctx->classify_pool = NULL;
+	rspamd_worker_init_classify (worker);
+
+	if (ctx->scheduler_threads > 0) {
+		ctx->scheduler = rspamd_task_scheduler_new (ctx->ev_base,
+				ctx->scheduler_threads, ctx->scheduler_queue, &err);
+
+		if (ctx->scheduler == NULL) {
+			msg_err ("scheduler threads create failed: %e", err);
+			if (err != NULL) {
+				g_error_free (err);
+			}
 		}
 	}
 
-	/* XXX: stupid default */
-	ctx->keys_cache = rspamd_keypair_cache_new (256);
+	ctx->keys_cache = rspamd_keypair_cache_new (MAX (ctx->keys_cache_size, 1));
+	rspamd_keypair_cache_set_counters (ctx->keys_cache,
+			&worker->srv->stat->keys_cache_hits,
+			&worker->srv->stat->keys_cache_misses);
+	rspamd_mime_stem_cache_set_counters (&worker->srv->stat->stem_cache_hits,
+			&worker->srv->stat->stem_cache_misses);
+
+	if (worker->srv->lua_profile != NULL) {
+		rspamd_lua_profile_start (worker->srv->cfg->lua_state,
+				worker->srv->lua_profile, worker->srv->stat,
+				worker->srv->cfg->lua_profiler_count);
+	}
+
+	if (ctx->lua_gc_step > 0) {
+		ctx->lua_gc = rspamd_lua_gc_new (worker->srv->cfg->lua_state,
+				ctx->ev_base, ctx->lua_gc_step, ctx->lua_gc_max_memory,
+				worker->srv->stat);
+	}
 
 	event_base_loop (ctx->ev_base, 0);
+	rspamd_lua_gc_destroy (ctx->lua_gc);
+	/* Do not lose learns queued before termination */
+	rspamd_worker_learn_flush (ctx);
+
+	if (ctx->classify_executor) {
+		rspamd_classify_executor_destroy (ctx->classify_executor);
+	}
+
+	if (ctx->scheduler) {
+		rspamd_task_scheduler_destroy (ctx->scheduler);
+	}
 
 	g_mime_shutdown ();
 	rspamd_log_close (rspamd_main->logger);
@@ -54,4 +54,42 @@ context("Trie search functions", function()
     end
     
   end)
+
+  test("Trie collect matches", function()
+    local patterns = {
+      'test',
+      'est',
+      'he',
+      'she',
+      'str\0ing'
+    }
+
+    local trie = t.create(patterns)
+    assert_not_nil(trie, "cannot create trie")
+
+    local cases = {
+      {'test', {[1] = {4}, [2] = {4}}},
+      {'she test TEST', {[1] = {8}, [2] = {8}, [3] = {3}, [4] = {3}}},
+      {'she test TEST', {[1] = {8, 13}, [2] = {8, 13}, [3] = {3}, [4] = {3}}, true},
+      {'str\0ing test', {[1] = {12}, [2] = {12}, [5] = {7}}},
+    }
+
+    for _,c in ipairs(cases) do
+      local ret = trie:match(c[1], c[3])
+
+      assert_not_equal(false, ret, 'matches expected for case: ' .. c[1])
+      for idx, positions in pairs(c[2]) do
+        assert_not_nil(ret[idx], 'pattern ' .. idx .. ' must match in: ' .. c[1])
+        assert_equal(#positions, #ret[idx], 'number of matches in: ' .. c[1])
+        for i, pos in ipairs(positions) do
+          assert_equal(pos, ret[idx][i], 'position of match in: ' .. c[1])
+        end
+      end
+      for idx, _ in pairs(ret) do
+        assert_not_nil(c[2][idx], 'unexpected match of ' .. idx .. ' in: ' .. c[1])
+      end
+    end
+
+    assert_equal(false, trie:match('non-existent'))
+  end)
 end)
\ No newline at end of file
@@ -0,0 +1,525 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * End-to-end benchmark: replays a corpus of messages through the whole task
+ * pipeline (message parsing, pre-filters, filters, statistics, post-filters
+ * and reply) in process and reports throughput, allocations, latency of
+ * stages and time spent by each symbol.
+ *
+ * DNS requests fail immediately unless --real-dns is specified, so results
+ * do not depend on network and can be compared between builds. Replies
+ * recorded by `dns { record = "file"; }` can be served with their latency by
+ * --dns-replay file. Other network checks, e.g. fuzzy storage, should be
+ * disabled in the configuration.
+ *
+ * Usage: rspamd-bench -c rspamd.conf [-n iterations] [-t top] [-j]
+ *        [--dns-replay file] files...
+ */
+
+#include "config.h"
+#include "main.h"
+#include "cfg_file.h"
+#include "message.h"
+#include "task.h"
+#include "dns.h"
+#include "events.h"
+#include "protocol.h"
+#include "regexp.h"
+#include "symbols_cache.h"
+#include "histogram.h"
+
+struct rspamd_main             *rspamd_main = NULL;
+worker_t *workers[] = { NULL };
+
+static gchar *cfg_name = NULL;
+static gint iterations = 1;
+static gint top_symbols = 20;
+static gboolean real_dns = FALSE;
+static gchar *dns_replay = NULL;
+static gboolean json = FALSE;
+
+static GOptionEntry entries[] =
+{
+	{ "config", 'c', 0, G_OPTION_ARG_STRING, &cfg_name,
+	  "Specify config file", NULL },
+	{ "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+	  "Number of passes over the corpus", NULL },
+	{ "top", 't', 0, G_OPTION_ARG_INT, &top_symbols,
+	  "Number of symbols with the largest time to show", NULL },
+	{ "real-dns", 0, 0, G_OPTION_ARG_NONE, &real_dns,
+	  "Send DNS requests to nameservers of the configuration", NULL },
+	{ "dns-replay", 0, 0, G_OPTION_ARG_STRING, &dns_replay,
+	  "Serve DNS replies recorded in the specified file", NULL },
+	{ "json", 'j', 0, G_OPTION_ARG_NONE, &json,
+	  "Output results in JSON", NULL },
+	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
+};
+
+struct bench_result {
+	guint64 messages;
+	guint64 failed;
+	guint64 chunks;
+	guint64 bytes;
+	gdouble elapsed;
+	gdouble cpu;
+	gdouble score;
+	guint64 actions[METRIC_ACTION_MAX];
+};
+
+struct bench_task_cbdata {
+	struct bench_result *res;
+	gboolean done;
+};
+
+static gboolean
+rspamd_bench_task_fin (struct rspamd_task *task, void *ud)
+{
+	struct bench_task_cbdata *cbd = ud;
+	ucl_object_t *reply;
+	const ucl_object_t *metric, *elt;
+	gint action;
+
+	reply = rspamd_protocol_write_ucl (task, NULL);
+	rspamd_task_stage_done (task, RSPAMD_TASK_STAGE_REPLY);
+	metric = ucl_object_find_key (reply, DEFAULT_METRIC);
+
+	if (metric != NULL) {
+		elt = ucl_object_find_key (metric, "score");
+
+		if (elt != NULL) {
+			cbd->res->score += ucl_object_todouble (elt);
+		}
+
+		elt = ucl_object_find_key (metric, "action");
+
+		if (elt != NULL && rspamd_action_from_str (ucl_object_tostring (elt),
+				&action)) {
+			cbd->res->actions[action] ++;
+		}
+	}
+	else {
+		cbd->res->failed ++;
+	}
+
+	ucl_object_unref (reply);
+	cbd->done = TRUE;
+
+	return TRUE;
+}
+
+static void
+rspamd_bench_message (struct rspamd_config *cfg, struct event_base *ev_base,
+		struct rspamd_dns_resolver *resolver, const gchar *data, gsize len,
+		struct bench_result *res)
+{
+	struct rspamd_task *task;
+	struct bench_task_cbdata cbd;
+	rspamd_mempool_stat_t st_start, st_end;
+	gdouble t1, t2, v1, v2;
+
+	rspamd_mempool_stat (&st_start);
+	t1 = rspamd_get_ticks ();
+	v1 = rspamd_get_virtual_ticks ();
+
+	cbd.res = res;
+	cbd.done = FALSE;
+
+	task = rspamd_task_new (NULL);
+	task->cfg = cfg;
+	task->ev_base = ev_base;
+	task->resolver = resolver;
+	task->fin_callback = rspamd_bench_task_fin;
+	task->fin_arg = &cbd;
+	task->s = new_async_session (task->task_pool, rspamd_task_fin,
+			rspamd_task_restore, rspamd_task_free_hard, task);
+
+	if (cfg->check_all_filters) {
+		task->flags |= RSPAMD_TASK_FLAG_PASS_ALL;
+	}
+
+	if (rspamd_task_process (task, NULL, data, len, NULL, TRUE)) {
+		event_base_loop (ev_base, 0);
+	}
+
+	if (!cbd.done) {
+		/* Task has not been finished by the session */
+		res->failed ++;
+		rspamd_task_free_hard (task);
+	}
+
+	t2 = rspamd_get_ticks ();
+	v2 = rspamd_get_virtual_ticks ();
+	rspamd_mempool_stat (&st_end);
+
+	res->messages ++;
+	res->elapsed += t2 - t1;
+	res->cpu += v2 - v1;
+	res->chunks += st_end.chunks_allocated - st_start.chunks_allocated;
+	res->bytes += st_end.bytes_allocated - st_start.bytes_allocated;
+}
+
+static gint
+rspamd_bench_item_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct cache_item *i1 = *(const struct cache_item **)a,
+			*i2 = *(const struct cache_item **)b;
+	gdouble t1, t2;
+
+	t1 = i1->s->avg_time * i1->cd->number;
+	t2 = i2->s->avg_time * i2->cd->number;
+
+	if (t1 != t2) {
+		return t1 > t2 ? -1 : 1;
+	}
+
+	return strcmp (i1->s->symbol, i2->s->symbol);
+}
+
+static GPtrArray *
+rspamd_bench_symbols (struct rspamd_config *cfg)
+{
+	GPtrArray *items;
+	struct cache_item *item;
+	guint i;
+
+	items = g_ptr_array_new ();
+	rspamd_symbols_cache_merge_counters (cfg->cache);
+
+	for (i = 0; i < cfg->cache->items_by_order->len; i ++) {
+		item = g_ptr_array_index (cfg->cache->items_by_order, i);
+
+		if (item->cd->number > 0) {
+			g_ptr_array_add (items, item);
+		}
+	}
+
+	g_ptr_array_sort (items, rspamd_bench_item_cmp);
+
+	if (top_symbols >= 0 && items->len > (guint)top_symbols) {
+		g_ptr_array_set_size (items, top_symbols);
+	}
+
+	return items;
+}
+
+static void
+rspamd_bench_output_text (struct bench_result *res, GPtrArray *items)
+{
+	struct rspamd_histogram *stages, *h;
+	struct cache_item *item;
+	guint i;
+
+	rspamd_printf ("messages: %uL (%uL failed) in %.3f seconds, "
+			"cpu %.3f seconds\n",
+			res->messages, res->failed, res->elapsed, res->cpu);
+	rspamd_printf ("messages/s: %.2f\n", res->messages / res->elapsed);
+
+	if (res->messages > 0) {
+		rspamd_printf ("allocations per message: %.2f chunks, %.2f bytes\n",
+				(gdouble)res->chunks / res->messages,
+				(gdouble)res->bytes / res->messages);
+	}
+
+	rspamd_printf ("sum of scores: %.3f\n", res->score);
+
+	for (i = 0; i < METRIC_ACTION_MAX; i ++) {
+		if (res->actions[i] > 0) {
+			rspamd_printf ("action %s: %uL\n", rspamd_action_to_str (i),
+					res->actions[i]);
+		}
+	}
+
+	rspamd_printf ("\n%-16s %10s %12s %12s %12s\n", "stage", "count",
+			"avg (ms)", "p50 (ms)", "p99 (ms)");
+	stages = rspamd_task_local_stages ();
+
+	for (i = 0; i < RSPAMD_TASK_STAGE_MAX; i ++) {
+		h = &stages[i];
+
+		if (h->count == 0) {
+			continue;
+		}
+
+		rspamd_printf ("%-16s %10uL %12.3f %12.3f %12.3f\n",
+				rspamd_task_stage_name (i), h->count,
+				h->sum / (gdouble)h->count / 1000.0,
+				rspamd_histogram_percentile (h, 50) / 1000.0,
+				rspamd_histogram_percentile (h, 99) / 1000.0);
+	}
+
+	rspamd_printf ("\n%-32s %10s %12s %12s %12s\n", "symbol", "checks",
+			"total (ms)", "avg (us)", "p99 (us)");
+
+	for (i = 0; i < items->len; i ++) {
+		item = g_ptr_array_index (items, i);
+		rspamd_printf ("%-32s %10d %12.3f %12.3f %12uL\n",
+				item->s->symbol, item->cd->number,
+				item->s->avg_time * item->cd->number / 1000.0,
+				item->s->avg_time,
+				item->hist ? rspamd_histogram_percentile (item->hist, 99) : 0);
+	}
+}
+
+static void
+rspamd_bench_output_json (struct bench_result *res, GPtrArray *items)
+{
+	ucl_object_t *top, *obj, *elt;
+	struct rspamd_histogram *stages, *h;
+	struct cache_item *item;
+	gchar *out;
+	guint i;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top, ucl_object_fromint (res->messages),
+			"messages", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (res->failed),
+			"failed", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromdouble (res->elapsed),
+			"elapsed", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromdouble (res->cpu),
+			"cpu", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromdouble (res->messages / res->elapsed),
+			"messages_per_second", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (res->chunks),
+			"chunks_allocated", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (res->bytes),
+			"bytes_allocated", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromdouble (res->score),
+			"score", 0, false);
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = 0; i < METRIC_ACTION_MAX; i ++) {
+		if (res->actions[i] > 0) {
+			ucl_object_insert_key (obj, ucl_object_fromint (res->actions[i]),
+					rspamd_action_to_str (i), 0, false);
+		}
+	}
+
+	ucl_object_insert_key (top, obj, "actions", 0, false);
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	stages = rspamd_task_local_stages ();
+
+	for (i = 0; i < RSPAMD_TASK_STAGE_MAX; i ++) {
+		h = &stages[i];
+
+		if (h->count == 0) {
+			continue;
+		}
+
+		elt = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (elt, ucl_object_fromint (h->count),
+				"count", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (h->sum),
+				"sum_us", 0, false);
+		ucl_object_insert_key (elt,
+				ucl_object_fromint (rspamd_histogram_percentile (h, 50)),
+				"p50_us", 0, false);
+		ucl_object_insert_key (elt,
+				ucl_object_fromint (rspamd_histogram_percentile (h, 99)),
+				"p99_us", 0, false);
+		ucl_object_insert_key (obj, elt, rspamd_task_stage_name (i), 0, false);
+	}
+
+	ucl_object_insert_key (top, obj, "stages", 0, false);
+
+	obj = ucl_object_typed_new (UCL_ARRAY);
+
+	for (i = 0; i < items->len; i ++) {
+		item = g_ptr_array_index (items, i);
+		elt = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (elt, ucl_object_fromstring (item->s->symbol),
+				"symbol", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (item->cd->number),
+				"checks", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromdouble (item->s->avg_time),
+				"avg_us", 0, false);
+		ucl_object_array_push (obj, elt);
+	}
+
+	ucl_object_insert_key (top, obj, "symbols", 0, false);
+
+	out = ucl_object_emit (top, UCL_EMIT_JSON);
+	rspamd_printf ("%s\n", out);
+	free (out);
+	ucl_object_unref (top);
+}
+
+int
+main (int argc, char **argv)
+{
+	struct rspamd_config *cfg;
+	struct rspamd_dns_resolver *resolver;
+	struct event_base *ev_base;
+	struct bench_result res;
+	GOptionContext *context;
+	GError *err = NULL;
+	GPtrArray *corpus, *items;
+	GString *msg;
+	gchar *data;
+	gsize len;
+	gint i, j;
+
+	context = g_option_context_new ("- benchmark messages processing");
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &err)) {
+		fprintf (stderr, "option parsing failed: %s\n", err->message);
+		exit (EXIT_FAILURE);
+	}
+
+	if (cfg_name == NULL || argc < 2) {
+		fprintf (stderr, "usage: rspamd-bench -c config [-n iterations] "
+				"[-t top] [-j] files...\n");
+		exit (EXIT_FAILURE);
+	}
+
+	rspamd_main = (struct rspamd_main *)g_malloc0 (sizeof (struct rspamd_main));
+	rspamd_main->server_pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+	rspamd_main->cfg = (struct rspamd_config *)g_malloc0 (sizeof (struct rspamd_config));
+	cfg = rspamd_main->cfg;
+
+	rspamd_init_libs ();
+	rspamd_init_cfg (cfg, TRUE);
+	cfg->log_type = RSPAMD_LOG_CONSOLE;
+	cfg->log_level = G_LOG_LEVEL_WARNING;
+	cfg->cfg_name = cfg_name;
+
+	rspamd_set_logger (cfg, g_quark_from_static_string ("bench"), rspamd_main);
+	(void)rspamd_log_open (rspamd_main->logger);
+	g_log_set_default_handler (rspamd_glib_log_function, rspamd_main->logger);
+
+	if (!rspamd_config_read (cfg, cfg_name, NULL, NULL, NULL)) {
+		fprintf (stderr, "cannot load config %s\n", cfg_name);
+		exit (EXIT_FAILURE);
+	}
+
+	rspamd_config_post_load (cfg);
+
+	if (!rspamd_init_filters (cfg, FALSE)) {
+		fprintf (stderr, "cannot init filters of config %s\n", cfg_name);
+		exit (EXIT_FAILURE);
+	}
+
+	rspamd_config_insert_classify_symbols (cfg);
+
+	if (!init_symbols_cache (cfg->cfg_pool, cfg->cache, cfg, NULL, TRUE)) {
+		fprintf (stderr, "cannot init symbols cache\n");
+		exit (EXIT_FAILURE);
+	}
+
+	ev_base = event_init ();
+
+	if (real_dns) {
+		resolver = dns_resolver_init (rspamd_main->logger, ev_base, cfg);
+
+		if (resolver == NULL) {
+			fprintf (stderr, "cannot init DNS resolver\n");
+			exit (EXIT_FAILURE);
+		}
+	}
+	else {
+		resolver = g_slice_alloc0 (sizeof (struct rspamd_dns_resolver));
+		resolver->ev_base = ev_base;
+		resolver->record_fd = -1;
+
+		if (dns_replay != NULL) {
+			if (!rspamd_dns_resolver_replay (resolver, dns_replay)) {
+				exit (EXIT_FAILURE);
+			}
+		}
+		else {
+			resolver->offline = TRUE;
+		}
+	}
+
+	corpus = g_ptr_array_new ();
+
+	for (i = 1; i < argc; i ++) {
+		if (!g_file_get_contents (argv[i], &data, &len, &err)) {
+			fprintf (stderr, "cannot read %s: %s\n", argv[i], err->message);
+			g_error_free (err);
+			err = NULL;
+			continue;
+		}
+
+		msg = g_string_new_len (data, len);
+		g_free (data);
+		g_ptr_array_add (corpus, msg);
+	}
+
+	if (corpus->len == 0) {
+		fprintf (stderr, "no messages to process\n");
+		exit (EXIT_FAILURE);
+	}
+
+	memset (&res, 0, sizeof (res));
+
+	for (j = 0; j < iterations; j ++) {
+		for (i = 0; i < (gint)corpus->len; i ++) {
+			msg = g_ptr_array_index (corpus, i);
+			rspamd_bench_message (cfg, ev_base, resolver, msg->str, msg->len,
+					&res);
+		}
+	}
+
+	if (res.elapsed <= 0) {
+		res.elapsed = 1e-9;
+	}
+
+	items = rspamd_bench_symbols (cfg);
+
+	if (json) {
+		rspamd_bench_output_json (&res, items);
+	}
+	else {
+		rspamd_bench_output_text (&res, items);
+	}
+
+	g_ptr_array_free (items, TRUE);
+
+	for (i = 0; i < (gint)corpus->len; i ++) {
+		g_string_free (g_ptr_array_index (corpus, i), TRUE);
+	}
+
+	g_ptr_array_free (corpus, TRUE);
+
+	if (real_dns) {
+		rdns_resolver_release (resolver->r);
+	}
+
+	if (resolver->replay != NULL) {
+		g_hash_table_unref (resolver->replay);
+	}
+
+	g_slice_free1 (sizeof (struct rspamd_dns_resolver), resolver);
+	event_base_free (ev_base);
+	rspamd_config_free (cfg);
+	g_mime_shutdown ();
+	rspamd_regexp_library_finalize ();
+
+	return 0;
+}
@@ -33,6 +33,8 @@
 static const int mapping_size = 64 * 8192 + 1;
 static const int max_seg = 32;
 static const int random_fuzz_cnt = 10000;
+static const int multi_messages_cnt = 37;
+static const int sha_data_size = 70000;
 
 static void *
 create_mapping (int mapping_len, guchar **beg, guchar **end)
@@ -160,6 +162,120 @@ create_constrainted_split (struct rspamd_cryptobox_segment *seg, int mseg,
 	return used;
 }
 
+static void
+check_multi (guchar *begin, guchar *end)
+{
+	struct rspamd_cryptobox_message *msgs;
+	rspamd_nm_t *keys;
+	rspamd_nonce_t *nonces;
+	rspamd_sig_t *macs;
+	gsize remain = end - begin, len;
+	double t1, t2;
+	gint i;
+
+	msgs = g_new0 (struct rspamd_cryptobox_message, multi_messages_cnt);
+	keys = g_new (rspamd_nm_t, multi_messages_cnt);
+	nonces = g_new (rspamd_nonce_t, multi_messages_cnt);
+	macs = g_new (rspamd_sig_t, multi_messages_cnt);
+
+	/* Short messages of random length including empty ones */
+	for (i = 0; i < multi_messages_cnt; i ++) {
+		len = MIN (ottery_rand_range (1024), remain);
+		ottery_rand_bytes (keys[i], sizeof (keys[i]));
+		ottery_rand_bytes (nonces[i], sizeof (nonces[i]));
+		msgs[i].data = begin;
+		msgs[i].len = len;
+		msgs[i].nonce = nonces[i];
+		msgs[i].nm = keys[i];
+		msgs[i].sig = macs[i];
+		begin += len;
+		remain -= len;
+	}
+
+	t1 = rspamd_get_ticks ();
+	rspamd_cryptobox_encrypt_nm_inplace_multi (msgs, multi_messages_cnt);
+	t2 = rspamd_get_ticks ();
+
+	msg_info ("multi-buffer encryption of %d messages: %.6f",
+			multi_messages_cnt, t2 - t1);
+
+	/* Each message must be readable by the single message function */
+	for (i = 0; i < multi_messages_cnt; i ++) {
+		check_result (keys[i], nonces[i], macs[i], msgs[i].data,
+				msgs[i].data + msgs[i].len);
+	}
+
+	rspamd_cryptobox_encrypt_nm_inplace_multi (msgs, multi_messages_cnt);
+	macs[1][0] ^= 0xff;
+	g_assert (!rspamd_cryptobox_decrypt_nm_inplace_multi (msgs,
+			multi_messages_cnt));
+
+	for (i = 0; i < multi_messages_cnt; i ++) {
+		if (i == 1) {
+			g_assert (!msgs[i].verified);
+			continue;
+		}
+
+		g_assert (msgs[i].verified);
+
+		for (len = 0; len < msgs[i].len; len ++) {
+			g_assert (msgs[i].data[len] == 0);
+		}
+	}
+
+	/* Cleanup the broken message */
+	memset (msgs[1].data, 0, msgs[1].len);
+
+	g_free (msgs);
+	g_free (keys);
+	g_free (nonces);
+	g_free (macs);
+}
+
+static void
+check_sha (void)
+{
+	static const GChecksumType gtypes[] = {G_CHECKSUM_SHA1, G_CHECKSUM_SHA256};
+	static const enum rspamd_cryptobox_sha_type types[] = {
+		RSPAMD_CRYPTOBOX_SHA1, RSPAMD_CRYPTOBOX_SHA256
+	};
+	rspamd_cryptobox_sha_state_t st;
+	GChecksum *ck;
+	guchar out[rspamd_cryptobox_SHA256BYTES];
+	guchar expected[rspamd_cryptobox_SHA256BYTES];
+	guchar *begin;
+	gsize len, cur, chunk, dlen, explen;
+	guint i, j;
+
+	begin = g_malloc (sha_data_size);
+	ottery_rand_bytes (begin, sha_data_size);
+
+	for (i = 0; i < G_N_ELEMENTS (types); i ++) {
+		for (j = 0; j < 1000; j ++) {
+			len = ottery_rand_range (sha_data_size);
+			ck = g_checksum_new (gtypes[i]);
+			g_checksum_update (ck, begin, len);
+			explen = sizeof (expected);
+			g_checksum_get_digest (ck, expected, &explen);
+			g_checksum_free (ck);
+
+			/* Feed data by random chunks to check buffering */
+			rspamd_cryptobox_sha_init (&st, types[i]);
+
+			for (cur = 0; cur < len; cur += chunk) {
+				chunk = MIN (ottery_rand_range (200) + 1, len - cur);
+				rspamd_cryptobox_sha_update (&st, begin + cur, chunk);
+			}
+
+			dlen = rspamd_cryptobox_sha_final (&st, out);
+			g_assert (dlen == explen);
+			g_assert (memcmp (out, expected, dlen) == 0);
+		}
+	}
+
+	g_free (begin);
+}
+
 void
 rspamd_cryptobox_test_func (void)
 {
@@ -290,6 +406,9 @@ rspamd_cryptobox_test_func (void)
 
 	msg_info ("constrainted split of %d chunks encryption: %.6f", cnt, t2 - t1);
 
+	check_multi (begin, end);
+	check_sha ();
+
 	for (i = 0; i < random_fuzz_cnt; i ++) {
 		ms = ottery_rand_range (i % max_seg * 2) + 1;
 		cnt = create_random_split (seg, ms, begin, end);
@@ -0,0 +1,80 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "cuckoo.h"
+#include "tests.h"
+
+const gsize cuckoo_elts = 100 * 1024;
+
+void
+rspamd_cuckoo_test_func (void)
+{
+	rspamd_cuckoo_filter_t *f, *loaded;
+	gchar path[PATH_MAX];
+	guint64 i, false_positives = 0;
+
+	f = rspamd_cuckoo_create (cuckoo_elts);
+
+	for (i = 0; i < cuckoo_elts; i ++) {
+		g_assert (rspamd_cuckoo_add (f, &i, sizeof (i)));
+	}
+
+	for (i = 0; i < cuckoo_elts; i ++) {
+		g_assert (rspamd_cuckoo_check (f, &i, sizeof (i)));
+	}
+
+	for (i = cuckoo_elts; i < cuckoo_elts * 2; i ++) {
+		if (rspamd_cuckoo_check (f, &i, sizeof (i))) {
+			false_positives ++;
+		}
+	}
+
+	msg_info ("cuckoo filter: %uL false positives of %z checks",
+			false_positives, cuckoo_elts);
+	g_assert (false_positives < cuckoo_elts / 100);
+
+	/* Save and load filter */
+	rspamd_snprintf (path, sizeof (path), "/tmp/rspamd_cuckoo_test.%d",
+			(gint)getpid ());
+	g_assert (rspamd_cuckoo_save (f, path));
+	loaded = rspamd_cuckoo_load (path);
+	unlink (path);
+	g_assert (loaded != NULL);
+	g_assert (loaded->count == f->count);
+
+	/* Delete half of elements */
+	for (i = 0; i < cuckoo_elts / 2; i ++) {
+		g_assert (rspamd_cuckoo_del (loaded, &i, sizeof (i)));
+	}
+
+	for (i = cuckoo_elts / 2; i < cuckoo_elts; i ++) {
+		g_assert (rspamd_cuckoo_check (loaded, &i, sizeof (i)));
+	}
+
+	g_assert (loaded->count == cuckoo_elts - cuckoo_elts / 2);
+
+	rspamd_cuckoo_destroy (loaded);
+	rspamd_cuckoo_destroy (f);
+}
@@ -0,0 +1,75 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "histogram.h"
+#include "tests.h"
+
+void
+rspamd_histogram_test_func (void)
+{
+	struct rspamd_histogram *h, *merged;
+	guint64 i, p;
+	guint idx;
+
+	h = g_malloc0 (sizeof (*h));
+	merged = g_malloc0 (sizeof (*merged));
+
+	/* Buckets low bounds must grow monotonically */
+	for (idx = 1; idx < RSPAMD_HISTOGRAM_BUCKETS; idx ++) {
+		g_assert (rspamd_histogram_bucket_low (idx) >
+				rspamd_histogram_bucket_low (idx - 1));
+	}
+
+	for (i = 1; i <= 100000; i ++) {
+		rspamd_histogram_add (h, i);
+	}
+
+	g_assert (h->count == 100000);
+	g_assert (h->max == 100000);
+	g_assert (h->sum == 100000ULL * 100001ULL / 2);
+
+	/* Relative error of percentiles must be below the size of a bucket */
+	p = rspamd_histogram_percentile (h, 50);
+	g_assert (p >= 50000 && p <= 50000 * 1.125);
+	p = rspamd_histogram_percentile (h, 99);
+	g_assert (p >= 99000 && p <= 100000);
+	g_assert (rspamd_histogram_percentile (h, 100) == 100000);
+
+	/* Huge values are counted in the last bucket */
+	rspamd_histogram_add (h, G_MAXUINT64);
+	g_assert (h->buckets[RSPAMD_HISTOGRAM_BUCKETS - 1] == 1);
+
+	rspamd_histogram_merge (merged, h);
+	rspamd_histogram_merge (merged, h);
+	g_assert (merged->count == h->count * 2);
+	g_assert (merged->max == G_MAXUINT64);
+
+	rspamd_histogram_reset (h);
+	g_assert (h->count == 0);
+	g_assert (rspamd_histogram_percentile (h, 50) == 0);
+
+	g_free (h);
+	g_free (merged);
+}
@@ -83,7 +83,7 @@ rspamd_http_server_func (const gchar *path, rspamd_inet_addr_t *addr,
 
 	rspamd_http_router_set_key (rt, kp);
 
-	g_assert ((fd = rspamd_inet_address_listen (addr, SOCK_STREAM, TRUE)) != -1);
+	g_assert ((fd = rspamd_inet_address_listen (addr, SOCK_STREAM, TRUE, FALSE)) != -1);
 	event_set (&accept_ev, fd, EV_READ | EV_PERSIST, rspamd_server_accept, rt);
 	event_base_set (ev_base, &accept_ev);
 	event_add (&accept_ev, NULL);
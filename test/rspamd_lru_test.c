@@ -0,0 +1,166 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "hash.h"
+#include "tests.h"
+
+static gint values_alive = 0;
+
+static void
+rspamd_lru_test_value_free (gpointer p)
+{
+	g_atomic_int_add (&values_alive, -1);
+	g_free (p);
+}
+
+static gpointer
+rspamd_lru_test_value_ref (gpointer p)
+{
+	/* Values are strings, so a reference is a copy */
+	g_atomic_int_inc (&values_alive);
+
+	return g_strdup (p);
+}
+
+static gchar *
+rspamd_lru_test_value (const gchar *s)
+{
+	g_atomic_int_inc (&values_alive);
+
+	return g_strdup (s);
+}
+
+static gpointer
+rspamd_lru_test_thread (gpointer h)
+{
+	rspamd_lru_hash_t *hash = h;
+	gchar key[32], *val;
+	guint i;
+
+	for (i = 0; i < 10000; i ++) {
+		rspamd_snprintf (key, sizeof (key), "key%ud", i % 500);
+		val = rspamd_lru_hash_lookup (hash, key, 0);
+
+		if (val == NULL) {
+			rspamd_lru_hash_insert (hash, g_strdup (key),
+					rspamd_lru_test_value (key), 0, 0);
+		}
+		else {
+			g_assert (strcmp (val, key) == 0);
+			rspamd_lru_test_value_free (val);
+		}
+	}
+
+	return NULL;
+}
+
+void
+rspamd_lru_test_func (void)
+{
+	rspamd_lru_hash_t *hash;
+	GThread *threads[4];
+	gchar key[32], *val;
+	guint i, j, found = 0;
+
+	hash = rspamd_lru_hash_new_full (100, 0, g_free, rspamd_lru_test_value_free,
+			g_str_hash, g_str_equal);
+
+	for (i = 0; i < 1000; i ++) {
+		rspamd_snprintf (key, sizeof (key), "key%ud", i);
+		rspamd_lru_hash_insert (hash, g_strdup (key),
+				rspamd_lru_test_value (key), 0, 0);
+
+		/* Frequently used keys must survive evictions */
+		for (j = 0; j < 10 && j <= i; j ++) {
+			rspamd_snprintf (key, sizeof (key), "key%ud", j);
+			val = rspamd_lru_hash_lookup (hash, key, 0);
+			g_assert (val != NULL && strcmp (val, key) == 0);
+		}
+	}
+
+	g_assert (values_alive == 100);
+
+	for (i = 0; i < 1000; i ++) {
+		rspamd_snprintf (key, sizeof (key), "key%ud", i);
+
+		if (rspamd_lru_hash_lookup (hash, key, 0) != NULL) {
+			found ++;
+		}
+	}
+
+	g_assert (found == 100);
+
+	/* Replace value */
+	rspamd_lru_hash_insert (hash, g_strdup ("key1"),
+			rspamd_lru_test_value ("new"), 0, 0);
+	g_assert (strcmp (rspamd_lru_hash_lookup (hash, "key1", 0), "new") == 0);
+	g_assert (values_alive == 100);
+
+	/* Expire by ttl */
+	rspamd_lru_hash_insert (hash, g_strdup ("ttl"),
+			rspamd_lru_test_value ("ttl"), 10, 5);
+	g_assert (rspamd_lru_hash_lookup (hash, "ttl", 15) != NULL);
+	g_assert (rspamd_lru_hash_lookup (hash, "ttl", 16) == NULL);
+
+	rspamd_lru_hash_destroy (hash);
+	g_assert (values_alive == 0);
+
+	/* Unlimited hash grows */
+	hash = rspamd_lru_hash_new_full (0, 0, g_free, rspamd_lru_test_value_free,
+			g_str_hash, g_str_equal);
+
+	for (i = 0; i < 5000; i ++) {
+		rspamd_snprintf (key, sizeof (key), "key%ud", i);
+		rspamd_lru_hash_insert (hash, g_strdup (key),
+				rspamd_lru_test_value (key), 0, 0);
+	}
+
+	for (i = 0; i < 5000; i ++) {
+		rspamd_snprintf (key, sizeof (key), "key%ud", i);
+		val = rspamd_lru_hash_lookup (hash, key, 0);
+		g_assert (val != NULL && strcmp (val, key) == 0);
+	}
+
+	rspamd_lru_hash_destroy (hash);
+	g_assert (values_alive == 0);
+
+	/* Concurrent hash returns references */
+	hash = rspamd_lru_hash_new_concurrent (200, 0, g_free,
+			rspamd_lru_test_value_free, rspamd_lru_test_value_ref,
+			g_str_hash, g_str_equal);
+
+	for (i = 0; i < G_N_ELEMENTS (threads); i ++) {
+		threads[i] = rspamd_create_thread ("lru", rspamd_lru_test_thread, hash,
+				NULL);
+		g_assert (threads[i] != NULL);
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (threads); i ++) {
+		g_thread_join (threads[i]);
+	}
+
+	rspamd_lru_hash_destroy (hash);
+	g_assert (values_alive == 0);
+}
@@ -9,7 +9,10 @@ void
 rspamd_mem_pool_test_func ()
 {
 	rspamd_mempool_t *pool;
+	rspamd_mempool_cache_t *cache;
 	rspamd_mempool_stat_t st;
+	rspamd_mempool_rwlock_t *rwlock;
+	guint reused, i, *counter;
 	char *tmp, *tmp2, *tmp3;
 	pid_t pid;
 	int ret;
@@ -40,8 +43,57 @@ rspamd_mem_pool_test_func ()
 	}
 	wait (&ret);
 	g_assert (*tmp3 == 't');
-	
+
+	/* Shared allocations spanning several chains and rwlock between processes */
+	for (i = 0; i < 64; i ++) {
+		tmp3 = rspamd_mempool_alloc_shared (pool, sizeof (TEST2_BUF));
+		g_assert (((uintptr_t)tmp3 & (MEM_ALIGNMENT - 1)) == 0);
+		snprintf (tmp3, sizeof (TEST2_BUF), "%s", TEST2_BUF);
+	}
+
+	counter = rspamd_mempool_alloc0_shared (pool, sizeof (*counter));
+	rwlock = rspamd_mempool_get_rwlock (pool);
+
+	if ((pid = fork ()) == 0) {
+		for (i = 0; i < 10000; i ++) {
+			rspamd_mempool_wlock_rwlock (rwlock);
+			(*counter) ++;
+			rspamd_mempool_wunlock_rwlock (rwlock);
+		}
+		exit (EXIT_SUCCESS);
+	}
+	else {
+		for (i = 0; i < 10000; i ++) {
+			rspamd_mempool_wlock_rwlock (rwlock);
+			(*counter) ++;
+			rspamd_mempool_wunlock_rwlock (rwlock);
+			rspamd_mempool_rlock_rwlock (rwlock);
+			g_assert (*counter > 0);
+			rspamd_mempool_runlock_rwlock (rwlock);
+		}
+	}
+	wait (&ret);
+	g_assert (*counter == 20000);
+
 	rspamd_mempool_delete (pool);
 	rspamd_mempool_stat (&st);
-	
+
+	/* Pages of pools created from a cache are reused */
+	cache = rspamd_mempool_cache_new (1024 * 1024);
+	pool = rspamd_mempool_new_cached (cache);
+	tmp = rspamd_mempool_alloc (pool, sizeof (TEST_BUF));
+	snprintf (tmp, sizeof (TEST_BUF), "%s", TEST_BUF);
+	rspamd_mempool_add_destructor (pool, g_free, g_strdup (TEST_BUF));
+	rspamd_mempool_delete (pool);
+
+	rspamd_mempool_stat (&st);
+	reused = st.chunks_reused;
+	pool = rspamd_mempool_new_cached (cache);
+	rspamd_mempool_stat (&st);
+	g_assert (st.chunks_reused == reused + 1);
+	tmp = rspamd_mempool_alloc (pool, sizeof (TEST_BUF));
+	snprintf (tmp, sizeof (TEST_BUF), "%s", TEST_BUF);
+	g_assert (strncmp (tmp, TEST_BUF, sizeof (TEST_BUF)) == 0);
+	rspamd_mempool_delete (pool);
+	rspamd_mempool_cache_destroy (cache);
 }
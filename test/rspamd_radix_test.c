@@ -78,10 +78,12 @@ struct _tv {
 static void
 rspamd_radix_text_vec (void)
 {
-	radix_compressed_t *tree = radix_create_compressed ();
+	radix_compressed_t *tree = radix_create_compressed (), *img_tree;
 	struct _tv *t = &test_vec[0];
 	struct in_addr ina;
 	struct in6_addr in6a;
+	GByteArray *img;
+	gsize len;
 	gulong i, val;
 
 	while (t->ip != NULL) {
@@ -134,6 +136,41 @@ rspamd_radix_text_vec (void)
 		t ++;
 	}
 
+	/* Compiled lookup tries must give the same results */
+	radix_compile_compressed (tree);
+
+	i = 0;
+	t = &test_vec[0];
+	while (t->ip != NULL) {
+		val = radix_find_compressed (tree, t->addr, t->len);
+		g_assert (val == ++i);
+		if (t->nip != NULL) {
+			val = radix_find_compressed (tree, t->naddr, t->len);
+			g_assert (val != i);
+		}
+		t ++;
+	}
+
+	/* Compiled image must give the same results */
+	img = radix_serialize_compressed (tree);
+	len = img->len;
+	img_tree = radix_create_compressed_image (g_byte_array_free (img, FALSE),
+			len, FALSE);
+	g_assert (img_tree != NULL);
+
+	i = 0;
+	t = &test_vec[0];
+	while (t->ip != NULL) {
+		val = radix_find_compressed (img_tree, t->addr, t->len);
+		g_assert (val == ++i);
+		if (t->nip != NULL) {
+			val = radix_find_compressed (img_tree, t->naddr, t->len);
+			g_assert (val != i);
+		}
+		t ++;
+	}
+
+	radix_destroy_compressed (img_tree);
 	radix_destroy_compressed (tree);
 }
 
@@ -240,6 +277,30 @@ rspamd_radix_test_func (void)
 	ts2 = rspamd_get_ticks ();
 	diff = (ts2 - ts1) * 1000.0;
 
+	msg_info ("Checked %z elements in %.6f ms", nelts, diff);
+
+	msg_info ("compiled radix performance (%z elts)", nelts);
+	ts1 = rspamd_get_ticks ();
+	radix_compile_compressed (comp_tree);
+	ts2 = rspamd_get_ticks ();
+	diff = (ts2 - ts1) * 1000.0;
+
+	msg_info ("Compiled %z elements in %.6f ms", nelts, diff);
+
+	ts1 = rspamd_get_ticks ();
+	for (lc = 0; lc < lookup_cycles; lc ++) {
+		for (i = 0; i < nelts; i ++) {
+			if (radix_find_compressed (comp_tree, addrs[i].addr6, sizeof (addrs[i].addr6))
+					== RADIX_NO_VALUE) {
+				all_good = FALSE;
+			}
+		}
+	}
+
+	g_assert (all_good);
+	ts2 = rspamd_get_ticks ();
+	diff = (ts2 - ts1) * 1000.0;
+
 	msg_info ("Checked %z elements in %.6f ms", nelts, diff);
 	radix_destroy_compressed (comp_tree);
 
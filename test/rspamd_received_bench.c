@@ -0,0 +1,143 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Received headers parsing benchmark: parses a set of typical Received
+ * headers of different MTA and reports throughput and allocations per header.
+ *
+ * Usage: rspamd-received-bench [-n iterations]
+ */
+
+#include "config.h"
+#include "main.h"
+#include "message.h"
+
+struct rspamd_main             *rspamd_main = NULL;
+worker_t *workers[] = { NULL };
+
+static gint iterations = 100000;
+
+static GOptionEntry entries[] =
+{
+	{ "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+	  "Number of passes over headers", NULL },
+	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
+};
+
+static const gchar *received_samples[] = {
+	/* Postfix */
+	"from mail.example.com (mail.example.com [192.0.2.1]) "
+	"by mx.example.org (Postfix) with ESMTPS id 3F1A520C4A "
+	"for <user@example.org>; Mon, 12 Oct 2015 10:00:00 +0000 (UTC)",
+	/* Exim */
+	"from [198.51.100.7] (port=51234 helo=client.example.net) "
+	"by relay.example.org with esmtpsa (TLSv1.2:AES256-GCM-SHA384:256) "
+	"(Exim 4.86) id 1ZlXyz-0003Ab-Cd; Mon, 12 Oct 2015 10:00:00 +0000",
+	/* Sendmail */
+	"from host.example.com (host.example.com [203.0.113.5]) "
+	"by smtp.example.org (8.14.9/8.14.9) with ESMTP id t9CA00abc012345 "
+	"for <user@example.org>; Mon, 12 Oct 2015 10:00:00 GMT",
+	/* IPv6 peer */
+	"from mail-out.example.com (mail-out.example.com [2001:db8::25]) "
+	"by mx.example.org (Postfix) with ESMTP id 8C2B1A0123; "
+	"Mon, 12 Oct 2015 10:00:00 +0000",
+	/* Qmail */
+	"(qmail 12345 invoked from network); 12 Oct 2015 10:00:00 -0000",
+	/* Local delivery */
+	"by mx.example.org (Postfix, from userid 1000) id 4A3B2C1D0E; "
+	"Mon, 12 Oct 2015 10:00:00 +0000 (UTC)",
+};
+
+int
+main (int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *err = NULL;
+	rspamd_mempool_t *pool;
+	rspamd_mempool_stat_t st_start, st_end;
+	struct raw_header rh;
+	struct received_header recv;
+	gchar *lines[G_N_ELEMENTS (received_samples)];
+	guint64 headers = 0, bytes = 0, parsed = 0;
+	gdouble t1, t2, elapsed = 0;
+	gint i;
+	guint j;
+
+	context = g_option_context_new ("- benchmark received headers parsing");
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &err)) {
+		fprintf (stderr, "option parsing failed: %s\n", err->message);
+		exit (EXIT_FAILURE);
+	}
+
+	for (j = 0; j < G_N_ELEMENTS (received_samples); j ++) {
+		lines[j] = g_strdup (received_samples[j]);
+	}
+
+	memset (&rh, 0, sizeof (rh));
+	rh.name = "Received";
+
+	for (i = 0; i < iterations; i ++) {
+		pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+		rspamd_mempool_stat (&st_start);
+		t1 = rspamd_get_ticks ();
+
+		for (j = 0; j < G_N_ELEMENTS (received_samples); j ++) {
+			memset (&recv, 0, sizeof (recv));
+			rh.value = lines[j];
+			rh.decoded = lines[j];
+			rspamd_message_parse_received (pool, &rh, &recv);
+
+			if (!recv.is_error) {
+				parsed ++;
+			}
+		}
+
+		t2 = rspamd_get_ticks ();
+		rspamd_mempool_stat (&st_end);
+		elapsed += t2 - t1;
+		headers += G_N_ELEMENTS (received_samples);
+		bytes += st_end.bytes_allocated - st_start.bytes_allocated;
+		rspamd_mempool_delete (pool);
+	}
+
+	if (elapsed <= 0) {
+		elapsed = 1e-9;
+	}
+
+	rspamd_printf ("headers: %uL (%uL parsed) in %.3f seconds\n",
+			headers, parsed, elapsed);
+	rspamd_printf ("headers/s: %.2f\n", headers / elapsed);
+
+	if (headers > 0) {
+		rspamd_printf ("allocations per header: %.2f bytes\n",
+				(gdouble)bytes / headers);
+	}
+
+	for (j = 0; j < G_N_ELEMENTS (received_samples); j ++) {
+		g_free (lines[j]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,837 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Scaling benchmark: starts rspamd with a worker of the selected type
+ * (normal, controller or fuzzy) listening on loopback, drives it with a fixed
+ * number of concurrent clients for some time and repeats this for each
+ * number of worker processes. The output is throughput and latency for
+ * each number of workers, so scaling of the worker can be compared with
+ * different settings, e.g. reuseport, cpu_affinity, keep-alive or threads.
+ *
+ * The configuration specified by -c is included to the generated one, so it
+ * should not define workers listening on the same port. Normal workers are
+ * sent messages from files with `check` command, controllers are sent `stat`
+ * command and fuzzy storages are sent checks of random digests.
+ *
+ * Usage: rspamd-scale-bench -c rspamd.conf [-r rspamd] [-T type]
+ *        [-w 1,2,4] [-C concurrency] [-d duration] [-k] [--reuseport]
+ *        [--cpu-affinity] [--threads n] [-j] [files...]
+ */
+
+#include "config.h"
+#include "main.h"
+#include "fuzzy_storage.h"
+#include "histogram.h"
+#include "rspamdclient.h"
+#include "ottery.h"
+
+struct rspamd_main             *rspamd_main = NULL;
+worker_t *workers[] = { NULL };
+
+enum scale_bench_type {
+	SCALE_BENCH_NORMAL = 0,
+	SCALE_BENCH_CONTROLLER,
+	SCALE_BENCH_FUZZY
+};
+
+static gchar *cfg_name = NULL;
+static gchar *rspamd_binary = "rspamd";
+static gchar *worker_type = "normal";
+static gchar *workers_list = NULL;
+static gint concurrency = 64;
+static gdouble duration = 10.0;
+static gdouble warmup = 1.0;
+static gdouble timeout = 10.0;
+static gint port = 11433;
+static gint threads = 0;
+static gboolean keepalive = FALSE;
+static gboolean reuseport = FALSE;
+static gboolean cpu_affinity = FALSE;
+static gboolean json = FALSE;
+
+static GOptionEntry entries[] =
+{
+	{ "config", 'c', 0, G_OPTION_ARG_STRING, &cfg_name,
+	  "Specify config file to include", NULL },
+	{ "rspamd", 'r', 0, G_OPTION_ARG_STRING, &rspamd_binary,
+	  "Path to rspamd binary (rspamd by default)", NULL },
+	{ "type", 'T', 0, G_OPTION_ARG_STRING, &worker_type,
+	  "Type of worker: normal, controller or fuzzy", NULL },
+	{ "workers", 'w', 0, G_OPTION_ARG_STRING, &workers_list,
+	  "Comma separated numbers of worker processes "
+	  "(powers of 2 up to the number of CPUs by default)", NULL },
+	{ "concurrency", 'C', 0, G_OPTION_ARG_INT, &concurrency,
+	  "Number of concurrent requests", NULL },
+	{ "duration", 'd', 0, G_OPTION_ARG_DOUBLE, &duration,
+	  "Time of measurement for each number of workers in seconds", NULL },
+	{ "warmup", 0, 0, G_OPTION_ARG_DOUBLE, &warmup,
+	  "Time to send requests before measurement in seconds", NULL },
+	{ "timeout", 't', 0, G_OPTION_ARG_DOUBLE, &timeout,
+	  "Timeout of a request in seconds", NULL },
+	{ "port", 'p', 0, G_OPTION_ARG_INT, &port,
+	  "Port to bind worker to", NULL },
+	{ "threads", 0, 0, G_OPTION_ARG_INT, &threads,
+	  "Number of scheduler threads of normal workers", NULL },
+	{ "keepalive", 'k', 0, G_OPTION_ARG_NONE, &keepalive,
+	  "Reuse persistent connections", NULL },
+	{ "reuseport", 0, 0, G_OPTION_ARG_NONE, &reuseport,
+	  "Bind socket of each worker with SO_REUSEPORT", NULL },
+	{ "cpu-affinity", 0, 0, G_OPTION_ARG_NONE, &cpu_affinity,
+	  "Bind workers to CPUs", NULL },
+	{ "json", 'j', 0, G_OPTION_ARG_NONE, &json,
+	  "Output results in JSON", NULL },
+	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
+};
+
+static const gchar *type_names[] = {
+	[SCALE_BENCH_NORMAL] = "normal",
+	[SCALE_BENCH_CONTROLLER] = "controller",
+	[SCALE_BENCH_FUZZY] = "fuzzy",
+};
+
+struct scale_bench_step {
+	guint workers;
+	guint64 requests;
+	guint64 failed;
+	gdouble elapsed;
+	gdouble cpu;
+	struct rspamd_histogram lat;
+};
+
+struct scale_bench_ctx {
+	enum scale_bench_type type;
+	struct event_base *ev_base;
+	struct scale_bench_step *step;
+	GPtrArray *corpus;
+	GHashTable *attrs;
+	rspamd_inet_addr_t *addr;
+	struct timeval tv;
+	guint cur_msg;
+	guint in_flight;
+	gboolean measuring;
+	gboolean stopping;
+	gdouble start;
+	gdouble cpu_start;
+	struct event warmup_ev;
+	struct event stop_ev;
+};
+
+struct scale_bench_slot {
+	struct scale_bench_ctx *ctx;
+	struct rspamd_client_connection *conn;
+	gint fd;
+	gdouble start;
+	guint32 tag;
+	struct event timer_ev;
+	struct event io_ev;
+};
+
+static void scale_bench_slot_next (struct scale_bench_slot *slot,
+		gdouble delay);
+
+static void
+scale_bench_slot_done (struct scale_bench_slot *slot, gboolean ok)
+{
+	struct scale_bench_ctx *ctx = slot->ctx;
+
+	if (ctx->measuring) {
+		if (ok) {
+			ctx->step->requests ++;
+			rspamd_histogram_add (&ctx->step->lat,
+					(rspamd_get_ticks () - slot->start) * 1e6);
+		}
+		else {
+			ctx->step->failed ++;
+		}
+	}
+
+	if (slot->conn != NULL && (!ok || !keepalive ||
+			!rspamd_client_is_persistent (slot->conn))) {
+		rspamd_client_destroy (slot->conn);
+		slot->conn = NULL;
+	}
+
+	/* Do not spin while server refuses connections */
+	scale_bench_slot_next (slot, ok ? 0.0 : 0.01);
+}
+
+static void
+scale_bench_http_cb (struct rspamd_client_connection *conn,
+	struct rspamd_http_message *msg,
+	const gchar *name, ucl_object_t *result,
+	gpointer ud, GError *err)
+{
+	struct scale_bench_slot *slot = ud;
+
+	if (result != NULL) {
+		ucl_object_unref (result);
+	}
+
+	scale_bench_slot_done (slot, err == NULL && result != NULL);
+}
+
+static void
+scale_bench_http_request (struct scale_bench_slot *slot)
+{
+	struct scale_bench_ctx *ctx = slot->ctx;
+	GString *msg;
+	GError *err = NULL;
+	gboolean ret;
+
+	if (slot->conn == NULL) {
+		slot->conn = rspamd_client_init (ctx->ev_base, "127.0.0.1", port,
+				timeout, NULL);
+
+		if (slot->conn == NULL) {
+			scale_bench_slot_done (slot, FALSE);
+			return;
+		}
+	}
+
+	slot->start = rspamd_get_ticks ();
+
+	if (ctx->type == SCALE_BENCH_NORMAL) {
+		msg = g_ptr_array_index (ctx->corpus,
+				ctx->cur_msg ++ % ctx->corpus->len);
+		ret = rspamd_client_command_data (slot->conn, "check", ctx->attrs,
+				msg->str, msg->len, scale_bench_http_cb, slot, &err);
+	}
+	else {
+		ret = rspamd_client_command (slot->conn, "stat", ctx->attrs, NULL,
+				scale_bench_http_cb, slot, &err);
+	}
+
+	if (!ret) {
+		g_error_free (err);
+		scale_bench_slot_done (slot, FALSE);
+	}
+}
+
+static void
+scale_bench_fuzzy_cb (gint fd, short what, gpointer ud)
+{
+	struct scale_bench_slot *slot = ud;
+	struct rspamd_fuzzy_reply rep;
+	gboolean ok = FALSE;
+	gssize r;
+
+	if (what == EV_READ) {
+		r = recv (fd, &rep, sizeof (rep), 0);
+		ok = r >= (gssize)sizeof (rep) && rep.tag == slot->tag;
+	}
+
+	scale_bench_slot_done (slot, ok);
+}
+
+static void
+scale_bench_fuzzy_request (struct scale_bench_slot *slot)
+{
+	struct scale_bench_ctx *ctx = slot->ctx;
+	struct rspamd_fuzzy_cmd cmd;
+
+	if (slot->fd == -1) {
+		slot->fd = rspamd_inet_address_connect (ctx->addr, SOCK_DGRAM, TRUE);
+
+		if (slot->fd == -1) {
+			scale_bench_slot_done (slot, FALSE);
+			return;
+		}
+	}
+
+	memset (&cmd, 0, sizeof (cmd));
+	cmd.version = RSPAMD_FUZZY_VERSION;
+	cmd.cmd = FUZZY_CHECK;
+	cmd.tag = ottery_rand_uint32 ();
+	ottery_rand_bytes (cmd.digest, sizeof (cmd.digest));
+	slot->tag = cmd.tag;
+	slot->start = rspamd_get_ticks ();
+
+	if (send (slot->fd, &cmd, sizeof (cmd), 0) == -1) {
+		scale_bench_slot_done (slot, FALSE);
+		return;
+	}
+
+	event_set (&slot->io_ev, slot->fd, EV_READ, scale_bench_fuzzy_cb, slot);
+	event_base_set (ctx->ev_base, &slot->io_ev);
+	event_add (&slot->io_ev, &ctx->tv);
+}
+
+static void
+scale_bench_slot_cb (gint fd, short what, gpointer ud)
+{
+	struct scale_bench_slot *slot = ud;
+	struct scale_bench_ctx *ctx = slot->ctx;
+
+	if (ctx->stopping) {
+		if (slot->conn != NULL) {
+			rspamd_client_destroy (slot->conn);
+		}
+
+		if (slot->fd != -1) {
+			close (slot->fd);
+		}
+
+		g_slice_free1 (sizeof (*slot), slot);
+
+		if (-- ctx->in_flight == 0) {
+			event_base_loopexit (ctx->ev_base, NULL);
+		}
+
+		return;
+	}
+
+	if (ctx->type == SCALE_BENCH_FUZZY) {
+		scale_bench_fuzzy_request (slot);
+	}
+	else {
+		scale_bench_http_request (slot);
+	}
+}
+
+/*
+ * Requests are started from timer, so that connections are never reused
+ * from their own callbacks
+ */
+static void
+scale_bench_slot_next (struct scale_bench_slot *slot, gdouble delay)
+{
+	struct timeval tv;
+
+	double_to_tv (delay, &tv);
+	evtimer_set (&slot->timer_ev, scale_bench_slot_cb, slot);
+	event_base_set (slot->ctx->ev_base, &slot->timer_ev);
+	evtimer_add (&slot->timer_ev, &tv);
+}
+
+static void
+scale_bench_warmup_cb (gint fd, short what, gpointer ud)
+{
+	struct scale_bench_ctx *ctx = ud;
+
+	ctx->measuring = TRUE;
+	ctx->start = rspamd_get_ticks ();
+	ctx->cpu_start = rspamd_get_virtual_ticks ();
+}
+
+static void
+scale_bench_stop_cb (gint fd, short what, gpointer ud)
+{
+	struct scale_bench_ctx *ctx = ud;
+
+	ctx->measuring = FALSE;
+	ctx->stopping = TRUE;
+	ctx->step->elapsed = rspamd_get_ticks () - ctx->start;
+	ctx->step->cpu = rspamd_get_virtual_ticks () - ctx->cpu_start;
+}
+
+static gboolean
+scale_bench_write_config (const gchar *path, const gchar *dir, guint count)
+{
+	GString *cf;
+	GError *err = NULL;
+	gboolean ret;
+
+	cf = g_string_sized_new (BUFSIZ);
+	rspamd_printf_gstring (cf, ".include \"%s\"\n\n", cfg_name);
+	rspamd_printf_gstring (cf, "worker {\n"
+			"\ttype = \"%s\";\n"
+			"\tbind_socket = \"127.0.0.1:%d\";\n"
+			"\tcount = %ud;\n"
+			"\treuseport = %s;\n"
+			"\tcpu_affinity = %s;\n",
+			worker_type, port, count,
+			reuseport ? "true" : "false",
+			cpu_affinity ? "true" : "false");
+
+	if (g_ascii_strcasecmp (worker_type, "normal") == 0) {
+		g_string_append (cf, "\tmime = true;\n");
+
+		if (threads > 0) {
+			rspamd_printf_gstring (cf, "\tscheduler_threads = %d;\n", threads);
+		}
+	}
+	else if (g_ascii_strcasecmp (worker_type, "controller") == 0) {
+		g_string_append (cf, "\tsecure_ip = \"127.0.0.1\";\n");
+	}
+	else {
+		rspamd_printf_gstring (cf, "\thashfile = \"%s/fuzzy.db\";\n", dir);
+	}
+
+	g_string_append (cf, "}\n");
+	ret = g_file_set_contents (path, cf->str, cf->len, &err);
+
+	if (!ret) {
+		fprintf (stderr, "cannot write %s: %s\n", path, err->message);
+		g_error_free (err);
+	}
+
+	g_string_free (cf, TRUE);
+
+	return ret;
+}
+
+static pid_t
+scale_bench_spawn (const gchar *conf, const gchar *pidfile)
+{
+	const gchar *args[8];
+	pid_t pid;
+	gint i = 0, fd;
+
+	args[i ++] = rspamd_binary;
+	args[i ++] = "-f";
+	args[i ++] = "-c";
+	args[i ++] = conf;
+	args[i ++] = "-p";
+	args[i ++] = pidfile;
+
+	if (geteuid () == 0) {
+		args[i ++] = "-i";
+	}
+
+	args[i] = NULL;
+	pid = fork ();
+
+	if (pid == 0) {
+		/* Console logging should not mix with results */
+		fd = open ("/dev/null", O_WRONLY);
+
+		if (fd != -1) {
+			dup2 (fd, STDOUT_FILENO);
+			close (fd);
+		}
+
+		execvp (rspamd_binary, (gchar * const *)args);
+		fprintf (stderr, "cannot execute %s: %s\n", rspamd_binary,
+				strerror (errno));
+		_exit (EXIT_FAILURE);
+	}
+	else if (pid == -1) {
+		fprintf (stderr, "fork failed: %s\n", strerror (errno));
+	}
+
+	return pid;
+}
+
+/*
+ * Wait until worker replies to a request or rspamd exits
+ */
+static gboolean
+scale_bench_wait_ready (struct scale_bench_ctx *ctx, pid_t pid)
+{
+	struct rspamd_fuzzy_cmd cmd;
+	struct rspamd_fuzzy_reply rep;
+	struct pollfd pfd;
+	gint fd, i, status;
+
+	memset (&cmd, 0, sizeof (cmd));
+	cmd.version = RSPAMD_FUZZY_VERSION;
+	cmd.cmd = FUZZY_CHECK;
+
+	for (i = 0; i < 300; i ++) {
+		if (waitpid (pid, &status, WNOHANG) == pid) {
+			fprintf (stderr, "rspamd has exited with status %d\n",
+					WEXITSTATUS (status));
+			return FALSE;
+		}
+
+		if (ctx->type == SCALE_BENCH_FUZZY) {
+			fd = rspamd_inet_address_connect (ctx->addr, SOCK_DGRAM, FALSE);
+
+			if (fd != -1) {
+				pfd.fd = fd;
+				pfd.events = POLLIN;
+
+				if (send (fd, &cmd, sizeof (cmd), 0) != -1 &&
+						poll (&pfd, 1, 100) == 1 &&
+						recv (fd, &rep, sizeof (rep), 0) > 0) {
+					close (fd);
+					return TRUE;
+				}
+
+				close (fd);
+			}
+		}
+		else {
+			fd = rspamd_inet_address_connect (ctx->addr, SOCK_STREAM, FALSE);
+
+			if (fd != -1) {
+				close (fd);
+				return TRUE;
+			}
+		}
+
+		usleep (100000);
+	}
+
+	fprintf (stderr, "rspamd has not started in 30 seconds\n");
+
+	return FALSE;
+}
+
+static void
+scale_bench_stop (pid_t pid)
+{
+	gint status;
+
+	kill (pid, SIGTERM);
+
+	while (waitpid (pid, &status, 0) == -1 && errno == EINTR);
+}
+
+static gboolean
+scale_bench_run_step (struct scale_bench_ctx *ctx,
+	struct scale_bench_step *step)
+{
+	struct scale_bench_slot *slot;
+	struct timeval tv;
+	gchar dir[] = "/tmp/rspamd-scale.XXXXXX";
+	gchar *conf, *pidfile, *db;
+	pid_t pid;
+	gboolean ret = FALSE;
+	gint i;
+
+	if (mkdtemp (dir) == NULL) {
+		fprintf (stderr, "cannot create temporary directory: %s\n",
+				strerror (errno));
+		return FALSE;
+	}
+
+	conf = g_strdup_printf ("%s/rspamd.conf", dir);
+	pidfile = g_strdup_printf ("%s/rspamd.pid", dir);
+	db = g_strdup_printf ("%s/fuzzy.db", dir);
+
+	if (!scale_bench_write_config (conf, dir, step->workers)) {
+		goto out;
+	}
+
+	if ((pid = scale_bench_spawn (conf, pidfile)) == -1) {
+		goto out;
+	}
+
+	if (!scale_bench_wait_ready (ctx, pid)) {
+		scale_bench_stop (pid);
+		goto out;
+	}
+
+	ctx->step = step;
+	ctx->measuring = FALSE;
+	ctx->stopping = FALSE;
+	ctx->in_flight = 0;
+
+	for (i = 0; i < concurrency; i ++) {
+		slot = g_slice_alloc0 (sizeof (*slot));
+		slot->ctx = ctx;
+		slot->fd = -1;
+		ctx->in_flight ++;
+		scale_bench_slot_next (slot, 0.0);
+	}
+
+	double_to_tv (warmup, &tv);
+	evtimer_set (&ctx->warmup_ev, scale_bench_warmup_cb, ctx);
+	event_base_set (ctx->ev_base, &ctx->warmup_ev);
+	evtimer_add (&ctx->warmup_ev, &tv);
+
+	double_to_tv (warmup + duration, &tv);
+	evtimer_set (&ctx->stop_ev, scale_bench_stop_cb, ctx);
+	event_base_set (ctx->ev_base, &ctx->stop_ev);
+	evtimer_add (&ctx->stop_ev, &tv);
+
+	event_base_loop (ctx->ev_base, 0);
+
+	if (step->elapsed <= 0) {
+		step->elapsed = 1e-9;
+	}
+
+	scale_bench_stop (pid);
+	ret = TRUE;
+
+out:
+	unlink (conf);
+	unlink (pidfile);
+	unlink (db);
+	rmdir (dir);
+	g_free (conf);
+	g_free (pidfile);
+	g_free (db);
+
+	return ret;
+}
+
+static GArray *
+scale_bench_parse_workers (void)
+{
+	GArray *res;
+	gchar **strv;
+	glong ncpus;
+	guint i, n;
+
+	res = g_array_new (FALSE, FALSE, sizeof (guint));
+
+	if (workers_list != NULL) {
+		strv = g_strsplit_set (workers_list, ", ", -1);
+
+		for (i = 0; strv[i] != NULL; i ++) {
+			n = strtoul (strv[i], NULL, 10);
+
+			if (n > 0) {
+				g_array_append_val (res, n);
+			}
+		}
+
+		g_strfreev (strv);
+	}
+	else {
+		ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+		if (ncpus < 1) {
+			ncpus = 1;
+		}
+
+		for (n = 1; n < (guint)ncpus; n *= 2) {
+			g_array_append_val (res, n);
+		}
+
+		n = ncpus;
+		g_array_append_val (res, n);
+	}
+
+	return res;
+}
+
+static void
+scale_bench_output_text (struct scale_bench_step *steps, guint nsteps)
+{
+	struct scale_bench_step *step;
+	gdouble rps, base = 0;
+	guint i;
+
+	rspamd_printf ("%s worker, %d concurrent requests%s%s%s\n\n",
+			worker_type, concurrency,
+			keepalive ? ", keep-alive" : "",
+			reuseport ? ", reuseport" : "",
+			cpu_affinity ? ", cpu affinity" : "");
+	rspamd_printf ("%8s %10s %8s %12s %10s %10s %10s %10s %10s\n",
+			"workers", "requests", "failed", "req/s", "avg (ms)", "p50 (ms)",
+			"p99 (ms)", "scaling", "cpu (s)");
+
+	for (i = 0; i < nsteps; i ++) {
+		step = &steps[i];
+		rps = step->requests / step->elapsed;
+
+		if (i == 0) {
+			base = rps / step->workers;
+		}
+
+		rspamd_printf ("%8ud %10uL %8uL %12.2f %10.3f %10.3f %10.3f %10.3f "
+				"%10.3f\n",
+				step->workers, step->requests, step->failed, rps,
+				step->lat.count > 0 ?
+						step->lat.sum / (gdouble)step->lat.count / 1000.0 : 0.0,
+				rspamd_histogram_percentile (&step->lat, 50) / 1000.0,
+				rspamd_histogram_percentile (&step->lat, 99) / 1000.0,
+				base > 0 ? rps / (base * step->workers) : 0.0,
+				step->cpu);
+	}
+}
+
+static void
+scale_bench_output_json (struct scale_bench_step *steps, guint nsteps)
+{
+	ucl_object_t *top, *obj, *elt;
+	struct scale_bench_step *step;
+	gchar *out;
+	guint i;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top, ucl_object_fromstring (worker_type),
+			"type", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (concurrency),
+			"concurrency", 0, false);
+	ucl_object_insert_key (top, ucl_object_frombool (keepalive),
+			"keepalive", 0, false);
+	ucl_object_insert_key (top, ucl_object_frombool (reuseport),
+			"reuseport", 0, false);
+	ucl_object_insert_key (top, ucl_object_frombool (cpu_affinity),
+			"cpu_affinity", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (threads),
+			"threads", 0, false);
+
+	obj = ucl_object_typed_new (UCL_ARRAY);
+
+	for (i = 0; i < nsteps; i ++) {
+		step = &steps[i];
+		elt = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (elt, ucl_object_fromint (step->workers),
+				"workers", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (step->requests),
+				"requests", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (step->failed),
+				"failed", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromdouble (step->elapsed),
+				"elapsed", 0, false);
+		ucl_object_insert_key (elt,
+				ucl_object_fromdouble (step->requests / step->elapsed),
+				"requests_per_second", 0, false);
+		ucl_object_insert_key (elt,
+				ucl_object_fromint (rspamd_histogram_percentile (&step->lat,
+						50)),
+				"p50_us", 0, false);
+		ucl_object_insert_key (elt,
+				ucl_object_fromint (rspamd_histogram_percentile (&step->lat,
+						99)),
+				"p99_us", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (step->lat.max),
+				"max_us", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromdouble (step->cpu),
+				"client_cpu", 0, false);
+		ucl_object_array_push (obj, elt);
+	}
+
+	ucl_object_insert_key (top, obj, "steps", 0, false);
+
+	out = ucl_object_emit (top, UCL_EMIT_JSON);
+	rspamd_printf ("%s\n", out);
+	free (out);
+	ucl_object_unref (top);
+}
+
+int
+main (int argc, char **argv)
+{
+	struct scale_bench_ctx ctx;
+	struct scale_bench_step *steps;
+	GOptionContext *context;
+	GError *err = NULL;
+	GArray *nworkers;
+	GString *msg;
+	gchar *data, *path;
+	gsize len;
+	guint i, nsteps = 0;
+
+	context = g_option_context_new ("- benchmark scaling of workers");
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &err)) {
+		fprintf (stderr, "option parsing failed: %s\n", err->message);
+		exit (EXIT_FAILURE);
+	}
+
+	if (cfg_name == NULL) {
+		fprintf (stderr, "usage: rspamd-scale-bench -c config [-T type] "
+				"[-w 1,2,4] [-C concurrency] [-d duration] [-k] [-j] "
+				"[files...]\n");
+		exit (EXIT_FAILURE);
+	}
+
+	memset (&ctx, 0, sizeof (ctx));
+
+	for (i = 0; i < G_N_ELEMENTS (type_names); i ++) {
+		if (g_ascii_strcasecmp (worker_type, type_names[i]) == 0) {
+			ctx.type = i;
+			worker_type = (gchar *)type_names[i];
+			break;
+		}
+	}
+
+	if (i == G_N_ELEMENTS (type_names)) {
+		fprintf (stderr, "unknown worker type: %s\n", worker_type);
+		exit (EXIT_FAILURE);
+	}
+
+	/* Generated configuration is not in the current directory */
+	if ((path = realpath (cfg_name, NULL)) == NULL) {
+		fprintf (stderr, "cannot find config %s: %s\n", cfg_name,
+				strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+
+	cfg_name = path;
+	ctx.corpus = g_ptr_array_new ();
+
+	for (i = 1; i < (guint)argc; i ++) {
+		if (!g_file_get_contents (argv[i], &data, &len, &err)) {
+			fprintf (stderr, "cannot read %s: %s\n", argv[i], err->message);
+			g_error_free (err);
+			err = NULL;
+			continue;
+		}
+
+		msg = g_string_new_len (data, len);
+		g_free (data);
+		g_ptr_array_add (ctx.corpus, msg);
+	}
+
+	if (ctx.type == SCALE_BENCH_NORMAL && ctx.corpus->len == 0) {
+		fprintf (stderr, "no messages to send to normal worker\n");
+		exit (EXIT_FAILURE);
+	}
+
+	if (!rspamd_parse_inet_address (&ctx.addr, "127.0.0.1")) {
+		exit (EXIT_FAILURE);
+	}
+
+	rspamd_inet_address_set_port (ctx.addr, port);
+	ctx.ev_base = event_init ();
+	ctx.attrs = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	double_to_tv (timeout, &ctx.tv);
+	concurrency = MAX (concurrency, 1);
+	signal (SIGPIPE, SIG_IGN);
+
+	nworkers = scale_bench_parse_workers ();
+	steps = g_malloc0 (nworkers->len * sizeof (*steps));
+
+	for (i = 0; i < nworkers->len; i ++) {
+		steps[nsteps].workers = g_array_index (nworkers, guint, i);
+
+		if (!json) {
+			fprintf (stderr, "running %u %s workers\n",
+					steps[nsteps].workers, worker_type);
+		}
+
+		if (scale_bench_run_step (&ctx, &steps[nsteps])) {
+			nsteps ++;
+		}
+	}
+
+	if (json) {
+		scale_bench_output_json (steps, nsteps);
+	}
+	else {
+		scale_bench_output_text (steps, nsteps);
+	}
+
+	for (i = 0; i < ctx.corpus->len; i ++) {
+		g_string_free (g_ptr_array_index (ctx.corpus, i), TRUE);
+	}
+
+	g_ptr_array_free (ctx.corpus, TRUE);
+	g_array_free (nworkers, TRUE);
+	g_hash_table_unref (ctx.attrs);
+	rspamd_inet_address_destroy (ctx.addr);
+	event_base_free (ctx.ev_base);
+	g_free (steps);
+	free (path);
+
+	return nsteps > 0 ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,242 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Statistics pipeline benchmark: replays a corpus of messages through
+ * tokenizer, classifier and the statfile backends defined in the
+ * configuration and reports throughput and allocations per message.
+ *
+ * Usage: rspamd-stat-bench -c rspamd.conf [-n iterations] [-l spam|ham] files...
+ */
+
+#include "config.h"
+#include "main.h"
+#include "cfg_file.h"
+#include "message.h"
+#include "task.h"
+#include "regexp.h"
+#include "stat_api.h"
+#include "stat_internal.h"
+
+struct rspamd_main             *rspamd_main = NULL;
+worker_t *workers[] = { NULL };
+
+static gchar *cfg_name = NULL;
+static gchar *learn_mode = NULL;
+static gint iterations = 1;
+
+static GOptionEntry entries[] =
+{
+	{ "config", 'c', 0, G_OPTION_ARG_STRING, &cfg_name,
+	  "Specify config file", NULL },
+	{ "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+	  "Number of passes over the corpus", NULL },
+	{ "learn", 'l', 0, G_OPTION_ARG_STRING, &learn_mode,
+	  "Learn messages as spam or ham instead of classifying them", NULL },
+	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
+};
+
+struct stat_bench_result {
+	guint64 messages;
+	guint64 failed;
+	guint64 chunks;
+	guint64 bytes;
+	gdouble elapsed;
+};
+
+static void
+rspamd_stat_bench_message (struct rspamd_config *cfg, const gchar *data,
+		gsize len, gboolean learn, gboolean spam, struct stat_bench_result *res)
+{
+	struct rspamd_task *task;
+	rspamd_mempool_stat_t st_start, st_end;
+	rspamd_stat_result_t ret;
+	GError *err = NULL;
+	gdouble t1, t2;
+
+	rspamd_mempool_stat (&st_start);
+	task = rspamd_task_new (NULL);
+	task->cfg = cfg;
+	task->msg.start = data;
+	task->msg.len = len;
+
+	t1 = rspamd_get_ticks ();
+
+	if (process_message (task) != 0) {
+		res->failed ++;
+		rspamd_task_free_hard (task);
+		return;
+	}
+
+	if (learn) {
+		ret = rspamd_stat_learn (task, spam, cfg->lua_state, &err);
+	}
+	else {
+		ret = rspamd_stat_classify (task, cfg->lua_state, &err);
+	}
+
+	t2 = rspamd_get_ticks ();
+
+	if (ret == RSPAMD_STAT_PROCESS_ERROR) {
+		res->failed ++;
+
+		if (err) {
+			msg_err ("cannot process message: %e", err);
+			g_error_free (err);
+		}
+	}
+
+	rspamd_mempool_stat (&st_end);
+	res->messages ++;
+	res->elapsed += t2 - t1;
+	res->chunks += st_end.chunks_allocated - st_start.chunks_allocated;
+	res->bytes += st_end.bytes_allocated - st_start.bytes_allocated;
+
+	rspamd_task_free_hard (task);
+}
+
+int
+main (int argc, char **argv)
+{
+	struct rspamd_config *cfg;
+	struct rspamd_stat_ctx *st_ctx;
+	struct stat_bench_result res;
+	GOptionContext *context;
+	GError *err = NULL;
+	GPtrArray *corpus;
+	GString *msg;
+	gchar *data;
+	gsize len;
+	gboolean learn = FALSE, spam = FALSE;
+	gint i, j;
+
+	context = g_option_context_new ("- benchmark statistics pipeline");
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &err)) {
+		fprintf (stderr, "option parsing failed: %s\n", err->message);
+		exit (EXIT_FAILURE);
+	}
+
+	if (cfg_name == NULL || argc < 2) {
+		fprintf (stderr, "usage: rspamd-stat-bench -c config [-n iterations] "
+				"[-l spam|ham] files...\n");
+		exit (EXIT_FAILURE);
+	}
+
+	if (learn_mode != NULL) {
+		if (g_ascii_strcasecmp (learn_mode, "spam") == 0) {
+			spam = TRUE;
+		}
+		else if (g_ascii_strcasecmp (learn_mode, "ham") != 0) {
+			fprintf (stderr, "invalid learn mode: %s\n", learn_mode);
+			exit (EXIT_FAILURE);
+		}
+
+		learn = TRUE;
+	}
+
+	rspamd_main = (struct rspamd_main *)g_malloc0 (sizeof (struct rspamd_main));
+	rspamd_main->server_pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+	rspamd_main->cfg = (struct rspamd_config *)g_malloc0 (sizeof (struct rspamd_config));
+	cfg = rspamd_main->cfg;
+
+	rspamd_init_libs ();
+	rspamd_init_cfg (cfg, TRUE);
+	cfg->log_type = RSPAMD_LOG_CONSOLE;
+	cfg->log_level = G_LOG_LEVEL_WARNING;
+	cfg->cfg_name = cfg_name;
+
+	rspamd_set_logger (cfg, g_quark_from_static_string ("stat-bench"), rspamd_main);
+	(void)rspamd_log_open (rspamd_main->logger);
+	g_log_set_default_handler (rspamd_glib_log_function, rspamd_main->logger);
+
+	if (!rspamd_config_read (cfg, cfg_name, NULL, NULL, NULL)) {
+		fprintf (stderr, "cannot load config %s\n", cfg_name);
+		exit (EXIT_FAILURE);
+	}
+
+	rspamd_config_post_load (cfg);
+
+	corpus = g_ptr_array_new ();
+
+	for (i = 1; i < argc; i ++) {
+		if (!g_file_get_contents (argv[i], &data, &len, &err)) {
+			fprintf (stderr, "cannot read %s: %s\n", argv[i], err->message);
+			g_error_free (err);
+			err = NULL;
+			continue;
+		}
+
+		msg = g_string_new_len (data, len);
+		g_free (data);
+		g_ptr_array_add (corpus, msg);
+	}
+
+	if (corpus->len == 0) {
+		fprintf (stderr, "no messages to process\n");
+		exit (EXIT_FAILURE);
+	}
+
+	memset (&res, 0, sizeof (res));
+	st_ctx = rspamd_stat_get_ctx ();
+	st_ctx->tokens_processed = 0;
+	st_ctx->tokens_lookups = 0;
+
+	for (j = 0; j < iterations; j ++) {
+		for (i = 0; i < (gint)corpus->len; i ++) {
+			msg = g_ptr_array_index (corpus, i);
+			rspamd_stat_bench_message (cfg, msg->str, msg->len, learn, spam,
+					&res);
+		}
+	}
+
+	if (res.elapsed <= 0) {
+		res.elapsed = 1e-9;
+	}
+
+	rspamd_printf ("messages: %uL (%uL failed) in %.3f seconds\n",
+			res.messages, res.failed, res.elapsed);
+	rspamd_printf ("messages/s: %.2f\n", res.messages / res.elapsed);
+	rspamd_printf ("tokens/s: %.2f (%uL tokens)\n",
+			st_ctx->tokens_processed / res.elapsed, st_ctx->tokens_processed);
+	rspamd_printf ("lookups/s: %.2f (%uL lookups)\n",
+			st_ctx->tokens_lookups / res.elapsed, st_ctx->tokens_lookups);
+
+	if (res.messages > 0) {
+		rspamd_printf ("allocations per message: %.2f chunks, %.2f bytes\n",
+				(gdouble)res.chunks / res.messages,
+				(gdouble)res.bytes / res.messages);
+	}
+
+	for (i = 0; i < (gint)corpus->len; i ++) {
+		g_string_free (g_ptr_array_index (corpus, i), TRUE);
+	}
+
+	g_ptr_array_free (corpus, TRUE);
+	rspamd_config_free (cfg);
+	g_mime_shutdown ();
+	rspamd_regexp_library_finalize ();
+
+	return 0;
+}
@@ -57,6 +57,9 @@ main (int argc, char **argv)
 	g_test_add_func ("/rspamd/lua", rspamd_lua_test_func);
 	g_test_add_func ("/rspamd/crypto", rspamd_cryptobox_test_func);
 	g_test_add_func ("/rspamd/cryptobox", rspamd_cryptobox_test_func);
+	g_test_add_func ("/rspamd/cuckoo", rspamd_cuckoo_test_func);
+	g_test_add_func ("/rspamd/histogram", rspamd_histogram_test_func);
+	g_test_add_func ("/rspamd/lru", rspamd_lru_test_func);
 
 	g_test_run ();
 
@@ -53,9 +53,74 @@ const char *test_text =
 "http://vsem.ru?action;\n";
 const char *test_html = "<some_tag>This is test file with <a href=\"http://microsoft.com\">http://TesT.com/././?%45%46%20 url</a></some_tag>";
 
+const char *test_filler =
+"Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod\n"
+"tempor incididunt ut labore et dolore magna aliqua; ut enim ad minim veniam\n";
+
+const gint url_blocks = 4 * 1024;
+
+static guint
+rspamd_url_test_count (rspamd_mempool_t *pool, const gchar *text, gsize len)
+{
+	const gchar *p = text, *end = text + len, *url_start, *url_end;
+	gchar *url_str;
+	guint n = 0;
+
+	while (p < end) {
+		url_str = NULL;
+
+		if (!rspamd_url_find (pool, p, end - p, &url_start, &url_end, &url_str,
+				FALSE, NULL)) {
+			break;
+		}
+
+		if (url_str != NULL) {
+			n ++;
+		}
+
+		p = url_end + 1;
+	}
+
+	return n;
+}
+
 /* Function for using in glib test suite */
 void
 rspamd_url_test_func ()
 {
-	/* XXX: maybe write test for this */
+	rspamd_mempool_t *pool;
+	GString *text;
+	guint single, total;
+	gint i;
+	gdouble ts1, ts2;
+
+	rspamd_url_init (NULL);
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+
+	/* Each block of urls is surrounded by the same text */
+	text = g_string_new (test_filler);
+	g_string_append (text, test_text);
+	g_string_append (text, test_filler);
+	single = rspamd_url_test_count (pool, text->str, text->len);
+	g_assert (single > 0);
+
+	g_string_assign (text, test_filler);
+
+	for (i = 0; i < url_blocks; i ++) {
+		g_string_append (text, test_text);
+		g_string_append (text, test_filler);
+	}
+
+	msg_info ("url scanner performance (%z bytes, %s kernel)", text->len,
+			rspamd_url_scanner_impl ());
+	ts1 = rspamd_get_ticks ();
+	total = rspamd_url_test_count (pool, text->str, text->len);
+	ts2 = rspamd_get_ticks ();
+
+	msg_info ("Found %ud urls in %.6f ms (%.2f MB/s)", total,
+			(ts2 - ts1) * 1000.0, text->len / (ts2 - ts1) / (1024.0 * 1024.0));
+	g_assert (total == single * url_blocks);
+
+	g_string_free (text, TRUE);
+	rspamd_mempool_delete (pool);
 }
@@ -0,0 +1,738 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmarks of libutil primitives: memory pools, radix trie, LRU hash,
+ * bloom filter, string hashes, printf, addresses parsing and upstreams
+ * selection.
+ *
+ * Each benchmark is calibrated so that a batch of operations takes at least
+ * the minimal time, then it is run once to warm caches and branch predictors
+ * and the batch is repeated. The median time per operation is reported with
+ * the best one and the spread of repetitions; cycles are measured by the
+ * time stamp counter when it is available.
+ *
+ * Results can be saved as a baseline (-o) and compared with a previous
+ * baseline (-b): benchmarks slower than the baseline by more than the
+ * threshold are reported and the exit code is non zero.
+ *
+ * Usage: rspamd-util-bench [-r repeats] [-m min_time] [-f filter]
+ *        [-b baseline] [-o output] [-T threshold]
+ */
+
+#include "config.h"
+#include "main.h"
+#include "mem_pool.h"
+#include "radix.h"
+#include "hash.h"
+#include "bloom.h"
+#include "fstring.h"
+#include "printf.h"
+#include "addr.h"
+#include "upstream.h"
+
+struct rspamd_main             *rspamd_main = NULL;
+worker_t *workers[] = { NULL };
+
+static gint repeats = 10;
+static gdouble min_time = 0.01;
+static gchar *filter = NULL;
+static gchar *baseline_file = NULL;
+static gchar *output_file = NULL;
+static gdouble threshold = 10.0;
+
+static GOptionEntry entries[] =
+{
+	{ "repeats", 'r', 0, G_OPTION_ARG_INT, &repeats,
+	  "Number of measured repetitions of each benchmark", NULL },
+	{ "min-time", 'm', 0, G_OPTION_ARG_DOUBLE, &min_time,
+	  "Minimal time of a single repetition in seconds", NULL },
+	{ "filter", 'f', 0, G_OPTION_ARG_STRING, &filter,
+	  "Run benchmarks whose names contain this string", NULL },
+	{ "baseline", 'b', 0, G_OPTION_ARG_STRING, &baseline_file,
+	  "Compare results with the specified baseline", NULL },
+	{ "output", 'o', 0, G_OPTION_ARG_STRING, &output_file,
+	  "Save results as a baseline to the specified file", NULL },
+	{ "threshold", 'T', 0, G_OPTION_ARG_DOUBLE, &threshold,
+	  "Slowdown in percents reported as a regression (10 by default)", NULL },
+	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
+};
+
+struct util_bench {
+	const gchar *name;
+	void (*setup) (void);
+	void (*run) (guint64 n);
+	void (*teardown) (void);
+};
+
+struct util_bench_result {
+	const gchar *name;
+	gdouble ns_op;
+	gdouble best_ns_op;
+	gdouble spread;
+	gdouble cycles_op;
+};
+
+#define BENCH_KEYS 4096
+#define BENCH_ELTS 10000
+
+/* Results are accumulated here, so the compiler cannot drop operations */
+static volatile guintptr bench_sink = 0;
+static guint64 bench_rng = 0x2545F4914F6CDD1DULL;
+
+static rspamd_mempool_t *bench_pool = NULL;
+static radix_compressed_t *bench_radix = NULL;
+static rspamd_lru_hash_t *bench_lru = NULL;
+static rspamd_bloom_filter_t *bench_bloom = NULL;
+static struct upstream_list *bench_ups = NULL;
+static guint32 bench_addrs[BENCH_KEYS];
+static gchar *bench_strs[BENCH_KEYS];
+static rspamd_fstring_t bench_fstr;
+
+/* Deterministic generator, so runs of different builds use the same data */
+static inline guint64
+bench_random (void)
+{
+	bench_rng ^= bench_rng >> 12;
+	bench_rng ^= bench_rng << 25;
+	bench_rng ^= bench_rng >> 27;
+
+	return bench_rng * 0x2545F4914F6CDD1DULL;
+}
+
+static inline guint64
+bench_cycles (void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	return __builtin_ia32_rdtsc ();
+#else
+	return 0;
+#endif
+}
+
+static void
+bench_keys_setup (void)
+{
+	guint i;
+
+	for (i = 0; i < BENCH_KEYS; i ++) {
+		bench_addrs[i] = bench_random ();
+		bench_strs[i] = g_strdup_printf ("key-%016" G_GINT64_MODIFIER "x",
+				(gint64)bench_random ());
+	}
+}
+
+static void
+bench_keys_teardown (void)
+{
+	guint i;
+
+	for (i = 0; i < BENCH_KEYS; i ++) {
+		g_free (bench_strs[i]);
+		bench_strs[i] = NULL;
+	}
+}
+
+/* Memory pools */
+static void
+bench_mempool_alloc (guint64 n)
+{
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		/* Limit memory used by the pool */
+		if ((i & 0xfff) == 0) {
+			if (bench_pool != NULL) {
+				rspamd_mempool_delete (bench_pool);
+			}
+			bench_pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+		}
+
+		bench_sink += (guintptr)rspamd_mempool_alloc (bench_pool,
+				16 + (i & 0x3f));
+	}
+}
+
+static void
+bench_mempool_teardown (void)
+{
+	if (bench_pool != NULL) {
+		rspamd_mempool_delete (bench_pool);
+		bench_pool = NULL;
+	}
+}
+
+static void
+bench_mempool_new (guint64 n)
+{
+	rspamd_mempool_t *pool;
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+		bench_sink += (guintptr)rspamd_mempool_alloc (pool, 64);
+		rspamd_mempool_delete (pool);
+	}
+}
+
+/* Radix trie */
+static void
+bench_radix_setup (void)
+{
+	guint32 key;
+	guint i;
+
+	bench_keys_setup ();
+	bench_radix = radix_create_compressed ();
+
+	for (i = 0; i < BENCH_ELTS; i ++) {
+		key = bench_random ();
+		/* Mixed /24 and /16 networks, mask is the number of masked bits */
+		radix_insert_compressed (bench_radix, (guint8 *)&key, sizeof (key),
+				i & 1 ? 8 : 16, i + 1);
+	}
+}
+
+static void
+bench_radix_run (guint64 n)
+{
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		bench_sink += radix_find_compressed (bench_radix,
+				(guint8 *)&bench_addrs[i % BENCH_KEYS], sizeof (guint32));
+	}
+}
+
+static void
+bench_radix_teardown (void)
+{
+	radix_destroy_compressed (bench_radix);
+	bench_radix = NULL;
+	bench_keys_teardown ();
+}
+
+/* LRU hash */
+static void
+bench_lru_setup (void)
+{
+	guint i;
+
+	bench_keys_setup ();
+	bench_lru = rspamd_lru_hash_new (BENCH_KEYS, -1, g_free, NULL);
+
+	/* Every 8th key is missing */
+	for (i = 0; i < BENCH_KEYS; i ++) {
+		if (i % 8 != 0) {
+			rspamd_lru_hash_insert (bench_lru, g_strdup (bench_strs[i]),
+					bench_strs[i], 0, 0);
+		}
+	}
+}
+
+static void
+bench_lru_lookup (guint64 n)
+{
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		bench_sink += (guintptr)rspamd_lru_hash_lookup (bench_lru,
+				bench_strs[i % BENCH_KEYS], 0);
+	}
+}
+
+static void
+bench_lru_insert_setup (void)
+{
+	bench_keys_setup ();
+	/* Smaller than the set of keys, so inserts evict elements */
+	bench_lru = rspamd_lru_hash_new (BENCH_KEYS / 4, -1, g_free, NULL);
+}
+
+static void
+bench_lru_insert (guint64 n)
+{
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		rspamd_lru_hash_insert (bench_lru, g_strdup (bench_strs[i % BENCH_KEYS]),
+				bench_strs[i % BENCH_KEYS], 0, 0);
+	}
+}
+
+static void
+bench_lru_teardown (void)
+{
+	rspamd_lru_hash_destroy (bench_lru);
+	bench_lru = NULL;
+	bench_keys_teardown ();
+}
+
+/* Bloom filter */
+static void
+bench_bloom_setup (void)
+{
+	guint i;
+
+	bench_keys_setup ();
+	bench_bloom = rspamd_bloom_create (BENCH_ELTS * 16, RSPAMD_DEFAULT_BLOOM_HASHES);
+
+	for (i = 0; i < BENCH_KEYS; i += 2) {
+		rspamd_bloom_add (bench_bloom, bench_strs[i]);
+	}
+}
+
+static void
+bench_bloom_check (guint64 n)
+{
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		bench_sink += rspamd_bloom_check (bench_bloom, bench_strs[i % BENCH_KEYS]);
+	}
+}
+
+static void
+bench_bloom_teardown (void)
+{
+	rspamd_bloom_destroy (bench_bloom);
+	bench_bloom = NULL;
+	bench_keys_teardown ();
+}
+
+/* String hashes */
+static void
+bench_fstr_setup (void)
+{
+	static gchar buf[] = "Subject: Re: Your Account Statement Is Ready For Review";
+
+	bench_fstr.begin = buf;
+	bench_fstr.len = sizeof (buf) - 1;
+	bench_fstr.size = sizeof (buf);
+}
+
+static void
+bench_fstrhash (guint64 n)
+{
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		bench_sink += rspamd_fstrhash (&bench_fstr);
+	}
+}
+
+static void
+bench_fstrhash_lc (guint64 n)
+{
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		bench_sink += rspamd_fstrhash_lc (&bench_fstr, FALSE);
+	}
+}
+
+static void
+bench_fstrhash_lc_utf (guint64 n)
+{
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		bench_sink += rspamd_fstrhash_lc (&bench_fstr, TRUE);
+	}
+}
+
+/* Printf */
+static void
+bench_printf (guint64 n)
+{
+	gchar buf[256];
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		bench_sink += rspamd_snprintf (buf, sizeof (buf),
+				"%s: %d of %uL, score %.2f, %s", "symbol", (gint)i, i,
+				(gdouble)i / 3.0, "message");
+	}
+}
+
+static void
+bench_printf_score (guint64 n)
+{
+	GString *s;
+	guint64 i;
+
+	s = g_string_sized_new (64);
+
+	for (i = 0; i < n; i ++) {
+		g_string_truncate (s, 0);
+		rspamd_printf_gstring (s, "%s(%.2f)", "SYMBOL", (gdouble)i / 3.0);
+		bench_sink += s->len;
+	}
+
+	g_string_free (s, TRUE);
+}
+
+static void
+bench_append_score (guint64 n)
+{
+	GString *s;
+	guint64 i;
+
+	s = g_string_sized_new (64);
+
+	for (i = 0; i < n; i ++) {
+		g_string_truncate (s, 0);
+		g_string_append (s, "SYMBOL");
+		g_string_append_c (s, '(');
+		rspamd_gstring_append_double (s, (gdouble)i / 3.0, 2);
+		g_string_append_c (s, ')');
+		bench_sink += s->len;
+	}
+
+	g_string_free (s, TRUE);
+}
+
+/* Addresses */
+static void
+bench_addr_parse (const gchar **addrs, guint naddrs, guint64 n)
+{
+	rspamd_inet_addr_t *addr;
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		if (rspamd_parse_inet_address (&addr, addrs[i % naddrs])) {
+			bench_sink += rspamd_inet_address_get_af (addr);
+			rspamd_inet_address_destroy (addr);
+		}
+	}
+}
+
+static void
+bench_addr_ipv4 (guint64 n)
+{
+	static const gchar *addrs[] = {
+		"192.0.2.1", "198.51.100.254", "203.0.113.17", "10.0.0.1"
+	};
+
+	bench_addr_parse (addrs, G_N_ELEMENTS (addrs), n);
+}
+
+static void
+bench_addr_ipv6 (guint64 n)
+{
+	static const gchar *addrs[] = {
+		"2001:db8::1", "2001:db8:85a3::8a2e:370:7334", "::ffff:192.0.2.1",
+		"fe80::1"
+	};
+
+	bench_addr_parse (addrs, G_N_ELEMENTS (addrs), n);
+}
+
+/* Upstreams */
+static void
+bench_upstreams_setup (void)
+{
+	bench_keys_setup ();
+	bench_ups = rspamd_upstreams_create ();
+	rspamd_upstreams_parse_line (bench_ups,
+			"192.0.2.1,192.0.2.2,192.0.2.3,192.0.2.4,"
+			"192.0.2.5,192.0.2.6,192.0.2.7,192.0.2.8", 11333, NULL);
+}
+
+static void
+bench_upstreams_round_robin (guint64 n)
+{
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		bench_sink += (guintptr)rspamd_upstream_get (bench_ups,
+				RSPAMD_UPSTREAM_ROUND_ROBIN);
+	}
+}
+
+static void
+bench_upstreams_hashed (guint64 n)
+{
+	const gchar *key;
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		key = bench_strs[i % BENCH_KEYS];
+		bench_sink += (guintptr)rspamd_upstream_get (bench_ups,
+				RSPAMD_UPSTREAM_HASHED, key, (guint)strlen (key));
+	}
+}
+
+static void
+bench_upstreams_teardown (void)
+{
+	rspamd_upstreams_destroy (bench_ups);
+	bench_ups = NULL;
+	bench_keys_teardown ();
+}
+
+static const struct util_bench benches[] = {
+	{ "mempool_alloc", NULL, bench_mempool_alloc, bench_mempool_teardown },
+	{ "mempool_new", NULL, bench_mempool_new, NULL },
+	{ "radix_find", bench_radix_setup, bench_radix_run, bench_radix_teardown },
+	{ "lru_lookup", bench_lru_setup, bench_lru_lookup, bench_lru_teardown },
+	{ "lru_insert", bench_lru_insert_setup, bench_lru_insert,
+	  bench_lru_teardown },
+	{ "bloom_check", bench_bloom_setup, bench_bloom_check,
+	  bench_bloom_teardown },
+	{ "fstrhash", bench_fstr_setup, bench_fstrhash, NULL },
+	{ "fstrhash_lc", bench_fstr_setup, bench_fstrhash_lc, NULL },
+	{ "fstrhash_lc_utf", bench_fstr_setup, bench_fstrhash_lc_utf, NULL },
+	{ "printf", NULL, bench_printf, NULL },
+	{ "printf_score", NULL, bench_printf_score, NULL },
+	{ "append_score", NULL, bench_append_score, NULL },
+	{ "addr_parse_ipv4", NULL, bench_addr_ipv4, NULL },
+	{ "addr_parse_ipv6", NULL, bench_addr_ipv6, NULL },
+	{ "upstream_round_robin", bench_upstreams_setup,
+	  bench_upstreams_round_robin, bench_upstreams_teardown },
+	{ "upstream_hashed", bench_upstreams_setup, bench_upstreams_hashed,
+	  bench_upstreams_teardown },
+};
+
+static gint
+bench_double_cmp (gconstpointer a, gconstpointer b)
+{
+	const gdouble *d1 = a, *d2 = b;
+
+	if (*d1 < *d2) {
+		return -1;
+	}
+	else if (*d1 > *d2) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+bench_execute (const struct util_bench *b, struct util_bench_result *res)
+{
+	gdouble *times, *cycles, t1, t2;
+	guint64 n = 1, c1, c2;
+	gint i;
+
+	times = g_new (gdouble, repeats);
+	cycles = g_new (gdouble, repeats);
+
+	if (b->setup) {
+		b->setup ();
+	}
+
+	/* Calibrate batch, it also warms up caches */
+	for (;;) {
+		t1 = rspamd_get_ticks ();
+		b->run (n);
+		t2 = rspamd_get_ticks ();
+
+		if (t2 - t1 >= min_time || n >= G_MAXUINT32) {
+			break;
+		}
+
+		n *= 2;
+	}
+
+	b->run (n);
+
+	for (i = 0; i < repeats; i ++) {
+		c1 = bench_cycles ();
+		t1 = rspamd_get_ticks ();
+		b->run (n);
+		t2 = rspamd_get_ticks ();
+		c2 = bench_cycles ();
+		times[i] = (t2 - t1) * 1e9 / n;
+		cycles[i] = (gdouble)(c2 - c1) / n;
+	}
+
+	if (b->teardown) {
+		b->teardown ();
+	}
+
+	qsort (times, repeats, sizeof (gdouble), bench_double_cmp);
+	qsort (cycles, repeats, sizeof (gdouble), bench_double_cmp);
+
+	res->name = b->name;
+	res->ns_op = times[repeats / 2];
+	res->best_ns_op = times[0];
+	res->spread = res->ns_op > 0 ?
+			(times[repeats - 1] - times[0]) / res->ns_op * 100.0 : 0;
+	res->cycles_op = cycles[repeats / 2];
+
+	g_free (times);
+	g_free (cycles);
+}
+
+static ucl_object_t *
+bench_load_baseline (const gchar *path)
+{
+	struct ucl_parser *parser;
+	ucl_object_t *obj;
+
+	parser = ucl_parser_new (0);
+
+	if (!ucl_parser_add_file (parser, path)) {
+		fprintf (stderr, "cannot load baseline %s: %s\n", path,
+				ucl_parser_get_error (parser));
+		ucl_parser_free (parser);
+
+		return NULL;
+	}
+
+	obj = ucl_parser_get_object (parser);
+	ucl_parser_free (parser);
+
+	return obj;
+}
+
+static gboolean
+bench_save_baseline (const gchar *path, struct util_bench_result *results,
+	guint nresults)
+{
+	ucl_object_t *top, *elt;
+	struct ucl_emitter_functions *efuncs;
+	FILE *f;
+	guint i;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = 0; i < nresults; i ++) {
+		elt = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (elt, ucl_object_fromdouble (results[i].ns_op),
+				"ns_op", 0, false);
+		ucl_object_insert_key (elt,
+				ucl_object_fromdouble (results[i].cycles_op),
+				"cycles_op", 0, false);
+		ucl_object_insert_key (top, elt, results[i].name, 0, false);
+	}
+
+	f = fopen (path, "w");
+
+	if (f == NULL) {
+		fprintf (stderr, "cannot open %s: %s\n", path, strerror (errno));
+		ucl_object_unref (top);
+
+		return FALSE;
+	}
+
+	efuncs = ucl_object_emit_file_funcs (f);
+	ucl_object_emit_full (top, UCL_EMIT_JSON, efuncs);
+	ucl_object_emit_funcs_free (efuncs);
+	fclose (f);
+	ucl_object_unref (top);
+
+	return TRUE;
+}
+
+int
+main (int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *err = NULL;
+	struct util_bench_result *results;
+	ucl_object_t *baseline = NULL;
+	const ucl_object_t *elt, *base_ns;
+	gdouble diff;
+	guint i, nresults = 0, regressions = 0;
+
+	context = g_option_context_new ("- benchmark libutil primitives");
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &err)) {
+		fprintf (stderr, "option parsing failed: %s\n", err->message);
+		exit (EXIT_FAILURE);
+	}
+
+	if (repeats <= 0) {
+		repeats = 1;
+	}
+
+	if (baseline_file) {
+		baseline = bench_load_baseline (baseline_file);
+
+		if (baseline == NULL) {
+			exit (EXIT_FAILURE);
+		}
+	}
+
+	results = g_new0 (struct util_bench_result, G_N_ELEMENTS (benches));
+
+	rspamd_printf ("%-24s %12s %12s %8s %12s%s\n", "benchmark", "ns/op",
+			"best ns/op", "spread", "cycles/op", baseline ? "    baseline" : "");
+
+	for (i = 0; i < G_N_ELEMENTS (benches); i ++) {
+		if (filter && strstr (benches[i].name, filter) == NULL) {
+			continue;
+		}
+
+		bench_execute (&benches[i], &results[nresults]);
+		rspamd_printf ("%-24s %12.2f %12.2f %7.1f%% %12.1f",
+				results[nresults].name, results[nresults].ns_op,
+				results[nresults].best_ns_op, results[nresults].spread,
+				results[nresults].cycles_op);
+
+		if (baseline) {
+			elt = ucl_object_find_key (baseline, results[nresults].name);
+			base_ns = elt ? ucl_object_find_key (elt, "ns_op") : NULL;
+
+			if (base_ns && ucl_object_todouble (base_ns) > 0) {
+				diff = (results[nresults].ns_op / ucl_object_todouble (base_ns)
+						- 1.0) * 100.0;
+				rspamd_printf ("    %+7.1f%%", diff);
+
+				if (diff > threshold) {
+					rspamd_printf (" REGRESSION");
+					regressions ++;
+				}
+			}
+			else {
+				rspamd_printf ("         new");
+			}
+		}
+
+		rspamd_printf ("\n");
+		nresults ++;
+	}
+
+	if (output_file && !bench_save_baseline (output_file, results, nresults)) {
+		exit (EXIT_FAILURE);
+	}
+
+	if (baseline) {
+		ucl_object_unref (baseline);
+	}
+
+	g_free (results);
+
+	if (regressions > 0) {
+		rspamd_printf ("%ud benchmarks are slower than baseline by more than "
+				"%.1f%%\n", regressions, threshold);
+
+		return 1;
+	}
+
+	return 0;
+}
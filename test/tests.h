@@ -42,4 +42,10 @@ void rspamd_lua_test_func (void);
 
 void rspamd_cryptobox_test_func (void);
 
+void rspamd_cuckoo_test_func (void);
+
+void rspamd_histogram_test_func (void);
+
+void rspamd_lru_test_func (void);
+
 #endif